@@ -28,19 +28,39 @@
 #ifndef LIBRPC_LIBRPC_HH
 #define LIBRPC_LIBRPC_HH
 
+#include <array>
+#include <cerrno>
+#include <deque>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <map>
 #include <rpc/object.h>
 #include <rpc/connection.h>
 #include <rpc/client.h>
 #include <rpc/service.h>
+#include <rpc/typing.h>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define	LIBRPC_COROUTINES
+#endif
 
 namespace librpc
 {
 	class Call;
 	class RemoteInterface;
+	class ObjectView;
+	class ArrayView;
+	class DictView;
 
 	class Exception: public std::runtime_error
 	{
@@ -107,6 +127,7 @@ namespace librpc
 		virtual ~Object();
 
 		static Object wrap(rpc_object_t other);
+		static Object wrap_stolen(rpc_object_t other);
 		rpc_type_t type();
 	    	Object copy();
 		void retain();
@@ -121,6 +142,7 @@ namespace librpc
 		std::string get_error_message();
 		vector_type as_vec() { return (vector_type)*this; }
 		map_type as_map() { return (map_type)*this; }
+		ObjectView view() const;
 
 		explicit operator int64_t() const;
 	 	explicit operator uint64_t() const;
@@ -136,6 +158,498 @@ namespace librpc
 	    	rpc_object_t m_value;
 	};
 
+	/**
+	 * Non-owning handle to an object.
+	 *
+	 * Views neither retain nor copy anything, so they are only valid for
+	 * as long as the object they point into is alive and not modified.
+	 * Use to_object() to keep a value around for longer.
+	 */
+	class ObjectView
+	{
+	public:
+		ObjectView(rpc_object_t value = nullptr) noexcept;
+		ObjectView(const Object &object) noexcept;
+
+		rpc_type_t type() const;
+		bool is_null() const;
+		bool as_bool() const;
+		int64_t as_int64() const;
+		uint64_t as_uint64() const;
+		double as_double() const;
+		std::string_view as_string() const;
+		std::string_view as_bytes() const;
+		ArrayView as_array() const;
+		DictView as_dict() const;
+		Object to_object() const;
+		rpc_object_t unwrap() const;
+
+	private:
+		rpc_object_t m_value;
+	};
+
+	/**
+	 * View of an array, iterable with range-for.
+	 *
+	 * Packed arrays are boxed on first access, as with
+	 * rpc_array_get_value().
+	 */
+	class ArrayView
+	{
+	public:
+		class iterator
+		{
+		public:
+			iterator(rpc_object_t array, size_t index) noexcept;
+			bool operator!=(const iterator &other) const;
+			ObjectView operator*() const;
+			iterator &operator++();
+
+		private:
+			rpc_object_t m_array;
+			size_t m_index;
+		};
+
+		ArrayView(rpc_object_t array) noexcept;
+		size_t size() const;
+		ObjectView operator[](size_t index) const;
+		iterator begin() const;
+		iterator end() const;
+
+	private:
+		rpc_object_t m_array;
+	};
+
+	/**
+	 * View of a dictionary, iterable with range-for over
+	 * (key, value) pairs. Iteration order is unspecified.
+	 */
+	class DictView
+	{
+	public:
+		typedef std::pair<std::string_view, ObjectView> value_type;
+
+		class iterator
+		{
+		public:
+			iterator() noexcept;
+			iterator(rpc_object_t dict);
+			bool operator!=(const iterator &other) const;
+			const value_type &operator*() const;
+			iterator &operator++();
+
+		private:
+			struct rpc_dictionary_iter m_iter;
+			value_type m_current;
+			bool m_ended;
+		};
+
+		DictView(rpc_object_t dict) noexcept;
+		size_t size() const;
+		ObjectView get(const char *key) const;
+		ObjectView operator[](const char *key) const;
+		iterator begin() const;
+		iterator end() const;
+
+	private:
+		rpc_object_t m_dict;
+	};
+
+	/**
+	 * One member of a struct mapped with LIBRPC_STRUCT().
+	 */
+	template <typename T, typename M>
+	struct Field
+	{
+		const char *name;
+		M T::*member;
+	};
+
+	template <typename T, typename M>
+	constexpr Field<T, M> field(const char *name, M T::*member)
+	{
+		return (Field<T, M>{name, member});
+	}
+
+	/**
+	 * Maps a C++ struct to an IDL struct type. Specialized by
+	 * LIBRPC_STRUCT() with a type_name and a tuple of fields.
+	 */
+	template <typename T>
+	struct StructMapping;
+
+	namespace detail
+	{
+		void check_struct(rpct_typei_t typei, size_t nfields);
+		int check_member(rpct_typei_t typei, const char *name,
+		    const char *idl);
+
+		template <typename T, typename = void>
+		struct is_mapped: std::false_type {};
+
+		template <typename T>
+		struct is_mapped<T, std::void_t<
+		    decltype(StructMapping<T>::type_name)>>: std::true_type {};
+
+		template <typename F>
+		struct field_type;
+
+		template <typename T, typename M>
+		struct field_type<Field<T, M>>
+		{
+			typedef M type;
+		};
+	}
+
+	/**
+	 * Converts a single member value. The idl name is what the member
+	 * has to be declared as in the IDL.
+	 */
+	template <typename V, typename = void>
+	struct ValueCodec;
+
+	template <>
+	struct ValueCodec<bool>
+	{
+		static constexpr const char *idl = "bool";
+
+		static rpc_object_t encode(bool value)
+		{
+			return (rpc_bool_create(value));
+		}
+
+		static bool decode(rpc_object_t obj, bool &value)
+		{
+			if (rpc_get_type(obj) != RPC_TYPE_BOOL)
+				return (false);
+
+			value = rpc_bool_get_value(obj);
+			return (true);
+		}
+	};
+
+	template <typename V>
+	struct ValueCodec<V, std::enable_if_t<std::is_integral_v<V> &&
+	    std::is_signed_v<V>>>
+	{
+		static constexpr const char *idl = "int64";
+
+		static rpc_object_t encode(V value)
+		{
+			return (rpc_int64_create((int64_t)value));
+		}
+
+		static bool decode(rpc_object_t obj, V &value)
+		{
+			if (rpc_get_type(obj) != RPC_TYPE_INT64)
+				return (false);
+
+			value = (V)rpc_int64_get_value(obj);
+			return (true);
+		}
+	};
+
+	template <typename V>
+	struct ValueCodec<V, std::enable_if_t<std::is_integral_v<V> &&
+	    std::is_unsigned_v<V> && !std::is_same_v<V, bool>>>
+	{
+		static constexpr const char *idl = "uint64";
+
+		static rpc_object_t encode(V value)
+		{
+			return (rpc_uint64_create((uint64_t)value));
+		}
+
+		static bool decode(rpc_object_t obj, V &value)
+		{
+			if (rpc_get_type(obj) != RPC_TYPE_UINT64)
+				return (false);
+
+			value = (V)rpc_uint64_get_value(obj);
+			return (true);
+		}
+	};
+
+	template <typename V>
+	struct ValueCodec<V, std::enable_if_t<std::is_floating_point_v<V>>>
+	{
+		static constexpr const char *idl = "double";
+
+		static rpc_object_t encode(V value)
+		{
+			return (rpc_double_create((double)value));
+		}
+
+		static bool decode(rpc_object_t obj, V &value)
+		{
+			if (rpc_get_type(obj) != RPC_TYPE_DOUBLE)
+				return (false);
+
+			value = (V)rpc_double_get_value(obj);
+			return (true);
+		}
+	};
+
+	template <>
+	struct ValueCodec<std::string>
+	{
+		static constexpr const char *idl = "string";
+
+		static rpc_object_t encode(const std::string &value)
+		{
+			return (rpc_string_create_len(value.data(),
+			    value.size()));
+		}
+
+		static bool decode(rpc_object_t obj, std::string &value)
+		{
+			if (rpc_get_type(obj) != RPC_TYPE_STRING)
+				return (false);
+
+			value.assign(rpc_string_get_string_ptr(obj),
+			    rpc_string_get_length(obj));
+			return (true);
+		}
+	};
+
+	template <typename V>
+	struct ValueCodec<std::vector<V>>
+	{
+		static constexpr const char *idl = "array";
+
+		static rpc_object_t encode(const std::vector<V> &value)
+		{
+			rpc_object_t result;
+
+			result = rpc_array_create_with_capacity(value.size());
+			for (const V &item: value) {
+				rpc_array_append_stolen_value(result,
+				    ValueCodec<V>::encode(item));
+			}
+
+			return (result);
+		}
+
+		static bool decode(rpc_object_t obj, std::vector<V> &value)
+		{
+			size_t count;
+
+			if (rpc_get_type(obj) != RPC_TYPE_ARRAY)
+				return (false);
+
+			count = rpc_array_get_count(obj);
+			value.resize(count);
+			for (size_t i = 0; i < count; i++) {
+				if (!ValueCodec<V>::decode(
+				    rpc_array_get_value(obj, i), value[i]))
+					return (false);
+			}
+
+			return (true);
+		}
+	};
+
+	template <typename V>
+	struct ValueCodec<V, std::enable_if_t<detail::is_mapped<V>::value>>;
+
+	/**
+	 * Per-type state of a mapped struct: its type instance and the
+	 * layout index of each field, looked up once.
+	 */
+	template <typename T>
+	class StructInfo
+	{
+	public:
+		static constexpr size_t nfields = std::tuple_size_v<
+		    std::decay_t<decltype(StructMapping<T>::fields)>>;
+
+		static const StructInfo &get()
+		{
+			static const StructInfo info;
+
+			return (info);
+		}
+
+		rpct_typei_t typei() const
+		{
+			return (m_typei);
+		}
+
+		int index(size_t field) const
+		{
+			return (m_index[field]);
+		}
+
+		bool is_instance(rpc_object_t obj) const
+		{
+			rpct_typei_t typei = rpct_get_typei(obj);
+
+			return (typei != nullptr &&
+			    rpct_typei_get_type(typei) ==
+			    rpct_typei_get_type(m_typei));
+		}
+
+	private:
+		StructInfo()
+		{
+			m_typei = rpct_new_typei(StructMapping<T>::type_name);
+			if (m_typei == nullptr) {
+				throw (Exception(ENOENT, std::string(
+				    "Unknown type ") +
+				    StructMapping<T>::type_name));
+			}
+
+			detail::check_struct(m_typei, nfields);
+			load(std::make_index_sequence<nfields>());
+		}
+
+		template <size_t... I>
+		void load(std::index_sequence<I...>)
+		{
+			((m_index[I] = detail::check_member(m_typei,
+			    std::get<I>(StructMapping<T>::fields).name,
+			    member_idl<I>())), ...);
+		}
+
+		template <size_t I>
+		static const char *member_idl()
+		{
+			using F = std::decay_t<decltype(std::get<I>(
+			    StructMapping<T>::fields))>;
+
+			return (ValueCodec<typename detail::field_type<
+			    F>::type>::idl);
+		}
+
+		rpct_typei_t m_typei;
+		std::array<int, nfields> m_index;
+	};
+
+	/**
+	 * Checks a mapped struct against its IDL type. Done implicitly
+	 * on first use; call at startup to fail early.
+	 *
+	 * @throws Exception if the type is unknown, or its members don't
+	 *         match the fields of the mapping
+	 */
+	template <typename T>
+	void register_struct()
+	{
+		StructInfo<T>::get();
+	}
+
+	/**
+	 * Builds a typed struct instance out of a mapped struct.
+	 */
+	template <typename T>
+	Object encode(const T &value)
+	{
+		return (Object::wrap_stolen(ValueCodec<T>::encode(value)));
+	}
+
+	/**
+	 * Fills in a mapped struct from an object.
+	 *
+	 * @throws Exception if a field is missing or of the wrong type
+	 */
+	template <typename T>
+	T decode(ObjectView view)
+	{
+		T result;
+
+		if (!ValueCodec<T>::decode(view.unwrap(), result)) {
+			throw (Exception(EINVAL, std::string("Not a valid ") +
+			    StructMapping<T>::type_name));
+		}
+
+		return (result);
+	}
+
+	template <typename V>
+	struct ValueCodec<V, std::enable_if_t<detail::is_mapped<V>::value>>
+	{
+		static constexpr const char *idl = StructMapping<V>::type_name;
+
+		static rpc_object_t encode(const V &value)
+		{
+			const StructInfo<V> &info = StructInfo<V>::get();
+			rpc_object_t empty;
+			rpc_object_t result;
+
+			empty = rpc_dictionary_create();
+			result = rpct_newi(info.typei(), empty);
+			rpc_release(empty);
+
+			encode_fields(info, value, result, std::make_index_sequence<
+			    StructInfo<V>::nfields>());
+			return (result);
+		}
+
+		static bool decode(rpc_object_t obj, V &value)
+		{
+			const StructInfo<V> &info = StructInfo<V>::get();
+
+			if (rpc_get_type(obj) != RPC_TYPE_DICTIONARY)
+				return (false);
+
+			return (decode_fields(info, obj, info.is_instance(obj),
+			    value, std::make_index_sequence<
+			    StructInfo<V>::nfields>()));
+		}
+
+	private:
+		template <size_t... I>
+		static void encode_fields(const StructInfo<V> &info,
+		    const V &value, rpc_object_t result,
+		    std::index_sequence<I...>)
+		{
+			(encode_field(info, value, result, I,
+			    std::get<I>(StructMapping<V>::fields)), ...);
+		}
+
+		template <typename M>
+		static void encode_field(const StructInfo<V> &info,
+		    const V &value, rpc_object_t result, size_t i,
+		    const Field<V, M> &field)
+		{
+			rpc_object_t member;
+
+			member = ValueCodec<M>::encode(value.*field.member);
+			rpct_struct_set(result, (size_t)info.index(i), member);
+			rpc_release(member);
+		}
+
+		template <size_t... I>
+		static bool decode_fields(const StructInfo<V> &info,
+		    rpc_object_t obj, bool slotted, V &value,
+		    std::index_sequence<I...>)
+		{
+			return ((decode_field(info, obj, slotted, value, I,
+			    std::get<I>(StructMapping<V>::fields)) && ...));
+		}
+
+		template <typename M>
+		static bool decode_field(const StructInfo<V> &info,
+		    rpc_object_t obj, bool slotted, V &value, size_t i,
+		    const Field<V, M> &field)
+		{
+			rpc_object_t member;
+
+			/* Instances of the type are looked up by slot */
+			if (slotted)
+				member = rpct_struct_get(obj,
+				    (size_t)info.index(i));
+			else
+				member = rpc_dictionary_get_value(obj,
+				    field.name);
+
+			if (member == nullptr)
+				return (false);
+
+			return (ValueCodec<M>::decode(member, value.*field.member));
+		}
+	};
+
 	class CallIterator
 	{
 	public:
@@ -170,6 +684,162 @@ namespace librpc
 	    	rpc_call_t m_call;
 	};
 
+	/**
+	 * Call state fed by the call's callback, on the connection's
+	 * callback threads, and consumed by Connection::call_future(),
+	 * CallAwaitable and CallStream. Fragments are buffered as they
+	 * arrive.
+	 */
+	class AsyncCall
+	{
+	public:
+		typedef std::function<void ()> waker_type;
+		typedef std::function<void (AsyncCall &)> handler_type;
+
+		static std::shared_ptr<AsyncCall> start(rpc_connection_t conn,
+		    const std::string &name, const Object &args,
+		    const std::string &path, const std::string &interface);
+
+		/**
+		 * Returns true if an item is ready or the call is over.
+		 * Otherwise @p waker is run, once, when either happens.
+		 */
+		bool ready(waker_type waker);
+
+		/**
+		 * Takes the next item. Returns false once the call is over.
+		 *
+		 * @throws Exception if the call failed
+		 */
+		bool next(Object &item);
+
+		/**
+		 * Runs @p handler once the call is over.
+		 */
+		void then(handler_type handler);
+
+		bool streaming();
+		void cancel();
+
+	private:
+		AsyncCall() = default;
+		bool on_status(rpc_call_t call);
+		void finish_locked(rpc_call_t call);
+
+		std::mutex m_mtx;
+		std::deque<Object> m_items;
+		Object m_error;
+		bool m_failed = false;
+		bool m_done = false;
+		bool m_streaming = false;
+		rpc_call_t m_call = nullptr;
+		waker_type m_waker;
+		handler_type m_handler;
+	};
+
+#ifdef LIBRPC_COROUTINES
+	/**
+	 * co_await on a call yields its result. The coroutine resumes on
+	 * a connection callback thread.
+	 */
+	class CallAwaitable
+	{
+	public:
+		explicit CallAwaitable(std::shared_ptr<AsyncCall> call):
+		    m_call(std::move(call))
+		{
+		}
+
+		bool await_ready()
+		{
+			return (m_call->ready(nullptr));
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			return (!m_call->ready([handle]() { handle.resume(); }));
+		}
+
+		Object await_resume()
+		{
+			Object result;
+
+			m_call->next(result);
+			return (result);
+		}
+
+	private:
+		std::shared_ptr<AsyncCall> m_call;
+	};
+
+	/**
+	 * Streaming call consumed from a coroutine:
+	 *
+	 *     while (auto item = co_await stream.next())
+	 *         ...
+	 *
+	 * Each co_await resumes as soon as a fragment arrives. The call
+	 * is aborted if the stream is destroyed before it is over.
+	 */
+	class CallStream
+	{
+	public:
+		class NextAwaitable
+		{
+		public:
+			explicit NextAwaitable(AsyncCall *call): m_call(call)
+			{
+			}
+
+			bool await_ready()
+			{
+				return (m_call->ready(nullptr));
+			}
+
+			bool await_suspend(std::coroutine_handle<> handle)
+			{
+				return (!m_call->ready([handle]() {
+					handle.resume();
+				}));
+			}
+
+			std::optional<Object> await_resume()
+			{
+				Object item;
+
+				if (!m_call->next(item))
+					return (std::nullopt);
+
+				return (item);
+			}
+
+		private:
+			AsyncCall *m_call;
+		};
+
+		explicit CallStream(std::shared_ptr<AsyncCall> call):
+		    m_call(std::move(call))
+		{
+		}
+
+		CallStream(CallStream &&other) noexcept = default;
+
+		~CallStream()
+		{
+			if (m_call != nullptr)
+				m_call->cancel();
+		}
+
+		NextAwaitable next()
+		{
+			return (NextAwaitable(m_call.get()));
+		}
+
+	private:
+		std::shared_ptr<AsyncCall> m_call;
+	};
+#endif
+
 	class Connection
 	{
 	public:
@@ -189,8 +859,37 @@ namespace librpc
 		    const std::string &interface,
 		    std::function<bool (Call)> &callback);
 
-	private:
-		rpc_connection_t m_connection;
+		/**
+		 * Makes a call without blocking. The future holds the
+		 * result, or an array of all fragments of a streaming call.
+		 */
+		std::future<Object> call_future(const std::string &name,
+		    const std::vector<Object> &args,
+		    const std::string &path = "/",
+		    const std::string &interface = RPC_DEFAULT_INTERFACE);
+
+#ifdef LIBRPC_COROUTINES
+		CallAwaitable co_call(const std::string &name,
+		    const std::vector<Object> &args,
+		    const std::string &path = "/",
+		    const std::string &interface = RPC_DEFAULT_INTERFACE)
+		{
+			return (CallAwaitable(AsyncCall::start(m_connection,
+			    name, Object(args), path, interface)));
+		}
+
+		CallStream co_stream(const std::string &name,
+		    const std::vector<Object> &args,
+		    const std::string &path = "/",
+		    const std::string &interface = RPC_DEFAULT_INTERFACE)
+		{
+			return (CallStream(AsyncCall::start(m_connection,
+			    name, Object(args), path, interface)));
+		}
+#endif
+
+	protected:
+		rpc_connection_t m_connection = nullptr;
 	};
 
 	class Client: public Connection
@@ -230,4 +929,19 @@ namespace librpc
 	};
 };
 
+/**
+ * Maps struct @p T onto the IDL struct type @p name. The remaining
+ * arguments are its fields, each given with LIBRPC_FIELD(). Has to be
+ * used at global scope.
+ */
+#define	LIBRPC_STRUCT(T, name, ...)					\
+	template <>							\
+	struct librpc::StructMapping<T>					\
+	{								\
+		static constexpr const char *type_name = name;		\
+		static constexpr auto fields = std::make_tuple(__VA_ARGS__); \
+	}
+
+#define	LIBRPC_FIELD(T, member)	librpc::field(#member, &T::member)
+
 #endif /* LIBRPC_LIBRPC_HH */
\ No newline at end of file
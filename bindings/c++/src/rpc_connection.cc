@@ -187,12 +187,231 @@ Connection::call_async(const std::string &name, const std::vector<Object> &args,
 		throw (Exception::last_error());
 }
 
+std::future<Object>
+Connection::call_future(const std::string &name,
+    const std::vector<Object> &args, const std::string &path,
+    const std::string &interface)
+{
+	auto promise = std::make_shared<std::promise<Object>>();
+	std::shared_ptr<AsyncCall> call;
+
+	call = AsyncCall::start(m_connection, name, Object(args), path,
+	    interface);
+
+	call->then([promise](AsyncCall &c) {
+		std::vector<Object> items;
+		Object item;
+
+		try {
+			while (c.next(item))
+				items.push_back(item);
+		} catch (...) {
+			promise->set_exception(std::current_exception());
+			return;
+		}
+
+		if (c.streaming())
+			promise->set_value(Object(items));
+		else
+			promise->set_value(items.empty() ? Object() : items[0]);
+	});
+
+	return (promise->get_future());
+}
+
+std::shared_ptr<AsyncCall>
+AsyncCall::start(rpc_connection_t conn, const std::string &name,
+    const Object &args, const std::string &path, const std::string &interface)
+{
+	std::shared_ptr<AsyncCall> self(new AsyncCall());
+	rpc_call_t call;
+
+	/* The callback keeps the state alive until the call is over */
+	call = rpc_connection_call(conn, path.c_str(), interface.c_str(),
+	    name.c_str(), args.unwrap(), ^bool(rpc_call_t c) {
+		return (self->on_status(c));
+	});
+
+	if (call == nullptr)
+		throw (Exception::last_error());
+
+	std::lock_guard<std::mutex> lock(self->m_mtx);
+	if (!self->m_done)
+		self->m_call = call;
+
+	return (self);
+}
+
+bool
+AsyncCall::ready(waker_type waker)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+
+	if (!m_items.empty() || m_done)
+		return (true);
+
+	if (waker)
+		m_waker = std::move(waker);
+
+	return (false);
+}
+
+bool
+AsyncCall::next(Object &item)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+
+	if (!m_items.empty()) {
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		return (true);
+	}
+
+	if (m_failed) {
+		throw (Exception(m_error.get_error_code(),
+		    m_error.get_error_message()));
+	}
+
+	return (false);
+}
+
+void
+AsyncCall::then(handler_type handler)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+
+	if (!m_done) {
+		m_handler = std::move(handler);
+		return;
+	}
+
+	lock.unlock();
+	handler(*this);
+}
+
+bool
+AsyncCall::streaming()
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+
+	return (m_streaming);
+}
+
+void
+AsyncCall::cancel()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	handler_type handler;
+	waker_type waker;
+	rpc_call_t call;
+
+	if (m_done)
+		return;
+
+	m_failed = true;
+	m_error = Object::wrap_stolen(rpc_error_create(ECANCELED,
+	    "Call cancelled", nullptr));
+
+	/*
+	 * Aborting may run the callback, which takes m_mtx. Once m_done
+	 * is set, a late callback aborts the rest of the stream without
+	 * touching the call.
+	 */
+	call = m_call;
+	m_call = nullptr;
+	m_done = true;
+	waker.swap(m_waker);
+	handler.swap(m_handler);
+	lock.unlock();
+
+	if (call != nullptr) {
+		rpc_call_abort(call);
+		rpc_call_free(call);
+	}
+
+	if (waker)
+		waker();
+
+	if (handler)
+		handler(*this);
+}
+
+/*
+ * Frees the call as soon as it is over. The callback worker holds a
+ * reference of its own, so this is safe from within the callback.
+ */
+void
+AsyncCall::finish_locked(rpc_call_t call)
+{
+
+	m_done = true;
+	m_call = nullptr;
+	rpc_call_free(call);
+}
+
+bool
+AsyncCall::on_status(rpc_call_t call)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	handler_type handler;
+	waker_type waker;
+
+	/* Aborts the rest of a stream that has been cancelled */
+	if (m_done)
+		return (false);
+
+	switch (rpc_call_status(call)) {
+	case RPC_CALL_STREAM_START:
+		m_streaming = true;
+		return (true);
+
+	case RPC_CALL_MORE_AVAILABLE:
+		m_streaming = true;
+		m_items.push_back(Object::wrap(rpc_call_result(call)));
+		break;
+
+	case RPC_CALL_DONE:
+		m_items.push_back(Object::wrap(rpc_call_result(call)));
+		finish_locked(call);
+		break;
+
+	case RPC_CALL_ENDED:
+		finish_locked(call);
+		break;
+
+	case RPC_CALL_ERROR:
+		m_failed = true;
+		m_error = Object::wrap(rpc_call_result(call));
+		finish_locked(call);
+		break;
+
+	default:
+		return (true);
+	}
+
+	waker.swap(m_waker);
+	if (m_done)
+		handler.swap(m_handler);
+
+	lock.unlock();
+
+	if (waker)
+		waker();
+
+	if (handler)
+		handler(*this);
+
+	return (true);
+}
+
 void
 Client::connect(const std::string &uri, const librpc::Object &params)
 {
 	m_client = rpc_client_create(uri.c_str(), params.unwrap());
 	if (m_client == nullptr)
 		throw (Exception::last_error());
+
+	m_connection = rpc_client_get_connection(m_client);
 }
 
 void
@@ -203,6 +422,7 @@ Client::disconnect()
 
 	rpc_client_close(m_client);
 	m_client = nullptr;
+	m_connection = nullptr;
 }
 
 std::vector<RemoteInterface>
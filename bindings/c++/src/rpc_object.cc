@@ -137,6 +137,16 @@ Object::wrap(rpc_object_t other)
 	return (result);
 }
 
+Object
+Object::wrap_stolen(rpc_object_t other)
+{
+	Object result;
+
+	rpc_release(result.m_value);
+	result.m_value = other;
+	return (result);
+}
+
 rpc_type_t
 Object::type()
 {
@@ -288,3 +298,245 @@ Object::operator[](size_t index)
 {
 	return (Object::wrap(rpc_array_get_value(m_value, index)));
 }
+
+ObjectView
+Object::view() const
+{
+	return (ObjectView(m_value));
+}
+
+ObjectView::ObjectView(rpc_object_t value) noexcept
+{
+	m_value = value;
+}
+
+ObjectView::ObjectView(const Object &object) noexcept
+{
+	m_value = object.unwrap();
+}
+
+rpc_type_t
+ObjectView::type() const
+{
+	return (rpc_get_type(m_value));
+}
+
+bool
+ObjectView::is_null() const
+{
+	return (rpc_get_type(m_value) == RPC_TYPE_NULL);
+}
+
+bool
+ObjectView::as_bool() const
+{
+	return (rpc_bool_get_value(m_value));
+}
+
+int64_t
+ObjectView::as_int64() const
+{
+	return (rpc_int64_get_value(m_value));
+}
+
+uint64_t
+ObjectView::as_uint64() const
+{
+	return (rpc_uint64_get_value(m_value));
+}
+
+double
+ObjectView::as_double() const
+{
+	return (rpc_double_get_value(m_value));
+}
+
+std::string_view
+ObjectView::as_string() const
+{
+	const char *str;
+
+	str = rpc_string_get_string_ptr(m_value);
+	if (str == nullptr)
+		return (std::string_view());
+
+	return (std::string_view(str, rpc_string_get_length(m_value)));
+}
+
+std::string_view
+ObjectView::as_bytes() const
+{
+	const void *data;
+
+	data = rpc_data_get_bytes_ptr(m_value);
+	if (data == nullptr)
+		return (std::string_view());
+
+	return (std::string_view((const char *)data,
+	    rpc_data_get_length(m_value)));
+}
+
+ArrayView
+ObjectView::as_array() const
+{
+	return (ArrayView(m_value));
+}
+
+DictView
+ObjectView::as_dict() const
+{
+	return (DictView(m_value));
+}
+
+Object
+ObjectView::to_object() const
+{
+	if (m_value == nullptr)
+		return (Object());
+
+	return (Object::wrap(m_value));
+}
+
+rpc_object_t
+ObjectView::unwrap() const
+{
+	return (m_value);
+}
+
+ArrayView::iterator::iterator(rpc_object_t array, size_t index) noexcept
+{
+	m_array = array;
+	m_index = index;
+}
+
+bool
+ArrayView::iterator::operator!=(const iterator &other) const
+{
+	return (m_index != other.m_index);
+}
+
+ObjectView
+ArrayView::iterator::operator*() const
+{
+	return (ObjectView(rpc_array_get_value(m_array, m_index)));
+}
+
+ArrayView::iterator &
+ArrayView::iterator::operator++()
+{
+	m_index++;
+	return (*this);
+}
+
+ArrayView::ArrayView(rpc_object_t array) noexcept
+{
+	m_array = array;
+}
+
+size_t
+ArrayView::size() const
+{
+	if (m_array == nullptr)
+		return (0);
+
+	return (rpc_array_get_count(m_array));
+}
+
+ObjectView
+ArrayView::operator[](size_t index) const
+{
+	return (ObjectView(rpc_array_get_value(m_array, index)));
+}
+
+ArrayView::iterator
+ArrayView::begin() const
+{
+	return (iterator(m_array, 0));
+}
+
+ArrayView::iterator
+ArrayView::end() const
+{
+	return (iterator(m_array, size()));
+}
+
+DictView::iterator::iterator() noexcept
+{
+	m_ended = true;
+}
+
+DictView::iterator::iterator(rpc_object_t dict)
+{
+	m_ended = false;
+	rpc_dictionary_iter_init(dict, &m_iter);
+	++*this;
+}
+
+bool
+DictView::iterator::operator!=(const iterator &other) const
+{
+	/* Only ever compared against end() in a range-for */
+	return (m_ended != other.m_ended);
+}
+
+const DictView::value_type &
+DictView::iterator::operator*() const
+{
+	return (m_current);
+}
+
+DictView::iterator &
+DictView::iterator::operator++()
+{
+	const char *key;
+	rpc_object_t value;
+
+	if (!rpc_dictionary_iter_next(&m_iter, &key, &value)) {
+		m_ended = true;
+		return (*this);
+	}
+
+	m_current = value_type(std::string_view(key), ObjectView(value));
+	return (*this);
+}
+
+DictView::DictView(rpc_object_t dict) noexcept
+{
+	m_dict = dict;
+}
+
+size_t
+DictView::size() const
+{
+	if (m_dict == nullptr)
+		return (0);
+
+	return (rpc_dictionary_get_count(m_dict));
+}
+
+ObjectView
+DictView::get(const char *key) const
+{
+	return (ObjectView(rpc_dictionary_get_value(m_dict, key)));
+}
+
+ObjectView
+DictView::operator[](const char *key) const
+{
+	return (get(key));
+}
+
+DictView::iterator
+DictView::begin() const
+{
+	if (m_dict == nullptr)
+		return (iterator());
+
+	return (iterator(m_dict));
+}
+
+DictView::iterator
+DictView::end() const
+{
+	return (iterator());
+}
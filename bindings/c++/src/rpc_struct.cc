@@ -0,0 +1,93 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <cstring>
+#include "../include/librpc.hh"
+
+using namespace librpc;
+
+/*
+ * Aliases are followed down to the type they stand for, so that a
+ * member declared with a typedef of int64 can still map to an integer.
+ */
+static rpct_type_t
+resolve_type(rpct_typei_t typei)
+{
+	rpct_type_t type = rpct_typei_get_type(typei);
+
+	while (rpct_type_get_class(type) == RPC_TYPING_TYPEDEF)
+		type = rpct_typei_get_type(rpct_type_get_definition(type));
+
+	return (type);
+}
+
+void
+detail::check_struct(rpct_typei_t typei, size_t nfields)
+{
+	rpct_type_t type = rpct_typei_get_type(typei);
+	__block size_t count = 0;
+
+	if (rpct_type_get_class(type) != RPC_TYPING_STRUCT) {
+		throw (Exception(EINVAL, std::string(rpct_type_get_name(type)) +
+		    " is not a struct"));
+	}
+
+	rpct_members_apply(type, ^(rpct_member_t member) {
+		count++;
+		return ((bool)true);
+	});
+
+	if (count != nfields) {
+		throw (Exception(EINVAL, std::string(rpct_type_get_name(type)) +
+		    " has " + std::to_string(count) + " members, mapping has " +
+		    std::to_string(nfields)));
+	}
+}
+
+int
+detail::check_member(rpct_typei_t typei, const char *name, const char *idl)
+{
+	rpct_type_t type = rpct_typei_get_type(typei);
+	rpct_member_t member;
+	const char *actual;
+	int index;
+
+	index = rpct_struct_index(type, name);
+	member = rpct_type_get_member(type, name);
+	if (index < 0 || member == nullptr) {
+		throw (Exception(ENOENT, std::string(rpct_type_get_name(type)) +
+		    " has no member " + name));
+	}
+
+	actual = rpct_type_get_name(resolve_type(rpct_member_get_typei(member)));
+	if (strcmp(actual, "any") != 0 && strcmp(actual, idl) != 0) {
+		throw (Exception(EINVAL, std::string(rpct_type_get_name(type)) +
+		    "." + name + " is " + actual + ", mapped as " + idl));
+	}
+
+	return (index);
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <rpc/server.h>
+#include "../include/librpc.hh"
+
+#define	TEST_URI	"unix://test-cpp.sock"
+
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		std::cerr << __FILE__ << ":" << __LINE__ << ": "	\
+		    << #cond << " failed" << std::endl;			\
+		std::exit(1);						\
+	}								\
+} while (0)
+
+using namespace librpc;
+
+static void
+register_methods(rpc_context_t ctx)
+{
+
+	rpc_context_register_block(ctx, nullptr, "hi", nullptr,
+	    ^rpc_object_t(void *, rpc_object_t args) {
+		return (rpc_string_create_with_format("hello %s!",
+		    rpc_array_get_string(args, 0)));
+	});
+
+	rpc_context_register_block(ctx, nullptr, "fail", nullptr,
+	    ^rpc_object_t(void *cookie, rpc_object_t) {
+		rpc_function_error(cookie, EPERM, "Not allowed");
+		return (nullptr);
+	});
+
+	rpc_context_register_block(ctx, nullptr, "count", nullptr,
+	    ^rpc_object_t(void *cookie, rpc_object_t args) {
+		int64_t n = rpc_array_get_int64(args, 0);
+
+		rpc_function_start_stream(cookie);
+		for (int64_t i = 0; i < n || n < 0; i++) {
+			if (rpc_function_yield(cookie,
+			    rpc_int64_create(i)) != 0)
+				return (RPC_FUNCTION_STILL_RUNNING);
+		}
+
+		rpc_function_end(cookie);
+		return (RPC_FUNCTION_STILL_RUNNING);
+	});
+
+	rpc_context_register_block(ctx, nullptr, "slow", nullptr,
+	    ^rpc_object_t(void *, rpc_object_t) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		return (rpc_null_create());
+	});
+}
+
+static void
+test_future(Client &client)
+{
+	std::future<Object> future;
+	Object result;
+
+	future = client.call_future("hi", {"world"});
+	result = future.get();
+	CHECK(result.as_string() == "hello world!");
+
+	/* A stream resolves to all of its fragments */
+	future = client.call_future("count", {3LL});
+	result = future.get();
+	CHECK(result.as_vec().size() == 3);
+	for (int64_t i = 0; i < 3; i++)
+		CHECK(result.as_vec()[i].as_int64() == i);
+
+	future = client.call_future("fail", {});
+	try {
+		future.get();
+		CHECK(false);
+	} catch (Exception &e) {
+		CHECK(e.code() == EPERM);
+	}
+}
+
+static void
+test_cancel(rpc_connection_t conn)
+{
+	std::shared_ptr<AsyncCall> call;
+	std::promise<void> ran;
+	Object item;
+
+	/* Cancelling runs the handler and fails the call */
+	call = AsyncCall::start(conn, "slow", Object(std::vector<Object>()),
+	    "/", RPC_DEFAULT_INTERFACE);
+	call->then([&ran](AsyncCall &) { ran.set_value(); });
+	call->cancel();
+	CHECK(ran.get_future().wait_for(std::chrono::seconds(1)) ==
+	    std::future_status::ready);
+
+	try {
+		call->next(item);
+		CHECK(false);
+	} catch (Exception &e) {
+		CHECK(e.code() == ECANCELED);
+	}
+
+	/* An endless stream is cancelled while fragments keep coming in */
+	call = AsyncCall::start(conn, "count",
+	    Object(std::vector<Object>{-1LL}), "/", RPC_DEFAULT_INTERFACE);
+	while (!call->ready(nullptr))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	CHECK(call->streaming());
+	call->cancel();
+	try {
+		while (call->next(item))
+			;
+
+		CHECK(false);
+	} catch (Exception &e) {
+		CHECK(e.code() == ECANCELED);
+	}
+}
+
+#ifdef LIBRPC_COROUTINES
+/*
+ * Coroutine that starts right away and signals @p done when it
+ * returns.
+ */
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+static Task
+co_test(Client &client, std::promise<int64_t> &done)
+{
+	int64_t sum = 0;
+	Object result;
+
+	result = co_await client.co_call("hi", {"world"});
+	CHECK(result.as_string() == "hello world!");
+
+	CallStream stream = client.co_stream("count", {4LL});
+	while (auto item = co_await stream.next())
+		sum += item->as_int64();
+
+	done.set_value(sum);
+}
+
+static void
+test_coroutines(Client &client)
+{
+	std::promise<int64_t> done;
+
+	co_test(client, done);
+	CHECK(done.get_future().get() == 6);
+}
+#endif
+
+int
+main()
+{
+	rpc_context_t ctx;
+	rpc_server_t srv;
+	rpc_client_t raw;
+	Client client;
+
+	ctx = rpc_context_create();
+	register_methods(ctx);
+	srv = rpc_server_create(TEST_URI, ctx);
+	CHECK(srv != nullptr);
+	rpc_server_resume(srv);
+
+	client.connect(TEST_URI, Object());
+	raw = rpc_client_create(TEST_URI, nullptr);
+	CHECK(raw != nullptr);
+
+	test_future(client);
+	test_cancel(rpc_client_get_connection(raw));
+#ifdef LIBRPC_COROUTINES
+	test_coroutines(client);
+#endif
+
+	rpc_client_close(raw);
+	client.disconnect();
+	rpc_server_close(srv);
+	rpc_context_free(ctx);
+	std::cout << "call_future: ok" << std::endl;
+	return (0);
+}
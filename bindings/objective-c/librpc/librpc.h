@@ -53,6 +53,8 @@ typedef void (^RPCFunctionCallback)(RPCCall * _Nonnull call, RPCObject * _Nonnul
 typedef void (^RPCPropertyCallback)(RPCObject *_Nonnull value);
 typedef void (^RPCEventCallback)(RPCObject* _Nonnull value, NSString * _Nonnull path,
                                  NSString * _Nonnull interface, NSString * _Nonnull method);
+typedef void (^RPCStreamCallback)(NSArray<RPCObject *> * _Nonnull items, BOOL done,
+                                  NSError * _Nullable error);
 
 /**
  * A boxed type representing librpc value.
@@ -103,6 +105,9 @@ typedef void (^RPCEventCallback)(RPCObject* _Nonnull value, NSString * _Nonnull
 /**
  * Returns unboxed value of the object.
  *
+ * Binary values are returned as NSData sharing the object's buffer,
+ * which stays alive for as long as the NSData does.
+ *
  * @return Object value
  */
 - (nullable id)value;
@@ -235,6 +240,18 @@ typedef void (^RPCEventCallback)(RPCObject* _Nonnull value, NSString * _Nonnull
  */
 - (void)disconnect;
 
+/**
+ * Delivers all callbacks of the connection on @p queue.
+ *
+ * Asynchronous call callbacks, event and property observers are then
+ * run on @p queue instead of librpc's internal thread pool. Fails if
+ * librpc was built without libdispatch support.
+ *
+ * @param queue Dispatch queue to run the callbacks on
+ */
+- (BOOL)setDispatchQueue:(nonnull dispatch_queue_t)queue
+                   error:(NSError * _Nullable *_Nullable)error;
+
 /**
  * Returns a C pointer to @p rpc_client_t handle.
  *
@@ -277,6 +294,27 @@ typedef void (^RPCEventCallback)(RPCObject* _Nonnull value, NSString * _Nonnull
                   args:(nullable RPCObject *)args
               callback:(nonnull RPCFunctionCallback)cb;
 
+/**
+ * Issues a streaming call to the server and delivers its fragments
+ * on @p queue in batches.
+ *
+ * Fragments already received are handed over up to @p batchSize at a
+ * time, and the server is asked for more once per batch rather than
+ * once per fragment. The last invocation of @p cb has @p done set, and
+ * carries the error if the call failed.
+ *
+ * @param batchSize Maximum number of fragments per callback invocation
+ * @param queue Dispatch queue to run @p cb on
+ */
+- (nullable RPCCall *)callStreaming:(nonnull NSString *)method
+                               path:(nullable NSString *)path
+                          interface:(nullable NSString *)interface
+                               args:(nullable RPCObject *)args
+                          batchSize:(NSUInteger)batchSize
+                              queue:(nonnull dispatch_queue_t)queue
+                           callback:(nonnull RPCStreamCallback)cb
+                              error:(NSError *_Nullable *_Nullable)error;
+
 /**
  * Sets up a callback to be fired whenever specified event occurs on
  * the server.
@@ -66,7 +66,11 @@
         } else if ([value isKindOfClass:[NSDate class]]) {
             _obj = rpc_date_create([(NSDate *)value timeIntervalSince1970]);
         } else if ([value isKindOfClass:[NSData class]]) {
-            _obj = rpc_data_create([(NSData *)value bytes], [(NSData *)value length], NULL);
+            /* Immutable data is only retained by -copy, never copied */
+            NSData *data = [(NSData *)value copy];
+            _obj = rpc_data_create([data bytes], [data length], ^(void *buf) {
+                (void)data;
+            });
         } else if ([value isKindOfClass:[NSException class]]) {
             _obj = rpc_error_create(0, [[(NSException *)value reason] UTF8String], NULL);
         } else if ([value isKindOfClass:[NSArray class]]) {
@@ -164,6 +168,7 @@
     __block NSMutableArray *array;
     __block NSMutableDictionary *dict;
     NSDictionary *userInfo;
+    rpc_object_t data;
     
     switch (rpc_get_type(_obj)) {
         case RPC_TYPE_NULL:
@@ -188,8 +193,15 @@
             return [NSDate dateWithTimeIntervalSince1970:rpc_date_get_value(_obj)];
             
         case RPC_TYPE_BINARY:
-            return [NSData dataWithBytes:rpc_data_get_bytes_ptr(_obj)
-                                  length:rpc_data_get_length(_obj)];
+            if (rpc_data_get_length(_obj) == 0)
+                return [NSData data];
+
+            data = rpc_retain(_obj);
+            return [[NSData alloc] initWithBytesNoCopy:(void *)rpc_data_get_bytes_ptr(data)
+                                                length:rpc_data_get_length(data)
+                                           deallocator:^(void *bytes, NSUInteger length) {
+                rpc_release(data);
+            }];
             
         case RPC_TYPE_ARRAY:
             array = [[NSMutableArray alloc] init];
@@ -356,6 +368,7 @@
 @implementation RPCClient {
     rpc_client_t client;
     rpc_connection_t conn;
+    dispatch_queue_t callbackQueue;
 }
 
 - (BOOL)connect:(NSString *)uri error:(NSError **)error
@@ -372,6 +385,26 @@
     }
 }
 
+- (BOOL)setDispatchQueue:(dispatch_queue_t)queue error:(NSError **)error
+{
+#ifdef ENABLE_LIBDISPATCH
+    if (rpc_connection_set_dispatch_queue(conn, queue) == 0) {
+        /* librpc doesn't retain the queue */
+        callbackQueue = queue;
+        return YES;
+    }
+#endif
+    if (error != nil) {
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain
+                                     code:ENOTSUP
+                                 userInfo:@{
+            NSLocalizedDescriptionKey: @"Dispatch queues are not supported"
+        }];
+    }
+
+    return NO;
+}
+
 - (void *)nativeValue
 {
     return client;
@@ -506,6 +539,68 @@
     return [[RPCCall alloc] initFromNativeObject:call];
 }
 
+- (RPCCall *)callStreaming:(NSString *)method
+                      path:(NSString *)path
+                 interface:(NSString *)interface
+                      args:(RPCObject *)args
+                 batchSize:(NSUInteger)batchSize
+                     queue:(dispatch_queue_t)queue
+                  callback:(RPCStreamCallback)cb
+                     error:(NSError **)error
+{
+    rpc_call_t call;
+    size_t max = MAX(batchSize, 1);
+
+    call = rpc_connection_call(conn, [path UTF8String], [interface UTF8String],
+                               [method UTF8String], [args nativeValue], NULL);
+    if (call == NULL) {
+        if (error != nil)
+            *error = [[RPCObject lastError] value];
+
+        return (nil);
+    }
+
+    /*
+     * Fragments are taken off the call on a worker thread, so that the
+     * credits go back to the server as soon as a batch is taken and not
+     * after the callback on the (possibly busy) queue has run.
+     */
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+        rpc_object_t items[max];
+        NSMutableArray<RPCObject *> *batch;
+        NSError *err = nil;
+        ssize_t n;
+        ssize_t i;
+
+        for (;;) {
+            n = rpc_call_take(call, items, max);
+            if (n <= 0)
+                break;
+
+            batch = [[NSMutableArray alloc] initWithCapacity:(NSUInteger)n];
+            for (i = 0; i < n; i++) {
+                [batch addObject:[[RPCObject alloc] initFromNativeObject:items[i]]];
+                rpc_release(items[i]);
+            }
+
+            dispatch_async(queue, ^{
+                cb(batch, NO, nil);
+            });
+        }
+
+        if (n < 0)
+            err = [[RPCObject lastError] value];
+        else if (rpc_call_status(call) == RPC_CALL_ERROR)
+            err = [[[RPCObject alloc] initFromNativeObject:rpc_call_result(call)] value];
+
+        dispatch_async(queue, ^{
+            cb(@[], YES, err);
+        });
+    });
+
+    return [[RPCCall alloc] initFromNativeObject:call];
+}
+
 - (nonnull RPCListenHandle *)eventObserver:(NSString *)method
                  path:(NSString *)path
             interface:(NSString *)interface
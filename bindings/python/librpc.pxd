@@ -72,6 +72,7 @@ cdef extern from "rpc/object.h" nogil:
         RPC_TYPE_ERROR
         RPC_TYPE_DICTIONARY
         RPC_TYPE_ARRAY
+        RPC_TYPE_SHMEM
 
     void *RPC_DICTIONARY_APPLIER(rpc_dictionary_applier_f fn, void *arg)
     void *RPC_ARRAY_APPLIER(rpc_array_applier_f fn, void *arg)
@@ -108,11 +109,15 @@ cdef extern from "rpc/object.h" nogil:
     size_t rpc_data_get_bytes(rpc_object_t xdata, void *buffer, size_t off,
         size_t length)
     rpc_object_t rpc_string_create(const char *string)
+    rpc_object_t rpc_string_create_len(const char *string, size_t length)
     size_t rpc_string_get_length(rpc_object_t xstring)
     const char *rpc_string_get_string_ptr(rpc_object_t xstring)
     rpc_object_t rpc_fd_create(int fd)
     int rpc_fd_dup(rpc_object_t xfd)
     int rpc_fd_get_value(rpc_object_t xfd)
+    void *rpc_shmem_map(rpc_object_t shmem)
+    void rpc_shmem_unmap(rpc_object_t shmem, void *addr)
+    size_t rpc_shmem_get_size(rpc_object_t shmem)
 
     rpc_object_t rpc_error_create(int code, const char *msg, rpc_object_t extra)
     rpc_object_t rpc_error_create_with_stack(int code, const char *msg, rpc_object_t extra, rpc_object_t stack)
@@ -128,13 +133,22 @@ cdef extern from "rpc/object.h" nogil:
     rpc_object_t rpc_array_create()
     void rpc_array_set_value(rpc_object_t array, size_t index, rpc_object_t value)
     bint rpc_array_apply(rpc_object_t array, void *applier)
+    rpc_object_t rpc_array_create_with_capacity(size_t capacity)
+    rpc_object_t rpc_array_create_packed(rpc_type_t type, const void *data,
+        size_t count)
+    const void *rpc_array_get_packed(rpc_object_t array, rpc_type_t *type,
+        size_t *count)
     void rpc_array_append_value(rpc_object_t array, rpc_object_t value)
+    void rpc_array_append_stolen_value(rpc_object_t array, rpc_object_t value)
     rpc_object_t rpc_array_get_value(rpc_object_t array, size_t index)
     size_t rpc_array_get_count(rpc_object_t array)
     void rpc_array_remove_index(rpc_object_t array, size_t index)
     void rpc_array_remove_all(rpc_object_t array)
 
     rpc_object_t rpc_dictionary_create()
+    rpc_object_t rpc_dictionary_create_with_capacity(size_t capacity)
+    void rpc_dictionary_steal_value(rpc_object_t dictionary, const char *key,
+        rpc_object_t value)
     rpc_object_t rpc_dictionary_get_value(rpc_object_t dictionary,
         const char *key)
     void rpc_dictionary_set_value(rpc_object_t dictionary, const char *key,
@@ -183,6 +197,7 @@ cdef extern from "rpc/connection.h" nogil:
     rpc_call_status_t rpc_call_status(rpc_call_t call)
     int rpc_call_wait(rpc_call_t call)
     int rpc_call_continue(rpc_call_t call, bint sync)
+    ssize_t rpc_call_take(rpc_call_t call, rpc_object_t *items, size_t max)
     int rpc_call_abort(rpc_call_t call)
     int rpc_call_success(rpc_call_t call)
     rpc_object_t rpc_call_result(rpc_call_t call)
@@ -435,6 +450,7 @@ cdef extern from "rpc/rpcd.h" nogil:
 cdef class Object(object):
     cdef rpc_object_t obj
     cdef object ref
+    cdef void *mapping
 
     @staticmethod
     cdef wrap(rpc_object_t ptr, bint retain=*)
@@ -544,6 +560,7 @@ cdef class BaseTypingObject(object):
 cdef class Call(object):
     cdef readonly Connection connection
     cdef rpc_call_t call
+    cdef list pending
 
     @staticmethod
     cdef Call wrap(rpc_call_t ptr)
@@ -30,6 +30,7 @@ import enum
 import errno
 import types
 import inspect
+import asyncio
 import functools
 import traceback
 import datetime
@@ -91,6 +91,85 @@ cdef class Call(object):
         self.resume()
         return result
 
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        if not self.pending:
+            loop = asyncio.get_event_loop()
+            self.pending = await loop.run_in_executor(None, self.take, 64)
+            if self.pending is None:
+                raise StopAsyncIteration()
+
+        return self.pending.pop(0)
+
+    def take(self, size=64):
+        """
+        Takes up to ``size`` fragments of a streaming call at once.
+
+        Waits for the first one with the GIL released, then converts
+        everything that has already arrived to native values. Returns
+        None once the stream is over.
+        """
+        cdef rpc_object_t *items
+        cdef rpc_object_t c_result
+        cdef size_t c_size = size
+        cdef ssize_t count
+        cdef ssize_t i
+
+        if c_size == 0:
+            raise ValueError('size must be positive')
+
+        items = <rpc_object_t *>malloc(c_size * sizeof(rpc_object_t))
+        if items == NULL:
+            raise MemoryError()
+
+        with nogil:
+            count = rpc_call_take(self.call, items, c_size)
+
+        try:
+            if count < 0:
+                raise_internal_exc()
+
+            if count == 0:
+                c_result = rpc_call_result(self.call)
+                if rpc_call_status(self.call) == RPC_CALL_ERROR:
+                    raise Object.wrap(c_result).value
+
+                return None
+
+            return [rpc_to_native(items[i]) for i in range(count)]
+        finally:
+            for i in range(max(count, 0)):
+                rpc_release(items[i])
+
+            free(items)
+
+    def iter_batches(self, size=64):
+        """
+        Iterates over a streaming call in lists of up to ``size`` items.
+        """
+        while True:
+            batch = self.take(size)
+            if batch is None:
+                return
+
+            yield batch
+
+    async def aiter_batches(self, size=64):
+        """
+        Same as iter_batches(), with the waiting done on the default
+        executor of the running event loop.
+        """
+        loop = asyncio.get_event_loop()
+
+        while True:
+            batch = await loop.run_in_executor(None, self.take, size)
+            if batch is None:
+                return
+
+            yield batch
+
     def abort(self):
         with nogil:
             rpc_call_abort(self.call)
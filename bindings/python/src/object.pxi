@@ -26,6 +26,10 @@
 
 import collections
 cimport cpython.object
+from cpython.buffer cimport PyObject_CheckBuffer, PyObject_GetBuffer, \
+    PyBuffer_Release, PyBuffer_FillInfo, PyBUF_CONTIG_RO, PyBUF_FORMAT, \
+    PyBUF_ND, PyBUF_WRITABLE, PyBUF_C_CONTIGUOUS
+from cpython.unicode cimport PyUnicode_InternFromString
 
 
 class ObjectType(enum.IntEnum):
@@ -44,6 +48,7 @@ class ObjectType(enum.IntEnum):
     ERROR = RPC_TYPE_ERROR
     DICTIONARY = RPC_TYPE_DICTIONARY
     ARRAY = RPC_TYPE_ARRAY
+    SHMEM = RPC_TYPE_SHMEM
 
 
 class LibException(Exception):
@@ -91,14 +96,24 @@ class RpcException(LibException):
 cdef class Object(object):
     """
     A boxed librpc object.
+
+    Binary and shared memory objects support the buffer protocol, so
+    memoryview(obj) gives access to their contents without a copy.
     """
     def __init__(self, value, typei=None):
         """
         Create a new boxed object.
 
+        One-dimensional, contiguous int64, uint64, double or bool buffers,
+        like numpy arrays of those types, become packed arrays. Other
+        objects supporting the buffer protocol, like bytearray, become
+        binary objects referencing their memory, which must not be
+        modified while the boxed object is in use.
+
         :param value: Value to box
         :param typei: Type instance to annotate the object
         """
+        cdef Py_buffer *view
 
         if value is None:
             self.obj = rpc_null_create()
@@ -125,7 +140,7 @@ cdef class Object(object):
         elif isinstance(value, datetime.datetime):
             self.obj = rpc_date_create(int(value.timestamp()))
 
-        elif isinstance(value, (bytearray, bytes)):
+        elif isinstance(value, bytes):
             Py_INCREF(value)
             self.obj = rpc_data_create(
                 <char *>value,
@@ -138,20 +153,8 @@ cdef class Object(object):
             stack = Object(value.stacktrace)
             self.obj = rpc_error_create_with_stack(value.code, value.message.encode('utf-8'), extra.obj, stack.obj)
 
-        elif isinstance(value, (list, tuple)):
-            self.obj = rpc_array_create()
-
-            for v in value:
-                child = Object(v)
-                rpc_array_append_value(self.obj, child.obj)
-
-        elif isinstance(value, dict):
-            self.obj = rpc_dictionary_create()
-
-            for k, v in value.items():
-                bkey = k.encode('utf-8')
-                child = Object(v)
-                rpc_dictionary_set_value(self.obj, bkey, child.obj)
+        elif isinstance(value, (list, tuple, dict)):
+            self.obj = native_to_rpc(value)
 
         elif isinstance(value, uuid.UUID):
             bstr = str(value).encode('utf-8')
@@ -165,6 +168,23 @@ cdef class Object(object):
             self.obj = (<BaseTypingObject>value).__object__.unwrap()
             rpc_retain(self.obj)
 
+        elif PyObject_CheckBuffer(value) and buffer_is_packable(value):
+            self.obj = buffer_to_packed(value)
+
+        elif PyObject_CheckBuffer(value):
+            view = <Py_buffer *>malloc(sizeof(Py_buffer))
+            try:
+                PyObject_GetBuffer(value, view, PyBUF_CONTIG_RO)
+            except:
+                free(view)
+                raise
+
+            self.obj = rpc_data_create(
+                view.buf,
+                <size_t>view.len,
+                RPC_BINARY_DESTRUCTOR_ARG(destruct_buffer, <void *>view)
+            )
+
         elif hasattr(value, '__getstate__'):
             try:
                 child = Object(value.__getstate__())
@@ -227,7 +247,35 @@ cdef class Object(object):
     def __hash__(self):
         return rpc_hash(self.unwrap())
 
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        cdef void *ptr
+        cdef size_t length
+        cdef bint readonly = True
+
+        if self.type == ObjectType.BINARY:
+            ptr = <void *>rpc_data_get_bytes_ptr(self.unwrap())
+            length = rpc_data_get_length(self.unwrap())
+
+        elif self.type == ObjectType.SHMEM:
+            # Mapped once and kept until the object goes away
+            if self.mapping == NULL:
+                self.mapping = rpc_shmem_map(self.unwrap())
+                if self.mapping == NULL:
+                    raise_internal_exc()
+
+            ptr = self.mapping
+            length = rpc_shmem_get_size(self.unwrap())
+            readonly = False
+
+        else:
+            raise BufferError('{0} object has no buffer'.format(self.type.name))
+
+        PyBuffer_FillInfo(buffer, self, ptr, length, readonly, flags)
+
     def __dealloc__(self):
+        if self.mapping != NULL:
+            rpc_shmem_unmap(self.obj, self.mapping)
+
         if self.obj != <rpc_object_t>NULL:
             rpc_release(self.obj)
 
@@ -276,6 +324,16 @@ cdef class Object(object):
 
         return self.value
 
+    def native(self):
+        """
+        Convert the whole tree into dicts, lists and plain values.
+
+        Unlike unpack(), which hands out Array and Dictionary wrappers
+        converted node by node on access, this walks the tree once at
+        the C level. Objects of non-builtin types are unpacked as usual.
+        """
+        return rpc_to_native(self.unwrap())
+
     def copy(self):
         return Object.wrap(rpc_copy(self.unwrap()))
 
@@ -326,6 +384,9 @@ cdef class Object(object):
                 c_len = rpc_data_get_length(self.unwrap())
                 return <bytes>c_bytes[:c_len]
 
+            if self.type == ObjectType.SHMEM:
+                return memoryview(self)
+
             if self.type == ObjectType.ERROR:
                 extra = Object.wrap(rpc_error_get_extra(self.unwrap()))
                 stack = Object.wrap(rpc_error_get_stack(self.unwrap()))
@@ -357,10 +418,21 @@ cdef class Object(object):
 
 
 cdef class Array(Object):
+    """
+    A boxed librpc array.
+
+    Packed numeric arrays support the buffer protocol, so
+    numpy.asarray(arr) turns one into an ndarray without going through
+    the elements one by one.
+    """
     def __init__(self, iterable=None, typei=None):
         if iterable is None:
             iterable = []
 
+        if PyObject_CheckBuffer(iterable) and buffer_is_packable(iterable):
+            super(Array, self).__init__(iterable, typei=typei)
+            return
+
         if not isinstance(iterable, collections.Iterable):
             raise TypeError("'{0}' object is not iterable".format(type(iterable)))
 
@@ -369,6 +441,48 @@ cdef class Array(Object):
 
         super(Array, self).__init__(iterable, typei=typei)
 
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        cdef packed_export *export
+        cdef const void *data
+        cdef rpc_type_t c_type
+        cdef size_t count
+
+        data = rpc_array_get_packed(self.unwrap(), &c_type, &count)
+        if data == NULL:
+            raise BufferError('Array is not packed')
+
+        if flags & PyBUF_WRITABLE:
+            raise BufferError('Array buffers are read-only')
+
+        # Anything boxing the array frees its buffer, so export a copy
+        export = <packed_export *>malloc(sizeof(packed_export))
+        export.copy = rpc_array_create_packed(c_type, data, count)
+        export.shape = <Py_ssize_t>count
+
+        buffer.buf = <void *>rpc_array_get_packed(export.copy, NULL, NULL)
+        buffer.obj = self
+        buffer.itemsize = 1 if c_type == RPC_TYPE_BOOL else 8
+        buffer.len = export.shape * buffer.itemsize
+        buffer.readonly = 1
+        buffer.ndim = 1
+        buffer.format = NULL
+        buffer.shape = NULL
+        buffer.strides = NULL
+        buffer.suboffsets = NULL
+        buffer.internal = <void *>export
+
+        if flags & PyBUF_FORMAT:
+            buffer.format = packed_format(c_type)
+
+        if flags & PyBUF_ND:
+            buffer.shape = &export.shape
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        cdef packed_export *export = <packed_export *>buffer.internal
+
+        rpc_release(export.copy)
+        free(export)
+
     @staticmethod
     cdef bint c_applier(void *arg, size_t index, rpc_object_t value) with gil:
         cdef object cb = <object>arg
@@ -692,11 +806,232 @@ cdef raise_internal_exc(rpc=False):
     raise exc(errno.EFAULT, "Unknown error")
 
 
+cdef struct packed_export:
+    rpc_object_t copy
+    Py_ssize_t shape
+
+
+cdef char *packed_format(rpc_type_t c_type):
+    if c_type == RPC_TYPE_INT64:
+        return b'q'
+
+    if c_type == RPC_TYPE_UINT64:
+        return b'Q'
+
+    if c_type == RPC_TYPE_DOUBLE:
+        return b'd'
+
+    return b'?'
+
+
+cdef int packed_type(object value):
+    """
+    Element type of a buffer that can become a packed array, or -1.
+    """
+    cdef Py_buffer view
+    cdef int result = -1
+
+    try:
+        PyObject_GetBuffer(value, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT)
+    except:
+        return -1
+
+    fmt = (<bytes>view.format).lstrip(b'@=') if view.format != NULL else b'B'
+    if view.ndim == 1:
+        if fmt in (b'q', b'l') and view.itemsize == 8:
+            result = RPC_TYPE_INT64
+        elif fmt in (b'Q', b'L') and view.itemsize == 8:
+            result = RPC_TYPE_UINT64
+        elif fmt == b'd' and view.itemsize == 8:
+            result = RPC_TYPE_DOUBLE
+        elif fmt == b'?' and view.itemsize == 1:
+            result = RPC_TYPE_BOOL
+
+    PyBuffer_Release(&view)
+    return result
+
+
+cdef bint buffer_is_packable(object value):
+    return packed_type(value) >= 0
+
+
+cdef rpc_object_t buffer_to_packed(object value) except NULL:
+    cdef Py_buffer view
+    cdef rpc_object_t result
+    cdef int c_type
+
+    c_type = packed_type(value)
+    PyObject_GetBuffer(value, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT)
+    try:
+        result = rpc_array_create_packed(<rpc_type_t>c_type, view.buf, <size_t>view.shape[0])
+    finally:
+        PyBuffer_Release(&view)
+
+    if result == <rpc_object_t>NULL:
+        raise LibException(errno.EINVAL, 'Cannot create a packed array')
+
+    return result
+
+
+cdef list packed_to_list(rpc_object_t obj):
+    cdef rpc_type_t c_type
+    cdef size_t count
+    cdef size_t i
+    cdef const void *data
+    cdef list result
+
+    data = rpc_array_get_packed(obj, &c_type, &count)
+    result = [None] * count
+    for i in range(count):
+        if c_type == RPC_TYPE_INT64:
+            result[i] = (<const int64_t *>data)[i]
+        elif c_type == RPC_TYPE_UINT64:
+            result[i] = uint((<const uint64_t *>data)[i])
+        elif c_type == RPC_TYPE_DOUBLE:
+            result[i] = (<const double *>data)[i]
+        else:
+            result[i] = (<const uint8_t *>data)[i] != 0
+
+    return result
+
+
+cdef bint native_dict_applier(void *arg, const char *key, rpc_object_t value) with gil:
+    cdef list ctx = <list>arg
+
+    try:
+        # Keys repeat across rows, so share one string per key
+        (<dict>ctx[0])[PyUnicode_InternFromString(key)] = rpc_to_native(value)
+        return True
+    except BaseException as e:
+        ctx[1] = e
+        return False
+
+
+cdef object rpc_to_native(rpc_object_t obj):
+    cdef rpct_typei_t typei
+    cdef rpc_type_t c_type
+    cdef const uint8_t *c_bytes
+    cdef size_t c_len
+    cdef size_t i
+    cdef list result
+    cdef list ctx
+
+    if obj == <rpc_object_t>NULL:
+        return None
+
+    typei = rpct_get_typei(obj)
+    if typei != <rpct_typei_t>NULL and rpct_type_get_class(rpct_typei_get_type(typei)) != RPC_TYPING_BUILTIN:
+        return Object.wrap(obj).unpack()
+
+    c_type = rpc_get_type(obj)
+    if c_type == RPC_TYPE_NULL:
+        return None
+
+    if c_type == RPC_TYPE_BOOL:
+        return rpc_bool_get_value(obj)
+
+    if c_type == RPC_TYPE_INT64:
+        return rpc_int64_get_value(obj)
+
+    if c_type == RPC_TYPE_UINT64:
+        return uint(rpc_uint64_get_value(obj))
+
+    if c_type == RPC_TYPE_DOUBLE:
+        return rpc_double_get_value(obj)
+
+    if c_type == RPC_TYPE_STRING:
+        return rpc_string_get_string_ptr(obj)[:rpc_string_get_length(obj)].decode('utf-8')
+
+    if c_type == RPC_TYPE_BINARY:
+        c_bytes = <uint8_t *>rpc_data_get_bytes_ptr(obj)
+        c_len = rpc_data_get_length(obj)
+        return <bytes>c_bytes[:c_len]
+
+    if c_type == RPC_TYPE_ARRAY and rpc_array_get_packed(obj, NULL, NULL) != NULL:
+        return packed_to_list(obj)
+
+    if c_type == RPC_TYPE_ARRAY:
+        c_len = rpc_array_get_count(obj)
+        result = [None] * c_len
+        for i in range(c_len):
+            result[i] = rpc_to_native(rpc_array_get_value(obj, i))
+
+        return result
+
+    if c_type == RPC_TYPE_DICTIONARY:
+        ctx = [{}, None]
+        rpc_dictionary_apply(obj, RPC_DICTIONARY_APPLIER(
+            <rpc_dictionary_applier_f>native_dict_applier,
+            <void *>ctx
+        ))
+
+        if ctx[1] is not None:
+            raise ctx[1]
+
+        return ctx[0]
+
+    return Object.wrap(obj).unpack()
+
+
+cdef rpc_object_t native_to_rpc(object value) except NULL:
+    cdef rpc_object_t result
+    cdef Object child
+
+    if value is None:
+        return rpc_null_create()
+
+    if type(value) is bool:
+        return rpc_bool_create(value)
+
+    if type(value) is int:
+        return rpc_int64_create(value)
+
+    if type(value) is float:
+        return rpc_double_create(value)
+
+    if type(value) is str:
+        bstr = (<str>value).encode('utf-8')
+        return rpc_string_create_len(bstr, len(bstr))
+
+    if isinstance(value, (list, tuple)):
+        result = rpc_array_create_with_capacity(len(value))
+        try:
+            for v in value:
+                rpc_array_append_stolen_value(result, native_to_rpc(v))
+        except:
+            rpc_release(result)
+            raise
+
+        return result
+
+    if isinstance(value, dict):
+        result = rpc_dictionary_create_with_capacity(len(value))
+        try:
+            for k, v in value.items():
+                bkey = k.encode('utf-8')
+                rpc_dictionary_steal_value(result, bkey, native_to_rpc(v))
+        except:
+            rpc_release(result)
+            raise
+
+        return result
+
+    # Subclasses (uint, fd, ...) and everything else take the long way
+    child = Object(value)
+    return rpc_retain(child.obj)
+
+
 cdef void destruct_bytes(void *arg, void *buffer) with gil:
     cdef object value = <object>arg
     Py_DECREF(value)
 
 
+cdef void destruct_buffer(void *arg, void *buffer) with gil:
+    cdef Py_buffer *view = <Py_buffer *>arg
+    PyBuffer_Release(view)
+    free(view)
+
+
 class uint(int):
     def __init__(self, x=0, base=None):
         if base:
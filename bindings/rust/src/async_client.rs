@@ -0,0 +1,319 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+//! Client driven by a tokio runtime.
+//!
+//! The connection is attached to a completion queue, whose pipe is
+//! watched by a task on the runtime. Call status changes picked up from
+//! the queue wake the future or stream waiting on that call; nothing
+//! runs on the librpc callback thread pool and no thread blocks per call.
+
+use std::collections::HashMap;
+use std::future::{Future, poll_fn};
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::pin::Pin;
+use std::ptr::null_mut;
+use std::mem::transmute;
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll, Waker};
+use tokio::io::unix::AsyncFd;
+use tokio::task::JoinHandle;
+use super::*;
+
+const CQ_BATCH: usize = 64;
+
+struct CompletionQueue
+{
+    value: *mut RawCompletionQueue
+}
+
+unsafe impl Send for CompletionQueue {}
+unsafe impl Sync for CompletionQueue {}
+
+impl Drop for CompletionQueue {
+    fn drop(&mut self) {
+        unsafe {
+            rpc_completion_queue_free(self.value);
+        }
+    }
+}
+
+struct QueueFd(RawFd);
+
+impl AsRawFd for QueueFd {
+    fn as_raw_fd(&self) -> RawFd {
+        self.0
+    }
+}
+
+struct Shared
+{
+    cq: CompletionQueue,
+    wakers: Mutex<HashMap<usize, Waker>>
+}
+
+impl Shared {
+    fn wait(&self, call: *mut RawCall, waker: &Waker) {
+        self.wakers.lock().unwrap().insert(call as usize, waker.clone());
+    }
+
+    fn forget(&self, call: *mut RawCall) {
+        self.wakers.lock().unwrap().remove(&(call as usize));
+    }
+}
+
+pub struct AsyncClient
+{
+    client: Client,
+    shared: Arc<Shared>,
+    driver: JoinHandle<()>
+}
+
+/// Result of a call, resolved without blocking.
+pub struct CallFuture
+{
+    shared: Arc<Shared>,
+    call: *mut RawCall
+}
+
+/// Fragments of a streaming call, each picked up as it arrives.
+pub struct CallStream
+{
+    shared: Arc<Shared>,
+    call: *mut RawCall,
+    finished: bool
+}
+
+unsafe impl Send for CallFuture {}
+unsafe impl Send for CallStream {}
+
+impl AsyncClient {
+    /// Connects to @p uri. Has to be called from within a tokio runtime,
+    /// which the completion queue is then polled on.
+    pub fn connect(uri: &str) -> std::io::Result<AsyncClient> {
+        unsafe {
+            let cq = rpc_completion_queue_create();
+            if cq.is_null() {
+                return Err(std::io::Error::last_os_error());
+            }
+
+            let shared = Arc::new(Shared {
+                cq: CompletionQueue { value: cq },
+                wakers: Mutex::new(HashMap::new())
+            });
+
+            let client = Client::connect(uri);
+            if rpc_connection_set_completion_queue(client.connection.value, cq) != 0 {
+                rpc_client_close(client.value);
+                return Err(std::io::Error::last_os_error());
+            }
+
+            let fd = AsyncFd::new(QueueFd(rpc_completion_queue_get_fd(cq)))?;
+            let driver = tokio::spawn(drive(shared.clone(), fd));
+
+            Ok(AsyncClient { client: client, shared: shared, driver: driver })
+        }
+    }
+
+    fn start(&self, name: &str, path: &str, interface: &str, args: &[Value]) -> *mut RawCall {
+        unsafe {
+            let c_path = to_cstr!(path);
+            let c_interface = to_cstr!(interface);
+            let c_name = to_cstr!(name);
+
+            rpc_connection_call(
+                self.client.connection.value, c_path.as_ptr(), c_interface.as_ptr(),
+                c_name.as_ptr(), Object::create(args).value, null_block!()
+            )
+        }
+    }
+
+    pub fn call(&self, name: &str, path: &str, interface: &str, args: &[Value]) -> CallFuture {
+        CallFuture {
+            shared: self.shared.clone(),
+            call: self.start(name, path, interface, args)
+        }
+    }
+
+    pub fn stream(&self, name: &str, path: &str, interface: &str, args: &[Value]) -> CallStream {
+        CallStream {
+            shared: self.shared.clone(),
+            call: self.start(name, path, interface, args),
+            finished: false
+        }
+    }
+}
+
+impl Drop for AsyncClient {
+    fn drop(&mut self) {
+        /* The connection has to be closed before its completion queue goes */
+        self.driver.abort();
+        unsafe {
+            rpc_client_close(self.client.value);
+        }
+    }
+}
+
+async fn drive(shared: Arc<Shared>, fd: AsyncFd<QueueFd>) {
+    let mut events: Vec<RawCqEvent> = (0..CQ_BATCH).map(|_| RawCqEvent {
+        conn: null_mut(),
+        call: null_mut(),
+        event: null_mut()
+    }).collect();
+
+    loop {
+        let mut guard = match fd.readable().await {
+            Ok(guard) => guard,
+            Err(_) => return
+        };
+
+        loop {
+            let count = unsafe {
+                rpc_cq_poll(shared.cq.value, events.as_mut_ptr(), CQ_BATCH)
+            };
+
+            for event in events[..count].iter_mut() {
+                if !event.call.is_null() {
+                    let waker = shared.wakers.lock().unwrap().remove(&(event.call as usize));
+                    if let Some(waker) = waker {
+                        waker.wake();
+                    }
+                }
+
+                unsafe {
+                    rpc_cq_event_release(event);
+                }
+            }
+
+            if count < CQ_BATCH {
+                break;
+            }
+        }
+
+        guard.clear_ready();
+    }
+}
+
+fn take_result(call: *mut RawCall) -> Object {
+    unsafe {
+        Object { value: rpc_retain(rpc_call_result(call)) }
+    }
+}
+
+impl Future for CallFuture {
+    type Output = Result<Object, Error>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context) -> Poll<Self::Output> {
+        /* Registered before looking, so that no status change is missed */
+        self.shared.wait(self.call, cx.waker());
+
+        loop {
+            let status = unsafe { rpc_call_status(self.call) };
+            let result = match status {
+                CallStatus::InProgress => return Poll::Pending,
+                CallStatus::StreamStart => {
+                    unsafe { rpc_call_continue(self.call, false); }
+                    continue;
+                },
+                CallStatus::MoreAvailable | CallStatus::Done => Ok(take_result(self.call)),
+                CallStatus::Error => Err(Error::from_object(&take_result(self.call))),
+                CallStatus::Aborted | CallStatus::Ended => Ok(Object::new(Value::Null))
+            };
+
+            self.shared.forget(self.call);
+            return Poll::Ready(result);
+        }
+    }
+}
+
+impl Drop for CallFuture {
+    fn drop(&mut self) {
+        self.shared.forget(self.call);
+        unsafe {
+            rpc_call_free(self.call);
+        }
+    }
+}
+
+impl CallStream {
+    pub fn poll_next(&mut self, cx: &mut Context) -> Poll<Option<Result<Object, Error>>> {
+        if self.finished {
+            return Poll::Ready(None);
+        }
+
+        self.shared.wait(self.call, cx.waker());
+
+        loop {
+            let status = unsafe { rpc_call_status(self.call) };
+            let result = match status {
+                CallStatus::InProgress => return Poll::Pending,
+                CallStatus::StreamStart => {
+                    unsafe { rpc_call_continue(self.call, false); }
+                    continue;
+                },
+                CallStatus::MoreAvailable => {
+                    let item = take_result(self.call);
+                    unsafe { rpc_call_continue(self.call, false); }
+                    Some(Ok(item))
+                },
+                CallStatus::Done => {
+                    self.finished = true;
+                    Some(Ok(take_result(self.call)))
+                },
+                CallStatus::Error => {
+                    self.finished = true;
+                    Some(Err(Error::from_object(&take_result(self.call))))
+                },
+                CallStatus::Aborted | CallStatus::Ended => {
+                    self.finished = true;
+                    None
+                }
+            };
+
+            self.shared.forget(self.call);
+            return Poll::Ready(result);
+        }
+    }
+
+    /// Waits for the next fragment; None once the stream is over.
+    pub async fn next(&mut self) -> Option<Result<Object, Error>> {
+        poll_fn(|cx| self.poll_next(cx)).await
+    }
+}
+
+impl Drop for CallStream {
+    fn drop(&mut self) {
+        self.shared.forget(self.call);
+        unsafe {
+            if !self.finished {
+                rpc_call_abort(self.call);
+            }
+
+            rpc_call_free(self.call);
+        }
+    }
+}
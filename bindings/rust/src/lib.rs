@@ -27,6 +27,8 @@
 
 extern crate libc;
 extern crate block;
+#[cfg(feature = "async")]
+extern crate tokio;
 use std::fmt;
 use std::ffi::{CString, CStr};
 use std::collections::hash_map::HashMap;
@@ -46,6 +48,9 @@ macro_rules! null_block {
     () => (transmute::<*mut c_void, _>(null_mut()))
 }
 
+#[cfg(feature = "async")]
+pub mod async_client;
+
 #[repr(C)]
 #[derive(Debug)]
 pub enum RawType
@@ -62,6 +67,7 @@ pub enum RawType
     Dictionary,
     Array,
     Error,
+    Shmem,
 }
 
 #[repr(C)]
@@ -69,6 +75,7 @@ pub enum RawType
 pub enum CallStatus
 {
     InProgress,
+    StreamStart,
     MoreAvailable,
     Done,
     Error,
@@ -80,6 +87,15 @@ pub enum RawObject {}
 pub enum RawConnection {}
 pub enum RawClient {}
 pub enum RawCall {}
+pub enum RawCompletionQueue {}
+
+#[repr(C)]
+pub struct RawCqEvent
+{
+    pub conn: *mut RawConnection,
+    pub call: *mut RawCall,
+    pub event: *mut RawObject
+}
 
 pub struct Object
 {
@@ -142,6 +158,18 @@ pub struct Error
     extra: Box<Value>
 }
 
+/*
+ * Objects are refcounted atomically, so they can be handed to another
+ * thread. They aren't Sync: reading a container may convert it in place.
+ * Connections, clients and calls do their own locking.
+ */
+unsafe impl Send for Object {}
+unsafe impl Send for Connection {}
+unsafe impl Sync for Connection {}
+unsafe impl Send for Client {}
+unsafe impl Sync for Client {}
+unsafe impl<'a> Send for Call<'a> {}
+
 #[link(name = "rpc")]
 extern {
     /* rpc/object.h */
@@ -160,7 +188,12 @@ extern {
     pub fn rpc_date_get_value(obj: *mut RawObject) -> u64;
     pub fn rpc_string_create(value: *const c_char) -> *mut RawObject;
     pub fn rpc_string_get_string_ptr(value: *mut RawObject) -> *const c_char;
+    pub fn rpc_string_get_length(value: *mut RawObject) -> usize;
     pub fn rpc_data_create(ptr: *const u8, len: usize, dtor: *const c_void) -> *mut RawObject;
+    pub fn rpc_data_get_bytes_ptr(value: *mut RawObject) -> *const u8;
+    pub fn rpc_data_get_length(value: *mut RawObject) -> usize;
+    pub fn rpc_error_get_code(value: *mut RawObject) -> i32;
+    pub fn rpc_error_get_message(value: *mut RawObject) -> *const c_char;
     pub fn rpc_array_create() -> *mut RawObject;
     pub fn rpc_dictionary_create() -> *mut RawObject;
     pub fn rpc_array_append_value(obj: *mut RawObject, value: *mut RawObject);
@@ -179,13 +212,23 @@ extern {
 
     pub fn rpc_call_status(call: *mut RawCall) -> CallStatus;
     pub fn rpc_call_result(call: *mut RawCall) -> *mut RawObject;
-    pub fn rpc_call_continue(call: *mut RawCall);
-    pub fn rpc_call_abort(call: *mut RawCall);
-    pub fn rpc_call_wait(call: *mut RawCall);
+    pub fn rpc_call_continue(call: *mut RawCall, sync: bool) -> i32;
+    pub fn rpc_call_abort(call: *mut RawCall) -> i32;
+    pub fn rpc_call_wait(call: *mut RawCall) -> i32;
+    pub fn rpc_call_free(call: *mut RawCall);
+    pub fn rpc_completion_queue_create() -> *mut RawCompletionQueue;
+    pub fn rpc_completion_queue_free(cq: *mut RawCompletionQueue);
+    pub fn rpc_completion_queue_get_fd(cq: *mut RawCompletionQueue) -> i32;
+    pub fn rpc_connection_set_completion_queue(conn: *mut RawConnection,
+                                               cq: *mut RawCompletionQueue) -> i32;
+    pub fn rpc_cq_poll(cq: *mut RawCompletionQueue, events: *mut RawCqEvent,
+                       max: usize) -> usize;
+    pub fn rpc_cq_event_release(event: *mut RawCqEvent);
 
     /* rpc/client.h */
     pub fn rpc_client_create(uri: *const c_char, params: *const RawObject) -> *mut RawClient;
     pub fn rpc_client_get_connection(client: *mut RawClient) -> *mut RawConnection;
+    pub fn rpc_client_close(client: *mut RawClient);
 }
 
 pub trait Create<T> {
@@ -339,14 +382,83 @@ impl Object {
                 RawType::Uint64 => Value::Uint64(rpc_uint64_get_value(self.value)),
                 RawType::Int64 => Value::Int64(rpc_int64_get_value(self.value)),
                 RawType::Double => Value::Double(rpc_double_get_value(self.value)),
-                RawType::String => Value::String(String::from(CStr::from_ptr(
-                    rpc_string_get_string_ptr(self.value)).to_str().unwrap())),
+                RawType::String => Value::String(String::from(self.as_str().unwrap_or(""))),
                 RawType::Date => Value::Date(rpc_date_get_value(self.value)),
-                RawType::Binary => Value::Null,
+                RawType::Binary => Value::Binary(self.as_bytes().unwrap_or(&[]).to_vec()),
                 RawType::Fd => Value::Fd(rpc_fd_get_value(self.value)),
                 RawType::Array => Value::Null,
                 RawType::Dictionary => Value::Null,
                 RawType::Error => Value::Null,
+                RawType::Shmem => Value::Null,
+            }
+        }
+    }
+
+    /// Borrows the contents of a string object, without copying them.
+    /// Returns None for other types and for strings that aren't UTF-8.
+    pub fn as_str(&self) -> Option<&str> {
+        unsafe {
+            match self.get_raw_type() {
+                RawType::String => {
+                    let ptr = rpc_string_get_string_ptr(self.value) as *const u8;
+                    let len = rpc_string_get_length(self.value);
+
+                    std::str::from_utf8(std::slice::from_raw_parts(ptr, len)).ok()
+                },
+                _ => None
+            }
+        }
+    }
+
+    /// Borrows the payload of a binary object, without copying it.
+    pub fn as_bytes(&self) -> Option<&[u8]> {
+        unsafe {
+            match self.get_raw_type() {
+                RawType::Binary => {
+                    let ptr = rpc_data_get_bytes_ptr(self.value);
+                    let len = rpc_data_get_length(self.value);
+
+                    match ptr.is_null() {
+                        true => Some(&[]),
+                        false => Some(std::slice::from_raw_parts(ptr, len))
+                    }
+                },
+                _ => None
+            }
+        }
+    }
+
+    /// Takes over a reference the caller already holds.
+    pub unsafe fn from_raw(value: *mut RawObject) -> Object {
+        Object { value: value }
+    }
+
+    pub fn as_raw(&self) -> *mut RawObject {
+        self.value
+    }
+}
+
+impl Error {
+    pub fn code(&self) -> u32 {
+        self.code
+    }
+
+    pub fn message(&self) -> &str {
+        self.message.as_str()
+    }
+
+    fn from_object(obj: &Object) -> Error {
+        unsafe {
+            let message = rpc_error_get_message(obj.value);
+
+            Error {
+                code: rpc_error_get_code(obj.value) as u32,
+                message: match message.is_null() {
+                    true => String::new(),
+                    false => CStr::from_ptr(message).to_string_lossy().into_owned()
+                },
+                stack_trace: Box::new(Value::Null),
+                extra: Box::new(Value::Null)
             }
         }
     }
@@ -56,6 +56,7 @@ export class LibRpcClient {
     }
 
     private connector: LibRpcConnector;
+    private lastId = 0;
 
     /**
      * Create a new LibRpcClient.
@@ -179,7 +180,7 @@ export class LibRpcClient {
      */
     public subscribe<T = any>(path: string): Observable<T> {
         const outMessage: LibRpcRequest = {
-            id: v4(),
+            id: this.nextId(),
             namespace: 'events',
             name: 'subscribe',
             args: [{
@@ -208,7 +209,7 @@ export class LibRpcClient {
      */
     public unsubscribe<T = any>(path: string): Observable<T> {
         return this.connector.send({
-            id: v4(),
+            id: this.nextId(),
             namespace: 'events',
             name: 'unsubscribe',
             args: [{
@@ -219,6 +220,13 @@ export class LibRpcClient {
         });
     }
 
+    /**
+     * Servers that advertised compact call ids get a counter instead of a v4 UUID per call.
+     */
+    private nextId(): string|number {
+        return this.connector.isCompact ? ++this.lastId : v4();
+    }
+
     private send<T = any>(
         namespace: string,
         name: string,
@@ -226,7 +234,7 @@ export class LibRpcClient {
         isBufferized: boolean = true,
     ): Observable<T> {
         const request: LibRpcRequest = assign({
-            id: v4(),
+            id: this.nextId(),
             namespace: namespace,
             name: name
         }, {args: payload || {}});
@@ -240,7 +248,7 @@ export class LibRpcClient {
                 if (response.name === 'fragment') {
                     const fragmentWrapper = (response.args as LibRpcFragment<T>);
                     this.sendRequest({
-                        id: response.id as string,
+                        id: response.id as string|number,
                         namespace: response.namespace,
                         name: 'continue',
                         args: fragmentWrapper.seqno + 1
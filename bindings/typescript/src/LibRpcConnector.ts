@@ -1,6 +1,7 @@
 /**
  * @module LibRpcClient
  */
+import {assign} from 'lodash';
 import {Codec, createCodec, decode, encode} from 'msgpack-lite';
 import {BehaviorSubject} from 'rxjs/BehaviorSubject';
 import {Observable} from 'rxjs/Observable';
@@ -8,17 +9,85 @@ import {Subject} from 'rxjs/Subject';
 import {LibRpcRequest} from './model';
 import {WebSocketFactory} from './WebSocketFactory';
 
+declare const BigInt64Array: any;
+declare const BigUint64Array: any;
+
+/**
+ * Subprotocol under which every WebSocket message carries one or more frames, each of them
+ * prefixed with its length as a 32-bit little endian integer.
+ */
+export const BATCH_PROTOCOL = 'librpc.batch.v1';
+
+const BATCH_MAX = 64 * 1024;
+
+const RPC_TYPE_BOOL = 1;
+const RPC_TYPE_UINT64 = 2;
+const RPC_TYPE_INT64 = 3;
+const RPC_TYPE_DOUBLE = 4;
+
+/**
+ * Unpacks a packed array extension: a type tag followed by little endian elements. The payload
+ * is copied out first, as typed arrays need their elements to be aligned.
+ */
+function unpackArray(buffer: Uint8Array): any {
+    const elements = new Uint8Array(Math.max(buffer.length - 1, 0));
+    const result: any[] = [];
+    let view: DataView;
+
+    elements.set(buffer.subarray(1));
+    switch (buffer[0]) {
+        case RPC_TYPE_DOUBLE:
+            return new Float64Array(elements.buffer);
+        case RPC_TYPE_INT64:
+            if (typeof BigInt64Array !== 'undefined') {
+                return new BigInt64Array(elements.buffer);
+            }
+            view = new DataView(elements.buffer);
+            for (let i = 0; i < elements.length; i += 8) {
+                result.push(view.getInt32(i + 4, true) * 0x100000000 + view.getUint32(i, true));
+            }
+            return result;
+        case RPC_TYPE_UINT64:
+            if (typeof BigUint64Array !== 'undefined') {
+                return new BigUint64Array(elements.buffer);
+            }
+            view = new DataView(elements.buffer);
+            for (let i = 0; i < elements.length; i += 8) {
+                result.push(view.getUint32(i + 4, true) * 0x100000000 + view.getUint32(i, true));
+            }
+            return result;
+        case RPC_TYPE_BOOL:
+            for (let i = 0; i < elements.length; i++) {
+                result.push(elements[i] !== 0);
+            }
+            return result;
+        default:
+            return null;
+    }
+}
+
+function toJson(key: string, value: any): any {
+    return (typeof value as string) === 'bigint' ? value.toString() : value;
+}
+
 export class LibRpcConnector {
     public isConnected$ = new BehaviorSubject<boolean>(false);
 
+    /**
+     * Whether the server accepts compact call ids, which is true once it has advertised them.
+     */
+    public isCompact = false;
+
     private EXT_UNPACKERS: Map<number, (buffer: Uint8Array) => any> = new Map([
-        [0x01, (buffer: Uint8Array) => new Date(new DataView(buffer.buffer, 0).getUint32(0, true) * 1000)],
+        [0x01, (buffer: Uint8Array) =>
+            new Date(new DataView(buffer.buffer, buffer.byteOffset).getUint32(0, true) * 1000)],
         [0x04, (buffer: Uint8Array) => decode(buffer, {codec: this.codec})],
+        [0x05, unpackArray],
     ]);
 
     private ws: WebSocket;
     private messages$: Subject<any>;
-    private messageBuffer: Buffer[];
+    private messageBuffer: Uint8Array[];
     private codec: Codec;
 
     public constructor(
@@ -35,7 +104,7 @@ export class LibRpcConnector {
 
         if (this.isDebugEnabled) {
             // tslint:disable-next-line:no-console
-            this.messages$.subscribe((message: any) => console.log('RECV\n', JSON.stringify(message)));
+            this.messages$.subscribe((message: any) => console.log('RECV\n', JSON.stringify(message, toJson)));
         }
         this.ws = this.webSocketFactory.get(this.url);
         this.connect();
@@ -46,10 +115,13 @@ export class LibRpcConnector {
             // tslint:disable-next-line:no-console
             console.log('SEND\n', JSON.stringify(message));
         }
-        const data = encode(message);
+        const data = encode(this.isCompact ? message : assign({}, message, {
+            compact_ids: true,
+            packed_arrays: true,
+        }));
         switch (this.ws.readyState) {
             case this.webSocketFactory.OPEN:
-                this.ws.send(data);
+                this.ws.send(this.isBatched() ? this.batch([data]) : data);
                 break;
             case this.webSocketFactory.CLOSED:
             case this.webSocketFactory.CLOSING:
@@ -78,7 +150,7 @@ export class LibRpcConnector {
     }
 
     private connect() {
-        this.ws = this.webSocketFactory.get(this.url);
+        this.ws = this.webSocketFactory.get(this.url, [BATCH_PROTOCOL]);
         this.isConnected$.next(this.ws.readyState === this.webSocketFactory.OPEN);
         this.ws.binaryType = 'arraybuffer';
         this.ws.onopen = () => {
@@ -90,19 +162,86 @@ export class LibRpcConnector {
             };
 
             this.ws.onmessage = (message: MessageEvent) => {
-                this.messages$.next(
-                    typeof message.data === 'object' ?
-                        decode(new Uint8Array(message.data), {codec: this.codec}) : JSON.parse(message.data)
-                );
+                if (this.isBatched()) {
+                    this.unbatch(message.data);
+                } else {
+                    this.receive(new Uint8Array(message.data));
+                }
             };
         };
     }
 
+    private isBatched(): boolean {
+        return this.ws.protocol === BATCH_PROTOCOL;
+    }
+
+    private receive(data: Uint8Array) {
+        const message = decode(data, {codec: this.codec});
+
+        if (!this.isCompact && message && message.compact_ids) {
+            this.isCompact = true;
+        }
+        this.messages$.next(message);
+    }
+
+    /**
+     * Walks the length prefixes of a batched message once, decoding every frame in place.
+     */
+    private unbatch(data: ArrayBuffer) {
+        const view = new DataView(data);
+        let offset = 0;
+
+        while (offset + 4 <= data.byteLength) {
+            const length = view.getUint32(offset, true);
+
+            offset += 4;
+            if (offset + length > data.byteLength) {
+                break;
+            }
+            this.receive(new Uint8Array(data, offset, length));
+            offset += length;
+        }
+    }
+
+    private batch(frames: Uint8Array[]): Uint8Array {
+        const size = frames.reduce((total: number, frame: Uint8Array) => total + 4 + frame.length, 0);
+        const result = new Uint8Array(size);
+        const view = new DataView(result.buffer);
+        let offset = 0;
+
+        frames.forEach((frame: Uint8Array) => {
+            view.setUint32(offset, frame.length, true);
+            result.set(frame, offset + 4);
+            offset += 4 + frame.length;
+        });
+        return result;
+    }
+
+    /**
+     * Frames queued while disconnected go out coalesced when batching has been negotiated, in
+     * messages of at most BATCH_MAX bytes unless a single frame is larger.
+     */
     private emptyMessageQueue() {
+        let frames: Uint8Array[] = [];
+        let size = 0;
         let data = this.messageBuffer.shift();
+
         while (data) {
-            this.ws.send(data);
+            if (!this.isBatched()) {
+                this.ws.send(data);
+            } else {
+                if (frames.length > 0 && size + 4 + data.length > BATCH_MAX) {
+                    this.ws.send(this.batch(frames));
+                    frames = [];
+                    size = 0;
+                }
+                frames.push(data);
+                size += 4 + data.length;
+            }
             data = this.messageBuffer.shift();
         }
+        if (frames.length > 0) {
+            this.ws.send(this.batch(frames));
+        }
     }
 }
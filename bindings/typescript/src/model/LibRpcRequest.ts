@@ -2,7 +2,7 @@
  * @module LibRpcClient
  */
 export interface LibRpcRequest<T = any> {
-    id: string;
+    id: string|number;
     namespace: string;
     name: string;
     args: T;
@@ -2,7 +2,7 @@
  * @module LibRpcClient
  */
 export interface LibRpcResponse<T = any> {
-    id: string|null;
+    id: string|number|null;
     namespace: string;
     name: string;
     args: T;
@@ -168,7 +168,8 @@ yuarel_parse(struct yuarel *url, char *u)
 			return -1;
 		}
 
-		if (!strcmp(url->scheme, "tcp")) {
+		if (!strcmp(url->scheme, "tcp") ||
+		    !strcmp(url->scheme, "tcp+tls")) {
 			sptr = strchr(u, '[');
 			ptr = strchr(u, ']');
 			if (sptr != NULL && ptr != NULL) {
@@ -184,7 +185,8 @@ yuarel_parse(struct yuarel *url, char *u)
 		}
 
 		url->host = u;
-		if (!strcmp(url->scheme, "unix"))
+		if (!strcmp(url->scheme, "unix") ||
+		    !strcmp(url->scheme, "unix+seq"))
 			return 0;
 
 		/* (Path) */
@@ -100,8 +100,13 @@ int rpc_bus_ping(const char *_Nonnull serial);
 /**
  * Enumerates connected devices on the RPC bus.
  *
+ * The first call after @ref rpc_bus_open scans the bus; afterwards the
+ * result is a copy of a node table kept current by hot-plug events, so
+ * no bus traffic is generated. Callers that need to track changes should
+ * register an event handler rather than poll this function.
+ *
  * @param result Array of @ref rpc_bus_node elements
- * @return 0 on success, -1 on error
+ * @return Number of nodes on success, -1 on error
  */
 int rpc_bus_enumerate(struct rpc_bus_node *_Nullable *_Nonnull result);
 
@@ -116,6 +121,10 @@ void rpc_bus_free_result(struct rpc_bus_node *_Nonnull result);
  * Configures an event handler block to be called whenever a bus
  * event occurs.
  *
+ * The handler runs after the node table used by @ref rpc_bus_enumerate
+ * has been updated. For @ref RPC_BUS_DETACHED events, the node carries
+ * the last known name, description and serial of the departed device.
+ *
  * @param handler Bus event handler
  */
 void rpc_bus_register_event_handler(_Nonnull rpc_bus_event_handler_t handler);
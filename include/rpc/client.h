@@ -29,6 +29,7 @@
 #define LIBRPC_CLIENT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <rpc/connection.h>
 
 /**
@@ -51,15 +52,43 @@ struct rpc_client;
  */
 typedef struct rpc_client *rpc_client_t;
 
+/**
+ * How rpc_client_next_connection() and rpc_client_call_sync() pick
+ * a pool member.
+ */
+typedef enum rpc_balance_policy
+{
+	RPC_BALANCE_ROUND_ROBIN,	/**< Take turns */
+	RPC_BALANCE_LEAST_OUTSTANDING,	/**< Fewest client calls in flight */
+	RPC_BALANCE_EWMA,		/**< Lowest recent latency under load */
+} rpc_balance_policy_t;
+
 /**
  * Creates a new, connected RPC client.
  *
  * URI parameter can take multiple forms:
  * - unix://(path) connects to an Unix domain socket
+ * - unix+seq://(path) connects to an Unix domain SOCK_SEQPACKET socket
  * - tcp://(ip-address):(port) connects using a TCP socket
+ * - tcp+tls://(host):(port) connects using TLS over a TCP socket
+ * - vsock://(cid):(port) connects to a VM or its host using an AF_VSOCK socket
  * - ws://(ip-address):(port)/(path) connects using a WebSocket
  * - loopback://(id) connects using a local transport
  *
+ * Besides the transport-specific ones, a params dictionary may set
+ * "resume" to make the connection reconnect and resume its session
+ * when the transport drops, "replay" to also send idempotent calls
+ * that were in flight again (see rpc_connection_set_idempotent()),
+ * and "event_group" to receive broadcast events over
+ * the UDP multicast group the server announces, if any.
+ *
+ * Setting "shared_loop" makes the client run its timers and other
+ * sources on one of a few main loops shared by the whole process,
+ * instead of a thread of its own; socket transports then also read
+ * through the shared I/O threads. Clients are spread over the loops
+ * round robin, unless "loop_affinity" gives an integer key: clients
+ * with the same key share a loop.
+ *
  * @param uri Endpoint URI
  * @param params Transport-specific parameters or NULL
  * @return Connect RPC client handle
@@ -67,15 +96,134 @@ typedef struct rpc_client *rpc_client_t;
 _Nullable rpc_client_t rpc_client_create(const char *_Nonnull uri,
     _Nullable rpc_object_t params);
 
+/**
+ * Creates a new RPC client backed by a pool of connections.
+ *
+ * All members connect to the same URI with the same parameters. The
+ * first one is the primary connection, returned by
+ * rpc_client_get_connection(): event handlers and subscriptions belong
+ * there, so that each event is delivered only once. Calls can be spread
+ * over all members with rpc_client_next_connection() and
+ * rpc_client_get_connection_by_key().
+ *
+ * Members other than the primary one are reconnected on their own when
+ * picked after they went down.
+ *
+ * @param uri Endpoint URI
+ * @param n Number of connections
+ * @param params Transport-specific parameters or NULL
+ * @return Connected RPC client handle
+ */
+_Nullable rpc_client_t rpc_client_create_pool(const char *_Nonnull uri,
+    size_t n, _Nullable rpc_object_t params);
+
+/**
+ * Creates a new RPC client backed by connections to several endpoints.
+ *
+ * Meant for replicas of the same service. The pool works as with
+ * rpc_client_create_pool(), with a member per URI; the first one is
+ * the primary connection and has to be reachable. Other endpoints that
+ * are down are connected to later, when picked.
+ *
+ * @param uris Endpoint URIs
+ * @param n Number of URIs
+ * @param params Transport-specific parameters or NULL
+ * @return Connected RPC client handle
+ */
+_Nullable rpc_client_t rpc_client_create_multi(
+    const char *_Nonnull const *_Nonnull uris, size_t n,
+    _Nullable rpc_object_t params);
+
+/**
+ * Sets how calls are spread over the pool of a client.
+ *
+ * Round robin is the default. The other policies go by the calls made
+ * with rpc_client_call_sync(): @ref RPC_BALANCE_LEAST_OUTSTANDING picks
+ * the member with the fewest of them in flight, and @ref RPC_BALANCE_EWMA
+ * the one with the lowest moving average of latency, scaled by the
+ * number in flight.
+ *
+ * @param client Client handle
+ * @param policy Balancing policy
+ */
+void rpc_client_set_balancing(_Nonnull rpc_client_t client,
+    rpc_balance_policy_t policy);
+
+/**
+ * Turns hedging of idempotent calls on or off.
+ *
+ * A hedged call that hasn't been answered within the 95th percentile of
+ * recent call latency, or @p min_delay_ms if that's longer, is sent
+ * once more to another pool member. The first successful response is
+ * taken and the other call is aborted. Nothing is hedged until enough
+ * calls have completed to estimate the percentile.
+ *
+ * @param client Client handle
+ * @param enable Whether to hedge
+ * @param min_delay_ms Lower bound of the delay, in milliseconds
+ */
+void rpc_client_set_hedging(_Nonnull rpc_client_t client, bool enable,
+    uint64_t min_delay_ms);
+
+/**
+ * Performs a synchronous call on a pool member picked by the client.
+ *
+ * Works like rpc_connection_call_sync() with an arguments array. The
+ * call is hedged if @p idempotent is set and hedging is turned on with
+ * rpc_client_set_hedging(), and it's also replayed after a transport
+ * drop if the connection was created with "replay"; only set it for
+ * calls that are safe to run twice.
+ *
+ * @param client Client handle
+ * @param path Object path
+ * @param interface Interface name
+ * @param name Method name
+ * @param args Arguments array; the reference is consumed
+ * @param idempotent Whether the call may be hedged or replayed
+ * @return Call result or error object, NULL if the call couldn't be made
+ */
+_Nullable rpc_object_t rpc_client_call_sync(_Nonnull rpc_client_t client,
+    const char *_Nullable path, const char *_Nullable interface,
+    const char *_Nonnull name, _Nullable rpc_object_t args, bool idempotent);
+
 /**
  * Gets the connection object from a client.
  *
+ * For pooled clients, this is the primary connection.
+ *
  * @param client Client object to get the connection from
  * @return Connection handle
  */
 _Nonnull rpc_connection_t rpc_client_get_connection(
     _Nonnull rpc_client_t client);
 
+/**
+ * Picks a connection from the client's pool, round robin unless set
+ * otherwise with rpc_client_set_balancing().
+ *
+ * Streaming calls stay on the connection they were started on. For
+ * clients that aren't pooled, this is the same as
+ * rpc_client_get_connection().
+ *
+ * @param client Client handle
+ * @return Connection handle
+ */
+_Nonnull rpc_connection_t rpc_client_next_connection(
+    _Nonnull rpc_client_t client);
+
+/**
+ * Picks a connection from the client's pool by key.
+ *
+ * The same key maps to the same connection for as long as it stays up,
+ * which keeps calls that depend on each other in order.
+ *
+ * @param client Client handle
+ * @param key Any value, such as a stream or session id
+ * @return Connection handle
+ */
+_Nonnull rpc_connection_t rpc_client_get_connection_by_key(
+    _Nonnull rpc_client_t client, uint64_t key);
+
 /**
  * Closes the connection and frees associated resources.
  *
@@ -83,6 +231,24 @@ _Nonnull rpc_connection_t rpc_client_get_connection(
  */
 void rpc_client_close(_Nonnull rpc_client_t client);
 
+/**
+ * Connects to a server, makes a single synchronous call and disconnects.
+ *
+ * Meant for short-lived programs: no client thread, emitter thread or
+ * callback pool is started and system types are not loaded, unless the
+ * call itself ends up needing them.
+ *
+ * @param uri URI to connect to
+ * @param path Object path (may be NULL)
+ * @param interface Interface name (may be NULL)
+ * @param name Method name
+ * @param args Array of arguments (may be NULL); the reference is consumed
+ * @return Call result or NULL on error
+ */
+_Nullable rpc_object_t rpc_client_call_once(const char *_Nonnull uri,
+    const char *_Nullable path, const char *_Nullable interface,
+    const char *_Nonnull name, _Nullable rpc_object_t args);
+
 #ifdef __cplusplus
 }
 #endif
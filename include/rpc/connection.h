@@ -88,6 +88,17 @@ typedef enum rpc_call_type
 	RPC_INBOUND_CALL,		/**< Call to be delivered to responder */
 } rpc_call_type_t;
 
+/**
+ * What happens to an event posted to a connection whose outbound event
+ * queue is full.
+ */
+typedef enum rpc_event_overflow
+{
+	RPC_EVENT_OVERFLOW_DROP_OLDEST,	/**< Drop the oldest queued event */
+	RPC_EVENT_OVERFLOW_COALESCE,	/**< Replace a queued event like it */
+	RPC_EVENT_OVERFLOW_DISCONNECT	/**< Close the connection */
+} rpc_event_overflow_t;
+
 /**
  * Definition of RPC connection pointer.
  */
@@ -98,6 +109,59 @@ typedef struct rpc_connection *rpc_connection_t;
  */
 typedef struct rpc_call *rpc_call_t;
 
+/**
+ * Definition of completion queue pointer.
+ */
+typedef struct rpc_completion_queue *rpc_completion_queue_t;
+
+/**
+ * Definition of fan-out call pointer.
+ */
+typedef struct rpc_fanout *rpc_fanout_t;
+
+/**
+ * How many of the targets of a fan-out call have to succeed.
+ */
+typedef enum rpc_fanout_policy
+{
+	RPC_FANOUT_ALL,		/**< Every target */
+	RPC_FANOUT_QUORUM,	/**< More than half of the targets */
+	RPC_FANOUT_FIRST_N	/**< A given number of targets */
+} rpc_fanout_policy_t;
+
+/**
+ * What a fan-out call does once a target has failed.
+ */
+typedef enum rpc_fanout_failure
+{
+	RPC_FANOUT_CONTINUE,	/**< Wait for the others while it can succeed */
+	RPC_FANOUT_FAIL_FAST	/**< Give up on the whole call */
+} rpc_fanout_failure_t;
+
+/**
+ * Answer of one target of a fan-out call.
+ */
+struct rpc_fanout_result
+{
+	rpc_connection_t _Nonnull	conn;	/**< Target connection */
+	rpc_call_status_t	status;	/**< RPC_CALL_DONE or RPC_CALL_ERROR */
+	rpc_object_t _Nullable	result;	/**< Result or error */
+};
+
+/**
+ * An entry picked up from a completion queue.
+ *
+ * Either @p call is set, for a call whose status has changed, or
+ * @p event is, for an event received on @p conn. The entry holds
+ * references to all of them until rpc_cq_event_release() is called.
+ */
+struct rpc_cq_event
+{
+	rpc_connection_t _Nonnull	conn;	/**< Connection */
+	rpc_call_t _Nullable	call;	/**< Call with a new status */
+	rpc_object_t _Nullable	event;	/**< Event received */
+};
+
 /**
  * Definition of RPC event handler block type.
  */
@@ -160,6 +224,33 @@ typedef bool (^rpc_callback_t)(_Nonnull rpc_call_t call);
 		return (_fn(_arg, _msg, _len, _fds, _nfd));		\
 	}
 
+/**
+ * Routing information of a frame, as read by rpc_connection_peek_frame().
+ * Values that don't fit are left empty.
+ */
+struct rpc_frame_info
+{
+	char			rfi_namespace[32];
+	char			rfi_name[32];
+	char			rfi_id[40];
+};
+
+/**
+ * Definition of proxy filter block type.
+ *
+ * Returns true to forward the frame, false to drop it.
+ */
+typedef bool (^rpc_proxy_filter_t)(_Nonnull rpc_connection_t from,
+    const struct rpc_frame_info *_Nonnull info);
+
+/**
+ * Converts function pointer to an rpc_proxy_filter_t block type.
+ */
+#define RPC_PROXY_FILTER(_fn, _arg)					\
+	^(rpc_connection_t _from, const struct rpc_frame_info *_info) {	\
+		return ((bool)_fn(_arg, _from, _info));			\
+	}
+
 /**
  * Converts function pointer to a @ref rpc_callback_t block type.
  */
@@ -271,6 +362,71 @@ int rpc_connection_set_dispatch_queue(_Nonnull rpc_connection_t conn,
     _Nonnull dispatch_queue_t queue);
 #endif
 
+/**
+ * Creates a completion queue.
+ *
+ * A completion queue lets an application with its own event loop handle
+ * call responses, stream fragments and events in its own thread. It comes
+ * with a file descriptor that polls readable while there are entries to
+ * pick up with rpc_cq_poll().
+ *
+ * @return Completion queue handle or NULL on failure
+ */
+_Nullable rpc_completion_queue_t rpc_completion_queue_create(void);
+
+/**
+ * Frees a completion queue, dropping the entries that are still queued.
+ *
+ * Connections attached to the queue have to be closed first.
+ *
+ * @param cq Completion queue handle
+ */
+void rpc_completion_queue_free(_Nonnull rpc_completion_queue_t cq);
+
+/**
+ * Returns the pollable file descriptor of a completion queue.
+ *
+ * @param cq Completion queue handle
+ * @return File descriptor, readable while the queue is not empty
+ */
+int rpc_completion_queue_get_fd(_Nonnull rpc_completion_queue_t cq);
+
+/**
+ * Attaches a connection to a completion queue.
+ *
+ * Once attached, every status change of an outbound call and every event
+ * received is queued on @p cq instead of running call callbacks and event
+ * handlers on the connection thread pool. It is up to the application to
+ * call rpc_call_continue() on streaming calls. Has to be called before any
+ * call is made on the connection.
+ *
+ * @param conn Connection handle
+ * @param cq Completion queue handle
+ * @return 0 on success, -1 on failure
+ */
+int rpc_connection_set_completion_queue(_Nonnull rpc_connection_t conn,
+    _Nonnull rpc_completion_queue_t cq);
+
+/**
+ * Picks up to @p max entries from a completion queue, without blocking.
+ *
+ * Each entry returned has to be released with rpc_cq_event_release().
+ *
+ * @param cq Completion queue handle
+ * @param events Array of at least @p max entries to fill in
+ * @param max Maximum number of entries to return
+ * @return Number of entries returned
+ */
+size_t rpc_cq_poll(_Nonnull rpc_completion_queue_t cq,
+    struct rpc_cq_event *_Nonnull events, size_t max);
+
+/**
+ * Releases the references held by a completion queue entry.
+ *
+ * @param event Entry returned by rpc_cq_poll()
+ */
+void rpc_cq_event_release(struct rpc_cq_event *_Nonnull event);
+
 /**
  * Subscribes for an event.
  *
@@ -289,6 +445,31 @@ int rpc_connection_subscribe_event(_Nonnull rpc_connection_t conn,
     const char *_Nullable path, const char *_Nullable interface,
     const char *_Nonnull name);
 
+/**
+ * Subscribes for an event, asking the server to send only those
+ * occurrences of it whose arguments match query rules.
+ *
+ * The rules take the same form as in rpc_query_apply() and are
+ * evaluated against the event arguments by the server, which compiles
+ * them once per subscription; events that don't match are never
+ * encoded or sent. A path may also be a glob pattern, using `*` and
+ * `?`, to subscribe to the event on every matching path at once.
+ *
+ * Rules belong to the subscription as a whole. Subscribing again with
+ * NULL rules takes another reference to it, while asking for different
+ * rules fails with EEXIST.
+ *
+ * @param conn Connection to subscribe on
+ * @param path Object path or a glob pattern
+ * @param interface Interface name
+ * @param name Event name
+ * @param rules Array of query rules or NULL to receive all events
+ * @return 0 on success, -1 on failure
+ */
+int rpc_connection_subscribe_event_filtered(_Nonnull rpc_connection_t conn,
+    const char *_Nullable path, const char *_Nullable interface,
+    const char *_Nonnull name, _Nullable rpc_object_t rules);
+
 /**
  * Undoes previous event subscription.
  *
@@ -442,6 +623,8 @@ _Nullable rpc_object_t rpc_connection_call_simple(
  * Function supports a callback argument of rpc_callback_t type,
  * which is a pointer to a function to be called on RPC completion.
  * Can be set to NULL when that functionality is not needed by the caller.
+ * The callback runs for every status change, including errors and the
+ * end of a stream, and may call rpc_call_free() once the call is over.
  *
  * @param conn Connection to do a call on
  * @param name Name of a method to be called
@@ -454,6 +637,192 @@ _Nullable rpc_call_t rpc_connection_call(_Nonnull rpc_connection_t conn,
     const char *_Nonnull name, _Nullable rpc_object_t args,
     _Nullable rpc_callback_t callback);
 
+/**
+ * Performs a RPC method call which streams its input.
+ *
+ * Works like rpc_connection_call(), except that after @p args the caller
+ * sends a stream of items with rpc_call_yield(), ended with
+ * rpc_call_end_upload(). The method reads them on the other end with
+ * rpc_function_next_input().
+ *
+ * @param conn Connection to do a call on
+ * @param path Object path
+ * @param interface Interface name
+ * @param name Name of a method to be called
+ * @param args RPC method arguments
+ * @param callback Callback function pointer to be called on RPC completion
+ * @return RPC call object
+ */
+_Nullable rpc_call_t rpc_connection_call_upload(
+    _Nonnull rpc_connection_t conn, const char *_Nullable path,
+    const char *_Nullable interface, const char *_Nonnull name,
+    _Nullable rpc_object_t args, _Nullable rpc_callback_t callback);
+
+/**
+ * Performs a streaming RPC method call, filtered on the server side.
+ *
+ * Works like rpc_connection_call(), except that fragments the method
+ * yields are checked against a query before being sent, so only the
+ * matching ones are transferred. The query is a dictionary with the
+ * following, all optional, keys:
+ * - rules (array) - query rules, as described for rpc_query().
+ * - offset, limit (uint64), single, count (bool) - as in rpc_query_params.
+ * - sort (string) - path of a field to sort the results by.
+ * - reverse (bool) - reverse the order of the results.
+ * - select (array of strings) - paths of fields to send; matching
+ *   dictionaries are cut down to just those.
+ *
+ * Sorted and reversed results are held back by the server until the
+ * method ends the stream. With count set, a single number is streamed.
+ *
+ * @param conn Connection to do a call on
+ * @param path Object path
+ * @param interface Interface name
+ * @param name Name of a method to be called
+ * @param args RPC method arguments
+ * @param query Query dictionary
+ * @param callback Callback function pointer to be called on RPC completion
+ * @return RPC call object
+ */
+_Nullable rpc_call_t rpc_connection_call_query(
+    _Nonnull rpc_connection_t conn, const char *_Nullable path,
+    const char *_Nullable interface, const char *_Nonnull name,
+    _Nullable rpc_object_t args, _Nullable rpc_object_t query,
+    _Nullable rpc_callback_t callback);
+
+/**
+ * Performs a conditional RPC method call.
+ *
+ * Works like rpc_connection_call(), except that the response comes with
+ * a tag, available through rpc_call_get_etag(): the version the method
+ * declared, or a digest of the response. Passing the tag of a previous
+ * response as @p etag makes the server leave out the response if its
+ * tag is still the same; rpc_call_not_modified() then returns true and
+ * the result is null. Use for polling results that seldom change.
+ *
+ * @param conn Connection to do a call on
+ * @param path Object path
+ * @param interface Interface name
+ * @param name Name of a method to be called
+ * @param args RPC method arguments
+ * @param etag Tag of the response the caller has or NULL
+ * @param callback Callback function pointer to be called on RPC completion
+ * @return RPC call object
+ */
+_Nullable rpc_call_t rpc_connection_call_conditional(
+    _Nonnull rpc_connection_t conn, const char *_Nullable path,
+    const char *_Nullable interface, const char *_Nonnull name,
+    _Nullable rpc_object_t args, const char *_Nullable etag,
+    _Nullable rpc_callback_t callback);
+
+/**
+ * Performs several RPC method calls using a single frame.
+ *
+ * Each element of @p calls is a dictionary with "path", "interface",
+ * "method" and "args" keys, just like rpc_connection_call() arguments.
+ * If the peer doesn't support batched calls, they're sent one by one.
+ * Every call gets its own rpc_call_t object and completes on its own.
+ *
+ * @param conn Connection to do the calls on
+ * @param calls Array of call descriptions
+ * @param results Array of at least as many call objects as @p calls
+ * @return 0 on success, -1 on error (no call is started then)
+ */
+int rpc_connection_call_batch(_Nonnull rpc_connection_t conn,
+    _Nonnull rpc_object_t calls, _Nonnull rpc_call_t *_Nonnull results);
+
+/**
+ * Creates a call of one method on many connections at once.
+ *
+ * The call is set up with the functions below and started with
+ * rpc_fanout_start(). The request frame is encoded once for all targets
+ * which negotiated the same encoding options, and answers are picked up
+ * with rpc_fanout_next() in the order they come in, so that a single
+ * thread can drive any number of targets. The method has to return a
+ * single result; streaming responses aren't supported.
+ *
+ * @param path Object path
+ * @param interface Interface name
+ * @param name Name of a method to be called
+ * @param args RPC method arguments
+ * @return Fan-out call handle
+ */
+_Nonnull rpc_fanout_t rpc_fanout_create(const char *_Nullable path,
+    const char *_Nullable interface, const char *_Nonnull name,
+    _Nullable rpc_object_t args);
+
+/**
+ * Sets the deadline of a fan-out call, relative to when it's started.
+ *
+ * Targets that haven't answered by then fail with ETIMEDOUT, and the
+ * servers get to drop the call as well. Defaults to the usual call
+ * timeout of 60 seconds.
+ *
+ * @param fanout Fan-out call handle
+ * @param timeout Deadline in milliseconds
+ */
+void rpc_fanout_set_timeout(_Nonnull rpc_fanout_t fanout, uint64_t timeout);
+
+/**
+ * Sets when a fan-out call is complete.
+ *
+ * The call completes as soon as @p policy is satisfied, or once it no
+ * longer can be; targets still outstanding then are aborted. With
+ * RPC_FANOUT_FAIL_FAST, the first failure completes the call. The
+ * default is RPC_FANOUT_ALL with RPC_FANOUT_CONTINUE.
+ *
+ * @param fanout Fan-out call handle
+ * @param policy How many targets have to succeed
+ * @param count Number of targets for RPC_FANOUT_FIRST_N
+ * @param failure What to do once a target has failed
+ */
+void rpc_fanout_set_policy(_Nonnull rpc_fanout_t fanout,
+    rpc_fanout_policy_t policy, size_t count, rpc_fanout_failure_t failure);
+
+/**
+ * Sends a fan-out call to its targets.
+ *
+ * A fan-out call can only be started once. Connections have to be
+ * distinct and stay valid until rpc_fanout_free(); a target the call
+ * can't be sent to is reported as failed right away.
+ *
+ * @param fanout Fan-out call handle
+ * @param conns Array of target connections
+ * @param nconns Number of entries in @p conns
+ * @return 0 on success, -1 on error
+ */
+int rpc_fanout_start(_Nonnull rpc_fanout_t fanout,
+    _Nonnull rpc_connection_t *_Nonnull conns, size_t nconns);
+
+/**
+ * Waits for the next answer of a fan-out call.
+ *
+ * Returns false once the call is complete and every answer it counted
+ * has been returned. The result in @p result has to be released by the
+ * caller with rpc_release().
+ *
+ * @param fanout Fan-out call handle
+ * @param result Filled in with the next answer
+ * @return true if an answer was returned, false if there are no more
+ */
+bool rpc_fanout_next(_Nonnull rpc_fanout_t fanout,
+    struct rpc_fanout_result *_Nonnull result);
+
+/**
+ * Tells whether a completed fan-out call satisfied its policy.
+ *
+ * @param fanout Fan-out call handle
+ * @return true if enough targets succeeded
+ */
+bool rpc_fanout_succeeded(_Nonnull rpc_fanout_t fanout);
+
+/**
+ * Aborts what's still outstanding of a fan-out call and frees it.
+ *
+ * @param fanout Fan-out call handle
+ */
+void rpc_fanout_free(_Nonnull rpc_fanout_t fanout);
+
 /**
  *
  * @param conn
@@ -564,6 +933,37 @@ int rpc_connection_send_raw_message(_Nonnull rpc_connection_t conn,
 void rpc_connection_set_raw_message_handler(_Nonnull rpc_connection_t conn,
     _Nullable rpc_raw_handler_t handler);
 
+/**
+ * Reads the namespace, name and id of a raw frame received on a
+ * connection without decoding the rest of it.
+ *
+ * @param conn Connection the frame was received on
+ * @param msg Raw frame
+ * @param len Frame length
+ * @param info Where to put the routing information
+ * @return 0 on success, -1 if the frame can't be parsed
+ */
+int rpc_connection_peek_frame(_Nonnull rpc_connection_t conn,
+    const void *_Nonnull msg, size_t len,
+    struct rpc_frame_info *_Nonnull info);
+
+/**
+ * Splices two connections together, so that every frame received on one
+ * is sent out on the other as it is, file descriptors included, without
+ * being decoded. Closing either of them closes the other one too.
+ *
+ * Both connections should use the same transport serialization. The
+ * raw message and error handlers of both are taken over.
+ *
+ * @param a First connection
+ * @param b Second connection
+ * @param filter Block deciding which frames get forwarded, or NULL to
+ *        forward all of them without looking at them
+ * @return 0 on success, -1 on failure
+ */
+int rpc_proxy_splice(_Nonnull rpc_connection_t a, _Nonnull rpc_connection_t b,
+    _Nullable rpc_proxy_filter_t filter);
+
 /**
  * Sets global event handler for a connection.
  *
@@ -590,6 +990,276 @@ void rpc_connection_set_error_handler(_Nonnull rpc_connection_t conn,
 const char *_Nullable rpc_connection_get_remote_address(
     _Nonnull rpc_connection_t conn);
 
+/**
+ * Returns connection statistics.
+ *
+ * The result is a dictionary. The "send_buffer" entry describes the
+ * retained output buffer: current "size", "high_water_mark" (largest
+ * batch of frames encoded so far), number of "frames" encoded, "grows"
+ * and "releases" of the underlying allocation. "writes" is the number
+ * of times the transport was handed a frame or a batch of frames.
+ *
+ * Traffic counters are "frames_in", "frames_out", "bytes_in",
+ * "bytes_out", "serialize_ns", "deserialize_ns", "events_dropped" and
+ * "events_coalesced"; "errors_sent" and
+ * "errors_received" map errno codes to the number of error frames.
+ * "calls_in_flight", "inbound_calls_in_flight", "stream_credits",
+ * "event_queue" and "send_queue_frames"/"send_queue_bytes" are gauges
+ * sampled at the time of the call. "memory" breaks down what the
+ * connection currently holds (see rpc_connection_set_memory_limits()).
+ *
+ * @param conn Connection handle
+ * @return Statistics dictionary
+ */
+_Nonnull rpc_object_t rpc_connection_get_stats(_Nonnull rpc_connection_t conn);
+
+/**
+ * Sets memory limits for a connection.
+ *
+ * Counted are frames being decoded, inbound calls in progress, stream
+ * fragments queued up and not yet consumed, and the send queue. Above
+ * the soft limit, a connection with a reader thread of its own stops
+ * reading from the peer until usage drops; one serviced by an event
+ * loop answers new calls with EBUSY instead. Going above the hard limit
+ * aborts the connection with ENOMEM.
+ *
+ * Zero means no limit, which is the default.
+ *
+ * @param conn Connection handle
+ * @param soft Soft limit in bytes
+ * @param hard Hard limit in bytes
+ */
+void rpc_connection_set_memory_limits(_Nonnull rpc_connection_t conn,
+    size_t soft, size_t hard);
+
+/**
+ * Sets the flush latency bound for outgoing frames.
+ *
+ * Frames sent while a previous batch is still being written are always
+ * coalesced into the next one. With a non-zero latency, a frame sent on
+ * an idle connection is also held back for up to the given time, so that
+ * frames following it shortly (streamed fragments, event bursts) go out
+ * together. The default is 0 (no delay).
+ *
+ * @param conn Connection handle
+ * @param usec Maximum delay in microseconds
+ */
+void rpc_connection_set_flush_latency(_Nonnull rpc_connection_t conn,
+    uint64_t usec);
+
+/**
+ * Declares whether a method is safe to replay after a transport drop.
+ *
+ * On a connection created with the "replay" parameter, outbound calls
+ * to methods declared idempotent are sent again when the session is
+ * resumed; calls to any other method fail with ECONNABORTED. Applies to
+ * calls made after this. Individual calls can be marked with
+ * rpc_call_set_idempotent() instead.
+ *
+ * @param conn Connection handle
+ * @param interface Interface name, or NULL for the default interface
+ * @param method Method name
+ * @param idempotent Whether calls to the method may run twice
+ */
+void rpc_connection_set_idempotent(_Nonnull rpc_connection_t conn,
+    const char *_Nullable interface, const char *_Nonnull method,
+    bool idempotent);
+
+/**
+ * Sets the event batching policy of a connection.
+ *
+ * With batching on, events sent over the connection are held back and
+ * go out together in a single events.event_burst frame, once
+ * @p max_events of them are pending, their approximate encoded size
+ * reaches @p max_bytes, or the first one of them has waited for
+ * @p max_delay microseconds, whichever comes first. A delay of 0 sends
+ * the events gathered in one iteration of the connection's main loop.
+ * The receiving end delivers a burst as a single callback work item.
+ *
+ * Setting @p max_events to 0 or 1 turns batching off, which is the
+ * default, and sends out whatever is pending.
+ *
+ * @param conn Connection handle
+ * @param max_events Maximum number of events in a burst
+ * @param max_bytes Maximum size of a burst in bytes, or 0 for no limit
+ * @param max_delay Maximum time an event is held back, in microseconds
+ */
+void rpc_connection_set_event_batching(_Nonnull rpc_connection_t conn,
+    size_t max_events, size_t max_bytes, uint64_t max_delay);
+
+/**
+ * Bounds the outbound event queue of a connection.
+ *
+ * Events emitted by a context, or broadcast by a server, are queued on
+ * each subscribed connection and written out from there, so a slow
+ * subscriber never holds up the others. Once @p max_events are queued,
+ * @p policy decides what gives: the oldest queued event is dropped, a
+ * queued event with the same path, interface and name is replaced by
+ * the new one (dropping the oldest one when there's none), or the
+ * connection is closed. Dropped and coalesced events are counted in the
+ * "events_dropped" and "events_coalesced" statistics.
+ *
+ * Zero means no limit, which is the default.
+ *
+ * @param conn Connection handle
+ * @param max_events Maximum number of queued events
+ * @param policy What to do when the queue is full
+ */
+void rpc_connection_set_event_queue(_Nonnull rpc_connection_t conn,
+    size_t max_events, rpc_event_overflow_t policy);
+
+/**
+ * Enables or disables the property cache of a connection.
+ *
+ * With the cache on, rpc_connection_get_property() answers from values
+ * read earlier, which are kept up to date from the property change
+ * events of their path; the connection subscribes to those on the first
+ * read of a property under a path. Values are fetched again when they
+ * are older than @p ttl, after the connection resumed, and after
+ * rpc_connection_set_property() changed them. Failed reads aren't
+ * cached.
+ *
+ * Disabling the cache drops all the values and subscriptions it had.
+ *
+ * @param conn Connection handle
+ * @param enable Whether to cache property values
+ * @param ttl Maximum age of a cached value in microseconds, or 0 for
+ *        no limit
+ */
+void rpc_connection_set_property_cache(_Nonnull rpc_connection_t conn,
+    bool enable, uint64_t ttl);
+
+/**
+ * Enables or disables arena allocation for inbound frames.
+ *
+ * When enabled, all the objects decoded from a frame are allocated from
+ * a single region, which is freed at once when the last of them is
+ * released. This saves a lot of small allocations on large frames, at
+ * the cost of keeping the whole region alive for as long as any object
+ * from the frame is retained. Applies to serializing transports only.
+ *
+ * @param conn Connection handle
+ * @param enable Whether to decode frames into an arena
+ */
+void rpc_connection_set_arena_decoding(_Nonnull rpc_connection_t conn,
+    bool enable);
+
+/**
+ * Enables or disables lazy decoding of inbound frames.
+ *
+ * When enabled, nested arrays and dictionaries of a frame are left in
+ * their wire form and decoded one level at a time, on first access.
+ * Handlers that only look at a few fields of a large message then skip
+ * decoding the rest of it. The receive buffer stays referenced until
+ * every object decoded from it is released. Applies to transports with
+ * pooled receive buffers only; frames carrying file descriptors are
+ * always decoded eagerly, and so are frames decoded into an arena.
+ *
+ * @param conn Connection handle
+ * @param enable Whether to decode frames lazily
+ */
+void rpc_connection_set_lazy_decoding(_Nonnull rpc_connection_t conn,
+    bool enable);
+
+/**
+ * Enables or disables positional encoding of IDL struct instances.
+ *
+ * When enabled, and the peer has enabled it as well, struct instances
+ * with exactly the members of their type are sent as a plain list of
+ * values in member name order, tagged with the type name and a
+ * fingerprint of its members, instead of as a keyed map. Both ends have
+ * to load the same IDL; a fingerprint mismatch makes the receiving end
+ * decode the value as an error. Needs to be enabled before the first
+ * call is made, as the feature is negotiated along with the first
+ * frames exchanged.
+ *
+ * @param conn Connection handle
+ * @param enable Whether to send struct instances positionally
+ */
+void rpc_connection_set_positional_structs(_Nonnull rpc_connection_t conn,
+    bool enable);
+
+/**
+ * Enables or disables columnar encoding of arrays of dictionaries.
+ *
+ * When enabled, and the peer has enabled it as well, arrays of at
+ * least four dictionaries that all have the same keys (and, for IDL
+ * struct instances, the same type) are sent as the list of keys
+ * followed by one column of values per key, with numeric and boolean
+ * columns packed, instead of repeating the keys in every element. The
+ * receiving end decodes them back into regular dictionaries or struct
+ * instances. Needs to be enabled before the first call is made, as
+ * the feature is negotiated along with the first frames exchanged.
+ *
+ * @param conn Connection handle
+ * @param enable Whether to send uniform arrays of dictionaries by column
+ */
+void rpc_connection_set_columnar_arrays(_Nonnull rpc_connection_t conn,
+    bool enable);
+
+/**
+ * Sets how large array results are sent and received.
+ *
+ * An array a method responds with over the connection, if it takes
+ * more than @p threshold bytes when encoded (roughly), goes out as a
+ * stream of consecutive slices, under the caller's flow control, rather
+ * than in one frame. Other calls on the connection then aren't held up
+ * behind it, and neither end has to hold the whole encoded frame. The
+ * caller puts the slices back together, so rpc_call_result() returns the
+ * whole array as usual. Peers that don't support this always get results
+ * in one piece. The default threshold is 8 MiB; zero turns slicing off.
+ *
+ * With @p incremental set, results that arrive in slices at this end are
+ * not put back together: the call becomes a regular streaming call
+ * instead, each fragment being an array of consecutive items.
+ *
+ * @param conn Connection handle
+ * @param threshold Size above which array results are sent in slices
+ * @param incremental Whether to hand out received slices as they come
+ */
+void rpc_connection_set_chunking(_Nonnull rpc_connection_t conn,
+    size_t threshold, bool incremental);
+
+/**
+ * Sets up an out-of-band channel for bulk data sent over the connection.
+ *
+ * Binaries of at least @p threshold bytes, in calls, results, fragments
+ * and events alike, are then copied into a shared memory pool of
+ * @p size bytes instead of being written into the frame, which only
+ * refers to them. The peer maps the pool once and hands the binaries
+ * out without copying them; chunks come back to the pool as the peer
+ * releases them. So frames behind a large transfer aren't held up by
+ * it, and the pool size bounds how much bulk data is in flight: when the
+ * peer holds on to all of it, binaries go inline until chunks come back.
+ *
+ * Only works with local peers over a transport that passes descriptors,
+ * when the peer supports it; elsewhere binaries keep going inline. A
+ * @p size of zero turns the channel off. Linux only.
+ *
+ * @param conn Connection handle
+ * @param size Size of the pool, in bytes
+ * @param threshold Size from which binaries go through the pool
+ * @return 0 on success, -1 on error
+ */
+int rpc_connection_set_bulk_pool(_Nonnull rpc_connection_t conn, size_t size,
+    size_t threshold);
+
+/**
+ * Enables the per-connection type name table.
+ *
+ * Type names attached to typed values are then sent in full only the
+ * first time, together with a small integer id, and as the bare id
+ * afterwards, when the peer has enabled the table as well. Received
+ * ids resolve straight to type instances, without parsing the type
+ * name again. Lazy decoding is not used on connections with a type
+ * table, since frames have to be decoded in the order they were sent.
+ * Needs to be enabled before the first call is made, and stays enabled
+ * until the connection is closed.
+ *
+ * @param conn Connection handle
+ */
+void rpc_connection_enable_type_table(_Nonnull rpc_connection_t conn);
+
 /**
  * Checks whether a given connection does support file descriptor passing.
  *
@@ -657,6 +1327,24 @@ int rpc_call_wait(_Nonnull rpc_call_t call);
  */
 int rpc_call_continue(_Nonnull rpc_call_t call, bool sync);
 
+/**
+ * Takes a batch of fragments of a streaming call in one go.
+ *
+ * Blocks until the call has something queued, then moves past up to
+ * @p max fragments which have already been received, granting the
+ * producer credits once for the whole batch. Returns 0 when the call is
+ * no longer streaming; rpc_call_status() and rpc_call_result() then tell
+ * how it ended.
+ *
+ * @param call Streaming call handle
+ * @param items Array of at least @p max entries; each fragment returned
+ *        has to be released by the caller
+ * @param max Maximum number of fragments to take
+ * @return Number of fragments taken, -1 on failure
+ */
+ssize_t rpc_call_take(_Nonnull rpc_call_t call,
+    _Nonnull rpc_object_t *_Nonnull items, size_t max);
+
 /**
  * Aborts a pending call.
  *
@@ -665,6 +1353,52 @@ int rpc_call_continue(_Nonnull rpc_call_t call, bool sync);
  */
 int rpc_call_abort(_Nonnull rpc_call_t call);
 
+/**
+ * Sends the next item of an upload stream.
+ *
+ * Blocks while the receiving end has no credits left for the call. The
+ * call timeout is restarted each time more credits are granted.
+ *
+ * @param call Call started with rpc_connection_call_upload()
+ * @param fragment Item to send; the reference is consumed
+ * @return 0 on success, -1 if the upload is over or the call completed
+ */
+int rpc_call_yield(_Nonnull rpc_call_t call, _Nonnull rpc_object_t fragment);
+
+/**
+ * Ends an upload stream.
+ *
+ * @param call Call started with rpc_connection_call_upload()
+ * @return 0 on success, -1 on error
+ */
+int rpc_call_end_upload(_Nonnull rpc_call_t call);
+
+/**
+ * Changes the timeout of a call that is still waiting for a response.
+ *
+ * The new deadline is counted from now, in milliseconds, and replaces
+ * the connection default of 60 seconds.
+ *
+ * @param call Outbound call handle
+ * @param msecs Timeout in milliseconds
+ * @return 0 on success, -1 if the call already got a response or timed out
+ */
+int rpc_call_set_timeout(_Nonnull rpc_call_t call, uint64_t msecs);
+
+/**
+ * Marks an outbound call as safe, or not, to replay after a transport
+ * drop.
+ *
+ * Overrides what rpc_connection_set_idempotent() says about the method.
+ * Has no effect unless the connection was created with the "replay"
+ * parameter.
+ *
+ * @param call Outbound call handle
+ * @param idempotent Whether the call may run twice
+ * @return 0 on success, -1 if the call isn't an outbound one
+ */
+int rpc_call_set_idempotent(_Nonnull rpc_call_t call, bool idempotent);
+
 /**
  * Sets how many items librpc should prefetch in a streaming call.
  *
@@ -674,6 +1408,26 @@ int rpc_call_abort(_Nonnull rpc_call_t call);
  */
 int rpc_call_set_prefetch(_Nonnull rpc_call_t call, size_t nitems);
 
+/**
+ * Makes a streaming call size its prefetch window adaptively.
+ *
+ * The window is derived from the measured round trip time and the rate
+ * at which the caller consumes items, so that the stream keeps the link
+ * busy while the caller keeps up, and credits are granted ahead of time
+ * instead of once the window runs out. The window never exceeds
+ * @p max_items items, nor about @p max_bytes bytes of encoded frames,
+ * based on the average size of the items received so far. Until there
+ * are measurements, the prefetch set with rpc_call_set_prefetch() is
+ * used, and calling that function turns adaptive mode off again.
+ *
+ * @param call Streaming call handle
+ * @param max_items Upper bound for the window, in items; 0 for the default
+ * @param max_bytes Upper bound for the window, in bytes; 0 for no limit
+ * @return 0 on success
+ */
+int rpc_call_set_prefetch_adaptive(_Nonnull rpc_call_t call, size_t max_items,
+    size_t max_bytes);
+
 /**
  * Waits for a call to change status.
  *
@@ -687,6 +1441,23 @@ int rpc_call_set_prefetch(_Nonnull rpc_call_t call, size_t nitems);
 int rpc_call_timedwait(_Nonnull rpc_call_t call,
     const struct timespec *_Nonnull ts);
 
+/**
+ * Returns the tag of the response to a conditional call.
+ *
+ * @param call Completed call
+ * @return Response tag or NULL if there wasn't one
+ */
+const char *_Nullable rpc_call_get_etag(_Nonnull rpc_call_t call);
+
+/**
+ * Checks whether the response to a conditional call was left out,
+ * being the same as the one the call was made with.
+ *
+ * @param call Completed call
+ * @return true if the response hasn't changed
+ */
+bool rpc_call_not_modified(_Nonnull rpc_call_t call);
+
 /**
  * Checks whether a call has been completed successfully.
  *
@@ -719,6 +1490,261 @@ _Nullable rpc_object_t rpc_call_result(_Nonnull rpc_call_t call);
  */
 void rpc_call_free(_Nonnull rpc_call_t call);
 
+/**
+ * Trace file magic, "RPCT" when read as little endian.
+ */
+#define	RPC_TRACE_MAGIC		0x54435052
+
+/**
+ * Version of the trace file layout.
+ */
+#define	RPC_TRACE_VERSION	1
+
+/**
+ * Trace record flags.
+ */
+#define	RPC_TRACE_SEND		0x0001	/**< Frame was sent */
+#define	RPC_TRACE_RECV		0x0002	/**< Frame was received */
+#define	RPC_TRACE_ID_HASHED	0x0004	/**< Call id is a hash of a UUID */
+#define	RPC_TRACE_PAYLOAD_HASH	0x0008	/**< Payload hash is valid */
+
+/**
+ * Opcode of trace records of frames that couldn't be classified.
+ */
+#define	RPC_TRACE_OP_UNKNOWN	0xffff
+
+/**
+ * Header of a trace dump, followed by struct rpc_trace_record entries.
+ *
+ * Both clocks are sampled at the time of the dump, so that record
+ * timestamps can be converted to wall clock time.
+ */
+struct rpc_trace_header
+{
+	uint32_t		rth_magic;
+	uint16_t		rth_version;
+	uint16_t		rth_record_size;
+	uint64_t		rth_realtime;	/**< CLOCK_REALTIME, ns */
+	uint64_t		rth_monotonic;	/**< CLOCK_MONOTONIC, ns */
+};
+
+/**
+ * A single traced frame.
+ */
+struct rpc_trace_record
+{
+	uint64_t		rtr_seq;	/**< Per-thread sequence number */
+	uint64_t		rtr_time;	/**< CLOCK_MONOTONIC, ns */
+	uint64_t		rtr_conn;	/**< Connection handle */
+	uint64_t		rtr_call_id;	/**< Call id, if any */
+	uint32_t		rtr_size;	/**< Encoded size, 0 if unknown */
+	uint32_t		rtr_hash;	/**< FNV-1a hash of the encoding */
+	uint32_t		rtr_thread;	/**< Thread (ring) number */
+	uint16_t		rtr_op;		/**< Frame opcode */
+	uint16_t		rtr_flags;	/**< RPC_TRACE_* flags */
+};
+
+/**
+ * Turns on frame tracing.
+ *
+ * Every frame sent or received afterwards is recorded into a ring
+ * buffer of the thread handling it, holding the last @p records frames
+ * (rounded up to a power of two). Nothing is formatted or written out
+ * until rpc_trace_dump() is called, so tracing is cheap enough to leave
+ * on in production. Setting the @p LIBRPC_TRACE environment variable
+ * to a path turns tracing on at startup and dumps to that path on
+ * SIGUSR2.
+ *
+ * @param records Ring size of threads that start tracing from now on,
+ *        0 to keep the current one
+ * @param flags RPC_TRACE_PAYLOAD_HASH to also hash encoded frames
+ * @return 0 on success, -1 on failure
+ */
+int rpc_trace_enable(size_t records, int flags);
+
+/**
+ * Turns off frame tracing. Records collected so far are kept.
+ */
+void rpc_trace_disable(void);
+
+/**
+ * Tells whether frame tracing is on.
+ *
+ * @return true if enabled
+ */
+bool rpc_trace_enabled(void);
+
+/**
+ * Writes a trace header and all records collected so far to @p fd.
+ *
+ * The function is async-signal-safe. Use `rpctool trace` to decode
+ * its output.
+ *
+ * @param fd File descriptor to write to
+ * @return 0 on success, -1 on failure
+ */
+int rpc_trace_dump(int fd);
+
+/**
+ * Installs a handler for @p signo that dumps the trace to @p path.
+ *
+ * @param signo Signal number
+ * @param path Path of the dump file, truncated on every dump
+ * @return 0 on success, -1 on failure
+ */
+int rpc_trace_dump_on_signal(int signo, const char *_Nonnull path);
+
+/**
+ * Resolves a trace record opcode to the frame namespace and name.
+ *
+ * @param op Opcode
+ * @param namespace Where to put the namespace
+ * @param name Where to put the name
+ * @return 0 on success, -1 if the opcode is unknown
+ */
+int rpc_trace_op_name(uint16_t op, const char *_Nullable *_Nonnull namespace,
+    const char *_Nullable *_Nonnull name);
+
+/**
+ * Turns on lock contention profiling.
+ *
+ * Needs librpc built with ENABLE_LOCKPROF, which makes every mutex,
+ * rwlock and condition variable wait in the library record how long
+ * it waited for the lock and how long the lock was held afterwards,
+ * per call site. Setting the @p LIBRPC_LOCKPROF environment variable
+ * to 1 turns profiling on at startup.
+ *
+ * @return 0 on success, -1 if support isn't compiled in
+ */
+int rpc_lockprof_enable(void);
+
+/**
+ * Turns off lock contention profiling. Collected data is kept.
+ */
+void rpc_lockprof_disable(void);
+
+/**
+ * Clears lock contention data collected so far.
+ */
+void rpc_lockprof_reset(void);
+
+/**
+ * Returns lock contention data.
+ *
+ * The result is a dictionary with "enabled", "dropped_sites" (sites
+ * that didn't fit in the table) and "sites", an array of call sites
+ * sorted by total wait time. Each entry has the "site" location, lock
+ * "kind" (mutex, read or write), "acquisitions", "contended" count,
+ * wait and hold time totals, maxima and 50th/99th percentiles in
+ * nanoseconds, and "wait_hist"/"hold_hist" power-of-two histograms,
+ * where bucket n counts times below 2^n ns.
+ *
+ * @return Lock statistics dictionary
+ */
+_Nonnull rpc_object_t rpc_lockprof_get_stats(void);
+
+/**
+ * Kinds of spans, as in OpenTelemetry.
+ */
+typedef enum rpc_span_kind {
+	RPC_SPAN_INTERNAL,	/**< A phase of a call */
+	RPC_SPAN_SERVER,	/**< Handling of an inbound call */
+	RPC_SPAN_CLIENT		/**< An outbound call, until its answer */
+} rpc_span_kind_t;
+
+/**
+ * A finished span.
+ *
+ * Server spans have "queue", "exec", "serialize" and "stream" child
+ * spans, for the time spent waiting for a worker, running the method
+ * (asynchronous responses included), serializing what was sent (summed
+ * up and placed at the end of the call) and streaming the response.
+ */
+struct rpc_span
+{
+	uint8_t			rs_trace_id[16];
+	uint8_t			rs_span_id[8];
+	uint8_t			rs_parent_id[8];	/**< Zero for roots */
+	const char *_Nonnull	rs_name;	/**< "server", "call", ... */
+	rpc_span_kind_t		rs_kind;
+	const char *_Nullable	rs_path;
+	const char *_Nullable	rs_interface;
+	const char *_Nonnull	rs_method;
+	uint64_t		rs_start;	/**< CLOCK_REALTIME, ns */
+	uint64_t		rs_end;		/**< CLOCK_REALTIME, ns */
+	bool			rs_failed;
+};
+
+/**
+ * Receives batches of finished spans, on a thread of its own. The spans
+ * are only valid during the call.
+ */
+typedef void (^rpc_span_sink_t)(const struct rpc_span *_Nonnull spans,
+    size_t count);
+
+/**
+ * Turns on distributed tracing.
+ *
+ * Calls carry W3C trace context in their rpc.call frames from now on,
+ * and finished spans of sampled traces are handed to @p sink in
+ * batches of up to 512, at least once a second. Traces started here
+ * are sampled at @p sample_rate; those started elsewhere keep the
+ * decision of where they started. A rate of 0.01 or lower keeps the
+ * overhead below a percent for typical calls.
+ *
+ * @param sample_rate Fraction of traces to record, 0 to 1
+ * @param sink Span sink
+ * @return 0 on success, -1 on failure
+ */
+int rpc_tracing_enable(double sample_rate, _Nonnull rpc_span_sink_t sink);
+
+/**
+ * Turns on distributed tracing with spans exported to an OpenTelemetry
+ * collector over OTLP/HTTP with JSON encoding.
+ *
+ * @param sample_rate Fraction of traces to record, 0 to 1
+ * @param endpoint Collector URL, such as http://localhost:4318/v1/traces
+ * @return 0 on success, -1 on failure
+ */
+int rpc_tracing_enable_otlp(double sample_rate,
+    const char *_Nonnull endpoint);
+
+/**
+ * Turns off distributed tracing, after exporting the spans queued up.
+ */
+void rpc_tracing_disable(void);
+
+/**
+ * Tells whether distributed tracing is on.
+ *
+ * @return true if enabled
+ */
+bool rpc_tracing_enabled(void);
+
+/**
+ * Asks for the spans queued up to be exported right away.
+ */
+void rpc_tracing_flush(void);
+
+/**
+ * Sets the trace context of calls made by the calling thread.
+ *
+ * Methods don't need this for calls they make from the thread they run
+ * on; pass the result of rpc_function_get_traceparent() to carry the
+ * context elsewhere.
+ *
+ * @param traceparent W3C traceparent header
+ * @param tracestate W3C tracestate header, or NULL
+ * @return 0 on success, -1 if @p traceparent is malformed
+ */
+int rpc_tracing_set_context(const char *_Nonnull traceparent,
+    const char *_Nullable tracestate);
+
+/**
+ * Clears the trace context set with rpc_tracing_set_context().
+ */
+void rpc_tracing_clear_context(void);
+
 #ifdef __cplusplus
 }
 #endif
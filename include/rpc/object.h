@@ -67,11 +67,59 @@ typedef enum {
 #endif
 } rpc_type_t;
 
+#if defined(__linux__)
+/**
+ * Enumerates shared memory placement flags.
+ */
+typedef enum {
+	RPC_SHMEM_HUGETLB = (1 << 0),	/**< back with explicit huge pages */
+	RPC_SHMEM_THP = (1 << 1),	/**< hint for transparent huge pages */
+	RPC_SHMEM_POPULATE = (1 << 2),	/**< pre-fault pages up front */
+} rpc_shmem_flags_t;
+
+/**
+ * NUMA node argument standing for no binding.
+ */
+#define	RPC_SHMEM_ANY_NODE	(-1)
+#endif
+
 /**
  * Definition of data object pointer.
  */
 typedef struct rpc_object *rpc_object_t;
 
+/**
+ * Definition of interned dictionary key handle.
+ */
+typedef const struct rpc_key *rpc_key_t;
+
+/**
+ * Definition of compiled rpc_object_pack() format handle.
+ */
+typedef struct rpc_pack_fmt *rpc_pack_fmt_t;
+
+/**
+ * Definition of shared memory pool handle.
+ */
+typedef struct rpc_shmem_pool *rpc_shmem_pool_t;
+
+/**
+ * Dictionary cursor, see rpc_dictionary_iter_init(). Its contents are
+ * private; it only reserves room so that it can live on the stack.
+ */
+struct rpc_dictionary_iter
+{
+	void *			rdi_opaque[8];
+};
+
+/**
+ * Array cursor, see rpc_array_iter_init(). Its contents are private.
+ */
+struct rpc_array_iter
+{
+	void *			rai_opaque[2];
+};
+
 /**
  * Definition of array applier block type.
  *
@@ -104,6 +152,30 @@ typedef _Nonnull rpc_object_t (^rpc_array_mapper_t)(size_t index,
 typedef bool (^rpc_dictionary_applier_t)(const char *_Nonnull key,
     _Nonnull rpc_object_t value);
 
+/**
+ * Function pointer counterpart of rpc_array_applier_t, for
+ * rpc_array_apply_f().
+ *
+ * @param arg User argument
+ * @param index Currently processed index.
+ * @param value Object stored at currently processed index.
+ * @return Continue iteration signal.
+ */
+typedef bool (*rpc_array_applier_f)(void *_Nullable arg, size_t index,
+    _Nonnull rpc_object_t value);
+
+/**
+ * Function pointer counterpart of rpc_dictionary_applier_t, for
+ * rpc_dictionary_apply_f().
+ *
+ * @param arg User argument
+ * @param key Currently processed key.
+ * @param value Object stored at currently processed key.
+ * @return Continue iteration signal.
+ */
+typedef bool (*rpc_dictionary_applier_f)(void *_Nullable arg,
+    const char *_Nonnull key, _Nonnull rpc_object_t value);
+
 /**
  *
  */
@@ -235,11 +307,42 @@ size_t rpc_get_column_number(_Nonnull rpc_object_t object);
 /**
  * Creates and returns independent copy of an object.
  *
+ * Copies of arrays and dictionaries share storage with the original until
+ * either side is modified or hands out a nested container.
+ *
  * @param object Object to be copied.
  * @return Copy of an provided as the function argument.
  */
 _Nonnull rpc_object_t rpc_copy(_Nonnull rpc_object_t object);
 
+/**
+ * Makes an object and everything it contains deeply immutable.
+ *
+ * Frozen objects can be shared between threads without locking. Trying
+ * to modify a frozen object aborts the program; use rpc_copy() to get
+ * a modifiable copy.
+ *
+ * Nested objects referenced only by their parent get pinned to it:
+ * references to them are counted on the parent, keep it alive and they
+ * are freed together with it. That counter is still updated atomically,
+ * so retaining and releasing frozen objects costs the same as it does
+ * for any other object.
+ *
+ * The tree must not be modified by other threads while being frozen.
+ *
+ * @param object Object to freeze.
+ * @return Same object
+ */
+_Nonnull rpc_object_t rpc_object_freeze(_Nonnull rpc_object_t object);
+
+/**
+ * Checks whether an object has been frozen.
+ *
+ * @param object Object to check.
+ * @return true if frozen, otherwise false.
+ */
+bool rpc_object_is_frozen(_Nonnull rpc_object_t object);
+
 /**
  * Compares objects provided as the function arguments
  * and returns the comparison result.
@@ -446,6 +549,53 @@ _Nullable rpc_object_t rpc_object_pack(const char *_Nonnull fmt, ...);
  */
 _Nullable rpc_object_t rpc_object_vpack(const char *_Nonnull fmt, va_list ap);
 
+/**
+ * Compiles a rpc_object_pack() format string.
+ *
+ * The format is only parsed once. The result may be passed
+ * to rpc_object_pack_compiled() any number of times, also from multiple
+ * threads at once.
+ *
+ * @param fmt Format string.
+ * @return Compiled format or NULL (with errno set to EINVAL) if the format
+ *     string is malformed.
+ */
+_Nullable rpc_pack_fmt_t rpc_pack_compile(const char *_Nonnull fmt);
+
+/**
+ * Frees a compiled format.
+ *
+ * @param fmt Compiled format.
+ */
+void rpc_pack_free(_Nullable rpc_pack_fmt_t fmt);
+
+/**
+ * Packs provided values accordingly to a compiled format.
+ *
+ * The function acts exactly the same as the rpc_object_pack function,
+ * but doesn't have to parse the format string.
+ *
+ * @param fmt Compiled format.
+ * @param ... Variable length list of values to be packed.
+ * @return Packed object.
+ */
+_Nullable rpc_object_t rpc_object_pack_compiled(_Nonnull rpc_pack_fmt_t fmt,
+    ...);
+
+/**
+ * Packs provided values accordingly to a compiled format.
+ *
+ * The function acts exactly the same as the rpc_object_pack_compiled
+ * function, but takes assembled variable arguments list structure as its
+ * argument.
+ *
+ * @param fmt Compiled format.
+ * @param ap Variable arguments list structure.
+ * @return Packed object.
+ */
+_Nullable rpc_object_t rpc_object_vpack_compiled(_Nonnull rpc_pack_fmt_t fmt,
+    va_list ap);
+
 /**
  * Unpacks provided values accordingly to a specified format string from an
  * object.
@@ -623,6 +773,19 @@ double rpc_double_get_value(_Nonnull rpc_object_t xdouble);
  */
 _Nonnull rpc_object_t rpc_date_create(int64_t interval);
 
+/**
+ * Creates an RPC object holding a date with microsecond precision.
+ *
+ * The time zone offset is only used when the date is formatted; dates
+ * are compared by the point in time they refer to, and peers receive
+ * them in UTC.
+ *
+ * @param usec Microseconds since the UNIX epoch.
+ * @param tz_offset Offset of the time zone, in seconds east of UTC.
+ * @return Newly created object.
+ */
+_Nonnull rpc_object_t rpc_date_create_usec(int64_t usec, int32_t tz_offset);
+
 /**
  * Creates an RPC object holding a date from current UTC time.
  *
@@ -641,6 +804,25 @@ _Nonnull rpc_object_t rpc_date_create_from_current(void);
  */
 int64_t rpc_date_get_value(_Nonnull rpc_object_t xdate);
 
+/**
+ * Returns the value of a date object in microseconds since the UNIX epoch.
+ *
+ * If rpc_object_t passed as the first argument if not of RPC_TYPE_DATE
+ * type, the function returns 0.
+ *
+ * @param xdate Object to read the value from.
+ * @return Microsecond UNIX timestamp value of the object.
+ */
+int64_t rpc_date_get_usec(_Nonnull rpc_object_t xdate);
+
+/**
+ * Returns the time zone offset of a date object, in seconds east of UTC.
+ *
+ * @param xdate Object to read the value from.
+ * @return Time zone offset, 0 for UTC or non-date objects.
+ */
+int32_t rpc_date_get_tz_offset(_Nonnull rpc_object_t xdate);
+
 /**
  * Creates an RPC object holding a binary data.
  *
@@ -663,6 +845,23 @@ _Nonnull rpc_object_t rpc_data_create(const void *_Nullable bytes,
 _Nonnull rpc_object_t rpc_data_create_iov(struct iovec *_Nonnull iov,
     size_t niov);
 
+/**
+ * Creates an RPC object holding @p length bytes of a file, starting at
+ * @p offset.
+ *
+ * The range is mapped, not copied, so sending the object over a socket
+ * connection doesn't copy the contents in userspace. Peers get it as an
+ * ordinary binary. The descriptor may be closed once this returns.
+ * Truncating the file while the object is alive is undefined.
+ *
+ * @param fd File descriptor to read from
+ * @param offset Start offset within the file
+ * @param length Number of bytes
+ * @return Newly created object or NULL in case of error
+ */
+_Nullable rpc_object_t rpc_data_create_fd_range(int fd, off_t offset,
+    size_t length);
+
 /**
  * Returns the length of internal binary data buffer of a provided object.
  *
@@ -778,6 +977,47 @@ int rpc_fd_get_value(_Nonnull rpc_object_t xfd);
  */
 _Nonnull rpc_object_t rpc_array_create(void);
 
+/**
+ * Creates a new, empty array with room for @p capacity objects.
+ *
+ * The array can still grow past @p capacity; the hint only saves
+ * reallocating the storage while it's filled up.
+ *
+ * @param capacity Expected number of elements.
+ * @return Empty array.
+ */
+_Nonnull rpc_object_t rpc_array_create_with_capacity(size_t capacity);
+
+/**
+ * Creates a new packed array out of a buffer of numeric values.
+ *
+ * Packed arrays store their elements in a single contiguous buffer
+ * instead of an object per element and are sent over the wire as a
+ * single blob. They behave like any other array; the typed getters,
+ * such as rpc_array_get_double(), and rpc_array_get_packed() read the
+ * buffer directly, while the functions that hand out or modify element
+ * objects turn the array into a regular one first.
+ *
+ * @param type Element type: RPC_TYPE_INT64, RPC_TYPE_UINT64,
+ * 	RPC_TYPE_DOUBLE or RPC_TYPE_BOOL.
+ * @param data Array of int64_t, uint64_t, double or bool values.
+ * @param count Number of elements in @p data.
+ * @return Newly created object or NULL if @p type is not supported.
+ */
+_Nullable rpc_object_t rpc_array_create_packed(rpc_type_t type,
+    const void *_Nonnull data, size_t count);
+
+/**
+ * Returns the element buffer of a packed array.
+ *
+ * @param array Input array.
+ * @param type Where to put the element type (optional).
+ * @param count Where to put the number of elements (optional).
+ * @return Element buffer or NULL if @p array is not a packed array.
+ */
+const void *_Nullable rpc_array_get_packed(_Nonnull rpc_object_t array,
+    rpc_type_t *_Nullable type, size_t *_Nullable count);
+
 /**
  * Creates a new array of objects, optionally populating it with data.
  *
@@ -900,6 +1140,42 @@ size_t rpc_array_get_count(_Nonnull rpc_object_t array);
 bool rpc_array_apply(_Nonnull rpc_object_t array,
     _Nonnull rpc_array_applier_t applier);
 
+/**
+ * Same as rpc_array_apply(), but calls a plain function, passing it
+ * @p arg along with each element.
+ *
+ * @param array Input array.
+ * @param arg User argument passed to the applier.
+ * @param applier Function to be called for each array element.
+ * @return Iteration terminated (true)/finished (false) boolean flag.
+ */
+bool rpc_array_apply_f(_Nonnull rpc_object_t array, void *_Nullable arg,
+    _Nonnull rpc_array_applier_f applier);
+
+/**
+ * Sets up a cursor over the elements of an array.
+ *
+ * This is the same walk rpc_array_apply() does, for callers which
+ * would rather write a loop. Values returned are borrowed from the
+ * array, which must not be modified while the cursor is in use.
+ *
+ * @param array Input array
+ * @param iter Cursor to initialize
+ */
+void rpc_array_iter_init(_Nonnull rpc_object_t array,
+    struct rpc_array_iter *_Nonnull iter);
+
+/**
+ * Moves an array cursor to the next element.
+ *
+ * @param iter Cursor set up with rpc_array_iter_init()
+ * @param index Where to store the index of the element, or NULL
+ * @param value Where to store the element
+ * @return true if an element was returned, false at the end
+ */
+bool rpc_array_iter_next(struct rpc_array_iter *_Nonnull iter,
+    size_t *_Nullable index, _Nullable rpc_object_t *_Nonnull value);
+
 /**
  * Iterates over a given array and replaces each element of said array with
  * a result of mapper block.
@@ -1229,6 +1505,105 @@ void rpc_shmem_unmap(_Nonnull rpc_object_t shmem, void *_Nonnull addr);
  * @return Size of a shared memory.
  */
 size_t rpc_shmem_get_size(_Nonnull rpc_object_t shmem);
+
+/**
+ * Allocates a chunk of a shared memory with placement options.
+ *
+ * RPC_SHMEM_HUGETLB backs the memory with huge pages from the reserved
+ * pool (see /proc/sys/vm/nr_hugepages), rounding the size up to a
+ * multiple of 2 MiB. RPC_SHMEM_THP asks for transparent huge pages
+ * instead, which takes shmem_enabled set to "advise" or higher.
+ * RPC_SHMEM_POPULATE allocates all pages right away, and pre-faults
+ * them on every rpc_shmem_map() of the object in this process. A node
+ * other than RPC_SHMEM_ANY_NODE binds the pages to that NUMA node.
+ *
+ * @param size Size (in bytes) of a shared memory to be allocated.
+ * @param flags Bitmask of rpc_shmem_flags_t values.
+ * @param node NUMA node to bind pages to, or RPC_SHMEM_ANY_NODE.
+ * @return Newly created object representing a shared memory.
+ */
+_Nullable rpc_object_t rpc_shmem_create_ex(size_t size, int flags, int node);
+
+/**
+ * Creates a shared memory pool of at least a given size.
+ *
+ * Objects allocated from a pool share a single memory file descriptor,
+ * which is passed to each peer only once. After that, sending one
+ * costs an offset and a size in the frame, and the peer maps nothing.
+ * The memory of an object is reclaimed when it has been released
+ * locally and by every peer it was sent to.
+ *
+ * @param size Size (in bytes) of the pool, rounded up to a power of two.
+ * @return Newly created pool or NULL in case of error.
+ */
+_Nullable rpc_shmem_pool_t rpc_shmem_pool_create(size_t size);
+
+/**
+ * Creates a shared memory pool with placement options.
+ *
+ * Flags and node have the same meaning as for rpc_shmem_create_ex(),
+ * applied to the whole pool once, when it's created. Huge page backed
+ * pools hand out chunks of at least 2 MiB.
+ *
+ * @param size Size (in bytes) of the pool, rounded up to a power of two.
+ * @param flags Bitmask of rpc_shmem_flags_t values.
+ * @param node NUMA node to bind pages to, or RPC_SHMEM_ANY_NODE.
+ * @return Newly created pool or NULL in case of error.
+ */
+_Nullable rpc_shmem_pool_t rpc_shmem_pool_create_ex(size_t size, int flags,
+    int node);
+
+/**
+ * Allocates a chunk of shared memory from a pool.
+ *
+ * Chunks are page aligned and rounded up to a power of two.
+ * rpc_shmem_map() on the result returns an address within the pool
+ * mapping; rpc_shmem_unmap() is a no-op for it.
+ *
+ * @param pool Pool to allocate from.
+ * @param size Size (in bytes) of a chunk to be allocated.
+ * @return Newly created shared memory object or NULL if the pool is full.
+ */
+_Nullable rpc_object_t rpc_shmem_pool_alloc(_Nonnull rpc_shmem_pool_t pool,
+    size_t size);
+
+/**
+ * Releases a shared memory pool.
+ *
+ * The pool goes away once all objects allocated from it are released.
+ *
+ * @param pool Pool to release.
+ */
+void rpc_shmem_pool_release(_Nullable rpc_shmem_pool_t pool);
+
+/**
+ * Lays out an immutable copy of an object graph in shared memory.
+ *
+ * The graph uses offsets rather than pointers, so a peer that receives
+ * the returned shared memory object can read it with
+ * rpc_shmem_graph_open() without decoding it. Passing the graph costs
+ * the same as passing any other shared memory object, whatever its
+ * size. File descriptors, errors and shared memory objects can't be
+ * part of the graph.
+ *
+ * @param pool Pool to allocate from, or NULL for a standalone chunk.
+ * @param obj Root of the graph.
+ * @return Shared memory object holding the graph or NULL on error.
+ */
+_Nullable rpc_object_t rpc_shmem_graph_create(_Nullable rpc_shmem_pool_t pool,
+    _Nonnull rpc_object_t obj);
+
+/**
+ * Opens an object graph laid out by rpc_shmem_graph_create().
+ *
+ * The graph is read in place: containers are filled in on first access
+ * and binary values point into the shared memory. Returned objects are
+ * frozen and keep the shared memory mapped while they are alive.
+ *
+ * @param shmem Shared memory object holding the graph.
+ * @return Root of the graph or NULL on error.
+ */
+_Nullable rpc_object_t rpc_shmem_graph_open(_Nonnull rpc_object_t shmem);
 #endif
 
 /**
@@ -1240,6 +1615,10 @@ size_t rpc_shmem_get_size(_Nonnull rpc_object_t shmem);
  *
  * Extra is an optional argument and can be safely set to NULL when not needed.
  *
+ * Only the return addresses are recorded at this point; they are turned
+ * into a readable stack trace the first time @ref rpc_error_get_stack
+ * is called. See @ref rpc_error_set_stack_capture.
+ *
  * @param code Numerical error code.
  * @param msg String representing an actual error description.
  * @param extra Extra data (optional).
@@ -1267,6 +1646,18 @@ _Nonnull rpc_object_t rpc_error_create_with_stack(int code,
     const char *_Nonnull msg, _Nullable rpc_object_t extra,
     _Nullable rpc_object_t stack);
 
+/**
+ * Turns stack trace capture in @ref rpc_error_create on or off for the
+ * whole process.
+ *
+ * Capture is on by default, unless the LIBRPC_ERROR_STACKS environment
+ * variable is set to 0. Contexts can turn it off for the methods they
+ * run with @ref rpc_context_set_error_stacks.
+ *
+ * @param enable Whether errors record where they were created.
+ */
+void rpc_error_set_stack_capture(bool enable);
+
 /**
  * Returns numerical error code of a provided error object.
  *
@@ -1317,6 +1708,14 @@ _Nullable rpc_object_t rpc_error_get_stack(_Nonnull rpc_object_t error);
  */
 _Nonnull rpc_object_t rpc_dictionary_create(void);
 
+/**
+ * Creates a new, empty dictionary sized for @p capacity entries.
+ *
+ * @param capacity Expected number of entries.
+ * @return Empty dictionary.
+ */
+_Nonnull rpc_object_t rpc_dictionary_create_with_capacity(size_t capacity);
+
 /**
  * Creates a new dictionary of objects, optionally populating it with data.
  *
@@ -1426,6 +1825,43 @@ size_t rpc_dictionary_get_count(_Nonnull rpc_object_t dictionary);
 bool rpc_dictionary_apply(_Nonnull rpc_object_t dictionary,
     _Nonnull rpc_dictionary_applier_t applier);
 
+/**
+ * Same as rpc_dictionary_apply(), but calls a plain function, passing
+ * it @p arg along with each entry.
+ *
+ * @param dictionary Input dictionary.
+ * @param arg User argument passed to the applier.
+ * @param applier Function to be called for each entry.
+ * @return Iteration terminated (true)/finished (false) boolean flag.
+ */
+bool rpc_dictionary_apply_f(_Nonnull rpc_object_t dictionary,
+    void *_Nullable arg, _Nonnull rpc_dictionary_applier_f applier);
+
+/**
+ * Sets up a cursor over the entries of a dictionary.
+ *
+ * This is the same walk rpc_dictionary_apply() does, for callers which
+ * can't use a block. Keys and values returned are borrowed from the
+ * dictionary, which must not be modified while the cursor is in use.
+ *
+ * @param dictionary Input dictionary
+ * @param iter Cursor to initialize
+ */
+void rpc_dictionary_iter_init(_Nonnull rpc_object_t dictionary,
+    struct rpc_dictionary_iter *_Nonnull iter);
+
+/**
+ * Moves a dictionary cursor to the next entry.
+ *
+ * @param iter Cursor set up with rpc_dictionary_iter_init()
+ * @param key Where to store the key of the entry
+ * @param value Where to store the value of the entry
+ * @return true if an entry was returned, false at the end
+ */
+bool rpc_dictionary_iter_next(struct rpc_dictionary_iter *_Nonnull iter,
+    const char *_Nullable *_Nonnull key,
+    _Nullable rpc_object_t *_Nonnull value);
+
 /**
  *
  * @param dictionary
@@ -1444,6 +1880,68 @@ void rpc_dictionary_map(_Nonnull rpc_object_t dictionary,
 bool rpc_dictionary_has_key(_Nonnull rpc_object_t dictionary,
     const char *_Nonnull key);
 
+/**
+ * Returns an interned dictionary key.
+ *
+ * Interned keys are shared between all the dictionaries using them and
+ * live until the program exits, so this is meant for a fixed set of
+ * keys used over and over again (eg. structure member names), not for
+ * arbitrary data. Keys inserted with the plain string API are shared
+ * too, as long as they have been interned before.
+ *
+ * @param key Key string.
+ * @return Interned key handle.
+ */
+_Nonnull rpc_key_t rpc_key_intern(const char *_Nonnull key);
+
+/**
+ * Returns the string of an interned key.
+ *
+ * @param key Interned key handle.
+ * @return Key string.
+ */
+const char *_Nonnull rpc_key_get_string(_Nonnull rpc_key_t key);
+
+/**
+ * Same as rpc_dictionary_set_value(), but takes an interned key.
+ *
+ * @param dictionary Input dictionary.
+ * @param key Interned key to store a value.
+ * @param value Value to be inserted.
+ */
+void rpc_dictionary_set_value_k(_Nonnull rpc_object_t dictionary,
+    _Nonnull rpc_key_t key, _Nullable rpc_object_t value);
+
+/**
+ * Same as rpc_dictionary_steal_value(), but takes an interned key.
+ *
+ * @param dictionary Input dictionary.
+ * @param key Interned key to store a value.
+ * @param value Value to be inserted.
+ */
+void rpc_dictionary_steal_value_k(_Nonnull rpc_object_t dictionary,
+    _Nonnull rpc_key_t key, _Nonnull rpc_object_t value);
+
+/**
+ * Same as rpc_dictionary_get_value(), but takes an interned key.
+ *
+ * @param dictionary Input dictionary.
+ * @param key Interned key of an object to be returned.
+ * @return Object at a given key.
+ */
+_Nullable rpc_object_t rpc_dictionary_get_value_k(
+    _Nonnull rpc_object_t dictionary, _Nonnull rpc_key_t key);
+
+/**
+ * Same as rpc_dictionary_has_key(), but takes an interned key.
+ *
+ * @param dictionary Input dictionary.
+ * @param key Interned key to be tested.
+ * @return Boolean check result.
+ */
+bool rpc_dictionary_has_key_k(_Nonnull rpc_object_t dictionary,
+    _Nonnull rpc_key_t key);
+
 /**
  * Sets a selected key of an input dictionary to a newly created RPC object
  * holding a given boolean value.
@@ -52,6 +52,63 @@ struct rpc_query_iter;
  */
 typedef struct rpc_query_iter *rpc_query_iter_t;
 
+/**
+ * Definition of the compiled query plan structure. Its contents are
+ * implementation detail.
+ */
+struct rpc_query_plan;
+
+/**
+ * Definition of rpc_query_plan pointer type.
+ */
+typedef struct rpc_query_plan *rpc_query_plan_t;
+
+/**
+ * Definition of the query index structure. Its contents are implementation
+ * detail.
+ */
+struct rpc_query_index;
+
+/**
+ * Definition of rpc_query_index pointer type.
+ */
+typedef struct rpc_query_index *rpc_query_index_t;
+
+/**
+ * Definition of the query view structure. Its contents are implementation
+ * detail.
+ */
+struct rpc_query_view;
+
+/**
+ * Definition of rpc_query_view pointer type.
+ */
+typedef struct rpc_query_view *rpc_query_view_t;
+
+struct rpc_instance;
+
+/**
+ * Definition of the compiled path structure. Its contents are
+ * implementation detail.
+ */
+struct rpc_query_path;
+
+/**
+ * Definition of compiled path pointer type.
+ */
+typedef struct rpc_query_path *rpc_path_t;
+
+/**
+ * Kinds of query indexes.
+ *
+ * A hash index serves "=" and "in" rules, an ordered index serves "=", "<",
+ * "<=", ">" and ">=" rules.
+ */
+typedef enum {
+	RPC_QUERY_INDEX_HASH,
+	RPC_QUERY_INDEX_ORDERED,
+} rpc_query_index_kind_t;
+
 /**
  * Definition of query callback block type.
  *
@@ -85,18 +142,29 @@ typedef _Nullable rpc_object_t (^rpc_query_cb_t)(_Nonnull rpc_object_t object);
  *   yielding the first result.
  * - limit (unsigned int) - yield no more than a specified number of matching
  *   elements.
- * - sort (rpc_array_cmp_t) - sort the input array before yielding the
- *   results - the sorting function is taking a rpc_array_cmp_t block as
+ * - sort (rpc_array_cmp_t) - sort the matching elements before yielding
+ *   the results - the sorting function is taking a rpc_array_cmp_t block as
  *   an argument to figure out relations between input an array's elements
- *   (a > b, a = b, a < b).
- * - reverse (boolean) - reverse the order of elements of an input array
- *   (always done after eventual sorting) - be aware that this operation
- *   has to create an intermediate object to store elements in the reversed
- *   order, so it might be expensive for large data sets.
+ *   (a > b, a = b, a < b). Sorting is stable and the input array itself
+ *   is not modified. With a limit set, only the first offset + limit
+ *   elements in sort order are picked out and sorted.
+ * - reverse (boolean) - reverse the order of the matching elements (always
+ *   done after eventual sorting).
  * - callback (rpc_query_cb_t) - for each of the matching elements run
  *   a callback function first - query will return an RPC object returned
  *   by a callback function, but will skip it if a callback function
  *   returns NULL instead of an RPC object.
+ * - parallel (unsigned int) - check rules on up to that many threads at
+ *   once when there are at least RPC_QUERY_PARALLEL_MIN elements to look
+ *   at. Results come out in the same order either way; the callback is
+ *   still run on the thread iterating over the results. Ignored for
+ *   single queries. Elements of the input array must not be shared with
+ *   objects being modified concurrently.
+ * - select (NULL terminated array of strings) - paths of fields to return;
+ *   matching dictionaries are returned as new dictionaries holding just
+ *   those fields, before the callback is run. Selected values are shared,
+ *   not copied, and nothing else of the element is retained. Missing
+ *   fields are left out.
  */
 struct rpc_query_params {
 	bool 				single;
@@ -106,8 +174,16 @@ struct rpc_query_params {
 	bool				reverse;
 	_Nullable rpc_array_cmp_t	sort;
 	_Nullable rpc_query_cb_t	callback;
+	unsigned int			parallel;
+	const char *_Nullable const *_Nullable select;
 };
 
+/**
+ * Minimum number of elements a query has to look at for the parallel
+ * query parameter to take effect.
+ */
+#define	RPC_QUERY_PARALLEL_MIN		65536
+
 /**
  * Definition of rpc_query_params pointer type.
  */
@@ -185,6 +261,102 @@ void rpc_query_delete(_Nonnull rpc_object_t object, const char *_Nonnull path);
  */
 bool rpc_query_contains(_Nonnull rpc_object_t object, const char *_Nonnull path);
 
+/**
+ * Compiles a "key1.key2.0.key3.1" like path for repeated use.
+ *
+ * The path is split into segments, array indexes are parsed and keys
+ * are interned (see rpc_key_intern) once, instead of on every lookup.
+ * Since interned keys are never freed, this is meant for a fixed set
+ * of paths, not for paths coming from arbitrary data.
+ *
+ * Empty segments are skipped, as with the string based functions.
+ *
+ * @param path Path - '.' character is required between each key/idx pair.
+ * @return Compiled path or NULL if path is NULL.
+ */
+_Nullable rpc_path_t rpc_path_compile(const char *_Nonnull path);
+
+/**
+ * Frees a compiled path.
+ *
+ * @param path Compiled path.
+ */
+void rpc_path_free(_Nonnull rpc_path_t path);
+
+/**
+ * Same as rpc_query_get, but takes a compiled path.
+ *
+ * @param object Object to perform the lookup on.
+ * @param path Compiled path.
+ * @param default_val Default value to be returned if desired object couldn't
+ * be found - nullable.
+ * @return Found RPC object or the default value.
+ */
+_Nullable rpc_object_t rpc_query_get_path(_Nonnull rpc_object_t object,
+    _Nonnull rpc_path_t path, _Nullable rpc_object_t default_val);
+
+/**
+ * Same as rpc_query_set, but takes a compiled path.
+ *
+ * @param object Object to perform the lookup on.
+ * @param path Compiled path.
+ * @param value Value to be set.
+ * @param steal Boolean flag - if set, then the function does not increase
+ * refcount of a set value.
+ */
+void rpc_query_set_path(_Nonnull rpc_object_t object, _Nonnull rpc_path_t path,
+    _Nullable rpc_object_t value, bool steal);
+
+/**
+ * Same as rpc_query_delete, but takes a compiled path.
+ *
+ * @param object Object to perform the lookup on.
+ * @param path Compiled path.
+ */
+void rpc_query_delete_path(_Nonnull rpc_object_t object,
+    _Nonnull rpc_path_t path);
+
+/**
+ * Same as rpc_query_contains, but takes a compiled path.
+ *
+ * @param object Object to perform the lookup on.
+ * @param path Compiled path.
+ * @return Boolean result of the check.
+ */
+bool rpc_query_contains_path(_Nonnull rpc_object_t object,
+    _Nonnull rpc_path_t path);
+
+/**
+ * Describes how to turn one object into another.
+ *
+ * The result is an array of operations, each a dictionary with "op"
+ * set to one of:
+ * - "set": sets "value" at "path",
+ * - "delete": removes the dictionary key at "path",
+ * - "splice": replaces "remove" elements of the array at "path",
+ *   starting at "index", with the elements of "insert".
+ *
+ * Paths are the "key1.key2.0" ones rpc_query_get() takes, with "" for
+ * the object itself. Dictionaries whose keys contain '.' are set whole.
+ *
+ * @param from Original object.
+ * @param to Changed object.
+ * @return Array of operations, empty if the objects are equal.
+ */
+_Nonnull rpc_object_t rpc_query_diff(_Nonnull rpc_object_t from,
+    _Nonnull rpc_object_t to);
+
+/**
+ * Applies operations produced by rpc_query_diff() to a copy of an
+ * object.
+ *
+ * @param object Object to apply the operations to; left unchanged.
+ * @param delta Array of operations.
+ * @return Changed copy or NULL if an operation doesn't apply.
+ */
+_Nullable rpc_object_t rpc_query_patch(_Nonnull rpc_object_t object,
+    _Nonnull rpc_object_t delta);
+
 /**
  * Performs a query operation on a given object.
  * Source object has to be an RPC object of array type, but it can contain
@@ -235,6 +407,11 @@ bool rpc_query_contains(_Nonnull rpc_object_t object, const char *_Nonnull path)
  * Example of a complex rule:
  * ["or", [["a.b.0.c", "=", 1], ["and", [["a.d", ">", 2], ["a.d", "<", 4]]]]]
  *
+ * An empty path ("") refers to the element itself. Queries over packed
+ * arrays whose rules are all comparisons of the element itself
+ * (i.e. [["", ">", 3], ["", "<=", 10]]) are checked against the packed
+ * buffer directly, boxing only the matching elements.
+ *
  * @param object Object to be queried.
  * @param params Query parameters.
  * @param rules Query rules.
@@ -274,6 +451,147 @@ _Nullable rpc_query_iter_t rpc_query_fmt(_Nonnull rpc_object_t object,
 _Nullable rpc_object_t rpc_query_apply(_Nonnull rpc_object_t object,
     _Nonnull rpc_object_t rules);
 
+/**
+ * Compiles query rules (the same format as in the rpc_query function case)
+ * into a plan.
+ *
+ * Paths are split, operators are resolved and regular expressions are
+ * compiled once, so that a plan can be evaluated against any number of
+ * objects without looking at the rules again. Plans are immutable and can
+ * be shared between threads.
+ *
+ * @param rules Query rules.
+ * @return Query plan or NULL if rules are not an array.
+ */
+_Nullable rpc_query_plan_t rpc_query_compile(_Nonnull rpc_object_t rules);
+
+/**
+ * Releases a query plan.
+ *
+ * The plan must not be freed before iterators created from it.
+ *
+ * @param plan Plan to be freed.
+ */
+void rpc_query_plan_free(_Nonnull rpc_query_plan_t plan);
+
+/**
+ * Performs a query operation on a given object, using a previously compiled
+ * plan instead of rules.
+ *
+ * Otherwise works exactly the same as the rpc_query function. The plan is
+ * not copied and has to outlive the returned iterator.
+ *
+ * @param object Object to be queried.
+ * @param params Query parameters.
+ * @param plan Compiled query plan.
+ * @return Query iterator.
+ */
+_Nullable rpc_query_iter_t rpc_query_plan(_Nonnull rpc_object_t object,
+    _Nullable rpc_query_params_t params, _Nonnull rpc_query_plan_t plan);
+
+/**
+ * Checks if a given RPC object does match a compiled query plan.
+ *
+ * @param object Object to be checked against the plan.
+ * @param plan Compiled query plan.
+ * @return The object itself if is matches the plan, otherwise NULL.
+ */
+_Nullable rpc_object_t rpc_query_plan_apply(_Nonnull rpc_object_t object,
+    _Nonnull rpc_query_plan_t plan);
+
+/**
+ * Creates an index over a field path of array elements.
+ *
+ * Queries over the array pick up the index on their own: top-level rules
+ * on the indexed path narrow down the elements that are looked at, instead
+ * of scanning the whole array. All the rules are still checked on every
+ * element that the index yields.
+ *
+ * The index is rebuilt on next use after the array is changed through
+ * the array API. Changes made to the elements themselves in place are not
+ * tracked - create the index again after making those.
+ *
+ * @param array Array to be indexed.
+ * @param path Field path, as in rpc_query_get.
+ * @param kind Index kind.
+ * @return Index or NULL if the object is not an array.
+ */
+_Nullable rpc_query_index_t rpc_query_index_create(_Nonnull rpc_object_t array,
+    const char *_Nonnull path, rpc_query_index_kind_t kind);
+
+/**
+ * Removes an index from its array and frees it.
+ *
+ * @param index Index to be freed.
+ */
+void rpc_query_index_free(_Nonnull rpc_query_index_t index);
+
+/**
+ * Creates a view of the elements of an array matching a compiled plan.
+ *
+ * The view holds the matching elements in array order and is kept up to
+ * date as the array is changed through the array API: appending, setting
+ * or removing an element only evaluates the plan against that element.
+ * Sorting or mapping the array and removing all of its elements make
+ * the view look at the whole array again.
+ *
+ * As with indexes, changes made to the elements themselves in place are
+ * not tracked - call rpc_query_view_refresh after making those.
+ *
+ * The plan has to outlive the view.
+ *
+ * @param array Array to be watched.
+ * @param plan Compiled query plan.
+ * @return View or NULL if the object is not an array.
+ */
+_Nullable rpc_query_view_t rpc_query_view_create(_Nonnull rpc_object_t array,
+    _Nonnull rpc_query_plan_t plan);
+
+/**
+ * Makes a view emit its changes as events of an instance.
+ *
+ * Every change is emitted as a separate event, with a dictionary holding
+ * the "op" and, depending on it, the "index" within the view and the
+ * "value":
+ * - add (index, value) - an element was inserted at index.
+ * - update (index, value) - the element at index was replaced.
+ * - remove (index) - the element at index was removed.
+ * - reset (value) - the view was rebuilt, value holds all of it.
+ *
+ * Events are emitted on the thread changing the array, while it is
+ * doing so.
+ *
+ * @param view View handle.
+ * @param instance Instance to emit events on, NULL to stop emitting them.
+ * @param interface Event interface name.
+ * @param name Event name.
+ */
+void rpc_query_view_set_event(_Nonnull rpc_query_view_t view,
+    struct rpc_instance *_Nullable instance,
+    const char *_Nullable interface, const char *_Nullable name);
+
+/**
+ * Returns the elements of a view, as a new array.
+ *
+ * @param view View handle.
+ * @return Array of matching elements.
+ */
+_Nonnull rpc_object_t rpc_query_view_get(_Nonnull rpc_query_view_t view);
+
+/**
+ * Evaluates the plan of a view against the whole array again.
+ *
+ * @param view View handle.
+ */
+void rpc_query_view_refresh(_Nonnull rpc_query_view_t view);
+
+/**
+ * Stops tracking the array of a view and frees it.
+ *
+ * @param view View handle.
+ */
+void rpc_query_view_free(_Nonnull rpc_query_view_t view);
+
 /**
  * Yields the next RPC object matching params and rules stored within
  * iterator structure.
@@ -38,6 +38,14 @@
 extern "C" {
 #endif
 
+/**
+ * Block type called with each object read by rpc_serializer_load_stream().
+ *
+ * The object is only valid for the duration of the call; retain it to
+ * keep it. Return false to stop reading.
+ */
+typedef bool (^rpc_serializer_item_t)(_Nonnull rpc_object_t item);
+
 /**
  * Checks whether specified serializer is available.
  *
@@ -57,6 +65,23 @@ bool rpc_serializer_exists(const char *_Nonnull serializer);
 _Nullable rpc_object_t rpc_serializer_load(const char *_Nonnull serializer,
     const void *_Nonnull frame, size_t len);
 
+/**
+ * Loads RPC objects from a file descriptor as they are being parsed.
+ *
+ * If the document is a sequence, each of its items is passed to the
+ * block as soon as it has been read, and the sequence itself is never
+ * built, so large documents are loaded with memory bounded by their
+ * largest item. A document of any other type is passed as a whole.
+ * Only the yaml serializer supports streaming.
+ *
+ * @param serializer Serializer type
+ * @param fd File descriptor to read from
+ * @param item Block called with each object
+ * @return 0 on success (including being stopped by the block), -1 on error
+ */
+int rpc_serializer_load_stream(const char *_Nonnull serializer, int fd,
+    _Nonnull rpc_serializer_item_t item);
+
 /**
  * Dumps an RPC object into a serialized blob form.
  * @param serializer Serializer type (msgpack, json or yaml)
@@ -68,6 +93,50 @@ int rpc_serializer_dump(const char *_Nonnull serializer,
     _Nonnull rpc_object_t obj, void *_Nullable *_Nonnull framep,
     size_t *_Nullable lenp);
 
+/**
+ * Dumps an RPC object in serialized form to a file descriptor.
+ *
+ * The output is written in chunks as it is being generated, so memory
+ * use doesn't grow with the size of the encoded object. On error, part
+ * of the output may already have been written.
+ *
+ * @param serializer Serializer type (msgpack, json or yaml)
+ * @param obj Object to dump
+ * @param fd File descriptor to write to
+ * @return 0 on success, -1 on error
+ */
+int rpc_serializer_dump_fd(const char *_Nonnull serializer,
+    _Nonnull rpc_object_t obj, int fd);
+
+/**
+ * Writes an RPC object to a file descriptor as a snapshot.
+ *
+ * A snapshot is a file that rpc_serializer_load_snapshot() maps and
+ * uses in place, without decoding it first. Snapshots are meant for
+ * large, read-mostly data sets shared by several processes. They can
+ * only be read on hosts of the same byte order. File descriptors,
+ * errors and shared memory objects can't be stored in a snapshot.
+ *
+ * @param obj Object to dump
+ * @param fd File descriptor to write to
+ * @return 0 on success, -1 on error
+ */
+int rpc_serializer_dump_snapshot(_Nonnull rpc_object_t obj, int fd);
+
+/**
+ * Loads an RPC object from a snapshot file.
+ *
+ * The file is mapped read-only and stays mapped as long as any object
+ * loaded from it is alive. Containers are filled in on first access and
+ * binary values point directly into the mapping. The returned objects
+ * are frozen. The file must not be modified while it is in use.
+ *
+ * @param path Snapshot file path
+ * @return RPC object or NULL in case of error.
+ */
+_Nullable rpc_object_t rpc_serializer_load_snapshot(
+    const char *_Nonnull path);
+
 #ifdef __cplusplus
 }
 #endif
@@ -58,12 +58,31 @@ typedef enum rpc_server_event
 	RPC_SERVER_CLIENT_DISCONNECT,
 } rpc_server_event_t;
 
+/**
+ * Policies for shedding load once a server is over its limits.
+ */
+typedef enum rpc_shed_policy
+{
+	RPC_SHED_NEWEST,	/**< Reject incoming calls */
+	RPC_SHED_OLDEST,	/**< Drop the longest waiting held call */
+	RPC_SHED_CODEL,		/**< Drop calls stuck waiting for a worker */
+} rpc_shed_policy_t;
+
 /**
  * Definition of RPC server event handler block type.
  */
 typedef void (^rpc_server_ev_handler_t)(_Nonnull rpc_connection_t conn,
     rpc_server_event_t event);
 
+/**
+ * Worker setup block type for @ref rpc_server_prefork.
+ *
+ * Called in every worker process with the worker's own context and
+ * index. Returning false makes the worker exit.
+ */
+typedef bool (^rpc_prefork_init_t)(_Nonnull rpc_context_t context,
+    int worker);
+
 /**
  * Converts function pointer to a @ref rpc_server_ev_handler_t block type.
  */
@@ -105,6 +124,36 @@ void rpc_server_pause(_Nonnull rpc_server_t server);
 /**
  * Creates a server instance listening on a given URI.
  *
+ * The socket transport accepts a dictionary of parameters with the
+ * following keys: "fd", "mode", "event_loop", "io_threads" and
+ * "io_backend". Setting "event_loop" to true makes accepted connections
+ * share a small pool of epoll/kqueue driven I/O threads instead of a reader
+ * thread each. Setting "io_backend" to "io_uring" selects io_uring for
+ * those threads, if librpc was built with it. Setting "compress" to true
+ * compresses frames of at least 512 bytes with zstd, on connections with
+ * peers that support it, if librpc was built with zstd. Clients request
+ * the same by passing {"compress": true} to rpc_client_create(). Setting
+ * "max_frame" to a positive number of bytes closes connections whose
+ * peer sends a larger frame, before any memory is allocated for it;
+ * clients accept the same key. Setting "listeners" to more than one on a
+ * TCP URI binds that many SO_REUSEPORT sockets, each with its own accept
+ * thread; with io_uring, every listener hands its connections to the I/O
+ * thread of the same index.
+ *
+ * Setting "cpus" to a CPU list such as "0-7,16-23" keeps the accept and
+ * reader threads of the server on those CPUs. "io_cpus" pins the event
+ * loop I/O threads, the i-th thread to the i-th CPU of the list; these
+ * threads are shared process-wide, so only the first event loop server
+ * places them. See also rpc_context_set_numa_affinity().
+ *
+ * On any serializing transport, setting "event_group" to a multicast
+ * "address:port" sends rpc_server_broadcast_event() events to clients
+ * that asked for it as UDP datagrams, numbered so that clients can have
+ * the ones they missed resent over their connection. "event_group_ttl"
+ * sets the multicast TTL (1 by default) and "event_group_max" the
+ * largest event, in bytes, to multicast (1400 by default); larger ones
+ * and ones carrying descriptors go over each connection as usual.
+ *
  * @param uri URI to listen on
  * @param context RPC context for a server instance
  * @param params Additional parameters for a transport
@@ -142,6 +191,55 @@ void rpc_server_broadcast_event(_Nonnull rpc_server_t server,
 void rpc_server_set_event_handler(_Nonnull rpc_server_t server,
     _Nullable rpc_server_ev_handler_t handler);
 
+/**
+ * Sets admission limits of a server.
+ *
+ * @p max_pending limits calls accepted by the server and not yet
+ * finished, whether held while the server is paused, waiting for a
+ * worker or running. @p max_per_connection does the same for a single
+ * client connection. Zero means no limit. Calls over a limit are
+ * answered right away with an @c EBUSY error.
+ *
+ * With @ref RPC_SHED_OLDEST, a call over the limit pushes out the
+ * oldest call held by a paused server instead, if there's one. With
+ * @ref RPC_SHED_CODEL, calls are also dropped while the time they
+ * spend waiting for a worker stays above 5 ms for longer than 100 ms.
+ *
+ * @param server Server handle
+ * @param max_pending Maximum number of pending calls
+ * @param max_per_connection Maximum number of pending calls per client
+ * @param policy Shedding policy
+ */
+void rpc_server_set_limits(_Nonnull rpc_server_t server, size_t max_pending,
+    size_t max_per_connection, rpc_shed_policy_t policy);
+
+/**
+ * Sets memory limits for connections accepted by the server.
+ *
+ * Applies to connections that are already open as well. See
+ * @ref rpc_connection_set_memory_limits for what the limits mean.
+ *
+ * @param server Server handle
+ * @param soft Per-connection soft limit in bytes, or 0 for none
+ * @param hard Per-connection hard limit in bytes, or 0 for none
+ */
+void rpc_server_set_memory_limits(_Nonnull rpc_server_t server, size_t soft,
+    size_t hard);
+
+/**
+ * Returns server statistics.
+ *
+ * The result is a dictionary with connection counts ("conn_made",
+ * "conn_refused", "conn_closed", "conn_aborted", "connections" still
+ * open), "pending_calls" and the traffic counters described in
+ * @ref rpc_connection_get_stats, summed over all connections the server
+ * ever accepted.
+ *
+ * @param server Server handle
+ * @return Statistics dictionary
+ */
+_Nonnull rpc_object_t rpc_server_get_stats(_Nonnull rpc_server_t server);
+
 /**
  * Closes a given RPC server.
  *
@@ -162,6 +260,75 @@ int rpc_server_socket_activate(_Nonnull rpc_context_t context,
     _Nonnull rpc_server_t *_Nonnull *_Nonnull servers,
     _Nullable rpc_object_t *_Nullable rest);
 
+/**
+ * Hands servers and their connections over to another process.
+ *
+ * Meant for restarting a server without dropping connections: the new
+ * process calls @ref rpc_server_takeover on @p path and the old one
+ * calls this function. The listening sockets go over first, and once
+ * the new process listens on all of them, the old one stops accepting.
+ * Each connection then stops being read on a frame boundary, calls in
+ * flight are given @p drain_timeout_ms to finish and the connection
+ * goes over with its negotiated state, session and subscriptions, to be
+ * read by the new process from the next frame on. Clients don't notice.
+ *
+ * Only socket transport servers are handed over. TLS connections,
+ * connections using shared memory and ones with calls still running at
+ * the deadline are closed instead, once idle or at the deadline. Events
+ * batched for a connection but not sent yet are lost.
+ *
+ * @param servers Servers to hand over
+ * @param nservers Number of servers
+ * @param path Unix socket path the new process listens on
+ * @param drain_timeout_ms How long to wait for calls in flight
+ * @return Number of connections handed over or -1 on error
+ */
+int rpc_server_handover(_Nonnull rpc_server_t *_Nonnull servers,
+    size_t nservers, const char *_Nonnull path, uint64_t drain_timeout_ms);
+
+/**
+ * Takes servers and their connections over from another process.
+ *
+ * Listens on @p path for @ref rpc_server_handover and waits for it to
+ * finish, or for @p timeout_ms to pass. Servers are created in
+ * @p context, paused like any new server, and returned in an array
+ * the caller frees with g_free().
+ *
+ * @param context RPC context for the servers
+ * @param path Unix socket path to listen on
+ * @param timeout_ms How long to wait for the handover
+ * @param servers Set to the servers taken over
+ * @return Number of servers taken over or -1 on error
+ */
+int rpc_server_takeover(_Nonnull rpc_context_t context,
+    const char *_Nonnull path, uint64_t timeout_ms,
+    _Nonnull rpc_server_t *_Nonnull *_Nonnull servers);
+
+/**
+ * Serves a URI from a number of pre-forked worker processes.
+ *
+ * Meant for handlers that are CPU heavy or don't get along with
+ * threads. The calling process binds the listening sockets, forks
+ * @p nworkers workers and supervises them until it gets SIGTERM or
+ * SIGINT, restarting workers that exit. Each worker has a context of
+ * its own, set up by @p init, and a server created with @p params. On
+ * TCP, every worker accepts on its own SO_REUSEPORT socket; otherwise
+ * all of them accept on the same socket.
+ *
+ * Events a worker broadcasts with @ref rpc_server_broadcast_event reach
+ * clients of all workers, except for events carrying descriptors. Only
+ * socket transport servers can be pre-forked. As workers are forked,
+ * call this before the process starts any threads of its own.
+ *
+ * @param uri URI to listen on
+ * @param params Transport parameters, as for @ref rpc_server_create_ex
+ * @param nworkers Number of worker processes
+ * @param init Worker setup block
+ * @return 0 once stopped by a signal or -1 on error; workers don't return
+ */
+int rpc_server_prefork(const char *_Nonnull uri, _Nullable rpc_object_t params,
+    unsigned int nworkers, _Nonnull rpc_prefork_init_t init);
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,6 +30,7 @@
 
 #include <rpc/object.h>
 #include <rpc/connection.h>
+#include <rpc/query.h>
 
 /**
  * @file service.h
@@ -54,9 +55,35 @@ extern "C" {
  */
 #define	RPC_FUNCTION_STILL_RUNNING	((rpc_object_t)1)
 
+/**
+ * Method flag declaring a method as non-blocking.
+ *
+ * Such a method runs directly on the thread reading from the client
+ * connection, instead of being handed off to a worker. It must return
+ * its result right away: it can't stream, read upload input or wait
+ * on anything, since nothing else is read from the connection while
+ * it runs.
+ */
+#define	RPC_METHOD_INLINE		0x1
+
+/**
+ * Method flag declaring a method as idempotent and side-effect free.
+ *
+ * Calls to such a method made while an identical one (same instance,
+ * interface, method and arguments) is already running don't run on
+ * their own; they get the result of the one in flight instead. If that
+ * one doesn't produce a plain result to share, because it streams,
+ * responds asynchronously or fails, the calls that were waiting on it
+ * run normally. Calls aren't coalesced while call hooks are set.
+ */
+#define	RPC_METHOD_COALESCE		0x2
+
 #define	RPC_DISCOVERABLE_INTERFACE	"com.twoporeguys.librpc.Discoverable"
 #define	RPC_INTROSPECTABLE_INTERFACE	"com.twoporeguys.librpc.Introspectable"
 #define	RPC_OBSERVABLE_INTERFACE	"com.twoporeguys.librpc.Observable"
+#define	RPC_STATISTICS_INTERFACE	"com.twoporeguys.librpc.Statistics"
+#define	RPC_SESSION_INTERFACE		"com.twoporeguys.librpc.Session"
+#define	RPC_HANDOVER_INTERFACE		"com.twoporeguys.librpc.Handover"
 #define	RPC_DEFAULT_INTERFACE		"com.twoporeguys.librpc.Default"
 
 /**
@@ -102,11 +129,44 @@ typedef _Nullable rpc_object_t (^rpc_property_getter_t)(void *_Nonnull cookie);
 typedef void (^rpc_property_setter_t)(void *_Nonnull cookie,
     _Nonnull rpc_object_t value);
 
+/**
+ * Bulk property read callback block type. Returning false stops the
+ * read.
+ */
+typedef bool (^rpc_property_bulk_cb_t)(const char *_Nonnull path,
+    _Nonnull rpc_object_t properties);
+
+/**
+ * Virtual instance resolver block type. Returns a new, unregistered
+ * instance for @p path, or NULL if there's no such object.
+ */
+typedef _Nullable rpc_instance_t (^rpc_instance_resolver_t)(
+    const char *_Nonnull path);
+
+/**
+ * Virtual instance enumeration callback block type. Returning false
+ * stops the enumeration.
+ */
+typedef bool (^rpc_instance_enum_cb_t)(const char *_Nonnull path,
+    const char *_Nullable description);
+
+/**
+ * Virtual instance enumerator block type. Calls @p callback for every
+ * object of the namespace.
+ */
+typedef void (^rpc_instance_enumerator_t)(
+    _Nonnull rpc_instance_enum_cb_t callback);
+
 /**
  * Asynchronous abort handler block type.
  */
 typedef void (^rpc_abort_handler_t)(void);
 
+/**
+ * Stream readiness handler block type.
+ */
+typedef void (^rpc_ready_handler_t)(void);
+
 /**
  * A macro to convert function pointer into @ref rpc_function_t block.
  */
@@ -204,6 +264,22 @@ typedef void (^rpc_abort_handler_t)(void);
                 }							\
 	}
 
+/**
+ * Same as @ref RPC_METHOD, but declares the method as non-blocking.
+ *
+ * @see RPC_METHOD_INLINE
+ */
+#define	RPC_INLINE_METHOD(_name, _fn)					\
+	{								\
+		.rim_type = RPC_MEMBER_METHOD,				\
+		.rim_name = (#_name),					\
+		.rim_method = {						\
+                        .rm_block = RPC_FUNCTION(_fn),			\
+			.rm_arg = NULL,					\
+			.rm_flags = RPC_METHOD_INLINE			\
+                }							\
+	}
+
 #define	RPC_MEMBER_END {}
 
 /**
@@ -216,6 +292,16 @@ enum rpc_if_member_type
 	RPC_MEMBER_METHOD,		/**< Method member */
 };
 
+/**
+ * Enumerates scheduling priorities of method calls.
+ */
+enum rpc_priority
+{
+	RPC_PRIORITY_HIGH,		/**< Latency-sensitive calls */
+	RPC_PRIORITY_NORMAL,		/**< Default priority */
+	RPC_PRIORITY_LOW,		/**< Bulk or expensive calls */
+};
+
 /**
  * Enumerates possible property right flags.
  */
@@ -233,6 +319,7 @@ struct rpc_if_method
 {
 	__unsafe_unretained _Nonnull rpc_function_t rm_block;
 	void *_Nullable	rm_arg;
+	int		rm_flags;
 };
 
 /**
@@ -274,6 +361,247 @@ _Nonnull rpc_context_t rpc_context_create(void);
  */
 void rpc_context_free(_Nonnull rpc_context_t context);
 
+/**
+ * Sets the number of worker threads running method calls of a context.
+ *
+ * Workers are started when the first call gets dispatched, so this has
+ * to be done before the context starts serving. By default, there's a
+ * worker per CPU, but no fewer than 8. Keep in mind that a method
+ * blocked on a streaming client occupies its worker the whole time.
+ *
+ * @param context Target RPC context
+ * @param nworkers Number of worker threads
+ * @return 0 on success, -1 on error
+ */
+int rpc_context_set_workers(_Nonnull rpc_context_t context, size_t nworkers);
+
+/**
+ * Keeps method calls on the NUMA node their frames were received on.
+ *
+ * Workers are spread over the nodes and bound to them, and a call goes
+ * to a worker on the node of the thread that received it. Pin reader
+ * or I/O threads with the "cpus" and "io_cpus" server parameters to
+ * make the most of it. Like rpc_context_set_workers(), this has to be
+ * done before the context starts serving. Does nothing on machines
+ * with a single node.
+ *
+ * @param context Target RPC context
+ * @param enable Whether to place workers and calls by node
+ * @return 0 on success, -1 on error
+ */
+int rpc_context_set_numa_affinity(_Nonnull rpc_context_t context,
+    bool enable);
+
+/**
+ * Sets up a QoS class for method calls of interface @p interface.
+ *
+ * Calls of the interface get picked up by workers ahead of calls with
+ * a lower priority. If @p limit is non-zero, no more than @p limit
+ * calls of the interface run at once; the rest wait in line. Calling
+ * this again for the same interface updates its class.
+ *
+ * @param context Target RPC context
+ * @param interface Interface name (NULL for the default interface)
+ * @param priority Call priority
+ * @param limit Concurrency limit, 0 for none
+ * @return 0 on success, -1 on error
+ */
+int rpc_context_set_interface_qos(_Nonnull rpc_context_t context,
+    const char *_Nullable interface, enum rpc_priority priority,
+    size_t limit);
+
+/**
+ * Turns fair scheduling between connections on or off.
+ *
+ * With fair scheduling on, the method calls of each connection wait in
+ * a queue of their own, and no more than @p slots of them are handed to
+ * the workers at a time. Free slots go round the connections with calls
+ * waiting, so that one connection firing off a lot of calls doesn't hold
+ * up everyone else. How big a share a connection gets is set up by the
+ * user it belongs to, see rpc_context_set_fair_share(). This has to be
+ * done before the context starts serving.
+ *
+ * @param context Target RPC context
+ * @param enable Whether to schedule calls fairly between connections
+ * @param slots Calls handed to the workers at once, 0 for one per worker
+ * @return 0 on success, -1 on error
+ */
+int rpc_context_set_fair_scheduling(_Nonnull rpc_context_t context,
+    bool enable, size_t slots);
+
+/**
+ * User id standing for all the users without a fair share of their own.
+ */
+#define	RPC_FAIR_SHARE_DEFAULT	((uid_t)-1)
+
+/**
+ * Sets the fair share of the connections of a user.
+ *
+ * Applies to connections whose peer credentials carry @p uid, or with
+ * RPC_FAIR_SHARE_DEFAULT, to the connections of all other users and
+ * those without credentials. Each connection gets up to @p weight turns
+ * in a row whenever it is its turn to have a call run. If @p max_running
+ * is non-zero, no more than that many of its calls run at once. With a
+ * non-zero @p rate, its calls are started at no more than @p rate a
+ * second on average, in bursts of up to @p burst calls. Connections
+ * that don't have a share get a weight of 1 and no limits.
+ *
+ * A connection picks up the share of its user on its first call;
+ * calling this again for the same user updates the share in place.
+ *
+ * @param context Target RPC context
+ * @param uid User id, or RPC_FAIR_SHARE_DEFAULT
+ * @param weight Relative weight of each connection, at least 1
+ * @param max_running Concurrency cap of each connection, 0 for none
+ * @param rate Calls a second each connection may start, 0 for no limit
+ * @param burst Calls a connection may start at once when under the rate
+ * @return 0 on success, -1 on error
+ */
+int rpc_context_set_fair_share(_Nonnull rpc_context_t context, uid_t uid,
+    unsigned int weight, size_t max_running, double rate, size_t burst);
+
+/**
+ * Limits the number of calls waiting in line for an interface.
+ *
+ * Once the concurrency limit of the interface QoS class is reached and
+ * @p max_queued calls are already waiting, further calls are answered
+ * right away with an @c EBUSY error.
+ *
+ * @param context Target RPC context
+ * @param interface Interface name (NULL for the default interface)
+ * @param max_queued Maximum number of waiting calls, 0 for no limit
+ * @return 0 on success, -1 if the interface has no QoS class
+ */
+int rpc_context_set_interface_queue_limit(_Nonnull rpc_context_t context,
+    const char *_Nullable interface, size_t max_queued);
+
+/**
+ * Returns the statistics of the QoS classes of a context.
+ *
+ * The result is a dictionary keyed by interface name. Each value holds
+ * the class priority and limit, the number of running and queued
+ * calls, and counts of calls dispatched, throttled and shed so far.
+ *
+ * @param context Target RPC context
+ * @return Statistics dictionary
+ */
+_Nonnull rpc_object_t rpc_context_get_qos_stats(
+    _Nonnull rpc_context_t context);
+
+/**
+ * Returns per-method call statistics of a context.
+ *
+ * The result is an array with an entry for every (interface, method)
+ * called so far. Each holds counts of calls, errors, and request and
+ * response bytes, and "queue" and "exec" latency summaries (count,
+ * mean, p50, p90, p99 and max, in microseconds) for the time spent
+ * waiting for a worker and the time taken from there on, streaming
+ * and asynchronous responses included.
+ *
+ * The same data is available remotely through the get_method_stats
+ * method of @ref RPC_STATISTICS_INTERFACE on the root instance, next
+ * to get_server_stats and get_connection_stats, which return the
+ * results of @ref rpc_server_get_stats and @ref rpc_connection_get_stats
+ * for every server and every client connection of the context, and
+ * get_lock_stats, which returns @ref rpc_lockprof_get_stats.
+ *
+ * @param context Target RPC context
+ * @return Statistics array
+ */
+_Nonnull rpc_object_t rpc_context_get_method_stats(
+    _Nonnull rpc_context_t context);
+
+/**
+ * Sets the latency budget of calls handled by a context.
+ *
+ * Calls taking longer than that from arrival to their last response
+ * frame are recorded in the slow call log with their method, request
+ * and response sizes, queue and execution times and, optionally, the
+ * backtrace of the thread that finished them. Each entry is also
+ * emitted as a slow_call event of @ref RPC_STATISTICS_INTERFACE on
+ * the root instance.
+ *
+ * @param context Target RPC context
+ * @param threshold_us Latency budget in microseconds, 0 to disable
+ * @param backtrace Whether to record backtraces
+ */
+void rpc_context_set_slow_call_threshold(_Nonnull rpc_context_t context,
+    uint64_t threshold_us, bool backtrace);
+
+/**
+ * Sets the slow consumer thresholds of a context.
+ *
+ * A connection whose unsent data grows past @p send_backlog bytes, or
+ * a call with more than @p queued_fragments stream fragments waiting
+ * to be consumed, is recorded in the slow consumer log and emitted as
+ * a slow_consumer event. Only connections that belong to the context
+ * are watched: those accepted by its servers and client connections
+ * registered with @ref rpc_connection_register_context.
+ *
+ * @param context Target RPC context
+ * @param send_backlog Unsent bytes, 0 to disable
+ * @param queued_fragments Queued fragments, 0 to disable
+ */
+void rpc_context_set_slow_consumer_threshold(_Nonnull rpc_context_t context,
+    size_t send_backlog, size_t queued_fragments);
+
+/**
+ * Sets how many entries the slow call and slow consumer logs keep.
+ * Defaults to 128; the oldest entries are dropped first.
+ *
+ * @param context Target RPC context
+ * @param entries Maximum number of entries
+ */
+void rpc_context_set_slow_log_size(_Nonnull rpc_context_t context,
+    size_t entries);
+
+/**
+ * Returns the slow call log of a context, oldest entries first.
+ * Also available through the get_slow_calls method of
+ * @ref RPC_STATISTICS_INTERFACE.
+ *
+ * @param context Target RPC context
+ * @return Array of slow call samples
+ */
+_Nonnull rpc_object_t rpc_context_get_slow_calls(
+    _Nonnull rpc_context_t context);
+
+/**
+ * Returns the slow consumer log of a context, oldest entries first.
+ * Also available through the get_slow_consumers method of
+ * @ref RPC_STATISTICS_INTERFACE.
+ *
+ * @param context Target RPC context
+ * @return Array of slow consumer samples
+ */
+_Nonnull rpc_object_t rpc_context_get_slow_consumers(
+    _Nonnull rpc_context_t context);
+
+/**
+ * Reads all the properties of an interface on many instances at once.
+ *
+ * @p paths is either a glob pattern (as in g_pattern_match_simple())
+ * that instance paths are matched against, or an array of instance
+ * paths. Getters run in parallel on the context worker pool, and
+ * @p callback gets the path of each instance with the interface along
+ * with the same array get_all of @ref RPC_OBSERVABLE_INTERFACE returns,
+ * in the order the instances were found in. Remotely, the same is
+ * available as a streaming get_properties method of
+ * @ref RPC_DISCOVERABLE_INTERFACE, which takes the interface and
+ * @p paths, streams {path, properties} dictionaries and is limited to
+ * instances under the one it's called on. A query attached to the call
+ * filters the stream.
+ *
+ * @param context Target RPC context
+ * @param interface Interface name
+ * @param paths Path pattern or array of paths
+ * @param callback Called for each instance, on the calling thread
+ * @return 0 on success, -1 if @p paths is neither a string nor an array
+ */
+int rpc_context_get_properties(_Nonnull rpc_context_t context,
+    const char *_Nonnull interface, _Nonnull rpc_object_t paths,
+    _Nonnull rpc_property_bulk_cb_t callback);
+
 /**
  * Finds an instance registered in @p context.
  *
@@ -310,6 +638,40 @@ int rpc_context_register_instance(_Nonnull rpc_context_t context,
 void rpc_context_unregister_instance(_Nonnull rpc_context_t context,
     const char *_Nonnull path);
 
+/**
+ * Registers a namespace of virtual instances under @p prefix.
+ *
+ * Objects of the namespace aren't registered one by one. When a lookup
+ * (see rpc_instance_find_and_retain()) finds no registered instance
+ * below @p prefix, @p resolver is asked for it; the instance it returns
+ * lives for as long as it's retained and is freed with the last
+ * reference. rpc_instance_new_shared() makes such instances cheap.
+ *
+ * @p enumerator, if set, lists the objects for get_instances and for
+ * the path patterns of rpc_context_get_properties(). Registered
+ * instances take precedence over virtual ones, and the longest
+ * matching prefix wins.
+ *
+ * @param context RPC context handle
+ * @param prefix Path under which the objects live
+ * @param resolver Resolver block
+ * @param enumerator Enumerator block, may be NULL
+ * @return 0 on success, -1 if the prefix is invalid or already taken
+ */
+int rpc_context_register_namespace(_Nonnull rpc_context_t context,
+    const char *_Nonnull prefix, _Nonnull rpc_instance_resolver_t resolver,
+    _Nullable rpc_instance_enumerator_t enumerator);
+
+/**
+ * Unregisters a namespace of virtual instances. Instances resolved
+ * before stay valid for as long as they're retained.
+ *
+ * @param context RPC context handle
+ * @param prefix Prefix the namespace was registered under
+ */
+void rpc_context_unregister_namespace(_Nonnull rpc_context_t context,
+    const char *_Nonnull prefix);
+
 /**
  * Registers a given rpc_method structure as an RPC method in a given context.
  *
@@ -384,6 +746,22 @@ void rpc_context_set_pre_call_hook(_Nonnull rpc_context_t context,
 void rpc_context_set_post_call_hook(_Nonnull rpc_context_t context,
     _Nonnull rpc_function_t fn);
 
+/**
+ * Sets the stack trace policy for errors of a context.
+ *
+ * With @p capture off, errors created while methods of the context run
+ * don't record a stack trace. Errors sent back to callers carry their
+ * stack trace only with @p send on; by default they go out without it,
+ * and the errors the library raises on its own, such as for missing
+ * instances or members, then don't record one in the first place.
+ *
+ * @param context Target context
+ * @param capture Whether to record stack traces, true by default
+ * @param send Whether to send stack traces to peers, false by default
+ */
+void rpc_context_set_error_stacks(_Nonnull rpc_context_t context,
+    bool capture, bool send);
+
 /**
  *
  * @param context RPC context handle
@@ -458,6 +836,43 @@ const char *_Nonnull rpc_function_get_path(void *_Nonnull cookie);
  */
 const char *_Nonnull rpc_function_get_interface(void *_Nonnull cookie);
 
+/**
+ * Returns the W3C traceparent of the call's server span, or NULL if
+ * tracing is off.
+ *
+ * @param cookie Running call handle
+ */
+const char *_Nullable rpc_function_get_traceparent(void *_Nonnull cookie);
+
+/**
+ * Returns the W3C tracestate the call came with, or NULL.
+ *
+ * @param cookie Running call handle
+ */
+const char *_Nullable rpc_function_get_tracestate(void *_Nonnull cookie);
+
+/**
+ * Returns the tag of the response the caller of a conditional call
+ * already has, or NULL.
+ *
+ * @param cookie Running call handle
+ */
+const char *_Nullable rpc_function_get_etag(void *_Nonnull cookie);
+
+/**
+ * Declares the version of the response to a conditional call.
+ *
+ * The version is used as the tag of the response in place of a digest
+ * of it. A method that can tell its version cheaply should compare it
+ * with rpc_function_get_etag() first; when they match, the response is
+ * not going to be sent, so the method may skip building it and return
+ * NULL. Has no effect on other calls.
+ *
+ * @param cookie Running call handle
+ * @param etag Version of the response
+ */
+void rpc_function_set_etag(void *_Nonnull cookie, const char *_Nonnull etag);
+
 /**
  * Sends a response to a call.
  *
@@ -513,6 +928,58 @@ int rpc_function_start_stream(void *_Nonnull cookie);
  */
 int rpc_function_yield(void *_Nonnull cookie, _Nonnull rpc_object_t fragment);
 
+/**
+ * Lets a streaming method run ahead of its consumer.
+ *
+ * Fragments yielded while the consumer has no credits left are kept in
+ * a per-call buffer and sent as credits come back, so that
+ * rpc_function_yield() only blocks once the buffer is full. Either
+ * limit may be 0 to leave it unbounded; both 0 turn the buffer off,
+ * which is the default. rpc_function_end() doesn't wait for a buffered
+ * stream to drain, the end goes out after the last fragment.
+ *
+ * @param cookie Running call handle
+ * @param max_items Most fragments held at a time
+ * @param max_bytes Most bytes, roughly, held at a time
+ * @return 0 on success, -1 if the call isn't running anymore
+ */
+int rpc_function_set_output_buffer(void *_Nonnull cookie, size_t max_items,
+    size_t max_bytes);
+
+/**
+ * Generates a new value in a streaming response, without blocking.
+ *
+ * If the fragment can't be sent or buffered right now, -1 is returned
+ * with the last error set to EAGAIN, @p fragment is left to the caller
+ * and @p handler gets called once it can be, replacing any handler set
+ * before. The handler runs on the connection's thread and must not
+ * block; it is dropped if the call gets aborted, the abort handler is
+ * called instead.
+ *
+ * A method producing that way returns RPC_FUNCTION_STILL_RUNNING,
+ * keeps a reference to the call and ends it with rpc_function_end().
+ *
+ * @param cookie Running call handle
+ * @param fragment Next data fragment
+ * @param handler Readiness handler block
+ * @return Status. Success is reported by returning 0
+ */
+int rpc_function_yield_async(void *_Nonnull cookie,
+    _Nonnull rpc_object_t fragment, _Nonnull rpc_ready_handler_t handler);
+
+/**
+ * Returns the next item of a streaming upload.
+ *
+ * Blocks until the caller sends another item with rpc_call_yield(). The
+ * caller is granted more credits as items are consumed, so an upload
+ * never buffers more than a small window on the receiving end.
+ *
+ * @param cookie Running call handle
+ * @return Next item, to be released by the caller, or NULL once the
+ *	upload has ended, the call was aborted or it isn't an upload
+ */
+_Nullable rpc_object_t rpc_function_next_input(void *_Nonnull cookie);
+
 /**
  * Ends a streaming response.
  *
@@ -538,11 +1005,33 @@ void rpc_function_kill(void *_Nonnull cookie);
  * Returns the value of a flag saying whether or not a method should
  * immediately stop because it was aborted on the client side.
  *
+ * The flag is also raised once the deadline sent along with the call
+ * has passed, since the client is no longer waiting for the result.
+ *
+ * It is raised as well once a query the caller attached to the call (see
+ * rpc_connection_call_query()) won't let any more fragments through.
+ *
  * @param cookie Running call handle
  * @return Whether or not function should abort
  */
 bool rpc_function_should_abort(void *_Nonnull cookie);
 
+/**
+ * Takes over the query the caller attached to the call, if any.
+ *
+ * By default rules and parameters of the query are applied to fragments
+ * passed to rpc_function_yield(). Methods that can do better, for example
+ * by using an index, may take the compiled plan and apply it themselves;
+ * fragments are then sent as they are. The plan stays valid for as long
+ * as the call runs.
+ *
+ * @param cookie Running call handle
+ * @param params Filled with the query parameters, may be NULL
+ * @return Compiled plan or NULL if the caller sent no query
+ */
+_Nullable rpc_query_plan_t rpc_function_get_query(void *_Nonnull cookie,
+    struct rpc_query_params *_Nullable params);
+
 /**
  * Sets a callback to be called when running method got an abort signal
  * from the client.
@@ -584,6 +1073,23 @@ int  rpc_function_release(void *_Nonnull cookie);
 _Nullable rpc_instance_t rpc_instance_new(void *_Nullable arg,
     const char *_Nonnull fmt, ...);
 
+/**
+ * Creates an instance sharing the interfaces and members of @p shape.
+ *
+ * Nothing but the path and @p arg is allocated for it, which makes it
+ * the way to go for the objects of a virtual namespace. @p shape is an
+ * instance created with rpc_instance_new(), which is never registered
+ * and has to outlive every instance sharing it. Interfaces can't be
+ * added to a shared instance.
+ *
+ * @param shape Instance to share the interfaces of
+ * @param arg User data pointer
+ * @param fmt Instance path
+ * @return Instance handle or NULL if the path is invalid
+ */
+_Nullable rpc_instance_t rpc_instance_new_shared(_Nonnull rpc_instance_t shape,
+    void *_Nullable arg, const char *_Nonnull fmt, ...);
+
 /**
  * Increment the reference count of an instance.
  *
@@ -723,6 +1229,38 @@ int rpc_instance_register_func(_Nonnull rpc_instance_t instance,
     const char *_Nonnull interface, const char *_Nonnull name,
     void *_Nullable arg, _Nonnull rpc_function_f fn);
 
+/**
+ * Same as @ref rpc_instance_register_func, but registers the method
+ * as non-blocking.
+ *
+ * @see RPC_METHOD_INLINE
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param name Method name
+ * @param arg Method private data pointer
+ * @param fn Function pointer
+ * @return 0 on success, -1 on error
+ */
+int rpc_instance_register_inline_func(_Nonnull rpc_instance_t instance,
+    const char *_Nonnull interface, const char *_Nonnull name,
+    void *_Nullable arg, _Nonnull rpc_function_f fn);
+
+/**
+ * Replaces the flags of method @p name registered on @p instance.
+ *
+ * @see RPC_METHOD_INLINE
+ * @see RPC_METHOD_COALESCE
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param name Method name
+ * @param flags New method flags
+ * @return 0 on success, -1 on error
+ */
+int rpc_instance_set_method_flags(_Nonnull rpc_instance_t instance,
+    const char *_Nullable interface, const char *_Nonnull name, int flags);
+
 /**
  * Finds member called @p name belonging to a @p interface in @p instance.
  *
@@ -817,6 +1355,47 @@ void rpc_instance_property_changed(_Nonnull rpc_instance_t instance,
     const char *_Nonnull interface, const char *_Nonnull name,
     _Nullable rpc_object_t value);
 
+/**
+ * Sets how change notifications of property @p name are rate limited.
+ *
+ * Changes reported through rpc_instance_property_changed() less than
+ * @p min_interval milliseconds after the previous notification are
+ * held back and coalesced; once the interval is up, only the latest
+ * value is sent. With @p compare set, changes to a value equal to the
+ * one last sent are dropped altogether. Passing 0 and false restores
+ * the default of notifying on every change.
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param name Property name
+ * @param min_interval Minimum time between notifications (in ms)
+ * @param compare Whether to suppress notifications of unchanged values
+ * @return 0 on success, -1 on error
+ */
+int rpc_instance_set_property_coalescing(_Nonnull rpc_instance_t instance,
+    const char *_Nonnull interface, const char *_Nonnull name,
+    uint64_t min_interval, bool compare);
+
+/**
+ * Sets whether changes of property @p name are sent as deltas.
+ *
+ * With deltas on, change events carry a "version" number and, when
+ * it's meaningfully smaller than the value, a "delta" as produced by
+ * rpc_query_diff() against the previous version instead of the whole
+ * "value". Changes that leave the value equal aren't sent. Watchers
+ * have to understand such events; the property cache of
+ * rpc_connection_get_property() does, and resyncs with the
+ * get_versioned method when it misses a version.
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param name Property name
+ * @param enable Whether to send deltas
+ * @return 0 on success, -1 on error
+ */
+int rpc_instance_set_property_delta(_Nonnull rpc_instance_t instance,
+    const char *_Nonnull interface, const char *_Nonnull name, bool enable);
+
 /**
  * Returns instance associated with the getter or setter call.
  *
@@ -195,29 +195,71 @@ int rpct_read_idl(const char *name, rpc_object_t idl);
 /**
  * Loads type information from an interface definition file.
  *
+ * Types may be loaded at any time, also while other threads validate
+ * or instantiate types. Those keep seeing the types loaded before,
+ * until the new ones are all in.
+ *
  * @param path Path of the IDL file
  * @return 0 on success, -1 on error
  */
 int rpct_load_types(const char *path);
 
 /**
+ * Loads type information from all the IDL files in a directory tree.
  *
- * @param path
- * @return
+ * The types of the whole tree become visible to other threads at once.
+ *
+ * @param path Directory with IDL files
+ * @return 0 on success, -1 on error
  */
 int rpct_load_types_dir(const char *path);
 
+/**
+ * Indexes the IDL files in a directory tree by namespace, without
+ * reading them. A file is read and its types loaded the first time a
+ * type or interface from its namespace is looked up.
+ *
+ * Files with no namespace are loaded right away.
+ *
+ * @param path Directory with IDL files
+ * @return 0 on success, -1 on error
+ */
+int rpct_index_types_dir(const char *path);
+
 /**
  * Loads type information from an interface definition stream.
  *
- * File descriptor is closed once all definitions have been
- * read from it or error happened.
+ * The stream carries a type database, as written by
+ * @ref rpct_compile_types_dir. File descriptor is closed once all
+ * definitions have been read from it or error happened.
  *
  * @param fd IDL stream file descriptor
  * @return 0 on success, -1 on error
  */
 int rpct_load_types_stream(int fd);
 
+/**
+ * Parses all the IDL files in a directory tree and writes them out as
+ * a binary type database, which loads without any YAML parsing.
+ *
+ * @param path Directory with IDL files
+ * @param dbpath Path of the database file to write
+ * @return 0 on success, -1 on error
+ */
+int rpct_compile_types_dir(const char *path, const char *dbpath);
+
+/**
+ * Loads type information from a database written by
+ * @ref rpct_compile_types_dir.
+ *
+ * Fails with ESTALE, without loading anything, if any of the IDL files
+ * the database was compiled from has changed since.
+ *
+ * @param dbpath Path of the database file
+ * @return 0 on success, -1 on error
+ */
+int rpct_load_types_db(const char *dbpath);
+
 /**
  * Loads type information from files previously loaded by @ref rpct_read_idl.
  *
@@ -370,6 +412,44 @@ rpct_typei_t rpct_typei_get_generic_var(rpct_typei_t typei, const char *name);
  */
 const char *rpct_typei_get_canonical_form(rpct_typei_t typei);
 
+/**
+ * Returns the index of a struct member, as used by @ref rpct_struct_get.
+ *
+ * Members are indexed in name order, the same on every peer loading
+ * the same IDL.
+ *
+ * @param type Struct type handle
+ * @param name Member name
+ * @return Member index or -1 if there is no such member
+ */
+int rpct_struct_index(rpct_type_t type, const char *name);
+
+/**
+ * Returns a member of a struct instance by its index.
+ *
+ * Struct instances created by @ref rpct_newi or decoded positionally
+ * keep their members in a slot array, in which case this doesn't look
+ * the member name up at all. Other instances still work, through their
+ * dictionary.
+ *
+ * @param instance Struct instance
+ * @param index Member index
+ * @return Member value (borrowed) or NULL if not set
+ */
+rpc_object_t rpct_struct_get(rpc_object_t instance, size_t index);
+
+/**
+ * Sets a member of a struct instance by its index.
+ *
+ * The value is retained, like with @ref rpc_dictionary_set_value.
+ *
+ * @param instance Struct instance
+ * @param index Member index
+ * @param value Member value
+ * @return 0 on success, -1 on error
+ */
+int rpct_struct_set(rpc_object_t instance, size_t index, rpc_object_t value);
+
 /**
  * Returns type instance handler of a structure or union member.
  *
@@ -684,6 +764,56 @@ bool rpct_validate_return(struct rpct_if_member *func, rpc_object_t result,
  */
 bool rpct_validate(rpct_typei_t typei, rpc_object_t obj, rpc_object_t *errors);
 
+/**
+ * Validation policies for @ref rpct_pre_call_hook and
+ * @ref rpct_post_call_hook.
+ */
+typedef enum {
+	RPCT_VALIDATE_DEFAULT = 0,	/**< Context policy, or always */
+	RPCT_VALIDATE_ALWAYS,		/**< Validate every call */
+	RPCT_VALIDATE_NEVER,		/**< Don't validate at all */
+	RPCT_VALIDATE_SAMPLED,		/**< Validate one call in N */
+	RPCT_VALIDATE_UNTRUSTED,	/**< Only peers with another uid */
+	RPCT_VALIDATE_MAX
+} rpct_validation_mode_t;
+
+/**
+ * Sets the validation policy for calls made within a context.
+ *
+ * A peer is trusted if it runs with the same effective uid as this
+ * process, which is only known on transports passing credentials.
+ * Calls dispatched locally, without a connection, are trusted too.
+ *
+ * @param context RPC context handle
+ * @param mode Validation mode
+ * @param rate N for RPCT_VALIDATE_SAMPLED, ignored otherwise
+ */
+void rpct_set_validation_policy(rpc_context_t context,
+    rpct_validation_mode_t mode, unsigned int rate);
+
+/**
+ * Overrides the context validation policy for calls coming in over
+ * a single connection. RPCT_VALIDATE_DEFAULT goes back to the context
+ * policy.
+ *
+ * @param conn Connection handle
+ * @param mode Validation mode
+ * @param rate N for RPCT_VALIDATE_SAMPLED, ignored otherwise
+ */
+void rpct_connection_set_validation_policy(rpc_connection_t conn,
+    rpct_validation_mode_t mode, unsigned int rate);
+
+/**
+ * Returns validation counters of a context, per validation mode in
+ * effect for the calls: a dictionary keyed by mode name ("always",
+ * "never", "sampled", "untrusted") of dictionaries with "validated",
+ * "skipped" and "failed" counts.
+ *
+ * @param context RPC context handle
+ * @return Dictionary of counters
+ */
+rpc_object_t rpct_get_validation_stats(rpc_context_t context);
+
 /**
  *
  * @param cookie
@@ -715,6 +845,22 @@ void rpct_allow_idl_download(rpc_context_t context);
  */
 int rpct_download_idl(rpc_connection_t conn);
 
+/**
+ * Downloads IDL from the peer, keeping a copy of every file in a cache
+ * directory.
+ *
+ * Files are identified by a SHA-256 hash of their contents. The hashes
+ * of cached files are sent along with the request and the server only
+ * sends bodies of files that are new or have changed; the rest are read
+ * from the cache.
+ *
+ * @param conn Connection handle
+ * @param cachedir Cache directory, created if it doesn't exist, or NULL
+ * @return 0 on success, -1 on error
+ */
+int rpct_download_idl_cached(rpc_connection_t conn,
+    const char *cachedir);
+
 #ifdef __cplusplus
 }
 #endif
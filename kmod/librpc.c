@@ -30,6 +30,12 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/kref.h>
 #include <linux/workqueue.h>
 #include <linux/connector.h>
 #include <linux/stat.h>
@@ -47,9 +53,21 @@ static ssize_t librpc_device_show_descr(struct device *,
     struct device_attribute *, char *);
 static ssize_t librpc_device_show_serial(struct device *,
     struct device_attribute *, char *);
-static void librpc_cn_send_ack(uint32_t, uint32_t, uint32_t, int);
+static void librpc_cn_send_ack(uint32_t, uint32_t, uint32_t, int, uint16_t);
+static void librpc_cn_send_frame(int, int, uint32_t, const void *, size_t);
 static void librpc_cn_send_presence(int, uint32_t, struct librpc_endpoint *);
 static void librpc_request(struct work_struct *);
+static struct librpc_ring_buf *librpc_ring_alloc(void);
+static void librpc_ring_free(struct kref *);
+static void librpc_ring_kill(struct librpc_ring_buf *);
+static bool librpc_ring_put(struct librpc_ring_buf *, int, const void *,
+    size_t);
+static struct librpc_device *librpc_find_parent(struct device *);
+static int librpc_ring_open(struct inode *, struct file *);
+static int librpc_ring_release(struct inode *, struct file *);
+static int librpc_ring_mmap(struct file *, struct vm_area_struct *);
+static unsigned int librpc_ring_poll(struct file *, poll_table *);
+static long librpc_ring_ioctl(struct file *, unsigned int, unsigned long);
 
 struct librpc_call
 {
@@ -64,6 +82,41 @@ struct librpc_call
 	struct work_struct	work;
 };
 
+/*
+ * Per-sender state: the frame being reassembled and the messages not
+ * acked yet. Senders are told apart by their netlink port id; there are
+ * only ever a few of them, so a small table will do.
+ */
+#define LIBRPC_MAX_PORTS        16
+
+struct librpc_port
+{
+	bool			used;
+	uint32_t		portid;
+	void *			buf;
+	size_t			len;
+	uint32_t		pending;
+	uint32_t		last_seq;
+	uint32_t		last_ack;
+};
+
+/*
+ * Event and log ring of a device. Open files hold a reference, so the
+ * ring outlives the device if a consumer still has it mapped; a dead
+ * ring reports hangup and takes no more records.
+ */
+struct librpc_ring_buf
+{
+	struct kref		kref;
+	struct librpc_ring *	hdr;
+	char *			data;
+	spinlock_t		lock;
+	wait_queue_head_t	wq;
+	struct eventfd_ctx *	efd;
+	bool			open;
+	bool			dead;
+};
+
 struct librpc_dev
 {
 	struct device *         dev;
@@ -87,11 +140,24 @@ static const struct device_attribute librpc_device_attrs[] = {
 	__ATTR(serial, S_IRUGO, librpc_device_show_serial, NULL)
 };
 
+static const struct file_operations librpc_ring_fops = {
+	.owner = THIS_MODULE,
+	.open = librpc_ring_open,
+	.release = librpc_ring_release,
+	.mmap = librpc_ring_mmap,
+	.poll = librpc_ring_poll,
+	.unlocked_ioctl = librpc_ring_ioctl
+};
+
 static struct workqueue_struct *librpc_wq;
 static struct class *librpc_class;
 static struct librpc_dev *dev;
 static DEFINE_MUTEX(librpc_mtx);
 static DEFINE_IDR(librpc_device_ids);
+static dev_t librpc_devt;
+static DEFINE_MUTEX(librpc_port_mtx);
+static struct librpc_port librpc_ports[LIBRPC_MAX_PORTS];
+static unsigned int librpc_port_next;
 static uint32_t resp_seq;
 
 struct librpc_device *
@@ -115,6 +181,7 @@ librpc_device_register(const char *name, struct device *dev,
 	rpcdev->dev.parent = dev;
 	rpcdev->dev.release = &librpc_dev_release;
 	rpcdev->dev.bus = &librpc_bus_type;
+	rpcdev->dev.devt = MKDEV(MAJOR(librpc_devt), id);
 
 	dev_set_name(&rpcdev->dev, "librpc%d", id);
 
@@ -126,11 +193,24 @@ librpc_device_register(const char *name, struct device *dev,
 		return (ERR_PTR(ret));
 	}
 
+	rpcdev->ring = librpc_ring_alloc();
+	rpcdev->cdev = cdev_alloc();
+	if (rpcdev->ring == NULL || rpcdev->cdev == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	rpcdev->cdev->owner = THIS_MODULE;
+	rpcdev->cdev->ops = &librpc_ring_fops;
+	ret = cdev_add(rpcdev->cdev, rpcdev->dev.devt, 1);
+	if (ret != 0)
+		goto fail;
+
         ret = device_register(&rpcdev->dev);
 	if (ret != 0) {
-		kfree(rpcdev);
-		mutex_unlock(&librpc_mtx);
-		return (ERR_PTR(ret));
+		cdev_del(rpcdev->cdev);
+		rpcdev->cdev = NULL;
+		goto fail;
 	}
 
 	for (i = 0; i < ARRAY_SIZE(librpc_device_attrs); i++)
@@ -140,6 +220,18 @@ librpc_device_register(const char *name, struct device *dev,
 	librpc_cn_send_presence(LIBRPC_ARRIVE, rpcdev->address, &rpcdev->endp);
 	mutex_unlock(&librpc_mtx);
 	return (rpcdev);
+
+fail:
+	if (rpcdev->cdev != NULL)
+		kobject_put(&rpcdev->cdev->kobj);
+
+	if (rpcdev->ring != NULL)
+		kref_put(&rpcdev->ring->kref, librpc_ring_free);
+
+	idr_remove(&librpc_device_ids, id);
+	kfree(rpcdev);
+	mutex_unlock(&librpc_mtx);
+	return (ERR_PTR(ret));
 }
 
 void
@@ -152,7 +244,9 @@ librpc_device_unregister(struct librpc_device *rpcdev)
 		device_remove_file(&rpcdev->dev, &librpc_device_attrs[i]);
 
 	device_unregister(&rpcdev->dev);
+	cdev_del(rpcdev->cdev);
 	idr_remove(&librpc_device_ids, rpcdev->address);
+	librpc_ring_kill(rpcdev->ring);
 	librpc_cn_send_presence(LIBRPC_DEPART, rpcdev->address, &rpcdev->endp);
 	kfree(rpcdev);
 	mutex_unlock(&librpc_mtx);
@@ -163,26 +257,12 @@ librpc_device_answer(struct device *dev, void *arg, const void *buf,
     size_t length)
 {
 	struct librpc_call *call = arg;
-	struct {
-	    struct cn_msg cn;
-	    struct librpc_message msg;
-	    char response[length];
-	} packet;
 
-	printk("librpc_device_answer: buf=%p, length=%zu\n", buf, sizeof(packet));
+	printk("librpc_device_answer: buf=%p, length=%zu\n", buf, length);
 	print_hex_dump(KERN_INFO, "response: ", DUMP_PREFIX_ADDRESS, 16,
 	    1, buf, length, true);
 
-	packet.cn.id = librpc_cb_id;
-	packet.cn.seq = resp_seq++;
-	packet.cn.ack = 0;
-	packet.cn.len = sizeof(packet);
-	packet.cn.flags = 0;
-	packet.msg.opcode = LIBRPC_RESPONSE;
-	packet.msg.status = 0;
-
-	memcpy(packet.response, buf, length);
-	cn_netlink_send(&packet.cn, call->portid, 0, GFP_KERNEL);
+	librpc_cn_send_frame(LIBRPC_RESPONSE, 0, call->portid, buf, length);
 }
 
 void
@@ -199,9 +279,10 @@ librpc_device_error(struct device *dev, void *arg, int error)
 	packet.cn.id = librpc_cb_id;
 	packet.cn.seq = resp_seq++;
 	packet.cn.ack = 0;
-	packet.cn.len = sizeof(packet);
+	packet.cn.len = sizeof(packet.msg);
 	packet.cn.flags = 0;
 	packet.msg.opcode = LIBRPC_RESPONSE;
+	packet.msg.address = 0;
 	packet.msg.status = error;
 
 	cn_netlink_send(&packet.cn, call->portid, 0, GFP_KERNEL);
@@ -210,32 +291,34 @@ librpc_device_error(struct device *dev, void *arg, int error)
 void
 librpc_device_event(struct device *dev, const void *buf, size_t length)
 {
-	struct {
-		struct cn_msg cn;
-		struct librpc_message msg;
-		char response[length];
-	} packet;
-
-	printk("librpc_device_event: device=%p\n", dev);
+	struct librpc_device *rpcdev;
+	bool queued = false;
 
-	packet.cn.id = librpc_cb_id;
-	packet.cn.seq = resp_seq++;
-	packet.cn.ack = 0;
-	packet.cn.len = sizeof(packet);
-	packet.cn.flags = 0;
-	packet.msg.opcode = LIBRPC_EVENT;
-	packet.msg.status = 0;
+	rpcdev = librpc_find_parent(dev);
+	if (rpcdev != NULL) {
+		queued = librpc_ring_put(rpcdev->ring, LIBRPC_EVENT, buf,
+		    length);
+		put_device(&rpcdev->dev);
+	}
 
-	memcpy(packet.response, buf, length);
-	cn_netlink_send(&packet.cn, 0, 0, GFP_KERNEL);
+	if (!queued)
+		librpc_cn_send_frame(LIBRPC_EVENT, 0, 0, buf, length);
 }
 
 void
 librpc_device_log(struct device *dev, const char *log, size_t len)
 {
+	struct librpc_device *rpcdev;
+	bool queued = false;
 
-	dev_dbg(dev, "librpc_device_log: len=%zu, buf=%p\n", len, log);
-	dev_info(dev, "%*s\n", (int)len, log);
+	rpcdev = librpc_find_parent(dev);
+	if (rpcdev != NULL) {
+		queued = librpc_ring_put(rpcdev->ring, LIBRPC_LOG, log, len);
+		put_device(&rpcdev->dev);
+	}
+
+	if (!queued)
+		dev_info(dev, "%*s\n", (int)len, log);
 }
 
 int
@@ -276,6 +359,30 @@ librpc_find_device(uint32_t address)
 	    librpc_match_device));
 }
 
+static int
+librpc_match_parent(struct device *dev, void *data)
+{
+
+	return (dev->parent == data);
+}
+
+/*
+ * Finds the librpc device registered on top of the transport device.
+ * The caller drops the reference with put_device().
+ */
+static struct librpc_device *
+librpc_find_parent(struct device *parent)
+{
+	struct device *dev;
+
+	dev = bus_find_device(&librpc_bus_type, NULL, parent,
+	    librpc_match_parent);
+	if (dev == NULL)
+		return (NULL);
+
+	return (to_librpc_device(dev));
+}
+
 static void
 librpc_request(struct work_struct *work)
 {
@@ -292,18 +399,100 @@ librpc_dev_release(struct device *dev)
 
 }
 
+static void
+librpc_port_discard(struct librpc_port *port)
+{
+
+	kfree(port->buf);
+	port->buf = NULL;
+	port->len = 0;
+}
+
+static void
+librpc_port_flush(struct librpc_port *port)
+{
+
+	if (port->pending == 0)
+		return;
+
+	librpc_cn_send_ack(port->last_seq, port->last_ack, port->portid, 0,
+	    LIBRPC_FLAG_CUMULATIVE);
+	port->pending = 0;
+}
+
+/*
+ * Must be called with librpc_port_mtx held. If the table is full, the
+ * oldest entry is flushed and reused.
+ */
+static struct librpc_port *
+librpc_port_get(uint32_t portid)
+{
+	struct librpc_port *port = NULL;
+	int i;
+
+	for (i = 0; i < LIBRPC_MAX_PORTS; i++) {
+		if (librpc_ports[i].used && librpc_ports[i].portid == portid)
+			return (&librpc_ports[i]);
+
+		if (!librpc_ports[i].used && port == NULL)
+			port = &librpc_ports[i];
+	}
+
+	if (port == NULL) {
+		port = &librpc_ports[librpc_port_next++ % LIBRPC_MAX_PORTS];
+		librpc_port_flush(port);
+		librpc_port_discard(port);
+	}
+
+	memset(port, 0, sizeof(*port));
+	port->used = true;
+	port->portid = portid;
+	return (port);
+}
+
+static void
+librpc_port_ack(struct librpc_port *port, struct cn_msg *cn, int error)
+{
+
+	if ((cn->flags & LIBRPC_FLAG_WINDOW) == 0) {
+		librpc_cn_send_ack(cn->seq, cn->ack, port->portid, error, 0);
+		return;
+	}
+
+	/* Keep acks in order: whatever is pending goes out first */
+	if (error != 0) {
+		librpc_port_flush(port);
+		librpc_cn_send_ack(cn->seq, cn->ack, port->portid, error, 0);
+		return;
+	}
+
+	port->pending++;
+	port->last_seq = cn->seq;
+	port->last_ack = cn->ack;
+
+	if ((cn->flags & LIBRPC_FLAG_ACK_NOW) ||
+	    port->pending >= LIBRPC_ACK_BATCH)
+		librpc_port_flush(port);
+}
+
 static void
 librpc_cn_callback(struct cn_msg *cn, struct netlink_skb_parms *nsp)
 {
 	struct librpc_message *msg = (struct librpc_message *)(cn + 1);
 	struct librpc_call *call;
 	struct librpc_device *rpcdev;
+	struct librpc_port *port;
 	struct device *dev;
+	size_t len = cn->len - sizeof(*msg);
+	void *buf;
 	int ret = 0;
 
 	printk("librpc_cn_callback: msg: opcode=%d, address=0x%08x, len=%d, "
-	    "seq=%d, portid=%d",  msg->opcode, msg->address, cn->len,
-	    cn->seq, nsp->portid);
+	    "seq=%d, flags=0x%x, portid=%d",  msg->opcode, msg->address,
+	    cn->len, cn->seq, cn->flags, nsp->portid);
+
+	mutex_lock(&librpc_port_mtx);
+	port = librpc_port_get(nsp->portid);
 
 	switch (msg->opcode) {
 	case LIBRPC_QUERY:
@@ -323,32 +512,57 @@ librpc_cn_callback(struct cn_msg *cn, struct netlink_skb_parms *nsp)
 	case LIBRPC_REQUEST:
 		dev = librpc_find_device(msg->address);
 		if (dev == NULL) {
+			librpc_port_discard(port);
 			ret = ENOENT;
 			goto ack;
 		}
 
+		/* Collect fragments until the last one comes in */
+		if (port->len + len > LIBRPC_MAX_FRAME) {
+			librpc_port_discard(port);
+			ret = EMSGSIZE;
+			goto ack;
+		}
+
+		buf = krealloc(port->buf, port->len + len, GFP_KERNEL);
+		if (buf == NULL) {
+			librpc_port_discard(port);
+			ret = ENOMEM;
+			goto ack;
+		}
+
+		memcpy(buf + port->len, msg->data, len);
+		port->buf = buf;
+		port->len += len;
+
+		if (cn->flags & LIBRPC_FLAG_MORE)
+			goto ack;
+
 		call = kzalloc(sizeof(*call), GFP_KERNEL);
 		call->rpcdev = to_librpc_device(dev);
 		call->dev = dev->parent;
-		call->len = cn->len - sizeof(*msg);
-		call->data = kmalloc(call->len, GFP_KERNEL);
+		call->data = port->buf;
+		call->len = port->len;
 		call->portid = nsp->portid;
 		call->seq = cn->seq;
 		call->ack = cn->ack;
 		call->id = cn->seq;
+		port->buf = NULL;
+		port->len = 0;
 
-		memcpy(call->data, msg->data, call->len);
 		INIT_WORK(&call->work, &librpc_request);
 		queue_work(librpc_wq, &call->work);
 		break;
 	}
 
 ack:
-	librpc_cn_send_ack(cn->seq, cn->ack, nsp->portid, ret);
+	librpc_port_ack(port, cn, ret);
+	mutex_unlock(&librpc_port_mtx);
 }
 
 static void
-librpc_cn_send_ack(uint32_t seq, uint32_t ack, uint32_t portid, int error)
+librpc_cn_send_ack(uint32_t seq, uint32_t ack, uint32_t portid, int error,
+    uint16_t flags)
 {
 	int ret;
 	struct {
@@ -356,15 +570,16 @@ librpc_cn_send_ack(uint32_t seq, uint32_t ack, uint32_t portid, int error)
 		struct librpc_message msg;
 	} packet;
 
-	printk("librpc_cn_send_ack: seq=%d, portid=%d, status=%d\n",
-	    seq, portid, error);
+	printk("librpc_cn_send_ack: seq=%d, portid=%d, status=%d, flags=0x%x\n",
+	    seq, portid, error, flags);
 
 	packet.cn.id = librpc_cb_id;
 	packet.cn.seq = seq;
 	packet.cn.ack = ack + 1;
-	packet.cn.len = sizeof(packet);
-	packet.cn.flags = 0;
+	packet.cn.len = sizeof(packet.msg);
+	packet.cn.flags = flags;
 	packet.msg.opcode = LIBRPC_ACK;
+	packet.msg.address = 0;
 	packet.msg.status = error;
 
 	ret = cn_netlink_send(&packet.cn, portid, 0, GFP_KERNEL);
@@ -372,6 +587,47 @@ librpc_cn_send_ack(uint32_t seq, uint32_t ack, uint32_t portid, int error)
 		printk("librpc_cn_send_ack: send failed, err=%d\n", ret);
 }
 
+/*
+ * Sends a response or an event, split into fragments of at most
+ * LIBRPC_FRAGMENT_SIZE bytes.
+ */
+static void
+librpc_cn_send_frame(int opcode, int status, uint32_t portid, const void *buf,
+    size_t length)
+{
+	struct cn_msg *cn;
+	struct librpc_message *msg;
+	size_t off = 0;
+	size_t chunk;
+
+	cn = kmalloc(sizeof(*cn) + sizeof(*msg) +
+	    min_t(size_t, length, LIBRPC_FRAGMENT_SIZE), GFP_KERNEL);
+	if (cn == NULL) {
+		printk("librpc_cn_send_frame: out of memory\n");
+		return;
+	}
+
+	msg = (struct librpc_message *)(cn + 1);
+
+	do {
+		chunk = min_t(size_t, length - off, LIBRPC_FRAGMENT_SIZE);
+		cn->id = librpc_cb_id;
+		cn->seq = resp_seq++;
+		cn->ack = 0;
+		cn->len = sizeof(*msg) + chunk;
+		cn->flags = off + chunk < length ? LIBRPC_FLAG_MORE : 0;
+		msg->opcode = opcode;
+		msg->address = 0;
+		msg->status = status;
+		memcpy(msg->data, buf + off, chunk);
+
+		cn_netlink_send(cn, portid, 0, GFP_KERNEL);
+		off += chunk;
+	} while (off < length);
+
+	kfree(cn);
+}
+
 static void
 librpc_cn_send_presence(int opcode, uint32_t address,
     struct librpc_endpoint *endpoint)
@@ -434,6 +690,235 @@ librpc_device_show_serial(struct device *dev, struct device_attribute *attr,
 	return (sprintf(buf, "%s\n", rpcdev->endp.serial));
 }
 
+static struct librpc_ring_buf *
+librpc_ring_alloc(void)
+{
+	struct librpc_ring_buf *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (ring == NULL)
+		return (NULL);
+
+	ring->hdr = vmalloc_user(PAGE_SIZE + LIBRPC_RING_SIZE);
+	if (ring->hdr == NULL) {
+		kfree(ring);
+		return (NULL);
+	}
+
+	ring->hdr->size = LIBRPC_RING_SIZE;
+	ring->data = (char *)ring->hdr + PAGE_SIZE;
+	kref_init(&ring->kref);
+	spin_lock_init(&ring->lock);
+	init_waitqueue_head(&ring->wq);
+	return (ring);
+}
+
+static void
+librpc_ring_free(struct kref *kref)
+{
+	struct librpc_ring_buf *ring;
+
+	ring = container_of(kref, struct librpc_ring_buf, kref);
+	if (ring->efd != NULL)
+		eventfd_ctx_put(ring->efd);
+
+	vfree(ring->hdr);
+	kfree(ring);
+}
+
+static void
+librpc_ring_kill(struct librpc_ring_buf *ring)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	ring->dead = true;
+	if (ring->efd != NULL)
+		eventfd_signal(ring->efd, 1);
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	wake_up_interruptible(&ring->wq);
+	kref_put(&ring->kref, librpc_ring_free);
+}
+
+/*
+ * Queues a record for the consumer. Returns false if there's no
+ * consumer, in which case the caller delivers the record the old way.
+ * The consumer owns tail and may scribble over it, so it's sanity
+ * checked: a bogus tail makes the ring look full.
+ */
+static bool
+librpc_ring_put(struct librpc_ring_buf *ring, int opcode, const void *buf,
+    size_t len)
+{
+	struct librpc_ring *hdr = ring->hdr;
+	struct librpc_ring_record *rec;
+	unsigned long flags;
+	uint64_t head;
+	uint64_t tail;
+	size_t need;
+	size_t off;
+	size_t pad = 0;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if (!ring->open || ring->dead) {
+		spin_unlock_irqrestore(&ring->lock, flags);
+		return (false);
+	}
+
+	head = hdr->head;
+	tail = smp_load_acquire(&hdr->tail);
+	need = ALIGN(sizeof(*rec) + len, LIBRPC_RING_ALIGN);
+	off = head % LIBRPC_RING_SIZE;
+	if (off + need > LIBRPC_RING_SIZE)
+		pad = LIBRPC_RING_SIZE - off;
+
+	if (head - tail > LIBRPC_RING_SIZE ||
+	    head - tail + pad + need > LIBRPC_RING_SIZE) {
+		hdr->dropped++;
+		spin_unlock_irqrestore(&ring->lock, flags);
+		return (true);
+	}
+
+	if (pad != 0) {
+		rec = (struct librpc_ring_record *)(ring->data + off);
+		rec->opcode = LIBRPC_RING_PAD;
+		rec->len = pad - sizeof(*rec);
+		off = 0;
+	}
+
+	rec = (struct librpc_ring_record *)(ring->data + off);
+	rec->opcode = opcode;
+	rec->len = len;
+	memcpy(rec->data, buf, len);
+	smp_store_release(&hdr->head, head + pad + need);
+
+	/*
+	 * Pairs with the consumer publishing tail, then re-reading head:
+	 * either it sees the new head or we see it caught up.
+	 */
+	smp_mb();
+	if (READ_ONCE(hdr->tail) == head) {
+		wake_up_interruptible(&ring->wq);
+		if (ring->efd != NULL)
+			eventfd_signal(ring->efd, 1);
+	}
+
+	spin_unlock_irqrestore(&ring->lock, flags);
+	return (true);
+}
+
+static int
+librpc_ring_open(struct inode *inode, struct file *file)
+{
+	struct librpc_device *rpcdev;
+	struct librpc_ring_buf *ring;
+	unsigned long flags;
+	int ret = 0;
+
+	mutex_lock(&librpc_mtx);
+	rpcdev = idr_find(&librpc_device_ids, iminor(inode));
+	if (rpcdev == NULL) {
+		mutex_unlock(&librpc_mtx);
+		return (-ENODEV);
+	}
+
+	ring = rpcdev->ring;
+	spin_lock_irqsave(&ring->lock, flags);
+	if (ring->open)
+		ret = -EBUSY;
+	else
+		ring->open = true;
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	if (ret == 0) {
+		kref_get(&ring->kref);
+		file->private_data = ring;
+	}
+
+	mutex_unlock(&librpc_mtx);
+	return (ret);
+}
+
+static int
+librpc_ring_release(struct inode *inode, struct file *file)
+{
+	struct librpc_ring_buf *ring = file->private_data;
+	struct eventfd_ctx *efd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	ring->open = false;
+	efd = ring->efd;
+	ring->efd = NULL;
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	if (efd != NULL)
+		eventfd_ctx_put(efd);
+
+	kref_put(&ring->kref, librpc_ring_free);
+	return (0);
+}
+
+static int
+librpc_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct librpc_ring_buf *ring = file->private_data;
+
+	if (vma->vm_pgoff != 0 ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + LIBRPC_RING_SIZE)
+		return (-EINVAL);
+
+	return (remap_vmalloc_range(vma, ring->hdr, 0));
+}
+
+static unsigned int
+librpc_ring_poll(struct file *file, poll_table *wait)
+{
+	struct librpc_ring_buf *ring = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &ring->wq, wait);
+
+	if (READ_ONCE(ring->dead))
+		mask |= POLLHUP;
+
+	if (READ_ONCE(ring->hdr->head) != READ_ONCE(ring->hdr->tail))
+		mask |= POLLIN | POLLRDNORM;
+
+	return (mask);
+}
+
+static long
+librpc_ring_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct librpc_ring_buf *ring = file->private_data;
+	struct eventfd_ctx *efd = NULL;
+	unsigned long flags;
+	int fd;
+
+	if (cmd != LIBRPC_IOC_SET_EVENTFD)
+		return (-ENOTTY);
+
+	if (get_user(fd, (int __user *)arg))
+		return (-EFAULT);
+
+	if (fd >= 0) {
+		efd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(efd))
+			return (PTR_ERR(efd));
+	}
+
+	spin_lock_irqsave(&ring->lock, flags);
+	swap(ring->efd, efd);
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	if (efd != NULL)
+		eventfd_ctx_put(efd);
+
+	return (0);
+}
+
 static int
 librpc_device_destroy(struct device *dev, void *data)
 {
@@ -455,6 +940,10 @@ librpc_init(void)
 	if (ret != 0)
 		goto done;
 
+	ret = alloc_chrdev_region(&librpc_devt, 0, 64, "librpc");
+	if (ret != 0)
+		goto done;
+
 	librpc_class = class_create(THIS_MODULE, "librpc");
 	if (IS_ERR(librpc_class)) {
 		ret = PTR_ERR(librpc_class);
@@ -489,6 +978,7 @@ librpc_exit(void)
 	bus_for_each_dev(&librpc_bus_type, NULL, NULL, librpc_device_destroy);
 	device_destroy(librpc_class, MKDEV(0, 0));
 	class_destroy(librpc_class);
+	unregister_chrdev_region(librpc_devt, 64);
 	bus_unregister(&librpc_bus_type);
 }
 
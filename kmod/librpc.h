@@ -36,6 +36,66 @@
 #define CN_LIBRPC_IDX           (CN_NETLINK_USERS + 5)
 #define CN_LIBRPC_VAL           1
 
+/*
+ * Flags carried in cn_msg.flags.
+ *
+ * Frames larger than LIBRPC_FRAGMENT_SIZE are split into fragments, all
+ * but the last one flagged LIBRPC_FLAG_MORE. Senders that keep several
+ * messages in flight flag them LIBRPC_FLAG_WINDOW; the kernel then acks
+ * them in batches with LIBRPC_FLAG_CUMULATIVE acks, each of which covers
+ * every message up to its sequence number. LIBRPC_FLAG_ACK_NOW asks for
+ * the batch to be acked right away. Failed messages are always acked
+ * on their own, right away.
+ */
+#define LIBRPC_FLAG_MORE        0x0001
+#define LIBRPC_FLAG_WINDOW      0x0002
+#define LIBRPC_FLAG_ACK_NOW     0x0004
+#define LIBRPC_FLAG_CUMULATIVE  0x0008
+
+#define LIBRPC_FRAGMENT_SIZE    8192
+#define LIBRPC_ACK_BATCH        8
+#define LIBRPC_MAX_FRAME        (16 * 1024 * 1024)
+
+/*
+ * Every device also gets a character device, /dev/librpcN (N being its
+ * address), through which a single consumer takes device events and logs
+ * from a ring buffer mapped with mmap(). The mapping is one page holding
+ * struct librpc_ring followed by LIBRPC_RING_SIZE bytes of records.
+ *
+ * head is advanced by the kernel and tail by the consumer; both are byte
+ * offsets that only grow and are taken modulo LIBRPC_RING_SIZE. Records
+ * are LIBRPC_RING_ALIGN-aligned and never wrap: one that wouldn't fit
+ * before the end of the ring is preceded by a LIBRPC_RING_PAD record
+ * filling the gap. Records that don't fit in the free space are dropped
+ * and counted.
+ *
+ * While the character device is open, events and logs go to the ring
+ * only. The doorbell (poll() readiness, plus the eventfd registered with
+ * LIBRPC_IOC_SET_EVENTFD, if any) is rung when a record goes into an
+ * empty ring, so a consumer must publish its tail and re-check head
+ * before going to sleep.
+ */
+#define LIBRPC_RING_SIZE        (256 * 1024)
+#define LIBRPC_RING_ALIGN       8
+#define LIBRPC_RING_PAD         0xff
+
+#define LIBRPC_IOC_SET_EVENTFD  _IOW('L', 1, int)
+
+struct librpc_ring
+{
+        uint64_t                head;
+        uint64_t                tail;
+        uint64_t                dropped;
+        uint32_t                size;
+};
+
+struct librpc_ring_record
+{
+        uint32_t                opcode;
+        uint32_t                len;
+        char                    data[];
+};
+
 struct librpc_endpoint
 {
         char                    name[NAME_MAX];
@@ -66,6 +126,8 @@ struct librpc_message
 
 #ifdef __KERNEL__
 
+struct librpc_ring_buf;
+
 struct librpc_device
 {
         int                             address;
@@ -74,6 +136,8 @@ struct librpc_device
         struct module *                 owner;
         struct device                   dev;
         const struct librpc_ops *       ops;
+        struct cdev *                   cdev;
+        struct librpc_ring_buf *        ring;
 };
 
 struct librpc_ops
@@ -30,6 +30,12 @@
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/scatterlist.h>
 #include <linux/usb.h>
 #include "librpc.h"
 
@@ -43,9 +49,28 @@ static int librpc_usb_request(struct device *, void *, const void *, size_t);
 static int librpc_usb_xfer(struct usb_device *, int, void *, size_t, int);
 static void librpc_usb_read_log(struct librpc_usb_device *);
 static int librpc_usb_thread(void *);
+static int librpc_usb_bulk_start(struct librpc_usb_device *);
+static void librpc_usb_bulk_stop(struct librpc_usb_device *);
+static int librpc_usb_bulk_request(struct librpc_usb_device *, struct device *,
+    void *, const void *, size_t);
+static void librpc_usb_rx_complete(struct urb *);
+static void librpc_usb_rx_work(struct work_struct *);
 
 #define	LIBRPC_MAX_MSGSIZE	4095
 
+/*
+ * Devices exposing a pair of bulk endpoints get the bulk data path:
+ * requests go out through bulk OUT, split in chunks submitted together,
+ * and responses, events and logs come back on bulk IN, which always has
+ * LIBRPC_USB_NURBS transfers queued up. Other devices keep using
+ * control transfers and polling.
+ */
+#define	LIBRPC_USB_NURBS	4
+#define	LIBRPC_USB_BUFSIZE	16384
+#define	LIBRPC_USB_SG_CHUNK	16384
+#define	LIBRPC_USB_TIMEOUT	5000
+#define	LIBRPC_USB_BULK_MAGIC	0x4c525043
+
 enum librpc_usb_opcode
 {
         LIBRPC_USB_PING = 0,
@@ -84,14 +109,78 @@ struct librpc_usb_log
     	char 		buffer[];
 };
 
+enum librpc_usb_bulk_type
+{
+	LIBRPC_USB_BULK_REQUEST = 0,
+	LIBRPC_USB_BULK_RESPONSE,
+	LIBRPC_USB_BULK_EVENT,
+	LIBRPC_USB_BULK_LOG
+};
+
+/*
+ * Every message on the bulk endpoints starts with this header; the
+ * payload follows right after it and may span several transfers.
+ * Responses carry the id of the request they answer.
+ */
+struct librpc_usb_bulk_header
+{
+	__le32		magic;
+	__le32		length;
+	uint8_t		type;
+	uint8_t		status;
+	__le16		id;
+} __packed;
+
+struct librpc_usb_call
+{
+	struct list_head	list;
+	struct completion	done;
+	uint16_t		id;
+	int			error;
+	uint8_t			status;
+	void *			data;
+	size_t			len;
+};
+
+struct librpc_usb_rx
+{
+	struct list_head		list;
+	struct librpc_usb_device *	rpcusbdev;
+	struct urb *			urb;
+	void *				buf;
+};
+
 struct librpc_usb_device {
+	struct list_head		link;
     	struct usb_device *		udev;
         struct librpc_device *  	rpcdev;
     	struct task_struct *		thread;
 	struct librpc_usb_response *	event;
 	struct librpc_usb_log *		log;
+
+	/* Bulk data path */
+	bool				bulk;
+	bool				gone;
+	unsigned int			in_pipe;
+	unsigned int			out_pipe;
+	struct usb_anchor		in_anchor;
+	struct librpc_usb_rx		rx[LIBRPC_USB_NURBS];
+	struct list_head		rx_done;
+	spinlock_t			rx_lock;
+	struct work_struct		rx_work;
+	struct librpc_usb_bulk_header	rx_hdr;
+	size_t				rx_hdr_len;
+	void *				rx_buf;
+	size_t				rx_len;
+	struct mutex			send_mtx;
+	spinlock_t			call_lock;
+	struct list_head		calls;
+	uint16_t			next_id;
 };
 
+static LIST_HEAD(librpc_usb_devices);
+static DEFINE_MUTEX(librpc_usb_devices_mtx);
+
 static struct librpc_ops librpc_usb_ops = {
         .open = NULL,
         .release = NULL,
@@ -100,11 +189,30 @@ static struct librpc_ops librpc_usb_ops = {
         .request = librpc_usb_request
 };
 
+static struct librpc_usb_device *
+librpc_usb_lookup(struct usb_device *udev)
+{
+	struct librpc_usb_device *rpcusbdev;
+
+	mutex_lock(&librpc_usb_devices_mtx);
+	list_for_each_entry(rpcusbdev, &librpc_usb_devices, link) {
+		if (rpcusbdev->udev == udev) {
+			mutex_unlock(&librpc_usb_devices_mtx);
+			return (rpcusbdev);
+		}
+	}
+
+	mutex_unlock(&librpc_usb_devices_mtx);
+	return (NULL);
+}
+
 static int
 librpc_usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 {
         struct librpc_usb_device *rpcusbdev;
         struct usb_device *udev = interface_to_usbdev(intf);
+        struct usb_endpoint_descriptor *bulk_in;
+        struct usb_endpoint_descriptor *bulk_out;
         struct librpc_endpoint endp;
         int ret;
 
@@ -120,14 +228,54 @@ librpc_usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 
         usb_set_intfdata(intf, rpcusbdev);
 	rpcusbdev->udev = udev;
+	init_usb_anchor(&rpcusbdev->in_anchor);
+	INIT_LIST_HEAD(&rpcusbdev->rx_done);
+	INIT_LIST_HEAD(&rpcusbdev->calls);
+	INIT_WORK(&rpcusbdev->rx_work, librpc_usb_rx_work);
+	spin_lock_init(&rpcusbdev->rx_lock);
+	spin_lock_init(&rpcusbdev->call_lock);
+	mutex_init(&rpcusbdev->send_mtx);
+
+	if (usb_find_common_endpoints(intf->cur_altsetting, &bulk_in,
+	    &bulk_out, NULL, NULL) == 0) {
+		rpcusbdev->bulk = true;
+		rpcusbdev->in_pipe = usb_rcvbulkpipe(udev,
+		    usb_endpoint_num(bulk_in));
+		rpcusbdev->out_pipe = usb_sndbulkpipe(udev,
+		    usb_endpoint_num(bulk_out));
+	}
+
+	mutex_lock(&librpc_usb_devices_mtx);
+	list_add_tail(&rpcusbdev->link, &librpc_usb_devices);
+	mutex_unlock(&librpc_usb_devices_mtx);
+
+	if (rpcusbdev->bulk) {
+		ret = librpc_usb_bulk_start(rpcusbdev);
+		if (ret != 0) {
+			dev_warn(&udev->dev, "bulk data path unavailable: %d\n",
+			    ret);
+			librpc_usb_bulk_stop(rpcusbdev);
+			rpcusbdev->bulk = false;
+		}
+	}
+
         rpcusbdev->rpcdev = librpc_device_register("usb", &udev->dev,
             &librpc_usb_ops, THIS_MODULE);
 
 	if (IS_ERR(rpcusbdev->rpcdev)) {
+		ret = PTR_ERR(rpcusbdev->rpcdev);
+		librpc_usb_bulk_stop(rpcusbdev);
+		mutex_lock(&librpc_usb_devices_mtx);
+		list_del(&rpcusbdev->link);
+		mutex_unlock(&librpc_usb_devices_mtx);
 		kfree(rpcusbdev);
-		return (PTR_ERR(rpcusbdev->rpcdev));
+		return (ret);
 	}
 
+	/* Bulk IN delivers events and logs, no need to poll for them */
+	if (rpcusbdev->bulk)
+		return (0);
+
 	rpcusbdev->event = kmalloc(
 	    sizeof(*rpcusbdev->event) + LIBRPC_MAX_MSGSIZE, GFP_KERNEL);
 	rpcusbdev->log = kmalloc(
@@ -142,8 +290,352 @@ librpc_usb_disconnect(struct usb_interface *intf)
 {
         struct librpc_usb_device *rpcusbdev = usb_get_intfdata(intf);
 
-	kthread_stop(rpcusbdev->thread);
+	if (rpcusbdev->thread != NULL)
+		kthread_stop(rpcusbdev->thread);
+
+	librpc_usb_bulk_stop(rpcusbdev);
 	librpc_device_unregister(rpcusbdev->rpcdev);
+
+	mutex_lock(&librpc_usb_devices_mtx);
+	list_del(&rpcusbdev->link);
+	mutex_unlock(&librpc_usb_devices_mtx);
+
+	kfree(rpcusbdev->event);
+	kfree(rpcusbdev->log);
+	kfree(rpcusbdev);
+}
+
+static int
+librpc_usb_bulk_start(struct librpc_usb_device *rpcusbdev)
+{
+	struct librpc_usb_rx *rx;
+	int ret;
+	int i;
+
+	for (i = 0; i < LIBRPC_USB_NURBS; i++) {
+		rx = &rpcusbdev->rx[i];
+		rx->rpcusbdev = rpcusbdev;
+		rx->urb = usb_alloc_urb(0, GFP_KERNEL);
+		rx->buf = kmalloc(LIBRPC_USB_BUFSIZE, GFP_KERNEL);
+		if (rx->urb == NULL || rx->buf == NULL)
+			return (-ENOMEM);
+
+		usb_fill_bulk_urb(rx->urb, rpcusbdev->udev, rpcusbdev->in_pipe,
+		    rx->buf, LIBRPC_USB_BUFSIZE, librpc_usb_rx_complete, rx);
+		usb_anchor_urb(rx->urb, &rpcusbdev->in_anchor);
+		ret = usb_submit_urb(rx->urb, GFP_KERNEL);
+		if (ret != 0) {
+			usb_unanchor_urb(rx->urb);
+			return (ret);
+		}
+	}
+
+	return (0);
+}
+
+static void
+librpc_usb_bulk_stop(struct librpc_usb_device *rpcusbdev)
+{
+	struct librpc_usb_call *call, *tmp;
+	unsigned long flags;
+	int i;
+
+	rpcusbdev->gone = true;
+	usb_kill_anchored_urbs(&rpcusbdev->in_anchor);
+	cancel_work_sync(&rpcusbdev->rx_work);
+
+	for (i = 0; i < LIBRPC_USB_NURBS; i++) {
+		usb_free_urb(rpcusbdev->rx[i].urb);
+		kfree(rpcusbdev->rx[i].buf);
+		rpcusbdev->rx[i].urb = NULL;
+		rpcusbdev->rx[i].buf = NULL;
+	}
+
+	kfree(rpcusbdev->rx_buf);
+	rpcusbdev->rx_buf = NULL;
+
+	/* Fail whatever is still waiting for a response */
+	spin_lock_irqsave(&rpcusbdev->call_lock, flags);
+	list_for_each_entry_safe(call, tmp, &rpcusbdev->calls, list) {
+		list_del_init(&call->list);
+		call->error = -ENODEV;
+		complete(&call->done);
+	}
+	spin_unlock_irqrestore(&rpcusbdev->call_lock, flags);
+}
+
+/*
+ * Bulk IN completions only queue the transfer up; it's parsed, and
+ * resubmitted, from rx_work. Transfers on an endpoint complete in
+ * order, so the stream is put back together in order too.
+ */
+static void
+librpc_usb_rx_complete(struct urb *urb)
+{
+	struct librpc_usb_rx *rx = urb->context;
+	struct librpc_usb_device *rpcusbdev = rx->rpcusbdev;
+	unsigned long flags;
+
+	switch (urb->status) {
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+	case -ENODEV:
+		return;
+
+	default:
+		break;
+	}
+
+	spin_lock_irqsave(&rpcusbdev->rx_lock, flags);
+	list_add_tail(&rx->list, &rpcusbdev->rx_done);
+	spin_unlock_irqrestore(&rpcusbdev->rx_lock, flags);
+	schedule_work(&rpcusbdev->rx_work);
+}
+
+static void
+librpc_usb_rx_deliver(struct librpc_usb_device *rpcusbdev)
+{
+	struct librpc_usb_bulk_header *hdr = &rpcusbdev->rx_hdr;
+	struct librpc_usb_call *call;
+	struct librpc_usb_call *found = NULL;
+	void *buf = rpcusbdev->rx_buf;
+	size_t len = rpcusbdev->rx_len;
+	unsigned long flags;
+
+	rpcusbdev->rx_buf = NULL;
+	rpcusbdev->rx_len = 0;
+	rpcusbdev->rx_hdr_len = 0;
+
+	switch (hdr->type) {
+	case LIBRPC_USB_BULK_RESPONSE:
+		spin_lock_irqsave(&rpcusbdev->call_lock, flags);
+		list_for_each_entry(call, &rpcusbdev->calls, list) {
+			if (call->id == le16_to_cpu(hdr->id)) {
+				found = call;
+				break;
+			}
+		}
+
+		if (found != NULL) {
+			list_del_init(&found->list);
+			found->status = hdr->status;
+			found->data = buf;
+			found->len = len;
+			complete(&found->done);
+			buf = NULL;
+		}
+		spin_unlock_irqrestore(&rpcusbdev->call_lock, flags);
+
+		if (found == NULL) {
+			dev_warn(&rpcusbdev->udev->dev,
+			    "response to unknown request %u\n",
+			    le16_to_cpu(hdr->id));
+		}
+		break;
+
+	case LIBRPC_USB_BULK_EVENT:
+		librpc_device_event(&rpcusbdev->udev->dev, buf, len);
+		break;
+
+	case LIBRPC_USB_BULK_LOG:
+		librpc_device_log(&rpcusbdev->udev->dev, buf, len);
+		break;
+	}
+
+	kfree(buf);
+}
+
+static void
+librpc_usb_rx_parse(struct librpc_usb_device *rpcusbdev, const uint8_t *data,
+    size_t len)
+{
+	struct librpc_usb_bulk_header *hdr = &rpcusbdev->rx_hdr;
+	size_t want;
+	size_t n;
+
+	while (len > 0) {
+		if (rpcusbdev->rx_hdr_len < sizeof(*hdr)) {
+			n = min(len, sizeof(*hdr) - rpcusbdev->rx_hdr_len);
+			memcpy((uint8_t *)hdr + rpcusbdev->rx_hdr_len, data, n);
+			rpcusbdev->rx_hdr_len += n;
+			data += n;
+			len -= n;
+
+			if (rpcusbdev->rx_hdr_len < sizeof(*hdr))
+				return;
+
+			/* Out of sync; drop the rest of this transfer */
+			if (le32_to_cpu(hdr->magic) != LIBRPC_USB_BULK_MAGIC ||
+			    le32_to_cpu(hdr->length) > LIBRPC_MAX_FRAME) {
+				dev_err(&rpcusbdev->udev->dev,
+				    "malformed message on bulk IN\n");
+				rpcusbdev->rx_hdr_len = 0;
+				return;
+			}
+
+			rpcusbdev->rx_buf = kmalloc(
+			    max_t(size_t, le32_to_cpu(hdr->length), 1),
+			    GFP_KERNEL);
+			rpcusbdev->rx_len = 0;
+			if (rpcusbdev->rx_buf == NULL) {
+				rpcusbdev->rx_hdr_len = 0;
+				return;
+			}
+		}
+
+		want = le32_to_cpu(hdr->length);
+		n = min(len, want - rpcusbdev->rx_len);
+		memcpy(rpcusbdev->rx_buf + rpcusbdev->rx_len, data, n);
+		rpcusbdev->rx_len += n;
+		data += n;
+		len -= n;
+
+		if (rpcusbdev->rx_len == want)
+			librpc_usb_rx_deliver(rpcusbdev);
+	}
+}
+
+static void
+librpc_usb_rx_work(struct work_struct *work)
+{
+	struct librpc_usb_device *rpcusbdev = container_of(work,
+	    struct librpc_usb_device, rx_work);
+	struct librpc_usb_rx *rx;
+	unsigned long flags;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&rpcusbdev->rx_lock, flags);
+		rx = list_first_entry_or_null(&rpcusbdev->rx_done,
+		    struct librpc_usb_rx, list);
+		if (rx != NULL)
+			list_del(&rx->list);
+		spin_unlock_irqrestore(&rpcusbdev->rx_lock, flags);
+
+		if (rx == NULL)
+			break;
+
+		if (rx->urb->status == 0) {
+			librpc_usb_rx_parse(rpcusbdev, rx->buf,
+			    rx->urb->actual_length);
+		} else {
+			dev_dbg(&rpcusbdev->udev->dev,
+			    "bulk IN transfer failed: %d\n", rx->urb->status);
+		}
+
+		if (rpcusbdev->gone)
+			continue;
+
+		usb_anchor_urb(rx->urb, &rpcusbdev->in_anchor);
+		ret = usb_submit_urb(rx->urb, GFP_KERNEL);
+		if (ret != 0) {
+			usb_unanchor_urb(rx->urb);
+			dev_err(&rpcusbdev->udev->dev,
+			    "resubmitting bulk IN failed: %d\n", ret);
+		}
+	}
+}
+
+/*
+ * Sends the request as a scatter-gather transfer: the header and the
+ * payload, in chunks, go out without being copied together first.
+ * Without scatter-gather support in the host controller, the core
+ * turns each chunk into a URB of its own and keeps them all in flight.
+ */
+static int
+librpc_usb_bulk_request(struct librpc_usb_device *rpcusbdev,
+    struct device *dev, void *cookie, const void *buf, size_t len)
+{
+	struct librpc_usb_bulk_header *hdr;
+	struct librpc_usb_call call;
+	struct usb_sg_request io;
+	struct scatterlist *sg;
+	unsigned long flags;
+	size_t nents;
+	size_t chunk;
+	size_t off;
+	int ret;
+	int i;
+
+	init_completion(&call.done);
+	INIT_LIST_HEAD(&call.list);
+	call.error = 0;
+	call.status = LIBRPC_USB_OK;
+	call.data = NULL;
+	call.len = 0;
+
+	nents = 1 + DIV_ROUND_UP(len, LIBRPC_USB_SG_CHUNK);
+	hdr = kzalloc(sizeof(*hdr), GFP_KERNEL);
+	sg = kmalloc_array(nents, sizeof(*sg), GFP_KERNEL);
+	if (hdr == NULL || sg == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	sg_init_table(sg, nents);
+	sg_set_buf(&sg[0], hdr, sizeof(*hdr));
+	for (i = 1, off = 0; off < len; i++, off += chunk) {
+		chunk = min_t(size_t, len - off, LIBRPC_USB_SG_CHUNK);
+		sg_set_buf(&sg[i], buf + off, chunk);
+	}
+
+	mutex_lock(&rpcusbdev->send_mtx);
+	call.id = rpcusbdev->next_id++;
+	hdr->magic = cpu_to_le32(LIBRPC_USB_BULK_MAGIC);
+	hdr->length = cpu_to_le32(len);
+	hdr->type = LIBRPC_USB_BULK_REQUEST;
+	hdr->id = cpu_to_le16(call.id);
+
+	spin_lock_irqsave(&rpcusbdev->call_lock, flags);
+	list_add_tail(&call.list, &rpcusbdev->calls);
+	spin_unlock_irqrestore(&rpcusbdev->call_lock, flags);
+
+	ret = usb_sg_init(&io, rpcusbdev->udev, rpcusbdev->out_pipe, 0, sg,
+	    nents, 0, GFP_KERNEL);
+	if (ret == 0) {
+		usb_sg_wait(&io);
+		ret = io.status;
+	}
+	mutex_unlock(&rpcusbdev->send_mtx);
+
+	if (ret == 0 && wait_for_completion_timeout(&call.done,
+	    msecs_to_jiffies(LIBRPC_USB_TIMEOUT)) == 0)
+		ret = -ETIME;
+
+	/* The response may still have come in after the timeout */
+	spin_lock_irqsave(&rpcusbdev->call_lock, flags);
+	if (!list_empty(&call.list))
+		list_del_init(&call.list);
+	else if (ret == -ETIME)
+		ret = 0;
+	spin_unlock_irqrestore(&rpcusbdev->call_lock, flags);
+
+	if (ret == 0)
+		ret = call.error;
+
+	if (ret != 0) {
+		dev_err(dev, "Bulk request failed: %d\n", ret);
+		goto fail;
+	}
+
+	if (call.status == LIBRPC_USB_OK)
+		librpc_device_answer(dev, cookie, call.data, call.len);
+	else
+		librpc_device_error(dev, cookie, -EIO);
+
+	ret = call.status;
+	kfree(call.data);
+	kfree(hdr);
+	kfree(sg);
+	return (ret);
+
+fail:
+	librpc_device_error(dev, cookie, ret);
+	kfree(call.data);
+	kfree(hdr);
+	kfree(sg);
+	return (ret);
 }
 
 static int
@@ -201,9 +693,15 @@ librpc_usb_request(struct device *dev, void *cookie, const void *buf, size_t len
 	struct librpc_usb_response *resp;
 	int wpipe = usb_sndctrlpipe(udev, 0);
 	int rpipe = usb_rcvctrlpipe(udev, 0);
+	struct librpc_usb_device *rpcusbdev;
 	int ret, status;
 	int errcnt = 500;
 
+	rpcusbdev = librpc_usb_lookup(udev);
+	if (rpcusbdev != NULL && rpcusbdev->bulk)
+		return (librpc_usb_bulk_request(rpcusbdev, dev, cookie, buf,
+		    len));
+
 	resp = kmalloc(sizeof(*resp) + LIBRPC_MAX_MSGSIZE, GFP_KERNEL);
 	ret = usb_control_msg(udev, wpipe, LIBRPC_USB_SEND_REQ, USB_TYPE_VENDOR,
 	    0, 0, (void *)buf, len, 500);
@@ -45,24 +45,30 @@ builtin_serialize(rpc_object_t obj)
 static rpc_object_t
 builtin_deserialize(rpc_object_t obj)
 {
+	struct rpc_dictionary_iter diter;
+	struct rpc_array_iter aiter;
 	rpc_object_t result;
+	rpc_object_t value;
+	const char *key;
 
 	if (rpc_get_type(obj) == RPC_TYPE_DICTIONARY) {
 		result = rpc_dictionary_create();
-		rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t value) {
-			rpc_dictionary_steal_value(result, key, rpct_deserialize(value));
-			return ((bool)true);
-		});
+		rpc_dictionary_iter_init(obj, &diter);
+		while (rpc_dictionary_iter_next(&diter, &key, &value)) {
+			rpc_dictionary_steal_value(result, key,
+			    rpct_deserialize(value));
+		}
 
 		return (result);
 	}
 
 	if (rpc_get_type(obj) == RPC_TYPE_ARRAY) {
 		result = rpc_array_create();
-		rpc_array_apply(obj, ^(size_t i __unused, rpc_object_t value) {
-			rpc_array_append_stolen_value(result, rpct_deserialize(value));
-			return ((bool)true);
-		});
+		rpc_array_iter_init(obj, &aiter);
+		while (rpc_array_iter_next(&aiter, NULL, &value)) {
+			rpc_array_append_stolen_value(result,
+			    rpct_deserialize(value));
+		}
 
 		return (result);
 	}
@@ -25,14 +25,234 @@
  */
 
 #include <assert.h>
+#include <glib.h>
 #include "../linker_set.h"
 #include "../internal.h"
 
+/*
+ * Containers with at least CONTAINER_PARALLEL_MIN values are validated
+ * in chunks of CONTAINER_CHUNK values, shared between the calling
+ * thread and a pool of helpers. Each chunk collects its own errors and
+ * stops at its first invalid value; the results are then merged in
+ * chunk order up to the first failed chunk, which gives the same errors
+ * validating serially would.
+ */
+#define	CONTAINER_PARALLEL_MIN	4096
+#define	CONTAINER_CHUNK		1024
+
+struct container_chunk
+{
+	GPtrArray *		errors;
+	bool			failed;
+};
+
+struct container_job
+{
+	rpct_typei_t		typei;
+	rpc_object_t *		values;
+	const char **		keys;		/* NULL for arrays */
+	const char *		path;
+	size_t			count;
+	guint			nchunks;
+	volatile gint		next;
+	volatile gint		first_failed;
+	volatile gint		refcnt;
+	guint			completed;
+	GMutex			mtx;
+	GCond			cv;
+	struct container_chunk *chunks;
+};
+
+static GThreadPool *container_pool;
+
+static void
+container_error_free(struct rpct_validation_error *err)
+{
+
+	g_free(err->path);
+	g_free(err->message);
+	if (err->extra != NULL)
+		rpc_release(err->extra);
+
+	g_free(err);
+}
+
+static void
+container_job_unref(struct container_job *job)
+{
+	guint i;
+
+	if (!g_atomic_int_dec_and_test(&job->refcnt))
+		return;
+
+	for (i = 0; i < job->nchunks; i++) {
+		if (job->chunks[i].errors != NULL)
+			g_ptr_array_free(job->chunks[i].errors, true);
+	}
+
+	g_mutex_clear(&job->mtx);
+	g_cond_clear(&job->cv);
+	g_free(job->chunks);
+	g_free(job);
+}
+
+static void
+container_run_chunk(struct container_job *job, guint c)
+{
+	struct container_chunk *chunk = &job->chunks[c];
+	struct rpct_error_context ctx;
+	struct rpct_error_context newctx;
+	char name[32];
+	size_t i;
+	size_t end;
+	gint failed;
+
+	ctx.path = (char *)job->path;
+	ctx.errors = chunk->errors;
+	end = MIN((c + 1) * (size_t)CONTAINER_CHUNK, job->count);
+
+	/* Nothing past an earlier failure ends up in the result */
+	for (i = c * (size_t)CONTAINER_CHUNK; i < end; i++) {
+		if ((gint)c > g_atomic_int_get(&job->first_failed))
+			break;
+
+		if (job->keys == NULL)
+			g_snprintf(name, sizeof(name), "%zu", i);
+
+		rpct_derive_error_context(&newctx, &ctx,
+		    job->keys != NULL ? job->keys[i] : name);
+		if (!rpct_validate_instance(job->typei, job->values[i],
+		    &newctx))
+			chunk->failed = true;
+
+		rpct_release_error_context(&newctx);
+		if (chunk->failed)
+			break;
+	}
+
+	if (chunk->failed) {
+		do {
+			failed = g_atomic_int_get(&job->first_failed);
+			if (failed <= (gint)c)
+				break;
+		} while (!g_atomic_int_compare_and_exchange(&job->first_failed,
+		    failed, (gint)c));
+	}
+
+	g_mutex_lock(&job->mtx);
+	if (++job->completed == job->nchunks)
+		g_cond_broadcast(&job->cv);
+
+	g_mutex_unlock(&job->mtx);
+}
+
+static void
+container_work(struct container_job *job)
+{
+	gint c;
+
+	for (;;) {
+		c = g_atomic_int_add(&job->next, 1);
+		if (c >= (gint)job->nchunks)
+			break;
+
+		container_run_chunk(job, (guint)c);
+	}
+}
+
+static void
+container_helper(gpointer data, gpointer user_data __unused)
+{
+	struct container_job *job = data;
+
+	container_work(job);
+	container_job_unref(job);
+}
+
+static gpointer
+container_pool_create(gpointer data __unused)
+{
+
+	container_pool = g_thread_pool_new(container_helper, NULL,
+	    (gint)g_get_num_processors(), false, NULL);
+	return (NULL);
+}
+
+/*
+ * The calling thread works on chunks too, so the call makes progress
+ * even when all the helpers are busy, and only waits for chunks that
+ * are actually being worked on.
+ */
+static bool
+container_validate_parallel(rpct_typei_t typei, rpc_object_t *values,
+    const char **keys, size_t count, struct rpct_error_context *errctx)
+{
+	static GOnce pool_once = G_ONCE_INIT;
+	struct container_job *job;
+	struct container_chunk *chunk;
+	bool failed = false;
+	guint nhelpers;
+	guint c;
+	guint i;
+
+	g_once(&pool_once, container_pool_create, NULL);
+
+	job = g_malloc0(sizeof(*job));
+	job->typei = typei;
+	job->values = values;
+	job->keys = keys;
+	job->path = errctx->path;
+	job->count = count;
+	job->nchunks = (guint)((count + CONTAINER_CHUNK - 1) / CONTAINER_CHUNK);
+	job->first_failed = G_MAXINT;
+	job->refcnt = 1;
+	job->chunks = g_new0(struct container_chunk, job->nchunks);
+	g_mutex_init(&job->mtx);
+	g_cond_init(&job->cv);
+
+	for (c = 0; c < job->nchunks; c++)
+		job->chunks[c].errors = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)container_error_free);
+
+	nhelpers = MIN(job->nchunks - 1, g_get_num_processors());
+	for (i = 0; i < nhelpers; i++) {
+		g_atomic_int_inc(&job->refcnt);
+		g_thread_pool_push(container_pool, job, NULL);
+	}
+
+	container_work(job);
+
+	g_mutex_lock(&job->mtx);
+	while (job->completed < job->nchunks)
+		g_cond_wait(&job->cv, &job->mtx);
+
+	g_mutex_unlock(&job->mtx);
+
+	for (c = 0; c < job->nchunks && !failed; c++) {
+		chunk = &job->chunks[c];
+		for (i = 0; i < chunk->errors->len; i++) {
+			g_ptr_array_add(errctx->errors,
+			    g_ptr_array_index(chunk->errors, i));
+		}
+
+		/* The errors now belong to the caller */
+		g_ptr_array_set_free_func(chunk->errors, NULL);
+		failed = chunk->failed;
+	}
+
+	container_job_unref(job);
+	return (!failed);
+}
+
 static bool
 container_validate(struct rpct_typei *typei, rpc_object_t obj,
     struct rpct_error_context *errctx)
 {
 	rpct_typei_t value_typei;
+	rpc_object_t *values;
+	const char **keys;
+	__block size_t n = 0;
+	size_t count;
 	bool fail;
 
 	/*
@@ -45,6 +265,20 @@ container_validate(struct rpct_typei *typei, rpc_object_t obj,
 
 	switch (rpc_get_type(obj)) {
 	case RPC_TYPE_ARRAY:
+		count = rpc_array_get_count(obj);
+		if (count >= CONTAINER_PARALLEL_MIN) {
+			values = g_new(rpc_object_t, count);
+			rpc_array_apply(obj, ^(size_t idx, rpc_object_t value) {
+				values[idx] = value;
+				return ((bool)true);
+			});
+
+			fail = !container_validate_parallel(value_typei,
+			    values, NULL, count, errctx);
+			g_free(values);
+			break;
+		}
+
 		fail = rpc_array_apply(obj, ^(size_t idx, rpc_object_t value) {
 			struct rpct_error_context newctx;
 			char *name = g_strdup_printf("%zu", idx);
@@ -59,6 +293,24 @@ container_validate(struct rpct_typei *typei, rpc_object_t obj,
 		break;
 
 	case RPC_TYPE_DICTIONARY:
+		count = rpc_dictionary_get_count(obj);
+		if (count >= CONTAINER_PARALLEL_MIN) {
+			values = g_new(rpc_object_t, count);
+			keys = g_new(const char *, count);
+			rpc_dictionary_apply(obj, ^(const char *key,
+			    rpc_object_t value) {
+				keys[n] = key;
+				values[n++] = value;
+				return ((bool)true);
+			});
+
+			fail = !container_validate_parallel(value_typei,
+			    values, keys, n, errctx);
+			g_free(values);
+			g_free(keys);
+			break;
+		}
+
 		fail = rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t value) {
 			struct rpct_error_context newctx;
 			bool ret;
@@ -86,7 +338,11 @@ container_validate(struct rpct_typei *typei, rpc_object_t obj,
 static rpc_object_t
 container_serialize(rpc_object_t obj)
 {
+	struct rpc_dictionary_iter diter;
+	struct rpc_array_iter aiter;
 	rpc_object_t value;
+	const char *k;
+	rpc_object_t v;
 
 	assert(obj != NULL);
 	assert(obj->ro_typei != NULL);
@@ -94,18 +350,16 @@ container_serialize(rpc_object_t obj)
 	switch (rpc_get_type(obj)) {
 	case RPC_TYPE_ARRAY:
 		value = rpc_array_create();
-		rpc_array_apply(obj, ^(size_t idx, rpc_object_t v) {
+		rpc_array_iter_init(obj, &aiter);
+		while (rpc_array_iter_next(&aiter, NULL, &v))
 			rpc_array_append_stolen_value(value, rpct_serialize(v));
-			return ((bool)true);
-		});
 		break;
 
 	case RPC_TYPE_DICTIONARY:
 		value = rpc_dictionary_create();
-		rpc_dictionary_apply(obj, ^(const char *k, rpc_object_t v) {
+		rpc_dictionary_iter_init(obj, &diter);
+		while (rpc_dictionary_iter_next(&diter, &k, &v))
 			rpc_dictionary_steal_value(value, k, rpct_serialize(v));
-			return ((bool)true);
-		});
 		break;
 
 	default:
@@ -118,24 +372,30 @@ container_serialize(rpc_object_t obj)
 static rpc_object_t
 container_deserialize(rpc_object_t obj)
 {
+	struct rpc_dictionary_iter diter;
+	struct rpc_array_iter aiter;
 	rpc_object_t result;
+	rpc_object_t value;
+	const char *key;
 
 	if (rpc_get_type(obj) == RPC_TYPE_DICTIONARY) {
 		result = rpc_dictionary_create();
-		rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t value) {
-			rpc_dictionary_steal_value(result, key, rpct_deserialize(value));
-			return ((bool)true);
-		});
+		rpc_dictionary_iter_init(obj, &diter);
+		while (rpc_dictionary_iter_next(&diter, &key, &value)) {
+			rpc_dictionary_steal_value(result, key,
+			    rpct_deserialize(value));
+		}
 
 		return (result);
 	}
 
 	if (rpc_get_type(obj) == RPC_TYPE_ARRAY) {
 		result = rpc_array_create();
-		rpc_array_apply(obj, ^(size_t i __unused, rpc_object_t value) {
-			rpc_array_append_stolen_value(result, rpct_deserialize(value));
-			return ((bool)true);
-		});
+		rpc_array_iter_init(obj, &aiter);
+		while (rpc_array_iter_next(&aiter, NULL, &value)) {
+			rpc_array_append_stolen_value(result,
+			    rpct_deserialize(value));
+		}
 
 		return (result);
 	}
@@ -39,6 +39,7 @@
 #include <rpc/server.h>
 #include <rpc/bus.h>
 #include <rpc/typing.h>
+#include <rpc/serializer.h>
 #ifdef LIBDISPATCH_SUPPORT
 #include <dispatch/dispatch.h>
 #endif
@@ -62,6 +63,7 @@
 #define	RPC_TRANSPORT_CREDENTIALS		(1 << 1)
 #define RPC_TRANSPORT_FD_PASSING		(1 << 2)
 #define	RPC_TRANSPORT_NO_RPCT_SERIALIZE		(1 << 3)
+#define	RPC_TRANSPORT_POOLED_RECV		(1 << 4)
 
 #if RPC_DEBUG
 #define debugf(...) 				\
@@ -74,13 +76,53 @@
 #define debugf(...)
 #endif
 
-#define	TYPE_REGEX	"(struct|union|type|container|enum) ([\\w\\.]+)(<(.*)>)?"
 #define	INTERFACE_REGEX	"interface (\\w+)"
-#define	INSTANCE_REGEX	"([\\w\\.]+)(<(.*)>)?"
+
+#if defined(__linux__)
+#define	RPC_TYPE_COUNT	(RPC_TYPE_SHMEM + 1)
+#else
+#define	RPC_TYPE_COUNT	(RPC_TYPE_ERROR + 1)
+#endif
 #define	METHOD_REGEX	"method (\\w+)"
 #define	PROPERTY_REGEX	"property (\\w+)"
 #define	EVENT_REGEX	"event (\\w+)"
 
+#define	RPC_OUTPUT_BUFFER_MIN		(4096)
+#define	RPC_OUTPUT_BUFFER_RETAIN_MAX	(1024 * 1024)
+
+#define	RPC_BINARY_SLICE_MIN		(4096)
+#define	RPC_BINARY_IOV_MIN		(64 * 1024)
+
+#define	RPC_SERIALIZER_CHUNK		(64 * 1024)
+
+#define	RPC_TOKEN_BYTES			(32)
+
+#define	RPC_SEND_BATCH_FRAMES		(64)
+#define	RPC_SEND_BATCH_BYTES		(256 * 1024)
+#define	RPC_SEND_BATCH_IOV		(512)
+
+#define	RPC_SCHEDULER_LEVELS		(RPC_PRIORITY_LOW + 1)
+
+#define	RPC_EVENT_PROFILES		(1 << 5)
+
+#define	RPC_HIST_SUB_BITS		3
+#define	RPC_HIST_SUB_COUNT		(1 << RPC_HIST_SUB_BITS)
+#define	RPC_HIST_BUCKETS					\
+    ((65 - RPC_HIST_SUB_BITS) << RPC_HIST_SUB_BITS)
+
+#define	RPC_SLOW_LOG_SIZE		128
+#define	RPC_BACKTRACE_DEPTH		128
+#define	RPC_LIST_BATCH			64	/* instances per snapshot */
+
+#define	RPC_CALL_SHARDS			16	/* power of 2 */
+#define	RPC_MAGAZINE_SIZE		64
+#define	RPC_MAGAZINE_DEPOT		16	/* full magazines */
+#define	RPC_CACHE_LINE			64
+#define	RPC_CPU_MAX			4096
+
+#define	RPC_CODEL_TARGET		(5 * 1000)	/* us */
+#define	RPC_CODEL_INTERVAL		(100 * 1000)	/* us */
+
 #define CONNECTION_OPEN		(0)
 #define CONNECTION_CLOSED	(1 << 0)
 #define CONNECTION_ABORTED	(1 << 1)
@@ -94,20 +136,50 @@ typedef int gid_t;
 struct rpc_connection;
 struct rpc_credentials;
 struct rpc_server;
+struct rpc_shmem_link;
 struct rpct_validator;
 struct rpct_error_context;
+struct rpct_program;
+struct rpct_layout;
 
 typedef int (*rpc_recv_msg_fn_t)(struct rpc_connection *, const void *, size_t,
     int *, size_t);
+typedef int (*rpc_recv_owned_fn_t)(struct rpc_connection *, const void *,
+    size_t, void *);
 typedef int (*rpc_send_msg_fn_t)(void *, const void *, size_t, const int *, size_t);
+typedef int (*rpc_send_msgv_fn_t)(void *, const struct iovec *, size_t,
+    const int *, size_t);
+typedef int (*rpc_send_batch_fn_t)(void *, const struct iovec *,
+    const size_t *, size_t, const int *, size_t);
 typedef int (*rpc_abort_fn_t)(void *);
 typedef int (*rpc_get_fd_fn_t)(void *);
+typedef int (*rpc_detach_fn_t)(void *);
 typedef void (*rpc_release_fn_t)(void *);
 typedef int (*rpc_close_fn_t)(struct rpc_connection *);
 typedef int (*rpc_accept_fn_t)(struct rpc_server *, struct rpc_connection *);
 typedef bool (*rpc_valid_fn_t)(struct rpc_server *);
 typedef int (*rpc_teardown_fn_t)(struct rpc_server *);
+typedef int (*rpc_handover_fn_t)(struct rpc_server *, GArray *);
+typedef int (*rpc_adopt_fn_t)(struct rpc_server *, int, rpc_object_t);
 typedef int (*rpc_set_creds_fn_t)(struct rpc_connection *, pid_t, uid_t, gid_t);
+typedef bool (*rpc_iomux_fn_t)(void *);
+typedef void (*rpc_executor_fn_t)(void *, void *);
+
+typedef enum {
+	RPC_IOMUX_BACKEND_DEFAULT = 0,	/* epoll or kqueue */
+	RPC_IOMUX_BACKEND_IO_URING,
+	RPC_IOMUX_BACKEND_MAX
+} rpc_iomux_backend_t;
+
+/*
+ * Changes made through the array API, as seen by query views.
+ */
+typedef enum {
+	RPC_ARRAY_CHANGE_APPEND,
+	RPC_ARRAY_CHANGE_REPLACE,
+	RPC_ARRAY_CHANGE_REMOVE,
+	RPC_ARRAY_CHANGE_RESET		/* anything else, look at it all */
+} rpc_array_change_t;
 
 typedef struct rpct_member *(*rpct_member_fn_t)(const char *, rpc_object_t,
     struct rpct_type *);
@@ -117,6 +189,9 @@ typedef rpc_object_t (*rpct_serialize_fn_t)(rpc_object_t);
 
 typedef bool (*rpct_validator_fn_t)(rpc_object_t, rpc_object_t,
     struct rpct_typei *, struct rpct_error_context *);
+typedef void *(*rpct_validator_compile_fn_t)(rpc_object_t);
+typedef bool (*rpct_validator_run_fn_t)(rpc_object_t, void *,
+    struct rpct_typei *, struct rpct_error_context *);
 
 typedef void (*rpc_fn_respond_fn_t)(void *, rpc_object_t);
 typedef void (*rpc_fn_error_fn_t)(void *, int , const char *, va_list ap);
@@ -128,11 +203,25 @@ typedef void (*rpc_fn_kill_fn_t)(void *);
 typedef bool (*rpc_fn_should_abt_fn_t)(void *);
 typedef void (*rpc_fn_set_abt_h_fn_t)(void *, rpc_abort_handler_t);
 
+struct rpc_iomux_handle;
+struct rpc_arena;
+struct rpc_shared_event;
+struct rpc_event_group;
+struct rpc_event_member;
+struct rpc_flight;
+struct rpc_query_pushdown;
+struct rpc_query_projection;
+
 struct rpc_query_iter
 {
 	rpc_object_t 		rqi_source;
 	size_t 			rqi_idx;
-	rpc_object_t 		rqi_rules;
+	rpc_query_plan_t	rqi_plan;
+	bool			rqi_plan_owned;
+	GArray *		rqi_candidates;
+	bool			rqi_prefiltered;
+	GPtrArray *		rqi_sorted;
+	struct rpc_query_projection *rqi_select;
 	rpc_query_params_t 	rqi_params;
 	bool			rqi_done;
 	bool			rqi_initialized;
@@ -146,11 +235,78 @@ struct rpc_binary_value
 	rpc_binary_destructor_t rbv_destructor;
 };
 
+/*
+ * Output buffer retained across frames. The capacity always is a power
+ * of two, starting at RPC_OUTPUT_BUFFER_MIN; buffers grown past
+ * RPC_OUTPUT_BUFFER_RETAIN_MAX are released after use.
+ */
+struct rpc_output_segment
+{
+	size_t			ros_offset;
+	const void *		ros_ptr;
+	size_t			ros_len;
+};
+
+struct rpc_output_frame
+{
+	size_t			rof_end;
+	guint			rof_segments;
+	guint			rof_fds;
+};
+
+/*
+ * Frames are appended one after another; rob_bounds records where each
+ * of them ends, along with the running count of its binary segments
+ * and descriptors. Frames referenced by segments are held in
+ * rob_objects until the buffer is recycled.
+ */
+struct rpc_output_buffer
+{
+	char *			rob_data;
+	size_t			rob_size;
+	size_t			rob_used;
+	size_t			rob_hwm;
+	uint64_t		rob_frames;
+	uint64_t		rob_grows;
+	uint64_t		rob_releases;
+	GArray *		rob_segments;
+	GArray *		rob_bounds;
+	GArray *		rob_fds;
+	GPtrArray *		rob_objects;
+};
+
 struct rpc_shmem_block
 {
     	int			rsb_fd;
     	off_t 			rsb_offset;
     	size_t 			rsb_size;
+	int			rsb_flags;
+	struct rpc_shmem_pool *	rsb_pool;
+	uint64_t		rsb_pool_id;	/* peer pool, until imported */
+	size_t			rsb_pool_size;
+};
+
+/*
+ * A single memfd mapped once, carved up into power-of-two chunks.
+ * Pools we allocate from are local; pools mapped from a peer's
+ * descriptor are remote and only track who to return chunks to.
+ * Cached mappings of received shmem files are remote pools without
+ * anyone to return chunks to.
+ */
+struct rpc_shmem_pool
+{
+	uint64_t		rsp_id;
+	int			rsp_fd;
+	void *			rsp_base;
+	size_t			rsp_size;
+	volatile int		rsp_refcnt;
+	bool			rsp_remote;
+	rpc_connection_t	rsp_conn;	/* remote only, weak */
+	GMutex			rsp_mtx;
+	guint			rsp_min_order;
+	guint			rsp_orders;
+	GHashTable **		rsp_free;	/* order -> free offsets */
+	GHashTable *		rsp_chunks;	/* offset -> chunk */
 };
 
 struct rpc_error_value
@@ -158,15 +314,103 @@ struct rpc_error_value
 	int			rev_code;
 	GString *		rev_message;
 	rpc_object_t		rev_extra;
-	rpc_object_t 		rev_stack;
+	rpc_object_t 		rev_stack;	/* symbolized on first use */
+	void **			rev_frames;
+	int			rev_nframes;
+};
+
+#define	RPC_DICT_SMALL_MAX	8
+
+struct rpc_key
+{
+	size_t			rk_len;
+	char			rk_str[];
+};
+
+struct rpc_dict_entry
+{
+	char *			rde_key;
+	rpc_object_t		rde_value;
+};
+
+/*
+ * Either a small, flat array of entries or (once grown past
+ * RPC_DICT_SMALL_MAX entries) a hash table. In the former case,
+ * rd_interned has a bit set for each entry with an interned key.
+ *
+ * Struct instances may instead keep one slot per member of their
+ * type's layout, with the keys shared with the layout. Such dicts are
+ * allocated without rd_entries (rd_compact) and fall back to a hash
+ * table when given a key the layout doesn't have.
+ */
+struct rpc_dict
+{
+	GHashTable *		rd_table;
+	guint			rd_count;
+	guint			rd_interned;
+	bool			rd_compact;
+	const struct rpct_layout *rd_layout;
+	rpc_object_t *		rd_slots;
+	struct rpc_dict_entry	rd_entries[RPC_DICT_SMALL_MAX];
+};
+
+struct rpc_list_iter
+{
+	GPtrArray *		rli_list;
+	guint			rli_index;
+};
+
+struct rpc_dict_iter
+{
+	struct rpc_dict *	rdi_dict;
+	guint			rdi_index;
+	GHashTableIter		rdi_iter;
+};
+
+#define	RPC_STRING_INLINE_MAX	22
+
+/*
+ * Strings up to RPC_STRING_INLINE_MAX bytes are stored inline, in which
+ * case rsv_str is NULL. Sized so that it doesn't grow union rpc_value.
+ */
+struct rpc_string_value
+{
+	GString *		rsv_str;
+	uint8_t			rsv_len;
+	char			rsv_inline[RPC_STRING_INLINE_MAX + 1];
+};
+
+/*
+ * Dates are kept as a point in time plus the offset of the zone they
+ * were taken in, which only matters when they are formatted.
+ */
+struct rpc_date_value
+{
+	int64_t			rdv_usec;	/* since the epoch */
+	int32_t			rdv_tz_offset;	/* seconds east of UTC */
+};
+
+/*
+ * Packed arrays keep int64, uint64, double or bool elements in a single
+ * contiguous buffer. rpa_list overlaps rv_list and stays NULL for as
+ * long as the array is packed; the first operation needing boxed
+ * elements converts the array into a regular one.
+ */
+struct rpc_packed_array
+{
+	GPtrArray *		rpa_list;
+	rpc_type_t		rpa_type;
+	size_t			rpa_count;
+	void *			rpa_data;
 };
 
 union rpc_value
 {
-	GHashTable *		rv_dict;
+	struct rpc_dict *	rv_dict;
 	GPtrArray *		rv_list;
-	GString *		rv_str;
-	GDateTime *		rv_datetime;
+	struct rpc_packed_array	rv_packed;
+	struct rpc_string_value	rv_str;
+	struct rpc_date_value	rv_date;
 	uint64_t 		rv_ui;
 	int64_t			rv_i;
 	bool			rv_b;
@@ -179,6 +423,31 @@ union rpc_value
 #endif
 };
 
+/*
+ * Memoized wire encoding of a frozen object, one per encoder variant.
+ * Entries are only ever prepended, so readers need no locking. An entry
+ * without re_valid set records that the object can't be cached.
+ */
+struct rpc_encoding
+{
+	struct rpc_encoding *	re_next;
+	unsigned int		re_flags;
+	bool			re_valid;
+	size_t			re_len;
+	char			re_data[];
+};
+
+/*
+ * Backing of a container whose storage is only filled in on first
+ * access, see rpc_container_load(). Each kind of backing (an inbound
+ * msgpack frame, a mapped snapshot) embeds this as its first member.
+ */
+struct rpc_lazy
+{
+	void			(*rl_materialize)(rpc_object_t);
+	void			(*rl_free)(struct rpc_lazy *);
+};
+
 struct rpc_object
 {
 	rpc_type_t		ro_type;
@@ -187,8 +456,38 @@ struct rpc_object
 	size_t			ro_column;
 	union rpc_value		ro_value;
 	struct rpct_typei *	ro_typei;
+	struct rpc_arena *	ro_arena;
+	volatile int *		ro_cow;
+	bool			ro_frozen;
+	struct rpc_object *	ro_root;
+	struct rpc_encoding *	ro_encoding;
+	struct rpc_lazy *	ro_lazy;
+	unsigned int		ro_generation;
+	size_t			ro_hash;	/* cached rpc_hash(), or 0 */
+};
+
+/*
+ * A per-thread cache of fixed size items, see rpc_magazine.c. Meant to
+ * be statically allocated with RPC_OBJECT_CACHE_INIT().
+ */
+struct rpc_object_cache
+{
+	size_t			roc_size;
+	GDestroyNotify		roc_destroy;	/* for items leaving it */
+	GPrivate		roc_thread;
+	GMutex			roc_mtx;
+	struct rpc_magazine *	roc_full;
+	guint			roc_full_count;
+	struct rpc_magazine *	roc_empty;
 };
 
+#define	RPC_OBJECT_CACHE_INIT(_type, _destroy)				\
+    {									\
+	.roc_size = sizeof(_type),					\
+	.roc_destroy = (_destroy),					\
+	.roc_thread = G_PRIVATE_INIT(rpc_object_cache_thread_exit)	\
+    }
+
 struct rpc_subscription
 {
 	char *			rsu_name;
@@ -196,7 +495,24 @@ struct rpc_subscription
 	char *			rsu_interface;
     	int 			rsu_refcount;
 	bool			rsu_busy;
+	bool			rsu_scheduled;
+	GQueue			rsu_pending;	/* events not yet delivered */
     	GPtrArray *		rsu_handlers;
+	bool			rsu_pattern;	/* path is a glob */
+	rpc_object_t		rsu_rules;	/* client: rules asked for */
+	GPtrArray *		rsu_filters;	/* server: per subscriber */
+};
+
+/*
+ * Query rules a server-side subscription was taken with, compiled once.
+ * A subscriber without rules gets a filter with no plan, which lets
+ * every event of the subscription through.
+ */
+struct rpc_subscription_filter
+{
+	rpc_object_t		rsf_rules;
+	rpc_query_plan_t	rsf_plan;
+	int			rsf_refcount;
 };
 
 struct rpc_subscription_handler
@@ -205,6 +521,90 @@ struct rpc_subscription_handler
 	rpc_handler_t 		rsh_handler;
 };
 
+/*
+ * Adaptive prefetch state of an outbound streaming call. The window is
+ * sized to cover the smoothed round trip time at the rate the consumer
+ * drains items, with a gain of two so that it keeps probing for more,
+ * and topped up once half of it is used.
+ */
+struct rpc_call_window
+{
+	bool			rcw_enabled;
+	size_t			rcw_max_items;
+	size_t			rcw_max_bytes;
+	bool			rcw_timing;
+	gint64			rcw_grant_time;
+	gint64			rcw_rtt;
+	gint64			rcw_last_consume;
+	double			rcw_drain_rate;
+	double			rcw_item_size;
+};
+
+/*
+ * Call timeouts are kept in a hierarchical timer wheel, one per
+ * connection, with a resolution of a millisecond. Each level has
+ * RPC_TIMER_SLOTS slots and spans RPC_TIMER_SLOTS times the range of
+ * the level below; timers are moved down a level when the slot they
+ * are in comes up. A single GSource drives the wheel.
+ */
+/* Items of an upload stream the receiving end buffers */
+#define	RPC_UPLOAD_WINDOW	64
+
+/* Array results larger than this go out in slices of RPC_CHUNK_SIZE */
+#define	RPC_CHUNK_THRESHOLD	(8 * 1024 * 1024)
+#define	RPC_CHUNK_SIZE		(1024 * 1024)
+#define	RPC_CHUNK_WINDOW	4	/* slices in flight */
+
+#define	RPC_TIMER_BITS		6
+#define	RPC_TIMER_SLOTS		(1 << RPC_TIMER_BITS)
+#define	RPC_TIMER_LEVELS	4
+
+struct rpc_timer
+{
+	struct rpc_timer *	rt_next;
+	struct rpc_timer **	rt_pprev;
+	uint64_t		rt_expires;
+};
+
+struct rpc_timer_wheel
+{
+	GMutex			rtw_mtx;
+	GSource *		rtw_source;
+	gint64			rtw_start;
+	uint64_t		rtw_now;
+	uint64_t		rtw_wake;
+	guint			rtw_count;
+	struct rpc_timer *	rtw_slots[RPC_TIMER_LEVELS][RPC_TIMER_SLOTS];
+};
+
+struct rpc_span_context
+{
+	uint8_t			rsc_trace_id[16];
+	uint8_t			rsc_span_id[8];
+	uint8_t			rsc_parent_id[8];
+	bool			rsc_valid;
+	bool			rsc_sampled;
+	bool			rsc_recorded;
+	gint64			rsc_start;
+	gint64			rsc_stream_start;
+	char *			rsc_tracestate;
+	char *			rsc_traceparent;	/* formatted lazily */
+};
+
+/*
+ * Statuses and fragments of an outbound call its consumer hasn't taken
+ * yet. How many are outstanding is bounded by the prefetch window, so
+ * they're kept in a ring sized from it, which only grows if the window
+ * does.
+ */
+struct rpc_call_queue
+{
+	struct queue_item *	rcq_items;
+	guint			rcq_size;
+	guint			rcq_head;
+	guint			rcq_len;
+};
+
 struct rpc_call
 {
 	rpc_connection_t    	rc_conn;
@@ -220,13 +620,51 @@ struct rpc_call
 	struct notify		rc_notify;
 	GMutex			rc_mtx;
 	GMutex			rc_ref_mtx;
-	GSource *		rc_timeout;
-	GQueue *		rc_queue;
+	struct rpc_timer	rc_timer;
+	bool			rc_timer_armed;
+	bool			rc_sync;
+	gint64			rc_deadline;
+	bool			rc_admitted;
+	gint64			rc_queued_at;
+	struct rpc_flight *	rc_flight;
+	gint64			rc_started_at;
+	bool			rc_failed;
+	uint64_t		rc_bytes_in;
+	uint64_t		rc_bytes_out;
+	GMutex			rc_batch_mtx;
+	rpc_object_t		rc_batch;
+	int64_t			rc_batch_seqno;
+	bool			rc_upload;
+	bool			rc_replay;
+	bool			rc_idempotent;
+	int			rc_validate;	/* 0 undecided, 1 yes, -1 no */
+	int			rc_validation_mode;
+	bool			rc_upload_ended;
+	GQueue			rc_outbuf;
+	size_t			rc_outbuf_bytes;
+	size_t			rc_outbuf_max;
+	size_t			rc_outbuf_max_bytes;
+	bool			rc_end_pending;
+	rpc_ready_handler_t	rc_ready_handler;
+	struct rpc_query_pushdown *rc_query;
+	bool			rc_conditional;
+	bool			rc_chunked;	/* result sent in slices */
+	rpc_object_t		rc_chunks;	/* result being put together */
+	struct rpc_fanout *	rc_fanout;	/* to report the answer to */
+	char *			rc_etag;	/* held by caller, or received */
+	char *			rc_new_etag;	/* declared by the method */
+	bool			rc_not_modified;
+	int64_t			rc_upload_seqno;
+	int64_t			rc_upload_credit;
+	GQueue *		rc_input;
+	int64_t			rc_input_consumed;
+	struct rpc_call_queue	rc_queue;
 	bool			rc_timedout;
 	rpc_callback_t    	rc_callback;
 	atomic_int_fast64_t	rc_producer_seqno;
 	atomic_int_fast64_t	rc_consumer_seqno; /* also rc_seqno */
 	uint64_t 		rc_prefetch;
+	struct rpc_call_window	rc_window;
 	rpc_instance_t 		rc_instance;
 	rpc_abort_handler_t	rc_abort_handler;
 	struct rpc_if_method *	rc_if_method;
@@ -235,6 +673,8 @@ struct rpc_call
 	bool			rc_responded;
 	bool			rc_ended;
 	bool			rc_aborted;
+	struct rpc_span_context	rc_span;
+	bool			rc_slow_flagged;
 };
 
 struct rpc_credentials
@@ -257,6 +697,89 @@ struct rpc_fn_callbacks
 	rpc_fn_set_abt_h_fn_t	rcf_set_async_abort_handler;
 };
 
+/*
+ * Per validation mode counters, updated atomically.
+ */
+struct rpct_validation_stats
+{
+	uint64_t		rvs_validated;
+	uint64_t		rvs_skipped;
+	uint64_t		rvs_failed;
+};
+
+/*
+ * Traffic counters of a connection, updated atomically. Errors change
+ * rarely and are counted by code, under rcs_errors_mtx.
+ */
+struct rpc_conn_stats
+{
+	uint64_t		rcs_frames_in;
+	uint64_t		rcs_frames_out;
+	uint64_t		rcs_bytes_in;
+	uint64_t		rcs_bytes_out;
+	uint64_t		rcs_serialize_ns;
+	uint64_t		rcs_deserialize_ns;
+	uint64_t		rcs_events_dropped;
+	uint64_t		rcs_events_coalesced;
+	GMutex			rcs_errors_mtx;
+	GHashTable *		rcs_errors_sent;
+	GHashTable *		rcs_errors_received;
+};
+
+/*
+ * Memory held on behalf of a connection: frames being decoded, inbound
+ * calls until they finish and stream fragments until they're consumed.
+ * The send queue is counted from the output buffers as it is.
+ */
+typedef enum
+{
+	RPC_MEM_FRAMES,
+	RPC_MEM_CALLS,
+	RPC_MEM_FRAGMENTS,
+	RPC_MEM_KINDS
+} rpc_mem_kind_t;
+
+struct rpc_mem_account
+{
+	uint64_t		rma_used[RPC_MEM_KINDS];
+	uint64_t		rma_peak;
+	uint64_t		rma_soft;
+	uint64_t		rma_hard;
+	uint64_t		rma_stalls;
+	uint64_t		rma_stall_ns;
+	volatile gint		rma_waiting;
+	GMutex			rma_mtx;
+	GCond			rma_cv;
+};
+
+/*
+ * One slice of the outbound call table, padded so that readers of
+ * different shards don't bounce each other's lock around.
+ */
+struct rpc_call_shard
+{
+	GRWLock			rcs_lock;
+	GHashTable *		rcs_calls;
+	char			rcs_pad[RPC_CACHE_LINE - sizeof(GRWLock) -
+	    sizeof(GHashTable *)];
+};
+
+/*
+ * A property value read through a connection, kept up to date from the
+ * property change events of its path. rpe_gen moves on with each change
+ * so that a fetch racing with one doesn't overwrite it. Properties sent
+ * as deltas are fetched along with their version, rpe_version, which
+ * the next delta has to follow.
+ */
+struct rpc_prop_entry
+{
+	rpc_object_t		rpe_value;
+	gint64			rpe_fetched;
+	uint64_t		rpe_gen;
+	uint64_t		rpe_version;
+	bool			rpe_versioned;
+};
+
 struct rpc_connection
 {
 	struct rpc_server *	rco_server;
@@ -265,24 +788,94 @@ struct rpc_connection
     	struct rpc_credentials	rco_creds;
 	bool			rco_has_creds;
 	bool			rco_supports_fd_passing;
+	int			rco_validation_mode;
+	guint			rco_validation_rate;
 	const char *        	rco_uri;
 	char *			rco_endpoint_address;
 	rpc_error_handler_t 	rco_error_handler;
 	rpc_handler_t		rco_event_handler;
 	rpc_raw_handler_t 	rco_raw_handler;
 	guint                 	rco_rpc_timeout;
-	GHashTable *		rco_calls;
+	struct rpc_timer_wheel	rco_timers;
+	volatile int		rco_compact_ids;
+	volatile int		rco_compact_ops;
+	volatile int		rco_compact_acked;
+	volatile int		rco_peer_legacy;
+	volatile int		rco_packed_arrays;
+	volatile int		rco_positional_structs;
+	volatile int		rco_columnar_arrays;
+	volatile int		rco_peer_types;
+	volatile int		rco_call_batch;
+	volatile int		rco_fragment_batch;
+	volatile int		rco_timestamps;
+	volatile int		rco_chunked_results;
+	volatile int		rco_shmem_pools;
+	volatile int		rco_peer_bulk;
+	volatile int		rco_bulk_shared;
+	struct rpc_shmem_link *	rco_shm;
+	bool			rco_event_group;
+	struct rpc_event_member *rco_event_member;
+	volatile int		rco_event_joined;
+	uint64_t		rco_event_from;
+	struct rpc_msgpack_types *rco_types;
+	uint64_t		rco_next_id;
+	struct rpc_call_shard	rco_call_shards[RPC_CALL_SHARDS];
 	GHashTable *		rco_inbound_calls;
-    	GPtrArray *		rco_subscriptions;
+    	GHashTable *		rco_subscriptions;
 	GRWLock			rco_subscription_rwlock;
+	volatile int		rco_subscription_patterns;
+	volatile int		rco_subscription_filters;
 	GMutex			rco_mtx;
 	GMutex			rco_ref_mtx;
 	GMutex			rco_send_mtx;
+	GCond			rco_send_cv;
+	struct rpc_output_buffer rco_send_buf;
+	struct rpc_output_buffer rco_flush_buf;
+	struct rpc_output_buffer rco_urgent_buf;	/* control frames */
+	struct rpc_output_buffer rco_urgent_flush_buf;
+	bool			rco_send_active;
+	bool			rco_send_failed;
+	guint64			rco_flush_latency;
+	GMutex			rco_batch_mtx;
+	rpc_object_t		rco_batch;		/* pending events */
+	size_t			rco_batch_bytes;
+	GSource *		rco_batch_source;
+	size_t			rco_batch_max_events;
+	size_t			rco_batch_max_bytes;
+	uint64_t		rco_batch_max_delay;	/* us */
+	GMutex			rco_evq_mtx;
+	GQueue			rco_evq;	/* rpc_shared_event */
+	bool			rco_evq_scheduled;
+	size_t			rco_evq_max;
+	rpc_event_overflow_t	rco_evq_policy;
+	GMutex			rco_prop_mtx;
+	GHashTable *		rco_prop_cache;
+	GHashTable *		rco_prop_watches;	/* path -> cookie */
+	volatile gint		rco_prop_caching;
+	uint64_t		rco_prop_ttl;		/* us */
+	size_t			rco_recv_len;
+	bool			rco_arena;
+	bool			rco_lazy;
+	bool			rco_positional;
+	bool			rco_columnar;
+	size_t			rco_chunk_threshold;
+	bool			rco_chunk_incremental;
+	bool			rco_resume;
+	bool			rco_replay;
+	GHashTable *		rco_idempotent;	/* under rco_mtx */
+	bool			rco_resuming;
+	char *			rco_session;
+	GPtrArray *		rco_stale_transports;
+	volatile guint		rco_send_writes;
+	struct rpc_conn_stats	rco_stats;
+	struct rpc_mem_account	rco_mem;
+	bool			rco_shared_reader;
+	bool			rco_slow_flagged;	/* under rco_send_mtx */
 	GRWLock			rco_icall_rwlock;
-	GRWLock			rco_call_rwlock;
 	GMainContext *		rco_main_context;
+	struct rpc_fair_flow *	rco_fair_flow;
 	rpc_object_t            rco_error;
-    	GThreadPool *		rco_callback_pool;
+	struct rpc_executor_queue *rco_callback_queue;
 	rpc_object_t 		rco_params;
     	int			rco_flags;
 	volatile uint		rco_state;
@@ -290,13 +883,18 @@ struct rpc_connection
 #if LIBDISPATCH_SUPPORT
 	dispatch_queue_t	rco_dispatch_queue;
 #endif
+	rpc_completion_queue_t	rco_cq;
 
     	/* Callbacks */
 	rpc_recv_msg_fn_t	rco_recv_msg;
+	rpc_recv_owned_fn_t	rco_recv_owned;
 	rpc_send_msg_fn_t	rco_send_msg;
+	rpc_send_msgv_fn_t	rco_send_msgv;
+	rpc_send_batch_fn_t	rco_send_batch;
 	rpc_abort_fn_t 		rco_abort;
 	rpc_close_fn_t		rco_close;
     	rpc_get_fd_fn_t 	rco_get_fd;
+	rpc_detach_fn_t		rco_detach;
 	rpc_release_fn_t	rco_release;
 	rpc_set_creds_fn_t	rco_set_creds;
 	void *			rco_arg;
@@ -327,25 +925,80 @@ struct rpc_server
 	int			rs_conn_refused;
 	volatile int		rs_conn_closed;
 	int			rs_conn_aborted;
+	struct rpc_conn_stats	rs_stats;	/* of closed connections */
+	size_t			rs_mem_soft;
+	size_t			rs_mem_hard;
 	rpc_object_t 		rs_params;
 	rpc_server_ev_handler_t rs_event_handler;
+	struct rpc_event_group *rs_event_group;
+	int			rs_relay_fd;	/* pre-forked worker */
+
+	/* Admission control */
+	guint			rs_max_pending;
+	guint			rs_max_per_conn;
+	rpc_shed_policy_t	rs_shed_policy;
+	volatile int		rs_pending;
+	GMutex			rs_codel_mtx;
+	gint64			rs_codel_first_above;
+	gint64			rs_codel_drop_next;
+	uint64_t		rs_codel_count;
+	bool			rs_codel_dropping;
 
     	/* Callbacks */
 	rpc_valid_fn_t		rs_valid;
     	rpc_accept_fn_t		rs_accept;
     	rpc_teardown_fn_t	rs_teardown;
 	rpc_teardown_fn_t	rs_teardown_end;
+	rpc_handover_fn_t	rs_handover;
+	rpc_teardown_fn_t	rs_stop_accepting;
+	rpc_adopt_fn_t		rs_adopt;
     	void *			rs_arg;
 };
 
+struct rpc_completion_queue
+{
+	GMutex			rcq_mtx;
+	GQueue			rcq_events;
+	int			rcq_fds[2];
+};
+
+/*
+ * Load of a pool member, as seen by calls made through the client.
+ * rcm_ewma is the smoothed latency in microseconds, 0 until the first
+ * call completes.
+ */
+struct rpc_client_member
+{
+	volatile gint		rcm_outstanding;
+	volatile gint64		rcm_ewma;
+};
+
 struct rpc_client
 {
     	GMainContext *		rci_g_context;
     	GMainLoop *		rci_g_loop;
     	GThread *		rci_thread;
+	gsize			rci_thread_once;
+	struct rpc_client_loop *rci_loop;	/* shared, or NULL */
     	rpc_connection_t 	rci_connection;
     	const char *		rci_uri;
 	rpc_object_t 		rci_params;
+	GMutex			rci_pool_mtx;
+	rpc_connection_t *	rci_pool;
+	char **			rci_pool_uris;
+	gint64 *		rci_pool_retry;
+	size_t			rci_pool_size;
+	volatile guint		rci_pool_next;
+	GPtrArray *		rci_pool_dead;
+	struct rpc_client_member *rci_members;
+	rpc_balance_policy_t	rci_policy;
+	bool			rci_hedge;
+	gint64			rci_hedge_min;		/* us */
+	volatile gint64		rci_hedge_delay;	/* us, 0 if unknown */
+	struct rpc_histogram *	rci_latency;
+	GMutex			rci_race_mtx;
+	GHashTable *		rci_races;		/* hedged calls by id */
+	uint64_t		rci_race_next;
 };
 
 struct rpc_instance
@@ -354,14 +1007,50 @@ struct rpc_instance
 	char *			ri_descr;
 	void *			ri_arg;
 	bool			ri_destroyed;
+	bool			ri_virtual;	/* resolved by a namespace */
 	int	 		ri_refcnt;
 	rpc_context_t 		ri_context;
+	rpc_instance_t		ri_shape;	/* owner of ri_interfaces */
 	GHashTable *		ri_interfaces;
+	GHashTable *		ri_coalesce;
+	GHashTable *		ri_deltas;
 	GMutex			ri_mtx;
 	GCond			ri_cv;
 	GRWLock			ri_rwlock;
 };
 
+/*
+ * Change notification policy of a single property. Updates coming in
+ * faster than rcl_interval are folded into rcl_pending, of which only
+ * the latest survives, and sent by the emitter thread once the
+ * interval is up. Protected by the instance mutex.
+ */
+struct rpc_property_coalesce
+{
+	rpc_instance_t		rcl_instance;
+	char *			rcl_interface;
+	char *			rcl_name;
+	gint64			rcl_interval;
+	bool			rcl_compare;
+	gint64			rcl_last_sent;
+	gint64			rcl_due;
+	rpc_object_t		rcl_last;
+	rpc_object_t		rcl_pending;
+};
+
+/*
+ * Last value of a property sent as deltas, which the next change is
+ * compared against. rpd_mtx keeps versions in the order the changes
+ * are emitted in. Entries stay around until the instance goes away.
+ */
+struct rpc_property_delta
+{
+	GMutex			rpd_mtx;
+	bool			rpd_enabled;
+	rpc_object_t		rpd_last;
+	uint64_t		rpd_version;
+};
+
 struct rpc_interface_priv
 {
 	const char *		rip_name;
@@ -381,19 +1070,87 @@ struct rpc_property_cookie
 
 struct rpc_context
 {
-    	GThreadPool *		rcx_threadpool;
+	struct rpc_scheduler *	rcx_scheduler;
+	GMutex			rcx_qos_mtx;
+	GHashTable *		rcx_qos;
+
+	/* Fair scheduling between connections, see rpc_service.c */
+	bool			rcx_fair;
+	GMutex			rcx_fair_mtx;
+	guint			rcx_fair_slots;
+	guint			rcx_fair_running;
+	GQueue			rcx_fair_active;	/* flows with calls */
+	GHashTable *		rcx_fair_shares;	/* uid -> share */
+	gint64			rcx_fair_wakeup;	/* 0 if none due */
+
 	GHashTable *		rcx_instances;
+	GPtrArray *		rcx_index;	/* instances by path */
+	GPtrArray *		rcx_namespaces;	/* under rcx_rwlock */
 	GPtrArray * 		rcx_servers;
 	GRWLock			rcx_rwlock;
 	GRWLock			rcx_server_rwlock;
 	rpc_instance_t 		rcx_root;
 	GAsyncQueue *		rcx_emit_queue;
 	GThread *		rcx_emit_thread;
-	GHashTable *		rcx_event_watchers;
+	gsize			rcx_emit_once;
+	GHashTable *		rcx_event_watchers;	/* event -> conns */
+	GHashTable *		rcx_event_patterns;	/* glob path -> conns */
+	GMutex			rcx_coalesce_mtx;
+	GPtrArray *		rcx_coalesce_due;
+	GMutex			rcx_flight_mtx;
+	GHashTable *		rcx_flights;
+	GMutex			rcx_stats_mtx;
+	GHashTable *		rcx_stats;
+	GMutex			rcx_sessions_mtx;
+	GHashTable *		rcx_sessions;		/* token -> session */
+
+	/* Slow call and slow consumer logs, see rpc_stats.c */
+	GMutex			rcx_slow_mtx;
+	GQueue			rcx_slow_calls;
+	GQueue			rcx_slow_consumers;
+	size_t			rcx_slow_log_size;
+	uint64_t		rcx_slow_call_us;
+	bool			rcx_slow_backtrace;
+	size_t			rcx_slow_send_bytes;
+	size_t			rcx_slow_queued;
+
+	/* Error stack traces */
+	bool			rcx_error_stacks;
+	bool			rcx_error_stacks_send;
 
 	/* Hooks */
 	rpc_function_t		rcx_pre_call_hook;
 	rpc_function_t		rcx_post_call_hook;
+
+	/* Validation policy of the rpct hooks */
+	int			rcx_validation_mode;
+	guint			rcx_validation_rate;
+	volatile gint		rcx_validation_tick;
+	struct rpct_validation_stats rcx_validation_stats[RPCT_VALIDATE_MAX];
+};
+
+/*
+ * Latency histogram, in microseconds; see rpc_stats.c for the bucket
+ * layout.
+ */
+struct rpc_histogram
+{
+	uint64_t		rh_count;
+	uint64_t		rh_sum;
+	uint64_t		rh_max;
+	uint64_t		rh_buckets[RPC_HIST_BUCKETS];
+};
+
+struct rpc_method_stats
+{
+	char *			rms_interface;
+	char *			rms_method;
+	uint64_t		rms_calls;
+	uint64_t		rms_errors;
+	uint64_t		rms_bytes_in;
+	uint64_t		rms_bytes_out;
+	struct rpc_histogram	rms_queue;
+	struct rpc_histogram	rms_exec;
 };
 
 struct rpc_bus_transport
@@ -418,16 +1175,48 @@ struct rpc_transport
 struct rpc_serializer
 {
     	int (*serialize)(rpc_object_t, void **, size_t *);
+	int (*serialize_typed)(rpc_object_t, void **, size_t *, int *,
+	    size_t *);
     	rpc_object_t (*deserialize)(const void *, size_t);
+	rpc_object_t (*deserialize_typed)(const void *, size_t);
+	int (*serialize_fd)(rpc_object_t, int);
+	int (*deserialize_stream)(int, rpc_serializer_item_t);
 	const char *name;
 };
 
-struct rpct_context
+/*
+ * A version of the typing context tables. Once published, a snapshot
+ * doesn't change: loading builds the next one aside and swaps it in,
+ * and the old one is retired through the epoch. The files, types and
+ * interfaces are shared by all snapshots and live as long as the
+ * context does.
+ */
+struct rpct_snapshot
 {
+	volatile int		refcnt;
+	uint64_t		generation;
 	GHashTable *		files;
 	GHashTable *		types;
 	GHashTable *		interfaces;
+};
+
+/*
+ * Loads are serialized by load_mtx, which is recursive as loading one
+ * type may pull in others. The staging snapshot is only ever seen by
+ * the loader thread, until the outermost load is done with it.
+ */
+struct rpct_context
+{
+	struct rpct_snapshot * volatile current;
+	struct rpct_snapshot *	staging;
+	GRecMutex		load_mtx;
+	guint			load_depth;
+	GThread * volatile	loader;
 	GHashTable *		typei_cache;
+	GHashTable *		typei_decls;
+	GRWLock			typei_decls_lock;	/**< Guards both caches */
+	GHashTable *		pending;	/**< Indexed files, by path */
+	volatile gint		system_types;	/**< RPCT_SYSTEM_* */
 	rpc_function_t		pre_call_hook;
 	rpc_function_t 		post_call_hook;
 };
@@ -443,6 +1232,7 @@ struct rpct_file
 	GHashTable *		types;
 	GHashTable *		interfaces;
 	rpc_object_t 		body;
+	char * volatile		hash;
 };
 
 /**
@@ -462,6 +1252,18 @@ struct rpct_type
 	GPtrArray *		generic_vars;
 	GHashTable *		members;
 	GHashTable *		constraints;
+	struct rpct_layout *	layout;
+};
+
+/*
+ * Positional layout of a struct type: member names in a fixed order
+ * both ends agree on, and a fingerprint of the member names and types.
+ */
+struct rpct_layout
+{
+	uint32_t		rl_fingerprint;
+	guint			rl_count;
+	const char *		rl_names[];
 };
 
 struct rpct_interface
@@ -486,6 +1288,7 @@ struct rpct_typei
 	char *			canonical_form;
 	GHashTable *		specializations;
 	GHashTable *		constraints;
+	struct rpct_program *	program;	/**< Compiled lazily */
 	volatile int		refcnt;
 };
 
@@ -543,31 +1346,252 @@ struct rpct_validator
 	const char *		type;
 	const char * 		name;
 	rpct_validator_fn_t 	validate;
+
+	/*
+	 * Optional: turns the constraint parameters into something
+	 * cheaper to apply once, when the validation program is built.
+	 */
+	rpct_validator_compile_fn_t compile;
+	rpct_validator_run_fn_t	validate_compiled;
+	GDestroyNotify		release;
+};
+
+/**
+ * A single constraint of a type instance, with its validator already
+ * resolved for every object type it could be applied to.
+ */
+struct rpct_check
+{
+	const char *		name;
+	rpc_object_t 		args;
+	const struct rpct_validator *validators[RPC_TYPE_COUNT];
+	void *			compiled[RPC_TYPE_COUNT];
+};
+
+struct rpct_program_member
+{
+	const char *		name;
+	struct rpct_typei *	typei;
+};
+
+/**
+ * Validation program compiled once per type instance by
+ * rpct_typei_program(), so that validating a value does not need to
+ * look anything up by name.
+ */
+struct rpct_program
+{
+	struct rpct_typei *	raw;		/**< Unwound type instance */
+	const struct rpct_class_handler *handler;
+	uint32_t		untyped_mask;	/**< Accepted untyped objects */
+	guint			nchecks;
+	struct rpct_check *	checks;
+	guint			nmembers;	/**< Only for structs */
+	struct rpct_program_member *members;
 };
 
 INTERNAL_LINKAGE rpc_object_t rpc_prim_create(rpc_type_t type,
     union rpc_value val);
+INTERNAL_LINKAGE rpc_object_t rpc_prim_create_in(struct rpc_arena *arena,
+    rpc_type_t type, union rpc_value val);
+INTERNAL_LINKAGE rpc_object_t rpc_string_create_in(struct rpc_arena *arena,
+    const char *string, size_t length);
+INTERNAL_LINKAGE size_t rpc_array_packed_elem_size(rpc_type_t type);
+INTERNAL_LINKAGE rpc_object_t rpc_array_create_packed_stolen(rpc_type_t type,
+    void *data, size_t count);
+INTERNAL_LINKAGE const struct rpc_encoding *rpc_encoding_find(
+    rpc_object_t object, unsigned int flags);
+INTERNAL_LINKAGE const struct rpc_encoding *rpc_encoding_add(
+    rpc_object_t object, unsigned int flags, const void *data, size_t len);
+INTERNAL_LINKAGE rpc_pack_fmt_t rpc_pack_compile_once(rpc_pack_fmt_t *cache,
+    const char *fmt);
+INTERNAL_LINKAGE bool rpc_array_walk(rpc_object_t array,
+    rpc_array_applier_t applier);
+INTERNAL_LINKAGE struct rpc_query_pushdown *rpc_query_pushdown_new(
+    rpc_object_t spec);
+INTERNAL_LINKAGE void rpc_query_pushdown_free(struct rpc_query_pushdown *pd);
+INTERNAL_LINKAGE rpc_object_t rpc_query_pushdown_filter(
+    struct rpc_query_pushdown *pd, rpc_object_t fragment);
+INTERNAL_LINKAGE bool rpc_query_pushdown_done(struct rpc_query_pushdown *pd);
+INTERNAL_LINKAGE GPtrArray *rpc_query_pushdown_finish(
+    struct rpc_query_pushdown *pd);
+INTERNAL_LINKAGE rpc_query_plan_t rpc_query_pushdown_take(
+    struct rpc_query_pushdown *pd, struct rpc_query_params *params);
+INTERNAL_LINKAGE void rpc_query_view_notify(rpc_object_t array,
+    rpc_array_change_t change, size_t index);
+INTERNAL_LINKAGE bool rpc_dictionary_walk(rpc_object_t dictionary,
+    rpc_dictionary_applier_t applier);
+INTERNAL_LINKAGE struct rpc_dict *rpc_dict_new(size_t hint);
+INTERNAL_LINKAGE void rpc_dict_free(struct rpc_dict *dict);
+INTERNAL_LINKAGE struct rpc_dict *rpc_dict_new_layout(
+    const struct rpct_layout *layout);
+INTERNAL_LINKAGE bool rpc_dict_adopt_layout(struct rpc_dict *dict,
+    const struct rpct_layout *layout);
+INTERNAL_LINKAGE void rpc_dict_set_slot(struct rpc_dict *dict, guint index,
+    rpc_object_t value);
+INTERNAL_LINKAGE rpc_object_t rpc_dict_lookup_slot(struct rpc_dict *dict,
+    const struct rpct_layout *layout, guint index);
+INTERNAL_LINKAGE void rpc_dict_insert(struct rpc_dict *dict, char *key,
+    rpc_object_t value);
+INTERNAL_LINKAGE void rpc_dict_insert_key(struct rpc_dict *dict,
+    rpc_key_t key, rpc_object_t value);
+INTERNAL_LINKAGE void rpc_dict_insert_str(struct rpc_dict *dict,
+    const char *key, size_t len, rpc_object_t value);
+INTERNAL_LINKAGE rpc_object_t rpc_dict_lookup(struct rpc_dict *dict,
+    const char *key);
+INTERNAL_LINKAGE rpc_object_t rpc_dict_lookup_key(struct rpc_dict *dict,
+    rpc_key_t key);
+INTERNAL_LINKAGE rpc_key_t rpc_key_lookup(const char *str, size_t len);
+INTERNAL_LINKAGE bool rpc_dict_remove(struct rpc_dict *dict, const char *key);
+INTERNAL_LINKAGE void rpc_dict_remove_all(struct rpc_dict *dict);
+INTERNAL_LINKAGE size_t rpc_dict_count(struct rpc_dict *dict);
+INTERNAL_LINKAGE void rpc_dict_iter_init(struct rpc_dict_iter *iter,
+    struct rpc_dict *dict);
+INTERNAL_LINKAGE bool rpc_dict_iter_next(struct rpc_dict_iter *iter,
+    const char **key, rpc_object_t *value);
+INTERNAL_LINKAGE void rpc_dict_iter_replace(struct rpc_dict_iter *iter,
+    rpc_object_t value);
+INTERNAL_LINKAGE struct rpc_arena *rpc_arena_new(size_t hint);
+INTERNAL_LINKAGE void *rpc_arena_alloc(struct rpc_arena *arena, size_t size);
+INTERNAL_LINKAGE void rpc_arena_retain(struct rpc_arena *arena);
+INTERNAL_LINKAGE void rpc_arena_release(struct rpc_arena *arena);
 
 #if defined(__linux__)
 INTERNAL_LINKAGE rpc_object_t rpc_shmem_recreate(int fd, off_t offset,
     size_t size);
+INTERNAL_LINKAGE rpc_object_t rpc_shmem_create_pooled(
+    struct rpc_shmem_pool *pool, off_t offset, size_t size);
 INTERNAL_LINKAGE int rpc_shmem_get_fd(rpc_object_t shmem);
 INTERNAL_LINKAGE off_t rpc_shmem_get_offset(rpc_object_t shmem);
+INTERNAL_LINKAGE void rpc_shmem_pool_unref(struct rpc_shmem_pool *pool);
+INTERNAL_LINKAGE void rpc_shmem_advise(void *addr, size_t size, int flags);
+INTERNAL_LINKAGE void rpc_shmem_block_release(struct rpc_shmem_block *block);
+INTERNAL_LINKAGE struct rpc_shmem_link *rpc_shmem_link_new(
+    rpc_connection_t conn);
+INTERNAL_LINKAGE void rpc_shmem_link_reset(struct rpc_shmem_link *link);
+INTERNAL_LINKAGE void rpc_shmem_link_retain(struct rpc_shmem_link *link);
+INTERNAL_LINKAGE void rpc_shmem_link_release(struct rpc_shmem_link *link);
+INTERNAL_LINKAGE bool rpc_shmem_link_lend(struct rpc_shmem_link *link,
+    struct rpc_shmem_pool *pool, off_t offset);
+INTERNAL_LINKAGE struct rpc_shmem_pool *rpc_shmem_link_import(
+    struct rpc_shmem_link *link, uint64_t id, int fd, size_t size);
+INTERNAL_LINKAGE void rpc_shmem_link_cache(struct rpc_shmem_link *link,
+    struct rpc_shmem_block *block);
+INTERNAL_LINKAGE struct rpc_shmem_pool *rpc_shmem_link_lookup(
+    struct rpc_shmem_link *link, uint64_t id);
+INTERNAL_LINKAGE void rpc_shmem_link_returned(struct rpc_shmem_link *link,
+    uint64_t id, off_t offset);
+INTERNAL_LINKAGE bool rpc_shmem_link_queue_return(struct rpc_shmem_link *link,
+    uint64_t id, off_t offset);
+INTERNAL_LINKAGE rpc_object_t rpc_shmem_link_take_returns(
+    struct rpc_shmem_link *link);
+INTERNAL_LINKAGE void rpc_shmem_link_set_bulk(struct rpc_shmem_link *link,
+    struct rpc_shmem_pool *pool, size_t threshold);
+INTERNAL_LINKAGE struct rpc_shmem_pool *rpc_shmem_link_get_bulk(
+    struct rpc_shmem_link *link);
+INTERNAL_LINKAGE rpc_object_t rpc_shmem_link_bulk(struct rpc_shmem_link *link,
+    const void *data, size_t size);
+INTERNAL_LINKAGE void rpc_connection_return_shmem(rpc_connection_t conn,
+    uint64_t id, off_t offset);
 #endif
 
 INTERNAL_LINKAGE rpc_object_t rpc_error_create_from_gerror(GError *g_error);
 
 INTERNAL_LINKAGE void rpc_abort(const char *fmt, ...);
-INTERNAL_LINKAGE void rpc_trace(const char *msg, const char *ident,
-    rpc_object_t frame);
+INTERNAL_LINKAGE extern volatile gint rpc_trace_active;
+#define	RPC_TRACING()	G_UNLIKELY(g_atomic_int_get(&rpc_trace_active))
+INTERNAL_LINKAGE void rpc_trace_init(void);
+INTERNAL_LINKAGE void rpc_trace_record(uint64_t conn, uint16_t op,
+    uint16_t flags, uint64_t call_id, const void *data, size_t len);
+INTERNAL_LINKAGE extern volatile gint rpc_lockprof_active;
+#define	RPC_LOCKPROFILING()	\
+	G_UNLIKELY(g_atomic_int_get(&rpc_lockprof_active))
+INTERNAL_LINKAGE void rpc_lockprof_init(void);
+INTERNAL_LINKAGE void rpc_lockprof_mutex_lock(GMutex *mutex,
+    const char *site);
+INTERNAL_LINKAGE void rpc_lockprof_mutex_unlock(GMutex *mutex);
+INTERNAL_LINKAGE void rpc_lockprof_rw_lock(GRWLock *lock, bool write,
+    const char *site);
+INTERNAL_LINKAGE void rpc_lockprof_rw_unlock(GRWLock *lock, bool write);
+INTERNAL_LINKAGE gboolean rpc_lockprof_cond_wait(GCond *cond, GMutex *mutex,
+    gint64 end_time, const char *site);
+
+INTERNAL_LINKAGE extern volatile gint rpc_spans_active;
+#define	RPC_SPANS_ACTIVE()	G_UNLIKELY(g_atomic_int_get(&rpc_spans_active))
+INTERNAL_LINKAGE int rpc_span_context_parse(struct rpc_span_context *ctx,
+    const char *traceparent, const char *tracestate);
+INTERNAL_LINKAGE void rpc_span_context_child(struct rpc_span_context *ctx,
+    const struct rpc_span_context *parent);
+INTERNAL_LINKAGE void rpc_span_context_free(struct rpc_span_context *ctx);
+INTERNAL_LINKAGE const char *rpc_span_traceparent(
+    struct rpc_span_context *ctx);
+INTERNAL_LINKAGE void rpc_span_inbound(struct rpc_call *call,
+    const char *traceparent, const char *tracestate);
+INTERNAL_LINKAGE void rpc_span_outbound(struct rpc_call *call);
+INTERNAL_LINKAGE struct rpc_span_context *rpc_span_enter(
+    struct rpc_call *call);
+INTERNAL_LINKAGE void rpc_span_leave(struct rpc_span_context *prev);
+INTERNAL_LINKAGE void rpc_span_stream_start(struct rpc_call *call);
+INTERNAL_LINKAGE void rpc_span_serialized(uint64_t ns);
+INTERNAL_LINKAGE uint64_t rpc_span_take_serialized(void);
+INTERNAL_LINKAGE void rpc_span_inbound_done(struct rpc_call *call);
+INTERNAL_LINKAGE void rpc_span_outbound_done(struct rpc_call *call,
+    bool failed);
+
+#ifdef RPC_LOCKPROF
+/* Lock contention profiling, see rpc_lockprof.c */
+#define	g_mutex_lock(_m)		rpc_lockprof_mutex_lock((_m), G_STRLOC)
+#define	g_mutex_unlock(_m)		rpc_lockprof_mutex_unlock((_m))
+#define	g_rw_lock_reader_lock(_l)	\
+	rpc_lockprof_rw_lock((_l), false, G_STRLOC)
+#define	g_rw_lock_reader_unlock(_l)	rpc_lockprof_rw_unlock((_l), false)
+#define	g_rw_lock_writer_lock(_l)	\
+	rpc_lockprof_rw_lock((_l), true, G_STRLOC)
+#define	g_rw_lock_writer_unlock(_l)	rpc_lockprof_rw_unlock((_l), true)
+#define	g_cond_wait(_c, _m)		\
+	(void)rpc_lockprof_cond_wait((_c), (_m), -1, G_STRLOC)
+#define	g_cond_wait_until(_c, _m, _t)	\
+	rpc_lockprof_cond_wait((_c), (_m), (_t), G_STRLOC)
+#endif
+
 INTERNAL_LINKAGE char *rpc_get_backtrace(void);
+INTERNAL_LINKAGE int rpc_backtrace_capture(void **buffer, int size);
+INTERNAL_LINKAGE GDateTime *rpc_date_get_gdatetime(rpc_object_t xdate);
+INTERNAL_LINKAGE rpc_object_t rpc_error_create_nostack(int code,
+    const char *msg, rpc_object_t extra);
+INTERNAL_LINKAGE rpc_object_t rpc_error_strip_stack(rpc_object_t error);
+INTERNAL_LINKAGE bool rpc_error_set_thread_capture(bool enable);
+INTERNAL_LINKAGE char *rpc_backtrace_format(void *const *frames, int count);
 INTERNAL_LINKAGE char *rpc_generate_v4_uuid(void);
+INTERNAL_LINKAGE char *rpc_generate_token(void);
 INTERNAL_LINKAGE gboolean rpc_kill_main_loop(void *arg);
+INTERNAL_LINKAGE struct rpc_iomux_handle *rpc_iomux_add(int fd,
+    rpc_iomux_fn_t fn, void *arg, guint nthreads, const GArray *cpus,
+    rpc_iomux_backend_t backend, int shard);
+INTERNAL_LINKAGE void rpc_iomux_remove(struct rpc_iomux_handle *handle);
+INTERNAL_LINKAGE bool rpc_iomux_supported(void);
+INTERNAL_LINKAGE void *rpc_recv_buffer_alloc(size_t size);
+INTERNAL_LINKAGE void *rpc_recv_buffer_wrap(GBytes *bytes);
+INTERNAL_LINKAGE void *rpc_recv_buffer_retain(void *data);
+INTERNAL_LINKAGE void rpc_recv_buffer_release(void *data);
+INTERNAL_LINKAGE void rpc_output_buffer_recycle(struct rpc_output_buffer *buf);
+INTERNAL_LINKAGE void rpc_output_buffer_free(struct rpc_output_buffer *buf);
+INTERNAL_LINKAGE void rpc_output_buffer_append(struct rpc_output_buffer *buf,
+    const void *data, size_t len);
+INTERNAL_LINKAGE void rpc_output_buffer_swap(struct rpc_output_buffer *a,
+    struct rpc_output_buffer *b);
+INTERNAL_LINKAGE size_t rpc_output_buffer_get_iov(
+    struct rpc_output_buffer *buf, guint first, guint count,
+    struct iovec **iovp, size_t *frame_niov);
+INTERNAL_LINKAGE rpc_object_t rpc_output_buffer_get_stats(
+    struct rpc_output_buffer *buf);
 INTERNAL_LINKAGE int rpc_ptr_array_string_index(GPtrArray *arr,
     const char *str);
 
 INTERNAL_LINKAGE const struct rpc_transport *rpc_find_transport(
     const char *scheme);
+INTERNAL_LINKAGE int rpc_serializer_write_all(int fd, const void *buf,
+    size_t len);
 INTERNAL_LINKAGE const struct rpc_serializer *rpc_find_serializer(
     const char *name);
 INTERNAL_LINKAGE const struct rpct_validator *rpc_find_validator(
@@ -583,16 +1607,27 @@ INTERNAL_LINKAGE void rpc_set_last_gerror(GError *error);
 INTERNAL_LINKAGE void rpc_set_last_errorf(int code, const char *fmt, ...)
     __attribute__((__format__(__printf__, 2, 3)));
 INTERNAL_LINKAGE rpc_connection_t rpc_connection_alloc(rpc_server_t server);
+INTERNAL_LINKAGE rpc_connection_t rpc_connection_create_uri(void *cookie,
+    const char *uri, rpc_object_t params);
 INTERNAL_LINKAGE void rpc_connection_dispatch(rpc_connection_t, rpc_object_t);
 INTERNAL_LINKAGE int rpc_connection_retain(rpc_connection_t);
 INTERNAL_LINKAGE int rpc_connection_release(rpc_connection_t);
 INTERNAL_LINKAGE int rpc_connection_retain_if_valid(rpc_connection_t, bool);
+INTERNAL_LINKAGE GMainContext *rpc_connection_get_main_context(
+    rpc_connection_t);
+INTERNAL_LINKAGE rpc_object_t rpc_connection_call_sync_impl(rpc_connection_t,
+    const char *, const char *, const char *, rpc_object_t);
 INTERNAL_LINKAGE int rpc_context_dispatch(rpc_context_t, struct rpc_call *);
 INTERNAL_LINKAGE int rpc_server_dispatch(rpc_server_t, struct rpc_call *);
+INTERNAL_LINKAGE bool rpc_server_should_shed(rpc_server_t, struct rpc_call *);
 INTERNAL_LINKAGE void rpc_server_release(rpc_server_t);
 INTERNAL_LINKAGE void rpc_server_quit(rpc_server_t);
 INTERNAL_LINKAGE void rpc_server_disconnect(rpc_server_t, rpc_connection_t);
 INTERNAL_LINKAGE GMainContext *rpc_server_get_main_context(rpc_server_t);
+INTERNAL_LINKAGE void rpc_server_broadcast_local(rpc_server_t, const char *,
+    const char *, const char *, rpc_object_t);
+INTERNAL_LINKAGE void rpc_prefork_relay(rpc_server_t, const char *,
+    const char *, const char *, rpc_object_t);
 INTERNAL_LINKAGE GMainContext *rpc_client_get_main_context(rpc_client_t);
 
 INTERNAL_LINKAGE void rpc_connection_send_err(rpc_connection_t, rpc_object_t,
@@ -601,16 +1636,133 @@ INTERNAL_LINKAGE void rpc_connection_send_errx(rpc_connection_t, rpc_object_t,
     rpc_object_t);
 INTERNAL_LINKAGE void rpc_connection_send_response(rpc_connection_t,
     rpc_object_t, rpc_object_t);
+INTERNAL_LINKAGE void rpc_connection_send_tagged_response(struct rpc_call *,
+    rpc_object_t);
 INTERNAL_LINKAGE void rpc_connection_send_start_stream(rpc_connection_t,
-    rpc_object_t, int64_t);
+    rpc_object_t, int64_t, bool);
 INTERNAL_LINKAGE void rpc_connection_send_fragment(rpc_connection_t,
     rpc_object_t, int64_t, rpc_object_t);
 INTERNAL_LINKAGE void rpc_connection_send_end(rpc_connection_t, rpc_object_t,
     int64_t);
+INTERNAL_LINKAGE void rpc_connection_queue_fragment(struct rpc_call *,
+    int64_t, rpc_object_t, bool);
+INTERNAL_LINKAGE void rpc_connection_flush_fragments(struct rpc_call *);
+INTERNAL_LINKAGE bool rpc_call_can_yield(struct rpc_call *);
+INTERNAL_LINKAGE size_t rpc_object_size_hint(rpc_object_t);
+INTERNAL_LINKAGE void rpc_connection_send_upload_continue(rpc_connection_t,
+    rpc_object_t, int64_t);
 INTERNAL_LINKAGE void rpc_connection_close_inbound_call(struct rpc_call *);
+INTERNAL_LINKAGE struct rpc_shared_event *rpc_shared_event_create(
+    const char *path, const char *interface, const char *name,
+    rpc_object_t args);
+INTERNAL_LINKAGE void rpc_shared_event_retain(struct rpc_shared_event *ev);
+INTERNAL_LINKAGE void rpc_shared_event_release(struct rpc_shared_event *ev);
+INTERNAL_LINKAGE rpc_object_t rpc_shared_event_get(struct rpc_shared_event *ev);
+INTERNAL_LINKAGE void rpc_connection_post_event(rpc_connection_t conn,
+    struct rpc_shared_event *ev);
+INTERNAL_LINKAGE void rpc_connection_deliver_event(rpc_connection_t conn,
+    rpc_object_t event);
+INTERNAL_LINKAGE void rpc_connection_send_event_repair(rpc_connection_t conn,
+    uint64_t from, uint64_t to);
+INTERNAL_LINKAGE struct rpc_event_group *rpc_event_group_create(
+    GMainContext *context, rpc_object_t params);
+INTERNAL_LINKAGE void rpc_event_group_free(struct rpc_event_group *group);
+INTERNAL_LINKAGE const char *rpc_event_group_name(
+    struct rpc_event_group *group);
+INTERNAL_LINKAGE uint64_t rpc_event_group_id(struct rpc_event_group *group);
+INTERNAL_LINKAGE bool rpc_event_group_publish(struct rpc_event_group *group,
+    struct rpc_shared_event *ev, uint64_t *seqp);
+INTERNAL_LINKAGE uint64_t rpc_event_group_join(struct rpc_event_group *group,
+    rpc_connection_t conn);
+INTERNAL_LINKAGE void rpc_event_group_repair(struct rpc_event_group *group,
+    rpc_connection_t conn, uint64_t from, uint64_t to);
+INTERNAL_LINKAGE struct rpc_event_member *rpc_event_member_create(
+    rpc_connection_t conn, const char *name, uint64_t id);
+INTERNAL_LINKAGE void rpc_event_member_synced(struct rpc_event_member *member,
+    uint64_t seq);
+INTERNAL_LINKAGE void rpc_event_member_detach(struct rpc_event_member *member);
+INTERNAL_LINKAGE bool rpc_call_deadline_passed(struct rpc_call *);
 INTERNAL_LINKAGE int rpc_connection_call_retain(struct rpc_call *call);
 INTERNAL_LINKAGE int rpc_connection_call_release(struct rpc_call *call);
+INTERNAL_LINKAGE struct rpc_executor_queue *rpc_executor_queue_create(
+    void *arg);
+INTERNAL_LINKAGE bool rpc_executor_queue_push(struct rpc_executor_queue *queue,
+    rpc_executor_fn_t fn, void *item);
+INTERNAL_LINKAGE void rpc_executor_queue_destroy(
+    struct rpc_executor_queue *queue);
+INTERNAL_LINKAGE GHashTable *rpc_method_stats_table_new(void);
+INTERNAL_LINKAGE void rpc_method_stats_free(gpointer data);
+INTERNAL_LINKAGE void rpc_context_account_call(struct rpc_call *call);
+INTERNAL_LINKAGE void rpc_context_check_send_backlog(rpc_connection_t conn,
+    size_t backlog);
+INTERNAL_LINKAGE void rpc_context_check_call_backlog(struct rpc_call *call);
+INTERNAL_LINKAGE uint64_t rpc_stats_now(void);
+INTERNAL_LINKAGE void rpc_histogram_record(struct rpc_histogram *hist,
+    uint64_t value);
+INTERNAL_LINKAGE uint64_t rpc_histogram_percentile(struct rpc_histogram *hist,
+    uint64_t count, double pct);
+INTERNAL_LINKAGE void rpc_conn_stats_init(struct rpc_conn_stats *stats);
+INTERNAL_LINKAGE void rpc_conn_stats_destroy(struct rpc_conn_stats *stats);
+INTERNAL_LINKAGE void rpc_conn_stats_error(struct rpc_conn_stats *stats,
+    bool sent, int code);
+INTERNAL_LINKAGE void rpc_conn_stats_merge(struct rpc_conn_stats *dst,
+    struct rpc_conn_stats *src);
+INTERNAL_LINKAGE void rpc_conn_stats_export(struct rpc_conn_stats *stats,
+    rpc_object_t dict);
+INTERNAL_LINKAGE uint64_t rpc_connection_take_sent_bytes(void);
+INTERNAL_LINKAGE gpointer rpc_object_cache_alloc(struct rpc_object_cache *,
+    bool *);
+INTERNAL_LINKAGE void rpc_object_cache_free(struct rpc_object_cache *,
+    gpointer);
+INTERNAL_LINKAGE void rpc_object_cache_thread_exit(gpointer);
+INTERNAL_LINKAGE void rpc_epoch_enter(void);
+INTERNAL_LINKAGE void rpc_epoch_exit(void);
+INTERNAL_LINKAGE void rpc_epoch_retire(void *ptr, GDestroyNotify fn);
+INTERNAL_LINKAGE struct rpc_scheduler *rpc_scheduler_create(
+    rpc_executor_fn_t fn, void *arg);
+INTERNAL_LINKAGE int rpc_scheduler_set_workers(struct rpc_scheduler *sched,
+    guint nworkers);
+INTERNAL_LINKAGE void rpc_scheduler_push(struct rpc_scheduler *sched,
+    void *item, guint level);
+INTERNAL_LINKAGE int rpc_scheduler_set_numa(struct rpc_scheduler *sched,
+    bool enable);
+INTERNAL_LINKAGE guint rpc_scheduler_get_workers(struct rpc_scheduler *sched);
+INTERNAL_LINKAGE bool rpc_scheduler_started(struct rpc_scheduler *sched);
+INTERNAL_LINKAGE void rpc_scheduler_free(struct rpc_scheduler *sched);
+INTERNAL_LINKAGE GArray *rpc_cpulist_parse(const char *spec);
+INTERNAL_LINKAGE guint rpc_node_count(void);
+INTERNAL_LINKAGE int rpc_cpu_node(int cpu);
+INTERNAL_LINKAGE int rpc_current_node(void);
+INTERNAL_LINKAGE int rpc_thread_bind(const GArray *cpus);
+INTERNAL_LINKAGE int rpc_thread_bind_cpu(int cpu);
+INTERNAL_LINKAGE int rpc_thread_bind_node(int node);
+INTERNAL_LINKAGE void rpc_completion_queue_push(rpc_completion_queue_t cq,
+    rpc_connection_t conn, rpc_call_t call, rpc_object_t event);
 INTERNAL_LINKAGE int rpc_connection_get_subscription_count(rpc_connection_t conn);
+INTERNAL_LINKAGE guint rpc_subscription_hash(gconstpointer key);
+INTERNAL_LINKAGE gboolean rpc_subscription_equal(gconstpointer a,
+    gconstpointer b);
+INTERNAL_LINKAGE void rpc_subscription_release(struct rpc_subscription *sub);
+INTERNAL_LINKAGE bool rpc_subscription_is_pattern(const char *path);
+INTERNAL_LINKAGE void rpc_context_add_event_watcher(rpc_context_t context,
+    const char *path, const char *interface, const char *name,
+    rpc_connection_t conn);
+INTERNAL_LINKAGE void rpc_context_remove_event_watcher(rpc_context_t context,
+    const char *path, const char *interface, const char *name,
+    rpc_connection_t conn);
+INTERNAL_LINKAGE void rpc_context_detach_session(rpc_context_t context,
+    rpc_connection_t conn);
+INTERNAL_LINKAGE rpc_object_t rpc_connection_snapshot_subscriptions(
+    rpc_connection_t conn);
+INTERNAL_LINKAGE void rpc_connection_restore_subscriptions(
+    rpc_connection_t conn, rpc_object_t subscriptions);
+INTERNAL_LINKAGE size_t rpc_connection_pending_calls(rpc_connection_t conn);
+INTERNAL_LINKAGE rpc_object_t rpc_connection_export_state(
+    rpc_connection_t conn);
+INTERNAL_LINKAGE int rpc_connection_import_state(rpc_connection_t conn,
+    rpc_object_t state);
+INTERNAL_LINKAGE void rpc_context_adopt_session(rpc_context_t context,
+    rpc_connection_t conn, const char *token);
 
 INTERNAL_LINKAGE void rpc_bus_event(rpc_bus_event_t, struct rpc_bus_node *);
 
@@ -625,6 +1777,12 @@ INTERNAL_LINKAGE bool rpct_validate_instance(struct rpct_typei *typei,
     rpc_object_t obj, struct rpct_error_context *errctx);
 INTERNAL_LINKAGE bool rpct_run_validators(struct rpct_typei *typei,
     rpc_object_t obj, struct rpct_error_context *errctx);
+INTERNAL_LINKAGE struct rpct_program *rpct_typei_program(
+    struct rpct_typei *typei);
+INTERNAL_LINKAGE bool rpct_is_initialized(void);
+INTERNAL_LINKAGE int rpct_init_deferred(void);
+INTERNAL_LINKAGE const struct rpct_layout *rpct_type_get_layout(
+    struct rpct_type *type);
 INTERNAL_LINKAGE struct rpct_typei *rpct_instantiate_type(const char *decl,
     struct rpct_typei *parent, struct rpct_type *ptype,
     struct rpct_file *origin);
@@ -32,7 +32,9 @@
 
 struct notify
 {
-	int 	fd;
+	int 		fd;		/* eventfd and kqueue */
+	volatile int	value;		/* futex */
+	volatile int	waiters;	/* futex */
 };
 
 void notify_init(struct notify *notify);
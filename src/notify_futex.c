@@ -0,0 +1,146 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <glib.h>
+#include "internal.h"
+#include "notify.h"
+
+/*
+ * Futex based notifications: a counter that waiters sleep on, so that
+ * a call doesn't need a file descriptor of its own.
+ */
+
+static int notify_futex(volatile int *, int, int, const struct timespec *);
+static int notify_take(struct notify *);
+static int notify_sleep(struct notify *, const struct timespec *);
+
+static int
+notify_futex(volatile int *uaddr, int op, int val, const struct timespec *ts)
+{
+
+	return ((int)syscall(SYS_futex, uaddr, op | FUTEX_PRIVATE_FLAG, val,
+	    ts, NULL, FUTEX_BITSET_MATCH_ANY));
+}
+
+static int
+notify_take(struct notify *notify)
+{
+	int value;
+
+	for (;;) {
+		value = g_atomic_int_get(&notify->value);
+		if (value == 0)
+			return (0);
+
+		if (g_atomic_int_compare_and_exchange(&notify->value, value, 0))
+			return (value);
+	}
+}
+
+static int
+notify_sleep(struct notify *notify, const struct timespec *deadline)
+{
+	int value;
+	int ret;
+
+	for (;;) {
+		value = notify_take(notify);
+		if (value > 0)
+			return (value);
+
+		g_atomic_int_inc(&notify->waiters);
+		ret = notify_futex(&notify->value, FUTEX_WAIT_BITSET, 0,
+		    deadline);
+		g_atomic_int_add(&notify->waiters, -1);
+
+		if (ret == 0 || errno == EAGAIN)
+			continue;
+
+		if (errno == ETIMEDOUT)
+			return (notify_take(notify));
+
+		return (-1);
+	}
+}
+
+void
+notify_init(struct notify *notify)
+{
+
+	notify->fd = -1;
+	notify->value = 0;
+	notify->waiters = 0;
+}
+
+void
+notify_free(struct notify *notify __unused)
+{
+
+}
+
+int
+notify_wait(struct notify *notify)
+{
+
+	return (notify_sleep(notify, NULL));
+}
+
+int
+notify_timedwait(struct notify *notify, const struct timespec *ts)
+{
+	struct timespec deadline;
+
+	if (ts == NULL)
+		return (notify_sleep(notify, NULL));
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += ts->tv_sec;
+	deadline.tv_nsec += ts->tv_nsec;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	return (notify_sleep(notify, &deadline));
+}
+
+int
+notify_signal(struct notify *notify)
+{
+
+	g_atomic_int_inc(&notify->value);
+	if (g_atomic_int_get(&notify->waiters) > 0)
+		notify_futex(&notify->value, FUTEX_WAKE, 1, NULL);
+
+	return (0);
+}
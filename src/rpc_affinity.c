@@ -0,0 +1,260 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "internal.h"
+
+/*
+ * CPU and NUMA node placement of library threads.
+ *
+ * The topology is read from sysfs once, the first time it's needed.
+ * Elsewhere, and on machines without node information, there's just
+ * node 0 and threads can't be bound.
+ */
+
+#define	RPC_NODE_SYSFS	"/sys/devices/system/node"
+
+static void rpc_topology_init(void);
+
+static GArray *rpc_cpu_nodes;		/* CPU -> node, -1 if unknown */
+static guint rpc_nnodes = 1;
+
+static void
+rpc_topology_init(void)
+{
+	static gsize initialized = 0;
+	const char *name;
+	GArray *cpus;
+	GDir *dir;
+	char *path;
+	char *list;
+	guint64 node;
+	guint i;
+	int none = -1;
+	int cpu;
+
+	if (!g_once_init_enter(&initialized))
+		return;
+
+	rpc_cpu_nodes = g_array_new(false, false, sizeof(int));
+	dir = g_dir_open(RPC_NODE_SYSFS, 0, NULL);
+	while (dir != NULL && (name = g_dir_read_name(dir)) != NULL) {
+		if (!g_str_has_prefix(name, "node") ||
+		    !g_ascii_string_to_unsigned(name + 4, 10, 0, G_MAXINT,
+		    &node, NULL))
+			continue;
+
+		path = g_strdup_printf("%s/%s/cpulist", RPC_NODE_SYSFS, name);
+		if (!g_file_get_contents(path, &list, NULL, NULL)) {
+			g_free(path);
+			continue;
+		}
+
+		cpus = rpc_cpulist_parse(g_strstrip(list));
+		for (i = 0; cpus != NULL && i < cpus->len; i++) {
+			cpu = g_array_index(cpus, int, i);
+			while (rpc_cpu_nodes->len <= (guint)cpu)
+				g_array_append_val(rpc_cpu_nodes, none);
+
+			g_array_index(rpc_cpu_nodes, int, cpu) = (int)node;
+		}
+
+		rpc_nnodes = MAX(rpc_nnodes, (guint)node + 1);
+		if (cpus != NULL)
+			g_array_unref(cpus);
+
+		g_free(list);
+		g_free(path);
+	}
+
+	if (dir != NULL)
+		g_dir_close(dir);
+
+	g_once_init_leave(&initialized, 1);
+}
+
+/*
+ * Parses a CPU list in the kernel's notation, as in "0-7,16,18-19".
+ */
+GArray *
+rpc_cpulist_parse(const char *spec)
+{
+	GArray *result;
+	char **ranges;
+	char **bounds;
+	guint64 first;
+	guint64 last;
+	guint i;
+	int cpu;
+
+	result = g_array_new(false, false, sizeof(int));
+	ranges = g_strsplit(spec, ",", -1);
+	for (i = 0; ranges[i] != NULL; i++) {
+		bounds = g_strsplit(g_strstrip(ranges[i]), "-", 2);
+		if (!g_ascii_string_to_unsigned(bounds[0], 10, 0,
+		    RPC_CPU_MAX - 1, &first, NULL) ||
+		    !g_ascii_string_to_unsigned(
+		    bounds[1] != NULL ? bounds[1] : bounds[0], 10, first,
+		    RPC_CPU_MAX - 1, &last, NULL)) {
+			g_strfreev(bounds);
+			g_strfreev(ranges);
+			g_array_unref(result);
+			rpc_set_last_errorf(EINVAL, "Invalid CPU list: %s",
+			    spec);
+			return (NULL);
+		}
+
+		for (cpu = (int)first; cpu <= (int)last; cpu++)
+			g_array_append_val(result, cpu);
+
+		g_strfreev(bounds);
+	}
+
+	g_strfreev(ranges);
+	return (result);
+}
+
+guint
+rpc_node_count(void)
+{
+
+	rpc_topology_init();
+	return (rpc_nnodes);
+}
+
+int
+rpc_cpu_node(int cpu)
+{
+
+	rpc_topology_init();
+	if (cpu < 0 || (guint)cpu >= rpc_cpu_nodes->len)
+		return (-1);
+
+	return (g_array_index(rpc_cpu_nodes, int, cpu));
+}
+
+/*
+ * Node the calling thread runs on right now, or -1 if unknown.
+ */
+int
+rpc_current_node(void)
+{
+
+#if defined(__linux__)
+	return (rpc_cpu_node(sched_getcpu()));
+#else
+	return (-1);
+#endif
+}
+
+#if defined(__linux__)
+int
+rpc_thread_bind(const GArray *cpus)
+{
+	cpu_set_t set;
+	guint i;
+	int cpu;
+	int ret;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < cpus->len; i++) {
+		cpu = g_array_index(cpus, int, i);
+		if (cpu >= 0 && cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+
+	if (CPU_COUNT(&set) == 0) {
+		rpc_set_last_error(EINVAL, "No usable CPUs", NULL);
+		return (-1);
+	}
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0) {
+		rpc_set_last_errorf(ret, "Cannot set CPU affinity: %s",
+		    g_strerror(ret));
+		return (-1);
+	}
+
+	return (0);
+}
+#else
+int
+rpc_thread_bind(const GArray *cpus __unused)
+{
+
+	rpc_set_last_error(ENOTSUP, "Not supported on this platform", NULL);
+	return (-1);
+}
+#endif
+
+int
+rpc_thread_bind_cpu(int cpu)
+{
+	GArray *cpus;
+	int ret;
+
+	cpus = g_array_new(false, false, sizeof(int));
+	g_array_append_val(cpus, cpu);
+	ret = rpc_thread_bind(cpus);
+	g_array_unref(cpus);
+	return (ret);
+}
+
+/*
+ * Binds the calling thread to the CPUs of @p node. Memory the thread
+ * touches first then comes from that node, under the default policy.
+ */
+int
+rpc_thread_bind_node(int node)
+{
+	GArray *cpus;
+	guint i;
+	int cpu;
+	int ret;
+
+	rpc_topology_init();
+	cpus = g_array_new(false, false, sizeof(int));
+	for (i = 0; i < rpc_cpu_nodes->len; i++) {
+		cpu = (int)i;
+		if (g_array_index(rpc_cpu_nodes, int, i) == node)
+			g_array_append_val(cpus, cpu);
+	}
+
+	ret = rpc_thread_bind(cpus);
+	g_array_unref(cpus);
+	return (ret);
+}
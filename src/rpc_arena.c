@@ -0,0 +1,137 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Bump allocator backing the object graph of a decoded frame. Every
+ * object carved out of an arena holds a reference to it; the memory is
+ * returned in one go once the last of those objects is released.
+ * Objects outliving the rest of the frame simply keep the arena alive.
+ */
+
+#define	RPC_ARENA_ALIGN		16
+#define	RPC_ARENA_CHUNK_MIN	1024
+#define	RPC_ARENA_CHUNK_MAX	(64 * 1024)
+
+struct rpc_arena_chunk
+{
+	struct rpc_arena_chunk *rac_next;
+	char			rac_data[];
+};
+
+struct rpc_arena
+{
+	volatile int		ra_refcnt;
+	struct rpc_arena_chunk *ra_chunks;
+	char *			ra_ptr;
+	size_t			ra_left;
+	size_t			ra_next_size;
+};
+
+static void *rpc_arena_chunk_alloc(struct rpc_arena *, size_t);
+
+static void *
+rpc_arena_chunk_alloc(struct rpc_arena *arena, size_t size)
+{
+	struct rpc_arena_chunk *chunk;
+
+	chunk = g_malloc(sizeof(*chunk) + size + RPC_ARENA_ALIGN);
+	chunk->rac_next = arena->ra_chunks;
+	arena->ra_chunks = chunk;
+
+	return ((void *)(((uintptr_t)chunk->rac_data + RPC_ARENA_ALIGN - 1) &
+	    ~(uintptr_t)(RPC_ARENA_ALIGN - 1)));
+}
+
+struct rpc_arena *
+rpc_arena_new(size_t hint)
+{
+	struct rpc_arena *arena;
+
+	arena = g_malloc0(sizeof(*arena));
+	arena->ra_refcnt = 1;
+	arena->ra_next_size = CLAMP(hint, RPC_ARENA_CHUNK_MIN,
+	    RPC_ARENA_CHUNK_MAX);
+
+	return (arena);
+}
+
+/*
+ * Not thread-safe; arenas are only ever filled by the thread decoding
+ * the frame.
+ */
+void *
+rpc_arena_alloc(struct rpc_arena *arena, size_t size)
+{
+	void *ret;
+
+	size = (size + RPC_ARENA_ALIGN - 1) & ~(size_t)(RPC_ARENA_ALIGN - 1);
+
+	/* Large allocations get a chunk of their own */
+	if (size > arena->ra_next_size / 2)
+		return (rpc_arena_chunk_alloc(arena, size));
+
+	if (size > arena->ra_left) {
+		arena->ra_ptr = rpc_arena_chunk_alloc(arena,
+		    arena->ra_next_size);
+		arena->ra_left = arena->ra_next_size;
+		arena->ra_next_size = MIN(arena->ra_next_size * 2,
+		    RPC_ARENA_CHUNK_MAX);
+	}
+
+	ret = arena->ra_ptr;
+	arena->ra_ptr += size;
+	arena->ra_left -= size;
+	return (ret);
+}
+
+void
+rpc_arena_retain(struct rpc_arena *arena)
+{
+
+	g_atomic_int_inc(&arena->ra_refcnt);
+}
+
+void
+rpc_arena_release(struct rpc_arena *arena)
+{
+	struct rpc_arena_chunk *chunk;
+
+	if (!g_atomic_int_dec_and_test(&arena->ra_refcnt))
+		return;
+
+	while (arena->ra_chunks != NULL) {
+		chunk = arena->ra_chunks;
+		arena->ra_chunks = chunk->rac_next;
+		g_free(chunk);
+	}
+
+	g_free(arena);
+}
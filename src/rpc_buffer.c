@@ -0,0 +1,179 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Receive buffers are pooled per power-of-two size class. Each buffer
+ * carries a reference count in front of its payload, so objects decoded
+ * from a frame may keep pointing into it after the transport is done
+ * with the frame itself.
+ */
+
+#define	RECV_POOL_MIN_SHIFT	12	/* 4 KiB */
+#define	RECV_POOL_MAX_SHIFT	24	/* 16 MiB */
+#define	RECV_POOL_CLASSES	(RECV_POOL_MAX_SHIFT - RECV_POOL_MIN_SHIFT + 1)
+#define	RECV_POOL_DEPTH		16
+
+struct rpc_recv_buffer
+{
+	volatile int		rrb_refcnt;
+	int			rrb_class;
+	size_t			rrb_size;
+	GBytes *		rrb_bytes;
+	char			rrb_data[];
+};
+
+struct rpc_recv_pool_class
+{
+	GMutex			rrp_mtx;
+	GSList *		rrp_free;
+	guint			rrp_count;
+};
+
+static int rpc_recv_buffer_class(size_t);
+static struct rpc_recv_buffer *rpc_recv_buffer_from_data(void *);
+
+static struct rpc_recv_pool_class recv_pool[RECV_POOL_CLASSES];
+
+static int
+rpc_recv_buffer_class(size_t size)
+{
+	int shift = RECV_POOL_MIN_SHIFT;
+
+	while (shift <= RECV_POOL_MAX_SHIFT) {
+		if (size <= ((size_t)1 << shift))
+			return (shift - RECV_POOL_MIN_SHIFT);
+
+		shift++;
+	}
+
+	return (-1);
+}
+
+static struct rpc_recv_buffer *
+rpc_recv_buffer_from_data(void *data)
+{
+
+	return ((struct rpc_recv_buffer *)((char *)data -
+	    offsetof(struct rpc_recv_buffer, rrb_data)));
+}
+
+void *
+rpc_recv_buffer_alloc(size_t size)
+{
+	struct rpc_recv_pool_class *pc;
+	struct rpc_recv_buffer *buf = NULL;
+	size_t capacity = size;
+	int cls;
+
+	cls = rpc_recv_buffer_class(size);
+	if (cls >= 0) {
+		pc = &recv_pool[cls];
+		capacity = (size_t)1 << (cls + RECV_POOL_MIN_SHIFT);
+
+		g_mutex_lock(&pc->rrp_mtx);
+		if (pc->rrp_free != NULL) {
+			buf = pc->rrp_free->data;
+			pc->rrp_free = g_slist_delete_link(pc->rrp_free,
+			    pc->rrp_free);
+			pc->rrp_count--;
+		}
+		g_mutex_unlock(&pc->rrp_mtx);
+	}
+
+	if (buf == NULL)
+		buf = g_malloc(sizeof(*buf) + capacity);
+
+	buf->rrb_refcnt = 1;
+	buf->rrb_class = cls;
+	buf->rrb_size = size;
+	buf->rrb_bytes = NULL;
+	return (buf->rrb_data);
+}
+
+/*
+ * Returns a receive buffer that holds no data of its own, but keeps the
+ * bytes alive for as long as it is referenced. Frames inside the bytes
+ * can then be decoded in place.
+ */
+void *
+rpc_recv_buffer_wrap(GBytes *bytes)
+{
+	struct rpc_recv_buffer *buf;
+
+	buf = g_malloc(sizeof(*buf));
+	buf->rrb_refcnt = 1;
+	buf->rrb_class = -1;
+	buf->rrb_size = 0;
+	buf->rrb_bytes = g_bytes_ref(bytes);
+	return (buf->rrb_data);
+}
+
+void *
+rpc_recv_buffer_retain(void *data)
+{
+	struct rpc_recv_buffer *buf = rpc_recv_buffer_from_data(data);
+
+	g_atomic_int_inc(&buf->rrb_refcnt);
+	return (data);
+}
+
+void
+rpc_recv_buffer_release(void *data)
+{
+	struct rpc_recv_pool_class *pc;
+	struct rpc_recv_buffer *buf;
+
+	if (data == NULL)
+		return;
+
+	buf = rpc_recv_buffer_from_data(data);
+	if (!g_atomic_int_dec_and_test(&buf->rrb_refcnt))
+		return;
+
+	if (buf->rrb_bytes != NULL) {
+		g_bytes_unref(buf->rrb_bytes);
+		g_free(buf);
+		return;
+	}
+
+	if (buf->rrb_class >= 0) {
+		pc = &recv_pool[buf->rrb_class];
+		g_mutex_lock(&pc->rrp_mtx);
+		if (pc->rrp_count < RECV_POOL_DEPTH) {
+			pc->rrp_free = g_slist_prepend(pc->rrp_free, buf);
+			pc->rrp_count++;
+			buf = NULL;
+		}
+		g_mutex_unlock(&pc->rrp_mtx);
+	}
+
+	g_free(buf);
+}
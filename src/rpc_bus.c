@@ -26,6 +26,7 @@
 
 #include <Block.h>
 #include <errno.h>
+#include <string.h>
 #include <glib.h>
 #include <rpc/bus.h>
 #include "internal.h"
@@ -38,6 +39,152 @@ static GMutex rpc_bus_mtx = { 0 };
 static void *rpc_bus_context = NULL;
 static gint rpc_bus_refcnt = 0;
 
+/*
+ * Live node table, keyed by bus address. It is seeded by a single
+ * transport enumeration and then kept current by hot-plug events, so
+ * rpc_bus_enumerate() only copies it. Addresses touched by events before
+ * the seed completes are recorded in rpc_bus_touched and win over the
+ * (possibly older) enumeration result.
+ */
+static GMutex rpc_bus_nodes_mtx = { 0 };
+static GHashTable *rpc_bus_nodes = NULL;
+static GHashTable *rpc_bus_touched = NULL;
+static bool rpc_bus_nodes_valid = false;
+
+static size_t rpc_bus_node_strsize(const struct rpc_bus_node *);
+static const char *rpc_bus_strpack(const char *, char **);
+static void rpc_bus_node_pack(struct rpc_bus_node *,
+    const struct rpc_bus_node *, char **);
+static struct rpc_bus_node *rpc_bus_node_copy(const struct rpc_bus_node *);
+static int rpc_bus_seed(const struct rpc_transport *);
+static int rpc_bus_snapshot(struct rpc_bus_node **);
+
+static size_t
+rpc_bus_node_strsize(const struct rpc_bus_node *node)
+{
+	size_t size = 0;
+
+	if (node->rbn_name != NULL)
+		size += strlen(node->rbn_name) + 1;
+
+	if (node->rbn_description != NULL)
+		size += strlen(node->rbn_description) + 1;
+
+	if (node->rbn_serial != NULL)
+		size += strlen(node->rbn_serial) + 1;
+
+	return (size);
+}
+
+static const char *
+rpc_bus_strpack(const char *str, char **bufp)
+{
+	char *ret = *bufp;
+	size_t len;
+
+	if (str == NULL)
+		return (NULL);
+
+	len = strlen(str) + 1;
+	memcpy(ret, str, len);
+	*bufp += len;
+	return (ret);
+}
+
+static void
+rpc_bus_node_pack(struct rpc_bus_node *dst, const struct rpc_bus_node *src,
+    char **bufp)
+{
+
+	dst->rbn_name = rpc_bus_strpack(src->rbn_name, bufp);
+	dst->rbn_description = rpc_bus_strpack(src->rbn_description, bufp);
+	dst->rbn_serial = rpc_bus_strpack(src->rbn_serial, bufp);
+	dst->rbn_address = src->rbn_address;
+}
+
+/*
+ * Copies the node and its strings into a single allocation, so that
+ * a plain g_free() releases it.
+ */
+static struct rpc_bus_node *
+rpc_bus_node_copy(const struct rpc_bus_node *node)
+{
+	struct rpc_bus_node *copy;
+	char *buf;
+
+	copy = g_malloc(sizeof(*copy) + rpc_bus_node_strsize(node));
+	buf = (char *)(copy + 1);
+	rpc_bus_node_pack(copy, node, &buf);
+	return (copy);
+}
+
+/*
+ * Called with rpc_bus_mtx held. The transport enumeration runs without
+ * the node lock, so hot-plug events are never blocked behind a bus scan.
+ */
+static int
+rpc_bus_seed(const struct rpc_transport *bus)
+{
+	struct rpc_bus_node *result = NULL;
+	gpointer key;
+	size_t count;
+	size_t i;
+
+	if (bus->bus_ops->enumerate(rpc_bus_context, &result, &count) != 0)
+		return (-1);
+
+	g_mutex_lock(&rpc_bus_nodes_mtx);
+	for (i = 0; i < count; i++) {
+		key = GUINT_TO_POINTER(result[i].rbn_address);
+		if (g_hash_table_contains(rpc_bus_touched, key))
+			continue;
+
+		g_hash_table_replace(rpc_bus_nodes, key,
+		    rpc_bus_node_copy(&result[i]));
+	}
+
+	g_hash_table_remove_all(rpc_bus_touched);
+	rpc_bus_nodes_valid = true;
+	g_mutex_unlock(&rpc_bus_nodes_mtx);
+	g_free(result);
+	return (0);
+}
+
+/*
+ * Copies the node table into one allocation: the node array followed
+ * by the strings it points to. rpc_bus_free_result() releases it.
+ */
+static int
+rpc_bus_snapshot(struct rpc_bus_node **resultp)
+{
+	GHashTableIter iter;
+	struct rpc_bus_node *result;
+	struct rpc_bus_node *node;
+	size_t count;
+	size_t size;
+	size_t i = 0;
+	char *buf;
+
+	g_mutex_lock(&rpc_bus_nodes_mtx);
+	count = g_hash_table_size(rpc_bus_nodes);
+	size = count * sizeof(*result);
+
+	g_hash_table_iter_init(&iter, rpc_bus_nodes);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&node))
+		size += rpc_bus_node_strsize(node);
+
+	result = g_malloc(size);
+	buf = (char *)(result + count);
+
+	g_hash_table_iter_init(&iter, rpc_bus_nodes);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&node))
+		rpc_bus_node_pack(&result[i++], node, &buf);
+
+	g_mutex_unlock(&rpc_bus_nodes_mtx);
+	*resultp = result;
+	return ((int)count);
+}
+
 static void *
 rpc_bus_worker(void *arg __unused)
 {
@@ -78,6 +225,16 @@ rpc_bus_open(void)
 	if (rpc_bus_context != NULL)
 		rpc_bus_refcnt++;
 
+	g_mutex_lock(&rpc_bus_nodes_mtx);
+	if (rpc_bus_context != NULL && rpc_bus_nodes == NULL) {
+		rpc_bus_nodes = g_hash_table_new_full(g_direct_hash,
+		    g_direct_equal, NULL, g_free);
+		rpc_bus_touched = g_hash_table_new(g_direct_hash,
+		    g_direct_equal);
+		rpc_bus_nodes_valid = false;
+	}
+	g_mutex_unlock(&rpc_bus_nodes_mtx);
+
 done:
 	g_mutex_unlock(&rpc_bus_mtx);
 	return (rpc_bus_context != NULL ? 0 : -1);
@@ -117,6 +274,12 @@ rpc_bus_close(void)
 		g_main_context_unref(rpc_g_main_context);
 		g_thread_join(rpc_g_main_thread);
 		rpc_bus_context = NULL;
+
+		g_mutex_lock(&rpc_bus_nodes_mtx);
+		g_clear_pointer(&rpc_bus_nodes, g_hash_table_destroy);
+		g_clear_pointer(&rpc_bus_touched, g_hash_table_destroy);
+		rpc_bus_nodes_valid = false;
+		g_mutex_unlock(&rpc_bus_nodes_mtx);
 	}
 
 done:
@@ -173,6 +336,16 @@ rpc_bus_enumerate(struct rpc_bus_node **resultp)
 		goto done;
 	}
 
+	if (rpc_bus_nodes != NULL) {
+		if (!rpc_bus_nodes_valid && rpc_bus_seed(bus) != 0) {
+			ret = -1;
+			goto done;
+		}
+
+		ret = rpc_bus_snapshot(resultp);
+		goto done;
+	}
+
 	if (bus->bus_ops->enumerate(rpc_bus_context, &result, &count) != 0) {
 		ret = -1;
 		goto done;
@@ -214,7 +387,31 @@ rpc_bus_unregister_event_handler(void)
 void
 rpc_bus_event(rpc_bus_event_t event, struct rpc_bus_node *node)
 {
+	struct rpc_bus_node *cached = NULL;
+	gpointer key = GUINT_TO_POINTER(node->rbn_address);
+
+	g_mutex_lock(&rpc_bus_nodes_mtx);
+	if (rpc_bus_nodes != NULL) {
+		if (!rpc_bus_nodes_valid)
+			g_hash_table_add(rpc_bus_touched, key);
+
+		if (event == RPC_BUS_ATTACHED) {
+			g_hash_table_replace(rpc_bus_nodes, key,
+			    rpc_bus_node_copy(node));
+		} else {
+			/*
+			 * Transports may only know the address of a departed
+			 * node; hand the handler our full copy instead.
+			 */
+			cached = g_hash_table_lookup(rpc_bus_nodes, key);
+			if (cached != NULL)
+				g_hash_table_steal(rpc_bus_nodes, key);
+		}
+	}
+	g_mutex_unlock(&rpc_bus_nodes_mtx);
 
 	if (rpc_bus_event_handler != NULL)
-		rpc_bus_event_handler(event, node);
+		rpc_bus_event_handler(event, cached != NULL ? cached : node);
+
+	g_free(cached);
 }
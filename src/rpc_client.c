@@ -25,55 +25,262 @@
  *
  */
 
+#include <errno.h>
 #include <rpc/client.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include "internal.h"
 
+#define	RPC_CLIENT_POOL_RETRY	(1 * G_USEC_PER_SEC)
+#define	RPC_CLIENT_EWMA_SHIFT	3	/* weight of a new sample: 1/8 */
+#define	RPC_CLIENT_HEDGE_UPDATE	64	/* samples between estimates */
+#define	RPC_CLIENT_HEDGE_WINDOW	4096	/* samples an estimate spans */
+#define	RPC_CLIENT_LOOPS_MAX	8
+
+/*
+ * A main loop shared by the clients created with "shared_loop". There
+ * are at most RPC_CLIENT_LOOPS_MAX of them per process, created on first
+ * use and never torn down; each one starts its thread the first time a
+ * client asks for its context.
+ */
+struct rpc_client_loop
+{
+	GMainContext *		rlp_context;
+	GMainLoop *		rlp_loop;
+	GThread *		rlp_thread;
+	gsize			rlp_once;
+};
+
+/*
+ * The calls of a hedged request. The first successful one wins; if
+ * none succeeds, the first to finish does. It lives on the caller's
+ * stack and is looked up by id under rci_race_mtx, since a call that
+ * lost may still see its callback run after the caller is gone.
+ */
+struct rpc_client_race
+{
+	uint64_t		rcr_id;
+	GCond			rcr_cv;
+	bool			rcr_settled[2];
+	rpc_call_status_t	rcr_status[2];
+	int			rcr_first;
+};
+
+static rpc_client_t rpc_client_alloc(const char *const *, size_t,
+    rpc_object_t);
+static struct rpc_client_loop *rpc_client_loop_get(int64_t);
+static rpc_connection_t rpc_client_pool_get(rpc_client_t, size_t);
+static gssize rpc_client_pick(rpc_client_t, gssize, rpc_connection_t *);
+static void rpc_client_account(rpc_client_t, size_t, gint64);
+static rpc_call_t rpc_client_race_start(rpc_client_t, uint64_t, guint,
+    rpc_connection_t, const char *, const char *, const char *,
+    rpc_object_t, bool);
+static int rpc_client_race_winner(struct rpc_client_race *, guint);
+static void rpc_client_close_connection(rpc_connection_t);
+
+static struct rpc_client_loop *rpc_client_loops;
+static guint rpc_client_nloops;
+static volatile guint rpc_client_next_loop;
+static gsize rpc_client_loops_once;
+
 static void *
 rpc_client_worker(void *arg)
 {
 	sigset_t set;
-	rpc_client_t client = arg;
+	GMainLoop *loop = arg;
 
 	sigemptyset(&set);
 	sigaddset(&set, SIGINT);
 	sigaddset(&set, SIGTERM);
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-	g_main_context_push_thread_default(client->rci_g_context);
-	g_main_loop_run(client->rci_g_loop);
+	g_main_context_push_thread_default(g_main_loop_get_context(loop));
+	g_main_loop_run(loop);
 	return (NULL);
 }
 
+/*
+ * Picks the shared loop for a new client: the same affinity key always
+ * maps to the same loop, otherwise they are handed out round robin.
+ */
+static struct rpc_client_loop *
+rpc_client_loop_get(int64_t affinity)
+{
+	struct rpc_client_loop *loop;
+	guint i;
+
+	if (g_once_init_enter(&rpc_client_loops_once)) {
+		rpc_client_nloops = MIN(g_get_num_processors(),
+		    RPC_CLIENT_LOOPS_MAX);
+		rpc_client_loops = g_new0(struct rpc_client_loop,
+		    rpc_client_nloops);
+		for (i = 0; i < rpc_client_nloops; i++) {
+			loop = &rpc_client_loops[i];
+			loop->rlp_context = g_main_context_new();
+			loop->rlp_loop = g_main_loop_new(loop->rlp_context,
+			    false);
+		}
+
+		g_once_init_leave(&rpc_client_loops_once, 1);
+	}
+
+	if (affinity >= 0)
+		i = (guint)(affinity % rpc_client_nloops);
+	else
+		i = g_atomic_int_add(&rpc_client_next_loop, 1) %
+		    rpc_client_nloops;
+
+	return (&rpc_client_loops[i]);
+}
+
 rpc_client_t
 rpc_client_create(const char *uri, rpc_object_t params)
+{
+
+	return (rpc_client_create_pool(uri, 1, params));
+}
+
+static rpc_client_t
+rpc_client_alloc(const char *const *uris, size_t n, rpc_object_t params)
 {
 	rpc_client_t client;
+	bool shared = false;
+	int64_t affinity = -1;
+	size_t i;
+
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY)
+		rpc_object_unpack(params, "{shared_loop:b,loop_affinity:i}",
+		    &shared, &affinity);
 
 	client = g_malloc0(sizeof(*client));
-	client->rci_g_context = g_main_context_new();
-	client->rci_g_loop = g_main_loop_new(client->rci_g_context, false);
-	client->rci_thread = g_thread_new("librpc client", rpc_client_worker,
-	    client);
-	client->rci_uri = uri;
+	g_mutex_init(&client->rci_pool_mtx);
+	client->rci_pool = g_new0(rpc_connection_t, n);
+	client->rci_pool_uris = g_new0(char *, n + 1);
+	client->rci_pool_retry = g_new0(gint64, n);
+	client->rci_pool_size = n;
+	client->rci_pool_dead = g_ptr_array_new();
+	client->rci_members = g_new0(struct rpc_client_member, n);
+	client->rci_latency = g_new0(struct rpc_histogram, 1);
+	client->rci_races = g_hash_table_new(g_int64_hash, g_int64_equal);
+	g_mutex_init(&client->rci_race_mtx);
+	if (shared) {
+		client->rci_loop = rpc_client_loop_get(affinity);
+		client->rci_g_context = g_main_context_ref(
+		    client->rci_loop->rlp_context);
+	} else {
+		client->rci_g_context = g_main_context_new();
+		client->rci_g_loop = g_main_loop_new(client->rci_g_context,
+		    false);
+	}
+
+	client->rci_uri = g_strdup(uris[0]);
 	client->rci_params = params;
 
+	for (i = 0; i < n; i++)
+		client->rci_pool_uris[i] = g_strdup(uris[i]);
+
 	if (params)
 		rpc_retain(params);
 
-	client->rci_connection = rpc_connection_create((void *)client, params);
+	return (client);
+}
+
+rpc_client_t
+rpc_client_create_pool(const char *uri, size_t n, rpc_object_t params)
+{
+	const char **uris;
+	rpc_client_t client;
+	size_t i;
+
+	if (n == 0) {
+		rpc_set_last_error(EINVAL, "Pool size must be at least 1",
+		    NULL);
+		return (NULL);
+	}
+
+	uris = g_new(const char *, n);
+	for (i = 0; i < n; i++)
+		uris[i] = uri;
+
+	client = rpc_client_alloc(uris, n, params);
+	g_free(uris);
+
+	for (i = 0; i < n; i++) {
+		client->rci_pool[i] = rpc_connection_create((void *)client,
+		    params);
+		if (client->rci_pool[i] == NULL) {
+			rpc_client_close(client);
+			return (NULL);
+		}
+
+		if (i == 0)
+			client->rci_connection = client->rci_pool[0];
+	}
+
+	return (client);
+}
+
+rpc_client_t
+rpc_client_create_multi(const char *const *uris, size_t n,
+    rpc_object_t params)
+{
+	rpc_client_t client;
+	size_t i;
+
+	if (n == 0) {
+		rpc_set_last_error(EINVAL, "At least one URI is required",
+		    NULL);
+		return (NULL);
+	}
+
+	client = rpc_client_alloc(uris, n, params);
+	client->rci_connection = rpc_connection_create_uri((void *)client,
+	    client->rci_pool_uris[0], params);
 	if (client->rci_connection == NULL) {
 		rpc_client_close(client);
 		return (NULL);
 	}
 
+	client->rci_pool[0] = client->rci_connection;
+	for (i = 1; i < n; i++) {
+		client->rci_pool[i] = rpc_connection_create_uri(
+		    (void *)client, client->rci_pool_uris[i], params);
+		if (client->rci_pool[i] == NULL) {
+			debugf("endpoint %s is down", client->rci_pool_uris[i]);
+			client->rci_pool_retry[i] = g_get_monotonic_time() +
+			    RPC_CLIENT_POOL_RETRY;
+		}
+	}
+
 	return (client);
 }
 
+/*
+ * The client thread only runs the main loop, which has nothing to do
+ * until something is attached to it: timers, batched events, or the
+ * I/O of transports working there. Whoever is about to attach gets the
+ * context through here, which starts the thread the first time.
+ */
 GMainContext *
 rpc_client_get_main_context(rpc_client_t client)
 {
+	struct rpc_client_loop *loop = client->rci_loop;
+
+	if (loop != NULL) {
+		if (g_once_init_enter(&loop->rlp_once)) {
+			loop->rlp_thread = g_thread_new("librpc client loop",
+			    rpc_client_worker, loop->rlp_loop);
+			g_once_init_leave(&loop->rlp_once, 1);
+		}
+
+		return (client->rci_g_context);
+	}
+
+	if (g_once_init_enter(&client->rci_thread_once)) {
+		client->rci_thread = g_thread_new("librpc client",
+		    rpc_client_worker, client->rci_g_loop);
+		g_once_init_leave(&client->rci_thread_once, 1);
+	}
 
 	return (client->rci_g_context);
 }
@@ -85,29 +292,443 @@ rpc_client_get_connection(rpc_client_t client)
 	return (client->rci_connection);
 }
 
+/*
+ * Returns the member in the given slot. A secondary member that went
+ * down is replaced with a fresh connection, at most once per
+ * RPC_CLIENT_POOL_RETRY. The primary one carries the user's handlers
+ * and subscriptions, so it's left for the user to deal with. Returns
+ * NULL if the slot is down.
+ */
+static rpc_connection_t
+rpc_client_pool_get(rpc_client_t client, size_t slot)
+{
+	rpc_connection_t conn;
+	rpc_connection_t fresh;
+	gint64 now;
+
+	g_mutex_lock(&client->rci_pool_mtx);
+	conn = client->rci_pool[slot];
+	if (conn != NULL && rpc_connection_is_open(conn)) {
+		g_mutex_unlock(&client->rci_pool_mtx);
+		return (conn);
+	}
+
+	now = g_get_monotonic_time();
+	if (slot == 0 || now < client->rci_pool_retry[slot]) {
+		g_mutex_unlock(&client->rci_pool_mtx);
+		return (NULL);
+	}
+
+	/* Keeps everyone else off this slot while we reconnect */
+	client->rci_pool_retry[slot] = now + RPC_CLIENT_POOL_RETRY;
+	g_mutex_unlock(&client->rci_pool_mtx);
+
+	fresh = rpc_connection_create_uri((void *)client,
+	    client->rci_pool_uris[slot], client->rci_params);
+	if (fresh == NULL) {
+		debugf("cannot reconnect pool member %zu", slot);
+		return (NULL);
+	}
+
+	/*
+	 * Someone may still be holding on to the old one, so it's only
+	 * freed along with the client.
+	 */
+	g_mutex_lock(&client->rci_pool_mtx);
+	client->rci_pool[slot] = fresh;
+	if (conn != NULL)
+		g_ptr_array_add(client->rci_pool_dead, conn);
+	g_mutex_unlock(&client->rci_pool_mtx);
+
+	return (fresh);
+}
+
+/*
+ * Picks a member that's up, other than @p exclude, according to the
+ * balancing policy. Ties go round robin. Returns -1 if there's none.
+ */
+static gssize
+rpc_client_pick(rpc_client_t client, gssize exclude, rpc_connection_t *connp)
+{
+	struct rpc_client_member *member;
+	rpc_connection_t conn;
+	gssize best = -1;
+	gint64 best_score = 0;
+	gint64 score = 0;
+	size_t start;
+	size_t slot;
+	size_t i;
+
+	start = g_atomic_int_add(&client->rci_pool_next, 1);
+	for (i = 0; i < client->rci_pool_size; i++) {
+		slot = (start + i) % client->rci_pool_size;
+		if ((gssize)slot == exclude)
+			continue;
+
+		conn = rpc_client_pool_get(client, slot);
+		if (conn == NULL)
+			continue;
+
+		member = &client->rci_members[slot];
+		switch (client->rci_policy) {
+		case RPC_BALANCE_ROUND_ROBIN:
+			*connp = conn;
+			return ((gssize)slot);
+
+		case RPC_BALANCE_LEAST_OUTSTANDING:
+			score = g_atomic_int_get(&member->rcm_outstanding);
+			break;
+
+		case RPC_BALANCE_EWMA:
+			score = (__atomic_load_n(&member->rcm_ewma,
+			    __ATOMIC_RELAXED) + 1) *
+			    (g_atomic_int_get(&member->rcm_outstanding) + 1);
+			break;
+		}
+
+		if (best == -1 || score < best_score) {
+			best = (gssize)slot;
+			best_score = score;
+			*connp = conn;
+		}
+	}
+
+	return (best);
+}
+
+rpc_connection_t
+rpc_client_next_connection(rpc_client_t client)
+{
+	rpc_connection_t conn;
+
+	if (client->rci_pool_size == 1)
+		return (client->rci_connection);
+
+	if (rpc_client_pick(client, -1, &conn) >= 0)
+		return (conn);
+
+	/* Everything is down; let the call fail on the primary one */
+	return (client->rci_connection);
+}
+
 void
-rpc_client_close(rpc_client_t client)
+rpc_client_set_balancing(rpc_client_t client, rpc_balance_policy_t policy)
+{
+
+	client->rci_policy = policy;
+}
+
+void
+rpc_client_set_hedging(rpc_client_t client, bool enable,
+    uint64_t min_delay_ms)
+{
+
+	client->rci_hedge_min = (gint64)min_delay_ms * 1000;
+	client->rci_hedge = enable;
+}
+
+/*
+ * Feeds the latency of a successful call into the member's moving
+ * average and the client's hedging delay estimate. The histogram is
+ * started over once in a while so that the estimate follows changes;
+ * samples recorded while that happens may get lost, which is fine for
+ * an estimate.
+ */
+static void
+rpc_client_account(rpc_client_t client, size_t slot, gint64 latency)
+{
+	struct rpc_client_member *member = &client->rci_members[slot];
+	uint64_t count;
+	gint64 ewma;
+
+	ewma = __atomic_load_n(&member->rcm_ewma, __ATOMIC_RELAXED);
+	ewma = ewma == 0 ? latency :
+	    ewma + ((latency - ewma) >> RPC_CLIENT_EWMA_SHIFT);
+	__atomic_store_n(&member->rcm_ewma, MAX(ewma, 1), __ATOMIC_RELAXED);
+
+	rpc_histogram_record(client->rci_latency, (uint64_t)latency);
+	count = __atomic_load_n(&client->rci_latency->rh_count,
+	    __ATOMIC_RELAXED);
+	if (count % RPC_CLIENT_HEDGE_UPDATE != 0)
+		return;
+
+	g_mutex_lock(&client->rci_pool_mtx);
+	__atomic_store_n(&client->rci_hedge_delay, (gint64)
+	    rpc_histogram_percentile(client->rci_latency, count, 95),
+	    __ATOMIC_RELAXED);
+	if (count >= RPC_CLIENT_HEDGE_WINDOW)
+		memset(client->rci_latency, 0, sizeof(*client->rci_latency));
+
+	g_mutex_unlock(&client->rci_pool_mtx);
+}
+
+static rpc_call_t
+rpc_client_race_start(rpc_client_t client, uint64_t id, guint idx,
+    rpc_connection_t conn, const char *path, const char *interface,
+    const char *name, rpc_object_t args, bool idempotent)
+{
+	rpc_call_t call;
+
+	call = rpc_connection_call(conn, path, interface, name, args,
+	    ^(rpc_call_t call) {
+		struct rpc_client_race *race;
+		rpc_call_status_t status = rpc_call_status(call);
+
+		if (status == RPC_CALL_IN_PROGRESS)
+			return ((bool)true);
+
+		g_mutex_lock(&client->rci_race_mtx);
+		race = g_hash_table_lookup(client->rci_races, &id);
+		if (race != NULL && !race->rcr_settled[idx]) {
+			race->rcr_settled[idx] = true;
+			race->rcr_status[idx] = status;
+			if (race->rcr_first == -1)
+				race->rcr_first = (int)idx;
+
+			g_cond_signal(&race->rcr_cv);
+		}
+
+		g_mutex_unlock(&client->rci_race_mtx);
+		return ((bool)false);
+	});
+
+	if (call != NULL && idempotent)
+		rpc_call_set_idempotent(call, true);
+
+	return (call);
+}
+
+/*
+ * Index of the call that decides the race, or -1 if it's still open.
+ * Called with rci_race_mtx held.
+ */
+static int
+rpc_client_race_winner(struct rpc_client_race *race, guint ncalls)
 {
+	guint i;
+
+	for (i = 0; i < ncalls; i++) {
+		if (race->rcr_settled[i] && race->rcr_status[i] == RPC_CALL_DONE)
+			return ((int)i);
+	}
+
+	for (i = 0; i < ncalls; i++) {
+		if (!race->rcr_settled[i])
+			return (-1);
+	}
+
+	return (race->rcr_first);
+}
+
+rpc_object_t
+rpc_client_call_sync(rpc_client_t client, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    bool idempotent)
+{
+	struct rpc_client_race race = { .rcr_first = -1 };
+	rpc_connection_t conn;
+	rpc_call_t calls[2] = { NULL, NULL };
+	gssize slots[2] = { -1, -1 };
+	gint64 started[2] = { 0, 0 };
+	gint64 deadline = 0;
+	gint64 delay;
+	rpc_object_t result;
+	guint ncalls = 0;
+	guint i;
+	int winner = -1;
+
+	if (args == NULL)
+		args = rpc_array_create();
+
+	slots[0] = rpc_client_pick(client, -1, &conn);
+	if (slots[0] == -1) {
+		slots[0] = 0;
+		conn = client->rci_connection;
+	}
+
+	delay = __atomic_load_n(&client->rci_hedge_delay, __ATOMIC_RELAXED);
+	if (idempotent && client->rci_hedge && client->rci_pool_size > 1 &&
+	    delay > 0) {
+		deadline = g_get_monotonic_time() +
+		    MAX(delay, client->rci_hedge_min);
+		rpc_retain(args);
+	}
+
+	g_cond_init(&race.rcr_cv);
+	g_mutex_lock(&client->rci_race_mtx);
+	race.rcr_id = ++client->rci_race_next;
+	g_hash_table_insert(client->rci_races, &race.rcr_id, &race);
+	g_mutex_unlock(&client->rci_race_mtx);
+
+	g_atomic_int_inc(&client->rci_members[slots[0]].rcm_outstanding);
+	started[0] = g_get_monotonic_time();
+	calls[0] = rpc_client_race_start(client, race.rcr_id, 0, conn, path,
+	    interface, name, args, idempotent);
+	if (calls[0] != NULL)
+		ncalls = 1;
+	else
+		deadline = 0;
+
+	g_mutex_lock(&client->rci_race_mtx);
+	while (ncalls > 0 && (winner = rpc_client_race_winner(&race,
+	    ncalls)) == -1) {
+		if (deadline == 0) {
+			g_cond_wait(&race.rcr_cv, &client->rci_race_mtx);
+			continue;
+		}
+
+		if (g_cond_wait_until(&race.rcr_cv, &client->rci_race_mtx,
+		    deadline))
+			continue;
+
+		/* Too slow; ask another member as well */
+		g_mutex_unlock(&client->rci_race_mtx);
+		deadline = 0;
+		slots[1] = rpc_client_pick(client, slots[0], &conn);
+		if (slots[1] != -1) {
+			g_atomic_int_inc(
+			    &client->rci_members[slots[1]].rcm_outstanding);
+			started[1] = g_get_monotonic_time();
+			calls[1] = rpc_client_race_start(client, race.rcr_id,
+			    1, conn, path, interface, name, args, idempotent);
+			if (calls[1] != NULL)
+				ncalls = 2;
+		} else
+			rpc_release(args);
 
-	if ((client->rci_connection != NULL) &&
-	    rpc_connection_retain_if_valid(client->rci_connection, false) == 0) {
+		g_mutex_lock(&client->rci_race_mtx);
+	}
+
+	g_hash_table_remove(client->rci_races, &race.rcr_id);
+	g_mutex_unlock(&client->rci_race_mtx);
+	g_cond_clear(&race.rcr_cv);
+
+	/* Still holding the reference meant for the hedge */
+	if (deadline != 0)
+		rpc_release(args);
+
+	if (ncalls == 0) {
+		g_atomic_int_add(
+		    &client->rci_members[slots[0]].rcm_outstanding, -1);
+		return (NULL);
+	}
+
+	result = rpc_retain(rpc_call_result(calls[winner]));
+	if (rpc_call_status(calls[winner]) == RPC_CALL_DONE)
+		rpc_client_account(client, (size_t)slots[winner],
+		    g_get_monotonic_time() - started[winner]);
+
+	for (i = 0; i < 2; i++) {
+		if (slots[i] == -1)
+			continue;
+
+		g_atomic_int_add(&client->rci_members[slots[i]].rcm_outstanding,
+		    -1);
+		if (calls[i] == NULL)
+			continue;
+
+		if ((int)i != winner)
+			rpc_call_abort(calls[i]);
+
+		rpc_call_free(calls[i]);
+	}
+
+	return (result);
+}
+
+rpc_connection_t
+rpc_client_get_connection_by_key(rpc_client_t client, uint64_t key)
+{
+	rpc_connection_t conn;
+
+	if (client->rci_pool_size == 1)
+		return (client->rci_connection);
+
+	conn = rpc_client_pool_get(client, key % client->rci_pool_size);
+	if (conn != NULL)
+		return (conn);
+
+	return (rpc_client_next_connection(client));
+}
+
+static void
+rpc_client_close_connection(rpc_connection_t conn)
+{
+
+	if (rpc_connection_retain_if_valid(conn, false) == 0) {
 		/* must hold a reference to retain the connection until it
 		 * is completely closed and cleaned up. Otherwise closing the
 		 * client thread below may prevent cleanup from happening.
 		 */
-		rpc_connection_close(client->rci_connection);
-		if (rpc_get_last_error() == NULL &&
-		    client->rci_connection->rco_error != NULL)
-			rpc_set_last_rpc_error(
-			    rpc_retain(client->rci_connection->rco_error));
-		rpc_connection_release(client->rci_connection);
-		client->rci_connection = NULL;
-        }
-
-	g_main_context_invoke(client->rci_g_context,
-	    (GSourceFunc)rpc_kill_main_loop, client->rci_g_loop);
-	g_thread_join(client->rci_thread);
-	g_main_loop_unref(client->rci_g_loop);
+		rpc_connection_close(conn);
+		if (rpc_get_last_error() == NULL && conn->rco_error != NULL)
+			rpc_set_last_rpc_error(rpc_retain(conn->rco_error));
+		rpc_connection_release(conn);
+	}
+}
+
+void
+rpc_client_close(rpc_client_t client)
+{
+	size_t i;
+
+	for (i = 0; i < client->rci_pool_size; i++) {
+		if (client->rci_pool[i] != NULL)
+			rpc_client_close_connection(client->rci_pool[i]);
+	}
+
+	for (i = 0; i < client->rci_pool_dead->len; i++)
+		rpc_client_close_connection(
+		    g_ptr_array_index(client->rci_pool_dead, i));
+
+	client->rci_connection = NULL;
+
+	if (client->rci_thread != NULL) {
+		g_main_context_invoke(client->rci_g_context,
+		    (GSourceFunc)rpc_kill_main_loop, client->rci_g_loop);
+		g_thread_join(client->rci_thread);
+	}
+
+	/* A shared loop carries on; our connections took their sources */
+	if (client->rci_g_loop != NULL)
+		g_main_loop_unref(client->rci_g_loop);
+
 	g_main_context_unref(client->rci_g_context);
+	g_ptr_array_free(client->rci_pool_dead, true);
+	g_free(client->rci_pool);
+	g_strfreev(client->rci_pool_uris);
+	g_free(client->rci_pool_retry);
+	g_free(client->rci_members);
+	g_free(client->rci_latency);
+	g_hash_table_destroy(client->rci_races);
+	g_mutex_clear(&client->rci_race_mtx);
+	g_free((char *)client->rci_uri);
+	g_mutex_clear(&client->rci_pool_mtx);
 	g_free(client);
 }
+
+rpc_object_t
+rpc_client_call_once(const char *uri, const char *path, const char *interface,
+    const char *name, rpc_object_t args)
+{
+	rpc_client_t client;
+	rpc_object_t result;
+
+	client = rpc_client_create(uri, NULL);
+	if (client == NULL) {
+		if (args != NULL)
+			rpc_release(args);
+
+		return (NULL);
+	}
+
+	if (args == NULL)
+		args = rpc_array_create();
+
+	result = rpc_connection_call_sync_impl(client->rci_connection, path,
+	    interface, name, args);
+
+	rpc_release(args);
+	rpc_client_close(client);
+	return (result);
+}
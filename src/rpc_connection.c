@@ -26,6 +26,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <glib.h>
 #include <glib/gprintf.h>
@@ -40,8 +41,17 @@
 #include "notify.h"
 #include "serializer/msgpack.h"
 
-#define	DEFAULT_RPC_TIMEOUT	60
+#define	DEFAULT_RPC_TIMEOUT	(60 * 1000)	/* milliseconds */
 #define	MAX_FDS			128
+#define	RPC_FRAGMENT_BATCH	64
+#define	RPC_FRAGMENT_LATENCY	2	/* milliseconds */
+#define	RPC_WINDOW_MIN		1
+#define	RPC_WINDOW_MAX		4096
+#define	RPC_WINDOW_GAIN		2
+#define	RPC_RESUME_ATTEMPTS	10
+#define	RPC_RESUME_BACKOFF_MIN	(100 * 1000)		/* microseconds */
+#define	RPC_RESUME_BACKOFF_MAX	(10 * G_USEC_PER_SEC)
+#define	RPC_CONNECTION_BUCKETS	64
 
 typedef enum rpc_close_source
 {
@@ -51,17 +61,87 @@ typedef enum rpc_close_source
 
 struct work_item;
 
-static rpc_object_t rpc_new_id(void);
-static rpc_object_t rpc_pack_frame(const char *, const char *, rpc_object_t,
-    rpc_object_t);
+/*
+ * Opcodes standing in for the namespace/name pair in compact frames.
+ * They travel on the wire, so existing values must never change.
+ */
+enum rpc_frame_op
+{
+	RPC_OP_CALL = 0,
+	RPC_OP_RESPONSE,
+	RPC_OP_START_STREAM,
+	RPC_OP_FRAGMENT,
+	RPC_OP_CONTINUE,
+	RPC_OP_END,
+	RPC_OP_ABORT,
+	RPC_OP_ERROR,
+	RPC_OP_EVENT,
+	RPC_OP_EVENT_BURST,
+	RPC_OP_SUBSCRIBE,
+	RPC_OP_UNSUBSCRIBE,
+	RPC_OP_CALL_BATCH,
+	RPC_OP_FRAGMENTS,
+	RPC_OP_UPLOAD,
+	RPC_OP_UPLOAD_END,
+	RPC_OP_UPLOAD_CONTINUE,
+	RPC_OP_SHMEM_RELEASE,
+	RPC_OP_EVENT_JOIN,
+	RPC_OP_EVENT_JOINED,
+	RPC_OP_EVENT_REPAIR,
+	RPC_OP_TAGGED_RESPONSE,
+	RPC_OP_SHMEM_POOL,
+	RPC_OP_MAX
+};
+
+static rpc_object_t rpc_new_id(rpc_connection_t);
+static guint rpc_call_id_hash(gconstpointer);
+static gboolean rpc_call_id_equal(gconstpointer, gconstpointer);
+static struct rpc_call_shard *rpc_call_shard(rpc_connection_t, rpc_object_t);
+static struct rpc_call *rpc_call_cache_get(void);
+static void rpc_call_destroy(gpointer);
+static rpc_object_t rpc_pack_frame(rpc_connection_t, enum rpc_frame_op,
+    rpc_object_t, rpc_object_t);
 static bool rpc_run_callback(rpc_connection_t, struct work_item *);
+static bool rpc_run_call_callback(rpc_connection_t, rpc_call_t);
+static void rpc_call_post_completion(rpc_connection_t, rpc_call_t);
 static struct rpc_call *rpc_call_alloc(rpc_connection_t, rpc_object_t,
     const char *, const char *, const char *, rpc_object_t);
+static struct rpc_call *rpc_connection_call_prepare(rpc_connection_t,
+    const char *, const char *, const char *, rpc_object_t, rpc_callback_t,
+    bool, rpc_object_t *);
 static int rpc_send_frame(rpc_connection_t, rpc_object_t);
+static int rpc_send_frame_urgent(rpc_connection_t, rpc_object_t);
+static int rpc_send_frame_prio(rpc_connection_t, rpc_object_t, bool);
+static int rpc_send_frame_queued(rpc_connection_t, rpc_object_t, GBytes *,
+    bool);
+static void rpc_trace_frame(rpc_connection_t, uint16_t, rpc_object_t,
+    const void *, size_t);
+static int rpc_event_profile(rpc_connection_t);
+static GBytes *rpc_shared_event_encode(rpc_connection_t,
+    struct rpc_shared_event *, int);
+static int rpc_connection_send_shared_event(rpc_connection_t,
+    struct rpc_shared_event *);
+static void rpc_connection_event_task(void *, void *);
+static int rpc_send_batch(rpc_connection_t, struct rpc_output_buffer *);
+static inline bool rpc_send_queue_full(rpc_connection_t);
+static bool rpc_connection_sends_error_stacks(rpc_connection_t);
 static void on_rpc_call(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_call_batch(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_response(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_tagged_response(rpc_connection_t, rpc_object_t,
+    rpc_object_t);
+static void rpc_call_complete(rpc_connection_t, rpc_object_t, rpc_object_t,
+    const char *);
+static char *rpc_etag_compute(rpc_object_t);
 static void on_rpc_start_stream(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_fragment(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_fragments(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_upload(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_upload_end(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_upload_continue(rpc_connection_t, rpc_object_t,
+    rpc_object_t);
+static struct rpc_call *rpc_connection_find_input_call(rpc_connection_t,
+    rpc_object_t);
 static void on_rpc_continue(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_end(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_abort(rpc_connection_t, rpc_object_t, rpc_object_t);
@@ -70,25 +150,80 @@ static void on_events_event(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_events_event_burst(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_events_subscribe(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_events_unsubscribe(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_shmem_release(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_shmem_pool(rpc_connection_t, rpc_object_t, rpc_object_t);
+#if defined(__linux__)
+static void rpc_connection_share_bulk_pool(rpc_connection_t);
+#endif
+static void on_events_join(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_events_joined(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_events_repair(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void rpc_callback_worker(void *, void *);
+static void rpc_call_callback_worker(void *, void *);
+static void rpc_connection_dispatch_event(rpc_connection_t, rpc_object_t);
+static void rpc_subscription_drain(rpc_connection_t,
+    struct rpc_subscription *);
+static void rpc_connection_event_queue_overflow(rpc_connection_t);
+static void rpc_connection_invalidate_properties(rpc_connection_t);
 static inline rpc_call_status_t rpc_call_status_locked(rpc_call_t);
 static int rpc_call_wait_locked(rpc_call_t);
-static gboolean rpc_call_timeout(gpointer user_data);
+static void rpc_call_window_sample(rpc_call_t, size_t);
+static int64_t rpc_call_window_update(rpc_call_t, int64_t);
+static int rpc_call_grant_locked(rpc_call_t, int64_t);
+static void rpc_call_add_chunk_locked(rpc_call_t, rpc_object_t);
+static uint64_t rpc_timer_now(struct rpc_timer_wheel *);
+static void rpc_timer_link(struct rpc_timer_wheel *, struct rpc_timer *,
+    uint64_t);
+static void rpc_timer_unlink(struct rpc_timer_wheel *, struct rpc_timer *);
+static void rpc_timer_schedule(struct rpc_timer_wheel *);
+static gboolean rpc_timer_dispatch(GSource *, GSourceFunc, gpointer);
+static gboolean rpc_timer_tick(gpointer);
+static void rpc_call_arm_timeout_locked(rpc_call_t, uint64_t);
+static void rpc_call_arm_timer(rpc_call_t, uint64_t);
+static void rpc_call_flush_fragments_locked(rpc_call_t);
+static bool rpc_call_drain_output_locked(struct rpc_call *);
+static void rpc_call_expire(rpc_call_t);
 static struct rpc_subscription *rpc_connection_subscribe_event_locked(
-    rpc_connection_t, const char *, const char *, const char *, bool);
+    rpc_connection_t, const char *, const char *, const char *, rpc_object_t,
+    bool);
 static struct rpc_subscription *rpc_connection_find_subscription(rpc_connection_t,
     const char *, const char *, const char *);
+static struct rpc_subscription *rpc_connection_match_subscription(
+    rpc_connection_t, const char *, const char *, const char *);
+static bool rpc_connection_event_wanted_locked(rpc_connection_t,
+    const char *, const char *, const char *, rpc_object_t, bool *);
+static void rpc_subscription_filter_free(gpointer);
+static rpc_object_t rpc_subscription_entry(struct rpc_subscription *);
+static bool rpc_connection_event_filter(rpc_connection_t,
+    struct rpc_shared_event *);
+static struct rpc_subscription_filter *rpc_subscription_find_filter(
+    struct rpc_subscription *, rpc_object_t);
+static bool rpc_subscription_accepts(struct rpc_subscription *, rpc_object_t);
 static void rpc_connection_free_resources(rpc_connection_t);
+static void rpc_connection_drop_event_watchers(rpc_connection_t);
+static void rpc_connection_join_event_group(rpc_connection_t, rpc_object_t);
 static int cancel_timeout_locked(rpc_call_t call);
 static void rpc_connection_set_default_fn_handlers(rpc_connection_t);
 static inline rpc_object_t rpc_call_result_save(rpc_call_t call);
 static int rpc_connection_do_close(rpc_connection_t conn, rpc_close_source_t);
 static rpc_connection_t rpc_connection_init(int);
 static void rpc_abort_worker(void *arg, void *data);
+static void rpc_end_worker(void *arg, void *data);
+static void rpc_connection_start_resume(rpc_connection_t conn);
+static rpc_object_t rpc_call_payload(rpc_connection_t conn,
+    struct rpc_call *call);
 static void call_abort_locked(struct rpc_call *call);
-static void rpc_subscription_release(struct rpc_subscription *sub);
 static void rpc_rsh_release(struct rpc_subscription_handler *rsh);
 static int rpc_set_creds(rpc_connection_t conn, pid_t pid, uid_t uid, gid_t gid);
+static uint64_t rpc_mem_usage(rpc_connection_t);
+static void rpc_mem_charge(rpc_connection_t, rpc_mem_kind_t, size_t);
+static void rpc_mem_uncharge(rpc_connection_t, rpc_mem_kind_t, size_t);
+static bool rpc_mem_over_soft(rpc_connection_t);
+static int rpc_mem_admit(rpc_connection_t, size_t);
+static struct queue_item *rpc_call_queue_push(rpc_call_t);
+static struct queue_item *rpc_call_queue_peek(rpc_call_t, guint);
+static void rpc_call_queue_pop(rpc_call_t);
+static void rpc_call_notify_fanout(rpc_call_t);
 static int rpc_connection_unsubscribe_event_locked(rpc_connection_t conn,
     struct rpc_subscription *sub);
 
@@ -103,37 +238,78 @@ struct queue_item
 {
 	rpc_call_status_t status;
 	rpc_object_t item;
+	size_t size;		/* charged to the connection */
 };
 
 struct work_item
 {
-    	rpc_call_t call;
     	rpc_object_t event;
+	struct rpc_subscription *sub;	/* to drain */
+};
+
+static const struct message_handler handlers[RPC_OP_MAX] = {
+	[RPC_OP_CALL] = { "rpc", "call", on_rpc_call },
+	[RPC_OP_RESPONSE] = { "rpc", "response", on_rpc_response },
+	[RPC_OP_START_STREAM] = { "rpc", "start_stream", on_rpc_start_stream },
+	[RPC_OP_FRAGMENT] = { "rpc", "fragment", on_rpc_fragment },
+	[RPC_OP_CONTINUE] = { "rpc", "continue", on_rpc_continue },
+	[RPC_OP_END] = { "rpc", "end", on_rpc_end },
+	[RPC_OP_ABORT] = { "rpc", "abort", on_rpc_abort },
+	[RPC_OP_ERROR] = { "rpc", "error", on_rpc_error },
+	[RPC_OP_EVENT] = { "events", "event", on_events_event },
+	[RPC_OP_EVENT_BURST] = {
+	    "events", "event_burst", on_events_event_burst
+	},
+	[RPC_OP_SUBSCRIBE] = { "events", "subscribe", on_events_subscribe },
+	[RPC_OP_UNSUBSCRIBE] = {
+	    "events", "unsubscribe", on_events_unsubscribe
+	},
+	[RPC_OP_CALL_BATCH] = { "rpc", "call_batch", on_rpc_call_batch },
+	[RPC_OP_FRAGMENTS] = { "rpc", "fragments", on_rpc_fragments },
+	[RPC_OP_UPLOAD] = { "rpc", "upload", on_rpc_upload },
+	[RPC_OP_UPLOAD_END] = { "rpc", "upload_end", on_rpc_upload_end },
+	[RPC_OP_UPLOAD_CONTINUE] = {
+	    "rpc", "upload_continue", on_rpc_upload_continue
+	},
+	[RPC_OP_SHMEM_RELEASE] = { "shmem", "release", on_shmem_release },
+	[RPC_OP_EVENT_JOIN] = { "events", "join", on_events_join },
+	[RPC_OP_EVENT_JOINED] = { "events", "joined", on_events_joined },
+	[RPC_OP_EVENT_REPAIR] = { "events", "repair", on_events_repair },
+	[RPC_OP_TAGGED_RESPONSE] = {
+	    "rpc", "tagged_response", on_rpc_tagged_response
+	},
+	[RPC_OP_SHMEM_POOL] = { "shmem", "pool", on_shmem_pool },
 };
 
-static const struct message_handler handlers[] = {
-	{ "rpc", "call", on_rpc_call },
-	{ "rpc", "response", on_rpc_response },
-	{ "rpc", "start_stream", on_rpc_start_stream },
-	{ "rpc", "fragment", on_rpc_fragment },
-	{ "rpc", "continue", on_rpc_continue },
-	{ "rpc", "end", on_rpc_end },
-	{ "rpc", "abort", on_rpc_abort },
-	{ "rpc", "error", on_rpc_error },
-	{ "events", "event", on_events_event },
-	{ "events", "event_burst", on_events_event_burst },
-	{ "events", "subscribe", on_events_subscribe },
-	{ "events", "unsubscribe", on_events_unsubscribe },
-	{ }
+/*
+ * Live connections, spread over buckets by address so that
+ * rpc_connection_retain_if_valid(), which runs on every message, only
+ * contends with lookups and teardowns of connections in the same bucket.
+ * A handle is only ever dereferenced after it was found here.
+ */
+struct rpc_connection_bucket
+{
+	GRWLock			rcb_lock;
+	GHashTable *		rcb_conns;
 };
 
-static GRWLock active_rwlock;
-static GHashTable *active_connections = NULL;
+static struct rpc_connection_bucket rpc_connection_buckets[
+    RPC_CONNECTION_BUCKETS];
+
+/* Bytes queued for sending by the current thread, for call statistics */
+static GPrivate rpc_sent_bytes;
+
+static struct rpc_object_cache rpc_call_cache =
+    RPC_OBJECT_CACHE_INIT(struct rpc_call, rpc_call_destroy);
 
 static size_t
 rpc_serialize_fds(rpc_object_t obj, int *fds, size_t *nfds, size_t idx)
 {
-	__block size_t counter = idx;
+	struct rpc_dictionary_iter diter;
+	struct rpc_array_iter aiter;
+	const char *name;
+	rpc_object_t i;
+	size_t counter = idx;
 
 	switch (rpc_get_type(obj)) {
 	case RPC_TYPE_FD:
@@ -151,18 +327,15 @@ rpc_serialize_fds(rpc_object_t obj, int *fds, size_t *nfds, size_t idx)
 #endif
 
 	case RPC_TYPE_ARRAY:
-		rpc_array_apply(obj, ^(size_t aidx __unused, rpc_object_t i) {
-			counter += rpc_serialize_fds(i, fds, nfds, idx);
-			return ((bool)true);
-		});
+		rpc_array_iter_init(obj, &aiter);
+		while (rpc_array_iter_next(&aiter, NULL, &i))
+			counter = rpc_serialize_fds(i, fds, nfds, counter);
 		break;
 
 	case RPC_TYPE_DICTIONARY:
-		rpc_dictionary_apply(obj, ^(const char *name __unused,
-		    rpc_object_t i) {
-			counter += rpc_serialize_fds(i, fds, nfds, idx);
-			return ((bool)true);
-		});
+		rpc_dictionary_iter_init(obj, &diter);
+		while (rpc_dictionary_iter_next(&diter, &name, &i))
+			counter = rpc_serialize_fds(i, fds, nfds, counter);
 		break;
 
 	default:
@@ -172,36 +345,113 @@ rpc_serialize_fds(rpc_object_t obj, int *fds, size_t *nfds, size_t idx)
 	return (counter);
 }
 
+#if defined(__linux__)
+/*
+ * The first chunk of a peer pool brings the pool descriptor along. The
+ * pool gets mapped once, and the chunk points into that mapping; if it
+ * can't be mapped, the chunk stays a plain shmem object. Other shmem
+ * objects go through the connection's mapping cache.
+ */
+static void
+rpc_restore_shmem_pool(rpc_connection_t conn, struct rpc_shmem_block *block)
+{
+	struct rpc_shmem_pool *pool;
+
+	if (conn->rco_shm == NULL)
+		return;
+
+	if (block->rsb_pool_id == 0) {
+		rpc_shmem_link_cache(conn->rco_shm, block);
+		return;
+	}
+
+	pool = rpc_shmem_link_import(conn->rco_shm, block->rsb_pool_id,
+	    block->rsb_fd, block->rsb_pool_size);
+	if (pool == NULL)
+		return;
+
+	/* The descriptor now belongs to the pool mapping */
+	if (block->rsb_offset < 0 ||
+	    (size_t)block->rsb_offset > pool->rsp_size ||
+	    block->rsb_size > pool->rsp_size - (size_t)block->rsb_offset) {
+		debugf("shmem chunk out of pool bounds, dropping it");
+		rpc_shmem_pool_unref(pool);
+		block->rsb_fd = -1;
+		block->rsb_pool_id = 0;
+		return;
+	}
+
+	block->rsb_fd = pool->rsp_fd;
+	block->rsb_pool = pool;
+	block->rsb_pool_id = 0;
+}
+#endif
+
+/*
+ * Replaces the descriptor index held by an fd or shmem object with the
+ * descriptor received.
+ */
 static void
-rpc_restore_fds(rpc_object_t obj, int *fds, size_t nfds)
+rpc_restore_fd(rpc_connection_t conn, rpc_object_t obj, int *fds,
+    size_t nfds)
 {
+	int idx;
 
 	switch (rpc_get_type(obj)) {
 		case RPC_TYPE_FD:
-			obj->ro_value.rv_fd = fds[obj->ro_value.rv_fd];
+			idx = obj->ro_value.rv_fd;
+			obj->ro_value.rv_fd = (idx >= 0 && (size_t)idx < nfds) ?
+			    fds[idx] : -1;
 			break;
 
 #if defined(__linux__)
 		case RPC_TYPE_SHMEM:
-			obj->ro_value.rv_shmem.rsb_fd =
-			    fds[obj->ro_value.rv_shmem.rsb_fd];
+			if (obj->ro_value.rv_shmem.rsb_pool != NULL)
+				break;
+
+			idx = obj->ro_value.rv_shmem.rsb_fd;
+			if (idx < 0 || (size_t)idx >= nfds) {
+				obj->ro_value.rv_shmem.rsb_fd = -1;
+				break;
+			}
+
+			obj->ro_value.rv_shmem.rsb_fd = fds[idx];
+			rpc_restore_shmem_pool(conn, &obj->ro_value.rv_shmem);
 			break;
 #endif
 
+		default:
+			break;
+	}
+}
+
+static void
+rpc_restore_fds(rpc_connection_t conn, rpc_object_t obj, int *fds,
+    size_t nfds)
+{
+	struct rpc_dictionary_iter diter;
+	struct rpc_array_iter aiter;
+	const char *key;
+	rpc_object_t item;
+
+	switch (rpc_get_type(obj)) {
+		case RPC_TYPE_FD:
+#if defined(__linux__)
+		case RPC_TYPE_SHMEM:
+#endif
+			rpc_restore_fd(conn, obj, fds, nfds);
+			break;
+
 		case RPC_TYPE_ARRAY:
-			rpc_array_apply(obj, ^(size_t idx __unused,
-			    rpc_object_t item) {
-				rpc_restore_fds(item, fds, nfds);
-				return ((bool)true);
-			});
+			rpc_array_iter_init(obj, &aiter);
+			while (rpc_array_iter_next(&aiter, NULL, &item))
+				rpc_restore_fds(conn, item, fds, nfds);
 			break;
 
 		case RPC_TYPE_DICTIONARY:
-			rpc_dictionary_apply(obj, ^(const char *key __unused,
-			    rpc_object_t value) {
-				rpc_restore_fds(value, fds, nfds);
-				return ((bool)true);
-			});
+			rpc_dictionary_iter_init(obj, &diter);
+			while (rpc_dictionary_iter_next(&diter, &key, &item))
+				rpc_restore_fds(conn, item, fds, nfds);
 			break;
 
 		default:
@@ -212,9 +462,15 @@ rpc_restore_fds(rpc_object_t obj, int *fds, size_t nfds)
 static bool
 rpc_run_callback(rpc_connection_t conn, struct work_item *item)
 {
-	GError *err = NULL;
 
 	/* must be called with connection retained */
+	if (conn->rco_cq != NULL) {
+		rpc_completion_queue_push(conn->rco_cq, conn, NULL,
+		    item->event);
+		g_free(item);
+		return (true);
+	}
+
 #ifdef ENABLE_LIBDISPATCH
 	if (conn->rco_dispatch_queue != NULL) {
 		dispatch_async(conn->rco_dispatch_queue, ^{
@@ -224,39 +480,71 @@ rpc_run_callback(rpc_connection_t conn, struct work_item *item)
 		return (true);
 	}
 #endif
-	g_thread_pool_push(conn->rco_callback_pool, item, &err);
-	if (err != NULL) {
-		g_error_free(err);
-		return (false);
+	return (rpc_executor_queue_push(conn->rco_callback_queue,
+	    rpc_callback_worker, item));
+}
+
+/*
+ * Runs the callback of an outbound call on the callback queue. The call
+ * itself is the work item, so that a stream doesn't allocate one for
+ * every fragment; it stays around until its callback has run, so that
+ * the callback can free it once the call has completed.
+ */
+static bool
+rpc_run_call_callback(rpc_connection_t conn, rpc_call_t call)
+{
+	bool ret;
+
+	/* must be called with connection retained */
+	rpc_connection_call_retain(call);
+
+#ifdef ENABLE_LIBDISPATCH
+	if (conn->rco_dispatch_queue != NULL) {
+		dispatch_async(conn->rco_dispatch_queue, ^{
+			rpc_call_callback_worker(call, conn);
+		});
+
+		return (true);
 	}
+#endif
+	ret = rpc_executor_queue_push(conn->rco_callback_queue,
+	    rpc_call_callback_worker, call);
+	if (!ret)
+		rpc_connection_call_release(call);
 
-	return (true);
+	return (ret);
 }
 
+/*
+ * Queues a status change of an outbound call on the completion queue of
+ * its connection, if there's one. Called with the call locked, after the
+ * new status has been queued.
+ */
 static void
-rpc_callback_worker(void *arg, void *data)
+rpc_call_post_completion(rpc_connection_t conn, rpc_call_t call)
 {
-	struct work_item *item = arg;
-	struct rpc_subscription *sub;
-	struct rpc_subscription_handler *handler;
-	const char *path;
-	const char *interface;
-	const char *name;
-	rpc_call_t call;
+
+	if (call->rc_fanout != NULL)
+		rpc_call_notify_fanout(call);
+
+	if (conn->rco_cq != NULL && !call->rc_sync)
+		rpc_completion_queue_push(conn->rco_cq, conn, call, NULL);
+}
+
+static void
+rpc_call_callback_worker(void *arg, void *data)
+{
+	rpc_call_t call = arg;
 	rpc_connection_t conn = data;
 	rpc_call_status_t call_status;
 	bool ret;
 
-
-	if (rpc_connection_retain_if_valid(conn, true) != 0)
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_connection_call_release(call);
 		return;
+	}
 
-	if (item->call) {
-		call = item->call;
-
-		if (call->rc_callback == NULL)
-			goto done;
-
+	if (call->rc_callback != NULL) {
 		ret = call->rc_callback(call);
 
 		call_status = rpc_call_status(call);
@@ -267,62 +555,243 @@ rpc_callback_worker(void *arg, void *data)
 			else
 				rpc_call_abort(call);
 		}
+	}
 
-		goto done;
+	rpc_connection_call_release(call);
+	rpc_connection_release(conn);
+}
+
+static void
+rpc_callback_worker(void *arg, void *data)
+{
+	struct work_item *item = arg;
+	rpc_connection_t conn = data;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
+		return;
+
+	if (item->sub != NULL)
+		rpc_subscription_drain(conn, item->sub);
+
+	/* Nobody subscribed to it, only the catch-all handler gets it */
+	if (item->event != NULL) {
+		if (conn->rco_event_handler != NULL) {
+			conn->rco_event_handler(
+			    rpc_dictionary_get_string(item->event, "path"),
+			    rpc_dictionary_get_string(item->event, "interface"),
+			    rpc_dictionary_get_string(item->event, "name"),
+			    rpc_dictionary_get_value(item->event, "args"));
+		}
+
+		rpc_release(item->event);
 	}
 
-	if (item->event) {
+	rpc_connection_release(conn);
+	g_free(item);
+}
+
+/*
+ * Events of a subscription are queued on it in the order they came in
+ * and delivered by a single worker at a time, which keeps draining the
+ * queue until it's empty. The worker holds a reference to the
+ * subscription, so that it stays around until then.
+ */
+static void
+rpc_connection_dispatch_event(rpc_connection_t conn, rpc_object_t event)
+{
+	struct rpc_subscription *sub = NULL;
+	struct work_item *item;
 
-		path = rpc_dictionary_get_string(item->event, "path");
-		interface = rpc_dictionary_get_string(item->event, "interface");
-		name = rpc_dictionary_get_string(item->event, "name");
-		data = rpc_dictionary_get_value(item->event, "args");
+	/* A completion queue takes events as they are */
+	if (conn->rco_cq == NULL) {
 		g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-		sub = rpc_connection_find_subscription(conn, path, interface, name);
-
+		sub = rpc_connection_match_subscription(conn,
+		    rpc_dictionary_get_string(event, "path"),
+		    rpc_dictionary_get_string(event, "interface"),
+		    rpc_dictionary_get_string(event, "name"));
 		if (sub != NULL) {
-			if (sub->rsu_busy) {
-				rpc_run_callback(conn, item);
-				g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-				rpc_connection_release(conn);
+			g_queue_push_tail(&sub->rsu_pending, rpc_retain(event));
+			if (sub->rsu_scheduled) {
+				g_rw_lock_writer_unlock(
+				    &conn->rco_subscription_rwlock);
 				return;
 			}
-			sub->rsu_busy = true;
-			for (guint i = 0; i < sub->rsu_handlers->len; i++) {
-				handler = g_ptr_array_index(sub->rsu_handlers, i);
-				g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-				handler->rsh_handler(path, interface, name, data);
-				g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-			}
-			sub->rsu_busy = false;
+
+			sub->rsu_scheduled = true;
+			sub->rsu_refcount++;
+		}
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	}
+
+	item = g_malloc0(sizeof(*item));
+	if (sub != NULL)
+		item->sub = sub;
+	else
+		item->event = rpc_retain(event);
+
+	if (rpc_run_callback(conn, item))
+		return;
+
+	if (sub != NULL) {
+		g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+		while (!g_queue_is_empty(&sub->rsu_pending))
+			rpc_release(g_queue_pop_head(&sub->rsu_pending));
+
+		sub->rsu_scheduled = false;
+		rpc_connection_unsubscribe_event_locked(conn, sub);
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	}
+
+	rpc_release(item->event);
+	g_free(item);
+}
+
+static void
+rpc_subscription_drain(rpc_connection_t conn, struct rpc_subscription *sub)
+{
+	struct rpc_subscription_handler *handler;
+	rpc_object_t event;
+	rpc_object_t data;
+	const char *path;
+	const char *interface;
+	const char *name;
+	guint i;
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	while ((event = g_queue_pop_head(&sub->rsu_pending)) != NULL) {
+		path = rpc_dictionary_get_string(event, "path");
+		interface = rpc_dictionary_get_string(event, "interface");
+		name = rpc_dictionary_get_string(event, "name");
+		data = rpc_dictionary_get_value(event, "args");
+
+		sub->rsu_busy = true;
+		for (i = 0; i < sub->rsu_handlers->len; i++) {
+			handler = g_ptr_array_index(sub->rsu_handlers, i);
+			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+			handler->rsh_handler(path, interface, name, data);
+			g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
 		}
+		sub->rsu_busy = false;
 		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
 
 		if (conn->rco_event_handler != NULL)
 			conn->rco_event_handler(path, interface, name, data);
 
-		rpc_release(item->event);
+		rpc_release(event);
+		g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
 	}
 
-done:
-	rpc_connection_release(conn);
-	g_free(item);
+	/* Drops the reference taken when the drain was scheduled */
+	sub->rsu_scheduled = false;
+	rpc_connection_unsubscribe_event_locked(conn, sub);
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+}
+
+	return (true);
 }
 
 static rpc_object_t
-rpc_pack_frame(const char *ns, const char *name, rpc_object_t id,
+rpc_pack_frame(rpc_connection_t conn, enum rpc_frame_op op, rpc_object_t id,
     rpc_object_t args)
 {
 	rpc_object_t obj;
 
 	obj = rpc_dictionary_create();
-	rpc_dictionary_set_string(obj, "namespace", ns);
-	rpc_dictionary_set_string(obj, "name", name);
+	if (g_atomic_int_get(&conn->rco_compact_ops))
+		rpc_dictionary_set_uint64(obj, "op", op);
+	else {
+		rpc_dictionary_set_string(obj, "namespace",
+		    handlers[op].namespace);
+		rpc_dictionary_set_string(obj, "name", handlers[op].name);
+	}
+
 	rpc_dictionary_steal_value(obj, "id", id ? rpc_retain(id) : rpc_null_create());
 	rpc_dictionary_steal_value(obj, "args", args);
 	return (obj);
 }
 
+/*
+ * Classifies a frame for a trace record. Pre-encoded frames, which come
+ * without the object, are peeked at instead.
+ */
+static void
+rpc_trace_frame(rpc_connection_t conn, uint16_t flags, rpc_object_t frame,
+    const void *data, size_t len)
+{
+	struct rpc_frame_info info;
+	rpc_object_t id = NULL;
+	rpc_object_t op;
+	const char *namespace;
+	const char *name;
+	const char *str = NULL;
+	uint64_t call_id = 0;
+	uint16_t opcode = RPC_TRACE_OP_UNKNOWN;
+	char *end;
+	int64_t peeked;
+	guint i;
+
+	if (frame != NULL && rpc_get_type(frame) == RPC_TYPE_DICTIONARY) {
+		id = rpc_dictionary_get_value(frame, "id");
+		op = rpc_dictionary_get_value(frame, "op");
+		if (op != NULL && rpc_get_type(op) == RPC_TYPE_UINT64 &&
+		    rpc_uint64_get_value(op) < RPC_OP_MAX)
+			opcode = (uint16_t)rpc_uint64_get_value(op);
+		else if (op == NULL) {
+			namespace = rpc_dictionary_get_string(frame,
+			    "namespace");
+			name = rpc_dictionary_get_string(frame, "name");
+			for (i = 0; i < RPC_OP_MAX; i++) {
+				if (!g_strcmp0(namespace, handlers[i].namespace) &&
+				    !g_strcmp0(name, handlers[i].name)) {
+					opcode = (uint16_t)i;
+					break;
+				}
+			}
+		}
+
+		if (id != NULL && rpc_get_type(id) == RPC_TYPE_UINT64)
+			call_id = rpc_uint64_get_value(id);
+		else if (id != NULL && rpc_get_type(id) == RPC_TYPE_STRING)
+			str = rpc_string_get_string_ptr(id);
+	} else if (data != NULL &&
+	    rpc_msgpack_peek_frame(data, len, &peeked, &info) == 0) {
+		for (i = 0; i < RPC_OP_MAX; i++) {
+			if (peeked >= 0 ? (uint64_t)peeked == i :
+			    !g_strcmp0(info.rfi_namespace,
+			    handlers[i].namespace) &&
+			    !g_strcmp0(info.rfi_name, handlers[i].name)) {
+				opcode = (uint16_t)i;
+				break;
+			}
+		}
+
+		/* Compact ids are peeked as decimal strings */
+		call_id = g_ascii_strtoull(info.rfi_id, &end, 10);
+		if (*end != '\0')
+			str = info.rfi_id;
+	}
+
+	if (str != NULL) {
+		call_id = g_str_hash(str);
+		flags |= RPC_TRACE_ID_HASHED;
+	}
+
+	rpc_trace_record((uint64_t)(uintptr_t)conn, opcode, flags, call_id,
+	    data, len);
+}
+
+int
+rpc_trace_op_name(uint16_t op, const char **namespace, const char **name)
+{
+
+	if (op >= RPC_OP_MAX)
+		return (-1);
+
+	*namespace = handlers[op].namespace;
+	*name = handlers[op].name;
+	return (0);
+}
+
 rpc_context_t
 rpc_connection_get_context(rpc_connection_t conn)
 {
@@ -355,14 +824,17 @@ rpc_connection_set_context(rpc_connection_t conn, rpc_context_t ctx)
 static int
 cancel_timeout_locked(rpc_call_t call)
 {
-	/* Cancel timeout source */
-	if (call->rc_timeout != NULL) {
+	struct rpc_timer_wheel *wheel = &call->rc_conn->rco_timers;
+
+	if (call->rc_timer_armed) {
 		if (call->rc_timedout)
 			return (-1);
 
-		g_source_destroy(call->rc_timeout);
-		g_source_unref(call->rc_timeout);
-		call->rc_timeout = NULL;
+		g_mutex_lock(&wheel->rtw_mtx);
+		if (call->rc_timer.rt_pprev != NULL)
+			rpc_timer_unlink(wheel, &call->rc_timer);
+		g_mutex_unlock(&wheel->rtw_mtx);
+		call->rc_timer_armed = false;
 	}
 	return (0);
 }
@@ -375,7 +847,11 @@ on_rpc_call(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	const char *interface = NULL;
 	const char *path = NULL;
 	rpc_object_t call_args = NULL;
+	rpc_object_t query = NULL;
 	rpc_object_t err;
+	const char *etag = NULL;
+	bool upload = false;
+	uint64_t timeout = 0;
 	int res;
 
 	if (conn->rco_rpc_context == NULL) {
@@ -383,11 +859,21 @@ on_rpc_call(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 		return;
 	}
 
-	rpc_object_unpack(args, "{s,s,s,v}",
+	if (rpc_mem_over_soft(conn)) {
+		rpc_connection_send_err(conn, id, EBUSY,
+		    "Connection memory limit reached");
+		return;
+	}
+
+	rpc_object_unpack(args, "{s,s,s,v,b,u,v,s}",
 	    "method", &method,
 	    "interface", &interface,
 	    "path", &path,
-	    "args", &call_args);
+	    "args", &call_args,
+	    "upload", &upload,
+	    "timeout", &timeout,
+	    "query", &query,
+	    "etag", &etag);
 
 	rpc_retain(id);
 	call = rpc_call_alloc(conn, id, path, interface, method, call_args);
@@ -398,13 +884,53 @@ on_rpc_call(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 		return;
 	}
 
+	if (query != NULL) {
+		call->rc_query = rpc_query_pushdown_new(query);
+		if (call->rc_query == NULL) {
+			err = rpc_get_last_error();
+			rpc_connection_send_err(conn, id,
+			    rpc_error_get_code(err),
+			    rpc_error_get_message(err));
+			rpc_connection_call_release(call);
+			return;
+		}
+	}
+
+	/* An empty tag asks for one without having any yet */
+	if (etag != NULL) {
+		call->rc_conditional = true;
+		call->rc_etag = *etag != '\0' ? g_strdup(etag) : NULL;
+	}
+
 	call->rc_type = RPC_INBOUND_CALL;
+	call->rc_bytes_in = conn->rco_recv_len;
+	rpc_mem_charge(conn, RPC_MEM_CALLS, call->rc_bytes_in);
+	if (RPC_SPANS_ACTIVE()) {
+		rpc_span_inbound(call,
+		    rpc_dictionary_get_string(args, "traceparent"),
+		    rpc_dictionary_get_string(args, "tracestate"));
+	}
+
+	if (timeout != 0) {
+		call->rc_deadline = g_get_monotonic_time() +
+		    (gint64)timeout * 1000;
+	}
+
+	if (upload) {
+		call->rc_upload = true;
+		call->rc_input = g_queue_new();
+	}
 
 	g_rw_lock_writer_lock(&conn->rco_icall_rwlock);
-	g_hash_table_insert(conn->rco_inbound_calls,
-	    (gpointer)rpc_string_get_string_ptr(id), call);
+	g_hash_table_insert(conn->rco_inbound_calls, call->rc_id, call);
 	g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
 
+	/* The first window of an upload stream is granted up front */
+	if (upload) {
+		rpc_connection_send_upload_continue(conn, call->rc_id,
+		    RPC_UPLOAD_WINDOW);
+	}
+
 	if (conn->rco_server != NULL)
 		res = rpc_server_dispatch(conn->rco_server, call);
 	else
@@ -420,48 +946,111 @@ on_rpc_call(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	}
 }
 
+/*
+ * A batch is a list of regular call payloads, each with its own call ID.
+ * The calls are dispatched one by one, and get responded to separately.
+ */
 static void
-on_rpc_response(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
+on_rpc_call_batch(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 {
-	struct queue_item *q_item;
-	struct work_item *item;
-	rpc_call_t call;
 
-	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
-	if (call == NULL) {
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+	if (rpc_get_type(args) != RPC_TYPE_ARRAY) {
+		rpc_connection_send_err(conn, id, EINVAL, "Malformed request");
 		return;
 	}
 
-	g_assert(call->rc_type == RPC_OUTBOUND_CALL);
-
-	rpc_connection_call_retain(call);
-	g_mutex_lock(&call->rc_mtx);
+	rpc_array_walk(args, ^(size_t idx __unused, rpc_object_t value) {
+		rpc_object_t call_id;
 
-	if (cancel_timeout_locked(call) != 0) {
-		g_mutex_unlock(&call->rc_mtx);
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
-		rpc_connection_call_release(call);
-		return;
-	}
+		call_id = rpc_get_type(value) == RPC_TYPE_DICTIONARY ?
+		    rpc_dictionary_get_value(value, "id") : NULL;
+		if (call_id == NULL) {
+			rpc_connection_send_err(conn, id, EINVAL,
+			    "Malformed request");
+			return ((bool)true);
+		}
 
-	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		on_rpc_call(conn, value, call_id);
+		return ((bool)true);
+	});
+}
 
-	if (call->rc_callback) {
-		item = g_malloc0(sizeof(*item));
-		item->call = call;
-		if (!rpc_run_callback(conn, item))
-			g_free(item);
+static void
+on_rpc_response(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
+{
+
+	rpc_call_complete(conn, id, args, NULL);
+}
+
+/*
+ * Response to a conditional call. It comes without a value when the
+ * tag is the one the call was made with.
+ */
+static void
+on_rpc_tagged_response(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id)
+{
+	rpc_object_t value = NULL;
+	const char *etag = NULL;
+
+	rpc_object_unpack(args, "{s,v}",
+	    "etag", &etag,
+	    "value", &value);
+
+	if (etag == NULL)
+		return;
+
+	rpc_call_complete(conn, id, value, etag);
+}
+
+static void
+rpc_call_complete(rpc_connection_t conn, rpc_object_t id,
+    rpc_object_t result, const char *etag)
+{
+	struct queue_item *q_item;
+	struct rpc_call_shard *shard;
+	rpc_call_t call;
+
+	shard = rpc_call_shard(conn, id);
+	g_rw_lock_reader_lock(&shard->rcs_lock);
+	call = g_hash_table_lookup(shard->rcs_calls, id);
+	if (call == NULL) {
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
+		return;
+	}
+
+	g_assert(call->rc_type == RPC_OUTBOUND_CALL);
+
+	rpc_connection_call_retain(call);
+	g_mutex_lock(&call->rc_mtx);
+
+	if (cancel_timeout_locked(call) != 0) {
+		g_mutex_unlock(&call->rc_mtx);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
+		rpc_connection_call_release(call);
+		return;
+	}
+
+	g_rw_lock_reader_unlock(&shard->rcs_lock);
+
+	if (etag != NULL) {
+		g_free(call->rc_etag);
+		call->rc_etag = g_strdup(etag);
+		call->rc_not_modified = result == NULL;
 	}
 
-	q_item = g_malloc(sizeof(*q_item));
+	if (call->rc_callback != NULL && conn->rco_cq == NULL)
+		rpc_run_call_callback(conn, call);
+
+	if (call->rc_span.rsc_valid)
+		rpc_span_outbound_done(call, false);
+
+	q_item = rpc_call_queue_push(call);
 	q_item->status = RPC_CALL_DONE;
-	q_item->item = rpc_retain(args);
+	q_item->item = result != NULL ? rpc_retain(result) : rpc_null_create();
 
-	g_queue_push_tail(call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	rpc_call_post_completion(conn, call);
 	g_mutex_unlock(&call->rc_mtx);
 	rpc_connection_call_release(call);
 }
@@ -470,43 +1059,50 @@ static void
 on_rpc_start_stream(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 {
 	struct queue_item *q_item;
-	struct work_item *item;
+	struct rpc_call_shard *shard;
 	rpc_call_t call;
 	int64_t seqno;
 
-	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	shard = rpc_call_shard(conn, id);
+	g_rw_lock_reader_lock(&shard->rcs_lock);
+	call = g_hash_table_lookup(shard->rcs_calls, id);
 	if (call == NULL) {
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
 		return;
 	}
 	rpc_connection_call_retain(call);
 	g_mutex_lock(&call->rc_mtx);
 	if (cancel_timeout_locked(call) != 0) {
 		g_mutex_unlock(&call->rc_mtx);
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
 		rpc_connection_call_release(call);
 		return;
 	}
 
-	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+	g_rw_lock_reader_unlock(&shard->rcs_lock);
 
 	seqno = rpc_dictionary_get_int64(args, "seqno");
 
-	if (call->rc_callback) {
-		item = g_malloc0(sizeof(*item));
-		item->call = call;
-		if (!rpc_run_callback(conn, item))
-			g_free(item);
+	/* A chunked result is put back together before anyone sees it */
+	if (rpc_dictionary_get_bool(args, "chunked") &&
+	    !conn->rco_chunk_incremental) {
+		call->rc_chunks = rpc_array_create();
+		call->rc_prefetch = MAX(call->rc_prefetch, RPC_CHUNK_WINDOW);
+		rpc_call_grant_locked(call, 1);
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_call_release(call);
+		return;
 	}
 
-	q_item = g_malloc(sizeof(*q_item));
+	if (call->rc_callback != NULL && conn->rco_cq == NULL)
+		rpc_run_call_callback(conn, call);
+
+	q_item = rpc_call_queue_push(call);
 	q_item->status = RPC_CALL_STREAM_START;
 	q_item->item = rpc_null_create();
 
-	g_queue_push_tail(call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	rpc_call_post_completion(conn, call);
 	g_mutex_unlock(&call->rc_mtx);
 	rpc_connection_call_release(call);
 }
@@ -515,16 +1111,16 @@ static void
 on_rpc_fragment(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 {
 	struct queue_item *q_item;
-	struct work_item *item;
+	struct rpc_call_shard *shard;
 	rpc_call_t call;
 	rpc_object_t payload;
 	int64_t seqno;
 
-	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	shard = rpc_call_shard(conn, id);
+	g_rw_lock_reader_lock(&shard->rcs_lock);
+	call = g_hash_table_lookup(shard->rcs_calls, id);
 	if (call == NULL) {
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
 		return;
 	}
 
@@ -532,12 +1128,12 @@ on_rpc_fragment(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	g_mutex_lock(&call->rc_mtx);
 	if (cancel_timeout_locked(call) != 0) {
 		g_mutex_unlock(&call->rc_mtx);
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
 		rpc_connection_call_release(call);
 		return;
 	}
 
-	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+	g_rw_lock_reader_unlock(&shard->rcs_lock);
 
 	seqno = rpc_dictionary_get_int64(args, "seqno");
 	payload = rpc_dictionary_get_value(args, "fragment");
@@ -549,18 +1145,213 @@ on_rpc_fragment(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 		return;
 	}
 
-	if (call->rc_callback) {
-		item = g_malloc0(sizeof(*item));
-		item->call = call;
-		if (!rpc_run_callback(conn, item))
-			g_free(item);
+	if (call->rc_chunks != NULL) {
+		rpc_call_add_chunk_locked(call, payload);
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_call_release(call);
+		return;
 	}
 
-	q_item = g_malloc(sizeof(*q_item));
+	if (call->rc_window.rcw_enabled)
+		rpc_call_window_sample(call, conn->rco_recv_len);
+
+	if (call->rc_callback != NULL && conn->rco_cq == NULL)
+		rpc_run_call_callback(conn, call);
+
+	q_item = rpc_call_queue_push(call);
 	q_item->status = RPC_CALL_MORE_AVAILABLE;
 	q_item->item = rpc_retain(payload);
+	q_item->size = conn->rco_recv_len;
+	rpc_mem_charge(conn, RPC_MEM_FRAGMENTS, q_item->size);
+
+	rpc_context_check_call_backlog(call);
+	notify_signal(&call->rc_notify);
+	rpc_call_post_completion(conn, call);
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_connection_call_release(call);
+}
+
+/*
+ * A batch of consecutive fragments of one stream. They all get queued
+ * under a single acquisition of the call lock.
+ */
+static void
+on_rpc_fragments(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
+{
+	struct queue_item *q_item;
+	struct rpc_call_shard *shard;
+	rpc_call_t call;
+	rpc_object_t fragments;
+	rpc_object_t payload;
+	size_t count;
+	size_t i;
+
+	shard = rpc_call_shard(conn, id);
+	g_rw_lock_reader_lock(&shard->rcs_lock);
+	call = g_hash_table_lookup(shard->rcs_calls, id);
+	if (call == NULL) {
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
+		return;
+	}
+
+	rpc_connection_call_retain(call);
+	g_mutex_lock(&call->rc_mtx);
+	if (cancel_timeout_locked(call) != 0) {
+		g_mutex_unlock(&call->rc_mtx);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
+		rpc_connection_call_release(call);
+		return;
+	}
+
+	g_rw_lock_reader_unlock(&shard->rcs_lock);
+
+	fragments = rpc_dictionary_get_value(args, "fragments");
+	if (fragments == NULL || rpc_get_type(fragments) != RPC_TYPE_ARRAY ||
+	    rpc_array_get_count(fragments) == 0) {
+		debugf("Malformed fragment batch received on %p", conn);
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_call_release(call);
+		return;
+	}
+
+	count = rpc_array_get_count(fragments);
+	if (call->rc_chunks != NULL) {
+		for (i = 0; i < count; i++) {
+			rpc_call_add_chunk_locked(call,
+			    rpc_array_get_value(fragments, i));
+		}
+
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_call_release(call);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		payload = rpc_array_get_value(fragments, i);
+
+		if (call->rc_window.rcw_enabled)
+			rpc_call_window_sample(call,
+			    conn->rco_recv_len / count);
+
+		if (call->rc_callback != NULL && conn->rco_cq == NULL)
+			rpc_run_call_callback(conn, call);
+
+		q_item = rpc_call_queue_push(call);
+		q_item->status = RPC_CALL_MORE_AVAILABLE;
+		q_item->item = rpc_retain(payload);
+		q_item->size = conn->rco_recv_len / count;
+		rpc_mem_charge(conn, RPC_MEM_FRAGMENTS, q_item->size);
+		rpc_call_post_completion(conn, call);
+	}
+
+	rpc_context_check_call_backlog(call);
+	notify_signal(&call->rc_notify);
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_connection_call_release(call);
+}
+
+/*
+ * Adds a slice of a chunked result to what's been received so far, and
+ * grants the producer another one in its place. Called with rc_mtx held.
+ */
+static void
+rpc_call_add_chunk_locked(rpc_call_t call, rpc_object_t chunk)
+{
+	struct rpc_array_iter iter;
+	rpc_object_t value;
+
+	if (rpc_get_type(chunk) == RPC_TYPE_ARRAY) {
+		rpc_array_iter_init(chunk, &iter);
+		while (rpc_array_iter_next(&iter, NULL, &value))
+			rpc_array_append_value(call->rc_chunks, value);
+	}
+
+	rpc_call_grant_locked(call, 1);
+}
+
+static struct rpc_call *
+rpc_connection_find_input_call(rpc_connection_t conn, rpc_object_t id)
+{
+	struct rpc_call *call;
+
+	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+	call = g_hash_table_lookup(conn->rco_inbound_calls, id);
+	if (call == NULL || !call->rc_upload) {
+		g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+		if (conn->rco_error_handler != NULL)
+			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, id);
+		return (NULL);
+	}
+
+	rpc_connection_call_retain(call);
+	g_mutex_lock(&call->rc_mtx);
+	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+	return (call);
+}
+
+static void
+on_rpc_upload(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
+{
+	struct rpc_call *call;
+	rpc_object_t fragment;
+
+	call = rpc_connection_find_input_call(conn, id);
+	if (call == NULL)
+		return;
+
+	fragment = rpc_dictionary_get_value(args, "fragment");
+	if (fragment != NULL && !call->rc_upload_ended) {
+		g_queue_push_tail(call->rc_input, rpc_retain(fragment));
+		notify_signal(&call->rc_notify);
+	}
+
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_connection_call_release(call);
+}
+
+static void
+on_rpc_upload_end(rpc_connection_t conn, rpc_object_t args __unused,
+    rpc_object_t id)
+{
+	struct rpc_call *call;
+
+	call = rpc_connection_find_input_call(conn, id);
+	if (call == NULL)
+		return;
+
+	call->rc_upload_ended = true;
+	notify_signal(&call->rc_notify);
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_connection_call_release(call);
+}
+
+static void
+on_rpc_upload_continue(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id)
+{
+	struct rpc_call_shard *shard;
+	rpc_call_t call;
+	int64_t increment = 0;
+
+	rpc_object_unpack(args, "{i}", "increment", &increment);
+
+	shard = rpc_call_shard(conn, id);
+	g_rw_lock_reader_lock(&shard->rcs_lock);
+	call = g_hash_table_lookup(shard->rcs_calls, id);
+	if (call == NULL || !call->rc_upload) {
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
+		return;
+	}
+
+	rpc_connection_call_retain(call);
+	g_mutex_lock(&call->rc_mtx);
+	g_rw_lock_reader_unlock(&shard->rcs_lock);
+	call->rc_upload_credit += increment;
+
+	/* An upload that makes progress doesn't time out */
+	if (call->rc_timer_armed && !call->rc_timedout)
+		rpc_call_arm_timeout_locked(call, conn->rco_rpc_timeout);
 
-	g_queue_push_tail(call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
 	g_mutex_unlock(&call->rc_mtx);
 	rpc_connection_call_release(call);
@@ -570,16 +1361,17 @@ static void
 on_rpc_continue(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 {
 	struct rpc_call *call;
+	rpc_ready_handler_t ready = NULL;
 	int64_t seqno = 0;
 	int64_t increment = 1;
+	bool ended;
 
 	rpc_object_unpack(args, "{i,i}",
 	    "seqno", &seqno,
 	    "increment", &increment);
 
 	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
-	call = g_hash_table_lookup(conn->rco_inbound_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_inbound_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 		if (conn->rco_error_handler != NULL)
@@ -591,22 +1383,75 @@ on_rpc_continue(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	g_mutex_lock(&call->rc_mtx);
 	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 	call->rc_consumer_seqno += increment;
+	ended = rpc_call_drain_output_locked(call);
 	notify_signal(&call->rc_notify);
+
+	if (call->rc_ready_handler != NULL && !call->rc_aborted &&
+	    rpc_call_can_yield(call)) {
+		ready = call->rc_ready_handler;
+		call->rc_ready_handler = NULL;
+	}
+
 	g_mutex_unlock(&call->rc_mtx);
+	if (ended)
+		rpc_connection_close_inbound_call(call);
+
+	if (ready != NULL) {
+		ready();
+		Block_release(ready);
+	}
+
 	rpc_connection_call_release(call);
 }
 
+/*
+ * Sends buffered fragments the consumer has credits for, and the end of
+ * the stream once they're all out if the producer is done. Returns
+ * whether it sent the end.
+ */
+static bool
+rpc_call_drain_output_locked(struct rpc_call *call)
+{
+	rpc_object_t fragment;
+
+	while (!g_queue_is_empty(&call->rc_outbuf) &&
+	    call->rc_producer_seqno < call->rc_consumer_seqno &&
+	    !call->rc_aborted) {
+		fragment = g_queue_pop_head(&call->rc_outbuf);
+		call->rc_outbuf_bytes -= MIN(call->rc_outbuf_bytes,
+		    rpc_object_size_hint(fragment));
+		rpc_connection_queue_fragment(call, call->rc_producer_seqno,
+		    fragment, call->rc_producer_seqno + 1 ==
+		    call->rc_consumer_seqno);
+		call->rc_producer_seqno++;
+	}
+
+	if (!call->rc_end_pending || !g_queue_is_empty(&call->rc_outbuf) ||
+	    call->rc_producer_seqno >= call->rc_consumer_seqno ||
+	    call->rc_aborted)
+		return (false);
+
+	rpc_connection_flush_fragments(call);
+	rpc_connection_send_end(call->rc_conn, call->rc_id,
+	    call->rc_producer_seqno);
+	call->rc_producer_seqno++;
+	call->rc_end_pending = false;
+	call->rc_ended = true;
+	return (true);
+}
+
 static void
 on_rpc_end(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 {
 	struct queue_item *q_item;
+	struct rpc_call_shard *shard;
 	rpc_call_t call;
 
-	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	shard = rpc_call_shard(conn, id);
+	g_rw_lock_reader_lock(&shard->rcs_lock);
+	call = g_hash_table_lookup(shard->rcs_calls, id);
 	if (call == NULL) {
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
 		if (conn->rco_error_handler != NULL)
 			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, id);
 		return;
@@ -616,19 +1461,31 @@ on_rpc_end(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 	g_mutex_lock(&call->rc_mtx);
 	if (cancel_timeout_locked(call) != 0) {
 		g_mutex_unlock(&call->rc_mtx);
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
 		rpc_connection_call_release(call);
 		return;
 	}
 
-	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+	g_rw_lock_reader_unlock(&shard->rcs_lock);
 
-	q_item = g_malloc(sizeof(*q_item));
-	q_item->status = RPC_CALL_ENDED;
-	q_item->item = rpc_retain(args);
+	if (call->rc_callback != NULL && conn->rco_cq == NULL)
+		rpc_run_call_callback(conn, call);
+
+	if (call->rc_span.rsc_valid)
+		rpc_span_outbound_done(call, false);
+
+	q_item = rpc_call_queue_push(call);
+	if (call->rc_chunks != NULL) {
+		q_item->status = RPC_CALL_DONE;
+		q_item->item = call->rc_chunks;
+		call->rc_chunks = NULL;
+	} else {
+		q_item->status = RPC_CALL_ENDED;
+		q_item->item = rpc_retain(args);
+	}
 
-	g_queue_push_tail(call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	rpc_call_post_completion(conn, call);
 	g_mutex_unlock(&call->rc_mtx);
 	rpc_connection_call_release(call);
 }
@@ -637,10 +1494,10 @@ static void
 on_rpc_abort(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 {
 	struct rpc_call *call;
+	bool pending;
 
 	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
-	call = g_hash_table_lookup(conn->rco_inbound_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_inbound_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 		if (conn->rco_error_handler != NULL)
@@ -654,6 +1511,13 @@ on_rpc_abort(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 	call->rc_ended = true;
 	call->rc_aborted = true;
 	notify_signal(&call->rc_notify);
+
+	/* The method is long gone, nobody else is going to close it */
+	pending = call->rc_end_pending;
+	call->rc_end_pending = false;
+	if (pending)
+		rpc_connection_call_retain(call);
+
 	if (call->rc_abort_handler) {
 		/* call_abort_locked() will cause the call release */
 		call_abort_locked(call);
@@ -661,25 +1525,33 @@ on_rpc_abort(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 		g_mutex_unlock(&call->rc_mtx);
 		rpc_connection_call_release(call);
 	}
+
+	if (pending) {
+		rpc_connection_close_inbound_call(call);
+		rpc_connection_call_release(call);
+	}
 }
 
 static void
 on_rpc_error(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 {
 	struct queue_item *q_item;
+	struct rpc_call_shard *shard;
 	rpc_call_t call;
 
-	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	rpc_conn_stats_error(&conn->rco_stats, false,
+	    rpc_error_get_code(args));
+	shard = rpc_call_shard(conn, id);
+	g_rw_lock_reader_lock(&shard->rcs_lock);
+	call = g_hash_table_lookup(shard->rcs_calls, id);
 	if (call == NULL) {
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
 
 		// Support for older clients that do not support stream_start message
 		if (rpc_error_get_code(args) == ENXIO) {
 			g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
 			call = g_hash_table_lookup(conn->rco_inbound_calls,
-			    rpc_string_get_string_ptr(id));
+			    id);
 			if (call != NULL) {
 				rpc_connection_call_retain(call);
 				g_mutex_lock(&call->rc_mtx);
@@ -702,19 +1574,25 @@ on_rpc_error(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	g_mutex_lock(&call->rc_mtx);
 	if (cancel_timeout_locked(call) != 0) {
 		g_mutex_unlock(&call->rc_mtx);
-		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
 		rpc_connection_call_release(call);
 		return;
 	}
 
-	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+	g_rw_lock_reader_unlock(&shard->rcs_lock);
+
+	if (call->rc_callback != NULL && conn->rco_cq == NULL)
+		rpc_run_call_callback(conn, call);
+
+	if (call->rc_span.rsc_valid)
+		rpc_span_outbound_done(call, true);
 
-	q_item = g_malloc(sizeof(*q_item));
+	q_item = rpc_call_queue_push(call);
 	q_item->status = RPC_CALL_ERROR;
 	q_item->item = rpc_retain(args);
 
-	g_queue_push_tail(call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	rpc_call_post_completion(conn, call);
 	g_mutex_unlock(&call->rc_mtx);
 	rpc_connection_call_release(call);
 }
@@ -723,30 +1601,26 @@ static void
 on_events_event(rpc_connection_t conn, rpc_object_t args,
     rpc_object_t id __unused)
 {
-	struct work_item *item;
 
 	if (args == NULL)
 		return;
 
-	rpc_retain(args);
-	item = g_malloc0(sizeof(*item));
-	item->event = args;
-	rpc_run_callback(conn, item);
+	rpc_connection_dispatch_event(conn, args);
 }
 
 static void
 on_events_event_burst(rpc_connection_t conn, rpc_object_t args,
     rpc_object_t id __unused)
 {
+	struct rpc_array_iter iter;
+	rpc_object_t value;
 
-	rpc_array_apply(args, ^(size_t idx __unused, rpc_object_t value) {
-		struct work_item *item;
+	if (rpc_get_type(args) != RPC_TYPE_ARRAY)
+		return;
 
-		rpc_retain(value);
-		item = g_malloc0(sizeof(*item));
-		rpc_run_callback(conn, item);
-		return ((bool)true);
-	});
+	rpc_array_iter_init(args, &iter);
+	while (rpc_array_iter_next(&iter, NULL, &value))
+		rpc_connection_dispatch_event(conn, value);
 }
 
 static void
@@ -757,10 +1631,14 @@ on_events_subscribe(rpc_connection_t conn, rpc_object_t args,
 		return;
 
 	rpc_array_apply(args, ^(size_t index __unused, rpc_object_t value) {
-		struct rpc_subscription *sub = NULL;
+		struct rpc_subscription *sub;
+		struct rpc_subscription_filter *filter;
 		const char *path = NULL;
 		const char *interface = NULL;
 		const char *name = NULL;
+		rpc_object_t rules;
+		rpc_query_plan_t plan = NULL;
+		bool added = false;
 
 		if (rpc_object_unpack(value, "{s,s,s}",
 		    "name", &name,
@@ -768,68 +1646,407 @@ on_events_subscribe(rpc_connection_t conn, rpc_object_t args,
 		    "path", &path) <1)
 	    		return ((bool)true);
 
+		/* Rules are compiled once, not for every event */
+		rules = rpc_dictionary_get_value(value, "rules");
+		if (rules != NULL) {
+			plan = rpc_query_compile(rules);
+			if (plan == NULL) {
+				debugf("invalid rules for event %s", name);
+				return ((bool)true);
+			}
+		}
+
 		g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-		if (conn->rco_subscriptions->len > 0)
-			sub = rpc_connection_find_subscription(conn, path,
-			    interface, name);
+		sub = rpc_connection_find_subscription(conn, path, interface,
+		    name);
 		if (sub == NULL) {
 			sub = g_malloc0(sizeof(*sub));
 			sub->rsu_path = g_strdup(path);
 			sub->rsu_interface = g_strdup(interface);
 			sub->rsu_name = g_strdup(name);
-			g_ptr_array_add(conn->rco_subscriptions, sub);
+			sub->rsu_pattern = rpc_subscription_is_pattern(path);
+			sub->rsu_filters = g_ptr_array_new_with_free_func(
+			    rpc_subscription_filter_free);
+			g_hash_table_add(conn->rco_subscriptions, sub);
+			if (sub->rsu_pattern) {
+				g_atomic_int_inc(
+				    &conn->rco_subscription_patterns);
+			}
+
+			added = true;
 		}
 
+		filter = rpc_subscription_find_filter(sub, rules);
+		if (filter == NULL) {
+			filter = g_malloc0(sizeof(*filter));
+			filter->rsf_rules = rpc_retain(rules);
+			filter->rsf_plan = plan;
+			g_ptr_array_add(sub->rsu_filters, filter);
+			if (plan != NULL) {
+				g_atomic_int_inc(
+				    &conn->rco_subscription_filters);
+			}
+		} else if (plan != NULL)
+			rpc_query_plan_free(plan);
+
+		filter->rsf_refcount++;
 		sub->rsu_refcount++;
-		if (conn->rco_subscriptions->len == 1) {
-			/* just added, add conn to context */
-			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-			g_rw_lock_writer_lock(
-			    &conn->rco_rpc_context->rcx_rwlock);
-			g_hash_table_insert(
-			    conn->rco_rpc_context->rcx_event_watchers, conn, conn);
-			g_rw_lock_writer_unlock(
-			    &conn->rco_rpc_context->rcx_rwlock);
-		} else {
-			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+		/* just added, let the context know where to send it */
+		if (added) {
+			rpc_context_add_event_watcher(conn->rco_rpc_context,
+			    path, interface, name, conn);
 		}
 
 		return ((bool)true);
 	});
 }
 
-static void
-rpc_subscription_release(struct rpc_subscription *sub)
+/*
+ * Subscriptions of a server connection in the form events.subscribe
+ * takes them, each repeated as many times as the peer subscribed to it.
+ */
+rpc_object_t
+rpc_connection_snapshot_subscriptions(rpc_connection_t conn)
 {
+	struct rpc_subscription *sub;
+	struct rpc_subscription_filter *filter;
+	GHashTableIter iter;
+	rpc_object_t result = rpc_array_create();
+	rpc_object_t entry;
+	guint i;
+	int j;
 
-	g_free(sub->rsu_path);
-	g_free(sub->rsu_interface);
-	g_free(sub->rsu_name);
-	if (sub->rsu_handlers != NULL)
-		g_ptr_array_free(sub->rsu_handlers, true);
-	g_free(sub);
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	g_hash_table_iter_init(&iter, conn->rco_subscriptions);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&sub, NULL)) {
+		for (i = 0; i < sub->rsu_filters->len; i++) {
+			filter = g_ptr_array_index(sub->rsu_filters, i);
+			for (j = 0; j < filter->rsf_refcount; j++) {
+				entry = rpc_object_pack("{s,s,s}",
+				    "path", sub->rsu_path,
+				    "interface", sub->rsu_interface,
+				    "name", sub->rsu_name);
+				if (filter->rsf_rules != NULL) {
+					rpc_dictionary_set_value(entry,
+					    "rules", filter->rsf_rules);
+				}
+
+				rpc_array_append_stolen_value(result, entry);
+			}
+		}
+	}
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+
+	return (result);
 }
 
-static void
-rpc_rsh_release(struct rpc_subscription_handler *rsh)
+void
+rpc_connection_restore_subscriptions(rpc_connection_t conn,
+    rpc_object_t subscriptions)
 {
 
-	Block_release(rsh->rsh_handler);
-	g_free(rsh);
+	on_events_subscribe(conn, subscriptions, NULL);
 }
 
-static void
-on_events_unsubscribe(rpc_connection_t conn, rpc_object_t args,
-    rpc_object_t id __unused)
+/*
+ * Calls still in flight on the connection, in either direction.
+ */
+size_t
+rpc_connection_pending_calls(rpc_connection_t conn)
 {
-	if (rpc_get_type(args) != RPC_TYPE_ARRAY)
-		return;
-
-	rpc_array_apply(args, ^(size_t index __unused, rpc_object_t value) {
-		struct rpc_subscription *sub;
-		const char *path = NULL;
-		const char *interface = NULL;
-		const char *name = NULL;
+	size_t pending;
+	int i;
+
+	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+	pending = g_hash_table_size(conn->rco_inbound_calls);
+	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+
+	for (i = 0; i < RPC_CALL_SHARDS; i++) {
+		g_rw_lock_reader_lock(&conn->rco_call_shards[i].rcs_lock);
+		pending += g_hash_table_size(conn->rco_call_shards[i].rcs_calls);
+		g_rw_lock_reader_unlock(&conn->rco_call_shards[i].rcs_lock);
+	}
+
+	return (pending);
+}
+
+/*
+ * Everything another process needs to carry on with a server connection
+ * from the next frame on: the negotiated features, id counters, the
+ * type table, credentials, session and subscriptions. Mutes the
+ * connection first, so nothing else goes out once the state is taken.
+ * Fails while calls are still in flight or shared memory is in use.
+ */
+rpc_object_t
+rpc_connection_export_state(rpc_connection_t conn)
+{
+	rpc_object_t features;
+	rpc_object_t result;
+	size_t pending;
+
+	if (conn->rco_shmem_pools) {
+		rpc_set_last_errorf(ENOTSUP,
+		    "Connections with shared memory can't be handed over");
+		return (NULL);
+	}
+
+	pending = rpc_connection_pending_calls(conn);
+	if (pending > 0) {
+		rpc_set_last_errorf(EBUSY, "%zu calls still in progress",
+		    pending);
+		return (NULL);
+	}
+
+	g_mutex_lock(&conn->rco_send_mtx);
+	while (conn->rco_send_active)
+		g_cond_wait(&conn->rco_send_cv, &conn->rco_send_mtx);
+
+	conn->rco_send_failed = true;
+	g_mutex_unlock(&conn->rco_send_mtx);
+
+	features = rpc_object_pack("{b,b,b,b,b,b,b,b,b,b,b}",
+	    "compact_ids", (bool)conn->rco_compact_ids,
+	    "compact_ops", (bool)conn->rco_compact_ops,
+	    "compact_acked", (bool)conn->rco_compact_acked,
+	    "packed_arrays", (bool)conn->rco_packed_arrays,
+	    "positional_structs", (bool)conn->rco_positional_structs,
+	    "columnar_arrays", (bool)conn->rco_columnar_arrays,
+	    "type_table", (bool)conn->rco_peer_types,
+	    "call_batch", (bool)conn->rco_call_batch,
+	    "fragment_batch", (bool)conn->rco_fragment_batch,
+	    "timestamps", (bool)conn->rco_timestamps,
+	    "chunked_results", (bool)conn->rco_chunked_results);
+
+	result = rpc_object_pack("{v,b,b,u,v}",
+	    "features", features,
+	    "positional", conn->rco_positional,
+	    "columnar", conn->rco_columnar,
+	    "next_id", conn->rco_next_id,
+	    "subscriptions", rpc_connection_snapshot_subscriptions(conn));
+
+	if (conn->rco_has_creds) {
+		rpc_dictionary_set_value(result, "creds", rpc_object_pack(
+		    "{i,i,i}",
+		    "uid", (int64_t)conn->rco_creds.rcc_uid,
+		    "gid", (int64_t)conn->rco_creds.rcc_gid,
+		    "pid", (int64_t)conn->rco_creds.rcc_pid));
+	}
+
+	if (conn->rco_session != NULL)
+		rpc_dictionary_set_string(result, "session", conn->rco_session);
+
+	if (conn->rco_types != NULL) {
+		rpc_dictionary_steal_value(result, "types",
+		    rpc_msgpack_types_export(conn->rco_types));
+	}
+
+	return (result);
+}
+
+/*
+ * The other half of rpc_connection_export_state(), called on a freshly
+ * accepted connection before its reader starts.
+ */
+int
+rpc_connection_import_state(rpc_connection_t conn, rpc_object_t state)
+{
+	rpc_object_t features;
+	rpc_object_t creds;
+	rpc_object_t types;
+	rpc_object_t subscriptions;
+	const char *session;
+
+	if (rpc_get_type(state) != RPC_TYPE_DICTIONARY) {
+		rpc_set_last_errorf(EINVAL, "Invalid connection state");
+		return (-1);
+	}
+
+	features = rpc_dictionary_get_value(state, "features");
+	if (features != NULL) {
+		conn->rco_compact_ids = rpc_dictionary_get_bool(features,
+		    "compact_ids");
+		conn->rco_compact_ops = rpc_dictionary_get_bool(features,
+		    "compact_ops");
+		conn->rco_compact_acked = rpc_dictionary_get_bool(features,
+		    "compact_acked");
+		conn->rco_packed_arrays = rpc_dictionary_get_bool(features,
+		    "packed_arrays");
+		conn->rco_positional_structs = rpc_dictionary_get_bool(
+		    features, "positional_structs");
+		conn->rco_columnar_arrays = rpc_dictionary_get_bool(features,
+		    "columnar_arrays");
+		conn->rco_peer_types = rpc_dictionary_get_bool(features,
+		    "type_table");
+		conn->rco_call_batch = rpc_dictionary_get_bool(features,
+		    "call_batch");
+		conn->rco_fragment_batch = rpc_dictionary_get_bool(features,
+		    "fragment_batch");
+		conn->rco_timestamps = rpc_dictionary_get_bool(features,
+		    "timestamps");
+		conn->rco_chunked_results = rpc_dictionary_get_bool(features,
+		    "chunked_results");
+	}
+
+	conn->rco_positional = rpc_dictionary_get_bool(state, "positional");
+	conn->rco_columnar = rpc_dictionary_get_bool(state, "columnar");
+	conn->rco_next_id = rpc_dictionary_get_uint64(state, "next_id");
+
+	creds = rpc_dictionary_get_value(state, "creds");
+	if (creds != NULL) {
+		conn->rco_has_creds = true;
+		conn->rco_creds.rcc_uid = (uid_t)rpc_dictionary_get_int64(
+		    creds, "uid");
+		conn->rco_creds.rcc_gid = (gid_t)rpc_dictionary_get_int64(
+		    creds, "gid");
+		conn->rco_creds.rcc_pid = (pid_t)rpc_dictionary_get_int64(
+		    creds, "pid");
+	}
+
+	types = rpc_dictionary_get_value(state, "types");
+	if (types != NULL) {
+		if (conn->rco_types == NULL)
+			conn->rco_types = rpc_msgpack_types_new();
+
+		rpc_msgpack_types_import(conn->rco_types, types);
+	}
+
+	session = rpc_dictionary_get_string(state, "session");
+	if (session != NULL)
+		rpc_context_adopt_session(conn->rco_rpc_context, conn, session);
+
+	subscriptions = rpc_dictionary_get_value(state, "subscriptions");
+	if (subscriptions != NULL)
+		rpc_connection_restore_subscriptions(conn, subscriptions);
+
+	return (0);
+}
+
+static void
+rpc_connection_drop_event_watchers(rpc_connection_t conn)
+{
+	struct rpc_subscription *sub;
+	GHashTableIter iter;
+
+	g_hash_table_iter_init(&iter, conn->rco_subscriptions);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&sub, NULL)) {
+		rpc_context_remove_event_watcher(conn->rco_rpc_context,
+		    sub->rsu_path, sub->rsu_interface, sub->rsu_name, conn);
+	}
+}
+
+void
+rpc_subscription_release(struct rpc_subscription *sub)
+{
+
+	g_free(sub->rsu_path);
+	g_free(sub->rsu_interface);
+	g_free(sub->rsu_name);
+	if (sub->rsu_handlers != NULL)
+		g_ptr_array_free(sub->rsu_handlers, true);
+	while (!g_queue_is_empty(&sub->rsu_pending))
+		rpc_release(g_queue_pop_head(&sub->rsu_pending));
+	if (sub->rsu_filters != NULL)
+		g_ptr_array_free(sub->rsu_filters, true);
+	if (sub->rsu_rules != NULL)
+		rpc_release(sub->rsu_rules);
+	g_free(sub);
+}
+
+static void
+rpc_subscription_filter_free(gpointer data)
+{
+	struct rpc_subscription_filter *filter = data;
+
+	if (filter->rsf_plan != NULL)
+		rpc_query_plan_free(filter->rsf_plan);
+	if (filter->rsf_rules != NULL)
+		rpc_release(filter->rsf_rules);
+	g_free(filter);
+}
+
+static struct rpc_subscription_filter *
+rpc_subscription_find_filter(struct rpc_subscription *sub, rpc_object_t rules)
+{
+	struct rpc_subscription_filter *filter;
+	guint i;
+
+	for (i = 0; i < sub->rsu_filters->len; i++) {
+		filter = g_ptr_array_index(sub->rsu_filters, i);
+		if (filter->rsf_rules == NULL || rules == NULL) {
+			if (filter->rsf_rules == rules)
+				return (filter);
+			continue;
+		}
+
+		if (rpc_equal(filter->rsf_rules, rules))
+			return (filter);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Whether any of the subscribers to a server-side subscription wants
+ * the event with these arguments.
+ */
+static bool
+rpc_subscription_accepts(struct rpc_subscription *sub, rpc_object_t args)
+{
+	struct rpc_subscription_filter *filter;
+	rpc_object_t match;
+	guint i;
+
+	if (sub->rsu_filters == NULL)
+		return (true);
+
+	for (i = 0; i < sub->rsu_filters->len; i++) {
+		filter = g_ptr_array_index(sub->rsu_filters, i);
+		if (filter->rsf_plan == NULL)
+			return (true);
+
+		if (args == NULL)
+			continue;
+
+		match = rpc_query_plan_apply(args, filter->rsf_plan);
+		if (match != NULL) {
+			rpc_release(match);
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+bool
+rpc_subscription_is_pattern(const char *path)
+{
+
+	return (path != NULL && strpbrk(path, "*?") != NULL);
+}
+
+static void
+rpc_rsh_release(struct rpc_subscription_handler *rsh)
+{
+
+	Block_release(rsh->rsh_handler);
+	g_free(rsh);
+}
+
+static void
+on_events_unsubscribe(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+	if (rpc_get_type(args) != RPC_TYPE_ARRAY)
+		return;
+
+	rpc_array_apply(args, ^(size_t index __unused, rpc_object_t value) {
+		struct rpc_subscription *sub;
+		struct rpc_subscription_filter *filter;
+		const char *path = NULL;
+		const char *interface = NULL;
+		const char *name = NULL;
 
 		if (rpc_object_unpack(value, "{s,s,s}",
 		    "name", &name,
@@ -844,23 +2061,163 @@ on_events_unsubscribe(rpc_connection_t conn, rpc_object_t args,
 			return ((bool)true);
 		}
 
-		sub->rsu_refcount--;
-		if (sub->rsu_refcount == 0) {
-			g_ptr_array_remove(conn->rco_subscriptions, sub);
-			if (conn->rco_subscriptions->len == 0) {
-				g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-				g_rw_lock_writer_lock(&conn->rco_rpc_context->rcx_rwlock);
-				g_assert(g_hash_table_remove(
-				    conn->rco_rpc_context->rcx_event_watchers,
-				    conn));
-				g_rw_lock_writer_unlock(&conn->rco_rpc_context->rcx_rwlock);
-				return ((bool)true);
+		/* Peers that don't say which rules drop whichever there is */
+		filter = rpc_subscription_find_filter(sub,
+		    rpc_dictionary_get_value(value, "rules"));
+		if (filter == NULL && sub->rsu_filters->len > 0)
+			filter = g_ptr_array_index(sub->rsu_filters, 0);
+
+		if (filter != NULL && --filter->rsf_refcount == 0) {
+			if (filter->rsf_plan != NULL) {
+				g_atomic_int_add(
+				    &conn->rco_subscription_filters, -1);
 			}
+
+			g_ptr_array_remove_fast(sub->rsu_filters, filter);
+		}
+
+		sub->rsu_refcount--;
+		if (sub->rsu_refcount > 0) {
+			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+			return ((bool)true);
 		}
+
+		if (sub->rsu_pattern)
+			g_atomic_int_add(&conn->rco_subscription_patterns, -1);
+
+		g_hash_table_remove(conn->rco_subscriptions, sub);
 		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		rpc_context_remove_event_watcher(conn->rco_rpc_context, path,
+		    interface, name, conn);
+		return ((bool)true);
+	});
+
+}
+
+static void
+on_shmem_release(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+
+#if defined(__linux__)
+	if (rpc_get_type(args) != RPC_TYPE_ARRAY || conn->rco_shm == NULL)
+		return;
+
+	rpc_array_apply(args, ^(size_t index __unused, rpc_object_t value) {
+		uint64_t pool;
+		uint64_t offset;
+
+		if (rpc_object_unpack(value, "[u,u]", &pool, &offset) < 2)
+			return ((bool)true);
+
+		rpc_shmem_link_returned(conn->rco_shm, pool, (off_t)offset);
 		return ((bool)true);
 	});
+#endif
+}
+
+/*
+ * The peer passed its bulk pool along. The pool got mapped when the
+ * descriptor was restored, so there's nothing left to do: the chunk it
+ * came with goes back once args are released.
+ */
+static void
+on_shmem_pool(rpc_connection_t conn __unused, rpc_object_t args __unused,
+    rpc_object_t id __unused)
+{
+
+}
+
+/*
+ * A client joined the event group we announced. Whatever gets
+ * published from now on reaches it by multicast, so tell it which
+ * sequence number that starts with.
+ */
+static void
+on_events_join(rpc_connection_t conn, rpc_object_t args __unused,
+    rpc_object_t id __unused)
+{
+	uint64_t seq;
+
+	if (conn->rco_server == NULL || conn->rco_server->rs_event_group == NULL)
+		return;
+
+	seq = rpc_event_group_join(conn->rco_server->rs_event_group, conn);
+	rpc_send_frame(conn, rpc_pack_frame(conn, RPC_OP_EVENT_JOINED, NULL,
+	    rpc_uint64_create(seq)));
+}
+
+static void
+on_events_joined(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+
+	if (conn->rco_event_member == NULL ||
+	    rpc_get_type(args) != RPC_TYPE_UINT64)
+		return;
+
+	rpc_event_member_synced(conn->rco_event_member,
+	    rpc_uint64_get_value(args));
+}
+
+static void
+on_events_repair(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+	uint64_t from;
+	uint64_t to;
+
+	if (conn->rco_server == NULL || conn->rco_server->rs_event_group == NULL)
+		return;
 
+	if (rpc_object_unpack(args, "[u,u]", &from, &to) < 2)
+		return;
+
+	rpc_event_group_repair(conn->rco_server->rs_event_group, conn, from,
+	    to);
+}
+
+/*
+ * Hands an event that came in through the event group to the usual
+ * callbacks. The server doesn't filter what it multicasts, so events
+ * we didn't subscribe to, or whose arguments don't match the rules we
+ * subscribed with, are dropped here.
+ */
+void
+rpc_connection_deliver_event(rpc_connection_t conn, rpc_object_t event)
+{
+	struct rpc_subscription *sub;
+	rpc_object_t args;
+	rpc_object_t match;
+	bool wanted = false;
+
+	args = rpc_dictionary_get_value(event, "args");
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	sub = rpc_connection_match_subscription(conn,
+	    rpc_dictionary_get_string(event, "path"),
+	    rpc_dictionary_get_string(event, "interface"),
+	    rpc_dictionary_get_string(event, "name"));
+	if (sub != NULL && sub->rsu_rules == NULL)
+		wanted = true;
+	else if (sub != NULL && args != NULL) {
+		match = rpc_query_apply(args, sub->rsu_rules);
+		wanted = match != NULL;
+		if (match != NULL)
+			rpc_release(match);
+	}
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+
+	if (wanted)
+		on_events_event(conn, event, NULL);
+}
+
+void
+rpc_connection_send_event_repair(rpc_connection_t conn, uint64_t from,
+    uint64_t to)
+{
+
+	rpc_send_frame(conn, rpc_pack_frame(conn, RPC_OP_EVENT_REPAIR, NULL,
+	    rpc_object_pack("[u,u]", from, to)));
 }
 
 static int
@@ -881,1433 +2238,5285 @@ rpc_set_creds(rpc_connection_t conn, pid_t pid, uid_t uid, gid_t gid)
 		rpc_set_last_errorf(EINVAL, "Connection is not open.");
 		ret = -1;
 	}
-	return (ret);
+	return (ret);
+}
+
+static uint64_t
+rpc_mem_usage(rpc_connection_t conn)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < RPC_MEM_KINDS; i++) {
+		total += __atomic_load_n(&conn->rco_mem.rma_used[i],
+		    __ATOMIC_RELAXED);
+	}
+
+	/* Read without the send lock, so only an estimate */
+	total += __atomic_load_n(&conn->rco_send_buf.rob_used,
+	    __ATOMIC_RELAXED);
+	total += __atomic_load_n(&conn->rco_flush_buf.rob_used,
+	    __ATOMIC_RELAXED);
+	total += __atomic_load_n(&conn->rco_urgent_buf.rob_used,
+	    __ATOMIC_RELAXED);
+	return (total);
+}
+
+static void
+rpc_mem_charge(rpc_connection_t conn, rpc_mem_kind_t kind, size_t size)
+{
+	struct rpc_mem_account *mem = &conn->rco_mem;
+	uint64_t usage;
+	uint64_t peak;
+
+	if (size == 0)
+		return;
+
+	__atomic_add_fetch(&mem->rma_used[kind], size, __ATOMIC_RELAXED);
+	usage = rpc_mem_usage(conn);
+	peak = __atomic_load_n(&mem->rma_peak, __ATOMIC_RELAXED);
+	while (usage > peak && !__atomic_compare_exchange_n(&mem->rma_peak,
+	    &peak, usage, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void
+rpc_mem_uncharge(rpc_connection_t conn, rpc_mem_kind_t kind, size_t size)
+{
+	struct rpc_mem_account *mem = &conn->rco_mem;
+
+	if (size == 0)
+		return;
+
+	__atomic_sub_fetch(&mem->rma_used[kind], size, __ATOMIC_RELAXED);
+	if (g_atomic_int_get(&mem->rma_waiting) > 0) {
+		g_mutex_lock(&mem->rma_mtx);
+		g_cond_broadcast(&mem->rma_cv);
+		g_mutex_unlock(&mem->rma_mtx);
+	}
+}
+
+static bool
+rpc_mem_over_soft(rpc_connection_t conn)
+{
+	uint64_t soft = conn->rco_mem.rma_soft;
+
+	return (soft != 0 && rpc_mem_usage(conn) > soft);
+}
+
+/*
+ * Charges a frame that was just read to its connection. Over the soft
+ * limit, a connection with a reader thread of its own stops reading
+ * until usage drops back, so that the peer is pushed back on by the
+ * transport; one sharing an I/O thread can't, and turns down new calls
+ * instead. Over the hard limit, the connection is dropped.
+ *
+ * The send queue shrinks without anyone being told, hence the periodic
+ * recheck.
+ */
+static int
+rpc_mem_admit(rpc_connection_t conn, size_t len)
+{
+	struct rpc_mem_account *mem = &conn->rco_mem;
+	uint64_t start;
+	uint64_t usage;
+
+	if (!conn->rco_shared_reader && rpc_mem_over_soft(conn)) {
+		start = rpc_stats_now();
+		g_mutex_lock(&mem->rma_mtx);
+		g_atomic_int_inc(&mem->rma_waiting);
+		while (rpc_mem_over_soft(conn) &&
+		    (g_atomic_int_get(&conn->rco_state) &
+		    CONNECTION_ABORTED) == 0) {
+			g_cond_wait_until(&mem->rma_cv, &mem->rma_mtx,
+			    g_get_monotonic_time() + 100 * 1000);
+		}
+
+		g_atomic_int_add(&mem->rma_waiting, -1);
+		g_mutex_unlock(&mem->rma_mtx);
+		__atomic_add_fetch(&mem->rma_stalls, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&mem->rma_stall_ns, rpc_stats_now() - start,
+		    __ATOMIC_RELAXED);
+	}
+
+	rpc_mem_charge(conn, RPC_MEM_FRAMES, len);
+	usage = rpc_mem_usage(conn);
+	if (mem->rma_hard == 0 || usage <= mem->rma_hard)
+		return (0);
+
+	rpc_mem_uncharge(conn, RPC_MEM_FRAMES, len);
+	if (conn->rco_error == NULL) {
+		conn->rco_error = rpc_error_create(ENOMEM,
+		    "Connection memory limit exceeded",
+		    rpc_object_pack("{usage:u,limit:u}", usage, mem->rma_hard));
+	}
+
+	return (-1);
+}
+
+/*
+ * Returns a cleared slot at the tail of the call queue. The ring starts
+ * out with room for the prefetch window, the stream start and the final
+ * status, and is only reallocated if the window grew past that. Called
+ * with rc_mtx held.
+ */
+static struct queue_item *
+rpc_call_queue_push(rpc_call_t call)
+{
+	struct rpc_call_queue *q = &call->rc_queue;
+	struct queue_item *items;
+	struct queue_item *q_item;
+	guint size;
+	guint i;
+
+	if (q->rcq_len == q->rcq_size) {
+		size = (guint)MIN(call->rc_prefetch + 2, G_MAXUINT / 2);
+		size = MAX(size, q->rcq_size * 2);
+		items = g_new(struct queue_item, size);
+		for (i = 0; i < q->rcq_len; i++)
+			items[i] = q->rcq_items[(q->rcq_head + i) % q->rcq_size];
+
+		g_free(q->rcq_items);
+		q->rcq_items = items;
+		q->rcq_size = size;
+		q->rcq_head = 0;
+	}
+
+	q_item = &q->rcq_items[(q->rcq_head + q->rcq_len) % q->rcq_size];
+	memset(q_item, 0, sizeof(*q_item));
+	q->rcq_len++;
+	return (q_item);
+}
+
+/* The @p n-th item from the head, or NULL. Called with rc_mtx held */
+static struct queue_item *
+rpc_call_queue_peek(rpc_call_t call, guint n)
+{
+	struct rpc_call_queue *q = &call->rc_queue;
+
+	if (n >= q->rcq_len)
+		return (NULL);
+
+	return (&q->rcq_items[(q->rcq_head + n) % q->rcq_size]);
+}
+
+/* Drops the head item and what it holds. Called with rc_mtx held */
+static void
+rpc_call_queue_pop(rpc_call_t call)
+{
+	struct rpc_call_queue *q = &call->rc_queue;
+	struct queue_item *q_item;
+
+	if (q->rcq_len == 0)
+		return;
+
+	q_item = &q->rcq_items[q->rcq_head];
+	rpc_mem_uncharge(call->rc_conn, RPC_MEM_FRAGMENTS, q_item->size);
+	rpc_release(q_item->item);
+	q->rcq_head = (q->rcq_head + 1) % q->rcq_size;
+	q->rcq_len--;
+}
+
+/*
+ * The pool, if set, is a receive buffer that owns the frame memory and
+ * that decoded objects may keep referencing.
+ */
+static int
+rpc_recv_msg_impl(struct rpc_connection *conn, const void *frame, size_t len,
+    int *fds, size_t nfds, void *pool)
+{
+	rpc_object_t msg = (rpc_object_t)frame;
+	rpc_object_t msgt;
+	GPtrArray *descs = NULL;
+	uint64_t start;
+	guint i;
+	int ret = 0;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		debugf("Rejecting msg, conn %p is closed", conn);
+		return (-1);
+	}
+
+	debugf("received frame: addr=%p, len=%zu", frame, len);
+	__atomic_add_fetch(&conn->rco_stats.rcs_frames_in, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&conn->rco_stats.rcs_bytes_in, len,
+	    __ATOMIC_RELAXED);
+
+	if (rpc_mem_admit(conn, len) != 0) {
+		rpc_connection_release(conn);
+		return (-1);
+	}
+
+	if (conn->rco_raw_handler != NULL) {
+		ret = (conn->rco_raw_handler(frame, len, fds, nfds));
+		goto done;
+	}
+
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0) {
+		/*
+		 * Typing information is resolved while decoding. Objects
+		 * holding descriptor indexes are collected on the way, so
+		 * frames carrying descriptors don't need another walk.
+		 */
+		if (nfds > 0)
+			descs = g_ptr_array_new();
+
+		start = rpc_stats_now();
+		msg = rpc_msgpack_deserialize_frame(frame, len, pool,
+		    conn->rco_arena, conn->rco_lazy, conn->rco_types,
+		    conn->rco_shm, descs);
+		__atomic_add_fetch(&conn->rco_stats.rcs_deserialize_ns,
+		    rpc_stats_now() - start, __ATOMIC_RELAXED);
+		if (msg == NULL) {
+			if (conn->rco_error_handler != NULL) {
+				conn->rco_error_handler(RPC_SPURIOUS_RESPONSE,
+				    NULL);
+			}
+			ret = -1;
+			goto done;
+		}
+	} else
+		rpc_retain(msg);
+
+	if (rpc_get_type(msg) != RPC_TYPE_DICTIONARY) {
+		if (conn->rco_error_handler != NULL)
+			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, msg);
+		rpc_release(msg);
+		ret = -1;
+		goto done;
+	}
+
+	if ((conn->rco_flags & (RPC_TRANSPORT_NO_SERIALIZE |
+	    RPC_TRANSPORT_NO_RPCT_SERIALIZE)) != RPC_TRANSPORT_NO_SERIALIZE)
+		msgt = msg;
+	else {
+		msgt = rpct_deserialize(msg);
+		rpc_release(msg);
+	}
+
+	if (msgt == NULL) {
+		if (conn->rco_error_handler != NULL)
+			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, NULL);
+
+		ret = -1;
+		goto done;
+	}
+
+	if (descs != NULL) {
+		for (i = 0; i < descs->len; i++) {
+			rpc_restore_fd(conn, g_ptr_array_index(descs, i), fds,
+			    nfds);
+		}
+	} else if (nfds > 0)
+		rpc_restore_fds(conn, msgt, fds, nfds);
+
+	if (RPC_TRACING()) {
+		rpc_trace_frame(conn, RPC_TRACE_RECV, msgt,
+		    (conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0 ?
+		    frame : NULL, len);
+	}
+
+	/* Handlers run on this thread, before the next frame is read */
+	conn->rco_recv_len = len;
+	rpc_connection_dispatch(conn, msgt);
+
+done:
+	if (descs != NULL)
+		g_ptr_array_free(descs, true);
+
+	rpc_mem_uncharge(conn, RPC_MEM_FRAMES, len);
+	rpc_connection_release(conn);
+	return (ret);
+}
+
+static int
+rpc_recv_msg(struct rpc_connection *conn, const void *frame, size_t len,
+    int *fds, size_t nfds)
+{
+
+	return (rpc_recv_msg_impl(conn, frame, len, fds, nfds,
+	    (conn->rco_flags & RPC_TRANSPORT_POOLED_RECV) != 0 ?
+	    (void *)frame : NULL));
+}
+
+/*
+ * Receives a frame living somewhere inside a receive buffer, usually
+ * one wrapping memory handed over by a library, such as a GBytes.
+ */
+static int
+rpc_recv_msg_owned(struct rpc_connection *conn, const void *frame, size_t len,
+    void *owner)
+{
+
+	return (rpc_recv_msg_impl(conn, frame, len, NULL, 0, owner));
+}
+
+static void
+call_abort_locked(struct rpc_call *call)
+{
+	rpc_abort_handler_t abt_fn;
+
+	abt_fn = call->rc_abort_handler;
+	call->rc_abort_handler = NULL;
+	g_mutex_unlock(&call->rc_mtx);
+	abt_fn();
+	Block_release(abt_fn);
+	rpc_connection_call_release(call);
+
+}
+
+static void
+rpc_abort_worker(void *arg, void *data)
+{
+	struct rpc_call *call = arg;
+	struct rpc_connection *conn = data;
+
+	g_mutex_lock(&call->rc_mtx);
+	g_assert(call->rc_conn == conn);
+	if (call->rc_abort_handler)
+		call_abort_locked(call);
+	else {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_call_release(call);
+	}
+}
+
+static void
+rpc_end_worker(void *arg, void *data __unused)
+{
+	struct rpc_call *call = arg;
+
+	rpc_connection_close_inbound_call(call);
+	rpc_connection_call_release(call);
+}
+
+static void
+rpc_connection_abort_inbound_calls(rpc_connection_t conn)
+{
+	GHashTableIter iter;
+	struct rpc_call *call;
+	char *key;
+
+	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+	g_hash_table_iter_init(&iter, conn->rco_inbound_calls);
+	while (g_hash_table_iter_next(&iter, (gpointer)&key, (gpointer)&call)) {
+		g_mutex_lock(&call->rc_mtx);
+		call->rc_aborted = true;
+		notify_signal(&call->rc_notify);
+
+		if (call->rc_end_pending) {
+			call->rc_end_pending = false;
+			rpc_connection_call_retain(call);
+			if (!rpc_executor_queue_push(conn->rco_callback_queue,
+			    rpc_end_worker, call))
+				rpc_connection_call_release(call);
+		}
+
+		if (call->rc_abort_handler) {
+			rpc_connection_call_retain(call);
+			g_mutex_unlock(&call->rc_mtx);
+			if (!rpc_executor_queue_push(conn->rco_callback_queue,
+			    rpc_abort_worker, call)) {
+				Block_release(call->rc_abort_handler);
+				call->rc_abort_handler = NULL;
+				rpc_connection_call_release(call);
+			}
+		} else
+			g_mutex_unlock(&call->rc_mtx);
+	}
+	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+}
+
+static void
+rpc_call_fail_aborted(struct rpc_call *call)
+{
+	struct queue_item *q_item;
+
+	g_mutex_lock(&call->rc_mtx);
+	/* Cancel timeout source */
+	if (cancel_timeout_locked(call) != 0) {
+		g_mutex_unlock(&call->rc_mtx);
+		return;
+	}
+
+	if (call->rc_span.rsc_valid)
+		rpc_span_outbound_done(call, true);
+
+	q_item = rpc_call_queue_push(call);
+	q_item->status = RPC_CALL_ERROR;
+	q_item->item = rpc_error_create(ECONNABORTED,
+	    "Connection closed", NULL);
+
+	if (call->rc_fanout != NULL)
+		rpc_call_notify_fanout(call);
+
+	notify_signal(&call->rc_notify);
+	g_mutex_unlock(&call->rc_mtx);
+}
+
+static int
+rpc_close(rpc_connection_t conn)
+{
+	GHashTableIter iter;
+	struct rpc_call_shard *shard;
+	struct rpc_call *call;
+	char *key;
+	guint i;
+
+	g_mutex_lock(&conn->rco_mtx);
+
+	/*
+	 * A client with a resumable session gets its transport replaced
+	 * in the background instead, unless it's being closed anyway.
+	 */
+	if (conn->rco_client != NULL && conn->rco_resume &&
+	    conn->rco_session != NULL &&
+	    (g_atomic_int_get(&conn->rco_state) &
+	    (CONNECTION_CLOSED | CONNECTION_ABORTED)) == 0) {
+		rpc_connection_start_resume(conn);
+		g_mutex_unlock(&conn->rco_mtx);
+		return (0);
+	}
+
+	if ((g_atomic_int_or(&conn->rco_state, CONNECTION_ABORTED) &
+	    CONNECTION_ABORTED) != 0) {
+		g_mutex_unlock(&conn->rco_mtx); /*another thread called first*/
+		return (0);
+	}
+
+	if (conn->rco_server != NULL)
+		g_atomic_int_or(&conn->rco_state, CONNECTION_CLOSED);
+
+	if (conn->rco_error_handler) {
+		if (conn->rco_error != NULL) {
+			conn->rco_error_handler(RPC_TRANSPORT_ERROR,
+			    conn->rco_error);
+		}
+		conn->rco_error_handler(RPC_CONNECTION_CLOSED, NULL);
+		Block_release(conn->rco_error_handler);
+		conn->rco_error_handler = NULL;
+	}
+
+	rpc_connection_retain(conn);
+
+	g_mutex_unlock(&conn->rco_mtx);
+
+	/* Tear down all the running inbound/outbound calls */
+	rpc_connection_abort_inbound_calls(conn);
+
+	for (i = 0; i < RPC_CALL_SHARDS; i++) {
+		shard = &conn->rco_call_shards[i];
+		g_rw_lock_reader_lock(&shard->rcs_lock);
+		g_hash_table_iter_init(&iter, shard->rcs_calls);
+		while (g_hash_table_iter_next(&iter, (gpointer)&key,
+		    (gpointer)&call))
+			rpc_call_fail_aborted(call);
+
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
+	}
+
+	if ((g_atomic_int_get(&conn->rco_state) & CONNECTION_CLOSED) != 0)
+		rpc_connection_do_close(conn, RPC_ABORTED);
+	rpc_connection_release(conn);
+
+	return (0);
+}
+
+/*
+ * The transport of a resumed connection is only released along with
+ * the connection, as its threads may still be on their way out.
+ */
+struct rpc_stale_transport
+{
+	rpc_release_fn_t	rst_release;
+	void *			rst_arg;
+};
+
+static void
+rpc_stale_transport_free(gpointer data)
+{
+	struct rpc_stale_transport *stale = data;
+
+	if (stale->rst_release != NULL && stale->rst_arg != NULL)
+		stale->rst_release(stale->rst_arg);
+
+	g_free(stale);
+}
+
+static int
+rpc_connection_open_session(rpc_connection_t conn)
+{
+	rpc_object_t result;
+
+	result = rpc_connection_call_syncp(conn, "/", RPC_SESSION_INTERFACE,
+	    "open", RPC_NULL_FORMAT);
+	if (result == NULL || rpc_get_type(result) != RPC_TYPE_STRING) {
+		rpc_release(result);
+		return (-1);
+	}
+
+	g_mutex_lock(&conn->rco_mtx);
+	g_free(conn->rco_session);
+	conn->rco_session = g_strdup(rpc_string_get_string_ptr(result));
+	g_mutex_unlock(&conn->rco_mtx);
+	rpc_release(result);
+	return (0);
+}
+
+/*
+ * Falls back to subscribing to everything we're subscribed to again
+ * when the server no longer knows about our session.
+ */
+static void
+rpc_connection_resubscribe(rpc_connection_t conn)
+{
+	struct rpc_subscription *sub;
+	GHashTableIter iter;
+	rpc_object_t args = rpc_array_create();
+
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	g_hash_table_iter_init(&iter, conn->rco_subscriptions);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&sub, NULL))
+		rpc_array_append_stolen_value(args, rpc_subscription_entry(sub));
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+
+	if (rpc_array_get_count(args) == 0) {
+		rpc_release(args);
+		return;
+	}
+
+	rpc_send_frame(conn, rpc_pack_frame(conn, RPC_OP_SUBSCRIBE, NULL,
+	    args));
+}
+
+/*
+ * Tells whether the method was declared safe to replay with
+ * rpc_connection_set_idempotent().
+ */
+static bool
+rpc_connection_is_idempotent(rpc_connection_t conn, const char *interface,
+    const char *method)
+{
+	char *key;
+	bool ret;
+
+	if (!conn->rco_replay)
+		return (false);
+
+	key = g_strdup_printf("%s.%s",
+	    interface != NULL ? interface : RPC_DEFAULT_INTERFACE, method);
+	g_mutex_lock(&conn->rco_mtx);
+	ret = conn->rco_idempotent != NULL &&
+	    g_hash_table_contains(conn->rco_idempotent, key);
+	g_mutex_unlock(&conn->rco_mtx);
+	g_free(key);
+	return (ret);
+}
+
+/*
+ * Only idempotent calls that haven't seen any of their result yet can
+ * be sent again.
+ */
+static bool
+rpc_call_replayable(struct rpc_call *call)
+{
+	bool ret;
+
+	g_mutex_lock(&call->rc_mtx);
+	ret = call->rc_replay && call->rc_idempotent &&
+	    call->rc_queue.rcq_len == 0 &&
+	    call->rc_consumer_seqno == 0;
+	g_mutex_unlock(&call->rc_mtx);
+
+	return (ret);
+}
+
+/*
+ * Settles the outbound calls that were in flight when the connection
+ * dropped: with replay enabled, idempotent ones that can be are sent
+ * once more under the same ID, everything else fails the way it would
+ * have if the connection had been closed. A replayed call may reach the
+ * server twice, which is why only idempotent calls are replayed.
+ */
+static void
+rpc_connection_settle_calls(rpc_connection_t conn, GPtrArray *calls)
+{
+	struct rpc_call *call;
+	rpc_object_t frame;
+	guint i;
+
+	for (i = 0; i < calls->len; i++) {
+		call = g_ptr_array_index(calls, i);
+		if (rpc_call_replayable(call)) {
+			frame = rpc_pack_frame(conn, RPC_OP_CALL, call->rc_id,
+			    rpc_call_payload(conn, call));
+			if (rpc_send_frame(conn, frame) == 0) {
+				rpc_connection_call_release(call);
+				continue;
+			}
+		}
+
+		rpc_call_fail_aborted(call);
+		rpc_connection_call_release(call);
+	}
+}
+
+static void *
+rpc_connection_resume_worker(void *arg)
+{
+	rpc_connection_t conn = arg;
+	const struct rpc_transport *transport;
+	struct rpc_stale_transport *stale;
+	GHashTableIter iter;
+	struct rpc_call_shard *shard;
+	struct rpc_call *call;
+	rpc_abort_fn_t abort_func;
+	rpc_object_t result;
+	GPtrArray *calls;
+	gint64 delay = RPC_RESUME_BACKOFF_MIN;
+	char *scheme;
+	char *key;
+	bool connected = false;
+	guint attempt;
+	guint i;
+
+	/* Let a writer still busy with the old transport run into its error */
+	g_mutex_lock(&conn->rco_send_mtx);
+	while (conn->rco_send_active)
+		g_cond_wait(&conn->rco_send_cv, &conn->rco_send_mtx);
+	g_mutex_unlock(&conn->rco_send_mtx);
+
+	calls = g_ptr_array_new();
+	for (i = 0; i < RPC_CALL_SHARDS; i++) {
+		shard = &conn->rco_call_shards[i];
+		g_rw_lock_reader_lock(&shard->rcs_lock);
+		g_hash_table_iter_init(&iter, shard->rcs_calls);
+		while (g_hash_table_iter_next(&iter, (gpointer)&key,
+		    (gpointer)&call)) {
+			rpc_connection_call_retain(call);
+			g_ptr_array_add(calls, call);
+		}
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
+	}
+
+	g_mutex_lock(&conn->rco_mtx);
+	abort_func = conn->rco_abort;
+	stale = g_malloc0(sizeof(*stale));
+	stale->rst_release = conn->rco_release;
+	stale->rst_arg = conn->rco_arg;
+	conn->rco_abort = NULL;
+	conn->rco_release = NULL;
+	conn->rco_arg = NULL;
+	if (conn->rco_stale_transports == NULL) {
+		conn->rco_stale_transports = g_ptr_array_new_with_free_func(
+		    rpc_stale_transport_free);
+	}
+	g_ptr_array_add(conn->rco_stale_transports, stale);
+	g_mutex_unlock(&conn->rco_mtx);
+
+	if (abort_func != NULL)
+		abort_func(stale->rst_arg);
+
+	/* Calls the server made to us died with the old transport */
+	rpc_connection_abort_inbound_calls(conn);
+
+	/* Whatever was negotiated applied to the old peer only */
+	g_atomic_int_set(&conn->rco_compact_ids, false);
+	g_atomic_int_set(&conn->rco_compact_ops, false);
+	g_atomic_int_set(&conn->rco_compact_acked, false);
+	g_atomic_int_set(&conn->rco_peer_legacy, false);
+	g_atomic_int_set(&conn->rco_packed_arrays, false);
+	g_atomic_int_set(&conn->rco_positional_structs, false);
+	g_atomic_int_set(&conn->rco_columnar_arrays, false);
+	g_atomic_int_set(&conn->rco_peer_types, false);
+	g_atomic_int_set(&conn->rco_call_batch, false);
+	g_atomic_int_set(&conn->rco_fragment_batch, false);
+	g_atomic_int_set(&conn->rco_timestamps, false);
+	g_atomic_int_set(&conn->rco_chunked_results, false);
+	g_atomic_int_set(&conn->rco_shmem_pools, false);
+	g_atomic_int_set(&conn->rco_peer_bulk, false);
+	g_atomic_int_set(&conn->rco_bulk_shared, false);
+#if defined(__linux__)
+	if (conn->rco_shm != NULL)
+		rpc_shmem_link_reset(conn->rco_shm);
+#endif
+	if (conn->rco_event_member != NULL) {
+		rpc_event_member_detach(conn->rco_event_member);
+		conn->rco_event_member = NULL;
+	}
+	if (conn->rco_types != NULL) {
+		rpc_msgpack_types_free(conn->rco_types);
+		conn->rco_types = rpc_msgpack_types_new();
+	}
+
+	scheme = g_uri_parse_scheme(conn->rco_uri);
+	transport = rpc_find_transport(scheme);
+	g_free(scheme);
+
+	/* Jitter keeps clients of a restarted server from coming back at once */
+	for (attempt = 0; transport != NULL && attempt < RPC_RESUME_ATTEMPTS;
+	    attempt++) {
+		g_usleep((gulong)(delay + g_random_int_range(0,
+		    (gint32)(delay / 2) + 1)));
+		delay = MIN(delay * 2, RPC_RESUME_BACKOFF_MAX);
+
+		if ((g_atomic_int_get(&conn->rco_state) & CONNECTION_CLOSED) != 0)
+			break;
+
+		if (transport->connect(conn, conn->rco_uri,
+		    conn->rco_params) == 0) {
+			connected = true;
+			break;
+		}
+
+		debugf("resume attempt %u of %p failed", attempt, conn);
+	}
+
+	g_mutex_lock(&conn->rco_mtx);
+	if (connected && (g_atomic_int_get(&conn->rco_state) &
+	    CONNECTION_CLOSED) != 0) {
+		/* Closed while we were reconnecting */
+		abort_func = conn->rco_abort;
+		conn->rco_abort = NULL;
+		g_mutex_unlock(&conn->rco_mtx);
+		if (abort_func != NULL)
+			abort_func(conn->rco_arg);
+
+		g_mutex_lock(&conn->rco_mtx);
+		connected = false;
+	}
+
+	if (!connected)
+		conn->rco_resume = false;
+	g_mutex_unlock(&conn->rco_mtx);
+
+	g_mutex_lock(&conn->rco_send_mtx);
+	rpc_output_buffer_recycle(&conn->rco_send_buf);
+	rpc_output_buffer_recycle(&conn->rco_urgent_buf);
+	conn->rco_send_failed = !connected;
+	conn->rco_resuming = false;
+	g_cond_broadcast(&conn->rco_send_cv);
+	g_mutex_unlock(&conn->rco_send_mtx);
+
+	if (!connected) {
+		g_ptr_array_foreach(calls, (GFunc)rpc_connection_call_release,
+		    NULL);
+		g_ptr_array_free(calls, true);
+		rpc_close(conn);
+		rpc_connection_release(conn);
+		return (NULL);
+	}
+
+	result = rpc_connection_call_syncp(conn, "/", RPC_SESSION_INTERFACE,
+	    "resume", "[s]", conn->rco_session);
+	if (result == NULL || rpc_get_type(result) != RPC_TYPE_BOOL ||
+	    !rpc_bool_get_value(result)) {
+		debugf("session of %p is gone, subscribing again", conn);
+		rpc_connection_resubscribe(conn);
+		rpc_connection_open_session(conn);
+	}
+
+	rpc_release(result);
+	rpc_connection_invalidate_properties(conn);
+	rpc_connection_settle_calls(conn, calls);
+	g_ptr_array_free(calls, true);
+	rpc_connection_release(conn);
+	return (NULL);
+}
+
+/*
+ * Called with rco_mtx held.
+ */
+static void
+rpc_connection_start_resume(rpc_connection_t conn)
+{
+
+	g_mutex_lock(&conn->rco_send_mtx);
+	if (conn->rco_resuming) {
+		g_mutex_unlock(&conn->rco_send_mtx);
+		return;
+	}
+
+	conn->rco_resuming = true;
+	g_mutex_unlock(&conn->rco_send_mtx);
+
+	rpc_connection_retain(conn);
+	g_thread_unref(g_thread_new("librpc resume",
+	    rpc_connection_resume_worker, conn));
+}
+
+static struct rpc_call *
+rpc_call_alloc(rpc_connection_t conn, rpc_object_t id, const char *path,
+    const char *interface, const char *method, rpc_object_t args)
+{
+	struct rpc_call *call;
+	rpc_object_t call_args;
+
+	if (method == NULL) {
+		rpc_set_last_errorf(EINVAL,
+		    "Method name not provided");
+		return (NULL);
+	}
+
+	/* retain the connection for the life of the call. */
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_errorf(EINVAL,
+		    "Connection not open.");
+		return (NULL);
+	}
+
+	if (args != NULL) {
+		if (rpc_get_type(args) != RPC_TYPE_ARRAY) {
+			rpc_set_last_errorf(EINVAL,
+			    "Method arguments must be an array");
+			rpc_connection_release(conn);
+			return (NULL);
+		}
+		call_args = rpc_retain(args);
+	} else
+		call_args = rpc_array_create();
+
+	call = rpc_call_cache_get();
+	call->rc_refcount = 1;
+	call->rc_prefetch = 1;
+	call->rc_conn = conn;
+	call->rc_context = conn->rco_rpc_context;
+	call->rc_path = g_strdup(path);
+	call->rc_interface = g_strdup(interface);
+	call->rc_method_name = g_strdup(method);
+	call->rc_args = call_args;
+	call->rc_id = id != NULL ? id : rpc_new_id(conn);
+
+	return (call);
+}
+
+static inline bool
+rpc_send_queue_full(rpc_connection_t conn)
+{
+
+	return (conn->rco_send_buf.rob_bounds != NULL &&
+	    (conn->rco_send_buf.rob_bounds->len >= RPC_SEND_BATCH_FRAMES ||
+	    conn->rco_send_buf.rob_used >= RPC_SEND_BATCH_BYTES));
+}
+
+static inline bool
+rpc_send_urgent_pending(rpc_connection_t conn)
+{
+
+	return (conn->rco_urgent_buf.rob_bounds != NULL &&
+	    conn->rco_urgent_buf.rob_bounds->len > 0);
+}
+
+/*
+ * Hands frames queued in buf over to the transport. Frames carrying
+ * descriptors start a new batch, so that the descriptors aren't
+ * delivered along with an earlier frame.
+ */
+static int
+rpc_send_batch(rpc_connection_t conn, struct rpc_output_buffer *buf)
+{
+	struct rpc_output_frame *frame;
+	struct iovec *iov;
+	size_t *frame_niov;
+	size_t niov;
+	size_t fds_start;
+	size_t nfds;
+	size_t cost;
+	guint first;
+	guint count;
+	guint nsegs;
+	guint i;
+	int *fds;
+	int ret = 0;
+
+	frame_niov = g_newa(size_t, buf->rob_bounds->len);
+
+	for (first = 0; first < buf->rob_bounds->len; first += count) {
+		fds_start = 0;
+		nsegs = 0;
+
+		if (first > 0) {
+			frame = &g_array_index(buf->rob_bounds,
+			    struct rpc_output_frame, first - 1);
+			fds_start = frame->rof_fds;
+			nsegs = frame->rof_segments;
+		}
+
+		count = 1;
+		if (conn->rco_send_batch != NULL) {
+			frame = &g_array_index(buf->rob_bounds,
+			    struct rpc_output_frame, first);
+			cost = (frame->rof_segments - nsegs) * 2 + 2;
+
+			for (i = first + 1; i < buf->rob_bounds->len; i++) {
+				frame = &g_array_index(buf->rob_bounds,
+				    struct rpc_output_frame, i);
+				cost += (frame->rof_segments - (frame - 1)->
+				    rof_segments) * 2 + 2;
+
+				if (frame->rof_fds != (frame - 1)->rof_fds ||
+				    cost > RPC_SEND_BATCH_IOV)
+					break;
+
+				count++;
+			}
+		}
+
+		frame = &g_array_index(buf->rob_bounds,
+		    struct rpc_output_frame, first + count - 1);
+		nfds = frame->rof_fds - fds_start;
+		fds = nfds > 0 ?
+		    &g_array_index(buf->rob_fds, int, fds_start) : NULL;
+
+		niov = rpc_output_buffer_get_iov(buf, first, count, &iov,
+		    frame_niov);
+
+		if (conn->rco_send_batch != NULL) {
+			ret = conn->rco_send_batch(conn->rco_arg, iov,
+			    frame_niov, count, fds, nfds);
+		} else if (conn->rco_send_msgv != NULL) {
+			ret = conn->rco_send_msgv(conn->rco_arg, iov, niov,
+			    fds, nfds);
+		} else {
+			ret = conn->rco_send_msg(conn->rco_arg,
+			    iov[0].iov_base, iov[0].iov_len, fds, nfds);
+		}
+
+		g_free(iov);
+		g_atomic_int_inc(&conn->rco_send_writes);
+
+		if (ret != 0)
+			break;
+	}
+
+	return (ret);
+}
+
+/*
+ * Appends an encoded frame to the connection's output queue. A sender
+ * finding the queue idle becomes the writer and keeps draining it until
+ * it's empty, so frames queued by other threads in the meantime go out
+ * in batches of up to RPC_SEND_BATCH_FRAMES frames or
+ * RPC_SEND_BATCH_BYTES bytes. With a flush latency set, the writer holds
+ * the first batch back for up to that long to let it fill up. A frame
+ * that's already been encoded can be passed in as encoded instead.
+ *
+ * Urgent frames go to a queue of their own, which never counts as full
+ * and is drained ahead of every batch, so a small control frame waits
+ * for at most the batch being written, not for all the bulk data queued
+ * before it.
+ */
+static int
+rpc_send_frame_queued(rpc_connection_t conn, rpc_object_t frame,
+    GBytes *encoded, bool urgent)
+{
+	struct rpc_output_buffer *buf;
+	struct rpc_output_buffer *flush;
+	gconstpointer data;
+	gint64 deadline;
+	uint64_t start;
+	size_t used;
+	guint nsegs;
+	gsize len;
+	int ret;
+
+	g_mutex_lock(&conn->rco_send_mtx);
+	while (conn->rco_resuming || (!urgent && conn->rco_send_active &&
+	    rpc_send_queue_full(conn) && !conn->rco_send_failed))
+		g_cond_wait(&conn->rco_send_cv, &conn->rco_send_mtx);
+
+	if (conn->rco_send_failed) {
+		g_mutex_unlock(&conn->rco_send_mtx);
+		rpc_release(frame);
+		return (-1);
+	}
+
+	buf = urgent ? &conn->rco_urgent_buf : &conn->rco_send_buf;
+	nsegs = buf->rob_segments != NULL ? buf->rob_segments->len : 0;
+	used = buf->rob_used;
+	start = rpc_stats_now();
+	if (encoded != NULL) {
+		data = g_bytes_get_data(encoded, &len);
+		rpc_output_buffer_append(buf, data, len);
+	} else if (rpc_msgpack_serialize_buffered(buf, frame, MAX_FDS,
+	    conn->rco_send_msgv != NULL,
+	    g_atomic_int_get(&conn->rco_packed_arrays),
+	    conn->rco_positional &&
+	    g_atomic_int_get(&conn->rco_positional_structs),
+	    conn->rco_columnar &&
+	    g_atomic_int_get(&conn->rco_columnar_arrays),
+	    g_atomic_int_get(&conn->rco_timestamps),
+	    g_atomic_int_get(&conn->rco_peer_types) ?
+	    conn->rco_types : NULL,
+	    g_atomic_int_get(&conn->rco_shmem_pools) ?
+	    conn->rco_shm : NULL) != 0) {
+		g_mutex_unlock(&conn->rco_send_mtx);
+		rpc_release(frame);
+		return (-1);
+	}
+
+	g_private_set(&rpc_sent_bytes, GSIZE_TO_POINTER(
+	    GPOINTER_TO_SIZE(g_private_get(&rpc_sent_bytes)) +
+	    buf->rob_used - used));
+	start = rpc_stats_now() - start;
+	__atomic_add_fetch(&conn->rco_stats.rcs_serialize_ns, start,
+	    __ATOMIC_RELAXED);
+	if (RPC_SPANS_ACTIVE())
+		rpc_span_serialized(start);
+
+	if (conn->rco_rpc_context != NULL) {
+		rpc_context_check_send_backlog(conn,
+		    conn->rco_send_buf.rob_used +
+		    conn->rco_flush_buf.rob_used);
+	}
+
+	__atomic_add_fetch(&conn->rco_stats.rcs_frames_out, 1,
+	    __ATOMIC_RELAXED);
+	__atomic_add_fetch(&conn->rco_stats.rcs_bytes_out,
+	    buf->rob_used - used, __ATOMIC_RELAXED);
+
+	if (RPC_TRACING()) {
+		rpc_trace_frame(conn, RPC_TRACE_SEND, frame,
+		    buf->rob_data + used, buf->rob_used - used);
+	}
+
+	/*
+	 * Large binaries are sent from where they are, so the frame
+	 * has to stay alive until the transport is done with it.
+	 */
+	if (buf->rob_segments != NULL && buf->rob_segments->len > nsegs) {
+		g_ptr_array_add(buf->rob_objects, frame);
+		frame = NULL;
+	}
+
+	if (conn->rco_send_active) {
+		/* The writer will pick it up */
+		g_cond_broadcast(&conn->rco_send_cv);
+		g_mutex_unlock(&conn->rco_send_mtx);
+		if (frame != NULL)
+			rpc_release(frame);
+
+		return (0);
+	}
+
+	conn->rco_send_active = true;
+
+	if (conn->rco_flush_latency > 0 && !urgent) {
+		deadline = g_get_monotonic_time() +
+		    (gint64)conn->rco_flush_latency;
+
+		while (!rpc_send_queue_full(conn) &&
+		    !rpc_send_urgent_pending(conn)) {
+			if (!g_cond_wait_until(&conn->rco_send_cv,
+			    &conn->rco_send_mtx, deadline))
+				break;
+		}
+	}
+
+	/*
+	 * Frames that were just sent end up back in the queue they came
+	 * from, where they're recycled, while the ones queued meanwhile
+	 * are flushed next, urgent ones first. Once the transport has
+	 * failed, whatever is left queued is dropped.
+	 */
+	for (;;) {
+		if (rpc_send_urgent_pending(conn)) {
+			buf = &conn->rco_urgent_buf;
+			flush = &conn->rco_urgent_flush_buf;
+		} else {
+			buf = &conn->rco_send_buf;
+			flush = &conn->rco_flush_buf;
+		}
+
+		rpc_output_buffer_swap(buf, flush);
+		rpc_output_buffer_recycle(buf);
+
+		if (flush->rob_bounds == NULL || flush->rob_bounds->len == 0)
+			break;
+
+		if (conn->rco_send_failed)
+			continue;
+
+		/* There's room in the queue again */
+		g_cond_broadcast(&conn->rco_send_cv);
+		g_mutex_unlock(&conn->rco_send_mtx);
+		ret = rpc_send_batch(conn, flush);
+		g_mutex_lock(&conn->rco_send_mtx);
+
+		if (ret != 0)
+			conn->rco_send_failed = true;
+	}
+
+	rpc_output_buffer_recycle(&conn->rco_urgent_flush_buf);
+
+	ret = conn->rco_send_failed ? -1 : 0;
+	conn->rco_send_active = false;
+	g_cond_broadcast(&conn->rco_send_cv);
+	g_mutex_unlock(&conn->rco_send_mtx);
+
+	if (frame != NULL)
+		rpc_release(frame);
+
+	return (ret);
+}
+
+static int
+rpc_send_frame(rpc_connection_t conn, rpc_object_t frame)
+{
+
+	return (rpc_send_frame_prio(conn, frame, false));
+}
+
+/*
+ * For responses and flow control frames, which nothing else of their
+ * call can still be queued ahead of. They skip past bulk data.
+ */
+static int
+rpc_send_frame_urgent(rpc_connection_t conn, rpc_object_t frame)
+{
+
+	return (rpc_send_frame_prio(conn, frame, true));
+}
+
+/*
+ * Returns a copy of the frame with our capabilities added, so that a
+ * frame shared with other connections or kept by the caller isn't
+ * modified. Consumes the frame.
+ */
+static rpc_object_t
+rpc_frame_advertise(rpc_connection_t conn, rpc_object_t frame)
+{
+	rpc_object_t result = rpc_dictionary_create();
+
+	rpc_dictionary_walk(frame, ^(const char *key, rpc_object_t value) {
+		rpc_dictionary_set_value(result, key, value);
+		return ((bool)true);
+	});
+	rpc_release(frame);
+
+	rpc_dictionary_set_bool(result, "compact_ids", true);
+	rpc_dictionary_set_bool(result, "compact_ops", true);
+	rpc_dictionary_set_bool(result, "packed_arrays", true);
+	if (conn->rco_positional)
+		rpc_dictionary_set_bool(result, "positional_structs", true);
+
+	if (conn->rco_columnar)
+		rpc_dictionary_set_bool(result, "columnar_arrays", true);
+
+	if (conn->rco_types != NULL)
+		rpc_dictionary_set_bool(result, "type_table", true);
+
+	rpc_dictionary_set_bool(result, "call_batch", true);
+	rpc_dictionary_set_bool(result, "fragment_batch", true);
+	rpc_dictionary_set_bool(result, "timestamps", true);
+	rpc_dictionary_set_bool(result, "chunked_results", true);
+	if (conn->rco_shm != NULL &&
+	    (conn->rco_flags & RPC_TRANSPORT_FD_PASSING) != 0) {
+		rpc_dictionary_set_bool(result, "shmem_pools", true);
+		rpc_dictionary_set_bool(result, "bulk_data", true);
+	}
+
+	if (conn->rco_server != NULL &&
+	    conn->rco_server->rs_event_group != NULL) {
+		rpc_dictionary_set_string(result, "event_group",
+		    rpc_event_group_name(conn->rco_server->rs_event_group));
+		rpc_dictionary_set_uint64(result, "event_group_id",
+		    rpc_event_group_id(conn->rco_server->rs_event_group));
+	}
+
+	return (result);
+}
+
+static int
+rpc_send_frame_prio(rpc_connection_t conn, rpc_object_t frame, bool urgent)
+{
+	void *buf = frame;
+	int fds[MAX_FDS];
+	rpc_object_t tmp;
+	size_t len = 0, nfds = 0;
+	int ret;
+
+	/*
+	 * Advertise compact call IDs, opcodes, packed arrays and, when
+	 * enabled locally, positional structs, columnar arrays and type
+	 * tables until the peer has advertised them too, and then once
+	 * more, so that it learns we've switched. A peer whose first frame
+	 * came without them is a legacy one and never will, so we stop
+	 * right there.
+	 */
+	if (g_atomic_int_get(&conn->rco_compact_ids) ?
+	    g_atomic_int_compare_and_exchange(&conn->rco_compact_acked, false,
+	    true) : !g_atomic_int_get(&conn->rco_peer_legacy))
+		frame = rpc_frame_advertise(conn, frame);
+
+	/*
+	 * Serializing transports get the typing wrappers written directly
+	 * into the msgpack stream, without an intermediate typed copy.
+	 */
+	if ((conn->rco_flags & (RPC_TRANSPORT_NO_SERIALIZE |
+	    RPC_TRANSPORT_NO_RPCT_SERIALIZE)) == 0) {
+		return (rpc_send_frame_queued(conn, frame, NULL, urgent));
+	}
+
+	/*
+	 * In-process transports get the typed frame itself. There's
+	 * nothing to serialize, descriptors are valid as they are and the
+	 * transport orders concurrent sends on its own, so the send lock
+	 * isn't needed either. The receiver gets a copy-on-write copy, so
+	 * either side can modify what it holds without the other one
+	 * seeing it, as if the frame had gone through a serializer.
+	 */
+	if (conn->rco_flags & RPC_TRANSPORT_NO_RPCT_SERIALIZE) {
+		if (RPC_TRACING())
+			rpc_trace_frame(conn, RPC_TRACE_SEND, frame, NULL, 0);
+
+		__atomic_add_fetch(&conn->rco_stats.rcs_frames_out, 1,
+		    __ATOMIC_RELAXED);
+		tmp = rpc_copy(frame);
+		rpc_release(frame);
+		ret = conn->rco_send_msg(conn->rco_arg, tmp, 0, NULL, 0);
+		rpc_release(tmp);
+		return (ret);
+	}
+
+	tmp = rpct_serialize(frame);
+	rpc_release(frame);
+	frame = tmp;
+	buf = tmp;
+
+	if (RPC_TRACING())
+		rpc_trace_frame(conn, RPC_TRACE_SEND, frame, NULL, 0);
+
+	__atomic_add_fetch(&conn->rco_stats.rcs_frames_out, 1,
+	    __ATOMIC_RELAXED);
+	g_mutex_lock(&conn->rco_send_mtx);
+	nfds = rpc_serialize_fds(frame, fds, NULL, 0);
+
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0) {
+		if (rpc_msgpack_serialize(frame, &buf, &len) != 0) {
+			g_mutex_unlock(&conn->rco_send_mtx);
+			rpc_release(frame);
+			return (-1);
+		}
+	}
+
+	ret = conn->rco_send_msg(conn->rco_arg, buf, len, fds, nfds);
+	rpc_release(frame);
+
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0)
+		free(buf);
+
+	g_mutex_unlock(&conn->rco_send_mtx);
+	return (ret);
+}
+
+static struct rpc_subscription *
+rpc_connection_find_subscription(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
+{
+	struct rpc_subscription key = {
+		.rsu_path = (char *)path,
+		.rsu_interface = (char *)interface,
+		.rsu_name = (char *)name
+	};
+
+	return (g_hash_table_lookup(conn->rco_subscriptions, &key));
+}
+
+/*
+ * Finds the subscription an event belongs to: the one for its exact
+ * path, or else the first one whose glob path matches it. Called with
+ * rco_subscription_rwlock held.
+ */
+static struct rpc_subscription *
+rpc_connection_match_subscription(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
+{
+	struct rpc_subscription *sub;
+	GHashTableIter iter;
+
+	sub = rpc_connection_find_subscription(conn, path, interface, name);
+	if (sub != NULL || path == NULL ||
+	    g_atomic_int_get(&conn->rco_subscription_patterns) == 0)
+		return (sub);
+
+	g_hash_table_iter_init(&iter, conn->rco_subscriptions);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&sub, NULL)) {
+		if (!sub->rsu_pattern ||
+		    g_strcmp0(sub->rsu_interface, interface) != 0 ||
+		    g_strcmp0(sub->rsu_name, name) != 0)
+			continue;
+
+		if (g_pattern_match_simple(sub->rsu_path, path))
+			return (sub);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Whether the peer wants an event, going by the rules of every
+ * subscription it matches. Sets @p subscribed if there was any such
+ * subscription at all. Called with rco_subscription_rwlock held.
+ */
+static bool
+rpc_connection_event_wanted_locked(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    bool *subscribed)
+{
+	struct rpc_subscription *sub;
+	GHashTableIter iter;
+
+	*subscribed = false;
+	sub = rpc_connection_find_subscription(conn, path, interface, name);
+	if (sub != NULL) {
+		*subscribed = true;
+		if (rpc_subscription_accepts(sub, args))
+			return (true);
+	}
+
+	if (path == NULL ||
+	    g_atomic_int_get(&conn->rco_subscription_patterns) == 0)
+		return (false);
+
+	g_hash_table_iter_init(&iter, conn->rco_subscriptions);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&sub, NULL)) {
+		if (!sub->rsu_pattern ||
+		    g_strcmp0(sub->rsu_interface, interface) != 0 ||
+		    g_strcmp0(sub->rsu_name, name) != 0 ||
+		    !g_pattern_match_simple(sub->rsu_path, path))
+			continue;
+
+		*subscribed = true;
+		if (rpc_subscription_accepts(sub, args))
+			return (true);
+	}
+
+	return (false);
+}
+
+guint
+rpc_subscription_hash(gconstpointer key)
+{
+	const struct rpc_subscription *sub = key;
+	guint hash = 0;
+
+	if (sub->rsu_path != NULL)
+		hash = g_str_hash(sub->rsu_path);
+
+	if (sub->rsu_interface != NULL)
+		hash = hash * 31 + g_str_hash(sub->rsu_interface);
+
+	if (sub->rsu_name != NULL)
+		hash = hash * 31 + g_str_hash(sub->rsu_name);
+
+	return (hash);
+}
+
+gboolean
+rpc_subscription_equal(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_subscription *sa = a;
+	const struct rpc_subscription *sb = b;
+
+	return (g_strcmp0(sa->rsu_path, sb->rsu_path) == 0 &&
+	    g_strcmp0(sa->rsu_interface, sb->rsu_interface) == 0 &&
+	    g_strcmp0(sa->rsu_name, sb->rsu_name) == 0);
+}
+
+static bool
+rpc_connection_sends_error_stacks(rpc_connection_t conn)
+{
+	rpc_context_t context = conn->rco_rpc_context;
+
+	return (context != NULL && context->rcx_error_stacks_send);
+}
+
+void
+rpc_connection_send_err(rpc_connection_t conn, rpc_object_t id, int code,
+    const char *descr, ...)
+{
+	rpc_object_t err;
+	va_list ap;
+	char *str;
+
+	va_start(ap, descr);
+	g_vasprintf(&str, descr, ap);
+	va_end(ap);
+
+	/* Don't walk the stack for something that won't be sent */
+	if (rpc_connection_sends_error_stacks(conn))
+		err = rpc_error_create(code, str, NULL);
+	else
+		err = rpc_error_create_nostack(code, str, NULL);
+
+	rpc_connection_send_errx(conn, id, err);
+	g_free(str);
+}
+
+static int
+rpc_call_wait_locked(rpc_call_t call)
+{
+	int ret = 0;
+
+	while (call->rc_queue.rcq_len == 0) {
+		g_mutex_unlock(&call->rc_mtx);
+		ret = notify_wait(&call->rc_notify);
+		if (ret < 0 && errno == EINTR) {
+			rpc_set_last_errorf(EINTR, "Interrupted by signal");
+			g_mutex_lock(&call->rc_mtx);
+			return (-1);
+		}
+
+		g_mutex_lock(&call->rc_mtx);
+	}
+
+	return (ret);
+}
+
+static GSourceFuncs rpc_timer_source_funcs = {
+	.dispatch = rpc_timer_dispatch
+};
+
+static uint64_t
+rpc_timer_now(struct rpc_timer_wheel *wheel)
+{
+
+	return ((uint64_t)((g_get_monotonic_time() - wheel->rtw_start) / 1000));
+}
+
+/*
+ * Puts a timer in the slot covering its expiry time, at the lowest level
+ * whose range reaches it. Timers never go before the @p floor tick, so
+ * that nothing lands in a slot which has already been processed.
+ */
+static void
+rpc_timer_link(struct rpc_timer_wheel *wheel, struct rpc_timer *timer,
+    uint64_t floor)
+{
+	struct rpc_timer **slot;
+	uint64_t span = 1ULL << (RPC_TIMER_BITS * RPC_TIMER_LEVELS);
+	uint64_t expires;
+	uint64_t delta;
+	int level;
+
+	expires = MAX(timer->rt_expires, floor);
+	delta = expires - wheel->rtw_now;
+
+	for (level = 0; level < RPC_TIMER_LEVELS - 1; level++) {
+		if (delta < (1ULL << (RPC_TIMER_BITS * (level + 1))))
+			break;
+	}
+
+	/* Beyond the range of the wheel; it gets another round at the top */
+	if (delta >= span)
+		expires = wheel->rtw_now + span - 1;
+
+	slot = &wheel->rtw_slots[level][(expires >> (RPC_TIMER_BITS * level)) &
+	    (RPC_TIMER_SLOTS - 1)];
+	timer->rt_next = *slot;
+	timer->rt_pprev = slot;
+	if (*slot != NULL)
+		(*slot)->rt_pprev = &timer->rt_next;
+
+	*slot = timer;
+}
+
+static void
+rpc_timer_unlink(struct rpc_timer_wheel *wheel, struct rpc_timer *timer)
+{
+
+	*timer->rt_pprev = timer->rt_next;
+	if (timer->rt_next != NULL)
+		timer->rt_next->rt_pprev = timer->rt_pprev;
+
+	timer->rt_next = NULL;
+	timer->rt_pprev = NULL;
+	wheel->rtw_count--;
+}
+
+/*
+ * Wakes the wheel up at the next tick with timers due, or at the next
+ * time a higher level slot has to be moved down, whichever comes first.
+ */
+static void
+rpc_timer_schedule(struct rpc_timer_wheel *wheel)
+{
+	uint64_t tick;
+
+	for (tick = wheel->rtw_now + 1;; tick++) {
+		if ((tick & (RPC_TIMER_SLOTS - 1)) == 0)
+			break;
+
+		if (wheel->rtw_slots[0][tick & (RPC_TIMER_SLOTS - 1)] != NULL)
+			break;
+	}
+
+	wheel->rtw_wake = tick;
+	g_source_set_ready_time(wheel->rtw_source,
+	    wheel->rtw_start + (gint64)tick * 1000);
+}
+
+static gboolean
+rpc_timer_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+
+	g_source_set_ready_time(source, -1);
+	return (callback(user_data));
+}
+
+static gboolean
+rpc_timer_tick(gpointer user_data)
+{
+	rpc_connection_t conn = user_data;
+	struct rpc_timer_wheel *wheel = &conn->rco_timers;
+	struct rpc_timer *timer;
+	struct rpc_timer *next;
+	GSList *expired = NULL;
+	GSList *item;
+	uint64_t target;
+	gboolean ret = true;
+	guint idx;
+	int level;
+
+	g_mutex_lock(&wheel->rtw_mtx);
+	target = rpc_timer_now(wheel);
+
+	while (wheel->rtw_count > 0 && wheel->rtw_now < target) {
+		wheel->rtw_now++;
+
+		for (level = 1; level < RPC_TIMER_LEVELS; level++) {
+			if (wheel->rtw_now &
+			    ((1ULL << (RPC_TIMER_BITS * level)) - 1))
+				break;
+
+			idx = (wheel->rtw_now >> (RPC_TIMER_BITS * level)) &
+			    (RPC_TIMER_SLOTS - 1);
+			timer = wheel->rtw_slots[level][idx];
+			wheel->rtw_slots[level][idx] = NULL;
+
+			for (; timer != NULL; timer = next) {
+				next = timer->rt_next;
+				rpc_timer_link(wheel, timer, wheel->rtw_now);
+			}
+		}
+
+		idx = wheel->rtw_now & (RPC_TIMER_SLOTS - 1);
+		while ((timer = wheel->rtw_slots[0][idx]) != NULL) {
+			rpc_timer_unlink(wheel, timer);
+			expired = g_slist_prepend(expired, (char *)timer -
+			    offsetof(struct rpc_call, rc_timer));
+			rpc_connection_call_retain(expired->data);
+		}
+	}
+
+	if (wheel->rtw_count == 0) {
+		/* Nothing left; the next timer armed brings a new source */
+		wheel->rtw_now = MAX(wheel->rtw_now, target);
+		wheel->rtw_source = NULL;
+		ret = false;
+	} else
+		rpc_timer_schedule(wheel);
+
+	g_mutex_unlock(&wheel->rtw_mtx);
+
+	for (item = expired; item != NULL; item = item->next) {
+		rpc_call_expire(item->data);
+		rpc_connection_call_release(item->data);
+	}
+
+	g_slist_free(expired);
+	return (ret);
+}
+
+static void
+rpc_call_arm_timeout_locked(rpc_call_t call, uint64_t msecs)
+{
+
+	rpc_call_arm_timer(call, msecs);
+	call->rc_timer_armed = true;
+}
+
+static void
+rpc_call_arm_timer(rpc_call_t call, uint64_t msecs)
+{
+	rpc_connection_t conn = call->rc_conn;
+	struct rpc_timer_wheel *wheel = &conn->rco_timers;
+	uint64_t now;
+
+	g_mutex_lock(&wheel->rtw_mtx);
+	if (call->rc_timer.rt_pprev != NULL)
+		rpc_timer_unlink(wheel, &call->rc_timer);
+
+	now = rpc_timer_now(wheel);
+	if (wheel->rtw_count == 0)
+		wheel->rtw_now = MAX(wheel->rtw_now, now);
+
+	if (wheel->rtw_source == NULL) {
+		wheel->rtw_source = g_source_new(&rpc_timer_source_funcs,
+		    sizeof(GSource));
+		wheel->rtw_wake = UINT64_MAX;
+		rpc_connection_retain(conn);
+		g_source_set_callback(wheel->rtw_source, rpc_timer_tick, conn,
+		    (GDestroyNotify)rpc_connection_release);
+		g_source_attach(wheel->rtw_source,
+		    rpc_connection_get_main_context(conn));
+		g_source_unref(wheel->rtw_source);
+	}
+
+	call->rc_timer.rt_expires = now + msecs;
+	rpc_timer_link(wheel, &call->rc_timer, wheel->rtw_now + 1);
+	wheel->rtw_count++;
+
+	if (call->rc_timer.rt_expires < wheel->rtw_wake) {
+		wheel->rtw_wake = MAX(call->rc_timer.rt_expires,
+		    wheel->rtw_now + 1);
+		g_source_set_ready_time(wheel->rtw_source,
+		    wheel->rtw_start + (gint64)wheel->rtw_wake * 1000);
+	}
+
+	g_mutex_unlock(&wheel->rtw_mtx);
+}
+
+static void
+rpc_call_expire(rpc_call_t call)
+{
+	struct rpc_timer_wheel *wheel = &call->rc_conn->rco_timers;
+	struct queue_item *q_item;
+	bool rearmed;
+
+	/* Inbound calls only use the timer to bound fragment batch latency */
+	if (call->rc_type == RPC_INBOUND_CALL) {
+		rpc_connection_flush_fragments(call);
+		return;
+	}
+
+	g_mutex_lock(&call->rc_mtx);
+	g_mutex_lock(&wheel->rtw_mtx);
+	rearmed = call->rc_timer.rt_pprev != NULL;
+	g_mutex_unlock(&wheel->rtw_mtx);
+
+	/* make sure when we get the lock someone hasn't already handled this */
+	if (!call->rc_timer_armed || call->rc_timedout || rearmed) {
+		g_mutex_unlock(&call->rc_mtx);
+		return;
+	}
+
+	if (call->rc_callback != NULL && call->rc_conn->rco_cq == NULL)
+		rpc_run_call_callback(call->rc_conn, call);
+
+	call->rc_timedout = true;
+	if (call->rc_span.rsc_valid)
+		rpc_span_outbound_done(call, true);
+
+	q_item = rpc_call_queue_push(call);
+	q_item->status = RPC_CALL_ERROR;
+	q_item->item = rpc_error_create(ETIMEDOUT, "Call timed out", NULL);
+
+	notify_signal(&call->rc_notify);
+	rpc_call_post_completion(call->rc_conn, call);
+	g_mutex_unlock(&call->rc_mtx);
+}
+
+void
+rpc_connection_send_errx(rpc_connection_t conn, rpc_object_t id __unused,
+    rpc_object_t err)
+{
+	rpc_object_t frame;
+	rpc_object_t wire;
+
+	rpc_conn_stats_error(&conn->rco_stats, true, rpc_error_get_code(err));
+
+	/* Stack traces only go out when the context asks for it */
+	if (!rpc_connection_sends_error_stacks(conn)) {
+		wire = rpc_error_strip_stack(err);
+		rpc_release(err);
+		err = wire;
+	}
+
+	frame = rpc_pack_frame(conn, RPC_OP_ERROR, id, err);
+	rpc_send_frame(conn, frame);
+}
+
+void
+rpc_connection_send_response(rpc_connection_t conn, rpc_object_t id,
+    rpc_object_t response)
+{
+	rpc_object_t frame;
+
+	if (response == NULL)
+		response = rpc_null_create();
+
+	frame = rpc_pack_frame(conn, RPC_OP_RESPONSE, id, response);
+	rpc_send_frame_urgent(conn, frame);
+}
+
+/*
+ * Digest of the encoded object. Equal objects may encode differently,
+ * dictionaries in another key order, which only costs a resend.
+ */
+static char *
+rpc_etag_compute(rpc_object_t object)
+{
+	void *buf;
+	size_t len;
+	char *etag;
+
+	if (rpc_msgpack_serialize(object, &buf, &len) != 0)
+		return (NULL);
+
+	etag = g_compute_checksum_for_data(G_CHECKSUM_SHA256, buf, len);
+	g_free(buf);
+	return (etag);
+}
+
+/*
+ * Responds to a conditional call. The tag is the version the method
+ * declared or, failing that, a digest of the response; if the caller
+ * has it already, the response itself isn't sent.
+ */
+void
+rpc_connection_send_tagged_response(struct rpc_call *call,
+    rpc_object_t response)
+{
+	rpc_connection_t conn = call->rc_conn;
+	rpc_object_t frame;
+	rpc_object_t args;
+	char *etag;
+
+	if (response == NULL)
+		response = rpc_null_create();
+
+	etag = call->rc_new_etag != NULL ? g_strdup(call->rc_new_etag) :
+	    rpc_etag_compute(response);
+	if (etag == NULL) {
+		rpc_connection_send_response(conn, call->rc_id, response);
+		return;
+	}
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_string(args, "etag", etag);
+	if (g_strcmp0(etag, call->rc_etag) == 0)
+		rpc_release(response);
+	else
+		rpc_dictionary_steal_value(args, "value", response);
+
+	frame = rpc_pack_frame(conn, RPC_OP_TAGGED_RESPONSE, call->rc_id, args);
+	rpc_send_frame_urgent(conn, frame);
+	g_free(etag);
+}
+
+void
+rpc_connection_send_start_stream(rpc_connection_t conn, rpc_object_t id,
+    int64_t seqno, bool chunked)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", seqno);
+	if (chunked)
+		rpc_dictionary_set_bool(args, "chunked", true);
+
+	frame = rpc_pack_frame(conn, RPC_OP_START_STREAM, id, args);
+	rpc_send_frame(conn, frame);
+}
+
+void
+rpc_connection_send_fragment(rpc_connection_t conn, rpc_object_t id,
+    int64_t seqno, rpc_object_t fragment)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", seqno);
+	rpc_dictionary_steal_value(args, "fragment", fragment);
+	frame = rpc_pack_frame(conn, RPC_OP_FRAGMENT, id, args);
+	rpc_send_frame(conn, frame);
+}
+
+/*
+ * Fragments of a stream are held back while the producer keeps yielding,
+ * provided the peer understands rpc.fragments, and go out together once
+ * there are RPC_FRAGMENT_BATCH of them, once the consumer window is used
+ * up, or RPC_FRAGMENT_LATENCY after the first one, whichever is first.
+ * A pending batch holds a reference to its call. Slices of a chunked
+ * result are large enough to go out on their own.
+ */
+void
+rpc_connection_queue_fragment(struct rpc_call *call, int64_t seqno,
+    rpc_object_t fragment, bool flush)
+{
+	rpc_connection_t conn = call->rc_conn;
+
+	if (!g_atomic_int_get(&conn->rco_fragment_batch) || call->rc_chunked) {
+		rpc_connection_send_fragment(conn, call->rc_id, seqno,
+		    fragment);
+		return;
+	}
+
+	g_mutex_lock(&call->rc_batch_mtx);
+	if (call->rc_batch == NULL) {
+		rpc_connection_call_retain(call);
+		call->rc_batch = rpc_array_create();
+		call->rc_batch_seqno = seqno;
+		rpc_call_arm_timer(call, RPC_FRAGMENT_LATENCY);
+	}
+
+	rpc_array_append_stolen_value(call->rc_batch, fragment);
+	if (flush || rpc_array_get_count(call->rc_batch) >= RPC_FRAGMENT_BATCH)
+		rpc_call_flush_fragments_locked(call);
+
+	g_mutex_unlock(&call->rc_batch_mtx);
+}
+
+void
+rpc_connection_flush_fragments(struct rpc_call *call)
+{
+
+	g_mutex_lock(&call->rc_batch_mtx);
+	rpc_call_flush_fragments_locked(call);
+	g_mutex_unlock(&call->rc_batch_mtx);
+}
+
+static void
+rpc_call_flush_fragments_locked(rpc_call_t call)
+{
+	struct rpc_timer_wheel *wheel = &call->rc_conn->rco_timers;
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	if (call->rc_batch == NULL)
+		return;
+
+	g_mutex_lock(&wheel->rtw_mtx);
+	if (call->rc_timer.rt_pprev != NULL)
+		rpc_timer_unlink(wheel, &call->rc_timer);
+	g_mutex_unlock(&wheel->rtw_mtx);
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", call->rc_batch_seqno);
+	rpc_dictionary_steal_value(args, "fragments", call->rc_batch);
+	frame = rpc_pack_frame(call->rc_conn, RPC_OP_FRAGMENTS, call->rc_id,
+	    args);
+	rpc_send_frame(call->rc_conn, frame);
+
+	/* The caller holds a reference of its own */
+	call->rc_batch = NULL;
+	rpc_connection_call_release(call);
+}
+
+void
+rpc_connection_send_upload_continue(rpc_connection_t conn, rpc_object_t id,
+    int64_t increment)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "increment", increment);
+	frame = rpc_pack_frame(conn, RPC_OP_UPLOAD_CONTINUE, id, args);
+	rpc_send_frame_urgent(conn, frame);
+}
+
+void
+rpc_connection_send_end(rpc_connection_t conn, rpc_object_t id, int64_t seqno)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", seqno);
+	frame = rpc_pack_frame(conn, RPC_OP_END, id, args);
+	rpc_send_frame(conn, frame);
+}
+
+int
+rpc_connection_call_retain(struct rpc_call *call)
+{
+
+	g_assert(call->rc_refcount > 0);
+	g_mutex_lock(&call->rc_ref_mtx);
+	if (call->rc_refcount < 1) {
+		g_mutex_unlock(&call->rc_ref_mtx);
+		return (-1);
+	}
+
+	++call->rc_refcount;
+
+	g_mutex_unlock(&call->rc_ref_mtx);
+	return (0);
+}
+
+int
+rpc_connection_call_release(struct rpc_call *call)
+{
+	rpc_connection_t conn;
+
+	g_assert(call->rc_refcount > 0);
+	g_mutex_lock(&call->rc_ref_mtx);
+
+	if (call->rc_refcount > 1) {
+		call->rc_refcount--;
+		g_mutex_unlock(&call->rc_ref_mtx);
+		return (0);
+	} else if (call->rc_refcount < 1) {
+		g_mutex_unlock(&call->rc_ref_mtx);
+		return (-1);
+	}
+
+	call->rc_refcount = -1;
+	g_mutex_unlock(&call->rc_ref_mtx);
+
+	if (call->rc_callback != NULL)
+		Block_release(call->rc_callback);
+
+	if (call->rc_instance != NULL)
+		rpc_instance_release(call->rc_instance);
+
+	rpc_release(call->rc_err);
+	rpc_release(call->rc_id);
+	rpc_release(call->rc_args);
+	g_free(call->rc_path);
+	g_free(call->rc_interface);
+	g_free(call->rc_method_name);
+
+	if (call->rc_input != NULL)
+		g_queue_free_full(call->rc_input,
+		    (GDestroyNotify)rpc_release_impl);
+
+	while (!g_queue_is_empty(&call->rc_outbuf))
+		rpc_release(g_queue_pop_head(&call->rc_outbuf));
+
+	if (call->rc_ready_handler != NULL)
+		Block_release(call->rc_ready_handler);
+
+	if (call->rc_query != NULL)
+		rpc_query_pushdown_free(call->rc_query);
+
+	g_free(call->rc_etag);
+	g_free(call->rc_new_etag);
+
+	/* Fragments nobody consumed still count against the conn */
+	while (call->rc_queue.rcq_len > 0)
+		rpc_call_queue_pop(call);
+
+	g_free(call->rc_queue.rcq_items);
+
+	if (call->rc_type == RPC_INBOUND_CALL)
+		rpc_mem_uncharge(call->rc_conn, RPC_MEM_CALLS,
+		    call->rc_bytes_in);
+
+	g_free(call->rc_span.rsc_tracestate);
+	g_free(call->rc_span.rsc_traceparent);
+
+	conn = call->rc_conn;
+	rpc_object_cache_free(&rpc_call_cache, call);
+
+	rpc_connection_release(conn); /*drop the call's ref */
+	return (0);
+}
+
+bool
+rpc_call_deadline_passed(struct rpc_call *call)
+{
+
+	if (call->rc_deadline == 0)
+		return (false);
+
+	return (g_get_monotonic_time() >= call->rc_deadline);
+}
+
+void
+rpc_connection_close_inbound_call(struct rpc_call *call)
+{
+	rpc_connection_t conn = call->rc_conn;
+
+	rpc_connection_retain(conn);
+
+	g_rw_lock_writer_lock(&conn->rco_icall_rwlock);
+
+	if (!g_hash_table_remove(conn->rco_inbound_calls, call->rc_id)) {
+		g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
+		rpc_connection_release(conn);
+		return;
+	}
+
+	g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
+
+	if (call->rc_admitted)
+		g_atomic_int_add(&conn->rco_server->rs_pending, -1);
+
+	call->rc_bytes_out += rpc_connection_take_sent_bytes();
+	if (call->rc_span.rsc_valid)
+		rpc_span_inbound_done(call);
+
+	rpc_context_account_call(call);
+
+	rpc_connection_call_release(call);
+	rpc_connection_release(conn);
+}
+
+uint64_t
+rpc_connection_take_sent_bytes(void)
+{
+	uint64_t result;
+
+	result = GPOINTER_TO_SIZE(g_private_get(&rpc_sent_bytes));
+	g_private_set(&rpc_sent_bytes, NULL);
+	return (result);
+}
+
+/*
+ * Once the peer is known to accept them, call IDs are taken from a
+ * per-connection counter. Legacy peers keep getting v4 UUID strings.
+ */
+static rpc_object_t
+rpc_new_id(rpc_connection_t conn)
+{
+	char *str;
+	rpc_object_t ret;
+
+	if (g_atomic_int_get(&conn->rco_compact_ids)) {
+		return (rpc_uint64_create(__atomic_add_fetch(
+		    &conn->rco_next_id, 1, __ATOMIC_RELAXED)));
+	}
+
+	str = rpc_generate_v4_uuid();
+	ret = rpc_string_create(str);
+	g_free(str);
+	return (ret);
+}
+
+static guint
+rpc_call_id_hash(gconstpointer key)
+{
+	rpc_object_t id = (rpc_object_t)key;
+
+	switch (rpc_get_type(id)) {
+	case RPC_TYPE_UINT64:
+		return (g_int64_hash(&id->ro_value.rv_ui));
+
+	case RPC_TYPE_STRING:
+		return (g_str_hash(rpc_string_get_string_ptr(id)));
+
+	default:
+		return (0);
+	}
+}
+
+static gboolean
+rpc_call_id_equal(gconstpointer a, gconstpointer b)
+{
+	rpc_object_t id1 = (rpc_object_t)a;
+	rpc_object_t id2 = (rpc_object_t)b;
+
+	if (rpc_get_type(id1) != rpc_get_type(id2))
+		return (false);
+
+	switch (rpc_get_type(id1)) {
+	case RPC_TYPE_UINT64:
+		return (id1->ro_value.rv_ui == id2->ro_value.rv_ui);
+
+	case RPC_TYPE_STRING:
+		return (g_strcmp0(rpc_string_get_string_ptr(id1),
+		    rpc_string_get_string_ptr(id2)) == 0);
+
+	default:
+		return (id1 == id2);
+	}
+}
+
+/*
+ * Sequential IDs hash to themselves, so consecutive calls land in
+ * consecutive shards.
+ */
+static struct rpc_call_shard *
+rpc_call_shard(rpc_connection_t conn, rpc_object_t id)
+{
+
+	return (&conn->rco_call_shards[rpc_call_id_hash(id) &
+	    (RPC_CALL_SHARDS - 1)]);
+}
+
+/*
+ * Calls come out of a per-thread cache with their locks and notifier
+ * still initialized from the last time around; everything else starts
+ * out zeroed.
+ */
+static struct rpc_call *
+rpc_call_cache_get(void)
+{
+	struct rpc_call *call;
+	struct notify notify;
+	GMutex mtx;
+	GMutex ref_mtx;
+	GMutex batch_mtx;
+	bool cached;
+
+	call = rpc_object_cache_alloc(&rpc_call_cache, &cached);
+	if (!cached) {
+		g_mutex_init(&call->rc_mtx);
+		g_mutex_init(&call->rc_ref_mtx);
+		g_mutex_init(&call->rc_batch_mtx);
+		notify_init(&call->rc_notify);
+		return (call);
+	}
+
+	notify = call->rc_notify;
+	mtx = call->rc_mtx;
+	ref_mtx = call->rc_ref_mtx;
+	batch_mtx = call->rc_batch_mtx;
+	memset(call, 0, sizeof(*call));
+	call->rc_notify = notify;
+	call->rc_mtx = mtx;
+	call->rc_ref_mtx = ref_mtx;
+	call->rc_batch_mtx = batch_mtx;
+	return (call);
+}
+
+static void
+rpc_call_destroy(gpointer data)
+{
+	struct rpc_call *call = data;
+
+	notify_free(&call->rc_notify);
+	g_mutex_clear(&call->rc_mtx);
+	g_mutex_clear(&call->rc_ref_mtx);
+	g_mutex_clear(&call->rc_batch_mtx);
+}
+
+static void
+rpc_connection_set_default_fn_handlers(rpc_connection_t conn)
+{
+
+	conn->rco_fn_cbs.rcf_fn_respond = rpc_function_respond_impl;
+	conn->rco_fn_cbs.rcf_fn_error = rpc_function_error_impl;
+	conn->rco_fn_cbs.rcf_fn_error_ex = rpc_function_error_ex_impl;
+	conn->rco_fn_cbs.rcf_fn_start_stream = rpc_function_start_stream_impl;
+	conn->rco_fn_cbs.rcf_fn_yield = rpc_function_yield_impl;
+	conn->rco_fn_cbs.rcf_fn_end = rpc_function_end_impl;
+	conn->rco_fn_cbs.rcf_fn_kill = rpc_function_kill_impl;
+	conn->rco_fn_cbs.rcf_should_abort = rpc_function_should_abort_impl;
+	conn->rco_fn_cbs.rcf_set_async_abort_handler =
+	    rpc_function_set_async_abort_handler_impl;
+}
+
+static struct rpc_connection_bucket *
+rpc_connection_bucket(rpc_connection_t conn)
+{
+
+	return (&rpc_connection_buckets[((uintptr_t)conn / sizeof(*conn)) %
+	    RPC_CONNECTION_BUCKETS]);
+}
+
+static void
+rpc_connection_activate(rpc_connection_t conn)
+{
+	struct rpc_connection_bucket *bucket = rpc_connection_bucket(conn);
+
+	g_rw_lock_writer_lock(&bucket->rcb_lock);
+	if (bucket->rcb_conns == NULL)
+		bucket->rcb_conns = g_hash_table_new(NULL, NULL);
+
+	if (!g_hash_table_add(bucket->rcb_conns, conn))
+		g_assert_not_reached();
+	g_rw_lock_writer_unlock(&bucket->rcb_lock);
+}
+
+static void
+rpc_connection_deactivate(rpc_connection_t conn)
+{
+	struct rpc_connection_bucket *bucket = rpc_connection_bucket(conn);
+
+	g_rw_lock_writer_lock(&bucket->rcb_lock);
+	if (!g_hash_table_remove(bucket->rcb_conns, conn))
+		g_assert_not_reached();
+	g_rw_lock_writer_unlock(&bucket->rcb_lock);
+}
+
+static rpc_connection_t
+rpc_connection_init(int flags)
+{
+	struct rpc_connection *conn = g_malloc0(sizeof(*conn));
+	guint i;
+
+	rpc_trace_init();
+	rpc_lockprof_init();
+	rpc_conn_stats_init(&conn->rco_stats);
+	g_mutex_init(&conn->rco_mem.rma_mtx);
+	g_cond_init(&conn->rco_mem.rma_cv);
+	g_mutex_init(&conn->rco_mtx);
+	g_mutex_init(&conn->rco_ref_mtx);
+	g_mutex_init(&conn->rco_send_mtx);
+	g_mutex_init(&conn->rco_batch_mtx);
+	g_mutex_init(&conn->rco_evq_mtx);
+	g_mutex_init(&conn->rco_prop_mtx);
+	g_cond_init(&conn->rco_send_cv);
+	g_rw_lock_init(&conn->rco_subscription_rwlock);
+	g_rw_lock_init(&conn->rco_icall_rwlock);
+
+	for (i = 0; i < RPC_CALL_SHARDS; i++) {
+		g_rw_lock_init(&conn->rco_call_shards[i].rcs_lock);
+		conn->rco_call_shards[i].rcs_calls = g_hash_table_new(
+		    rpc_call_id_hash, rpc_call_id_equal);
+	}
+
+	conn->rco_inbound_calls = g_hash_table_new(rpc_call_id_hash,
+	    rpc_call_id_equal);
+	conn->rco_subscriptions = g_hash_table_new_full(rpc_subscription_hash,
+	    rpc_subscription_equal, NULL,
+	    (GDestroyNotify)rpc_subscription_release);
+	conn->rco_rpc_timeout = DEFAULT_RPC_TIMEOUT;
+	conn->rco_chunk_threshold = RPC_CHUNK_THRESHOLD;
+	conn->rco_timers.rtw_start = g_get_monotonic_time();
+	g_mutex_init(&conn->rco_timers.rtw_mtx);
+	conn->rco_recv_msg = rpc_recv_msg;
+	conn->rco_recv_owned = rpc_recv_msg_owned;
+	conn->rco_close = rpc_close;
+#if defined(__linux__)
+	conn->rco_shm = rpc_shmem_link_new(conn);
+#endif
+
+	conn->rco_flags = flags;
+	if (rpc_connection_supports_credentials(conn))
+		conn->rco_set_creds = rpc_set_creds;
+
+	g_atomic_int_set(&conn->rco_refcnt, 1);
+	conn->rco_arg = conn;
+	rpc_connection_set_default_fn_handlers(conn);
+
+	return(conn);
+}
+
+rpc_connection_t
+rpc_connection_alloc(rpc_server_t server)
+{
+	struct rpc_connection *conn = NULL;
+
+	conn = rpc_connection_init(server->rs_flags);
+
+	conn->rco_uri = server->rs_uri;
+	conn->rco_server = server;
+	conn->rco_main_context = rpc_server_get_main_context(server);
+
+	conn->rco_callback_queue = rpc_executor_queue_create(conn);
+	rpc_connection_activate(conn);
+
+	return (conn);
+}
+
+rpc_connection_t
+rpc_connection_create(void *cookie, rpc_object_t params)
+{
+	struct rpc_client *client = cookie;
+
+	return (rpc_connection_create_uri(cookie, client->rci_uri, params));
+}
+
+/*
+ * Like rpc_connection_create(), but for one of the endpoints of a
+ * multi-endpoint client. @p uri has to live as long as the client.
+ */
+rpc_connection_t
+rpc_connection_create_uri(void *cookie, const char *uri, rpc_object_t params)
+{
+	const struct rpc_transport *transport;
+	struct rpc_connection *conn = NULL;
+	struct rpc_client *client = cookie;
+	char *scheme = NULL;
+
+	scheme = g_uri_parse_scheme(uri);
+	transport = rpc_find_transport(scheme);
+	g_free(scheme);
+
+	if (transport == NULL) {
+		rpc_set_last_error(ENXIO, "Transport not found", NULL);
+		return (NULL);
+	}
+
+	conn = rpc_connection_init(transport->flags);
+
+	conn->rco_client = client;
+	conn->rco_params = params;
+	conn->rco_uri = uri;
+	conn->rco_main_context = client->rci_g_context;
+
+	conn->rco_callback_queue = rpc_executor_queue_create(conn);
+	rpc_connection_set_default_fn_handlers(conn);
+
+	/*
+	 * Resuming needs a transport that can connect again on its own
+	 * and frames that go through our send queue.
+	 */
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY &&
+	    (transport->flags & (RPC_TRANSPORT_NO_SERIALIZE |
+	    RPC_TRANSPORT_NO_RPCT_SERIALIZE)) == 0 &&
+	    !rpc_dictionary_has_key(params, "fd")) {
+		rpc_object_unpack(params, "{resume:b,replay:b,event_group:b}",
+		    &conn->rco_resume, &conn->rco_replay,
+		    &conn->rco_event_group);
+		conn->rco_replay = conn->rco_replay && conn->rco_resume;
+	}
+
+	if (transport->connect(conn, conn->rco_uri, params) != 0)
+		goto fail;
+
+	if (conn->rco_flags & RPC_TRANSPORT_FD_PASSING)
+		conn->rco_supports_fd_passing = transport->is_fd_passing(conn);
+
+	rpc_connection_activate(conn);
+
+	/*
+	 * Servers that don't know about sessions simply get us a
+	 * connection that closes the usual way.
+	 */
+	if (conn->rco_resume && rpc_connection_open_session(conn) != 0) {
+		debugf("server doesn't support sessions, not resuming %p",
+		    conn);
+		conn->rco_resume = false;
+		conn->rco_replay = false;
+	}
+
+	return (conn);
+fail:
+	if (conn != NULL)
+		rpc_connection_free_resources(conn);
+	return (NULL);
+}
+
+/*
+ * Main context to attach the connection's sources to. The client's is
+ * fetched on demand, as that starts its thread.
+ */
+GMainContext *
+rpc_connection_get_main_context(rpc_connection_t conn)
+{
+
+	if (conn->rco_client != NULL)
+		return (rpc_client_get_main_context(conn->rco_client));
+
+	return (conn->rco_main_context);
+}
+
+int
+rpc_connection_register_context(rpc_connection_t conn, rpc_context_t ctx)
+{
+
+	if (rpc_connection_retain_if_valid(conn, true) == 0) {
+		g_mutex_lock(&conn->rco_mtx);
+		conn->rco_rpc_context = ctx;
+		g_mutex_unlock(&conn->rco_mtx);
+		rpc_connection_release(conn);
+		return (0);
+	}
+	return (-1);
+}
+
+int rpc_connection_get_subscription_count(rpc_connection_t conn)
+{
+
+	return (
+	    rpc_connection_is_open(conn) ?
+	    (int)g_hash_table_size(conn->rco_subscriptions) : -1);
+}
+
+static void
+rpc_connection_free_resources(rpc_connection_t conn)
+{
+	struct rpc_call_shard *shard;
+	guint i;
+
+	g_assert_cmpint(g_hash_table_size(conn->rco_inbound_calls), ==, 0);
+	if (conn->rco_event_member != NULL)
+		rpc_event_member_detach(conn->rco_event_member);
+
+	for (i = 0; i < RPC_CALL_SHARDS; i++) {
+		shard = &conn->rco_call_shards[i];
+		g_assert_cmpint(g_hash_table_size(shard->rcs_calls), ==, 0);
+		g_hash_table_destroy(shard->rcs_calls);
+		g_rw_lock_clear(&shard->rcs_lock);
+	}
+
+	g_hash_table_destroy(conn->rco_inbound_calls);
+
+	if (conn->rco_subscriptions != NULL)
+		g_hash_table_destroy(conn->rco_subscriptions);
+
+	if (conn->rco_callback_queue != NULL) {
+		rpc_executor_queue_destroy(conn->rco_callback_queue);
+		conn->rco_callback_queue = NULL;
+	}
+
+	rpc_release(conn->rco_error);
+	rpc_msgpack_types_free(conn->rco_types);
+#if defined(__linux__)
+	/* Lazy frames may hold on to it, but the peer is gone for good */
+	if (conn->rco_shm != NULL)
+		rpc_shmem_link_reset(conn->rco_shm);
+
+	rpc_shmem_link_release(conn->rco_shm);
+#endif
+	rpc_output_buffer_free(&conn->rco_send_buf);
+	rpc_output_buffer_free(&conn->rco_flush_buf);
+	rpc_output_buffer_free(&conn->rco_urgent_buf);
+	rpc_output_buffer_free(&conn->rco_urgent_flush_buf);
+	rpc_conn_stats_destroy(&conn->rco_stats);
+	rpc_release(conn->rco_batch);
+	g_mutex_clear(&conn->rco_batch_mtx);
+	g_queue_foreach(&conn->rco_evq, (GFunc)rpc_shared_event_release, NULL);
+	g_queue_clear(&conn->rco_evq);
+	g_mutex_clear(&conn->rco_evq_mtx);
+	if (conn->rco_prop_cache != NULL) {
+		g_hash_table_destroy(conn->rco_prop_cache);
+		g_hash_table_destroy(conn->rco_prop_watches);
+	}
+	if (conn->rco_idempotent != NULL)
+		g_hash_table_destroy(conn->rco_idempotent);
+	g_mutex_clear(&conn->rco_prop_mtx);
+	g_mutex_clear(&conn->rco_mem.rma_mtx);
+	g_cond_clear(&conn->rco_mem.rma_cv);
+	g_free(conn->rco_endpoint_address);
+	g_free(conn->rco_session);
+	g_rw_lock_clear(&conn->rco_icall_rwlock);
+	g_rw_lock_clear(&conn->rco_subscription_rwlock);
+	g_mutex_clear(&conn->rco_timers.rtw_mtx);
+
+	/* Calls hold the connection, so the flow has none of them left */
+	g_free(conn->rco_fair_flow);
+	conn->rco_fair_flow = NULL;
+}
+
+int
+rpc_connection_close(rpc_connection_t conn)
+{
+
+	return (rpc_connection_do_close(conn, RPC_CLOSE_CALLED));
+}
+
+int
+rpc_connection_do_close(rpc_connection_t conn, rpc_close_source_t source)
+{
+	rpc_abort_fn_t abort_func;
+	uint state;
+
+	debugf("%s state: %d conn: %p refcnt: %d  arg: %p, source: %d",
+	    conn->rco_server ? "Server" : "Client",
+	    conn->rco_state, conn, conn->rco_refcnt,
+	    conn->rco_arg, source);
+
+	g_mutex_lock(&conn->rco_mtx);
+	if (source == RPC_CLOSE_CALLED)
+		g_atomic_int_or(&conn->rco_state, CONNECTION_CLOSED);
+
+	/* rco_state will only be modified under rco_mtx */
+	state = g_atomic_int_get(&conn->rco_state);
+
+	if ((conn->rco_abort != NULL) &&
+	    (state & CONNECTION_ABORTED) == 0) {
+		abort_func = conn->rco_abort;
+		conn->rco_abort = NULL;
+		g_mutex_unlock(&conn->rco_mtx);
+
+		rpc_connection_retain(conn);
+		abort_func(conn->rco_arg);
+		rpc_connection_release(conn);
+		return (0);
+	}
+	if ((state & CONNECTION_RELEASED) != 0)
+		goto done;
+
+	if (conn->rco_client != NULL) {
+		if ((state & CONNECTION_CLOSED) == 0)
+			goto done;
+
+		g_atomic_int_or(&conn->rco_state, CONNECTION_RELEASED);
+		g_mutex_unlock(&conn->rco_mtx);
+
+	} else if (conn->rco_server != NULL) {
+		g_atomic_int_inc(&conn->rco_server->rs_conn_closed);
+		g_atomic_int_or(&conn->rco_state, CONNECTION_RELEASED);
+		g_mutex_unlock(&conn->rco_mtx);
+
+		/* if server isn't closed this will undo server's ref */
+		rpc_server_disconnect(conn->rco_server, conn);
+	}
+	/* undo connection's initial reference */
+	rpc_connection_release(conn);
+	return (0);
+done:
+	g_mutex_unlock(&conn->rco_mtx);
+	return (0);
+}
+
+bool
+rpc_connection_is_valid(rpc_connection_t conn)
+{
+	struct rpc_connection_bucket *bucket;
+	bool ret;
+
+	/* Use this when waiting for a conn to become invalid */
+	if (conn == NULL)
+		return (false);
+
+	bucket = rpc_connection_bucket(conn);
+	g_rw_lock_reader_lock(&bucket->rcb_lock);
+	ret = bucket->rcb_conns != NULL &&
+	    g_hash_table_contains(bucket->rcb_conns, conn);
+	g_rw_lock_reader_unlock(&bucket->rcb_lock);
+
+	return (ret);
+}
+
+bool
+rpc_connection_is_open(rpc_connection_t conn)
+{
+
+	/* conn if non-null must be valid */
+	return (conn != NULL &&
+	    (g_atomic_int_get(&conn->rco_state) == CONNECTION_OPEN));
+}
+
+int
+rpc_connection_retain(rpc_connection_t conn)
+{
+
+	/* conn if non-null is expected to be valid */
+	if (conn == NULL)
+		return (-1);
+
+	g_atomic_int_inc(&conn->rco_refcnt);
+	g_assert(conn->rco_refcnt > 1);
+
+	return (0);
+}
+
+int
+rpc_connection_release(rpc_connection_t conn)
+{
+
+	/* conn if non-null is expected to be valid */
+	if (conn == NULL)
+		return (-1);
+
+	g_assert(conn->rco_refcnt > 0);
+	if (g_atomic_int_dec_and_test(&conn->rco_refcnt)) {
+
+		g_assert((g_atomic_int_get(&conn->rco_state) &
+		    CONNECTION_CLOSED) != 0);
+
+		/*
+		 * Nobody can retain it anymore, since
+		 * rpc_connection_retain_if_valid() never brings the count
+		 * back up from zero.
+		 */
+		rpc_connection_deactivate(conn);
+
+		if (conn->rco_release && conn->rco_arg) {
+			conn->rco_release(conn->rco_arg);
+			conn->rco_arg = NULL;
+		}
+
+		if (conn->rco_stale_transports != NULL)
+			g_ptr_array_free(conn->rco_stale_transports, true);
+
+		if (conn->rco_server != NULL && conn->rco_rpc_context != NULL) {
+			rpc_context_detach_session(conn->rco_rpc_context,
+			    conn);
+			rpc_connection_drop_event_watchers(conn);
+		}
+
+		rpc_connection_free_resources(conn);
+
+		debugf("%s in thread %p freed %p",
+		    conn->rco_server ? "Server" : "Client",
+		    g_thread_self(), conn);
+
+		g_atomic_int_set(&conn->rco_refcnt, -1);
+
+		if (conn->rco_server != NULL) {
+			/* undo connection's ref on server */
+			rpc_server_release(conn->rco_server);
+		}
+		g_free(conn);
+	}
+
+	return (0);
+}
+
+int
+rpc_connection_get_fd(rpc_connection_t conn)
+{
+
+	return (conn->rco_get_fd(conn->rco_arg));
+}
+
+void
+rpc_connection_free(rpc_connection_t conn)
+{
+
+
+}
+
+int
+rpc_connection_set_completion_queue(rpc_connection_t conn,
+    rpc_completion_queue_t cq)
+{
+
+	if (conn->rco_cq != NULL) {
+		rpc_set_last_errorf(EBUSY, "Completion queue already set");
+		return (-1);
+	}
+
+	conn->rco_cq = cq;
+	return (0);
+}
+
+#ifdef ENABLE_LIBDISPATCH
+int
+rpc_connection_set_dispatch_queue(rpc_connection_t conn, dispatch_queue_t queue)
+{
+
+	if (conn->rco_callback_queue == NULL)
+		return (-1);
+
+	conn->rco_dispatch_queue = queue;
+	return (0);
+}
+#endif
+
+/*
+ * Joins the event group the server announced. Failing to is no reason
+ * to fail the connection, events keep coming in over it as usual.
+ */
+static void
+rpc_connection_join_event_group(rpc_connection_t conn, rpc_object_t frame)
+{
+	struct rpc_event_member *member;
+
+	member = rpc_event_member_create(conn,
+	    rpc_dictionary_get_string(frame, "event_group"),
+	    rpc_dictionary_get_uint64(frame, "event_group_id"));
+	if (member == NULL) {
+		debugf("cannot join event group: %s",
+		    rpc_error_get_message(rpc_get_last_error()));
+		return;
+	}
+
+	conn->rco_event_member = member;
+	rpc_send_frame(conn, rpc_pack_frame(conn, RPC_OP_EVENT_JOIN, NULL,
+	    rpc_null_create()));
+}
+
+void
+rpc_connection_dispatch(rpc_connection_t conn, rpc_object_t frame)
+{
+	rpc_object_t id;
+	rpc_object_t op;
+	rpc_object_t args;
+	const struct message_handler *h = NULL;
+	const char *namespace;
+	const char *name;
+	guint i;
+
+	/* Must be called with the connection retained */
+	id = rpc_dictionary_get_value(frame, "id");
+	if (id == NULL) {
+		rpc_connection_send_err(conn, id, EINVAL, "Malformed request");
+		return;
+	}
+
+	/*
+	 * Peers that know about compact frames advertise them from their
+	 * very first frame on, so one that didn't never will.
+	 */
+	if (!g_atomic_int_get(&conn->rco_compact_ids) &&
+	    !rpc_dictionary_get_bool(frame, "compact_ids"))
+		g_atomic_int_set(&conn->rco_peer_legacy, true);
+
+	if (!g_atomic_int_get(&conn->rco_compact_ids) &&
+	    rpc_dictionary_get_bool(frame, "compact_ids")) {
+		if (rpc_dictionary_get_bool(frame, "compact_ops"))
+			g_atomic_int_set(&conn->rco_compact_ops, true);
+
+		if (rpc_dictionary_get_bool(frame, "packed_arrays"))
+			g_atomic_int_set(&conn->rco_packed_arrays, true);
+
+		if (rpc_dictionary_get_bool(frame, "positional_structs"))
+			g_atomic_int_set(&conn->rco_positional_structs, true);
+
+		if (rpc_dictionary_get_bool(frame, "columnar_arrays"))
+			g_atomic_int_set(&conn->rco_columnar_arrays, true);
+
+		if (rpc_dictionary_get_bool(frame, "type_table"))
+			g_atomic_int_set(&conn->rco_peer_types, true);
+
+		if (rpc_dictionary_get_bool(frame, "call_batch"))
+			g_atomic_int_set(&conn->rco_call_batch, true);
+
+		if (rpc_dictionary_get_bool(frame, "fragment_batch"))
+			g_atomic_int_set(&conn->rco_fragment_batch, true);
+
+		if (rpc_dictionary_get_bool(frame, "timestamps"))
+			g_atomic_int_set(&conn->rco_timestamps, true);
+
+		if (rpc_dictionary_get_bool(frame, "chunked_results"))
+			g_atomic_int_set(&conn->rco_chunked_results, true);
+
+		if (rpc_dictionary_get_bool(frame, "shmem_pools") &&
+		    conn->rco_shm != NULL &&
+		    (conn->rco_flags & RPC_TRANSPORT_FD_PASSING) != 0) {
+			g_atomic_int_set(&conn->rco_shmem_pools, true);
+#if defined(__linux__)
+			if (rpc_dictionary_get_bool(frame, "bulk_data")) {
+				g_atomic_int_set(&conn->rco_peer_bulk, true);
+				rpc_connection_share_bulk_pool(conn);
+			}
+#endif
+		}
+
+		if (conn->rco_client != NULL && conn->rco_event_group &&
+		    conn->rco_event_member == NULL &&
+		    rpc_dictionary_get_string(frame, "event_group") != NULL)
+			rpc_connection_join_event_group(conn, frame);
+
+		g_atomic_int_set(&conn->rco_compact_ids, true);
+	}
+
+	/* Compact frames carry an opcode instead of namespace and name */
+	op = rpc_dictionary_get_value(frame, "op");
+	if (op != NULL) {
+		if (rpc_get_type(op) == RPC_TYPE_UINT64 &&
+		    rpc_uint64_get_value(op) < RPC_OP_MAX)
+			h = &handlers[rpc_uint64_get_value(op)];
+	} else {
+		namespace = rpc_dictionary_get_string(frame, "namespace");
+		name = rpc_dictionary_get_string(frame, "name");
+
+		if (namespace == NULL || name == NULL) {
+			rpc_connection_send_err(conn, id, EINVAL,
+			    "Malformed request");
+			return;
+		}
+
+		for (i = 0; i < RPC_OP_MAX; i++) {
+			if (g_strcmp0(namespace, handlers[i].namespace))
+				continue;
+
+			if (g_strcmp0(name, handlers[i].name))
+				continue;
+
+			h = &handlers[i];
+			break;
+		}
+	}
+
+	if (h == NULL) {
+		rpc_connection_send_err(conn, id, ENXIO,
+		    "No request handler found");
+		rpc_release(frame);
+		return;
+	}
+
+	debugf("inbound frame: namespace=%s, name=%s", h->namespace, h->name);
+
+	args = rpc_dictionary_get_value(frame, "args");
+	h->handler(conn, args, id);
+	rpc_release(frame);
+}
+
+/*
+ * Describes a subscription the way events.subscribe and unsubscribe
+ * take it.
+ */
+static rpc_object_t
+rpc_subscription_entry(struct rpc_subscription *sub)
+{
+	rpc_object_t entry;
+
+	entry = rpc_object_pack("{s,s,s}",
+	    "path", sub->rsu_path,
+	    "interface", sub->rsu_interface,
+	    "name", sub->rsu_name);
+
+	if (sub->rsu_rules != NULL)
+		rpc_dictionary_set_value(entry, "rules", sub->rsu_rules);
+
+	return (entry);
+}
+
+static struct rpc_subscription *
+rpc_connection_subscribe_event_locked(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t rules,
+    bool check_busy)
+{
+	struct rpc_subscription *sub;
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	sub = rpc_connection_find_subscription(conn, path, interface, name);
+	if (sub == NULL) {
+		sub = g_malloc0(sizeof(*sub));
+		sub->rsu_path = g_strdup(path);
+		sub->rsu_interface = g_strdup(interface);
+		sub->rsu_name = g_strdup(name);
+		sub->rsu_pattern = rpc_subscription_is_pattern(path);
+		sub->rsu_rules = rules != NULL ? rpc_copy(rules) : NULL;
+		sub->rsu_handlers = g_ptr_array_new_with_free_func((GDestroyNotify)rpc_rsh_release);
+		args = rpc_array_create();
+		rpc_array_append_stolen_value(args,
+		    rpc_subscription_entry(sub));
+
+		frame = rpc_pack_frame(conn, RPC_OP_SUBSCRIBE, NULL, args);
+
+		if (rpc_send_frame(conn, frame) != 0) {
+			rpc_subscription_release(sub);
+			return (NULL);
+		}
+		sub->rsu_refcount = 1;
+		g_hash_table_add(conn->rco_subscriptions, sub);
+		if (sub->rsu_pattern)
+			g_atomic_int_inc(&conn->rco_subscription_patterns);
+	} else {
+		if (!check_busy || !sub->rsu_busy)
+			sub->rsu_refcount++;
+	}
+	return (sub);
+}
+
+int
+rpc_connection_subscribe_event(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
+{
+
+	return (rpc_connection_subscribe_event_filtered(conn, path, interface,
+	    name, NULL));
+}
+
+int
+rpc_connection_subscribe_event_filtered(rpc_connection_t conn,
+    const char *path, const char *interface, const char *name,
+    rpc_object_t rules)
+{
+	struct rpc_subscription *sub;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	if (rules != NULL && rpc_get_type(rules) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Rules have to be an array", NULL);
+		rpc_connection_release(conn);
+		return (-1);
+	}
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+
+	/* The server only knows the rules the first subscriber asked for */
+	sub = rpc_connection_find_subscription(conn, path, interface, name);
+	if (sub != NULL && rules != NULL && !rpc_equal(rules, sub->rsu_rules)) {
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		rpc_set_last_error(EEXIST,
+		    "Subscribed to the event with different rules", NULL);
+		rpc_connection_release(conn);
+		return (-1);
+	}
+
+	sub = rpc_connection_subscribe_event_locked(conn, path, interface,
+	    name, rules, false);
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	if (sub == NULL)
+		rpc_set_last_error(EFAULT, "Unknown error", NULL);
+
+	rpc_connection_release(conn);
+	return (sub == NULL) ? -1 : 0;
+}
+
+int
+rpc_connection_unsubscribe_event(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
+{
+	struct rpc_subscription *sub;
+	int ret = 0;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	sub = rpc_connection_find_subscription(conn, path, interface, name);
+	if (sub == NULL) {
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		rpc_set_last_error(ENOENT, "Subscription not found", NULL);
+		rpc_connection_release(conn);
+		return (-1);
+	}
+	ret = rpc_connection_unsubscribe_event_locked(conn, sub);
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	rpc_connection_release(conn);
+	return (ret);
+}
+
+static int
+rpc_connection_unsubscribe_event_locked(rpc_connection_t conn,
+    struct rpc_subscription *sub)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+	int ret = 0;
+
+	/* Called with the connection retained and the subscription locked  */
+
+	sub->rsu_refcount--;
+	if (sub->rsu_refcount > 0)
+		return (0);
+
+	args = rpc_array_create();
+	rpc_array_append_stolen_value(args, rpc_subscription_entry(sub));
+
+	frame = rpc_pack_frame(conn, RPC_OP_UNSUBSCRIBE, NULL, args);
+	ret = rpc_send_frame(conn, frame);
+
+	if (sub->rsu_pattern)
+		g_atomic_int_add(&conn->rco_subscription_patterns, -1);
+
+	g_hash_table_remove(conn->rco_subscriptions, sub);
+
+	return (ret);
+}
+
+int
+rpc_connection_retain_if_valid(rpc_connection_t conn, bool open)
+{
+	struct rpc_connection_bucket *bucket;
+	int refcnt;
+
+	if (conn == NULL)
+		return (-1);
+
+	bucket = rpc_connection_bucket(conn);
+	g_rw_lock_reader_lock(&bucket->rcb_lock);
+	if (bucket->rcb_conns == NULL ||
+	    !g_hash_table_contains(bucket->rcb_conns, conn)) {
+		g_rw_lock_reader_unlock(&bucket->rcb_lock);
+		return (-1);
+	}
+
+	/* Only take a reference on a connection that still has one */
+	do {
+		refcnt = g_atomic_int_get(&conn->rco_refcnt);
+		if (refcnt <= 0) {
+			g_rw_lock_reader_unlock(&bucket->rcb_lock);
+			return (-1);
+		}
+	} while (!g_atomic_int_compare_and_exchange(&conn->rco_refcnt, refcnt,
+	    refcnt + 1));
+	g_rw_lock_reader_unlock(&bucket->rcb_lock);
+
+	/* Unless the conn mutex is held, state may change after this check */
+	if (open && g_atomic_int_get(&conn->rco_state) != CONNECTION_OPEN) {
+		rpc_connection_release(conn);
+		return (-1);
+	}
+
+	return (0);
+}
+
+void *
+rpc_connection_register_event_handler(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_handler_t handler)
+{
+	struct rpc_subscription *sub;
+	struct rpc_subscription_handler *rsh = NULL;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (NULL);
+	}
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+
+	sub = rpc_connection_subscribe_event_locked(conn, path, interface,
+	    name, NULL, true);
+	if (sub == NULL) {
+		/* Couldn't inform server, error has been set */
+		goto done;
+	}
+	if (sub->rsu_busy) {
+		/* no state changes were made, tell caller to retry */
+		rpc_set_last_error(EBUSY, "Subscription locked, retry", NULL);
+		goto done;
+	}
+	rsh = g_malloc0(sizeof(*rsh));
+	rsh->rsh_parent = sub;
+	rsh->rsh_handler = Block_copy(handler);
+	g_ptr_array_add(sub->rsu_handlers, rsh);
+done:
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	rpc_connection_release(conn);
+
+	return (rsh);
+}
+
+int
+rpc_connection_unregister_event_handler(rpc_connection_t conn, void *cookie)
+{
+	struct rpc_subscription_handler *rsh = cookie;
+	struct rpc_subscription *sub;
+	int ret = 0;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	sub = rsh->rsh_parent;
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	if (sub->rsu_busy) {
+		ret = -1;
+		rpc_set_last_error(EBUSY, "Subscription locked, retry", NULL);
+		goto done;
+	}
+	if (g_ptr_array_remove(sub->rsu_handlers, rsh))
+		rpc_connection_unsubscribe_event_locked(conn, sub);
+
+done:
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	rpc_connection_release(conn);
+	return ret;
+}
+
+rpc_object_t
+rpc_connection_call_syncv(rpc_connection_t conn, const char *path,
+    const char *interface, const char *method, va_list ap)
+{
+	rpc_object_t args;
+	rpc_object_t i;
+
+	args = rpc_array_create();
+
+	for (;;) {
+		i = va_arg(ap, rpc_object_t);
+		if (i == NULL)
+			break;
+
+		rpc_array_append_stolen_value(args, i);
+	}
+
+	return (rpc_connection_call_sync_impl(conn, path, interface, method,
+	    args));
+}
+
+/*
+ * Synchronous calls don't go through the timer wheel: the calling thread
+ * is blocked on the call anyway, so it waits for the response with the
+ * deadline itself, and the reader thread wakes it up directly.
+ */
+rpc_object_t
+rpc_connection_call_sync_impl(rpc_connection_t conn, const char *path,
+    const char *interface, const char *method, rpc_object_t args)
+{
+	struct queue_item *q_item;
+	struct timespec ts;
+	rpc_call_t call;
+	rpc_object_t payload;
+	rpc_object_t frame;
+	rpc_object_t result;
+	gint64 deadline;
+	gint64 remaining;
+
+	call = rpc_connection_call_prepare(conn, path, interface, method, args,
+	    NULL, true, &payload);
+	if (call == NULL)
+		return (NULL);
+
+	frame = rpc_pack_frame(conn, RPC_OP_CALL, call->rc_id, payload);
+	if (rpc_send_frame(conn, frame) != 0) {
+		rpc_call_free(call);
+		return (NULL);
+	}
+
+	deadline = g_get_monotonic_time() +
+	    (gint64)conn->rco_rpc_timeout * 1000;
+	g_mutex_lock(&call->rc_mtx);
+	while (call->rc_queue.rcq_len == 0) {
+		remaining = deadline - g_get_monotonic_time();
+		if (remaining <= 0) {
+			q_item = rpc_call_queue_push(call);
+			q_item->status = RPC_CALL_ERROR;
+			q_item->item = rpc_error_create(ETIMEDOUT,
+			    "Call timed out", NULL);
+			break;
+		}
+
+		ts.tv_sec = remaining / G_USEC_PER_SEC;
+		ts.tv_nsec = (remaining % G_USEC_PER_SEC) * 1000;
+		g_mutex_unlock(&call->rc_mtx);
+		notify_timedwait(&call->rc_notify, &ts);
+		g_mutex_lock(&call->rc_mtx);
+	}
+
+	q_item = rpc_call_queue_peek(call, 0);
+	result = rpc_retain(q_item->item);
+	g_mutex_unlock(&call->rc_mtx);
+
+	rpc_call_free(call);
+	return (result);
+}
+
+rpc_object_t
+rpc_connection_call_sync(rpc_connection_t conn, const char *path,
+    const char *interface, const char *method, ...)
+{
+	rpc_object_t result;
+	va_list ap;
+
+	va_start(ap, method);
+	result = rpc_connection_call_syncv(conn, path, interface, method, ap);
+	va_end(ap);
+
+	return (result);
+}
+
+rpc_object_t
+rpc_connection_call_syncp(rpc_connection_t conn, const char *path,
+    const char *interface, const char *method, const char *fmt, ...)
+{
+	rpc_object_t result;
+	va_list ap;
+
+	va_start(ap, fmt);
+	result = rpc_connection_call_syncpv(conn, path, interface, method, fmt, ap);
+	va_end(ap);
+
+	return (result);
+}
+
+rpc_object_t rpc_connection_call_syncpv(rpc_connection_t conn,
+    const char *path, const char *interface, const char *method,
+    const char *fmt, va_list ap)
+{
+	rpc_auto_object_t args = NULL;
+
+	args = rpc_object_vpack(fmt, ap);
+	return (rpc_connection_call_sync_impl(conn, path, interface, method,
+	    args));
+}
+
+rpc_object_t
+rpc_connection_call_simple(rpc_connection_t conn, const char *name,
+    const char *fmt, ...)
+{
+	va_list ap;
+	rpc_object_t result;
+
+	va_start(ap, fmt);
+	result = rpc_connection_call_syncpv(conn, NULL, NULL, name, fmt, ap);
+	va_end(ap);
+
+	return (result);
+}
+
+/*
+ * Builds the payload of the rpc.call frame of an outbound call; also
+ * used to send it again after the connection resumed.
+ */
+static rpc_object_t
+rpc_call_payload(rpc_connection_t conn, struct rpc_call *call)
+{
+	rpc_object_t payload;
+
+	payload = rpc_dictionary_create();
+
+	if (call->rc_path != NULL)
+		rpc_dictionary_set_string(payload, "path", call->rc_path);
+
+	if (call->rc_interface != NULL) {
+		rpc_dictionary_set_string(payload, "interface",
+		    call->rc_interface);
+	}
+
+	rpc_dictionary_set_string(payload, "method", call->rc_method_name);
+	rpc_dictionary_set_value(payload, "args", call->rc_args);
+
+	/*
+	 * The timeout travels relative to the time of sending, so the
+	 * server can drop the call once we've given up waiting for it.
+	 */
+	rpc_dictionary_set_uint64(payload, "timeout", conn->rco_rpc_timeout);
+
+	if (call->rc_conditional) {
+		rpc_dictionary_set_string(payload, "etag",
+		    call->rc_etag != NULL ? call->rc_etag : "");
+	}
+
+	if (call->rc_span.rsc_valid) {
+		rpc_dictionary_set_string(payload, "traceparent",
+		    rpc_span_traceparent(&call->rc_span));
+		if (call->rc_span.rsc_tracestate != NULL) {
+			rpc_dictionary_set_string(payload, "tracestate",
+			    call->rc_span.rsc_tracestate);
+		}
+	}
+
+	return (payload);
+}
+
+/*
+ * Sets up an outbound call, with its timeout armed, and builds the
+ * payload of its rpc.call frame. The frame is left for the caller to
+ * send. Synchronous calls keep track of their deadline themselves.
+ */
+static struct rpc_call *
+rpc_connection_call_prepare(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    rpc_callback_t callback, bool sync, rpc_object_t *payloadp)
+{
+	struct rpc_call_shard *shard;
+	struct rpc_call *call;
+
+	call = rpc_call_alloc(conn, NULL, path, interface, name, args);
+	if (call == NULL)
+		return (NULL);
+
+	call->rc_type = RPC_OUTBOUND_CALL;
+	if (RPC_SPANS_ACTIVE())
+		rpc_span_outbound(call);
+
+	call->rc_callback = callback != NULL ? Block_copy(callback) : NULL;
+	call->rc_sync = sync;
+	call->rc_replay = conn->rco_replay;
+	call->rc_idempotent = rpc_connection_is_idempotent(conn, interface,
+	    name);
+
+	g_mutex_lock(&call->rc_mtx);
+	shard = rpc_call_shard(conn, call->rc_id);
+	g_rw_lock_writer_lock(&shard->rcs_lock);
+	g_hash_table_insert(shard->rcs_calls, call->rc_id, call);
+	g_rw_lock_writer_unlock(&shard->rcs_lock);
+
+	if (!sync)
+		rpc_call_arm_timeout_locked(call, conn->rco_rpc_timeout);
+
+	g_mutex_unlock(&call->rc_mtx);
+
+	*payloadp = rpc_call_payload(conn, call);
+	return (call);
+}
+
+rpc_call_t
+rpc_connection_call(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    rpc_callback_t callback)
+{
+	struct rpc_call *call;
+	rpc_object_t payload;
+	rpc_object_t frame;
+
+	call = rpc_connection_call_prepare(conn, path, interface, name, args,
+	    callback, false, &payload);
+	if (call == NULL)
+		return (NULL);
+
+	frame = rpc_pack_frame(conn, RPC_OP_CALL, call->rc_id, payload);
+	if (rpc_send_frame(conn, frame) != 0) {
+		rpc_call_free(call);
+		return (NULL);
+	}
+
+	return (call);
+}
+
+rpc_call_t
+rpc_connection_call_upload(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    rpc_callback_t callback)
+{
+	struct rpc_call *call;
+	rpc_object_t payload;
+	rpc_object_t frame;
+
+	call = rpc_connection_call_prepare(conn, path, interface, name, args,
+	    callback, false, &payload);
+	if (call == NULL)
+		return (NULL);
+
+	call->rc_upload = true;
+	call->rc_replay = false;
+	rpc_dictionary_set_bool(payload, "upload", true);
+	frame = rpc_pack_frame(conn, RPC_OP_CALL, call->rc_id, payload);
+	if (rpc_send_frame(conn, frame) != 0) {
+		rpc_call_free(call);
+		return (NULL);
+	}
+
+	return (call);
+}
+
+rpc_call_t
+rpc_connection_call_query(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    rpc_object_t query, rpc_callback_t callback)
+{
+	struct rpc_call *call;
+	rpc_object_t payload;
+	rpc_object_t frame;
+
+	call = rpc_connection_call_prepare(conn, path, interface, name, args,
+	    callback, false, &payload);
+	if (call == NULL)
+		return (NULL);
+
+	if (query != NULL) {
+		call->rc_replay = false;
+		rpc_dictionary_set_value(payload, "query", query);
+	}
+
+	frame = rpc_pack_frame(conn, RPC_OP_CALL, call->rc_id, payload);
+	if (rpc_send_frame(conn, frame) != 0) {
+		rpc_call_free(call);
+		return (NULL);
+	}
+
+	return (call);
+}
+
+rpc_call_t
+rpc_connection_call_conditional(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    const char *etag, rpc_callback_t callback)
+{
+	struct rpc_call *call;
+	rpc_object_t payload;
+	rpc_object_t frame;
+
+	call = rpc_connection_call_prepare(conn, path, interface, name, args,
+	    callback, false, &payload);
+	if (call == NULL)
+		return (NULL);
+
+	call->rc_conditional = true;
+	call->rc_etag = etag != NULL && *etag != '\0' ? g_strdup(etag) : NULL;
+	rpc_dictionary_set_string(payload, "etag", etag != NULL ? etag : "");
+	frame = rpc_pack_frame(conn, RPC_OP_CALL, call->rc_id, payload);
+	if (rpc_send_frame(conn, frame) != 0) {
+		rpc_call_free(call);
+		return (NULL);
+	}
+
+	return (call);
 }
 
-static int
-rpc_recv_msg(struct rpc_connection *conn, const void *frame, size_t len,
-    int *fds, size_t nfds)
+/*
+ * Peers that don't know about rpc.call_batch get the calls as separate
+ * frames. Those still leave in as few writes as the send queue allows.
+ */
+int
+rpc_connection_call_batch(rpc_connection_t conn, rpc_object_t calls,
+    rpc_call_t *results)
 {
-	rpc_object_t msg = (rpc_object_t)frame;
-	rpc_object_t msgt;
+	rpc_object_t batch;
+	rpc_object_t payload;
+	rpc_object_t frame;
+	rpc_object_t entry;
+	size_t count;
+	size_t i;
+	bool batched;
 	int ret = 0;
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		debugf("Rejecting msg, conn %p is closed", conn);
+	if (calls == NULL || rpc_get_type(calls) != RPC_TYPE_ARRAY) {
+		rpc_set_last_errorf(EINVAL, "Calls must be an array");
 		return (-1);
 	}
 
-	debugf("received frame: addr=%p, len=%zu", frame, len);
+	count = rpc_array_get_count(calls);
+	if (count == 0)
+		return (0);
 
-	if (conn->rco_raw_handler != NULL) {
-		ret = (conn->rco_raw_handler(frame, len, fds, nfds));
-		goto done;
-	}
+	batched = g_atomic_int_get(&conn->rco_call_batch);
+	batch = rpc_array_create();
 
-	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0) {
-		msg = rpc_msgpack_deserialize(frame, len);
-		if (msg == NULL) {
-			if (conn->rco_error_handler != NULL) {
-				conn->rco_error_handler(RPC_SPURIOUS_RESPONSE,
-				    NULL);
-			}
+	for (i = 0; i < count; i++) {
+		entry = rpc_array_get_value(calls, i);
+		results[i] = NULL;
+
+		if (rpc_get_type(entry) != RPC_TYPE_DICTIONARY ||
+		    rpc_dictionary_get_string(entry, "method") == NULL) {
+			rpc_set_last_errorf(EINVAL, "Malformed call at %zu",
+			    i);
 			ret = -1;
-			goto done;
+			break;
 		}
-	} else
-		rpc_retain(msg);
 
-	if (rpc_get_type(msg) != RPC_TYPE_DICTIONARY) {
-		if (conn->rco_error_handler != NULL)
-			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, msg);
-		rpc_release(msg);
-		ret = -1;
-		goto done;
+		results[i] = rpc_connection_call_prepare(conn,
+		    rpc_dictionary_get_string(entry, "path"),
+		    rpc_dictionary_get_string(entry, "interface"),
+		    rpc_dictionary_get_string(entry, "method"),
+		    rpc_dictionary_get_value(entry, "args"), NULL, false,
+		    &payload);
+		if (results[i] == NULL) {
+			ret = -1;
+			break;
+		}
+
+		if (batched) {
+			rpc_dictionary_set_value(payload, "id",
+			    results[i]->rc_id);
+			rpc_array_append_stolen_value(batch, payload);
+			continue;
+		}
+
+		frame = rpc_pack_frame(conn, RPC_OP_CALL, results[i]->rc_id,
+		    payload);
+		if (rpc_send_frame(conn, frame) != 0) {
+			ret = -1;
+			break;
+		}
 	}
 
-	msgt = rpct_deserialize(msg);
-	rpc_release(msg);
+	if (ret == 0 && batched) {
+		frame = rpc_pack_frame(conn, RPC_OP_CALL_BATCH,
+		    results[0]->rc_id, batch);
+		ret = rpc_send_frame(conn, frame);
+	} else
+		rpc_release(batch);
 
-	if (msgt == NULL) {
-		if (conn->rco_error_handler != NULL)
-			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, NULL);
+	if (ret != 0) {
+		for (i = 0; i < count && results[i] != NULL; i++) {
+			rpc_call_free(results[i]);
+			results[i] = NULL;
+		}
 
-		ret = -1;
-		goto done;
+		for (; i < count; i++)
+			results[i] = NULL;
 	}
 
-	rpc_restore_fds(msgt, fds, nfds);
-	rpc_connection_dispatch(conn, msgt);
-
-done:
-	rpc_connection_release(conn);
 	return (ret);
 }
 
-static void
-call_abort_locked(struct rpc_call *call)
+static char *
+rpc_prop_key(const char *path, const char *interface, const char *name)
 {
-	rpc_abort_handler_t abt_fn;
-
-	abt_fn = call->rc_abort_handler;
-	call->rc_abort_handler = NULL;
-	g_mutex_unlock(&call->rc_mtx);
-	abt_fn();
-	Block_release(abt_fn);
-	rpc_connection_call_release(call);
 
+	return (g_strdup_printf("%s\x1f%s\x1f%s", path != NULL ? path : "",
+	    interface != NULL ? interface : "", name));
 }
 
 static void
-rpc_abort_worker(void *arg, void *data)
+rpc_prop_entry_free(struct rpc_prop_entry *entry)
 {
-	struct rpc_call *call = arg;
-	struct rpc_connection *conn = data;
 
-	g_mutex_lock(&call->rc_mtx);
-	g_assert(call->rc_conn == conn);
-	if (call->rc_abort_handler)
-		call_abort_locked(call);
-	else {
-		g_mutex_unlock(&call->rc_mtx);
-		rpc_connection_call_release(call);
-	}
+	rpc_release(entry->rpe_value);
+	g_free(entry);
 }
 
-static int
-rpc_close(rpc_connection_t conn)
+/*
+ * A delta only applies on top of the version right before it; if one
+ * was missed, the value is dropped and fetched again on the next read.
+ */
+static void
+rpc_connection_prop_changed(rpc_connection_t conn, const char *path,
+    rpc_object_t args)
 {
-	GHashTableIter iter;
-	struct rpc_call *call;
-	struct queue_item *q_item;
+	struct rpc_prop_entry *entry;
+	const char *interface = NULL;
+	const char *name = NULL;
+	rpc_object_t value = NULL;
+	rpc_object_t delta = NULL;
+	rpc_object_t patched = NULL;
+	uint64_t version = 0;
 	char *key;
-	GError *err = NULL;
 
-	g_mutex_lock(&conn->rco_mtx);
+	rpc_object_unpack(args, "{s,s,v,v,u}",
+	    "interface", &interface,
+	    "name", &name,
+	    "value", &value,
+	    "delta", &delta,
+	    "version", &version);
 
-	if ((g_atomic_int_or(&conn->rco_state, CONNECTION_ABORTED) &
-	    CONNECTION_ABORTED) != 0) {
-		g_mutex_unlock(&conn->rco_mtx); /*another thread called first*/
-		return (0);
-	}
+	if (name == NULL || (value == NULL && delta == NULL))
+		return;
 
-	if (conn->rco_server != NULL)
-		g_atomic_int_or(&conn->rco_state, CONNECTION_CLOSED);
+	key = rpc_prop_key(path, interface, name);
+	g_mutex_lock(&conn->rco_prop_mtx);
+	entry = conn->rco_prop_cache != NULL ?
+	    g_hash_table_lookup(conn->rco_prop_cache, key) : NULL;
+	if (entry == NULL)
+		goto done;
 
-	if (conn->rco_error_handler) {
-		if (conn->rco_error != NULL) {
-			conn->rco_error_handler(RPC_TRANSPORT_ERROR,
-			    conn->rco_error);
-		}
-		conn->rco_error_handler(RPC_CONNECTION_CLOSED, NULL);
-		Block_release(conn->rco_error_handler);
-		conn->rco_error_handler = NULL;
+	if (value == NULL) {
+		entry->rpe_versioned = true;
+		if (entry->rpe_value != NULL &&
+		    entry->rpe_version + 1 == version)
+			patched = rpc_query_patch(entry->rpe_value, delta);
+
+		value = patched;
 	}
 
-	rpc_connection_retain(conn);
+	rpc_release(entry->rpe_value);
+	entry->rpe_value = value != NULL ? rpc_retain(value) : NULL;
+	entry->rpe_version = version;
+	entry->rpe_fetched = g_get_monotonic_time();
+	entry->rpe_gen++;
+	if (version != 0)
+		entry->rpe_versioned = true;
 
-	g_mutex_unlock(&conn->rco_mtx);
+done:
+	g_mutex_unlock(&conn->rco_prop_mtx);
+	rpc_release(patched);
+	g_free(key);
+}
 
-	/* Tear down all the running inbound/outbound calls */
+/*
+ * Subscribes to property changes under a path, unless already done.
+ */
+static void
+rpc_connection_prop_watch(rpc_connection_t conn, const char *path)
+{
+	const char *wpath = path != NULL ? path : "";
+	void *cookie;
+	bool watched;
 
-	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
-	g_hash_table_iter_init(&iter, conn->rco_inbound_calls);
-	while (g_hash_table_iter_next(&iter, (gpointer)&key, (gpointer)&call)) {
-		g_mutex_lock(&call->rc_mtx);
-		call->rc_aborted = true;
-		notify_signal(&call->rc_notify);
+	g_mutex_lock(&conn->rco_prop_mtx);
+	watched = conn->rco_prop_watches == NULL ||
+	    g_hash_table_contains(conn->rco_prop_watches, wpath);
+	g_mutex_unlock(&conn->rco_prop_mtx);
 
-		if (call->rc_abort_handler) {
-			rpc_connection_call_retain(call);
-			g_mutex_unlock(&call->rc_mtx);
-			g_thread_pool_push(conn->rco_callback_pool, call, &err);
-			if (err != NULL) {
-				g_error_free(err);
-				Block_release(call->rc_abort_handler);
-				call->rc_abort_handler = NULL;
-				rpc_connection_call_release(call);
-			}
-		} else
-			g_mutex_unlock(&call->rc_mtx);
-	}
-	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+	if (watched)
+		return;
 
-	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	g_hash_table_iter_init(&iter, conn->rco_calls);
-	while (g_hash_table_iter_next(&iter, (gpointer)&key, (gpointer)&call)) {
-		g_mutex_lock(&call->rc_mtx);
-		/* Cancel timeout source */
-		if (cancel_timeout_locked(call) != 0) {
-			g_mutex_unlock(&call->rc_mtx);
-			continue;
-		}
+	cookie = rpc_connection_register_event_handler(conn, path,
+	    RPC_OBSERVABLE_INTERFACE, "changed", ^(const char *p,
+	    const char *i __unused, const char *n __unused, rpc_object_t args) {
+		rpc_connection_prop_changed(conn, p, args);
+	});
 
-		q_item = g_malloc(sizeof(*q_item));
-		q_item->status = RPC_CALL_ERROR;
-		q_item->item = rpc_error_create(ECONNABORTED,
-		    "Connection closed", NULL);
+	if (cookie == NULL)
+		return;
 
-		g_queue_push_tail(call->rc_queue, q_item);
-		notify_signal(&call->rc_notify);
-		g_mutex_unlock(&call->rc_mtx);
+	g_mutex_lock(&conn->rco_prop_mtx);
+	if (conn->rco_prop_watches != NULL &&
+	    !g_hash_table_contains(conn->rco_prop_watches, wpath)) {
+		g_hash_table_insert(conn->rco_prop_watches, g_strdup(wpath),
+		    cookie);
+		cookie = NULL;
 	}
+	g_mutex_unlock(&conn->rco_prop_mtx);
 
-	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+	/* Someone else got there first */
+	if (cookie != NULL)
+		rpc_connection_unregister_event_handler(conn, cookie);
+}
 
-	if ((g_atomic_int_get(&conn->rco_state) & CONNECTION_CLOSED) != 0)
-		rpc_connection_do_close(conn, RPC_ABORTED);
-	rpc_connection_release(conn);
+static void
+rpc_connection_invalidate_properties(rpc_connection_t conn)
+{
+	struct rpc_prop_entry *entry;
+	GHashTableIter iter;
 
-	return (0);
+	g_mutex_lock(&conn->rco_prop_mtx);
+	if (conn->rco_prop_cache != NULL) {
+		g_hash_table_iter_init(&iter, conn->rco_prop_cache);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+			rpc_release(entry->rpe_value);
+			entry->rpe_value = NULL;
+			entry->rpe_gen++;
+		}
+	}
+	g_mutex_unlock(&conn->rco_prop_mtx);
 }
 
-static struct rpc_call *
-rpc_call_alloc(rpc_connection_t conn, rpc_object_t id, const char *path,
-    const char *interface, const char *method, rpc_object_t args)
+/*
+ * Values are cached once fetched, unless a change event for the same
+ * property came in while the fetch was under way.
+ */
+rpc_object_t
+rpc_connection_get_property(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
 {
-	struct rpc_call *call;
-	rpc_object_t call_args;
+	struct rpc_prop_entry *entry;
+	rpc_object_t result;
+	rpc_object_t value;
+	uint64_t version = 0;
+	uint64_t gen;
+	bool versioned;
+	gint64 now;
+	char *key;
 
-	if (method == NULL) {
-		rpc_set_last_errorf(EINVAL,
-		    "Method name not provided");
-		return (NULL);
+	if (!g_atomic_int_get(&conn->rco_prop_caching)) {
+		return (rpc_connection_call_syncp(conn, path,
+		    RPC_OBSERVABLE_INTERFACE, "get", "[s,s]", interface, name));
 	}
 
-	/* retain the connection for the life of the call. */
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_errorf(EINVAL,
-		    "Connection not open.");
-		return (NULL);
+	key = rpc_prop_key(path, interface, name);
+	now = g_get_monotonic_time();
+
+	g_mutex_lock(&conn->rco_prop_mtx);
+	if (conn->rco_prop_cache == NULL) {
+		g_mutex_unlock(&conn->rco_prop_mtx);
+		g_free(key);
+		return (rpc_connection_call_syncp(conn, path,
+		    RPC_OBSERVABLE_INTERFACE, "get", "[s,s]", interface, name));
 	}
 
-	if (args != NULL) {
-		if (rpc_get_type(args) != RPC_TYPE_ARRAY) {
-			rpc_set_last_errorf(EINVAL,
-			    "Method arguments must be an array");
-			rpc_connection_release(conn);
-			return (NULL);
-		}
-		call_args = rpc_retain(args);
-	} else
-		call_args = rpc_array_create();
+	entry = g_hash_table_lookup(conn->rco_prop_cache, key);
+	if (entry != NULL && entry->rpe_value != NULL &&
+	    (conn->rco_prop_ttl == 0 ||
+	    (uint64_t)(now - entry->rpe_fetched) < conn->rco_prop_ttl)) {
+		result = rpc_retain(entry->rpe_value);
+		g_mutex_unlock(&conn->rco_prop_mtx);
+		g_free(key);
+		return (result);
+	}
 
-	call = g_malloc0(sizeof(*call));
-	call->rc_refcount = 1;
-	call->rc_queue = g_queue_new();
-	call->rc_prefetch = 1;
-	call->rc_conn = conn;
-	call->rc_context = conn->rco_rpc_context;
-	call->rc_path = g_strdup(path);
-	call->rc_interface = g_strdup(interface);
-	call->rc_method_name = g_strdup(method);
-	call->rc_args = call_args;
-	call->rc_id = id != NULL ? id : rpc_new_id();
-	g_mutex_init(&call->rc_mtx);
-	g_mutex_init(&call->rc_ref_mtx);
-	notify_init(&call->rc_notify);
+	if (entry == NULL) {
+		entry = g_malloc0(sizeof(*entry));
+		g_hash_table_insert(conn->rco_prop_cache, g_strdup(key), entry);
+	}
 
-	return (call);
-}
+	gen = entry->rpe_gen;
+	versioned = entry->rpe_versioned;
+	g_mutex_unlock(&conn->rco_prop_mtx);
 
-static int
-rpc_send_frame(rpc_connection_t conn, rpc_object_t frame)
-{
-	void *buf = frame;
-	int fds[MAX_FDS];
-	rpc_object_t tmp;
-	size_t len = 0, nfds = 0;
-	int ret;
+	/* Watch first, so that no change goes unnoticed */
+	rpc_connection_prop_watch(conn, path);
+	result = rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
+	    versioned ? "get_versioned" : "get", "[s,s]", interface, name);
 
-	if ((conn->rco_flags & RPC_TRANSPORT_NO_RPCT_SERIALIZE) == 0) {
-		tmp = rpct_serialize(frame);
-		rpc_release(frame);
-		frame = tmp;
-		buf = tmp;
+	if (result == NULL || rpc_get_type(result) == RPC_TYPE_ERROR) {
+		g_free(key);
+		return (result);
 	}
 
-#ifdef RPC_TRACE
-	rpc_trace("SEND", conn->rco_uri, frame);
-#endif
-
-	g_mutex_lock(&conn->rco_send_mtx);
-	nfds = rpc_serialize_fds(frame, fds, NULL, 0);
+	if (versioned) {
+		value = NULL;
+		rpc_object_unpack(result, "{v,u}",
+		    "value", &value,
+		    "version", &version);
+		if (value != NULL)
+			rpc_retain(value);
 
-	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0) {
-		if (rpc_msgpack_serialize(frame, &buf, &len) != 0) {
-			g_mutex_unlock(&conn->rco_send_mtx);
-			rpc_release(frame);
-			return (-1);
-		}
+		rpc_release(result);
+		result = value;
 	}
 
-	ret = conn->rco_send_msg(conn->rco_arg, buf, len, fds, nfds);
-	rpc_release(frame);
-
-	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0)
-		free(buf);
+	g_mutex_lock(&conn->rco_prop_mtx);
+	entry = conn->rco_prop_cache != NULL ?
+	    g_hash_table_lookup(conn->rco_prop_cache, key) : NULL;
+	if (result != NULL && entry != NULL && entry->rpe_gen == gen) {
+		rpc_release(entry->rpe_value);
+		entry->rpe_value = rpc_retain(result);
+		entry->rpe_version = version;
+		entry->rpe_fetched = now;
+	}
+	g_mutex_unlock(&conn->rco_prop_mtx);
 
-	g_mutex_unlock(&conn->rco_send_mtx);
-	return (ret);
+	g_free(key);
+	return (result);
 }
 
-static struct rpc_subscription *
-rpc_connection_find_subscription(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name)
+
+rpc_object_t
+rpc_connection_set_property(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t value)
 {
-	struct rpc_subscription *result;
-	guint i;
+	struct rpc_prop_entry *entry;
+	rpc_object_t result;
+	char *key;
 
-	for (i = 0; i < conn->rco_subscriptions->len; i++) {
-		result = g_ptr_array_index(conn->rco_subscriptions, i);
+	result = rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
+	    "set", "[s,s,v]", interface, name, value);
+
+	/* Read what was written, even if the change event isn't in yet */
+	if (g_atomic_int_get(&conn->rco_prop_caching)) {
+		key = rpc_prop_key(path, interface, name);
+		g_mutex_lock(&conn->rco_prop_mtx);
+		entry = conn->rco_prop_cache != NULL ?
+		    g_hash_table_lookup(conn->rco_prop_cache, key) : NULL;
+		if (entry != NULL) {
+			rpc_release(entry->rpe_value);
+			entry->rpe_value = NULL;
+			entry->rpe_gen++;
+		}
+		g_mutex_unlock(&conn->rco_prop_mtx);
+		g_free(key);
+	}
 
-		if (g_strcmp0(result->rsu_path, path) != 0)
-			continue;
+	return (result);
+}
 
-		if (g_strcmp0(result->rsu_interface, interface) != 0)
-			continue;
+void
+rpc_connection_set_property_cache(rpc_connection_t conn, bool enable,
+    uint64_t ttl)
+{
+	GHashTable *watches = NULL;
+	GHashTableIter iter;
+	void *cookie;
+
+	g_mutex_lock(&conn->rco_prop_mtx);
+	conn->rco_prop_ttl = ttl;
+	if (enable && conn->rco_prop_cache == NULL) {
+		conn->rco_prop_cache = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, (GDestroyNotify)rpc_prop_entry_free);
+		conn->rco_prop_watches = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, NULL);
+	} else if (!enable && conn->rco_prop_cache != NULL) {
+		g_hash_table_destroy(conn->rco_prop_cache);
+		watches = conn->rco_prop_watches;
+		conn->rco_prop_cache = NULL;
+		conn->rco_prop_watches = NULL;
+	}
 
-		if (g_strcmp0(result->rsu_name, name) != 0)
-			continue;
+	g_atomic_int_set(&conn->rco_prop_caching, enable);
+	g_mutex_unlock(&conn->rco_prop_mtx);
+
+	if (watches == NULL)
+		return;
 
-		return (result);
-	}
+	g_hash_table_iter_init(&iter, watches);
+	while (g_hash_table_iter_next(&iter, NULL, &cookie))
+		rpc_connection_unregister_event_handler(conn, cookie);
 
-	return (NULL);
+	g_hash_table_destroy(watches);
 }
 
-void
-rpc_connection_send_err(rpc_connection_t conn, rpc_object_t id, int code,
-    const char *descr, ...)
+
+rpc_object_t
+rpc_connection_set_propertyp(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, const char *fmt, ...)
 {
-	rpc_object_t err;
+	rpc_object_t value;
 	va_list ap;
-	char *str;
 
-	va_start(ap, descr);
-	g_vasprintf(&str, descr, ap);
+	va_start(ap, fmt);
+	value = rpc_object_vpack(fmt, ap);
 	va_end(ap);
 
-	err = rpc_error_create(code, str, NULL);
-	rpc_connection_send_errx(conn, id, err);
-	g_free(str);
+	return (rpc_connection_set_property(conn, path, interface, name, value));
 }
 
-static int
-rpc_call_wait_locked(rpc_call_t call)
-{
-	int ret = 0;
-
-	while (g_queue_is_empty(call->rc_queue)) {
-		g_mutex_unlock(&call->rc_mtx);
-		ret = notify_wait(&call->rc_notify);
-		if (ret < 0 && errno == EINTR) {
-			rpc_set_last_errorf(EINTR, "Interrupted by signal");
-			g_mutex_lock(&call->rc_mtx);
-			return (-1);
-		}
 
-		g_mutex_lock(&call->rc_mtx);
-	}
+rpc_object_t
+rpc_connection_set_propertypv(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, const char *fmt, va_list ap)
+{
+	rpc_object_t value;
 
-	return (ret);
+	value = rpc_object_vpack(fmt, ap);
+	return (rpc_connection_set_property(conn, path, interface, name, value));
 }
 
-static gboolean
-rpc_call_timeout(gpointer user_data)
+void *
+rpc_connection_watch_property(rpc_connection_t conn, const char *path,
+    const char *interface, const char *property,
+    rpc_property_handler_t handler)
 {
-	struct queue_item *q_item;
-	rpc_call_t call = user_data;
+	/* add some memory leaks to we can remove them later */
+	path = g_strdup(path);
+	interface = g_strdup(interface);
+	property = g_strdup(property);
 
-	if (g_source_is_destroyed(g_main_current_source()))
-		return (false);
+	rpc_handler_t block = ^(const char *_p __unused, const char *_i __unused,
+	    const char *_n __unused, rpc_object_t args) {
+		const char *ev_iface;
+		const char *ev_name;
+		rpc_object_t ev_value;
 
-	g_mutex_lock(&call->rc_mtx);
-	call->rc_timedout = true;
+		if (rpc_object_unpack(args, "{s,s,v}",
+		    "interface", &ev_iface,
+		    "name", &ev_name,
+		    "value", &ev_value) < 3)
+			return;
 
-	/* make sure when we get the lock someone hasn't already handled this */
-	if (call->rc_timeout == NULL ||
-	    g_source_is_destroyed(call->rc_timeout)) {
-		g_mutex_unlock(&call->rc_mtx);
-		return false;
-	}
+		if (g_strcmp0(interface, ev_iface) != 0)
+			return;
 
-	q_item = g_malloc(sizeof(*q_item));
-	q_item->status = RPC_CALL_ERROR;
-	q_item->item = rpc_error_create(ETIMEDOUT, "Call timed out", NULL);
+		if (g_strcmp0(property, ev_name) != 0)
+			return;
 
-	g_queue_push_tail(call->rc_queue, q_item);
-	notify_signal(&call->rc_notify);
-	g_mutex_unlock(&call->rc_mtx);
+		handler(ev_value);
+	};
 
-	return (false);
+	return (rpc_connection_register_event_handler(conn, path,
+	    RPC_OBSERVABLE_INTERFACE, "changed", block));
 }
 
-void
-rpc_connection_send_errx(rpc_connection_t conn, rpc_object_t id __unused,
-    rpc_object_t err)
+/*
+ * A rough idea of how big an object gets on the wire, to tell when a
+ * batch of events or a stream's output buffer is full.
+ */
+size_t
+rpc_object_size_hint(rpc_object_t obj)
 {
-	rpc_object_t frame;
+	struct rpc_dictionary_iter diter;
+	struct rpc_array_iter aiter;
+	rpc_object_t value;
+	const char *key;
+	size_t size = 5;
 
-	frame = rpc_pack_frame("rpc", "error", id, err);
-	rpc_send_frame(conn, frame);
-}
+	switch (rpc_get_type(obj)) {
+	case RPC_TYPE_STRING:
+		return (size + rpc_string_get_length(obj));
 
-void
-rpc_connection_send_response(rpc_connection_t conn, rpc_object_t id,
-    rpc_object_t response)
-{
-	rpc_object_t frame;
+	case RPC_TYPE_BINARY:
+		return (size + rpc_data_get_length(obj));
 
-	if (response == NULL)
-		response = rpc_null_create();
+	case RPC_TYPE_ARRAY:
+		rpc_array_iter_init(obj, &aiter);
+		while (rpc_array_iter_next(&aiter, NULL, &value))
+			size += rpc_object_size_hint(value);
 
-	frame = rpc_pack_frame("rpc", "response", id, response);
-	rpc_send_frame(conn, frame);
-}
+		return (size);
 
-void
-rpc_connection_send_start_stream(rpc_connection_t conn, rpc_object_t id,
-    int64_t seqno)
-{
-	rpc_object_t frame;
-	rpc_object_t args;
+	case RPC_TYPE_DICTIONARY:
+		rpc_dictionary_iter_init(obj, &diter);
+		while (rpc_dictionary_iter_next(&diter, &key, &value))
+			size += 1 + strlen(key) + rpc_object_size_hint(value);
 
-	args = rpc_dictionary_create();
-	rpc_dictionary_set_int64(args, "seqno", seqno);
-	frame = rpc_pack_frame("rpc", "start_stream", id, args);
-	rpc_send_frame(conn, frame);
+		return (size);
+
+	default:
+		return (9);
+	}
 }
 
-void
-rpc_connection_send_fragment(rpc_connection_t conn, rpc_object_t id,
-    int64_t seqno, rpc_object_t fragment)
+/*
+ * Sends out the pending events, as a burst unless there's just one.
+ * Keeping the batch lock held while sending keeps them in order.
+ */
+static void
+rpc_connection_flush_events_locked(rpc_connection_t conn)
 {
+	rpc_object_t batch = conn->rco_batch;
 	rpc_object_t frame;
-	rpc_object_t args;
 
-	args = rpc_dictionary_create();
-	rpc_dictionary_set_int64(args, "seqno", seqno);
-	rpc_dictionary_steal_value(args, "fragment", fragment);
-	frame = rpc_pack_frame("rpc", "fragment", id, args);
+	if (conn->rco_batch_source != NULL) {
+		g_source_destroy(conn->rco_batch_source);
+		conn->rco_batch_source = NULL;
+	}
+
+	if (batch == NULL)
+		return;
+
+	conn->rco_batch = NULL;
+	conn->rco_batch_bytes = 0;
+
+	if (rpc_array_get_count(batch) == 1) {
+		frame = rpc_pack_frame(conn, RPC_OP_EVENT, NULL,
+		    rpc_retain(rpc_array_get_value(batch, 0)));
+		rpc_release(batch);
+	} else
+		frame = rpc_pack_frame(conn, RPC_OP_EVENT_BURST, NULL, batch);
+
 	rpc_send_frame(conn, frame);
 }
 
-void
-rpc_connection_send_end(rpc_connection_t conn, rpc_object_t id, int64_t seqno)
+static gboolean
+rpc_connection_batch_tick(gpointer user_data)
 {
-	rpc_object_t frame;
-	rpc_object_t args;
+	rpc_connection_t conn = user_data;
 
-	args = rpc_dictionary_create();
-	rpc_dictionary_set_int64(args, "seqno", seqno);
-	frame = rpc_pack_frame("rpc", "end", id, args);
-	rpc_send_frame(conn, frame);
+	g_mutex_lock(&conn->rco_batch_mtx);
+	/* Unless the batch went out and a new one was started meanwhile */
+	if (conn->rco_batch_source == g_main_current_source()) {
+		conn->rco_batch_source = NULL;
+		rpc_connection_flush_events_locked(conn);
+	}
+	g_mutex_unlock(&conn->rco_batch_mtx);
+	return (false);
 }
 
-int
-rpc_connection_call_retain(struct rpc_call *call)
+/*
+ * Sends an events.event frame, or adds the event to the pending batch
+ * when batching is on. Steals the event.
+ */
+static int
+rpc_connection_queue_event(rpc_connection_t conn, rpc_object_t event)
 {
+	GSource *source;
 
-	g_assert(call->rc_refcount > 0);
-	g_mutex_lock(&call->rc_ref_mtx);
-	if (call->rc_refcount < 1) {
-		g_mutex_unlock(&call->rc_ref_mtx);
-		return (-1);
+	g_mutex_lock(&conn->rco_batch_mtx);
+	if (conn->rco_batch_max_events < 2) {
+		g_mutex_unlock(&conn->rco_batch_mtx);
+		return (rpc_send_frame(conn, rpc_pack_frame(conn, RPC_OP_EVENT,
+		    NULL, event)));
 	}
 
-	++call->rc_refcount;
+	if (conn->rco_batch == NULL)
+		conn->rco_batch = rpc_array_create();
 
-	g_mutex_unlock(&call->rc_ref_mtx);
+	conn->rco_batch_bytes += rpc_object_size_hint(event);
+	rpc_array_append_stolen_value(conn->rco_batch, event);
+
+	if (rpc_array_get_count(conn->rco_batch) >=
+	    conn->rco_batch_max_events || (conn->rco_batch_max_bytes != 0 &&
+	    conn->rco_batch_bytes >= conn->rco_batch_max_bytes))
+		rpc_connection_flush_events_locked(conn);
+	else if (conn->rco_batch_source == NULL) {
+		source = g_source_new(&rpc_timer_source_funcs, sizeof(GSource));
+		g_source_set_ready_time(source, g_get_monotonic_time() +
+		    (gint64)conn->rco_batch_max_delay);
+		rpc_connection_retain(conn);
+		g_source_set_callback(source, rpc_connection_batch_tick, conn,
+		    (GDestroyNotify)rpc_connection_release);
+		g_source_attach(source, rpc_connection_get_main_context(conn));
+		g_source_unref(source);
+		conn->rco_batch_source = source;
+	}
+
+	g_mutex_unlock(&conn->rco_batch_mtx);
 	return (0);
 }
 
 int
-rpc_connection_call_release(struct rpc_call *call)
+rpc_connection_send_event(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args)
 {
+	static rpc_pack_fmt_t event_fmt;
+	rpc_object_t event;
+	bool subscribed;
+	int ret = 0;
 
-	g_assert(call->rc_refcount > 0);
-	g_mutex_lock(&call->rc_ref_mtx);
-
-	if (call->rc_refcount > 1) {
-		call->rc_refcount--;
-		g_mutex_unlock(&call->rc_ref_mtx);
-		return (0);
-	} else if (call->rc_refcount < 1) {
-		g_mutex_unlock(&call->rc_ref_mtx);
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
 		return (-1);
-	}
-
-	call->rc_refcount = -1;
-	g_mutex_unlock(&call->rc_ref_mtx);
 
-	if (call->rc_callback != NULL)
-		Block_release(call->rc_callback);
+	/* Any listeners? */
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	if (rpc_connection_get_subscription_count(conn) < 1)
+		goto done;
 
-	if (call->rc_instance != NULL)
-		rpc_instance_release(call->rc_instance);
+	/* Filtered out events are never encoded */
+	if (!rpc_connection_event_wanted_locked(conn, path, interface, name,
+	    args, &subscribed))
+		goto done;
 
-	rpc_release(call->rc_err);
-	rpc_release(call->rc_id);
-	rpc_release(call->rc_args);
-	g_free(call->rc_path);
-	g_free(call->rc_interface);
-	g_free(call->rc_method_name);
-	notify_free(&call->rc_notify);
-	g_mutex_clear(&call->rc_mtx);
-	g_mutex_clear(&call->rc_ref_mtx);
+	event = rpc_object_pack_compiled(
+	    rpc_pack_compile_once(&event_fmt, "{s,s,s,v}"),
+	    "path", path,
+	    "interface", interface,
+	    "name", name,
+	    "args", rpc_retain(args));
 
-	if (call->rc_queue != NULL)
-		g_queue_free(call->rc_queue);
+	ret = rpc_connection_queue_event(conn, event);
 
-	rpc_connection_release(call->rc_conn); /*drop the call's ref */
-	g_free(call);
-	return (0);
+done:
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+	rpc_connection_release(conn);
+	return (ret);
 }
 
-void
-rpc_connection_close_inbound_call(struct rpc_call *call)
+/*
+ * An event on its way to many connections. It's encoded once for each
+ * combination of negotiated encoding options found among them, and the
+ * same bytes are then queued to every connection using that one.
+ */
+struct rpc_shared_event
 {
-	rpc_connection_t conn = call->rc_conn;
+	volatile int		rse_refcnt;
+	GMutex			rse_mtx;
+	rpc_object_t		rse_event;
+	GBytes *		rse_encoded[RPC_EVENT_PROFILES];
+	bool			rse_failed[RPC_EVENT_PROFILES];
+};
 
-	rpc_connection_retain(conn);
+struct rpc_shared_event *
+rpc_shared_event_create(const char *path, const char *interface,
+    const char *name, rpc_object_t args)
+{
+	static rpc_pack_fmt_t event_fmt;
+	struct rpc_shared_event *ev;
+
+	ev = g_malloc0(sizeof(*ev));
+	ev->rse_refcnt = 1;
+	g_mutex_init(&ev->rse_mtx);
+	ev->rse_event = rpc_object_pack_compiled(
+	    rpc_pack_compile_once(&event_fmt, "{s,s,s,v}"),
+	    "path", path,
+	    "interface", interface,
+	    "name", name,
+	    "args", rpc_retain(args));
 
-	g_rw_lock_writer_lock(&conn->rco_icall_rwlock);
+	return (ev);
+}
 
-	if (!g_hash_table_remove(conn->rco_inbound_calls, rpc_string_get_string_ptr(
-	    call->rc_id))) {
-		g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
-		rpc_connection_release(conn);
+void
+rpc_shared_event_release(struct rpc_shared_event *ev)
+{
+	guint i;
+
+	if (!g_atomic_int_dec_and_test(&ev->rse_refcnt))
 		return;
-	}
 
-	g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
+	for (i = 0; i < RPC_EVENT_PROFILES; i++) {
+		if (ev->rse_encoded[i] != NULL)
+			g_bytes_unref(ev->rse_encoded[i]);
+	}
 
-	rpc_connection_call_release(call);
-	rpc_connection_release(conn);
+	rpc_release(ev->rse_event);
+	g_mutex_clear(&ev->rse_mtx);
+	g_free(ev);
 }
 
-static rpc_object_t
-rpc_new_id(void)
+void
+rpc_shared_event_retain(struct rpc_shared_event *ev)
 {
-	char *str = rpc_generate_v4_uuid();
-	rpc_object_t ret = rpc_string_create(str);
 
-	g_free(str);
-	return (ret);
+	g_atomic_int_inc(&ev->rse_refcnt);
 }
 
-static void
-rpc_connection_set_default_fn_handlers(rpc_connection_t conn)
+rpc_object_t
+rpc_shared_event_get(struct rpc_shared_event *ev)
 {
 
-	conn->rco_fn_cbs.rcf_fn_respond = rpc_function_respond_impl;
-	conn->rco_fn_cbs.rcf_fn_error = rpc_function_error_impl;
-	conn->rco_fn_cbs.rcf_fn_error_ex = rpc_function_error_ex_impl;
-	conn->rco_fn_cbs.rcf_fn_start_stream = rpc_function_start_stream_impl;
-	conn->rco_fn_cbs.rcf_fn_yield = rpc_function_yield_impl;
-	conn->rco_fn_cbs.rcf_fn_end = rpc_function_end_impl;
-	conn->rco_fn_cbs.rcf_fn_kill = rpc_function_kill_impl;
-	conn->rco_fn_cbs.rcf_should_abort = rpc_function_should_abort_impl;
-	conn->rco_fn_cbs.rcf_set_async_abort_handler =
-	    rpc_function_set_async_abort_handler_impl;
+	return (ev->rse_event);
 }
 
-static rpc_connection_t
-rpc_connection_init(int flags)
-{
-	struct rpc_connection *conn = g_malloc0(sizeof(*conn));
+/*
+ * Returns the index of the encoding options a connection settled on,
+ * or -1 if frames sent over it can't be shared with other connections:
+ * when the transport doesn't serialize, while the handshake is still
+ * going on, or when a per-connection type table is in use.
+ */
+static int
+rpc_event_profile(rpc_connection_t conn)
+{
+	int profile = 0;
+
+	if (conn->rco_flags & (RPC_TRANSPORT_NO_SERIALIZE |
+	    RPC_TRANSPORT_NO_RPCT_SERIALIZE))
+		return (-1);
+
+	if (!g_atomic_int_get(&conn->rco_compact_ids) ||
+	    !g_atomic_int_get(&conn->rco_compact_acked))
+		return (-1);
+
+	if (g_atomic_int_get(&conn->rco_peer_types) && conn->rco_types != NULL)
+		return (-1);
+
+	if (g_atomic_int_get(&conn->rco_compact_ops))
+		profile |= 1 << 0;
 
-	g_mutex_init(&conn->rco_mtx);
-	g_mutex_init(&conn->rco_ref_mtx);
-	g_mutex_init(&conn->rco_send_mtx);
-	g_rw_lock_init(&conn->rco_subscription_rwlock);
-	g_rw_lock_init(&conn->rco_call_rwlock);
-	g_rw_lock_init(&conn->rco_icall_rwlock);
+	if (g_atomic_int_get(&conn->rco_packed_arrays))
+		profile |= 1 << 1;
 
-	conn->rco_calls = g_hash_table_new(g_str_hash, g_str_equal);
-	conn->rco_inbound_calls = g_hash_table_new(g_str_hash, g_str_equal);
-	conn->rco_subscriptions = g_ptr_array_new_with_free_func((GDestroyNotify)rpc_subscription_release);
-	conn->rco_rpc_timeout = DEFAULT_RPC_TIMEOUT;
-	conn->rco_recv_msg = rpc_recv_msg;
-	conn->rco_close = rpc_close;
+	if (conn->rco_positional &&
+	    g_atomic_int_get(&conn->rco_positional_structs))
+		profile |= 1 << 2;
 
-	conn->rco_flags = flags;
-	if (rpc_connection_supports_credentials(conn))
-		conn->rco_set_creds = rpc_set_creds;
+	if (g_atomic_int_get(&conn->rco_timestamps))
+		profile |= 1 << 3;
 
-	conn->rco_refcnt = 1;
-	conn->rco_arg = conn;
-	rpc_connection_set_default_fn_handlers(conn);
+	if (conn->rco_columnar &&
+	    g_atomic_int_get(&conn->rco_columnar_arrays))
+		profile |= 1 << 4;
+
+	return (profile);
+}
+
+static GBytes *
+rpc_shared_event_encode(rpc_connection_t conn, struct rpc_shared_event *ev,
+    int profile)
+{
+	struct rpc_output_buffer buf = { 0 };
+	rpc_object_t frame;
+	GBytes *result;
+
+	g_mutex_lock(&ev->rse_mtx);
+	if (ev->rse_encoded[profile] == NULL && !ev->rse_failed[profile]) {
+		/* Descriptors and out-of-line binaries can't be shared */
+		frame = rpc_pack_frame(conn, RPC_OP_EVENT, NULL,
+		    rpc_retain(ev->rse_event));
+		if (rpc_msgpack_serialize_buffered(&buf, frame, 0, false,
+		    (profile & (1 << 1)) != 0, (profile & (1 << 2)) != 0,
+		    (profile & (1 << 4)) != 0, (profile & (1 << 3)) != 0,
+		    NULL, NULL) == 0) {
+			ev->rse_encoded[profile] = g_bytes_new(buf.rob_data,
+			    buf.rob_used);
+		} else
+			ev->rse_failed[profile] = true;
 
-	if (active_connections == NULL) {
-		active_connections = g_hash_table_new(NULL, NULL);
-		g_rw_lock_init(&active_rwlock);
+		rpc_output_buffer_free(&buf);
+		rpc_release(frame);
 	}
 
-	return(conn);
+	result = ev->rse_encoded[profile];
+	if (result != NULL)
+		g_bytes_ref(result);
+
+	g_mutex_unlock(&ev->rse_mtx);
+	return (result);
 }
 
-rpc_connection_t
-rpc_connection_alloc(rpc_server_t server)
+static int
+rpc_connection_send_shared_event(rpc_connection_t conn,
+    struct rpc_shared_event *ev)
 {
-	struct rpc_connection *conn = NULL;
-	GError *err = NULL;
+	struct rpc_subscription *sub;
+	rpc_object_t frame;
+	GBytes *encoded = NULL;
+	const char *path;
+	const char *interface;
+	const char *name;
+	int profile;
+	int ret = 0;
 
-	conn = rpc_connection_init(server->rs_flags);
+	path = rpc_dictionary_get_string(ev->rse_event, "path");
+	interface = rpc_dictionary_get_string(ev->rse_event, "interface");
+	name = rpc_dictionary_get_string(ev->rse_event, "name");
 
-	conn->rco_uri = server->rs_uri;
-	conn->rco_server = server;
-	conn->rco_main_context = rpc_server_get_main_context(server);
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	if (rpc_connection_get_subscription_count(conn) < 1)
+		goto done;
 
-	conn->rco_callback_pool = g_thread_pool_new(&rpc_abort_worker, conn,
-	    g_get_num_processors(), false, &err);
-	if (err != NULL) {
-		g_error_free(err);
-		rpc_connection_free_resources(conn);
-		return NULL;
+	sub = rpc_connection_find_subscription(conn, path, interface, name);
+	if (sub == NULL)
+		goto done;
+
+	/* A batch gets encoded as a whole, so there's nothing to share */
+	if (conn->rco_batch_max_events > 1) {
+		ret = rpc_connection_queue_event(conn,
+		    rpc_retain(ev->rse_event));
+		goto done;
 	}
 
-	g_rw_lock_writer_lock(&active_rwlock);
-	g_assert(!g_hash_table_contains(active_connections, conn));
-	if (!g_hash_table_insert(active_connections, conn, conn))
-		g_assert_not_reached();
-	g_rw_lock_writer_unlock(&active_rwlock);
+	profile = rpc_event_profile(conn);
+	if (profile >= 0)
+		encoded = rpc_shared_event_encode(conn, ev, profile);
 
-	return (conn);
+	if (encoded != NULL) {
+		ret = rpc_send_frame_queued(conn, NULL, encoded, false);
+		g_bytes_unref(encoded);
+		goto done;
+	}
+
+	frame = rpc_pack_frame(conn, RPC_OP_EVENT, NULL,
+	    rpc_retain(ev->rse_event));
+	ret = rpc_send_frame(conn, frame);
+
+done:
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+	return (ret);
 }
 
-rpc_connection_t
-rpc_connection_create(void *cookie, rpc_object_t params)
+static void
+rpc_connection_event_task(void *item __unused, void *arg)
 {
-	GError *err = NULL;
-	const struct rpc_transport *transport;
-	struct rpc_connection *conn = NULL;
-	struct rpc_client *client = cookie;
-	char *scheme = NULL;
+	struct rpc_shared_event *ev;
+	rpc_connection_t conn = arg;
 
-	scheme = g_uri_parse_scheme(client->rci_uri);
-	transport = rpc_find_transport(scheme);
-	g_free(scheme);
+	for (;;) {
+		g_mutex_lock(&conn->rco_evq_mtx);
+		ev = g_queue_pop_head(&conn->rco_evq);
+		if (ev == NULL)
+			conn->rco_evq_scheduled = false;
+		g_mutex_unlock(&conn->rco_evq_mtx);
 
-	if (transport == NULL) {
-		rpc_set_last_error(ENXIO, "Transport not found", NULL);
-		return (NULL);
-	}
+		if (ev == NULL)
+			break;
 
-	conn = rpc_connection_init(transport->flags);
+		rpc_connection_send_shared_event(conn, ev);
+		rpc_shared_event_release(ev);
+	}
 
-	conn->rco_client = client;
-	conn->rco_params = params;
-	conn->rco_uri = client->rci_uri;
-	conn->rco_main_context = rpc_client_get_main_context(client);
+	rpc_connection_release(conn);
+}
 
-	conn->rco_callback_pool = g_thread_pool_new(&rpc_callback_worker, conn,
-	    g_get_num_processors(), false, &err);
-	rpc_connection_set_default_fn_handlers(conn);
+/*
+ * A call of one method on many connections. Every target gets a call of
+ * its own, but they all share one ID and one payload, so that, just like
+ * a shared event, the request frame is encoded only once for each
+ * combination of encoding options found among the targets.
+ */
+struct rpc_fanout
+{
+	GMutex			rfo_mtx;
+	GCond			rfo_cv;
+	char *			rfo_path;
+	char *			rfo_interface;
+	char *			rfo_method;
+	rpc_object_t		rfo_args;
+	uint64_t		rfo_timeout;
+	rpc_fanout_policy_t	rfo_policy;
+	size_t			rfo_count;
+	rpc_fanout_failure_t	rfo_failure;
+	GPtrArray *		rfo_calls;
+	GQueue			rfo_ready;	/* answers not taken yet */
+	size_t			rfo_targets;
+	size_t			rfo_pending;
+	size_t			rfo_succeeded;
+	size_t			rfo_failed;
+	gint64			rfo_deadline;
+	bool			rfo_started;
+	bool			rfo_done;
+	bool			rfo_met;
+	bool			rfo_aborted;
+	GBytes *		rfo_encoded[RPC_EVENT_PROFILES];
+	bool			rfo_unshared[RPC_EVENT_PROFILES];
+};
 
-	if (err != NULL) {
-		g_error_free(err);
-		goto fail;
-	}
-	if (transport->connect(conn, conn->rco_uri, params) != 0)
-		goto fail;
+static size_t
+rpc_fanout_needed(struct rpc_fanout *fanout)
+{
 
-	if (conn->rco_flags & RPC_TRANSPORT_FD_PASSING)
-		conn->rco_supports_fd_passing = transport->is_fd_passing(conn);
+	switch (fanout->rfo_policy) {
+	case RPC_FANOUT_QUORUM:
+		return (fanout->rfo_targets / 2 + 1);
 
-	g_rw_lock_writer_lock(&active_rwlock);
-	g_assert(!g_hash_table_contains(active_connections, conn));
-	if (!g_hash_table_insert(active_connections, conn, conn))
-		g_assert_not_reached();
-	g_rw_lock_writer_unlock(&active_rwlock);
+	case RPC_FANOUT_FIRST_N:
+		return (MIN(MAX(fanout->rfo_count, 1), fanout->rfo_targets));
 
-	return (conn);
-fail:
-	if (conn != NULL)
-		rpc_connection_free_resources(conn);
-	return (NULL);
+	default:
+		return (fanout->rfo_targets);
+	}
 }
 
-int
-rpc_connection_register_context(rpc_connection_t conn, rpc_context_t ctx)
+/*
+ * Records the answer of a target and checks whether the fan-out is
+ * complete. Answers coming in after that aren't counted. Called with
+ * rfo_mtx held.
+ */
+static void
+rpc_fanout_add_locked(struct rpc_fanout *fanout, rpc_connection_t conn,
+    rpc_call_status_t status, rpc_object_t result)
 {
+	struct rpc_fanout_result *res;
+	size_t needed;
 
-	if (rpc_connection_retain_if_valid(conn, true) == 0) {
-		g_mutex_lock(&conn->rco_mtx);
-		conn->rco_rpc_context = ctx;
-		g_mutex_unlock(&conn->rco_mtx);
-		rpc_connection_release(conn);
-		return (0);
+	fanout->rfo_pending--;
+	if (fanout->rfo_done) {
+		rpc_release(result);
+		return;
 	}
-	return (-1);
-}
 
-int rpc_connection_get_subscription_count(rpc_connection_t conn)
-{
+	res = g_malloc0(sizeof(*res));
+	res->conn = conn;
+	res->status = status;
+	res->result = result;
+	g_queue_push_tail(&fanout->rfo_ready, res);
 
-	return (
-	    rpc_connection_is_open(conn) ? conn->rco_subscriptions->len : -1);
+	if (status == RPC_CALL_DONE)
+		fanout->rfo_succeeded++;
+	else
+		fanout->rfo_failed++;
+
+	needed = rpc_fanout_needed(fanout);
+	if (fanout->rfo_succeeded >= needed) {
+		fanout->rfo_done = true;
+		fanout->rfo_met = true;
+	} else if (fanout->rfo_succeeded + fanout->rfo_pending < needed ||
+	    (fanout->rfo_failure == RPC_FANOUT_FAIL_FAST &&
+	    fanout->rfo_failed > 0))
+		fanout->rfo_done = true;
+
+	g_cond_broadcast(&fanout->rfo_cv);
 }
 
+/*
+ * Reports how a call that's part of a fan-out ended, once it has. The
+ * call is detached from the fan-out then. Called with rc_mtx held.
+ */
 static void
-rpc_connection_free_resources(rpc_connection_t conn)
+rpc_call_notify_fanout(rpc_call_t call)
 {
+	struct rpc_fanout *fanout = call->rc_fanout;
+	struct queue_item *q_item;
+	rpc_call_status_t status;
+	rpc_object_t result;
 
-	g_assert_cmpint(g_hash_table_size(conn->rco_calls), ==, 0);
-	g_assert_cmpint(g_hash_table_size(conn->rco_inbound_calls), ==, 0);
-	g_hash_table_destroy(conn->rco_calls);
-	g_hash_table_destroy(conn->rco_inbound_calls);
-
-	if (conn->rco_subscriptions != NULL)
-		g_ptr_array_free(conn->rco_subscriptions, true);
+	q_item = rpc_call_queue_peek(call, 0);
+	if (q_item == NULL)
+		return;
 
-	if (conn->rco_callback_pool != NULL) {
-		g_thread_pool_free(conn->rco_callback_pool, true, false);
-		conn->rco_callback_pool = NULL;
+	status = q_item->status;
+	if (status == RPC_CALL_DONE || status == RPC_CALL_ERROR) {
+		result = q_item->item != NULL ? rpc_retain(q_item->item) :
+		    rpc_null_create();
+	} else {
+		status = RPC_CALL_ERROR;
+		result = rpc_error_create(EINVAL,
+		    "Streaming response in a fan-out call", NULL);
 	}
 
-	rpc_release(conn->rco_error);
-	g_free(conn->rco_endpoint_address);
-	g_rw_lock_clear(&conn->rco_call_rwlock);
-	g_rw_lock_clear(&conn->rco_icall_rwlock);
-	g_rw_lock_clear(&conn->rco_subscription_rwlock);
+	call->rc_fanout = NULL;
+	g_mutex_lock(&fanout->rfo_mtx);
+	rpc_fanout_add_locked(fanout, call->rc_conn, status, result);
+	g_mutex_unlock(&fanout->rfo_mtx);
 }
 
-int
-rpc_connection_close(rpc_connection_t conn)
+rpc_fanout_t
+rpc_fanout_create(const char *path, const char *interface, const char *name,
+    rpc_object_t args)
 {
-
-	return (rpc_connection_do_close(conn, RPC_CLOSE_CALLED));
+	struct rpc_fanout *fanout;
+
+	fanout = g_malloc0(sizeof(*fanout));
+	g_mutex_init(&fanout->rfo_mtx);
+	g_cond_init(&fanout->rfo_cv);
+	g_queue_init(&fanout->rfo_ready);
+	fanout->rfo_path = g_strdup(path);
+	fanout->rfo_interface = g_strdup(interface);
+	fanout->rfo_method = g_strdup(name);
+	fanout->rfo_args = args != NULL ? rpc_retain(args) : NULL;
+	fanout->rfo_timeout = DEFAULT_RPC_TIMEOUT;
+	fanout->rfo_policy = RPC_FANOUT_ALL;
+	fanout->rfo_failure = RPC_FANOUT_CONTINUE;
+	fanout->rfo_calls = g_ptr_array_new();
+	return (fanout);
 }
 
-int
-rpc_connection_do_close(rpc_connection_t conn, rpc_close_source_t source)
+void
+rpc_fanout_set_timeout(rpc_fanout_t fanout, uint64_t timeout)
 {
-	rpc_abort_fn_t abort_func;
-	uint state;
 
-	debugf("%s state: %d conn: %p refcnt: %d  arg: %p, source: %d",
-	    conn->rco_server ? "Server" : "Client",
-	    conn->rco_state, conn, conn->rco_refcnt,
-	    conn->rco_arg, source);
+	fanout->rfo_timeout = timeout;
+}
 
-	g_mutex_lock(&conn->rco_mtx);
-	if (source == RPC_CLOSE_CALLED)
-		g_atomic_int_or(&conn->rco_state, CONNECTION_CLOSED);
+void
+rpc_fanout_set_policy(rpc_fanout_t fanout, rpc_fanout_policy_t policy,
+    size_t count, rpc_fanout_failure_t failure)
+{
 
-	/* rco_state will only be modified under rco_mtx */
-	state = g_atomic_int_get(&conn->rco_state);
+	fanout->rfo_policy = policy;
+	fanout->rfo_count = count;
+	fanout->rfo_failure = failure;
+}
 
-	if ((conn->rco_abort != NULL) &&
-	    (state & CONNECTION_ABORTED) == 0) {
-		abort_func = conn->rco_abort;
-		conn->rco_abort = NULL;
-		g_mutex_unlock(&conn->rco_mtx);
+/*
+ * Sets up the call to one target, under the ID shared by all of them,
+ * with its timeout armed for the deadline of the fan-out.
+ */
+static struct rpc_call *
+rpc_fanout_call_prepare(struct rpc_fanout *fanout, rpc_connection_t conn,
+    rpc_object_t id)
+{
+	struct rpc_call_shard *shard;
+	struct rpc_call *call;
 
-		rpc_connection_retain(conn);
-		abort_func(conn->rco_arg);
-		rpc_connection_release(conn);
-		return (0);
+	call = rpc_call_alloc(conn, rpc_retain(id), fanout->rfo_path,
+	    fanout->rfo_interface, fanout->rfo_method, fanout->rfo_args);
+	if (call == NULL) {
+		rpc_release(id);
+		return (NULL);
 	}
-	if ((state & CONNECTION_RELEASED) != 0)
-		goto done;
 
-	if (conn->rco_client != NULL) {
-		if ((state & CONNECTION_CLOSED) == 0)
-			goto done;
+	call->rc_type = RPC_OUTBOUND_CALL;
+	call->rc_replay = conn->rco_replay;
+	call->rc_idempotent = rpc_connection_is_idempotent(conn,
+	    fanout->rfo_interface, fanout->rfo_method);
 
-		g_atomic_int_or(&conn->rco_state, CONNECTION_RELEASED);
-		g_mutex_unlock(&conn->rco_mtx);
+	g_mutex_lock(&call->rc_mtx);
+	shard = rpc_call_shard(conn, call->rc_id);
+	g_rw_lock_writer_lock(&shard->rcs_lock);
+	if (g_hash_table_contains(shard->rcs_calls, call->rc_id)) {
+		g_rw_lock_writer_unlock(&shard->rcs_lock);
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_call_release(call);
+		rpc_set_last_error(EEXIST, "Connection targeted twice", NULL);
+		return (NULL);
+	}
 
-	} else if (conn->rco_server != NULL) {
-		g_atomic_int_inc(&conn->rco_server->rs_conn_closed);
-		g_atomic_int_or(&conn->rco_state, CONNECTION_RELEASED);
-		g_mutex_unlock(&conn->rco_mtx);
+	g_hash_table_insert(shard->rcs_calls, call->rc_id, call);
+	g_rw_lock_writer_unlock(&shard->rcs_lock);
 
-		/* if server isn't closed this will undo server's ref */
-		rpc_server_disconnect(conn->rco_server, conn);
-	}
-	/* undo connection's initial reference */
-	rpc_connection_release(conn);
-	return (0);
-done:
-	g_mutex_unlock(&conn->rco_mtx);
-	return (0);
+	call->rc_fanout = fanout;
+	rpc_call_arm_timeout_locked(call, fanout->rfo_timeout);
+	g_mutex_unlock(&call->rc_mtx);
+	return (call);
 }
 
-bool
-rpc_connection_is_valid(rpc_connection_t conn)
+static int
+rpc_fanout_send(struct rpc_fanout *fanout, rpc_connection_t conn,
+    struct rpc_call *call, rpc_object_t payload)
 {
-	bool ret;
+	struct rpc_output_buffer buf = { 0 };
+	rpc_object_t frame;
+	GBytes *encoded = NULL;
+	int profile;
+	int ret;
 
-	/* Use this when waiting for a conn to become invalid */
-	if (conn == NULL)
-		return (false);
-	g_rw_lock_reader_lock(&active_rwlock);
-	ret =  g_hash_table_contains(active_connections, conn);
-	g_rw_lock_reader_unlock(&active_rwlock);
+	profile = rpc_event_profile(conn);
+	if (profile >= 0 && fanout->rfo_encoded[profile] == NULL &&
+	    !fanout->rfo_unshared[profile]) {
+		/* Descriptors and out-of-line binaries can't be shared */
+		frame = rpc_pack_frame(conn, RPC_OP_CALL, call->rc_id,
+		    rpc_retain(payload));
+		if (rpc_msgpack_serialize_buffered(&buf, frame, 0, false,
+		    (profile & (1 << 1)) != 0, (profile & (1 << 2)) != 0,
+		    (profile & (1 << 4)) != 0, (profile & (1 << 3)) != 0,
+		    NULL, NULL) == 0) {
+			fanout->rfo_encoded[profile] = g_bytes_new(
+			    buf.rob_data, buf.rob_used);
+		} else
+			fanout->rfo_unshared[profile] = true;
 
-	return (ret);
-}
+		rpc_output_buffer_free(&buf);
+		rpc_release(frame);
+	}
 
-bool
-rpc_connection_is_open(rpc_connection_t conn)
-{
+	if (profile >= 0)
+		encoded = fanout->rfo_encoded[profile];
 
-	/* conn if non-null must be valid */
-	return (conn != NULL &&
-	    (g_atomic_int_get(&conn->rco_state) == CONNECTION_OPEN));
+	if (encoded != NULL) {
+		return (rpc_send_frame_queued(conn, NULL, g_bytes_ref(encoded),
+		    false));
+	}
+
+	/* In-process transports hand the frame over as it is */
+	frame = rpc_pack_frame(conn, RPC_OP_CALL, call->rc_id,
+	    rpc_copy(payload));
+	ret = rpc_send_frame(conn, frame);
+	return (ret);
 }
 
-int
-rpc_connection_retain(rpc_connection_t conn)
+/* Fails a target which hasn't answered yet, unless it has meanwhile */
+static void
+rpc_fanout_fail(struct rpc_fanout *fanout, struct rpc_call *call,
+    rpc_object_t error)
 {
 
-	/* conn if non-null is expected to be valid */
-	if (conn == NULL)
-		return (-1);
-
-	g_atomic_int_inc(&conn->rco_refcnt);
-	g_assert(conn->rco_refcnt > 1);
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_fanout == NULL) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_release(error);
+		return;
+	}
 
-	return (0);
+	call->rc_fanout = NULL;
+	g_mutex_lock(&fanout->rfo_mtx);
+	rpc_fanout_add_locked(fanout, call->rc_conn, RPC_CALL_ERROR, error);
+	g_mutex_unlock(&fanout->rfo_mtx);
+	g_mutex_unlock(&call->rc_mtx);
 }
 
 int
-rpc_connection_release(rpc_connection_t conn)
+rpc_fanout_start(rpc_fanout_t fanout, rpc_connection_t *conns, size_t nconns)
 {
+	struct rpc_call *call;
+	rpc_object_t payload = NULL;
+	rpc_object_t error;
+	rpc_object_t id;
+	char *uuid;
+	size_t i;
 
-	/* conn if non-null is expected to be valid */
-	if (conn == NULL)
+	if (fanout->rfo_args != NULL &&
+	    rpc_get_type(fanout->rfo_args) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Method arguments must be an array",
+		    NULL);
 		return (-1);
+	}
 
-	g_assert(conn->rco_refcnt > 0);
-	if (g_atomic_int_dec_and_test(&conn->rco_refcnt)) {
-
-		g_assert((g_atomic_int_get(&conn->rco_state) &
-		    CONNECTION_CLOSED) != 0);
-
-		g_rw_lock_writer_lock(&active_rwlock);
-		if (!g_hash_table_contains(active_connections, conn)) {
-			/* someone might have retained and released and done
-			 * cleanup while we waited for the lock. just exit.
-			 */
-			g_assert_not_reached(); /* current code won't permit */
-			g_rw_lock_writer_unlock(&active_rwlock);
-			return (0);
-		}
-		if (g_atomic_int_get(&conn->rco_refcnt) > 0) {
-			/* someone retained; just exit for now */
-			g_assert_not_reached(); /* current code won't permit */
-			g_rw_lock_writer_unlock(&active_rwlock);
-			return (0);
-		}
-
-		/* ok, we have the lock, the conn is valid and unretained */
-		if (!g_hash_table_remove(active_connections, conn))
-			g_assert_not_reached();
-		g_rw_lock_writer_unlock(&active_rwlock);
+	g_mutex_lock(&fanout->rfo_mtx);
+	if (fanout->rfo_started) {
+		g_mutex_unlock(&fanout->rfo_mtx);
+		rpc_set_last_error(EBUSY, "Fan-out call already started", NULL);
+		return (-1);
+	}
 
-		if (conn->rco_release && conn->rco_arg) {
-			conn->rco_release(conn->rco_arg);
-			conn->rco_arg = NULL;
+	fanout->rfo_started = true;
+	fanout->rfo_targets = nconns;
+	fanout->rfo_pending = nconns;
+	fanout->rfo_deadline = g_get_monotonic_time() +
+	    (gint64)fanout->rfo_timeout * 1000;
+	fanout->rfo_done = nconns == 0;
+	fanout->rfo_met = nconns == 0;
+	g_mutex_unlock(&fanout->rfo_mtx);
+
+	/* Compact IDs are per connection, so the shared one is a UUID */
+	uuid = rpc_generate_v4_uuid();
+	id = rpc_string_create(uuid);
+	g_free(uuid);
+
+	for (i = 0; i < nconns; i++) {
+		call = rpc_fanout_call_prepare(fanout, conns[i], id);
+		if (call == NULL) {
+			error = rpc_get_last_error();
+			error = error != NULL ? rpc_retain(error) :
+			    rpc_error_create(ECONNRESET, "Connection closed",
+			    NULL);
+			g_mutex_lock(&fanout->rfo_mtx);
+			rpc_fanout_add_locked(fanout, conns[i], RPC_CALL_ERROR,
+			    error);
+			g_mutex_unlock(&fanout->rfo_mtx);
+			continue;
 		}
-		rpc_connection_free_resources(conn);
 
-		debugf("%s in thread %p freed %p",
-		    conn->rco_server ? "Server" : "Client",
-		    g_thread_self(), conn);
-
-		conn->rco_refcnt = -1;
+		g_ptr_array_add(fanout->rfo_calls, call);
+		if (payload == NULL) {
+			payload = rpc_call_payload(conns[i], call);
+			rpc_dictionary_set_uint64(payload, "timeout",
+			    fanout->rfo_timeout);
+		}
 
-		if (conn->rco_server != NULL) {
-			/* undo connection's ref on server */
-			rpc_server_release(conn->rco_server);
+		if (rpc_fanout_send(fanout, conns[i], call, payload) != 0) {
+			rpc_fanout_fail(fanout, call, rpc_error_create(
+			    ECONNRESET, "Couldn't send the call", NULL));
 		}
-		g_free(conn);
 	}
 
+	if (payload != NULL)
+		rpc_release(payload);
+
+	rpc_release(id);
 	return (0);
 }
 
-int
-rpc_connection_get_fd(rpc_connection_t conn)
+bool
+rpc_fanout_next(rpc_fanout_t fanout, struct rpc_fanout_result *result)
 {
+	struct rpc_fanout_result *res;
+	bool abort = false;
+	guint i;
 
-	return (conn->rco_get_fd(conn->rco_arg));
-}
+	g_mutex_lock(&fanout->rfo_mtx);
+	for (;;) {
+		res = g_queue_pop_head(&fanout->rfo_ready);
+		if (res != NULL || fanout->rfo_done || !fanout->rfo_started)
+			break;
 
-void
-rpc_connection_free(rpc_connection_t conn)
-{
+		if (g_cond_wait_until(&fanout->rfo_cv, &fanout->rfo_mtx,
+		    fanout->rfo_deadline))
+			continue;
+
+		/* Past the deadline, whatever hasn't answered has timed out */
+		g_mutex_unlock(&fanout->rfo_mtx);
+		for (i = 0; i < fanout->rfo_calls->len; i++) {
+			rpc_fanout_fail(fanout,
+			    g_ptr_array_index(fanout->rfo_calls, i),
+			    rpc_error_create(ETIMEDOUT, "Call timed out", NULL));
+		}
+		g_mutex_lock(&fanout->rfo_mtx);
+	}
+
+	if (fanout->rfo_done && !fanout->rfo_aborted) {
+		fanout->rfo_aborted = true;
+		abort = true;
+	}
+	g_mutex_unlock(&fanout->rfo_mtx);
+
+	/* The outcome is settled, the stragglers aren't needed anymore */
+	if (abort) {
+		for (i = 0; i < fanout->rfo_calls->len; i++)
+			rpc_call_abort(g_ptr_array_index(fanout->rfo_calls, i));
+	}
 
+	if (res == NULL)
+		return (false);
 
+	*result = *res;
+	g_free(res);
+	return (true);
 }
 
-#ifdef ENABLE_LIBDISPATCH
-int
-rpc_connection_set_dispatch_queue(rpc_connection_t conn, dispatch_queue_t queue)
+bool
+rpc_fanout_succeeded(rpc_fanout_t fanout)
 {
-	GError *err = NULL;
-
-	if (conn->rco_callback_pool == NULL)
-		return (-1);
+	bool ret;
 
-	g_thread_pool_set_max_threads(conn->rco_callback_pool, 0, &err);
-	conn->rco_dispatch_queue = queue;
-	return (0);
+	g_mutex_lock(&fanout->rfo_mtx);
+	ret = fanout->rfo_met;
+	g_mutex_unlock(&fanout->rfo_mtx);
+	return (ret);
 }
-#endif
 
 void
-rpc_connection_dispatch(rpc_connection_t conn, rpc_object_t frame)
+rpc_fanout_free(rpc_fanout_t fanout)
 {
-	rpc_object_t id;
-	rpc_object_t args;
-	const struct message_handler *h;
-	const char *namespace;
-	const char *name;
+	struct rpc_fanout_result *res;
+	struct rpc_call *call;
+	guint i;
 
-	/* Must be called with the connection retained */
-	id = rpc_dictionary_get_value(frame, "id");
-	namespace = rpc_dictionary_get_string(frame, "namespace");
-	name = rpc_dictionary_get_string(frame, "name");
+	for (i = 0; i < fanout->rfo_calls->len; i++) {
+		call = g_ptr_array_index(fanout->rfo_calls, i);
+		g_mutex_lock(&call->rc_mtx);
+		call->rc_fanout = NULL;
+		g_mutex_unlock(&call->rc_mtx);
 
-	if (id == NULL || namespace == NULL || name == NULL) {
-		rpc_connection_send_err(conn, id, EINVAL, "Malformed request");
-		return;
+		rpc_call_abort(call);
+		rpc_call_free(call);
 	}
 
-	debugf("inbound call: namespace=%s, name=%s, id=%s", namespace, name,
-	    rpc_string_get_string_ptr(id));
+	while ((res = g_queue_pop_head(&fanout->rfo_ready)) != NULL) {
+		rpc_release(res->result);
+		g_free(res);
+	}
 
-#ifdef RPC_TRACE
-	rpc_trace("RECV", conn->rco_uri, frame);
-#endif
+	for (i = 0; i < RPC_EVENT_PROFILES; i++) {
+		if (fanout->rfo_encoded[i] != NULL)
+			g_bytes_unref(fanout->rfo_encoded[i]);
+	}
 
-	for (h = &handlers[0]; h->namespace != NULL; h++) {
-		if (g_strcmp0(namespace, h->namespace))
-			continue;
+	g_ptr_array_free(fanout->rfo_calls, true);
+	rpc_release(fanout->rfo_args);
+	g_free(fanout->rfo_path);
+	g_free(fanout->rfo_interface);
+	g_free(fanout->rfo_method);
+	g_cond_clear(&fanout->rfo_cv);
+	g_mutex_clear(&fanout->rfo_mtx);
+	g_free(fanout);
+}
 
-		if (g_strcmp0(name, h->name))
-			continue;
+static bool
+rpc_shared_event_same(struct rpc_shared_event *a, struct rpc_shared_event *b)
+{
+	static const char *keys[] = { "path", "interface", "name" };
+	guint i;
 
-		args = rpc_dictionary_get_value(frame, "args");
-		h->handler(conn, args, id);
-		rpc_release(frame);
-		return;
+	for (i = 0; i < G_N_ELEMENTS(keys); i++) {
+		if (g_strcmp0(rpc_dictionary_get_string(a->rse_event, keys[i]),
+		    rpc_dictionary_get_string(b->rse_event, keys[i])) != 0)
+			return (false);
 	}
 
-	rpc_connection_send_err(conn, id, ENXIO, "No request handler found");
-	rpc_release(frame);
+	return (true);
 }
 
-static struct rpc_subscription *
-rpc_connection_subscribe_event_locked(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, bool check_busy)
+/*
+ * Makes room for one more event in a full queue, or sets @p replaced
+ * if the event took the place of a queued one instead. Returns false
+ * when the connection has to go. Called with rco_evq_mtx held.
+ */
+static bool
+rpc_connection_event_overflow_locked(rpc_connection_t conn,
+    struct rpc_shared_event *ev, bool *replaced)
 {
-	struct rpc_subscription *sub;
-	rpc_object_t frame;
-	rpc_object_t args;
-
-	sub = rpc_connection_find_subscription(conn, path, interface, name);
-	if (sub == NULL) {
-		sub = g_malloc0(sizeof(*sub));
-		sub->rsu_path = g_strdup(path);
-		sub->rsu_interface = g_strdup(interface);
-		sub->rsu_name = g_strdup(name);
-		sub->rsu_handlers = g_ptr_array_new_with_free_func((GDestroyNotify)rpc_rsh_release);
-		args = rpc_object_pack("[{s,s,s}]",
-		    "path", path,
-		    "interface", interface,
-		    "name", name);
+	struct rpc_shared_event *old;
+	GList *link;
 
-		frame = rpc_pack_frame("events", "subscribe", NULL, args);
+	*replaced = false;
+	if (conn->rco_evq_policy == RPC_EVENT_OVERFLOW_DISCONNECT)
+		return (false);
 
-		if (rpc_send_frame(conn, frame) != 0) {
-			rpc_subscription_release(sub);
-			return (NULL);
+	if (conn->rco_evq_policy == RPC_EVENT_OVERFLOW_COALESCE) {
+		/* The newest one is the most likely to match */
+		for (link = conn->rco_evq.tail; link != NULL;
+		    link = link->prev) {
+			old = link->data;
+			if (!rpc_shared_event_same(old, ev))
+				continue;
+
+			link->data = ev;
+			rpc_shared_event_release(old);
+			__atomic_add_fetch(&conn->rco_stats.rcs_events_coalesced,
+			    1, __ATOMIC_RELAXED);
+			*replaced = true;
+			return (true);
 		}
-		sub->rsu_refcount = 1;
-		g_ptr_array_add(conn->rco_subscriptions, sub);
-	} else {
-		if (!check_busy || !sub->rsu_busy)
-			sub->rsu_refcount++;
 	}
-	return (sub);
+
+	rpc_shared_event_release(g_queue_pop_head(&conn->rco_evq));
+	__atomic_add_fetch(&conn->rco_stats.rcs_events_dropped, 1,
+	    __ATOMIC_RELAXED);
+	return (true);
 }
 
-int
-rpc_connection_subscribe_event(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name)
+/*
+ * Whether a shared event gets past the rules the peer subscribed with.
+ * Broadcasts also reach peers that didn't subscribe to them at all,
+ * those only get filtered out when there's a subscription saying so.
+ */
+static bool
+rpc_connection_event_filter(rpc_connection_t conn,
+    struct rpc_shared_event *ev)
 {
-	struct rpc_subscription *sub;
-
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
-		return (-1);
-	}
+	bool subscribed;
+	bool wanted;
 
-	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-	sub = rpc_connection_subscribe_event_locked(conn, path, interface,
-	    name, false);
-	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	if (g_atomic_int_get(&conn->rco_subscription_filters) == 0)
+		return (true);
 
-	if (sub == NULL)
-		rpc_set_last_error(EFAULT, "Unknown error", NULL);
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	wanted = rpc_connection_event_wanted_locked(conn,
+	    rpc_dictionary_get_string(ev->rse_event, "path"),
+	    rpc_dictionary_get_string(ev->rse_event, "interface"),
+	    rpc_dictionary_get_string(ev->rse_event, "name"),
+	    rpc_dictionary_get_value(ev->rse_event, "args"), &subscribed);
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
 
-	rpc_connection_release(conn);
-	return (sub == NULL) ? -1 : 0;
+	return (wanted || !subscribed);
 }
 
-int
-rpc_connection_unsubscribe_event(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name)
+/*
+ * Queues the event on the connection, to be sent from the connection's
+ * own executor queue, so that a fan-out to many connections runs in
+ * parallel while events still go out to each one of them in order.
+ * Whoever posts never waits for a slow connection; its queue is bounded
+ * by rpc_connection_set_event_queue() instead.
+ */
+void
+rpc_connection_post_event(rpc_connection_t conn, struct rpc_shared_event *ev)
 {
-	struct rpc_subscription *sub;
-	int ret = 0;
+	bool replaced = false;
+	bool schedule;
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
-		return (-1);
-	}
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
+		return;
 
-	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-	sub = rpc_connection_find_subscription(conn, path, interface, name);
-	if (sub == NULL) {
-		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-		rpc_set_last_error(ENOENT, "Subscription not found", NULL);
+	if (!rpc_connection_event_filter(conn, ev)) {
 		rpc_connection_release(conn);
-		return (-1);
+		return;
 	}
-	ret = rpc_connection_unsubscribe_event_locked(conn, sub);
-	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-	rpc_connection_release(conn);
-	return (ret);
-}
 
-static int
-rpc_connection_unsubscribe_event_locked(rpc_connection_t conn,
-    struct rpc_subscription *sub)
-{
-	rpc_object_t frame;
-	rpc_object_t args;
-	int ret = 0;
+	g_atomic_int_inc(&ev->rse_refcnt);
+	g_mutex_lock(&conn->rco_evq_mtx);
+	if (conn->rco_evq_max > 0 && conn->rco_evq.length >= conn->rco_evq_max &&
+	    !rpc_connection_event_overflow_locked(conn, ev, &replaced)) {
+		g_mutex_unlock(&conn->rco_evq_mtx);
+		rpc_shared_event_release(ev);
+		__atomic_add_fetch(&conn->rco_stats.rcs_events_dropped, 1,
+		    __ATOMIC_RELAXED);
+		rpc_connection_event_queue_overflow(conn);
+		rpc_connection_release(conn);
+		return;
+	}
 
-	/* Called with the connection retained and the subscription locked  */
+	if (!replaced)
+		g_queue_push_tail(&conn->rco_evq, ev);
 
-	sub->rsu_refcount--;
-	if (sub->rsu_refcount > 0)
-		return (0);
+	schedule = !conn->rco_evq_scheduled;
+	conn->rco_evq_scheduled = true;
+	g_mutex_unlock(&conn->rco_evq_mtx);
 
-	args = rpc_object_pack("[{s,s,s}]",
-	    "path", sub->rsu_path,
-	    "interface", sub->rsu_interface,
-	    "name", sub->rsu_name);
+	/* The task already running or queued picks it up */
+	if (!schedule) {
+		rpc_connection_release(conn);
+		return;
+	}
 
-	frame = rpc_pack_frame("events", "unsubscribe", NULL, args);
-	ret = rpc_send_frame(conn, frame);
+	if (!rpc_executor_queue_push(conn->rco_callback_queue,
+	    rpc_connection_event_task, NULL)) {
+		g_mutex_lock(&conn->rco_evq_mtx);
+		conn->rco_evq_scheduled = false;
+		g_mutex_unlock(&conn->rco_evq_mtx);
+		rpc_connection_release(conn);
+	}
+}
 
-	g_ptr_array_remove(conn->rco_subscriptions, sub);
+static gboolean
+rpc_connection_overflow_close(gpointer user_data)
+{
 
-	return (ret);
+	rpc_connection_close(user_data);
+	return (false);
 }
 
-int
-rpc_connection_retain_if_valid(rpc_connection_t conn, bool open)
+/*
+ * A subscriber that can't keep up, under the disconnect policy. Events
+ * get posted with server or context locks held, which closing the
+ * connection takes too, so it's closed from its main context instead.
+ */
+static void
+rpc_connection_event_queue_overflow(rpc_connection_t conn)
 {
+	GSource *source;
+	bool first = false;
 
-	g_rw_lock_reader_lock(&active_rwlock);
-	if (!g_hash_table_contains(active_connections, conn)) {
-		g_rw_lock_reader_unlock(&active_rwlock);
-		return (-1);
+	g_mutex_lock(&conn->rco_mtx);
+	if (conn->rco_error == NULL) {
+		conn->rco_error = rpc_error_create(ENOBUFS,
+		    "Event queue overflow", NULL);
+		first = true;
 	}
+	g_mutex_unlock(&conn->rco_mtx);
+
+	if (!first)
+		return;
+
+	source = g_idle_source_new();
 	rpc_connection_retain(conn);
-	g_rw_lock_reader_unlock(&active_rwlock);
+	g_source_set_callback(source, rpc_connection_overflow_close, conn,
+	    (GDestroyNotify)rpc_connection_release);
+	g_source_attach(source, rpc_connection_get_main_context(conn));
+	g_source_unref(source);
+}
 
-	/* Unless the conn mutex is held, state may change after this check */
-	if (open && g_atomic_int_get(&conn->rco_state) != CONNECTION_OPEN) {
-		rpc_connection_release(conn);
-		return (-1);
-	}
+void
+rpc_connection_set_event_queue(rpc_connection_t conn, size_t max_events,
+    rpc_event_overflow_t policy)
+{
 
-	return (0);
+	g_mutex_lock(&conn->rco_evq_mtx);
+	conn->rco_evq_max = max_events;
+	conn->rco_evq_policy = policy;
+	g_mutex_unlock(&conn->rco_evq_mtx);
 }
 
-void *
-rpc_connection_register_event_handler(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, rpc_handler_t handler)
+#if defined(__linux__)
+/*
+ * Passes the descriptor of our bulk pool to the peer, along with a
+ * chunk of it, once the peer has said it can take binaries out of band.
+ * Only binaries serialized after this frame refer to the pool, so the
+ * peer has it mapped by the time it decodes them.
+ */
+static void
+rpc_connection_share_bulk_pool(rpc_connection_t conn)
 {
-	struct rpc_subscription *sub;
-	struct rpc_subscription_handler *rsh = NULL;
+	struct rpc_shmem_pool *pool;
+	rpc_object_t chunk;
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
-		return (NULL);
-	}
+	if (!g_atomic_int_get(&conn->rco_shmem_pools) ||
+	    !g_atomic_int_get(&conn->rco_peer_bulk))
+		return;
 
-	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	pool = rpc_shmem_link_get_bulk(conn->rco_shm);
+	if (pool == NULL)
+		return;
 
-	sub = rpc_connection_subscribe_event_locked(conn, path, interface,
-	    name, true);
-	if (sub == NULL) {
-		/* Couldn't inform server, error has been set */
-		goto done;
+	if (!g_atomic_int_compare_and_exchange(&conn->rco_bulk_shared, false,
+	    true)) {
+		rpc_shmem_pool_unref(pool);
+		return;
 	}
-	if (sub->rsu_busy) {
-		/* no state changes were made, tell caller to retry */
-		rpc_set_last_error(EBUSY, "Subscription locked, retry", NULL);
-		goto done;
+
+	chunk = rpc_shmem_pool_alloc(pool, 1);
+	rpc_shmem_pool_unref(pool);
+	if (chunk == NULL) {
+		g_atomic_int_set(&conn->rco_bulk_shared, false);
+		return;
 	}
-	rsh = g_malloc0(sizeof(*rsh));
-	rsh->rsh_parent = sub;
-	rsh->rsh_handler = Block_copy(handler);
-	g_ptr_array_add(sub->rsu_handlers, rsh);
-done:
-	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-	rpc_connection_release(conn);
 
-	return (rsh);
+	rpc_send_frame(conn, rpc_pack_frame(conn, RPC_OP_SHMEM_POOL, NULL,
+	    chunk));
 }
 
-int
-rpc_connection_unregister_event_handler(rpc_connection_t conn, void *cookie)
+static void
+rpc_connection_shmem_task(void *item __unused, void *arg)
 {
-	struct rpc_subscription_handler *rsh = cookie;
-	struct rpc_subscription *sub;
-	int ret = 0;
-
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
-		return (-1);
-	}
-
-	sub = rsh->rsh_parent;
+	rpc_connection_t conn = arg;
+	rpc_object_t returns;
 
-	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-	if (sub->rsu_busy) {
-		ret = -1;
-		rpc_set_last_error(EBUSY, "Subscription locked, retry", NULL);
-		goto done;
-	}
-	if (g_ptr_array_remove(sub->rsu_handlers, rsh))
-		rpc_connection_unsubscribe_event_locked(conn, sub);
+	returns = rpc_shmem_link_take_returns(conn->rco_shm);
+	if (returns != NULL) {
+		rpc_send_frame_urgent(conn, rpc_pack_frame(conn,
+		    RPC_OP_SHMEM_RELEASE, NULL, returns));
+	}
 
-done:
-	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
 	rpc_connection_release(conn);
-	return ret;
 }
 
-rpc_object_t
-rpc_connection_call_syncv(rpc_connection_t conn, const char *path,
-    const char *interface, const char *method, va_list ap)
+/*
+ * Gives a chunk of a peer pool back to the peer. Objects get released
+ * anywhere, including with the send lock held, so the frame goes out
+ * from the connection's executor queue, along with any other chunks
+ * released by the time it runs.
+ */
+void
+rpc_connection_return_shmem(rpc_connection_t conn, uint64_t id, off_t offset)
 {
-	rpc_call_t call;
-	rpc_object_t args;
-	rpc_object_t result;
-	rpc_object_t i;
-
-	args = rpc_array_create();
 
-	for (;;) {
-		i = va_arg(ap, rpc_object_t);
-		if (i == NULL)
-			break;
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
+		return;
 
-		rpc_array_append_stolen_value(args, i);
+	if (!rpc_shmem_link_queue_return(conn->rco_shm, id, offset)) {
+		rpc_connection_release(conn);
+		return;
 	}
 
-	if ((call = rpc_connection_call(conn, path, interface, method, args, NULL)) == NULL)
-		return (NULL);
-
-	rpc_call_wait(call);
-	result = rpc_call_result_save(call);
-	rpc_call_free(call);
-	return (result);
+	if (!rpc_executor_queue_push(conn->rco_callback_queue,
+	    rpc_connection_shmem_task, NULL)) {
+		rpc_release(rpc_shmem_link_take_returns(conn->rco_shm));
+		rpc_connection_release(conn);
+	}
 }
+#endif
 
-rpc_object_t
-rpc_connection_call_sync(rpc_connection_t conn, const char *path,
-    const char *interface, const char *method, ...)
+/*
+ * Frames without descriptors join the send queue on serializing
+ * transports, so they go out batched with, and never in the middle of,
+ * the ones we send ourselves. The rest wait for the writer to finish.
+ */
+int
+rpc_connection_send_raw_message(rpc_connection_t conn, const void *msg,
+    size_t len, const int *fds, size_t nfds)
 {
-	rpc_object_t result;
-	va_list ap;
+	GBytes *encoded;
+	int ret;
 
-	va_start(ap, method);
-	result = rpc_connection_call_syncv(conn, path, interface, method, ap);
-	va_end(ap);
+	if (nfds == 0 && (conn->rco_flags & (RPC_TRANSPORT_NO_SERIALIZE |
+	    RPC_TRANSPORT_NO_RPCT_SERIALIZE)) == 0) {
+		encoded = g_bytes_new_static(msg, len);
+		ret = rpc_send_frame_queued(conn, NULL, encoded, false);
+		g_bytes_unref(encoded);
+		return (ret);
+	}
 
-	return (result);
+	g_mutex_lock(&conn->rco_send_mtx);
+	while (conn->rco_send_active)
+		g_cond_wait(&conn->rco_send_cv, &conn->rco_send_mtx);
+
+	ret = conn->rco_send_msg(conn->rco_arg, msg, len, fds, nfds);
+	g_mutex_unlock(&conn->rco_send_mtx);
+
+	return (ret);
 }
 
-rpc_object_t
-rpc_connection_call_syncp(rpc_connection_t conn, const char *path,
-    const char *interface, const char *method, const char *fmt, ...)
+void
+rpc_connection_set_raw_message_handler(rpc_connection_t conn,
+    rpc_raw_handler_t handler)
 {
-	rpc_object_t result;
-	va_list ap;
 
-	va_start(ap, fmt);
-	result = rpc_connection_call_syncpv(conn, path, interface, method, fmt, ap);
-	va_end(ap);
+	g_mutex_lock(&conn->rco_mtx);
+	if (conn->rco_raw_handler != NULL) {
+		Block_release(conn->rco_raw_handler);
+		conn->rco_raw_handler = NULL;
+	}
 
-	return (result);
+	if (handler == NULL) {
+		g_mutex_unlock(&conn->rco_mtx);
+		return;
+	}
+
+	conn->rco_raw_handler = Block_copy(handler);
+	g_mutex_unlock(&conn->rco_mtx);
 }
 
-rpc_object_t rpc_connection_call_syncpv(rpc_connection_t conn,
-    const char *path, const char *interface, const char *method,
-    const char *fmt, va_list ap)
+int
+rpc_connection_peek_frame(rpc_connection_t conn, const void *msg, size_t len,
+    struct rpc_frame_info *info)
 {
-	rpc_call_t call;
-	rpc_auto_object_t args = NULL;
-	rpc_object_t result;
+	rpc_object_t frame = (rpc_object_t)msg;
+	rpc_object_t value;
+	const char *str;
+	int64_t op = -1;
+
+	/*
+	 * Non-serializing transports hand us the frame object itself. It
+	 * may carry a compact opcode and id, just like an encoded one.
+	 */
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) != 0) {
+		memset(info, 0, sizeof(*info));
+		if (rpc_get_type(frame) != RPC_TYPE_DICTIONARY)
+			return (-1);
 
-	args = rpc_object_vpack(fmt, ap);
-	call = rpc_connection_call(conn, path, interface, method, args, NULL);
+		str = rpc_dictionary_get_string(frame, "namespace");
+		if (str != NULL) {
+			g_strlcpy(info->rfi_namespace, str,
+			    sizeof(info->rfi_namespace));
+		}
 
-	if (call == NULL)
-		return (NULL);
+		str = rpc_dictionary_get_string(frame, "name");
+		if (str != NULL)
+			g_strlcpy(info->rfi_name, str, sizeof(info->rfi_name));
+
+		value = rpc_dictionary_get_value(frame, "id");
+		if (value != NULL && rpc_get_type(value) == RPC_TYPE_STRING) {
+			g_strlcpy(info->rfi_id, rpc_string_get_string_ptr(value),
+			    sizeof(info->rfi_id));
+		} else if (value != NULL &&
+		    rpc_get_type(value) == RPC_TYPE_UINT64) {
+			g_snprintf(info->rfi_id, sizeof(info->rfi_id),
+			    "%" G_GUINT64_FORMAT, rpc_uint64_get_value(value));
+		}
 
-	rpc_call_wait(call);
-	result = rpc_call_result_save(call);
-	rpc_call_free(call);
-	return (result);
+		value = rpc_dictionary_get_value(frame, "op");
+		if (value != NULL && rpc_get_type(value) == RPC_TYPE_UINT64 &&
+		    rpc_uint64_get_value(value) < RPC_OP_MAX)
+			op = (int64_t)rpc_uint64_get_value(value);
+	} else if (rpc_msgpack_peek_frame(msg, len, &op, info) != 0)
+		return (-1);
+
+	if (op >= 0 && op < RPC_OP_MAX && handlers[op].namespace != NULL) {
+		g_strlcpy(info->rfi_namespace, handlers[op].namespace,
+		    sizeof(info->rfi_namespace));
+		g_strlcpy(info->rfi_name, handlers[op].name,
+		    sizeof(info->rfi_name));
+	}
+
+	return (0);
 }
 
-rpc_object_t
-rpc_connection_call_simple(rpc_connection_t conn, const char *name,
-    const char *fmt, ...)
+/*
+ * Two spliced connections. Each of them holds a reference, dropped
+ * once it's closed.
+ */
+struct rpc_proxy
 {
-	va_list ap;
-	rpc_object_t result;
+	rpc_connection_t	rp_ends[2];
+	rpc_proxy_filter_t	rp_filter;
+	volatile int		rp_refcnt;
+};
 
-	va_start(ap, fmt);
-	result = rpc_connection_call_syncpv(conn, NULL, NULL, name, fmt, ap);
-	va_end(ap);
+static int
+rpc_proxy_forward(struct rpc_proxy *proxy, int from, const void *msg,
+    size_t len, const int *fds, size_t nfds)
+{
+	struct rpc_frame_info info;
+	rpc_connection_t dest = proxy->rp_ends[!from];
+	int ret;
 
-	return (result);
+	if (proxy->rp_filter != NULL && rpc_connection_peek_frame(
+	    proxy->rp_ends[from], msg, len, &info) == 0 &&
+	    !proxy->rp_filter(proxy->rp_ends[from], &info))
+		return (0);
+
+	if (rpc_connection_retain_if_valid(dest, true) != 0)
+		return (-1);
+
+	ret = rpc_connection_send_raw_message(dest, msg, len, fds, nfds);
+	rpc_connection_release(dest);
+	return (ret);
 }
 
-rpc_call_t
-rpc_connection_call(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, rpc_object_t args,
-    rpc_callback_t callback)
+static void
+rpc_proxy_closed(struct rpc_proxy *proxy, int end)
 {
-	struct rpc_call *call;
-	rpc_object_t payload;
-	rpc_object_t frame;
+	rpc_connection_t other = proxy->rp_ends[!end];
 
-	call = rpc_call_alloc(conn, NULL, path, interface, name, args);
-	if (call == NULL)
-		return (NULL);
+	if (rpc_connection_retain_if_valid(other, false) == 0) {
+		rpc_connection_close(other);
+		rpc_connection_release(other);
+	}
 
-	call->rc_type = RPC_OUTBOUND_CALL;
-	call->rc_callback = callback != NULL ? Block_copy(callback) : NULL;
-	payload = rpc_dictionary_create();
+	if (g_atomic_int_dec_and_test(&proxy->rp_refcnt)) {
+		if (proxy->rp_filter != NULL)
+			Block_release(proxy->rp_filter);
 
-	if (path != NULL)
-		rpc_dictionary_set_string(payload, "path", path);
+		g_free(proxy);
+	}
+}
 
-	if (interface != NULL)
-		rpc_dictionary_set_string(payload, "interface", interface);
+int
+rpc_proxy_splice(rpc_connection_t a, rpc_connection_t b,
+    rpc_proxy_filter_t filter)
+{
+	struct rpc_proxy *proxy;
+	int i;
 
-	rpc_dictionary_set_string(payload, "method", name);
-	rpc_dictionary_set_value(payload, "args", call->rc_args);
-	frame = rpc_pack_frame("rpc", "call", call->rc_id, payload);
+	if ((a->rco_flags ^ b->rco_flags) & RPC_TRANSPORT_NO_SERIALIZE) {
+		rpc_set_last_errorf(EINVAL,
+		    "Connections serialize frames differently");
+		return (-1);
+	}
 
-	g_mutex_lock(&call->rc_mtx);
-	g_rw_lock_writer_lock(&conn->rco_call_rwlock);
-	g_hash_table_insert(conn->rco_calls,
-	    (gpointer)rpc_string_get_string_ptr(call->rc_id), call);
-	g_rw_lock_writer_unlock(&conn->rco_call_rwlock);
-
-	call->rc_timeout = g_timeout_source_new_seconds(conn->rco_rpc_timeout);
-	g_source_set_callback(call->rc_timeout, &rpc_call_timeout, call, NULL);
-	g_source_attach(call->rc_timeout, conn->rco_main_context);
-	g_mutex_unlock(&call->rc_mtx);
+	proxy = g_malloc0(sizeof(*proxy));
+	proxy->rp_ends[0] = a;
+	proxy->rp_ends[1] = b;
+	proxy->rp_filter = filter != NULL ? Block_copy(filter) : NULL;
+	proxy->rp_refcnt = 2;
+
+	for (i = 0; i < 2; i++) {
+		rpc_connection_set_raw_message_handler(proxy->rp_ends[i],
+		    ^(const void *msg, size_t len, const int *fds,
+		    size_t nfds) {
+			return (rpc_proxy_forward(proxy, i, msg, len, fds,
+			    nfds));
+		});
 
-	if (rpc_send_frame(conn, frame) != 0) {
-		rpc_call_free(call);
-		return (NULL);
+		rpc_connection_set_error_handler(proxy->rp_ends[i],
+		    ^(rpc_error_code_t code, rpc_object_t args __unused) {
+			if (code == RPC_CONNECTION_CLOSED)
+				rpc_proxy_closed(proxy, i);
+		});
 	}
 
-	return (call);
+	return (0);
 }
 
-rpc_object_t
-rpc_connection_get_property(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name)
+void
+rpc_connection_set_event_handler(rpc_connection_t conn, rpc_handler_t h)
 {
 
-	return (rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
-	    "get", "[s,s]", interface, name));
+	Block_release(conn->rco_event_handler);
+	conn->rco_event_handler = Block_copy(h);
 }
 
-
-rpc_object_t
-rpc_connection_set_property(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, rpc_object_t value)
+void
+rpc_connection_set_error_handler(rpc_connection_t conn, rpc_error_handler_t h)
 {
 
-	return (rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
-	    "set", "[s,s,v]", interface, name, value));
+	Block_release(conn->rco_error_handler);
+	conn->rco_error_handler = Block_copy(h);
 }
 
-
-rpc_object_t
-rpc_connection_set_propertyp(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, const char *fmt, ...)
+void
+rpc_connection_set_memory_limits(rpc_connection_t conn, size_t soft,
+    size_t hard)
 {
-	rpc_object_t value;
-	va_list ap;
-
-	va_start(ap, fmt);
-	value = rpc_object_vpack(fmt, ap);
-	va_end(ap);
+	struct rpc_mem_account *mem = &conn->rco_mem;
 
-	return (rpc_connection_set_property(conn, path, interface, name, value));
+	g_mutex_lock(&mem->rma_mtx);
+	mem->rma_soft = soft;
+	mem->rma_hard = hard;
+	g_cond_broadcast(&mem->rma_cv);
+	g_mutex_unlock(&mem->rma_mtx);
 }
 
-
-rpc_object_t
-rpc_connection_set_propertypv(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, const char *fmt, va_list ap)
+const char *
+rpc_connection_get_remote_address(rpc_connection_t conn)
 {
-	rpc_object_t value;
 
-	value = rpc_object_vpack(fmt, ap);
-	return (rpc_connection_set_property(conn, path, interface, name, value));
+	return (conn->rco_endpoint_address);
 }
 
-void *
-rpc_connection_watch_property(rpc_connection_t conn, const char *path,
-    const char *interface, const char *property,
-    rpc_property_handler_t handler)
-{
-	/* add some memory leaks to we can remove them later */
-	path = g_strdup(path);
-	interface = g_strdup(interface);
-	property = g_strdup(property);
-
-	rpc_handler_t block = ^(const char *_p __unused, const char *_i __unused,
-	    const char *_n __unused, rpc_object_t args) {
-		const char *ev_iface;
-		const char *ev_name;
-		rpc_object_t ev_value;
-
-		if (rpc_object_unpack(args, "{s,s,v}",
-		    "interface", &ev_iface,
-		    "name", &ev_name,
-		    "value", &ev_value) < 3)
-			return;
-
-		if (g_strcmp0(interface, ev_iface) != 0)
-			return;
 
-		if (g_strcmp0(property, ev_name) != 0)
-			return;
+rpc_object_t
+rpc_connection_get_stats(rpc_connection_t conn)
+{
+	struct rpc_mem_account *mem = &conn->rco_mem;
+	GHashTableIter iter;
+	struct rpc_call_shard *shard;
+	rpc_call_t call;
+	rpc_object_t result;
+	uint64_t in_flight = 0;
+	uint64_t credits = 0;
+	int64_t granted;
+	guint i;
 
-		handler(ev_value);
-	};
+	g_mutex_lock(&conn->rco_send_mtx);
+	result = rpc_object_pack("{v,writes:u,send_queue_frames:u,"
+	    "send_queue_bytes:u}",
+	    "send_buffer", rpc_output_buffer_get_stats(&conn->rco_send_buf),
+	    (uint64_t)g_atomic_int_get(&conn->rco_send_writes),
+	    (uint64_t)(conn->rco_send_buf.rob_bounds != NULL ?
+	    conn->rco_send_buf.rob_bounds->len : 0),
+	    (uint64_t)conn->rco_send_buf.rob_used);
+	g_mutex_unlock(&conn->rco_send_mtx);
 
-	return (rpc_connection_register_event_handler(conn, path,
-	    RPC_OBSERVABLE_INTERFACE, "changed", block));
-}
+	rpc_conn_stats_export(&conn->rco_stats, result);
+
+	/* Credits granted to producers, but not consumed yet */
+	for (i = 0; i < RPC_CALL_SHARDS; i++) {
+		shard = &conn->rco_call_shards[i];
+		g_rw_lock_reader_lock(&shard->rcs_lock);
+		in_flight += g_hash_table_size(shard->rcs_calls);
+		g_hash_table_iter_init(&iter, shard->rcs_calls);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&call)) {
+			granted = call->rc_producer_seqno -
+			    call->rc_consumer_seqno;
+			if (granted > 0)
+				credits += (uint64_t)granted;
+		}
+		g_rw_lock_reader_unlock(&shard->rcs_lock);
+	}
 
-int
-rpc_connection_send_event(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, rpc_object_t args)
-{
-	rpc_object_t frame;
-	rpc_object_t event;
-	struct rpc_subscription *sub;
-	int ret = 0;
+	rpc_dictionary_set_uint64(result, "calls_in_flight", in_flight);
+	rpc_dictionary_set_uint64(result, "stream_credits", credits);
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0)
-		return (-1);
+	g_mutex_lock(&conn->rco_evq_mtx);
+	rpc_dictionary_set_uint64(result, "event_queue", conn->rco_evq.length);
+	g_mutex_unlock(&conn->rco_evq_mtx);
 
-	/* Any listeners? */
-	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
-	if (rpc_connection_get_subscription_count(conn) < 1)
-		goto done;
+	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+	rpc_dictionary_set_uint64(result, "inbound_calls_in_flight",
+	    g_hash_table_size(conn->rco_inbound_calls));
+	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 
-	sub = rpc_connection_find_subscription(conn, path, interface, name);
-	if (sub == NULL)
-		goto done;
+	rpc_dictionary_steal_value(result, "memory", rpc_object_pack(
+	    "{frames:u,calls:u,fragments:u,send_queue:u,total:u,peak:u,"
+	    "soft_limit:u,hard_limit:u,stalls:u,stall_ns:u}",
+	    __atomic_load_n(&mem->rma_used[RPC_MEM_FRAMES], __ATOMIC_RELAXED),
+	    __atomic_load_n(&mem->rma_used[RPC_MEM_CALLS], __ATOMIC_RELAXED),
+	    __atomic_load_n(&mem->rma_used[RPC_MEM_FRAGMENTS],
+	    __ATOMIC_RELAXED),
+	    (uint64_t)(__atomic_load_n(&conn->rco_send_buf.rob_used,
+	    __ATOMIC_RELAXED) + __atomic_load_n(&conn->rco_flush_buf.rob_used,
+	    __ATOMIC_RELAXED) + __atomic_load_n(&conn->rco_urgent_buf.rob_used,
+	    __ATOMIC_RELAXED)),
+	    rpc_mem_usage(conn),
+	    __atomic_load_n(&mem->rma_peak, __ATOMIC_RELAXED),
+	    mem->rma_soft, mem->rma_hard,
+	    __atomic_load_n(&mem->rma_stalls, __ATOMIC_RELAXED),
+	    __atomic_load_n(&mem->rma_stall_ns, __ATOMIC_RELAXED)));
 
-	event = rpc_object_pack("{s,s,s,v}",
-	    "path", path,
-	    "interface", interface,
-	    "name", name,
-	    "args", rpc_retain(args));
+	return (result);
+}
 
-	frame = rpc_pack_frame("events", "event", NULL, event);
-	ret = rpc_send_frame(conn, frame);
+void
+rpc_connection_set_flush_latency(rpc_connection_t conn, uint64_t usec)
+{
 
-done:
-	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
-	rpc_connection_release(conn);
-	return (ret);
+	g_mutex_lock(&conn->rco_send_mtx);
+	conn->rco_flush_latency = usec;
+	g_mutex_unlock(&conn->rco_send_mtx);
 }
 
-int
-rpc_connection_send_raw_message(rpc_connection_t conn, const void *msg,
-    size_t len, const int *fds, size_t nfds)
+void
+rpc_connection_set_event_batching(rpc_connection_t conn, size_t max_events,
+    size_t max_bytes, uint64_t max_delay)
 {
-	int ret;
 
-	g_mutex_lock(&conn->rco_mtx);
-	ret = conn->rco_send_msg(conn->rco_arg, msg, len, fds, nfds);
-	g_mutex_unlock(&conn->rco_mtx);
+	g_mutex_lock(&conn->rco_batch_mtx);
+	conn->rco_batch_max_events = max_events;
+	conn->rco_batch_max_bytes = max_bytes;
+	conn->rco_batch_max_delay = max_delay;
+	if (max_events < 2)
+		rpc_connection_flush_events_locked(conn);
+	g_mutex_unlock(&conn->rco_batch_mtx);
+}
 
-	return (ret);
+void
+rpc_connection_set_arena_decoding(rpc_connection_t conn, bool enable)
+{
+
+	conn->rco_arena = enable;
 }
 
 void
-rpc_connection_set_raw_message_handler(rpc_connection_t conn,
-    rpc_raw_handler_t handler)
+rpc_connection_set_lazy_decoding(rpc_connection_t conn, bool enable)
 {
 
-	g_mutex_lock(&conn->rco_mtx);
-	if (conn->rco_raw_handler != NULL) {
-		Block_release(conn->rco_raw_handler);
-		conn->rco_raw_handler = NULL;
-	}
+	conn->rco_lazy = enable;
+}
 
-	if (handler == NULL) {
-		g_mutex_unlock(&conn->rco_mtx);
-		return;
-	}
+void
+rpc_connection_set_positional_structs(rpc_connection_t conn, bool enable)
+{
 
-	conn->rco_raw_handler = Block_copy(handler);
-	g_mutex_unlock(&conn->rco_mtx);
+	conn->rco_positional = enable;
 }
 
 void
-rpc_connection_set_event_handler(rpc_connection_t conn, rpc_handler_t h)
+rpc_connection_set_columnar_arrays(rpc_connection_t conn, bool enable)
 {
 
-	Block_release(conn->rco_event_handler);
-	conn->rco_event_handler = Block_copy(h);
+	conn->rco_columnar = enable;
 }
 
 void
-rpc_connection_set_error_handler(rpc_connection_t conn, rpc_error_handler_t h)
+rpc_connection_set_chunking(rpc_connection_t conn, size_t threshold,
+    bool incremental)
 {
 
-	Block_release(conn->rco_error_handler);
-	conn->rco_error_handler = Block_copy(h);
+	conn->rco_chunk_threshold = threshold;
+	conn->rco_chunk_incremental = incremental;
 }
 
-const char *
-rpc_connection_get_remote_address(rpc_connection_t conn)
+int
+rpc_connection_set_bulk_pool(rpc_connection_t conn, size_t size,
+    size_t threshold)
 {
+#if defined(__linux__)
+	struct rpc_shmem_pool *pool = NULL;
 
-	return (conn->rco_endpoint_address);
+	if (size > 0) {
+		pool = rpc_shmem_pool_create(size);
+		if (pool == NULL)
+			return (-1);
+	}
+
+	rpc_shmem_link_set_bulk(conn->rco_shm, pool, threshold);
+	g_atomic_int_set(&conn->rco_bulk_shared, false);
+	rpc_connection_share_bulk_pool(conn);
+	return (0);
+#else
+	(void)conn;
+	(void)size;
+	(void)threshold;
+	rpc_set_last_error(ENOTSUP, "Shared memory not supported", NULL);
+	return (-1);
+#endif
 }
 
+void
+rpc_connection_enable_type_table(rpc_connection_t conn)
+{
+
+	if (conn->rco_types == NULL)
+		conn->rco_types = rpc_msgpack_types_new();
+}
 
 bool
 rpc_connection_supports_fd_passing(rpc_connection_t conn)
@@ -2366,50 +7575,74 @@ rpc_call_wait(rpc_call_t call)
 	return (ret);
 }
 
-int
-rpc_call_continue(rpc_call_t call, bool sync)
+/*
+ * Accounts for @p consumed items the caller is done with and grants the
+ * producer more credits, if it is time to. Called with rc_mtx held, before
+ * the items are popped off rc_queue.
+ */
+static int
+rpc_call_grant_locked(rpc_call_t call, int64_t consumed)
 {
+	static rpc_pack_fmt_t continue_fmt;
 	struct queue_item *q_item;
-	rpc_call_status_t status;
 	rpc_object_t frame;
+	int64_t first = call->rc_consumer_seqno;
 	int64_t seqno;
+	int64_t increment = 0;
 	int ret = 0;
 
-	g_mutex_lock(&call->rc_mtx);
-	status = rpc_call_status_locked(call);
+	/* Credits are granted as if the items were consumed one by one */
+	call->rc_consumer_seqno += consumed - 1;
 
-	if (status != RPC_CALL_IN_PROGRESS &&
-	    status != RPC_CALL_MORE_AVAILABLE &&
-	    status != RPC_CALL_STREAM_START) {
-		rpc_set_last_errorf(ENXIO, "Not an open streaming call");
-		g_mutex_unlock(&call->rc_mtx);
-		return (-1);
-	}
+	if (call->rc_window.rcw_enabled)
+		increment = rpc_call_window_update(call, consumed);
+	else if (first <= call->rc_producer_seqno &&
+	    call->rc_consumer_seqno >= call->rc_producer_seqno)
+		increment = (int64_t)call->rc_prefetch;
 
-	if (call->rc_consumer_seqno == call->rc_producer_seqno) {
+	if (increment > 0) {
 		seqno = call->rc_producer_seqno + 1;
-		frame = rpc_pack_frame("rpc", "continue", call->rc_id, rpc_object_pack(
-		    "{i,i}",
+		frame = rpc_pack_frame(call->rc_conn, RPC_OP_CONTINUE,
+		    call->rc_id, rpc_object_pack_compiled(
+		    rpc_pack_compile_once(&continue_fmt, "{i,i}"),
 		    "seqno", seqno,
-		    "increment", call->rc_prefetch));
+		    "increment", increment));
 
-		if (rpc_send_frame(call->rc_conn, frame) != 0) {
-			q_item = g_malloc0(sizeof(*q_item));
+		if (rpc_send_frame_urgent(call->rc_conn, frame) != 0) {
+			q_item = rpc_call_queue_push(call);
 			q_item->status = RPC_CALL_ERROR;
 			q_item->item = rpc_retain(rpc_get_last_error());
-			g_queue_push_tail(call->rc_queue, q_item);
 			ret = -1;
 		}
 
-		call->rc_producer_seqno += call->rc_prefetch;
+		call->rc_producer_seqno += increment;
 	}
 
 	call->rc_consumer_seqno++;
+	return (ret);
+}
+
+int
+rpc_call_continue(rpc_call_t call, bool sync)
+{
+	rpc_call_status_t status;
+	int ret;
+
+	g_mutex_lock(&call->rc_mtx);
+	status = rpc_call_status_locked(call);
+
+	if (status != RPC_CALL_IN_PROGRESS &&
+	    status != RPC_CALL_MORE_AVAILABLE &&
+	    status != RPC_CALL_STREAM_START) {
+		rpc_set_last_errorf(ENXIO, "Not an open streaming call");
+		g_mutex_unlock(&call->rc_mtx);
+		return (-1);
+	}
+
+	ret = rpc_call_grant_locked(call, 1);
 
 	/* It is assumed that the caller retains q_item->item if it is needed */
-	q_item = g_queue_pop_head(call->rc_queue);
-	rpc_release(q_item->item);
-	g_free(q_item);
+	rpc_call_queue_pop(call);
 
 	if (sync && ret == 0) {
 		if (rpc_call_wait_locked(call) < 0) {
@@ -2425,6 +7658,49 @@ rpc_call_continue(rpc_call_t call, bool sync)
 	return (ret);
 }
 
+ssize_t
+rpc_call_take(rpc_call_t call, rpc_object_t *items, size_t max)
+{
+	struct queue_item *q_item;
+	int64_t consumed;
+	size_t count = 0;
+
+	g_mutex_lock(&call->rc_mtx);
+
+	for (;;) {
+		if (rpc_call_wait_locked(call) < 0) {
+			g_mutex_unlock(&call->rc_mtx);
+			return (-1);
+		}
+
+		q_item = rpc_call_queue_peek(call, 0);
+		if (q_item->status != RPC_CALL_STREAM_START)
+			break;
+
+		/* Nothing to hand out, just move past the stream start */
+		rpc_call_grant_locked(call, 1);
+		rpc_call_queue_pop(call);
+	}
+
+	while (count < max) {
+		q_item = rpc_call_queue_peek(call, (guint)count);
+		if (q_item == NULL || q_item->status != RPC_CALL_MORE_AVAILABLE)
+			break;
+
+		items[count++] = rpc_retain(q_item->item);
+	}
+
+	if (count > 0) {
+		consumed = (int64_t)count;
+		rpc_call_grant_locked(call, consumed);
+		while (consumed-- > 0)
+			rpc_call_queue_pop(call);
+	}
+
+	g_mutex_unlock(&call->rc_mtx);
+	return ((ssize_t)count);
+}
+
 int
 rpc_call_abort(rpc_call_t call)
 {
@@ -2443,40 +7719,250 @@ rpc_call_abort(rpc_call_t call)
 		return (-1);
 	}
 
-	frame = rpc_pack_frame("rpc", "abort", call->rc_id, rpc_null_create());
-	if (rpc_send_frame(call->rc_conn, frame) != 0) {
+	/* Unless the peer has answered, the call itself may still be queued */
+	frame = rpc_pack_frame(call->rc_conn, RPC_OP_ABORT, call->rc_id,
+	    rpc_null_create());
+	if (rpc_send_frame_prio(call->rc_conn, frame,
+	    status != RPC_CALL_IN_PROGRESS) != 0) {
 		g_mutex_unlock(&call->rc_mtx);
 		return (-1);
 	}
 
 	if (cancel_timeout_locked(call) == 0) {
-		q_item = g_malloc(sizeof(*q_item));
+		q_item = rpc_call_queue_push(call);
 		q_item->status = RPC_CALL_ABORTED;
 		q_item->item = NULL;
-		g_queue_push_tail(call->rc_queue, q_item);
 	}
 
 	g_mutex_unlock(&call->rc_mtx);
 	return (0);
 }
 
+int
+rpc_call_yield(rpc_call_t call, rpc_object_t fragment)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+	int ret;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (!call->rc_upload || call->rc_upload_ended) {
+		errno = EINVAL;
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_release(fragment);
+		return (-1);
+	}
+
+	while (call->rc_upload_seqno >= call->rc_upload_credit &&
+	    call->rc_queue.rcq_len == 0) {
+		g_mutex_unlock(&call->rc_mtx);
+		notify_wait(&call->rc_notify);
+		g_mutex_lock(&call->rc_mtx);
+	}
+
+	if (call->rc_queue.rcq_len > 0) {
+		/* The call is over; leave the wakeup to rpc_call_wait() */
+		notify_signal(&call->rc_notify);
+		errno = EPIPE;
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_release(fragment);
+		return (-1);
+	}
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", call->rc_upload_seqno);
+	rpc_dictionary_steal_value(args, "fragment", fragment);
+	frame = rpc_pack_frame(call->rc_conn, RPC_OP_UPLOAD, call->rc_id, args);
+	call->rc_upload_seqno++;
+	ret = rpc_send_frame(call->rc_conn, frame);
+	g_mutex_unlock(&call->rc_mtx);
+	return (ret);
+}
+
+int
+rpc_call_end_upload(rpc_call_t call)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+	int ret;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (!call->rc_upload || call->rc_upload_ended) {
+		errno = EINVAL;
+		g_mutex_unlock(&call->rc_mtx);
+		return (-1);
+	}
+
+	call->rc_upload_ended = true;
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", call->rc_upload_seqno);
+	frame = rpc_pack_frame(call->rc_conn, RPC_OP_UPLOAD_END, call->rc_id,
+	    args);
+	ret = rpc_send_frame(call->rc_conn, frame);
+	g_mutex_unlock(&call->rc_mtx);
+	return (ret);
+}
+
+int
+rpc_call_set_timeout(rpc_call_t call, uint64_t msecs)
+{
+
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_type != RPC_OUTBOUND_CALL || !call->rc_timer_armed ||
+	    call->rc_timedout) {
+		errno = EINVAL;
+		g_mutex_unlock(&call->rc_mtx);
+		return (-1);
+	}
+
+	rpc_call_arm_timeout_locked(call, msecs);
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+int
+rpc_call_set_idempotent(rpc_call_t call, bool idempotent)
+{
+
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_type != RPC_OUTBOUND_CALL) {
+		errno = EINVAL;
+		g_mutex_unlock(&call->rc_mtx);
+		return (-1);
+	}
+
+	call->rc_idempotent = idempotent;
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+void
+rpc_connection_set_idempotent(rpc_connection_t conn, const char *interface,
+    const char *method, bool idempotent)
+{
+	char *key;
+
+	key = g_strdup_printf("%s.%s",
+	    interface != NULL ? interface : RPC_DEFAULT_INTERFACE, method);
+	g_mutex_lock(&conn->rco_mtx);
+	if (conn->rco_idempotent == NULL) {
+		conn->rco_idempotent = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, NULL);
+	}
+
+	if (idempotent)
+		g_hash_table_add(conn->rco_idempotent, key);
+	else {
+		g_hash_table_remove(conn->rco_idempotent, key);
+		g_free(key);
+	}
+
+	g_mutex_unlock(&conn->rco_mtx);
+}
+
 int
 rpc_call_set_prefetch(_Nonnull rpc_call_t call, size_t nitems)
 {
 
 	g_mutex_lock(&call->rc_mtx);
 	call->rc_prefetch = (int64_t)nitems;
+	call->rc_window.rcw_enabled = false;
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+int
+rpc_call_set_prefetch_adaptive(_Nonnull rpc_call_t call, size_t max_items,
+    size_t max_bytes)
+{
+
+	g_mutex_lock(&call->rc_mtx);
+	call->rc_window.rcw_enabled = true;
+	call->rc_window.rcw_max_items = max_items > 0 ?
+	    max_items : RPC_WINDOW_MAX;
+	call->rc_window.rcw_max_bytes = max_bytes;
 	g_mutex_unlock(&call->rc_mtx);
 	return (0);
 }
 
+/*
+ * Takes note of an item arriving on an adaptive streaming call. The
+ * first item after a grant that found the producer out of credits
+ * times a round trip.
+ */
+static void
+rpc_call_window_sample(rpc_call_t call, size_t len)
+{
+	struct rpc_call_window *w = &call->rc_window;
+	gint64 rtt;
+
+	if (w->rcw_timing) {
+		rtt = MAX(g_get_monotonic_time() - w->rcw_grant_time, 1);
+		w->rcw_rtt = w->rcw_rtt == 0 ? rtt : (7 * w->rcw_rtt + rtt) / 8;
+		w->rcw_timing = false;
+	}
+
+	if (len > 0) {
+		w->rcw_item_size = w->rcw_item_size == 0 ? (double)len :
+		    (7 * w->rcw_item_size + (double)len) / 8;
+	}
+}
+
+/*
+ * Called as the consumer moves past @p consumed items. Returns how many
+ * credits to grant the producer now, if any: enough to refill the
+ * window, once no more than half of it is outstanding.
+ */
+static int64_t
+rpc_call_window_update(rpc_call_t call, int64_t consumed)
+{
+	struct rpc_call_window *w = &call->rc_window;
+	gint64 now = g_get_monotonic_time();
+	int64_t outstanding;
+	int64_t window;
+	double rate;
+
+	if (w->rcw_last_consume != 0 && now > w->rcw_last_consume) {
+		rate = 1000000.0 * (double)consumed /
+		    (double)(now - w->rcw_last_consume);
+		w->rcw_drain_rate = w->rcw_drain_rate == 0 ? rate :
+		    (7 * w->rcw_drain_rate + rate) / 8;
+	}
+
+	w->rcw_last_consume = now;
+
+	/* Until there are samples, the static prefetch is the window */
+	if (w->rcw_rtt == 0 || w->rcw_drain_rate == 0)
+		window = (int64_t)call->rc_prefetch;
+	else
+		window = (int64_t)(RPC_WINDOW_GAIN * w->rcw_drain_rate *
+		    (double)w->rcw_rtt / 1000000.0);
+
+	window = MIN(window, (int64_t)w->rcw_max_items);
+	if (w->rcw_max_bytes > 0 && w->rcw_item_size > 0)
+		window = MIN(window,
+		    (int64_t)((double)w->rcw_max_bytes / w->rcw_item_size));
+
+	window = MAX(window, RPC_WINDOW_MIN);
+	outstanding = call->rc_producer_seqno - call->rc_consumer_seqno;
+	if (outstanding > window / 2)
+		return (0);
+
+	if (outstanding <= 0) {
+		w->rcw_grant_time = now;
+		w->rcw_timing = true;
+	}
+
+	return (window - outstanding);
+}
+
 inline int
 rpc_call_timedwait(rpc_call_t call, const struct timespec *ts)
 {
 	int ret = 0;
 
 	g_mutex_lock(&call->rc_mtx);
-	while (g_queue_is_empty(call->rc_queue)) {
+	while (call->rc_queue.rcq_len == 0) {
 		g_mutex_unlock(&call->rc_mtx);
 		if (!notify_timedwait(&call->rc_notify, ts)) {
 			ret = -1;
@@ -2489,6 +7975,28 @@ rpc_call_timedwait(rpc_call_t call, const struct timespec *ts)
 	return (ret);
 }
 
+const char *
+rpc_call_get_etag(rpc_call_t call)
+{
+	const char *result;
+
+	g_mutex_lock(&call->rc_mtx);
+	result = call->rc_etag;
+	g_mutex_unlock(&call->rc_mtx);
+	return (result);
+}
+
+bool
+rpc_call_not_modified(rpc_call_t call)
+{
+	bool result;
+
+	g_mutex_lock(&call->rc_mtx);
+	result = call->rc_not_modified;
+	g_mutex_unlock(&call->rc_mtx);
+	return (result);
+}
+
 int
 rpc_call_success(rpc_call_t call)
 {
@@ -2501,10 +8009,9 @@ rpc_call_status_locked(rpc_call_t call)
 {
 	struct queue_item *q_item;
 
-	if (!g_queue_is_empty(call->rc_queue)) {
-		q_item = g_queue_peek_head(call->rc_queue);
+	q_item = rpc_call_queue_peek(call, 0);
+	if (q_item != NULL)
 		return (q_item->status);
-	}
 
 	return (RPC_CALL_IN_PROGRESS);
 }
@@ -2524,49 +8031,53 @@ inline rpc_object_t
 rpc_call_result(rpc_call_t call)
 {
 	struct queue_item *q_item;
+	rpc_object_t result;
 
 	g_mutex_lock(&call->rc_mtx);
-	q_item = g_queue_peek_head(call->rc_queue);
+	q_item = rpc_call_queue_peek(call, 0);
+	result = q_item != NULL ? q_item->item : NULL;
 	g_mutex_unlock(&call->rc_mtx);
 
-	return (q_item != NULL ? q_item->item : NULL);
+	return (result);
 }
 
 static inline rpc_object_t
 rpc_call_result_save(rpc_call_t call)
 {
 	struct queue_item *q_item;
+	rpc_object_t result = NULL;
 
 	g_mutex_lock(&call->rc_mtx);
-	q_item = g_queue_peek_head(call->rc_queue);
+	q_item = rpc_call_queue_peek(call, 0);
 	if (q_item != NULL)
-		rpc_retain(q_item->item);
+		result = rpc_retain(q_item->item);
 	g_mutex_unlock(&call->rc_mtx);
 
-	return (q_item != NULL ? q_item->item : NULL);
+	return (result);
 }
 
 void
 rpc_call_free(rpc_call_t call)
 {
 	rpc_connection_t conn = call->rc_conn;
-	struct queue_item *q_item;
+	struct rpc_call_shard *shard;
 
 	rpc_connection_retain(conn);
 
 	g_mutex_lock(&call->rc_mtx);
 	cancel_timeout_locked(call);
-	while (!g_queue_is_empty(call->rc_queue)) {
-		q_item = g_queue_pop_head(call->rc_queue);
-		rpc_release(q_item->item);
-		g_free(q_item);
+	while (call->rc_queue.rcq_len > 0)
+		rpc_call_queue_pop(call);
+	if (call->rc_chunks != NULL) {
+		rpc_release(call->rc_chunks);
+		call->rc_chunks = NULL;
 	}
 	g_mutex_unlock(&call->rc_mtx);
 
-	g_rw_lock_writer_lock(&conn->rco_call_rwlock);
-	g_hash_table_remove(conn->rco_calls,
-	    (gpointer)rpc_string_get_string_ptr(call->rc_id));
-	g_rw_lock_writer_unlock(&conn->rco_call_rwlock);
+	shard = rpc_call_shard(conn, call->rc_id);
+	g_rw_lock_writer_lock(&shard->rcs_lock);
+	g_hash_table_remove(shard->rcs_calls, call->rc_id);
+	g_rw_lock_writer_unlock(&shard->rcs_lock);
 
 	rpc_connection_call_release(call);
 	rpc_connection_release(conn);
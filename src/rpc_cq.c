@@ -0,0 +1,157 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include "internal.h"
+
+/*
+ * A completion queue collects call status changes and events from the
+ * connections attached to it, so that an application can pick them up
+ * from its own event loop instead of having them delivered on the
+ * callback thread pool. The pipe is readable while the queue is not
+ * empty; both are only touched under rcq_mtx, so they never disagree.
+ */
+
+static void rpc_completion_queue_drain(rpc_completion_queue_t);
+
+static void
+rpc_completion_queue_drain(rpc_completion_queue_t cq)
+{
+	char buf[64];
+
+	while (read(cq->rcq_fds[0], buf, sizeof(buf)) > 0);
+}
+
+rpc_completion_queue_t
+rpc_completion_queue_create(void)
+{
+	rpc_completion_queue_t cq;
+	GError *err = NULL;
+
+	cq = g_malloc0(sizeof(*cq));
+	if (!g_unix_open_pipe(cq->rcq_fds, FD_CLOEXEC, &err)) {
+		rpc_set_last_gerror(err);
+		g_error_free(err);
+		g_free(cq);
+		return (NULL);
+	}
+
+	g_unix_set_fd_nonblocking(cq->rcq_fds[0], true, NULL);
+	g_unix_set_fd_nonblocking(cq->rcq_fds[1], true, NULL);
+	g_mutex_init(&cq->rcq_mtx);
+	g_queue_init(&cq->rcq_events);
+	return (cq);
+}
+
+void
+rpc_completion_queue_free(rpc_completion_queue_t cq)
+{
+	struct rpc_cq_event *event;
+
+	while ((event = g_queue_pop_head(&cq->rcq_events)) != NULL) {
+		rpc_cq_event_release(event);
+		g_free(event);
+	}
+
+	close(cq->rcq_fds[0]);
+	close(cq->rcq_fds[1]);
+	g_mutex_clear(&cq->rcq_mtx);
+	g_free(cq);
+}
+
+int
+rpc_completion_queue_get_fd(rpc_completion_queue_t cq)
+{
+
+	return (cq->rcq_fds[0]);
+}
+
+void
+rpc_completion_queue_push(rpc_completion_queue_t cq, rpc_connection_t conn,
+    rpc_call_t call, rpc_object_t event)
+{
+	struct rpc_cq_event *item;
+
+	item = g_malloc(sizeof(*item));
+	item->conn = conn;
+	item->call = call;
+	item->event = event;
+
+	rpc_connection_retain(conn);
+	if (call != NULL)
+		rpc_connection_call_retain(call);
+
+	g_mutex_lock(&cq->rcq_mtx);
+	if (g_queue_is_empty(&cq->rcq_events)) {
+		if (write(cq->rcq_fds[1], "", 1) < 0 && errno != EAGAIN)
+			g_warning("cannot signal completion queue");
+	}
+
+	g_queue_push_tail(&cq->rcq_events, item);
+	g_mutex_unlock(&cq->rcq_mtx);
+}
+
+size_t
+rpc_cq_poll(rpc_completion_queue_t cq, struct rpc_cq_event *events,
+    size_t max)
+{
+	struct rpc_cq_event *item;
+	size_t count = 0;
+
+	g_mutex_lock(&cq->rcq_mtx);
+	while (count < max) {
+		item = g_queue_pop_head(&cq->rcq_events);
+		if (item == NULL)
+			break;
+
+		events[count++] = *item;
+		g_free(item);
+	}
+
+	if (g_queue_is_empty(&cq->rcq_events))
+		rpc_completion_queue_drain(cq);
+
+	g_mutex_unlock(&cq->rcq_mtx);
+	return (count);
+}
+
+void
+rpc_cq_event_release(struct rpc_cq_event *event)
+{
+
+	if (event->call != NULL)
+		rpc_connection_call_release(event->call);
+
+	rpc_release(event->event);
+	rpc_connection_release(event->conn);
+	event->conn = NULL;
+	event->call = NULL;
+	event->event = NULL;
+}
@@ -0,0 +1,736 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <string.h>
+#include <glib.h>
+#include <rpc/typing.h>
+#include "internal.h"
+
+/*
+ * Dictionary storage. Most dictionaries we see (frames, call payloads,
+ * structs) only have a handful of keys, so they start out as a flat
+ * array of key/value pairs searched linearly, and get converted to a
+ * GHashTable once they grow past RPC_DICT_SMALL_MAX entries.
+ *
+ * Keys are either owned by the dictionary or interned (see below) and
+ * values are stolen, just like with the hash table created by
+ * g_hash_table_new_full(). Hash tables always hold their own copies.
+ */
+
+/*
+ * Interned keys are allocated once and never freed. The table is
+ * seeded with the keys every frame carries; other keys only get there
+ * through rpc_key_intern(), so that arbitrary keys coming in off the
+ * wire can't grow it.
+ */
+#define	RPC_KEY_LOOKUP_MAX	64
+
+static const char *rpc_well_known_keys[] = {
+	"namespace",
+	"name",
+	"id",
+	"op",
+	"args",
+	"path",
+	"interface",
+	"method",
+	"seqno",
+	"fragment",
+	"code",
+	"message",
+	"extra",
+	"stack",
+	RPCT_TYPE_FIELD,
+	RPCT_VALUE_FIELD,
+	NULL
+};
+
+static GHashTable *rpc_keys;
+static GRWLock rpc_keys_lock;
+
+static struct rpc_key *rpc_key_new(const char *);
+static GHashTable *rpc_keys_get(void);
+static GHashTable *rpc_dict_table_new(void);
+static void rpc_dict_upgrade(struct rpc_dict *);
+static struct rpc_dict_entry *rpc_dict_find(struct rpc_dict *, const char *);
+static struct rpc_dict_entry *rpc_dict_find_key(struct rpc_dict *,
+    rpc_key_t);
+static void rpc_dict_append(struct rpc_dict *, char *, bool, rpc_object_t);
+static gint rpc_dict_slot_index(const struct rpct_layout *, const char *);
+static void rpc_dict_unslot(struct rpc_dict *);
+
+static struct rpc_key *
+rpc_key_new(const char *str)
+{
+	struct rpc_key *key;
+	size_t len = strlen(str);
+
+	key = g_malloc(sizeof(*key) + len + 1);
+	key->rk_len = len;
+	memcpy(key->rk_str, str, len + 1);
+	return (key);
+}
+
+static GHashTable *
+rpc_keys_get(void)
+{
+	struct rpc_key *key;
+	const char **str;
+
+	g_rw_lock_reader_lock(&rpc_keys_lock);
+	if (rpc_keys != NULL) {
+		g_rw_lock_reader_unlock(&rpc_keys_lock);
+		return (rpc_keys);
+	}
+
+	g_rw_lock_reader_unlock(&rpc_keys_lock);
+	g_rw_lock_writer_lock(&rpc_keys_lock);
+	if (rpc_keys == NULL) {
+		rpc_keys = g_hash_table_new(g_str_hash, g_str_equal);
+		for (str = rpc_well_known_keys; *str != NULL; str++) {
+			key = rpc_key_new(*str);
+			g_hash_table_insert(rpc_keys, key->rk_str, key);
+		}
+	}
+
+	g_rw_lock_writer_unlock(&rpc_keys_lock);
+	return (rpc_keys);
+}
+
+rpc_key_t
+rpc_key_intern(const char *str)
+{
+	GHashTable *keys = rpc_keys_get();
+	struct rpc_key *key;
+
+	key = (struct rpc_key *)rpc_key_lookup(str, strlen(str));
+	if (key != NULL)
+		return (key);
+
+	g_rw_lock_writer_lock(&rpc_keys_lock);
+	key = g_hash_table_lookup(keys, str);
+	if (key == NULL) {
+		key = rpc_key_new(str);
+		g_hash_table_insert(keys, key->rk_str, key);
+	}
+
+	g_rw_lock_writer_unlock(&rpc_keys_lock);
+	return (key);
+}
+
+const char *
+rpc_key_get_string(rpc_key_t key)
+{
+
+	return (key->rk_str);
+}
+
+/*
+ * Looks up an already interned key. The string doesn't have to be
+ * NUL-terminated. Keys longer than RPC_KEY_LOOKUP_MAX are never looked
+ * up and always get stored as plain copies.
+ */
+rpc_key_t
+rpc_key_lookup(const char *str, size_t len)
+{
+	GHashTable *keys = rpc_keys_get();
+	rpc_key_t key;
+	char buf[RPC_KEY_LOOKUP_MAX];
+
+	if (len >= sizeof(buf))
+		return (NULL);
+
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	g_rw_lock_reader_lock(&rpc_keys_lock);
+	key = g_hash_table_lookup(keys, buf);
+	g_rw_lock_reader_unlock(&rpc_keys_lock);
+	return (key);
+}
+
+static GHashTable *
+rpc_dict_table_new(void)
+{
+
+	return (g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	    (GDestroyNotify)rpc_release_impl));
+}
+
+static void
+rpc_dict_upgrade(struct rpc_dict *dict)
+{
+	guint i;
+
+	struct rpc_dict_entry *entry;
+	char *key;
+
+	dict->rd_table = rpc_dict_table_new();
+	for (i = 0; i < dict->rd_count; i++) {
+		entry = &dict->rd_entries[i];
+		key = entry->rde_key;
+		if (dict->rd_interned & (1u << i))
+			key = g_strdup(key);
+
+		g_hash_table_insert(dict->rd_table, key, entry->rde_value);
+	}
+
+	dict->rd_count = 0;
+	dict->rd_interned = 0;
+}
+
+static struct rpc_dict_entry *
+rpc_dict_find(struct rpc_dict *dict, const char *key)
+{
+	struct rpc_dict_entry *entry;
+	guint i;
+
+	for (i = 0; i < dict->rd_count; i++) {
+		entry = &dict->rd_entries[i];
+		if (entry->rde_key == key)
+			return (entry);
+
+		if (entry->rde_key[0] == key[0] &&
+		    strcmp(entry->rde_key, key) == 0)
+			return (entry);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Interned keys compare by pointer; only entries inserted with a plain
+ * copy of the key need to be compared as strings.
+ */
+static struct rpc_dict_entry *
+rpc_dict_find_key(struct rpc_dict *dict, rpc_key_t key)
+{
+	struct rpc_dict_entry *entry;
+	guint i;
+
+	for (i = 0; i < dict->rd_count; i++) {
+		if (dict->rd_entries[i].rde_key == key->rk_str)
+			return (&dict->rd_entries[i]);
+	}
+
+	for (i = 0; i < dict->rd_count; i++) {
+		entry = &dict->rd_entries[i];
+		if (dict->rd_interned & (1u << i))
+			continue;
+
+		if (strcmp(entry->rde_key, key->rk_str) == 0)
+			return (entry);
+	}
+
+	return (NULL);
+}
+
+static void
+rpc_dict_append(struct rpc_dict *dict, char *key, bool interned,
+    rpc_object_t value)
+{
+	struct rpc_dict_entry *entry;
+
+	if (interned)
+		dict->rd_interned |= (1u << dict->rd_count);
+
+	entry = &dict->rd_entries[dict->rd_count++];
+	entry->rde_key = key;
+	entry->rde_value = value;
+}
+
+/*
+ * Layout names are sorted, so slots are found by binary search.
+ */
+static gint
+rpc_dict_slot_index(const struct rpct_layout *layout, const char *key)
+{
+	guint low = 0;
+	guint high = layout->rl_count;
+	guint mid;
+	int cmp;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (layout->rl_names[mid] == key)
+			return ((gint)mid);
+
+		cmp = strcmp(key, layout->rl_names[mid]);
+		if (cmp == 0)
+			return ((gint)mid);
+
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	return (-1);
+}
+
+/*
+ * Moves the slots of a struct dict into a hash table, for when it is
+ * given a key its layout doesn't have.
+ */
+static void
+rpc_dict_unslot(struct rpc_dict *dict)
+{
+	rpc_object_t *slots = dict->rd_slots;
+	guint i;
+
+	dict->rd_table = rpc_dict_table_new();
+	for (i = 0; i < dict->rd_layout->rl_count; i++) {
+		if (slots[i] != NULL) {
+			g_hash_table_insert(dict->rd_table,
+			    g_strdup(dict->rd_layout->rl_names[i]), slots[i]);
+		}
+	}
+
+	dict->rd_layout = NULL;
+	dict->rd_slots = NULL;
+	dict->rd_count = 0;
+	g_free(slots);
+}
+
+struct rpc_dict *
+rpc_dict_new(size_t hint)
+{
+	struct rpc_dict *dict;
+
+	dict = g_malloc(sizeof(*dict));
+	dict->rd_count = 0;
+	dict->rd_interned = 0;
+	dict->rd_compact = false;
+	dict->rd_layout = NULL;
+	dict->rd_slots = NULL;
+	dict->rd_table = hint > RPC_DICT_SMALL_MAX ? rpc_dict_table_new() :
+	    NULL;
+
+	return (dict);
+}
+
+struct rpc_dict *
+rpc_dict_new_layout(const struct rpct_layout *layout)
+{
+	struct rpc_dict *dict;
+
+	dict = g_malloc(offsetof(struct rpc_dict, rd_entries));
+	dict->rd_count = 0;
+	dict->rd_interned = 0;
+	dict->rd_compact = true;
+	dict->rd_layout = layout;
+	dict->rd_slots = g_new0(rpc_object_t, layout->rl_count);
+	dict->rd_table = NULL;
+
+	return (dict);
+}
+
+/*
+ * Switches a dict over to slots, if all of its keys are in the layout.
+ */
+bool
+rpc_dict_adopt_layout(struct rpc_dict *dict, const struct rpct_layout *layout)
+{
+	struct rpc_dict_iter iter;
+	GHashTableIter hiter;
+	rpc_object_t *slots;
+	const char *key;
+	rpc_object_t value;
+	gpointer hkey;
+	gint idx;
+	guint i;
+
+	if (dict->rd_layout != NULL)
+		return (dict->rd_layout == layout);
+
+	slots = g_new0(rpc_object_t, layout->rl_count);
+	rpc_dict_iter_init(&iter, dict);
+	while (rpc_dict_iter_next(&iter, &key, &value)) {
+		idx = rpc_dict_slot_index(layout, key);
+		if (idx < 0) {
+			g_free(slots);
+			return (false);
+		}
+
+		slots[idx] = value;
+	}
+
+	/* Values now belong to the slots; only the keys go */
+	if (dict->rd_table != NULL) {
+		g_hash_table_iter_init(&hiter, dict->rd_table);
+		while (g_hash_table_iter_next(&hiter, &hkey, NULL)) {
+			g_hash_table_iter_steal(&hiter);
+			g_free(hkey);
+		}
+
+		g_hash_table_unref(dict->rd_table);
+		dict->rd_table = NULL;
+	} else {
+		for (i = 0; i < dict->rd_count; i++) {
+			if (!(dict->rd_interned & (1u << i)))
+				g_free(dict->rd_entries[i].rde_key);
+		}
+	}
+
+	dict->rd_count = 0;
+	dict->rd_interned = 0;
+	for (i = 0; i < layout->rl_count; i++) {
+		if (slots[i] != NULL)
+			dict->rd_count++;
+	}
+
+	dict->rd_layout = layout;
+	dict->rd_slots = slots;
+	return (true);
+}
+
+void
+rpc_dict_set_slot(struct rpc_dict *dict, guint index, rpc_object_t value)
+{
+
+	g_assert(dict->rd_layout != NULL && index < dict->rd_layout->rl_count);
+
+	if (dict->rd_slots[index] != NULL)
+		rpc_release_impl(dict->rd_slots[index]);
+	else
+		dict->rd_count++;
+
+	dict->rd_slots[index] = value;
+}
+
+rpc_object_t
+rpc_dict_lookup_slot(struct rpc_dict *dict, const struct rpct_layout *layout,
+    guint index)
+{
+
+	if (dict->rd_layout == layout)
+		return (dict->rd_slots[index]);
+
+	return (rpc_dict_lookup(dict, layout->rl_names[index]));
+}
+
+void
+rpc_dict_free(struct rpc_dict *dict)
+{
+
+	rpc_dict_remove_all(dict);
+	if (dict->rd_table != NULL)
+		g_hash_table_unref(dict->rd_table);
+
+	g_free(dict->rd_slots);
+	g_free(dict);
+}
+
+void
+rpc_dict_insert(struct rpc_dict *dict, char *key, rpc_object_t value)
+{
+	struct rpc_dict_entry *entry;
+	gint idx;
+
+	if (dict->rd_layout != NULL) {
+		idx = rpc_dict_slot_index(dict->rd_layout, key);
+		if (idx >= 0) {
+			g_free(key);
+			rpc_dict_set_slot(dict, (guint)idx, value);
+			return;
+		}
+
+		rpc_dict_unslot(dict);
+	}
+
+	if (dict->rd_table == NULL) {
+		entry = rpc_dict_find(dict, key);
+		if (entry != NULL) {
+			/* Same as g_hash_table_insert(): keep the old key */
+			g_free(key);
+			rpc_release_impl(entry->rde_value);
+			entry->rde_value = value;
+			return;
+		}
+
+		if (dict->rd_count < RPC_DICT_SMALL_MAX) {
+			rpc_dict_append(dict, key, false, value);
+			return;
+		}
+
+		rpc_dict_upgrade(dict);
+	}
+
+	g_hash_table_insert(dict->rd_table, key, value);
+}
+
+void
+rpc_dict_insert_key(struct rpc_dict *dict, rpc_key_t key, rpc_object_t value)
+{
+	struct rpc_dict_entry *entry;
+	gint idx;
+
+	if (dict->rd_layout != NULL) {
+		idx = rpc_dict_slot_index(dict->rd_layout, key->rk_str);
+		if (idx >= 0) {
+			rpc_dict_set_slot(dict, (guint)idx, value);
+			return;
+		}
+
+		rpc_dict_unslot(dict);
+	}
+
+	if (dict->rd_table == NULL) {
+		entry = rpc_dict_find_key(dict, key);
+		if (entry != NULL) {
+			rpc_release_impl(entry->rde_value);
+			entry->rde_value = value;
+			return;
+		}
+
+		if (dict->rd_count < RPC_DICT_SMALL_MAX) {
+			rpc_dict_append(dict, (char *)key->rk_str, true, value);
+			return;
+		}
+
+		rpc_dict_upgrade(dict);
+	}
+
+	g_hash_table_insert(dict->rd_table, g_strdup(key->rk_str), value);
+}
+
+/*
+ * Inserts a value at a key that isn't NUL-terminated, sharing the
+ * interned copy of the key if there is one.
+ */
+void
+rpc_dict_insert_str(struct rpc_dict *dict, const char *key, size_t len,
+    rpc_object_t value)
+{
+	rpc_key_t ikey;
+
+	ikey = rpc_key_lookup(key, len);
+	if (ikey != NULL)
+		rpc_dict_insert_key(dict, ikey, value);
+	else
+		rpc_dict_insert(dict, g_strndup(key, len), value);
+}
+
+rpc_object_t
+rpc_dict_lookup_key(struct rpc_dict *dict, rpc_key_t key)
+{
+	struct rpc_dict_entry *entry;
+	gint idx;
+
+	if (dict->rd_layout != NULL) {
+		idx = rpc_dict_slot_index(dict->rd_layout, key->rk_str);
+		return (idx >= 0 ? dict->rd_slots[idx] : NULL);
+	}
+
+	if (dict->rd_table != NULL)
+		return (g_hash_table_lookup(dict->rd_table, key->rk_str));
+
+	entry = rpc_dict_find_key(dict, key);
+	return (entry != NULL ? entry->rde_value : NULL);
+}
+
+rpc_object_t
+rpc_dict_lookup(struct rpc_dict *dict, const char *key)
+{
+	struct rpc_dict_entry *entry;
+	gint idx;
+
+	if (dict->rd_layout != NULL) {
+		idx = rpc_dict_slot_index(dict->rd_layout, key);
+		return (idx >= 0 ? dict->rd_slots[idx] : NULL);
+	}
+
+	if (dict->rd_table != NULL)
+		return (g_hash_table_lookup(dict->rd_table, key));
+
+	entry = rpc_dict_find(dict, key);
+	return (entry != NULL ? entry->rde_value : NULL);
+}
+
+bool
+rpc_dict_remove(struct rpc_dict *dict, const char *key)
+{
+	struct rpc_dict_entry *entry;
+	rpc_object_t value;
+	char *okey;
+	guint idx;
+	guint low;
+	gint slot;
+	bool interned;
+
+	if (dict->rd_layout != NULL) {
+		slot = rpc_dict_slot_index(dict->rd_layout, key);
+		if (slot < 0 || dict->rd_slots[slot] == NULL)
+			return (false);
+
+		rpc_release_impl(dict->rd_slots[slot]);
+		dict->rd_slots[slot] = NULL;
+		dict->rd_count--;
+		return (true);
+	}
+
+	if (dict->rd_table != NULL)
+		return (g_hash_table_remove(dict->rd_table, key));
+
+	entry = rpc_dict_find(dict, key);
+	if (entry == NULL)
+		return (false);
+
+	/* Keep insertion order */
+	okey = entry->rde_key;
+	value = entry->rde_value;
+	idx = (guint)(entry - dict->rd_entries);
+	interned = (dict->rd_interned & (1u << idx)) != 0;
+	memmove(entry, entry + 1,
+	    (dict->rd_count - idx - 1) * sizeof(*entry));
+	dict->rd_count--;
+
+	low = (1u << idx) - 1;
+	dict->rd_interned = (dict->rd_interned & low) |
+	    ((dict->rd_interned >> 1) & ~low);
+
+	if (!interned)
+		g_free(okey);
+
+	rpc_release_impl(value);
+	return (true);
+}
+
+void
+rpc_dict_remove_all(struct rpc_dict *dict)
+{
+	guint i;
+
+	if (dict->rd_layout != NULL) {
+		for (i = 0; i < dict->rd_layout->rl_count; i++) {
+			if (dict->rd_slots[i] != NULL)
+				rpc_release_impl(dict->rd_slots[i]);
+
+			dict->rd_slots[i] = NULL;
+		}
+
+		dict->rd_count = 0;
+		return;
+	}
+
+	if (dict->rd_table != NULL) {
+		/* Compact dicts have nowhere else to put entries */
+		if (dict->rd_compact) {
+			g_hash_table_remove_all(dict->rd_table);
+			return;
+		}
+
+		g_hash_table_unref(dict->rd_table);
+		dict->rd_table = NULL;
+		return;
+	}
+
+	for (i = 0; i < dict->rd_count; i++) {
+		if (!(dict->rd_interned & (1u << i)))
+			g_free(dict->rd_entries[i].rde_key);
+
+		rpc_release_impl(dict->rd_entries[i].rde_value);
+	}
+
+	dict->rd_count = 0;
+	dict->rd_interned = 0;
+}
+
+size_t
+rpc_dict_count(struct rpc_dict *dict)
+{
+
+	if (dict->rd_layout == NULL && dict->rd_table != NULL)
+		return ((size_t)g_hash_table_size(dict->rd_table));
+
+	return ((size_t)dict->rd_count);
+}
+
+void
+rpc_dict_iter_init(struct rpc_dict_iter *iter, struct rpc_dict *dict)
+{
+
+	iter->rdi_dict = dict;
+	iter->rdi_index = 0;
+	if (dict->rd_layout == NULL && dict->rd_table != NULL)
+		g_hash_table_iter_init(&iter->rdi_iter, dict->rd_table);
+}
+
+bool
+rpc_dict_iter_next(struct rpc_dict_iter *iter, const char **key,
+    rpc_object_t *value)
+{
+	struct rpc_dict *dict = iter->rdi_dict;
+	struct rpc_dict_entry *entry;
+
+	if (dict->rd_layout != NULL) {
+		while (iter->rdi_index < dict->rd_layout->rl_count) {
+			*value = dict->rd_slots[iter->rdi_index];
+			*key = dict->rd_layout->rl_names[iter->rdi_index++];
+			if (*value != NULL)
+				return (true);
+		}
+
+		return (false);
+	}
+
+	if (dict->rd_table != NULL) {
+		return (g_hash_table_iter_next(&iter->rdi_iter,
+		    (gpointer *)key, (gpointer *)value));
+	}
+
+	if (iter->rdi_index >= dict->rd_count)
+		return (false);
+
+	entry = &dict->rd_entries[iter->rdi_index++];
+	*key = entry->rde_key;
+	*value = entry->rde_value;
+	return (true);
+}
+
+void
+rpc_dict_iter_replace(struct rpc_dict_iter *iter, rpc_object_t value)
+{
+	struct rpc_dict *dict = iter->rdi_dict;
+	struct rpc_dict_entry *entry;
+
+	if (dict->rd_layout != NULL) {
+		rpc_release_impl(dict->rd_slots[iter->rdi_index - 1]);
+		dict->rd_slots[iter->rdi_index - 1] = value;
+		return;
+	}
+
+	if (dict->rd_table != NULL) {
+		g_hash_table_iter_replace(&iter->rdi_iter, value);
+		return;
+	}
+
+	entry = &dict->rd_entries[iter->rdi_index - 1];
+	rpc_release_impl(entry->rde_value);
+	entry->rde_value = value;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Epoch-based reclamation for read-mostly structures.
+ *
+ * Readers bracket their accesses with rpc_epoch_enter() and
+ * rpc_epoch_exit(), which only touch the calling thread's own record.
+ * Writers publish a new version of a structure and hand the old one
+ * to rpc_epoch_retire(). It gets destroyed once the global epoch has
+ * moved on twice, which can only happen after every reader that
+ * might have seen it has left its critical section.
+ */
+
+struct rpc_epoch_thread
+{
+	volatile int		ret_active;
+	volatile int		ret_epoch;
+	guint			ret_depth;
+};
+
+struct rpc_epoch_garbage
+{
+	void *			reg_ptr;
+	GDestroyNotify		reg_fn;
+	int			reg_epoch;
+};
+
+static struct rpc_epoch_thread *rpc_epoch_self_get(void);
+static void rpc_epoch_thread_exit(gpointer);
+static bool rpc_epoch_advance(void);
+
+static volatile int rpc_epoch_global;
+static GMutex rpc_epoch_mtx;
+static GPtrArray *rpc_epoch_threads;
+static GQueue rpc_epoch_limbo = G_QUEUE_INIT;
+static GPrivate rpc_epoch_self = G_PRIVATE_INIT(rpc_epoch_thread_exit);
+
+static struct rpc_epoch_thread *
+rpc_epoch_self_get(void)
+{
+	struct rpc_epoch_thread *self;
+
+	self = g_private_get(&rpc_epoch_self);
+	if (self != NULL)
+		return (self);
+
+	self = g_malloc0(sizeof(*self));
+	g_mutex_lock(&rpc_epoch_mtx);
+	if (rpc_epoch_threads == NULL)
+		rpc_epoch_threads = g_ptr_array_new();
+
+	g_ptr_array_add(rpc_epoch_threads, self);
+	g_mutex_unlock(&rpc_epoch_mtx);
+	g_private_set(&rpc_epoch_self, self);
+	return (self);
+}
+
+static void
+rpc_epoch_thread_exit(gpointer data)
+{
+	struct rpc_epoch_thread *self = data;
+
+	g_mutex_lock(&rpc_epoch_mtx);
+	g_ptr_array_remove_fast(rpc_epoch_threads, self);
+	g_mutex_unlock(&rpc_epoch_mtx);
+	g_free(self);
+}
+
+/* Called with rpc_epoch_mtx held */
+static bool
+rpc_epoch_advance(void)
+{
+	struct rpc_epoch_thread *thread;
+	int epoch = g_atomic_int_get(&rpc_epoch_global);
+	guint i;
+
+	for (i = 0; rpc_epoch_threads != NULL &&
+	    i < rpc_epoch_threads->len; i++) {
+		thread = g_ptr_array_index(rpc_epoch_threads, i);
+		if (g_atomic_int_get(&thread->ret_active) &&
+		    g_atomic_int_get(&thread->ret_epoch) != epoch)
+			return (false);
+	}
+
+	g_atomic_int_set(&rpc_epoch_global, epoch + 1);
+	return (true);
+}
+
+void
+rpc_epoch_enter(void)
+{
+	struct rpc_epoch_thread *self = rpc_epoch_self_get();
+
+	if (self->ret_depth++ > 0)
+		return;
+
+	g_atomic_int_set(&self->ret_epoch,
+	    g_atomic_int_get(&rpc_epoch_global));
+	g_atomic_int_set(&self->ret_active, true);
+}
+
+void
+rpc_epoch_exit(void)
+{
+	struct rpc_epoch_thread *self = g_private_get(&rpc_epoch_self);
+
+	g_assert(self != NULL && self->ret_depth > 0);
+	if (--self->ret_depth > 0)
+		return;
+
+	g_atomic_int_set(&self->ret_active, false);
+}
+
+void
+rpc_epoch_retire(void *ptr, GDestroyNotify fn)
+{
+	struct rpc_epoch_garbage *garbage;
+	GQueue ready = G_QUEUE_INIT;
+	int epoch;
+	int i;
+
+	garbage = g_malloc(sizeof(*garbage));
+	garbage->reg_ptr = ptr;
+	garbage->reg_fn = fn;
+
+	g_mutex_lock(&rpc_epoch_mtx);
+	garbage->reg_epoch = g_atomic_int_get(&rpc_epoch_global);
+	g_queue_push_tail(&rpc_epoch_limbo, garbage);
+
+	/* Two steps are needed before the new garbage can go */
+	for (i = 0; i < 2; i++) {
+		if (!rpc_epoch_advance())
+			break;
+	}
+
+	epoch = g_atomic_int_get(&rpc_epoch_global);
+	while ((garbage = g_queue_peek_head(&rpc_epoch_limbo)) != NULL) {
+		if (epoch - garbage->reg_epoch < 2)
+			break;
+
+		g_queue_push_tail(&ready, g_queue_pop_head(&rpc_epoch_limbo));
+	}
+
+	g_mutex_unlock(&rpc_epoch_mtx);
+
+	while ((garbage = g_queue_pop_head(&ready)) != NULL) {
+		garbage->reg_fn(garbage->reg_ptr);
+		g_free(garbage);
+	}
+}
@@ -0,0 +1,594 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <rpc/object.h>
+#include <rpc/connection.h>
+#include "internal.h"
+#include "serializer/msgpack.h"
+
+/*
+ * Event groups put a server's broadcast events on a UDP multicast
+ * group, so that the cost of fanning an event out no longer grows with
+ * the number of subscribers on the same network. The group is
+ * announced along with the other connection options; clients that
+ * asked for it join the group and tell the server, which from then on
+ * leaves them out of the unicast fan-out.
+ *
+ * Datagrams are numbered. A member that sees a gap, or learns from the
+ * periodic heartbeat that it missed the tail, asks for the missing
+ * sequence numbers over its connection, and the server resends them
+ * from a ring of recent events as ordinary unicast events. Events that
+ * can't go out as a single datagram, because they carry descriptors or
+ * are too large, are sent over every connection as before.
+ */
+
+#define	RPC_EVENT_GROUP_MAGIC		0x52504345	/* "RPCE" */
+#define	RPC_EVENT_GROUP_RING		1024
+#define	RPC_EVENT_GROUP_TTL		1
+#define	RPC_EVENT_GROUP_MAX_PAYLOAD	1400
+#define	RPC_EVENT_GROUP_HEARTBEAT	1	/* seconds */
+#define	RPC_EVENT_GROUP_HEADER		24
+
+enum rpc_event_group_kind
+{
+	RPC_EVENT_GROUP_EVENT = 0,
+	RPC_EVENT_GROUP_HEARTBEAT,
+};
+
+struct rpc_event_group_slot
+{
+	uint64_t		regs_seq;
+	struct rpc_shared_event *regs_event;
+};
+
+struct rpc_event_group
+{
+	GSocket *		reg_socket;
+	GSocketAddress *	reg_address;
+	char *			reg_name;
+	uint64_t		reg_id;
+	size_t			reg_max_payload;
+	GSource *		reg_heartbeat;
+	GMutex			reg_mtx;
+	uint64_t		reg_next;
+	struct rpc_event_group_slot reg_ring[RPC_EVENT_GROUP_RING];
+};
+
+struct rpc_event_member
+{
+	volatile int		rem_refcnt;
+	GMutex			rem_mtx;
+	rpc_connection_t	rem_conn;
+	GSocket *		rem_socket;
+	GSource *		rem_source;
+	uint64_t		rem_id;
+	uint64_t		rem_next;
+	bool			rem_synced;
+};
+
+static void
+rpc_event_group_header(uint8_t *buf, enum rpc_event_group_kind kind,
+    uint64_t id, uint64_t seq)
+{
+	guint32 magic = GUINT32_TO_BE(RPC_EVENT_GROUP_MAGIC);
+
+	memset(buf, 0, RPC_EVENT_GROUP_HEADER);
+	memcpy(buf, &magic, sizeof(magic));
+	buf[4] = (uint8_t)kind;
+	id = GUINT64_TO_BE(id);
+	seq = GUINT64_TO_BE(seq);
+	memcpy(buf + 8, &id, sizeof(id));
+	memcpy(buf + 16, &seq, sizeof(seq));
+}
+
+static bool
+rpc_event_group_parse_header(const uint8_t *buf, size_t len,
+    enum rpc_event_group_kind *kind, uint64_t *id, uint64_t *seq)
+{
+	guint32 magic;
+
+	if (len < RPC_EVENT_GROUP_HEADER)
+		return (false);
+
+	memcpy(&magic, buf, sizeof(magic));
+	if (GUINT32_FROM_BE(magic) != RPC_EVENT_GROUP_MAGIC)
+		return (false);
+
+	*kind = (enum rpc_event_group_kind)buf[4];
+	memcpy(id, buf + 8, sizeof(*id));
+	memcpy(seq, buf + 16, sizeof(*seq));
+	*id = GUINT64_FROM_BE(*id);
+	*seq = GUINT64_FROM_BE(*seq);
+	return (true);
+}
+
+/*
+ * Accepts "address:port", with IPv6 addresses in brackets, and returns
+ * the multicast address along with the port.
+ */
+static GInetAddress *
+rpc_event_group_parse_name(const char *name, guint16 *port)
+{
+	GSocketConnectable *addr;
+	GInetAddress *result;
+	GError *err = NULL;
+
+	addr = g_network_address_parse(name, 0, &err);
+	if (addr == NULL) {
+		rpc_set_last_errorf(EINVAL, "Invalid event group %s: %s", name,
+		    err->message);
+		g_error_free(err);
+		return (NULL);
+	}
+
+	*port = g_network_address_get_port(G_NETWORK_ADDRESS(addr));
+	result = g_inet_address_new_from_string(
+	    g_network_address_get_hostname(G_NETWORK_ADDRESS(addr)));
+	g_object_unref(addr);
+
+	if (result == NULL || *port == 0 ||
+	    !g_inet_address_get_is_multicast(result)) {
+		rpc_set_last_errorf(EINVAL,
+		    "Event group %s is not a multicast address and port", name);
+		if (result != NULL)
+			g_object_unref(result);
+
+		return (NULL);
+	}
+
+	return (result);
+}
+
+static gboolean
+rpc_event_group_heartbeat(gpointer arg)
+{
+	struct rpc_event_group *group = arg;
+	uint8_t buf[RPC_EVENT_GROUP_HEADER];
+	uint64_t next;
+
+	g_mutex_lock(&group->reg_mtx);
+	next = group->reg_next;
+	g_mutex_unlock(&group->reg_mtx);
+
+	/* Nothing sent yet, so nothing a member could have missed */
+	if (next == 0)
+		return (G_SOURCE_CONTINUE);
+
+	rpc_event_group_header(buf, RPC_EVENT_GROUP_HEARTBEAT, group->reg_id,
+	    next);
+	g_socket_send_to(group->reg_socket, group->reg_address,
+	    (const gchar *)buf, sizeof(buf), NULL, NULL);
+	return (G_SOURCE_CONTINUE);
+}
+
+/*
+ * Params are the server ones: {"event_group": "address:port",
+ * "event_group_ttl": int, "event_group_max": int}, the latter being
+ * the largest event payload to send as a datagram.
+ */
+struct rpc_event_group *
+rpc_event_group_create(GMainContext *context, rpc_object_t params)
+{
+	struct rpc_event_group *group;
+	GInetAddress *address;
+	GSocket *sock;
+	GError *err = NULL;
+	const char *name = NULL;
+	int64_t ttl = RPC_EVENT_GROUP_TTL;
+	int64_t max_payload = RPC_EVENT_GROUP_MAX_PAYLOAD;
+	guint16 port;
+
+	rpc_object_unpack(params, "{event_group:s,event_group_ttl:i,"
+	    "event_group_max:i}", &name, &ttl, &max_payload);
+
+	if (name == NULL) {
+		rpc_set_last_errorf(EINVAL, "event_group must be a string");
+		return (NULL);
+	}
+
+	if (ttl < 0 || ttl > 255 || max_payload <= 0 ||
+	    max_payload > 65507 - RPC_EVENT_GROUP_HEADER) {
+		rpc_set_last_errorf(EINVAL, "Invalid event group options");
+		return (NULL);
+	}
+
+	address = rpc_event_group_parse_name(name, &port);
+	if (address == NULL)
+		return (NULL);
+
+	sock = g_socket_new(g_inet_address_get_family(address),
+	    G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &err);
+	if (sock == NULL) {
+		rpc_set_last_errorf(EIO, "Cannot create event group socket: %s",
+		    err->message);
+		g_error_free(err);
+		g_object_unref(address);
+		return (NULL);
+	}
+
+	/* A full socket buffer costs a datagram, never the broadcaster */
+	g_socket_set_blocking(sock, false);
+	g_socket_set_multicast_ttl(sock, (guint)ttl);
+	g_socket_set_multicast_loopback(sock, true);
+
+	group = g_malloc0(sizeof(*group));
+	group->reg_socket = sock;
+	group->reg_address = g_inet_socket_address_new(address, port);
+	group->reg_name = g_strdup(name);
+	group->reg_id = ((uint64_t)g_random_int() << 32) | g_random_int();
+	group->reg_max_payload = (size_t)max_payload;
+	g_mutex_init(&group->reg_mtx);
+	g_object_unref(address);
+
+	group->reg_heartbeat = g_timeout_source_new_seconds(
+	    RPC_EVENT_GROUP_HEARTBEAT);
+	g_source_set_callback(group->reg_heartbeat, rpc_event_group_heartbeat,
+	    group, NULL);
+	g_source_attach(group->reg_heartbeat, context);
+
+	return (group);
+}
+
+/*
+ * Must only be called once the heartbeat can no longer fire, that is
+ * with the server worker thread gone.
+ */
+void
+rpc_event_group_free(struct rpc_event_group *group)
+{
+	guint i;
+
+	if (group == NULL)
+		return;
+
+	g_source_destroy(group->reg_heartbeat);
+	g_source_unref(group->reg_heartbeat);
+
+	for (i = 0; i < RPC_EVENT_GROUP_RING; i++) {
+		if (group->reg_ring[i].regs_event != NULL)
+			rpc_shared_event_release(group->reg_ring[i].regs_event);
+	}
+
+	g_socket_close(group->reg_socket, NULL);
+	g_object_unref(group->reg_socket);
+	g_object_unref(group->reg_address);
+	g_mutex_clear(&group->reg_mtx);
+	g_free(group->reg_name);
+	g_free(group);
+}
+
+const char *
+rpc_event_group_name(struct rpc_event_group *group)
+{
+
+	return (group->reg_name);
+}
+
+uint64_t
+rpc_event_group_id(struct rpc_event_group *group)
+{
+
+	return (group->reg_id);
+}
+
+/*
+ * Numbers the event and sends it to the group. Returns false, without
+ * using up a sequence number, if it can't go out as a datagram; a
+ * failed send is not reported, members recover from it like from any
+ * other lost datagram.
+ */
+bool
+rpc_event_group_publish(struct rpc_event_group *group,
+    struct rpc_shared_event *ev, uint64_t *seqp)
+{
+	struct rpc_event_group_slot *slot;
+	void *payload = NULL;
+	uint8_t *buf;
+	size_t len = 0;
+	size_t nfds = 0;
+	uint64_t seq;
+	int fd;
+
+	/* No room for descriptors makes the serializer refuse them */
+	if (rpc_msgpack_serialize_typed(rpc_shared_event_get(ev), &payload,
+	    &len, &fd, &nfds) != 0)
+		return (false);
+
+	if (len > group->reg_max_payload) {
+		free(payload);
+		return (false);
+	}
+
+	buf = g_malloc(RPC_EVENT_GROUP_HEADER + len);
+	memcpy(buf + RPC_EVENT_GROUP_HEADER, payload, len);
+	free(payload);
+
+	g_mutex_lock(&group->reg_mtx);
+	seq = group->reg_next++;
+	slot = &group->reg_ring[seq % RPC_EVENT_GROUP_RING];
+	if (slot->regs_event != NULL)
+		rpc_shared_event_release(slot->regs_event);
+
+	slot->regs_seq = seq;
+	slot->regs_event = ev;
+	rpc_shared_event_retain(ev);
+
+	/* Sent under the lock, so that datagrams leave in sequence order */
+	rpc_event_group_header(buf, RPC_EVENT_GROUP_EVENT, group->reg_id, seq);
+	g_socket_send_to(group->reg_socket, group->reg_address,
+	    (const gchar *)buf, RPC_EVENT_GROUP_HEADER + len, NULL, NULL);
+	g_mutex_unlock(&group->reg_mtx);
+
+	g_free(buf);
+	*seqp = seq;
+	return (true);
+}
+
+/*
+ * Switches a server connection over to the group. Events numbered from
+ * the returned sequence number on are left to multicast; the ones
+ * before it still go out over the connection.
+ */
+uint64_t
+rpc_event_group_join(struct rpc_event_group *group, rpc_connection_t conn)
+{
+	uint64_t seq;
+
+	g_mutex_lock(&group->reg_mtx);
+	seq = group->reg_next;
+	conn->rco_event_from = seq;
+	g_atomic_int_set(&conn->rco_event_joined, true);
+	g_mutex_unlock(&group->reg_mtx);
+
+	return (seq);
+}
+
+/*
+ * Resends events still in the ring over the connection. Ones that have
+ * already dropped out of it are lost to the member.
+ */
+void
+rpc_event_group_repair(struct rpc_event_group *group, rpc_connection_t conn,
+    uint64_t from, uint64_t to)
+{
+	struct rpc_event_group_slot *slot;
+	struct rpc_shared_event *ev;
+	uint64_t seq;
+
+	if (to < from)
+		return;
+
+	if (to - from >= RPC_EVENT_GROUP_RING)
+		from = to - RPC_EVENT_GROUP_RING + 1;
+
+	for (seq = from; seq <= to; seq++) {
+		ev = NULL;
+		g_mutex_lock(&group->reg_mtx);
+		slot = &group->reg_ring[seq % RPC_EVENT_GROUP_RING];
+		if (seq < group->reg_next && slot->regs_seq == seq &&
+		    slot->regs_event != NULL) {
+			ev = slot->regs_event;
+			rpc_shared_event_retain(ev);
+		}
+		g_mutex_unlock(&group->reg_mtx);
+
+		if (ev != NULL) {
+			rpc_connection_post_event(conn, ev);
+			rpc_shared_event_release(ev);
+		}
+
+		if (seq == UINT64_MAX)
+			break;
+	}
+}
+
+static void
+rpc_event_member_release(struct rpc_event_member *member)
+{
+
+	if (!g_atomic_int_dec_and_test(&member->rem_refcnt))
+		return;
+
+	g_socket_close(member->rem_socket, NULL);
+	g_object_unref(member->rem_socket);
+	g_mutex_clear(&member->rem_mtx);
+	g_free(member);
+}
+
+/* Called with rem_mtx held */
+static void
+rpc_event_member_repair(struct rpc_event_member *member, uint64_t from,
+    uint64_t to)
+{
+
+	if (to - from >= RPC_EVENT_GROUP_RING)
+		from = to - RPC_EVENT_GROUP_RING + 1;
+
+	rpc_connection_send_event_repair(member->rem_conn, from, to);
+}
+
+static gboolean
+rpc_event_member_recv(GSocket *sock, GIOCondition cond __unused,
+    gpointer arg)
+{
+	struct rpc_event_member *member = arg;
+	enum rpc_event_group_kind kind;
+	rpc_connection_t conn;
+	rpc_object_t event;
+	uint8_t buf[65536];
+	gssize len;
+	uint64_t id;
+	uint64_t seq;
+
+	len = g_socket_receive(sock, (gchar *)buf, sizeof(buf), NULL, NULL);
+	if (len <= 0)
+		return (G_SOURCE_CONTINUE);
+
+	g_mutex_lock(&member->rem_mtx);
+	conn = member->rem_conn;
+	if (conn == NULL || rpc_connection_retain_if_valid(conn, true) != 0) {
+		g_mutex_unlock(&member->rem_mtx);
+		return (G_SOURCE_CONTINUE);
+	}
+
+	/* Until the server says where we start, everything is unicast */
+	if (!member->rem_synced ||
+	    !rpc_event_group_parse_header(buf, (size_t)len, &kind, &id, &seq) ||
+	    id != member->rem_id)
+		goto done;
+
+	if (kind == RPC_EVENT_GROUP_HEARTBEAT) {
+		if (seq > member->rem_next) {
+			rpc_event_member_repair(member, member->rem_next,
+			    seq - 1);
+			member->rem_next = seq;
+		}
+
+		goto done;
+	}
+
+	if (kind != RPC_EVENT_GROUP_EVENT || seq < member->rem_next)
+		goto done;
+
+	if (seq > member->rem_next)
+		rpc_event_member_repair(member, member->rem_next, seq - 1);
+
+	member->rem_next = seq + 1;
+	event = rpc_msgpack_deserialize_typed(buf + RPC_EVENT_GROUP_HEADER,
+	    (size_t)len - RPC_EVENT_GROUP_HEADER);
+	if (event != NULL) {
+		rpc_connection_deliver_event(conn, event);
+		rpc_release(event);
+	}
+
+done:
+	/* The last reference going away detaches us, so drop it unlocked */
+	g_mutex_unlock(&member->rem_mtx);
+	rpc_connection_release(conn);
+	return (G_SOURCE_CONTINUE);
+}
+
+/*
+ * Joins the group a server announced. Datagrams are read from the
+ * client's main context and ignored until rpc_event_member_synced().
+ */
+struct rpc_event_member *
+rpc_event_member_create(rpc_connection_t conn, const char *name, uint64_t id)
+{
+	struct rpc_event_member *member;
+	GInetAddress *address;
+	GInetAddress *any;
+	GSocketAddress *bind_addr;
+	GSocket *sock;
+	GError *err = NULL;
+	guint16 port;
+
+	address = rpc_event_group_parse_name(name, &port);
+	if (address == NULL)
+		return (NULL);
+
+	sock = g_socket_new(g_inet_address_get_family(address),
+	    G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &err);
+	if (sock == NULL)
+		goto fail;
+
+	/* Every client on the host binds the same port */
+	any = g_inet_address_new_any(g_inet_address_get_family(address));
+	bind_addr = g_inet_socket_address_new(any, port);
+	g_object_unref(any);
+
+	if (!g_socket_bind(sock, bind_addr, true, &err)) {
+		g_object_unref(bind_addr);
+		goto fail;
+	}
+
+	g_object_unref(bind_addr);
+	if (!g_socket_join_multicast_group(sock, address, false, NULL, &err))
+		goto fail;
+
+	g_socket_set_blocking(sock, false);
+	g_object_unref(address);
+
+	member = g_malloc0(sizeof(*member));
+	member->rem_refcnt = 2;		/* the connection and the source */
+	member->rem_conn = conn;
+	member->rem_socket = sock;
+	member->rem_id = id;
+	g_mutex_init(&member->rem_mtx);
+
+	member->rem_source = g_socket_create_source(sock, G_IO_IN, NULL);
+	g_source_set_callback(member->rem_source,
+	    (GSourceFunc)rpc_event_member_recv, member,
+	    (GDestroyNotify)rpc_event_member_release);
+	g_source_attach(member->rem_source,
+	    rpc_connection_get_main_context(conn));
+
+	return (member);
+
+fail:
+	rpc_set_last_errorf(EIO, "Cannot join event group %s: %s", name,
+	    err != NULL ? err->message : "unknown error");
+	if (err != NULL)
+		g_error_free(err);
+
+	if (sock != NULL)
+		g_object_unref(sock);
+
+	g_object_unref(address);
+	return (NULL);
+}
+
+void
+rpc_event_member_synced(struct rpc_event_member *member, uint64_t seq)
+{
+
+	g_mutex_lock(&member->rem_mtx);
+	member->rem_next = seq;
+	member->rem_synced = true;
+	g_mutex_unlock(&member->rem_mtx);
+}
+
+/*
+ * Detaches the member from its connection, which the callback may no
+ * longer touch once this returns, and drops the connection's reference.
+ */
+void
+rpc_event_member_detach(struct rpc_event_member *member)
+{
+
+	g_mutex_lock(&member->rem_mtx);
+	member->rem_conn = NULL;
+	g_mutex_unlock(&member->rem_mtx);
+
+	g_source_destroy(member->rem_source);
+	g_source_unref(member->rem_source);
+	rpc_event_member_release(member);
+}
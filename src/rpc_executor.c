@@ -0,0 +1,204 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Process-wide executor for connection callbacks.
+ *
+ * Every connection owns a serial queue of tasks. A queue with pending
+ * tasks is put on a single run queue shared by all workers, and only
+ * ever runs on one worker at a time, which keeps callbacks of a given
+ * connection in order. A worker runs at most RPC_EXECUTOR_BATCH tasks
+ * of a queue before moving it to the back of the run queue, so that a
+ * busy connection can't starve the others.
+ */
+
+#define	RPC_EXECUTOR_MIN_THREADS	4
+#define	RPC_EXECUTOR_BATCH		32
+
+struct rpc_executor_task
+{
+	rpc_executor_fn_t	ret_fn;
+	void *			ret_item;
+};
+
+struct rpc_executor_queue
+{
+	volatile int		req_refcnt;
+	GMutex			req_mtx;
+	GQueue			req_tasks;
+	bool			req_scheduled;
+	bool			req_dead;
+	void *			req_arg;
+};
+
+static gpointer rpc_executor_start(gpointer);
+static gpointer rpc_executor_worker(gpointer);
+static void rpc_executor_run(struct rpc_executor_queue *);
+static void rpc_executor_queue_unref(struct rpc_executor_queue *);
+
+static GAsyncQueue *rpc_executor_runq;
+
+static gpointer
+rpc_executor_start(gpointer data __unused)
+{
+	guint nthreads;
+	guint i;
+
+	nthreads = MAX(g_get_num_processors(), RPC_EXECUTOR_MIN_THREADS);
+	rpc_executor_runq = g_async_queue_new();
+
+	for (i = 0; i < nthreads; i++)
+		g_thread_unref(g_thread_new("librpc callback",
+		    rpc_executor_worker, NULL));
+
+	return (NULL);
+}
+
+static gpointer
+rpc_executor_worker(gpointer data __unused)
+{
+
+	for (;;)
+		rpc_executor_run(g_async_queue_pop(rpc_executor_runq));
+
+	return (NULL);
+}
+
+static void
+rpc_executor_run(struct rpc_executor_queue *queue)
+{
+	struct rpc_executor_task *task;
+	guint i;
+
+	for (i = 0; i < RPC_EXECUTOR_BATCH; i++) {
+		g_mutex_lock(&queue->req_mtx);
+		task = queue->req_dead ? NULL :
+		    g_queue_pop_head(&queue->req_tasks);
+		if (task == NULL) {
+			queue->req_scheduled = false;
+			g_mutex_unlock(&queue->req_mtx);
+			rpc_executor_queue_unref(queue);
+			return;
+		}
+
+		g_mutex_unlock(&queue->req_mtx);
+		task->ret_fn(task->ret_item, queue->req_arg);
+		g_free(task);
+	}
+
+	/* Still busy; requeue, holding on to the reference for the run queue */
+	g_mutex_lock(&queue->req_mtx);
+	if (!queue->req_dead && !g_queue_is_empty(&queue->req_tasks)) {
+		g_mutex_unlock(&queue->req_mtx);
+		g_async_queue_push(rpc_executor_runq, queue);
+		return;
+	}
+
+	queue->req_scheduled = false;
+	g_mutex_unlock(&queue->req_mtx);
+	rpc_executor_queue_unref(queue);
+}
+
+static void
+rpc_executor_queue_unref(struct rpc_executor_queue *queue)
+{
+	struct rpc_executor_task *task;
+
+	if (!g_atomic_int_dec_and_test(&queue->req_refcnt))
+		return;
+
+	while ((task = g_queue_pop_head(&queue->req_tasks)) != NULL)
+		g_free(task);
+
+	g_mutex_clear(&queue->req_mtx);
+	g_free(queue);
+}
+
+struct rpc_executor_queue *
+rpc_executor_queue_create(void *arg)
+{
+	struct rpc_executor_queue *queue;
+
+	queue = g_malloc0(sizeof(*queue));
+	queue->req_refcnt = 1;
+	queue->req_arg = arg;
+	g_mutex_init(&queue->req_mtx);
+	g_queue_init(&queue->req_tasks);
+	return (queue);
+}
+
+/*
+ * The worker threads are started by the first task pushed, so that
+ * connections which never run a callback don't start them.
+ */
+bool
+rpc_executor_queue_push(struct rpc_executor_queue *queue,
+    rpc_executor_fn_t fn, void *item)
+{
+	static GOnce once = G_ONCE_INIT;
+	struct rpc_executor_task *task;
+
+	g_mutex_lock(&queue->req_mtx);
+	if (queue->req_dead) {
+		g_mutex_unlock(&queue->req_mtx);
+		return (false);
+	}
+
+	task = g_malloc(sizeof(*task));
+	task->ret_fn = fn;
+	task->ret_item = item;
+	g_queue_push_tail(&queue->req_tasks, task);
+
+	if (queue->req_scheduled) {
+		g_mutex_unlock(&queue->req_mtx);
+		return (true);
+	}
+
+	queue->req_scheduled = true;
+	g_atomic_int_inc(&queue->req_refcnt);
+	g_mutex_unlock(&queue->req_mtx);
+	g_once(&once, rpc_executor_start, NULL);
+	g_async_queue_push(rpc_executor_runq, queue);
+	return (true);
+}
+
+/*
+ * Tasks that haven't run yet are dropped. A task that is running at the
+ * time finishes on its own; the queue lives on until it does.
+ */
+void
+rpc_executor_queue_destroy(struct rpc_executor_queue *queue)
+{
+
+	g_mutex_lock(&queue->req_mtx);
+	queue->req_dead = true;
+	g_mutex_unlock(&queue->req_mtx);
+	rpc_executor_queue_unref(queue);
+}
@@ -0,0 +1,468 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Hot restart.
+ *
+ * The old process connects to a Unix socket the new one listens on and
+ * passes it, as descriptors in ordinary calls, first copies of its
+ * listening sockets and then, one by one, its connections along with
+ * the state rpc_connection_export_state() takes. A connection is
+ * detached first, so that it stops being read on a frame boundary and
+ * whatever the peer sends next is left in the socket for the new
+ * process to read. Its calls in flight are then given until the drain
+ * deadline to finish, since their responses can only go out from the
+ * old process. Connections that can't be handed over stay with the old
+ * process until they're idle or the deadline passes, and are closed.
+ */
+
+#define	RPC_HANDOVER_POLL	10	/* ms */
+
+struct rpc_takeover
+{
+	GMutex			rto_mtx;
+	GCond			rto_cv;
+	bool			rto_done;
+	rpc_context_t		rto_context;
+	GPtrArray *		rto_servers;
+};
+
+static bool rpc_handover_failed(rpc_object_t);
+static int rpc_handover_listeners(rpc_connection_t, rpc_server_t, int *);
+static rpc_object_t rpc_handover_params(rpc_server_t);
+static GPtrArray *rpc_handover_connections(rpc_server_t);
+static bool rpc_handover_connection(rpc_connection_t, rpc_connection_t,
+    int, gint64);
+static void rpc_handover_close_idle(GPtrArray *, gint64);
+static rpc_object_t rpc_takeover_listener(void *, rpc_object_t);
+static rpc_object_t rpc_takeover_connection(void *, rpc_object_t);
+static rpc_object_t rpc_takeover_done(void *, rpc_object_t);
+
+static bool
+rpc_handover_failed(rpc_object_t result)
+{
+
+	if (result == NULL)
+		return (true);
+
+	if (rpc_get_type(result) == RPC_TYPE_ERROR) {
+		rpc_set_last_rpc_error(result);
+		rpc_release(result);
+		return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * Transport parameters of a server, minus the descriptor it may have
+ * been created from.
+ */
+static rpc_object_t
+rpc_handover_params(rpc_server_t server)
+{
+	rpc_object_t params;
+
+	if (server->rs_params == NULL ||
+	    rpc_get_type(server->rs_params) != RPC_TYPE_DICTIONARY)
+		return (rpc_dictionary_create());
+
+	params = rpc_copy(server->rs_params);
+	rpc_dictionary_remove_key(params, "fd");
+	return (params);
+}
+
+/*
+ * Passes the listening sockets of a server over. *index is set to the
+ * index the new process gave the server created for the first one, or
+ * -1 if the server had none.
+ */
+static int
+rpc_handover_listeners(rpc_connection_t conn, rpc_server_t server,
+    int *index)
+{
+	rpc_object_t result;
+	GArray *fds;
+	guint i;
+	int ret = 0;
+
+	*index = -1;
+	fds = g_array_new(false, false, sizeof(int));
+	if (server->rs_handover(server, fds) != 0) {
+		g_array_free(fds, true);
+		return (-1);
+	}
+
+	for (i = 0; i < fds->len; i++) {
+		result = rpc_connection_call_syncp(conn, "/",
+		    RPC_HANDOVER_INTERFACE, "listener", "[s,v,f]",
+		    server->rs_uri, rpc_handover_params(server),
+		    g_array_index(fds, int, i));
+		if (rpc_handover_failed(result)) {
+			ret = -1;
+			break;
+		}
+
+		if (*index == -1)
+			*index = (int)rpc_uint64_get_value(result);
+
+		rpc_release(result);
+	}
+
+	for (i = 0; i < fds->len; i++)
+		close(g_array_index(fds, int, i));
+
+	g_array_free(fds, true);
+	return (ret);
+}
+
+static GPtrArray *
+rpc_handover_connections(rpc_server_t server)
+{
+	GPtrArray *result;
+	GList *item;
+
+	result = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_connection_release);
+
+	g_rw_lock_reader_lock(&server->rs_connections_rwlock);
+	for (item = server->rs_connections; item != NULL; item = item->next) {
+		rpc_connection_retain(item->data);
+		g_ptr_array_add(result, item->data);
+	}
+	g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
+
+	return (result);
+}
+
+/*
+ * Hands over a connection that was already detached, as fd. Whatever
+ * happens, the connection is closed here afterwards, since nothing
+ * reads from it anymore.
+ */
+static bool
+rpc_handover_connection(rpc_connection_t handover, rpc_connection_t conn,
+    int index, gint64 deadline)
+{
+	rpc_object_t state;
+	rpc_object_t result;
+	bool ret = false;
+	int fd;
+
+	fd = conn->rco_detach(conn->rco_arg);
+	if (fd == -1)
+		return (false);
+
+	for (;;) {
+		state = rpc_connection_export_state(conn);
+		if (state != NULL)
+			break;
+
+		if (rpc_error_get_code(rpc_get_last_error()) != EBUSY ||
+		    g_get_monotonic_time() >= deadline)
+			goto done;
+
+		g_usleep(RPC_HANDOVER_POLL * 1000);
+	}
+
+	result = rpc_connection_call_syncp(handover, "/",
+	    RPC_HANDOVER_INTERFACE, "connection", "[i,f,v]", (int64_t)index,
+	    fd, state);
+	if (!rpc_handover_failed(result)) {
+		rpc_release(result);
+		ret = true;
+	}
+
+done:
+	close(fd);
+	rpc_connection_close(conn);
+	return (ret);
+}
+
+/*
+ * Waits for the connections left behind to run out of calls, but not
+ * past the deadline, and closes them.
+ */
+static void
+rpc_handover_close_idle(GPtrArray *conns, gint64 deadline)
+{
+	rpc_connection_t conn;
+	guint i;
+
+	for (i = 0; i < conns->len; i++) {
+		conn = g_ptr_array_index(conns, i);
+		while (rpc_connection_pending_calls(conn) > 0 &&
+		    g_get_monotonic_time() < deadline)
+			g_usleep(RPC_HANDOVER_POLL * 1000);
+
+		rpc_connection_close(conn);
+	}
+}
+
+int
+rpc_server_handover(rpc_server_t *servers, size_t nservers,
+    const char *path, uint64_t drain_timeout_ms)
+{
+	rpc_client_t client;
+	rpc_connection_t handover;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	GPtrArray *conns;
+	GPtrArray *leftover;
+	gint64 deadline;
+	char *uri;
+	int *indices;
+	int count = 0;
+	size_t i;
+	guint j;
+
+	uri = g_strdup_printf("unix://%s", path);
+	client = rpc_client_create(uri, NULL);
+	g_free(uri);
+	if (client == NULL)
+		return (-1);
+
+	handover = rpc_client_get_connection(client);
+	indices = g_new(int, nservers);
+
+	/* Both processes accept until all listeners have made it over */
+	for (i = 0; i < nservers; i++) {
+		indices[i] = -1;
+		if (servers[i]->rs_handover == NULL)
+			continue;
+
+		if (rpc_handover_listeners(handover, servers[i],
+		    &indices[i]) != 0) {
+			g_free(indices);
+			rpc_client_close(client);
+			return (-1);
+		}
+	}
+
+	for (i = 0; i < nservers; i++) {
+		if (servers[i]->rs_stop_accepting != NULL)
+			servers[i]->rs_stop_accepting(servers[i]);
+	}
+
+	deadline = g_get_monotonic_time() +
+	    (gint64)drain_timeout_ms * 1000;
+	leftover = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_connection_release);
+
+	for (i = 0; i < nservers; i++) {
+		conns = rpc_handover_connections(servers[i]);
+		for (j = 0; j < conns->len; j++) {
+			conn = g_ptr_array_index(conns, j);
+			if (indices[i] == -1 || conn->rco_detach == NULL ||
+			    conn->rco_shmem_pools) {
+				rpc_connection_retain(conn);
+				g_ptr_array_add(leftover, conn);
+				continue;
+			}
+
+			if (rpc_handover_connection(handover, conn, indices[i],
+			    deadline))
+				count++;
+		}
+
+		g_ptr_array_free(conns, true);
+	}
+
+	rpc_handover_close_idle(leftover, deadline);
+	g_ptr_array_free(leftover, true);
+
+	result = rpc_connection_call_syncp(handover, "/",
+	    RPC_HANDOVER_INTERFACE, "done", RPC_NULL_FORMAT);
+	rpc_release(result);
+
+	g_free(indices);
+	rpc_client_close(client);
+	return (count);
+}
+
+static rpc_object_t
+rpc_takeover_listener(void *cookie, rpc_object_t args)
+{
+	struct rpc_takeover *takeover = rpc_function_get_arg(cookie);
+	rpc_server_t server;
+	rpc_object_t params = NULL;
+	const char *uri = NULL;
+	uint64_t index;
+	int fd = -1;
+
+	if (rpc_object_unpack(args, "[s,v,f]", &uri, &params, &fd) < 3 ||
+	    uri == NULL || fd == -1) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	params = rpc_get_type(params) == RPC_TYPE_DICTIONARY ?
+	    rpc_copy(params) : rpc_dictionary_create();
+	rpc_dictionary_steal_value(params, "fd", rpc_fd_create(fd));
+
+	/* Servers keep the URI and params they were created with */
+	server = rpc_server_create_ex(g_intern_string(uri),
+	    takeover->rto_context, params);
+	if (server == NULL) {
+		rpc_release(params);
+		close(fd);
+		rpc_function_error(cookie, ENXIO, "Cannot listen on %s", uri);
+		return (NULL);
+	}
+
+	g_mutex_lock(&takeover->rto_mtx);
+	index = takeover->rto_servers->len;
+	g_ptr_array_add(takeover->rto_servers, server);
+	g_mutex_unlock(&takeover->rto_mtx);
+	return (rpc_uint64_create(index));
+}
+
+static rpc_object_t
+rpc_takeover_connection(void *cookie, rpc_object_t args)
+{
+	struct rpc_takeover *takeover = rpc_function_get_arg(cookie);
+	rpc_server_t server = NULL;
+	rpc_object_t state = NULL;
+	rpc_object_t error;
+	int64_t index = -1;
+	int fd = -1;
+
+	if (rpc_object_unpack(args, "[i,f,v]", &index, &fd, &state) < 3 ||
+	    fd == -1) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	g_mutex_lock(&takeover->rto_mtx);
+	if (index >= 0 && (guint64)index < takeover->rto_servers->len)
+		server = g_ptr_array_index(takeover->rto_servers, index);
+	g_mutex_unlock(&takeover->rto_mtx);
+
+	if (server == NULL || server->rs_adopt == NULL) {
+		close(fd);
+		rpc_function_error(cookie, ENOENT, "No such server");
+		return (NULL);
+	}
+
+	if (server->rs_adopt(server, fd, state) != 0) {
+		error = rpc_get_last_error();
+		rpc_function_error(cookie, rpc_error_get_code(error), "%s",
+		    rpc_error_get_message(error));
+		return (NULL);
+	}
+
+	return (rpc_null_create());
+}
+
+static rpc_object_t
+rpc_takeover_done(void *cookie, rpc_object_t args __unused)
+{
+	struct rpc_takeover *takeover = rpc_function_get_arg(cookie);
+
+	g_mutex_lock(&takeover->rto_mtx);
+	takeover->rto_done = true;
+	g_cond_broadcast(&takeover->rto_cv);
+	g_mutex_unlock(&takeover->rto_mtx);
+	return (rpc_null_create());
+}
+
+int
+rpc_server_takeover(rpc_context_t context, const char *path,
+    uint64_t timeout_ms, rpc_server_t **servers)
+{
+	struct rpc_takeover takeover;
+	rpc_context_t priv;
+	rpc_server_t server;
+	gint64 deadline;
+	char *uri;
+	guint i;
+	int ret;
+
+	memset(&takeover, 0, sizeof(takeover));
+	g_mutex_init(&takeover.rto_mtx);
+	g_cond_init(&takeover.rto_cv);
+	takeover.rto_context = context;
+	takeover.rto_servers = g_ptr_array_new();
+
+	priv = rpc_context_create();
+	rpc_context_register_func(priv, RPC_HANDOVER_INTERFACE, "listener",
+	    &takeover, rpc_takeover_listener);
+	rpc_context_register_func(priv, RPC_HANDOVER_INTERFACE, "connection",
+	    &takeover, rpc_takeover_connection);
+	rpc_context_register_func(priv, RPC_HANDOVER_INTERFACE, "done",
+	    &takeover, rpc_takeover_done);
+
+	uri = g_strdup_printf("unix://%s", path);
+	server = rpc_server_create(uri, priv);
+	if (server == NULL) {
+		ret = -1;
+		goto done;
+	}
+
+	rpc_server_resume(server);
+
+	deadline = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+	g_mutex_lock(&takeover.rto_mtx);
+	while (!takeover.rto_done) {
+		if (!g_cond_wait_until(&takeover.rto_cv, &takeover.rto_mtx,
+		    deadline))
+			break;
+	}
+	g_mutex_unlock(&takeover.rto_mtx);
+
+	rpc_server_close(server);
+	unlink(path);
+
+	if (!takeover.rto_done) {
+		rpc_set_last_errorf(ETIMEDOUT, "Handover timed out");
+		for (i = 0; i < takeover.rto_servers->len; i++)
+			rpc_server_close(g_ptr_array_index(
+			    takeover.rto_servers, i));
+
+		ret = -1;
+		goto done;
+	}
+
+	ret = (int)takeover.rto_servers->len;
+	*servers = g_malloc0(sizeof(rpc_server_t) * MAX(ret, 1));
+	for (i = 0; i < takeover.rto_servers->len; i++)
+		(*servers)[i] = g_ptr_array_index(takeover.rto_servers, i);
+
+done:
+	rpc_context_free(priv);
+	g_free(uri);
+	g_ptr_array_free(takeover.rto_servers, true);
+	g_cond_clear(&takeover.rto_cv);
+	g_mutex_clear(&takeover.rto_mtx);
+	return (ret);
+}
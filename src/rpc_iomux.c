@@ -0,0 +1,566 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+#include "internal.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define	IOMUX_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/types.h>
+#include <sys/event.h>
+#define	IOMUX_KQUEUE
+#endif
+
+#if defined(IO_URING_SUPPORT)
+#include <poll.h>
+#include <liburing.h>
+#endif
+
+/*
+ * A small, process-wide pool of I/O threads servicing readiness events
+ * for registered descriptors.
+ *
+ * The epoll/kqueue backend has all threads waiting on a single queue.
+ * Descriptors are registered in one-shot mode, so a given handle is only
+ * ever serviced by one thread at a time; it is rearmed once its callback
+ * has drained the socket.
+ *
+ * The io_uring backend gives every thread its own ring. Each handle is
+ * bound to one ring and watched with a multishot poll request, so no
+ * rearming is needed; requests queued by the owning thread are submitted
+ * in batches together with the next wait. Rings are handed out round
+ * robin, unless the caller asks for a particular shard.
+ *
+ * Threads can be pinned to a list of CPUs, which is given by whoever
+ * creates the pool. Thread i takes the i-th CPU of the list (wrapping
+ * around), so with io_uring, shard i runs on it.
+ */
+
+#define	IOMUX_MAX_EVENTS	64
+#define	IOMUX_URING_ENTRIES	256
+
+struct rpc_iomux_handle
+{
+	uint64_t		imh_id;
+	int			imh_fd;
+	rpc_iomux_fn_t		imh_fn;
+	void *			imh_arg;
+	volatile int		imh_refcnt;
+	bool			imh_dead;
+	bool			imh_busy;
+	GThread *		imh_owner;
+	GCond			imh_cv;
+	guint			imh_ring;
+	struct rpc_iomux *	imh_mux;
+};
+
+#if defined(IO_URING_SUPPORT)
+struct rpc_iomux_ring
+{
+	struct io_uring		imr_ring;
+	GMutex			imr_mtx;
+	struct rpc_iomux *	imr_mux;
+};
+#endif
+
+struct rpc_iomux
+{
+	rpc_iomux_backend_t	im_backend;
+	int			im_fd;
+	GMutex			im_mtx;
+	GHashTable *		im_handles;
+	uint64_t		im_next_id;
+	GPtrArray *		im_threads;
+	guint			im_nrings;
+	guint			im_next_ring;
+	GArray *		im_cpus;
+	volatile guint		im_next_cpu;
+#if defined(IO_URING_SUPPORT)
+	struct rpc_iomux_ring *	im_rings;
+#endif
+};
+
+#if defined(IOMUX_EPOLL) || defined(IOMUX_KQUEUE)
+static struct rpc_iomux *rpc_iomux_get(rpc_iomux_backend_t, guint,
+    const GArray *);
+static struct rpc_iomux *rpc_iomux_create(rpc_iomux_backend_t, guint,
+    const GArray *);
+static void rpc_iomux_bind(struct rpc_iomux *, guint);
+static int rpc_iomux_arm(struct rpc_iomux *, struct rpc_iomux_handle *, bool);
+static void rpc_iomux_disarm(struct rpc_iomux *, struct rpc_iomux_handle *);
+static void rpc_iomux_dispatch(struct rpc_iomux *, uint64_t, bool);
+static void rpc_iomux_handle_release(struct rpc_iomux_handle *);
+static void *rpc_iomux_worker(void *);
+#if defined(IO_URING_SUPPORT)
+static void *rpc_iomux_uring_worker(void *);
+#endif
+
+static struct rpc_iomux *iomux[RPC_IOMUX_BACKEND_MAX];
+static GMutex iomux_mtx;
+
+static struct rpc_iomux *
+rpc_iomux_create(rpc_iomux_backend_t backend, guint nthreads,
+    const GArray *cpus)
+{
+	struct rpc_iomux *mux;
+	guint i;
+
+	mux = g_malloc0(sizeof(*mux));
+	mux->im_backend = backend;
+	mux->im_fd = -1;
+
+	if (nthreads == 0)
+		nthreads = MIN(g_get_num_processors(), 4);
+
+	switch (backend) {
+	case RPC_IOMUX_BACKEND_DEFAULT:
+#if defined(IOMUX_EPOLL)
+		mux->im_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+		mux->im_fd = kqueue();
+#endif
+		if (mux->im_fd < 0) {
+			rpc_set_last_errorf(errno,
+			    "Cannot create event queue: %s",
+			    g_strerror(errno));
+			g_free(mux);
+			return (NULL);
+		}
+		break;
+
+	case RPC_IOMUX_BACKEND_IO_URING:
+#if defined(IO_URING_SUPPORT)
+		mux->im_rings = g_new0(struct rpc_iomux_ring, nthreads);
+		for (i = 0; i < nthreads; i++) {
+			if (io_uring_queue_init(IOMUX_URING_ENTRIES,
+			    &mux->im_rings[i].imr_ring, 0) == 0) {
+				g_mutex_init(&mux->im_rings[i].imr_mtx);
+				mux->im_rings[i].imr_mux = mux;
+				continue;
+			}
+
+			/* Most likely an older kernel */
+			while (i-- > 0)
+				io_uring_queue_exit(&mux->im_rings[i].imr_ring);
+
+			rpc_set_last_error(ENOTSUP, "io_uring not available",
+			    NULL);
+			g_free(mux->im_rings);
+			g_free(mux);
+			return (NULL);
+		}
+
+		mux->im_nrings = nthreads;
+		break;
+#else
+		rpc_set_last_error(ENOTSUP, "io_uring support not compiled in",
+		    NULL);
+		g_free(mux);
+		return (NULL);
+#endif
+
+	default:
+		g_assert_not_reached();
+	}
+
+	g_mutex_init(&mux->im_mtx);
+	mux->im_handles = g_hash_table_new(g_int64_hash, g_int64_equal);
+	mux->im_threads = g_ptr_array_new();
+	if (cpus != NULL && cpus->len > 0) {
+		mux->im_cpus = g_array_sized_new(false, false, sizeof(int),
+		    cpus->len);
+		g_array_append_vals(mux->im_cpus, cpus->data, cpus->len);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+#if defined(IO_URING_SUPPORT)
+		if (backend == RPC_IOMUX_BACKEND_IO_URING) {
+			g_ptr_array_add(mux->im_threads, g_thread_new(
+			    "librpc I/O", rpc_iomux_uring_worker,
+			    &mux->im_rings[i]));
+			continue;
+		}
+#endif
+		g_ptr_array_add(mux->im_threads, g_thread_new("librpc I/O",
+		    rpc_iomux_worker, mux));
+	}
+
+	return (mux);
+}
+
+static struct rpc_iomux *
+rpc_iomux_get(rpc_iomux_backend_t backend, guint nthreads, const GArray *cpus)
+{
+	struct rpc_iomux *mux;
+
+	g_mutex_lock(&iomux_mtx);
+	if (iomux[backend] == NULL)
+		iomux[backend] = rpc_iomux_create(backend, nthreads, cpus);
+
+	mux = iomux[backend];
+	g_mutex_unlock(&iomux_mtx);
+	return (mux);
+}
+
+static int
+rpc_iomux_arm(struct rpc_iomux *mux, struct rpc_iomux_handle *handle,
+    bool add)
+{
+#if defined(IO_URING_SUPPORT)
+	struct rpc_iomux_ring *ring;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	if (mux->im_backend == RPC_IOMUX_BACKEND_IO_URING) {
+		ring = &mux->im_rings[handle->imh_ring];
+		g_mutex_lock(&ring->imr_mtx);
+		sqe = io_uring_get_sqe(&ring->imr_ring);
+		if (sqe == NULL) {
+			io_uring_submit(&ring->imr_ring);
+			sqe = io_uring_get_sqe(&ring->imr_ring);
+		}
+
+		io_uring_prep_poll_multishot(sqe, handle->imh_fd,
+		    POLLIN | POLLRDHUP);
+		io_uring_sqe_set_data64(sqe, handle->imh_id);
+
+		/*
+		 * Requests queued from the ring's own thread go out with
+		 * its next wait; anybody else has to submit right away.
+		 */
+		ret = add ? io_uring_submit(&ring->imr_ring) : 0;
+		g_mutex_unlock(&ring->imr_mtx);
+		return (ret < 0 ? -1 : 0);
+	}
+#endif
+
+#if defined(IOMUX_EPOLL)
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT,
+		.data.u64 = handle->imh_id
+	};
+
+	return (epoll_ctl(mux->im_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+	    handle->imh_fd, &ev));
+#else
+	struct kevent ev;
+
+	EV_SET(&ev, handle->imh_fd, EVFILT_READ,
+	    EV_ADD | EV_ENABLE | EV_DISPATCH | EV_CLEAR, 0, 0,
+	    (void *)(uintptr_t)handle->imh_id);
+
+	return (kevent(mux->im_fd, &ev, 1, NULL, 0, NULL));
+#endif
+}
+
+static void
+rpc_iomux_disarm(struct rpc_iomux *mux, struct rpc_iomux_handle *handle)
+{
+#if defined(IO_URING_SUPPORT)
+	struct rpc_iomux_ring *ring;
+	struct io_uring_sqe *sqe;
+
+	if (mux->im_backend == RPC_IOMUX_BACKEND_IO_URING) {
+		ring = &mux->im_rings[handle->imh_ring];
+		g_mutex_lock(&ring->imr_mtx);
+		sqe = io_uring_get_sqe(&ring->imr_ring);
+		if (sqe == NULL) {
+			io_uring_submit(&ring->imr_ring);
+			sqe = io_uring_get_sqe(&ring->imr_ring);
+		}
+
+		io_uring_prep_poll_remove(sqe, handle->imh_id);
+		io_uring_sqe_set_data64(sqe, 0);
+		io_uring_submit(&ring->imr_ring);
+		g_mutex_unlock(&ring->imr_mtx);
+		return;
+	}
+#endif
+
+#if defined(IOMUX_EPOLL)
+	epoll_ctl(mux->im_fd, EPOLL_CTL_DEL, handle->imh_fd, NULL);
+#else
+	struct kevent ev;
+
+	EV_SET(&ev, handle->imh_fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	kevent(mux->im_fd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+static void
+rpc_iomux_handle_release(struct rpc_iomux_handle *handle)
+{
+
+	if (!g_atomic_int_dec_and_test(&handle->imh_refcnt))
+		return;
+
+	g_cond_clear(&handle->imh_cv);
+	g_free(handle);
+}
+
+static void
+rpc_iomux_dispatch(struct rpc_iomux *mux, uint64_t id, bool rearm)
+{
+	struct rpc_iomux_handle *handle;
+	bool keep;
+
+	g_mutex_lock(&mux->im_mtx);
+	handle = g_hash_table_lookup(mux->im_handles, &id);
+	if (handle == NULL || handle->imh_dead) {
+		g_mutex_unlock(&mux->im_mtx);
+		return;
+	}
+
+	g_atomic_int_inc(&handle->imh_refcnt);
+	handle->imh_busy = true;
+	handle->imh_owner = g_thread_self();
+	g_mutex_unlock(&mux->im_mtx);
+
+	keep = handle->imh_fn(handle->imh_arg);
+
+	g_mutex_lock(&mux->im_mtx);
+	handle->imh_busy = false;
+	handle->imh_owner = NULL;
+	if (keep && rearm && !handle->imh_dead)
+		rpc_iomux_arm(mux, handle, false);
+
+	g_cond_broadcast(&handle->imh_cv);
+	g_mutex_unlock(&mux->im_mtx);
+	rpc_iomux_handle_release(handle);
+}
+
+static void
+rpc_iomux_bind(struct rpc_iomux *mux, guint index)
+{
+	int cpu;
+
+	if (mux->im_cpus == NULL)
+		return;
+
+	cpu = g_array_index(mux->im_cpus, int, index % mux->im_cpus->len);
+	if (rpc_thread_bind_cpu(cpu) != 0)
+		debugf("Couldn't pin I/O thread to CPU %d", cpu);
+}
+
+static void *
+rpc_iomux_worker(void *arg)
+{
+	struct rpc_iomux *mux = arg;
+	int nevents;
+	int i;
+#if defined(IOMUX_EPOLL)
+	struct epoll_event events[IOMUX_MAX_EVENTS];
+#else
+	struct kevent events[IOMUX_MAX_EVENTS];
+#endif
+
+	rpc_iomux_bind(mux, g_atomic_int_add(&mux->im_next_cpu, 1));
+
+	for (;;) {
+#if defined(IOMUX_EPOLL)
+		nevents = epoll_wait(mux->im_fd, events, IOMUX_MAX_EVENTS, -1);
+#else
+		nevents = kevent(mux->im_fd, NULL, 0, events,
+		    IOMUX_MAX_EVENTS, NULL);
+#endif
+		if (nevents < 0) {
+			if (errno == EINTR)
+				continue;
+
+			rpc_abort("I/O multiplexer wait failed: %s",
+			    g_strerror(errno));
+		}
+
+		for (i = 0; i < nevents; i++) {
+#if defined(IOMUX_EPOLL)
+			rpc_iomux_dispatch(mux, events[i].data.u64, true);
+#else
+			rpc_iomux_dispatch(mux,
+			    (uint64_t)(uintptr_t)events[i].udata, true);
+#endif
+		}
+	}
+
+	return (NULL);
+}
+
+#if defined(IO_URING_SUPPORT)
+static void *
+rpc_iomux_uring_worker(void *arg)
+{
+	struct rpc_iomux_ring *ring = arg;
+	struct rpc_iomux *mux = ring->imr_mux;
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	unsigned count;
+	uint64_t *ids;
+	bool *rearm;
+	unsigned i;
+	int ret;
+
+	rpc_iomux_bind(mux, (guint)(ring - mux->im_rings));
+	ids = g_new(uint64_t, IOMUX_URING_ENTRIES);
+	rearm = g_new(bool, IOMUX_URING_ENTRIES);
+
+	for (;;) {
+		/* Flush rearm requests queued by the previous batch */
+		g_mutex_lock(&ring->imr_mtx);
+		io_uring_submit(&ring->imr_ring);
+		g_mutex_unlock(&ring->imr_mtx);
+
+		ret = io_uring_wait_cqe(&ring->imr_ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+
+		if (ret < 0)
+			rpc_abort("io_uring wait failed: %s", g_strerror(-ret));
+
+		/*
+		 * Collect the whole batch first, so that callbacks are free
+		 * to queue new requests on this ring.
+		 */
+		count = 0;
+		io_uring_for_each_cqe(&ring->imr_ring, head, cqe) {
+			if (count == IOMUX_URING_ENTRIES)
+				break;
+
+			ids[count] = io_uring_cqe_get_data64(cqe);
+			rearm[count] = (cqe->flags & IORING_CQE_F_MORE) == 0 &&
+			    cqe->res != -ECANCELED && cqe->res != -ENOENT;
+			count++;
+		}
+
+		io_uring_cq_advance(&ring->imr_ring, count);
+
+		for (i = 0; i < count; i++) {
+			if (ids[i] != 0)
+				rpc_iomux_dispatch(mux, ids[i], rearm[i]);
+		}
+	}
+
+	return (NULL);
+}
+#endif
+
+struct rpc_iomux_handle *
+rpc_iomux_add(int fd, rpc_iomux_fn_t fn, void *arg, guint nthreads,
+    const GArray *cpus, rpc_iomux_backend_t backend, int shard)
+{
+	struct rpc_iomux *mux;
+	struct rpc_iomux_handle *handle;
+
+	mux = rpc_iomux_get(backend, nthreads, cpus);
+	if (mux == NULL && backend != RPC_IOMUX_BACKEND_DEFAULT) {
+		debugf("falling back to the default I/O multiplexer");
+		mux = rpc_iomux_get(RPC_IOMUX_BACKEND_DEFAULT, nthreads, cpus);
+	}
+
+	if (mux == NULL)
+		return (NULL);
+
+	handle = g_malloc0(sizeof(*handle));
+	handle->imh_fd = fd;
+	handle->imh_fn = fn;
+	handle->imh_arg = arg;
+	handle->imh_refcnt = 1;
+	handle->imh_mux = mux;
+	g_cond_init(&handle->imh_cv);
+
+	g_mutex_lock(&mux->im_mtx);
+	handle->imh_id = ++mux->im_next_id;
+	if (mux->im_nrings > 0 && shard >= 0)
+		handle->imh_ring = (guint)shard % mux->im_nrings;
+	else if (mux->im_nrings > 0)
+		handle->imh_ring = mux->im_next_ring++ % mux->im_nrings;
+
+	g_hash_table_insert(mux->im_handles, &handle->imh_id, handle);
+
+	if (rpc_iomux_arm(mux, handle, true) != 0) {
+		rpc_set_last_errorf(errno, "Cannot register descriptor: %s",
+		    g_strerror(errno));
+		g_hash_table_remove(mux->im_handles, &handle->imh_id);
+		g_mutex_unlock(&mux->im_mtx);
+		rpc_iomux_handle_release(handle);
+		return (NULL);
+	}
+
+	g_mutex_unlock(&mux->im_mtx);
+	return (handle);
+}
+
+void
+rpc_iomux_remove(struct rpc_iomux_handle *handle)
+{
+	struct rpc_iomux *mux = handle->imh_mux;
+
+	g_mutex_lock(&mux->im_mtx);
+	handle->imh_dead = true;
+	g_hash_table_remove(mux->im_handles, &handle->imh_id);
+	rpc_iomux_disarm(mux, handle);
+
+	/* Wait for an in-flight callback, unless we're being called from it */
+	while (handle->imh_busy && handle->imh_owner != g_thread_self())
+		g_cond_wait(&handle->imh_cv, &mux->im_mtx);
+
+	g_mutex_unlock(&mux->im_mtx);
+	rpc_iomux_handle_release(handle);
+}
+
+bool
+rpc_iomux_supported(void)
+{
+
+	return (true);
+}
+#else
+struct rpc_iomux_handle *
+rpc_iomux_add(int fd __unused, rpc_iomux_fn_t fn __unused, void *arg __unused,
+    guint nthreads __unused, const GArray *cpus __unused,
+    rpc_iomux_backend_t backend __unused, int shard __unused)
+{
+
+	rpc_set_last_error(ENOTSUP, "I/O multiplexing not supported", NULL);
+	return (NULL);
+}
+
+void
+rpc_iomux_remove(struct rpc_iomux_handle *handle __unused)
+{
+
+}
+
+bool
+rpc_iomux_supported(void)
+{
+
+	return (false);
+}
+#endif
@@ -0,0 +1,538 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Lock contention profiling.
+ *
+ * With RPC_LOCKPROF defined, internal.h routes the GLib mutex, rwlock
+ * and condition variable calls of the library through the wrappers
+ * below, tagged with the file and line of the call. Nothing is recorded
+ * until profiling is turned on at runtime. Acquisitions try the lock
+ * first, so an uncontended one costs a trylock and a clock read.
+ *
+ * Wait time is charged to the site that acquired the lock, and so is
+ * hold time, up to the unlock. Every thread keeps a small stack of the
+ * locks it holds to match the two up; unlocks that don't match (the
+ * lock was taken while profiling was off, or too many are held) are
+ * ignored. Waiting on a condition variable ends the hold, and the
+ * reacquisition after the wait starts a new one charged to the wait.
+ *
+ * Sites live in a fixed size open addressing table keyed by the
+ * location string, filled in with compare-and-swap, so that the
+ * profiler itself takes no locks.
+ */
+
+#undef g_mutex_lock
+#undef g_mutex_unlock
+#undef g_rw_lock_reader_lock
+#undef g_rw_lock_reader_unlock
+#undef g_rw_lock_writer_lock
+#undef g_rw_lock_writer_unlock
+#undef g_cond_wait
+#undef g_cond_wait_until
+
+#define	RPC_LOCKPROF_SITES	4096
+#define	RPC_LOCKPROF_BUCKETS	40
+#define	RPC_LOCKPROF_HELD	32
+
+typedef enum {
+	RPC_LOCK_MUTEX,
+	RPC_LOCK_READ,
+	RPC_LOCK_WRITE
+} rpc_lock_kind_t;
+
+static const char *rpc_lock_kind_names[] = {
+	[RPC_LOCK_MUTEX] = "mutex",
+	[RPC_LOCK_READ] = "read",
+	[RPC_LOCK_WRITE] = "write"
+};
+
+struct rpc_lockprof_site
+{
+	const char *volatile	rls_site;
+	rpc_lock_kind_t		rls_kind;
+	uint64_t		rls_count;
+	uint64_t		rls_contended;
+	uint64_t		rls_wait_ns;
+	uint64_t		rls_max_wait_ns;
+	uint64_t		rls_hold_ns;
+	uint64_t		rls_max_hold_ns;
+	uint64_t		rls_wait_hist[RPC_LOCKPROF_BUCKETS];
+	uint64_t		rls_hold_hist[RPC_LOCKPROF_BUCKETS];
+};
+
+struct rpc_lockprof_held
+{
+	void *			rlh_lock;
+	struct rpc_lockprof_site *rlh_site;
+	uint64_t		rlh_since;
+};
+
+struct rpc_lockprof_thread
+{
+	guint			rlt_depth;
+	struct rpc_lockprof_held rlt_held[RPC_LOCKPROF_HELD];
+};
+
+static struct rpc_lockprof_site *rpc_lockprof_site_get(const char *,
+    rpc_lock_kind_t);
+static guint rpc_lockprof_bucket(uint64_t);
+static void rpc_lockprof_max(uint64_t *, uint64_t);
+static void rpc_lockprof_acquired(void *, struct rpc_lockprof_site *,
+    uint64_t, uint64_t);
+static void rpc_lockprof_released(void *);
+static rpc_object_t rpc_lockprof_hist_export(const uint64_t *);
+static uint64_t rpc_lockprof_percentile(const uint64_t *, double);
+static gint rpc_lockprof_compare(gconstpointer, gconstpointer);
+
+INTERNAL_LINKAGE volatile gint rpc_lockprof_active;
+static struct rpc_lockprof_site rpc_lockprof_sites[RPC_LOCKPROF_SITES];
+static volatile guint rpc_lockprof_dropped;
+static GPrivate rpc_lockprof_thread = G_PRIVATE_INIT(g_free);
+
+static struct rpc_lockprof_site *
+rpc_lockprof_site_get(const char *site, rpc_lock_kind_t kind)
+{
+	struct rpc_lockprof_site *entry;
+	const char *cur;
+	guint i;
+	guint n;
+
+	i = (guint)(((uintptr_t)site >> 3) * 2654435761u);
+	for (n = 0; n < RPC_LOCKPROF_SITES; n++, i++) {
+		entry = &rpc_lockprof_sites[i % RPC_LOCKPROF_SITES];
+		cur = g_atomic_pointer_get(&entry->rls_site);
+		if (cur == site)
+			return (entry);
+
+		if (cur != NULL)
+			continue;
+
+		if (g_atomic_pointer_compare_and_exchange(&entry->rls_site,
+		    NULL, site)) {
+			entry->rls_kind = kind;
+			return (entry);
+		}
+
+		if (g_atomic_pointer_get(&entry->rls_site) == site)
+			return (entry);
+	}
+
+	g_atomic_int_inc(&rpc_lockprof_dropped);
+	return (NULL);
+}
+
+/* Power-of-two buckets: bucket n holds [2^(n-1), 2^n) ns */
+static guint
+rpc_lockprof_bucket(uint64_t ns)
+{
+	guint bucket = 0;
+
+	while (ns != 0 && bucket < RPC_LOCKPROF_BUCKETS - 1) {
+		ns >>= 1;
+		bucket++;
+	}
+
+	return (bucket);
+}
+
+static void
+rpc_lockprof_max(uint64_t *max, uint64_t value)
+{
+	uint64_t cur;
+
+	cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (value > cur && !__atomic_compare_exchange_n(max, &cur, value,
+	    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void
+rpc_lockprof_acquired(void *lock, struct rpc_lockprof_site *site,
+    uint64_t start, uint64_t now)
+{
+	struct rpc_lockprof_thread *thread;
+	struct rpc_lockprof_held *held;
+	uint64_t wait = now - start;
+
+	if (site == NULL)
+		return;
+
+	__atomic_add_fetch(&site->rls_count, 1, __ATOMIC_RELAXED);
+	if (wait != 0) {
+		__atomic_add_fetch(&site->rls_contended, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->rls_wait_ns, wait, __ATOMIC_RELAXED);
+		rpc_lockprof_max(&site->rls_max_wait_ns, wait);
+	}
+
+	__atomic_add_fetch(&site->rls_wait_hist[rpc_lockprof_bucket(wait)], 1,
+	    __ATOMIC_RELAXED);
+
+	thread = g_private_get(&rpc_lockprof_thread);
+	if (thread == NULL) {
+		thread = g_malloc0(sizeof(*thread));
+		g_private_set(&rpc_lockprof_thread, thread);
+	}
+
+	if (thread->rlt_depth == RPC_LOCKPROF_HELD)
+		return;
+
+	held = &thread->rlt_held[thread->rlt_depth++];
+	held->rlh_lock = lock;
+	held->rlh_site = site;
+	held->rlh_since = now;
+}
+
+static void
+rpc_lockprof_released(void *lock)
+{
+	struct rpc_lockprof_thread *thread;
+	struct rpc_lockprof_held *held;
+	uint64_t hold;
+	guint i;
+
+	thread = g_private_get(&rpc_lockprof_thread);
+	if (thread == NULL)
+		return;
+
+	for (i = thread->rlt_depth; i > 0; i--) {
+		held = &thread->rlt_held[i - 1];
+		if (held->rlh_lock != lock)
+			continue;
+
+		hold = rpc_stats_now() - held->rlh_since;
+		__atomic_add_fetch(&held->rlh_site->rls_hold_ns, hold,
+		    __ATOMIC_RELAXED);
+		__atomic_add_fetch(&held->rlh_site->rls_hold_hist[
+		    rpc_lockprof_bucket(hold)], 1, __ATOMIC_RELAXED);
+		rpc_lockprof_max(&held->rlh_site->rls_max_hold_ns, hold);
+
+		/* Locks aren't always released in reverse order */
+		memmove(held, held + 1, (thread->rlt_depth - i) *
+		    sizeof(*held));
+		thread->rlt_depth--;
+		return;
+	}
+}
+
+void
+rpc_lockprof_mutex_lock(GMutex *mutex, const char *site)
+{
+	uint64_t start;
+
+	if (!RPC_LOCKPROFILING()) {
+		g_mutex_lock(mutex);
+		return;
+	}
+
+	start = rpc_stats_now();
+	if (g_mutex_trylock(mutex)) {
+		rpc_lockprof_acquired(mutex,
+		    rpc_lockprof_site_get(site, RPC_LOCK_MUTEX), start, start);
+		return;
+	}
+
+	g_mutex_lock(mutex);
+	rpc_lockprof_acquired(mutex, rpc_lockprof_site_get(site,
+	    RPC_LOCK_MUTEX), start, rpc_stats_now());
+}
+
+void
+rpc_lockprof_mutex_unlock(GMutex *mutex)
+{
+
+	if (RPC_LOCKPROFILING())
+		rpc_lockprof_released(mutex);
+
+	g_mutex_unlock(mutex);
+}
+
+void
+rpc_lockprof_rw_lock(GRWLock *lock, bool write, const char *site)
+{
+	rpc_lock_kind_t kind = write ? RPC_LOCK_WRITE : RPC_LOCK_READ;
+	uint64_t start;
+	gboolean locked;
+
+	if (!RPC_LOCKPROFILING()) {
+		if (write)
+			g_rw_lock_writer_lock(lock);
+		else
+			g_rw_lock_reader_lock(lock);
+
+		return;
+	}
+
+	start = rpc_stats_now();
+	locked = write
+	    ? g_rw_lock_writer_trylock(lock)
+	    : g_rw_lock_reader_trylock(lock);
+
+	if (locked) {
+		rpc_lockprof_acquired(lock, rpc_lockprof_site_get(site, kind),
+		    start, start);
+		return;
+	}
+
+	if (write)
+		g_rw_lock_writer_lock(lock);
+	else
+		g_rw_lock_reader_lock(lock);
+
+	rpc_lockprof_acquired(lock, rpc_lockprof_site_get(site, kind), start,
+	    rpc_stats_now());
+}
+
+void
+rpc_lockprof_rw_unlock(GRWLock *lock, bool write)
+{
+
+	if (RPC_LOCKPROFILING())
+		rpc_lockprof_released(lock);
+
+	if (write)
+		g_rw_lock_writer_unlock(lock);
+	else
+		g_rw_lock_reader_unlock(lock);
+}
+
+gboolean
+rpc_lockprof_cond_wait(GCond *cond, GMutex *mutex, gint64 end_time,
+    const char *site)
+{
+	gboolean ret = true;
+	uint64_t now;
+
+	if (!RPC_LOCKPROFILING()) {
+		if (end_time < 0)
+			g_cond_wait(cond, mutex);
+		else
+			ret = g_cond_wait_until(cond, mutex, end_time);
+
+		return (ret);
+	}
+
+	rpc_lockprof_released(mutex);
+	if (end_time < 0)
+		g_cond_wait(cond, mutex);
+	else
+		ret = g_cond_wait_until(cond, mutex, end_time);
+
+	/* Time spent sleeping on the condition isn't contention */
+	now = rpc_stats_now();
+	rpc_lockprof_acquired(mutex, rpc_lockprof_site_get(site,
+	    RPC_LOCK_MUTEX), now, now);
+	return (ret);
+}
+
+void
+rpc_lockprof_init(void)
+{
+	static gsize initialized = 0;
+	const char *env;
+
+	if (!g_once_init_enter(&initialized))
+		return;
+
+	env = getenv("LIBRPC_LOCKPROF");
+	if (env != NULL && *env != '\0' && *env != '0')
+		rpc_lockprof_enable();
+
+	g_once_init_leave(&initialized, 1);
+}
+
+static uint64_t
+rpc_lockprof_percentile(const uint64_t *hist, double pct)
+{
+	uint64_t total = 0;
+	uint64_t rank;
+	uint64_t seen = 0;
+	guint i;
+
+	for (i = 0; i < RPC_LOCKPROF_BUCKETS; i++)
+		total += hist[i];
+
+	rank = (uint64_t)(total * pct);
+
+	for (i = 0; i < RPC_LOCKPROF_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > rank)
+			return (i == 0 ? 0 : (uint64_t)1 << i);
+	}
+
+	return ((uint64_t)1 << (RPC_LOCKPROF_BUCKETS - 1));
+}
+
+static rpc_object_t
+rpc_lockprof_hist_export(const uint64_t *hist)
+{
+	rpc_object_t result = rpc_array_create();
+	guint last = 0;
+	guint i;
+
+	for (i = 0; i < RPC_LOCKPROF_BUCKETS; i++) {
+		if (hist[i] != 0)
+			last = i + 1;
+	}
+
+	for (i = 0; i < last; i++)
+		rpc_array_append_stolen_value(result,
+		    rpc_uint64_create(hist[i]));
+
+	return (result);
+}
+
+static gint
+rpc_lockprof_compare(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_lockprof_site *sa = *(struct rpc_lockprof_site **)a;
+	const struct rpc_lockprof_site *sb = *(struct rpc_lockprof_site **)b;
+
+	if (sa->rls_wait_ns != sb->rls_wait_ns)
+		return (sa->rls_wait_ns < sb->rls_wait_ns ? 1 : -1);
+
+	return (sa->rls_hold_ns < sb->rls_hold_ns ? 1 :
+	    sa->rls_hold_ns > sb->rls_hold_ns ? -1 : 0);
+}
+
+#ifdef RPC_LOCKPROF
+int
+rpc_lockprof_enable(void)
+{
+
+	g_atomic_int_set(&rpc_lockprof_active, true);
+	return (0);
+}
+#else
+int
+rpc_lockprof_enable(void)
+{
+
+	rpc_set_last_errorf(ENOTSUP,
+	    "librpc was built without lock profiling support");
+	return (-1);
+}
+#endif
+
+void
+rpc_lockprof_disable(void)
+{
+
+	g_atomic_int_set(&rpc_lockprof_active, false);
+}
+
+/*
+ * Sites stay in the table, since a thread may be updating them; only
+ * their counters are cleared.
+ */
+void
+rpc_lockprof_reset(void)
+{
+	struct rpc_lockprof_site *site;
+	size_t off = G_STRUCT_OFFSET(struct rpc_lockprof_site, rls_count);
+	guint i;
+
+	for (i = 0; i < RPC_LOCKPROF_SITES; i++) {
+		site = &rpc_lockprof_sites[i];
+		if (g_atomic_pointer_get(&site->rls_site) == NULL)
+			continue;
+
+		memset((char *)site + off, 0, sizeof(*site) - off);
+	}
+
+	g_atomic_int_set(&rpc_lockprof_dropped, 0);
+}
+
+rpc_object_t
+rpc_lockprof_get_stats(void)
+{
+	struct rpc_lockprof_site *copies;
+	struct rpc_lockprof_site *site;
+	rpc_object_t sites;
+	rpc_object_t entry;
+	GPtrArray *sorted;
+	guint count = 0;
+	guint i;
+
+	copies = g_malloc0_n(RPC_LOCKPROF_SITES, sizeof(*copies));
+	sorted = g_ptr_array_new();
+
+	/* Counters are read racily, which is fine for a profile */
+	for (i = 0; i < RPC_LOCKPROF_SITES; i++) {
+		site = &rpc_lockprof_sites[i];
+		if (g_atomic_pointer_get(&site->rls_site) == NULL)
+			continue;
+
+		copies[count] = *site;
+		if (copies[count].rls_count != 0)
+			g_ptr_array_add(sorted, &copies[count]);
+
+		count++;
+	}
+
+	g_ptr_array_sort(sorted, rpc_lockprof_compare);
+	sites = rpc_array_create();
+
+	for (i = 0; i < sorted->len; i++) {
+		site = g_ptr_array_index(sorted, i);
+		entry = rpc_object_pack("{s,s,u,u,u,u,u,u,u,u,u,u}",
+		    "site", site->rls_site,
+		    "kind", rpc_lock_kind_names[site->rls_kind],
+		    "acquisitions", site->rls_count,
+		    "contended", site->rls_contended,
+		    "wait_ns", site->rls_wait_ns,
+		    "max_wait_ns", site->rls_max_wait_ns,
+		    "p50_wait_ns",
+		    rpc_lockprof_percentile(site->rls_wait_hist, 0.50),
+		    "p99_wait_ns",
+		    rpc_lockprof_percentile(site->rls_wait_hist, 0.99),
+		    "hold_ns", site->rls_hold_ns,
+		    "max_hold_ns", site->rls_max_hold_ns,
+		    "p50_hold_ns",
+		    rpc_lockprof_percentile(site->rls_hold_hist, 0.50),
+		    "p99_hold_ns",
+		    rpc_lockprof_percentile(site->rls_hold_hist, 0.99));
+
+		rpc_dictionary_steal_value(entry, "wait_hist",
+		    rpc_lockprof_hist_export(site->rls_wait_hist));
+		rpc_dictionary_steal_value(entry, "hold_hist",
+		    rpc_lockprof_hist_export(site->rls_hold_hist));
+		rpc_array_append_stolen_value(sites, entry);
+	}
+
+	g_ptr_array_free(sorted, true);
+	g_free(copies);
+
+	return (rpc_object_pack("{b,u,v}",
+	    "enabled", (bool)g_atomic_int_get(&rpc_lockprof_active),
+	    "dropped_sites", (uint64_t)g_atomic_int_get(&rpc_lockprof_dropped),
+	    "sites", sites));
+}
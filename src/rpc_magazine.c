@@ -0,0 +1,207 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Per-thread caches of fixed size structures.
+ *
+ * Every thread keeps two magazines of free items per cache, so that
+ * allocating and freeing is a pointer pop or push as long as one of them
+ * has an item, or room for one. Only when both are exhausted does the
+ * thread trade a magazine with the cache's depot, under its lock, which
+ * is also how items freed on one thread get back to the one allocating
+ * them. Items the depot has no room for are destroyed.
+ *
+ * Cached items keep whatever their owner left initialized in them.
+ */
+
+struct rpc_magazine
+{
+	struct rpc_magazine *	rm_next;
+	guint			rm_count;
+	gpointer		rm_items[RPC_MAGAZINE_SIZE];
+};
+
+struct rpc_magazine_thread
+{
+	struct rpc_object_cache *rmt_cache;
+	struct rpc_magazine *	rmt_loaded;
+	struct rpc_magazine *	rmt_previous;
+};
+
+static struct rpc_magazine_thread *rpc_magazine_thread_get(
+    struct rpc_object_cache *);
+static void rpc_magazine_destroy(struct rpc_object_cache *,
+    struct rpc_magazine *);
+
+static struct rpc_magazine_thread *
+rpc_magazine_thread_get(struct rpc_object_cache *cache)
+{
+	struct rpc_magazine_thread *self;
+
+	self = g_private_get(&cache->roc_thread);
+	if (G_LIKELY(self != NULL))
+		return (self);
+
+	self = g_malloc0(sizeof(*self));
+	self->rmt_cache = cache;
+	self->rmt_loaded = g_malloc0(sizeof(struct rpc_magazine));
+	self->rmt_previous = g_malloc0(sizeof(struct rpc_magazine));
+	g_private_set(&cache->roc_thread, self);
+	return (self);
+}
+
+static void
+rpc_magazine_destroy(struct rpc_object_cache *cache,
+    struct rpc_magazine *mag)
+{
+	guint i;
+
+	for (i = 0; i < mag->rm_count; i++) {
+		if (cache->roc_destroy != NULL)
+			cache->roc_destroy(mag->rm_items[i]);
+
+		g_free(mag->rm_items[i]);
+	}
+
+	g_free(mag);
+}
+
+/*
+ * GPrivate destructor of a cache. Items of an exiting thread go to the
+ * depot if it has room for them.
+ */
+void
+rpc_object_cache_thread_exit(gpointer data)
+{
+	struct rpc_magazine_thread *self = data;
+	struct rpc_object_cache *cache = self->rmt_cache;
+	struct rpc_magazine *mags[] = { self->rmt_loaded, self->rmt_previous };
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(mags); i++) {
+		g_mutex_lock(&cache->roc_mtx);
+		if (mags[i]->rm_count > 0 &&
+		    cache->roc_full_count < RPC_MAGAZINE_DEPOT) {
+			mags[i]->rm_next = cache->roc_full;
+			cache->roc_full = mags[i];
+			cache->roc_full_count++;
+			mags[i] = NULL;
+		}
+		g_mutex_unlock(&cache->roc_mtx);
+
+		if (mags[i] != NULL)
+			rpc_magazine_destroy(cache, mags[i]);
+	}
+
+	g_free(self);
+}
+
+/*
+ * Returns a cached item as its last owner left it, or a zeroed new one.
+ * Whether it was cached is returned in @p cached.
+ */
+gpointer
+rpc_object_cache_alloc(struct rpc_object_cache *cache, bool *cached)
+{
+	struct rpc_magazine_thread *self = rpc_magazine_thread_get(cache);
+	struct rpc_magazine *mag;
+
+	if (G_UNLIKELY(self->rmt_loaded->rm_count == 0)) {
+		if (self->rmt_previous->rm_count > 0) {
+			mag = self->rmt_loaded;
+			self->rmt_loaded = self->rmt_previous;
+			self->rmt_previous = mag;
+		} else {
+			g_mutex_lock(&cache->roc_mtx);
+			mag = cache->roc_full;
+			if (mag != NULL) {
+				cache->roc_full = mag->rm_next;
+				cache->roc_full_count--;
+				self->rmt_previous->rm_next = cache->roc_empty;
+				cache->roc_empty = self->rmt_previous;
+				self->rmt_previous = self->rmt_loaded;
+				self->rmt_loaded = mag;
+			}
+			g_mutex_unlock(&cache->roc_mtx);
+
+			if (mag == NULL) {
+				*cached = false;
+				return (g_malloc0(cache->roc_size));
+			}
+		}
+	}
+
+	*cached = true;
+	mag = self->rmt_loaded;
+	return (mag->rm_items[--mag->rm_count]);
+}
+
+void
+rpc_object_cache_free(struct rpc_object_cache *cache, gpointer item)
+{
+	struct rpc_magazine_thread *self = rpc_magazine_thread_get(cache);
+	struct rpc_magazine *mag;
+
+	if (G_UNLIKELY(self->rmt_loaded->rm_count == RPC_MAGAZINE_SIZE)) {
+		if (self->rmt_previous->rm_count < RPC_MAGAZINE_SIZE) {
+			mag = self->rmt_loaded;
+			self->rmt_loaded = self->rmt_previous;
+			self->rmt_previous = mag;
+		} else {
+			g_mutex_lock(&cache->roc_mtx);
+			if (cache->roc_full_count >= RPC_MAGAZINE_DEPOT) {
+				g_mutex_unlock(&cache->roc_mtx);
+				if (cache->roc_destroy != NULL)
+					cache->roc_destroy(item);
+
+				g_free(item);
+				return;
+			}
+
+			self->rmt_previous->rm_next = cache->roc_full;
+			cache->roc_full = self->rmt_previous;
+			cache->roc_full_count++;
+			self->rmt_previous = self->rmt_loaded;
+
+			mag = cache->roc_empty;
+			if (mag != NULL)
+				cache->roc_empty = mag->rm_next;
+			g_mutex_unlock(&cache->roc_mtx);
+
+			if (mag == NULL)
+				mag = g_malloc0(sizeof(*mag));
+
+			mag->rm_count = 0;
+			self->rmt_loaded = mag;
+		}
+	}
+
+	mag = self->rmt_loaded;
+	mag->rm_items[mag->rm_count++] = item;
+}
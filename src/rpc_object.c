@@ -44,9 +44,9 @@
 #include <sys/uio.h>
 #include "serializer/json.h"
 #include "internal.h"
-#if defined(__linux__)
-#include "memfd.h"
-#endif
+#include "serializer/msgpack.h"
+
+#define	RPC_LAZY_LOCKS		64
 
 static const char *rpc_types[] = {
     [RPC_TYPE_NULL] = "nulltype",
@@ -73,22 +73,433 @@ static struct rpc_object this_null_obj = {
 };
 
 static rpc_object_t this_null = &this_null_obj;
+static struct rpc_object_cache rpc_object_cache =
+    RPC_OBJECT_CACHE_INIT(struct rpc_object, NULL);
+static volatile gint rpc_error_capture = true;
+static GPrivate rpc_error_capture_off;
+static GMutex rpc_lazy_locks[RPC_LAZY_LOCKS];
 
 rpc_object_t
 rpc_prim_create(rpc_type_t type, union rpc_value val)
 {
 	struct rpc_object *ro;
+	bool cached;
 
-	ro = (rpc_object_t)g_malloc0(sizeof(*ro));
+	ro = rpc_object_cache_alloc(&rpc_object_cache, &cached);
 	if (ro == NULL)
 		rpc_abort("malloc() returned NULL");
 
+	if (cached)
+		memset(ro, 0, sizeof(*ro));
+
+	ro->ro_type = type;
+	ro->ro_value = val;
+	ro->ro_refcnt = 1;
+	return (ro);
+}
+
+rpc_object_t
+rpc_prim_create_in(struct rpc_arena *arena, rpc_type_t type,
+    union rpc_value val)
+{
+	struct rpc_object *ro;
+
+	if (arena == NULL)
+		return (rpc_prim_create(type, val));
+
+	ro = rpc_arena_alloc(arena, sizeof(*ro));
+	memset(ro, 0, sizeof(*ro));
 	ro->ro_type = type;
 	ro->ro_value = val;
 	ro->ro_refcnt = 1;
+	ro->ro_arena = arena;
+	rpc_arena_retain(arena);
 	return (ro);
 }
 
+static bool
+rpc_string_set_inline(union rpc_value *val, const char *string, size_t length)
+{
+
+	if (length > RPC_STRING_INLINE_MAX)
+		return (false);
+
+	val->rv_str.rsv_str = NULL;
+	val->rv_str.rsv_len = (uint8_t)length;
+	memcpy(val->rv_str.rsv_inline, string, length);
+	val->rv_str.rsv_inline[length] = '\0';
+	return (true);
+}
+
+static void
+rpc_string_set(union rpc_value *val, const char *string, size_t length)
+{
+
+	if (!rpc_string_set_inline(val, string, length))
+		val->rv_str.rsv_str = g_string_new_len(string, length);
+}
+
+static rpc_object_t
+rpc_string_create_vprintf(const char *fmt, va_list ap)
+{
+	union rpc_value val;
+	va_list copy;
+	int len;
+
+	va_copy(copy, ap);
+	len = g_vsnprintf(val.rv_str.rsv_inline, sizeof(val.rv_str.rsv_inline),
+	    fmt, copy);
+	va_end(copy);
+
+	if (len >= 0 && len <= RPC_STRING_INLINE_MAX) {
+		val.rv_str.rsv_str = NULL;
+		val.rv_str.rsv_len = (uint8_t)len;
+	} else {
+		val.rv_str.rsv_str = g_string_new(NULL);
+		g_string_vprintf(val.rv_str.rsv_str, fmt, ap);
+	}
+
+	return (rpc_prim_create(RPC_TYPE_STRING, val));
+}
+
+/*
+ * Strings placed in an arena have their GString header and contents
+ * allocated right next to each other, unless short enough to be stored
+ * inline. Like rpc_string_create(), this stops at the first NUL
+ * character.
+ */
+rpc_object_t
+rpc_string_create_in(struct rpc_arena *arena, const char *string,
+    size_t length)
+{
+	union rpc_value val;
+	GString *str;
+
+	length = strnlen(string, length);
+	if (arena == NULL) {
+		rpc_string_set(&val, string, length);
+		return (rpc_prim_create(RPC_TYPE_STRING, val));
+	}
+
+	if (!rpc_string_set_inline(&val, string, length)) {
+		str = rpc_arena_alloc(arena, sizeof(*str) + length + 1);
+		str->str = (char *)(str + 1);
+		str->len = length;
+		str->allocated_len = length + 1;
+		memcpy(str->str, string, length);
+		str->str[length] = '\0';
+		val.rv_str.rsv_str = str;
+	}
+
+	return (rpc_prim_create_in(arena, RPC_TYPE_STRING, val));
+}
+
+/*
+ * Containers decoded lazily from an inbound frame or a mapped snapshot
+ * keep their storage empty until first accessed. Every path looking
+ * into the storage goes through here first.
+ *
+ * Materializing frees the lazy state, so threads racing to touch a
+ * container first are serialized on a lock picked by its address; the
+ * ones that lose find ro_lazy cleared once they get it.
+ */
+static inline void
+rpc_container_load(rpc_object_t object)
+{
+	struct rpc_lazy *lazy;
+	GMutex *mtx;
+
+	if (g_atomic_pointer_get(&object->ro_lazy) == NULL)
+		return;
+
+	mtx = &rpc_lazy_locks[((uintptr_t)object / sizeof(*object)) %
+	    RPC_LAZY_LOCKS];
+	g_mutex_lock(mtx);
+	lazy = object->ro_lazy;
+	if (lazy != NULL)
+		lazy->rl_materialize(object);
+
+	g_mutex_unlock(mtx);
+}
+
+static bool
+rpc_array_is_packed(rpc_object_t array)
+{
+
+	return (array->ro_type == RPC_TYPE_ARRAY &&
+	    array->ro_value.rv_list == NULL);
+}
+
+/*
+ * Converts a packed array into a regular array of boxed elements.
+ */
+static void
+rpc_array_box(rpc_object_t array)
+{
+	struct rpc_packed_array packed;
+	GPtrArray *list;
+	rpc_object_t item;
+	size_t i;
+
+	rpc_container_load(array);
+	if (!rpc_array_is_packed(array))
+		return;
+
+	packed = array->ro_value.rv_packed;
+	list = g_ptr_array_new_full((guint)packed.rpa_count,
+	    (GDestroyNotify)rpc_release_impl);
+
+	for (i = 0; i < packed.rpa_count; i++) {
+		switch (packed.rpa_type) {
+		case RPC_TYPE_INT64:
+			item = rpc_int64_create(
+			    ((int64_t *)packed.rpa_data)[i]);
+			break;
+
+		case RPC_TYPE_UINT64:
+			item = rpc_uint64_create(
+			    ((uint64_t *)packed.rpa_data)[i]);
+			break;
+
+		case RPC_TYPE_DOUBLE:
+			item = rpc_double_create(
+			    ((double *)packed.rpa_data)[i]);
+			break;
+
+		case RPC_TYPE_BOOL:
+			item = rpc_bool_create(((bool *)packed.rpa_data)[i]);
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+		g_ptr_array_add(list, item);
+	}
+
+	g_free(packed.rpa_data);
+	array->ro_value.rv_list = list;
+}
+
+static bool
+rpc_is_container(rpc_object_t object)
+{
+
+	return (object->ro_type == RPC_TYPE_ARRAY ||
+	    object->ro_type == RPC_TYPE_DICTIONARY);
+}
+
+/*
+ * rpc_copy() of a container shares its storage with the original. The
+ * owners are counted in ro_cow, allocated on the first copy and freed
+ * along with the storage by the last owner. Storage is split off on
+ * the first modification, or when a value is handed out, since the
+ * caller might modify it in turn; even scalars carry a mutable type
+ * (see rpct_set_typei()). Typed getters only read values, so they leave
+ * the storage shared.
+ */
+static rpc_object_t
+rpc_container_share(rpc_object_t object)
+{
+	volatile int *cow;
+	rpc_object_t result;
+
+	rpc_container_load(object);
+	if (g_atomic_pointer_get(&object->ro_cow) == NULL) {
+		cow = g_new(volatile int, 1);
+		*cow = 1;
+		if (!g_atomic_pointer_compare_and_exchange(&object->ro_cow,
+		    NULL, (void *)cow))
+			g_free((void *)cow);
+	}
+
+	g_atomic_int_inc(object->ro_cow);
+	result = rpc_prim_create(object->ro_type, object->ro_value);
+	result->ro_cow = object->ro_cow;
+	return (result);
+}
+
+static rpc_object_t
+rpc_container_share_value(rpc_object_t value)
+{
+
+	if (rpc_array_is_packed(value))
+		return (rpc_retain(value));
+
+	return (rpc_copy(value));
+}
+
+static void
+rpc_container_free_storage(rpc_object_t object)
+{
+
+	if (object->ro_type == RPC_TYPE_DICTIONARY)
+		rpc_dict_free(object->ro_value.rv_dict);
+	else
+		g_ptr_array_unref(object->ro_value.rv_list);
+}
+
+/*
+ * Builds a private copy of the container storage. Values are copied;
+ * nested containers share their storage in turn.
+ */
+static union rpc_value
+rpc_container_dup_storage(rpc_object_t object)
+{
+	struct rpc_dict_iter iter;
+	union rpc_value result;
+	const char *key;
+	rpc_object_t value;
+	guint i;
+
+	if (object->ro_type == RPC_TYPE_DICTIONARY) {
+		result.rv_dict = rpc_dict_new(
+		    rpc_dict_count(object->ro_value.rv_dict));
+		rpc_dict_iter_init(&iter, object->ro_value.rv_dict);
+		while (rpc_dict_iter_next(&iter, &key, &value)) {
+			rpc_dict_insert_str(result.rv_dict, key, strlen(key),
+			    rpc_container_share_value(value));
+		}
+
+		return (result);
+	}
+
+	result.rv_list = g_ptr_array_new_full(object->ro_value.rv_list->len,
+	    (GDestroyNotify)rpc_release_impl);
+	for (i = 0; i < object->ro_value.rv_list->len; i++) {
+		g_ptr_array_add(result.rv_list, rpc_container_share_value(
+		    g_ptr_array_index(object->ro_value.rv_list, i)));
+	}
+
+	return (result);
+}
+
+static void
+rpc_container_unshare(rpc_object_t object)
+{
+	volatile int *cow = object->ro_cow;
+	union rpc_value storage;
+
+	rpc_container_load(object);
+
+	/* Frozen objects are never modified, so their storage stays shared */
+	if (object->ro_frozen)
+		return;
+
+	if (cow == NULL || g_atomic_int_get(cow) == 1)
+		return;
+
+	storage = rpc_container_dup_storage(object);
+
+	/* Other owners may have let go in the meantime */
+	if (g_atomic_int_dec_and_test(cow)) {
+		rpc_container_free_storage(object);
+		g_free((void *)cow);
+	}
+
+	object->ro_value = storage;
+	object->ro_cow = NULL;
+}
+
+/*
+ * Prepares an array for handing out its elements.
+ */
+static void
+rpc_array_own(rpc_object_t array)
+{
+
+	rpc_array_box(array);
+	rpc_container_unshare(array);
+}
+
+/*
+ * Prepares a container for modification. Bumping the generation lets
+ * query indexes built over the container notice it has changed.
+ */
+static void
+rpc_container_modify(rpc_object_t object)
+{
+
+	if (object->ro_frozen)
+		rpc_abort("Trying to modify a frozen object");
+
+	rpc_array_box(object);
+	rpc_container_unshare(object);
+	object->ro_generation++;
+}
+
+/*
+ * Same as rpc_array_apply() and rpc_dictionary_apply(), but don't split
+ * shared storage off. The applier must not modify the values.
+ */
+bool
+rpc_array_walk(rpc_object_t array, rpc_array_applier_t applier)
+{
+	size_t i;
+
+	rpc_array_box(array);
+	for (i = 0; i < array->ro_value.rv_list->len; i++) {
+		if (!applier(i, g_ptr_array_index(array->ro_value.rv_list, i)))
+			return (true);
+	}
+
+	return (false);
+}
+
+bool
+rpc_dictionary_walk(rpc_object_t dictionary, rpc_dictionary_applier_t applier)
+{
+	struct rpc_dict_iter iter;
+	const char *key;
+	rpc_object_t value;
+
+	rpc_container_load(dictionary);
+	rpc_dict_iter_init(&iter, dictionary->ro_value.rv_dict);
+	while (rpc_dict_iter_next(&iter, &key, &value)) {
+		if (!applier(key, value))
+			return (true);
+	}
+
+	return (false);
+}
+
+size_t
+rpc_array_packed_elem_size(rpc_type_t type)
+{
+
+	switch (type) {
+	case RPC_TYPE_INT64:
+		return (sizeof(int64_t));
+
+	case RPC_TYPE_UINT64:
+		return (sizeof(uint64_t));
+
+	case RPC_TYPE_DOUBLE:
+		return (sizeof(double));
+
+	case RPC_TYPE_BOOL:
+		return (sizeof(bool));
+
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Wraps a g_malloc()ed buffer of elements, taking ownership of it.
+ */
+rpc_object_t
+rpc_array_create_packed_stolen(rpc_type_t type, void *data, size_t count)
+{
+	union rpc_value val;
+
+	val.rv_packed.rpa_list = NULL;
+	val.rv_packed.rpa_type = type;
+	val.rv_packed.rpa_count = count;
+	val.rv_packed.rpa_data = data;
+	return (rpc_prim_create(RPC_TYPE_ARRAY, val));
+}
+
 static size_t
 rpc_data_hash(const uint8_t *data, size_t length)
 {
@@ -107,6 +518,7 @@ rpc_create_description(GString *description, rpc_object_t object,
 	unsigned int local_indent_lvl = indent_lvl + 1;
 	size_t data_length, i;
 	uint8_t *data_ptr;
+	GDateTime *datetime;
 	char *str_date;
 
 	if ((indent_lvl > 0) && (!nested))
@@ -163,9 +575,10 @@ rpc_create_description(GString *description, rpc_object_t object,
 		break;
 
 	case RPC_TYPE_DATE:
-		str_date = g_date_time_format(object->ro_value.rv_datetime,
-		    "%F %T");
+		datetime = rpc_date_get_gdatetime(object);
+		str_date = g_date_time_format(datetime, "%F %T");
 		g_string_append(description, str_date);
+		g_date_time_unref(datetime);
 		g_free(str_date);
 		break;
 
@@ -214,7 +627,7 @@ rpc_create_description(GString *description, rpc_object_t object,
 
 	case RPC_TYPE_DICTIONARY:
 		g_string_append(description, "{\n");
-		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
+		rpc_dictionary_walk(object, ^(const char *k, rpc_object_t v) {
 			g_string_append_printf(description, "%*s%s: ",
 			    (local_indent_lvl * 4), "", k);
 			rpc_create_description(description, v, local_indent_lvl,
@@ -233,7 +646,7 @@ rpc_create_description(GString *description, rpc_object_t object,
 
 	case RPC_TYPE_ARRAY:
 		g_string_append(description, "[\n");
-		rpc_array_apply(object, ^(size_t idx, rpc_object_t v) {
+		rpc_array_walk(object, ^(size_t idx, rpc_object_t v) {
 			g_string_append_printf(
 			    description, "%*s%u: ",
 			    (local_indent_lvl * 4),
@@ -461,14 +874,59 @@ rpc_array_comparator_converter(const void *p1, const void *p2, void *data)
 	return (((rpc_array_cmp_t)data)(o1, o2));
 }
 
+/*
+ * Objects pinned by rpc_object_freeze() don't use their own reference
+ * count: references to them are counted on the root of the frozen tree,
+ * which frees them along with itself.
+ *
+ * The root's count stays atomic. A biased count would let the freezing
+ * thread skip the atomic, but references move between threads all the
+ * time here, e.g. into callbacks, and a release on another thread would
+ * then need the owner to merge counts, which it has no point to do.
+ */
+static inline volatile int *
+rpc_object_refcnt(rpc_object_t object)
+{
+
+	if (object->ro_root != NULL)
+		return (&object->ro_root->ro_refcnt);
+
+	return (&object->ro_refcnt);
+}
+
 inline rpc_object_t
 rpc_retain(rpc_object_t object)
 {
 
-	g_atomic_int_inc(&object->ro_refcnt);
+	g_atomic_int_inc(rpc_object_refcnt(object));
 	return (object);
 }
 
+static void
+rpc_encoding_free(struct rpc_encoding *enc)
+{
+	struct rpc_encoding *next;
+
+	for (; enc != NULL; enc = next) {
+		next = enc->re_next;
+		g_free(enc);
+	}
+}
+
+static int
+rpc_release_pinned(rpc_object_t object)
+{
+	rpc_object_t root = object->ro_root;
+
+	if (g_atomic_int_get(&root->ro_refcnt) > 0)
+		return (rpc_release_impl(root));
+
+	/* The root is being torn down, take the object along */
+	object->ro_root = NULL;
+	object->ro_refcnt = 1;
+	return (rpc_release_impl(object));
+}
+
 inline int
 rpc_release_impl(rpc_object_t object)
 {
@@ -476,6 +934,9 @@ rpc_release_impl(rpc_object_t object)
 	if (object == NULL)
 		return (0);
 
+	if (object->ro_root != NULL)
+		return (rpc_release_pinned(object));
+
 	assert(object->ro_refcnt > 0);
 
 	if (g_atomic_int_dec_and_test(&object->ro_refcnt)) {
@@ -491,12 +952,18 @@ rpc_release_impl(rpc_object_t object)
 			break;
 
 		case RPC_TYPE_STRING:
-			g_string_free(object->ro_value.rv_str, true);
+			if (object->ro_arena == NULL &&
+			    object->ro_value.rv_str.rsv_str != NULL) {
+				g_string_free(object->ro_value.rv_str.rsv_str,
+				    true);
+			}
 			break;
 
-		case RPC_TYPE_DATE:
-			g_date_time_unref(object->ro_value.rv_datetime);
+#if defined(__linux__)
+		case RPC_TYPE_SHMEM:
+			rpc_shmem_block_release(&object->ro_value.rv_shmem);
 			break;
+#endif
 
 		case RPC_TYPE_NULL:
 			g_assert_not_reached();
@@ -509,16 +976,29 @@ rpc_release_impl(rpc_object_t object)
 			return (0);
 
 		case RPC_TYPE_ARRAY:
-			g_ptr_array_unref(object->ro_value.rv_list);
-			break;
-
 		case RPC_TYPE_DICTIONARY:
-			g_hash_table_unref(object->ro_value.rv_dict);
+			if (rpc_array_is_packed(object)) {
+				g_free(object->ro_value.rv_packed.rpa_data);
+				break;
+			}
+
+			if (object->ro_lazy != NULL)
+				object->ro_lazy->rl_free(object->ro_lazy);
+
+			if (object->ro_cow != NULL) {
+				if (!g_atomic_int_dec_and_test(object->ro_cow))
+					break;
+
+				g_free((void *)object->ro_cow);
+			}
+
+			rpc_container_free_storage(object);
 			break;
 
 		case RPC_TYPE_ERROR:
 			rpc_release(object->ro_value.rv_error.rev_extra);
 			rpc_release(object->ro_value.rv_error.rev_stack);
+			g_free(object->ro_value.rv_error.rev_frames);
 			g_string_free(object->ro_value.rv_error.rev_message,
 			    true);
 			break;
@@ -527,10 +1007,16 @@ rpc_release_impl(rpc_object_t object)
 			break;
 		}
 
+		rpc_encoding_free(object->ro_encoding);
+
 		if (object->ro_typei != NULL)
 			rpct_typei_release(object->ro_typei);
 
-		g_free(object);
+		if (object->ro_arena != NULL)
+			rpc_arena_release(object->ro_arena);
+		else
+			rpc_object_cache_free(&rpc_object_cache, object);
+
 		return (0);
 	}
 
@@ -543,29 +1029,159 @@ rpc_get_refcount(rpc_object_t object)
 	if (object == NULL)
 		return (0);
 
-	return (object->ro_refcnt);
+	return (*rpc_object_refcnt(object));
 }
 
-inline size_t
-rpc_get_line_number(rpc_object_t object)
+static void
+rpc_object_freeze_one(rpc_object_t object, rpc_object_t root)
 {
 
-	return (object->ro_line);
-}
+	if (object->ro_frozen)
+		return;
 
-inline size_t
-rpc_get_column_number(rpc_object_t object)
-{
+	switch (object->ro_type) {
+	case RPC_TYPE_NULL:
+		/* Shared singleton */
+		return;
 
-	return (object->ro_column);
-}
+	case RPC_TYPE_ARRAY:
+		/* Boxing later on would modify the object */
+		rpc_array_box(object);
+		rpc_container_unshare(object);
+		break;
 
-inline rpc_type_t
-rpc_get_type(rpc_object_t object)
-{
+	case RPC_TYPE_DICTIONARY:
+		rpc_container_unshare(object);
+		break;
 
-	if (object == NULL)
-		return (RPC_TYPE_NULL);
+	default:
+		break;
+	}
+
+	/*
+	 * Only objects that nothing but their parent refers to can be
+	 * pinned. Others keep counting on their own and become the root
+	 * for their descendants.
+	 */
+	if (object != root && object->ro_refcnt == 1)
+		object->ro_root = root;
+	else
+		root = object;
+
+	object->ro_frozen = true;
+
+	switch (object->ro_type) {
+	case RPC_TYPE_ARRAY:
+		rpc_array_walk(object, ^(size_t idx __unused, rpc_object_t v) {
+			rpc_object_freeze_one(v, root);
+			return ((bool)true);
+		});
+		break;
+
+	case RPC_TYPE_DICTIONARY:
+		rpc_dictionary_walk(object, ^(const char *k __unused,
+		    rpc_object_t v) {
+			rpc_object_freeze_one(v, root);
+			return ((bool)true);
+		});
+		break;
+
+	case RPC_TYPE_ERROR:
+		if (object->ro_value.rv_error.rev_extra != NULL) {
+			rpc_object_freeze_one(
+			    object->ro_value.rv_error.rev_extra, root);
+		}
+
+		if (object->ro_value.rv_error.rev_stack != NULL) {
+			rpc_object_freeze_one(
+			    object->ro_value.rv_error.rev_stack, root);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+rpc_object_t
+rpc_object_freeze(rpc_object_t object)
+{
+
+	rpc_object_freeze_one(object, object);
+	return (object);
+}
+
+bool
+rpc_object_is_frozen(rpc_object_t object)
+{
+
+	return (object->ro_frozen);
+}
+
+const struct rpc_encoding *
+rpc_encoding_find(rpc_object_t object, unsigned int flags)
+{
+	struct rpc_encoding *enc;
+
+	enc = g_atomic_pointer_get(&object->ro_encoding);
+	for (; enc != NULL; enc = enc->re_next) {
+		if (enc->re_flags == flags)
+			return (enc);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Attaches an encoding to a frozen object. Passing NULL data marks the
+ * object as not cacheable for the given flags.
+ */
+const struct rpc_encoding *
+rpc_encoding_add(rpc_object_t object, unsigned int flags, const void *data,
+    size_t len)
+{
+	struct rpc_encoding *enc;
+
+	g_assert(object->ro_frozen);
+
+	if (data == NULL)
+		len = 0;
+
+	enc = g_malloc(sizeof(*enc) + len);
+	enc->re_flags = flags;
+	enc->re_valid = data != NULL;
+	enc->re_len = len;
+	if (data != NULL)
+		memcpy(enc->re_data, data, len);
+
+	do {
+		enc->re_next = g_atomic_pointer_get(&object->ro_encoding);
+	} while (!g_atomic_pointer_compare_and_exchange(&object->ro_encoding,
+	    enc->re_next, enc));
+
+	return (enc);
+}
+
+inline size_t
+rpc_get_line_number(rpc_object_t object)
+{
+
+	return (object->ro_line);
+}
+
+inline size_t
+rpc_get_column_number(rpc_object_t object)
+{
+
+	return (object->ro_column);
+}
+
+inline rpc_type_t
+rpc_get_type(rpc_object_t object)
+{
+
+	if (object == NULL)
+		return (RPC_TYPE_NULL);
 
 	return (object->ro_type);
 }
@@ -584,6 +1200,9 @@ inline rpc_object_t
 rpc_copy(rpc_object_t object)
 {
 	rpc_object_t result = NULL;
+	const void *packed;
+	rpc_type_t packed_type;
+	size_t packed_count;
 	void *buffer;
 
 	switch (object->ro_type) {
@@ -604,7 +1223,8 @@ rpc_copy(rpc_object_t object)
 		break;
 
 	case RPC_TYPE_DATE:
-		result = rpc_date_create(rpc_date_get_value(object));
+		result = rpc_date_create_usec(object->ro_value.rv_date.rdv_usec,
+		    object->ro_value.rv_date.rdv_tz_offset);
 		break;
 
 	case RPC_TYPE_DOUBLE:
@@ -628,6 +1248,12 @@ rpc_copy(rpc_object_t object)
 
 #if defined(__linux__)
 	case RPC_TYPE_SHMEM:
+		/* A pooled chunk is one allocation, shared by every copy */
+		if (object->ro_value.rv_shmem.rsb_pool != NULL) {
+			result = rpc_retain(object);
+			break;
+		}
+
 		result = rpc_shmem_recreate(
 		    object->ro_value.rv_shmem.rsb_fd,
 		    object->ro_value.rv_shmem.rsb_offset,
@@ -642,19 +1268,31 @@ rpc_copy(rpc_object_t object)
 		break;
 
 	case RPC_TYPE_DICTIONARY:
-		result = rpc_dictionary_create();
-		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
-		    	rpc_dictionary_steal_value(result, k, rpc_copy(v));
-		    	return ((bool)true);
-		});
+		if (object->ro_frozen) {
+			result = rpc_prim_create(object->ro_type,
+			    rpc_container_dup_storage(object));
+			break;
+		}
+
+		result = rpc_container_share(object);
 		break;
 
 	case RPC_TYPE_ARRAY:
-		result = rpc_array_create();
-		rpc_array_apply(object, ^(size_t idx, rpc_object_t v) {
-			rpc_array_steal_value(result, idx, rpc_copy(v));
-		    	return ((bool)true);
-		});
+		packed = rpc_array_get_packed(object, &packed_type,
+		    &packed_count);
+		if (packed != NULL) {
+			result = rpc_array_create_packed(packed_type, packed,
+			    packed_count);
+			break;
+		}
+
+		if (object->ro_frozen) {
+			result = rpc_prim_create(object->ro_type,
+			    rpc_container_dup_storage(object));
+			break;
+		}
+
+		result = rpc_container_share(object);
 		break;
 	}
 
@@ -664,13 +1302,53 @@ rpc_copy(rpc_object_t object)
 	return (result);
 }
 
+/*
+ * Strings never change and neither does anything under a frozen
+ * object, so their hashes are computed once and kept. Anything else
+ * may be modified in place, or, for descriptors, renumbered, and is
+ * hashed every time. A hash of 0 is indistinguishable from none.
+ */
+static inline bool
+rpc_hash_cacheable(rpc_object_t object)
+{
+
+	switch (object->ro_type) {
+	case RPC_TYPE_STRING:
+		return (true);
+
+	case RPC_TYPE_BINARY:
+	case RPC_TYPE_ARRAY:
+	case RPC_TYPE_DICTIONARY:
+		return (object->ro_frozen);
+
+	default:
+		return (false);
+	}
+}
+
+static inline size_t
+rpc_hash_cached(rpc_object_t object)
+{
+
+	return (__atomic_load_n(&object->ro_hash, __ATOMIC_RELAXED));
+}
+
 inline int
 rpc_cmp(rpc_object_t o1, rpc_object_t o2)
 {
-	int h1 = (int)rpc_hash(o1);
-	int h2 = (int)rpc_hash(o2);
+	int64_t d1, d2;
+	int h1, h2;
 
-	return (h1 - h2);
+	/* Dates sort in time order */
+	if (o1->ro_type == RPC_TYPE_DATE && o2->ro_type == RPC_TYPE_DATE) {
+		d1 = o1->ro_value.rv_date.rdv_usec;
+		d2 = o2->ro_value.rv_date.rdv_usec;
+		return ((d1 > d2) - (d1 < d2));
+	}
+
+	h1 = (int)rpc_hash(o1);
+	h2 = (int)rpc_hash(o2);
+	return ((h1 > h2) - (h1 < h2));
 }
 
 inline bool
@@ -686,6 +1364,14 @@ rpc_equal(rpc_object_t o1, rpc_object_t o2)
 	if (o1->ro_type != o2->ro_type)
 		return (false);
 
+	if (o1 == o2)
+		return (true);
+
+	/* Only cached hashes are worth looking at, computing is a walk */
+	if (rpc_hash_cached(o1) != 0 && rpc_hash_cached(o2) != 0 &&
+	    rpc_hash_cached(o1) != rpc_hash_cached(o2))
+		return (false);
+
 	switch (o1->ro_type) {
 	case RPC_TYPE_NULL:
 		return (true);
@@ -713,11 +1399,15 @@ rpc_equal(rpc_object_t o1, rpc_object_t o2)
 		    (o1_fdstat.st_ino == o2_fdstat.st_ino));
 
 	case RPC_TYPE_DATE:
-		return (rpc_date_get_value(o1) == rpc_date_get_value(o2));
+		return (o1->ro_value.rv_date.rdv_usec ==
+		    o2->ro_value.rv_date.rdv_usec);
 
 	case RPC_TYPE_STRING:
-		return (bool)(g_string_equal(o1->ro_value.rv_str,
-		    o2->ro_value.rv_str));
+		return (bool)(rpc_string_get_length(o1) ==
+		    rpc_string_get_length(o2) &&
+		    memcmp(rpc_string_get_string_ptr(o1),
+		    rpc_string_get_string_ptr(o2),
+		    rpc_string_get_length(o1)) == 0);
 
 	case RPC_TYPE_BINARY:
 		data_len = rpc_data_get_length(o1);
@@ -747,18 +1437,20 @@ rpc_equal(rpc_object_t o1, rpc_object_t o2)
 			return (false);
 
 		return ((o1_fdstat.st_dev == o2_fdstat.st_dev) &&
-		    (o1_fdstat.st_ino == o2_fdstat.st_ino));
+		    (o1_fdstat.st_ino == o2_fdstat.st_ino) &&
+		    (o1->ro_value.rv_shmem.rsb_offset ==
+		    o2->ro_value.rv_shmem.rsb_offset));
 #endif
 
 	case RPC_TYPE_DICTIONARY:
 		if (rpc_dictionary_get_count(o1) != rpc_dictionary_get_count(o2))
 			return (false);
 
-		return (!rpc_dictionary_apply(o1,
+		return (!rpc_dictionary_walk(o1,
 		    ^(const char *k, rpc_object_t v1) {
 			rpc_object_t v2;
 
-			v2 = rpc_dictionary_get_value(o2, k);
+			v2 = rpc_dict_lookup(o2->ro_value.rv_dict, k);
 			if (v2 == NULL)
 				return ((bool)false);
 
@@ -769,10 +1461,21 @@ rpc_equal(rpc_object_t o1, rpc_object_t o2)
 		if (rpc_array_get_count(o1) != rpc_array_get_count(o2))
 			return (false);
 
-		return (!rpc_array_apply(o1, ^(size_t idx, rpc_object_t v1) {
+		if (rpc_array_is_packed(o1) && rpc_array_is_packed(o2) &&
+		    o1->ro_value.rv_packed.rpa_type ==
+		    o2->ro_value.rv_packed.rpa_type) {
+			return (memcmp(o1->ro_value.rv_packed.rpa_data,
+			    o2->ro_value.rv_packed.rpa_data,
+			    rpc_array_get_count(o1) *
+			    rpc_array_packed_elem_size(
+			    o1->ro_value.rv_packed.rpa_type)) == 0);
+		}
+
+		rpc_array_box(o2);
+		return (!rpc_array_walk(o1, ^(size_t idx, rpc_object_t v1) {
 			rpc_object_t v2;
 
-			v2 = rpc_array_get_value(o2, idx);
+			v2 = g_ptr_array_index(o2->ro_value.rv_list, idx);
 
 			return ((bool)rpc_equal(v1, v2));
 		}));
@@ -782,8 +1485,8 @@ rpc_equal(rpc_object_t o1, rpc_object_t o2)
 	return (false);
 }
 
-inline size_t
-rpc_hash(rpc_object_t object)
+static size_t
+rpc_hash_compute(rpc_object_t object)
 {
 	__block size_t hash = 0;
 	struct stat fdstat;
@@ -809,10 +1512,10 @@ rpc_hash(rpc_object_t object)
 		return (fdstat.st_dev ^ fdstat.st_ino);
 
 	case RPC_TYPE_DATE:
-		return ((size_t)rpc_date_get_value(object));
+		return ((size_t)object->ro_value.rv_date.rdv_usec);
 
 	case RPC_TYPE_STRING:
-		return (g_string_hash(object->ro_value.rv_str));
+		return (g_str_hash(rpc_string_get_string_ptr(object)));
 
 	case RPC_TYPE_BINARY:
 		return (rpc_data_hash((uint8_t *)rpc_data_get_bytes_ptr(object),
@@ -830,7 +1533,7 @@ rpc_hash(rpc_object_t object)
 #endif
 
 	case RPC_TYPE_DICTIONARY:
-		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
+		rpc_dictionary_walk(object, ^(const char *k, rpc_object_t v) {
 		    	hash ^= rpc_data_hash((const uint8_t *)k, strlen(k));
 		    	hash ^= rpc_hash(v);
 		    	return ((bool)true);
@@ -838,7 +1541,7 @@ rpc_hash(rpc_object_t object)
 		return (hash);
 
 	case RPC_TYPE_ARRAY:
-		rpc_array_apply(object, ^(size_t idx __unused, rpc_object_t v) {
+		rpc_array_walk(object, ^(size_t idx __unused, rpc_object_t v) {
 		    	hash ^= rpc_hash(v);
 		    	return ((bool)true);
 		});
@@ -848,6 +1551,22 @@ rpc_hash(rpc_object_t object)
 	return (0);
 }
 
+inline size_t
+rpc_hash(rpc_object_t object)
+{
+	size_t hash;
+
+	hash = rpc_hash_cached(object);
+	if (hash != 0)
+		return (hash);
+
+	hash = rpc_hash_compute(object);
+	if (rpc_hash_cacheable(object))
+		__atomic_store_n(&object->ro_hash, hash, __ATOMIC_RELAXED);
+
+	return (hash);
+}
+
 inline char *
 rpc_copy_description(rpc_object_t object)
 {
@@ -878,280 +1597,16 @@ rpc_object_pack(const char *fmt, ...)
 rpc_object_t
 rpc_object_vpack(const char *fmt, va_list ap)
 {
-	GQueue *stack = g_queue_new();
-	GQueue *key_q = g_queue_new();
-	GQueue *idx_q = g_queue_new();
-	rpc_object_t current = NULL;
-	rpc_object_t container = NULL;
-	rpc_object_t tmp;
-	const char *ptr;
-	const char *search_ptr;
-	const char *comma_ptr;
-	const char *colon_ptr;
-	const char *type_start;
-	char *idx_end_ptr;
-	char *key;
-	char *type = NULL;
-	char ch;
-	char delim;
-	size_t *idx;
-	uint32_t nesting;
-
-	for (ptr = fmt; *ptr != '\0'; ptr++) {
-
-		ch = *ptr;
-		if (container != NULL) {
-			if (rpc_get_type(container) == RPC_TYPE_ARRAY)
-				delim = ']';
-			else
-				delim = '}';
-		}
-
-		if ((container != NULL) && (ch != delim)) {
-			comma_ptr = NULL;
-			colon_ptr = NULL;
-			search_ptr = ptr;
-			while (1) {
-				if (*search_ptr == ',') {
-					comma_ptr = search_ptr;
-					break;
-				}
-
-				if (*search_ptr == ':')
-					colon_ptr = search_ptr;
-
-				if (*search_ptr == '<')
-					break;
-
-				if (*search_ptr == '[')
-					break;
-
-				if (*search_ptr == ']')
-					break;
-
-				if (*search_ptr == '{')
-					break;
-
-				if (*search_ptr == '}')
-					break;
-
-				if (*search_ptr == '\'')
-					break;
-
-				search_ptr++;
-			}
-
-			if (rpc_get_type(container) == RPC_TYPE_ARRAY) {
-				idx = g_malloc0(sizeof(size_t));
-				if (colon_ptr != NULL) {
-					*idx = (size_t)strtol(ptr,
-					    &idx_end_ptr, 10);
-
-					if (idx_end_ptr != colon_ptr)
-						goto error;
-				} else {
-					*idx = rpc_array_get_count(
-					    container);
-				}
-				g_queue_push_tail(idx_q, idx);
-			} else {
-				if (colon_ptr != NULL) {
-					g_queue_push_tail(key_q,
-					    g_strndup(ptr,
-					    (colon_ptr - ptr)));
-
-				} else {
-					key = g_strdup(
-					    va_arg(ap, const char *));
-					g_queue_push_tail(key_q,
-					    (gpointer)key);
-				}
-			}
-
-			if ((comma_ptr == NULL) &&
-			    (*search_ptr != delim)) {
-				ptr = search_ptr;
-				ch = *search_ptr;
-			} else if ((comma_ptr == NULL) &&
-			    (*search_ptr == delim)) {
-				ch = *(search_ptr - 1);
-				ptr = search_ptr - 1;
-			} else {
-				ch = *(search_ptr - 1);
-				ptr = search_ptr;
-			}
-
-		}
-
-		switch (ch) {
-		case 'v':
-		case 'V':
-			current = va_arg(ap, rpc_object_t);
-			if (current == NULL) {
-				current = rpc_null_create();
-				break;
-			}
-
-			if (ch == 'V')
-				rpc_retain(current);
-
-			break;
-
-		case 'n':
-			current = rpc_null_create();
-			break;
-
-		case 'b':
-			current = rpc_bool_create(va_arg(ap, int));
-			break;
-
-		case 'B':
-			current = rpc_data_create(va_arg(ap, const void *),
-			    va_arg(ap, size_t),
-			    va_arg(ap, rpc_binary_destructor_t));
-			break;
-
-		case 'I':
-			current = rpc_data_create_iov(
-			    va_arg(ap, struct iovec *), va_arg(ap, size_t));
-			break;
-
-		case 'f':
-			current = rpc_fd_create(va_arg(ap, int));
-			break;
-
-		case 'i':
-			current = rpc_int64_create(va_arg(ap, int64_t));
-			break;
-
-		case 'u':
-			current = rpc_uint64_create(va_arg(ap, uint64_t));
-			break;
-
-		case 'd':
-			current = rpc_double_create(va_arg(ap, double));
-			break;
-
-		case 'D':
-			current = rpc_date_create(va_arg(ap, int64_t));
-			break;
-
-		case 's':
-			current = rpc_string_create(va_arg(ap, const char *));
-			break;
-
-		case '\'':
-			search_ptr = strchr(ptr + 1, '\'');
-			if (search_ptr == NULL)
-				goto error;
-
-			current = rpc_string_create_len(ptr + 1,
-			    search_ptr - ptr - 1);
-			ptr = search_ptr + 1;
-			break;
-
-		case '<':
-			type_start = ptr + 1;
-			nesting = 1;
-			while (nesting != 0) {
-				ptr++;
-
-				if (*(ptr) == '<')
-					nesting++;
-
-				if (*(ptr) == '>')
-					nesting--;
-			}
-			type = g_strndup(type_start, (ptr - type_start));
-			continue;
-
-		case '{':
-			container = rpc_dictionary_create();
-			if (type != NULL) {
-				tmp = rpct_new(type, container);
-				if (tmp == NULL)
-					goto error;
-
-				g_free(type);
-				rpc_release(container);
-				type = NULL;
-				container = tmp;
-			}
-
-			g_queue_push_tail(stack, container);
-			continue;
-
-		case '[':
-			container = rpc_array_create();
-			if (type != NULL) {
-				tmp = rpct_new(type, container);
-				if (tmp == NULL)
-					goto error;
-
-				g_free(type);
-				rpc_release(container);
-				type = NULL;
-				container = tmp;
-			}
-
-			g_queue_push_tail(stack, container);
-			continue;
-
-		case '}':
-		case ']':
-			if (*(ptr + 1) == ',')
-				ptr++;
-
-			current = g_queue_pop_tail(stack);
-			container = g_queue_peek_tail(stack);
-			break;
-
-		default:
-			goto error;
-		}
-
-		if (type != NULL) {
-			current = rpct_new(type, current);
-			if (current == NULL)
-				goto error;
-
-			g_free(type);
-			type = NULL;
-		}
-
-		if (container != NULL) {
-			if (rpc_get_type(container) == RPC_TYPE_DICTIONARY) {
-				key = g_queue_pop_tail(key_q);
-				rpc_dictionary_steal_value(container, key,
-				    current);
-				g_free(key);
-			}
-
-			if (rpc_get_type(container) == RPC_TYPE_ARRAY) {
-				idx = g_queue_pop_tail(idx_q);
-				rpc_array_steal_value(container, *idx, current);
-				g_free(idx);
-			}
-
-			continue;
-		}
-
-		g_queue_free(stack);
-		g_queue_free_full(key_q, g_free);
-		g_queue_free_full(idx_q, g_free);
-
-		return (current);
-	}
-
-error:
-	rpc_release(current);
+	rpc_pack_fmt_t compiled;
+	rpc_object_t result;
 
-	g_queue_free(stack);
-	g_queue_free_full(key_q, g_free);
-	g_queue_free_full(idx_q, g_free);
-	errno = EINVAL;
+	compiled = rpc_pack_compile(fmt);
+	if (compiled == NULL)
+		return (NULL);
 
-	return (NULL);
+	result = rpc_object_vpack_compiled(compiled, ap);
+	rpc_pack_free(compiled);
+	return (result);
 }
 
 int
@@ -1260,30 +1715,92 @@ rpc_double_get_value(rpc_object_t xdouble)
 
 inline rpc_object_t
 rpc_date_create(int64_t interval)
+{
+
+	return (rpc_date_create_usec(interval * G_USEC_PER_SEC, 0));
+}
+
+inline rpc_object_t
+rpc_date_create_usec(int64_t usec, int32_t tz_offset)
 {
 	union rpc_value val;
 
-	val.rv_datetime = g_date_time_new_from_unix_utc(interval);
+	val.rv_date.rdv_usec = usec;
+	val.rv_date.rdv_tz_offset = tz_offset;
 	return (rpc_prim_create(RPC_TYPE_DATE, val));
 }
 
 inline rpc_object_t
 rpc_date_create_from_current(void)
 {
-	union rpc_value val;
 
-	val.rv_datetime = g_date_time_new_now_utc();
-	return (rpc_prim_create(RPC_TYPE_DATE, val));
+	return (rpc_date_create_usec(g_get_real_time(), 0));
 }
 
 inline int64_t
 rpc_date_get_value(rpc_object_t xdate)
 {
+	int64_t usec;
 
 	if (xdate->ro_type != RPC_TYPE_DATE)
 		return (0);
 
-	return (g_date_time_to_unix(xdate->ro_value.rv_datetime));
+	/* Round towards the past, like g_date_time_to_unix() did */
+	usec = xdate->ro_value.rv_date.rdv_usec;
+	if (usec < 0)
+		return ((usec + 1) / G_USEC_PER_SEC - 1);
+
+	return (usec / G_USEC_PER_SEC);
+}
+
+inline int64_t
+rpc_date_get_usec(rpc_object_t xdate)
+{
+
+	if (xdate->ro_type != RPC_TYPE_DATE)
+		return (0);
+
+	return (xdate->ro_value.rv_date.rdv_usec);
+}
+
+inline int32_t
+rpc_date_get_tz_offset(rpc_object_t xdate)
+{
+
+	if (xdate->ro_type != RPC_TYPE_DATE)
+		return (0);
+
+	return (xdate->ro_value.rv_date.rdv_tz_offset);
+}
+
+GDateTime *
+rpc_date_get_gdatetime(rpc_object_t xdate)
+{
+	struct rpc_date_value *date = &xdate->ro_value.rv_date;
+	GDateTime *utc;
+	GDateTime *result;
+	GTimeZone *tz;
+	char *ident;
+
+	utc = g_date_time_new_from_unix_utc(rpc_date_get_value(xdate));
+	result = g_date_time_add(utc, date->rdv_usec -
+	    rpc_date_get_value(xdate) * G_USEC_PER_SEC);
+	g_date_time_unref(utc);
+
+	if (date->rdv_tz_offset == 0)
+		return (result);
+
+	ident = g_strdup_printf("%c%02d:%02d",
+	    date->rdv_tz_offset < 0 ? '-' : '+',
+	    ABS(date->rdv_tz_offset) / 3600,
+	    ABS(date->rdv_tz_offset) / 60 % 60);
+	tz = g_time_zone_new(ident);
+	utc = result;
+	result = g_date_time_to_timezone(utc, tz);
+	g_date_time_unref(utc);
+	g_time_zone_unref(tz);
+	g_free(ident);
+	return (result);
 }
 
 inline rpc_object_t
@@ -1326,9 +1843,75 @@ rpc_data_create_iov(struct iovec *iov, size_t niov)
 		data_ptr += iov[i].iov_len;
 	}
 
-	return (rpc_data_create(data_buf, data_size,
-	    RPC_BINARY_DESTRUCTOR(g_free)));
+	return (rpc_data_create(data_buf, data_size,
+	    RPC_BINARY_DESTRUCTOR(g_free)));
+}
+
+#ifndef _WIN32
+/*
+ * The range is mapped rather than read, so that connections able to
+ * send large binaries from where they are (see RPC_BINARY_IOV_MIN) pass
+ * page cache pages straight to the kernel, with no copy in userspace.
+ * Descriptors that can't be mapped, like pipes, are read instead.
+ */
+rpc_object_t
+rpc_data_create_fd_range(int fd, off_t offset, size_t length)
+{
+	struct stat st;
+	void *base;
+	char *buf;
+	size_t maplen;
+	off_t aligned;
+	ssize_t ret;
+	size_t done = 0;
+
+	if (fd < 0 || offset < 0) {
+		rpc_set_last_error(EINVAL, "Invalid descriptor or offset", NULL);
+		return (NULL);
+	}
+
+	if (length == 0)
+		return (rpc_data_create(NULL, 0, NULL));
+
+	/* Touching a mapping past the end of the file raises SIGBUS */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    (offset > st.st_size || length > (size_t)(st.st_size - offset))) {
+		rpc_set_last_error(EINVAL, "Range past the end of file", NULL);
+		return (NULL);
+	}
+
+	aligned = offset - (offset % (off_t)sysconf(_SC_PAGESIZE));
+	maplen = length + (size_t)(offset - aligned);
+	base = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, aligned);
+	if (base != MAP_FAILED) {
+		madvise(base, maplen, MADV_SEQUENTIAL);
+		return (rpc_data_create((char *)base + (offset - aligned),
+		    length, ^(void *ptr __unused) {
+			munmap(base, maplen);
+		}));
+	}
+
+	buf = g_malloc(length);
+	while (done < length) {
+		ret = pread(fd, buf + done, length - done,
+		    offset + (off_t)done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			rpc_set_last_errorf(ret < 0 ? errno : EIO,
+			    "Cannot read %zu bytes at %jd", length,
+			    (intmax_t)offset);
+			g_free(buf);
+			return (NULL);
+		}
+
+		done += (size_t)ret;
+	}
+
+	return (rpc_data_create(buf, length, RPC_BINARY_DESTRUCTOR(g_free)));
 }
+#endif
 
 inline size_t
 rpc_data_get_length(rpc_object_t xdata)
@@ -1377,7 +1960,7 @@ rpc_string_create(const char *string)
 	if (string == NULL)
 		return (rpc_null_create());
 
-	val.rv_str = g_string_new(string);
+	rpc_string_set(&val, string, strlen(string));
 	return (rpc_prim_create(RPC_TYPE_STRING, val));
 }
 
@@ -1391,7 +1974,7 @@ rpc_string_create_len(const char *string, size_t length)
 	if ((null_b != NULL) && (null_b != string + length))
 		return (rpc_null_create());
 
-	val.rv_str = g_string_new_len(string, length);
+	rpc_string_set(&val, string, length);
 	return (rpc_prim_create(RPC_TYPE_STRING, val));
 }
 
@@ -1399,24 +1982,20 @@ inline rpc_object_t
 rpc_string_create_with_format(const char *fmt, ...)
 {
 	va_list ap;
-	union rpc_value val;
+	rpc_object_t result;
 
 	va_start(ap, fmt);
-	val.rv_str = g_string_new(NULL);
-	g_string_vprintf(val.rv_str, fmt, ap);
+	result = rpc_string_create_vprintf(fmt, ap);
 	va_end(ap);
 
-	return (rpc_prim_create(RPC_TYPE_STRING, val));
+	return (result);
 }
 
 inline rpc_object_t
 rpc_string_create_with_format_and_arguments(const char *fmt, va_list ap)
 {
-	union rpc_value val;
 
-	val.rv_str = g_string_new(NULL);
-	g_string_vprintf(val.rv_str, fmt, ap);
-	return (rpc_prim_create(RPC_TYPE_STRING, val));
+	return (rpc_string_create_vprintf(fmt, ap));
 }
 
 inline size_t
@@ -1426,7 +2005,10 @@ rpc_string_get_length(rpc_object_t xstring)
 	if (xstring->ro_type != RPC_TYPE_STRING)
 		return (0);
 
-	return (xstring->ro_value.rv_str->len);
+	if (xstring->ro_value.rv_str.rsv_str == NULL)
+		return (xstring->ro_value.rv_str.rsv_len);
+
+	return (xstring->ro_value.rv_str.rsv_str->len);
 }
 
 inline const char *
@@ -1436,7 +2018,10 @@ rpc_string_get_string_ptr(rpc_object_t xstring)
 	if (xstring->ro_type != RPC_TYPE_STRING)
 		return (NULL);
 
-	return (xstring->ro_value.rv_str->str);
+	if (xstring->ro_value.rv_str.rsv_str == NULL)
+		return (xstring->ro_value.rv_str.rsv_inline);
+
+	return (xstring->ro_value.rv_str.rsv_str->str);
 }
 
 inline rpc_object_t
@@ -1472,30 +2057,35 @@ rpc_fd_dup(rpc_object_t xfd)
 inline rpc_object_t
 rpc_shmem_create(size_t size)
 {
-	union rpc_value val;
 
-	if (size == 0)
-		return (NULL);
+	return (rpc_shmem_create_ex(size, 0, RPC_SHMEM_ANY_NODE));
+}
 
+inline rpc_object_t
+rpc_shmem_recreate(int fd, off_t offset, size_t size)
+{
+	union rpc_value val = { 0 };
+	val.rv_shmem.rsb_fd = fd;
+	val.rv_shmem.rsb_offset = offset;
 	val.rv_shmem.rsb_size = size;
-	val.rv_shmem.rsb_offset = 0;
-	val.rv_shmem.rsb_fd = memfd_create("librpc", 0);
-
-	if (ftruncate(val.rv_shmem.rsb_fd, (off_t)size) != 0) {
-		close(val.rv_shmem.rsb_fd);
-		return (NULL);
-	}
 
 	return (rpc_prim_create(RPC_TYPE_SHMEM, val));
 }
 
-inline rpc_object_t
-rpc_shmem_recreate(int fd, off_t offset, size_t size)
+/*
+ * Wraps a chunk of a pool. Takes over the caller's reference on the
+ * chunk, or on the pool if it's one mapped from a peer.
+ */
+rpc_object_t
+rpc_shmem_create_pooled(struct rpc_shmem_pool *pool, off_t offset,
+    size_t size)
 {
-	union rpc_value val;
-	val.rv_shmem.rsb_fd = fd;
+	union rpc_value val = { 0 };
+
+	val.rv_shmem.rsb_fd = pool->rsp_fd;
 	val.rv_shmem.rsb_offset = offset;
 	val.rv_shmem.rsb_size = size;
+	val.rv_shmem.rsb_pool = pool;
 
 	return (rpc_prim_create(RPC_TYPE_SHMEM, val));
 }
@@ -1510,16 +2100,34 @@ rpc_shmem_unmap(rpc_object_t shmem, void *addr)
 	if (shmem == NULL)
 		return;
 
+	/* Pooled chunks live in the pool mapping */
+	if (shmem->ro_value.rv_shmem.rsb_pool != NULL)
+		return;
+
 	munmap(addr, shmem->ro_value.rv_shmem.rsb_size);
 }
 
 inline void *
 rpc_shmem_map(rpc_object_t shmem)
 {
+	struct rpc_shmem_pool *pool = shmem->ro_value.rv_shmem.rsb_pool;
+	int flags = shmem->ro_value.rv_shmem.rsb_flags;
+	void *addr;
+
+	if (pool != NULL) {
+		return ((char *)pool->rsp_base +
+		    shmem->ro_value.rv_shmem.rsb_offset);
+	}
+
+	addr = mmap(NULL, shmem->ro_value.rv_shmem.rsb_size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED |
+	    ((flags & RPC_SHMEM_POPULATE) ? MAP_POPULATE : 0),
+	    shmem->ro_value.rv_shmem.rsb_fd,
+	    shmem->ro_value.rv_shmem.rsb_offset);
+	if (addr != MAP_FAILED)
+		rpc_shmem_advise(addr, shmem->ro_value.rv_shmem.rsb_size, flags);
 
-	return (mmap(NULL, shmem->ro_value.rv_shmem.rsb_size,
-	    PROT_READ | PROT_WRITE, MAP_SHARED, shmem->ro_value.rv_shmem.rsb_fd,
-	    shmem->ro_value.rv_shmem.rsb_offset));
+	return (addr);
 }
 
 inline size_t
@@ -1548,29 +2156,112 @@ off_t rpc_shmem_get_offset(rpc_object_t shmem)
 }
 #endif
 
-rpc_object_t
-rpc_error_create(int code, const char *msg, rpc_object_t extra)
+static bool
+rpc_error_capture_enabled(void)
+{
+	static gsize initialized = 0;
+	const char *env;
+
+	if (g_once_init_enter(&initialized)) {
+		env = getenv("LIBRPC_ERROR_STACKS");
+		if (env != NULL && g_strcmp0(env, "0") == 0)
+			g_atomic_int_set(&rpc_error_capture, false);
+
+		g_once_init_leave(&initialized, 1);
+	}
+
+	if (!g_atomic_int_get(&rpc_error_capture))
+		return (false);
+
+	return (g_private_get(&rpc_error_capture_off) == NULL);
+}
+
+/*
+ * Only the return addresses are taken here; rpc_error_get_stack() turns
+ * them into a string the first time somebody asks for it.
+ */
+static rpc_object_t
+rpc_error_create_impl(int code, const char *msg, rpc_object_t extra,
+    bool stack)
 {
-	char *stack;
+	void *buffer[RPC_BACKTRACE_DEPTH];
 	union rpc_value val;
+	int count = 0;
 
 	if (extra == NULL)
 		extra = rpc_null_create();
 	else
 		rpc_retain(extra);
 
-	stack = rpc_get_backtrace();
-
 	val.rv_error.rev_code = code;
 	val.rv_error.rev_message = g_string_new(msg);
 	val.rv_error.rev_extra = extra;
-	val.rv_error.rev_stack = rpc_string_create(stack);
-
-	g_free(stack);
+	val.rv_error.rev_stack = NULL;
+	val.rv_error.rev_frames = NULL;
+	val.rv_error.rev_nframes = 0;
+
+	if (stack)
+		count = rpc_backtrace_capture(buffer, RPC_BACKTRACE_DEPTH);
+
+	/* Skip the capture and our own frame */
+	if (count > 2) {
+		val.rv_error.rev_nframes = count - 2;
+		val.rv_error.rev_frames = g_malloc(
+		    (count - 2) * sizeof(void *));
+		memcpy(val.rv_error.rev_frames, &buffer[2],
+		    (count - 2) * sizeof(void *));
+	}
 
 	return (rpc_prim_create(RPC_TYPE_ERROR, val));
 }
 
+rpc_object_t
+rpc_error_create(int code, const char *msg, rpc_object_t extra)
+{
+
+	return (rpc_error_create_impl(code, msg, extra,
+	    rpc_error_capture_enabled()));
+}
+
+rpc_object_t
+rpc_error_create_nostack(int code, const char *msg, rpc_object_t extra)
+{
+
+	return (rpc_error_create_impl(code, msg, extra, false));
+}
+
+rpc_object_t
+rpc_error_strip_stack(rpc_object_t error)
+{
+	struct rpc_error_value *rev = &error->ro_value.rv_error;
+
+	if (rev->rev_stack == NULL && rev->rev_frames == NULL)
+		return (rpc_retain(error));
+
+	return (rpc_error_create_impl(rev->rev_code, rev->rev_message->str,
+	    rev->rev_extra, false));
+}
+
+void
+rpc_error_set_stack_capture(bool enable)
+{
+
+	/* Let the environment be read first, so that it doesn't win */
+	(void)rpc_error_capture_enabled();
+	g_atomic_int_set(&rpc_error_capture, enable);
+}
+
+bool
+rpc_error_set_thread_capture(bool enable)
+{
+	bool prev;
+
+	prev = g_private_get(&rpc_error_capture_off) == NULL;
+	g_private_set(&rpc_error_capture_off, enable ? NULL :
+	    GINT_TO_POINTER(1));
+	return (prev);
+}
+
 
 rpc_object_t
 rpc_error_create_from_gerror(GError *g_error)
@@ -1586,10 +2277,10 @@ rpc_error_create_with_stack(int code, const char *msg, rpc_object_t extra,
 {
 	rpc_object_t result;
 
-	result = rpc_error_create(code, msg, extra);
-	rpc_release(result->ro_value.rv_error.rev_stack);
-	result->ro_value.rv_error.rev_stack = stack;
-	rpc_retain(stack);
+	result = rpc_error_create_impl(code, msg, extra, false);
+	if (stack != NULL)
+		result->ro_value.rv_error.rev_stack = rpc_retain(stack);
+
 	return (result);
 }
 
@@ -1621,13 +2312,40 @@ rpc_error_get_extra(rpc_object_t error)
 	return (error->ro_value.rv_error.rev_extra);
 }
 
+/*
+ * The string is built outside of any lock; if two threads race, the
+ * loser drops its copy. It isn't part of a frozen object graph, but it
+ * is never modified after being published either.
+ */
 rpc_object_t
 rpc_error_get_stack(rpc_object_t error)
 {
+	struct rpc_error_value *rev;
+	rpc_object_t stack;
+	char *str;
+
 	if (rpc_get_type(error) != RPC_TYPE_ERROR)
 		return (NULL);
 
-	return (error->ro_value.rv_error.rev_stack);
+	rev = &error->ro_value.rv_error;
+	stack = g_atomic_pointer_get(&rev->rev_stack);
+	if (stack != NULL || rev->rev_frames == NULL)
+		return (stack);
+
+	str = rpc_backtrace_format(rev->rev_frames, rev->rev_nframes);
+	if (str == NULL)
+		return (NULL);
+
+	stack = rpc_string_create(str);
+	g_free(str);
+
+	if (!g_atomic_pointer_compare_and_exchange(&rev->rev_stack, NULL,
+	    stack)) {
+		rpc_release(stack);
+		stack = g_atomic_pointer_get(&rev->rev_stack);
+	}
+
+	return (stack);
 }
 
 void
@@ -1646,27 +2364,65 @@ rpc_error_set_extra(rpc_object_t error, rpc_object_t extra)
 
 inline rpc_object_t
 rpc_array_create(void)
+{
+
+	return (rpc_array_create_with_capacity(0));
+}
+
+rpc_object_t
+rpc_array_create_with_capacity(size_t capacity)
 {
 	union rpc_value val;
 
-	val.rv_list = g_ptr_array_new_with_free_func(
+	val.rv_list = g_ptr_array_new_full((guint)capacity,
 	    (GDestroyNotify)rpc_release_impl);
 	return (rpc_prim_create(RPC_TYPE_ARRAY, val));
 }
 
+rpc_object_t
+rpc_array_create_packed(rpc_type_t type, const void *data, size_t count)
+{
+	void *copy;
+	size_t size;
+
+	size = rpc_array_packed_elem_size(type);
+	if (size == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	copy = g_malloc_n(count, size);
+	memcpy(copy, data, count * size);
+	return (rpc_array_create_packed_stolen(type, copy, count));
+}
+
+const void *
+rpc_array_get_packed(rpc_object_t array, rpc_type_t *type, size_t *count)
+{
+
+	if (!rpc_array_is_packed(array))
+		return (NULL);
+
+	if (type != NULL)
+		*type = array->ro_value.rv_packed.rpa_type;
+
+	if (count != NULL)
+		*count = array->ro_value.rv_packed.rpa_count;
+
+	return (array->ro_value.rv_packed.rpa_data);
+}
+
 inline rpc_object_t
 rpc_array_create_ex(const rpc_object_t *objects, size_t count, bool steal)
 {
 	rpc_object_t array_object;
 	size_t i;
-	void (*setter_fn)(rpc_object_t, rpc_object_t);
-
-	setter_fn = steal ? &rpc_array_append_stolen_value :
-	    &rpc_array_append_value;
 
-	array_object = rpc_array_create();
-	for (i = 0; i < count; i++)
-		setter_fn(array_object, objects[i]);
+	array_object = rpc_array_create_with_capacity(count);
+	for (i = 0; i < count; i++) {
+		g_ptr_array_add(array_object->ro_value.rv_list,
+		    steal ? objects[i] : rpc_retain(objects[i]));
+	}
 
 	return array_object;
 }
@@ -1692,6 +2448,7 @@ rpc_array_steal_value(rpc_object_t array, size_t index, rpc_object_t value)
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		rpc_abort("Trying array API on non-array object");
 
+	rpc_container_modify(array);
 	for (i = (index - array->ro_value.rv_list->len); i > 0; i--) {
 		rpc_array_append_stolen_value(
 		    array,
@@ -1707,6 +2464,7 @@ rpc_array_steal_value(rpc_object_t array, size_t index, rpc_object_t value)
 	ro = (rpc_object_t *)&g_ptr_array_index(array->ro_value.rv_list, index);
 	rpc_release_impl(*ro);
 	*ro = value;
+	rpc_query_view_notify(array, RPC_ARRAY_CHANGE_REPLACE, index);
 }
 
 inline void
@@ -1719,7 +2477,9 @@ rpc_array_remove_index(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return;
 
+	rpc_container_modify(array);
 	g_ptr_array_remove_index(array->ro_value.rv_list, (guint)index);
+	rpc_query_view_notify(array, RPC_ARRAY_CHANGE_REMOVE, index);
 }
 
 inline void
@@ -1734,7 +2494,9 @@ rpc_array_remove_all(rpc_object_t array)
 	if (cnt == 0)
 		return;
 
+	rpc_container_modify(array);
 	g_ptr_array_remove_range(array->ro_value.rv_list, 0, (guint)cnt);
+	rpc_query_view_notify(array, RPC_ARRAY_CHANGE_RESET, 0);
 }
 
 inline void
@@ -1752,27 +2514,54 @@ rpc_array_append_stolen_value(rpc_object_t array, rpc_object_t value)
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		rpc_abort("Trying array API on non-array object");
 
+	rpc_container_modify(array);
 	g_ptr_array_add(array->ro_value.rv_list, value);
+	rpc_query_view_notify(array, RPC_ARRAY_CHANGE_APPEND,
+	    array->ro_value.rv_list->len - 1);
 }
 
-inline rpc_object_t
-rpc_array_get_value(rpc_object_t array, size_t index)
+/*
+ * Looks a value up without splitting shared storage off. The caller
+ * must not modify it or hand it out.
+ */
+static rpc_object_t
+rpc_array_peek_value(rpc_object_t array, size_t index)
 {
+
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		return (NULL);
 
+	rpc_array_box(array);
 	if (index >= array->ro_value.rv_list->len)
 		return (NULL);
 
 	return (g_ptr_array_index(array->ro_value.rv_list, index));
 }
 
+inline rpc_object_t
+rpc_array_get_value(rpc_object_t array, size_t index)
+{
+
+	if (rpc_array_peek_value(array, index) == NULL)
+		return (NULL);
+
+	/* Values may only be handed out of unshared storage */
+	if (array->ro_cow != NULL)
+		rpc_container_unshare(array);
+
+	return (g_ptr_array_index(array->ro_value.rv_list, index));
+}
+
 inline size_t
 rpc_array_get_count(rpc_object_t array)
 {
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		return (0);
 
+	rpc_container_load(array);
+	if (rpc_array_is_packed(array))
+		return (array->ro_value.rv_packed.rpa_count);
+
 	return (array->ro_value.rv_list->len);
 }
 
@@ -1782,6 +2571,7 @@ rpc_array_apply(rpc_object_t array, rpc_array_applier_t applier)
 	bool flag = false;
 	size_t i;
 
+	rpc_array_own(array);
 	for (i = 0; i < array->ro_value.rv_list->len; i++) {
 		if (!applier(i, g_ptr_array_index(array->ro_value.rv_list, i))) {
 			flag = true;
@@ -1792,18 +2582,71 @@ rpc_array_apply(rpc_object_t array, rpc_array_applier_t applier)
 	return (flag);
 }
 
+bool
+rpc_array_apply_f(rpc_object_t array, void *arg, rpc_array_applier_f applier)
+{
+	GPtrArray *list;
+	size_t i;
+
+	rpc_array_own(array);
+	list = array->ro_value.rv_list;
+	for (i = 0; i < list->len; i++) {
+		if (!applier(arg, i, g_ptr_array_index(list, i)))
+			return (true);
+	}
+
+	return (false);
+}
+
+G_STATIC_ASSERT(sizeof(struct rpc_list_iter) <=
+    sizeof(struct rpc_array_iter));
+
+void
+rpc_array_iter_init(rpc_object_t array, struct rpc_array_iter *iter)
+{
+	struct rpc_list_iter *li = (struct rpc_list_iter *)iter;
+
+	li->rli_index = 0;
+	if (array->ro_type != RPC_TYPE_ARRAY) {
+		li->rli_list = NULL;
+		return;
+	}
+
+	rpc_array_own(array);
+	li->rli_list = array->ro_value.rv_list;
+}
+
+bool
+rpc_array_iter_next(struct rpc_array_iter *iter, size_t *index,
+    rpc_object_t *value)
+{
+	struct rpc_list_iter *li = (struct rpc_list_iter *)iter;
+
+	if (li->rli_list == NULL || li->rli_index >= li->rli_list->len)
+		return (false);
+
+	if (index != NULL)
+		*index = li->rli_index;
+
+	*value = g_ptr_array_index(li->rli_list, li->rli_index++);
+	return (true);
+}
+
 inline void
 rpc_array_map(rpc_object_t array, rpc_array_mapper_t mapper)
 {
 	rpc_object_t oldv, newv;
 	size_t i;
 
+	rpc_container_modify(array);
 	for (i = 0; i < array->ro_value.rv_list->len; i++) {
 		oldv = g_ptr_array_index(array->ro_value.rv_list, i);
 		newv = mapper(i, oldv);
 		g_ptr_array_index(array->ro_value.rv_list, i) = newv;
 		rpc_release(oldv);
 	}
+
+	rpc_query_view_notify(array, RPC_ARRAY_CHANGE_RESET, 0);
 }
 
 inline bool
@@ -1814,7 +2657,7 @@ rpc_array_contains(rpc_object_t array, rpc_object_t value)
 	if (rpc_get_type(array) != RPC_TYPE_ARRAY)
 		return (false);
 
-	rpc_array_apply(array, ^(size_t idx __unused, rpc_object_t v) {
+	rpc_array_walk(array, ^(size_t idx __unused, rpc_object_t v) {
 		if (rpc_equal(v, value)) {
 			match = true;
 			return ((bool)false);
@@ -1833,6 +2676,7 @@ rpc_array_reverse_apply(rpc_object_t array, rpc_array_applier_t applier)
 	size_t i;
 	size_t idx;
 
+	rpc_array_own(array);
 	for (i = array->ro_value.rv_list->len; i > 0 ; i--) {
 		idx = i - 1;
 		if (!applier(idx, g_ptr_array_index(array->ro_value.rv_list,
@@ -1852,8 +2696,10 @@ rpc_array_sort(rpc_object_t array, rpc_array_cmp_t comparator)
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		rpc_abort("Trying array API on non-array object");
 
+	rpc_container_modify(array);
 	g_ptr_array_sort_with_data(array->ro_value.rv_list,
 	    &rpc_array_comparator_converter, (void *)comparator);
+	rpc_query_view_notify(array, RPC_ARRAY_CHANGE_RESET, 0);
 }
 
 rpc_object_t
@@ -1864,9 +2710,9 @@ rpc_array_slice(rpc_object_t array, size_t index, ssize_t len)
 	rpc_object_t result;
 
 	if (len == -1)
-		end = array->ro_value.rv_list->len;
+		end = rpc_array_get_count(array);
 	else
-		end = MIN(array->ro_value.rv_list->len, index + len);
+		end = MIN(rpc_array_get_count(array), index + len);
 
 	result = rpc_array_create();
 
@@ -1942,7 +2788,14 @@ rpc_array_get_bool(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (false);
 
-	return (rpc_bool_get_value(rpc_array_get_value(array, index)));
+	if (rpc_array_is_packed(array)) {
+		if (array->ro_value.rv_packed.rpa_type != RPC_TYPE_BOOL)
+			return (false);
+
+		return (((bool *)array->ro_value.rv_packed.rpa_data)[index]);
+	}
+
+	return (rpc_bool_get_value(rpc_array_peek_value(array, index)));
 }
 
 inline int64_t
@@ -1952,7 +2805,14 @@ rpc_array_get_int64(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
-	return (rpc_int64_get_value(rpc_array_get_value(array, index)));
+	if (rpc_array_is_packed(array)) {
+		if (array->ro_value.rv_packed.rpa_type != RPC_TYPE_INT64)
+			return (0);
+
+		return (((int64_t *)array->ro_value.rv_packed.rpa_data)[index]);
+	}
+
+	return (rpc_int64_get_value(rpc_array_peek_value(array, index)));
 }
 
 inline uint64_t
@@ -1961,7 +2821,15 @@ rpc_array_get_uint64(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
-	return (rpc_uint64_get_value(rpc_array_get_value(array, index)));
+	if (rpc_array_is_packed(array)) {
+		if (array->ro_value.rv_packed.rpa_type != RPC_TYPE_UINT64)
+			return (0);
+
+		return (((uint64_t *)
+		    array->ro_value.rv_packed.rpa_data)[index]);
+	}
+
+	return (rpc_uint64_get_value(rpc_array_peek_value(array, index)));
 }
 
 inline double
@@ -1971,7 +2839,14 @@ rpc_array_get_double(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
-	return (rpc_double_get_value(rpc_array_get_value(array, index)));
+	if (rpc_array_is_packed(array)) {
+		if (array->ro_value.rv_packed.rpa_type != RPC_TYPE_DOUBLE)
+			return (0);
+
+		return (((double *)array->ro_value.rv_packed.rpa_data)[index]);
+	}
+
+	return (rpc_double_get_value(rpc_array_peek_value(array, index)));
 }
 
 inline int64_t
@@ -1981,7 +2856,7 @@ rpc_array_get_date(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
-	return (rpc_date_get_value(rpc_array_get_value(array, index)));
+	return (rpc_date_get_value(rpc_array_peek_value(array, index)));
 }
 
 inline const void *
@@ -1992,7 +2867,7 @@ rpc_array_get_data(rpc_object_t array, size_t index, size_t *length)
 	if (index >= rpc_array_get_count(array))
 		return (NULL);
 
-	if ((xdata = rpc_array_get_value(array, index)) == 0)
+	if ((xdata = rpc_array_peek_value(array, index)) == 0)
 		return (NULL);
 
 	if (length != NULL)
@@ -2008,7 +2883,7 @@ rpc_array_get_string(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (NULL);
 
-	return rpc_string_get_string_ptr(rpc_array_get_value(array, index));
+	return rpc_string_get_string_ptr(rpc_array_peek_value(array, index));
 }
 
 inline int
@@ -2018,7 +2893,7 @@ rpc_array_get_fd(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
-	return (rpc_fd_get_value(rpc_array_get_value(array, index)));
+	return (rpc_fd_get_value(rpc_array_peek_value(array, index)));
 }
 
 inline int
@@ -2028,16 +2903,22 @@ rpc_array_dup_fd(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
-	return (rpc_fd_dup(rpc_array_get_value(array, index)));
+	return (rpc_fd_dup(rpc_array_peek_value(array, index)));
 }
 
 inline rpc_object_t
 rpc_dictionary_create(void)
+{
+
+	return (rpc_dictionary_create_with_capacity(0));
+}
+
+rpc_object_t
+rpc_dictionary_create_with_capacity(size_t capacity)
 {
 	union rpc_value val;
 
-	val.rv_dict = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-	    (GDestroyNotify)rpc_release_impl);
+	val.rv_dict = rpc_dict_new(capacity);
 
 	return (rpc_prim_create(RPC_TYPE_DICTIONARY, val));
 }
@@ -2053,7 +2934,7 @@ rpc_dictionary_create_ex(const char * const *keys, const rpc_object_t *values,
 	setter_fn = steal ? &rpc_dictionary_steal_value :
 	    &rpc_dictionary_set_value;
 
-	object = rpc_dictionary_create();
+	object = rpc_dictionary_create_with_capacity(count);
 
 	for (i = 0; i < count; i++)
 		setter_fn(object, keys[i], values[i]);
@@ -2081,8 +2962,10 @@ rpc_dictionary_steal_value(rpc_object_t dictionary, const char *key,
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
-	g_hash_table_insert(dictionary->ro_value.rv_dict,
-	    (gpointer)g_strdup(key), value);
+	rpc_container_modify(dictionary);
+
+	rpc_dict_insert_str(dictionary->ro_value.rv_dict, key, strlen(key),
+	    value);
 }
 
 inline void
@@ -2093,8 +2976,10 @@ rpc_dictionary_steal_value_internal(rpc_object_t dictionary, const char *key,
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
-	g_hash_table_insert(dictionary->ro_value.rv_dict,
-	    (gpointer)g_strdup(key), value);
+	rpc_container_modify(dictionary);
+
+	rpc_dict_insert_str(dictionary->ro_value.rv_dict, key, strlen(key),
+	    value);
 }
 
 inline void
@@ -2104,7 +2989,9 @@ rpc_dictionary_remove_key(rpc_object_t dictionary, const char *key)
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
-	g_hash_table_remove(dictionary->ro_value.rv_dict, key);
+	rpc_container_modify(dictionary);
+
+	rpc_dict_remove(dictionary->ro_value.rv_dict, key);
 }
 
 inline void
@@ -2114,7 +3001,9 @@ rpc_dictionary_remove_all(rpc_object_t dictionary)
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
-	g_hash_table_remove_all(dictionary->ro_value.rv_dict);
+	rpc_container_modify(dictionary);
+
+	rpc_dict_remove_all(dictionary->ro_value.rv_dict);
 
 }
 
@@ -2136,36 +3025,89 @@ rpc_dictionary_detach_key(rpc_object_t dictionary, const char *key)
 	return (result);
 }
 
+/*
+ * Looks a value up without splitting shared storage off. The caller
+ * must not modify it or hand it out.
+ */
+static rpc_object_t
+rpc_dictionary_peek_value(rpc_object_t dictionary, const char *key)
+{
+
+	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
+		return (NULL);
+
+	rpc_container_load(dictionary);
+	return (rpc_dict_lookup(dictionary->ro_value.rv_dict, key));
+}
+
 inline rpc_object_t
 rpc_dictionary_get_value(rpc_object_t dictionary,
     const char *key)
 {
+	rpc_object_t result;
 
-	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
-		return (NULL);
+	result = rpc_dictionary_peek_value(dictionary, key);
+
+	/* Values may only be handed out of unshared storage */
+	if (result != NULL && dictionary->ro_cow != NULL) {
+		rpc_container_unshare(dictionary);
+		result = rpc_dict_lookup(dictionary->ro_value.rv_dict, key);
+	}
 
-	return ((rpc_object_t)g_hash_table_lookup(
-	    dictionary->ro_value.rv_dict, key));
+	return (result);
 }
 
 inline size_t
 rpc_dictionary_get_count(rpc_object_t dictionary)
 {
 
-	return ((size_t)g_hash_table_size(dictionary->ro_value.rv_dict));
+	rpc_container_load(dictionary);
+	return (rpc_dict_count(dictionary->ro_value.rv_dict));
+}
+
+G_STATIC_ASSERT(sizeof(struct rpc_dict_iter) <=
+    sizeof(struct rpc_dictionary_iter));
+
+void
+rpc_dictionary_iter_init(rpc_object_t dictionary,
+    struct rpc_dictionary_iter *iter)
+{
+	struct rpc_dict_iter *di = (struct rpc_dict_iter *)iter;
+
+	if (dictionary->ro_type != RPC_TYPE_DICTIONARY) {
+		di->rdi_dict = NULL;
+		return;
+	}
+
+	rpc_container_unshare(dictionary);
+	rpc_dict_iter_init(di, dictionary->ro_value.rv_dict);
+}
+
+bool
+rpc_dictionary_iter_next(struct rpc_dictionary_iter *iter, const char **key,
+    rpc_object_t *value)
+{
+	struct rpc_dict_iter *di = (struct rpc_dict_iter *)iter;
+
+	if (di->rdi_dict == NULL)
+		return (false);
+
+	return (rpc_dict_iter_next(di, key, value));
 }
 
 inline bool
 rpc_dictionary_apply(rpc_object_t dictionary, rpc_dictionary_applier_t applier)
 {
-	GHashTableIter iter;
-	gpointer key, value;
+	struct rpc_dict_iter iter;
+	const char *key;
+	rpc_object_t value;
 	bool flag = false;
 
-	g_hash_table_iter_init(&iter, dictionary->ro_value.rv_dict);
+	rpc_container_unshare(dictionary);
+	rpc_dict_iter_init(&iter, dictionary->ro_value.rv_dict);
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		if (!applier((const char *)key, (rpc_object_t)value)) {
+	while (rpc_dict_iter_next(&iter, &key, &value)) {
+		if (!applier(key, value)) {
 			flag = true;
 			break;
 		}
@@ -2174,19 +3116,37 @@ rpc_dictionary_apply(rpc_object_t dictionary, rpc_dictionary_applier_t applier)
 	return (flag);
 }
 
+bool
+rpc_dictionary_apply_f(rpc_object_t dictionary, void *arg,
+    rpc_dictionary_applier_f applier)
+{
+	struct rpc_dict_iter iter;
+	const char *key;
+	rpc_object_t value;
+
+	rpc_container_unshare(dictionary);
+	rpc_dict_iter_init(&iter, dictionary->ro_value.rv_dict);
+	while (rpc_dict_iter_next(&iter, &key, &value)) {
+		if (!applier(arg, key, value))
+			return (true);
+	}
+
+	return (false);
+}
+
 inline void
 rpc_dictionary_map(rpc_object_t dictionary, rpc_dictionary_mapper_t mapper)
 {
-	GHashTableIter iter;
-	gpointer key, value;
+	struct rpc_dict_iter iter;
+	const char *key;
 	rpc_object_t oldv, newv;
 
-	g_hash_table_iter_init(&iter, dictionary->ro_value.rv_dict);
+	rpc_container_modify(dictionary);
+	rpc_dict_iter_init(&iter, dictionary->ro_value.rv_dict);
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		oldv = (rpc_object_t)value;
-		newv = mapper((const char *)key, oldv);
-		g_hash_table_iter_replace(&iter, newv);
+	while (rpc_dict_iter_next(&iter, &key, &oldv)) {
+		newv = mapper(key, oldv);
+		rpc_dict_iter_replace(&iter, newv);
 	}
 }
 
@@ -2194,7 +3154,63 @@ inline bool
 rpc_dictionary_has_key(rpc_object_t dictionary, const char *key)
 {
 
-	return (g_hash_table_lookup(dictionary->ro_value.rv_dict, key) != NULL);
+	rpc_container_load(dictionary);
+	return (rpc_dict_lookup(dictionary->ro_value.rv_dict, key) != NULL);
+}
+
+inline void
+rpc_dictionary_set_value_k(rpc_object_t dictionary, rpc_key_t key,
+    rpc_object_t value)
+{
+
+	if (value == NULL)
+		rpc_dictionary_remove_key(dictionary, rpc_key_get_string(key));
+	else {
+		rpc_dictionary_steal_value_k(dictionary, key, value);
+		rpc_retain(value);
+	}
+}
+
+inline void
+rpc_dictionary_steal_value_k(rpc_object_t dictionary, rpc_key_t key,
+    rpc_object_t value)
+{
+
+	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
+		rpc_abort("Trying dictionary API on non-dictionary object");
+
+	rpc_container_modify(dictionary);
+
+	rpc_dict_insert_key(dictionary->ro_value.rv_dict, key, value);
+}
+
+inline rpc_object_t
+rpc_dictionary_get_value_k(rpc_object_t dictionary, rpc_key_t key)
+{
+	rpc_object_t result;
+
+	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
+		return (NULL);
+
+	rpc_container_load(dictionary);
+	result = rpc_dict_lookup_key(dictionary->ro_value.rv_dict, key);
+	if (result != NULL && dictionary->ro_cow != NULL) {
+		rpc_container_unshare(dictionary);
+		result = rpc_dict_lookup_key(dictionary->ro_value.rv_dict, key);
+	}
+
+	return (result);
+}
+
+inline bool
+rpc_dictionary_has_key_k(rpc_object_t dictionary, rpc_key_t key)
+{
+
+	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
+		return (false);
+
+	rpc_container_load(dictionary);
+	return (rpc_dict_lookup_key(dictionary->ro_value.rv_dict, key) != NULL);
 }
 
 inline void
@@ -2265,7 +3281,7 @@ rpc_dictionary_get_bool(rpc_object_t dictionary, const char *key)
 {
 	rpc_object_t xbool;
 
-	xbool = rpc_dictionary_get_value(dictionary, key);
+	xbool = rpc_dictionary_peek_value(dictionary, key);
 	return ((xbool != NULL) ? rpc_bool_get_value(xbool) : false);
 }
 
@@ -2274,7 +3290,7 @@ rpc_dictionary_get_int64(rpc_object_t dictionary, const char *key)
 {
 	rpc_object_t xint;
 
-	xint = rpc_dictionary_get_value(dictionary, key);
+	xint = rpc_dictionary_peek_value(dictionary, key);
 	return ((xint != NULL) ? rpc_int64_get_value(xint) : 0);
 }
 
@@ -2283,7 +3299,7 @@ rpc_dictionary_get_uint64(rpc_object_t dictionary, const char *key)
 {
 	rpc_object_t xuint;
 
-	xuint = rpc_dictionary_get_value(dictionary, key);
+	xuint = rpc_dictionary_peek_value(dictionary, key);
 	return ((xuint != NULL) ? rpc_uint64_get_value(xuint) : 0);
 }
 
@@ -2292,7 +3308,7 @@ rpc_dictionary_get_double(rpc_object_t dictionary, const char *key)
 {
 	rpc_object_t xdouble;
 
-	xdouble = rpc_dictionary_get_value(dictionary, key);
+	xdouble = rpc_dictionary_peek_value(dictionary, key);
 	return ((xdouble != NULL) ? rpc_double_get_value(xdouble) : 0);
 }
 
@@ -2301,7 +3317,7 @@ rpc_dictionary_get_date(rpc_object_t dictionary, const char *key)
 {
 	rpc_object_t xdate;
 
-	xdate = rpc_dictionary_get_value(dictionary, key);
+	xdate = rpc_dictionary_peek_value(dictionary, key);
 	return ((xdate != NULL) ? rpc_date_get_value(xdate) : false);
 }
 
@@ -2311,7 +3327,7 @@ rpc_dictionary_get_data(rpc_object_t dictionary, const char *key,
 {
 	rpc_object_t xdata;
 
-	if ((xdata = rpc_dictionary_get_value(dictionary, key)) == NULL)
+	if ((xdata = rpc_dictionary_peek_value(dictionary, key)) == NULL)
 		return (NULL);
 
 	if (length != NULL)
@@ -2325,7 +3341,7 @@ rpc_dictionary_get_string(rpc_object_t dictionary, const char *key)
 {
 	rpc_object_t xstring;
 
-	xstring = rpc_dictionary_get_value(dictionary, key);
+	xstring = rpc_dictionary_peek_value(dictionary, key);
 	return ((xstring != NULL) ? rpc_string_get_string_ptr(xstring) : NULL);
 }
 
@@ -2334,7 +3350,7 @@ rpc_dictionary_get_fd(rpc_object_t dictionary, const char *key)
 {
 	rpc_object_t xfd;
 
-	xfd = rpc_dictionary_get_value(dictionary, key);
+	xfd = rpc_dictionary_peek_value(dictionary, key);
 	return ((xfd != NULL) ? rpc_fd_get_value(xfd) : -1);
 }
 
@@ -2343,6 +3359,6 @@ rpc_dictionary_dup_fd(rpc_object_t dictionary, const char *key)
 {
 	rpc_object_t xfd;
 
-	xfd = rpc_dictionary_get_value(dictionary, key);
+	xfd = rpc_dictionary_peek_value(dictionary, key);
 	return (xfd != NULL ? rpc_fd_dup(xfd) : 0);
 }
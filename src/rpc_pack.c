@@ -0,0 +1,442 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/typing.h>
+#include "internal.h"
+
+/*
+ * rpc_object_pack() format strings are compiled into a flat program with
+ * one instruction per value, in the order the values appear in. Container
+ * instructions are followed by their members and a closing instruction.
+ * Running the program only walks the instructions and pulls arguments,
+ * so a compiled format can be reused, also from multiple threads at once.
+ */
+struct rpc_pack_insn
+{
+	char			rpi_op;
+	char *			rpi_key;
+	ssize_t			rpi_index;
+	char *			rpi_type;
+	char *			rpi_str;
+	size_t			rpi_len;
+};
+
+struct rpc_pack_fmt
+{
+	GArray *		rpf_insns;
+};
+
+static bool rpc_pack_compile_value(GArray *, const char **,
+    struct rpc_pack_insn *);
+static rpc_object_t rpc_pack_run(struct rpc_pack_fmt *, guint *, va_list *);
+
+static const char *
+rpc_pack_skip_spaces(const char *ptr)
+{
+
+	while (g_ascii_isspace(*ptr))
+		ptr++;
+
+	return (ptr);
+}
+
+/*
+ * Parses the optional "key:" or "index:" prefix of a container member.
+ */
+static bool
+rpc_pack_compile_prefix(const char **ptrp, bool array,
+    struct rpc_pack_insn *insn)
+{
+	const char *ptr = *ptrp;
+	const char *end;
+	char *idx_end;
+
+	end = ptr + strcspn(ptr, ",:<[]{}'");
+	if (*end != ':')
+		return (true);
+
+	if (array) {
+		insn->rpi_index = (ssize_t)strtol(ptr, &idx_end, 10);
+		if (idx_end != end || insn->rpi_index < 0)
+			return (false);
+	} else
+		insn->rpi_key = g_strndup(ptr, (gsize)(end - ptr));
+
+	*ptrp = end + 1;
+	return (true);
+}
+
+static bool
+rpc_pack_compile_container(GArray *insns, const char **ptrp, char delim)
+{
+	struct rpc_pack_insn member;
+	struct rpc_pack_insn end = { .rpi_op = delim, .rpi_index = -1 };
+	const char *ptr = rpc_pack_skip_spaces(*ptrp);
+
+	if (*ptr != delim) {
+		for (;;) {
+			memset(&member, 0, sizeof(member));
+			member.rpi_index = -1;
+			ptr = rpc_pack_skip_spaces(ptr);
+			if (!rpc_pack_compile_prefix(&ptr, delim == ']',
+			    &member))
+				return (false);
+
+			if (!rpc_pack_compile_value(insns, &ptr, &member))
+				return (false);
+
+			ptr = rpc_pack_skip_spaces(ptr);
+			if (*ptr == delim)
+				break;
+
+			if (*ptr != ',')
+				return (false);
+
+			ptr++;
+		}
+	}
+
+	g_array_append_val(insns, end);
+	*ptrp = ptr + 1;
+	return (true);
+}
+
+/*
+ * Compiles a single value, with the member prefix already parsed into
+ * @p insn.
+ */
+static bool
+rpc_pack_compile_value(GArray *insns, const char **ptrp,
+    struct rpc_pack_insn *insn)
+{
+	const char *ptr = rpc_pack_skip_spaces(*ptrp);
+	const char *start;
+	uint32_t nesting;
+
+	if (*ptr == '<') {
+		start = ptr + 1;
+		for (nesting = 1; nesting != 0;) {
+			ptr++;
+			if (*ptr == '\0')
+				goto error;
+
+			if (*ptr == '<')
+				nesting++;
+
+			if (*ptr == '>')
+				nesting--;
+		}
+
+		insn->rpi_type = g_strndup(start, (gsize)(ptr - start));
+		ptr++;
+	}
+
+	insn->rpi_op = *ptr;
+	switch (*ptr) {
+	case 'v':
+	case 'V':
+	case 'n':
+	case 'b':
+	case 'B':
+	case 'I':
+	case 'f':
+	case 'i':
+	case 'u':
+	case 'd':
+	case 'D':
+	case 's':
+		g_array_append_val(insns, *insn);
+		*ptrp = ptr + 1;
+		return (true);
+
+	case '\'':
+		start = ptr + 1;
+		ptr = strchr(start, '\'');
+		if (ptr == NULL)
+			goto error;
+
+		insn->rpi_len = (size_t)(ptr - start);
+		insn->rpi_str = g_strndup(start, insn->rpi_len);
+		g_array_append_val(insns, *insn);
+		*ptrp = ptr + 1;
+		return (true);
+
+	case '{':
+	case '[':
+		g_array_append_val(insns, *insn);
+		*ptrp = ptr + 1;
+		return (rpc_pack_compile_container(insns, ptrp,
+		    *ptr == '{' ? '}' : ']'));
+
+	default:
+		break;
+	}
+
+error:
+	g_free(insn->rpi_key);
+	g_free(insn->rpi_type);
+	return (false);
+}
+
+rpc_pack_fmt_t
+rpc_pack_compile(const char *fmt)
+{
+	struct rpc_pack_fmt *result;
+	struct rpc_pack_insn insn = { .rpi_index = -1 };
+	const char *ptr = fmt;
+
+	result = g_malloc0(sizeof(*result));
+	result->rpf_insns = g_array_new(false, false,
+	    sizeof(struct rpc_pack_insn));
+
+	if (!rpc_pack_compile_value(result->rpf_insns, &ptr, &insn) ||
+	    *rpc_pack_skip_spaces(ptr) != '\0') {
+		rpc_pack_free(result);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	return (result);
+}
+
+void
+rpc_pack_free(rpc_pack_fmt_t fmt)
+{
+	struct rpc_pack_insn *insn;
+	guint i;
+
+	if (fmt == NULL)
+		return;
+
+	for (i = 0; i < fmt->rpf_insns->len; i++) {
+		insn = &g_array_index(fmt->rpf_insns, struct rpc_pack_insn, i);
+		g_free(insn->rpi_key);
+		g_free(insn->rpi_type);
+		g_free(insn->rpi_str);
+	}
+
+	g_array_free(fmt->rpf_insns, true);
+	g_free(fmt);
+}
+
+rpc_pack_fmt_t
+rpc_pack_compile_once(rpc_pack_fmt_t *cache, const char *fmt)
+{
+	rpc_pack_fmt_t result;
+
+	result = g_atomic_pointer_get(cache);
+	if (result != NULL)
+		return (result);
+
+	result = rpc_pack_compile(fmt);
+	g_assert_nonnull(result);
+
+	if (!g_atomic_pointer_compare_and_exchange(cache, NULL, result)) {
+		rpc_pack_free(result);
+		result = g_atomic_pointer_get(cache);
+	}
+
+	return (result);
+}
+
+static rpc_object_t
+rpc_pack_run_container(struct rpc_pack_fmt *fmt, guint *pc, va_list *ap,
+    rpc_object_t container)
+{
+	struct rpc_pack_insn *member;
+	const char *key = NULL;
+	rpc_object_t value;
+	size_t idx;
+	bool dict = rpc_get_type(container) == RPC_TYPE_DICTIONARY;
+
+	for (;;) {
+		member = &g_array_index(fmt->rpf_insns, struct rpc_pack_insn,
+		    *pc);
+		if (member->rpi_op == '}' || member->rpi_op == ']')
+			break;
+
+		if (dict) {
+			key = member->rpi_key != NULL ?
+			    member->rpi_key : va_arg(*ap, const char *);
+		}
+
+		idx = member->rpi_index >= 0 ? (size_t)member->rpi_index :
+		    rpc_array_get_count(container);
+
+		value = rpc_pack_run(fmt, pc, ap);
+		if (value == NULL) {
+			rpc_release(container);
+			return (NULL);
+		}
+
+		if (dict)
+			rpc_dictionary_steal_value(container, key, value);
+		else
+			rpc_array_steal_value(container, idx, value);
+	}
+
+	(*pc)++;
+	return (container);
+}
+
+static rpc_object_t
+rpc_pack_run(struct rpc_pack_fmt *fmt, guint *pc, va_list *ap)
+{
+	struct rpc_pack_insn *insn;
+	rpc_object_t result = NULL;
+	rpc_object_t typed;
+	const void *ptr;
+	size_t len;
+
+	insn = &g_array_index(fmt->rpf_insns, struct rpc_pack_insn, *pc);
+	(*pc)++;
+
+	switch (insn->rpi_op) {
+	case 'v':
+	case 'V':
+		result = va_arg(*ap, rpc_object_t);
+		if (result == NULL)
+			result = rpc_null_create();
+		else if (insn->rpi_op == 'V')
+			rpc_retain(result);
+		break;
+
+	case 'n':
+		result = rpc_null_create();
+		break;
+
+	case 'b':
+		result = rpc_bool_create(va_arg(*ap, int));
+		break;
+
+	case 'B':
+		ptr = va_arg(*ap, const void *);
+		len = va_arg(*ap, size_t);
+		result = rpc_data_create(ptr, len,
+		    va_arg(*ap, rpc_binary_destructor_t));
+		break;
+
+	case 'I':
+		ptr = va_arg(*ap, struct iovec *);
+		result = rpc_data_create_iov((struct iovec *)ptr,
+		    va_arg(*ap, size_t));
+		break;
+
+	case 'f':
+		result = rpc_fd_create(va_arg(*ap, int));
+		break;
+
+	case 'i':
+		result = rpc_int64_create(va_arg(*ap, int64_t));
+		break;
+
+	case 'u':
+		result = rpc_uint64_create(va_arg(*ap, uint64_t));
+		break;
+
+	case 'd':
+		result = rpc_double_create(va_arg(*ap, double));
+		break;
+
+	case 'D':
+		result = rpc_date_create(va_arg(*ap, int64_t));
+		break;
+
+	case 's':
+		result = rpc_string_create(va_arg(*ap, const char *));
+		break;
+
+	case '\'':
+		result = rpc_string_create_len(insn->rpi_str, insn->rpi_len);
+		break;
+
+	case '{':
+	case '[':
+		result = insn->rpi_op == '{' ?
+		    rpc_dictionary_create() : rpc_array_create();
+
+		/* Members go into the typed copy */
+		if (insn->rpi_type != NULL) {
+			typed = rpct_new(insn->rpi_type, result);
+			rpc_release(result);
+			if (typed == NULL)
+				return (NULL);
+
+			result = typed;
+		}
+
+		return (rpc_pack_run_container(fmt, pc, ap, result));
+
+	default:
+		g_assert_not_reached();
+	}
+
+	if (insn->rpi_type != NULL) {
+		typed = rpct_new(insn->rpi_type, result);
+		rpc_release(result);
+		result = typed;
+	}
+
+	return (result);
+}
+
+rpc_object_t
+rpc_object_pack_compiled(rpc_pack_fmt_t fmt, ...)
+{
+	va_list ap;
+	rpc_object_t result;
+
+	va_start(ap, fmt);
+	result = rpc_object_vpack_compiled(fmt, ap);
+	va_end(ap);
+	return (result);
+}
+
+rpc_object_t
+rpc_object_vpack_compiled(rpc_pack_fmt_t fmt, va_list ap)
+{
+	rpc_object_t result;
+	va_list copy;
+	guint pc = 0;
+
+	va_copy(copy, ap);
+	result = rpc_pack_run(fmt, &pc, &copy);
+	va_end(copy);
+
+	if (result == NULL)
+		errno = EINVAL;
+
+	return (result);
+}
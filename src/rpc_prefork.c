@@ -0,0 +1,482 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include "internal.h"
+#include "serializer/msgpack.h"
+
+/*
+ * Pre-forked servers.
+ *
+ * The parent binds the listening sockets with a short-lived server of
+ * its own, takes copies of them the way rpc_server_handover() does and
+ * tears that server and its context down again, so that it has no
+ * threads left when it forks. Each worker then gets a fresh context and
+ * a server created on one of the inherited sockets: its own SO_REUSEPORT
+ * socket on TCP, so that the kernel spreads connections, or the one
+ * shared socket otherwise, which all workers accept on.
+ *
+ * The parent stays single threaded. It restarts workers that exit and
+ * relays broadcast events: every worker has a SOCK_SEQPACKET socket pair
+ * to the parent, and an event a worker broadcasts is sent there, one
+ * datagram per event, and handed on to all other workers, which
+ * broadcast it to their own clients.
+ */
+
+#define	RPC_PREFORK_POLL	100	/* ms */
+#define	RPC_PREFORK_BACKOFF	1000	/* ms */
+
+struct rpc_prefork_worker
+{
+	pid_t			rpw_pid;
+	int			rpw_relay;
+	gint64			rpw_started;
+};
+
+struct rpc_prefork
+{
+	const char *		rp_uri;
+	rpc_object_t		rp_params;
+	rpc_prefork_init_t	rp_init;
+	GArray *		rp_fds;
+	struct rpc_prefork_worker *rp_workers;
+	unsigned int		rp_nworkers;
+};
+
+static int rpc_prefork_bind(struct rpc_prefork *);
+static int rpc_prefork_spawn(struct rpc_prefork *, unsigned int);
+static void rpc_prefork_worker_main(struct rpc_prefork *, unsigned int, int)
+    __attribute__((noreturn));
+static void rpc_prefork_forward(struct rpc_prefork *, unsigned int);
+static void rpc_prefork_reap(struct rpc_prefork *, bool);
+static gboolean rpc_prefork_relay_recv(gint, GIOCondition, gpointer);
+static void rpc_prefork_stop(int);
+
+static volatile sig_atomic_t rpc_prefork_stopping;
+
+static void
+rpc_prefork_stop(int sig __unused)
+{
+
+	rpc_prefork_stopping = 1;
+}
+
+/*
+ * Binds the listening sockets and keeps copies of them in rp_fds. On
+ * TCP, one SO_REUSEPORT socket is bound for every worker. The server is
+ * closed right away; a connection it manages to accept meanwhile is
+ * dropped.
+ */
+static int
+rpc_prefork_bind(struct rpc_prefork *pf)
+{
+	rpc_context_t context;
+	rpc_server_t server;
+	rpc_object_t params;
+	int ret = 0;
+
+	if (pf->rp_params != NULL &&
+	    rpc_get_type(pf->rp_params) == RPC_TYPE_DICTIONARY)
+		params = rpc_copy(pf->rp_params);
+	else
+		params = rpc_dictionary_create();
+
+	rpc_dictionary_set_int64(params, "listeners", pf->rp_nworkers);
+	context = rpc_context_create();
+	server = rpc_server_create_ex(pf->rp_uri, context, params);
+	if (server == NULL) {
+		rpc_context_free(context);
+		rpc_release(params);
+		return (-1);
+	}
+
+	if (server->rs_handover == NULL) {
+		rpc_set_last_errorf(ENOTSUP,
+		    "Only socket transport servers can be pre-forked");
+		ret = -1;
+	} else {
+		ret = server->rs_handover(server, pf->rp_fds);
+		if (server->rs_stop_accepting != NULL)
+			server->rs_stop_accepting(server);
+	}
+
+	rpc_server_close(server);
+	rpc_context_free(context);
+	rpc_release(params);
+
+	if (ret == 0 && pf->rp_fds->len == 0) {
+		rpc_set_last_errorf(ENXIO, "Server has no listening sockets");
+		ret = -1;
+	}
+
+	return (ret);
+}
+
+static int
+rpc_prefork_spawn(struct rpc_prefork *pf, unsigned int index)
+{
+	struct rpc_prefork_worker *worker = &pf->rp_workers[index];
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+		rpc_set_last_errorf(errno, "Cannot create relay socket: %s",
+		    g_strerror(errno));
+		return (-1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		rpc_set_last_errorf(errno, "Cannot fork worker: %s",
+		    g_strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return (-1);
+	}
+
+	if (pid == 0) {
+		close(sv[0]);
+		rpc_prefork_worker_main(pf, index, sv[1]);
+	}
+
+	close(sv[1]);
+	worker->rpw_pid = pid;
+	worker->rpw_relay = sv[0];
+	worker->rpw_started = g_get_monotonic_time();
+	debugf("worker %u started as pid %d", index, pid);
+	return (0);
+}
+
+static void
+rpc_prefork_worker_main(struct rpc_prefork *pf, unsigned int index,
+    int relay)
+{
+	rpc_context_t context;
+	rpc_server_t server;
+	rpc_object_t params;
+	GSource *source;
+	sigset_t set;
+	int fd;
+	int sig;
+	guint i;
+
+	/* Blocked before any thread exists, so that sigwait() gets them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (i = 0; i < pf->rp_nworkers; i++) {
+		if (i != index && pf->rp_workers[i].rpw_relay != -1)
+			close(pf->rp_workers[i].rpw_relay);
+	}
+
+	fd = g_array_index(pf->rp_fds, int, index % pf->rp_fds->len);
+	for (i = 0; i < pf->rp_fds->len; i++) {
+		if (g_array_index(pf->rp_fds, int, i) != fd)
+			close(g_array_index(pf->rp_fds, int, i));
+	}
+
+	if (pf->rp_params != NULL &&
+	    rpc_get_type(pf->rp_params) == RPC_TYPE_DICTIONARY)
+		params = rpc_copy(pf->rp_params);
+	else
+		params = rpc_dictionary_create();
+
+	rpc_dictionary_remove_key(params, "listeners");
+	rpc_dictionary_set_fd(params, "fd", fd);
+
+	context = rpc_context_create();
+	if (!pf->rp_init(context, (int)index))
+		_exit(1);
+
+	server = rpc_server_create_ex(pf->rp_uri, context, params);
+	if (server == NULL) {
+		debugf("worker %u: %s", index,
+		    rpc_error_get_message(rpc_get_last_error()));
+		_exit(1);
+	}
+
+	server->rs_relay_fd = relay;
+	source = g_unix_fd_source_new(relay, G_IO_IN | G_IO_HUP | G_IO_ERR);
+	g_source_set_callback(source, (GSourceFunc)rpc_prefork_relay_recv,
+	    server, NULL);
+	g_source_attach(source, server->rs_g_context);
+	g_source_unref(source);
+
+	rpc_server_resume(server);
+	sigwait(&set, &sig);
+
+	g_source_destroy(source);
+	server->rs_relay_fd = -1;
+	rpc_server_close(server);
+	rpc_context_free(context);
+	_exit(0);
+}
+
+/*
+ * Hands an event from one worker on to the others. A worker whose relay
+ * socket is full misses the event rather than stalling the rest.
+ */
+static void
+rpc_prefork_forward(struct rpc_prefork *pf, unsigned int from)
+{
+	struct rpc_prefork_worker *worker = &pf->rp_workers[from];
+	void *buf;
+	ssize_t len;
+	unsigned int i;
+
+	len = recv(worker->rpw_relay, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if (len <= 0) {
+		close(worker->rpw_relay);
+		worker->rpw_relay = -1;
+		return;
+	}
+
+	buf = g_malloc((size_t)len);
+	len = recv(worker->rpw_relay, buf, (size_t)len, 0);
+
+	for (i = 0; len > 0 && i < pf->rp_nworkers; i++) {
+		if (i == from || pf->rp_workers[i].rpw_relay == -1)
+			continue;
+
+		if (send(pf->rp_workers[i].rpw_relay, buf, (size_t)len,
+		    MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+			debugf("worker %u missed a relayed event", i);
+	}
+
+	g_free(buf);
+}
+
+static void
+rpc_prefork_reap(struct rpc_prefork *pf, bool block)
+{
+	struct rpc_prefork_worker *worker;
+	unsigned int i;
+	int status;
+
+	for (i = 0; i < pf->rp_nworkers; i++) {
+		worker = &pf->rp_workers[i];
+		if (worker->rpw_pid == -1 || waitpid(worker->rpw_pid, &status,
+		    block ? 0 : WNOHANG) != worker->rpw_pid)
+			continue;
+
+		debugf("worker %u (pid %d) exited with status %d", i,
+		    worker->rpw_pid, status);
+		worker->rpw_pid = -1;
+		if (worker->rpw_relay != -1) {
+			close(worker->rpw_relay);
+			worker->rpw_relay = -1;
+		}
+	}
+}
+
+static gboolean
+rpc_prefork_relay_recv(gint fd, GIOCondition cond, gpointer arg)
+{
+	rpc_server_t server = arg;
+	rpc_object_t event;
+	const char *path = NULL;
+	const char *interface = NULL;
+	const char *name = NULL;
+	rpc_object_t args = NULL;
+	void *buf;
+	ssize_t len;
+
+	len = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if (len <= 0 || (cond & (G_IO_HUP | G_IO_ERR))) {
+		/* The parent is gone; so are we */
+		kill(getpid(), SIGTERM);
+		return (G_SOURCE_REMOVE);
+	}
+
+	buf = g_malloc((size_t)len);
+	len = recv(fd, buf, (size_t)len, 0);
+	event = len > 0 ? rpc_msgpack_deserialize(buf, (size_t)len) : NULL;
+	g_free(buf);
+
+	if (event == NULL)
+		return (G_SOURCE_CONTINUE);
+
+	rpc_object_unpack(event, "{path:s,interface:s,name:s,args:v}",
+	    &path, &interface, &name, &args);
+	if (name != NULL)
+		rpc_server_broadcast_local(server, path, interface, name, args);
+
+	rpc_release(event);
+	return (G_SOURCE_CONTINUE);
+}
+
+void
+rpc_prefork_relay(rpc_server_t server, const char *path,
+    const char *interface, const char *name, rpc_object_t args)
+{
+	rpc_object_t event;
+	void *buf;
+	size_t len;
+
+	event = rpc_dictionary_create();
+	if (path != NULL)
+		rpc_dictionary_set_string(event, "path", path);
+
+	if (interface != NULL)
+		rpc_dictionary_set_string(event, "interface", interface);
+
+	rpc_dictionary_set_string(event, "name", name);
+	if (args != NULL)
+		rpc_dictionary_set_value(event, "args", args);
+
+	/* Events carrying descriptors stay with the worker's own clients */
+	if (rpc_msgpack_serialize(event, &buf, &len) != 0) {
+		rpc_release(event);
+		return;
+	}
+
+	if (send(server->rs_relay_fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) !=
+	    (ssize_t)len)
+		debugf("cannot relay event %s: %s", name, g_strerror(errno));
+
+	g_free(buf);
+	rpc_release(event);
+}
+
+int
+rpc_server_prefork(const char *uri, rpc_object_t params,
+    unsigned int nworkers, rpc_prefork_init_t init)
+{
+	struct rpc_prefork pf;
+	struct sigaction sa;
+	struct sigaction old_term;
+	struct sigaction old_int;
+	struct pollfd *fds;
+	unsigned int *owners;
+	unsigned int i;
+	nfds_t nfds;
+	gint64 now;
+	int ret = 0;
+
+	if (nworkers == 0) {
+		rpc_set_last_errorf(EINVAL, "At least one worker is needed");
+		return (-1);
+	}
+
+	memset(&pf, 0, sizeof(pf));
+	pf.rp_uri = uri;
+	pf.rp_params = params;
+	pf.rp_init = init;
+	pf.rp_nworkers = nworkers;
+	pf.rp_fds = g_array_new(false, false, sizeof(int));
+	pf.rp_workers = g_malloc0_n(nworkers, sizeof(*pf.rp_workers));
+	for (i = 0; i < nworkers; i++) {
+		pf.rp_workers[i].rpw_pid = -1;
+		pf.rp_workers[i].rpw_relay = -1;
+	}
+
+	if (rpc_prefork_bind(&pf) != 0) {
+		g_array_free(pf.rp_fds, true);
+		g_free(pf.rp_workers);
+		return (-1);
+	}
+
+	rpc_prefork_stopping = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = rpc_prefork_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, &old_term);
+	sigaction(SIGINT, &sa, &old_int);
+
+	fds = g_malloc0_n(nworkers, sizeof(*fds));
+	owners = g_malloc0_n(nworkers, sizeof(*owners));
+
+	while (!rpc_prefork_stopping) {
+		/* Workers that die right after starting are held back */
+		now = g_get_monotonic_time();
+		for (i = 0; i < nworkers; i++) {
+			if (pf.rp_workers[i].rpw_pid != -1)
+				continue;
+
+			if (pf.rp_workers[i].rpw_started != 0 &&
+			    now - pf.rp_workers[i].rpw_started <
+			    RPC_PREFORK_BACKOFF * 1000)
+				continue;
+
+			if (rpc_prefork_spawn(&pf, i) != 0) {
+				ret = -1;
+				rpc_prefork_stopping = 1;
+				break;
+			}
+		}
+
+		nfds = 0;
+		for (i = 0; i < nworkers; i++) {
+			if (pf.rp_workers[i].rpw_relay == -1)
+				continue;
+
+			fds[nfds].fd = pf.rp_workers[i].rpw_relay;
+			fds[nfds].events = POLLIN;
+			owners[nfds++] = i;
+		}
+
+		if (poll(fds, nfds, RPC_PREFORK_POLL) > 0) {
+			for (i = 0; i < nfds; i++) {
+				if (fds[i].revents != 0)
+					rpc_prefork_forward(&pf, owners[i]);
+			}
+		}
+
+		rpc_prefork_reap(&pf, false);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		if (pf.rp_workers[i].rpw_pid != -1)
+			kill(pf.rp_workers[i].rpw_pid, SIGTERM);
+	}
+
+	rpc_prefork_reap(&pf, true);
+
+	for (i = 0; i < pf.rp_fds->len; i++)
+		close(g_array_index(pf.rp_fds, int, i));
+
+	sigaction(SIGTERM, &old_term, NULL);
+	sigaction(SIGINT, &old_int, NULL);
+	g_array_free(pf.rp_fds, true);
+	g_free(pf.rp_workers);
+	g_free(owners);
+	g_free(fds);
+	return (ret);
+}
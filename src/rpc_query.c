@@ -29,477 +29,2505 @@
 #include <glib.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <Block.h>
 #ifndef _WIN32
 #include <fnmatch.h>
 #endif
 #include "internal.h"
 
-static bool eval_rule(rpc_object_t obj, rpc_object_t rule);
+/*
+ * Rules are compiled into a tree of plan nodes: paths are split into
+ * segments up front, operators become an enum and regular expressions
+ * are compiled once, so evaluating a plan against an element never
+ * looks at the rules again.
+ */
+typedef enum {
+	RPC_QUERY_OP_FALSE,	/* malformed rule, never matches */
+	RPC_QUERY_OP_ALL,	/* top-level rule list */
+	RPC_QUERY_OP_AND,
+	RPC_QUERY_OP_OR,
+	RPC_QUERY_OP_NOR,
+	RPC_QUERY_OP_EQ,
+	RPC_QUERY_OP_NE,
+	RPC_QUERY_OP_GT,
+	RPC_QUERY_OP_LT,
+	RPC_QUERY_OP_GE,
+	RPC_QUERY_OP_LE,
+	RPC_QUERY_OP_REGEX,
+	RPC_QUERY_OP_IN,
+	RPC_QUERY_OP_NIN,
+	RPC_QUERY_OP_MATCH
+} rpc_query_op_t;
+
+/*
+ * Paths compiled through rpc_path_compile() also carry interned keys,
+ * the ones split internally for query rules do not, since rules are
+ * arbitrary data and interned keys are never freed.
+ */
+struct rpc_query_segment
+{
+	char *			rqs_key;
+	rpc_key_t		rqs_ikey;
+	size_t			rqs_idx;
+	bool			rqs_isidx;
+};
+
+struct rpc_query_path
+{
+	size_t			rqp_count;
+	struct rpc_query_segment *rqp_segments;
+};
+
+struct rpc_query_node
+{
+	rpc_query_op_t		rqn_op;
+	bool			rqn_has_path;
+	char *			rqn_left;
+	struct rpc_query_path	rqn_path;
+	rpc_object_t		rqn_value;
+	const char *		rqn_pattern;
+	GRegex *		rqn_regex;
+	GPtrArray *		rqn_children;
+};
+
+struct rpc_query_plan
+{
+	struct rpc_query_node *	rqp_root;
+};
+
+/*
+ * Indexes are looked up by the array they cover, so that queries can
+ * find them without the caller passing them around. Each index keeps
+ * the generation of the array it was built at and is rebuilt once the
+ * array has been modified since.
+ */
+struct rpc_query_index_entry
+{
+	int			rqe_key;
+	guint			rqe_pos;
+};
+
+struct rpc_query_index
+{
+	rpc_object_t		rqx_array;
+	char *			rqx_path_str;
+	struct rpc_query_path	rqx_path;
+	rpc_query_index_kind_t	rqx_kind;
+	GMutex			rqx_mtx;
+	bool			rqx_valid;
+	unsigned int		rqx_generation;
+	GHashTable *		rqx_hash;
+	GArray *		rqx_sorted;
+};
+
+/*
+ * A view keeps the elements of its array matching a plan, in array
+ * order, and is told about every change made through the array API.
+ * Only the changed element is looked at; where it lands in the view
+ * is found by counting the matches in front of it.
+ */
+struct rpc_query_view
+{
+	rpc_object_t		rqv_array;
+	rpc_query_plan_t	rqv_plan;
+	GMutex			rqv_mtx;
+	GByteArray *		rqv_matched;
+	GPtrArray *		rqv_result;
+	rpc_instance_t		rqv_instance;
+	char *			rqv_interface;
+	char *			rqv_name;
+};
+
+static struct rpc_query_node *rpc_query_compile_rule(rpc_object_t);
+static bool rpc_query_eval(struct rpc_query_node *, rpc_object_t);
+static char *rpc_query_diff_path(const char *, const char *);
+static void rpc_query_diff_set(rpc_object_t, const char *, rpc_object_t);
+static void rpc_query_diff_dict(rpc_object_t, const char *, rpc_object_t,
+    rpc_object_t);
+static void rpc_query_diff_array(rpc_object_t, const char *, rpc_object_t,
+    rpc_object_t);
+static void rpc_query_diff_impl(rpc_object_t, const char *, rpc_object_t,
+    rpc_object_t);
+static rpc_object_t rpc_query_splice(rpc_object_t, size_t, size_t,
+    rpc_object_t);
+
+static GMutex rpc_query_indexes_mtx;
+static GHashTable *rpc_query_indexes;
+static volatile gint rpc_query_nindexes;
+
+static GMutex rpc_query_views_mtx;
+static GHashTable *rpc_query_views;
+static volatile gint rpc_query_nviews;
+
+static const struct {
+	const char *		name;
+	rpc_query_op_t		op;
+} rpc_query_field_ops[] = {
+	{ "=", RPC_QUERY_OP_EQ },
+	{ "!=", RPC_QUERY_OP_NE },
+	{ ">", RPC_QUERY_OP_GT },
+	{ "<", RPC_QUERY_OP_LT },
+	{ ">=", RPC_QUERY_OP_GE },
+	{ "<=", RPC_QUERY_OP_LE },
+	{ "~", RPC_QUERY_OP_REGEX },
+	{ "in", RPC_QUERY_OP_IN },
+	{ "contains", RPC_QUERY_OP_IN },
+	{ "nin", RPC_QUERY_OP_NIN },
+	{ "ncontains", RPC_QUERY_OP_NIN },
+#ifndef _WIN32
+	{ "match", RPC_QUERY_OP_MATCH },
+#endif
+	{ NULL, RPC_QUERY_OP_FALSE }
+};
+
+static void
+rpc_query_path_split(struct rpc_query_path *rpath, const char *path)
+{
+	struct rpc_query_segment *seg;
+	char **tokens;
+	char *endptr;
+	size_t i;
+
+	tokens = g_strsplit(path, ".", 0);
+	rpath->rqp_count = 0;
+	rpath->rqp_segments = g_new0(struct rpc_query_segment,
+	    g_strv_length(tokens));
+
+	for (i = 0; tokens[i] != NULL; i++) {
+		/* Empty segments are skipped, like strtok() would */
+		if (*tokens[i] == '\0') {
+			g_free(tokens[i]);
+			continue;
+		}
+
+		seg = &rpath->rqp_segments[rpath->rqp_count++];
+		seg->rqs_key = tokens[i];
+		seg->rqs_idx = (size_t)g_ascii_strtoull(tokens[i], &endptr, 10);
+		seg->rqs_isidx = endptr != tokens[i];
+	}
+
+	g_free(tokens);
+}
+
+static void
+rpc_query_path_free(struct rpc_query_path *rpath)
+{
+	size_t i;
+
+	for (i = 0; i < rpath->rqp_count; i++)
+		g_free(rpath->rqp_segments[i].rqs_key);
+
+	g_free(rpath->rqp_segments);
+}
+
+static rpc_object_t
+rpc_query_segment_lookup(rpc_object_t dictionary,
+    const struct rpc_query_segment *seg)
+{
+
+	if (seg->rqs_ikey != NULL)
+		return (rpc_dictionary_get_value_k(dictionary, seg->rqs_ikey));
+
+	return (rpc_dictionary_get_value(dictionary, seg->rqs_key));
+}
+
+static void
+rpc_query_segment_store(rpc_object_t dictionary,
+    const struct rpc_query_segment *seg, rpc_object_t value, bool steal)
+{
+
+	if (seg->rqs_ikey != NULL && steal)
+		rpc_dictionary_steal_value_k(dictionary, seg->rqs_ikey, value);
+	else if (seg->rqs_ikey != NULL)
+		rpc_dictionary_set_value_k(dictionary, seg->rqs_ikey, value);
+	else if (steal)
+		rpc_dictionary_steal_value(dictionary, seg->rqs_key, value);
+	else
+		rpc_dictionary_set_value(dictionary, seg->rqs_key, value);
+}
+
+static rpc_object_t
+rpc_query_path_get(rpc_object_t object, const struct rpc_query_path *rpath,
+    rpc_object_t default_val)
+{
+	rpc_object_t leaf = object;
+	size_t i;
+
+	for (i = 0; i < rpath->rqp_count; i++) {
+		switch (rpc_get_type(leaf)) {
+		case RPC_TYPE_DICTIONARY:
+			leaf = rpc_query_segment_lookup(leaf,
+			    &rpath->rqp_segments[i]);
+			break;
+
+		case RPC_TYPE_ARRAY:
+			leaf = rpc_array_get_value(leaf,
+			    rpath->rqp_segments[i].rqs_idx);
+			break;
+
+		default:
+			return (NULL);
+		}
+	}
+
+	return (leaf != NULL ? leaf : default_val);
+}
+
+static void
+rpc_query_path_set(rpc_object_t object, const struct rpc_query_path *rpath,
+    rpc_object_t value, bool steal)
+{
+	const struct rpc_query_segment *seg;
+	rpc_object_t container = object;
+	rpc_object_t temp;
+	size_t i;
+
+	if (rpath->rqp_count == 0) {
+		rpc_set_last_errorf(EINVAL, "SET: Path is empty");
+		return;
+	}
+
+	for (i = 0; i + 1 < rpath->rqp_count; i++) {
+		seg = &rpath->rqp_segments[i];
+
+		switch (rpc_get_type(container)) {
+		case RPC_TYPE_DICTIONARY:
+			temp = rpc_query_segment_lookup(container, seg);
+			break;
+
+		case RPC_TYPE_ARRAY:
+			if (!seg->rqs_isidx) {
+				rpc_set_last_errorf(EINVAL,
+				    "SET: Token %s is not a number",
+				    seg->rqs_key);
+				return;
+			}
+
+			temp = rpc_array_get_value(container, seg->rqs_idx);
+			break;
+
+		default:
+			rpc_set_last_errorf(EINVAL,
+			    "SET: Unsupported type of container");
+			return;
+		}
+
+		if (temp == NULL) {
+			temp = rpath->rqp_segments[i + 1].rqs_isidx ?
+			    rpc_array_create() : rpc_dictionary_create();
+
+			if (rpc_get_type(container) == RPC_TYPE_DICTIONARY)
+				rpc_query_segment_store(container, seg, temp,
+				    true);
+			else
+				rpc_array_steal_value(container, seg->rqs_idx,
+				    temp);
+		}
+
+		container = temp;
+	}
+
+	seg = &rpath->rqp_segments[i];
+
+	switch (rpc_get_type(container)) {
+	case RPC_TYPE_DICTIONARY:
+		rpc_query_segment_store(container, seg, value, steal);
+		break;
+
+	case RPC_TYPE_ARRAY:
+		if (!seg->rqs_isidx) {
+			rpc_set_last_errorf(EINVAL,
+			    "SET: Token %s is not a number", seg->rqs_key);
+			return;
+		}
+
+		if (steal)
+			rpc_array_steal_value(container, seg->rqs_idx, value);
+		else
+			rpc_array_set_value(container, seg->rqs_idx, value);
+
+		break;
+
+	default:
+		rpc_set_last_error(EINVAL,
+		    "SET: Cannot navigate through non-container types.", NULL);
+		break;
+	}
+}
+
+static void
+rpc_query_path_delete(rpc_object_t object, const struct rpc_query_path *rpath)
+{
+	const struct rpc_query_segment *seg;
+	struct rpc_query_path parent;
+	rpc_object_t container;
+
+	if (rpath->rqp_count == 0) {
+		rpc_set_last_error(ENOENT,
+		    "DELETE: Path too short - specify target for the value.",
+		    NULL);
+		return;
+	}
+
+	parent.rqp_count = rpath->rqp_count - 1;
+	parent.rqp_segments = rpath->rqp_segments;
+	container = rpc_query_path_get(object, &parent, NULL);
+	if (container == NULL) {
+		rpc_set_last_error(ENOENT, "DELETE: Parent object not found.",
+		    NULL);
+		return;
+	}
+
+	seg = &rpath->rqp_segments[parent.rqp_count];
+
+	switch (rpc_get_type(container)) {
+	case RPC_TYPE_DICTIONARY:
+		rpc_dictionary_remove_key(container, seg->rqs_key);
+		break;
+
+	case RPC_TYPE_ARRAY:
+		if (!seg->rqs_isidx) {
+			rpc_set_last_error(ENOENT,
+			    "DELETE: String to index conversion failed.",
+			    NULL);
+			return;
+		}
+
+		rpc_array_remove_index(container, seg->rqs_idx);
+		break;
+
+	default:
+		rpc_set_last_error(EINVAL,
+		    "DELETE: Cannot navigate through non-container types.",
+		    NULL);
+		break;
+	}
+}
+
+/*
+ * A projection copies the selected paths of an object into a new one,
+ * sharing the values rather than copying them. When only top-level
+ * keys are selected, results are built straight into slots of a layout
+ * made for that set of keys, which skips hashing every key of every
+ * result. Layouts have to outlive the dictionaries using them, so they
+ * are interned for good, up to a limit.
+ */
+#define	RPC_QUERY_LAYOUTS_MAX	256
+
+struct rpc_query_projection
+{
+	GPtrArray *		rpr_paths;
+	const struct rpct_layout *rpr_layout;
+	guint *			rpr_slots;
+};
+
+static GMutex rpc_query_layouts_mtx;
+static GHashTable *rpc_query_layouts;
+
+static void
+rpc_query_path_destroy(struct rpc_query_path *path)
+{
+
+	rpc_query_path_free(path);
+	g_free(path);
+}
+
+static gint
+rpc_query_name_cmp(gconstpointer a, gconstpointer b)
+{
+
+	return (strcmp(*(const char **)a, *(const char **)b));
+}
+
+static const struct rpct_layout *
+rpc_query_layout_intern(GPtrArray *names)
+{
+	struct rpct_layout *layout;
+	GString *key;
+	guint i;
+
+	g_ptr_array_sort(names, rpc_query_name_cmp);
+	key = g_string_new(NULL);
+	for (i = 0; i < names->len; i++) {
+		g_string_append(key, g_ptr_array_index(names, i));
+		g_string_append_c(key, '\n');
+	}
+
+	g_mutex_lock(&rpc_query_layouts_mtx);
+	if (rpc_query_layouts == NULL)
+		rpc_query_layouts = g_hash_table_new(g_str_hash, g_str_equal);
+
+	layout = g_hash_table_lookup(rpc_query_layouts, key->str);
+	if (layout == NULL &&
+	    g_hash_table_size(rpc_query_layouts) < RPC_QUERY_LAYOUTS_MAX) {
+		layout = g_malloc0(sizeof(*layout) +
+		    names->len * sizeof(const char *));
+		layout->rl_count = names->len;
+		for (i = 0; i < names->len; i++)
+			layout->rl_names[i] = g_strdup(
+			    g_ptr_array_index(names, i));
+
+		g_hash_table_insert(rpc_query_layouts,
+		    g_string_free(key, false), layout);
+		key = NULL;
+	}
+
+	g_mutex_unlock(&rpc_query_layouts_mtx);
+	if (key != NULL)
+		g_string_free(key, true);
+
+	return (layout);
+}
+
+static struct rpc_query_projection *
+rpc_query_projection_new(void)
+{
+	struct rpc_query_projection *proj;
+
+	proj = g_malloc0(sizeof(*proj));
+	proj->rpr_paths = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_query_path_destroy);
+	return (proj);
+}
+
+static void
+rpc_query_projection_add(struct rpc_query_projection *proj, const char *path)
+{
+	struct rpc_query_path *rpath;
+
+	rpath = g_malloc0(sizeof(*rpath));
+	rpc_query_path_split(rpath, path);
+	if (rpath->rqp_count == 0) {
+		rpc_query_path_destroy(rpath);
+		return;
+	}
+
+	g_ptr_array_add(proj->rpr_paths, rpath);
+}
+
+static void
+rpc_query_projection_seal(struct rpc_query_projection *proj)
+{
+	struct rpc_query_path *rpath;
+	GPtrArray *names;
+	GHashTable *seen;
+	guint i;
+	guint j;
+
+	names = g_ptr_array_new();
+	seen = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; i < proj->rpr_paths->len; i++) {
+		rpath = g_ptr_array_index(proj->rpr_paths, i);
+		if (rpath->rqp_count != 1 ||
+		    strchr(rpath->rqp_segments[0].rqs_key, '\n') != NULL ||
+		    !g_hash_table_add(seen, rpath->rqp_segments[0].rqs_key))
+			goto done;
+
+		g_ptr_array_add(names, rpath->rqp_segments[0].rqs_key);
+	}
+
+	if (names->len == 0)
+		goto done;
+
+	proj->rpr_layout = rpc_query_layout_intern(names);
+	if (proj->rpr_layout == NULL)
+		goto done;
+
+	proj->rpr_slots = g_new(guint, proj->rpr_paths->len);
+	for (i = 0; i < proj->rpr_paths->len; i++) {
+		rpath = g_ptr_array_index(proj->rpr_paths, i);
+		for (j = 0; j < proj->rpr_layout->rl_count; j++) {
+			if (!strcmp(proj->rpr_layout->rl_names[j],
+			    rpath->rqp_segments[0].rqs_key))
+				break;
+		}
+
+		proj->rpr_slots[i] = j;
+	}
+
+done:
+	g_hash_table_destroy(seen);
+	g_ptr_array_free(names, true);
+}
+
+static void
+rpc_query_projection_free(struct rpc_query_projection *proj)
+{
+
+	g_ptr_array_free(proj->rpr_paths, true);
+	g_free(proj->rpr_slots);
+	g_free(proj);
+}
+
+/*
+ * Returns a new object with only the selected paths of a dictionary.
+ * Anything else is passed through, with its reference count bumped.
+ */
+static rpc_object_t
+rpc_query_projection_apply(struct rpc_query_projection *proj,
+    rpc_object_t object)
+{
+	struct rpc_query_path *path;
+	union rpc_value val;
+	rpc_object_t result;
+	rpc_object_t container;
+	rpc_object_t value;
+	rpc_object_t next;
+	size_t i;
+	guint j;
+
+	if (rpc_get_type(object) != RPC_TYPE_DICTIONARY)
+		return (rpc_retain(object));
+
+	if (proj->rpr_layout != NULL) {
+		val.rv_dict = rpc_dict_new_layout(proj->rpr_layout);
+		result = rpc_prim_create(RPC_TYPE_DICTIONARY, val);
+		for (j = 0; j < proj->rpr_paths->len; j++) {
+			path = g_ptr_array_index(proj->rpr_paths, j);
+			value = rpc_dictionary_get_value(object,
+			    path->rqp_segments[0].rqs_key);
+			if (value != NULL) {
+				rpc_dict_set_slot(result->ro_value.rv_dict,
+				    proj->rpr_slots[j], rpc_retain(value));
+			}
+		}
+
+		return (result);
+	}
+
+	result = rpc_dictionary_create();
+	for (j = 0; j < proj->rpr_paths->len; j++) {
+		path = g_ptr_array_index(proj->rpr_paths, j);
+		value = rpc_query_path_get(object, path, NULL);
+		if (value == NULL)
+			continue;
+
+		/* Intermediate levels always come out as dictionaries */
+		container = result;
+		for (i = 0; i + 1 < path->rqp_count; i++) {
+			next = rpc_dictionary_get_value(container,
+			    path->rqp_segments[i].rqs_key);
+			if (rpc_get_type(next) != RPC_TYPE_DICTIONARY) {
+				next = rpc_dictionary_create();
+				rpc_dictionary_steal_value(container,
+				    path->rqp_segments[i].rqs_key, next);
+			}
+
+			container = next;
+		}
+
+		rpc_dictionary_set_value(container,
+		    path->rqp_segments[i].rqs_key, value);
+	}
+
+	return (result);
+}
+
+static struct rpc_query_node *
+rpc_query_node_new(rpc_query_op_t op)
+{
+	struct rpc_query_node *node;
+
+	node = g_malloc0(sizeof(*node));
+	node->rqn_op = op;
+	return (node);
+}
+
+static void
+rpc_query_node_free(struct rpc_query_node *node)
+{
+
+	if (node->rqn_children != NULL)
+		g_ptr_array_free(node->rqn_children, true);
+
+	if (node->rqn_regex != NULL)
+		g_regex_unref(node->rqn_regex);
+
+	if (node->rqn_value != NULL)
+		rpc_release(node->rqn_value);
+
+	rpc_query_path_free(&node->rqn_path);
+	g_free(node->rqn_left);
+	g_free(node);
+}
+
+static struct rpc_query_node *
+rpc_query_compile_list(rpc_query_op_t op, rpc_object_t lst)
+{
+	struct rpc_query_node *node;
+
+	if (rpc_get_type(lst) != RPC_TYPE_ARRAY)
+		return (rpc_query_node_new(RPC_QUERY_OP_FALSE));
+
+	node = rpc_query_node_new(op);
+	node->rqn_children = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_query_node_free);
+
+	rpc_array_apply(lst, ^(size_t idx __unused, rpc_object_t v) {
+		g_ptr_array_add(node->rqn_children,
+		    rpc_query_compile_rule(v));
+		return ((bool)true);
+	});
+
+	return (node);
+}
+
+static struct rpc_query_node *
+rpc_query_compile_logic(rpc_object_t rule)
+{
+	const char *op;
+	rpc_object_t op_val;
+	rpc_object_t lst;
+
+	/* A pair of rules with no operator is a conjunction */
+	op_val = rpc_array_get_value(rule, 0);
+	if (rpc_get_type(op_val) == RPC_TYPE_ARRAY)
+		return (rpc_query_compile_list(RPC_QUERY_OP_AND, rule));
+
+	op = rpc_string_get_string_ptr(op_val);
+	lst = rpc_array_get_value(rule, 1);
+
+	if (!g_strcmp0(op, "or"))
+		return (rpc_query_compile_list(RPC_QUERY_OP_OR, lst));
+
+	if (!g_strcmp0(op, "and"))
+		return (rpc_query_compile_list(RPC_QUERY_OP_AND, lst));
+
+	if (!g_strcmp0(op, "nor"))
+		return (rpc_query_compile_list(RPC_QUERY_OP_NOR, lst));
+
+	return (rpc_query_node_new(RPC_QUERY_OP_FALSE));
+}
+
+static struct rpc_query_node *
+rpc_query_compile_field(rpc_object_t rule)
+{
+	struct rpc_query_node *node;
+	const char *left;
+	const char *op;
+	rpc_object_t right;
+	size_t i;
+
+	left = rpc_array_get_string(rule, 0);
+	op = rpc_array_get_string(rule, 1);
+	right = rpc_array_get_value(rule, 2);
+
+	if (op == NULL)
+		return (rpc_query_node_new(RPC_QUERY_OP_FALSE));
+
+	for (i = 0; rpc_query_field_ops[i].name != NULL; i++) {
+		if (!strcmp(op, rpc_query_field_ops[i].name))
+			break;
+	}
+
+	node = rpc_query_node_new(rpc_query_field_ops[i].op);
+	if (node->rqn_op == RPC_QUERY_OP_FALSE)
+		return (node);
+
+	switch (node->rqn_op) {
+	case RPC_QUERY_OP_REGEX:
+	case RPC_QUERY_OP_MATCH:
+		/* String operators never match a non-string pattern */
+		if (rpc_get_type(right) != RPC_TYPE_STRING) {
+			node->rqn_op = RPC_QUERY_OP_FALSE;
+			return (node);
+		}
+
+		if (node->rqn_op == RPC_QUERY_OP_REGEX) {
+			node->rqn_regex = g_regex_new(
+			    rpc_string_get_string_ptr(right), G_REGEX_OPTIMIZE,
+			    0, NULL);
+			if (node->rqn_regex == NULL) {
+				node->rqn_op = RPC_QUERY_OP_FALSE;
+				return (node);
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	/* A non-string path resolves to nothing, but still compares */
+	if (left != NULL) {
+		rpc_query_path_split(&node->rqn_path, left);
+		node->rqn_left = g_strdup(left);
+		node->rqn_has_path = true;
+	}
+
+	node->rqn_value = rpc_retain(right);
+	node->rqn_pattern = rpc_string_get_string_ptr(right);
+	return (node);
+}
+
+static struct rpc_query_node *
+rpc_query_compile_rule(rpc_object_t rule)
+{
+
+	if (rpc_get_type(rule) != RPC_TYPE_ARRAY)
+		return (rpc_query_node_new(RPC_QUERY_OP_FALSE));
+
+	switch (rpc_array_get_count(rule)) {
+	case 2:
+		return (rpc_query_compile_logic(rule));
+	case 3:
+		return (rpc_query_compile_field(rule));
+	default:
+		return (rpc_query_node_new(RPC_QUERY_OP_FALSE));
+	}
+}
+
+static bool
+op_in(rpc_object_t o1, rpc_object_t o2)
+{
+	if (rpc_get_type(o2) == RPC_TYPE_ARRAY)
+		return (rpc_array_contains(o2, o1));
+
+	if (rpc_get_type(o1) == RPC_TYPE_ARRAY)
+		return (rpc_array_contains(o1, o2));
+
+	return (false);
+}
+
+static bool
+rpc_query_eval_field(struct rpc_query_node *node, rpc_object_t obj)
+{
+	rpc_object_t item;
+
+	item = node->rqn_has_path ?
+	    rpc_query_path_get(obj, &node->rqn_path, NULL) : NULL;
+
+	switch (node->rqn_op) {
+	case RPC_QUERY_OP_EQ:
+		return (rpc_equal(item, node->rqn_value));
+
+	case RPC_QUERY_OP_NE:
+		return (rpc_cmp(item, node->rqn_value) != 0);
+
+	case RPC_QUERY_OP_GT:
+		return (rpc_cmp(item, node->rqn_value) > 0);
+
+	case RPC_QUERY_OP_LT:
+		return (rpc_cmp(item, node->rqn_value) < 0);
+
+	case RPC_QUERY_OP_GE:
+		return (rpc_cmp(item, node->rqn_value) >= 0);
+
+	case RPC_QUERY_OP_LE:
+		return (rpc_cmp(item, node->rqn_value) <= 0);
+
+	case RPC_QUERY_OP_REGEX:
+		if (rpc_get_type(item) != RPC_TYPE_STRING)
+			return (false);
+
+		return ((bool)g_regex_match(node->rqn_regex,
+		    rpc_string_get_string_ptr(item), 0, NULL));
+
+	case RPC_QUERY_OP_IN:
+		return (op_in(item, node->rqn_value));
+
+	case RPC_QUERY_OP_NIN:
+		return (!op_in(item, node->rqn_value));
+
+#ifndef _WIN32
+	case RPC_QUERY_OP_MATCH:
+		if (rpc_get_type(item) != RPC_TYPE_STRING)
+			return (false);
+
+		return (fnmatch(node->rqn_pattern,
+		    rpc_string_get_string_ptr(item), 0) == 0);
+#endif
+
+	default:
+		return (false);
+	}
+}
+
+/*
+ * Note that "and", "or" and "nor" over an empty list never match, while
+ * an empty top-level rule list matches everything.
+ */
+static bool
+rpc_query_eval(struct rpc_query_node *node, rpc_object_t obj)
+{
+	GPtrArray *children = node->rqn_children;
+	guint i;
+
+	switch (node->rqn_op) {
+	case RPC_QUERY_OP_FALSE:
+		return (false);
+
+	case RPC_QUERY_OP_ALL:
+		for (i = 0; i < children->len; i++) {
+			if (!rpc_query_eval(g_ptr_array_index(children, i), obj))
+				return (false);
+		}
+
+		return (true);
+
+	case RPC_QUERY_OP_AND:
+		for (i = 0; i < children->len; i++) {
+			if (!rpc_query_eval(g_ptr_array_index(children, i), obj))
+				return (false);
+		}
+
+		return (children->len > 0);
+
+	case RPC_QUERY_OP_OR:
+		for (i = 0; i < children->len; i++) {
+			if (rpc_query_eval(g_ptr_array_index(children, i), obj))
+				return (true);
+		}
+
+		return (false);
+
+	case RPC_QUERY_OP_NOR:
+		for (i = 0; i < children->len; i++) {
+			if (rpc_query_eval(g_ptr_array_index(children, i), obj))
+				return (false);
+		}
+
+		return (children->len > 0);
+
+	default:
+		return (rpc_query_eval_field(node, obj));
+	}
+}
+
+static rpc_object_t
+rpc_query_steal_apply(rpc_object_t object, rpc_query_plan_t plan)
+{
+
+	if (object == NULL)
+		return (NULL);
+
+	return (rpc_query_eval(plan->rqp_root, object) ? object : NULL);
+}
+
+/*
+ * Parallel filtering splits the elements to look at into chunks, which
+ * the iterating thread and helpers from a shared pool claim one at a
+ * time. Each chunk records its matching positions and those are joined
+ * in chunk order, so the outcome doesn't depend on scheduling.
+ */
+#define	RPC_QUERY_PARALLEL_CHUNK	8192
+
+struct rpc_query_job
+{
+	rpc_query_plan_t	rqj_plan;
+	rpc_object_t *		rqj_elements;
+	const guint *		rqj_positions;
+	size_t			rqj_count;
+	guint			rqj_nchunks;
+	volatile gint		rqj_next;
+	volatile gint		rqj_refcnt;
+	guint			rqj_completed;
+	GMutex			rqj_mtx;
+	GCond			rqj_cv;
+	GArray **		rqj_matches;
+};
+
+static GThreadPool *rpc_query_pool;
+
+static void
+rpc_query_job_unref(struct rpc_query_job *job)
+{
+	guint i;
+
+	if (!g_atomic_int_dec_and_test(&job->rqj_refcnt))
+		return;
+
+	for (i = 0; i < job->rqj_nchunks; i++) {
+		if (job->rqj_matches[i] != NULL)
+			g_array_free(job->rqj_matches[i], true);
+	}
+
+	g_mutex_clear(&job->rqj_mtx);
+	g_cond_clear(&job->rqj_cv);
+	g_free(job->rqj_matches);
+	g_free(job);
+}
+
+static void
+rpc_query_job_work(struct rpc_query_job *job)
+{
+	GArray *matches;
+	guint pos;
+	size_t i;
+	size_t end;
+	gint c;
+
+	for (;;) {
+		c = g_atomic_int_add(&job->rqj_next, 1);
+		if (c >= (gint)job->rqj_nchunks)
+			break;
+
+		matches = job->rqj_matches[c];
+		end = MIN((size_t)(c + 1) * RPC_QUERY_PARALLEL_CHUNK,
+		    job->rqj_count);
+
+		for (i = (size_t)c * RPC_QUERY_PARALLEL_CHUNK; i < end; i++) {
+			if (!rpc_query_eval(job->rqj_plan->rqp_root,
+			    job->rqj_elements[i]))
+				continue;
+
+			pos = job->rqj_positions != NULL ?
+			    job->rqj_positions[i] : (guint)i;
+			g_array_append_val(matches, pos);
+		}
+
+		g_mutex_lock(&job->rqj_mtx);
+		if (++job->rqj_completed == job->rqj_nchunks)
+			g_cond_broadcast(&job->rqj_cv);
+
+		g_mutex_unlock(&job->rqj_mtx);
+	}
+}
+
+static void
+rpc_query_job_helper(gpointer data, gpointer user_data __unused)
+{
+	struct rpc_query_job *job = data;
+
+	rpc_query_job_work(job);
+	rpc_query_job_unref(job);
+}
+
+static gpointer
+rpc_query_pool_create(gpointer data __unused)
+{
+
+	rpc_query_pool = g_thread_pool_new(rpc_query_job_helper, NULL,
+	    (gint)g_get_num_processors(), false, NULL);
+	return (NULL);
+}
+
+/*
+ * Replaces the elements to look at with the ones that match, so the
+ * rest of the query doesn't check the rules again. Element pointers are
+ * fetched up front, as handing them out may modify the source.
+ */
+static void
+rpc_query_filter_parallel(rpc_query_iter_t iter)
+{
+	static GOnce pool_once = G_ONCE_INIT;
+	struct rpc_query_job *job;
+	GArray *result;
+	size_t count;
+	size_t i;
+	guint nhelpers;
+	guint c;
+
+	count = iter->rqi_candidates != NULL ? iter->rqi_candidates->len :
+	    rpc_array_get_count(iter->rqi_source);
+	if (count < RPC_QUERY_PARALLEL_MIN)
+		return;
+
+	g_once(&pool_once, rpc_query_pool_create, NULL);
+
+	job = g_malloc0(sizeof(*job));
+	job->rqj_plan = iter->rqi_plan;
+	job->rqj_count = count;
+	job->rqj_positions = iter->rqi_candidates != NULL ?
+	    (const guint *)iter->rqi_candidates->data : NULL;
+	job->rqj_elements = g_new(rpc_object_t, count);
+	job->rqj_nchunks = (guint)((count + RPC_QUERY_PARALLEL_CHUNK - 1) /
+	    RPC_QUERY_PARALLEL_CHUNK);
+	job->rqj_matches = g_new0(GArray *, job->rqj_nchunks);
+	job->rqj_refcnt = 1;
+	g_mutex_init(&job->rqj_mtx);
+	g_cond_init(&job->rqj_cv);
+
+	for (i = 0; i < count; i++) {
+		job->rqj_elements[i] = rpc_array_get_value(iter->rqi_source,
+		    job->rqj_positions != NULL ? job->rqj_positions[i] : i);
+	}
+
+	for (c = 0; c < job->rqj_nchunks; c++)
+		job->rqj_matches[c] = g_array_new(false, false, sizeof(guint));
+
+	nhelpers = MIN(iter->rqi_params->parallel - 1, job->rqj_nchunks - 1);
+	for (c = 0; c < nhelpers; c++) {
+		g_atomic_int_inc(&job->rqj_refcnt);
+		g_thread_pool_push(rpc_query_pool, job, NULL);
+	}
+
+	rpc_query_job_work(job);
+
+	g_mutex_lock(&job->rqj_mtx);
+	while (job->rqj_completed < job->rqj_nchunks)
+		g_cond_wait(&job->rqj_cv, &job->rqj_mtx);
+
+	g_mutex_unlock(&job->rqj_mtx);
+
+	result = g_array_new(false, false, sizeof(guint));
+	for (c = 0; c < job->rqj_nchunks; c++) {
+		g_array_append_vals(result, job->rqj_matches[c]->data,
+		    job->rqj_matches[c]->len);
+	}
+
+	/* Helpers starting this late find no chunks left to claim */
+	g_free(job->rqj_elements);
+	job->rqj_elements = NULL;
+
+	if (iter->rqi_candidates != NULL)
+		g_array_free(iter->rqi_candidates, true);
+
+	iter->rqi_candidates = result;
+	iter->rqi_prefiltered = true;
+	rpc_query_job_unref(job);
+}
+
+/*
+ * Packed arrays hold plain numbers, so rules comparing elements as a
+ * whole (an empty path) can be checked straight against the buffer,
+ * with one selection byte per element. The loops below are kept free
+ * of branches and calls so that the compiler can vectorize them.
+ *
+ * Ordering operators compare objects by their hashes, which for numbers
+ * is the value cast to size_t and truncated to an int - the scans do the
+ * same, so they match the regular evaluation exactly.
+ */
+#define	RPC_QUERY_PACKED_SCAN(_type, _op)				\
+	do {								\
+		const _type *_p = data;					\
+		for (i = 0; i < count; i++)				\
+			mask[i] &= (int)(size_t)_p[i] _op key;		\
+	} while (0)
+
+#define	RPC_QUERY_PACKED_OPS(_type)					\
+	do {								\
+		switch (op) {						\
+		case RPC_QUERY_OP_NE:					\
+			RPC_QUERY_PACKED_SCAN(_type, !=);		\
+			break;						\
+		case RPC_QUERY_OP_GT:					\
+			RPC_QUERY_PACKED_SCAN(_type, >);		\
+			break;						\
+		case RPC_QUERY_OP_LT:					\
+			RPC_QUERY_PACKED_SCAN(_type, <);		\
+			break;						\
+		case RPC_QUERY_OP_GE:					\
+			RPC_QUERY_PACKED_SCAN(_type, >=);		\
+			break;						\
+		case RPC_QUERY_OP_LE:					\
+			RPC_QUERY_PACKED_SCAN(_type, <=);		\
+			break;						\
+		default:						\
+			break;						\
+		}							\
+	} while (0)
+
+static void
+rpc_query_packed_scan(rpc_type_t type, const void *data, size_t count,
+    rpc_query_op_t op, int key, guint8 *restrict mask)
+{
+	size_t i;
+
+	switch (type) {
+	case RPC_TYPE_INT64:
+		RPC_QUERY_PACKED_OPS(int64_t);
+		break;
+
+	case RPC_TYPE_UINT64:
+		RPC_QUERY_PACKED_OPS(uint64_t);
+		break;
+
+	case RPC_TYPE_DOUBLE:
+		RPC_QUERY_PACKED_OPS(double);
+		break;
+
+	case RPC_TYPE_BOOL:
+		RPC_QUERY_PACKED_OPS(bool);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Equality is exact and needs the types to match, like rpc_equal().
+ */
+static void
+rpc_query_packed_scan_eq(rpc_type_t type, const void *data, size_t count,
+    rpc_object_t value, guint8 *restrict mask)
+{
+	const int64_t *pi = data;
+	const uint64_t *pu = data;
+	const double *pd = data;
+	const bool *pb = data;
+	size_t i;
+
+	if (rpc_get_type(value) != type) {
+		memset(mask, 0, count);
+		return;
+	}
+
+	switch (type) {
+	case RPC_TYPE_INT64:
+		for (i = 0; i < count; i++)
+			mask[i] &= pi[i] == value->ro_value.rv_i;
+		break;
+
+	case RPC_TYPE_UINT64:
+		for (i = 0; i < count; i++)
+			mask[i] &= pu[i] == value->ro_value.rv_ui;
+		break;
+
+	case RPC_TYPE_DOUBLE:
+		for (i = 0; i < count; i++)
+			mask[i] &= pd[i] == value->ro_value.rv_d;
+		break;
+
+	case RPC_TYPE_BOOL:
+		for (i = 0; i < count; i++)
+			mask[i] &= pb[i] == value->ro_value.rv_b;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static bool
+rpc_query_packed_eligible(rpc_query_plan_t plan)
+{
+	struct rpc_query_node *root = plan->rqp_root;
+	struct rpc_query_node *node;
+	guint i;
+
+	if (root->rqn_op != RPC_QUERY_OP_ALL || root->rqn_children->len == 0)
+		return (false);
+
+	for (i = 0; i < root->rqn_children->len; i++) {
+		node = g_ptr_array_index(root->rqn_children, i);
+		if (node->rqn_op < RPC_QUERY_OP_EQ ||
+		    node->rqn_op > RPC_QUERY_OP_LE)
+			return (false);
+
+		if (!node->rqn_has_path || node->rqn_path.rqp_count != 0 ||
+		    node->rqn_value == NULL)
+			return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Filters a packed source without boxing it. Only the matches get boxed,
+ * into a new array that replaces the source for the rest of the query.
+ */
+static void
+rpc_query_filter_packed(rpc_query_iter_t iter)
+{
+	struct rpc_query_node *root = iter->rqi_plan->rqp_root;
+	struct rpc_query_node *node;
+	rpc_object_t *matches;
+	rpc_object_t item;
+	rpc_type_t type;
+	const void *data;
+	guint8 *mask;
+	size_t count;
+	size_t nmatches = 0;
+	size_t i;
+
+	if (rpc_array_get_count(iter->rqi_source) == 0 ||
+	    !rpc_query_packed_eligible(iter->rqi_plan))
+		return;
+
+	data = rpc_array_get_packed(iter->rqi_source, &type, &count);
+	if (data == NULL)
+		return;
+
+	mask = g_malloc(count);
+	memset(mask, 1, count);
+
+	for (i = 0; i < root->rqn_children->len; i++) {
+		node = g_ptr_array_index(root->rqn_children, i);
+		if (node->rqn_op == RPC_QUERY_OP_EQ)
+			rpc_query_packed_scan_eq(type, data, count,
+			    node->rqn_value, mask);
+		else
+			rpc_query_packed_scan(type, data, count, node->rqn_op,
+			    (int)rpc_hash(node->rqn_value), mask);
+	}
+
+	for (i = 0; i < count; i++)
+		nmatches += mask[i];
+
+	matches = g_new(rpc_object_t, nmatches);
+	nmatches = 0;
+	for (i = 0; i < count; i++) {
+		if (!mask[i])
+			continue;
+
+		switch (type) {
+		case RPC_TYPE_INT64:
+			item = rpc_int64_create(((const int64_t *)data)[i]);
+			break;
+
+		case RPC_TYPE_UINT64:
+			item = rpc_uint64_create(((const uint64_t *)data)[i]);
+			break;
+
+		case RPC_TYPE_DOUBLE:
+			item = rpc_double_create(((const double *)data)[i]);
+			break;
+
+		default:
+			item = rpc_bool_create(((const bool *)data)[i]);
+			break;
+		}
+
+		matches[nmatches++] = item;
+	}
+
+	rpc_release(iter->rqi_source);
+	iter->rqi_source = rpc_array_create_ex(matches, nmatches, true);
+	iter->rqi_prefiltered = true;
+	g_free(matches);
+	g_free(mask);
+}
+
+struct rpc_query_sort_entry
+{
+	rpc_object_t		rse_obj;
+	size_t			rse_pos;
+};
+
+/*
+ * Orders matches by the sort comparator, then by their position in the
+ * source, which makes it a total order that gives the same result as a
+ * stable sort. Reversing negates the whole thing, so it matches sorting
+ * followed by reversal without making a reversed copy.
+ */
+static int
+rpc_query_sort_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	const struct rpc_query_sort_entry *e1 = a;
+	const struct rpc_query_sort_entry *e2 = b;
+	rpc_query_params_t params = data;
+	int ret = 0;
+
+	if (params->sort != NULL)
+		ret = params->sort(e1->rse_obj, e2->rse_obj);
+
+	if (ret == 0)
+		ret = (e1->rse_pos > e2->rse_pos) - (e1->rse_pos < e2->rse_pos);
+
+	return (params->reverse ? -ret : ret);
+}
+
+static void
+rpc_query_heap_sift_down(struct rpc_query_sort_entry *heap, size_t len,
+    rpc_query_params_t params)
+{
+	struct rpc_query_sort_entry tmp;
+	size_t i = 0;
+	size_t child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= len)
+			break;
+
+		if (child + 1 < len &&
+		    rpc_query_sort_cmp(&heap[child + 1], &heap[child], params) > 0)
+			child++;
+
+		if (rpc_query_sort_cmp(&heap[child], &heap[i], params) <= 0)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void
+rpc_query_heap_sift_up(struct rpc_query_sort_entry *heap, size_t i,
+    rpc_query_params_t params)
+{
+	struct rpc_query_sort_entry tmp;
+	size_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (rpc_query_sort_cmp(&heap[i], &heap[parent], params) <= 0)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/*
+ * Filters the source and orders the matches, for queries that sort or
+ * reverse. With a limit set, only offset + limit matches can ever be
+ * returned, so they're picked with a bounded max-heap instead of
+ * sorting all of them. The source array is left untouched.
+ */
+static void
+rpc_query_materialize(rpc_query_iter_t iter)
+{
+	rpc_query_params_t params = iter->rqi_params;
+	struct rpc_query_sort_entry entry;
+	struct rpc_query_sort_entry *heap;
+	GArray *entries;
+	size_t count;
+	size_t pos;
+	size_t i;
+	uint64_t k = 0;
+
+	if (params->limit > 0) {
+		k = params->offset + params->limit;
+		if (k < params->limit)
+			k = 0;
+	}
+
+	count = iter->rqi_candidates != NULL ? iter->rqi_candidates->len :
+	    rpc_array_get_count(iter->rqi_source);
+	entries = g_array_sized_new(false, false, sizeof(entry),
+	    (guint)(k > 0 ? MIN(k, count) : count));
+
+	for (i = 0; i < count; i++) {
+		pos = iter->rqi_candidates != NULL ?
+		    g_array_index(iter->rqi_candidates, guint, i) : i;
+		entry.rse_obj = rpc_array_get_value(iter->rqi_source, pos);
+		entry.rse_pos = pos;
+
+		if (!iter->rqi_prefiltered && rpc_query_steal_apply(
+		    entry.rse_obj, iter->rqi_plan) == NULL)
+			continue;
+
+		if (k == 0 || entries->len < k) {
+			g_array_append_val(entries, entry);
+			if (k > 0) {
+				rpc_query_heap_sift_up(
+				    (struct rpc_query_sort_entry *)entries->data,
+				    entries->len - 1, params);
+			}
+
+			continue;
+		}
+
+		heap = (struct rpc_query_sort_entry *)entries->data;
+		if (rpc_query_sort_cmp(&entry, &heap[0], params) < 0) {
+			heap[0] = entry;
+			rpc_query_heap_sift_down(heap, entries->len, params);
+		}
+	}
+
+	g_array_sort_with_data(entries, rpc_query_sort_cmp, params);
+
+	iter->rqi_sorted = g_ptr_array_new_full(entries->len,
+	    (GDestroyNotify)rpc_release_impl);
+	for (i = 0; i < entries->len; i++) {
+		g_ptr_array_add(iter->rqi_sorted, rpc_retain(g_array_index(
+		    entries, struct rpc_query_sort_entry, i).rse_obj));
+	}
+
+	g_array_free(entries, true);
+}
+
+static rpc_object_t
+rpc_query_find_next(rpc_query_iter_t iter)
+{
+	rpc_object_t current = NULL;
+	rpc_object_t result = NULL;
+
+	/* Already filtered and ordered */
+	if (iter->rqi_sorted != NULL) {
+		if (iter->rqi_idx < iter->rqi_sorted->len)
+			result = g_ptr_array_index(iter->rqi_sorted,
+			    iter->rqi_idx);
+
+		iter->rqi_idx++;
+	} else {
+		do {
+			if (iter->rqi_candidates == NULL) {
+				current = rpc_array_get_value(iter->rqi_source,
+				    iter->rqi_idx);
+			} else if (iter->rqi_idx < iter->rqi_candidates->len) {
+				current = rpc_array_get_value(iter->rqi_source,
+				    g_array_index(iter->rqi_candidates, guint,
+				    iter->rqi_idx));
+			} else
+				current = NULL;
+
+			iter->rqi_idx++;
+			result = iter->rqi_prefiltered ? current :
+			    rpc_query_steal_apply(current, iter->rqi_plan);
+
+		} while ((current != NULL) && (result == NULL));
+	}
+
+	if (iter->rqi_params->limit > 0) {
+		if ((result != NULL) && (iter->rqi_initialized)) {
+			if (iter->rqi_limit < iter->rqi_params->limit)
+				iter->rqi_limit++;
+			else
+				result = NULL;
+		}
+	}
+
+	return (result);
+}
+
+static guint
+rpc_query_index_hash(gconstpointer key)
+{
+
+	return ((guint)rpc_hash((rpc_object_t)key));
+}
+
+static gboolean
+rpc_query_index_equal(gconstpointer a, gconstpointer b)
+{
+
+	return (rpc_equal((rpc_object_t)a, (rpc_object_t)b));
+}
+
+static void
+rpc_query_index_garray_free(gpointer data)
+{
+
+	g_array_free(data, true);
+}
+
+static gint
+rpc_query_index_entry_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_query_index_entry *e1 = a;
+	const struct rpc_query_index_entry *e2 = b;
+
+	if (e1->rqe_key != e2->rqe_key)
+		return (e1->rqe_key < e2->rqe_key ? -1 : 1);
+
+	return (e1->rqe_pos < e2->rqe_pos ? -1 : e1->rqe_pos > e2->rqe_pos);
+}
+
+static void
+rpc_query_index_clear(rpc_query_index_t index)
+{
+
+	if (index->rqx_hash != NULL) {
+		g_hash_table_destroy(index->rqx_hash);
+		index->rqx_hash = NULL;
+	}
+
+	if (index->rqx_sorted != NULL) {
+		g_array_free(index->rqx_sorted, true);
+		index->rqx_sorted = NULL;
+	}
+
+	index->rqx_valid = false;
+}
+
+/*
+ * Elements that don't have the field at all are left out; none of the
+ * indexed operators can match them.
+ */
+static void
+rpc_query_index_build(rpc_query_index_t index)
+{
+	rpc_object_t array = index->rqx_array;
+	rpc_object_t item;
+	struct rpc_query_index_entry entry;
+	GArray *positions;
+	guint count;
+	guint i;
+
+	rpc_query_index_clear(index);
+	count = (guint)rpc_array_get_count(array);
+
+	if (index->rqx_kind == RPC_QUERY_INDEX_HASH) {
+		index->rqx_hash = g_hash_table_new_full(rpc_query_index_hash,
+		    rpc_query_index_equal, (GDestroyNotify)rpc_release_impl,
+		    rpc_query_index_garray_free);
+	} else
+		index->rqx_sorted = g_array_sized_new(false, false,
+		    sizeof(struct rpc_query_index_entry), count);
+
+	for (i = 0; i < count; i++) {
+		item = rpc_query_path_get(rpc_array_get_value(array, i),
+		    &index->rqx_path, NULL);
+		if (item == NULL)
+			continue;
+
+		if (index->rqx_kind == RPC_QUERY_INDEX_ORDERED) {
+			entry.rqe_key = (int)rpc_hash(item);
+			entry.rqe_pos = i;
+			g_array_append_val(index->rqx_sorted, entry);
+			continue;
+		}
+
+		positions = g_hash_table_lookup(index->rqx_hash, item);
+		if (positions == NULL) {
+			positions = g_array_new(false, false, sizeof(guint));
+			g_hash_table_insert(index->rqx_hash, rpc_retain(item),
+			    positions);
+		}
+
+		g_array_append_val(positions, i);
+	}
+
+	if (index->rqx_sorted != NULL)
+		g_array_sort(index->rqx_sorted, rpc_query_index_entry_cmp);
+
+	index->rqx_generation = array->ro_generation;
+	index->rqx_valid = true;
+}
+
+static void
+rpc_query_index_add_key(rpc_query_index_t index, rpc_object_t key,
+    GArray *out)
+{
+	GArray *positions;
+
+	positions = g_hash_table_lookup(index->rqx_hash, key);
+	if (positions != NULL)
+		g_array_append_vals(out, positions->data, positions->len);
+}
+
+/*
+ * First entry in the sorted index with a key not below (or, with
+ * "after" set, above) the given one.
+ */
+static guint
+rpc_query_index_bound(rpc_query_index_t index, int key, bool after)
+{
+	struct rpc_query_index_entry *entries;
+	guint lo = 0;
+	guint hi = index->rqx_sorted->len;
+	guint mid;
+
+	entries = (struct rpc_query_index_entry *)index->rqx_sorted->data;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (entries[mid].rqe_key < key ||
+		    (after && entries[mid].rqe_key == key))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static gint
+rpc_query_pos_cmp(gconstpointer a, gconstpointer b)
+{
+	guint p1 = *(const guint *)a;
+	guint p2 = *(const guint *)b;
+
+	return (p1 < p2 ? -1 : p1 > p2);
+}
+
+/*
+ * Returns positions of elements that may match the rule, in array
+ * order, or NULL if the index can't serve it.
+ */
+static GArray *
+rpc_query_index_lookup(rpc_query_index_t index, struct rpc_query_node *node)
+{
+	struct rpc_query_index_entry *entries;
+	rpc_object_t value = node->rqn_value;
+	GArray *out;
+	guint from;
+	guint to;
+	guint i;
+	int key;
+
+	if (index->rqx_kind == RPC_QUERY_INDEX_HASH) {
+		switch (node->rqn_op) {
+		case RPC_QUERY_OP_EQ:
+		case RPC_QUERY_OP_IN:
+			break;
+
+		default:
+			return (NULL);
+		}
+
+		/* "in" with a scalar operand tests the field as an array */
+		if (node->rqn_op == RPC_QUERY_OP_IN &&
+		    rpc_get_type(value) != RPC_TYPE_ARRAY)
+			return (NULL);
+	} else {
+		switch (node->rqn_op) {
+		case RPC_QUERY_OP_EQ:
+		case RPC_QUERY_OP_GT:
+		case RPC_QUERY_OP_LT:
+		case RPC_QUERY_OP_GE:
+		case RPC_QUERY_OP_LE:
+			break;
+
+		default:
+			return (NULL);
+		}
+	}
+
+	g_mutex_lock(&index->rqx_mtx);
+	if (!index->rqx_valid ||
+	    index->rqx_generation != index->rqx_array->ro_generation)
+		rpc_query_index_build(index);
+
+	out = g_array_new(false, false, sizeof(guint));
+
+	if (index->rqx_kind == RPC_QUERY_INDEX_HASH) {
+		if (node->rqn_op == RPC_QUERY_OP_EQ)
+			rpc_query_index_add_key(index, value, out);
+		else {
+			rpc_array_walk(value, ^(size_t idx __unused,
+			    rpc_object_t v) {
+				rpc_query_index_add_key(index, v, out);
+				return ((bool)true);
+			});
+		}
+	} else {
+		key = (int)rpc_hash(value);
+		from = 0;
+		to = index->rqx_sorted->len;
+
+		switch (node->rqn_op) {
+		case RPC_QUERY_OP_EQ:
+			from = rpc_query_index_bound(index, key, false);
+			to = rpc_query_index_bound(index, key, true);
+			break;
+
+		case RPC_QUERY_OP_GT:
+			from = rpc_query_index_bound(index, key, true);
+			break;
+
+		case RPC_QUERY_OP_GE:
+			from = rpc_query_index_bound(index, key, false);
+			break;
+
+		case RPC_QUERY_OP_LT:
+			to = rpc_query_index_bound(index, key, false);
+			break;
 
-static rpc_object_t
-rpc_query_get_parent(rpc_object_t object, const char *path,
-    const char **child, rpc_object_t default_val)
-{
-	char *get_path;
-	size_t get_path_len;
-	rpc_object_t parent;
-	char *last_segment;
+		case RPC_QUERY_OP_LE:
+			to = rpc_query_index_bound(index, key, true);
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
 
-	last_segment = g_strrstr(path, ".");
-	if (last_segment == NULL) {
-		*child = path;
-		return (object);
+		entries = (struct rpc_query_index_entry *)
+		    index->rqx_sorted->data;
+		for (i = from; i < to; i++)
+			g_array_append_val(out, entries[i].rqe_pos);
 	}
 
-	last_segment += 1;
-	get_path_len = strlen(path) - strlen(last_segment) - 1;
-	get_path = g_strndup(path, get_path_len);
-	parent = rpc_query_get(object, (const char *)get_path,
-	    default_val);
+	g_mutex_unlock(&index->rqx_mtx);
+
+	/* Keep the original element order, without duplicates */
+	g_array_sort(out, rpc_query_pos_cmp);
+	for (i = 1, to = out->len > 0 ? 1 : 0; i < out->len; i++) {
+		if (g_array_index(out, guint, i) !=
+		    g_array_index(out, guint, to - 1))
+			g_array_index(out, guint, to++) =
+			    g_array_index(out, guint, i);
+	}
 
-	g_free(get_path);
-	*child = (const char *)last_segment;
-	return (parent);
+	g_array_set_size(out, to);
+	return (out);
 }
 
-static bool
-eval_logic_and(rpc_object_t obj, rpc_object_t lst)
+/*
+ * Narrows a query down to the smallest candidate set any index on the
+ * source array gives for one of the top-level rules. Every candidate is
+ * still checked against the whole plan.
+ */
+static GArray *
+rpc_query_index_candidates(rpc_object_t array, rpc_query_plan_t plan)
 {
-	__block bool result = false;
+	struct rpc_query_node *root = plan->rqp_root;
+	struct rpc_query_node *node;
+	rpc_query_index_t index;
+	GPtrArray *indexes;
+	GArray *best = NULL;
+	GArray *cur;
+	guint i;
+	guint j;
+
+	if (g_atomic_int_get(&rpc_query_nindexes) == 0)
+		return (NULL);
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY)
-		return (false);
+	if (root->rqn_op != RPC_QUERY_OP_ALL)
+		return (NULL);
 
-	rpc_array_apply(lst, ^(size_t idx __unused, rpc_object_t v) {
-		result = eval_rule(obj, v);
-		return ((bool)result);
-	});
+	g_mutex_lock(&rpc_query_indexes_mtx);
+	indexes = g_hash_table_lookup(rpc_query_indexes, array);
+	if (indexes == NULL) {
+		g_mutex_unlock(&rpc_query_indexes_mtx);
+		return (NULL);
+	}
 
-	return (result);
-}
+	for (i = 0; i < root->rqn_children->len; i++) {
+		node = g_ptr_array_index(root->rqn_children, i);
+		if (node->rqn_left == NULL)
+			continue;
 
-static bool
-eval_logic_or(rpc_object_t obj, rpc_object_t lst)
-{
-	__block bool result = false;
+		for (j = 0; j < indexes->len; j++) {
+			index = g_ptr_array_index(indexes, j);
+			if (g_strcmp0(index->rqx_path_str, node->rqn_left) != 0)
+				continue;
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY)
-		return (false);
+			cur = rpc_query_index_lookup(index, node);
+			if (cur == NULL)
+				continue;
 
-	rpc_array_apply(lst, ^(size_t idx __unused, rpc_object_t v) {
-	    result = eval_rule(obj, v);
-	    return ((bool)!result);
-	});
+			if (best == NULL || cur->len < best->len) {
+				if (best != NULL)
+					g_array_free(best, true);
 
-	return (result);
+				best = cur;
+			} else
+				g_array_free(cur, true);
+		}
+	}
+
+	g_mutex_unlock(&rpc_query_indexes_mtx);
+	return (best);
 }
 
-static bool
-eval_logic_nor(rpc_object_t obj, rpc_object_t lst)
+rpc_query_index_t
+rpc_query_index_create(rpc_object_t array, const char *path,
+    rpc_query_index_kind_t kind)
 {
-	__block bool result = false;
+	rpc_query_index_t index;
+	GPtrArray *indexes;
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY)
-		return (false);
+	if (rpc_get_type(array) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Only arrays can be indexed", NULL);
+		return (NULL);
+	}
 
-	rpc_array_apply(lst, ^(size_t idx __unused, rpc_object_t v) {
-	    result = !eval_rule(obj, v);
-	    return ((bool)result);
-	});
+	index = g_malloc0(sizeof(*index));
+	index->rqx_array = rpc_retain(array);
+	index->rqx_path_str = g_strdup(path);
+	index->rqx_kind = kind;
+	rpc_query_path_split(&index->rqx_path, path);
+	g_mutex_init(&index->rqx_mtx);
+
+	g_mutex_lock(&rpc_query_indexes_mtx);
+	if (rpc_query_indexes == NULL)
+		rpc_query_indexes = g_hash_table_new_full(NULL, NULL, NULL,
+		    (GDestroyNotify)g_ptr_array_unref);
+
+	indexes = g_hash_table_lookup(rpc_query_indexes, array);
+	if (indexes == NULL) {
+		indexes = g_ptr_array_new();
+		g_hash_table_insert(rpc_query_indexes, array, indexes);
+	}
 
-	return (result);
+	g_ptr_array_add(indexes, index);
+	g_atomic_int_inc(&rpc_query_nindexes);
+	g_mutex_unlock(&rpc_query_indexes_mtx);
+	return (index);
 }
 
-static bool
-eval_logic_operator(rpc_object_t obj, rpc_object_t rule)
+void
+rpc_query_index_free(rpc_query_index_t index)
 {
-	const char *op;
-	rpc_object_t lst;
-	rpc_object_t op_val;
-
-	if (rpc_get_type(rule) != RPC_TYPE_ARRAY)
-		return (false);
-
-	op_val = rpc_array_get_value(rule, 0);
-	if (rpc_get_type(op_val) == RPC_TYPE_ARRAY)
-		return (eval_logic_and(obj, rule));
+	GPtrArray *indexes;
+
+	g_mutex_lock(&rpc_query_indexes_mtx);
+	indexes = g_hash_table_lookup(rpc_query_indexes, index->rqx_array);
+	g_ptr_array_remove(indexes, index);
+	if (indexes->len == 0)
+		g_hash_table_remove(rpc_query_indexes, index->rqx_array);
+
+	g_atomic_int_add(&rpc_query_nindexes, -1);
+	g_mutex_unlock(&rpc_query_indexes_mtx);
+
+	rpc_query_index_clear(index);
+	rpc_query_path_free(&index->rqx_path);
+	g_mutex_clear(&index->rqx_mtx);
+	rpc_release(index->rqx_array);
+	g_free(index->rqx_path_str);
+	g_free(index);
+}
 
-	op = rpc_string_get_string_ptr(op_val);
-	lst = rpc_array_get_value(rule, 1);
+static void
+rpc_query_view_emit(rpc_query_view_t view, const char *op, guint pos,
+    rpc_object_t value)
+{
+	rpc_object_t delta;
 
-	if (!g_strcmp0(op, "or"))
-		return (eval_logic_or(obj, lst));
+	if (view->rqv_instance == NULL)
+		return;
 
-	if (!g_strcmp0(op, "and"))
-		return (eval_logic_and(obj, lst));
+	delta = rpc_dictionary_create();
+	rpc_dictionary_set_string(delta, "op", op);
+	if (strcmp(op, "reset") != 0)
+		rpc_dictionary_set_uint64(delta, "index", pos);
 
-	if (!g_strcmp0(op, "nor"))
-		return (eval_logic_nor(obj, lst));
+	if (value != NULL)
+		rpc_dictionary_set_value(delta, "value", value);
 
-	return (false);
+	rpc_instance_emit_event(view->rqv_instance, view->rqv_interface,
+	    view->rqv_name, delta);
 }
 
-static bool
-op_in(rpc_object_t o1, rpc_object_t o2)
+static guint
+rpc_query_view_position(rpc_query_view_t view, size_t index)
 {
-	if (rpc_get_type(o2) == RPC_TYPE_ARRAY)
-		return (rpc_array_contains(o2, o1));
+	guint pos = 0;
+	size_t i;
 
-	if (rpc_get_type(o1) == RPC_TYPE_ARRAY)
-		return (rpc_array_contains(o1, o2));
+	for (i = 0; i < index; i++)
+		pos += view->rqv_matched->data[i];
 
-	return (false);
+	return (pos);
 }
 
-static bool
-eval_field_operator(rpc_object_t obj, rpc_object_t rule)
+static void
+rpc_query_view_rebuild(rpc_query_view_t view)
 {
-	const char *left;
-	const char *op;
-	rpc_object_t right;
 	rpc_object_t item;
+	rpc_object_t snapshot;
+	size_t count;
+	size_t i;
+	guint8 match;
+
+	g_byte_array_set_size(view->rqv_matched, 0);
+	g_ptr_array_set_size(view->rqv_result, 0);
+
+	count = rpc_array_get_count(view->rqv_array);
+	for (i = 0; i < count; i++) {
+		item = rpc_array_get_value(view->rqv_array, i);
+		match = rpc_query_eval(view->rqv_plan->rqp_root, item);
+		g_byte_array_append(view->rqv_matched, &match, 1);
+		if (match)
+			g_ptr_array_add(view->rqv_result, rpc_retain(item));
+	}
 
-	if (rpc_get_type(rule) != RPC_TYPE_ARRAY)
-		return (false);
+	if (view->rqv_instance == NULL)
+		return;
 
-	left = rpc_array_get_string(rule, 0);
-	op = rpc_array_get_string(rule, 1);
-	right = rpc_array_get_value(rule, 2);
+	snapshot = rpc_array_create_ex(
+	    (const rpc_object_t *)view->rqv_result->pdata,
+	    view->rqv_result->len, false);
+	rpc_query_view_emit(view, "reset", 0, snapshot);
+	rpc_release(snapshot);
+}
 
-	item = rpc_query_get(obj, left, NULL);
+static void
+rpc_query_view_update(rpc_query_view_t view, rpc_array_change_t change,
+    size_t index)
+{
+	rpc_object_t item;
+	guint8 match;
+	guint pos;
 
-	if (!g_strcmp0(op, "="))
-		return (rpc_equal(item, right));
+	if (change == RPC_ARRAY_CHANGE_RESET ||
+	    index > view->rqv_matched->len) {
+		rpc_query_view_rebuild(view);
+		return;
+	}
 
-	if (!g_strcmp0(op, "!="))
-		return (rpc_cmp(item, right) != 0);
+	pos = rpc_query_view_position(view, index);
 
-	if (!g_strcmp0(op, ">"))
-		return (rpc_cmp(item, right) > 0);
+	if (change == RPC_ARRAY_CHANGE_REMOVE) {
+		if (index == view->rqv_matched->len) {
+			rpc_query_view_rebuild(view);
+			return;
+		}
 
-	if (!g_strcmp0(op, "<"))
-		return (rpc_cmp(item, right) < 0);
+		if (view->rqv_matched->data[index]) {
+			g_ptr_array_remove_index(view->rqv_result, pos);
+			rpc_query_view_emit(view, "remove", pos, NULL);
+		}
 
-	if (!g_strcmp0(op, ">="))
-		return (rpc_cmp(item, right) >= 0);
+		g_byte_array_remove_index(view->rqv_matched, (guint)index);
+		return;
+	}
 
-	if (!g_strcmp0(op, "<="))
-		return (rpc_cmp(item, right) <= 0);
+	item = rpc_array_get_value(view->rqv_array, index);
+	match = item != NULL && rpc_query_eval(view->rqv_plan->rqp_root, item);
 
-	if (!g_strcmp0(op, "~")) {
-		if (rpc_get_type(right) != RPC_TYPE_STRING)
-			return (false);
+	if (change == RPC_ARRAY_CHANGE_APPEND) {
+		if (index != view->rqv_matched->len) {
+			rpc_query_view_rebuild(view);
+			return;
+		}
 
-		if (rpc_get_type(item) != RPC_TYPE_STRING)
-			return (false);
+		g_byte_array_append(view->rqv_matched, &match, 1);
+		if (match) {
+			g_ptr_array_add(view->rqv_result, rpc_retain(item));
+			rpc_query_view_emit(view, "add", pos, item);
+		}
 
-		return ((bool)g_regex_match_simple(
-		    rpc_string_get_string_ptr(right),
-		    rpc_string_get_string_ptr(item), 0, 0));
+		return;
+	}
 
+	if (index == view->rqv_matched->len) {
+		rpc_query_view_rebuild(view);
+		return;
 	}
 
-	if ((!g_strcmp0(op, "in")) || (!g_strcmp0(op, "contains")))
-		return (op_in(item, right));
+	if (view->rqv_matched->data[index] && match) {
+		rpc_release_impl(g_ptr_array_index(view->rqv_result, pos));
+		g_ptr_array_index(view->rqv_result, pos) = rpc_retain(item);
+		rpc_query_view_emit(view, "update", pos, item);
+	} else if (view->rqv_matched->data[index]) {
+		g_ptr_array_remove_index(view->rqv_result, pos);
+		rpc_query_view_emit(view, "remove", pos, NULL);
+	} else if (match) {
+		g_ptr_array_insert(view->rqv_result, pos, rpc_retain(item));
+		rpc_query_view_emit(view, "add", pos, item);
+	}
 
-	if ((!g_strcmp0(op, "nin")) || (!g_strcmp0(op, "ncontains")))
-		return (!op_in(item, right));
+	view->rqv_matched->data[index] = match;
+}
 
-#ifndef _WIN32
-	if (!g_strcmp0(op, "match")) {
-		if (rpc_get_type(right) != RPC_TYPE_STRING)
-			return (false);
+void
+rpc_query_view_notify(rpc_object_t array, rpc_array_change_t change,
+    size_t index)
+{
+	rpc_query_view_t view;
+	GPtrArray *views;
+	guint i;
 
-		if (rpc_get_type(item) != RPC_TYPE_STRING)
-			return (false);
+	if (g_atomic_int_get(&rpc_query_nviews) == 0)
+		return;
 
-		return (fnmatch(rpc_string_get_string_ptr(right),
-		    rpc_string_get_string_ptr(item), 0) == 0);
+	g_mutex_lock(&rpc_query_views_mtx);
+	views = g_hash_table_lookup(rpc_query_views, array);
+	for (i = 0; views != NULL && i < views->len; i++) {
+		view = g_ptr_array_index(views, i);
+		g_mutex_lock(&view->rqv_mtx);
+		rpc_query_view_update(view, change, index);
+		g_mutex_unlock(&view->rqv_mtx);
 	}
-#endif
 
-	return (false);
+	g_mutex_unlock(&rpc_query_views_mtx);
 }
 
-static bool
-eval_rule(rpc_object_t obj, rpc_object_t rule)
+rpc_query_view_t
+rpc_query_view_create(rpc_object_t array, rpc_query_plan_t plan)
 {
-	if (rpc_get_type(rule) != RPC_TYPE_ARRAY)
-		return (false);
+	rpc_query_view_t view;
+	GPtrArray *views;
 
-	switch (rule->ro_value.rv_list->len) {
-	case 2:
-		return (eval_logic_operator(obj, rule));
-	case 3:
-		return (eval_field_operator(obj, rule));
-	default:
-		return (false);
+	if (rpc_get_type(array) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Views can only be made of arrays",
+		    NULL);
+		return (NULL);
 	}
+
+	view = g_malloc0(sizeof(*view));
+	view->rqv_array = rpc_retain(array);
+	view->rqv_plan = plan;
+	view->rqv_matched = g_byte_array_new();
+	view->rqv_result = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_release_impl);
+	g_mutex_init(&view->rqv_mtx);
+	rpc_query_view_rebuild(view);
+
+	g_mutex_lock(&rpc_query_views_mtx);
+	if (rpc_query_views == NULL)
+		rpc_query_views = g_hash_table_new_full(NULL, NULL, NULL,
+		    (GDestroyNotify)g_ptr_array_unref);
+
+	views = g_hash_table_lookup(rpc_query_views, array);
+	if (views == NULL) {
+		views = g_ptr_array_new();
+		g_hash_table_insert(rpc_query_views, array, views);
+	}
+
+	g_ptr_array_add(views, view);
+	g_atomic_int_inc(&rpc_query_nviews);
+	g_mutex_unlock(&rpc_query_views_mtx);
+	return (view);
 }
 
-static rpc_object_t
-rpc_query_steal_apply(rpc_object_t object, rpc_object_t rules)
+void
+rpc_query_view_set_event(rpc_query_view_t view, struct rpc_instance *instance,
+    const char *interface, const char *name)
 {
-	__block bool fail = false;
 
-	if (object == NULL)
-		return (NULL);
+	g_mutex_lock(&view->rqv_mtx);
+	g_free(view->rqv_interface);
+	g_free(view->rqv_name);
+	view->rqv_instance = instance;
+	view->rqv_interface = g_strdup(interface);
+	view->rqv_name = g_strdup(name);
+	g_mutex_unlock(&view->rqv_mtx);
+}
 
-	if (rules == NULL)
-		return (NULL);
+rpc_object_t
+rpc_query_view_get(rpc_query_view_t view)
+{
+	rpc_object_t result;
 
-	if (rpc_get_type(rules) != RPC_TYPE_ARRAY)
+	g_mutex_lock(&view->rqv_mtx);
+	result = rpc_array_create_ex(
+	    (const rpc_object_t *)view->rqv_result->pdata,
+	    view->rqv_result->len, false);
+	g_mutex_unlock(&view->rqv_mtx);
+	return (result);
+}
+
+void
+rpc_query_view_refresh(rpc_query_view_t view)
+{
+
+	g_mutex_lock(&view->rqv_mtx);
+	rpc_query_view_rebuild(view);
+	g_mutex_unlock(&view->rqv_mtx);
+}
+
+void
+rpc_query_view_free(rpc_query_view_t view)
+{
+	GPtrArray *views;
+
+	g_mutex_lock(&rpc_query_views_mtx);
+	views = g_hash_table_lookup(rpc_query_views, view->rqv_array);
+	g_ptr_array_remove(views, view);
+	if (views->len == 0)
+		g_hash_table_remove(rpc_query_views, view->rqv_array);
+
+	g_atomic_int_add(&rpc_query_nviews, -1);
+	g_mutex_unlock(&rpc_query_views_mtx);
+
+	g_ptr_array_free(view->rqv_result, true);
+	g_byte_array_free(view->rqv_matched, true);
+	g_mutex_clear(&view->rqv_mtx);
+	rpc_release(view->rqv_array);
+	g_free(view->rqv_interface);
+	g_free(view->rqv_name);
+	g_free(view);
+}
+
+rpc_object_t
+rpc_query_get(rpc_object_t object, const char *path, rpc_object_t default_val)
+{
+	struct rpc_query_path rpath;
+	rpc_object_t retval;
+
+	if (path == NULL)
 		return (NULL);
 
-	rpc_array_apply(rules, ^(size_t idx __unused, rpc_object_t v) {
-		if (!eval_rule(object, v)) {
-			fail = true;
-			return ((bool)false);
-		}
-	    	return (bool)true;
-	});
+	rpc_query_path_split(&rpath, path);
+	retval = rpc_query_path_get(object, &rpath, default_val);
+	rpc_query_path_free(&rpath);
+	return (retval);
+}
+
+void
+rpc_query_set(rpc_object_t object, const char *path, rpc_object_t value,
+    bool steal)
+{
+	struct rpc_query_path rpath;
 
-	return (fail ? NULL : object);
+	g_assert_nonnull(object);
+	g_assert_nonnull(value);
+
+	rpc_query_path_split(&rpath, path);
+	rpc_query_path_set(object, &rpath, value, steal);
+	rpc_query_path_free(&rpath);
 }
 
-static rpc_object_t
-rpc_query_find_next(rpc_query_iter_t iter)
+void
+rpc_query_delete(rpc_object_t object, const char *path)
 {
-	rpc_object_t current = NULL;
-	rpc_object_t result = NULL;
+	struct rpc_query_path rpath;
 
-	do {
-		current = rpc_array_get_value(iter->rqi_source, iter->rqi_idx);
-		iter->rqi_idx++;
-		result = rpc_query_steal_apply(current, iter->rqi_rules);
+	rpc_query_path_split(&rpath, path);
+	rpc_query_path_delete(object, &rpath);
+	rpc_query_path_free(&rpath);
+}
 
-	} while ((current != NULL) && (result == NULL));
+bool
+rpc_query_contains(rpc_object_t object, const char *path)
+{
+	rpc_object_t target = rpc_query_get(object, path, NULL);
 
-	if (iter->rqi_params->limit > 0) {
-		if ((result != NULL) && (iter->rqi_initialized)) {
-			if (iter->rqi_limit < iter->rqi_params->limit)
-				iter->rqi_limit++;
-			else
-				result = NULL;
-		}
+	return (target != NULL);
+}
+
+rpc_path_t
+rpc_path_compile(const char *path)
+{
+	rpc_path_t rpath;
+	size_t i;
+
+	if (path == NULL) {
+		rpc_set_last_error(EINVAL, "Path is NULL", NULL);
+		return (NULL);
 	}
 
-	return (result);
+	rpath = g_malloc0(sizeof(*rpath));
+	rpc_query_path_split(rpath, path);
+	for (i = 0; i < rpath->rqp_count; i++) {
+		rpath->rqp_segments[i].rqs_ikey =
+		    rpc_key_intern(rpath->rqp_segments[i].rqs_key);
+	}
+
+	return (rpath);
+}
+
+void
+rpc_path_free(rpc_path_t path)
+{
+
+	rpc_query_path_free(path);
+	g_free(path);
 }
 
 rpc_object_t
-rpc_query_get(rpc_object_t object, const char *path, rpc_object_t default_val)
+rpc_query_get_path(rpc_object_t object, rpc_path_t path,
+    rpc_object_t default_val)
 {
-	char *split_path;
-	char *token;
-	rpc_object_t leaf = object;
-	rpc_object_t retval = default_val;
-	bool error = false;
 
-	if (path == NULL)
-		return (NULL);
+	return (rpc_query_path_get(object, path, default_val));
+}
 
-	split_path = g_strdup(path);
-	token = strtok(split_path, ".");
-	while (token != NULL) {
-		switch(rpc_get_type(leaf)) {
-		case RPC_TYPE_DICTIONARY:
-			leaf = rpc_dictionary_get_value(leaf, token);
-			break;
+void
+rpc_query_set_path(rpc_object_t object, rpc_path_t path, rpc_object_t value,
+    bool steal)
+{
 
-		case RPC_TYPE_ARRAY:
-			leaf = rpc_array_get_value(leaf, (size_t)atoi(token));
-			break;
+	g_assert_nonnull(object);
+	g_assert_nonnull(value);
 
-		default:
-			retval = NULL;
-			error = true;
-			break;
+	rpc_query_path_set(object, path, value, steal);
+}
+
+void
+rpc_query_delete_path(rpc_object_t object, rpc_path_t path)
+{
+
+	rpc_query_path_delete(object, path);
+}
+
+bool
+rpc_query_contains_path(rpc_object_t object, rpc_path_t path)
+{
+
+	return (rpc_query_path_get(object, path, NULL) != NULL);
+}
+
+static char *
+rpc_query_diff_path(const char *prefix, const char *key)
+{
+
+	if (*prefix == '\0')
+		return (g_strdup(key));
+
+	return (g_strdup_printf("%s.%s", prefix, key));
+}
+
+static void
+rpc_query_diff_set(rpc_object_t ops, const char *path, rpc_object_t value)
+{
+
+	rpc_array_append_stolen_value(ops, rpc_object_pack("{s,s,v}",
+	    "op", "set",
+	    "path", path,
+	    "value", rpc_retain(value)));
+}
+
+static void
+rpc_query_diff_dict(rpc_object_t ops, const char *path, rpc_object_t from,
+    rpc_object_t to)
+{
+	__block bool addressable = true;
+
+	/* Keys that can't be spelled in a path take the whole dictionary */
+	rpc_dictionary_apply(to, ^(const char *key, rpc_object_t v __unused) {
+		if (*key == '\0' || strchr(key, '.') != NULL)
+			addressable = false;
+
+		return ((bool)addressable);
+	});
+
+	if (!addressable) {
+		rpc_query_diff_set(ops, path, to);
+		return;
+	}
+
+	rpc_dictionary_apply(from, ^(const char *key, rpc_object_t v __unused) {
+		char *kpath;
+
+		if (rpc_dictionary_has_key(to, key))
+			return ((bool)true);
+
+		kpath = rpc_query_diff_path(path, key);
+		rpc_array_append_stolen_value(ops, rpc_object_pack("{s,s}",
+		    "op", "delete",
+		    "path", kpath));
+		g_free(kpath);
+		return ((bool)true);
+	});
+
+	rpc_dictionary_apply(to, ^(const char *key, rpc_object_t v) {
+		rpc_object_t old = rpc_dictionary_get_value(from, key);
+		char *kpath = rpc_query_diff_path(path, key);
+
+		if (old == NULL)
+			rpc_query_diff_set(ops, kpath, v);
+		else
+			rpc_query_diff_impl(ops, kpath, old, v);
+
+		g_free(kpath);
+		return ((bool)true);
+	});
+}
+
+/*
+ * Arrays are compared on the ends: whatever lies between the longest
+ * common head and tail either changed in place, if both sides have the
+ * same length there, or is spliced.
+ */
+static void
+rpc_query_diff_array(rpc_object_t ops, const char *path, rpc_object_t from,
+    rpc_object_t to)
+{
+	rpc_object_t insert;
+	size_t nfrom = rpc_array_get_count(from);
+	size_t nto = rpc_array_get_count(to);
+	size_t head = 0;
+	size_t tail = 0;
+	size_t i;
+	char idx[32];
+	char *ipath;
+
+	while (head < nfrom && head < nto &&
+	    rpc_equal(rpc_array_get_value(from, head),
+	    rpc_array_get_value(to, head)))
+		head++;
+
+	while (tail < nfrom - head && tail < nto - head &&
+	    rpc_equal(rpc_array_get_value(from, nfrom - tail - 1),
+	    rpc_array_get_value(to, nto - tail - 1)))
+		tail++;
+
+	if (nfrom == nto) {
+		for (i = head; i < nto - tail; i++) {
+			g_snprintf(idx, sizeof(idx), "%zu", i);
+			ipath = rpc_query_diff_path(path, idx);
+			rpc_query_diff_impl(ops, ipath,
+			    rpc_array_get_value(from, i),
+			    rpc_array_get_value(to, i));
+			g_free(ipath);
 		}
 
-		if (error)
-			break;
+		return;
+	}
+
+	insert = rpc_array_create();
+	for (i = head; i < nto - tail; i++)
+		rpc_array_append_value(insert, rpc_array_get_value(to, i));
+
+	rpc_array_append_stolen_value(ops, rpc_object_pack("{s,s,u,u,v}",
+	    "op", "splice",
+	    "path", path,
+	    "index", (uint64_t)head,
+	    "remove", (uint64_t)(nfrom - tail - head),
+	    "insert", insert));
+}
+
+static void
+rpc_query_diff_impl(rpc_object_t ops, const char *path, rpc_object_t from,
+    rpc_object_t to)
+{
+
+	if (rpc_equal(from, to))
+		return;
 
-		token = strtok(NULL, ".");
+	if (rpc_get_type(from) != rpc_get_type(to)) {
+		rpc_query_diff_set(ops, path, to);
+		return;
 	}
 
-	if ((!error) && (leaf != NULL))
-		retval = leaf;
+	switch (rpc_get_type(to)) {
+	case RPC_TYPE_DICTIONARY:
+		rpc_query_diff_dict(ops, path, from, to);
+		break;
 
-	g_free(split_path);
+	case RPC_TYPE_ARRAY:
+		rpc_query_diff_array(ops, path, from, to);
+		break;
 
-	return (retval);
+	default:
+		rpc_query_diff_set(ops, path, to);
+		break;
+	}
 }
 
-void
-rpc_query_set(rpc_object_t object, const char *path, rpc_object_t value,
-    bool steal)
+rpc_object_t
+rpc_query_diff(rpc_object_t from, rpc_object_t to)
 {
-	rpc_object_t container = object;
-	rpc_object_t temp;
-	size_t idx;
-	char *endptr;
-	char **tokens;
-	char *token;
-	char *next_token;
-	size_t tok_ptr = 0;
+	rpc_object_t ops = rpc_array_create();
 
-	g_assert_nonnull(object);
-	g_assert_nonnull(value);
+	rpc_query_diff_impl(ops, "", from, to);
+	return (ops);
+}
 
-	if (strlen(path) == 0) {
-		rpc_set_last_errorf(EINVAL, "SET: Path is empty");
-		return;
+static rpc_object_t
+rpc_query_splice(rpc_object_t array, size_t index, size_t remove,
+    rpc_object_t insert)
+{
+	rpc_object_t result = rpc_array_create();
+	size_t count = rpc_array_get_count(array);
+	size_t i;
+
+	for (i = 0; i < index; i++)
+		rpc_array_append_value(result, rpc_array_get_value(array, i));
+
+	if (insert != NULL) {
+		rpc_array_apply(insert, ^(size_t j __unused, rpc_object_t v) {
+			rpc_array_append_value(result, v);
+			return ((bool)true);
+		});
 	}
 
-	tokens = g_strsplit(path, ".", 0);
-	token = tokens[0];
+	for (i = index + remove; i < count; i++)
+		rpc_array_append_value(result, rpc_array_get_value(array, i));
 
-	while (tokens[tok_ptr + 1] != NULL) {
-		switch(rpc_get_type(container)) {
-		case RPC_TYPE_DICTIONARY:
-			temp = rpc_dictionary_get_value(container, token);
-			break;
-		case RPC_TYPE_ARRAY:
-			idx = (size_t)g_ascii_strtoull(token, &endptr, 10);
-			if ((idx == 0) && (token == endptr)) {
-				rpc_set_last_errorf(EINVAL,
-				    "SET: Token %s is not a number", token);
-				goto error;
-			}
+	return (result);
+}
 
-			temp = rpc_array_get_value(container, idx);
-			break;
-		default:
-			rpc_set_last_errorf(EINVAL,
-			    "SET: Unsupported type of container");
-			goto error;
-		}
+/*
+ * The copy shares storage with the original wherever the delta leaves
+ * it alone, so applying a few operations to a large object is cheap.
+ */
+rpc_object_t
+rpc_query_patch(rpc_object_t object, rpc_object_t delta)
+{
+	__block rpc_object_t result = rpc_copy(object);
+	bool ok;
 
-		if (temp == NULL) {
-			next_token = tokens[tok_ptr + 1];
+	if (rpc_get_type(delta) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Delta is not an array", NULL);
+		rpc_release(result);
+		return (NULL);
+	}
 
-			idx = (size_t)g_ascii_strtoull(next_token, &endptr, 10);
-			if ((idx == 0) && (next_token == endptr))
-				temp = rpc_dictionary_create();
-			else
-				temp = rpc_array_create();
+	ok = rpc_array_apply(delta, ^(size_t i __unused, rpc_object_t op) {
+		rpc_object_t value = NULL;
+		rpc_object_t insert = NULL;
+		rpc_object_t target;
+		const char *kind = NULL;
+		const char *path = NULL;
+		uint64_t index = 0;
+		uint64_t remove = 0;
+
+		rpc_object_unpack(op, "{s,s,v,u,u,v}",
+		    "op", &kind,
+		    "path", &path,
+		    "value", &value,
+		    "index", &index,
+		    "remove", &remove,
+		    "insert", &insert);
+
+		if (kind == NULL || path == NULL)
+			return ((bool)false);
 
-			if (rpc_get_type(container) == RPC_TYPE_DICTIONARY) {
-				rpc_dictionary_steal_value(container, token,
-				    temp);
-			} else {
-				idx = (size_t)g_ascii_strtoull(token, &endptr,
-				    10);
-				rpc_array_steal_value(container, idx, temp);
-			}
+		if (g_strcmp0(kind, "set") == 0 && value != NULL) {
+			if (*path == '\0') {
+				rpc_release(result);
+				result = rpc_copy(value);
+			} else
+				rpc_query_set(result, path, value, false);
+
+			return ((bool)true);
 		}
 
-		container = temp;
-		tok_ptr++;
-		token = tokens[tok_ptr];
-	}
+		if (g_strcmp0(kind, "delete") == 0 && *path != '\0') {
+			if (!rpc_query_contains(result, path))
+				return ((bool)false);
 
-	switch(rpc_get_type(container)) {
-	case RPC_TYPE_DICTIONARY:
-		if (steal)
-			rpc_dictionary_steal_value(container, token, value);
-		else
-			rpc_dictionary_set_value(container, token, value);
+			rpc_query_delete(result, path);
+			return ((bool)true);
+		}
 
-		break;
+		if (g_strcmp0(kind, "splice") != 0)
+			return ((bool)false);
 
-	case RPC_TYPE_ARRAY:
-		idx = (size_t)g_ascii_strtoull(token, &endptr, 10);
-		if ((idx == 0) && (token == endptr)) {
-			rpc_set_last_errorf(EINVAL,
-			    "SET: Token %s is not a number", token);
-			goto error;
-		}
+		target = *path == '\0' ? result :
+		    rpc_query_get(result, path, NULL);
+		if (target == NULL || rpc_get_type(target) != RPC_TYPE_ARRAY ||
+		    index > rpc_array_get_count(target) ||
+		    remove > rpc_array_get_count(target) - index ||
+		    (insert != NULL && rpc_get_type(insert) != RPC_TYPE_ARRAY))
+			return ((bool)false);
 
-		if (steal)
-			rpc_array_steal_value(container, idx, value);
-		else
-			rpc_array_set_value(container, idx, value);
+		target = rpc_query_splice(target, index, remove, insert);
+		if (*path == '\0') {
+			rpc_release(result);
+			result = target;
+		} else
+			rpc_query_set(result, path, target, true);
 
-		break;
+		return ((bool)true);
+	});
 
-	default:
-		rpc_set_last_error(EINVAL,
-		    "SET: Cannot navigate through non-container types.", NULL);
-		break;
+	if (!ok) {
+		rpc_set_last_error(EINVAL, "Delta doesn't apply", NULL);
+		rpc_release(result);
+		return (NULL);
 	}
 
-error:
-	g_strfreev(tokens);
+	return (result);
 }
 
-void
-rpc_query_delete(rpc_object_t object, const char *path)
+rpc_query_plan_t
+rpc_query_compile(rpc_object_t rules)
 {
-	rpc_object_t container;
-	const char *child;
-	size_t idx;
-	char *next_char;
-
-	container = rpc_query_get_parent(object, path, &child, NULL);
-	if (container == NULL) {
-		rpc_set_last_error(ENOENT, "DELETE: Parent object not found.",
-		    NULL);
-		return;
-	}
+	rpc_query_plan_t plan;
 
-	if (child == NULL) {
-		rpc_set_last_error(ENOENT,
-		    "DELETE: Path too short - specify target for the value.",
+	if (rpc_get_type(rules) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Query rules have to be an array",
 		    NULL);
-		return;
+		return (NULL);
 	}
 
-	switch(rpc_get_type(container)) {
-	case RPC_TYPE_DICTIONARY:
-		rpc_dictionary_remove_key(container, child);
-		break;
+	plan = g_malloc0(sizeof(*plan));
+	plan->rqp_root = rpc_query_compile_list(RPC_QUERY_OP_ALL, rules);
+	return (plan);
+}
 
-	case RPC_TYPE_ARRAY:
-		idx = (size_t)strtol(child, &next_char, 10);
-			if (next_char != NULL)
-				rpc_set_last_error(ENOENT,
-				    "DELETE: String to index conversion failed."
-				    , NULL);
-		rpc_array_remove_index(container, idx);
-		break;
+static rpc_query_plan_t
+rpc_query_plan_new_all(void)
+{
+	rpc_query_plan_t plan;
 
-	default:
-		rpc_set_last_error(EINVAL,
-		    "DELETE: Cannot navigate through non-container types.",
-		    NULL);
-		break;
-	}
+	plan = g_malloc0(sizeof(*plan));
+	plan->rqp_root = rpc_query_node_new(RPC_QUERY_OP_ALL);
+	plan->rqp_root->rqn_children = g_ptr_array_new();
+	return (plan);
 }
 
-bool
-rpc_query_contains(rpc_object_t object, const char *path)
+void
+rpc_query_plan_free(rpc_query_plan_t plan)
 {
-	rpc_object_t target = rpc_query_get(object, path, NULL);
 
-	return (target != NULL);
+	rpc_query_node_free(plan->rqp_root);
+	g_free(plan);
 }
 
-rpc_query_iter_t
-rpc_query(rpc_object_t object, rpc_query_params_t params, rpc_object_t rules)
+static rpc_query_iter_t
+rpc_query_iter_new(rpc_object_t object, rpc_query_params_t params,
+    rpc_query_plan_t plan, bool owned)
 {
 	rpc_query_iter_t iter;
 	rpc_query_params_t local_params;
-
-	if (rpc_get_type(object) != RPC_TYPE_ARRAY) {
-		rpc_set_last_error(EINVAL, "Query can operate on arrays only",
-		    NULL);
-		return (NULL);
-	}
+	size_t i;
 
 	iter = g_malloc(sizeof(*iter));
-	local_params = g_malloc(sizeof(*local_params));
+	local_params = g_malloc0(sizeof(*local_params));
 
 	if (params != NULL)
 		*local_params = *params;
@@ -507,16 +2535,67 @@ rpc_query(rpc_object_t object, rpc_query_params_t params, rpc_object_t rules)
 	iter->rqi_source = object;
 	iter->rqi_idx = 0;
 	iter->rqi_params = local_params;
-	iter->rqi_rules = rules;
+	iter->rqi_plan = plan;
+	iter->rqi_plan_owned = owned;
+	iter->rqi_candidates = NULL;
+	iter->rqi_prefiltered = false;
+	iter->rqi_sorted = NULL;
+	iter->rqi_select = NULL;
+
+	if (local_params->select != NULL) {
+		iter->rqi_select = rpc_query_projection_new();
+		for (i = 0; local_params->select[i] != NULL; i++)
+			rpc_query_projection_add(iter->rqi_select,
+			    local_params->select[i]);
+
+		rpc_query_projection_seal(iter->rqi_select);
+		local_params->select = NULL;
+	}
+
 	iter->rqi_done = false;
 	iter->rqi_initialized = false;
 	iter->rqi_limit = 0;
 
-	rpc_retain(rules);
 	rpc_retain(object);
 	return (iter);
 }
 
+rpc_query_iter_t
+rpc_query(rpc_object_t object, rpc_query_params_t params, rpc_object_t rules)
+{
+	rpc_query_plan_t plan;
+
+	if (rpc_get_type(object) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Query can operate on arrays only",
+		    NULL);
+		return (NULL);
+	}
+
+	/* Malformed rules don't fail the query, they just match nothing */
+	if (rpc_get_type(rules) == RPC_TYPE_ARRAY)
+		plan = rpc_query_compile(rules);
+	else {
+		plan = g_malloc0(sizeof(*plan));
+		plan->rqp_root = rpc_query_node_new(RPC_QUERY_OP_FALSE);
+	}
+
+	return (rpc_query_iter_new(object, params, plan, true));
+}
+
+rpc_query_iter_t
+rpc_query_plan(rpc_object_t object, rpc_query_params_t params,
+    rpc_query_plan_t plan)
+{
+
+	if (rpc_get_type(object) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Query can operate on arrays only",
+		    NULL);
+		return (NULL);
+	}
+
+	return (rpc_query_iter_new(object, params, plan, false));
+}
+
 rpc_query_iter_t
 rpc_query_fmt(rpc_object_t object, rpc_query_params_t params,
     const char *rules_fmt, ...)
@@ -537,12 +2616,24 @@ rpc_query_fmt(rpc_object_t object, rpc_query_params_t params,
 rpc_object_t
 rpc_query_apply(rpc_object_t object, rpc_object_t rules)
 {
+	rpc_query_plan_t plan;
 	rpc_object_t result;
 
 	if (rpc_get_type(rules) != RPC_TYPE_ARRAY)
 		return (NULL);
 
-	result = rpc_query_steal_apply(object, rules);
+	plan = rpc_query_compile(rules);
+	result = rpc_query_plan_apply(object, plan);
+	rpc_query_plan_free(plan);
+	return (result);
+}
+
+rpc_object_t
+rpc_query_plan_apply(rpc_object_t object, rpc_query_plan_t plan)
+{
+	rpc_object_t result;
+
+	result = rpc_query_steal_apply(object, plan);
 
 	if (result != NULL)
 		rpc_retain(result);
@@ -554,6 +2645,7 @@ bool
 rpc_query_next(rpc_query_iter_t iter, rpc_object_t *chunk)
 {
 	rpc_object_t temp_obj = NULL;
+	rpc_object_t result;
 	uint32_t match_cnt = 0;
 	uint32_t i;
 
@@ -563,20 +2655,18 @@ rpc_query_next(rpc_query_iter_t iter, rpc_object_t *chunk)
 	}
 
 	if (!iter->rqi_initialized) {
-		if (iter->rqi_params->sort)
-			rpc_array_sort(iter->rqi_source, iter->rqi_params->sort);
-
-		if (iter->rqi_params->reverse) {
-			temp_obj = rpc_array_create();
-			rpc_array_reverse_apply(iter->rqi_source,
-			    ^(size_t idx __unused, rpc_object_t v) {
-				rpc_array_append_value(temp_obj, v);
-				return ((bool) true);
-			});
+		rpc_query_filter_packed(iter);
 
-			rpc_release(iter->rqi_source);
-			iter->rqi_source = temp_obj;
-		}
+		if (!iter->rqi_prefiltered)
+			iter->rqi_candidates = rpc_query_index_candidates(
+			    iter->rqi_source, iter->rqi_plan);
+
+		if (iter->rqi_params->parallel > 1 &&
+		    !iter->rqi_params->single && !iter->rqi_prefiltered)
+			rpc_query_filter_parallel(iter);
+
+		if (iter->rqi_params->sort || iter->rqi_params->reverse)
+			rpc_query_materialize(iter);
 
 		for (i = 0; i < iter->rqi_params->offset; i++) {
 			temp_obj = rpc_query_find_next(iter);
@@ -600,7 +2690,10 @@ rpc_query_next(rpc_query_iter_t iter, rpc_object_t *chunk)
 
 	if (iter->rqi_params->single) {
 		temp_obj = rpc_query_find_next(iter);
-		if (temp_obj != NULL)
+		if (temp_obj != NULL && iter->rqi_select != NULL)
+			temp_obj = rpc_query_projection_apply(iter->rqi_select,
+			    temp_obj);
+		else if (temp_obj != NULL)
 			rpc_retain(temp_obj);
 
 		*chunk = temp_obj;
@@ -614,8 +2707,21 @@ rpc_query_next(rpc_query_iter_t iter, rpc_object_t *chunk)
 		if (temp_obj == NULL)
 			break;
 
-		if (iter->rqi_params->callback)
-			temp_obj = iter->rqi_params->callback(temp_obj);
+		/* From here on, temp_obj is a reference of our own */
+		if (iter->rqi_select != NULL)
+			temp_obj = rpc_query_projection_apply(iter->rqi_select,
+			    temp_obj);
+		else
+			rpc_retain(temp_obj);
+
+		if (iter->rqi_params->callback) {
+			result = iter->rqi_params->callback(temp_obj);
+			if (result != NULL)
+				rpc_retain(result);
+
+			rpc_release(temp_obj);
+			temp_obj = result;
+		}
 
 	} while (temp_obj == NULL);
 
@@ -626,7 +2732,6 @@ rpc_query_next(rpc_query_iter_t iter, rpc_object_t *chunk)
 		return (false);
 	}
 
-	rpc_retain(temp_obj);
 	return (true);
 }
 
@@ -634,8 +2739,281 @@ void
 rpc_query_iter_free(rpc_query_iter_t iter)
 {
 
-	rpc_release(iter->rqi_rules);
+	if (iter->rqi_plan_owned)
+		rpc_query_plan_free(iter->rqi_plan);
+
+	if (iter->rqi_candidates != NULL)
+		g_array_free(iter->rqi_candidates, true);
+
+	if (iter->rqi_sorted != NULL)
+		g_ptr_array_free(iter->rqi_sorted, true);
+
+	if (iter->rqi_select != NULL)
+		rpc_query_projection_free(iter->rqi_select);
+
 	rpc_release(iter->rqi_source);
 	g_free(iter->rqi_params);
 	g_free(iter);
 }
+
+/*
+ * Query rules and parameters a client attached to a streaming call. The
+ * fragments a method yields go through the filter before being sent.
+ * Sorting and reversing need to see every match first, so in that case
+ * matches are held back until the method ends the stream.
+ */
+struct rpc_query_pushdown
+{
+	rpc_query_plan_t	rqd_plan;
+	bool			rqd_single;
+	bool			rqd_count;
+	bool			rqd_reverse;
+	uint64_t		rqd_offset;
+	uint64_t		rqd_limit;
+	bool			rqd_has_sort;
+	struct rpc_query_path	rqd_sort;
+	rpc_array_cmp_t		rqd_sort_cb;
+	struct rpc_query_projection *rqd_select;
+	GPtrArray *		rqd_buffer;
+	uint64_t		rqd_matched;
+	uint64_t		rqd_sent;
+	bool			rqd_taken;
+};
+
+static int
+rpc_query_pushdown_cmp(struct rpc_query_pushdown *pd, rpc_object_t o1,
+    rpc_object_t o2)
+{
+	rpc_object_t v1;
+	rpc_object_t v2;
+
+	v1 = rpc_query_path_get(o1, &pd->rqd_sort, NULL);
+	v2 = rpc_query_path_get(o2, &pd->rqd_sort, NULL);
+
+	/* Elements without the field go first */
+	if (v1 == NULL || v2 == NULL)
+		return ((v1 != NULL) - (v2 != NULL));
+
+	return (rpc_cmp(v1, v2));
+}
+
+struct rpc_query_pushdown *
+rpc_query_pushdown_new(rpc_object_t spec)
+{
+	struct rpc_query_pushdown *pd;
+	rpc_object_t rules = NULL;
+	rpc_object_t select = NULL;
+	const char *sort = NULL;
+
+	if (rpc_get_type(spec) != RPC_TYPE_DICTIONARY) {
+		rpc_set_last_error(EINVAL, "Malformed query", NULL);
+		return (NULL);
+	}
+
+	pd = g_malloc0(sizeof(*pd));
+	rpc_object_unpack(spec, "{v,b,b,u,u,s,b,v}",
+	    "rules", &rules,
+	    "single", &pd->rqd_single,
+	    "count", &pd->rqd_count,
+	    "offset", &pd->rqd_offset,
+	    "limit", &pd->rqd_limit,
+	    "sort", &sort,
+	    "reverse", &pd->rqd_reverse,
+	    "select", &select);
+
+	/* No rules at all lets everything through */
+	pd->rqd_plan = rules != NULL ? rpc_query_compile(rules) :
+	    rpc_query_plan_new_all();
+
+	if (pd->rqd_plan == NULL) {
+		g_free(pd);
+		return (NULL);
+	}
+
+	if (sort != NULL) {
+		pd->rqd_has_sort = true;
+		rpc_query_path_split(&pd->rqd_sort, sort);
+		pd->rqd_sort_cb = Block_copy(^(rpc_object_t o1,
+		    rpc_object_t o2) {
+			return (rpc_query_pushdown_cmp(pd, o1, o2));
+		});
+	}
+
+	if (rpc_get_type(select) == RPC_TYPE_ARRAY) {
+		pd->rqd_select = rpc_query_projection_new();
+		rpc_array_walk(select, ^(size_t idx __unused, rpc_object_t v) {
+			if (rpc_get_type(v) == RPC_TYPE_STRING) {
+				rpc_query_projection_add(pd->rqd_select,
+				    rpc_string_get_string_ptr(v));
+			}
+
+			return ((bool)true);
+		});
+
+		rpc_query_projection_seal(pd->rqd_select);
+	}
+
+	if (pd->rqd_has_sort || pd->rqd_reverse)
+		pd->rqd_buffer = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)rpc_release_impl);
+
+	return (pd);
+}
+
+void
+rpc_query_pushdown_free(struct rpc_query_pushdown *pd)
+{
+
+	rpc_query_plan_free(pd->rqd_plan);
+
+	if (pd->rqd_has_sort) {
+		rpc_query_path_free(&pd->rqd_sort);
+		Block_release(pd->rqd_sort_cb);
+	}
+
+	if (pd->rqd_select != NULL)
+		rpc_query_projection_free(pd->rqd_select);
+
+	if (pd->rqd_buffer != NULL)
+		g_ptr_array_free(pd->rqd_buffer, true);
+
+	g_free(pd);
+}
+
+bool
+rpc_query_pushdown_done(struct rpc_query_pushdown *pd)
+{
+
+	if (pd->rqd_taken || pd->rqd_buffer != NULL || pd->rqd_count)
+		return (false);
+
+	if (pd->rqd_single && pd->rqd_sent > 0)
+		return (true);
+
+	return (pd->rqd_limit > 0 && pd->rqd_sent >= pd->rqd_limit);
+}
+
+/*
+ * Consumes the fragment. Returns what is to be sent in its place, if
+ * anything.
+ */
+rpc_object_t
+rpc_query_pushdown_filter(struct rpc_query_pushdown *pd, rpc_object_t fragment)
+{
+	rpc_object_t result;
+
+	if (pd->rqd_taken)
+		return (fragment);
+
+	if (!rpc_query_eval(pd->rqd_plan->rqp_root, fragment)) {
+		rpc_release(fragment);
+		return (NULL);
+	}
+
+	if (pd->rqd_buffer != NULL) {
+		g_ptr_array_add(pd->rqd_buffer, fragment);
+		return (NULL);
+	}
+
+	pd->rqd_matched++;
+	if (pd->rqd_matched <= pd->rqd_offset || rpc_query_pushdown_done(pd)) {
+		rpc_release(fragment);
+		return (NULL);
+	}
+
+	pd->rqd_sent++;
+	if (pd->rqd_count) {
+		rpc_release(fragment);
+		return (NULL);
+	}
+
+	if (pd->rqd_select == NULL)
+		return (fragment);
+
+	result = rpc_query_projection_apply(pd->rqd_select, fragment);
+	rpc_release(fragment);
+	return (result);
+}
+
+/*
+ * Returns what is left to be sent once the method has ended the stream.
+ */
+GPtrArray *
+rpc_query_pushdown_finish(struct rpc_query_pushdown *pd)
+{
+	struct rpc_query_params params = { 0 };
+	rpc_query_plan_t all;
+	rpc_query_iter_t iter;
+	rpc_object_t source;
+	rpc_object_t item;
+	GPtrArray *result;
+
+	result = g_ptr_array_new();
+	if (pd->rqd_taken)
+		return (result);
+
+	if (pd->rqd_buffer == NULL) {
+		if (pd->rqd_count)
+			g_ptr_array_add(result, rpc_uint64_create(pd->rqd_sent));
+
+		return (result);
+	}
+
+	/* Buffered matches get ordered and cut with a regular query */
+	source = rpc_array_create_ex(
+	    (const rpc_object_t *)pd->rqd_buffer->pdata,
+	    pd->rqd_buffer->len, false);
+	params.offset = pd->rqd_offset;
+	params.limit = pd->rqd_single ? 1 : pd->rqd_limit;
+	params.reverse = pd->rqd_reverse;
+	params.sort = pd->rqd_sort_cb;
+
+	all = rpc_query_plan_new_all();
+	iter = rpc_query_plan(source, &params, all);
+
+	while (rpc_query_next(iter, &item)) {
+		if (pd->rqd_count) {
+			pd->rqd_sent++;
+			rpc_release(item);
+			continue;
+		}
+
+		if (pd->rqd_select != NULL) {
+			g_ptr_array_add(result, rpc_query_projection_apply(
+			    pd->rqd_select, item));
+			rpc_release(item);
+		} else
+			g_ptr_array_add(result, item);
+	}
+
+	if (pd->rqd_count)
+		g_ptr_array_add(result, rpc_uint64_create(pd->rqd_sent));
+
+	rpc_query_iter_free(iter);
+	rpc_query_plan_free(all);
+	rpc_release(source);
+	return (result);
+}
+
+/*
+ * Hands the query over to a method that applies it by itself. Yielded
+ * fragments are sent as they are from then on.
+ */
+rpc_query_plan_t
+rpc_query_pushdown_take(struct rpc_query_pushdown *pd,
+    struct rpc_query_params *params)
+{
+
+	if (params != NULL) {
+		memset(params, 0, sizeof(*params));
+		params->single = pd->rqd_single;
+		params->count = pd->rqd_count;
+		params->offset = pd->rqd_offset;
+		params->limit = pd->rqd_limit;
+		params->reverse = pd->rqd_reverse;
+		params->sort = pd->rqd_has_sort ? pd->rqd_sort_cb : NULL;
+	}
+
+	pd->rqd_taken = true;
+	return (pd->rqd_plan);
+}
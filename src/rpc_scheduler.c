@@ -0,0 +1,371 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <errno.h>
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Work-stealing scheduler running method calls of an RPC context.
+ *
+ * There's a fixed set of workers, each with its own deque of tasks
+ * for every priority level. Tasks submitted from outside the scheduler
+ * are spread over the workers round-robin and appended to the tail;
+ * tasks submitted by a worker itself go to the head of its own deque.
+ * A worker takes tasks from the head of its own deques, and when these
+ * are empty, steals from the tail of the others, always going for the
+ * most urgent level first. Workers with nothing to do sleep until the
+ * pending task count goes up.
+ *
+ * With NUMA placement on, workers are dealt out over the nodes and
+ * bound to them. A task submitted from outside goes to a worker on the
+ * submitting thread's node, which for a method call is the node its
+ * frame was received and decoded on, and stealing looks at the same
+ * node before going across.
+ */
+
+#define	RPC_SCHEDULER_MIN_WORKERS	8
+
+struct rpc_scheduler_worker
+{
+	struct rpc_scheduler *	rsw_sched;
+	GThread *		rsw_thread;
+	GMutex			rsw_mtx;
+	GQueue			rsw_deque[RPC_SCHEDULER_LEVELS];
+	int			rsw_node;
+};
+
+struct rpc_scheduler
+{
+	rpc_executor_fn_t	rsc_fn;
+	void *			rsc_arg;
+	guint			rsc_nworkers;
+	guint			rsc_nnodes;
+	bool			rsc_numa;
+	struct rpc_scheduler_worker *rsc_workers;
+	GMutex			rsc_mtx;
+	GCond			rsc_cv;
+	volatile int		rsc_started;
+	volatile int		rsc_pending;
+	volatile int		rsc_idle;
+	volatile guint		rsc_next;
+	volatile int		rsc_shutdown;
+};
+
+static void rpc_scheduler_start(struct rpc_scheduler *);
+static gpointer rpc_scheduler_worker(gpointer);
+static void *rpc_scheduler_take(struct rpc_scheduler_worker *);
+static void *rpc_scheduler_pop(struct rpc_scheduler_worker *, guint, bool);
+static struct rpc_scheduler_worker *rpc_scheduler_pick(
+    struct rpc_scheduler *);
+
+static GPrivate rpc_scheduler_self;
+
+static void
+rpc_scheduler_start(struct rpc_scheduler *sched)
+{
+	struct rpc_scheduler_worker *worker;
+	guint i;
+	guint j;
+
+	g_mutex_lock(&sched->rsc_mtx);
+	if (sched->rsc_started) {
+		g_mutex_unlock(&sched->rsc_mtx);
+		return;
+	}
+
+	sched->rsc_workers = g_malloc0_n(sched->rsc_nworkers,
+	    sizeof(*sched->rsc_workers));
+	sched->rsc_nnodes = sched->rsc_numa ? rpc_node_count() : 1;
+
+	for (i = 0; i < sched->rsc_nworkers; i++) {
+		worker = &sched->rsc_workers[i];
+		worker->rsw_sched = sched;
+		worker->rsw_node = (int)(i % sched->rsc_nnodes);
+		g_mutex_init(&worker->rsw_mtx);
+		for (j = 0; j < RPC_SCHEDULER_LEVELS; j++)
+			g_queue_init(&worker->rsw_deque[j]);
+	}
+
+	for (i = 0; i < sched->rsc_nworkers; i++) {
+		worker = &sched->rsc_workers[i];
+		worker->rsw_thread = g_thread_new("librpc worker",
+		    rpc_scheduler_worker, worker);
+	}
+
+	g_atomic_int_set(&sched->rsc_started, true);
+	g_mutex_unlock(&sched->rsc_mtx);
+}
+
+static void *
+rpc_scheduler_pop(struct rpc_scheduler_worker *worker, guint level,
+    bool steal)
+{
+	GQueue *deque = &worker->rsw_deque[level];
+	void *item;
+
+	/* Unlocked peek; a stale answer only costs another round */
+	if (g_queue_is_empty(deque))
+		return (NULL);
+
+	g_mutex_lock(&worker->rsw_mtx);
+	item = steal ? g_queue_pop_tail(deque) : g_queue_pop_head(deque);
+	g_mutex_unlock(&worker->rsw_mtx);
+	return (item);
+}
+
+static void *
+rpc_scheduler_take(struct rpc_scheduler_worker *self)
+{
+	struct rpc_scheduler *sched = self->rsw_sched;
+	struct rpc_scheduler_worker *victim;
+	void *item;
+	guint passes;
+	guint level;
+	guint start;
+	guint pass;
+	guint i;
+
+	start = (guint)(self - sched->rsc_workers);
+	passes = sched->rsc_nnodes > 1 ? 2 : 1;
+	for (level = 0; level < RPC_SCHEDULER_LEVELS; level++) {
+		item = rpc_scheduler_pop(self, level, false);
+		if (item != NULL)
+			return (item);
+
+		/* Same node first, then the others */
+		for (pass = 0; pass < passes; pass++) {
+			for (i = 1; i < sched->rsc_nworkers; i++) {
+				victim = &sched->rsc_workers[
+				    (start + i) % sched->rsc_nworkers];
+				if (passes > 1 && (pass == 0) !=
+				    (victim->rsw_node == self->rsw_node))
+					continue;
+
+				item = rpc_scheduler_pop(victim, level, true);
+				if (item != NULL)
+					return (item);
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+static gpointer
+rpc_scheduler_worker(gpointer data)
+{
+	struct rpc_scheduler_worker *self = data;
+	struct rpc_scheduler *sched = self->rsw_sched;
+	void *item;
+
+	g_private_set(&rpc_scheduler_self, self);
+	if (sched->rsc_numa && rpc_thread_bind_node(self->rsw_node) != 0)
+		debugf("Couldn't bind worker to node %d", self->rsw_node);
+
+	while (!g_atomic_int_get(&sched->rsc_shutdown)) {
+		item = rpc_scheduler_take(self);
+		if (item != NULL) {
+			g_atomic_int_add(&sched->rsc_pending, -1);
+			sched->rsc_fn(item, sched->rsc_arg);
+			continue;
+		}
+
+		/*
+		 * The idle count goes up before the pending count is
+		 * checked, and submitters do the opposite, so either we
+		 * see the new task or the submitter sees us sleeping.
+		 */
+		g_mutex_lock(&sched->rsc_mtx);
+		g_atomic_int_inc(&sched->rsc_idle);
+		while (g_atomic_int_get(&sched->rsc_pending) == 0 &&
+		    !sched->rsc_shutdown)
+			g_cond_wait(&sched->rsc_cv, &sched->rsc_mtx);
+
+		g_atomic_int_add(&sched->rsc_idle, -1);
+		g_mutex_unlock(&sched->rsc_mtx);
+	}
+
+	return (NULL);
+}
+
+struct rpc_scheduler *
+rpc_scheduler_create(rpc_executor_fn_t fn, void *arg)
+{
+	struct rpc_scheduler *sched;
+
+	sched = g_malloc0(sizeof(*sched));
+	sched->rsc_fn = fn;
+	sched->rsc_arg = arg;
+	sched->rsc_nworkers = MAX(g_get_num_processors(),
+	    RPC_SCHEDULER_MIN_WORKERS);
+	g_mutex_init(&sched->rsc_mtx);
+	g_cond_init(&sched->rsc_cv);
+	return (sched);
+}
+
+int
+rpc_scheduler_set_workers(struct rpc_scheduler *sched, guint nworkers)
+{
+
+	if (nworkers == 0) {
+		rpc_set_last_error(EINVAL, "Invalid worker count", NULL);
+		return (-1);
+	}
+
+	g_mutex_lock(&sched->rsc_mtx);
+	if (sched->rsc_started) {
+		g_mutex_unlock(&sched->rsc_mtx);
+		rpc_set_last_error(EBUSY, "Scheduler already running", NULL);
+		return (-1);
+	}
+
+	sched->rsc_nworkers = nworkers;
+	g_mutex_unlock(&sched->rsc_mtx);
+	return (0);
+}
+
+int
+rpc_scheduler_set_numa(struct rpc_scheduler *sched, bool enable)
+{
+
+	g_mutex_lock(&sched->rsc_mtx);
+	if (sched->rsc_started) {
+		g_mutex_unlock(&sched->rsc_mtx);
+		rpc_set_last_error(EBUSY, "Scheduler already running", NULL);
+		return (-1);
+	}
+
+	sched->rsc_numa = enable;
+	g_mutex_unlock(&sched->rsc_mtx);
+	return (0);
+}
+
+guint
+rpc_scheduler_get_workers(struct rpc_scheduler *sched)
+{
+
+	return (sched->rsc_nworkers);
+}
+
+bool
+rpc_scheduler_started(struct rpc_scheduler *sched)
+{
+
+	return (g_atomic_int_get(&sched->rsc_started));
+}
+
+/*
+ * Round robin over the workers of the caller's node, or over all of
+ * them if that's unknown or there's just one node.
+ */
+static struct rpc_scheduler_worker *
+rpc_scheduler_pick(struct rpc_scheduler *sched)
+{
+	guint idx;
+	guint count;
+	int node;
+
+	idx = (guint)g_atomic_int_add(&sched->rsc_next, 1);
+	if (sched->rsc_nnodes > 1) {
+		node = rpc_current_node();
+		if (node >= 0 && (guint)node < MIN(sched->rsc_nnodes,
+		    sched->rsc_nworkers)) {
+			count = (sched->rsc_nworkers - (guint)node +
+			    sched->rsc_nnodes - 1) / sched->rsc_nnodes;
+			return (&sched->rsc_workers[(guint)node +
+			    (idx % count) * sched->rsc_nnodes]);
+		}
+	}
+
+	return (&sched->rsc_workers[idx % sched->rsc_nworkers]);
+}
+
+void
+rpc_scheduler_push(struct rpc_scheduler *sched, void *item, guint level)
+{
+	struct rpc_scheduler_worker *self;
+	struct rpc_scheduler_worker *worker;
+
+	g_assert(level < RPC_SCHEDULER_LEVELS);
+
+	if (!g_atomic_int_get(&sched->rsc_started))
+		rpc_scheduler_start(sched);
+
+	self = g_private_get(&rpc_scheduler_self);
+	if (self != NULL && self->rsw_sched == sched) {
+		g_mutex_lock(&self->rsw_mtx);
+		g_queue_push_head(&self->rsw_deque[level], item);
+		g_mutex_unlock(&self->rsw_mtx);
+	} else {
+		worker = rpc_scheduler_pick(sched);
+		g_mutex_lock(&worker->rsw_mtx);
+		g_queue_push_tail(&worker->rsw_deque[level], item);
+		g_mutex_unlock(&worker->rsw_mtx);
+	}
+
+	g_atomic_int_inc(&sched->rsc_pending);
+	if (g_atomic_int_get(&sched->rsc_idle) > 0) {
+		g_mutex_lock(&sched->rsc_mtx);
+		g_cond_signal(&sched->rsc_cv);
+		g_mutex_unlock(&sched->rsc_mtx);
+	}
+}
+
+/*
+ * Waits for the running tasks to finish. Tasks that haven't been
+ * picked up by a worker yet are dropped.
+ */
+void
+rpc_scheduler_free(struct rpc_scheduler *sched)
+{
+	struct rpc_scheduler_worker *worker;
+	guint i;
+	guint j;
+
+	g_mutex_lock(&sched->rsc_mtx);
+	g_atomic_int_set(&sched->rsc_shutdown, true);
+	g_cond_broadcast(&sched->rsc_cv);
+	g_mutex_unlock(&sched->rsc_mtx);
+
+	if (sched->rsc_started) {
+		for (i = 0; i < sched->rsc_nworkers; i++) {
+			worker = &sched->rsc_workers[i];
+			g_thread_join(worker->rsw_thread);
+			for (j = 0; j < RPC_SCHEDULER_LEVELS; j++)
+				g_queue_clear(&worker->rsw_deque[j]);
+
+			g_mutex_clear(&worker->rsw_mtx);
+		}
+
+		g_free(sched->rsc_workers);
+	}
+
+	g_cond_clear(&sched->rsc_cv);
+	g_mutex_clear(&sched->rsc_mtx);
+	g_free(sched);
+}
@@ -26,6 +26,7 @@
  */
 
 #include <errno.h>
+#include <unistd.h>
 #include <rpc/serializer.h>
 #include "internal.h"
 
@@ -49,6 +50,9 @@ rpc_serializer_load(const char *serializer, const void *frame,
 		return (NULL);
 	}
 
+	if (impl->deserialize_typed != NULL)
+		return (impl->deserialize_typed(frame, len));
+
 	untyped = impl->deserialize(frame, len);
 	if (untyped == NULL)
 		return (NULL);
@@ -56,6 +60,40 @@ rpc_serializer_load(const char *serializer, const void *frame,
 	return (rpct_deserialize(untyped));
 }
 
+int
+rpc_serializer_load_stream(const char *serializer, int fd,
+    rpc_serializer_item_t item)
+{
+	const struct rpc_serializer *impl;
+	__block bool failed = false;
+	int ret;
+
+	impl = rpc_find_serializer(serializer);
+	if (impl == NULL) {
+		rpc_set_last_error(ENOENT, "Serializer not found", NULL);
+		return (-1);
+	}
+
+	if (impl->deserialize_stream == NULL) {
+		rpc_set_last_error(ENOTSUP, "Serializer can't load streams",
+		    NULL);
+		return (-1);
+	}
+
+	ret = impl->deserialize_stream(fd, ^(rpc_object_t untyped) {
+		rpc_auto_object_t typed = rpct_deserialize(untyped);
+
+		if (typed == NULL) {
+			failed = true;
+			return ((bool)false);
+		}
+
+		return (item(typed));
+	});
+
+	return (failed ? -1 : ret);
+}
+
 int
 rpc_serializer_dump(const char *serializer, rpc_object_t obj, void **framep,
     size_t *lenp)
@@ -69,9 +107,73 @@ rpc_serializer_dump(const char *serializer, rpc_object_t obj, void **framep,
 		return (-1);
 	}
 
+	if (impl->serialize_typed != NULL)
+		return (impl->serialize_typed(obj, framep, lenp, NULL, NULL));
+
 	typed = rpct_serialize(obj);
 	if (typed == NULL)
 		return (-1);
 
 	return (impl->serialize(typed, framep, lenp));
 }
+
+/*
+ * Backends with a serialize_typed op take the object as is from
+ * serialize_fd, the others take its rpct_serialize() form.
+ */
+int
+rpc_serializer_dump_fd(const char *serializer, rpc_object_t obj, int fd)
+{
+	const struct rpc_serializer *impl;
+	rpc_auto_object_t typed = NULL;
+	void *frame;
+	size_t len;
+	int ret;
+
+	impl = rpc_find_serializer(serializer);
+	if (impl == NULL) {
+		rpc_set_last_error(ENOENT, "Serializer not found", NULL);
+		return (-1);
+	}
+
+	if (impl->serialize_fd == NULL) {
+		if (rpc_serializer_dump(serializer, obj, &frame, &len) != 0)
+			return (-1);
+
+		ret = rpc_serializer_write_all(fd, frame, len);
+		g_free(frame);
+		return (ret);
+	}
+
+	if (impl->serialize_typed != NULL)
+		return (impl->serialize_fd(obj, fd));
+
+	typed = rpct_serialize(obj);
+	if (typed == NULL)
+		return (-1);
+
+	return (impl->serialize_fd(typed, fd));
+}
+
+int
+rpc_serializer_write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, ptr, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			rpc_set_last_error(errno, g_strerror(errno), NULL);
+			return (-1);
+		}
+
+		ptr += ret;
+		len -= (size_t)ret;
+	}
+
+	return (0);
+}
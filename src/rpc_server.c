@@ -43,6 +43,8 @@ static void rpc_server_cleanup(rpc_server_t);
 static bool rpc_server_valid(rpc_server_t);
 static void * rpc_server_worker(void *);
 static gboolean rpc_server_listen(void *);
+static bool rpc_server_admit(rpc_server_t, struct rpc_call *);
+static uint64_t rpc_isqrt(uint64_t);
 static void server_queue_purge(rpc_server_t);
 
 static void
@@ -87,6 +89,8 @@ rpc_server_accept(rpc_server_t server, rpc_connection_t conn)
 
 	debugf("Server accepting connection %p", conn);
 	conn->rco_rpc_context = server->rs_context;
+	rpc_connection_set_memory_limits(conn, server->rs_mem_soft,
+	    server->rs_mem_hard);
 
 	g_rw_lock_writer_lock(&server->rs_connections_rwlock);
 	server->rs_connections = g_list_append(server->rs_connections, conn);
@@ -121,6 +125,7 @@ rpc_server_disconnect(rpc_server_t server, rpc_connection_t conn)
 
 	g_rw_lock_writer_lock(&server->rs_connections_rwlock);
 	server->rs_connections = g_list_remove(server->rs_connections, conn);
+	rpc_conn_stats_merge(&server->rs_stats, &conn->rco_stats);
 	g_rw_lock_writer_unlock(&server->rs_connections_rwlock);
 	g_mutex_unlock(&server->rs_mtx);
 
@@ -170,6 +175,21 @@ rpc_server_listen(void *arg)
 
 	debugf("selected transport %s", transport->name);
 	server->rs_flags = transport->flags;
+
+	/* Clients of transports that don't serialize can't decode datagrams */
+	if (server->rs_params != NULL &&
+	    rpc_get_type(server->rs_params) == RPC_TYPE_DICTIONARY &&
+	    rpc_dictionary_has_key(server->rs_params, "event_group") &&
+	    (transport->flags & (RPC_TRANSPORT_NO_SERIALIZE |
+	    RPC_TRANSPORT_NO_RPCT_SERIALIZE)) == 0) {
+		server->rs_event_group = rpc_event_group_create(
+		    server->rs_g_context, server->rs_params);
+		if (server->rs_event_group == NULL) {
+			server->rs_error = rpc_retain(rpc_get_last_error());
+			goto done;
+		}
+	}
+
 	if (transport->listen(server, server->rs_uri, server->rs_params) == 0)
 	    server->rs_operational = true;
 
@@ -221,6 +241,7 @@ rpc_server_create_ex(const char *uri, rpc_context_t context, rpc_object_t params
 	server->rs_accept = rpc_server_accept;
 	server->rs_valid = rpc_server_valid;
 	server->rs_params = params;
+	server->rs_relay_fd = -1;
 	server->rs_g_context = g_main_context_new();
 	server->rs_g_loop = g_main_loop_new(server->rs_g_context, false);
 	server->rs_thread = g_thread_new("librpc server", rpc_server_worker,
@@ -228,6 +249,8 @@ rpc_server_create_ex(const char *uri, rpc_context_t context, rpc_object_t params
 	g_cond_init(&server->rs_cv);
 	g_mutex_init(&server->rs_mtx);
 	g_mutex_init(&server->rs_calls_mtx);
+	g_mutex_init(&server->rs_codel_mtx);
+	rpc_conn_stats_init(&server->rs_stats);
 
 	g_mutex_lock(&server->rs_mtx);
 	g_main_context_invoke(server->rs_g_context, rpc_server_listen, server);
@@ -240,6 +263,8 @@ rpc_server_create_ex(const char *uri, rpc_context_t context, rpc_object_t params
 		    rpc_error_get_message(server->rs_error));
 		rpc_set_last_rpc_error(server->rs_error);
                 rpc_server_cleanup(server);
+		rpc_event_group_free(server->rs_event_group);
+		rpc_conn_stats_destroy(&server->rs_stats);
 		g_free(server);
                 return (NULL);
 	}
@@ -258,7 +283,21 @@ rpc_server_broadcast_event(rpc_server_t server, const char *path,
     const char *interface, const char *name, rpc_object_t args)
 {
 
+	rpc_server_broadcast_local(server, path, interface, name, args);
+
+	/* Pre-forked workers pass it on to the other workers too */
+	if (server->rs_relay_fd != -1)
+		rpc_prefork_relay(server, path, interface, name, args);
+}
+
+void
+rpc_server_broadcast_local(rpc_server_t server, const char *path,
+    const char *interface, const char *name, rpc_object_t args)
+{
+	struct rpc_shared_event *ev;
 	GList *item;
+	uint64_t seq = 0;
+	bool multicast;
 
 	g_rw_lock_reader_lock(&server->rs_connections_rwlock);
         if (server->rs_closed) {
@@ -266,12 +305,23 @@ rpc_server_broadcast_event(rpc_server_t server, const char *path,
 		return;
 	}
 
+	ev = rpc_shared_event_create(path, interface, name, args);
+	multicast = server->rs_event_group != NULL &&
+	    rpc_event_group_publish(server->rs_event_group, ev, &seq);
+
 	for (item = g_list_first(server->rs_connections); item;
 	     item = item->next) {
 		rpc_connection_t conn = item->data;
-		rpc_connection_send_event(conn, path, interface, name, args);
+
+		/* Members get anything numbered after they joined by multicast */
+		if (multicast && g_atomic_int_get(&conn->rco_event_joined) &&
+		    seq >= conn->rco_event_from)
+			continue;
+
+		rpc_connection_post_event(conn, ev);
 	}
 	g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
+	rpc_shared_event_release(ev);
 }
 
 void
@@ -286,6 +336,179 @@ rpc_server_set_event_handler(rpc_server_t server,
 		server->rs_event_handler = Block_copy(handler);
 }
 
+void
+rpc_server_set_limits(rpc_server_t server, size_t max_pending,
+    size_t max_per_connection, rpc_shed_policy_t policy)
+{
+
+	g_mutex_lock(&server->rs_calls_mtx);
+	server->rs_max_pending = (guint)max_pending;
+	server->rs_max_per_conn = (guint)max_per_connection;
+	server->rs_shed_policy = policy;
+	g_mutex_unlock(&server->rs_calls_mtx);
+}
+
+void
+rpc_server_set_memory_limits(rpc_server_t server, size_t soft, size_t hard)
+{
+	GList *item;
+
+	g_rw_lock_writer_lock(&server->rs_connections_rwlock);
+	server->rs_mem_soft = soft;
+	server->rs_mem_hard = hard;
+	for (item = server->rs_connections; item != NULL; item = item->next)
+		rpc_connection_set_memory_limits(item->data, soft, hard);
+
+	g_rw_lock_writer_unlock(&server->rs_connections_rwlock);
+}
+
+rpc_object_t
+rpc_server_get_stats(rpc_server_t server)
+{
+	struct rpc_conn_stats total;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	GList *item;
+
+	rpc_conn_stats_init(&total);
+
+	/* Closed connections are folded into rs_stats under the same lock */
+	g_rw_lock_reader_lock(&server->rs_connections_rwlock);
+	rpc_conn_stats_merge(&total, &server->rs_stats);
+	for (item = server->rs_connections; item != NULL; item = item->next) {
+		conn = item->data;
+		rpc_conn_stats_merge(&total, &conn->rco_stats);
+	}
+
+	result = rpc_object_pack("{s,conn_made:i,conn_refused:i,"
+	    "conn_closed:i,conn_aborted:i,connections:u,pending_calls:u}",
+	    "uri", server->rs_uri,
+	    (int64_t)server->rs_conn_made,
+	    (int64_t)server->rs_conn_refused,
+	    (int64_t)g_atomic_int_get(&server->rs_conn_closed),
+	    (int64_t)server->rs_conn_aborted,
+	    (uint64_t)g_list_length(server->rs_connections),
+	    (uint64_t)g_atomic_int_get(&server->rs_pending));
+	g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
+
+	rpc_conn_stats_export(&total, result);
+	rpc_conn_stats_destroy(&total);
+	return (result);
+}
+
+/* called with rs_calls_mtx held */
+static bool
+rpc_server_admit(rpc_server_t server, struct rpc_call *call)
+{
+	rpc_connection_t conn = call->rc_conn;
+	struct rpc_call *victim;
+	guint inbound;
+
+	if (server->rs_max_per_conn != 0) {
+		/* The call itself is already in the inbound table */
+		g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+		inbound = g_hash_table_size(conn->rco_inbound_calls);
+		g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+
+		if (inbound > server->rs_max_per_conn)
+			return (false);
+	}
+
+	if (server->rs_max_pending != 0 &&
+	    (guint)g_atomic_int_get(&server->rs_pending) >=
+	    server->rs_max_pending) {
+		if (server->rs_shed_policy != RPC_SHED_OLDEST ||
+		    g_queue_is_empty(server->rs_calls))
+			return (false);
+
+		victim = g_queue_pop_head(server->rs_calls);
+		rpc_function_error(victim, EBUSY, "Server overloaded");
+		rpc_connection_close_inbound_call(victim);
+	}
+
+	call->rc_admitted = true;
+	g_atomic_int_inc(&server->rs_pending);
+	return (true);
+}
+
+/*
+ * CoDel control law: once the time calls spend waiting for a worker
+ * has stayed above the target for a whole interval, start dropping,
+ * and drop more often for as long as it doesn't come down.
+ */
+bool
+rpc_server_should_shed(rpc_server_t server, struct rpc_call *call)
+{
+	gint64 now;
+	gint64 sojourn;
+	bool result = false;
+
+	if (server->rs_shed_policy != RPC_SHED_CODEL || call->rc_queued_at == 0)
+		return (false);
+
+	now = g_get_monotonic_time();
+	sojourn = now - call->rc_queued_at;
+
+	g_mutex_lock(&server->rs_codel_mtx);
+	if (sojourn < RPC_CODEL_TARGET) {
+		server->rs_codel_first_above = 0;
+		server->rs_codel_dropping = false;
+		goto done;
+	}
+
+	if (server->rs_codel_first_above == 0) {
+		server->rs_codel_first_above = now + RPC_CODEL_INTERVAL;
+		goto done;
+	}
+
+	if (!server->rs_codel_dropping) {
+		if (now < server->rs_codel_first_above)
+			goto done;
+
+		/* Pick up where we left off if the last episode was recent */
+		server->rs_codel_dropping = true;
+		if (server->rs_codel_count > 2 && now -
+		    server->rs_codel_drop_next < 16 * RPC_CODEL_INTERVAL)
+			server->rs_codel_count -= 2;
+		else
+			server->rs_codel_count = 1;
+
+		server->rs_codel_drop_next = now + RPC_CODEL_INTERVAL * 1000 /
+		    (gint64)rpc_isqrt(server->rs_codel_count * 1000000);
+		result = true;
+		goto done;
+	}
+
+	if (now >= server->rs_codel_drop_next) {
+		server->rs_codel_count++;
+		server->rs_codel_drop_next += RPC_CODEL_INTERVAL * 1000 /
+		    (gint64)rpc_isqrt(server->rs_codel_count * 1000000);
+		result = true;
+	}
+
+done:
+	g_mutex_unlock(&server->rs_codel_mtx);
+	return (result);
+}
+
+static uint64_t
+rpc_isqrt(uint64_t value)
+{
+	uint64_t result = value;
+	uint64_t next;
+
+	if (value < 2)
+		return (value);
+
+	next = (result + value / result) / 2;
+	while (next < result) {
+		result = next;
+		next = (result + value / result) / 2;
+	}
+
+	return (result);
+}
+
 int
 rpc_server_dispatch(rpc_server_t server, struct rpc_call *call)
 {
@@ -295,8 +518,15 @@ rpc_server_dispatch(rpc_server_t server, struct rpc_call *call)
 
 	if (server->rs_closed) {
 		g_mutex_unlock(&server->rs_calls_mtx);
-		call->rc_err =
-		    rpc_error_create(ECONNRESET, "Server not active", NULL);
+		call->rc_err = rpc_error_create_nostack(ECONNRESET,
+		    "Server not active", NULL);
+		return (-1);
+	}
+
+	if (!rpc_server_admit(server, call)) {
+		g_mutex_unlock(&server->rs_calls_mtx);
+		call->rc_err = rpc_error_create_nostack(EBUSY,
+		    "Server overloaded", NULL);
 		return (-1);
 	}
 
@@ -325,7 +555,7 @@ server_queue_purge(rpc_server_t server)
 			    icall) == 0)
 				continue;
 		} else {
-			icall->rc_err = rpc_error_create(ECONNRESET,
+			icall->rc_err = rpc_error_create_nostack(ECONNRESET,
 			    "Server not active", NULL);
 		}
 
@@ -387,6 +617,8 @@ rpc_server_release(rpc_server_t server)
 			server->rs_conn_closed,
 			server->rs_conn_aborted);
 		server->rs_refcnt = -1;
+		rpc_event_group_free(server->rs_event_group);
+		rpc_conn_stats_destroy(&server->rs_stats);
 		g_free(server);
 		return;
 	}
@@ -36,23 +36,98 @@
 #include <glib/gprintf.h>
 #include "internal.h"
 
+struct rpc_qos_class;
+struct rpc_fair_flow;
+
 static bool rpc_context_path_is_valid(const char *);
 static rpc_object_t rpc_get_objects(void *, rpc_object_t);
+static rpc_object_t rpc_list_objects(void *, rpc_object_t);
 static rpc_object_t rpc_get_interfaces(void *, rpc_object_t);
 static rpc_object_t rpc_get_methods(void *, rpc_object_t);
 static rpc_object_t rpc_get_events(void *, rpc_object_t);
 static rpc_object_t rpc_interface_exists(void *, rpc_object_t);
 static rpc_object_t rpc_observable_property_get(void *, rpc_object_t);
 static rpc_object_t rpc_observable_property_get_all(void *, rpc_object_t);
+static rpc_object_t rpc_observable_property_get_versioned(void *,
+    rpc_object_t);
+static rpc_object_t rpc_get_properties(void *, rpc_object_t);
+static rpc_object_t rpc_instance_get_all_properties(rpc_instance_t,
+    const char *);
+static void rpc_bulk_get_work(struct rpc_bulk_get *);
+static void rpc_bulk_get_release(struct rpc_bulk_get *);
 static rpc_object_t rpc_observable_property_set(void *, rpc_object_t);
+static rpc_object_t rpc_get_method_stats(void *, rpc_object_t);
+static rpc_object_t rpc_get_server_stats(void *, rpc_object_t);
+static rpc_object_t rpc_get_connection_stats(void *, rpc_object_t);
+static rpc_object_t rpc_get_lock_stats(void *, rpc_object_t);
+static rpc_object_t rpc_get_slow_calls(void *, rpc_object_t);
+static rpc_object_t rpc_get_slow_consumers(void *, rpc_object_t);
+static rpc_object_t rpc_session_open(void *, rpc_object_t);
+static rpc_object_t rpc_session_resume(void *, rpc_object_t);
+static void rpc_session_free(gpointer);
 void rpc_interface_free(struct rpc_interface_priv *);
 void rpc_if_member_free(struct rpc_if_member *);
 static gpointer emit_events(gpointer data);
+static void rpc_context_post_patterns_locked(struct rpc_context *,
+    const char *, const char *, const char *, struct rpc_shared_event *,
+    GHashTable *);
+static void rpc_context_emit_push(struct rpc_context *, void *);
+static bool rpc_function_should_chunk(struct rpc_call *, rpc_object_t);
+static void rpc_function_respond_chunked(struct rpc_call *, rpc_object_t);
+static gint64 rpc_context_flush_properties(struct rpc_context *);
+static void rpc_property_coalesce_free(gpointer);
+static void rpc_property_delta_free(gpointer);
+static struct rpc_property_delta *rpc_instance_get_delta(rpc_instance_t,
+    const char *, const char *);
+static bool rpc_instance_emit_delta(rpc_instance_t,
+    struct rpc_property_delta *, const char *, const char *, rpc_object_t);
+static void rpc_instance_emit_changed(rpc_instance_t, const char *,
+    const char *, rpc_object_t);
+static void rpc_context_tp_call(struct rpc_context *, struct rpc_call *);
+static void rpc_context_run_call(struct rpc_context *, struct rpc_call *,
+    struct rpc_if_method *);
+static void rpc_context_qos_release(struct rpc_context *,
+    struct rpc_qos_class *);
+static void rpc_qos_class_free(gpointer);
+static void rpc_context_submit(struct rpc_context *, struct tp_item *,
+    guint);
+static struct rpc_fair_flow *rpc_context_fair_flow(struct rpc_context *,
+    rpc_connection_t);
+static bool rpc_fair_flow_ready(struct rpc_fair_flow *, gint64, gint64 *);
+static void rpc_context_fair_run_locked(struct rpc_context *);
+static void rpc_context_fair_release(struct rpc_context *,
+    struct rpc_fair_flow *);
+static gint64 rpc_context_fair_tick(struct rpc_context *);
+static guint rpc_flight_hash(gconstpointer);
+static gboolean rpc_flight_equal(gconstpointer, gconstpointer);
+static bool rpc_context_join_flight(struct rpc_context *, struct rpc_call *);
+static void rpc_context_land_flight(struct rpc_context *, struct rpc_call *,
+    rpc_object_t);
+static void rpc_interface_free_cb(gpointer, gpointer, gpointer);
+static void rpc_instance_destroy(gpointer);
+static void rpc_instance_free_interfaces(rpc_instance_t);
+static rpc_instance_t rpc_instance_shape(rpc_instance_t);
+static struct rpc_namespace *rpc_context_find_namespace(rpc_context_t,
+    const char *);
+static void rpc_namespace_release(gpointer);
+static rpc_instance_t rpc_context_resolve_instance(rpc_context_t,
+    const char *);
+static void rpc_context_enumerate_namespaces(rpc_context_t, const char *,
+    rpc_instance_enum_cb_t);
+static struct rpc_interface_priv *rpc_instance_find_interface(
+    rpc_instance_t, const char *);
+static GHashTable *rpc_table_copy(GHashTable *);
+static void rpc_table_publish(GHashTable **, GHashTable *);
+static guint rpc_index_lower_bound(GPtrArray *, const char *);
+static void rpc_index_insert(rpc_context_t, rpc_instance_t);
+static void rpc_index_remove(rpc_context_t, const char *);
 
 static const struct rpc_if_member rpc_discoverable_vtable[] = {
 	RPC_EVENT(instance_added),
 	RPC_EVENT(instance_removed),
 	RPC_METHOD(get_instances, rpc_get_objects),
+	RPC_METHOD(list_instances, rpc_list_objects),
+	RPC_METHOD(get_properties, rpc_get_properties),
 	RPC_MEMBER_END
 };
 
@@ -70,10 +145,61 @@ static const struct rpc_if_member rpc_observable_vtable[] = {
 	RPC_EVENT(changed),
 	RPC_METHOD(get, rpc_observable_property_get),
 	RPC_METHOD(get_all, rpc_observable_property_get_all),
+	RPC_METHOD(get_versioned, rpc_observable_property_get_versioned),
 	RPC_METHOD(set, rpc_observable_property_set),
 	RPC_MEMBER_END
 };
 
+static const struct rpc_if_member rpc_statistics_vtable[] = {
+	RPC_METHOD(get_method_stats, rpc_get_method_stats),
+	RPC_METHOD(get_server_stats, rpc_get_server_stats),
+	RPC_METHOD(get_connection_stats, rpc_get_connection_stats),
+	RPC_METHOD(get_lock_stats, rpc_get_lock_stats),
+	RPC_METHOD(get_slow_calls, rpc_get_slow_calls),
+	RPC_METHOD(get_slow_consumers, rpc_get_slow_consumers),
+	RPC_EVENT(slow_call),
+	RPC_EVENT(slow_consumer),
+	RPC_MEMBER_END
+};
+
+static const struct rpc_if_member rpc_session_vtable[] = {
+	RPC_METHOD(open, rpc_session_open),
+	RPC_METHOD(resume, rpc_session_resume),
+	RPC_MEMBER_END
+};
+
+/* How long a session outlives its connection, in microseconds */
+#define	RPC_SESSION_TTL		(60 * G_USEC_PER_SEC)
+
+/*
+ * A resumable session. While its connection is alive, rse_conn points
+ * to it; once the connection goes away, its subscriptions are kept in
+ * rse_subscriptions until either a new connection resumes the session
+ * or it expires. If the transport carries peer credentials, the ones of
+ * the connection that opened the session are kept in rse_creds.
+ */
+struct rpc_session {
+	char *		rse_token;
+	rpc_connection_t rse_conn;
+	rpc_object_t	rse_subscriptions;
+	gint64		rse_expires;
+	bool		rse_has_creds;
+	struct rpc_credentials rse_creds;
+};
+
+/*
+ * A call to a coalescing method in progress, together with the
+ * identical calls that came in while it ran and wait for its result.
+ */
+struct rpc_flight {
+	char *		path;
+	char *		interface;
+	char *		method;
+	rpc_object_t	args;
+	guint		hash;
+	GPtrArray *	waiters;
+};
+
 struct emit_item {
 	rpc_context_t	context;
 	char *		path;
@@ -85,11 +211,91 @@ struct emit_item {
 enum tp_type {
 	TYPE_CALL,
 	TYPE_INSTANCE,
+	TYPE_BULK_GET,
+};
+
+/*
+ * A bulk property read. The caller and any number of pool workers
+ * claim instances off rbg_next and leave the results in their slots;
+ * the caller hands them out in order. Workers that come late find
+ * nothing left to do and just drop their reference.
+ */
+struct rpc_bulk_get {
+	volatile gint		rbg_refcnt;
+	char *			rbg_interface;
+	GPtrArray *		rbg_instances;
+	rpc_object_t *		rbg_results;
+	bool *			rbg_done;
+	volatile gint		rbg_next;
+	volatile gint		rbg_stop;
+	GMutex			rbg_mtx;
+	GCond			rbg_cv;
+};
+
+/*
+ * A namespace of virtual instances. rns_prefix has no trailing slash,
+ * so the root namespace has an empty one.
+ */
+struct rpc_namespace {
+	volatile gint		rns_refcnt;
+	char *			rns_prefix;
+	rpc_instance_resolver_t	rns_resolver;
+	rpc_instance_enumerator_t rns_enumerator;
 };
 
 struct tp_item {
 	gpointer data;
 	enum tp_type type;
+	struct rpc_qos_class *qos;
+	struct rpc_fair_flow *flow;
+	guint level;
+};
+
+/*
+ * Calls of an interface with a QoS class set up are scheduled at the
+ * class priority. Once the class concurrency limit is reached, further
+ * calls wait in the class queue until a running one returns.
+ */
+struct rpc_qos_class {
+	enum rpc_priority	rqc_priority;
+	guint			rqc_limit;
+	guint			rqc_max_queued;
+	guint			rqc_running;
+	GQueue			rqc_queue;
+	uint64_t		rqc_dispatched;
+	uint64_t		rqc_throttled;
+	uint64_t		rqc_shed;
+};
+
+/*
+ * With fair scheduling on, the calls of each connection wait in a flow
+ * of their own, and no more than rcx_fair_slots calls are with the
+ * scheduler at a time. Free slots are dealt out deficit round robin
+ * over the flows with calls waiting, each flow taking up to its weight
+ * of calls per turn. A flow sits out its turn while it's at its
+ * concurrency cap, or while its token bucket, which refills at
+ * rfs_rate calls a second up to rfs_burst, is empty; the emitter thread
+ * has another go once it has refilled.
+ */
+struct rpc_fair_share {
+	guint			rfs_weight;
+	guint			rfs_max_running;
+	double			rfs_rate;
+	double			rfs_burst;
+};
+
+struct rpc_fair_flow {
+	const struct rpc_fair_share *rff_share;
+	GQueue			rff_queue;	/* tp_item */
+	bool			rff_active;
+	guint			rff_running;
+	guint			rff_deficit;
+	double			rff_tokens;
+	gint64			rff_refill;
+};
+
+static const struct rpc_fair_share rpc_fair_share_default = {
+	.rfs_weight = 1,
 };
 
 static void
@@ -97,10 +303,11 @@ rpc_context_tp_handler(gpointer data, gpointer user_data)
 {
 	struct rpc_context *context = user_data;
 	struct tp_item *item = data;
+	struct rpc_qos_class *qos;
+	struct rpc_fair_flow *flow;
 	struct rpc_call *call;
+	rpc_connection_t conn;
 	rpc_instance_t instance;
-	struct rpc_if_method *method;
-	rpc_object_t result;
 
 	if (item->type == TYPE_INSTANCE) {
 		instance = item->data;
@@ -111,28 +318,179 @@ rpc_context_tp_handler(gpointer data, gpointer user_data)
 			g_cond_wait(&instance->ri_cv, &instance->ri_mtx);
 
 		g_mutex_unlock(&instance->ri_mtx);
-		g_cond_clear(&instance->ri_cv);
-		g_mutex_clear(&instance->ri_mtx);
 		g_rw_lock_clear(&instance->ri_rwlock);
-		g_free(instance->ri_path);
-		g_hash_table_destroy(instance->ri_interfaces);
-		g_free(instance);
+		rpc_instance_free_interfaces(instance);
+		g_free(item);
+
+		/* Lock-free lookups may still be looking at it */
+		rpc_epoch_retire(instance, rpc_instance_destroy);
+		return;
+	}
+
+	if (item->type == TYPE_BULK_GET) {
+		rpc_bulk_get_work(item->data);
+		rpc_bulk_get_release(item->data);
 		g_free(item);
 		return;
 	}
 
 	call = item->data;
-	method = call->rc_if_method;
+	qos = item->qos;
+	flow = item->flow;
 	g_free(item);
 
+	/* The call may be the last thing holding its connection and flow */
+	conn = call->rc_conn;
+	if (flow != NULL)
+		rpc_connection_retain(conn);
+
+	rpc_context_tp_call(context, call);
+	if (qos != NULL)
+		rpc_context_qos_release(context, qos);
+
+	if (flow != NULL) {
+		rpc_context_fair_release(context, flow);
+		rpc_connection_release(conn);
+	}
+}
+
+static guint
+rpc_flight_hash(gconstpointer key)
+{
+	const struct rpc_flight *flight = key;
+
+	return (flight->hash);
+}
+
+static gboolean
+rpc_flight_equal(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_flight *fa = a;
+	const struct rpc_flight *fb = b;
+
+	return (fa->hash == fb->hash &&
+	    g_strcmp0(fa->path, fb->path) == 0 &&
+	    g_strcmp0(fa->interface, fb->interface) == 0 &&
+	    g_strcmp0(fa->method, fb->method) == 0 &&
+	    rpc_equal(fa->args, fb->args));
+}
+
+/*
+ * Either attaches the call to an identical one in flight, returning
+ * true, or makes it the leader of a new flight others can join.
+ */
+static bool
+rpc_context_join_flight(struct rpc_context *context, struct rpc_call *call)
+{
+	struct rpc_flight key;
+	struct rpc_flight *flight;
+
+	/* Hooks may well treat every caller differently */
+	if (context->rcx_pre_call_hook != NULL ||
+	    context->rcx_post_call_hook != NULL)
+		return (false);
+
+	/* So may their queries */
+	if (call->rc_query != NULL)
+		return (false);
+
+	key.path = call->rc_path == NULL ? (char *)"/" : call->rc_path;
+	key.interface = call->rc_interface;
+	key.method = call->rc_method_name;
+	key.args = call->rc_args;
+	key.hash = g_str_hash(key.path) ^ g_str_hash(key.method);
+	if (key.args != NULL)
+		key.hash ^= (guint)rpc_hash(key.args);
+
+	g_mutex_lock(&context->rcx_flight_mtx);
+	flight = g_hash_table_lookup(context->rcx_flights, &key);
+	if (flight != NULL) {
+		if (rpc_connection_call_retain(call) < 0) {
+			g_mutex_unlock(&context->rcx_flight_mtx);
+			return (false);
+		}
+
+		g_ptr_array_add(flight->waiters, call);
+		g_mutex_unlock(&context->rcx_flight_mtx);
+		return (true);
+	}
+
+	flight = g_malloc0(sizeof(*flight));
+	flight->path = g_strdup(key.path);
+	flight->interface = g_strdup(key.interface);
+	flight->method = g_strdup(key.method);
+	flight->args = key.args != NULL ? rpc_retain(key.args) : NULL;
+	flight->hash = key.hash;
+	flight->waiters = g_ptr_array_new();
+	g_hash_table_add(context->rcx_flights, flight);
+	call->rc_flight = flight;
+	g_mutex_unlock(&context->rcx_flight_mtx);
+	return (false);
+}
+
+/*
+ * Ends the flight led by the call, if any. Waiters get @p result when
+ * there is one to share, otherwise they're dispatched to run on their
+ * own.
+ */
+static void
+rpc_context_land_flight(struct rpc_context *context, struct rpc_call *call,
+    rpc_object_t result)
+{
+	struct rpc_flight *flight = call->rc_flight;
+	struct rpc_call *waiter;
+	struct tp_item *item;
+	guint i;
+
+	if (flight == NULL)
+		return;
+
+	g_mutex_lock(&context->rcx_flight_mtx);
+	g_hash_table_remove(context->rcx_flights, flight);
+	call->rc_flight = NULL;
+	g_mutex_unlock(&context->rcx_flight_mtx);
+
+	for (i = 0; i < flight->waiters->len; i++) {
+		waiter = g_ptr_array_index(flight->waiters, i);
+		if (result != NULL) {
+			rpc_function_respond(waiter, rpc_retain(result));
+			rpc_connection_call_release(waiter);
+			continue;
+		}
+
+		item = g_malloc(sizeof(*item));
+		item->type = TYPE_CALL;
+		item->data = waiter;
+		item->qos = NULL;
+		rpc_context_submit(context, item, RPC_PRIORITY_NORMAL);
+		rpc_connection_call_release(waiter);
+	}
+
+	g_ptr_array_free(flight->waiters, true);
+	if (flight->args != NULL)
+		rpc_release(flight->args);
+
+	g_free(flight->path);
+	g_free(flight->interface);
+	g_free(flight->method);
+	g_free(flight);
+}
+
+static void
+rpc_context_tp_call(struct rpc_context *context, struct rpc_call *call)
+{
+	struct rpc_if_method *method = call->rc_if_method;
+
 	if (rpc_connection_call_retain(call) < 0) {
 		debugf("Can't dispatch call %p, not valid", call);
 		return;
 	}
 
-	if (call->rc_aborted || !rpc_connection_is_open(call->rc_conn)) {
-		debugf("Can't dispatch call, aborted or conn %p not open",
-		    call->rc_conn);
+	if (call->rc_aborted || !rpc_connection_is_open(call->rc_conn) ||
+	    rpc_call_deadline_passed(call)) {
+		debugf("Can't dispatch call, aborted, expired or conn %p "
+		    "not open", call->rc_conn);
+		rpc_context_land_flight(context, call, NULL);
 		rpc_connection_call_release(call);
 		rpc_connection_close_inbound_call(call);
 		return;
@@ -140,86 +498,210 @@ rpc_context_tp_handler(gpointer data, gpointer user_data)
 
 	if (method == NULL) {
 		rpc_function_error(call, ENOENT, "Method not found");
+		rpc_context_land_flight(context, call, NULL);
+		rpc_connection_call_release(call);
+		rpc_connection_close_inbound_call(call);
+		return;
+	}
+
+	if (call->rc_conn->rco_server != NULL &&
+	    rpc_server_should_shed(call->rc_conn->rco_server, call)) {
+		rpc_function_error(call, EBUSY, "Server overloaded");
+		rpc_context_land_flight(context, call, NULL);
 		rpc_connection_call_release(call);
 		rpc_connection_close_inbound_call(call);
 		return;
 	}
 
+	rpc_context_run_call(context, call, method);
+	rpc_connection_call_release(call);
+}
+
+static void
+rpc_context_run_call(struct rpc_context *context, struct rpc_call *call,
+    struct rpc_if_method *method)
+{
+	struct rpc_span_context *prev_span;
+	rpc_object_t result;
+	bool capture;
+
 	g_assert(call->rc_type == RPC_INBOUND_CALL);
 
 	call->rc_m_arg = method->rm_arg;
 	call->rc_context = context;
 	call->rc_consumer_seqno = 1;
+	call->rc_started_at = g_get_monotonic_time();
+
+	/* What this thread sends from here on is accounted to the call */
+	rpc_connection_take_sent_bytes();
+	if (RPC_SPANS_ACTIVE())
+		rpc_span_take_serialized();
 
 	debugf("method=%p", method);
 
 	if (context->rcx_pre_call_hook != NULL) {
 		context->rcx_pre_call_hook(call, call->rc_args);
 		if (call->rc_responded)
-			goto done;
+			return;
 	}
 
+	/* Calls made by the method become children of its span */
+	prev_span = rpc_span_enter(call);
+	capture = rpc_error_set_thread_capture(context->rcx_error_stacks);
 	result = method->rm_block((void *)call, call->rc_args);
+	rpc_error_set_thread_capture(capture);
+	rpc_span_leave(prev_span);
+
+	/* Only a plain result, not yet sent, can be handed to others */
+	if (result == RPC_FUNCTION_STILL_RUNNING || call->rc_streaming ||
+	    call->rc_responded)
+		rpc_context_land_flight(context, call, NULL);
+	else
+		rpc_context_land_flight(context, call, result);
 
 	if (result == RPC_FUNCTION_STILL_RUNNING)
-		goto done;
+		return;
 
 	if (context->rcx_post_call_hook != NULL) {
 		context->rcx_post_call_hook(call, result);
 		if (call->rc_responded)
-			goto done;
+			return;
 	}
 
 	if (!call->rc_streaming)
 		rpc_function_respond(call, result);
-	else if (!call->rc_ended)
+	else if (!call->rc_ended && !call->rc_end_pending)
 		rpc_function_end(call);
-done:
-	rpc_connection_call_release(call);
 }
 
 rpc_context_t
 rpc_context_create(void)
 {
-	GError *err;
 	rpc_context_t result;
 
-	rpct_init(true);
+	rpct_init_deferred();
 
 	result = g_malloc0(sizeof(*result));
 	result->rcx_root = rpc_instance_new(NULL, "/");
 	result->rcx_servers = g_ptr_array_new();
 	result->rcx_instances = g_hash_table_new(g_str_hash, g_str_equal);
-	result->rcx_threadpool = g_thread_pool_new(rpc_context_tp_handler,
-	    result, -1, false, &err);
+	result->rcx_index = g_ptr_array_new();
+	result->rcx_namespaces = g_ptr_array_new_with_free_func(
+	    rpc_namespace_release);
+	result->rcx_scheduler = rpc_scheduler_create(rpc_context_tp_handler,
+	    result);
+	result->rcx_qos = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, rpc_qos_class_free);
+	g_mutex_init(&result->rcx_qos_mtx);
+	g_mutex_init(&result->rcx_fair_mtx);
+	g_queue_init(&result->rcx_fair_active);
+	result->rcx_fair_shares = g_hash_table_new_full(g_direct_hash,
+	    g_direct_equal, NULL, g_free);
+	g_mutex_init(&result->rcx_coalesce_mtx);
+	result->rcx_coalesce_due = g_ptr_array_new();
+	g_mutex_init(&result->rcx_flight_mtx);
+	result->rcx_flights = g_hash_table_new(rpc_flight_hash,
+	    rpc_flight_equal);
+	g_mutex_init(&result->rcx_stats_mtx);
+	result->rcx_stats = rpc_method_stats_table_new();
+	g_mutex_init(&result->rcx_slow_mtx);
+	g_queue_init(&result->rcx_slow_calls);
+	g_queue_init(&result->rcx_slow_consumers);
+	result->rcx_slow_log_size = RPC_SLOW_LOG_SIZE;
+	result->rcx_error_stacks = true;
+	g_mutex_init(&result->rcx_sessions_mtx);
+	result->rcx_sessions = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    NULL, rpc_session_free);
 	result->rcx_emit_queue = g_async_queue_new();
-	result->rcx_emit_thread = g_thread_new("emitter", emit_events,
-	    result->rcx_emit_queue);
-	result->rcx_event_watchers = g_hash_table_new(NULL, NULL);
-
+	result->rcx_event_watchers = g_hash_table_new_full(
+	    rpc_subscription_hash, rpc_subscription_equal,
+	    (GDestroyNotify)rpc_subscription_release,
+	    (GDestroyNotify)g_hash_table_destroy);
+	result->rcx_event_patterns = g_hash_table_new_full(
+	    rpc_subscription_hash, rpc_subscription_equal,
+	    (GDestroyNotify)rpc_subscription_release,
+	    (GDestroyNotify)g_hash_table_destroy);
+
+	rpc_instance_register_interface(result->rcx_root,
+	    RPC_STATISTICS_INTERFACE, rpc_statistics_vtable, NULL);
+	rpc_instance_register_interface(result->rcx_root,
+	    RPC_SESSION_INTERFACE, rpc_session_vtable, NULL);
 	rpc_instance_set_description(result->rcx_root, "Root object");
 	rpc_context_register_instance(result, result->rcx_root);
 	return (result);
 }
 
+int
+rpc_context_set_workers(rpc_context_t context, size_t nworkers)
+{
+
+	return (rpc_scheduler_set_workers(context->rcx_scheduler,
+	    (guint)nworkers));
+}
+
+int
+rpc_context_set_numa_affinity(rpc_context_t context, bool enable)
+{
+
+	return (rpc_scheduler_set_numa(context->rcx_scheduler, enable));
+}
+
 void
 rpc_context_free(rpc_context_t context)
 {
+	struct rpc_property_coalesce *cl;
 	struct emit_item *item;
+	guint i;
 
 	if (context == NULL)
 		return;
 
 	/* free the instance before taking down the tp */
 	rpc_instance_free(context->rcx_root);
-	g_thread_pool_free(context->rcx_threadpool, true, true);
+	rpc_scheduler_free(context->rcx_scheduler);
+	g_hash_table_destroy(context->rcx_qos);
+	g_mutex_clear(&context->rcx_qos_mtx);
+	g_queue_clear(&context->rcx_fair_active);
+	g_hash_table_destroy(context->rcx_fair_shares);
+	g_mutex_clear(&context->rcx_fair_mtx);
+
+	if (context->rcx_emit_thread != NULL) {
+		item = g_malloc(sizeof (*item));
+		item->context = NULL;
+		g_async_queue_push(context->rcx_emit_queue, item);
+		g_thread_join(context->rcx_emit_thread);
+	}
 
-	item = g_malloc(sizeof (*item));
-	item->context = NULL;
-	g_async_queue_push(context->rcx_emit_queue, item);
-	g_thread_join(context->rcx_emit_thread);
 	g_async_queue_unref(context->rcx_emit_queue);
+
+	/* Whatever was still held back goes away with its instance */
+	for (i = 0; i < context->rcx_coalesce_due->len; i++) {
+		cl = g_ptr_array_index(context->rcx_coalesce_due, i);
+		g_mutex_lock(&cl->rcl_instance->ri_mtx);
+		cl->rcl_due = 0;
+		g_mutex_unlock(&cl->rcl_instance->ri_mtx);
+		rpc_instance_release(cl->rcl_instance);
+	}
+
+	g_ptr_array_free(context->rcx_coalesce_due, true);
+	g_mutex_clear(&context->rcx_coalesce_mtx);
+	g_hash_table_destroy(context->rcx_flights);
+	g_mutex_clear(&context->rcx_flight_mtx);
+	g_hash_table_destroy(context->rcx_stats);
+	g_mutex_clear(&context->rcx_stats_mtx);
+	g_queue_foreach(&context->rcx_slow_calls, (GFunc)rpc_release_impl,
+	    NULL);
+	g_queue_clear(&context->rcx_slow_calls);
+	g_queue_foreach(&context->rcx_slow_consumers, (GFunc)rpc_release_impl,
+	    NULL);
+	g_queue_clear(&context->rcx_slow_consumers);
+	g_mutex_clear(&context->rcx_slow_mtx);
+	g_hash_table_destroy(context->rcx_sessions);
+	g_mutex_clear(&context->rcx_sessions_mtx);
 	g_hash_table_destroy(context->rcx_event_watchers);
+	g_hash_table_destroy(context->rcx_event_patterns);
+	g_ptr_array_free(context->rcx_namespaces, true);
+	g_ptr_array_unref(context->rcx_index);
 	g_free(context);
 }
 
@@ -227,8 +709,8 @@ int
 rpc_context_dispatch(rpc_context_t context, struct rpc_call *call)
 {
 	struct rpc_if_member *member;
-	GError *err = NULL;
 	rpc_instance_t instance = NULL;
+	struct rpc_qos_class *qos;
 	struct tp_item *item;
 
 	debugf("call=%p, name=%s", call, call->rc_method_name);
@@ -238,12 +720,18 @@ rpc_context_dispatch(rpc_context_t context, struct rpc_call *call)
 		return (-1);
 	}
 
+	/* The caller has already given up on this one, don't bother */
+	if (rpc_call_deadline_passed(call)) {
+		debugf("Dropping call %p, deadline passed", call);
+		return (-1);
+	}
+
 	instance = rpc_instance_find_and_retain(context,
 	    call->rc_path == NULL ? "/" : call->rc_path);
 
 	if (instance == NULL) {
-		call->rc_err = rpc_error_create(ENOENT, "No valid instance found",
-		    NULL);
+		call->rc_err = rpc_error_create_nostack(ENOENT,
+		    "No valid instance found", NULL);
 		return (-1);
 	}
 
@@ -258,1035 +746,3351 @@ rpc_context_dispatch(rpc_context_t context, struct rpc_call *call)
 	}
 
 	if (member == NULL || member->rim_type != RPC_MEMBER_METHOD) {
-		call->rc_err = rpc_error_create(ENOENT, "Member not found",
-		    NULL);
+		call->rc_err = rpc_error_create_nostack(ENOENT,
+		    "Member not found", NULL);
 		rpc_instance_release(instance);
 		return (-1);
 	}
 
 	call->rc_if_method = &member->rim_method;
+
+	/* Non-blocking methods run right here, on the reader thread */
+	if (member->rim_method.rm_flags & RPC_METHOD_INLINE) {
+		if (rpc_connection_call_retain(call) < 0)
+			return (-1);
+
+		rpc_context_run_call(context, call, call->rc_if_method);
+		rpc_connection_call_release(call);
+		return (0);
+	}
+
+	/* An identical call is running already, wait for its result */
+	if ((member->rim_method.rm_flags & RPC_METHOD_COALESCE) &&
+	    rpc_context_join_flight(context, call))
+		return (0);
+
 	item = g_malloc(sizeof(*item));
 	item->type = TYPE_CALL;
 	item->data = call;
-	g_thread_pool_push(context->rcx_threadpool, item, &err);
-	if (err != NULL) {
-		call->rc_err = rpc_error_create(EFAULT, "Cannot submit call",
-		    NULL);
-		g_free(item);
-		g_error_free(err);
-		rpc_instance_release(instance);
-		return (-1);
+	item->qos = NULL;
+	call->rc_queued_at = g_get_monotonic_time();
+
+	g_mutex_lock(&context->rcx_qos_mtx);
+	qos = g_hash_table_lookup(context->rcx_qos, call->rc_interface != NULL ?
+	    call->rc_interface : RPC_DEFAULT_INTERFACE);
+	if (qos == NULL) {
+		g_mutex_unlock(&context->rcx_qos_mtx);
+		rpc_context_submit(context, item, RPC_PRIORITY_NORMAL);
+		return (0);
 	}
 
+	item->qos = qos;
+	if (qos->rqc_limit != 0 && qos->rqc_running >= qos->rqc_limit) {
+		if (qos->rqc_max_queued != 0 && qos->rqc_max_queued <=
+		    g_queue_get_length(&qos->rqc_queue)) {
+			qos->rqc_shed++;
+			g_mutex_unlock(&context->rcx_qos_mtx);
+			call->rc_err = rpc_error_create_nostack(EBUSY,
+			    "Interface queue full", NULL);
+			rpc_context_land_flight(context, call, NULL);
+			g_free(item);
+			rpc_instance_release(instance);
+			return (-1);
+		}
+
+		g_queue_push_tail(&qos->rqc_queue, item);
+		qos->rqc_throttled++;
+		g_mutex_unlock(&context->rcx_qos_mtx);
+		return (0);
+	}
+
+	qos->rqc_running++;
+	qos->rqc_dispatched++;
+	g_mutex_unlock(&context->rcx_qos_mtx);
+	rpc_context_submit(context, item, qos->rqc_priority);
 	return (0);
 }
 
-rpc_instance_t
-rpc_context_find_instance(rpc_context_t context, const char *path)
+static void
+rpc_context_qos_release(struct rpc_context *context,
+    struct rpc_qos_class *qos)
 {
-	rpc_instance_t result;
-
-	if (context == NULL)
-		return (NULL);
-
+	struct tp_item *item;
 
-	g_rw_lock_reader_lock(&context->rcx_rwlock);
-	result = path == NULL
-	    ? context->rcx_root
-	    : g_hash_table_lookup(context->rcx_instances, path);
+	g_mutex_lock(&context->rcx_qos_mtx);
+	item = g_queue_pop_head(&qos->rqc_queue);
+	if (item == NULL) {
+		qos->rqc_running--;
+		g_mutex_unlock(&context->rcx_qos_mtx);
+		return;
+	}
 
-	g_rw_lock_reader_unlock(&context->rcx_rwlock);
-	return (result);
+	/* The slot is handed over to the next call in line */
+	qos->rqc_dispatched++;
+	g_mutex_unlock(&context->rcx_qos_mtx);
+	rpc_context_submit(context, item, qos->rqc_priority);
 }
 
-rpc_instance_t
-rpc_instance_find_and_retain(rpc_context_t context, const char *path)
+/*
+ * Hands a call over to the scheduler, or with fair scheduling on, to
+ * the flow of its connection.
+ */
+static void
+rpc_context_submit(struct rpc_context *context, struct tp_item *item,
+    guint level)
 {
-	rpc_instance_t instance;
+	struct rpc_call *call = item->data;
+	struct rpc_fair_flow *flow;
 
-	if (context == NULL)
-		return (NULL);
+	item->flow = NULL;
+	if (!context->rcx_fair) {
+		rpc_scheduler_push(context->rcx_scheduler, item, level);
+		return;
+	}
 
+	item->level = level;
+	g_mutex_lock(&context->rcx_fair_mtx);
+	flow = rpc_context_fair_flow(context, call->rc_conn);
+	item->flow = flow;
+	g_queue_push_tail(&flow->rff_queue, item);
+	if (!flow->rff_active) {
+		flow->rff_active = true;
+		g_queue_push_tail(&context->rcx_fair_active, flow);
+	}
 
-	g_rw_lock_reader_lock(&context->rcx_rwlock);
-	instance = g_hash_table_lookup(context->rcx_instances, path);
-	instance = rpc_instance_retain(instance);
-	g_rw_lock_reader_unlock(&context->rcx_rwlock);
-	return (instance);
+	rpc_context_fair_run_locked(context);
+	g_mutex_unlock(&context->rcx_fair_mtx);
 }
 
-rpc_instance_t
-rpc_context_get_root(rpc_context_t context)
+/*
+ * Flow of the calls of a connection, set up on its first call with the
+ * share of its peer's user. Called with rcx_fair_mtx held.
+ */
+static struct rpc_fair_flow *
+rpc_context_fair_flow(struct rpc_context *context, rpc_connection_t conn)
 {
+	const struct rpc_fair_share *share = NULL;
+	struct rpc_fair_flow *flow;
 
-	return (context->rcx_root);
-}
+	if (conn->rco_fair_flow != NULL)
+		return (conn->rco_fair_flow);
 
-void
-rpc_instance_emit_event(rpc_instance_t instance, const char *interface,
-    const char *name, rpc_object_t args)
-{
-	rpc_context_t context;
+	if (conn->rco_has_creds) {
+		share = g_hash_table_lookup(context->rcx_fair_shares,
+		    GUINT_TO_POINTER(conn->rco_creds.rcc_uid));
+	}
 
-	g_mutex_lock(&instance->ri_mtx);
-	if (instance->ri_context) {
-		context = instance->ri_context;
-		g_mutex_unlock(&instance->ri_mtx);
-		g_rw_lock_reader_lock(&context->rcx_rwlock);
-		rpc_context_emit_event(instance->ri_context, instance->ri_path,
-		    interface, name, args);
-		g_rw_lock_reader_unlock(&context->rcx_rwlock);
-		return;
+	if (share == NULL) {
+		share = g_hash_table_lookup(context->rcx_fair_shares,
+		    GUINT_TO_POINTER(RPC_FAIR_SHARE_DEFAULT));
 	}
-	rpc_release(args);
-	g_mutex_unlock(&instance->ri_mtx);
+
+	flow = g_malloc0(sizeof(*flow));
+	flow->rff_share = share != NULL ? share : &rpc_fair_share_default;
+	flow->rff_tokens = flow->rff_share->rfs_burst;
+	flow->rff_refill = g_get_monotonic_time();
+	g_queue_init(&flow->rff_queue);
+	conn->rco_fair_flow = flow;
+	return (flow);
 }
 
-int
-rpc_instance_register_property(rpc_instance_t instance, const char *interface,
-    const char *name, void *arg, rpc_property_getter_t getter,
-    rpc_property_setter_t setter)
+/*
+ * Whether the flow may dispatch a call now. If it's only out of
+ * tokens, @p wakeup is moved up to when it gets the next one.
+ */
+static bool
+rpc_fair_flow_ready(struct rpc_fair_flow *flow, gint64 now, gint64 *wakeup)
 {
-	struct rpc_if_member member;
+	const struct rpc_fair_share *share = flow->rff_share;
+	gint64 when;
 
-	member.rim_name = name;
-	member.rim_type = RPC_MEMBER_PROPERTY;
-	member.rim_property.rp_getter = getter;
-	member.rim_property.rp_setter = setter;
-	member.rim_property.rp_arg = arg;
+	if (share->rfs_max_running != 0 &&
+	    flow->rff_running >= share->rfs_max_running)
+		return (false);
 
-	return (rpc_instance_register_member(instance, interface, &member));
+	if (share->rfs_rate <= 0)
+		return (true);
+
+	flow->rff_tokens = MIN(share->rfs_burst, flow->rff_tokens +
+	    share->rfs_rate * (double)(now - flow->rff_refill) /
+	    G_USEC_PER_SEC);
+	flow->rff_refill = now;
+	if (flow->rff_tokens >= 1)
+		return (true);
+
+	when = now + (gint64)((1 - flow->rff_tokens) * G_USEC_PER_SEC /
+	    share->rfs_rate) + 1;
+	if (*wakeup == 0 || when < *wakeup)
+		*wakeup = when;
+
+	return (false);
 }
 
-int
-rpc_context_register_instance(rpc_context_t context, rpc_instance_t instance)
+/*
+ * Deals out the free slots. Stops once there are none left, or every
+ * flow with calls waiting has had to sit out its turn in a row. Called
+ * with rcx_fair_mtx held.
+ */
+static void
+rpc_context_fair_run_locked(struct rpc_context *context)
 {
-	GHashTableIter iter;
-	rpc_object_t payload;
-	rpc_object_t ifaces;
-	const char *key;
+	GQueue *active = &context->rcx_fair_active;
+	struct rpc_fair_flow *flow;
+	struct emit_item *wakeup;
+	struct tp_item *item;
+	gint64 now = g_get_monotonic_time();
+	gint64 when = 0;
+	guint skipped = 0;
+
+	while (context->rcx_fair_running < context->rcx_fair_slots &&
+	    skipped < g_queue_get_length(active)) {
+		flow = g_queue_peek_head(active);
+		if (!rpc_fair_flow_ready(flow, now, &when)) {
+			flow->rff_deficit = 0;
+			g_queue_push_tail(active, g_queue_pop_head(active));
+			skipped++;
+			continue;
+		}
 
-	g_rw_lock_writer_lock(&context->rcx_rwlock);
+		if (flow->rff_deficit == 0)
+			flow->rff_deficit = flow->rff_share->rfs_weight;
 
-	if (g_hash_table_contains(context->rcx_instances, instance->ri_path)) {
-		rpc_set_last_error(EEXIST, "Instance already exists", NULL);
-		g_rw_lock_writer_unlock(&context->rcx_rwlock);
-		return (-1);
-	}
+		item = g_queue_pop_head(&flow->rff_queue);
+		flow->rff_deficit--;
+		flow->rff_running++;
+		if (flow->rff_share->rfs_rate > 0)
+			flow->rff_tokens -= 1;
 
-	ifaces = rpc_array_create();
-	g_hash_table_iter_init(&iter, instance->ri_interfaces);
-	while (g_hash_table_iter_next(&iter, (gpointer)&key, NULL))
-		rpc_array_append_stolen_value(ifaces, rpc_string_create(key));
+		context->rcx_fair_running++;
+		skipped = 0;
 
-	payload = rpc_object_pack("{s,v}",
-	    "path", instance->ri_path,
-	    "interfaces", ifaces);
+		if (g_queue_is_empty(&flow->rff_queue)) {
+			g_queue_pop_head(active);
+			flow->rff_active = false;
+			flow->rff_deficit = 0;
+		} else if (flow->rff_deficit == 0)
+			g_queue_push_tail(active, g_queue_pop_head(active));
 
-	rpc_context_emit_event(context, "/", RPC_DISCOVERABLE_INTERFACE,
-	    "instance_added", payload);
+		rpc_scheduler_push(context->rcx_scheduler, item, item->level);
+	}
 
-	instance->ri_context = context;
+	if (when == 0 || (context->rcx_fair_wakeup != 0 &&
+	    context->rcx_fair_wakeup <= when))
+		return;
 
-	g_hash_table_insert(context->rcx_instances, instance->ri_path, instance);
-	g_rw_lock_writer_unlock(&context->rcx_rwlock);
-	return (0);
+	context->rcx_fair_wakeup = when;
+	wakeup = g_malloc0(sizeof(*wakeup));
+	wakeup->context = context;
+	rpc_context_emit_push(context, wakeup);
 }
 
-void
-rpc_context_unregister_instance(rpc_context_t context, const char *path)
+static void
+rpc_context_fair_release(struct rpc_context *context,
+    struct rpc_fair_flow *flow)
 {
 
-	g_rw_lock_writer_lock(&context->rcx_rwlock);
+	g_mutex_lock(&context->rcx_fair_mtx);
+	flow->rff_running--;
+	context->rcx_fair_running--;
+	rpc_context_fair_run_locked(context);
+	g_mutex_unlock(&context->rcx_fair_mtx);
+}
 
-	if (g_hash_table_remove(context->rcx_instances, path)) {
-		rpc_context_emit_event(context, "/",
-		    RPC_DISCOVERABLE_INTERFACE, "instance_removed",
-		    rpc_string_create(path));
+/*
+ * Run by the emitter thread: gives flows that were out of tokens
+ * another go once they're due. Returns the number of microseconds
+ * until the next time it needs to run, or -1 if it doesn't.
+ */
+static gint64
+rpc_context_fair_tick(struct rpc_context *context)
+{
+	gint64 now;
+	gint64 next;
+
+	if (!context->rcx_fair)
+		return (-1);
+
+	g_mutex_lock(&context->rcx_fair_mtx);
+	now = g_get_monotonic_time();
+	if (context->rcx_fair_wakeup != 0 && context->rcx_fair_wakeup <= now) {
+		context->rcx_fair_wakeup = 0;
+		rpc_context_fair_run_locked(context);
 	}
 
-	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+	next = context->rcx_fair_wakeup;
+	g_mutex_unlock(&context->rcx_fair_mtx);
+	return (next != 0 ? MAX(next - now, 0) : -1);
 }
 
-int
-rpc_context_register_member(rpc_context_t context, const char *interface,
-    struct rpc_if_member *m)
+static void
+rpc_qos_class_free(gpointer data)
 {
+	struct rpc_qos_class *qos = data;
+	struct tp_item *item;
 
-	return (rpc_instance_register_member(context->rcx_root, interface, m));
+	while ((item = g_queue_pop_head(&qos->rqc_queue)) != NULL)
+		g_free(item);
+
+	g_free(qos);
 }
 
 int
-rpc_context_register_block(rpc_context_t context, const char *interface,
-    const char *name, void *arg, rpc_function_t func)
+rpc_context_set_interface_qos(rpc_context_t context, const char *interface,
+    enum rpc_priority priority, size_t limit)
 {
+	struct rpc_qos_class *qos;
 
-	return (rpc_instance_register_block(context->rcx_root, interface,
-	    name, arg, func));
-}
+	if (priority > RPC_PRIORITY_LOW) {
+		rpc_set_last_error(EINVAL, "Invalid priority", NULL);
+		return (-1);
+	}
 
-int
-rpc_context_register_func(rpc_context_t context, const char *interface,
-    const char *name, void *arg, rpc_function_f func)
-{
-	rpc_function_t fn = ^(void *cookie, rpc_object_t args) {
-		return (func(cookie, args));
-	};
+	if (interface == NULL)
+		interface = RPC_DEFAULT_INTERFACE;
 
-	return (rpc_context_register_block(context, interface, name, arg, fn));
+	g_mutex_lock(&context->rcx_qos_mtx);
+	qos = g_hash_table_lookup(context->rcx_qos, interface);
+	if (qos == NULL) {
+		qos = g_malloc0(sizeof(*qos));
+		g_queue_init(&qos->rqc_queue);
+		g_hash_table_insert(context->rcx_qos, g_strdup(interface), qos);
+	}
+
+	qos->rqc_priority = priority;
+	qos->rqc_limit = (guint)limit;
+	g_mutex_unlock(&context->rcx_qos_mtx);
+	return (0);
 }
 
 int
-rpc_context_unregister_member(rpc_context_t context, const char *interface,
-    const char *name)
+rpc_context_set_fair_scheduling(rpc_context_t context, bool enable,
+    size_t slots)
 {
 
-	return (rpc_instance_unregister_member(context->rcx_root, interface,
-	    name));
+	if (rpc_scheduler_started(context->rcx_scheduler)) {
+		rpc_set_last_error(EBUSY, "Context already serving", NULL);
+		return (-1);
+	}
+
+	context->rcx_fair = enable;
+	context->rcx_fair_slots = slots != 0 ? (guint)slots :
+	    rpc_scheduler_get_workers(context->rcx_scheduler);
+	return (0);
 }
 
-static gpointer
-emit_events(gpointer data)
+int
+rpc_context_set_fair_share(rpc_context_t context, uid_t uid,
+    unsigned int weight, size_t max_running, double rate, size_t burst)
 {
-	struct emit_item *item;
-	GAsyncQueue *q = data;
-	rpc_connection_t conn;
-	rpc_context_t context;
-	GHashTableIter iter;
+	struct rpc_fair_share *share;
 
-	for (;;) {
-		item = g_async_queue_pop(q);
-		if (item->context == NULL)
-			break;
-		context = item->context;
-
-		g_rw_lock_reader_lock(&context->rcx_rwlock);
-		g_hash_table_iter_init(&iter, context->rcx_event_watchers);
-		while (g_hash_table_iter_next(&iter, (gpointer)&conn, NULL)) {
-			rpc_connection_send_event(conn, item->path,
-			    item->interface, item->name, item->args);
-		}
-
-		g_rw_lock_reader_unlock(&context->rcx_rwlock);
-		rpc_release(item->args);
-		g_free(item->path);
-		g_free(item->interface);
-		g_free(item->name);
-		g_free(item);
+	if (weight == 0 || rate < 0) {
+		rpc_set_last_error(EINVAL, "Invalid fair share", NULL);
+		return (-1);
 	}
-	return (NULL);
-}
 
-void
-rpc_context_emit_event(rpc_context_t context, const char *path,
-    const char *interface, const char *name, rpc_object_t args)
-{
-	struct emit_item *item = g_malloc(sizeof (*item));
-
-	item->context = context;
-	item->path = g_strdup(path);
-	item->interface = g_strdup(interface);
-	item->name = g_strdup(name);
-	item->args = args;
+	/* Flows keep pointing at their share, so it's updated in place */
+	g_mutex_lock(&context->rcx_fair_mtx);
+	share = g_hash_table_lookup(context->rcx_fair_shares,
+	    GUINT_TO_POINTER(uid));
+	if (share == NULL) {
+		share = g_malloc0(sizeof(*share));
+		g_hash_table_insert(context->rcx_fair_shares,
+		    GUINT_TO_POINTER(uid), share);
+	}
 
-	g_async_queue_push(context->rcx_emit_queue, item);
+	share->rfs_weight = weight;
+	share->rfs_max_running = (guint)max_running;
+	share->rfs_rate = rate;
+	share->rfs_burst = MAX((double)burst, 1);
+	g_mutex_unlock(&context->rcx_fair_mtx);
+	return (0);
 }
 
-inline void *
-rpc_function_get_arg(void *cookie)
+int
+rpc_context_set_interface_queue_limit(rpc_context_t context,
+    const char *interface, size_t max_queued)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_qos_class *qos;
 
-	return (call->rc_m_arg);
-}
+	if (interface == NULL)
+		interface = RPC_DEFAULT_INTERFACE;
 
-inline rpc_connection_t
-rpc_function_get_connection(void *cookie)
-{
-	struct rpc_call *call = cookie;
+	g_mutex_lock(&context->rcx_qos_mtx);
+	qos = g_hash_table_lookup(context->rcx_qos, interface);
+	if (qos == NULL) {
+		g_mutex_unlock(&context->rcx_qos_mtx);
+		rpc_set_last_error(ENOENT, "No QoS class for interface", NULL);
+		return (-1);
+	}
 
-	return (rpc_connection_is_open(call->rc_conn) ? call->rc_conn : NULL);
+	qos->rqc_max_queued = (guint)max_queued;
+	g_mutex_unlock(&context->rcx_qos_mtx);
+	return (0);
 }
 
-inline rpc_context_t
-rpc_function_get_context(void *cookie)
+rpc_object_t
+rpc_context_get_qos_stats(rpc_context_t context)
 {
-	struct rpc_call *call = cookie;
+	GHashTableIter iter;
+	struct rpc_qos_class *qos;
+	const char *interface;
+	rpc_object_t result;
 
-	return (call->rc_context);
+	result = rpc_dictionary_create();
+	g_mutex_lock(&context->rcx_qos_mtx);
+	g_hash_table_iter_init(&iter, context->rcx_qos);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&interface,
+	    (gpointer *)&qos)) {
+		rpc_dictionary_steal_value(result, interface, rpc_object_pack(
+		    "{i,u,u,u,u,u,u}",
+		    "priority", (int64_t)qos->rqc_priority,
+		    "limit", (uint64_t)qos->rqc_limit,
+		    "running", (uint64_t)qos->rqc_running,
+		    "queued", (uint64_t)g_queue_get_length(&qos->rqc_queue),
+		    "dispatched", qos->rqc_dispatched,
+		    "throttled", qos->rqc_throttled,
+		    "shed", qos->rqc_shed));
+	}
+
+	g_mutex_unlock(&context->rcx_qos_mtx);
+	return (result);
 }
 
-inline rpc_instance_t
-rpc_function_get_instance(void *cookie)
+rpc_instance_t
+rpc_context_find_instance(rpc_context_t context, const char *path)
 {
-	struct rpc_call *call = cookie;
+	rpc_instance_t result;
 
-	return (call->rc_instance);
-}
+	if (context == NULL)
+		return (NULL);
 
-const char *
-rpc_function_get_name(void *cookie)
-{
-	struct rpc_call *call = cookie;
 
-	return (call->rc_method_name);
+	rpc_epoch_enter();
+	result = path == NULL
+	    ? context->rcx_root
+	    : g_hash_table_lookup(g_atomic_pointer_get(&context->rcx_instances),
+	    path);
+
+	rpc_epoch_exit();
+	return (result);
 }
 
-const char *
-rpc_function_get_path(void *cookie)
+rpc_instance_t
+rpc_instance_find_and_retain(rpc_context_t context, const char *path)
 {
-	struct rpc_call *call = cookie;
+	rpc_instance_t instance;
 
-	return (call->rc_path);
-}
+	if (context == NULL)
+		return (NULL);
 
-const char *
-rpc_function_get_interface(void *cookie)
-{
-	struct rpc_call *call = cookie;
 
-	return (call->rc_interface);
-}
+	rpc_epoch_enter();
+	instance = g_hash_table_lookup(
+	    g_atomic_pointer_get(&context->rcx_instances), path);
+	instance = rpc_instance_retain(instance);
+	rpc_epoch_exit();
 
-void
-rpc_function_respond(void *cookie, rpc_object_t object)
-{
-	struct rpc_call *call = cookie;
+	if (instance == NULL && path != NULL)
+		instance = rpc_context_resolve_instance(context, path);
 
-	call->rc_conn->rco_fn_cbs.rcf_fn_respond(cookie, object);
+	return (instance);
 }
 
-void
-rpc_function_respond_impl(void *cookie, rpc_object_t object)
+/*
+ * Longest prefix match, retained. The prefix has to be followed by
+ * a slash and something more in @p path.
+ */
+static struct rpc_namespace *
+rpc_context_find_namespace(rpc_context_t context, const char *path)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_namespace *result = NULL;
+	struct rpc_namespace *ns;
+	size_t best = 0;
+	size_t len;
+	guint i;
 
-	g_assert(call->rc_type == RPC_INBOUND_CALL);
-	if (!call->rc_responded)
-		rpc_connection_send_response(call->rc_conn,
-		    call->rc_id, object);
+	g_rw_lock_reader_lock(&context->rcx_rwlock);
+	for (i = 0; i < context->rcx_namespaces->len; i++) {
+		ns = g_ptr_array_index(context->rcx_namespaces, i);
+		len = strlen(ns->rns_prefix);
+		if (strncmp(path, ns->rns_prefix, len) != 0)
+			continue;
 
-	rpc_connection_close_inbound_call(call);
-}
+		if (path[len] != '/' || path[len + 1] == '\0')
+			continue;
 
-void
-rpc_function_error(void *cookie, int code, const char *message, ...)
-{
-	struct rpc_call *call = cookie;
-	va_list ap;
+		if (result == NULL || len > best) {
+			result = ns;
+			best = len;
+		}
+	}
 
-	va_start(ap, message);
-	call->rc_conn->rco_fn_cbs.rcf_fn_error(cookie, code, message, ap);
-	va_end(ap);
+	if (result != NULL)
+		g_atomic_int_inc(&result->rns_refcnt);
+
+	g_rw_lock_reader_unlock(&context->rcx_rwlock);
+	return (result);
 }
 
-void
-rpc_function_error_impl(void *cookie, int code, const char *message, va_list ap)
+static void
+rpc_namespace_release(gpointer data)
 {
-	struct rpc_call *call = cookie;
-	char *msg;
+	struct rpc_namespace *ns = data;
 
-	g_vasprintf(&msg, message, ap);
-	rpc_connection_send_err(call->rc_conn, call->rc_id, code, msg);
-	call->rc_responded = true;
-	g_free(msg);
-}
+	if (!g_atomic_int_dec_and_test(&ns->rns_refcnt))
+		return;
 
-void
-rpc_function_error_ex(void *cookie, rpc_object_t exception)
-{
-	struct rpc_call *call = cookie;
+	Block_release(ns->rns_resolver);
+	if (ns->rns_enumerator != NULL)
+		Block_release(ns->rns_enumerator);
 
-	call->rc_conn->rco_fn_cbs.rcf_fn_error_ex(cookie, exception);
+	g_free(ns->rns_prefix);
+	g_free(ns);
 }
 
-void
-rpc_function_error_ex_impl(void *cookie, rpc_object_t exception)
+/*
+ * The resolver runs without any of the context locks held, so it's
+ * free to look other instances up.
+ */
+static rpc_instance_t
+rpc_context_resolve_instance(rpc_context_t context, const char *path)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_namespace *ns;
+	rpc_instance_t instance;
 
-	rpc_connection_send_errx(call->rc_conn, call->rc_id, exception);
-	call->rc_responded = true;
-}
+	ns = rpc_context_find_namespace(context, path);
+	if (ns == NULL)
+		return (NULL);
 
-int
-rpc_function_start_stream(void *cookie)
-{
-	struct rpc_call *call = cookie;
+	instance = ns->rns_resolver(path);
+	rpc_namespace_release(ns);
+	if (instance == NULL)
+		return (NULL);
 
-	return (call->rc_conn->rco_fn_cbs.rcf_fn_start_stream(cookie));
+	g_assert(instance->ri_context == NULL);
+	instance->ri_context = context;
+	instance->ri_virtual = true;
+	return (rpc_instance_retain(instance));
 }
 
-int
-rpc_function_start_stream_impl(void *cookie)
+/*
+ * Calls @p callback for the objects of every namespace that may have
+ * something under @p prefix (a path ending with a slash), skipping
+ * those shadowed by registered instances.
+ */
+static void
+rpc_context_enumerate_namespaces(rpc_context_t context, const char *prefix,
+    rpc_instance_enum_cb_t callback)
 {
-	struct rpc_call *call = cookie;
-	struct rpc_context *context = call->rc_context;
+	struct rpc_namespace *ns;
+	GPtrArray *namespaces;
+	__block bool more = true;
+	char *base;
+	guint i;
 
-	g_mutex_lock(&call->rc_mtx);
+	namespaces = g_ptr_array_new_with_free_func(rpc_namespace_release);
+	g_rw_lock_reader_lock(&context->rcx_rwlock);
+	for (i = 0; i < context->rcx_namespaces->len; i++) {
+		ns = g_ptr_array_index(context->rcx_namespaces, i);
+		if (ns->rns_enumerator == NULL)
+			continue;
 
-	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
-	       !call->rc_aborted) {
-		g_mutex_unlock(&call->rc_mtx);
-		notify_wait(&call->rc_notify);
-		g_mutex_lock(&call->rc_mtx);
+		g_atomic_int_inc(&ns->rns_refcnt);
+		g_ptr_array_add(namespaces, ns);
 	}
+	g_rw_lock_reader_unlock(&context->rcx_rwlock);
 
-	if (call->rc_aborted) {
-		if (!call->rc_ended) {
-			rpc_function_error(call, ECONNRESET, "Call aborted");
-			call->rc_ended = true;
+	for (i = 0; more && i < namespaces->len; i++) {
+		ns = g_ptr_array_index(namespaces, i);
+		base = g_strdup_printf("%s/", ns->rns_prefix);
+		if (prefix != NULL && !g_str_has_prefix(base, prefix) &&
+		    !g_str_has_prefix(prefix, base)) {
+			g_free(base);
+			continue;
 		}
 
-		g_mutex_unlock(&call->rc_mtx);
-		return (-1);
-	}
+		g_free(base);
+		ns->rns_enumerator(^(const char *path, const char *descr) {
+			bool shadowed;
 
-	if (context->rcx_pre_call_hook != NULL) {
+			if (prefix != NULL && !g_str_has_prefix(path, prefix))
+				return ((bool)true);
 
+			rpc_epoch_enter();
+			shadowed = (bool)g_hash_table_contains(
+			    g_atomic_pointer_get(&context->rcx_instances),
+			    path);
+			rpc_epoch_exit();
+
+			if (!shadowed)
+				more = callback(path, descr);
+
+			return (more);
+		});
 	}
-	rpc_connection_send_start_stream(call->rc_conn, call->rc_id,
-	    call->rc_producer_seqno);
 
-	call->rc_producer_seqno++;
-	call->rc_streaming = true;
-	g_mutex_unlock(&call->rc_mtx);
-	return (0);
+	g_ptr_array_free(namespaces, true);
 }
 
-int
-rpc_function_yield(void *cookie, rpc_object_t fragment)
+rpc_instance_t
+rpc_context_get_root(rpc_context_t context)
 {
-	struct rpc_call *call = cookie;
 
-	return (call->rc_conn->rco_fn_cbs.rcf_fn_yield(cookie, fragment));
+	return (context->rcx_root);
 }
 
-int
-rpc_function_yield_impl(void *cookie, rpc_object_t fragment)
+void
+rpc_instance_emit_event(rpc_instance_t instance, const char *interface,
+    const char *name, rpc_object_t args)
 {
-	struct rpc_call *call = cookie;
+	rpc_context_t context;
+
+	g_mutex_lock(&instance->ri_mtx);
+	if (instance->ri_context) {
+		context = instance->ri_context;
+		g_mutex_unlock(&instance->ri_mtx);
+		g_rw_lock_reader_lock(&context->rcx_rwlock);
+		rpc_context_emit_event(instance->ri_context, instance->ri_path,
+		    interface, name, args);
+		g_rw_lock_reader_unlock(&context->rcx_rwlock);
+		return;
+	}
+	rpc_release(args);
+	g_mutex_unlock(&instance->ri_mtx);
+}
+
+int
+rpc_instance_register_property(rpc_instance_t instance, const char *interface,
+    const char *name, void *arg, rpc_property_getter_t getter,
+    rpc_property_setter_t setter)
+{
+	struct rpc_if_member member;
+
+	member.rim_name = name;
+	member.rim_type = RPC_MEMBER_PROPERTY;
+	member.rim_property.rp_getter = getter;
+	member.rim_property.rp_setter = setter;
+	member.rim_property.rp_arg = arg;
+
+	return (rpc_instance_register_member(instance, interface, &member));
+}
+
+int
+rpc_context_register_instance(rpc_context_t context, rpc_instance_t instance)
+{
+	GHashTableIter iter;
+	GHashTable *instances;
+	rpc_object_t payload;
+	rpc_object_t ifaces;
+	const char *key;
+
+	g_rw_lock_writer_lock(&context->rcx_rwlock);
+
+	if (g_hash_table_contains(context->rcx_instances, instance->ri_path)) {
+		rpc_set_last_error(EEXIST, "Instance already exists", NULL);
+		g_rw_lock_writer_unlock(&context->rcx_rwlock);
+		return (-1);
+	}
+
+	ifaces = rpc_array_create();
+	g_hash_table_iter_init(&iter,
+	    rpc_instance_shape(instance)->ri_interfaces);
+	while (g_hash_table_iter_next(&iter, (gpointer)&key, NULL))
+		rpc_array_append_stolen_value(ifaces, rpc_string_create(key));
+
+	payload = rpc_object_pack("{s,v}",
+	    "path", instance->ri_path,
+	    "interfaces", ifaces);
+
+	rpc_context_emit_event(context, "/", RPC_DISCOVERABLE_INTERFACE,
+	    "instance_added", payload);
+
+	instance->ri_context = context;
+
+	instances = rpc_table_copy(context->rcx_instances);
+	g_hash_table_insert(instances, instance->ri_path, instance);
+	rpc_table_publish(&context->rcx_instances, instances);
+	rpc_index_insert(context, instance);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+	return (0);
+}
+
+void
+rpc_context_unregister_instance(rpc_context_t context, const char *path)
+{
+	GHashTable *instances;
+
+	g_rw_lock_writer_lock(&context->rcx_rwlock);
+
+	if (g_hash_table_contains(context->rcx_instances, path)) {
+		instances = rpc_table_copy(context->rcx_instances);
+		g_hash_table_remove(instances, path);
+		rpc_table_publish(&context->rcx_instances, instances);
+		rpc_index_remove(context, path);
+		rpc_context_emit_event(context, "/",
+		    RPC_DISCOVERABLE_INTERFACE, "instance_removed",
+		    rpc_string_create(path));
+	}
+
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+}
+
+int
+rpc_context_register_namespace(rpc_context_t context, const char *prefix,
+    rpc_instance_resolver_t resolver, rpc_instance_enumerator_t enumerator)
+{
+	struct rpc_namespace *other;
+	struct rpc_namespace *ns;
+	guint i;
+
+	if (!rpc_context_path_is_valid(prefix)) {
+		rpc_set_last_error(EINVAL, "Invalid path", NULL);
+		return (-1);
+	}
+
+	ns = g_malloc0(sizeof(*ns));
+	ns->rns_refcnt = 1;
+	ns->rns_prefix = g_strdup(strcmp(prefix, "/") == 0 ? "" : prefix);
+	ns->rns_resolver = Block_copy(resolver);
+	ns->rns_enumerator = enumerator != NULL ? Block_copy(enumerator) : NULL;
+
+	g_rw_lock_writer_lock(&context->rcx_rwlock);
+	for (i = 0; i < context->rcx_namespaces->len; i++) {
+		other = g_ptr_array_index(context->rcx_namespaces, i);
+		if (g_strcmp0(ns->rns_prefix, other->rns_prefix) == 0) {
+			g_rw_lock_writer_unlock(&context->rcx_rwlock);
+			rpc_namespace_release(ns);
+			rpc_set_last_error(EEXIST, "Namespace already exists",
+			    NULL);
+			return (-1);
+		}
+	}
+
+	g_ptr_array_add(context->rcx_namespaces, ns);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+	return (0);
+}
+
+void
+rpc_context_unregister_namespace(rpc_context_t context, const char *prefix)
+{
+	struct rpc_namespace *ns;
+	guint i;
+
+	if (strcmp(prefix, "/") == 0)
+		prefix = "";
+
+	g_rw_lock_writer_lock(&context->rcx_rwlock);
+	for (i = 0; i < context->rcx_namespaces->len; i++) {
+		ns = g_ptr_array_index(context->rcx_namespaces, i);
+		if (g_strcmp0(ns->rns_prefix, prefix) == 0) {
+			/* Lookups in progress hold their own reference */
+			g_ptr_array_remove_index_fast(context->rcx_namespaces,
+			    i);
+			break;
+		}
+	}
+
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+}
+
+int
+rpc_context_register_member(rpc_context_t context, const char *interface,
+    struct rpc_if_member *m)
+{
+
+	return (rpc_instance_register_member(context->rcx_root, interface, m));
+}
+
+int
+rpc_context_register_block(rpc_context_t context, const char *interface,
+    const char *name, void *arg, rpc_function_t func)
+{
+
+	return (rpc_instance_register_block(context->rcx_root, interface,
+	    name, arg, func));
+}
+
+int
+rpc_context_register_func(rpc_context_t context, const char *interface,
+    const char *name, void *arg, rpc_function_f func)
+{
+	rpc_function_t fn = ^(void *cookie, rpc_object_t args) {
+		return (func(cookie, args));
+	};
+
+	return (rpc_context_register_block(context, interface, name, arg, fn));
+}
+
+int
+rpc_context_unregister_member(rpc_context_t context, const char *interface,
+    const char *name)
+{
+
+	return (rpc_instance_unregister_member(context->rcx_root, interface,
+	    name));
+}
+
+/*
+ * The emitter thread is started by the first event, so contexts that
+ * never emit one don't pay for it.
+ */
+static void
+rpc_context_emit_push(struct rpc_context *context, void *item)
+{
+
+	if (g_once_init_enter(&context->rcx_emit_once)) {
+		context->rcx_emit_thread = g_thread_new("emitter", emit_events,
+		    context);
+		g_once_init_leave(&context->rcx_emit_once, 1);
+	}
+
+	g_async_queue_push(context->rcx_emit_queue, item);
+}
+
+/*
+ * Posts an event to the connections subscribed to it with a glob path,
+ * each of them once, skipping those that got it by its exact path
+ * already. Called with rcx_rwlock held.
+ */
+static void
+rpc_context_post_patterns_locked(rpc_context_t context, const char *path,
+    const char *interface, const char *name, struct rpc_shared_event *ev,
+    GHashTable *posted)
+{
+	struct rpc_subscription *pattern;
+	rpc_connection_t conn;
+	GHashTableIter iter;
+	GHashTableIter citer;
+	GHashTable *conns;
+	GHashTable *seen;
+
+	seen = g_hash_table_new(NULL, NULL);
+	g_hash_table_iter_init(&iter, context->rcx_event_patterns);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&pattern,
+	    (gpointer *)&conns)) {
+		if (g_strcmp0(pattern->rsu_interface, interface) != 0 ||
+		    g_strcmp0(pattern->rsu_name, name) != 0)
+			continue;
+
+		if (path == NULL ||
+		    !g_pattern_match_simple(pattern->rsu_path, path))
+			continue;
+
+		g_hash_table_iter_init(&citer, conns);
+		while (g_hash_table_iter_next(&citer, (gpointer *)&conn,
+		    NULL)) {
+			if (posted != NULL && g_hash_table_contains(posted,
+			    conn))
+				continue;
+
+			if (g_hash_table_add(seen, conn))
+				rpc_connection_post_event(conn, ev);
+		}
+	}
+
+	g_hash_table_destroy(seen);
+}
+
+static gpointer
+emit_events(gpointer data)
+{
+	struct rpc_subscription key;
+	struct rpc_shared_event *ev;
+	struct emit_item *item;
+	rpc_context_t context = data;
+	GAsyncQueue *q = context->rcx_emit_queue;
+	rpc_connection_t conn;
+	GHashTableIter iter;
+	GHashTable *conns;
+	gint64 timeout;
+	gint64 fair;
+
+	for (;;) {
+		timeout = rpc_context_flush_properties(context);
+		fair = rpc_context_fair_tick(context);
+		if (fair >= 0 && (timeout < 0 || fair < timeout))
+			timeout = fair;
+
+		if (timeout < 0)
+			item = g_async_queue_pop(q);
+		else
+			item = g_async_queue_timeout_pop(q, (guint64)timeout);
+
+		if (item == NULL)
+			continue;
+
+		if (item->context == NULL)
+			break;
+
+		/* Just a wakeup, a property has been held back */
+		if (item->path == NULL) {
+			g_free(item);
+			continue;
+		}
+
+		ev = rpc_shared_event_create(item->path, item->interface,
+		    item->name, item->args);
+
+		key.rsu_path = item->path;
+		key.rsu_interface = item->interface;
+		key.rsu_name = item->name;
+
+		g_rw_lock_reader_lock(&context->rcx_rwlock);
+		conns = g_hash_table_lookup(context->rcx_event_watchers, &key);
+		if (conns != NULL) {
+			g_hash_table_iter_init(&iter, conns);
+			while (g_hash_table_iter_next(&iter, (gpointer)&conn,
+			    NULL))
+				rpc_connection_post_event(conn, ev);
+		}
+
+		if (g_hash_table_size(context->rcx_event_patterns) > 0)
+			rpc_context_post_patterns_locked(context, item->path,
+			    item->interface, item->name, ev, conns);
+
+		g_rw_lock_reader_unlock(&context->rcx_rwlock);
+		rpc_shared_event_release(ev);
+		rpc_release(item->args);
+		g_free(item->path);
+		g_free(item->interface);
+		g_free(item->name);
+		g_free(item);
+	}
+	return (NULL);
+}
+
+/*
+ * Sends out the held back property changes that are due. Returns the
+ * number of microseconds until the next one is, or -1 if there are none
+ * left.
+ */
+static gint64
+rpc_context_flush_properties(struct rpc_context *context)
+{
+	struct rpc_property_coalesce *cl;
+	GPtrArray *due = NULL;
+	rpc_object_t value;
+	gint64 next = -1;
+	gint64 now;
+	guint i;
+
+	now = g_get_monotonic_time();
+	g_mutex_lock(&context->rcx_coalesce_mtx);
+	for (i = 0; i < context->rcx_coalesce_due->len;) {
+		cl = g_ptr_array_index(context->rcx_coalesce_due, i);
+		if (cl->rcl_due > now) {
+			if (next < 0 || cl->rcl_due - now < next)
+				next = cl->rcl_due - now;
+
+			i++;
+			continue;
+		}
+
+		if (due == NULL)
+			due = g_ptr_array_new();
+
+		g_ptr_array_add(due, cl);
+		g_ptr_array_remove_index_fast(context->rcx_coalesce_due, i);
+	}
+
+	g_mutex_unlock(&context->rcx_coalesce_mtx);
+	if (due == NULL)
+		return (next);
+
+	for (i = 0; i < due->len; i++) {
+		cl = g_ptr_array_index(due, i);
+		g_mutex_lock(&cl->rcl_instance->ri_mtx);
+		value = cl->rcl_pending;
+		cl->rcl_pending = NULL;
+		cl->rcl_due = 0;
+
+		if (value != NULL && cl->rcl_compare &&
+		    rpc_equal(value, cl->rcl_last)) {
+			rpc_release(value);
+			value = NULL;
+		}
+
+		if (value != NULL) {
+			cl->rcl_last_sent = now;
+			if (cl->rcl_compare) {
+				rpc_release(cl->rcl_last);
+				cl->rcl_last = rpc_retain(value);
+			}
+		}
+
+		g_mutex_unlock(&cl->rcl_instance->ri_mtx);
+
+		if (value != NULL) {
+			rpc_instance_emit_changed(cl->rcl_instance,
+			    cl->rcl_interface, cl->rcl_name, value);
+			rpc_release(value);
+		}
+
+		rpc_instance_release(cl->rcl_instance);
+	}
+
+	g_ptr_array_free(due, true);
+	return (next);
+}
+
+void
+rpc_context_add_event_watcher(rpc_context_t context, const char *path,
+    const char *interface, const char *name, rpc_connection_t conn)
+{
+	struct rpc_subscription key = {
+		.rsu_path = (char *)path,
+		.rsu_interface = (char *)interface,
+		.rsu_name = (char *)name
+	};
+	struct rpc_subscription *event;
+	GHashTable *watchers;
+	GHashTable *conns;
+
+	watchers = rpc_subscription_is_pattern(path) ?
+	    context->rcx_event_patterns : context->rcx_event_watchers;
+
+	g_rw_lock_writer_lock(&context->rcx_rwlock);
+	conns = g_hash_table_lookup(watchers, &key);
+	if (conns == NULL) {
+		event = g_malloc0(sizeof(*event));
+		event->rsu_path = g_strdup(path);
+		event->rsu_interface = g_strdup(interface);
+		event->rsu_name = g_strdup(name);
+		conns = g_hash_table_new(NULL, NULL);
+		g_hash_table_insert(watchers, event, conns);
+	}
+
+	g_hash_table_add(conns, conn);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+}
+
+void
+rpc_context_remove_event_watcher(rpc_context_t context, const char *path,
+    const char *interface, const char *name, rpc_connection_t conn)
+{
+	struct rpc_subscription key = {
+		.rsu_path = (char *)path,
+		.rsu_interface = (char *)interface,
+		.rsu_name = (char *)name
+	};
+	GHashTable *watchers;
+	GHashTable *conns;
+
+	watchers = rpc_subscription_is_pattern(path) ?
+	    context->rcx_event_patterns : context->rcx_event_watchers;
+
+	g_rw_lock_writer_lock(&context->rcx_rwlock);
+	conns = g_hash_table_lookup(watchers, &key);
+	if (conns != NULL) {
+		g_hash_table_remove(conns, conn);
+		if (g_hash_table_size(conns) == 0)
+			g_hash_table_remove(watchers, &key);
+	}
+
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+}
+
+void
+rpc_context_emit_event(rpc_context_t context, const char *path,
+    const char *interface, const char *name, rpc_object_t args)
+{
+	struct emit_item *item = g_malloc(sizeof (*item));
+
+	item->context = context;
+	item->path = g_strdup(path);
+	item->interface = g_strdup(interface);
+	item->name = g_strdup(name);
+	item->args = args;
+
+	rpc_context_emit_push(context, item);
+}
+
+inline void *
+rpc_function_get_arg(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_m_arg);
+}
+
+inline rpc_connection_t
+rpc_function_get_connection(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (rpc_connection_is_open(call->rc_conn) ? call->rc_conn : NULL);
+}
+
+inline rpc_context_t
+rpc_function_get_context(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_context);
+}
+
+inline rpc_instance_t
+rpc_function_get_instance(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_instance);
+}
+
+const char *
+rpc_function_get_name(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_method_name);
+}
+
+const char *
+rpc_function_get_path(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_path);
+}
+
+const char *
+rpc_function_get_interface(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_interface);
+}
+
+const char *
+rpc_function_get_etag(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_etag);
+}
+
+void
+rpc_function_set_etag(void *cookie, const char *etag)
+{
+	struct rpc_call *call = cookie;
+
+	g_free(call->rc_new_etag);
+	call->rc_new_etag = g_strdup(etag);
+}
+
+/*
+ * Whether an array result is worth sending in slices. Peers that don't
+ * support them, and transports passing objects over as they are, get
+ * it in one piece. Sizes are only added up until the threshold is
+ * reached, so looking at small results costs little.
+ */
+static bool
+rpc_function_should_chunk(struct rpc_call *call, rpc_object_t object)
+{
+	rpc_connection_t conn = call->rc_conn;
+	struct rpc_array_iter iter;
+	rpc_object_t value;
+	size_t size = 0;
+
+	if (conn->rco_chunk_threshold == 0 || object == NULL ||
+	    rpc_get_type(object) != RPC_TYPE_ARRAY || call->rc_streaming ||
+	    (conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) != 0 ||
+	    !g_atomic_int_get(&conn->rco_chunked_results))
+		return (false);
+
+	rpc_array_iter_init(object, &iter);
+	while (rpc_array_iter_next(&iter, NULL, &value)) {
+		size += rpc_object_size_hint(value);
+		if (size > conn->rco_chunk_threshold)
+			return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * Sends an array result as a stream of slices of about RPC_CHUNK_SIZE
+ * bytes, which the caller puts back together. Every slice waits for
+ * the caller to make room for it, like any other fragment. Closes the
+ * call, whichever way it goes.
+ */
+static void
+rpc_function_respond_chunked(struct rpc_call *call, rpc_object_t object)
+{
+	struct rpc_array_iter iter;
+	rpc_object_t chunk = NULL;
+	rpc_object_t value;
+	size_t size = 0;
+
+	call->rc_chunked = true;
+	if (rpc_function_start_stream_impl(call) != 0)
+		goto fail;
+
+	rpc_array_iter_init(object, &iter);
+	while (rpc_array_iter_next(&iter, NULL, &value)) {
+		if (chunk == NULL)
+			chunk = rpc_array_create();
+
+		rpc_array_append_value(chunk, value);
+		size += rpc_object_size_hint(value);
+		if (size < RPC_CHUNK_SIZE)
+			continue;
+
+		size = 0;
+		if (rpc_function_yield_impl(call, chunk) != 0)
+			goto fail;
+
+		chunk = NULL;
+	}
+
+	if (chunk != NULL && rpc_function_yield_impl(call, chunk) != 0)
+		goto fail;
+
+	rpc_release(object);
+	rpc_function_end_impl(call);
+	return;
+
+fail:
+	rpc_release(object);
+	rpc_connection_close_inbound_call(call);
+}
+
+void
+rpc_function_respond(void *cookie, rpc_object_t object)
+{
+	struct rpc_call *call = cookie;
+
+	call->rc_conn->rco_fn_cbs.rcf_fn_respond(cookie, object);
+}
+
+void
+rpc_function_respond_impl(void *cookie, rpc_object_t object)
+{
+	struct rpc_call *call = cookie;
+
+	g_assert(call->rc_type == RPC_INBOUND_CALL);
+	if (!call->rc_responded && !call->rc_conditional &&
+	    rpc_function_should_chunk(call, object)) {
+		rpc_function_respond_chunked(call, object);
+		return;
+	}
+
+	if (!call->rc_responded) {
+		if (call->rc_conditional)
+			rpc_connection_send_tagged_response(call, object);
+		else
+			rpc_connection_send_response(call->rc_conn,
+			    call->rc_id, object);
+	}
+
+	rpc_connection_close_inbound_call(call);
+}
+
+void
+rpc_function_error(void *cookie, int code, const char *message, ...)
+{
+	struct rpc_call *call = cookie;
+	va_list ap;
+
+	va_start(ap, message);
+	call->rc_conn->rco_fn_cbs.rcf_fn_error(cookie, code, message, ap);
+	va_end(ap);
+}
+
+void
+rpc_function_error_impl(void *cookie, int code, const char *message, va_list ap)
+{
+	struct rpc_call *call = cookie;
+	char *msg;
+
+	g_vasprintf(&msg, message, ap);
+	rpc_connection_flush_fragments(call);
+	rpc_connection_send_err(call->rc_conn, call->rc_id, code, msg);
+	call->rc_responded = true;
+	call->rc_failed = true;
+	g_free(msg);
+}
+
+void
+rpc_function_error_ex(void *cookie, rpc_object_t exception)
+{
+	struct rpc_call *call = cookie;
+
+	call->rc_conn->rco_fn_cbs.rcf_fn_error_ex(cookie, exception);
+}
+
+void
+rpc_function_error_ex_impl(void *cookie, rpc_object_t exception)
+{
+	struct rpc_call *call = cookie;
+
+	rpc_connection_flush_fragments(call);
+	rpc_connection_send_errx(call->rc_conn, call->rc_id, exception);
+	call->rc_responded = true;
+	call->rc_failed = true;
+}
+
+int
+rpc_function_start_stream(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_conn->rco_fn_cbs.rcf_fn_start_stream(cookie));
+}
+
+int
+rpc_function_start_stream_impl(void *cookie)
+{
+	struct rpc_call *call = cookie;
+	struct rpc_context *context = call->rc_context;
+
+	g_mutex_lock(&call->rc_mtx);
+
+	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
+	       !call->rc_aborted) {
+		g_mutex_unlock(&call->rc_mtx);
+		notify_wait(&call->rc_notify);
+		g_mutex_lock(&call->rc_mtx);
+	}
+
+	if (call->rc_aborted) {
+		if (!call->rc_ended) {
+			rpc_function_error(call, ECONNRESET, "Call aborted");
+			call->rc_ended = true;
+		}
+
+		g_mutex_unlock(&call->rc_mtx);
+		return (-1);
+	}
+
+	if (context->rcx_pre_call_hook != NULL) {
+
+	}
+	rpc_connection_send_start_stream(call->rc_conn, call->rc_id,
+	    call->rc_producer_seqno, call->rc_chunked);
+
+	call->rc_producer_seqno++;
+	call->rc_streaming = true;
+	if (call->rc_span.rsc_sampled)
+		rpc_span_stream_start(call);
+
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+int
+rpc_function_yield(void *cookie, rpc_object_t fragment)
+{
+	struct rpc_call *call = cookie;
+
+	/* Fragments the caller's query filters out are dropped here */
+	if (call->rc_query != NULL) {
+		fragment = rpc_query_pushdown_filter(call->rc_query, fragment);
+		if (fragment == NULL)
+			return (0);
+	}
+
+	return (call->rc_conn->rco_fn_cbs.rcf_fn_yield(cookie, fragment));
+}
+
+int
+rpc_function_yield_async(void *cookie, rpc_object_t fragment,
+    rpc_ready_handler_t handler)
+{
+	struct rpc_call *call = cookie;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (!call->rc_aborted && !rpc_call_can_yield(call)) {
+		if (call->rc_ready_handler != NULL)
+			Block_release(call->rc_ready_handler);
+
+		call->rc_ready_handler = Block_copy(handler);
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_set_last_errorf(EAGAIN, "No room for the fragment yet");
+		return (-1);
+	}
+
+	/* Only this producer takes room away, so it's still there */
+	g_mutex_unlock(&call->rc_mtx);
+	return (rpc_function_yield(cookie, fragment));
+}
+
+int
+rpc_function_set_output_buffer(void *cookie, size_t max_items,
+    size_t max_bytes)
+{
+	struct rpc_call *call = cookie;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_ended || call->rc_end_pending) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_set_last_errorf(EINVAL, "Call has already ended");
+		return (-1);
+	}
+
+	call->rc_outbuf_max = max_items;
+	call->rc_outbuf_max_bytes = max_bytes;
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+/*
+ * Whether a fragment yielded now can be sent or buffered without
+ * waiting. Called with rc_mtx held.
+ */
+bool
+rpc_call_can_yield(struct rpc_call *call)
+{
+
+	if (g_queue_is_empty(&call->rc_outbuf) &&
+	    call->rc_producer_seqno < call->rc_consumer_seqno)
+		return (true);
+
+	if (call->rc_outbuf_max == 0 && call->rc_outbuf_max_bytes == 0)
+		return (false);
+
+	if (call->rc_outbuf_max != 0 &&
+	    g_queue_get_length(&call->rc_outbuf) >= call->rc_outbuf_max)
+		return (false);
+
+	return (call->rc_outbuf_max_bytes == 0 ||
+	    call->rc_outbuf_bytes < call->rc_outbuf_max_bytes);
+}
+
+int
+rpc_function_yield_impl(void *cookie, rpc_object_t fragment)
+{
+	struct rpc_call *call = cookie;
 	struct rpc_context *context = call->rc_context;
 
-	g_mutex_lock(&call->rc_mtx);
+	g_mutex_lock(&call->rc_mtx);
+
+	while (!rpc_call_can_yield(call) && !call->rc_aborted) {
+		g_mutex_unlock(&call->rc_mtx);
+		notify_wait(&call->rc_notify);
+		g_mutex_lock(&call->rc_mtx);
+	}
+
+	if (call->rc_aborted) {
+		if (!call->rc_ended) {
+			rpc_function_error(call, ECONNRESET, "Call aborted");
+			call->rc_ended = true;
+		}
+
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_release(fragment);
+		return (-1);
+	}
+
+	if (context->rcx_pre_call_hook != NULL) {
+
+	}
+
+	/* Out of credits, or behind fragments already waiting for some */
+	if (!g_queue_is_empty(&call->rc_outbuf) ||
+	    call->rc_producer_seqno == call->rc_consumer_seqno) {
+		call->rc_outbuf_bytes += rpc_object_size_hint(fragment);
+		g_queue_push_tail(&call->rc_outbuf, fragment);
+	} else {
+		/* Send the batch right away if there's no window left after */
+		rpc_connection_queue_fragment(call, call->rc_producer_seqno,
+		    fragment,
+		    call->rc_producer_seqno + 1 == call->rc_consumer_seqno);
+		call->rc_producer_seqno++;
+	}
+
+	call->rc_streaming = true;
+	if (call->rc_span.rsc_sampled)
+		rpc_span_stream_start(call);
+
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+rpc_object_t
+rpc_function_next_input(void *cookie)
+{
+	struct rpc_call *call = cookie;
+	rpc_object_t item;
+
+	if (!call->rc_upload)
+		return (NULL);
+
+	g_mutex_lock(&call->rc_mtx);
+	while (g_queue_is_empty(call->rc_input) && !call->rc_upload_ended &&
+	    !call->rc_aborted) {
+		g_mutex_unlock(&call->rc_mtx);
+		notify_wait(&call->rc_notify);
+		g_mutex_lock(&call->rc_mtx);
+	}
+
+	item = g_queue_pop_head(call->rc_input);
+	if (item != NULL &&
+	    ++call->rc_input_consumed == RPC_UPLOAD_WINDOW / 2) {
+		rpc_connection_send_upload_continue(call->rc_conn, call->rc_id,
+		    call->rc_input_consumed);
+		call->rc_input_consumed = 0;
+	}
+
+	g_mutex_unlock(&call->rc_mtx);
+	return (item);
+}
+
+int
+rpc_function_retain(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (rpc_connection_call_retain(call));
+}
+
+int
+rpc_function_release(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (rpc_connection_call_release(call));
+}
+
+void
+rpc_function_end(void *cookie)
+{
+	struct rpc_call *call = cookie;
+	GPtrArray *rest;
+	guint i;
+
+	if (call->rc_query != NULL) {
+		rest = rpc_query_pushdown_finish(call->rc_query);
+		for (i = 0; i < rest->len; i++) {
+			call->rc_conn->rco_fn_cbs.rcf_fn_yield(cookie,
+			    g_ptr_array_index(rest, i));
+		}
+
+		g_ptr_array_free(rest, true);
+	}
+
+	call->rc_conn->rco_fn_cbs.rcf_fn_end(cookie);
+}
+
+void
+rpc_function_end_impl(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	g_mutex_lock(&call->rc_mtx);
+
+	if (call->rc_end_pending) {
+		g_mutex_unlock(&call->rc_mtx);
+		return;
+	}
+
+	/* A buffered stream ends once the consumer has taken the rest */
+	if ((!g_queue_is_empty(&call->rc_outbuf) ||
+	    call->rc_producer_seqno == call->rc_consumer_seqno) &&
+	    (call->rc_outbuf_max != 0 || call->rc_outbuf_max_bytes != 0) &&
+	    !call->rc_aborted) {
+		call->rc_end_pending = true;
+		g_mutex_unlock(&call->rc_mtx);
+		return;
+	}
+
+	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
+	    !call->rc_aborted) {
+		g_mutex_unlock(&call->rc_mtx);
+		notify_wait(&call->rc_notify);
+		g_mutex_lock(&call->rc_mtx);
+	}
+
+	if (call->rc_aborted) {
+		if (!call->rc_ended && !call->rc_responded) {
+			rpc_function_error(call, ECONNRESET,
+			    "Call aborted");
+			call->rc_ended = true;
+		}
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_close_inbound_call(call);
+
+		return;
+	}
+
+	rpc_connection_flush_fragments(call);
+	if (!call->rc_ended)
+		rpc_connection_send_end(call->rc_conn, call->rc_id,
+		    call->rc_producer_seqno);
+
+	call->rc_producer_seqno++;
+	call->rc_streaming = true;
+	if (call->rc_span.rsc_sampled)
+		rpc_span_stream_start(call);
+
+	call->rc_ended = true;
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_connection_close_inbound_call(call);
+}
+
+void
+rpc_function_kill(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	call->rc_conn->rco_fn_cbs.rcf_fn_kill(cookie);
+}
+
+void
+rpc_function_kill_impl(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	g_mutex_lock(&call->rc_mtx);
+	call->rc_aborted = true;
+	notify_signal(&call->rc_notify);
+	g_mutex_unlock(&call->rc_mtx);
+}
+
+bool
+rpc_function_should_abort(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	/* Nothing more is going to be sent anyway */
+	if (call->rc_query != NULL && rpc_query_pushdown_done(call->rc_query))
+		return (true);
+
+	return (call->rc_conn->rco_fn_cbs.rcf_should_abort(cookie));
+}
+
+rpc_query_plan_t
+rpc_function_get_query(void *cookie, struct rpc_query_params *params)
+{
+	struct rpc_call *call = cookie;
+
+	if (call->rc_query == NULL)
+		return (NULL);
+
+	return (rpc_query_pushdown_take(call->rc_query, params));
+}
+
+bool rpc_function_should_abort_impl(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_aborted || rpc_call_deadline_passed(call));
+}
+
+void rpc_function_set_async_abort_handler(void *cookie,
+    rpc_abort_handler_t handler)
+{
+	struct rpc_call *call = cookie;
+
+	call->rc_conn->rco_fn_cbs.rcf_set_async_abort_handler(cookie, handler);
+}
+
+void rpc_function_set_async_abort_handler_impl(void *cookie,
+    rpc_abort_handler_t handler)
+{
+	struct rpc_call *call = cookie;
+
+	if (call->rc_abort_handler != NULL)
+		Block_release(call->rc_abort_handler);
+
+	call->rc_abort_handler = Block_copy(handler);
+}
+
+rpc_instance_t
+rpc_instance_new(void *arg, const char *fmt, ...)
+{
+	va_list ap;
+	rpc_instance_t result;
+	char *path;
+
+	va_start(ap, fmt);
+	path = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	if (!rpc_context_path_is_valid(path)) {
+		rpc_set_last_error(EINVAL, "Invalid path", NULL);
+		g_free(path);
+		return (NULL);
+	}
+
+	result = g_malloc0(sizeof(*result));
+	g_mutex_init(&result->ri_mtx);
+	g_cond_init(&result->ri_cv);
+	g_rw_lock_init(&result->ri_rwlock);
+	result->ri_path = path;
+	result->ri_interfaces = g_hash_table_new(g_str_hash, g_str_equal);
+	result->ri_arg = arg;
+
+	rpc_instance_register_interface(result, RPC_DISCOVERABLE_INTERFACE,
+	    rpc_discoverable_vtable, NULL);
+
+	rpc_instance_register_interface(result, RPC_INTROSPECTABLE_INTERFACE,
+	    rpc_introspectable_vtable, NULL);
+
+	rpc_instance_register_interface(result, RPC_DEFAULT_INTERFACE,
+	    NULL, NULL);
+
+	rpc_instance_register_interface(result, RPC_OBSERVABLE_INTERFACE,
+	    rpc_observable_vtable, NULL);
+
+	return (result);
+}
+
+rpc_instance_t
+rpc_instance_new_shared(rpc_instance_t shape, void *arg, const char *fmt, ...)
+{
+	va_list ap;
+	rpc_instance_t result;
+	char *path;
+
+	va_start(ap, fmt);
+	path = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	if (!rpc_context_path_is_valid(path)) {
+		rpc_set_last_error(EINVAL, "Invalid path", NULL);
+		g_free(path);
+		return (NULL);
+	}
+
+	result = g_malloc0(sizeof(*result));
+	g_mutex_init(&result->ri_mtx);
+	g_cond_init(&result->ri_cv);
+	g_rw_lock_init(&result->ri_rwlock);
+	result->ri_path = path;
+	result->ri_shape = rpc_instance_shape(shape);
+	result->ri_arg = arg;
+	return (result);
+}
+
+void
+rpc_instance_set_description(rpc_instance_t instance, const char *fmt, ...)
+{
+	va_list ap;
+	char *description;
+
+	va_start(ap, fmt);
+	description = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	instance->ri_descr = description;
+}
+
+void *
+rpc_instance_get_arg(rpc_instance_t instance)
+{
+
+	g_assert_nonnull(instance);
+
+	return (instance->ri_arg);
+}
+
+const char *
+rpc_instance_get_path(rpc_instance_t instance)
+{
+
+	g_assert_nonnull(instance);
+
+	return (instance->ri_path);
+}
+
+void
+rpc_instance_free(rpc_instance_t instance)
+{
+	struct tp_item *item;
+
+	g_assert_nonnull(instance);
+	item = g_malloc(sizeof(*item));
+
+	g_mutex_lock(&instance->ri_mtx);
+	item->type = TYPE_INSTANCE;
+	item->data = instance;
+	instance->ri_destroyed = true;
+
+	/* wait on any outstanding calls to complete in another thread. */
+	item->qos = NULL;
+	rpc_scheduler_push(instance->ri_context->rcx_scheduler, item,
+	    RPC_PRIORITY_NORMAL);
+	g_mutex_unlock(&instance->ri_mtx);
+
+}
+
+struct rpc_if_member *
+rpc_instance_find_member(rpc_instance_t instance, const char *interface,
+    const char *name)
+{
+	struct rpc_interface_priv *iface;
+	struct rpc_if_member *result;
+
+	if (name == NULL)
+		return (NULL);
+
+	if (interface == NULL)
+		interface = RPC_DEFAULT_INTERFACE;
+
+	rpc_epoch_enter();
+	iface = g_hash_table_lookup(
+	    g_atomic_pointer_get(&rpc_instance_shape(instance)->ri_interfaces),
+	    interface);
+
+	if (iface == NULL) {
+		debugf("member %s not found on %s\n", name,
+		    interface);
+		rpc_epoch_exit();
+		return (NULL);
+	}
+
+	result = g_hash_table_lookup(g_atomic_pointer_get(&iface->rip_members),
+	    name);
+	rpc_epoch_exit();
+	return (result);
+}
+
+static struct rpc_interface_priv *
+rpc_instance_find_interface(rpc_instance_t instance, const char *interface)
+{
+	struct rpc_interface_priv *result;
+
+	rpc_epoch_enter();
+	result = g_hash_table_lookup(
+	    g_atomic_pointer_get(&rpc_instance_shape(instance)->ri_interfaces),
+	    interface);
+	rpc_epoch_exit();
+	return (result);
+}
+
+bool
+rpc_instance_has_interface(rpc_instance_t instance, const char *interface)
+{
+
+	bool result;
+
+	g_assert_nonnull(interface);
+
+	rpc_epoch_enter();
+	result = (bool)g_hash_table_contains(
+	    g_atomic_pointer_get(&rpc_instance_shape(instance)->ri_interfaces),
+	    interface);
+	rpc_epoch_exit();
+	return (result);
+}
+
+int
+rpc_instance_register_interface(rpc_instance_t instance,
+    const char *interface, const struct rpc_if_member *vtable, void *arg)
+{
+	struct rpc_interface_priv *priv;
+	const struct rpc_if_member *member;
+	GHashTable *interfaces;
+
+	g_assert_nonnull(interface);
+
+	if (instance->ri_shape != NULL) {
+		rpc_set_last_error(EINVAL,
+		    "Cannot add interfaces to a shared instance", NULL);
+		return (-1);
+	}
+
+	if (rpc_instance_has_interface(instance, interface))
+		return (0);
+
+	priv = g_malloc0(sizeof(*priv));
+	g_rw_lock_init(&priv->rip_rwlock);
+	priv->rip_members = g_hash_table_new(g_str_hash, g_str_equal);
+	priv->rip_arg = arg;
+	priv->rip_name = g_strdup(interface);
+
+	g_rw_lock_writer_lock(&instance->ri_rwlock);
+	interfaces = rpc_table_copy(instance->ri_interfaces);
+	g_hash_table_insert(interfaces, (gpointer)priv->rip_name, priv);
+	rpc_table_publish(&instance->ri_interfaces, interfaces);
+	g_rw_lock_writer_unlock(&instance->ri_rwlock);
+
+	if (vtable != NULL) {
+		for (member = &vtable[0]; member->rim_name != NULL; member++)
+			rpc_instance_register_member(instance, interface, 
+			    member);
+	}
+
+	rpc_instance_emit_event(instance, RPC_INTROSPECTABLE_INTERFACE,
+	    "interface_added", rpc_string_create(interface));
+
+	return (0);
+}
+
+void
+rpc_instance_unregister_interface(rpc_instance_t instance,
+    const char *interface)
+{
+	struct rpc_interface_priv *priv;
+	GHashTable *interfaces;
+
+	if (instance->ri_shape != NULL)
+		return;
+
+	g_rw_lock_writer_lock(&instance->ri_rwlock);
+	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
+	if (priv != NULL) {
+		interfaces = rpc_table_copy(instance->ri_interfaces);
+		g_hash_table_remove(interfaces, interface);
+		rpc_table_publish(&instance->ri_interfaces, interfaces);
+		rpc_epoch_retire(priv, (GDestroyNotify)rpc_interface_free);
+	}
+
+	g_rw_lock_writer_unlock(&instance->ri_rwlock);
+
+	rpc_instance_emit_event(instance, RPC_INTROSPECTABLE_INTERFACE,
+	    "interface_removed", rpc_string_create(interface));
+}
+
+void
+rpc_interface_free(struct rpc_interface_priv *priv)
+{
+	GHashTableIter iter;
+	struct rpc_if_member *member;
+
+	g_hash_table_iter_init(&iter, priv->rip_members);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&member))
+		rpc_if_member_free(member);
+
+	g_hash_table_destroy(priv->rip_members);
+	g_rw_lock_clear(&priv->rip_rwlock);
+	g_free((char *)priv->rip_name);
+	g_free(priv->rip_description);
+	g_free(priv);
+}
+
+static void
+rpc_interface_free_cb(gpointer key __unused, gpointer value,
+    gpointer user_data __unused)
+{
+
+	rpc_interface_free(value);
+}
+
+static rpc_instance_t
+rpc_instance_shape(rpc_instance_t instance)
+{
+
+	return (instance->ri_shape != NULL ? instance->ri_shape : instance);
+}
+
+static void
+rpc_instance_free_interfaces(rpc_instance_t instance)
+{
+
+	/* The shape's interfaces are the shape's to free */
+	if (instance->ri_shape != NULL)
+		return;
+
+	g_hash_table_foreach(instance->ri_interfaces, rpc_interface_free_cb,
+	    NULL);
+	g_hash_table_destroy(instance->ri_interfaces);
+}
+
+static void
+rpc_instance_destroy(gpointer data)
+{
+	rpc_instance_t instance = data;
+
+	if (instance->ri_coalesce != NULL)
+		g_hash_table_destroy(instance->ri_coalesce);
+
+	if (instance->ri_deltas != NULL)
+		g_hash_table_destroy(instance->ri_deltas);
+
+	g_cond_clear(&instance->ri_cv);
+	g_mutex_clear(&instance->ri_mtx);
+	g_free(instance->ri_path);
+	g_free(instance);
+}
+
+/*
+ * The lookup tables are copied on write and swapped in whole, so that
+ * readers never need a lock. Values aren't owned by the tables; what's
+ * taken out of them has to be retired separately.
+ */
+static GHashTable *
+rpc_table_copy(GHashTable *table)
+{
+	GHashTableIter iter;
+	GHashTable *result;
+	gpointer key;
+	gpointer value;
+
+	result = g_hash_table_new(g_str_hash, g_str_equal);
+	g_hash_table_iter_init(&iter, table);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		g_hash_table_insert(result, key, value);
+
+	return (result);
+}
+
+static void
+rpc_table_publish(GHashTable **tablep, GHashTable *table)
+{
+	GHashTable *old = *tablep;
+
+	g_atomic_pointer_set(tablep, table);
+	rpc_epoch_retire(old, (GDestroyNotify)g_hash_table_unref);
+}
+
+/*
+ * rcx_index holds the registered instances sorted by path, so that
+ * a subtree is a contiguous run of it. Same rules as the tables.
+ */
+static guint
+rpc_index_lower_bound(GPtrArray *index, const char *path)
+{
+	rpc_instance_t instance;
+	guint lo = 0;
+	guint hi = index->len;
+	guint mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		instance = g_ptr_array_index(index, mid);
+		if (strcmp(instance->ri_path, path) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static void
+rpc_index_insert(rpc_context_t context, rpc_instance_t instance)
+{
+	GPtrArray *old = context->rcx_index;
+	GPtrArray *index;
+	guint pos;
+	guint i;
+
+	pos = rpc_index_lower_bound(old, instance->ri_path);
+	index = g_ptr_array_sized_new(old->len + 1);
+	for (i = 0; i < pos; i++)
+		g_ptr_array_add(index, g_ptr_array_index(old, i));
+
+	g_ptr_array_add(index, instance);
+	for (i = pos; i < old->len; i++)
+		g_ptr_array_add(index, g_ptr_array_index(old, i));
+
+	g_atomic_pointer_set(&context->rcx_index, index);
+	rpc_epoch_retire(old, (GDestroyNotify)g_ptr_array_unref);
+}
+
+static void
+rpc_index_remove(rpc_context_t context, const char *path)
+{
+	GPtrArray *old = context->rcx_index;
+	GPtrArray *index;
+	guint pos;
+	guint i;
+
+	pos = rpc_index_lower_bound(old, path);
+	index = g_ptr_array_sized_new(old->len);
+	for (i = 0; i < old->len; i++) {
+		if (i != pos)
+			g_ptr_array_add(index, g_ptr_array_index(old, i));
+	}
+
+	g_atomic_pointer_set(&context->rcx_index, index);
+	rpc_epoch_retire(old, (GDestroyNotify)g_ptr_array_unref);
+}
+
+void
+rpc_if_member_free(struct rpc_if_member *member)
+{
+
+	if (member->rim_type == RPC_MEMBER_METHOD) {
+		if (member->rim_method.rm_block != NULL)
+			Block_release(member->rim_method.rm_block);
+	}
+
+	if (member->rim_type == RPC_MEMBER_PROPERTY) {
+		if (member->rim_property.rp_getter != NULL)
+			Block_release(member->rim_property.rp_getter);
+
+		if (member->rim_property.rp_setter != NULL)
+			Block_release(member->rim_property.rp_setter);
+	}
+
+	g_free((void *)member->rim_name);
+	g_free(member);
+}
+
+int rpc_instance_register_member(rpc_instance_t instance, const char *interface,
+    const struct rpc_if_member *member)
+{
+	struct rpc_interface_priv *priv;
+	struct rpc_if_member *copy;
+	struct rpc_if_member *old;
+	GHashTable *members;
+
+	if (interface == NULL)
+		interface = RPC_DEFAULT_INTERFACE;
+
+	priv = rpc_instance_find_interface(instance, interface);
+	if (priv == NULL) {
+		rpc_set_last_error(ENOENT, "Interface not found", NULL);
+		return (-1);
+	}
+
+	copy = g_memdup(member, sizeof(*member));
+	copy->rim_name = g_strdup(member->rim_name);
+
+	if (copy->rim_type == RPC_MEMBER_METHOD) {
+		copy->rim_method.rm_block = Block_copy(
+		    copy->rim_method.rm_block);
+
+		if (copy->rim_method.rm_arg == NULL)
+			copy->rim_method.rm_arg = priv->rip_arg;
+	}
+
+	if (copy->rim_type == RPC_MEMBER_PROPERTY) {
+		if (copy->rim_property.rp_getter != NULL) {
+			copy->rim_property.rp_getter = Block_copy(
+			    copy->rim_property.rp_getter);
+		}
+
+		if (copy->rim_property.rp_setter != NULL) {
+			copy->rim_property.rp_setter = Block_copy(
+			    copy->rim_property.rp_setter);
+		}
+
+		if (copy->rim_property.rp_arg == NULL)
+			copy->rim_property.rp_arg = priv->rip_arg;
+
+	}
+
+	g_rw_lock_writer_lock(&priv->rip_rwlock);
+	old = g_hash_table_lookup(priv->rip_members, copy->rim_name);
+	members = rpc_table_copy(priv->rip_members);
+	g_hash_table_insert(members, (gpointer)copy->rim_name, copy);
+	rpc_table_publish(&priv->rip_members, members);
+	g_rw_lock_writer_unlock(&priv->rip_rwlock);
+
+	if (old != NULL)
+		rpc_epoch_retire(old, (GDestroyNotify)rpc_if_member_free);
+
+	return (0);
+}
+
+int
+rpc_instance_register_block(rpc_instance_t instance, const char *interface,
+    const char *name, void *arg, rpc_function_t func)
+{
+	struct rpc_if_member member;
+
+	member.rim_name = name;
+	member.rim_type = RPC_MEMBER_METHOD;
+	member.rim_method.rm_block = func;
+	member.rim_method.rm_arg = arg;
+	member.rim_method.rm_flags = 0;
+
+	return (rpc_instance_register_member(instance, interface, &member));
+}
+
+int
+rpc_instance_register_inline_func(rpc_instance_t instance,
+    const char *interface, const char *name, void *arg, rpc_function_f func)
+{
+	struct rpc_if_member member;
+
+	member.rim_name = name;
+	member.rim_type = RPC_MEMBER_METHOD;
+	member.rim_method.rm_block = RPC_FUNCTION(func);
+	member.rim_method.rm_arg = arg;
+	member.rim_method.rm_flags = RPC_METHOD_INLINE;
+
+	return (rpc_instance_register_member(instance, interface, &member));
+}
+
+int
+rpc_instance_set_method_flags(rpc_instance_t instance, const char *interface,
+    const char *name, int flags)
+{
+	struct rpc_if_member *member;
+
+	member = rpc_instance_find_member(instance, interface, name);
+	if (member == NULL || member->rim_type != RPC_MEMBER_METHOD) {
+		rpc_set_last_error(ENOENT, "Method not found", NULL);
+		return (-1);
+	}
+
+	g_atomic_int_set(&member->rim_method.rm_flags, flags);
+	return (0);
+}
+
+int
+rpc_instance_register_func(rpc_instance_t instance, const char *interface,
+    const char *name, void *arg, rpc_function_f func)
+{
+	return (rpc_instance_register_block(instance, interface, name, arg,
+	    RPC_FUNCTION(func)));
+}
+
+int
+rpc_instance_unregister_member(rpc_instance_t instance, const char *interface,
+    const char *name)
+{
+	struct rpc_interface_priv *priv;
+	struct rpc_if_member *member;
+	GHashTable *members;
+
+	g_assert_nonnull(name);
+
+	if (interface == NULL)
+		interface = RPC_DEFAULT_INTERFACE;
+
+	priv = rpc_instance_find_interface(instance, interface);
+	if (priv == NULL) {
+		rpc_set_last_error(ENOENT, "Interface not found", NULL);
+		return (-1);
+	}
+
+	g_rw_lock_writer_lock(&priv->rip_rwlock);
+	member = g_hash_table_lookup(priv->rip_members, name);
+	if (member == NULL) {
+		rpc_set_last_error(ENOENT, "Member not found", NULL);
+		g_rw_lock_writer_unlock(&priv->rip_rwlock);
+		return (-1);
+	}
+
+	members = rpc_table_copy(priv->rip_members);
+	g_hash_table_remove(members, name);
+	rpc_table_publish(&priv->rip_members, members);
+	g_rw_lock_writer_unlock(&priv->rip_rwlock);
+	rpc_epoch_retire(member, (GDestroyNotify)rpc_if_member_free);
+
+	debugf("unregistered %s", name);
+	return (0);
+}
+
+void
+rpc_context_set_pre_call_hook(rpc_context_t context, rpc_function_t fn)
+{
+
+	context->rcx_pre_call_hook = fn;
+}
+
+
+void
+rpc_context_set_post_call_hook(rpc_context_t context, rpc_function_t fn)
+{
+
+	context->rcx_post_call_hook = fn;
+}
+
+void
+rpc_context_set_error_stacks(rpc_context_t context, bool capture, bool send)
+{
+
+	context->rcx_error_stacks = capture;
+	context->rcx_error_stacks_send = send;
+}
+
+int
+rpc_instance_get_property_rights(rpc_instance_t instance, const char *interface,
+    const char *name)
+{
+	struct rpc_if_member *member;
+	int rights = 0;
+
+	member = rpc_instance_find_member(instance, interface, name);
+	if (member == NULL || member->rim_type != RPC_MEMBER_PROPERTY) {
+		rpc_set_last_error(ENOENT, "Property not found", NULL);
+		return (-1);
+	}
+
+	if (member->rim_property.rp_getter != NULL)
+		rights |= RPC_PROPERTY_READ;
+
+	if (member->rim_property.rp_setter != NULL)
+		rights |= RPC_PROPERTY_WRITE;
 
-	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
-	    !call->rc_aborted) {
-		g_mutex_unlock(&call->rc_mtx);
-		notify_wait(&call->rc_notify);
-		g_mutex_lock(&call->rc_mtx);
+	return (rights);
+}
+
+void
+rpc_instance_property_changed(rpc_instance_t instance, const char *interface,
+    const char *name, rpc_object_t value)
+{
+	struct rpc_property_coalesce *cl = NULL;
+	struct rpc_if_member *prop;
+	struct rpc_property_cookie cookie;
+	struct emit_item *wakeup;
+	rpc_context_t context;
+	bool release = false;
+	char *key;
+	gint64 now;
+
+	prop = rpc_instance_find_member(instance, interface, name);
+	g_assert(prop != NULL);
+	g_assert(prop->rim_type == RPC_MEMBER_PROPERTY);
+
+	if (value == NULL) {
+		cookie.instance = instance;
+		cookie.name = name;
+		cookie.arg = prop->rim_property.rp_arg;
+		cookie.error = NULL;
+		value = prop->rim_property.rp_getter(&cookie);
+
+		if (cookie.error != NULL)
+			return;
+
+		release = true;
 	}
 
-	if (call->rc_aborted) {
-		if (!call->rc_ended) {
-			rpc_function_error(call, ECONNRESET, "Call aborted");
-			call->rc_ended = true;
+	g_mutex_lock(&instance->ri_mtx);
+	if (instance->ri_coalesce != NULL) {
+		key = g_strdup_printf("%s:%s", interface, name);
+		cl = g_hash_table_lookup(instance->ri_coalesce, key);
+		g_free(key);
+	}
+
+	if (cl == NULL) {
+		g_mutex_unlock(&instance->ri_mtx);
+		rpc_instance_emit_changed(instance, interface, name, value);
+		goto done;
+	}
+
+	/* Compare against what the watchers are going to see last */
+	if (cl->rcl_compare && rpc_equal(value, cl->rcl_pending != NULL ?
+	    cl->rcl_pending : cl->rcl_last)) {
+		g_mutex_unlock(&instance->ri_mtx);
+		goto done;
+	}
+
+	now = g_get_monotonic_time();
+	if (cl->rcl_due == 0 && now - cl->rcl_last_sent >= cl->rcl_interval) {
+		cl->rcl_last_sent = now;
+		if (cl->rcl_compare) {
+			rpc_release(cl->rcl_last);
+			cl->rcl_last = rpc_retain(value);
 		}
 
-		g_mutex_unlock(&call->rc_mtx);
-		rpc_release(fragment);
-		return (-1);
+		g_mutex_unlock(&instance->ri_mtx);
+		rpc_instance_emit_changed(instance, interface, name, value);
+		goto done;
 	}
 
-	if (context->rcx_pre_call_hook != NULL) {
+	rpc_release(cl->rcl_pending);
+	cl->rcl_pending = rpc_retain(value);
+
+	if (cl->rcl_due == 0 && !instance->ri_destroyed &&
+	    instance->ri_context != NULL) {
+		/* The flush holds the instance until it's done */
+		context = instance->ri_context;
+		cl->rcl_due = cl->rcl_last_sent + cl->rcl_interval;
+		instance->ri_refcnt++;
+
+		g_mutex_lock(&context->rcx_coalesce_mtx);
+		g_ptr_array_add(context->rcx_coalesce_due, cl);
+		g_mutex_unlock(&context->rcx_coalesce_mtx);
 
+		wakeup = g_malloc0(sizeof(*wakeup));
+		wakeup->context = context;
+		rpc_context_emit_push(context, wakeup);
 	}
-	rpc_connection_send_fragment(call->rc_conn, call->rc_id,
-	    call->rc_producer_seqno, fragment);
 
-	call->rc_producer_seqno++;
-	call->rc_streaming = true;
-	g_mutex_unlock(&call->rc_mtx);
-	return (0);
+	g_mutex_unlock(&instance->ri_mtx);
+
+done:
+	if (release)
+		rpc_release(value);
 }
 
-int
-rpc_function_retain(void *cookie)
+static void
+rpc_instance_emit_changed(rpc_instance_t instance, const char *interface,
+    const char *name, rpc_object_t value)
 {
-	struct rpc_call *call = cookie;
+	static rpc_pack_fmt_t changed_fmt;
+	struct rpc_property_delta *pd;
 
-	return (rpc_connection_call_retain(call));
+	pd = rpc_instance_get_delta(instance, interface, name);
+	if (pd != NULL &&
+	    rpc_instance_emit_delta(instance, pd, interface, name, value))
+		return;
+
+	rpc_instance_emit_event(instance, RPC_OBSERVABLE_INTERFACE, "changed",
+	    rpc_object_pack_compiled(
+		rpc_pack_compile_once(&changed_fmt, "{s,s,v}"),
+		"interface", interface,
+		"name", name,
+		"value", rpc_retain(value)));
 }
 
 int
-rpc_function_release(void *cookie)
+rpc_instance_set_property_coalescing(rpc_instance_t instance,
+    const char *interface, const char *name, uint64_t min_interval,
+    bool compare)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_property_coalesce *cl;
+	struct rpc_if_member *prop;
+	char *key;
 
-	return (rpc_connection_call_release(call));
+	prop = rpc_instance_find_member(instance, interface, name);
+	if (prop == NULL || prop->rim_type != RPC_MEMBER_PROPERTY) {
+		rpc_set_last_error(ENOENT, "Property not found", NULL);
+		return (-1);
+	}
+
+	key = g_strdup_printf("%s:%s", interface, name);
+	g_mutex_lock(&instance->ri_mtx);
+	if (instance->ri_coalesce == NULL) {
+		instance->ri_coalesce = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, rpc_property_coalesce_free);
+	}
+
+	/*
+	 * Entries stay around until the instance goes away; one may be
+	 * waiting in the flush list of the context.
+	 */
+	cl = g_hash_table_lookup(instance->ri_coalesce, key);
+	if (cl == NULL) {
+		cl = g_malloc0(sizeof(*cl));
+		cl->rcl_instance = instance;
+		cl->rcl_interface = g_strdup(interface);
+		cl->rcl_name = g_strdup(name);
+		g_hash_table_insert(instance->ri_coalesce, key, cl);
+	} else
+		g_free(key);
+
+	cl->rcl_interval = (gint64)min_interval * 1000;
+	cl->rcl_compare = compare;
+	if (!compare) {
+		rpc_release(cl->rcl_last);
+		cl->rcl_last = NULL;
+	}
+
+	g_mutex_unlock(&instance->ri_mtx);
+	return (0);
 }
 
-void
-rpc_function_end(void *cookie)
+static void
+rpc_property_coalesce_free(gpointer data)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_property_coalesce *cl = data;
 
-	call->rc_conn->rco_fn_cbs.rcf_fn_end(cookie);
+	rpc_release(cl->rcl_last);
+	rpc_release(cl->rcl_pending);
+	g_free(cl->rcl_interface);
+	g_free(cl->rcl_name);
+	g_free(cl);
 }
 
-void
-rpc_function_end_impl(void *cookie)
+static struct rpc_property_delta *
+rpc_instance_get_delta(rpc_instance_t instance, const char *interface,
+    const char *name)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_property_delta *pd = NULL;
+	char *key;
 
-	g_mutex_lock(&call->rc_mtx);
+	g_mutex_lock(&instance->ri_mtx);
+	if (instance->ri_deltas != NULL) {
+		key = g_strdup_printf("%s:%s", interface, name);
+		pd = g_hash_table_lookup(instance->ri_deltas, key);
+		g_free(key);
+	}
 
-	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
-	    !call->rc_aborted) {
-		g_mutex_unlock(&call->rc_mtx);
-		notify_wait(&call->rc_notify);
-		g_mutex_lock(&call->rc_mtx);
+	g_mutex_unlock(&instance->ri_mtx);
+	return (pd);
+}
+
+/*
+ * Sends the change as operations against the previous version when
+ * that's meaningfully smaller than the value, and the whole value
+ * otherwise. Either way the event carries the new version number, so
+ * that watchers can tell they've missed one. The event goes out with
+ * rpd_mtx held, which keeps versions in order on the wire.
+ */
+static bool
+rpc_instance_emit_delta(rpc_instance_t instance, struct rpc_property_delta *pd,
+    const char *interface, const char *name, rpc_object_t value)
+{
+	static rpc_pack_fmt_t delta_fmt;
+	static rpc_pack_fmt_t value_fmt;
+	rpc_object_t delta = NULL;
+	const char *kind = NULL;
+	const char *path = NULL;
+	size_t entries = 0;
+	size_t nops;
+
+	g_mutex_lock(&pd->rpd_mtx);
+	if (!pd->rpd_enabled) {
+		g_mutex_unlock(&pd->rpd_mtx);
+		return (false);
 	}
 
-	if (call->rc_aborted) {
-		if (!call->rc_ended && !call->rc_responded) {
-			rpc_function_error(call, ECONNRESET,
-			    "Call aborted");
-			call->rc_ended = true;
+	if (pd->rpd_last != NULL) {
+		delta = rpc_query_diff(pd->rpd_last, value);
+		nops = rpc_array_get_count(delta);
+		if (nops == 0) {
+			rpc_release(delta);
+			g_mutex_unlock(&pd->rpd_mtx);
+			return (true);
 		}
-		g_mutex_unlock(&call->rc_mtx);
-		rpc_connection_close_inbound_call(call);
 
-		return;
+		if (rpc_get_type(value) == RPC_TYPE_ARRAY)
+			entries = rpc_array_get_count(value);
+		else if (rpc_get_type(value) == RPC_TYPE_DICTIONARY)
+			entries = rpc_dictionary_get_count(value);
+
+		/* Replacing the root is no better than the value itself */
+		rpc_object_unpack(rpc_array_get_value(delta, 0), "{s,s}",
+		    "op", &kind,
+		    "path", &path);
+		if ((g_strcmp0(kind, "set") == 0 && g_strcmp0(path, "") == 0) ||
+		    nops * 2 > entries) {
+			rpc_release(delta);
+			delta = NULL;
+		}
 	}
 
-	if (!call->rc_ended)
-		rpc_connection_send_end(call->rc_conn, call->rc_id,
-		    call->rc_producer_seqno);
+	pd->rpd_version++;
+	rpc_release(pd->rpd_last);
+	pd->rpd_last = rpc_retain(value);
+
+	if (delta != NULL) {
+		rpc_instance_emit_event(instance, RPC_OBSERVABLE_INTERFACE,
+		    "changed", rpc_object_pack_compiled(
+			rpc_pack_compile_once(&delta_fmt, "{s,s,u,v}"),
+			"interface", interface,
+			"name", name,
+			"version", pd->rpd_version,
+			"delta", delta));
+	} else {
+		rpc_instance_emit_event(instance, RPC_OBSERVABLE_INTERFACE,
+		    "changed", rpc_object_pack_compiled(
+			rpc_pack_compile_once(&value_fmt, "{s,s,u,v}"),
+			"interface", interface,
+			"name", name,
+			"version", pd->rpd_version,
+			"value", rpc_retain(value)));
+	}
 
-	call->rc_producer_seqno++;
-	call->rc_streaming = true;
-	call->rc_ended = true;
-	g_mutex_unlock(&call->rc_mtx);
-	rpc_connection_close_inbound_call(call);
+	g_mutex_unlock(&pd->rpd_mtx);
+	return (true);
 }
 
-void
-rpc_function_kill(void *cookie)
+int
+rpc_instance_set_property_delta(rpc_instance_t instance,
+    const char *interface, const char *name, bool enable)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_property_delta *pd;
+	struct rpc_property_cookie cookie;
+	struct rpc_if_member *prop;
+	rpc_object_t value = NULL;
+	char *key;
 
-	call->rc_conn->rco_fn_cbs.rcf_fn_kill(cookie);
-}
+	prop = rpc_instance_find_member(instance, interface, name);
+	if (prop == NULL || prop->rim_type != RPC_MEMBER_PROPERTY) {
+		rpc_set_last_error(ENOENT, "Property not found", NULL);
+		return (-1);
+	}
 
-void
-rpc_function_kill_impl(void *cookie)
-{
-	struct rpc_call *call = cookie;
+	/* Deltas are taken against the value watchers have right now */
+	if (enable && prop->rim_property.rp_getter != NULL) {
+		cookie.instance = instance;
+		cookie.name = name;
+		cookie.arg = prop->rim_property.rp_arg;
+		cookie.error = NULL;
+		value = prop->rim_property.rp_getter(&cookie);
 
-	g_mutex_lock(&call->rc_mtx);
-	call->rc_aborted = true;
-	notify_signal(&call->rc_notify);
-	g_mutex_unlock(&call->rc_mtx);
+		if (cookie.error != NULL) {
+			rpc_set_last_rpc_error(cookie.error);
+			rpc_release(cookie.error);
+			return (-1);
+		}
+	}
+
+	key = g_strdup_printf("%s:%s", interface, name);
+	g_mutex_lock(&instance->ri_mtx);
+	if (instance->ri_deltas == NULL) {
+		instance->ri_deltas = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, rpc_property_delta_free);
+	}
+
+	pd = g_hash_table_lookup(instance->ri_deltas, key);
+	if (pd == NULL) {
+		pd = g_malloc0(sizeof(*pd));
+		g_mutex_init(&pd->rpd_mtx);
+		g_hash_table_insert(instance->ri_deltas, key, pd);
+	} else
+		g_free(key);
+
+	g_mutex_unlock(&instance->ri_mtx);
+
+	g_mutex_lock(&pd->rpd_mtx);
+	pd->rpd_enabled = enable;
+	rpc_release(pd->rpd_last);
+	pd->rpd_last = value;
+	g_mutex_unlock(&pd->rpd_mtx);
+	return (0);
 }
 
-bool
-rpc_function_should_abort(void *cookie)
+static void
+rpc_property_delta_free(gpointer data)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_property_delta *pd = data;
 
-	return (call->rc_conn->rco_fn_cbs.rcf_should_abort(cookie));
+	rpc_release(pd->rpd_last);
+	g_mutex_clear(&pd->rpd_mtx);
+	g_free(pd);
 }
 
-bool rpc_function_should_abort_impl(void *cookie)
+rpc_instance_t
+rpc_property_get_instance(void *cookie)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_property_cookie *prop = cookie;
 
-	return (call->rc_aborted);
+	return (prop->instance);
 }
 
-void rpc_function_set_async_abort_handler(void *cookie,
-    rpc_abort_handler_t handler)
+void *
+rpc_property_get_arg(void *cookie)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_property_cookie *prop = cookie;
 
-	call->rc_conn->rco_fn_cbs.rcf_set_async_abort_handler(cookie, handler);
+	return (prop->arg);
 }
 
-void rpc_function_set_async_abort_handler_impl(void *cookie,
-    rpc_abort_handler_t handler)
+const char *
+rpc_property_get_name(void *cookie)
 {
-	struct rpc_call *call = cookie;
-
-	if (call->rc_abort_handler != NULL)
-		Block_release(call->rc_abort_handler);
+	struct rpc_property_cookie *prop = cookie;
 
-	call->rc_abort_handler = Block_copy(handler);
+	return (prop->name);
 }
 
-rpc_instance_t
-rpc_instance_new(void *arg, const char *fmt, ...)
+void
+rpc_property_error(void *cookie, int code, const char *fmt, ...)
 {
+	struct rpc_property_cookie *prop = cookie;
+	char *msg;
 	va_list ap;
-	rpc_instance_t result;
-	char *path;
 
 	va_start(ap, fmt);
-	path = g_strdup_vprintf(fmt, ap);
+	msg = g_strdup_vprintf(fmt, ap);
 	va_end(ap);
 
-	if (!rpc_context_path_is_valid(path)) {
-		rpc_set_last_error(EINVAL, "Invalid path", NULL);
-		g_free(path);
+	prop->error = rpc_error_create(code, msg, NULL);
+	g_free(msg);
+
+}
+
+static rpc_object_t
+rpc_get_objects(void *cookie, rpc_object_t args __unused)
+{
+	rpc_context_t context = rpc_function_get_context(cookie);
+	GPtrArray *index;
+	char *prefix = NULL;
+	rpc_instance_t instance;
+	rpc_instance_t v;
+	rpc_object_t list;
+	guint i;
+
+	instance = rpc_function_get_instance(cookie);
+	list = rpc_array_create();
+
+	if (strlen(rpc_instance_get_path(instance)) > 1)
+		prefix = g_strdup_printf("%s/", rpc_instance_get_path(instance));
+
+	rpc_epoch_enter();
+	index = g_atomic_pointer_get(&context->rcx_index);
+	i = prefix != NULL ? rpc_index_lower_bound(index, prefix) : 0;
+	for (; i < index->len; i++) {
+		v = g_ptr_array_index(index, i);
+		if (prefix != NULL && !g_str_has_prefix(v->ri_path, prefix))
+			break;
+		rpc_array_append_stolen_value(list, rpc_object_pack("{s,s}",
+		    "path", v->ri_path,
+		    "description", v->ri_descr));
+	}
+
+	rpc_epoch_exit();
+
+	rpc_context_enumerate_namespaces(context, prefix,
+	    ^(const char *path, const char *descr) {
+		rpc_array_append_stolen_value(list, rpc_object_pack("{s,s}",
+		    "path", path,
+		    "description", descr));
+		return ((bool)true);
+	});
+
+	g_free(prefix);
+	return (list);
+}
+
+/*
+ * Streams the instances under this one in path order, starting after
+ * @p cursor if set and stopping after @p limit of them if nonzero.
+ * A client pages through by passing the last path it got as the next
+ * cursor. Each batch is copied out of the index snapshot current at
+ * the time, so neither registrations nor the epoch wait on the client.
+ */
+static rpc_object_t
+rpc_list_objects(void *cookie, rpc_object_t args)
+{
+	rpc_context_t context = rpc_function_get_context(cookie);
+	rpc_instance_t instance = rpc_function_get_instance(cookie);
+	GPtrArray *index;
+	GPtrArray *batch;
+	const char *cursor = NULL;
+	char *prefix = NULL;
+	char *last;
+	rpc_instance_t v;
+	int64_t limit = 0;
+	int64_t count = 0;
+	guint i;
+
+	if (rpc_object_unpack(args, "[s,i]", &cursor, &limit) < 0 ||
+	    limit < 0) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
 		return (NULL);
 	}
 
-	result = g_malloc0(sizeof(*result));
-	g_mutex_init(&result->ri_mtx);
-	g_cond_init(&result->ri_cv);
-	g_rw_lock_init(&result->ri_rwlock);
-	result->ri_path = path;
-	result->ri_interfaces = g_hash_table_new_full(g_str_hash, g_str_equal,
-	    g_free, (GDestroyNotify)rpc_interface_free);
-	result->ri_arg = arg;
+	if (strlen(rpc_instance_get_path(instance)) > 1)
+		prefix = g_strdup_printf("%s/", rpc_instance_get_path(instance));
 
-	rpc_instance_register_interface(result, RPC_DISCOVERABLE_INTERFACE,
-	    rpc_discoverable_vtable, NULL);
+	last = g_strdup(cursor);
+	batch = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_release_impl);
+	rpc_function_start_stream(cookie);
 
-	rpc_instance_register_interface(result, RPC_INTROSPECTABLE_INTERFACE,
-	    rpc_introspectable_vtable, NULL);
+	for (;;) {
+		rpc_epoch_enter();
+		index = g_atomic_pointer_get(&context->rcx_index);
+		i = 0;
+		if (last != NULL)
+			i = rpc_index_lower_bound(index, last);
+		else if (prefix != NULL)
+			i = rpc_index_lower_bound(index, prefix);
+
+		for (; i < index->len && batch->len < RPC_LIST_BATCH; i++) {
+			v = g_ptr_array_index(index, i);
+			if (last != NULL && strcmp(v->ri_path, last) <= 0)
+				continue;
+
+			if (prefix != NULL &&
+			    !g_str_has_prefix(v->ri_path, prefix))
+				break;
+
+			if (limit > 0 && count + batch->len >= limit)
+				break;
+
+			g_ptr_array_add(batch, rpc_object_pack("{s,s}",
+			    "path", v->ri_path,
+			    "description", v->ri_descr));
+		}
+		rpc_epoch_exit();
 
-	rpc_instance_register_interface(result, RPC_DEFAULT_INTERFACE,
-	    NULL, NULL);
+		if (batch->len == 0)
+			break;
 
-	rpc_instance_register_interface(result, RPC_OBSERVABLE_INTERFACE,
-	    rpc_observable_vtable, NULL);
+		g_free(last);
+		last = g_strdup(rpc_dictionary_get_string(
+		    g_ptr_array_index(batch, batch->len - 1), "path"));
 
-	return (result);
-}
+		for (i = 0; i < batch->len; i++) {
+			if (rpc_function_should_abort(cookie))
+				goto done;
 
-void
-rpc_instance_set_description(rpc_instance_t instance, const char *fmt, ...)
-{
-	va_list ap;
-	char *description;
+			if (rpc_function_yield(cookie,
+			    rpc_retain(g_ptr_array_index(batch, i))) != 0)
+				goto done;
+		}
 
-	va_start(ap, fmt);
-	description = g_strdup_vprintf(fmt, ap);
-	va_end(ap);
+		count += batch->len;
+		g_ptr_array_set_size(batch, 0);
+	}
 
-	instance->ri_descr = description;
+done:
+	g_ptr_array_free(batch, true);
+	g_free(prefix);
+	g_free(last);
+	return (NULL);
 }
 
-void *
-rpc_instance_get_arg(rpc_instance_t instance)
+static gint
+rpc_instance_path_cmp(gconstpointer a, gconstpointer b)
 {
+	rpc_instance_t ia = *(rpc_instance_t *)a;
+	rpc_instance_t ib = *(rpc_instance_t *)b;
 
-	g_assert_nonnull(instance);
-
-	return (instance->ri_arg);
+	return (strcmp(ia->ri_path, ib->ri_path));
 }
 
-const char *
-rpc_instance_get_path(rpc_instance_t instance)
+/*
+ * Retained instances matching a path pattern or a list of paths, under
+ * @p prefix if set. NULL if @p paths is neither.
+ */
+static GPtrArray *
+rpc_context_match_instances(rpc_context_t context, const char *prefix,
+    rpc_object_t paths)
 {
+	struct rpc_array_iter aiter;
+	GPatternSpec *pattern;
+	GHashTableIter iter;
+	GPtrArray *result;
+	rpc_instance_t instance;
+	rpc_object_t value;
 
-	g_assert_nonnull(instance);
-
-	return (instance->ri_path);
-}
+	switch (rpc_get_type(paths)) {
+	case RPC_TYPE_STRING:
+		result = g_ptr_array_new();
+		pattern = g_pattern_spec_new(rpc_string_get_string_ptr(paths));
+		g_rw_lock_reader_lock(&context->rcx_rwlock);
+		g_hash_table_iter_init(&iter, context->rcx_instances);
+		while (g_hash_table_iter_next(&iter, NULL,
+		    (gpointer)&instance)) {
+			if (prefix != NULL &&
+			    !g_str_has_prefix(instance->ri_path, prefix))
+				continue;
+
+			if (!g_pattern_match_string(pattern, instance->ri_path))
+				continue;
+
+			instance = rpc_instance_retain(instance);
+			if (instance != NULL)
+				g_ptr_array_add(result, instance);
+		}
+		g_rw_lock_reader_unlock(&context->rcx_rwlock);
 
-void
-rpc_instance_free(rpc_instance_t instance)
-{
-	struct tp_item *item;
+		rpc_context_enumerate_namespaces(context, prefix,
+		    ^(const char *path, const char *descr __unused) {
+			rpc_instance_t match;
 
-	g_assert_nonnull(instance);
-	item = g_malloc(sizeof(*item));
+			if (!g_pattern_match_string(pattern, path))
+				return ((bool)true);
 
-	g_mutex_lock(&instance->ri_mtx);
-	item->type = TYPE_INSTANCE;
-	item->data = instance;
-	instance->ri_destroyed = true;
+			match = rpc_instance_find_and_retain(context, path);
+			if (match != NULL)
+				g_ptr_array_add(result, match);
 
-	/* wait on any outstanding calls to complete in another thread. */
-	g_thread_pool_push(instance->ri_context->rcx_threadpool, item, NULL);
-	g_mutex_unlock(&instance->ri_mtx);
+			return ((bool)true);
+		});
 
-}
+		g_pattern_spec_free(pattern);
+		g_ptr_array_sort(result, rpc_instance_path_cmp);
+		return (result);
 
-struct rpc_if_member *
-rpc_instance_find_member(rpc_instance_t instance, const char *interface,
-    const char *name)
-{
-	struct rpc_interface_priv *iface;
-	struct rpc_if_member *result;
+	case RPC_TYPE_ARRAY:
+		result = g_ptr_array_new();
+		rpc_array_iter_init(paths, &aiter);
+		while (rpc_array_iter_next(&aiter, NULL, &value)) {
+			if (rpc_get_type(value) != RPC_TYPE_STRING)
+				continue;
 
-	if (name == NULL)
-		return (NULL);
+			if (prefix != NULL && !g_str_has_prefix(
+			    rpc_string_get_string_ptr(value), prefix))
+				continue;
 
-	if (interface == NULL)
-		interface = RPC_DEFAULT_INTERFACE;
+			instance = rpc_instance_find_and_retain(context,
+			    rpc_string_get_string_ptr(value));
+			if (instance != NULL)
+				g_ptr_array_add(result, instance);
+		}
 
-	g_rw_lock_reader_lock(&instance->ri_rwlock);
-	iface = g_hash_table_lookup(instance->ri_interfaces, interface);
-	g_rw_lock_reader_unlock(&instance->ri_rwlock);
+		return (result);
 
-	if (iface == NULL) {
-		debugf("member %s not found on %s\n", name,
-		    interface);
+	default:
 		return (NULL);
 	}
-
-	g_rw_lock_reader_lock(&iface->rip_rwlock);
-	result = g_hash_table_lookup(iface->rip_members, name);
-	g_rw_lock_reader_unlock(&iface->rip_rwlock);
-
-	return (result);
 }
 
-bool
-rpc_instance_has_interface(rpc_instance_t instance, const char *interface)
+static void
+rpc_bulk_get_release(struct rpc_bulk_get *bulk)
 {
+	guint i;
 
-	g_assert_nonnull(interface);
+	if (!g_atomic_int_dec_and_test(&bulk->rbg_refcnt))
+		return;
+
+	for (i = 0; i < bulk->rbg_instances->len; i++) {
+		rpc_release(bulk->rbg_results[i]);
+		rpc_instance_release(g_ptr_array_index(bulk->rbg_instances, i));
+	}
 
-	return ((bool)g_hash_table_contains(instance->ri_interfaces, interface));
+	g_ptr_array_free(bulk->rbg_instances, true);
+	g_mutex_clear(&bulk->rbg_mtx);
+	g_cond_clear(&bulk->rbg_cv);
+	g_free(bulk->rbg_results);
+	g_free(bulk->rbg_done);
+	g_free(bulk->rbg_interface);
+	g_free(bulk);
 }
 
-int
-rpc_instance_register_interface(rpc_instance_t instance,
-    const char *interface, const struct rpc_if_member *vtable, void *arg)
+/*
+ * Claims and reads one instance. Returns false once there's none left.
+ */
+static bool
+rpc_bulk_get_one(struct rpc_bulk_get *bulk)
 {
-	struct rpc_interface_priv *priv;
-	const struct rpc_if_member *member;
-
-	g_assert_nonnull(interface);
-
-	if (rpc_instance_has_interface(instance, interface))
-		return (0);
-
-	priv = g_malloc0(sizeof(*priv));
-	g_rw_lock_init(&priv->rip_rwlock);
-	priv->rip_members = g_hash_table_new_full(g_str_hash, g_str_equal,
-	    g_free, (GDestroyNotify)rpc_if_member_free);
-	priv->rip_arg = arg;
-	priv->rip_name = g_strdup(interface);
+	rpc_object_t result;
+	guint idx;
 
-	g_rw_lock_writer_lock(&instance->ri_rwlock);
-	g_hash_table_insert(instance->ri_interfaces, g_strdup(priv->rip_name),
-	    priv);
-	g_rw_lock_writer_unlock(&instance->ri_rwlock);
+	if (g_atomic_int_get(&bulk->rbg_stop))
+		return (false);
 
-	if (vtable != NULL) {
-		for (member = &vtable[0]; member->rim_name != NULL; member++)
-			rpc_instance_register_member(instance, interface, 
-			    member);
-	}
+	idx = (guint)g_atomic_int_add(&bulk->rbg_next, 1);
+	if (idx >= bulk->rbg_instances->len)
+		return (false);
 
-	rpc_instance_emit_event(instance, RPC_INTROSPECTABLE_INTERFACE,
-	    "interface_added", rpc_string_create(interface));
+	result = rpc_instance_get_all_properties(
+	    g_ptr_array_index(bulk->rbg_instances, idx), bulk->rbg_interface);
 
-	return (0);
+	g_mutex_lock(&bulk->rbg_mtx);
+	bulk->rbg_results[idx] = result;
+	bulk->rbg_done[idx] = true;
+	g_cond_broadcast(&bulk->rbg_cv);
+	g_mutex_unlock(&bulk->rbg_mtx);
+	return (true);
 }
 
-void
-rpc_instance_unregister_interface(rpc_instance_t instance,
-    const char *interface)
+static void
+rpc_bulk_get_work(struct rpc_bulk_get *bulk)
 {
-	g_rw_lock_writer_lock(&instance->ri_rwlock);
-	g_hash_table_remove(instance->ri_interfaces, interface);
-	g_rw_lock_writer_unlock(&instance->ri_rwlock);
 
-	rpc_instance_emit_event(instance, RPC_INTROSPECTABLE_INTERFACE,
-	    "interface_removed", rpc_string_create(interface));
+	while (rpc_bulk_get_one(bulk));
 }
 
-void
-rpc_interface_free(struct rpc_interface_priv *priv)
+/*
+ * Takes over the instances. Helps with the reads on the calling thread,
+ * handing out results whenever the next ones in order are ready.
+ */
+static void
+rpc_context_bulk_get(rpc_context_t context, const char *interface,
+    GPtrArray *instances, rpc_property_bulk_cb_t callback)
 {
+	struct rpc_bulk_get *bulk;
+	struct tp_item *item;
+	rpc_instance_t instance;
+	rpc_object_t result;
+	guint len = instances->len;
+	guint next = 0;
+	guint i;
+	bool more = true;
+
+	bulk = g_malloc0(sizeof(*bulk));
+	bulk->rbg_refcnt = 1;
+	bulk->rbg_interface = g_strdup(interface);
+	bulk->rbg_instances = instances;
+	bulk->rbg_results = g_malloc0_n(MAX(len, 1), sizeof(rpc_object_t));
+	bulk->rbg_done = g_malloc0_n(MAX(len, 1), sizeof(bool));
+	g_mutex_init(&bulk->rbg_mtx);
+	g_cond_init(&bulk->rbg_cv);
+
+	for (i = 0; i + 1 < MIN(len, g_get_num_processors()); i++) {
+		g_atomic_int_inc(&bulk->rbg_refcnt);
+		item = g_malloc(sizeof(*item));
+		item->type = TYPE_BULK_GET;
+		item->data = bulk;
+		item->qos = NULL;
+		rpc_scheduler_push(context->rcx_scheduler, item,
+		    RPC_PRIORITY_NORMAL);
+	}
 
-	g_hash_table_destroy(priv->rip_members);
-	g_rw_lock_clear(&priv->rip_rwlock);
-	g_free(priv->rip_description);
-	g_free(priv);
-}
+	while (next < len) {
+		more = more && rpc_bulk_get_one(bulk);
 
-void
-rpc_if_member_free(struct rpc_if_member *member)
-{
+		g_mutex_lock(&bulk->rbg_mtx);
+		while (!more && !bulk->rbg_done[next])
+			g_cond_wait(&bulk->rbg_cv, &bulk->rbg_mtx);
 
-	if (member->rim_type == RPC_MEMBER_METHOD) {
-		if (member->rim_method.rm_block != NULL)
-			Block_release(member->rim_method.rm_block);
-	}
+		while (next < len && bulk->rbg_done[next]) {
+			instance = g_ptr_array_index(instances, next);
+			result = bulk->rbg_results[next];
+			bulk->rbg_results[next++] = NULL;
+			if (result == NULL)
+				continue;
 
-	if (member->rim_type == RPC_MEMBER_PROPERTY) {
-		if (member->rim_property.rp_getter != NULL)
-			Block_release(member->rim_property.rp_getter);
+			g_mutex_unlock(&bulk->rbg_mtx);
+			if (!callback(instance->ri_path, result))
+				next = len;
 
-		if (member->rim_property.rp_setter != NULL)
-			Block_release(member->rim_property.rp_setter);
+			rpc_release(result);
+			g_mutex_lock(&bulk->rbg_mtx);
+		}
+		g_mutex_unlock(&bulk->rbg_mtx);
 	}
 
-	g_free((void *)member->rim_name);
-	g_free(member);
+	g_atomic_int_set(&bulk->rbg_stop, true);
+	rpc_bulk_get_release(bulk);
 }
 
-int rpc_instance_register_member(rpc_instance_t instance, const char *interface,
-    const struct rpc_if_member *member)
+int
+rpc_context_get_properties(rpc_context_t context, const char *interface,
+    rpc_object_t paths, rpc_property_bulk_cb_t callback)
 {
-	struct rpc_interface_priv *priv;
-	struct rpc_if_member *copy;
-
-	if (interface == NULL)
-		interface = RPC_DEFAULT_INTERFACE;
+	GPtrArray *instances;
 
-	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
-	if (priv == NULL) {
-		rpc_set_last_error(ENOENT, "Interface not found", NULL);
+	instances = rpc_context_match_instances(context, NULL, paths);
+	if (instances == NULL) {
+		rpc_set_last_errorf(EINVAL,
+		    "Paths must be a pattern or an array of paths");
 		return (-1);
 	}
 
-	copy = g_memdup(member, sizeof(*member));
-	copy->rim_name = g_strdup(member->rim_name);
+	rpc_context_bulk_get(context, interface, instances, callback);
+	return (0);
+}
 
-	if (copy->rim_type == RPC_MEMBER_METHOD) {
-		copy->rim_method.rm_block = Block_copy(
-		    copy->rim_method.rm_block);
+static rpc_object_t
+rpc_get_properties(void *cookie, rpc_object_t args)
+{
+	rpc_context_t context = rpc_function_get_context(cookie);
+	rpc_instance_t instance = rpc_function_get_instance(cookie);
+	GPtrArray *instances;
+	const char *interface;
+	rpc_object_t paths;
+	char *prefix = NULL;
 
-		if (copy->rim_method.rm_arg == NULL)
-			copy->rim_method.rm_arg = priv->rip_arg;
+	if (rpc_object_unpack(args, "[s,v]", &interface, &paths) < 2) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
 	}
 
-	if (copy->rim_type == RPC_MEMBER_PROPERTY) {
-		if (copy->rim_property.rp_getter != NULL) {
-			copy->rim_property.rp_getter = Block_copy(
-			    copy->rim_property.rp_getter);
-		}
-
-		if (copy->rim_property.rp_setter != NULL) {
-			copy->rim_property.rp_setter = Block_copy(
-			    copy->rim_property.rp_setter);
-		}
+	if (strlen(rpc_instance_get_path(instance)) > 1)
+		prefix = g_strdup_printf("%s/", rpc_instance_get_path(instance));
 
-		if (copy->rim_property.rp_arg == NULL)
-			copy->rim_property.rp_arg = priv->rip_arg;
+	instances = rpc_context_match_instances(context, prefix, paths);
+	g_free(prefix);
 
+	if (instances == NULL) {
+		rpc_function_error(cookie, EINVAL,
+		    "Paths must be a pattern or an array of paths");
+		return (NULL);
 	}
 
-	g_rw_lock_writer_lock(&priv->rip_rwlock);
-	g_hash_table_insert(priv->rip_members, g_strdup(member->rim_name), copy);
-	g_rw_lock_writer_unlock(&priv->rip_rwlock);
-	return (0);
-}
-
-int
-rpc_instance_register_block(rpc_instance_t instance, const char *interface,
-    const char *name, void *arg, rpc_function_t func)
-{
-	struct rpc_if_member member;
+	rpc_function_start_stream(cookie);
+	rpc_context_bulk_get(context, interface, instances,
+	    ^(const char *path, rpc_object_t properties) {
+		if (rpc_function_should_abort(cookie))
+			return ((bool)false);
 
-	member.rim_name = name;
-	member.rim_type = RPC_MEMBER_METHOD;
-	member.rim_method.rm_block = func;
-	member.rim_method.rm_arg = arg;
+		return ((bool)(rpc_function_yield(cookie, rpc_object_pack(
+		    "{s,v}",
+		    "path", path,
+		    "properties", rpc_retain(properties))) == 0));
+	});
 
-	return (rpc_instance_register_member(instance, interface, &member));
+	return (NULL);
 }
 
-int
-rpc_instance_register_func(rpc_instance_t instance, const char *interface,
-    const char *name, void *arg, rpc_function_f func)
+static rpc_object_t
+rpc_get_interfaces(void *cookie, rpc_object_t args __unused)
 {
-	return (rpc_instance_register_block(instance, interface, name, arg,
-	    RPC_FUNCTION(func)));
+	GHashTableIter iter;
+	const char *k;
+	void *v;
+	rpc_object_t list = rpc_array_create();
+	rpc_instance_t instance;
+
+	instance = rpc_instance_shape(rpc_function_get_instance(cookie));
+	g_rw_lock_reader_lock(&instance->ri_rwlock);
+	g_hash_table_iter_init(&iter, instance->ri_interfaces);
+	while (g_hash_table_iter_next(&iter, (gpointer)&k, (gpointer)&v))
+		rpc_array_append_stolen_value(list, rpc_string_create(k));
+
+	g_rw_lock_reader_unlock(&instance->ri_rwlock);
+	return (list);
 }
 
-int
-rpc_instance_unregister_member(rpc_instance_t instance, const char *interface,
-    const char *name)
-{
-	struct rpc_interface_priv *priv;
-	struct rpc_if_member *member;
+static rpc_object_t
+rpc_get_method_stats(void *cookie, rpc_object_t args __unused)
+{
 
-	g_assert_nonnull(name);
+	return (rpc_context_get_method_stats(rpc_function_get_context(cookie)));
+}
 
-	if (interface == NULL)
-		interface = RPC_DEFAULT_INTERFACE;
+static rpc_object_t
+rpc_get_server_stats(void *cookie, rpc_object_t args __unused)
+{
+	rpc_context_t context = rpc_function_get_context(cookie);
+	rpc_object_t result = rpc_array_create();
+	guint i;
 
-	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
-	if (priv == NULL) {
-		rpc_set_last_error(ENOENT, "Interface not found", NULL);
-		return (-1);
+	g_rw_lock_reader_lock(&context->rcx_server_rwlock);
+	for (i = 0; i < context->rcx_servers->len; i++) {
+		rpc_array_append_stolen_value(result, rpc_server_get_stats(
+		    g_ptr_array_index(context->rcx_servers, i)));
 	}
+	g_rw_lock_reader_unlock(&context->rcx_server_rwlock);
 
-	g_rw_lock_writer_lock(&priv->rip_rwlock);
-	member = g_hash_table_lookup(priv->rip_members, name);
-	if (member == NULL) {
-		rpc_set_last_error(ENOENT, "Member not found", NULL);
-		g_rw_lock_writer_unlock(&priv->rip_rwlock);
-		return (-1);
-	}
+	return (result);
+}
 
-	g_hash_table_remove(priv->rip_members, name);
-	g_rw_lock_writer_unlock(&priv->rip_rwlock);
+static rpc_object_t
+rpc_get_connection_stats(void *cookie, rpc_object_t args __unused)
+{
+	rpc_context_t context = rpc_function_get_context(cookie);
+	rpc_object_t result = rpc_array_create();
+	rpc_server_t server;
+	rpc_connection_t conn;
+	rpc_object_t stats;
+	const char *address;
+	GList *item;
+	guint i;
+
+	g_rw_lock_reader_lock(&context->rcx_server_rwlock);
+	for (i = 0; i < context->rcx_servers->len; i++) {
+		server = g_ptr_array_index(context->rcx_servers, i);
+		g_rw_lock_reader_lock(&server->rs_connections_rwlock);
+		for (item = server->rs_connections; item != NULL;
+		    item = item->next) {
+			conn = item->data;
+			address = rpc_connection_get_remote_address(conn);
+			stats = rpc_connection_get_stats(conn);
+			rpc_dictionary_set_string(stats, "server",
+			    server->rs_uri);
+			if (address != NULL)
+				rpc_dictionary_set_string(stats, "remote",
+				    address);
+
+			rpc_array_append_stolen_value(result, stats);
+		}
+		g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
+	}
+	g_rw_lock_reader_unlock(&context->rcx_server_rwlock);
 
-	debugf("unregistered %s", name);
-	return (0);
+	return (result);
 }
 
-void
-rpc_context_set_pre_call_hook(rpc_context_t context, rpc_function_t fn)
+static rpc_object_t
+rpc_get_lock_stats(void *cookie __unused, rpc_object_t args __unused)
 {
 
-	context->rcx_pre_call_hook = fn;
+	return (rpc_lockprof_get_stats());
 }
 
-
-void
-rpc_context_set_post_call_hook(rpc_context_t context, rpc_function_t fn)
+static rpc_object_t
+rpc_get_slow_calls(void *cookie, rpc_object_t args __unused)
 {
 
-	context->rcx_post_call_hook = fn;
+	return (rpc_context_get_slow_calls(rpc_function_get_context(cookie)));
 }
 
-int
-rpc_instance_get_property_rights(rpc_instance_t instance, const char *interface,
-    const char *name)
+static rpc_object_t
+rpc_get_slow_consumers(void *cookie, rpc_object_t args __unused)
 {
-	struct rpc_if_member *member;
-	int rights = 0;
 
-	member = rpc_instance_find_member(instance, interface, name);
-	if (member == NULL || member->rim_type != RPC_MEMBER_PROPERTY) {
-		rpc_set_last_error(ENOENT, "Property not found", NULL);
-		return (-1);
-	}
+	return (rpc_context_get_slow_consumers(
+	    rpc_function_get_context(cookie)));
+}
 
-	if (member->rim_property.rp_getter != NULL)
-		rights |= RPC_PROPERTY_READ;
+static void
+rpc_session_free(gpointer data)
+{
+	struct rpc_session *session = data;
 
-	if (member->rim_property.rp_setter != NULL)
-		rights |= RPC_PROPERTY_WRITE;
+	g_free(session->rse_token);
+	rpc_release(session->rse_subscriptions);
+	g_free(session);
+}
 
-	return (rights);
+/*
+ * Drops the sessions nobody resumed in time. Called with
+ * rcx_sessions_mtx held.
+ */
+static void
+rpc_context_expire_sessions(rpc_context_t context)
+{
+	struct rpc_session *session;
+	GHashTableIter iter;
+	gint64 now = g_get_monotonic_time();
+
+	g_hash_table_iter_init(&iter, context->rcx_sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session)) {
+		if (session->rse_conn == NULL && session->rse_expires < now)
+			g_hash_table_iter_remove(&iter);
+	}
 }
 
-void
-rpc_instance_property_changed(rpc_instance_t instance, const char *interface,
-    const char *name, rpc_object_t value)
+static void
+rpc_session_bind(struct rpc_session *session, rpc_connection_t conn)
 {
-	struct rpc_if_member *prop;
-	struct rpc_property_cookie cookie;
-	bool release = false;
 
-	prop = rpc_instance_find_member(instance, interface, name);
-	g_assert(prop != NULL);
-	g_assert(prop->rim_type == RPC_MEMBER_PROPERTY);
+	session->rse_conn = conn;
+	if (!session->rse_has_creds && conn->rco_has_creds) {
+		session->rse_has_creds = true;
+		session->rse_creds = conn->rco_creds;
+	}
+}
 
-	if (value == NULL) {
-		cookie.instance = instance;
-		cookie.name = name;
-		cookie.arg = prop->rim_property.rp_arg;
-		cookie.error = NULL;
-		value = prop->rim_property.rp_getter(&cookie);
+/*
+ * Tells whether conn may take over the session. The token alone is
+ * enough for a detached session, unless credentials tell the peers
+ * apart. A session whose connection is still alive is only handed over
+ * to the very same process, since otherwise anyone who learned the
+ * token could hijack a live session.
+ */
+static bool
+rpc_session_may_resume(struct rpc_session *session, rpc_connection_t conn)
+{
+	rpc_connection_t live = session->rse_conn;
 
-		if (cookie.error != NULL)
-			return;
+	if (live == NULL) {
+		if (!session->rse_has_creds || !conn->rco_has_creds)
+			return (true);
 
-		release = true;
+		return (session->rse_creds.rcc_uid == conn->rco_creds.rcc_uid);
 	}
 
-	rpc_instance_emit_event(instance, RPC_OBSERVABLE_INTERFACE, "changed",
-	    rpc_object_pack("{s,s,v}",
-		"interface", interface,
-		"name", name,
-		"value", rpc_retain(value)));
+	if (!live->rco_has_creds || !conn->rco_has_creds)
+		return (false);
 
-	if (release)
-		rpc_release(value);
+	return (live->rco_creds.rcc_uid == conn->rco_creds.rcc_uid &&
+	    live->rco_creds.rcc_pid == conn->rco_creds.rcc_pid);
 }
 
-rpc_instance_t
-rpc_property_get_instance(void *cookie)
+void
+rpc_context_detach_session(rpc_context_t context, rpc_connection_t conn)
 {
-	struct rpc_property_cookie *prop = cookie;
+	struct rpc_session *session;
 
-	return (prop->instance);
-}
+	g_mutex_lock(&context->rcx_sessions_mtx);
+	if (conn->rco_session == NULL) {
+		g_mutex_unlock(&context->rcx_sessions_mtx);
+		return;
+	}
 
-void *
-rpc_property_get_arg(void *cookie)
-{
-	struct rpc_property_cookie *prop = cookie;
+	session = g_hash_table_lookup(context->rcx_sessions, conn->rco_session);
+	if (session != NULL && session->rse_conn == conn) {
+		session->rse_subscriptions =
+		    rpc_connection_snapshot_subscriptions(conn);
+		rpc_session_bind(session, conn);
+		session->rse_conn = NULL;
+		session->rse_expires = g_get_monotonic_time() + RPC_SESSION_TTL;
+	}
 
-	return (prop->arg);
+	g_free(conn->rco_session);
+	conn->rco_session = NULL;
+	g_mutex_unlock(&context->rcx_sessions_mtx);
 }
 
-const char *
-rpc_property_get_name(void *cookie)
+/*
+ * Binds a connection handed over by another process to the session it
+ * had there, so that the peer can still resume it under the same token.
+ */
+void
+rpc_context_adopt_session(rpc_context_t context, rpc_connection_t conn,
+    const char *token)
 {
-	struct rpc_property_cookie *prop = cookie;
+	struct rpc_session *session;
+
+	g_mutex_lock(&context->rcx_sessions_mtx);
+	session = g_hash_table_lookup(context->rcx_sessions, token);
+	if (session == NULL) {
+		session = g_malloc0(sizeof(*session));
+		session->rse_token = g_strdup(token);
+		g_hash_table_insert(context->rcx_sessions, session->rse_token,
+		    session);
+	}
 
-	return (prop->name);
+	rpc_session_bind(session, conn);
+	g_free(conn->rco_session);
+	conn->rco_session = g_strdup(token);
+	g_mutex_unlock(&context->rcx_sessions_mtx);
 }
 
-void
-rpc_property_error(void *cookie, int code, const char *fmt, ...)
+static rpc_object_t
+rpc_session_open(void *cookie, rpc_object_t args __unused)
 {
-	struct rpc_property_cookie *prop = cookie;
-	char *msg;
-	va_list ap;
+	rpc_context_t context = rpc_function_get_context(cookie);
+	rpc_connection_t conn = rpc_function_get_connection(cookie);
+	struct rpc_session *session;
+	rpc_object_t result;
+	char *token;
 
-	va_start(ap, fmt);
-	msg = g_strdup_vprintf(fmt, ap);
-	va_end(ap);
+	if (conn == NULL) {
+		rpc_function_error(cookie, ENOTCONN, "Not connected");
+		return (NULL);
+	}
 
-	prop->error = rpc_error_create(code, msg, NULL);
-	g_free(msg);
+	g_mutex_lock(&context->rcx_sessions_mtx);
+	rpc_context_expire_sessions(context);
+	if (conn->rco_session == NULL) {
+		token = rpc_generate_token();
+		if (token == NULL) {
+			g_mutex_unlock(&context->rcx_sessions_mtx);
+			rpc_function_error(cookie, errno,
+			    "Cannot generate session token");
+			return (NULL);
+		}
 
+		session = g_malloc0(sizeof(*session));
+		session->rse_token = token;
+		rpc_session_bind(session, conn);
+		g_hash_table_insert(context->rcx_sessions, session->rse_token,
+		    session);
+		conn->rco_session = g_strdup(session->rse_token);
+	}
+
+	result = rpc_string_create(conn->rco_session);
+	g_mutex_unlock(&context->rcx_sessions_mtx);
+	return (result);
 }
 
+/*
+ * Moves a session over to the calling connection, along with all of
+ * the subscriptions it had, in one step. If the old connection hasn't
+ * been torn down yet, it's left without a session and its
+ * subscriptions are copied as they are now; that's only allowed for
+ * the same process, see rpc_session_may_resume().
+ */
 static rpc_object_t
-rpc_get_objects(void *cookie, rpc_object_t args __unused)
+rpc_session_resume(void *cookie, rpc_object_t args)
 {
 	rpc_context_t context = rpc_function_get_context(cookie);
-	GHashTableIter iter;
-	const char *k;
-	char *prefix = NULL;
-	rpc_instance_t instance;
-	rpc_instance_t v;
-	rpc_object_t list;
+	rpc_connection_t conn = rpc_function_get_connection(cookie);
+	struct rpc_session *session;
+	rpc_object_t subscriptions = NULL;
+	const char *token = NULL;
 
-	instance = rpc_function_get_instance(cookie);
-	list = rpc_array_create();
-
-	if (strlen(rpc_instance_get_path(instance)) > 1)
-		prefix = g_strdup_printf("%s/", rpc_instance_get_path(instance));
+	if (rpc_object_unpack(args, "[s]", &token) < 1 || token == NULL) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
 
-	g_rw_lock_reader_lock(&context->rcx_rwlock);
-	g_hash_table_iter_init(&iter, context->rcx_instances);
+	if (conn == NULL) {
+		rpc_function_error(cookie, ENOTCONN, "Not connected");
+		return (NULL);
+	}
 
-	while (g_hash_table_iter_next(&iter, (gpointer)&k, (gpointer)&v)) {
-		if (prefix != NULL && !g_str_has_prefix(v->ri_path, prefix))
-			continue;
-		rpc_array_append_stolen_value(list, rpc_object_pack("{s,s}",
-		    "path", v->ri_path,
-		    "description", v->ri_descr));
+	g_mutex_lock(&context->rcx_sessions_mtx);
+	rpc_context_expire_sessions(context);
+	session = g_hash_table_lookup(context->rcx_sessions, token);
+	if (session == NULL || conn->rco_session != NULL ||
+	    !rpc_session_may_resume(session, conn)) {
+		g_mutex_unlock(&context->rcx_sessions_mtx);
+		return (rpc_bool_create(false));
 	}
 
-	g_rw_lock_reader_unlock(&context->rcx_rwlock);
-	g_free(prefix);
-	return (list);
-}
+	if (session->rse_conn != NULL) {
+		subscriptions = rpc_connection_snapshot_subscriptions(
+		    session->rse_conn);
+		g_free(session->rse_conn->rco_session);
+		session->rse_conn->rco_session = NULL;
+	} else {
+		subscriptions = session->rse_subscriptions;
+		session->rse_subscriptions = NULL;
+	}
 
-static rpc_object_t
-rpc_get_interfaces(void *cookie, rpc_object_t args __unused)
-{
-	GHashTableIter iter;
-	const char *k;
-	void *v;
-	rpc_object_t list = rpc_array_create();
-	rpc_instance_t instance = rpc_function_get_instance(cookie);
+	rpc_session_bind(session, conn);
+	conn->rco_session = g_strdup(session->rse_token);
+	g_mutex_unlock(&context->rcx_sessions_mtx);
 
-	g_rw_lock_reader_lock(&instance->ri_rwlock);
-	g_hash_table_iter_init(&iter, instance->ri_interfaces);
-	while (g_hash_table_iter_next(&iter, (gpointer)&k, (gpointer)&v))
-		rpc_array_append_stolen_value(list, rpc_string_create(k));
+	if (subscriptions != NULL) {
+		rpc_connection_restore_subscriptions(conn, subscriptions);
+		rpc_release(subscriptions);
+	}
 
-	g_rw_lock_reader_unlock(&instance->ri_rwlock);
-	return (list);
+	return (rpc_bool_create(true));
 }
 
 static rpc_object_t
@@ -1308,22 +4112,25 @@ rpc_get_methods(void *cookie, rpc_object_t args)
 	if (interface == NULL)
 		interface = RPC_DEFAULT_INTERFACE;
 
-	g_rw_lock_reader_lock(&instance->ri_rwlock);
-	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
+	rpc_epoch_enter();
+	priv = g_hash_table_lookup(
+	    g_atomic_pointer_get(&rpc_instance_shape(instance)->ri_interfaces),
+	    interface);
 	if (priv == NULL) {
 		rpc_function_error(cookie, ENOENT, "Interface not found");
-		g_rw_lock_reader_unlock(&instance->ri_rwlock);
+		rpc_epoch_exit();
 		return (NULL);
 	}
 
-	g_hash_table_iter_init(&iter, priv->rip_members);
+	g_hash_table_iter_init(&iter,
+	    g_atomic_pointer_get(&priv->rip_members));
 	while (g_hash_table_iter_next(&iter, (gpointer)&k, (gpointer)&v)) {
 		if (v->rim_type != RPC_MEMBER_METHOD)
 			continue;
 		rpc_array_append_stolen_value(result, rpc_string_create(k));
 	}
 
-	g_rw_lock_reader_unlock(&instance->ri_rwlock);
+	rpc_epoch_exit();
 	return (result);
 }
 
@@ -1343,15 +4150,18 @@ rpc_get_events(void *cookie, rpc_object_t args)
 		return (NULL);
 	}
 
-	g_rw_lock_reader_lock(&instance->ri_rwlock);
-	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
+	rpc_epoch_enter();
+	priv = g_hash_table_lookup(
+	    g_atomic_pointer_get(&rpc_instance_shape(instance)->ri_interfaces),
+	    interface);
 	if (priv == NULL) {
 		rpc_function_error(cookie, ENOENT, "Interface not found");
-		g_rw_lock_reader_unlock(&instance->ri_rwlock);
+		rpc_epoch_exit();
 		return (NULL);
 	}
 
-	g_hash_table_iter_init(&iter, priv->rip_members);
+	g_hash_table_iter_init(&iter,
+	    g_atomic_pointer_get(&priv->rip_members));
 	while (g_hash_table_iter_next(&iter, (gpointer)&k, (gpointer)&v)) {
 		if (v->rim_type != RPC_MEMBER_EVENT)
 			continue;
@@ -1359,7 +4169,7 @@ rpc_get_events(void *cookie, rpc_object_t args)
 		rpc_array_append_stolen_value(result, rpc_string_create(k));
 	}
 
-	g_rw_lock_reader_unlock(&instance->ri_rwlock);
+	rpc_epoch_exit();
 	return (result);
 }
 
@@ -1375,8 +4185,8 @@ rpc_interface_exists(void *cookie, rpc_object_t args)
 		return (NULL);
 	}
 
-	return (rpc_bool_create((bool)g_hash_table_contains(
-	    instance->ri_interfaces, interface)));
+	return (rpc_bool_create(rpc_instance_has_interface(instance,
+	    interface)));
 }
 
 static rpc_object_t
@@ -1419,6 +4229,47 @@ rpc_observable_property_get(void *cookie, rpc_object_t args)
 	return (result);
 }
 
+/*
+ * Returns the value of a property together with the version the next
+ * delta event is going to follow, or 0 if it isn't sent as deltas.
+ */
+static rpc_object_t
+rpc_observable_property_get_versioned(void *cookie, rpc_object_t args)
+{
+	rpc_instance_t inst = rpc_function_get_instance(cookie);
+	struct rpc_property_delta *pd;
+	rpc_object_t value = NULL;
+	const char *interface;
+	const char *name;
+	uint64_t version = 0;
+
+	if (rpc_object_unpack(args, "[s,s]", &interface, &name) < 2) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	pd = rpc_instance_get_delta(inst, interface, name);
+	if (pd != NULL) {
+		g_mutex_lock(&pd->rpd_mtx);
+		if (pd->rpd_enabled && pd->rpd_last != NULL) {
+			value = rpc_retain(pd->rpd_last);
+			version = pd->rpd_version;
+		}
+
+		g_mutex_unlock(&pd->rpd_mtx);
+	}
+
+	if (value == NULL) {
+		value = rpc_observable_property_get(cookie, args);
+		if (value == NULL)
+			return (NULL);
+	}
+
+	return (rpc_object_pack("{v,u}",
+	    "value", value,
+	    "version", version));
+}
+
 static rpc_object_t
 rpc_observable_property_set(void *cookie, rpc_object_t args)
 {
@@ -1460,13 +4311,15 @@ rpc_observable_property_set(void *cookie, rpc_object_t args)
 	return (NULL);
 }
 
+/*
+ * Values of all the properties of an interface, or NULL if the instance
+ * doesn't have it.
+ */
 static rpc_object_t
-rpc_observable_property_get_all(void *cookie, rpc_object_t args)
+rpc_instance_get_all_properties(rpc_instance_t inst, const char *interface)
 {
-	rpc_instance_t inst = rpc_function_get_instance(cookie);
 	GHashTableIter iter;
 	struct rpc_property_cookie prop;
-	const char *interface;
 	const char *k;
 	struct rpc_if_member *v;
 	struct rpc_interface_priv *priv;
@@ -1474,16 +4327,9 @@ rpc_observable_property_get_all(void *cookie, rpc_object_t args)
 	rpc_object_t result;
 	rpc_object_t item;
 
-	if (rpc_object_unpack(args, "[s]", &interface) < 1) {
-		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
-		return (NULL);
-	}
-
-	priv = g_hash_table_lookup(inst->ri_interfaces, interface);
-	if (priv == NULL) {
-		rpc_function_error(cookie, ENOENT, "Interface not found");
+	priv = rpc_instance_find_interface(inst, interface);
+	if (priv == NULL)
 		return (NULL);
-	}
 
 	result = rpc_array_create();
 	g_rw_lock_reader_lock(&priv->rip_rwlock);
@@ -1525,6 +4371,27 @@ rpc_observable_property_get_all(void *cookie, rpc_object_t args)
 	return (result);
 }
 
+static rpc_object_t
+rpc_observable_property_get_all(void *cookie, rpc_object_t args)
+{
+	rpc_instance_t inst = rpc_function_get_instance(cookie);
+	const char *interface;
+	rpc_object_t result;
+
+	if (rpc_object_unpack(args, "[s]", &interface) < 1) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	result = rpc_instance_get_all_properties(inst, interface);
+	if (result == NULL) {
+		rpc_function_error(cookie, ENOENT, "Interface not found");
+		return (NULL);
+	}
+
+	return (result);
+}
+
 static bool
 rpc_context_path_is_valid(const char *path)
 {
@@ -1569,6 +4436,15 @@ rpc_instance_release(rpc_instance_t inst)
 		g_mutex_lock(&inst->ri_mtx);
 		inst->ri_refcnt--;
 		g_cond_broadcast(&inst->ri_cv);
+		if (inst->ri_virtual && inst->ri_refcnt == 0) {
+			/* Nothing but references can reach a virtual one */
+			g_mutex_unlock(&inst->ri_mtx);
+			g_rw_lock_clear(&inst->ri_rwlock);
+			rpc_instance_free_interfaces(inst);
+			rpc_instance_destroy(inst);
+			return;
+		}
+
 		g_mutex_unlock(&inst->ri_mtx);
 	}
 }
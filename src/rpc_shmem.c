@@ -0,0 +1,1042 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(__linux__)
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include "internal.h"
+#include "memfd.h"
+
+/*
+ * Shared memory pools hand out power-of-two chunks of one memfd from a
+ * buddy allocator. The descriptor of a pool travels to each peer once;
+ * after that, objects allocated from it go over the wire as an offset
+ * and a size, and the peer maps nothing. Chunks are reference counted:
+ * the local object holds one reference, and every send to a peer that
+ * speaks the pool protocol takes another one, which the peer gives back
+ * with a shmem.release frame once it's done with its copy.
+ *
+ * A connection may also have a bulk pool of its own, which serves as an
+ * out-of-band channel for large binaries: they are copied into a chunk
+ * of it and travel by reference, keeping the socket free for the rest of
+ * the traffic. The pool size bounds how much bulk data the peer can hold
+ * at once; past that, binaries go inline again until chunks come back.
+ */
+
+#define	RPC_SHMEM_MIN_ORDER	12	/* 4 KiB, page aligned */
+#define	RPC_SHMEM_HUGE_ORDER	21	/* 2 MiB, huge page aligned */
+#define	RPC_SHMEM_MAX_ORDER	40	/* 1 TiB */
+#define	RPC_SHMEM_MAX_NODES	1024
+#define	RPC_SHMEM_FILE_CACHE	32
+
+#ifndef MFD_ALLOW_SEALING
+#define	MFD_ALLOW_SEALING	0x0002U
+#endif
+
+#ifndef MFD_HUGETLB
+#define	MFD_HUGETLB		0x0004U
+#endif
+
+#ifndef MPOL_BIND
+#define	MPOL_BIND		2
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define	MADV_POPULATE_WRITE	23
+#endif
+
+struct rpc_shmem_chunk
+{
+	guint			rsc_order;
+	guint			rsc_refcnt;
+};
+
+struct rpc_shmem_loan
+{
+	struct rpc_shmem_pool *	rsl_pool;
+	off_t			rsl_offset;
+	guint			rsl_count;
+};
+
+struct rpc_shmem_return
+{
+	uint64_t		rsr_id;
+	off_t			rsr_offset;
+};
+
+struct rpc_shmem_file
+{
+	dev_t			rsf_dev;
+	ino_t			rsf_ino;
+};
+
+/*
+ * Pool state of one connection: our pools the peer has the descriptor
+ * of, chunks of those the peer still holds, the peer's pools we have
+ * mapped, and chunks of them waiting to be given back. Plain shmem
+ * objects received get their whole file mapped once too, in a small
+ * cache of mappings keyed by inode. Lazily decoded frames keep a
+ * reference, to resolve chunks they carry later on.
+ */
+struct rpc_shmem_link
+{
+	volatile int		rsl_refcnt;
+	GMutex			rsl_mtx;
+	rpc_connection_t	rsl_conn;
+	GHashTable *		rsl_shared;
+	GHashTable *		rsl_loans;
+	GHashTable *		rsl_mapped;
+	GHashTable *		rsl_files;
+	GArray *		rsl_returns;
+	struct rpc_shmem_pool *	rsl_bulk;
+	size_t			rsl_bulk_threshold;
+};
+
+static guint
+rpc_shmem_order(size_t size, guint min)
+{
+	guint order = min;
+
+	while (order < RPC_SHMEM_MAX_ORDER && ((size_t)1 << order) < size)
+		order++;
+
+	return (order);
+}
+
+static size_t
+rpc_shmem_block_size(struct rpc_shmem_pool *pool, guint order)
+{
+
+	return ((size_t)1 << (order + pool->rsp_min_order));
+}
+
+/*
+ * Creates the memfd backing a shared memory object or pool. Huge page
+ * backed files can only be sized in whole huge pages. The size is sealed,
+ * so a peer we pass the descriptor to can't truncate the file under our
+ * mappings.
+ */
+static int
+rpc_shmem_memfd(size_t *size, int flags)
+{
+	size_t huge = (size_t)1 << RPC_SHMEM_HUGE_ORDER;
+	int fd;
+
+	if (flags & RPC_SHMEM_HUGETLB)
+		*size = (*size + huge - 1) & ~(huge - 1);
+
+	fd = memfd_create("librpc", MFD_ALLOW_SEALING |
+	    ((flags & RPC_SHMEM_HUGETLB) ? MFD_HUGETLB : 0));
+	if (fd < 0)
+		return (-1);
+
+	if (ftruncate(fd, (off_t)*size) != 0 ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+rpc_shmem_bind(void *addr, size_t size, int node)
+{
+	unsigned long mask[RPC_SHMEM_MAX_NODES / (8 * sizeof(unsigned long))];
+	size_t bits = 8 * sizeof(unsigned long);
+
+	if (node >= RPC_SHMEM_MAX_NODES) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	memset(mask, 0, sizeof(mask));
+	mask[(size_t)node / bits] |= 1UL << ((size_t)node % bits);
+	return ((int)syscall(__NR_mbind, addr, size, MPOL_BIND, mask,
+	    RPC_SHMEM_MAX_NODES + 1, 0));
+}
+
+/*
+ * Kernels before 5.14 don't know MADV_POPULATE_WRITE; reading a page
+ * of a shared mapping allocates it just the same.
+ */
+static int
+rpc_shmem_populate(void *addr, size_t size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t off;
+
+	if (madvise(addr, size, MADV_POPULATE_WRITE) == 0)
+		return (0);
+
+	if (errno != EINVAL)
+		return (-1);
+
+	for (off = 0; off < size; off += page)
+		(void)*((volatile char *)addr + off);
+
+	return (0);
+}
+
+void
+rpc_shmem_advise(void *addr, size_t size, int flags)
+{
+
+	/* Only a hint; shmem_enabled may well say never */
+	if (flags & RPC_SHMEM_THP)
+		madvise(addr, size, MADV_HUGEPAGE);
+}
+
+/*
+ * Applies placement to a fresh mapping. Pages have to be bound to the
+ * node before anything faults them in, as policy only affects future
+ * allocations.
+ */
+static int
+rpc_shmem_place(void *addr, size_t size, int flags, int node)
+{
+
+	rpc_shmem_advise(addr, size, flags);
+
+	if (node != RPC_SHMEM_ANY_NODE && rpc_shmem_bind(addr, size, node) != 0)
+		return (-1);
+
+	if ((flags & RPC_SHMEM_POPULATE) && rpc_shmem_populate(addr, size) != 0)
+		return (-1);
+
+	return (0);
+}
+
+rpc_object_t
+rpc_shmem_create_ex(size_t size, int flags, int node)
+{
+	rpc_object_t result;
+	void *addr;
+	int fd;
+
+	if (size == 0) {
+		rpc_set_last_error(EINVAL, "Size must not be zero", NULL);
+		return (NULL);
+	}
+
+	fd = rpc_shmem_memfd(&size, flags);
+	if (fd < 0)
+		goto fail;
+
+	/* Placement sticks to the file, so a throwaway mapping does */
+	if (node != RPC_SHMEM_ANY_NODE || (flags & RPC_SHMEM_POPULATE)) {
+		addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		    0);
+		if (addr == MAP_FAILED)
+			goto fail;
+
+		if (rpc_shmem_place(addr, size, flags, node) != 0) {
+			munmap(addr, size);
+			goto fail;
+		}
+
+		munmap(addr, size);
+	}
+
+	result = rpc_shmem_recreate(fd, 0, size);
+	result->ro_value.rv_shmem.rsb_flags = flags;
+	return (result);
+
+fail:
+	rpc_set_last_error(errno, strerror(errno), NULL);
+	if (fd >= 0)
+		close(fd);
+
+	return (NULL);
+}
+
+/*
+ * Takes a free block of the given order, splitting a larger one if
+ * needed. Called with the pool locked.
+ */
+static bool
+rpc_shmem_pool_take(struct rpc_shmem_pool *pool, guint order, off_t *offset)
+{
+	GHashTableIter iter;
+	gpointer key;
+	guint i;
+
+	for (i = order; i < pool->rsp_orders; i++) {
+		if (g_hash_table_size(pool->rsp_free[i]) > 0)
+			break;
+	}
+
+	if (i == pool->rsp_orders)
+		return (false);
+
+	g_hash_table_iter_init(&iter, pool->rsp_free[i]);
+	g_hash_table_iter_next(&iter, &key, NULL);
+	g_hash_table_iter_remove(&iter);
+	*offset = (off_t)GPOINTER_TO_SIZE(key);
+
+	while (i > order) {
+		i--;
+		g_hash_table_add(pool->rsp_free[i], GSIZE_TO_POINTER(
+		    (size_t)*offset + rpc_shmem_block_size(pool, i)));
+	}
+
+	return (true);
+}
+
+/*
+ * Puts a block back, merging it with its buddy for as long as that one
+ * is free too. Called with the pool locked.
+ */
+static void
+rpc_shmem_pool_give(struct rpc_shmem_pool *pool, off_t offset, guint order)
+{
+	size_t off = (size_t)offset;
+	size_t buddy;
+
+	while (order + 1 < pool->rsp_orders) {
+		buddy = off ^ rpc_shmem_block_size(pool, order);
+		if (!g_hash_table_remove(pool->rsp_free[order],
+		    GSIZE_TO_POINTER(buddy)))
+			break;
+
+		off = MIN(off, buddy);
+		order++;
+	}
+
+	g_hash_table_add(pool->rsp_free[order], GSIZE_TO_POINTER(off));
+}
+
+static void
+rpc_shmem_chunk_get(struct rpc_shmem_pool *pool, off_t offset)
+{
+	struct rpc_shmem_chunk *chunk;
+
+	g_mutex_lock(&pool->rsp_mtx);
+	chunk = g_hash_table_lookup(pool->rsp_chunks,
+	    GSIZE_TO_POINTER((size_t)offset));
+	g_assert_nonnull(chunk);
+	chunk->rsc_refcnt++;
+	g_mutex_unlock(&pool->rsp_mtx);
+}
+
+static void
+rpc_shmem_chunk_put(struct rpc_shmem_pool *pool, off_t offset, guint count)
+{
+	struct rpc_shmem_chunk *chunk;
+	bool freed = false;
+
+	g_mutex_lock(&pool->rsp_mtx);
+	chunk = g_hash_table_lookup(pool->rsp_chunks,
+	    GSIZE_TO_POINTER((size_t)offset));
+	if (chunk == NULL || chunk->rsc_refcnt < count) {
+		g_mutex_unlock(&pool->rsp_mtx);
+		return;
+	}
+
+	chunk->rsc_refcnt -= count;
+	if (chunk->rsc_refcnt == 0) {
+		rpc_shmem_pool_give(pool, offset, chunk->rsc_order);
+		g_hash_table_remove(pool->rsp_chunks,
+		    GSIZE_TO_POINTER((size_t)offset));
+		freed = true;
+	}
+	g_mutex_unlock(&pool->rsp_mtx);
+
+	/* Every live chunk keeps its pool around */
+	if (freed)
+		rpc_shmem_pool_unref(pool);
+}
+
+/*
+ * Takes a chunk of at least size bytes out of a local pool, holding a
+ * reference on the pool. Called without the pool locked.
+ */
+static bool
+rpc_shmem_pool_alloc_chunk(struct rpc_shmem_pool *pool, size_t size,
+    off_t *offset)
+{
+	struct rpc_shmem_chunk *chunk;
+	guint order;
+
+	order = rpc_shmem_order(size, pool->rsp_min_order) -
+	    pool->rsp_min_order;
+	if (order >= pool->rsp_orders)
+		return (false);
+
+	g_mutex_lock(&pool->rsp_mtx);
+	if (!rpc_shmem_pool_take(pool, order, offset)) {
+		g_mutex_unlock(&pool->rsp_mtx);
+		return (false);
+	}
+
+	chunk = g_new(struct rpc_shmem_chunk, 1);
+	chunk->rsc_order = order;
+	chunk->rsc_refcnt = 1;
+	g_hash_table_insert(pool->rsp_chunks,
+	    GSIZE_TO_POINTER((size_t)*offset), chunk);
+	g_mutex_unlock(&pool->rsp_mtx);
+
+	g_atomic_int_inc(&pool->rsp_refcnt);
+	return (true);
+}
+
+rpc_shmem_pool_t
+rpc_shmem_pool_create(size_t size)
+{
+
+	return (rpc_shmem_pool_create_ex(size, 0, RPC_SHMEM_ANY_NODE));
+}
+
+rpc_shmem_pool_t
+rpc_shmem_pool_create_ex(size_t size, int flags, int node)
+{
+	struct rpc_shmem_pool *pool;
+	guint order;
+	guint i;
+
+	if (size == 0) {
+		rpc_set_last_error(EINVAL, "Pool size must not be zero", NULL);
+		return (NULL);
+	}
+
+	pool = g_new0(struct rpc_shmem_pool, 1);
+	pool->rsp_min_order = (flags & RPC_SHMEM_HUGETLB) ?
+	    RPC_SHMEM_HUGE_ORDER : RPC_SHMEM_MIN_ORDER;
+	order = rpc_shmem_order(size, pool->rsp_min_order);
+	pool->rsp_size = (size_t)1 << order;
+	pool->rsp_fd = rpc_shmem_memfd(&pool->rsp_size, flags);
+	if (pool->rsp_fd < 0)
+		goto fail;
+
+	pool->rsp_base = mmap(NULL, pool->rsp_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, pool->rsp_fd, 0);
+	if (pool->rsp_base == MAP_FAILED)
+		goto fail;
+
+	if (rpc_shmem_place(pool->rsp_base, pool->rsp_size, flags, node) != 0) {
+		munmap(pool->rsp_base, pool->rsp_size);
+		goto fail;
+	}
+
+	do {
+		pool->rsp_id = ((uint64_t)g_random_int() << 32) |
+		    g_random_int();
+	} while (pool->rsp_id == 0);
+
+	pool->rsp_refcnt = 1;
+	pool->rsp_orders = order - pool->rsp_min_order + 1;
+	pool->rsp_free = g_new0(GHashTable *, pool->rsp_orders);
+	for (i = 0; i < pool->rsp_orders; i++)
+		pool->rsp_free[i] = g_hash_table_new(NULL, NULL);
+
+	pool->rsp_chunks = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	g_hash_table_add(pool->rsp_free[pool->rsp_orders - 1],
+	    GSIZE_TO_POINTER(0));
+	g_mutex_init(&pool->rsp_mtx);
+	return (pool);
+
+fail:
+	rpc_set_last_error(errno, strerror(errno), NULL);
+	if (pool->rsp_fd >= 0)
+		close(pool->rsp_fd);
+
+	g_free(pool);
+	return (NULL);
+}
+
+rpc_object_t
+rpc_shmem_pool_alloc(rpc_shmem_pool_t pool, size_t size)
+{
+	off_t offset;
+
+	if (pool == NULL || pool->rsp_remote || size == 0) {
+		rpc_set_last_error(EINVAL, "Invalid allocation", NULL);
+		return (NULL);
+	}
+
+	if (rpc_shmem_order(size, pool->rsp_min_order) - pool->rsp_min_order >=
+	    pool->rsp_orders) {
+		rpc_set_last_error(ENOMEM, "Allocation larger than the pool",
+		    NULL);
+		return (NULL);
+	}
+
+	if (!rpc_shmem_pool_alloc_chunk(pool, size, &offset)) {
+		rpc_set_last_error(ENOMEM, "Shared memory pool exhausted",
+		    NULL);
+		return (NULL);
+	}
+
+	return (rpc_shmem_create_pooled(pool, offset, size));
+}
+
+void
+rpc_shmem_pool_release(rpc_shmem_pool_t pool)
+{
+
+	if (pool != NULL)
+		rpc_shmem_pool_unref(pool);
+}
+
+void
+rpc_shmem_pool_unref(struct rpc_shmem_pool *pool)
+{
+	guint i;
+
+	if (!g_atomic_int_dec_and_test(&pool->rsp_refcnt))
+		return;
+
+	munmap(pool->rsp_base, pool->rsp_size);
+	close(pool->rsp_fd);
+
+	if (!pool->rsp_remote) {
+		for (i = 0; i < pool->rsp_orders; i++)
+			g_hash_table_destroy(pool->rsp_free[i]);
+
+		g_free(pool->rsp_free);
+		g_hash_table_destroy(pool->rsp_chunks);
+		g_mutex_clear(&pool->rsp_mtx);
+	}
+
+	g_free(pool);
+}
+
+/*
+ * Drops the reference a shmem object holds on its chunk. Chunks of a
+ * peer's pool are given back to the peer, if the connection they came
+ * in on is still around.
+ */
+void
+rpc_shmem_block_release(struct rpc_shmem_block *block)
+{
+	struct rpc_shmem_pool *pool = block->rsb_pool;
+	rpc_connection_t conn;
+
+	if (pool == NULL)
+		return;
+
+	if (!pool->rsp_remote) {
+		rpc_shmem_chunk_put(pool, block->rsb_offset, 1);
+		return;
+	}
+
+	conn = g_atomic_pointer_get(&pool->rsp_conn);
+	if (conn != NULL)
+		rpc_connection_return_shmem(conn, pool->rsp_id,
+		    block->rsb_offset);
+
+	rpc_shmem_pool_unref(pool);
+}
+
+static guint
+rpc_shmem_loan_hash(gconstpointer key)
+{
+	const struct rpc_shmem_loan *loan = key;
+
+	return (g_int64_hash(&loan->rsl_pool->rsp_id) ^
+	    (guint)(loan->rsl_offset >> RPC_SHMEM_MIN_ORDER));
+}
+
+static gboolean
+rpc_shmem_loan_equal(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_shmem_loan *la = a;
+	const struct rpc_shmem_loan *lb = b;
+
+	return (la->rsl_pool == lb->rsl_pool &&
+	    la->rsl_offset == lb->rsl_offset);
+}
+
+static guint
+rpc_shmem_file_hash(gconstpointer key)
+{
+	const struct rpc_shmem_file *file = key;
+
+	return ((guint)file->rsf_dev ^ (guint)file->rsf_ino);
+}
+
+static gboolean
+rpc_shmem_file_equal(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_shmem_file *fa = a;
+	const struct rpc_shmem_file *fb = b;
+
+	return (fa->rsf_dev == fb->rsf_dev && fa->rsf_ino == fb->rsf_ino);
+}
+
+static void
+rpc_shmem_link_init_tables(struct rpc_shmem_link *link)
+{
+
+	link->rsl_shared = g_hash_table_new(g_int64_hash, g_int64_equal);
+	link->rsl_loans = g_hash_table_new_full(rpc_shmem_loan_hash,
+	    rpc_shmem_loan_equal, g_free, NULL);
+	link->rsl_mapped = g_hash_table_new(g_int64_hash, g_int64_equal);
+	link->rsl_files = g_hash_table_new_full(rpc_shmem_file_hash,
+	    rpc_shmem_file_equal, g_free, (GDestroyNotify)rpc_shmem_pool_unref);
+	link->rsl_returns = NULL;
+}
+
+struct rpc_shmem_link *
+rpc_shmem_link_new(rpc_connection_t conn)
+{
+	struct rpc_shmem_link *link;
+
+	link = g_new0(struct rpc_shmem_link, 1);
+	link->rsl_refcnt = 1;
+	link->rsl_conn = conn;
+	g_mutex_init(&link->rsl_mtx);
+	rpc_shmem_link_init_tables(link);
+	return (link);
+}
+
+/*
+ * Forgets everything exchanged with the current peer: chunks it held
+ * are reclaimed, and its pools stop being given back to, as there's
+ * nobody to give them back to anymore.
+ */
+void
+rpc_shmem_link_reset(struct rpc_shmem_link *link)
+{
+	struct rpc_shmem_loan *loan;
+	struct rpc_shmem_pool *pool;
+	GHashTableIter iter;
+	GHashTable *shared;
+	GHashTable *loans;
+	GHashTable *mapped;
+	GHashTable *files;
+	GArray *returns;
+
+	g_mutex_lock(&link->rsl_mtx);
+	shared = link->rsl_shared;
+	loans = link->rsl_loans;
+	mapped = link->rsl_mapped;
+	files = link->rsl_files;
+	returns = link->rsl_returns;
+	rpc_shmem_link_init_tables(link);
+	g_mutex_unlock(&link->rsl_mtx);
+
+	g_hash_table_iter_init(&iter, loans);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&loan, NULL)) {
+		rpc_shmem_chunk_put(loan->rsl_pool, loan->rsl_offset,
+		    loan->rsl_count);
+	}
+
+	g_hash_table_iter_init(&iter, mapped);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&pool)) {
+		g_atomic_pointer_set(&pool->rsp_conn, NULL);
+		rpc_shmem_pool_unref(pool);
+	}
+
+	g_hash_table_iter_init(&iter, shared);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&pool))
+		rpc_shmem_pool_unref(pool);
+
+	g_hash_table_destroy(loans);
+	g_hash_table_destroy(mapped);
+	g_hash_table_destroy(shared);
+	g_hash_table_destroy(files);
+	if (returns != NULL)
+		g_array_free(returns, true);
+}
+
+void
+rpc_shmem_link_retain(struct rpc_shmem_link *link)
+{
+
+	g_atomic_int_inc(&link->rsl_refcnt);
+}
+
+void
+rpc_shmem_link_release(struct rpc_shmem_link *link)
+{
+
+	if (link == NULL)
+		return;
+
+	if (!g_atomic_int_dec_and_test(&link->rsl_refcnt))
+		return;
+
+	rpc_shmem_link_reset(link);
+	if (link->rsl_bulk != NULL)
+		rpc_shmem_pool_unref(link->rsl_bulk);
+
+	g_hash_table_destroy(link->rsl_loans);
+	g_hash_table_destroy(link->rsl_mapped);
+	g_hash_table_destroy(link->rsl_shared);
+	g_hash_table_destroy(link->rsl_files);
+	g_mutex_clear(&link->rsl_mtx);
+	g_free(link);
+}
+
+/*
+ * Records a chunk of a local pool going out to the peer, which takes a
+ * reference on it until the peer gives it back. Returns whether the
+ * peer already has the pool descriptor; if not, the caller has to pass
+ * it along with this frame.
+ */
+bool
+rpc_shmem_link_lend(struct rpc_shmem_link *link, struct rpc_shmem_pool *pool,
+    off_t offset)
+{
+	struct rpc_shmem_loan key = { .rsl_pool = pool, .rsl_offset = offset };
+	struct rpc_shmem_loan *loan;
+	bool shared = true;
+
+	g_mutex_lock(&link->rsl_mtx);
+	if (!g_hash_table_contains(link->rsl_shared, &pool->rsp_id)) {
+		g_atomic_int_inc(&pool->rsp_refcnt);
+		g_hash_table_insert(link->rsl_shared, &pool->rsp_id, pool);
+		shared = false;
+	}
+
+	loan = g_hash_table_lookup(link->rsl_loans, &key);
+	if (loan == NULL) {
+		loan = g_memdup(&key, sizeof(key));
+		g_hash_table_add(link->rsl_loans, loan);
+	}
+
+	loan->rsl_count++;
+	g_mutex_unlock(&link->rsl_mtx);
+
+	rpc_shmem_chunk_get(pool, offset);
+	return (shared);
+}
+
+/*
+ * Sets the pool large binaries sent to the peer go through, replacing
+ * the previous one, if any. Takes over the caller's reference.
+ */
+void
+rpc_shmem_link_set_bulk(struct rpc_shmem_link *link,
+    struct rpc_shmem_pool *pool, size_t threshold)
+{
+	struct rpc_shmem_pool *old;
+
+	g_mutex_lock(&link->rsl_mtx);
+	old = link->rsl_bulk;
+	link->rsl_bulk = pool;
+	link->rsl_bulk_threshold = threshold;
+	g_mutex_unlock(&link->rsl_mtx);
+
+	if (old != NULL)
+		rpc_shmem_pool_unref(old);
+}
+
+/*
+ * Returns the bulk pool with a reference for the caller, or NULL if
+ * there's none.
+ */
+struct rpc_shmem_pool *
+rpc_shmem_link_get_bulk(struct rpc_shmem_link *link)
+{
+	struct rpc_shmem_pool *pool;
+
+	g_mutex_lock(&link->rsl_mtx);
+	pool = link->rsl_bulk;
+	if (pool != NULL)
+		g_atomic_int_inc(&pool->rsp_refcnt);
+	g_mutex_unlock(&link->rsl_mtx);
+	return (pool);
+}
+
+/*
+ * Copies a binary into a chunk of the bulk pool and lends it to the
+ * peer. Returns the chunk, for the frame to refer to, or NULL if the
+ * binary goes inline: if it's too small, if the peer doesn't have the
+ * pool descriptor yet, or if the peer holds on to too much of the pool
+ * at the moment.
+ */
+rpc_object_t
+rpc_shmem_link_bulk(struct rpc_shmem_link *link, const void *data,
+    size_t size)
+{
+	struct rpc_shmem_pool *pool;
+	off_t offset;
+
+	g_mutex_lock(&link->rsl_mtx);
+	pool = link->rsl_bulk;
+	if (pool == NULL || size == 0 || size < link->rsl_bulk_threshold ||
+	    !g_hash_table_contains(link->rsl_shared, &pool->rsp_id)) {
+		g_mutex_unlock(&link->rsl_mtx);
+		return (NULL);
+	}
+
+	g_atomic_int_inc(&pool->rsp_refcnt);
+	g_mutex_unlock(&link->rsl_mtx);
+
+	if (!rpc_shmem_pool_alloc_chunk(pool, size, &offset)) {
+		rpc_shmem_pool_unref(pool);
+		return (NULL);
+	}
+
+	rpc_shmem_pool_unref(pool);
+	memcpy((char *)pool->rsp_base + offset, data, size);
+	rpc_shmem_link_lend(link, pool, offset);
+	return (rpc_shmem_create_pooled(pool, offset, size));
+}
+
+/*
+ * Maps a pool the peer has just passed the descriptor of. Returns it
+ * with a reference for the caller, or NULL if it can't be mapped.
+ */
+struct rpc_shmem_pool *
+rpc_shmem_link_import(struct rpc_shmem_link *link, uint64_t id, int fd,
+    size_t size)
+{
+	struct rpc_shmem_pool *pool;
+	struct stat st;
+	void *base;
+
+	g_mutex_lock(&link->rsl_mtx);
+	pool = g_hash_table_lookup(link->rsl_mapped, &id);
+	if (pool != NULL) {
+		g_atomic_int_inc(&pool->rsp_refcnt);
+		g_mutex_unlock(&link->rsl_mtx);
+		close(fd);
+		return (pool);
+	}
+
+	/* Pages past the end of the file would fault on access */
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < size) {
+		g_mutex_unlock(&link->rsl_mtx);
+		return (NULL);
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		g_mutex_unlock(&link->rsl_mtx);
+		return (NULL);
+	}
+
+	pool = g_new0(struct rpc_shmem_pool, 1);
+	pool->rsp_id = id;
+	pool->rsp_fd = fd;
+	pool->rsp_base = base;
+	pool->rsp_size = size;
+	pool->rsp_remote = true;
+	pool->rsp_conn = link->rsl_conn;
+	pool->rsp_refcnt = 2;
+	g_hash_table_insert(link->rsl_mapped, &pool->rsp_id, pool);
+	g_mutex_unlock(&link->rsl_mtx);
+	return (pool);
+}
+
+/*
+ * Drops cached mappings nothing but the cache refers to anymore. Called
+ * with the link locked.
+ */
+static void
+rpc_shmem_link_trim_files(struct rpc_shmem_link *link)
+{
+	struct rpc_shmem_pool *pool;
+	GHashTableIter iter;
+
+	g_hash_table_iter_init(&iter, link->rsl_files);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&pool)) {
+		if (g_atomic_int_get(&pool->rsp_refcnt) == 1)
+			g_hash_table_iter_remove(&iter);
+	}
+}
+
+/*
+ * Points a received plain shmem object into a cached mapping of its
+ * file, mapping the file if it isn't cached yet. The same memory sent
+ * over and over again, like a ring buffer, then costs an fstat() and a
+ * close() of the duplicate descriptor per message instead of an mmap(),
+ * page faults and an munmap() per view. Objects that can't be cached
+ * are left alone.
+ */
+void
+rpc_shmem_link_cache(struct rpc_shmem_link *link,
+    struct rpc_shmem_block *block)
+{
+	struct rpc_shmem_file key;
+	struct rpc_shmem_pool *pool;
+	struct stat st;
+	void *base;
+	int fd = block->rsb_fd;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+
+	if (block->rsb_offset < 0 || (size_t)st.st_size <
+	    (size_t)block->rsb_offset + block->rsb_size)
+		return;
+
+	key.rsf_dev = st.st_dev;
+	key.rsf_ino = st.st_ino;
+
+	g_mutex_lock(&link->rsl_mtx);
+	pool = g_hash_table_lookup(link->rsl_files, &key);
+	if (pool != NULL && pool->rsp_size >=
+	    (size_t)block->rsb_offset + block->rsb_size) {
+		g_atomic_int_inc(&pool->rsp_refcnt);
+		g_mutex_unlock(&link->rsl_mtx);
+		close(fd);
+		goto done;
+	}
+
+	/* A file that grew gets mapped anew; old views keep the old one */
+	if (pool == NULL &&
+	    g_hash_table_size(link->rsl_files) >= RPC_SHMEM_FILE_CACHE) {
+		rpc_shmem_link_trim_files(link);
+		if (g_hash_table_size(link->rsl_files) >= RPC_SHMEM_FILE_CACHE) {
+			g_mutex_unlock(&link->rsl_mtx);
+			return;
+		}
+	}
+
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		g_mutex_unlock(&link->rsl_mtx);
+		return;
+	}
+
+	pool = g_new0(struct rpc_shmem_pool, 1);
+	pool->rsp_fd = fd;
+	pool->rsp_base = base;
+	pool->rsp_size = (size_t)st.st_size;
+	pool->rsp_remote = true;
+	pool->rsp_refcnt = 2;
+	g_hash_table_replace(link->rsl_files, g_memdup(&key, sizeof(key)),
+	    pool);
+	g_mutex_unlock(&link->rsl_mtx);
+
+done:
+	block->rsb_fd = pool->rsp_fd;
+	block->rsb_pool = pool;
+}
+
+struct rpc_shmem_pool *
+rpc_shmem_link_lookup(struct rpc_shmem_link *link, uint64_t id)
+{
+	struct rpc_shmem_pool *pool;
+
+	g_mutex_lock(&link->rsl_mtx);
+	pool = g_hash_table_lookup(link->rsl_mapped, &id);
+	if (pool != NULL)
+		g_atomic_int_inc(&pool->rsp_refcnt);
+	g_mutex_unlock(&link->rsl_mtx);
+	return (pool);
+}
+
+/*
+ * The peer is done with a chunk of one of our pools. Chunks it never
+ * got from us are ignored.
+ */
+void
+rpc_shmem_link_returned(struct rpc_shmem_link *link, uint64_t id,
+    off_t offset)
+{
+	struct rpc_shmem_loan key = { .rsl_offset = offset };
+	struct rpc_shmem_loan *loan;
+
+	g_mutex_lock(&link->rsl_mtx);
+	key.rsl_pool = g_hash_table_lookup(link->rsl_shared, &id);
+	if (key.rsl_pool == NULL) {
+		g_mutex_unlock(&link->rsl_mtx);
+		return;
+	}
+
+	loan = g_hash_table_lookup(link->rsl_loans, &key);
+	if (loan == NULL) {
+		g_mutex_unlock(&link->rsl_mtx);
+		return;
+	}
+
+	if (--loan->rsl_count == 0)
+		g_hash_table_remove(link->rsl_loans, loan);
+	g_mutex_unlock(&link->rsl_mtx);
+
+	rpc_shmem_chunk_put(key.rsl_pool, offset, 1);
+}
+
+/*
+ * Queues a chunk of a peer pool to be given back. Returns whether the
+ * queue was empty, in which case the caller schedules sending it.
+ */
+bool
+rpc_shmem_link_queue_return(struct rpc_shmem_link *link, uint64_t id,
+    off_t offset)
+{
+	struct rpc_shmem_return ret = { .rsr_id = id, .rsr_offset = offset };
+	bool first;
+
+	g_mutex_lock(&link->rsl_mtx);
+	if (link->rsl_returns == NULL) {
+		link->rsl_returns = g_array_new(false, false,
+		    sizeof(struct rpc_shmem_return));
+	}
+
+	g_array_append_val(link->rsl_returns, ret);
+	first = link->rsl_returns->len == 1;
+	g_mutex_unlock(&link->rsl_mtx);
+	return (first);
+}
+
+/*
+ * Takes the queued returns, as an array of [pool id, offset] pairs to
+ * go in a single shmem.release frame.
+ */
+rpc_object_t
+rpc_shmem_link_take_returns(struct rpc_shmem_link *link)
+{
+	struct rpc_shmem_return *ret;
+	rpc_object_t result;
+	GArray *returns;
+	guint i;
+
+	g_mutex_lock(&link->rsl_mtx);
+	returns = link->rsl_returns;
+	link->rsl_returns = NULL;
+	g_mutex_unlock(&link->rsl_mtx);
+
+	if (returns == NULL)
+		return (NULL);
+
+	result = rpc_array_create();
+	for (i = 0; i < returns->len; i++) {
+		ret = &g_array_index(returns, struct rpc_shmem_return, i);
+		rpc_array_append_stolen_value(result, rpc_object_pack("[u,u]",
+		    ret->rsr_id, (uint64_t)ret->rsr_offset));
+	}
+
+	g_array_free(returns, true);
+	return (result);
+}
+
+#endif
@@ -0,0 +1,615 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/serializer.h>
+#include "internal.h"
+
+/*
+ * Snapshots.
+ *
+ * A snapshot file holds an object tree in a form that is used in place
+ * once mapped: every value is a fixed size node, and the children of a
+ * container are an array of nodes (entries, for dictionaries) at an
+ * offset from the start of the file. Nothing is parsed on load. The
+ * root and every nested container come up as lazy containers, see
+ * struct rpc_lazy, whose children are created from their nodes on first
+ * access. Binary values point into the mapping; strings are copied as
+ * their containers are first looked into.
+ *
+ * The same layout serves as a shared memory object graph: the writer
+ * fills a shared memory chunk instead of a file, only the chunk is sent
+ * and the receiver reads the graph in place from its mapping of it.
+ *
+ * Snapshots are written in host byte order and rejected on hosts of the
+ * other one. All offsets are multiples of RPC_SNAPSHOT_ALIGN.
+ */
+
+#define	RPC_SNAPSHOT_MAGIC	"RPCSNAP"
+#define	RPC_SNAPSHOT_VERSION	1
+#define	RPC_SNAPSHOT_BYTEORDER	0x01020304
+#define	RPC_SNAPSHOT_ALIGN	8
+
+/*
+ * Scalars keep their value in rsn_value (dates keep the zone offset in
+ * rsn_count). Strings, binaries and containers keep an offset there and
+ * their length or number of children in rsn_count.
+ */
+struct rpc_snapshot_node
+{
+	uint32_t		rsn_type;
+	uint32_t		rsn_count;
+	uint64_t		rsn_value;
+};
+
+struct rpc_snapshot_entry
+{
+	uint64_t		rse_key;
+	uint32_t		rse_keylen;
+	uint32_t		rse_reserved;
+	struct rpc_snapshot_node rse_value;
+};
+
+struct rpc_snapshot_header
+{
+	char			rsh_magic[8];
+	uint32_t		rsh_byteorder;
+	uint32_t		rsh_version;
+	uint64_t		rsh_size;
+	struct rpc_snapshot_node rsh_root;
+};
+
+/*
+ * A mapped file or shared memory chunk, alive for as long as a lazy
+ * container or a binary value refers to it.
+ */
+struct rpc_snapshot
+{
+	volatile int		rss_refcnt;
+	GMutex			rss_mtx;
+	const char *		rss_base;
+	size_t			rss_size;
+	rpc_object_t		rss_shmem;
+};
+
+/*
+ * Output of the writer. Without a buffer it only adds up the size, so
+ * the writer runs twice: once to size the buffer, once to fill it.
+ */
+struct rpc_snapshot_writer
+{
+	char *			rsw_data;
+	size_t			rsw_len;
+};
+
+struct rpc_snapshot_lazy
+{
+	struct rpc_lazy		rsl_base;
+	struct rpc_snapshot *	rsl_snapshot;
+	struct rpc_snapshot_node rsl_node;
+};
+
+static uint64_t rpc_snapshot_reserve(struct rpc_snapshot_writer *, size_t);
+static void rpc_snapshot_copy(struct rpc_snapshot_writer *, uint64_t,
+    const void *, size_t);
+static int rpc_snapshot_write(struct rpc_snapshot_writer *, rpc_object_t,
+    struct rpc_snapshot_node *);
+static int rpc_snapshot_build(struct rpc_snapshot_writer *, rpc_object_t);
+static rpc_object_t rpc_snapshot_open(const void *, size_t, size_t,
+    rpc_object_t);
+static bool rpc_snapshot_range(struct rpc_snapshot *, uint64_t, uint64_t);
+static void rpc_snapshot_release(struct rpc_snapshot *);
+static rpc_object_t rpc_snapshot_object(struct rpc_snapshot *,
+    const struct rpc_snapshot_node *);
+static void rpc_snapshot_materialize(rpc_object_t);
+static void rpc_snapshot_lazy_free(struct rpc_lazy *);
+
+/*
+ * Appends len zeroed bytes, aligned, and returns their offset.
+ */
+static uint64_t
+rpc_snapshot_reserve(struct rpc_snapshot_writer *out, size_t len)
+{
+	size_t start = out->rsw_len;
+	size_t off;
+
+	off = (start + RPC_SNAPSHOT_ALIGN - 1) & ~(RPC_SNAPSHOT_ALIGN - 1);
+	out->rsw_len = off + len;
+	if (out->rsw_data != NULL)
+		memset(out->rsw_data + start, 0, off + len - start);
+
+	return (off);
+}
+
+static void
+rpc_snapshot_copy(struct rpc_snapshot_writer *out, uint64_t off,
+    const void *data, size_t len)
+{
+
+	if (out->rsw_data != NULL && len > 0)
+		memcpy(out->rsw_data + off, data, len);
+}
+
+static int
+rpc_snapshot_write(struct rpc_snapshot_writer *out, rpc_object_t obj,
+    struct rpc_snapshot_node *node)
+{
+	__block int ret = 0;
+	__block size_t i = 0;
+	uint64_t base;
+	const void *data;
+	size_t len;
+	double d;
+
+	memset(node, 0, sizeof(*node));
+	node->rsn_type = rpc_get_type(obj);
+
+	switch (rpc_get_type(obj)) {
+	case RPC_TYPE_NULL:
+		break;
+
+	case RPC_TYPE_BOOL:
+		node->rsn_value = rpc_bool_get_value(obj);
+		break;
+
+	case RPC_TYPE_UINT64:
+		node->rsn_value = rpc_uint64_get_value(obj);
+		break;
+
+	case RPC_TYPE_INT64:
+		node->rsn_value = (uint64_t)rpc_int64_get_value(obj);
+		break;
+
+	case RPC_TYPE_DOUBLE:
+		d = rpc_double_get_value(obj);
+		memcpy(&node->rsn_value, &d, sizeof(d));
+		break;
+
+	case RPC_TYPE_DATE:
+		node->rsn_value = (uint64_t)obj->ro_value.rv_date.rdv_usec;
+		node->rsn_count = (uint32_t)obj->ro_value.rv_date.rdv_tz_offset;
+		break;
+
+	case RPC_TYPE_STRING:
+	case RPC_TYPE_BINARY:
+		if (rpc_get_type(obj) == RPC_TYPE_STRING) {
+			data = rpc_string_get_string_ptr(obj);
+			len = rpc_string_get_length(obj);
+		} else {
+			data = rpc_data_get_bytes_ptr(obj);
+			len = rpc_data_get_length(obj);
+		}
+
+		if (len > UINT32_MAX) {
+			rpc_set_last_errorf(E2BIG,
+			    "Value too large for a snapshot");
+			return (-1);
+		}
+
+		/* Strings keep their terminator, so they can be used as is */
+		base = rpc_snapshot_reserve(out, len + 1);
+		rpc_snapshot_copy(out, base, data, len);
+
+		node->rsn_value = base;
+		node->rsn_count = (uint32_t)len;
+		break;
+
+	case RPC_TYPE_ARRAY:
+		node->rsn_count = (uint32_t)rpc_array_get_count(obj);
+		base = rpc_snapshot_reserve(out,
+		    node->rsn_count * sizeof(struct rpc_snapshot_node));
+		node->rsn_value = base;
+
+		rpc_array_apply(obj, ^(size_t idx, rpc_object_t v) {
+			struct rpc_snapshot_node child;
+
+			if (rpc_snapshot_write(out, v, &child) != 0) {
+				ret = -1;
+				return ((bool)false);
+			}
+
+			rpc_snapshot_copy(out, base + idx * sizeof(child),
+			    &child, sizeof(child));
+			return ((bool)true);
+		});
+		break;
+
+	case RPC_TYPE_DICTIONARY:
+		node->rsn_count = (uint32_t)rpc_dictionary_get_count(obj);
+		base = rpc_snapshot_reserve(out,
+		    node->rsn_count * sizeof(struct rpc_snapshot_entry));
+		node->rsn_value = base;
+
+		rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t v) {
+			struct rpc_snapshot_entry entry;
+			size_t keylen = strlen(key);
+
+			memset(&entry, 0, sizeof(entry));
+			entry.rse_key = rpc_snapshot_reserve(out, keylen + 1);
+			entry.rse_keylen = (uint32_t)keylen;
+			rpc_snapshot_copy(out, entry.rse_key, key, keylen);
+
+			if (rpc_snapshot_write(out, v, &entry.rse_value) != 0) {
+				ret = -1;
+				return ((bool)false);
+			}
+
+			rpc_snapshot_copy(out, base + i++ * sizeof(entry),
+			    &entry, sizeof(entry));
+			return ((bool)true);
+		});
+		break;
+
+	default:
+		rpc_set_last_errorf(EINVAL,
+		    "%s values can't be stored in a snapshot",
+		    rpc_get_type_name(rpc_get_type(obj)));
+		return (-1);
+	}
+
+	return (ret);
+}
+
+static bool
+rpc_snapshot_range(struct rpc_snapshot *snap, uint64_t off, uint64_t len)
+{
+
+	return (off <= snap->rss_size && len <= snap->rss_size - off);
+}
+
+static void
+rpc_snapshot_release(struct rpc_snapshot *snap)
+{
+
+	if (!g_atomic_int_dec_and_test(&snap->rss_refcnt))
+		return;
+
+	if (snap->rss_shmem != NULL) {
+		rpc_shmem_unmap(snap->rss_shmem, (void *)snap->rss_base);
+		rpc_release(snap->rss_shmem);
+	} else
+		munmap((void *)snap->rss_base, snap->rss_size);
+
+	g_mutex_clear(&snap->rss_mtx);
+	g_free(snap);
+}
+
+/*
+ * Creates the object a node stands for. Containers come up empty and
+ * lazy. Nodes pointing outside of the mapping come up as null.
+ */
+static rpc_object_t
+rpc_snapshot_object(struct rpc_snapshot *snap,
+    const struct rpc_snapshot_node *node)
+{
+	struct rpc_snapshot_lazy *lazy;
+	union rpc_value val;
+	rpc_object_t result;
+	double d;
+
+	switch (node->rsn_type) {
+	case RPC_TYPE_BOOL:
+		result = rpc_bool_create(node->rsn_value != 0);
+		break;
+
+	case RPC_TYPE_UINT64:
+		result = rpc_uint64_create(node->rsn_value);
+		break;
+
+	case RPC_TYPE_INT64:
+		result = rpc_int64_create((int64_t)node->rsn_value);
+		break;
+
+	case RPC_TYPE_DOUBLE:
+		memcpy(&d, &node->rsn_value, sizeof(d));
+		result = rpc_double_create(d);
+		break;
+
+	case RPC_TYPE_DATE:
+		result = rpc_date_create_usec((int64_t)node->rsn_value,
+		    (int32_t)node->rsn_count);
+		break;
+
+	case RPC_TYPE_STRING:
+		if (!rpc_snapshot_range(snap, node->rsn_value,
+		    (uint64_t)node->rsn_count + 1))
+			return (rpc_null_create());
+
+		result = rpc_string_create_len(snap->rss_base +
+		    node->rsn_value, node->rsn_count);
+		break;
+
+	case RPC_TYPE_BINARY:
+		if (!rpc_snapshot_range(snap, node->rsn_value,
+		    node->rsn_count))
+			return (rpc_null_create());
+
+		g_atomic_int_inc(&snap->rss_refcnt);
+		result = rpc_data_create(snap->rss_base + node->rsn_value,
+		    node->rsn_count, ^(void *ptr __unused) {
+			rpc_snapshot_release(snap);
+		    });
+		break;
+
+	case RPC_TYPE_ARRAY:
+	case RPC_TYPE_DICTIONARY:
+		if (node->rsn_type == RPC_TYPE_ARRAY) {
+			val.rv_list = g_ptr_array_new_with_free_func(
+			    (GDestroyNotify)rpc_release_impl);
+		} else
+			val.rv_dict = rpc_dict_new(node->rsn_count);
+
+		result = rpc_prim_create(node->rsn_type, val);
+		lazy = g_new(struct rpc_snapshot_lazy, 1);
+		lazy->rsl_base.rl_materialize = rpc_snapshot_materialize;
+		lazy->rsl_base.rl_free = rpc_snapshot_lazy_free;
+		lazy->rsl_snapshot = snap;
+		lazy->rsl_node = *node;
+		g_atomic_int_inc(&snap->rss_refcnt);
+		result->ro_lazy = &lazy->rsl_base;
+		break;
+
+	default:
+		return (rpc_null_create());
+	}
+
+	result->ro_frozen = true;
+	return (result);
+}
+
+/*
+ * Creates the children of a lazy container from their nodes. Called
+ * with the container's lazy lock held; the snapshot lock serializes
+ * containers of the same snapshot.
+ */
+static void
+rpc_snapshot_materialize(rpc_object_t object)
+{
+	struct rpc_snapshot_lazy *lazy = (struct rpc_snapshot_lazy *)
+	    g_atomic_pointer_get(&object->ro_lazy);
+	const struct rpc_snapshot_node *children;
+	const struct rpc_snapshot_entry *entries;
+	struct rpc_snapshot *snap;
+	const struct rpc_snapshot_node *node;
+	uint32_t i;
+
+	if (lazy == NULL)
+		return;
+
+	snap = lazy->rsl_snapshot;
+	node = &lazy->rsl_node;
+	g_mutex_lock(&snap->rss_mtx);
+	if (object->ro_lazy == NULL) {
+		g_mutex_unlock(&snap->rss_mtx);
+		return;
+	}
+
+	if (node->rsn_type == RPC_TYPE_ARRAY &&
+	    rpc_snapshot_range(snap, node->rsn_value,
+	    (uint64_t)node->rsn_count * sizeof(*children))) {
+		children = (const void *)(snap->rss_base + node->rsn_value);
+		for (i = 0; i < node->rsn_count; i++) {
+			g_ptr_array_add(object->ro_value.rv_list,
+			    rpc_snapshot_object(snap, &children[i]));
+		}
+	}
+
+	if (node->rsn_type == RPC_TYPE_DICTIONARY &&
+	    rpc_snapshot_range(snap, node->rsn_value,
+	    (uint64_t)node->rsn_count * sizeof(*entries))) {
+		entries = (const void *)(snap->rss_base + node->rsn_value);
+		for (i = 0; i < node->rsn_count; i++) {
+			if (!rpc_snapshot_range(snap, entries[i].rse_key,
+			    (uint64_t)entries[i].rse_keylen + 1))
+				continue;
+
+			rpc_dict_insert_str(object->ro_value.rv_dict,
+			    snap->rss_base + entries[i].rse_key,
+			    entries[i].rse_keylen,
+			    rpc_snapshot_object(snap, &entries[i].rse_value));
+		}
+	}
+
+	/* Publish the storage before readers stop taking the lock */
+	g_atomic_pointer_set(&object->ro_lazy, NULL);
+	g_mutex_unlock(&snap->rss_mtx);
+	rpc_snapshot_lazy_free(&lazy->rsl_base);
+}
+
+static void
+rpc_snapshot_lazy_free(struct rpc_lazy *base)
+{
+	struct rpc_snapshot_lazy *lazy = (struct rpc_snapshot_lazy *)base;
+
+	rpc_snapshot_release(lazy->rsl_snapshot);
+	g_free(lazy);
+}
+
+/*
+ * Lays out the header and the tree. Returns the full size in rsw_len.
+ */
+static int
+rpc_snapshot_build(struct rpc_snapshot_writer *out, rpc_object_t obj)
+{
+	struct rpc_snapshot_header hdr;
+
+	out->rsw_len = 0;
+	rpc_snapshot_reserve(out, sizeof(hdr));
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (rpc_snapshot_write(out, obj, &hdr.rsh_root) != 0)
+		return (-1);
+
+	memcpy(hdr.rsh_magic, RPC_SNAPSHOT_MAGIC, sizeof(RPC_SNAPSHOT_MAGIC));
+	hdr.rsh_byteorder = RPC_SNAPSHOT_BYTEORDER;
+	hdr.rsh_version = RPC_SNAPSHOT_VERSION;
+	hdr.rsh_size = out->rsw_len;
+	rpc_snapshot_copy(out, 0, &hdr, sizeof(hdr));
+	return (0);
+}
+
+/*
+ * Validates the header of a mapped snapshot and returns its root. The
+ * snapshot takes over the mapping, and the caller's reference on shmem
+ * if there is one, even on error.
+ */
+static rpc_object_t
+rpc_snapshot_open(const void *base, size_t size, size_t expected,
+    rpc_object_t shmem)
+{
+	const struct rpc_snapshot_header *hdr = base;
+	struct rpc_snapshot *snap;
+	rpc_object_t result;
+
+	snap = g_new0(struct rpc_snapshot, 1);
+	snap->rss_refcnt = 1;
+	snap->rss_base = base;
+	snap->rss_size = size;
+	snap->rss_shmem = shmem;
+	g_mutex_init(&snap->rss_mtx);
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->rsh_magic, RPC_SNAPSHOT_MAGIC,
+	    sizeof(RPC_SNAPSHOT_MAGIC)) != 0 ||
+	    hdr->rsh_byteorder != RPC_SNAPSHOT_BYTEORDER ||
+	    hdr->rsh_version != RPC_SNAPSHOT_VERSION ||
+	    hdr->rsh_size < sizeof(*hdr) || hdr->rsh_size > size ||
+	    (expected != 0 && hdr->rsh_size != expected)) {
+		rpc_set_last_error(EINVAL,
+		    "Not a snapshot this host can read", NULL);
+		rpc_snapshot_release(snap);
+		return (NULL);
+	}
+
+	/* Trailing space of a shared memory chunk is not ours to read */
+	snap->rss_size = hdr->rsh_size;
+	result = rpc_snapshot_object(snap, &hdr->rsh_root);
+	rpc_snapshot_release(snap);
+	return (result);
+}
+
+int
+rpc_serializer_dump_snapshot(rpc_object_t obj, int fd)
+{
+	struct rpc_snapshot_writer out = { NULL, 0 };
+	int ret;
+
+	if (rpc_snapshot_build(&out, obj) != 0)
+		return (-1);
+
+	out.rsw_data = g_malloc(out.rsw_len);
+	rpc_snapshot_build(&out, obj);
+	ret = rpc_serializer_write_all(fd, out.rsw_data, out.rsw_len);
+	g_free(out.rsw_data);
+	return (ret);
+}
+
+rpc_object_t
+rpc_serializer_load_snapshot(const char *path)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		rpc_set_last_errorf(errno, "Cannot open %s: %s", path,
+		    g_strerror(errno));
+		return (NULL);
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		rpc_set_last_errorf(EINVAL, "%s is not a snapshot", path);
+		close(fd);
+		return (NULL);
+	}
+
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		rpc_set_last_errorf(errno, "Cannot map %s: %s", path,
+		    g_strerror(errno));
+		return (NULL);
+	}
+
+	return (rpc_snapshot_open(base, (size_t)st.st_size,
+	    (size_t)st.st_size, NULL));
+}
+
+#if defined(__linux__)
+rpc_object_t
+rpc_shmem_graph_create(rpc_shmem_pool_t pool, rpc_object_t obj)
+{
+	struct rpc_snapshot_writer out = { NULL, 0 };
+	rpc_object_t shmem;
+
+	if (rpc_snapshot_build(&out, obj) != 0)
+		return (NULL);
+
+	shmem = pool != NULL ? rpc_shmem_pool_alloc(pool, out.rsw_len) :
+	    rpc_shmem_create(out.rsw_len);
+	if (shmem == NULL)
+		return (NULL);
+
+	out.rsw_data = rpc_shmem_map(shmem);
+	if (out.rsw_data == MAP_FAILED) {
+		rpc_set_last_error(errno, strerror(errno), NULL);
+		rpc_release(shmem);
+		return (NULL);
+	}
+
+	rpc_snapshot_build(&out, obj);
+	rpc_shmem_unmap(shmem, out.rsw_data);
+	return (shmem);
+}
+
+rpc_object_t
+rpc_shmem_graph_open(rpc_object_t shmem)
+{
+	void *base;
+
+	if (rpc_get_type(shmem) != RPC_TYPE_SHMEM) {
+		rpc_set_last_error(EINVAL, "Not a shared memory object", NULL);
+		return (NULL);
+	}
+
+	base = rpc_shmem_map(shmem);
+	if (base == MAP_FAILED) {
+		rpc_set_last_error(errno, strerror(errno), NULL);
+		return (NULL);
+	}
+
+	return (rpc_snapshot_open(base, rpc_shmem_get_size(shmem), 0,
+	    rpc_retain(shmem)));
+}
+#endif
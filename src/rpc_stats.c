@@ -0,0 +1,620 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Per-method call statistics.
+ *
+ * Latencies go into log-linear histograms in the spirit of HdrHistogram:
+ * values below 2^RPC_HIST_SUB_BITS microseconds get a bucket each, and
+ * every power of two above that is split into 2^RPC_HIST_SUB_BITS
+ * equal parts, which bounds the relative error of a reported value to
+ * 1/2^RPC_HIST_SUB_BITS. Recording is a handful of atomic adds.
+ */
+
+static guint rpc_method_stats_hash(gconstpointer);
+static gboolean rpc_method_stats_equal(gconstpointer, gconstpointer);
+static struct rpc_method_stats *rpc_method_stats_get(struct rpc_context *,
+    const char *, const char *);
+static guint rpc_histogram_index(uint64_t);
+static uint64_t rpc_histogram_value(guint);
+static rpc_object_t rpc_histogram_export(struct rpc_histogram *);
+static void rpc_slow_log_append(rpc_context_t, GQueue *, const char *,
+    rpc_object_t);
+static rpc_object_t rpc_slow_log_export(rpc_context_t, GQueue *);
+static void rpc_context_check_slow_call(struct rpc_call *, gint64);
+
+static guint
+rpc_method_stats_hash(gconstpointer key)
+{
+	const struct rpc_method_stats *stats = key;
+
+	return (g_str_hash(stats->rms_interface) * 31 +
+	    g_str_hash(stats->rms_method));
+}
+
+static gboolean
+rpc_method_stats_equal(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_method_stats *sa = a;
+	const struct rpc_method_stats *sb = b;
+
+	return (g_str_equal(sa->rms_interface, sb->rms_interface) &&
+	    g_str_equal(sa->rms_method, sb->rms_method));
+}
+
+void
+rpc_method_stats_free(gpointer data)
+{
+	struct rpc_method_stats *stats = data;
+
+	g_free(stats->rms_interface);
+	g_free(stats->rms_method);
+	g_free(stats);
+}
+
+GHashTable *
+rpc_method_stats_table_new(void)
+{
+
+	return (g_hash_table_new_full(rpc_method_stats_hash,
+	    rpc_method_stats_equal, NULL, rpc_method_stats_free));
+}
+
+static struct rpc_method_stats *
+rpc_method_stats_get(struct rpc_context *context, const char *interface,
+    const char *method)
+{
+	struct rpc_method_stats key;
+	struct rpc_method_stats *stats;
+
+	key.rms_interface = (char *)interface;
+	key.rms_method = (char *)method;
+
+	g_mutex_lock(&context->rcx_stats_mtx);
+	stats = g_hash_table_lookup(context->rcx_stats, &key);
+	if (stats == NULL) {
+		stats = g_malloc0(sizeof(*stats));
+		stats->rms_interface = g_strdup(interface);
+		stats->rms_method = g_strdup(method);
+		g_hash_table_add(context->rcx_stats, stats);
+	}
+
+	g_mutex_unlock(&context->rcx_stats_mtx);
+	return (stats);
+}
+
+static guint
+rpc_histogram_index(uint64_t value)
+{
+	guint exp;
+
+	if (value < RPC_HIST_SUB_COUNT)
+		return ((guint)value);
+
+	exp = 63 - (guint)__builtin_clzll(value);
+	return (((exp - RPC_HIST_SUB_BITS + 1) << RPC_HIST_SUB_BITS) +
+	    (guint)((value >> (exp - RPC_HIST_SUB_BITS)) &
+	    (RPC_HIST_SUB_COUNT - 1)));
+}
+
+/* Lowest value that falls into bucket @p idx */
+static uint64_t
+rpc_histogram_value(guint idx)
+{
+	uint64_t base;
+	guint exp;
+
+	if (idx < RPC_HIST_SUB_COUNT)
+		return (idx);
+
+	exp = (idx >> RPC_HIST_SUB_BITS) + RPC_HIST_SUB_BITS - 1;
+	base = RPC_HIST_SUB_COUNT + (idx & (RPC_HIST_SUB_COUNT - 1));
+	return (base << (exp - RPC_HIST_SUB_BITS));
+}
+
+void
+rpc_histogram_record(struct rpc_histogram *hist, uint64_t value)
+{
+	uint64_t max;
+
+	__atomic_add_fetch(&hist->rh_buckets[rpc_histogram_index(value)], 1,
+	    __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->rh_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->rh_sum, value, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->rh_max, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&hist->rh_max,
+	    &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+uint64_t
+rpc_histogram_percentile(struct rpc_histogram *hist, uint64_t count,
+    double pct)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	guint i;
+
+	target = (uint64_t)(count * pct / 100.0 + 0.5);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < RPC_HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->rh_buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target)
+			return (rpc_histogram_value(i));
+	}
+
+	return (__atomic_load_n(&hist->rh_max, __ATOMIC_RELAXED));
+}
+
+static rpc_object_t
+rpc_histogram_export(struct rpc_histogram *hist)
+{
+	uint64_t count;
+	uint64_t sum;
+
+	count = __atomic_load_n(&hist->rh_count, __ATOMIC_RELAXED);
+	sum = __atomic_load_n(&hist->rh_sum, __ATOMIC_RELAXED);
+	if (count == 0)
+		return (rpc_object_pack("{count:u}", (uint64_t)0));
+
+	return (rpc_object_pack("{count:u,mean:u,p50:u,p90:u,p99:u,max:u}",
+	    count, sum / count,
+	    rpc_histogram_percentile(hist, count, 50),
+	    rpc_histogram_percentile(hist, count, 90),
+	    rpc_histogram_percentile(hist, count, 99),
+	    __atomic_load_n(&hist->rh_max, __ATOMIC_RELAXED)));
+}
+
+/*
+ * Called once an inbound call is done: records how long it waited to
+ * be picked up by a worker and how long it took from there, streaming
+ * and asynchronous responses included.
+ */
+void
+rpc_context_account_call(struct rpc_call *call)
+{
+	struct rpc_method_stats *stats;
+	gint64 now;
+
+	if (call->rc_context == NULL || call->rc_started_at == 0)
+		return;
+
+	now = g_get_monotonic_time();
+	stats = rpc_method_stats_get(call->rc_context,
+	    call->rc_interface != NULL ? call->rc_interface :
+	    RPC_DEFAULT_INTERFACE, call->rc_method_name);
+
+	if (call->rc_queued_at != 0) {
+		rpc_histogram_record(&stats->rms_queue,
+		    (uint64_t)(call->rc_started_at - call->rc_queued_at));
+	}
+
+	rpc_histogram_record(&stats->rms_exec,
+	    (uint64_t)(now - call->rc_started_at));
+
+	__atomic_add_fetch(&stats->rms_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->rms_bytes_in, call->rc_bytes_in,
+	    __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->rms_bytes_out, call->rc_bytes_out,
+	    __ATOMIC_RELAXED);
+	if (call->rc_failed)
+		__atomic_add_fetch(&stats->rms_errors, 1, __ATOMIC_RELAXED);
+
+	rpc_context_check_slow_call(call, now);
+}
+
+/*
+ * Slow calls and slow consumers.
+ *
+ * Both end up in bounded logs on the context, oldest entries going
+ * first, and are announced with slow_call and slow_consumer events of
+ * the Statistics interface on the root instance. A connection or call
+ * is reported once when it crosses the threshold, not on every frame.
+ */
+static void
+rpc_slow_log_append(rpc_context_t context, GQueue *log, const char *event,
+    rpc_object_t sample)
+{
+
+	g_mutex_lock(&context->rcx_slow_mtx);
+	g_queue_push_tail(log, rpc_retain(sample));
+	while (g_queue_get_length(log) > context->rcx_slow_log_size)
+		rpc_release(g_queue_pop_head(log));
+
+	g_mutex_unlock(&context->rcx_slow_mtx);
+	rpc_context_emit_event(context, "/", RPC_STATISTICS_INTERFACE, event,
+	    sample);
+}
+
+static rpc_object_t
+rpc_slow_log_export(rpc_context_t context, GQueue *log)
+{
+	rpc_object_t result = rpc_array_create();
+	GList *item;
+
+	g_mutex_lock(&context->rcx_slow_mtx);
+	for (item = log->head; item != NULL; item = item->next)
+		rpc_array_append_value(result, item->data);
+
+	g_mutex_unlock(&context->rcx_slow_mtx);
+	return (result);
+}
+
+static void
+rpc_context_check_slow_call(struct rpc_call *call, gint64 now)
+{
+	rpc_context_t context = call->rc_context;
+	rpc_object_t sample;
+	const char *remote;
+	char *backtrace;
+	gint64 since;
+
+	if (context->rcx_slow_call_us == 0)
+		return;
+
+	since = call->rc_queued_at != 0 ? call->rc_queued_at :
+	    call->rc_started_at;
+	if ((uint64_t)(now - since) < context->rcx_slow_call_us)
+		return;
+
+	sample = rpc_object_pack("{s,s,s,u,u,u,u,b,u}",
+	    "path", call->rc_path != NULL ? call->rc_path : "/",
+	    "interface", call->rc_interface != NULL ? call->rc_interface :
+	    RPC_DEFAULT_INTERFACE,
+	    "method", call->rc_method_name,
+	    "args_size", call->rc_bytes_in,
+	    "response_size", call->rc_bytes_out,
+	    "queue_us", (uint64_t)(call->rc_queued_at != 0 ?
+	    call->rc_started_at - call->rc_queued_at : 0),
+	    "exec_us", (uint64_t)(now - call->rc_started_at),
+	    "failed", call->rc_failed,
+	    "timestamp", (uint64_t)g_get_real_time());
+
+	remote = rpc_connection_get_remote_address(call->rc_conn);
+	if (remote != NULL)
+		rpc_dictionary_set_string(sample, "remote", remote);
+
+	/* Where the call finished, which is often where it got stuck */
+	if (context->rcx_slow_backtrace) {
+		backtrace = rpc_get_backtrace();
+		if (backtrace != NULL) {
+			rpc_dictionary_set_string(sample, "backtrace",
+			    backtrace);
+			g_free(backtrace);
+		}
+	}
+
+	rpc_slow_log_append(context, &context->rcx_slow_calls, "slow_call",
+	    sample);
+}
+
+/*
+ * The peer doesn't read what we send fast enough. Called with
+ * rco_send_mtx held whenever the send queue grows.
+ */
+void
+rpc_context_check_send_backlog(rpc_connection_t conn, size_t backlog)
+{
+	rpc_context_t context = conn->rco_rpc_context;
+	rpc_object_t sample;
+	const char *remote;
+
+	if (context == NULL || context->rcx_slow_send_bytes == 0)
+		return;
+
+	if (backlog < context->rcx_slow_send_bytes) {
+		/* Rearm once it has mostly drained */
+		if (backlog < context->rcx_slow_send_bytes / 2)
+			conn->rco_slow_flagged = false;
+
+		return;
+	}
+
+	if (conn->rco_slow_flagged)
+		return;
+
+	conn->rco_slow_flagged = true;
+	sample = rpc_object_pack("{s,u,u}",
+	    "kind", "send_queue",
+	    "backlog", (uint64_t)backlog,
+	    "timestamp", (uint64_t)g_get_real_time());
+
+	remote = rpc_connection_get_remote_address(conn);
+	if (remote != NULL)
+		rpc_dictionary_set_string(sample, "remote", remote);
+
+	rpc_slow_log_append(context, &context->rcx_slow_consumers,
+	    "slow_consumer", sample);
+}
+
+/*
+ * The application doesn't consume the fragments of an outbound call
+ * fast enough. Called with rc_mtx held, after a fragment was queued.
+ */
+void
+rpc_context_check_call_backlog(struct rpc_call *call)
+{
+	rpc_context_t context = call->rc_conn->rco_rpc_context;
+	rpc_object_t sample;
+	const char *remote;
+	guint backlog;
+
+	if (context == NULL || context->rcx_slow_queued == 0 ||
+	    call->rc_slow_flagged)
+		return;
+
+	backlog = call->rc_queue.rcq_len;
+	if (backlog < context->rcx_slow_queued)
+		return;
+
+	call->rc_slow_flagged = true;
+	sample = rpc_object_pack("{s,s,s,u,u}",
+	    "kind", "call_queue",
+	    "interface", call->rc_interface != NULL ? call->rc_interface :
+	    RPC_DEFAULT_INTERFACE,
+	    "method", call->rc_method_name,
+	    "backlog", (uint64_t)backlog,
+	    "timestamp", (uint64_t)g_get_real_time());
+
+	remote = rpc_connection_get_remote_address(call->rc_conn);
+	if (remote != NULL)
+		rpc_dictionary_set_string(sample, "remote", remote);
+
+	rpc_slow_log_append(context, &context->rcx_slow_consumers,
+	    "slow_consumer", sample);
+}
+
+void
+rpc_context_set_slow_call_threshold(rpc_context_t context,
+    uint64_t threshold_us, bool backtrace)
+{
+
+	g_mutex_lock(&context->rcx_slow_mtx);
+	context->rcx_slow_call_us = threshold_us;
+	context->rcx_slow_backtrace = backtrace;
+	g_mutex_unlock(&context->rcx_slow_mtx);
+}
+
+void
+rpc_context_set_slow_consumer_threshold(rpc_context_t context,
+    size_t send_backlog, size_t queued_fragments)
+{
+
+	g_mutex_lock(&context->rcx_slow_mtx);
+	context->rcx_slow_send_bytes = send_backlog;
+	context->rcx_slow_queued = queued_fragments;
+	g_mutex_unlock(&context->rcx_slow_mtx);
+}
+
+void
+rpc_context_set_slow_log_size(rpc_context_t context, size_t entries)
+{
+
+	g_mutex_lock(&context->rcx_slow_mtx);
+	context->rcx_slow_log_size = MAX(entries, 1);
+	while (g_queue_get_length(&context->rcx_slow_calls) >
+	    context->rcx_slow_log_size)
+		rpc_release(g_queue_pop_head(&context->rcx_slow_calls));
+
+	while (g_queue_get_length(&context->rcx_slow_consumers) >
+	    context->rcx_slow_log_size)
+		rpc_release(g_queue_pop_head(&context->rcx_slow_consumers));
+
+	g_mutex_unlock(&context->rcx_slow_mtx);
+}
+
+rpc_object_t
+rpc_context_get_slow_calls(rpc_context_t context)
+{
+
+	return (rpc_slow_log_export(context, &context->rcx_slow_calls));
+}
+
+rpc_object_t
+rpc_context_get_slow_consumers(rpc_context_t context)
+{
+
+	return (rpc_slow_log_export(context, &context->rcx_slow_consumers));
+}
+
+rpc_object_t
+rpc_context_get_method_stats(rpc_context_t context)
+{
+	struct rpc_method_stats *stats;
+	GHashTableIter iter;
+	rpc_object_t result;
+
+	result = rpc_array_create();
+	g_mutex_lock(&context->rcx_stats_mtx);
+	g_hash_table_iter_init(&iter, context->rcx_stats);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&stats, NULL)) {
+		rpc_array_append_stolen_value(result, rpc_object_pack(
+		    "{s,s,calls:u,errors:u,bytes_in:u,bytes_out:u,v,v}",
+		    "interface", stats->rms_interface,
+		    "method", stats->rms_method,
+		    __atomic_load_n(&stats->rms_calls, __ATOMIC_RELAXED),
+		    __atomic_load_n(&stats->rms_errors, __ATOMIC_RELAXED),
+		    __atomic_load_n(&stats->rms_bytes_in, __ATOMIC_RELAXED),
+		    __atomic_load_n(&stats->rms_bytes_out, __ATOMIC_RELAXED),
+		    "queue", rpc_histogram_export(&stats->rms_queue),
+		    "exec", rpc_histogram_export(&stats->rms_exec)));
+	}
+
+	g_mutex_unlock(&context->rcx_stats_mtx);
+	return (result);
+}
+
+/*
+ * Connection traffic counters.
+ *
+ * A connection receives frames on a single thread and sends them under
+ * its send lock, so its counters see next to no contention. Servers
+ * keep no counters of their own on the hot path: their totals are those
+ * of the live connections plus what closed ones left behind, which is
+ * merged in on disconnect.
+ */
+uint64_t
+rpc_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+void
+rpc_conn_stats_init(struct rpc_conn_stats *stats)
+{
+
+	memset(stats, 0, sizeof(*stats));
+	g_mutex_init(&stats->rcs_errors_mtx);
+	stats->rcs_errors_sent = g_hash_table_new(NULL, NULL);
+	stats->rcs_errors_received = g_hash_table_new(NULL, NULL);
+}
+
+void
+rpc_conn_stats_destroy(struct rpc_conn_stats *stats)
+{
+
+	g_hash_table_destroy(stats->rcs_errors_sent);
+	g_hash_table_destroy(stats->rcs_errors_received);
+	g_mutex_clear(&stats->rcs_errors_mtx);
+}
+
+static void
+rpc_conn_stats_count(GHashTable *table, int code, uint64_t count)
+{
+	gpointer key = GINT_TO_POINTER(code);
+
+	g_hash_table_insert(table, key, GSIZE_TO_POINTER(
+	    GPOINTER_TO_SIZE(g_hash_table_lookup(table, key)) + count));
+}
+
+void
+rpc_conn_stats_error(struct rpc_conn_stats *stats, bool sent, int code)
+{
+
+	g_mutex_lock(&stats->rcs_errors_mtx);
+	rpc_conn_stats_count(sent ? stats->rcs_errors_sent :
+	    stats->rcs_errors_received, code, 1);
+	g_mutex_unlock(&stats->rcs_errors_mtx);
+}
+
+void
+rpc_conn_stats_merge(struct rpc_conn_stats *dst, struct rpc_conn_stats *src)
+{
+	GHashTableIter iter;
+	gpointer code;
+	gpointer count;
+
+	__atomic_add_fetch(&dst->rcs_frames_in, __atomic_load_n(
+	    &src->rcs_frames_in, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dst->rcs_frames_out, __atomic_load_n(
+	    &src->rcs_frames_out, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dst->rcs_bytes_in, __atomic_load_n(
+	    &src->rcs_bytes_in, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dst->rcs_bytes_out, __atomic_load_n(
+	    &src->rcs_bytes_out, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dst->rcs_serialize_ns, __atomic_load_n(
+	    &src->rcs_serialize_ns, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dst->rcs_deserialize_ns, __atomic_load_n(
+	    &src->rcs_deserialize_ns, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+	g_mutex_lock(&dst->rcs_errors_mtx);
+	g_mutex_lock(&src->rcs_errors_mtx);
+	g_hash_table_iter_init(&iter, src->rcs_errors_sent);
+	while (g_hash_table_iter_next(&iter, &code, &count)) {
+		rpc_conn_stats_count(dst->rcs_errors_sent,
+		    GPOINTER_TO_INT(code), GPOINTER_TO_SIZE(count));
+	}
+
+	g_hash_table_iter_init(&iter, src->rcs_errors_received);
+	while (g_hash_table_iter_next(&iter, &code, &count)) {
+		rpc_conn_stats_count(dst->rcs_errors_received,
+		    GPOINTER_TO_INT(code), GPOINTER_TO_SIZE(count));
+	}
+
+	g_mutex_unlock(&src->rcs_errors_mtx);
+	g_mutex_unlock(&dst->rcs_errors_mtx);
+}
+
+static rpc_object_t
+rpc_conn_stats_export_errors(GHashTable *table)
+{
+	GHashTableIter iter;
+	rpc_object_t result;
+	gpointer code;
+	gpointer count;
+	char key[16];
+
+	result = rpc_dictionary_create();
+	g_hash_table_iter_init(&iter, table);
+	while (g_hash_table_iter_next(&iter, &code, &count)) {
+		g_snprintf(key, sizeof(key), "%d", GPOINTER_TO_INT(code));
+		rpc_dictionary_set_uint64(result, key,
+		    GPOINTER_TO_SIZE(count));
+	}
+
+	return (result);
+}
+
+void
+rpc_conn_stats_export(struct rpc_conn_stats *stats, rpc_object_t dict)
+{
+
+	rpc_dictionary_set_uint64(dict, "frames_in",
+	    __atomic_load_n(&stats->rcs_frames_in, __ATOMIC_RELAXED));
+	rpc_dictionary_set_uint64(dict, "frames_out",
+	    __atomic_load_n(&stats->rcs_frames_out, __ATOMIC_RELAXED));
+	rpc_dictionary_set_uint64(dict, "bytes_in",
+	    __atomic_load_n(&stats->rcs_bytes_in, __ATOMIC_RELAXED));
+	rpc_dictionary_set_uint64(dict, "bytes_out",
+	    __atomic_load_n(&stats->rcs_bytes_out, __ATOMIC_RELAXED));
+	rpc_dictionary_set_uint64(dict, "serialize_ns",
+	    __atomic_load_n(&stats->rcs_serialize_ns, __ATOMIC_RELAXED));
+	rpc_dictionary_set_uint64(dict, "deserialize_ns",
+	    __atomic_load_n(&stats->rcs_deserialize_ns, __ATOMIC_RELAXED));
+	rpc_dictionary_set_uint64(dict, "events_dropped",
+	    __atomic_load_n(&stats->rcs_events_dropped, __ATOMIC_RELAXED));
+	rpc_dictionary_set_uint64(dict, "events_coalesced",
+	    __atomic_load_n(&stats->rcs_events_coalesced, __ATOMIC_RELAXED));
+
+	g_mutex_lock(&stats->rcs_errors_mtx);
+	rpc_dictionary_steal_value(dict, "errors_sent",
+	    rpc_conn_stats_export_errors(stats->rcs_errors_sent));
+	rpc_dictionary_steal_value(dict, "errors_received",
+	    rpc_conn_stats_export_errors(stats->rcs_errors_received));
+	g_mutex_unlock(&stats->rcs_errors_mtx);
+}
@@ -0,0 +1,327 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include "internal.h"
+
+/*
+ * Frame tracing.
+ *
+ * Every thread that sends or receives frames while tracing is on gets a
+ * ring of fixed size binary records, which only that thread writes to,
+ * so recording a frame takes no locks and allocates nothing. Rings are
+ * linked into a global list that only ever grows and are never freed,
+ * which is what lets rpc_trace_dump() walk them from a signal handler.
+ * The ring of a thread that exits is picked up by the next new one.
+ * A record is complete once its sequence number matches its slot; the
+ * dump skips the ones that were being overwritten while it ran.
+ */
+
+#define	RPC_TRACE_DEFAULT_RECORDS	4096
+
+struct rpc_trace_ring
+{
+	struct rpc_trace_ring *	rtr_next;
+	volatile gint		rtr_busy;
+	uint32_t		rtr_thread;
+	uint64_t		rtr_mask;
+	volatile uint64_t	rtr_head;
+	struct rpc_trace_record	rtr_records[];
+};
+
+static uint64_t rpc_trace_now(clockid_t);
+static struct rpc_trace_ring *rpc_trace_ring_get(void);
+static void rpc_trace_ring_put(gpointer);
+static void rpc_trace_signal(int);
+
+INTERNAL_LINKAGE volatile gint rpc_trace_active;
+static volatile gint rpc_trace_flags;
+static volatile gsize rpc_trace_records = RPC_TRACE_DEFAULT_RECORDS;
+static volatile guint rpc_trace_threads;
+static struct rpc_trace_ring *volatile rpc_trace_rings;
+static GPrivate rpc_trace_ring = G_PRIVATE_INIT(rpc_trace_ring_put);
+static char rpc_trace_path[1024];
+
+static uint64_t
+rpc_trace_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+static struct rpc_trace_ring *
+rpc_trace_ring_get(void)
+{
+	struct rpc_trace_ring *ring;
+	uint64_t count = 1;
+
+	ring = g_private_get(&rpc_trace_ring);
+	if (G_LIKELY(ring != NULL))
+		return (ring);
+
+	for (ring = g_atomic_pointer_get(&rpc_trace_rings); ring != NULL;
+	    ring = ring->rtr_next) {
+		if (g_atomic_int_compare_and_exchange(&ring->rtr_busy, 0, 1)) {
+			g_private_set(&rpc_trace_ring, ring);
+			return (ring);
+		}
+	}
+
+	while (count < g_atomic_pointer_get(&rpc_trace_records))
+		count <<= 1;
+
+	ring = g_malloc0(sizeof(*ring) +
+	    count * sizeof(struct rpc_trace_record));
+	ring->rtr_mask = count - 1;
+	ring->rtr_busy = 1;
+	ring->rtr_thread = g_atomic_int_add(&rpc_trace_threads, 1) + 1;
+
+	do
+		ring->rtr_next = g_atomic_pointer_get(&rpc_trace_rings);
+	while (!g_atomic_pointer_compare_and_exchange(&rpc_trace_rings,
+	    ring->rtr_next, ring));
+
+	g_private_set(&rpc_trace_ring, ring);
+	return (ring);
+}
+
+static void
+rpc_trace_ring_put(gpointer data)
+{
+	struct rpc_trace_ring *ring = data;
+
+	g_atomic_int_set(&ring->rtr_busy, 0);
+}
+
+static void
+rpc_trace_signal(int signo)
+{
+	int saved_errno = errno;
+	int fd;
+
+	fd = open(rpc_trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1) {
+		rpc_trace_dump(fd);
+		close(fd);
+	}
+
+	errno = saved_errno;
+}
+
+/*
+ * Tracing can also be turned on from the environment, with
+ * LIBRPC_TRACE naming the file rpc_trace_dump() writes to on SIGUSR2.
+ */
+void
+rpc_trace_init(void)
+{
+	static gsize initialized = 0;
+	const char *path;
+
+	if (!g_once_init_enter(&initialized))
+		return;
+
+	path = getenv("LIBRPC_TRACE");
+	if (path != NULL && *path != '\0') {
+		rpc_trace_enable(0, 0);
+		rpc_trace_dump_on_signal(SIGUSR2, path);
+	}
+
+	g_once_init_leave(&initialized, 1);
+}
+
+void
+rpc_trace_record(uint64_t conn, uint16_t op, uint16_t flags,
+    uint64_t call_id, const void *data, size_t len)
+{
+	struct rpc_trace_ring *ring = rpc_trace_ring_get();
+	struct rpc_trace_record *rec;
+	const uint8_t *ptr = data;
+	uint32_t hash = 0x811c9dc5;
+	uint64_t head;
+	size_t i;
+
+	head = ring->rtr_head;
+	rec = &ring->rtr_records[head & ring->rtr_mask];
+
+	/* Invalidate the slot first, so that a dump can't mix records */
+	__atomic_store_n(&rec->rtr_seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->rtr_time = rpc_trace_now(CLOCK_MONOTONIC);
+	rec->rtr_conn = conn;
+	rec->rtr_call_id = call_id;
+	rec->rtr_size = (uint32_t)MIN(len, G_MAXUINT32);
+	rec->rtr_thread = ring->rtr_thread;
+	rec->rtr_op = op;
+	rec->rtr_flags = flags;
+	rec->rtr_hash = 0;
+
+	if (data != NULL &&
+	    (g_atomic_int_get(&rpc_trace_flags) & RPC_TRACE_PAYLOAD_HASH)) {
+		/* FNV-1a */
+		for (i = 0; i < len; i++) {
+			hash ^= ptr[i];
+			hash *= 0x01000193;
+		}
+
+		rec->rtr_hash = hash;
+		rec->rtr_flags |= RPC_TRACE_PAYLOAD_HASH;
+	}
+
+	__atomic_store_n(&rec->rtr_seq, head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->rtr_head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+rpc_trace_enable(size_t records, int flags)
+{
+
+	if (records != 0)
+		g_atomic_pointer_set(&rpc_trace_records, records);
+
+	g_atomic_int_set(&rpc_trace_flags, flags);
+	g_atomic_int_set(&rpc_trace_active, true);
+	return (0);
+}
+
+void
+rpc_trace_disable(void)
+{
+
+	g_atomic_int_set(&rpc_trace_active, false);
+}
+
+bool
+rpc_trace_enabled(void)
+{
+
+	return (g_atomic_int_get(&rpc_trace_active) != 0);
+}
+
+/*
+ * Only uses async-signal-safe calls, so that it can run off a signal
+ * handler. Records go out oldest first within each thread's ring.
+ */
+int
+rpc_trace_dump(int fd)
+{
+	struct rpc_trace_header hdr;
+	struct rpc_trace_record chunk[64];
+	struct rpc_trace_ring *ring;
+	struct rpc_trace_record *rec;
+	uint64_t head;
+	uint64_t seq;
+	uint64_t i;
+	size_t n = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.rth_magic = RPC_TRACE_MAGIC;
+	hdr.rth_version = RPC_TRACE_VERSION;
+	hdr.rth_record_size = sizeof(struct rpc_trace_record);
+	hdr.rth_realtime = rpc_trace_now(CLOCK_REALTIME);
+	hdr.rth_monotonic = rpc_trace_now(CLOCK_MONOTONIC);
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return (-1);
+
+	for (ring = g_atomic_pointer_get(&rpc_trace_rings); ring != NULL;
+	    ring = ring->rtr_next) {
+		head = __atomic_load_n(&ring->rtr_head, __ATOMIC_ACQUIRE);
+		i = head > ring->rtr_mask ? head - ring->rtr_mask - 1 : 0;
+
+		for (; i < head; i++) {
+			rec = &ring->rtr_records[i & ring->rtr_mask];
+			seq = __atomic_load_n(&rec->rtr_seq, __ATOMIC_ACQUIRE);
+			if (seq != i + 1)
+				continue;
+
+			chunk[n] = *rec;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&rec->rtr_seq,
+			    __ATOMIC_RELAXED) != seq)
+				continue;
+
+			if (++n < G_N_ELEMENTS(chunk))
+				continue;
+
+			if (write(fd, chunk, sizeof(chunk)) != sizeof(chunk))
+				return (-1);
+
+			n = 0;
+		}
+	}
+
+	if (n > 0 && write(fd, chunk, n * sizeof(*chunk)) !=
+	    (ssize_t)(n * sizeof(*chunk)))
+		return (-1);
+
+	return (0);
+}
+
+#ifdef _WIN32
+int
+rpc_trace_dump_on_signal(int signo, const char *path)
+{
+
+	rpc_set_last_errorf(ENOTSUP, "Not supported on this platform");
+	return (-1);
+}
+#else
+int
+rpc_trace_dump_on_signal(int signo, const char *path)
+{
+	struct sigaction sa;
+
+	if (g_strlcpy(rpc_trace_path, path, sizeof(rpc_trace_path)) >=
+	    sizeof(rpc_trace_path)) {
+		rpc_set_last_errorf(ENAMETOOLONG, "Path too long");
+		return (-1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = rpc_trace_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(signo, &sa, NULL) != 0) {
+		rpc_set_last_errorf(errno, "Cannot install signal handler: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	return (0);
+}
+#endif
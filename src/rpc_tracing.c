@@ -0,0 +1,801 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include "internal.h"
+
+/*
+ * Distributed tracing.
+ *
+ * Calls carry a W3C trace context ("traceparent" and, if there is one,
+ * "tracestate") in their rpc.call frame. An inbound call becomes a
+ * server span whose parent is the span of the caller; while its method
+ * runs, the span is the current context of the thread, so that calls
+ * made from there become client spans in the same trace. Other threads
+ * pick a context up with rpc_tracing_set_context().
+ *
+ * Whether a trace is recorded is decided once, where it starts, and
+ * travels along in the sampled flag, so that traces are either complete
+ * or missing. Unsampled calls still pass the context on, which costs a
+ * couple of random numbers; sampled ones are queued up as they finish
+ * and handed to the sink in batches by an exporter thread.
+ */
+
+#define	RPC_SPAN_BATCH		512
+#define	RPC_SPAN_QUEUE_MAX	(64 * RPC_SPAN_BATCH)
+#define	RPC_SPAN_FLUSH_US	(1000 * 1000)
+
+struct rpc_span_exporter
+{
+	GAsyncQueue *		rse_queue;
+	GThread *		rse_thread;
+	rpc_span_sink_t		rse_sink;
+	volatile gint		rse_stop;
+	volatile gint		rse_users;
+	volatile gint		rse_pending;
+	volatile guint		rse_dropped;
+};
+
+static void rpc_span_random(uint8_t *, size_t);
+static bool rpc_span_hex_decode(const char *, uint8_t *, size_t);
+static void rpc_span_hex_encode(const uint8_t *, size_t, char *);
+static bool rpc_span_is_zero(const uint8_t *, size_t);
+static uint64_t rpc_span_realtime(gint64);
+static void rpc_span_emit(const struct rpc_call *, const uint8_t *,
+    const uint8_t *, const char *, rpc_span_kind_t, gint64, gint64, bool);
+static void rpc_span_free(struct rpc_span *);
+static void *rpc_span_export_thread(void *);
+static void rpc_span_otlp_append(GString *, const struct rpc_span *);
+static void rpc_span_json_string(GString *, const char *);
+static int rpc_span_otlp_post(const char *, const char *, GString *);
+
+INTERNAL_LINKAGE volatile gint rpc_spans_active;
+static volatile gint rpc_span_sample_permille;
+static struct rpc_span_exporter *volatile rpc_span_exporter;
+static GMutex rpc_span_mtx;
+static GPrivate rpc_span_current;
+static GPrivate rpc_span_thread_ctx = G_PRIVATE_INIT(
+    (GDestroyNotify)rpc_span_context_free);
+static GPrivate rpc_span_serialize_ns;
+
+static const uint8_t rpc_span_flush_marker;
+
+static void
+rpc_span_random(uint8_t *buf, size_t len)
+{
+	guint32 value;
+	size_t i;
+
+	do {
+		for (i = 0; i < len; i += sizeof(value)) {
+			value = g_random_int();
+			memcpy(buf + i, &value, MIN(sizeof(value), len - i));
+		}
+	} while (rpc_span_is_zero(buf, len));
+}
+
+static bool
+rpc_span_hex_decode(const char *str, uint8_t *buf, size_t len)
+{
+	int hi;
+	int lo;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hi = g_ascii_xdigit_value(str[2 * i]);
+		lo = hi < 0 ? -1 : g_ascii_xdigit_value(str[2 * i + 1]);
+		if (lo < 0)
+			return (false);
+
+		buf[i] = (uint8_t)(hi << 4 | lo);
+	}
+
+	return (true);
+}
+
+static void
+rpc_span_hex_encode(const uint8_t *buf, size_t len, char *str)
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		str[2 * i] = digits[buf[i] >> 4];
+		str[2 * i + 1] = digits[buf[i] & 0xf];
+	}
+
+	str[2 * len] = '\0';
+}
+
+static bool
+rpc_span_is_zero(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != 0)
+			return (false);
+	}
+
+	return (true);
+}
+
+/* Converts a g_get_monotonic_time() timestamp to wall clock ns */
+static uint64_t
+rpc_span_realtime(gint64 monotonic)
+{
+
+	return ((uint64_t)(g_get_real_time() -
+	    (g_get_monotonic_time() - monotonic)) * 1000);
+}
+
+/*
+ * Parses a traceparent header: version, trace id, parent id and flags,
+ * dash separated and in lowercase hex. Versions other than 00 may add
+ * fields after the flags, which are ignored.
+ */
+int
+rpc_span_context_parse(struct rpc_span_context *ctx, const char *traceparent,
+    const char *tracestate)
+{
+	uint8_t version;
+	uint8_t flags;
+
+	if (traceparent == NULL || strlen(traceparent) < 55)
+		return (-1);
+
+	if (traceparent[2] != '-' || traceparent[35] != '-' ||
+	    traceparent[52] != '-')
+		return (-1);
+
+	if (!rpc_span_hex_decode(traceparent, &version, 1) || version == 0xff)
+		return (-1);
+
+	if (version == 0 && traceparent[55] != '\0')
+		return (-1);
+
+	if (!rpc_span_hex_decode(traceparent + 3, ctx->rsc_trace_id, 16) ||
+	    !rpc_span_hex_decode(traceparent + 36, ctx->rsc_parent_id, 8) ||
+	    !rpc_span_hex_decode(traceparent + 53, &flags, 1))
+		return (-1);
+
+	if (rpc_span_is_zero(ctx->rsc_trace_id, 16) ||
+	    rpc_span_is_zero(ctx->rsc_parent_id, 8))
+		return (-1);
+
+	ctx->rsc_sampled = (flags & 0x01) != 0;
+	ctx->rsc_valid = true;
+	g_free(ctx->rsc_tracestate);
+	ctx->rsc_tracestate = g_strdup(tracestate);
+	return (0);
+}
+
+/*
+ * Makes ctx a new span: a child of parent if there is one, or the root
+ * of a new trace, sampled at the configured rate, if not.
+ */
+void
+rpc_span_context_child(struct rpc_span_context *ctx,
+    const struct rpc_span_context *parent)
+{
+
+	if (parent != NULL && parent->rsc_valid) {
+		memcpy(ctx->rsc_trace_id, parent->rsc_trace_id, 16);
+		memcpy(ctx->rsc_parent_id, parent->rsc_span_id, 8);
+		ctx->rsc_sampled = parent->rsc_sampled;
+		ctx->rsc_tracestate = g_strdup(parent->rsc_tracestate);
+	} else {
+		rpc_span_random(ctx->rsc_trace_id, 16);
+		memset(ctx->rsc_parent_id, 0, 8);
+		ctx->rsc_sampled = g_random_int_range(0, 1000) <
+		    g_atomic_int_get(&rpc_span_sample_permille);
+	}
+
+	rpc_span_random(ctx->rsc_span_id, 8);
+	ctx->rsc_valid = true;
+}
+
+void
+rpc_span_context_free(struct rpc_span_context *ctx)
+{
+
+	if (ctx == NULL)
+		return;
+
+	g_free(ctx->rsc_tracestate);
+	g_free(ctx->rsc_traceparent);
+	g_free(ctx);
+}
+
+void
+rpc_span_inbound(struct rpc_call *call, const char *traceparent,
+    const char *tracestate)
+{
+	struct rpc_span_context parent = { 0 };
+
+	if (traceparent == NULL ||
+	    rpc_span_context_parse(&parent, traceparent, tracestate) != 0) {
+		rpc_span_context_child(&call->rc_span, NULL);
+	} else {
+		/* The caller's span id is what we're the child of */
+		memcpy(parent.rsc_span_id, parent.rsc_parent_id, 8);
+		rpc_span_context_child(&call->rc_span, &parent);
+	}
+
+	g_free(parent.rsc_tracestate);
+	call->rc_span.rsc_start = g_get_monotonic_time();
+}
+
+void
+rpc_span_outbound(struct rpc_call *call)
+{
+	struct rpc_span_context *parent;
+
+	parent = g_private_get(&rpc_span_current);
+	if (parent == NULL)
+		parent = g_private_get(&rpc_span_thread_ctx);
+
+	rpc_span_context_child(&call->rc_span, parent);
+	call->rc_span.rsc_start = g_get_monotonic_time();
+}
+
+const char *
+rpc_span_traceparent(struct rpc_span_context *ctx)
+{
+	char trace_id[33];
+	char span_id[17];
+
+	if (!ctx->rsc_valid)
+		return (NULL);
+
+	if (ctx->rsc_traceparent == NULL) {
+		rpc_span_hex_encode(ctx->rsc_trace_id, 16, trace_id);
+		rpc_span_hex_encode(ctx->rsc_span_id, 8, span_id);
+		ctx->rsc_traceparent = g_strdup_printf("00-%s-%s-%02x",
+		    trace_id, span_id, ctx->rsc_sampled ? 1 : 0);
+	}
+
+	return (ctx->rsc_traceparent);
+}
+
+struct rpc_span_context *
+rpc_span_enter(struct rpc_call *call)
+{
+	struct rpc_span_context *prev;
+
+	prev = g_private_get(&rpc_span_current);
+	g_private_set(&rpc_span_current, call->rc_span.rsc_valid ?
+	    &call->rc_span : NULL);
+	return (prev);
+}
+
+void
+rpc_span_leave(struct rpc_span_context *prev)
+{
+
+	g_private_set(&rpc_span_current, prev);
+}
+
+void
+rpc_span_stream_start(struct rpc_call *call)
+{
+
+	if (call->rc_span.rsc_stream_start == 0)
+		call->rc_span.rsc_stream_start = g_get_monotonic_time();
+}
+
+void
+rpc_span_serialized(uint64_t ns)
+{
+
+	g_private_set(&rpc_span_serialize_ns, GSIZE_TO_POINTER(
+	    GPOINTER_TO_SIZE(g_private_get(&rpc_span_serialize_ns)) + ns));
+}
+
+uint64_t
+rpc_span_take_serialized(void)
+{
+	uint64_t result;
+
+	result = GPOINTER_TO_SIZE(g_private_get(&rpc_span_serialize_ns));
+	g_private_set(&rpc_span_serialize_ns, NULL);
+	return (result);
+}
+
+static void
+rpc_span_emit(const struct rpc_call *call, const uint8_t *span_id,
+    const uint8_t *parent_id, const char *name, rpc_span_kind_t kind,
+    gint64 start, gint64 end, bool failed)
+{
+	struct rpc_span_exporter *exporter;
+	struct rpc_span *span;
+
+	exporter = g_atomic_pointer_get(&rpc_span_exporter);
+	if (exporter == NULL)
+		return;
+
+	/* rpc_tracing_disable() waits for us before tearing it down */
+	g_atomic_int_inc(&exporter->rse_users);
+	if (g_atomic_pointer_get(&rpc_span_exporter) != exporter) {
+		g_atomic_int_add(&exporter->rse_users, -1);
+		return;
+	}
+
+	if (g_atomic_int_get(&exporter->rse_pending) >= RPC_SPAN_QUEUE_MAX) {
+		g_atomic_int_inc(&exporter->rse_dropped);
+		g_atomic_int_add(&exporter->rse_users, -1);
+		return;
+	}
+
+	span = g_malloc0(sizeof(*span));
+	memcpy(span->rs_trace_id, call->rc_span.rsc_trace_id, 16);
+	memcpy(span->rs_span_id, span_id, 8);
+	memcpy(span->rs_parent_id, parent_id, 8);
+	span->rs_name = name;
+	span->rs_kind = kind;
+	span->rs_path = g_strdup(call->rc_path);
+	span->rs_interface = g_strdup(call->rc_interface);
+	span->rs_method = g_strdup(call->rc_method_name);
+	span->rs_start = rpc_span_realtime(start);
+	span->rs_end = rpc_span_realtime(end);
+	span->rs_failed = failed;
+
+	g_atomic_int_inc(&exporter->rse_pending);
+	g_async_queue_push(exporter->rse_queue, span);
+	g_atomic_int_add(&exporter->rse_users, -1);
+}
+
+/*
+ * An inbound call is over. Queue wait, execution, time spent
+ * serializing what the call sent (summed up, and placed at the end)
+ * and streaming become children of the server span.
+ */
+void
+rpc_span_inbound_done(struct rpc_call *call)
+{
+	struct rpc_span_context *ctx = &call->rc_span;
+	uint8_t child[8];
+	uint64_t serialized;
+	gint64 now;
+
+	serialized = rpc_span_take_serialized();
+	if (!ctx->rsc_valid || !ctx->rsc_sampled || ctx->rsc_recorded)
+		return;
+
+	ctx->rsc_recorded = true;
+	now = g_get_monotonic_time();
+
+	rpc_span_emit(call, ctx->rsc_span_id, ctx->rsc_parent_id,
+	    "server", RPC_SPAN_SERVER, ctx->rsc_start, now, call->rc_failed);
+
+	if (call->rc_queued_at != 0 && call->rc_started_at != 0) {
+		rpc_span_random(child, sizeof(child));
+		rpc_span_emit(call, child, ctx->rsc_span_id, "queue",
+		    RPC_SPAN_INTERNAL, call->rc_queued_at, call->rc_started_at,
+		    false);
+	}
+
+	if (call->rc_started_at != 0) {
+		rpc_span_random(child, sizeof(child));
+		rpc_span_emit(call, child, ctx->rsc_span_id, "exec",
+		    RPC_SPAN_INTERNAL, call->rc_started_at, now,
+		    call->rc_failed);
+	}
+
+	if (serialized >= 1000) {
+		rpc_span_random(child, sizeof(child));
+		rpc_span_emit(call, child, ctx->rsc_span_id, "serialize",
+		    RPC_SPAN_INTERNAL, now - (gint64)(serialized / 1000), now,
+		    false);
+	}
+
+	if (ctx->rsc_stream_start != 0) {
+		rpc_span_random(child, sizeof(child));
+		rpc_span_emit(call, child, ctx->rsc_span_id, "stream",
+		    RPC_SPAN_INTERNAL, ctx->rsc_stream_start, now,
+		    call->rc_failed);
+	}
+}
+
+/* Called with rc_mtx held, when an outbound call gets its final answer */
+void
+rpc_span_outbound_done(struct rpc_call *call, bool failed)
+{
+	struct rpc_span_context *ctx = &call->rc_span;
+
+	if (!ctx->rsc_valid || !ctx->rsc_sampled || ctx->rsc_recorded)
+		return;
+
+	ctx->rsc_recorded = true;
+	rpc_span_emit(call, ctx->rsc_span_id, ctx->rsc_parent_id, "call",
+	    RPC_SPAN_CLIENT, ctx->rsc_start, g_get_monotonic_time(), failed);
+}
+
+static void
+rpc_span_free(struct rpc_span *span)
+{
+
+	g_free((char *)span->rs_path);
+	g_free((char *)span->rs_interface);
+	g_free((char *)span->rs_method);
+	g_free(span);
+}
+
+static void *
+rpc_span_export_thread(void *arg)
+{
+	struct rpc_span_exporter *exporter = arg;
+	struct rpc_span *batch;
+	void *item;
+	gint64 deadline;
+	size_t count;
+	size_t i;
+	bool done = false;
+
+	batch = g_malloc_n(RPC_SPAN_BATCH, sizeof(*batch));
+
+	while (!done) {
+		count = 0;
+		deadline = g_get_monotonic_time() + RPC_SPAN_FLUSH_US;
+
+		while (count < RPC_SPAN_BATCH) {
+			item = g_async_queue_timeout_pop(exporter->rse_queue,
+			    MAX(deadline - g_get_monotonic_time(), 0));
+			if (item == NULL)
+				break;
+
+			if (item == &rpc_span_flush_marker) {
+				done = g_atomic_int_get(&exporter->rse_stop);
+				break;
+			}
+
+			batch[count++] = *(struct rpc_span *)item;
+			g_free(item);
+		}
+
+		if (count == 0)
+			continue;
+
+		g_atomic_int_add(&exporter->rse_pending, -(gint)count);
+		exporter->rse_sink(batch, count);
+
+		for (i = 0; i < count; i++) {
+			g_free((char *)batch[i].rs_path);
+			g_free((char *)batch[i].rs_interface);
+			g_free((char *)batch[i].rs_method);
+		}
+	}
+
+	g_free(batch);
+	return (NULL);
+}
+
+static void
+rpc_span_json_string(GString *str, const char *value)
+{
+	const char *ptr;
+
+	g_string_append_c(str, '"');
+	for (ptr = value; ptr != NULL && *ptr != '\0'; ptr++) {
+		if (*ptr == '"' || *ptr == '\\')
+			g_string_append_printf(str, "\\%c", *ptr);
+		else if ((guchar)*ptr < 0x20)
+			g_string_append_printf(str, "\\u%04x", (guchar)*ptr);
+		else
+			g_string_append_c(str, *ptr);
+	}
+
+	g_string_append_c(str, '"');
+}
+
+static void
+rpc_span_otlp_append(GString *str, const struct rpc_span *span)
+{
+	char trace_id[33];
+	char span_id[17];
+	char parent_id[17];
+	static const int kinds[] = {
+		[RPC_SPAN_INTERNAL] = 1,
+		[RPC_SPAN_SERVER] = 2,
+		[RPC_SPAN_CLIENT] = 3
+	};
+
+	rpc_span_hex_encode(span->rs_trace_id, 16, trace_id);
+	rpc_span_hex_encode(span->rs_span_id, 8, span_id);
+	rpc_span_hex_encode(span->rs_parent_id, 8, parent_id);
+
+	g_string_append_printf(str, "{\"traceId\":\"%s\",\"spanId\":\"%s\",",
+	    trace_id, span_id);
+	if (!rpc_span_is_zero(span->rs_parent_id, 8))
+		g_string_append_printf(str, "\"parentSpanId\":\"%s\",",
+		    parent_id);
+
+	g_string_append(str, "\"name\":");
+	if (span->rs_kind == RPC_SPAN_INTERNAL) {
+		rpc_span_json_string(str, span->rs_name);
+	} else {
+		g_string_append_printf(str, "\"%s/%s\"",
+		    span->rs_interface != NULL ? span->rs_interface :
+		    RPC_DEFAULT_INTERFACE, span->rs_method);
+	}
+
+	g_string_append_printf(str, ",\"kind\":%d,\"startTimeUnixNano\":"
+	    "\"%" G_GUINT64_FORMAT "\",\"endTimeUnixNano\":\"%"
+	    G_GUINT64_FORMAT "\",\"attributes\":["
+	    "{\"key\":\"rpc.system\",\"value\":{\"stringValue\":\"librpc\"}},"
+	    "{\"key\":\"rpc.method\",\"value\":{\"stringValue\":",
+	    kinds[span->rs_kind], span->rs_start, span->rs_end);
+	rpc_span_json_string(str, span->rs_method);
+	g_string_append(str, "}},{\"key\":\"rpc.service\","
+	    "\"value\":{\"stringValue\":");
+	rpc_span_json_string(str, span->rs_interface != NULL ?
+	    span->rs_interface : RPC_DEFAULT_INTERFACE);
+	g_string_append(str, "}},{\"key\":\"rpc.librpc.path\","
+	    "\"value\":{\"stringValue\":");
+	rpc_span_json_string(str, span->rs_path != NULL ? span->rs_path : "/");
+	g_string_append_printf(str, "}}],\"status\":{\"code\":%d}}",
+	    span->rs_failed ? 2 : 0);
+}
+
+/*
+ * Posts a batch to an OTLP/HTTP collector. The endpoint is a plain
+ * http:// URL; HTTPS collectors need a local agent in front of them.
+ */
+static int
+rpc_span_otlp_post(const char *host_port, const char *path, GString *body)
+{
+	GSocketClient *client;
+	GSocketConnection *conn;
+	GOutputStream *out;
+	GInputStream *in;
+	char status[64];
+	char *request;
+	gssize nread;
+	int ret = -1;
+
+	client = g_socket_client_new();
+	g_socket_client_set_timeout(client, 5);
+	conn = g_socket_client_connect_to_host(client, host_port, 4318, NULL,
+	    NULL);
+	g_object_unref(client);
+	if (conn == NULL)
+		return (-1);
+
+	request = g_strdup_printf("POST %s HTTP/1.1\r\nHost: %s\r\n"
+	    "Content-Type: application/json\r\nContent-Length: %"
+	    G_GSIZE_FORMAT "\r\nConnection: close\r\n\r\n", path, host_port,
+	    body->len);
+
+	out = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+	in = g_io_stream_get_input_stream(G_IO_STREAM(conn));
+	if (!g_output_stream_write_all(out, request, strlen(request), NULL,
+	    NULL, NULL))
+		goto done;
+
+	if (!g_output_stream_write_all(out, body->str, body->len, NULL, NULL,
+	    NULL))
+		goto done;
+
+	/* "HTTP/1.1 2xx" */
+	nread = g_input_stream_read(in, status, sizeof(status) - 1, NULL, NULL);
+	if (nread >= 12 && status[9] == '2')
+		ret = 0;
+
+done:
+	g_free(request);
+	g_object_unref(conn);
+	return (ret);
+}
+
+int
+rpc_tracing_enable(double sample_rate, rpc_span_sink_t sink)
+{
+	struct rpc_span_exporter *exporter;
+
+	if (sample_rate < 0 || sample_rate > 1) {
+		rpc_set_last_errorf(EINVAL, "Sample rate out of range");
+		return (-1);
+	}
+
+	g_mutex_lock(&rpc_span_mtx);
+	if (g_atomic_pointer_get(&rpc_span_exporter) != NULL) {
+		g_mutex_unlock(&rpc_span_mtx);
+		rpc_set_last_errorf(EBUSY, "Tracing already enabled");
+		return (-1);
+	}
+
+	exporter = g_malloc0(sizeof(*exporter));
+	exporter->rse_queue = g_async_queue_new();
+	exporter->rse_sink = Block_copy(sink);
+	exporter->rse_thread = g_thread_new("span exporter",
+	    rpc_span_export_thread, exporter);
+
+	g_atomic_int_set(&rpc_span_sample_permille, (gint)(sample_rate * 1000));
+	g_atomic_pointer_set(&rpc_span_exporter, exporter);
+	g_atomic_int_set(&rpc_spans_active, true);
+	g_mutex_unlock(&rpc_span_mtx);
+	return (0);
+}
+
+int
+rpc_tracing_enable_otlp(double sample_rate, const char *endpoint)
+{
+	const char *host;
+	const char *slash;
+	char *host_port;
+	char *path;
+	char *service;
+
+	if (!g_str_has_prefix(endpoint, "http://")) {
+		rpc_set_last_errorf(EINVAL, "Only http:// endpoints supported");
+		return (-1);
+	}
+
+	host = endpoint + strlen("http://");
+	slash = strchr(host, '/');
+	host_port = slash != NULL ? g_strndup(host, (gsize)(slash - host)) :
+	    g_strdup(host);
+	path = g_strdup(slash != NULL ? slash : "/v1/traces");
+	service = g_strdup(g_get_prgname() != NULL ? g_get_prgname() :
+	    "librpc");
+
+	if (rpc_tracing_enable(sample_rate, ^(const struct rpc_span *spans,
+	    size_t count) {
+		GString *body = g_string_new(NULL);
+		size_t i;
+
+		g_string_append(body, "{\"resourceSpans\":[{\"resource\":"
+		    "{\"attributes\":[{\"key\":\"service.name\",\"value\":"
+		    "{\"stringValue\":");
+		rpc_span_json_string(body, service);
+		g_string_append(body, "}}]},\"scopeSpans\":[{\"scope\":"
+		    "{\"name\":\"librpc\"},\"spans\":[");
+
+		for (i = 0; i < count; i++) {
+			if (i > 0)
+				g_string_append_c(body, ',');
+
+			rpc_span_otlp_append(body, &spans[i]);
+		}
+
+		g_string_append(body, "]}]}]}");
+		if (rpc_span_otlp_post(host_port, path, body) != 0)
+			debugf("Cannot export %zu spans to %s", count,
+			    host_port);
+
+		g_string_free(body, true);
+	}) != 0) {
+		g_free(host_port);
+		g_free(path);
+		g_free(service);
+		return (-1);
+	}
+
+	/* The sink lives as long as the process does */
+	return (0);
+}
+
+void
+rpc_tracing_flush(void)
+{
+	struct rpc_span_exporter *exporter;
+
+	exporter = g_atomic_pointer_get(&rpc_span_exporter);
+	if (exporter != NULL)
+		g_async_queue_push(exporter->rse_queue,
+		    (void *)&rpc_span_flush_marker);
+}
+
+/*
+ * Spans still queued are exported before this returns. Calls that are
+ * still running won't record theirs.
+ */
+void
+rpc_tracing_disable(void)
+{
+	struct rpc_span_exporter *exporter;
+	void *item;
+
+	g_mutex_lock(&rpc_span_mtx);
+	exporter = g_atomic_pointer_get(&rpc_span_exporter);
+	if (exporter == NULL) {
+		g_mutex_unlock(&rpc_span_mtx);
+		return;
+	}
+
+	g_atomic_int_set(&rpc_spans_active, false);
+	g_atomic_pointer_set(&rpc_span_exporter, NULL);
+	g_mutex_unlock(&rpc_span_mtx);
+
+	while (g_atomic_int_get(&exporter->rse_users) > 0)
+		g_thread_yield();
+
+	/* Export what's queued up, then stop */
+	g_atomic_int_set(&exporter->rse_stop, true);
+	g_async_queue_push(exporter->rse_queue,
+	    (void *)&rpc_span_flush_marker);
+	g_thread_join(exporter->rse_thread);
+
+	while ((item = g_async_queue_try_pop(exporter->rse_queue)) != NULL) {
+		if (item != &rpc_span_flush_marker)
+			rpc_span_free(item);
+	}
+
+	g_async_queue_unref(exporter->rse_queue);
+	Block_release(exporter->rse_sink);
+	g_free(exporter);
+}
+
+bool
+rpc_tracing_enabled(void)
+{
+
+	return (g_atomic_int_get(&rpc_spans_active) != 0);
+}
+
+int
+rpc_tracing_set_context(const char *traceparent, const char *tracestate)
+{
+	struct rpc_span_context *ctx;
+
+	ctx = g_malloc0(sizeof(*ctx));
+	if (rpc_span_context_parse(ctx, traceparent, tracestate) != 0) {
+		rpc_span_context_free(ctx);
+		rpc_set_last_errorf(EINVAL, "Malformed traceparent");
+		return (-1);
+	}
+
+	/* Outbound calls become children of the span named in there */
+	memcpy(ctx->rsc_span_id, ctx->rsc_parent_id, 8);
+	g_private_replace(&rpc_span_thread_ctx, ctx);
+	return (0);
+}
+
+void
+rpc_tracing_clear_context(void)
+{
+
+	g_private_replace(&rpc_span_thread_ctx, NULL);
+}
+
+const char *
+rpc_function_get_traceparent(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (rpc_span_traceparent(&call->rc_span));
+}
+
+const char *
+rpc_function_get_tracestate(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_span.rsc_valid ? call->rc_span.rsc_tracestate : NULL);
+}
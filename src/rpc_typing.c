@@ -25,13 +25,28 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <yaml.h>
 #include <rpc/object.h>
 #include <rpc/serializer.h>
 #include "internal.h"
 
 #define SYSTEM_IDL_PATH		TOSTRING(RPC_PREFIX) "/share/idl"
+#define SYSTEM_IDL_DB		TOSTRING(RPC_PREFIX) "/share/idl.db"
+#define RPCT_DB_MAGIC		"RPCTIDB"
+#define RPCT_DB_VERSION		1
+#define RPCT_FILES		G_STRUCT_OFFSET(struct rpct_snapshot, files)
+#define RPCT_TYPES		G_STRUCT_OFFSET(struct rpct_snapshot, types)
+#define RPCT_INTERFACES		\
+    G_STRUCT_OFFSET(struct rpct_snapshot, interfaces)
+
+#define	RPCT_SYSTEM_LOADED	0
+#define	RPCT_SYSTEM_PENDING	1
+#define	RPCT_SYSTEM_LOADING	2
 
 static int rpct_read_meta(struct rpct_file *, rpc_object_t);
 static int rpct_lookup_type(const char *, const char **, rpc_object_t *,
@@ -39,6 +54,12 @@ static int rpct_lookup_type(const char *, const char **, rpc_object_t *,
 static struct rpct_type *rpct_find_type(const char *);
 static struct rpct_type *rpct_find_type_fuzzy(const char *, struct rpct_file *);
 static rpc_object_t rpct_stream_idl(void *, rpc_object_t);
+static const char *rpct_file_hash(struct rpct_file *);
+static bool rpct_is_hash(const char *);
+static rpc_object_t rpct_idl_cache_load(const char *, const char *);
+static void rpct_idl_cache_store(const char *, const char *, rpc_object_t);
+static int rpct_download_idl_once(rpc_connection_t, const char *,
+    rpc_object_t, rpc_object_t, rpc_object_t, GPtrArray *);
 static int rpct_check_fields(rpc_object_t, ...);
 #if 0
 static inline bool rpct_type_is_fully_specialized(struct rpct_typei *inst);
@@ -47,11 +68,34 @@ static inline struct rpct_typei *rpct_unwind_typei(struct rpct_typei *);
 static char *rpct_canonical_type(struct rpct_typei *);
 static int rpct_read_type(struct rpct_file *, const char *, rpc_object_t);
 static int rpct_parse_type(const char *, GPtrArray *);
+static int rpct_layout_cmp(const void *, const void *);
 static void rpct_interface_free(struct rpct_interface *);
+static rpc_object_t rpct_parse_file(const char *);
+static void rpct_parse_file_job(gpointer, gpointer);
+static void rpct_collect_files(const char *, GPtrArray *);
+static GPtrArray *rpct_parse_dir(const char *);
+static void rpct_parse_jobs_free(GPtrArray *);
+static int rpct_read_db(const uint8_t *, size_t, bool);
+static char *rpct_scan_namespace(const char *);
+static guint rpct_load_pending(const char *);
+static struct rpct_program *rpct_compile_program(struct rpct_typei *);
+static void rpct_program_free(struct rpct_program *);
+static inline bool rpct_is_name_char(char);
+static bool rpct_split_instance(const char *, char **, char **);
+static bool rpct_split_typedef(const char *, char **, char **, char **);
+static GHashTable *rpct_table_copy(GHashTable *);
+static struct rpct_snapshot *rpct_snapshot_copy(struct rpct_snapshot *);
+static struct rpct_snapshot *rpct_snapshot_acquire(void);
+static void rpct_snapshot_release(struct rpct_snapshot *);
+static struct rpct_snapshot *rpct_view(void);
+static gpointer rpct_snapshot_lookup(glong, const char *);
+static void rpct_snapshot_insert(glong, const char *, gpointer);
+static void rpct_load_begin(void);
+static void rpct_load_end(void);
+static int rpct_load_system_types(void);
+static void rpct_load_system_pending(void);
 
-static GRegex *rpct_instance_regex = NULL;
 static GRegex *rpct_interface_regex = NULL;
-static GRegex *rpct_type_regex = NULL;
 static GRegex *rpct_method_regex = NULL;
 static GRegex *rpct_property_regex = NULL;
 static GRegex *rpct_event_regex = NULL;
@@ -109,6 +153,14 @@ rpct_newi(rpct_typei_t typei, rpc_object_t object)
 		return (NULL);
 
 	object = rpc_copy(object);
+
+	/* Struct instances keep their members in layout order */
+	if (typei->type != NULL && typei->type->clazz == RPC_TYPING_STRUCT &&
+	    object->ro_type == RPC_TYPE_DICTIONARY) {
+		rpc_dict_adopt_layout(object->ro_value.rv_dict,
+		    rpct_type_get_layout(typei->type));
+	}
+
 	return (rpct_set_typei(typei, object));
 }
 
@@ -253,13 +305,18 @@ rpct_find_type(const char *name)
 {
 	struct rpct_file *file;
 	rpct_type_t type = NULL;
+	const char *decl;
+	rpc_object_t obj;
 
-	type = g_hash_table_lookup(context->types, name);
+	type = rpct_snapshot_lookup(RPCT_TYPES, name);
+	if (type != NULL)
+		return (type);
 
-	if (type == NULL) {
-		const char *decl;
-		rpc_object_t obj;
+	rpct_load_begin();
+	if (rpct_load_pending(name) > 0)
+		type = rpct_snapshot_lookup(RPCT_TYPES, name);
 
+	if (type == NULL) {
 		debugf("type %s not found, trying to look it up", name);
 
 		if (rpct_lookup_type(name, &decl, &obj, &file) == 0)
@@ -267,32 +324,94 @@ rpct_find_type(const char *name)
 
 		debugf("hopefully %s is loaded now", name);
 
-		type = g_hash_table_lookup(context->types, name);
+		type = rpct_snapshot_lookup(RPCT_TYPES, name);
 		if (type != NULL)
 			debugf("successfully chain-loaded %s", name);
 	}
 
+	rpct_load_end();
 	return (type);
 
 }
 
+/*
+ * Takes an optional dictionary of file names to content hashes the
+ * client already has. Files with a matching hash are streamed without
+ * their body.
+ */
 static rpc_object_t
-rpct_stream_idl(void *cookie, rpc_object_t args __unused)
+rpct_stream_idl(void *cookie, rpc_object_t args)
 {
 	GHashTableIter iter;
+	struct rpct_snapshot *snap;
 	struct rpct_file *file;
+	rpc_object_t known = NULL;
+	rpc_object_t entry;
+	const char *hash;
+
+	if (args != NULL && rpc_array_get_count(args) > 0) {
+		known = rpc_array_get_value(args, 0);
+		if (rpc_get_type(known) != RPC_TYPE_DICTIONARY)
+			known = NULL;
+	}
 
-	g_hash_table_iter_init(&iter, context->files);
+	rpct_load_pending(NULL);
+	snap = rpct_snapshot_acquire();
+	g_hash_table_iter_init(&iter, snap->files);
 	rpc_function_start_stream(cookie);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer)&file)) {
-		rpc_function_yield(cookie, rpc_object_pack("{s,v}",
+		hash = rpct_file_hash(file);
+		if (known != NULL && hash != NULL && g_strcmp0(hash,
+		    rpc_dictionary_get_string(known, file->path)) == 0) {
+			rpc_function_yield(cookie, rpc_object_pack("{s,s}",
+			    "name", file->path,
+			    "hash", hash));
+			continue;
+		}
+
+		entry = rpc_object_pack("{s,v}",
 		    "name", file->path,
-		    "body", rpc_retain(file->body)));
+		    "body", rpc_retain(file->body));
+
+		if (hash != NULL)
+			rpc_dictionary_set_string(entry, "hash", hash);
+
+		rpc_function_yield(cookie, entry);
 	}
 
+	rpct_snapshot_release(snap);
 	return (NULL);
 }
 
+/*
+ * SHA-256 of the msgpack form of the file body. Computed on first use
+ * and published with a CAS, so concurrent callers agree on one copy.
+ */
+static const char *
+rpct_file_hash(struct rpct_file *file)
+{
+	void *frame;
+	size_t len;
+	char *hash;
+
+	hash = g_atomic_pointer_get(&file->hash);
+	if (hash != NULL)
+		return (hash);
+
+	if (rpc_serializer_dump("msgpack", file->body, &frame, &len) != 0)
+		return (NULL);
+
+	hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, frame, len);
+	g_free(frame);
+
+	if (!g_atomic_pointer_compare_and_exchange(&file->hash, NULL, hash)) {
+		g_free(hash);
+		hash = g_atomic_pointer_get(&file->hash);
+	}
+
+	return (hash);
+}
+
 static int
 rpct_read_meta(struct rpct_file *file, rpc_object_t obj)
 {
@@ -330,12 +449,85 @@ rpct_read_meta(struct rpct_file *file, rpc_object_t obj)
 	return (ret >= 3 ? 0 : -1);
 }
 
+static inline bool
+rpct_is_name_char(char c)
+{
+
+	return (g_ascii_isalnum(c) || c == '_' || c == '.');
+}
+
+/*
+ * Splits an instance declaration like "foo.Bar<string,int64>" into
+ * the type name and its generic arguments (NULL if there are none),
+ * the same way the ([\w\.]+)(<(.*)>)? pattern used to: the first run
+ * of name characters, and everything from a '<' right after it up to
+ * the last '>'.
+ */
+static bool
+rpct_split_instance(const char *decl, char **name, char **vars)
+{
+	const char *start;
+	const char *end;
+	const char *close;
+
+	for (start = decl; *start != '\0' && !rpct_is_name_char(*start);
+	    start++)
+		;
+
+	for (end = start; rpct_is_name_char(*end); end++)
+		;
+
+	if (end == start)
+		return (false);
+
+	*name = g_strndup(start, (gsize)(end - start));
+	*vars = NULL;
+
+	close = strrchr(end, '>');
+	if (*end == '<' && close != NULL)
+		*vars = g_strndup(end + 1, (gsize)(close - end - 1));
+
+	return (true);
+}
+
+/*
+ * Same for type definitions, which come as "struct foo.Bar<T>" and
+ * the like; @p kind is one of struct, union, type, container or enum.
+ */
+static bool
+rpct_split_typedef(const char *decl, char **kind, char **name, char **vars)
+{
+	static const char *kinds[] = {
+		"struct", "union", "type", "container", "enum", NULL
+	};
+	const char **k;
+	size_t len;
+
+	while (g_ascii_isspace(*decl))
+		decl++;
+
+	for (k = kinds; *k != NULL; k++) {
+		len = strlen(*k);
+		if (strncmp(decl, *k, len) == 0 && decl[len] == ' ' &&
+		    rpct_is_name_char(decl[len + 1]))
+			break;
+	}
+
+	if (*k == NULL)
+		return (false);
+
+	if (!rpct_split_instance(decl + len + 1, name, vars))
+		return (false);
+
+	*kind = g_strdup(*k);
+	return (true);
+}
+
 struct rpct_typei *
 rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
     struct rpct_type *ptype, struct rpct_file *origin)
 {
 	GError *err = NULL;
-	GMatchInfo *match = NULL;
 	GPtrArray *splitvars = NULL;
 	struct rpct_type *type = NULL;
 	struct rpct_typei *ret = NULL;
@@ -351,19 +543,28 @@ rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
 		return (NULL);
 	}
 
-	if (!g_regex_match(rpct_instance_regex, decl, 0, &match)) {
-		rpc_set_last_errorf(EINVAL, "Invalid type specification: %s",
-		    decl);
-		goto error;
+	/*
+	 * Declarations seen on the wire resolve without any context, so
+	 * the same string always yields the same instance; look it up
+	 * before doing any parsing.
+	 */
+	if (parent == NULL && ptype == NULL && origin == NULL) {
+		g_rw_lock_reader_lock(&context->typei_decls_lock);
+		ret = g_hash_table_lookup(context->typei_decls, decl);
+		if (ret != NULL)
+			rpct_typei_retain(ret);
+
+		g_rw_lock_reader_unlock(&context->typei_decls_lock);
+		if (ret != NULL)
+			return (ret);
 	}
 
-	if (g_match_info_get_match_count(match) < 1) {
+	if (!rpct_split_instance(decl, &decltype, &declvars)) {
 		rpc_set_last_errorf(EINVAL, "Invalid type specification: %s",
 		    decl);
 		goto error;
 	}
 
-	decltype = g_match_info_fetch(match, 1);
 	type = rpct_find_type_fuzzy(decltype, origin);
 
 	if (type != NULL && !type->generic) {
@@ -372,12 +573,14 @@ rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
 		 * up in the cache
 		 */
 
+		g_rw_lock_reader_lock(&context->typei_decls_lock);
 		ret = g_hash_table_lookup(context->typei_cache, decltype);
-		if (ret != NULL) {
-			g_free(decltype);
-			g_match_info_free(match);
-			return (rpct_typei_retain(ret));
-		}
+		if (ret != NULL)
+			rpct_typei_retain(ret);
+
+		g_rw_lock_reader_unlock(&context->typei_decls_lock);
+		if (ret != NULL)
+			goto done;
 	}
 
 	if (type == NULL) {
@@ -431,7 +634,6 @@ rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
 	ret->constraints = type->constraints;
 
 	if (type->generic) {
-		declvars = g_match_info_fetch(match, 3);
 		if (declvars == NULL) {
 			rpc_set_last_errorf(EINVAL,
 			    "Invalid generic variable specification: %s",
@@ -477,9 +679,6 @@ done:
 	if (err != NULL)
 		g_error_free(err);
 
-	if (match != NULL)
-		g_match_info_free(match);
-
 	if (splitvars != NULL)
 		g_ptr_array_free(splitvars, true);
 
@@ -490,9 +689,25 @@ done:
 		g_free(declvars);
 
 	if (ret != NULL && ret->type != NULL && !ret->type->generic) {
-		rpct_typei_retain(ret);
-		g_hash_table_insert(context->typei_cache,
-		    g_strdup(ret->canonical_form), ret);
+		g_rw_lock_writer_lock(&context->typei_decls_lock);
+		if (!g_hash_table_contains(context->typei_cache,
+		    ret->canonical_form)) {
+			g_hash_table_insert(context->typei_cache,
+			    g_strdup(ret->canonical_form),
+			    rpct_typei_retain(ret));
+		}
+
+		g_rw_lock_writer_unlock(&context->typei_decls_lock);
+	}
+
+	if (ret != NULL && parent == NULL && ptype == NULL && origin == NULL) {
+		g_rw_lock_writer_lock(&context->typei_decls_lock);
+		if (!g_hash_table_contains(context->typei_decls, decl)) {
+			g_hash_table_insert(context->typei_decls,
+			    g_strdup(decl), rpct_typei_retain(ret));
+		}
+
+		g_rw_lock_writer_unlock(&context->typei_decls_lock);
 	}
 
 	return (ret);
@@ -503,10 +718,32 @@ rpct_instantiate_member(struct rpct_member *member, struct rpct_typei *parent)
 {
 	struct rpct_typei *ret;
 
+	struct rpct_typei *copy;
+
 	ret = rpct_instantiate_type(member->type->canonical_form,
 	    parent, parent->type, parent->type->file);
-	ret->constraints = member->constraints;
-	return (ret);
+	if (ret == NULL || ret->constraints == member->constraints)
+		return (ret);
+
+	/*
+	 * The instance may be shared through typei_cache, so give the
+	 * member its own copy carrying the member constraints rather
+	 * than overwriting them for everyone else.
+	 */
+	copy = g_malloc0(sizeof(*copy));
+	copy->proxy = ret->proxy;
+	copy->parent = ret->parent;
+	copy->type = ret->type;
+	copy->variable = ret->variable;
+	copy->canonical_form = g_strdup(ret->canonical_form);
+	copy->specializations = ret->specializations != NULL
+	    ? g_hash_table_ref(ret->specializations)
+	    : NULL;
+	copy->constraints = member->constraints;
+	copy->refcnt = 1;
+
+	rpct_typei_release(ret);
+	return (copy);
 }
 
 static void
@@ -518,6 +755,7 @@ rpct_type_free(rpct_type_t type)
 	g_ptr_array_free(type->generic_vars, true);
 	g_hash_table_destroy(type->members);
 	g_hash_table_destroy(type->constraints);
+	g_free(type->layout);
 	g_free(type);
 }
 
@@ -527,6 +765,7 @@ rpct_file_free(struct rpct_file *file)
 
 	rpc_release(file->body);
 	g_free(file->path);
+	g_free(file->hash);
 	g_ptr_array_free(file->uses, true);
 	g_hash_table_destroy(file->types);
 	g_hash_table_destroy(file->interfaces);
@@ -730,7 +969,8 @@ rpct_lookup_type(const char *name, const char **decl, rpc_object_t *result,
 	struct rpct_file *file;
 	__block int ret = -1;
 
-	g_hash_table_iter_init(&iter, context->files);
+	/* Called by the loader, whose view doesn't change under it */
+	g_hash_table_iter_init(&iter, rpct_view()->files);
 
 	while (g_hash_table_iter_next(&iter, (gpointer *)&filename,
 	    (gpointer *)&file)) {
@@ -739,15 +979,15 @@ rpct_lookup_type(const char *name, const char **decl, rpc_object_t *result,
 
 		rpc_dictionary_apply(file->body,
 		    ^(const char *key, rpc_object_t value) {
-			GMatchInfo *m;
+			g_autofree char *type_kind = NULL;
 			g_autofree char *type_name = NULL;
+			g_autofree char *type_vars = NULL;
 			g_autofree char *full_name = NULL;
 
-			if (!g_regex_match(rpct_type_regex, key, 0, &m)) {
-				g_match_info_free(m);
+			if (!rpct_split_typedef(key, &type_kind, &type_name,
+			    &type_vars))
 				return ((bool)true);
-			}
-			type_name = g_match_info_fetch(m, 2);
+
 			full_name = file->ns != NULL
 			    ? g_strdup_printf("%s.%s", file->ns, type_name)
 			    : g_strdup(type_name);
@@ -757,11 +997,9 @@ rpct_lookup_type(const char *name, const char **decl, rpc_object_t *result,
 				*result = value;
 				*filep = file;
 				ret = 0;
-				g_match_info_free(m);
 				return ((bool)false);
 			}
 
-			g_match_info_free(m);
 			return ((bool)true);
 		});
 	}
@@ -783,7 +1021,6 @@ rpct_read_type(struct rpct_file *file, const char *decl, rpc_object_t obj)
 	char *declname = NULL;
 	char *declvars = NULL;
 	const char *type_def = NULL;
-	GMatchInfo *match = NULL;
 	rpc_object_t members = NULL;
 	int ret = 0;
 
@@ -807,28 +1044,18 @@ rpct_read_type(struct rpct_file *file, const char *decl, rpc_object_t obj)
 		}
 	}
 
-	if (!g_regex_match(rpct_type_regex, decl, 0, &match)) {
-		rpc_set_last_errorf(EINVAL, "Syntax error: %s", decl);
-		ret = -1;
-		goto done;
-	}
-
-	if (g_match_info_get_match_count(match) < 2) {
+	if (!rpct_split_typedef(decl, &decltype, &declname, &declvars)) {
 		rpc_set_last_errorf(EINVAL, "Syntax error: %s", decl);
 		ret = -1;
 		goto done;
 	}
 
-	decltype = g_match_info_fetch(match, 1);
-	declname = g_match_info_fetch(match, 2);
-	declvars = g_match_info_fetch(match, 4);
-
 	typename = file->ns != NULL
 	    ? g_strdup_printf("%s.%s", file->ns, declname)
 	    : g_strdup(declname);
 
 	/* If type already exists, do nothing */
-	if (g_hash_table_contains(context->types, typename)) {
+	if (rpct_snapshot_lookup(RPCT_TYPES, typename) != NULL) {
 		g_free(typename);
 		ret = 0;
 		goto done;
@@ -912,12 +1139,10 @@ rpct_read_type(struct rpct_file *file, const char *decl, rpc_object_t obj)
 		g_assert_nonnull(type->value_type);
 	}
 
-	if (!g_hash_table_insert(context->types, g_strdup(type->name), type))
-		g_assert_not_reached();
+	rpct_snapshot_insert(RPCT_TYPES, type->name, type);
 
 	debugf("inserted type %s", declname);
 done:
-	g_match_info_free(match);
 	if (declvars != NULL)
 		g_free(declvars);
 	if (declname != NULL)
@@ -1222,7 +1447,7 @@ rpct_read_interface(struct rpct_file *file, const char *decl, rpc_object_t obj)
 
 	g_match_info_free(match);
 
-	if (g_hash_table_contains(context->interfaces, iface->name))
+	if (rpct_snapshot_lookup(RPCT_INTERFACES, iface->name) != NULL)
 		goto abort;
 
 	result = rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t v) {
@@ -1249,7 +1474,7 @@ rpct_read_interface(struct rpct_file *file, const char *decl, rpc_object_t obj)
 		goto abort;
 	}
 
-	g_hash_table_insert(context->interfaces, iface->name, iface);
+	rpct_snapshot_insert(RPCT_INTERFACES, iface->name, iface);
 	g_hash_table_insert(file->interfaces, iface->name, iface);
 	return (ret);
 
@@ -1285,69 +1510,223 @@ rpct_read_idl(const char *name, rpc_object_t idl)
 		return (-1);
 	}
 
-	if (g_hash_table_contains(context->files, name)) {
+	rpct_load_begin();
+	if (rpct_snapshot_lookup(RPCT_FILES, name) != NULL) {
 		debugf("file %s already loaded", name);
+		rpct_load_end();
 		return (0);
 	}
 
-	g_hash_table_insert(context->files, g_strdup(name), file);
+	rpct_snapshot_insert(RPCT_FILES, name, file);
+	rpct_load_end();
 	return (0);
 }
 
+/*
+ * Parses an IDL file straight out of a read-only mapping, instead of
+ * reading it into a buffer first. Doesn't touch the typing context, so
+ * multiple files may be parsed concurrently.
+ */
+static rpc_object_t
+rpct_parse_file(const char *path)
+{
+	GMappedFile *file;
+	GError *err = NULL;
+	rpc_object_t obj;
+	const char *contents;
+	size_t length;
+
+	file = g_mapped_file_new(path, false, &err);
+	if (file == NULL) {
+		rpc_set_last_gerror(err);
+		g_error_free(err);
+		return (NULL);
+	}
+
+	/* Empty files have no mapping */
+	contents = g_mapped_file_get_contents(file);
+	length = g_mapped_file_get_length(file);
+	obj = rpc_serializer_load("yaml", contents != NULL ? contents : "",
+	    length);
+
+	g_mapped_file_unref(file);
+	return (obj);
+}
+
 int
 rpct_read_file(const char *path)
 {
-	char *contents;
-	size_t length;
 	rpc_auto_object_t obj = NULL;
-	GError *err = NULL;
 
 	debugf("trying to read %s", path);
 
-	if (g_hash_table_contains(context->files, path)) {
+	if (rpct_snapshot_lookup(RPCT_FILES, path) != NULL) {
 		debugf("file %s already loaded", path);
 		return (0);
 	}
 
-	if (!g_file_get_contents(path, &contents, &length, &err)) {
-		rpc_set_last_gerror(err);
+	obj = rpct_parse_file(path);
+	if (obj == NULL)
 		return (-1);
+
+	return (rpct_read_idl(path, obj));
+}
+
+static struct rpct_program *
+rpct_compile_program(struct rpct_typei *typei)
+{
+	GHashTableIter iter;
+	const struct rpct_validator *v;
+	struct rpct_program *prog;
+	struct rpct_check *check;
+	struct rpct_member *member;
+	const char *key;
+	rpc_object_t value;
+	guint i;
+	int t;
+
+	prog = g_malloc0(sizeof(*prog));
+	prog->raw = rpct_unwind_typei(typei);
+	prog->handler = rpc_find_class_handler(NULL, typei->type->clazz);
+	g_assert_nonnull(prog->handler);
+
+	/* Which untyped objects the instance accepts */
+	if (g_strcmp0(prog->raw->canonical_form, "any") == 0)
+		prog->untyped_mask = UINT32_MAX;
+
+	if (g_strcmp0(prog->raw->canonical_form, "nullptr") == 0)
+		prog->untyped_mask |= (1u << RPC_TYPE_NULL);
+
+	for (t = 0; t < RPC_TYPE_COUNT; t++) {
+		if (g_strcmp0(rpc_get_type_name((rpc_type_t)t),
+		    prog->raw->canonical_form) == 0)
+			prog->untyped_mask |= (1u << t);
+	}
+
+	/* Resolve validators for each constraint and object type */
+	if (typei->constraints != NULL) {
+		prog->checks = g_new0(struct rpct_check,
+		    g_hash_table_size(typei->constraints));
+
+		g_hash_table_iter_init(&iter, typei->constraints);
+		while (g_hash_table_iter_next(&iter, (gpointer *)&key,
+		    (gpointer *)&value)) {
+			check = &prog->checks[prog->nchecks++];
+			check->name = key;
+			check->args = value;
+
+			for (t = 0; t < RPC_TYPE_COUNT; t++) {
+				v = rpc_find_validator(
+				    rpc_get_type_name((rpc_type_t)t), key);
+				check->validators[t] = v;
+				if (v != NULL && v->compile != NULL)
+					check->compiled[t] = v->compile(value);
+			}
+		}
 	}
 
-	obj = rpc_serializer_load("yaml", contents, length);
-	g_free(contents);
+	/* Instantiate struct members up front */
+	if (typei->type->clazz == RPC_TYPING_STRUCT) {
+		prog->members = g_new0(struct rpct_program_member,
+		    g_hash_table_size(typei->type->members));
 
-	if (obj == NULL)
-		return (-1);
+		i = 0;
+		g_hash_table_iter_init(&iter, typei->type->members);
+		while (g_hash_table_iter_next(&iter, (gpointer *)&key,
+		    (gpointer *)&member)) {
+			prog->members[i].name = member->name;
+			prog->members[i].typei = rpct_instantiate_member(member,
+			    typei);
+			i++;
+		}
 
-	return (rpct_read_idl(path, obj));
+		prog->nmembers = i;
+	}
+
+	return (prog);
+}
+
+static void
+rpct_program_free(struct rpct_program *prog)
+{
+	struct rpct_check *check;
+	guint i;
+	int t;
+
+	for (i = 0; i < prog->nchecks; i++) {
+		check = &prog->checks[i];
+		for (t = 0; t < RPC_TYPE_COUNT; t++) {
+			if (check->compiled[t] != NULL)
+				check->validators[t]->release(
+				    check->compiled[t]);
+		}
+	}
+
+	for (i = 0; i < prog->nmembers; i++) {
+		if (prog->members[i].typei != NULL)
+			rpct_typei_release(prog->members[i].typei);
+	}
+
+	g_free(prog->members);
+	g_free(prog->checks);
+	g_free(prog);
+}
+
+struct rpct_program *
+rpct_typei_program(struct rpct_typei *typei)
+{
+	struct rpct_program *prog;
+
+	prog = g_atomic_pointer_get(&typei->program);
+	if (prog != NULL)
+		return (prog);
+
+	/* Two threads may race to compile; the loser frees its copy */
+	prog = rpct_compile_program(typei);
+	if (!g_atomic_pointer_compare_and_exchange(&typei->program, NULL,
+	    prog)) {
+		rpct_program_free(prog);
+		prog = g_atomic_pointer_get(&typei->program);
+	}
+
+	return (prog);
 }
 
 bool
 rpct_run_validators(struct rpct_typei *typei, rpc_object_t obj,
     struct rpct_error_context *errctx)
 {
-	GHashTableIter iter;
+	const struct rpct_program *prog;
+	const struct rpct_check *check;
 	const struct rpct_validator *v;
-	const char *typename = rpc_get_type_name(rpc_get_type(obj));
-	const char *key;
-	rpc_object_t value;
+	rpc_type_t type = rpc_get_type(obj);
 	bool valid = true;
+	guint i;
+
+	prog = rpct_typei_program(typei);
 
 	/* Run validators */
-	g_hash_table_iter_init(&iter, typei->constraints);
-	while (g_hash_table_iter_next(&iter, (gpointer *)&key,
-	    (gpointer *)&value)) {
-		v = rpc_find_validator(typename, key);
+	for (i = 0; i < prog->nchecks; i++) {
+		check = &prog->checks[i];
+		v = check->validators[type];
 		if (v == NULL) {
 			rpct_add_error(errctx, NULL, "Validator %s not found",
-			    key);
+			    check->name);
 			valid = false;
 			continue;
 		}
 
-		debugf("Running validator %s on %s", key, typename);
-		if (!v->validate(obj, value, typei, errctx))
+		debugf("Running validator %s on %s", check->name,
+		    rpc_get_type_name(type));
+		if (check->compiled[type] != NULL) {
+			if (!v->validate_compiled(obj, check->compiled[type],
+			    typei, errctx))
+				valid = false;
+
+			continue;
+		}
+
+		if (!v->validate(obj, check->args, typei, errctx))
 			valid = false;
 	}
 
@@ -1358,55 +1737,39 @@ bool
 rpct_validate_instance(struct rpct_typei *typei, rpc_object_t obj,
     struct rpct_error_context *errctx)
 {
-	const struct rpct_class_handler *handler;
-	struct rpct_typei *raw_typei;
-	bool valid;
+	const struct rpct_program *prog;
+	struct rpct_typei *obj_typei;
 
-	raw_typei = rpct_unwind_typei(typei);
+	prog = rpct_typei_program(typei);
 
 	/* Step 1: is it typed at all? */
 	if (obj->ro_typei == NULL) {
 		/* Can only be builtin type */
-		if (g_strcmp0(raw_typei->canonical_form, "any") == 0)
-			goto step3;
-
-		if (g_strcmp0(raw_typei->canonical_form, "nullptr") == 0) {
-			if (obj->ro_type == RPC_TYPE_NULL)
-				goto step3;
-		}
-
-		if (g_strcmp0(rpc_get_type_name(obj->ro_type),
-		    raw_typei->canonical_form) == 0)
+		if (prog->untyped_mask & (1u << obj->ro_type))
 			goto step3;
 
 		rpct_add_error(errctx, NULL,
 		    "Incompatible type %s, should be %s",
 		    rpc_get_type_name(obj->ro_type),
-		    raw_typei->canonical_form);
+		    prog->raw->canonical_form);
 		return (false);
 	}
 
 	/* Step 2: check type */
-	if (!rpct_typei_is_compatible(raw_typei,
-	    rpct_unwind_typei(obj->ro_typei))) {
+	obj_typei = rpct_unwind_typei(obj->ro_typei);
+	if (obj_typei != prog->raw &&
+	    !rpct_typei_is_compatible(prog->raw, obj_typei)) {
 		rpct_add_error(errctx, NULL,
 		    "Incompatible type %s, should be %s",
 		    obj->ro_typei->canonical_form,
 		    typei->canonical_form);
 
-		valid = false;
-		goto done;
+		return (false);
 	}
 
 step3:
-	handler = rpc_find_class_handler(NULL, typei->type->clazz);
-	g_assert_nonnull(handler);
-
 	/* Step 3: run per-class validator */
-	valid = handler->validate_fn(typei, obj, errctx);
-
-done:
-	return (valid);
+	return (prog->handler->validate_fn(typei, obj, errctx));
 }
 
 bool
@@ -1499,6 +1862,129 @@ rpct_validate(struct rpct_typei *typei, rpc_object_t obj, rpc_object_t *errors)
 	return (valid);
 }
 
+static const char *rpct_validation_modes[RPCT_VALIDATE_MAX] = {
+	[RPCT_VALIDATE_ALWAYS] = "always",
+	[RPCT_VALIDATE_NEVER] = "never",
+	[RPCT_VALIDATE_SAMPLED] = "sampled",
+	[RPCT_VALIDATE_UNTRUSTED] = "untrusted",
+};
+
+/*
+ * Decides once per call whether it gets validated, so that with sampling
+ * a call has either both its arguments and result checked or neither.
+ */
+static bool
+rpct_should_validate(struct rpc_call *ic)
+{
+	rpc_context_t context = ic->rc_context;
+	rpc_connection_t conn = ic->rc_conn;
+	int mode = RPCT_VALIDATE_ALWAYS;
+	guint rate = 1;
+	bool validate;
+
+	if (ic->rc_validate != 0)
+		return (ic->rc_validate > 0);
+
+	if (context != NULL && context->rcx_validation_mode !=
+	    RPCT_VALIDATE_DEFAULT) {
+		mode = context->rcx_validation_mode;
+		rate = context->rcx_validation_rate;
+	}
+
+	if (conn != NULL && conn->rco_validation_mode !=
+	    RPCT_VALIDATE_DEFAULT) {
+		mode = conn->rco_validation_mode;
+		rate = conn->rco_validation_rate;
+	}
+
+	switch (mode) {
+	case RPCT_VALIDATE_NEVER:
+		validate = false;
+		break;
+
+	case RPCT_VALIDATE_SAMPLED:
+		validate = context == NULL || rate <= 1 ||
+		    (guint)g_atomic_int_add(&context->rcx_validation_tick,
+		    1) % rate == 0;
+		break;
+
+	case RPCT_VALIDATE_UNTRUSTED:
+		validate = conn != NULL && (!conn->rco_has_creds ||
+		    conn->rco_creds.rcc_uid != geteuid());
+		break;
+
+	default:
+		validate = true;
+		break;
+	}
+
+	ic->rc_validate = validate ? 1 : -1;
+	ic->rc_validation_mode = mode;
+
+	if (!validate && context != NULL) {
+		__atomic_add_fetch(
+		    &context->rcx_validation_stats[mode].rvs_skipped, 1,
+		    __ATOMIC_RELAXED);
+	}
+
+	return (validate);
+}
+
+static void
+rpct_count_validation(struct rpc_call *ic, bool valid)
+{
+	struct rpct_validation_stats *stats;
+
+	if (ic->rc_context == NULL)
+		return;
+
+	stats = &ic->rc_context->rcx_validation_stats[ic->rc_validation_mode];
+	__atomic_add_fetch(&stats->rvs_validated, 1, __ATOMIC_RELAXED);
+	if (!valid)
+		__atomic_add_fetch(&stats->rvs_failed, 1, __ATOMIC_RELAXED);
+}
+
+void
+rpct_set_validation_policy(rpc_context_t context,
+    rpct_validation_mode_t mode, unsigned int rate)
+{
+
+	g_assert(mode < RPCT_VALIDATE_MAX);
+	context->rcx_validation_rate = MAX(rate, 1);
+	context->rcx_validation_mode = mode;
+}
+
+void
+rpct_connection_set_validation_policy(rpc_connection_t conn,
+    rpct_validation_mode_t mode, unsigned int rate)
+{
+
+	g_assert(mode < RPCT_VALIDATE_MAX);
+	conn->rco_validation_rate = MAX(rate, 1);
+	conn->rco_validation_mode = mode;
+}
+
+rpc_object_t
+rpct_get_validation_stats(rpc_context_t context)
+{
+	struct rpct_validation_stats *stats;
+	rpc_object_t result;
+	int mode;
+
+	result = rpc_dictionary_create();
+	for (mode = RPCT_VALIDATE_ALWAYS; mode < RPCT_VALIDATE_MAX; mode++) {
+		stats = &context->rcx_validation_stats[mode];
+		rpc_dictionary_steal_value(result, rpct_validation_modes[mode],
+		    rpc_object_pack("{validated:u,skipped:u,failed:u}",
+			__atomic_load_n(&stats->rvs_validated,
+			    __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->rvs_skipped, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->rvs_failed, __ATOMIC_RELAXED)));
+	}
+
+	return (result);
+}
+
 rpc_object_t
 rpct_pre_call_hook(void *cookie, rpc_object_t args)
 {
@@ -1506,13 +1992,20 @@ rpct_pre_call_hook(void *cookie, rpc_object_t args)
 	struct rpct_if_member *member;
 	char *msg;
 	rpc_object_t errors;
+	bool valid;
 
 	g_assert(ic->rc_type == RPC_INBOUND_CALL);
 	member = rpct_find_if_member(ic->rc_interface, ic->rc_method_name);
 	if (member == NULL)
 		return (NULL);
 
-	if (!rpct_validate_args(member, args, &errors)) {
+	if (!rpct_should_validate(ic))
+		return (NULL);
+
+	valid = rpct_validate_args(member, args, &errors);
+	rpct_count_validation(ic, valid);
+
+	if (!valid) {
 		msg = g_strdup_printf("Validation failed: %zu errors",
 		    rpc_array_get_count(errors));
 
@@ -1531,13 +2024,20 @@ rpct_post_call_hook(void *cookie, rpc_object_t result)
 	struct rpc_call *ic = cookie;
 	struct rpct_if_member *member;
 	rpc_object_t errors;
+	bool valid;
 
 	g_assert(ic->rc_type == RPC_INBOUND_CALL);
 	member = rpct_find_if_member(ic->rc_interface, ic->rc_method_name);
 	if (member == NULL)
 		return (NULL);
 
-	if (!rpct_validate_return(member, result, &errors)) {
+	if (!rpct_should_validate(ic))
+		return (NULL);
+
+	valid = rpct_validate_return(member, result, &errors);
+	rpct_count_validation(ic, valid);
+
+	if (!valid) {
 		rpc_function_error_ex(cookie, rpc_error_create(EINVAL,
 		    "Return value validation failed", errors));
 	}
@@ -1555,36 +2055,146 @@ rpct_allow_idl_download(rpc_context_t context)
 int
 rpct_download_idl(rpc_connection_t conn)
 {
-	rpc_call_t call;
-	rpc_object_t result;
-	rpc_object_t body;
-	const char *name;
-	int ret = 0;
 
-	call = rpc_connection_call(conn, "/", RPCT_TYPING_INTERFACE,
-	    "download", NULL, NULL);
-	if (call == NULL)
-		return (-1);
+	return (rpct_download_idl_cached(conn, NULL));
+}
 
-next:
-	rpc_call_wait(call);
+/*
+ * Hashes come off the wire and end up in cache file names, so only
+ * accept what a SHA-256 hex digest looks like.
+ */
+static bool
+rpct_is_hash(const char *hash)
+{
+	size_t i;
 
-	switch (rpc_call_status(call)) {
-	case RPC_CALL_STREAM_START:
-		rpc_call_continue(call, true);
-		goto next;
+	if (hash == NULL || strlen(hash) != 64)
+		return (false);
 
-	case RPC_CALL_MORE_AVAILABLE:
-		result = rpc_call_result(call);
-		if (rpc_object_unpack(result, "{s,v}",
-		    "name", &name,
-		    "body", &body) < 2) {
-			ret = -1;
-			break;
-		}
+	for (i = 0; i < 64; i++) {
+		if (!g_ascii_isxdigit(hash[i]))
+			return (false);
+	}
 
-		if (rpct_read_idl(name, body) < 0)
-			ret = -1;
+	return (true);
+}
+
+static rpc_object_t
+rpct_idl_cache_load(const char *cachedir, const char *hash)
+{
+	rpc_object_t ret;
+	char *path;
+	char *contents;
+	gsize len;
+
+	path = g_strdup_printf("%s/%s.idl", cachedir, hash);
+	if (!g_file_get_contents(path, &contents, &len, NULL)) {
+		g_free(path);
+		return (NULL);
+	}
+
+	ret = rpc_serializer_load("msgpack", contents, len);
+	g_free(contents);
+	g_free(path);
+	return (ret);
+}
+
+static void
+rpct_idl_cache_store(const char *cachedir, const char *hash,
+    rpc_object_t body)
+{
+	void *frame;
+	size_t len;
+	char *path;
+
+	if (rpc_serializer_dump("msgpack", body, &frame, &len) != 0)
+		return;
+
+	/* A failed write only means the file is downloaded again */
+	path = g_strdup_printf("%s/%s.idl", cachedir, hash);
+	if (!g_file_set_contents(path, frame, (gssize)len, NULL))
+		debugf("cannot write %s", path);
+
+	g_free(frame);
+	g_free(path);
+}
+
+static int
+rpct_download_idl_once(rpc_connection_t conn, const char *cachedir,
+    rpc_object_t known, rpc_object_t index, rpc_object_t bodies,
+    GPtrArray *missing)
+{
+	rpc_call_t call;
+	rpc_object_t result;
+	rpc_object_t body;
+	rpc_object_t args;
+	const char *name;
+	const char *hash;
+	int ret = 0;
+
+	args = rpc_array_create();
+	rpc_array_append_value(args, known);
+	call = rpc_connection_call(conn, "/", RPCT_TYPING_INTERFACE,
+	    "download", args, NULL);
+	rpc_release(args);
+	if (call == NULL)
+		return (-1);
+
+next:
+	rpc_call_wait(call);
+
+	switch (rpc_call_status(call)) {
+	case RPC_CALL_STREAM_START:
+		rpc_call_continue(call, true);
+		goto next;
+
+	case RPC_CALL_MORE_AVAILABLE:
+		/* Older servers leave out the hash and always send the body */
+		result = rpc_call_result(call);
+		if (rpc_get_type(result) != RPC_TYPE_DICTIONARY) {
+			ret = -1;
+			break;
+		}
+
+		name = rpc_dictionary_get_string(result, "name");
+		hash = rpc_dictionary_get_string(result, "hash");
+		body = rpc_dictionary_get_value(result, "body");
+		if (name == NULL) {
+			ret = -1;
+			break;
+		}
+
+		if (!rpct_is_hash(hash))
+			hash = NULL;
+
+		if (body == NULL) {
+			/* We've told the server we have this one */
+			if (rpct_snapshot_lookup(RPCT_FILES, name) != NULL) {
+				if (hash != NULL)
+					rpc_dictionary_set_string(index, name,
+					    hash);
+
+				rpc_call_continue(call, true);
+				goto next;
+			}
+
+			body = hash != NULL && cachedir != NULL ?
+			    rpct_idl_cache_load(cachedir, hash) : NULL;
+			if (body == NULL) {
+				g_ptr_array_add(missing, g_strdup(name));
+				rpc_call_continue(call, true);
+				goto next;
+			}
+
+			rpc_dictionary_steal_value(bodies, name, body);
+		} else {
+			rpc_dictionary_set_value(bodies, name, body);
+			if (hash != NULL && cachedir != NULL)
+				rpct_idl_cache_store(cachedir, hash, body);
+		}
+
+		if (hash != NULL)
+			rpc_dictionary_set_string(index, name, hash);
 
 		rpc_call_continue(call, true);
 		goto next;
@@ -1602,10 +2212,311 @@ next:
 	}
 
 	rpc_call_free(call);
+	return (ret);
+}
+
+int
+rpct_download_idl_cached(rpc_connection_t conn, const char *cachedir)
+{
+	GPtrArray *missing;
+	rpc_object_t known = NULL;
+	rpc_object_t index;
+	rpc_object_t bodies;
+	char *indexpath = NULL;
+	__block bool failed = false;
+	char *contents;
+	void *frame;
+	size_t len;
+	gsize clen;
+	guint i;
+	int ret;
+
+	if (cachedir != NULL) {
+		if (g_mkdir_with_parents(cachedir, 0755) != 0) {
+			rpc_set_last_errorf(errno, "Cannot create %s",
+			    cachedir);
+			return (-1);
+		}
+
+		indexpath = g_build_filename(cachedir, "index", NULL);
+		if (g_file_get_contents(indexpath, &contents, &clen, NULL)) {
+			known = rpc_serializer_load("msgpack", contents, clen);
+			g_free(contents);
+		}
+	}
+
+	if (known == NULL || rpc_get_type(known) != RPC_TYPE_DICTIONARY) {
+		if (known != NULL)
+			rpc_release(known);
+
+		known = rpc_dictionary_create();
+	}
+
+	missing = g_ptr_array_new_with_free_func(g_free);
+	index = rpc_dictionary_create();
+	bodies = rpc_dictionary_create();
+	ret = rpct_download_idl_once(conn, cachedir, known, index, bodies,
+	    missing);
+
+	/*
+	 * Some cache entries went away behind our back. Ask again, this
+	 * time for their bodies too.
+	 */
+	if (ret == 0 && missing->len > 0) {
+		for (i = 0; i < missing->len; i++) {
+			rpc_dictionary_remove_key(known,
+			    g_ptr_array_index(missing, i));
+		}
+
+		g_ptr_array_set_size(missing, 0);
+		ret = rpct_download_idl_once(conn, cachedir, known, index,
+		    bodies, missing);
+		if (ret == 0 && missing->len > 0) {
+			rpc_set_last_errorf(EIO, "Server did not send %s",
+			    (const char *)g_ptr_array_index(missing, 0));
+			ret = -1;
+		}
+	}
+
+	/*
+	 * Nothing is read in until the download is over, so that a slow
+	 * server doesn't hold up other loads. What's downloaded is then
+	 * published in one go.
+	 */
+	rpct_load_begin();
+	rpc_dictionary_apply(bodies, ^(const char *name, rpc_object_t v) {
+		if (rpct_read_idl(name, v) < 0)
+			failed = true;
+
+		return ((bool)true);
+	});
+
+	if (failed)
+		ret = -1;
+
+	/* The index only keeps files the server still has */
+	if (ret == 0 && indexpath != NULL &&
+	    rpc_serializer_dump("msgpack", index, &frame, &len) == 0) {
+		if (!g_file_set_contents(indexpath, frame, (gssize)len, NULL))
+			debugf("cannot write %s", indexpath);
+
+		g_free(frame);
+	}
+
+	g_ptr_array_free(missing, true);
+	rpc_release(bodies);
+	rpc_release(index);
+	rpc_release(known);
+	g_free(indexpath);
 	rpct_load_types_cached();
+	rpct_load_end();
 	return (ret);
 }
 
+static GHashTable *
+rpct_table_copy(GHashTable *from)
+{
+	GHashTable *result;
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+
+	result = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	if (from == NULL)
+		return (result);
+
+	g_hash_table_iter_init(&iter, from);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		g_hash_table_insert(result, g_strdup(key), value);
+
+	return (result);
+}
+
+static struct rpct_snapshot *
+rpct_snapshot_copy(struct rpct_snapshot *from)
+{
+	struct rpct_snapshot *result;
+
+	result = g_malloc0(sizeof(*result));
+	result->refcnt = 1;
+	result->generation = from != NULL ? from->generation + 1 : 0;
+	result->files = rpct_table_copy(from != NULL ? from->files : NULL);
+	result->types = rpct_table_copy(from != NULL ? from->types : NULL);
+	result->interfaces = rpct_table_copy(from != NULL ?
+	    from->interfaces : NULL);
+
+	return (result);
+}
+
+/*
+ * For walks that may take a while, or call out. The snapshot stays
+ * around until released, even if a newer one gets published.
+ */
+static struct rpct_snapshot *
+rpct_snapshot_acquire(void)
+{
+	struct rpct_snapshot *snap;
+
+	rpct_load_system_pending();
+	rpc_epoch_enter();
+	snap = rpct_view();
+	g_atomic_int_inc(&snap->refcnt);
+	rpc_epoch_exit();
+	return (snap);
+}
+
+static void
+rpct_snapshot_release(struct rpct_snapshot *snap)
+{
+
+	if (!g_atomic_int_dec_and_test(&snap->refcnt))
+		return;
+
+	g_hash_table_unref(snap->files);
+	g_hash_table_unref(snap->types);
+	g_hash_table_unref(snap->interfaces);
+	g_free(snap);
+}
+
+/*
+ * The loader sees what it has staged so far, everyone else the last
+ * published snapshot. Must be called within an epoch section, unless
+ * by the loader.
+ */
+static struct rpct_snapshot *
+rpct_view(void)
+{
+
+	if (g_atomic_pointer_get(&context->loader) == g_thread_self() &&
+	    context->staging != NULL)
+		return (context->staging);
+
+	return (g_atomic_pointer_get(&context->current));
+}
+
+/*
+ * What's found stays valid once the snapshot is gone; only the tables
+ * go away with it.
+ */
+static gpointer
+rpct_snapshot_lookup(glong table, const char *key)
+{
+	gpointer result;
+
+	rpct_load_system_pending();
+	rpc_epoch_enter();
+	result = g_hash_table_lookup(G_STRUCT_MEMBER(GHashTable *,
+	    rpct_view(), table), key);
+	rpc_epoch_exit();
+	return (result);
+}
+
+/*
+ * The first change a load makes copies the published tables; the rest
+ * go to the same copy.
+ */
+static void
+rpct_snapshot_insert(glong table, const char *key, gpointer value)
+{
+
+	g_assert(g_atomic_pointer_get(&context->loader) == g_thread_self());
+	if (context->staging == NULL)
+		context->staging = rpct_snapshot_copy(context->current);
+
+	g_hash_table_insert(G_STRUCT_MEMBER(GHashTable *, context->staging,
+	    table), g_strdup(key), value);
+}
+
+static void
+rpct_load_begin(void)
+{
+
+	g_rec_mutex_lock(&context->load_mtx);
+	if (context->load_depth++ == 0)
+		g_atomic_pointer_set(&context->loader, g_thread_self());
+}
+
+/*
+ * Publishes what the outermost load has staged. Readers still on the
+ * previous snapshot finish against it; it's freed once they're out.
+ */
+static void
+rpct_load_end(void)
+{
+	struct rpct_snapshot *old;
+
+	g_assert(context->load_depth > 0);
+	if (--context->load_depth == 0) {
+		if (context->staging != NULL) {
+			old = context->current;
+			g_atomic_pointer_set(&context->current,
+			    context->staging);
+			context->staging = NULL;
+			rpc_epoch_retire(old,
+			    (GDestroyNotify)rpct_snapshot_release);
+		}
+
+		g_atomic_pointer_set(&context->loader, NULL);
+	}
+
+	g_rec_mutex_unlock(&context->load_mtx);
+}
+
+static int
+rpct_load_system_types(void)
+{
+
+	/* From the compiled database if there's one */
+	if (g_file_test(SYSTEM_IDL_DB, G_FILE_TEST_EXISTS) &&
+	    rpct_load_types_db(SYSTEM_IDL_DB) == 0)
+		return (0);
+
+	return (rpct_load_types_dir(SYSTEM_IDL_PATH));
+}
+
+/*
+ * Loads the system types left for later by rpct_init_deferred(), the
+ * first time anything is looked up. Other threads looking things up
+ * meanwhile wait for the load; the loading thread itself goes on with
+ * what it has staged.
+ */
+static void
+rpct_load_system_pending(void)
+{
+
+	if (g_atomic_int_get(&context->system_types) == RPCT_SYSTEM_LOADED)
+		return;
+
+	g_rec_mutex_lock(&context->load_mtx);
+	if (context->system_types == RPCT_SYSTEM_PENDING) {
+		g_atomic_int_set(&context->system_types, RPCT_SYSTEM_LOADING);
+		if (rpct_load_system_types() != 0)
+			debugf("cannot load system types");
+
+		g_atomic_int_set(&context->system_types, RPCT_SYSTEM_LOADED);
+	}
+
+	g_rec_mutex_unlock(&context->load_mtx);
+}
+
+/*
+ * Same as rpct_init(true), but the system types are only loaded once
+ * something is looked up, which short-lived processes often never do.
+ */
+int
+rpct_init_deferred(void)
+{
+
+	if (context != NULL)
+		return (0);
+
+	if (rpct_init(false) != 0)
+		return (-1);
+
+	context->system_types = RPCT_SYSTEM_PENDING;
+	return (0);
+}
+
 int
 rpct_init(bool load_system_types)
 {
@@ -1617,211 +2528,760 @@ rpct_init(bool load_system_types)
 		return (0);
 
 	/* Compile all the regexes */
-	rpct_instance_regex = g_regex_new(INSTANCE_REGEX, 0,
-	    G_REGEX_MATCH_NOTEMPTY, NULL);
 	rpct_interface_regex =  g_regex_new(INTERFACE_REGEX, 0,
 	    G_REGEX_MATCH_NOTEMPTY, NULL);
 	rpct_property_regex = g_regex_new(PROPERTY_REGEX, 0,
 	    G_REGEX_MATCH_NOTEMPTY, NULL);
-	rpct_type_regex = g_regex_new(TYPE_REGEX, 0,
-	    G_REGEX_MATCH_NOTEMPTY, NULL);
 	rpct_method_regex = g_regex_new(METHOD_REGEX, 0,
 	    G_REGEX_MATCH_NOTEMPTY, NULL);
 	rpct_event_regex = g_regex_new(EVENT_REGEX, 0,
 	    G_REGEX_MATCH_NOTEMPTY, NULL);
 
-	context = g_malloc0(sizeof(*context));
-	context->files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-	    (GDestroyNotify)rpct_file_free);
-	context->types = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-	    (GDestroyNotify)rpct_type_free);
-	context->interfaces = g_hash_table_new_full(g_str_hash, g_str_equal,
-	    NULL, (GDestroyNotify)rpct_interface_free);
-	context->typei_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
-	    g_free, (GDestroyNotify)rpct_typei_release);
+	context = g_malloc0(sizeof(*context));
+	context->current = rpct_snapshot_copy(NULL);
+	g_rec_mutex_init(&context->load_mtx);
+	context->typei_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)rpct_typei_release);
+	context->typei_decls = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)rpct_typei_release);
+	g_rw_lock_init(&context->typei_decls_lock);
+	context->pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, g_free);
+
+	for (b = builtin_types; *b != NULL; b++) {
+		type = g_malloc0(sizeof(*type));
+		type->name = g_strdup(*b);
+		type->clazz = RPC_TYPING_BUILTIN;
+		type->members = g_hash_table_new_full(g_str_hash, g_str_equal,
+		    g_free, (GDestroyNotify)rpct_member_free);
+		type->constraints = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, (GDestroyNotify)rpc_release_impl);
+		type->description = g_strdup_printf("Builtin %s type", *b);
+		type->generic_vars = g_ptr_array_new();
+		g_hash_table_insert(context->current->types,
+		    g_strdup(type->name), type);
+	}
+
+	if (load_system_types)
+		return (rpct_load_system_types());
+
+	return (0);
+}
+
+bool
+rpct_is_initialized(void)
+{
+
+	return (context != NULL);
+}
+
+void
+rpct_free(void)
+{
+	GHashTableIter iter;
+	struct rpct_interface *iface;
+	struct rpct_file *file;
+
+	g_hash_table_iter_init(&iter, context->current->files);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&file))
+		rpct_file_free(file);
+
+	g_hash_table_iter_init(&iter, context->current->interfaces);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&iface))
+		rpct_interface_free(iface);
+
+	rpct_snapshot_release(context->current);
+	g_hash_table_unref(context->typei_decls);
+	g_hash_table_unref(context->pending);
+	g_rw_lock_clear(&context->typei_decls_lock);
+	g_rec_mutex_clear(&context->load_mtx);
+	g_free(context);
+}
+
+rpct_typei_t
+rpct_typei_retain(rpct_typei_t typei)
+{
+
+	g_atomic_int_inc(&typei->refcnt);
+	return (typei);
+}
+
+void
+rpct_typei_release(rpct_typei_t typei)
+{
+	if (!g_atomic_int_dec_and_test(&typei->refcnt))
+		return;
+
+	if (typei->specializations != NULL)
+		g_hash_table_unref(typei->specializations);
+
+	if (typei->program != NULL)
+		rpct_program_free(typei->program);
+
+	g_free(typei->canonical_form);
+	g_free(typei);
+}
+
+int
+rpct_load_types(const char *path)
+{
+	struct rpct_file *file;
+	rpc_object_t error;
+	char *errmsg;
+	bool fail;
+
+	rpct_load_begin();
+	file = rpct_snapshot_lookup(RPCT_FILES, path);
+	if (file == NULL) {
+		if (rpct_read_file(path) != 0) {
+			rpct_load_end();
+			return (-1);
+		}
+
+		file = rpct_snapshot_lookup(RPCT_FILES, path);
+	}
+
+	g_assert_nonnull(file);
+	if (file->loaded) {
+		rpct_load_end();
+		return (-1);
+	}
+
+	fail = rpc_dictionary_apply(file->body, ^bool(const char *key,
+	    rpc_object_t v) {
+		if (g_strcmp0(key, "meta") == 0)
+			return (true);
+
+		if (g_str_has_prefix(key, "interface")) {
+			if (rpct_read_interface(file, key, v) != 0)
+				return ((bool)false);
+
+			return (true);
+	    	}
+
+		if (rpct_read_type(file, key, v) != 0)
+			return (false);
+
+		return (true);
+	});
+
+	rpct_load_end();
+	if (fail) {
+		error = rpc_get_last_error();
+		errmsg = g_strdup_printf("%s: %s", path,
+		    rpc_error_get_message(error));
+		rpc_set_last_error(rpc_error_get_code(error), errmsg,
+		    rpc_error_get_extra(error));
+		g_free(errmsg);
+		return (-1);
+	}
+
+	return (0);
+}
+
+struct rpct_parse_job
+{
+	char *			path;
+	rpc_object_t		body;
+};
+
+static void
+rpct_parse_file_job(gpointer data, gpointer user_data __unused)
+{
+	struct rpct_parse_job *job = data;
+
+	job->body = rpct_parse_file(job->path);
+	if (job->body == NULL)
+		debugf("cannot parse %s", job->path);
+}
+
+/*
+ * Gathers IDL files not read yet from a directory tree, as parse jobs.
+ */
+static void
+rpct_collect_files(const char *path, GPtrArray *jobs)
+{
+	struct rpct_parse_job *job;
+	GDir *dir;
+	const char *name;
+	char *s;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	for (;;) {
+		name = g_dir_read_name(dir);
+		if (name == NULL)
+			break;
+
+		s = g_build_filename(path, name, NULL);
+		if (g_file_test(s, G_FILE_TEST_IS_DIR)) {
+			rpct_collect_files(s, jobs);
+			g_free(s);
+			continue;
+		}
+
+		if (!g_str_has_suffix(name, ".yaml") ||
+		    rpct_snapshot_lookup(RPCT_FILES, s) != NULL) {
+			g_free(s);
+			continue;
+		}
+
+		job = g_malloc0(sizeof(*job));
+		job->path = s;
+		g_ptr_array_add(jobs, job);
+	}
+
+	g_dir_close(dir);
+}
+
+/*
+ * Files are parsed in parallel on a thread pool, as that's where most
+ * of the time goes.
+ */
+static GPtrArray *
+rpct_parse_dir(const char *path)
+{
+	GThreadPool *pool;
+	GPtrArray *jobs;
+	GError *error = NULL;
+	GDir *dir;
+	guint nthreads;
+	guint i;
+
+	dir = g_dir_open(path, 0, &error);
+	if (dir == NULL) {
+		rpc_set_last_gerror(error);
+		g_error_free(error);
+		return (NULL);
+	}
+
+	g_dir_close(dir);
+	jobs = g_ptr_array_new();
+	rpct_collect_files(path, jobs);
+
+	nthreads = MIN(g_get_num_processors(), MAX(jobs->len, 1));
+	pool = g_thread_pool_new(rpct_parse_file_job, NULL, (gint)nthreads,
+	    true, NULL);
+
+	for (i = 0; i < jobs->len; i++)
+		g_thread_pool_push(pool, g_ptr_array_index(jobs, i), NULL);
+
+	/* Waits for all the queued jobs to finish */
+	g_thread_pool_free(pool, false, true);
+	return (jobs);
+}
+
+static void
+rpct_parse_jobs_free(GPtrArray *jobs)
+{
+	struct rpct_parse_job *job;
+	guint i;
+
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index(jobs, i);
+		if (job->body != NULL)
+			rpc_release(job->body);
+
+		g_free(job->path);
+		g_free(job);
+	}
+
+	g_ptr_array_free(jobs, true);
+}
+
+/*
+ * Reading the parsed files into the context and linking the types is
+ * done in a single thread, in directory order. Readers keep seeing the
+ * previous snapshot until all of the directory is in.
+ */
+int
+rpct_load_types_dir(const char *path)
+{
+	struct rpct_parse_job *job;
+	GPtrArray *jobs;
+	guint i;
+
+	jobs = rpct_parse_dir(path);
+	if (jobs == NULL)
+		return (-1);
+
+	rpct_load_begin();
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index(jobs, i);
+		if (job->body != NULL && rpct_read_idl(job->path,
+		    job->body) != 0) {
+			rpc_release(job->body);
+			job->body = NULL;
+		}
+	}
+
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index(jobs, i);
+		if (job->body != NULL)
+			rpct_load_types(job->path);
+	}
+
+	rpct_load_end();
+	rpct_parse_jobs_free(jobs);
+	return (0);
+}
+
+/*
+ * Finds the namespace of an IDL file without parsing it, by looking
+ * for a "namespace:" line in its top-level meta section.
+ */
+static char *
+rpct_scan_namespace(const char *path)
+{
+	GMappedFile *file;
+	const char *p;
+	const char *end;
+	const char *eol;
+	const char *value;
+	char *ret = NULL;
+	bool in_meta = false;
+
+	file = g_mapped_file_new(path, false, NULL);
+	if (file == NULL)
+		return (NULL);
+
+	p = g_mapped_file_get_contents(file);
+	end = p + g_mapped_file_get_length(file);
+
+	for (; p != NULL && p < end; p = eol + 1) {
+		eol = memchr(p, '\n', (size_t)(end - p));
+		if (eol == NULL)
+			eol = end;
+
+		if (p == eol || *p == '#')
+			continue;
+
+		if (!g_ascii_isspace(*p)) {
+			in_meta = (size_t)(eol - p) >= 5 &&
+			    strncmp(p, "meta:", 5) == 0;
+			continue;
+		}
+
+		if (!in_meta)
+			continue;
+
+		while (p < eol && g_ascii_isspace(*p))
+			p++;
+
+		if ((size_t)(eol - p) < 10 || strncmp(p, "namespace:", 10) != 0)
+			continue;
+
+		value = p + 10;
+		while (value < eol && (g_ascii_isspace(*value) ||
+		    *value == '"' || *value == '\''))
+			value++;
+
+		for (p = value; p < eol && rpct_is_name_char(*p); p++)
+			;
+
+		if (p > value)
+			ret = g_strndup(value, (gsize)(p - value));
+
+		break;
+	}
+
+	g_mapped_file_unref(file);
+	return (ret);
+}
+
+/*
+ * Reads and links the indexed files whose namespace @p name belongs
+ * to, or all of them if @p name is NULL. Returns the number of files
+ * loaded.
+ */
+static guint
+rpct_load_pending(const char *name)
+{
+	GHashTableIter iter;
+	GPtrArray *paths;
+	const char *path;
+	const char *ns;
+	size_t len;
+	guint ret = 0;
+	guint i;
+
+	rpct_load_begin();
+	if (g_hash_table_size(context->pending) == 0) {
+		rpct_load_end();
+		return (0);
+	}
+
+	paths = g_ptr_array_new_with_free_func(g_free);
+	g_hash_table_iter_init(&iter, context->pending);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&path,
+	    (gpointer *)&ns)) {
+		len = strlen(ns);
+		if (name != NULL && (strncmp(name, ns, len) != 0 ||
+		    name[len] != '.'))
+			continue;
 
-	for (b = builtin_types; *b != NULL; b++) {
-		type = g_malloc0(sizeof(*type));
-		type->name = g_strdup(*b);
-		type->clazz = RPC_TYPING_BUILTIN;
-		type->members = g_hash_table_new_full(g_str_hash, g_str_equal,
-		    g_free, (GDestroyNotify)rpct_member_free);
-		type->constraints = g_hash_table_new_full(g_str_hash,
-		    g_str_equal, g_free, (GDestroyNotify)rpc_release_impl);
-		type->description = g_strdup_printf("Builtin %s type", *b);
-		type->generic_vars = g_ptr_array_new();
-		g_hash_table_insert(context->types, g_strdup(type->name), type);
+		g_ptr_array_add(paths, g_strdup(path));
+		g_hash_table_iter_remove(&iter);
 	}
 
-	/* Load system-wide types */
-	if (load_system_types)
-		return (rpct_load_types_dir(SYSTEM_IDL_PATH));
+	/* Loading may look up types from other pending files */
+	for (i = 0; i < paths->len; i++) {
+		path = g_ptr_array_index(paths, i);
+		if (rpct_snapshot_lookup(RPCT_FILES, path) != NULL ||
+		    rpct_read_file(path) != 0) {
+			g_free(paths->pdata[i]);
+			paths->pdata[i] = NULL;
+			continue;
+		}
 
-	return (0);
-}
+		ret++;
+	}
 
-void
-rpct_free(void)
-{
+	for (i = 0; i < paths->len; i++) {
+		path = g_ptr_array_index(paths, i);
+		if (path != NULL)
+			rpct_load_types(path);
+	}
 
-	g_hash_table_unref(context->files);
-	g_free(context);
+	rpct_load_end();
+	g_ptr_array_free(paths, true);
+	return (ret);
 }
 
-rpct_typei_t
-rpct_typei_retain(rpct_typei_t typei)
+int
+rpct_index_types_dir(const char *path)
 {
+	struct rpct_parse_job *job;
+	GPtrArray *jobs;
+	GError *error = NULL;
+	GDir *dir;
+	char *ns;
+	guint i;
 
-	g_atomic_int_inc(&typei->refcnt);
-	return (typei);
+	dir = g_dir_open(path, 0, &error);
+	if (dir == NULL) {
+		rpc_set_last_gerror(error);
+		g_error_free(error);
+		return (-1);
+	}
+
+	g_dir_close(dir);
+	jobs = g_ptr_array_new();
+	rpct_collect_files(path, jobs);
+
+	rpct_load_begin();
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index(jobs, i);
+		ns = rpct_scan_namespace(job->path);
+
+		/* Files without a namespace can't be found by one */
+		if (ns == NULL) {
+			if (rpct_read_file(job->path) == 0)
+				rpct_load_types(job->path);
+		} else if (!g_hash_table_contains(context->pending,
+		    job->path)) {
+			g_hash_table_insert(context->pending, job->path, ns);
+			job->path = NULL;
+			ns = NULL;
+		}
+
+		g_free(ns);
+	}
+
+	rpct_load_end();
+	rpct_parse_jobs_free(jobs);
+	return (0);
 }
 
-void
-rpct_typei_release(rpct_typei_t typei)
+/*
+ * Type database layout, all integers little endian:
+ *
+ *	header:	char magic[8], uint32 version, uint32 nfiles
+ *	file:	uint32 path length, uint32 body length, int64 mtime,
+ *		path (not terminated), body (msgpack)
+ *
+ * The bodies are the parsed YAML documents, so loading the database
+ * skips YAML parsing and goes straight to rpct_read_idl().
+ */
+struct rpct_db_entry
 {
-	if (!g_atomic_int_dec_and_test(&typei->refcnt))
-		return;
+	const char *		path;
+	uint32_t		pathlen;
+	const uint8_t *		body;
+	uint32_t		bodylen;
+	int64_t			mtime;
+};
 
-	if (typei->specializations != NULL)
-		g_hash_table_destroy(typei->specializations);
+static bool
+rpct_db_next(const uint8_t **cursor, const uint8_t *end,
+    struct rpct_db_entry *entry)
+{
+	uint32_t u32;
+	int64_t i64;
 
-	g_free(typei->canonical_form);
-	g_free(typei);
+	if (end - *cursor < 16)
+		return (false);
+
+	memcpy(&u32, *cursor, sizeof(u32));
+	entry->pathlen = GUINT32_FROM_LE(u32);
+	memcpy(&u32, *cursor + 4, sizeof(u32));
+	entry->bodylen = GUINT32_FROM_LE(u32);
+	memcpy(&i64, *cursor + 8, sizeof(i64));
+	entry->mtime = GINT64_FROM_LE(i64);
+	*cursor += 16;
+
+	if ((size_t)(end - *cursor) < (size_t)entry->pathlen + entry->bodylen)
+		return (false);
+
+	entry->path = (const char *)*cursor;
+	entry->body = *cursor + entry->pathlen;
+	*cursor += entry->pathlen + entry->bodylen;
+	return (true);
 }
 
-int
-rpct_load_types(const char *path)
+static int
+rpct_read_db(const uint8_t *data, size_t len, bool check_mtime)
 {
-	struct rpct_file *file;
-	rpc_object_t error;
-	char *errmsg;
-	bool fail;
+	struct rpct_db_entry entry;
+	const uint8_t *cursor;
+	const uint8_t *end = data + len;
+	GStatBuf st;
+	rpc_object_t body;
+	uint32_t version;
+	uint32_t nfiles;
+	uint32_t i;
+	char *path;
+	int ret;
 
-	file = g_hash_table_lookup(context->files, path);
-	if (file == NULL) {
-		if (rpct_read_file(path) != 0)
-			return (-1);
+	if (len < 16 || memcmp(data, RPCT_DB_MAGIC, sizeof(RPCT_DB_MAGIC)) != 0) {
+		rpc_set_last_errorf(EINVAL, "Not a type database");
+		return (-1);
 	}
 
-	if (file == NULL)
-		g_assert_not_reached();
+	memcpy(&version, data + 8, sizeof(version));
+	memcpy(&nfiles, data + 12, sizeof(nfiles));
+	version = GUINT32_FROM_LE(version);
+	nfiles = GUINT32_FROM_LE(nfiles);
 
-	if (file->loaded)
+	if (version != RPCT_DB_VERSION) {
+		rpc_set_last_errorf(EINVAL,
+		    "Unsupported type database version %u", version);
 		return (-1);
+	}
 
-	fail = rpc_dictionary_apply(file->body, ^bool(const char *key,
-	    rpc_object_t v) {
-		if (g_strcmp0(key, "meta") == 0)
-			return (true);
+	/* Validate the whole thing before touching the context */
+	cursor = data + 16;
+	for (i = 0; i < nfiles; i++) {
+		if (!rpct_db_next(&cursor, end, &entry)) {
+			rpc_set_last_errorf(EINVAL, "Truncated type database");
+			return (-1);
+		}
 
-		if (g_str_has_prefix(key, "interface")) {
-			if (rpct_read_interface(file, key, v) != 0)
-				return ((bool)false);
+		if (!check_mtime)
+			continue;
 
-			return (true);
-	    	}
+		path = g_strndup(entry.path, entry.pathlen);
+		if (g_stat(path, &st) != 0 || (int64_t)st.st_mtime !=
+		    entry.mtime) {
+			rpc_set_last_errorf(ESTALE,
+			    "Type database is out of date: %s", path);
+			g_free(path);
+			return (-1);
+		}
 
-		if (rpct_read_type(file, key, v) != 0)
-			return (false);
+		g_free(path);
+	}
 
-		return (true);
-	});
+	rpct_load_begin();
+	cursor = data + 16;
+	for (i = 0; i < nfiles; i++) {
+		rpct_db_next(&cursor, end, &entry);
+		path = g_strndup(entry.path, entry.pathlen);
+		if (rpct_snapshot_lookup(RPCT_FILES, path) != NULL) {
+			g_free(path);
+			continue;
+		}
 
-	if (fail) {
-		error = rpc_get_last_error();
-		errmsg = g_strdup_printf("%s: %s", path,
-		    rpc_error_get_message(error));
-		rpc_set_last_error(rpc_error_get_code(error), errmsg,
-		    rpc_error_get_extra(error));
-		g_free(errmsg);
-#ifdef RPC_TRACE
-		rpc_trace("ERROR", "rpct_load_types", rpc_get_last_error());
-#endif
-		return (-1);
+		body = rpc_serializer_load("msgpack", entry.body,
+		    entry.bodylen);
+		if (body == NULL || rpct_read_idl(path, body) != 0)
+			debugf("cannot read %s from type database", path);
+
+		if (body != NULL)
+			rpc_release(body);
+
+		g_free(path);
 	}
 
-	return (0);
+	ret = rpct_load_types_cached();
+	rpct_load_end();
+	return (ret);
 }
 
 int
-rpct_load_types_dir(const char *path)
+rpct_compile_types_dir(const char *path, const char *dbpath)
 {
-	GDir *dir;
-	GPtrArray *files;
+	struct rpct_parse_job *job;
+	GPtrArray *jobs;
+	GByteArray *out;
 	GError *error = NULL;
-	const char *name;
-	char *s;
+	GStatBuf st;
+	void *frame;
+	size_t len;
+	uint32_t u32;
+	uint32_t nfiles = 0;
+	int64_t i64;
 	guint i;
+	int ret = 0;
 
-	dir = g_dir_open(path, 0, &error);
-	if (dir == NULL) {
-		rpc_set_last_gerror(error);
-		g_error_free(error);
+	jobs = rpct_parse_dir(path);
+	if (jobs == NULL)
 		return (-1);
-	}
 
-	files = g_ptr_array_new_with_free_func((GDestroyNotify)g_free);
+	out = g_byte_array_new();
+	g_byte_array_append(out, (const guint8 *)RPCT_DB_MAGIC,
+	    sizeof(RPCT_DB_MAGIC));
+	u32 = GUINT32_TO_LE(RPCT_DB_VERSION);
+	g_byte_array_append(out, (const guint8 *)&u32, sizeof(u32));
 
-	for (;;) {
-		name = g_dir_read_name(dir);
-		if (name == NULL)
-			break;
+	/* Number of files is patched in at the end */
+	g_byte_array_append(out, (const guint8 *)&nfiles, sizeof(nfiles));
 
-		s = g_build_filename(path, name, NULL);
-		if (g_file_test(s, G_FILE_TEST_IS_DIR)) {
-			rpct_load_types_dir(s);
-			g_free(s);
-			continue;
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index(jobs, i);
+		if (job->body == NULL) {
+			rpc_set_last_errorf(EINVAL, "Cannot parse %s",
+			    job->path);
+			ret = -1;
+			goto done;
 		}
 
-		if (!g_str_has_suffix(name, ".yaml")) {
-			g_free(s);
-			continue;
+		if (g_stat(job->path, &st) != 0) {
+			rpc_set_last_errorf(errno, "Cannot stat %s",
+			    job->path);
+			ret = -1;
+			goto done;
 		}
 
-		if (rpct_read_file(s) != 0) {
-			g_free(s);
-			continue;
+		if (rpc_serializer_dump("msgpack", job->body, &frame,
+		    &len) != 0) {
+			ret = -1;
+			goto done;
 		}
 
-		g_ptr_array_add(files, s);
+		u32 = GUINT32_TO_LE((uint32_t)strlen(job->path));
+		g_byte_array_append(out, (const guint8 *)&u32, sizeof(u32));
+		u32 = GUINT32_TO_LE((uint32_t)len);
+		g_byte_array_append(out, (const guint8 *)&u32, sizeof(u32));
+		i64 = GINT64_TO_LE((int64_t)st.st_mtime);
+		g_byte_array_append(out, (const guint8 *)&i64, sizeof(i64));
+		g_byte_array_append(out, (const guint8 *)job->path,
+		    (guint)strlen(job->path));
+		g_byte_array_append(out, frame, (guint)len);
+		g_free(frame);
+		nfiles++;
 	}
 
-	g_dir_close(dir);
+	u32 = GUINT32_TO_LE(nfiles);
+	memcpy(out->data + 12, &u32, sizeof(u32));
 
-	for (i = 0; i < files->len; i++) {
-		s = g_ptr_array_index(files, i);
-		rpct_load_types(s);
+	if (!g_file_set_contents(dbpath, (const gchar *)out->data,
+	    (gssize)out->len, &error)) {
+		rpc_set_last_gerror(error);
+		g_error_free(error);
+		ret = -1;
 	}
 
-	g_ptr_array_free(files, true);
-	return (0);
+done:
+	g_byte_array_free(out, true);
+	rpct_parse_jobs_free(jobs);
+	return (ret);
+}
+
+int
+rpct_load_types_db(const char *dbpath)
+{
+	GMappedFile *file;
+	GError *err = NULL;
+	int ret;
+
+	file = g_mapped_file_new(dbpath, false, &err);
+	if (file == NULL) {
+		rpc_set_last_gerror(err);
+		g_error_free(err);
+		return (-1);
+	}
+
+	ret = rpct_read_db((const uint8_t *)g_mapped_file_get_contents(file),
+	    g_mapped_file_get_length(file), true);
+
+	g_mapped_file_unref(file);
+	return (ret);
 }
 
 int
 rpct_load_types_stream(int fd)
 {
+	GByteArray *buf;
+	uint8_t chunk[4096];
+	ssize_t ret;
+	int result;
 
-	rpc_set_last_errorf(ENOTSUP, "Not implemented");
-	return (-1);
+	buf = g_byte_array_new();
+
+	for (;;) {
+		ret = read(fd, chunk, sizeof(chunk));
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0) {
+			rpc_set_last_errorf(errno, "Cannot read stream: %s",
+			    g_strerror(errno));
+			g_byte_array_free(buf, true);
+			close(fd);
+			return (-1);
+		}
+
+		if (ret == 0)
+			break;
+
+		g_byte_array_append(buf, chunk, (guint)ret);
+	}
+
+	close(fd);
+
+	/* Paths in a stream need not exist on this machine */
+	result = rpct_read_db(buf->data, buf->len, false);
+	g_byte_array_free(buf, true);
+	return (result);
 }
 
 int
 rpct_load_types_cached(void)
 {
 	GHashTableIter iter;
+	struct rpct_snapshot *snap;
 	struct rpct_file *file;
+	int ret = 0;
 
-	g_hash_table_iter_init(&iter, context->files);
+	rpct_load_begin();
+	snap = rpct_snapshot_acquire();
+	g_hash_table_iter_init(&iter, snap->files);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&file)) {
 		if (file->loaded)
 			continue;
 
-		if (rpct_load_types(file->path) != 0)
-			return (-1);
+		if (rpct_load_types(file->path) != 0) {
+			ret = -1;
+			break;
+		}
 	}
 
-	return (0);
+	rpct_snapshot_release(snap);
+	rpct_load_end();
+	return (ret);
 }
 
 const char *
@@ -2059,17 +3519,152 @@ bool
 rpct_types_apply(rpct_type_applier_t applier)
 {
 	GHashTableIter iter;
+	struct rpct_snapshot *snap;
 	char *key;
 	rpct_type_t value;
+	bool ret = true;
 
-	g_hash_table_iter_init(&iter, context->types);
+	rpct_load_pending(NULL);
+	snap = rpct_snapshot_acquire();
+	g_hash_table_iter_init(&iter, snap->types);
 	while (g_hash_table_iter_next(&iter, (gpointer *)&key,
 	    (gpointer *)&value)) {
-		if (!applier(value))
-			return (false);
+		if (!applier(value)) {
+			ret = false;
+			break;
+		}
 	}
 
-	return (true);
+	rpct_snapshot_release(snap);
+	return (ret);
+}
+
+static int
+rpct_layout_cmp(const void *a, const void *b)
+{
+
+	return (strcmp(*(const char **)a, *(const char **)b));
+}
+
+/*
+ * Members go in name order, which doesn't depend on hash table layout
+ * and so comes out the same on every peer loading the same IDL. The
+ * layout is built on first use and lives as long as the type.
+ */
+const struct rpct_layout *
+rpct_type_get_layout(struct rpct_type *type)
+{
+	struct rpct_layout *layout;
+	struct rpct_member *member;
+	GHashTableIter iter;
+	const char *type_name;
+	uint32_t hash = 2166136261u;
+	const char *p;
+	guint count;
+	guint i;
+
+	layout = g_atomic_pointer_get(&type->layout);
+	if (layout != NULL)
+		return (layout);
+
+	count = g_hash_table_size(type->members);
+	layout = g_malloc(sizeof(*layout) + count * sizeof(const char *));
+	layout->rl_count = 0;
+
+	g_hash_table_iter_init(&iter, type->members);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&member))
+		layout->rl_names[layout->rl_count++] = member->name;
+
+	qsort(layout->rl_names, count, sizeof(const char *), rpct_layout_cmp);
+
+	/* FNV-1a over the member names and types, NUL separated */
+	for (i = 0; i < count; i++) {
+		member = g_hash_table_lookup(type->members,
+		    layout->rl_names[i]);
+		type_name = member->type != NULL &&
+		    member->type->canonical_form != NULL ?
+		    member->type->canonical_form : "";
+
+		for (p = member->name; ; p++) {
+			hash = (hash ^ (uint8_t)*p) * 16777619u;
+			if (*p == '\0')
+				break;
+		}
+
+		for (p = type_name; ; p++) {
+			hash = (hash ^ (uint8_t)*p) * 16777619u;
+			if (*p == '\0')
+				break;
+		}
+	}
+
+	layout->rl_fingerprint = hash;
+
+	if (!g_atomic_pointer_compare_and_exchange(&type->layout, NULL,
+	    layout)) {
+		g_free(layout);
+		layout = g_atomic_pointer_get(&type->layout);
+	}
+
+	return (layout);
+}
+
+int
+rpct_struct_index(rpct_type_t type, const char *name)
+{
+	const struct rpct_layout *layout;
+	guint i;
+
+	if (type->clazz != RPC_TYPING_STRUCT)
+		return (-1);
+
+	layout = rpct_type_get_layout(type);
+	for (i = 0; i < layout->rl_count; i++) {
+		if (g_strcmp0(layout->rl_names[i], name) == 0)
+			return ((int)i);
+	}
+
+	return (-1);
+}
+
+rpc_object_t
+rpct_struct_get(rpc_object_t instance, size_t index)
+{
+	const struct rpct_layout *layout;
+
+	if (instance == NULL || instance->ro_typei == NULL ||
+	    instance->ro_type != RPC_TYPE_DICTIONARY ||
+	    instance->ro_typei->type->clazz != RPC_TYPING_STRUCT)
+		return (NULL);
+
+	layout = rpct_type_get_layout(instance->ro_typei->type);
+	if (index >= layout->rl_count)
+		return (NULL);
+
+	return (rpc_dict_lookup_slot(instance->ro_value.rv_dict, layout,
+	    (guint)index));
+}
+
+int
+rpct_struct_set(rpc_object_t instance, size_t index, rpc_object_t value)
+{
+	const struct rpct_layout *layout;
+
+	if (instance == NULL || instance->ro_typei == NULL ||
+	    instance->ro_type != RPC_TYPE_DICTIONARY ||
+	    instance->ro_typei->type->clazz != RPC_TYPING_STRUCT) {
+		rpc_set_last_errorf(EINVAL, "Not a struct instance");
+		return (-1);
+	}
+
+	layout = rpct_type_get_layout(instance->ro_typei->type);
+	if (index >= layout->rl_count) {
+		rpc_set_last_errorf(ERANGE, "Member index out of range");
+		return (-1);
+	}
+
+	rpc_dictionary_set_value(instance, layout->rl_names[index], value);
+	return (0);
 }
 
 bool
@@ -2095,11 +3690,14 @@ bool
 rpct_interface_apply(rpct_interface_applier_t applier)
 {
 	GHashTableIter iter;
+	struct rpct_snapshot *snap;
 	char *key;
 	struct rpct_interface *value;
 	bool flag = false;
 
-	g_hash_table_iter_init(&iter, context->interfaces);
+	rpct_load_pending(NULL);
+	snap = rpct_snapshot_acquire();
+	g_hash_table_iter_init(&iter, snap->interfaces);
 	while (g_hash_table_iter_next(&iter, (gpointer *)&key,
 	    (gpointer *)&value)) {
 		if (!applier(value)) {
@@ -2108,6 +3706,7 @@ rpct_interface_apply(rpct_interface_applier_t applier)
 		}
 	}
 
+	rpct_snapshot_release(snap);
 	return (flag);
 }
 
@@ -2135,7 +3734,10 @@ rpct_find_interface(const char *name)
 {
 	struct rpct_interface *iface;
 
-	iface = g_hash_table_lookup(context->interfaces, name);
+	iface = rpct_snapshot_lookup(RPCT_INTERFACES, name);
+	if (iface == NULL && rpct_load_pending(name) > 0)
+		iface = rpct_snapshot_lookup(RPCT_INTERFACES, name);
+
 	if (iface == NULL) {
 		rpc_set_last_errorf(ENOENT, "Interface not found");
 		return (NULL);
@@ -2167,8 +3769,12 @@ rpc_object_t
 rpct_serialize(rpc_object_t object)
 {
 	const struct rpct_class_handler *handler;
+	struct rpc_dictionary_iter diter;
+	struct rpc_array_iter aiter;
 	rpct_class_t clazz;
 	rpc_object_t cont;
+	const char *key;
+	rpc_object_t v;
 
 	if (context == NULL)
 		return (rpc_retain(object));
@@ -2179,22 +3785,21 @@ rpct_serialize(rpc_object_t object)
 		if (rpc_get_type(object) == RPC_TYPE_DICTIONARY) {
 			cont = rpc_dictionary_create();
 			cont->ro_typei = rpct_new_typei("dictionary");
-			rpc_dictionary_apply(object,
-			    ^(const char *key, rpc_object_t v) {
+			rpc_dictionary_iter_init(object, &diter);
+			while (rpc_dictionary_iter_next(&diter, &key, &v)) {
 				rpc_dictionary_steal_value(cont, key,
 				    rpct_serialize(v));
-				return ((bool)true);
-			});
+			}
 
 			return (cont);
 		} else if (rpc_get_type(object) == RPC_TYPE_ARRAY) {
 			cont = rpc_array_create();
 			cont->ro_typei = rpct_new_typei("array");
-			rpc_array_apply(object, ^(size_t idx, rpc_object_t v) {
+			rpc_array_iter_init(object, &aiter);
+			while (rpc_array_iter_next(&aiter, NULL, &v)) {
 				rpc_array_append_stolen_value(cont,
 				    rpct_serialize(v));
-				return ((bool)true);
-			});
+			}
 
 			return (cont);
 		} else {
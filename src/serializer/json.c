@@ -36,51 +36,102 @@
 #include "../internal.h"
 #include "json.h"
 
+#if defined(JSON_SIMD_SUPPORT)
+typedef rpc_json_gen_t json_gen_t;
+typedef int json_gen_status_t;
+
+#define	JSON_GEN_OK		0
+#define	json_gen_alloc		rpc_json_gen_alloc
+#define	json_gen_free		rpc_json_gen_free
+#define	json_gen_null		rpc_json_gen_null
+#define	json_gen_bool		rpc_json_gen_bool
+#define	json_gen_integer	rpc_json_gen_integer
+#define	json_gen_double		rpc_json_gen_double
+#define	json_gen_string		rpc_json_gen_string
+#define	json_gen_map_open	rpc_json_gen_map_open
+#define	json_gen_map_close	rpc_json_gen_map_close
+#define	json_gen_array_open	rpc_json_gen_array_open
+#define	json_gen_array_close	rpc_json_gen_array_close
+#else
+typedef yajl_gen json_gen_t;
+typedef yajl_gen_status json_gen_status_t;
+
+#define	JSON_GEN_OK		yajl_gen_status_ok
+#define	json_gen_free		yajl_gen_free
+#define	json_gen_null		yajl_gen_null
+#define	json_gen_bool		yajl_gen_bool
+#define	json_gen_integer	yajl_gen_integer
+#define	json_gen_double		yajl_gen_double
+#define	json_gen_string		yajl_gen_string
+#define	json_gen_map_open	yajl_gen_map_open
+#define	json_gen_map_close	yajl_gen_map_close
+#define	json_gen_array_open	yajl_gen_array_open
+#define	json_gen_array_close	yajl_gen_array_close
+
+static json_gen_t
+json_gen_alloc(rpc_json_print_t print, void *arg)
+{
+	yajl_gen gen = yajl_gen_alloc(NULL);
+
+	yajl_gen_config(gen, yajl_gen_print_callback, print, arg);
+	return (gen);
+}
+#endif
+
+struct rpc_json_output
+{
+	GString *	rjo_buf;
+	int		rjo_fd;
+	int		rjo_error;
+};
+
 struct parse_context
 {
 	rpc_object_t result;
 	GQueue *leaf_stack;
-	char *key_buf;
+	GString *key_buf;
+	bool has_key;
 };
 
-static yajl_gen_status rpc_json_write_object(yajl_gen gen, rpc_object_t object);
+static json_gen_status_t rpc_json_write_object(json_gen_t gen,
+    rpc_object_t object);
 
-static inline yajl_gen_status
-rpc_json_write_ext_long(yajl_gen gen, const unsigned char *key, long value)
+static inline json_gen_status_t
+rpc_json_write_ext_long(json_gen_t gen, const unsigned char *key, long value)
 {
-	yajl_gen_status status;
+	json_gen_status_t status;
 
-	status = yajl_gen_string(gen, key, strlen((const char *)key));
-	if (status != yajl_gen_status_ok)
+	status = json_gen_string(gen, key, strlen((const char *)key));
+	if (status != JSON_GEN_OK)
 		return (status);
 
-	status = yajl_gen_integer(gen, value);
+	status = json_gen_integer(gen, value);
 	return (status);
 }
 
-static inline yajl_gen_status
-rpc_json_write_ext_str(yajl_gen gen, const unsigned char *key,
+static inline json_gen_status_t
+rpc_json_write_ext_str(json_gen_t gen, const unsigned char *key,
     const char *value)
 {
-	yajl_gen_status status;
+	json_gen_status_t status;
 
-	status = yajl_gen_string(gen, key, strlen((const char *)key));
-	if (status != yajl_gen_status_ok)
+	status = json_gen_string(gen, key, strlen((const char *)key));
+	if (status != JSON_GEN_OK)
 		return (status);
 
-	status = yajl_gen_string(gen, (const unsigned char *)value,
+	status = json_gen_string(gen, (const unsigned char *)value,
 	    strlen(value));
 	return (status);
 }
 
-static inline yajl_gen_status
-rpc_json_write_ext_obj(yajl_gen gen, const unsigned char *key,
+static inline json_gen_status_t
+rpc_json_write_ext_obj(json_gen_t gen, const unsigned char *key,
     rpc_object_t value)
 {
-	yajl_gen_status status;
+	json_gen_status_t status;
 
-	status = yajl_gen_string(gen, key, strlen((const char *)key));
-	if (status != yajl_gen_status_ok)
+	status = json_gen_string(gen, key, strlen((const char *)key));
+	if (status != JSON_GEN_OK)
 		return (status);
 
 	status = rpc_json_write_object(gen, value);
@@ -113,19 +164,18 @@ rpc_json_context_insert_value(void *ctx_ptr, rpc_object_t value)
 
 	switch (leaf->ro_type) {
 	case RPC_TYPE_ARRAY:
-		if (ctx->key_buf != NULL)
+		if (ctx->has_key)
 			return (0);
 
 		rpc_array_append_stolen_value(leaf, value);
 		break;
 
 	case RPC_TYPE_DICTIONARY:
-		if (ctx->key_buf == NULL)
+		if (!ctx->has_key)
 			return (0);
 
-		rpc_dictionary_steal_value(leaf, ctx->key_buf, value);
-		g_free(ctx->key_buf);
-		ctx->key_buf = NULL;
+		rpc_dictionary_steal_value(leaf, ctx->key_buf->str, value);
+		ctx->has_key = false;
 		break;
 
 	default:
@@ -154,8 +204,9 @@ rpc_json_try_unpack_ext(void *ctx_ptr, rpc_object_t leaf)
 	void *data_buf;
 	size_t data_len;
 	const char *base64_data;
-	GHashTableIter iter;
-	gpointer key, value;
+	struct rpc_dict_iter iter;
+	const char *key;
+	rpc_object_t value;
 	int err_code;
 	const char *err_msg;
 	const char *dbl_type;
@@ -249,12 +300,11 @@ rpc_json_try_unpack_ext(void *ctx_ptr, rpc_object_t leaf)
 		rpc_release(leaf);
 
 	} else if (branch->ro_type == RPC_TYPE_DICTIONARY) {
-		g_hash_table_iter_init(&iter, branch->ro_value.rv_dict);
+		rpc_dict_iter_init(&iter, branch->ro_value.rv_dict);
 
-		while (g_hash_table_iter_next(&iter, &key, &value)) {
+		while (rpc_dict_iter_next(&iter, &key, &value)) {
 			if (value == leaf) {
-				g_hash_table_iter_replace(&iter,
-				    unpacked_value);
+				rpc_dict_iter_replace(&iter, unpacked_value);
 				break;
 			}
 		}
@@ -308,16 +358,19 @@ static int
 rpc_json_map_key(void *ctx_ptr, const unsigned char *key, size_t key_len)
 {
 	struct parse_context *ctx = ctx_ptr;
-	GString *key_copy;
 
-	if (ctx->key_buf != NULL)
+	if (ctx->has_key)
 		return (0);
 
-	if (key[0] == '\\')
-		key += sizeof(char);
+	if (key_len > 0 && key[0] == '\\') {
+		key++;
+		key_len--;
+	}
 
-	key_copy = g_string_new_len((const char *)key, key_len);
-	ctx->key_buf = g_string_free(key_copy, false);
+	/* The key buffer is reused for every key of the document */
+	g_string_truncate(ctx->key_buf, 0);
+	g_string_append_len(ctx->key_buf, (const char *)key, key_len);
+	ctx->has_key = true;
 	return 1;
 }
 
@@ -344,7 +397,7 @@ rpc_json_end_map(void *ctx_ptr)
 	if (leaf->ro_type != RPC_TYPE_DICTIONARY)
 		return (0);
 
-	if (ctx->key_buf != NULL)
+	if (ctx->has_key)
 		return (0);
 
 	leaf_size = rpc_dictionary_get_count(leaf);
@@ -373,7 +426,7 @@ rpc_json_end_array(void *ctx_ptr)
 	if (leaf->ro_type != RPC_TYPE_ARRAY)
 		return (0);
 
-	if (ctx->key_buf != NULL)
+	if (ctx->has_key)
 		return (0);
 
 	return (1);
@@ -393,48 +446,63 @@ static yajl_callbacks callbacks = {
     rpc_json_end_array
 };
 
-static yajl_gen_status
-rpc_json_write_object_ext(yajl_gen gen, rpc_object_t object,
+#if defined(JSON_SIMD_SUPPORT)
+static const struct rpc_json_handlers handlers = {
+	.rjh_null = rpc_json_parse_null,
+	.rjh_boolean = rpc_json_parse_boolean,
+	.rjh_integer = rpc_json_parse_integer,
+	.rjh_double = rpc_json_parse_double,
+	.rjh_string = rpc_json_parse_string,
+	.rjh_start_map = rpc_json_start_map,
+	.rjh_map_key = rpc_json_map_key,
+	.rjh_end_map = rpc_json_end_map,
+	.rjh_start_array = rpc_json_start_array,
+	.rjh_end_array = rpc_json_end_array
+};
+#endif
+
+static json_gen_status_t
+rpc_json_write_object_ext(json_gen_t gen, rpc_object_t object,
     const uint8_t *type, size_t type_size)
 {
-	yajl_gen_status status;
+	json_gen_status_t status;
 	const void *data_buf;
 	char *base64_data;
 	double d_value;
 
-	if ((status = yajl_gen_map_open(gen)) != yajl_gen_status_ok)
+	if ((status = json_gen_map_open(gen)) != JSON_GEN_OK)
 		return (status);
 
-	status = yajl_gen_string(gen, type, type_size);
-	if (status != yajl_gen_status_ok)
+	status = json_gen_string(gen, type, type_size);
+	if (status != JSON_GEN_OK)
 		return (status);
 
 	switch (object->ro_type) {
 	case RPC_TYPE_UINT64:
-		status = yajl_gen_integer(gen,
+		status = json_gen_integer(gen,
 		    (long long)rpc_uint64_get_value(object));
 		break;
 
 	case RPC_TYPE_DATE:
-		status = yajl_gen_integer(gen, rpc_date_get_value(object));
+		status = json_gen_integer(gen, rpc_date_get_value(object));
 		break;
 
 	case RPC_TYPE_FD:
-		status = yajl_gen_integer(gen, rpc_fd_get_value(object));
+		status = json_gen_integer(gen, rpc_fd_get_value(object));
 		break;
 
 	case RPC_TYPE_DOUBLE:
 		d_value = rpc_double_get_value(object);
 		if (d_value == INFINITY)
-			status = yajl_gen_string(gen,
+			status = json_gen_string(gen,
 			    (const uint8_t *)JSON_EXTTYPE_DBL_INF,
 			    strlen(JSON_EXTTYPE_DBL_INF));
 		else if (d_value == -INFINITY)
-			status = yajl_gen_string(gen,
+			status = json_gen_string(gen,
 			    (const uint8_t *)JSON_EXTTYPE_DBL_NINF,
 			    strlen(JSON_EXTTYPE_DBL_NINF));
 		else
-			status = yajl_gen_string(gen,
+			status = json_gen_string(gen,
 			    (const uint8_t *)JSON_EXTTYPE_DBL_NAN,
 			    strlen(JSON_EXTTYPE_DBL_NAN));
 
@@ -449,32 +517,32 @@ rpc_json_write_object_ext(yajl_gen gen, rpc_object_t object,
 			    object->ro_value.rv_bin.rbv_length);
 		}
 
-		status = yajl_gen_string(gen, (const uint8_t *)base64_data,
+		status = json_gen_string(gen, (const uint8_t *)base64_data,
 		    strlen(base64_data));
 		g_free(base64_data);
 		break;
 
 	case RPC_TYPE_ERROR:
-		if ((status = yajl_gen_map_open(gen)) != yajl_gen_status_ok)
+		if ((status = json_gen_map_open(gen)) != JSON_GEN_OK)
 			return (status);
 
 		status = rpc_json_write_ext(gen,
 		    (const uint8_t *)JSON_EXTTYPE_ERROR_CODE,
 		    (int64_t)rpc_error_get_code(object));
-		if (status != yajl_gen_status_ok)
+		if (status != JSON_GEN_OK)
 			return (status);
 
 		status = rpc_json_write_ext(gen,
 		    (const uint8_t *)JSON_EXTTYPE_ERROR_MSG,
 		    rpc_error_get_message(object));
-		if (status != yajl_gen_status_ok)
+		if (status != JSON_GEN_OK)
 			return (status);
 
 		if (rpc_error_get_extra(object) != NULL) {
 			status = rpc_json_write_ext(gen,
 			    (const uint8_t *) JSON_EXTTYPE_ERROR_XTRA,
 			    rpc_error_get_extra(object));
-			if (status != yajl_gen_status_ok)
+			if (status != JSON_GEN_OK)
 				return (status);
 		}
 
@@ -482,37 +550,37 @@ rpc_json_write_object_ext(yajl_gen gen, rpc_object_t object,
 			status = rpc_json_write_ext(gen,
 			    (const uint8_t *) JSON_EXTTYPE_ERROR_STCK,
 			    rpc_error_get_stack(object));
-			if (status != yajl_gen_status_ok)
+			if (status != JSON_GEN_OK)
 				return (status);
 		}
 
-		status = yajl_gen_map_close(gen);
+		status = json_gen_map_close(gen);
 		break;
 
 #if defined(__linux__)
 	case RPC_TYPE_SHMEM:
-		if ((status = yajl_gen_map_open(gen)) != yajl_gen_status_ok)
+		if ((status = json_gen_map_open(gen)) != JSON_GEN_OK)
 			return (status);
 
 		status = rpc_json_write_ext(gen,
 		    (const uint8_t *)JSON_EXTTYPE_SHMEM_ADDR,
 		    (int64_t)rpc_shmem_get_offset(object));
-		if (status != yajl_gen_status_ok)
+		if (status != JSON_GEN_OK)
 			return (status);
 
 		status = rpc_json_write_ext(gen,
 		    (const uint8_t *)JSON_EXTTYPE_SHMEM_LEN,
 		    (int64_t)rpc_shmem_get_size(object));
-		if (status != yajl_gen_status_ok)
+		if (status != JSON_GEN_OK)
 			return (status);
 
 		status = rpc_json_write_ext(gen,
 		    (const uint8_t *)JSON_EXTTYPE_SHMEM_FD,
 		    (int64_t)rpc_shmem_get_fd(object));
-		if (status != yajl_gen_status_ok)
+		if (status != JSON_GEN_OK)
 			return (status);
 
-		status = yajl_gen_map_close(gen);
+		status = json_gen_map_close(gen);
 		break;
 #endif
 
@@ -521,27 +589,27 @@ rpc_json_write_object_ext(yajl_gen gen, rpc_object_t object,
 
 	}
 
-	if (status != yajl_gen_status_ok)
+	if (status != JSON_GEN_OK)
 		return (status);
 
-	return (yajl_gen_map_close(gen));
+	return (json_gen_map_close(gen));
 }
 
-static yajl_gen_status
-rpc_json_write_object(yajl_gen gen, rpc_object_t object)
+static json_gen_status_t
+rpc_json_write_object(json_gen_t gen, rpc_object_t object)
 {
-	__block yajl_gen_status status;
+	__block json_gen_status_t status;
 	double value;
 
 	switch (object->ro_type) {
 	case RPC_TYPE_NULL:
-		return (yajl_gen_null(gen));
+		return (json_gen_null(gen));
 
 	case RPC_TYPE_BOOL:
-		return (yajl_gen_bool(gen, rpc_bool_get_value(object)));
+		return (json_gen_bool(gen, rpc_bool_get_value(object)));
 
 	case RPC_TYPE_INT64:
-		return (yajl_gen_integer(gen, rpc_int64_get_value(object)));
+		return (json_gen_integer(gen, rpc_int64_get_value(object)));
 
 	case RPC_TYPE_UINT64:
 		return (rpc_json_write_object_ext(gen, object,
@@ -583,121 +651,194 @@ rpc_json_write_object(yajl_gen gen, rpc_object_t object)
 			    strlen(JSON_EXTTYPE_DBL)));
 		}
 
-		return (yajl_gen_double(gen, value));
+		return (json_gen_double(gen, value));
 
 	case RPC_TYPE_STRING:
-		return (yajl_gen_string(gen,
+		return (json_gen_string(gen,
 		    (const uint8_t *)rpc_string_get_string_ptr(object),
 		    rpc_string_get_length(object)));
 
 	case RPC_TYPE_DICTIONARY:
-		status = yajl_gen_map_open(gen);
-		if (status != yajl_gen_status_ok)
+		status = json_gen_map_open(gen);
+		if (status != JSON_GEN_OK)
 			return (status);
 
-		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
+		rpc_dictionary_walk(object, ^(const char *k, rpc_object_t v) {
 			char *esc_key;
 
 			if ((k[0] == '\\') || (k[0] == '$')) {
 				esc_key = g_strdup_printf("\\%s", k);
-				status = yajl_gen_string(gen,
+				status = json_gen_string(gen,
 				    (const uint8_t *) esc_key, strlen(esc_key));
 				g_free(esc_key);
 			} else {
-				status = yajl_gen_string(gen,
+				status = json_gen_string(gen,
 				    (const uint8_t *) k, strlen(k));
 			}
 
-			if (status != yajl_gen_status_ok)
+			if (status != JSON_GEN_OK)
 				return ((bool)false);
 
 			status = rpc_json_write_object(gen, v);
-			if (status != yajl_gen_status_ok)
+			if (status != JSON_GEN_OK)
 				return ((bool)false);
 
 			return ((bool)true);
 		});
-		if (status != yajl_gen_status_ok)
+		if (status != JSON_GEN_OK)
 			return (status);
 
-		return (yajl_gen_map_close(gen));
+		return (json_gen_map_close(gen));
 
 	case RPC_TYPE_ARRAY:
-		status = yajl_gen_array_open(gen);
-		if (status != yajl_gen_status_ok)
+		status = json_gen_array_open(gen);
+		if (status != JSON_GEN_OK)
 			return (status);
 
-		rpc_array_apply(object, ^(size_t idx __unused, rpc_object_t v) {
+		rpc_array_walk(object, ^(size_t idx __unused, rpc_object_t v) {
 			status = rpc_json_write_object(gen, v);
-			if (status != yajl_gen_status_ok)
+			if (status != JSON_GEN_OK)
 				return ((bool)false);
 
 			return ((bool)true);
 		});
-		if (status != yajl_gen_status_ok)
+		if (status != JSON_GEN_OK)
 			return (status);
 
-		return (yajl_gen_array_close(gen));
+		return (json_gen_array_close(gen));
 	}
 
-	return (yajl_gen_status_ok);
+	return (JSON_GEN_OK);
+}
+
+static void
+rpc_json_print_buf(void *ctx, const char *str, size_t len)
+{
+
+	g_string_append_len((GString *)ctx, str, (gssize)len);
 }
 
 int
 rpc_json_serialize(rpc_object_t obj, void **frame, size_t *size)
 {
-	yajl_gen gen = yajl_gen_alloc(NULL);
-	yajl_gen_status status;
+	json_gen_t gen;
+	json_gen_status_t status;
 	GString *out_buffer;
 
 	out_buffer = g_string_new(NULL);
-	yajl_gen_config(gen, yajl_gen_print_callback,
-	    (yajl_print_t)g_string_append_len, (void *)out_buffer);
+	gen = json_gen_alloc(rpc_json_print_buf, out_buffer);
 
-	if ((status = rpc_json_write_object(gen, obj)) != yajl_gen_status_ok)
+	if ((status = rpc_json_write_object(gen, obj)) != JSON_GEN_OK)
 		goto end;
 
 	*size = out_buffer->len;
 
-end:	yajl_gen_free(gen);
+end:	json_gen_free(gen);
 	*frame = g_string_free(out_buffer, false);
 	return (status);
 }
 
+static void
+rpc_json_print_fd(void *ctx, const char *str, size_t len)
+{
+	struct rpc_json_output *out = ctx;
+
+	if (out->rjo_error != 0)
+		return;
+
+	g_string_append_len(out->rjo_buf, str, len);
+	if (out->rjo_buf->len < RPC_SERIALIZER_CHUNK)
+		return;
+
+	out->rjo_error = rpc_serializer_write_all(out->rjo_fd,
+	    out->rjo_buf->str, out->rjo_buf->len);
+	g_string_truncate(out->rjo_buf, 0);
+}
+
+int
+rpc_json_serialize_fd(rpc_object_t obj, int fd)
+{
+	json_gen_t gen;
+	struct rpc_json_output out = {
+		.rjo_buf = g_string_sized_new(RPC_SERIALIZER_CHUNK),
+		.rjo_fd = fd,
+		.rjo_error = 0
+	};
+	int ret = -1;
+
+	gen = json_gen_alloc(rpc_json_print_fd, &out);
+
+	if (rpc_json_write_object(gen, obj) != JSON_GEN_OK) {
+		rpc_set_last_error(EINVAL, "JSON generation failed", NULL);
+		goto end;
+	}
+
+	if (out.rjo_error == 0) {
+		ret = rpc_serializer_write_all(fd, out.rjo_buf->str,
+		    out.rjo_buf->len);
+	}
+
+end:	json_gen_free(gen);
+	g_string_free(out.rjo_buf, true);
+	return (ret);
+}
+
+static int
+rpc_json_parse_yajl(const void *frame, size_t size, struct parse_context *ctx)
+{
+	yajl_handle handle;
+	int ret = -1;
+
+	handle = yajl_alloc(&callbacks, NULL, (void *)ctx);
+	if (yajl_parse(handle, (const guchar *)frame, size) != yajl_status_ok)
+		goto end;
+
+	if (yajl_complete_parse(handle) != yajl_status_ok)
+		goto end;
+
+	ret = 0;
+
+end:	yajl_free(handle);
+	return (ret);
+}
+
 rpc_object_t
 rpc_json_deserialize(const void *frame, size_t size)
 {
-	yajl_handle handle;
 	struct parse_context ctx;
+	int ret;
 
 	ctx.result = NULL;
 	ctx.leaf_stack = g_queue_new();
-	ctx.key_buf = NULL;
-
-	handle = yajl_alloc(&callbacks, NULL, (void *) &ctx);
-	if (yajl_parse(handle, (const guchar *)frame, size) != yajl_status_ok) {
-		rpc_release(ctx.result);
-		rpc_set_last_error(EINVAL, "Parse error", NULL);
-		goto end;
-	}
+	ctx.key_buf = g_string_sized_new(64);
+	ctx.has_key = false;
+
+#if defined(JSON_SIMD_SUPPORT)
+	/* Frames too big for 32-bit offsets go through yajl */
+	if (size <= RPC_JSON_SIMD_MAX)
+		ret = rpc_json_simd_parse(frame, size, &handlers, &ctx);
+	else
+		ret = rpc_json_parse_yajl(frame, size, &ctx);
+#else
+	ret = rpc_json_parse_yajl(frame, size, &ctx);
+#endif
 
-	if (yajl_complete_parse(handle) != yajl_status_ok) {
+	if (ret != 0) {
 		rpc_release(ctx.result);
+		ctx.result = NULL;
 		rpc_set_last_error(EINVAL, "Parse error", NULL);
-		goto end;
 	}
 
-end:
-	yajl_free(handle);
 	g_queue_free(ctx.leaf_stack);
-	g_free(ctx.key_buf);
+	g_string_free(ctx.key_buf, true);
 	return (ctx.result);
 }
 
 static struct rpc_serializer json_serializer = {
 	.name = "json",
 	.serialize = &rpc_json_serialize,
-	.deserialize = &rpc_json_deserialize
+	.deserialize = &rpc_json_deserialize,
+	.serialize_fd = &rpc_json_serialize_fd
 };
 
 DECLARE_SERIALIZER(json_serializer);
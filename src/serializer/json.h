@@ -56,7 +56,46 @@ extern "C" {
 #define JSON_EXTTYPE_SHMEM_FD	"fd"
 #endif
 
+typedef void (*rpc_json_print_t)(void *, const char *, size_t);
+
+#if defined(JSON_SIMD_SUPPORT)
+/* Stage one indexes the input with 32-bit offsets */
+#define	RPC_JSON_SIMD_MAX	((size_t)UINT32_MAX)
+
+struct rpc_json_handlers
+{
+	int (*rjh_null)(void *);
+	int (*rjh_boolean)(void *, int);
+	int (*rjh_integer)(void *, long long);
+	int (*rjh_double)(void *, double);
+	int (*rjh_string)(void *, const unsigned char *, size_t);
+	int (*rjh_start_map)(void *);
+	int (*rjh_map_key)(void *, const unsigned char *, size_t);
+	int (*rjh_end_map)(void *);
+	int (*rjh_start_array)(void *);
+	int (*rjh_end_array)(void *);
+};
+
+typedef struct rpc_json_gen *rpc_json_gen_t;
+
+int rpc_json_simd_parse(const void *, size_t, const struct rpc_json_handlers *,
+    void *);
+
+rpc_json_gen_t rpc_json_gen_alloc(rpc_json_print_t, void *);
+void rpc_json_gen_free(rpc_json_gen_t);
+int rpc_json_gen_null(rpc_json_gen_t);
+int rpc_json_gen_bool(rpc_json_gen_t, int);
+int rpc_json_gen_integer(rpc_json_gen_t, long long);
+int rpc_json_gen_double(rpc_json_gen_t, double);
+int rpc_json_gen_string(rpc_json_gen_t, const unsigned char *, size_t);
+int rpc_json_gen_map_open(rpc_json_gen_t);
+int rpc_json_gen_map_close(rpc_json_gen_t);
+int rpc_json_gen_array_open(rpc_json_gen_t);
+int rpc_json_gen_array_close(rpc_json_gen_t);
+#endif
+
 int rpc_json_serialize(rpc_object_t, void **, size_t *);
+int rpc_json_serialize_fd(rpc_object_t, int);
 rpc_object_t rpc_json_deserialize(const void *, size_t);
 
 #ifdef __cplusplus
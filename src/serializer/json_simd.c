@@ -0,0 +1,1306 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * SIMD backend of the JSON serializer.
+ *
+ * Parsing runs in two stages, the way simdjson does it. The first stage
+ * classifies the input 64 bytes at a time into bitmasks of quotes,
+ * backslashes, structural characters and whitespace, works out from
+ * those which bytes are inside strings, and records the offset of every
+ * structural character and of the first byte of every other value. The
+ * second stage walks those offsets and hands the values to the same
+ * callbacks the yajl parser drives, so both build the same trees.
+ *
+ * The generator writes straight into a buffer, looking for characters
+ * to escape 16 bytes at a time, and produces what yajl_gen does.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <rpc/object.h>
+#include "../internal.h"
+#include "json.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define	JSON_SIMD_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define	JSON_SIMD_NEON
+#endif
+
+#define	JSON_BLOCK		64
+#define	JSON_GEN_CHUNK		(64 * 1024)
+#define	JSON_EVEN_BITS		0x5555555555555555ULL
+
+/* Generator states, the ones of yajl_gen */
+#define	JSON_GEN_START		0
+#define	JSON_GEN_MAP_START	1
+#define	JSON_GEN_MAP_KEY	2
+#define	JSON_GEN_MAP_VAL	3
+#define	JSON_GEN_ARRAY_START	4
+#define	JSON_GEN_IN_ARRAY	5
+#define	JSON_GEN_COMPLETE	6
+
+/* Parser container stack */
+#define	JSON_IN_MAP		0
+#define	JSON_IN_ARRAY		1
+
+struct json_block
+{
+	uint64_t		jb_quote;
+	uint64_t		jb_backslash;
+	uint64_t		jb_op;
+	uint64_t		jb_ws;
+	uint64_t		jb_ctrl;
+	uint64_t		jb_high;
+};
+
+struct json_parser
+{
+	const uint8_t *		jp_buf;
+	size_t			jp_len;
+	uint32_t *		jp_idx;
+	size_t			jp_count;
+	size_t			jp_size;
+	const struct rpc_json_handlers *jp_handlers;
+	void *			jp_ctx;
+	GString *		jp_scratch;
+	uint8_t *		jp_stack;
+	size_t			jp_depth;
+	size_t			jp_stack_size;
+};
+
+struct rpc_json_gen
+{
+	GString *		rjg_buf;
+	rpc_json_print_t	rjg_print;
+	void *			rjg_arg;
+	uint8_t *		rjg_state;
+	size_t			rjg_depth;
+	size_t			rjg_size;
+};
+
+#if defined(JSON_SIMD_SSE2)
+static inline uint64_t
+json_movemask(__m128i v)
+{
+
+	return ((uint64_t)(uint16_t)_mm_movemask_epi8(v));
+}
+
+static void
+json_classify(const uint8_t *in, struct json_block *b)
+{
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+	__m128i v, folded;
+	int i;
+
+	memset(b, 0, sizeof(*b));
+	for (i = 0; i < JSON_BLOCK / 16; i++) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)
+		    (in + 16 * i));
+
+		/* '[' and ']' differ from '{' and '}' in bit 5 only */
+		folded = _mm_or_si128(v, lower);
+		b->jb_op |= json_movemask(_mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+		    _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8(','))))) << (16 * i);
+		b->jb_ws |= json_movemask(_mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))))) << (16 * i);
+		b->jb_quote |= json_movemask(_mm_cmpeq_epi8(v,
+		    _mm_set1_epi8('"'))) << (16 * i);
+		b->jb_backslash |= json_movemask(_mm_cmpeq_epi8(v,
+		    _mm_set1_epi8('\\'))) << (16 * i);
+		b->jb_ctrl |= json_movemask(_mm_cmpeq_epi8(
+		    _mm_max_epu8(v, ctrl), ctrl)) << (16 * i);
+		b->jb_high |= json_movemask(v) << (16 * i);
+	}
+}
+
+/*
+ * Returns the offset of the first byte of a string that needs escaping,
+ * or len if there's none.
+ */
+static size_t
+json_find_escape(const uint8_t *s, size_t len)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+	__m128i v;
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+		    _mm_cmpeq_epi8(v, backslash)),
+		    _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl)));
+		if (mask != 0)
+			return (i + (size_t)__builtin_ctz((unsigned)mask));
+	}
+
+	for (; i < len; i++) {
+		if (s[i] < 0x20 || s[i] == '"' || s[i] == '\\')
+			break;
+	}
+
+	return (i);
+}
+
+/*
+ * Returns the offset of the first quote or backslash, or len.
+ */
+static size_t
+json_find_quote(const uint8_t *s, size_t len)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	__m128i v;
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+		    _mm_cmpeq_epi8(v, backslash)));
+		if (mask != 0)
+			return (i + (size_t)__builtin_ctz((unsigned)mask));
+	}
+
+	for (; i < len; i++) {
+		if (s[i] == '"' || s[i] == '\\')
+			break;
+	}
+
+	return (i);
+}
+#elif defined(JSON_SIMD_NEON)
+static inline uint64_t
+json_movemask(uint8x16_t v)
+{
+	static const uint8_t bits[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+	};
+	uint8x16_t t = vandq_u8(v, vld1q_u8(bits));
+
+	return ((uint64_t)vaddv_u8(vget_low_u8(t)) |
+	    ((uint64_t)vaddv_u8(vget_high_u8(t)) << 8));
+}
+
+static void
+json_classify(const uint8_t *in, struct json_block *b)
+{
+	uint8x16_t v, folded;
+	int i;
+
+	memset(b, 0, sizeof(*b));
+	for (i = 0; i < JSON_BLOCK / 16; i++) {
+		v = vld1q_u8(in + 16 * i);
+
+		/* '[' and ']' differ from '{' and '}' in bit 5 only */
+		folded = vorrq_u8(v, vdupq_n_u8(0x20));
+		b->jb_op |= json_movemask(vorrq_u8(
+		    vorrq_u8(vceqq_u8(folded, vdupq_n_u8('{')),
+		    vceqq_u8(folded, vdupq_n_u8('}'))),
+		    vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+		    vceqq_u8(v, vdupq_n_u8(','))))) << (16 * i);
+		b->jb_ws |= json_movemask(vorrq_u8(
+		    vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+		    vceqq_u8(v, vdupq_n_u8('\t'))),
+		    vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+		    vceqq_u8(v, vdupq_n_u8('\r'))))) << (16 * i);
+		b->jb_quote |= json_movemask(vceqq_u8(v,
+		    vdupq_n_u8('"'))) << (16 * i);
+		b->jb_backslash |= json_movemask(vceqq_u8(v,
+		    vdupq_n_u8('\\'))) << (16 * i);
+		b->jb_ctrl |= json_movemask(vcleq_u8(v,
+		    vdupq_n_u8(0x1f))) << (16 * i);
+		b->jb_high |= json_movemask(vcgeq_u8(v,
+		    vdupq_n_u8(0x80))) << (16 * i);
+	}
+}
+
+static size_t
+json_find_escape(const uint8_t *s, size_t len)
+{
+	uint8x16_t v, hit;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8(s + i);
+		hit = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+		    vceqq_u8(v, vdupq_n_u8('\\'))),
+		    vcleq_u8(v, vdupq_n_u8(0x1f)));
+		if (vmaxvq_u8(hit) != 0) {
+			return (i +
+			    (size_t)__builtin_ctzll(json_movemask(hit)));
+		}
+	}
+
+	for (; i < len; i++) {
+		if (s[i] < 0x20 || s[i] == '"' || s[i] == '\\')
+			break;
+	}
+
+	return (i);
+}
+
+static size_t
+json_find_quote(const uint8_t *s, size_t len)
+{
+	uint8x16_t v, hit;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8(s + i);
+		hit = vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+		    vceqq_u8(v, vdupq_n_u8('\\')));
+		if (vmaxvq_u8(hit) != 0) {
+			return (i +
+			    (size_t)__builtin_ctzll(json_movemask(hit)));
+		}
+	}
+
+	for (; i < len; i++) {
+		if (s[i] == '"' || s[i] == '\\')
+			break;
+	}
+
+	return (i);
+}
+#else
+/*
+ * Portable fallback, for targets without SSE2 or NEON. Same masks, one
+ * byte at a time.
+ */
+static void
+json_classify(const uint8_t *in, struct json_block *b)
+{
+	uint64_t bit;
+	int i;
+
+	memset(b, 0, sizeof(*b));
+	for (i = 0; i < JSON_BLOCK; i++) {
+		bit = 1ULL << i;
+		switch (in[i]) {
+		case '{':
+		case '}':
+		case '[':
+		case ']':
+		case ':':
+		case ',':
+			b->jb_op |= bit;
+			break;
+
+		case ' ':
+			b->jb_ws |= bit;
+			break;
+
+		case '\t':
+		case '\n':
+		case '\r':
+			b->jb_ws |= bit;
+			b->jb_ctrl |= bit;
+			break;
+
+		case '"':
+			b->jb_quote |= bit;
+			break;
+
+		case '\\':
+			b->jb_backslash |= bit;
+			break;
+
+		default:
+			if (in[i] < 0x20)
+				b->jb_ctrl |= bit;
+			else if (in[i] >= 0x80)
+				b->jb_high |= bit;
+
+			break;
+		}
+	}
+}
+
+static size_t
+json_find_escape(const uint8_t *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] < 0x20 || s[i] == '"' || s[i] == '\\')
+			break;
+	}
+
+	return (i);
+}
+
+static size_t
+json_find_quote(const uint8_t *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] == '"' || s[i] == '\\')
+			break;
+	}
+
+	return (i);
+}
+#endif
+
+/*
+ * Finds the characters escaped by a backslash: the ones following an
+ * odd-length run of backslashes. A run may go on from the previous
+ * block, which is what prev_escaped carries over.
+ */
+static inline uint64_t
+json_find_escaped(uint64_t backslash, uint64_t *prev_escaped)
+{
+	uint64_t follows_escape;
+	uint64_t odd_starts;
+	uint64_t even_starts;
+
+	backslash &= ~*prev_escaped;
+	follows_escape = (backslash << 1) | *prev_escaped;
+	odd_starts = backslash & ~JSON_EVEN_BITS & ~follows_escape;
+	*prev_escaped = __builtin_add_overflow(odd_starts, backslash,
+	    &even_starts) ? 1 : 0;
+
+	return ((JSON_EVEN_BITS ^ (even_starts << 1)) & follows_escape);
+}
+
+static inline uint64_t
+json_prefix_xor(uint64_t x)
+{
+
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return (x);
+}
+
+/*
+ * Checks multi-byte sequences the way yajl does: a valid lead byte
+ * followed by the right number of continuation bytes.
+ */
+static bool
+json_utf8_valid(const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+	size_t n;
+	size_t j;
+
+	while (i < len) {
+		if (s[i] < 0x80) {
+			i++;
+			continue;
+		}
+
+		if ((s[i] >> 5) == 0x06)
+			n = 1;
+		else if ((s[i] >> 4) == 0x0e)
+			n = 2;
+		else if ((s[i] >> 3) == 0x1e)
+			n = 3;
+		else
+			return (false);
+
+		if (len - i <= n)
+			return (false);
+
+		for (j = 1; j <= n; j++) {
+			if ((s[i + j] >> 6) != 0x02)
+				return (false);
+		}
+
+		i += n + 1;
+	}
+
+	return (true);
+}
+
+/*
+ * Stage one: records the offset of every structural character and of
+ * the first byte of every string, number and literal outside strings.
+ */
+static int
+json_index(struct json_parser *p)
+{
+	struct json_block b;
+	uint8_t tail[JSON_BLOCK];
+	uint64_t prev_escaped = 0;
+	uint64_t prev_in_string = 0;
+	uint64_t prev_scalar = 0;
+	uint64_t errors = 0;
+	uint64_t high = 0;
+	uint64_t quote;
+	uint64_t in_string;
+	uint64_t scalar;
+	uint64_t nonquote;
+	uint64_t starts;
+	uint64_t bits;
+	size_t pos;
+
+	for (pos = 0; pos < p->jp_len; pos += JSON_BLOCK) {
+		if (p->jp_len - pos >= JSON_BLOCK)
+			json_classify(p->jp_buf + pos, &b);
+		else {
+			/* Pad the last block with whitespace */
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, p->jp_buf + pos, p->jp_len - pos);
+			json_classify(tail, &b);
+		}
+
+		quote = b.jb_quote & ~json_find_escaped(b.jb_backslash,
+		    &prev_escaped);
+		in_string = json_prefix_xor(quote) ^ prev_in_string;
+		prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+		/* Raw control characters aren't allowed in strings */
+		errors |= b.jb_ctrl & in_string & ~quote;
+		high |= b.jb_high;
+
+		scalar = ~(b.jb_op | b.jb_ws);
+		nonquote = scalar & ~quote;
+		starts = scalar & ~((nonquote << 1) | prev_scalar);
+		prev_scalar = nonquote >> 63;
+
+		/* Drop everything inside strings but the opening quotes */
+		bits = (b.jb_op | starts) & ~(in_string ^ quote);
+
+		if (p->jp_size - p->jp_count < JSON_BLOCK) {
+			p->jp_size = p->jp_size * 2 + JSON_BLOCK;
+			p->jp_idx = g_renew(uint32_t, p->jp_idx, p->jp_size);
+		}
+
+		while (bits != 0) {
+			p->jp_idx[p->jp_count++] =
+			    (uint32_t)(pos + (size_t)__builtin_ctzll(bits));
+			bits &= bits - 1;
+		}
+	}
+
+	if (errors != 0 || prev_in_string != 0)
+		return (-1);
+
+	if (high != 0 && !json_utf8_valid(p->jp_buf, p->jp_len))
+		return (-1);
+
+	return (0);
+}
+
+static inline bool
+json_is_delimiter(struct json_parser *p, size_t pos)
+{
+
+	if (pos >= p->jp_len)
+		return (true);
+
+	switch (p->jp_buf[pos]) {
+	case ' ':
+	case '\t':
+	case '\n':
+	case '\r':
+	case '{':
+	case '}':
+	case '[':
+	case ']':
+	case ':':
+	case ',':
+		return (true);
+
+	default:
+		return (false);
+	}
+}
+
+static int
+json_hex4(const uint8_t *s, size_t avail, uint32_t *value)
+{
+	uint32_t result = 0;
+	int i;
+
+	if (avail < 4)
+		return (-1);
+
+	for (i = 0; i < 4; i++) {
+		result <<= 4;
+		if (s[i] >= '0' && s[i] <= '9')
+			result |= (uint32_t)(s[i] - '0');
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			result |= (uint32_t)(s[i] - 'a' + 10);
+		else if (s[i] >= 'A' && s[i] <= 'F')
+			result |= (uint32_t)(s[i] - 'A' + 10);
+		else
+			return (-1);
+	}
+
+	*value = result;
+	return (0);
+}
+
+static void
+json_append_utf8(GString *out, uint32_t cp)
+{
+
+	if (cp < 0x80)
+		g_string_append_c(out, (char)cp);
+	else if (cp < 0x800) {
+		g_string_append_c(out, (char)(0xc0 | (cp >> 6)));
+		g_string_append_c(out, (char)(0x80 | (cp & 0x3f)));
+	} else if (cp < 0x10000) {
+		g_string_append_c(out, (char)(0xe0 | (cp >> 12)));
+		g_string_append_c(out, (char)(0x80 | ((cp >> 6) & 0x3f)));
+		g_string_append_c(out, (char)(0x80 | (cp & 0x3f)));
+	} else if (cp < 0x200000) {
+		g_string_append_c(out, (char)(0xf0 | (cp >> 18)));
+		g_string_append_c(out, (char)(0x80 | ((cp >> 12) & 0x3f)));
+		g_string_append_c(out, (char)(0x80 | ((cp >> 6) & 0x3f)));
+		g_string_append_c(out, (char)(0x80 | (cp & 0x3f)));
+	} else
+		g_string_append_c(out, '?');
+}
+
+/*
+ * Decodes the string starting with the quote at pos. Strings without
+ * escapes are passed on as they are in the input; the others are
+ * decoded into the scratch buffer.
+ */
+static int
+json_parse_string(struct json_parser *p, size_t pos, const uint8_t **str,
+    size_t *len)
+{
+	const uint8_t *buf = p->jp_buf;
+	size_t end = p->jp_len;
+	size_t start = pos + 1;
+	size_t i;
+	uint32_t cp;
+	uint32_t lo;
+
+	i = start + json_find_quote(buf + start, end - start);
+	if (i < end && buf[i] == '"') {
+		*str = buf + start;
+		*len = i - start;
+		return (0);
+	}
+
+	g_string_truncate(p->jp_scratch, 0);
+	for (;;) {
+		g_string_append_len(p->jp_scratch, (const char *)buf + start,
+		    (gssize)(i - start));
+		if (i >= end)
+			return (-1);
+
+		if (buf[i] == '"')
+			break;
+
+		/* A backslash; the first stage made sure the string ends */
+		if (i + 1 >= end)
+			return (-1);
+
+		switch (buf[i + 1]) {
+		case '"':
+		case '\\':
+		case '/':
+			g_string_append_c(p->jp_scratch, (char)buf[i + 1]);
+			i += 2;
+			break;
+
+		case 'b':
+			g_string_append_c(p->jp_scratch, '\b');
+			i += 2;
+			break;
+
+		case 'f':
+			g_string_append_c(p->jp_scratch, '\f');
+			i += 2;
+			break;
+
+		case 'n':
+			g_string_append_c(p->jp_scratch, '\n');
+			i += 2;
+			break;
+
+		case 'r':
+			g_string_append_c(p->jp_scratch, '\r');
+			i += 2;
+			break;
+
+		case 't':
+			g_string_append_c(p->jp_scratch, '\t');
+			i += 2;
+			break;
+
+		case 'u':
+			if (json_hex4(buf + i + 2, end - i - 2, &cp) != 0)
+				return (-1);
+
+			i += 6;
+			if ((cp & 0xfc00) == 0xd800) {
+				if (i + 1 >= end || buf[i] != '\\' ||
+				    buf[i + 1] != 'u') {
+					/* yajl gives up on lone surrogates */
+					g_string_append_c(p->jp_scratch, '?');
+					break;
+				}
+
+				if (json_hex4(buf + i + 2, end - i - 2,
+				    &lo) != 0)
+					return (-1);
+
+				cp = ((cp & 0x3f) << 10) |
+				    ((((cp >> 6) & 0x0f) + 1) << 16) |
+				    (lo & 0x3ff);
+				i += 6;
+			}
+
+			json_append_utf8(p->jp_scratch, cp);
+			break;
+
+		default:
+			return (-1);
+		}
+
+		start = i;
+		i = start + json_find_quote(buf + start, end - start);
+	}
+
+	*str = (const uint8_t *)p->jp_scratch->str;
+	*len = p->jp_scratch->len;
+	return (0);
+}
+
+/*
+ * Numbers follow the JSON grammar strictly. Ones without a fraction or
+ * an exponent are integers and have to fit an int64_t, like with yajl.
+ */
+static int
+json_parse_number(struct json_parser *p, size_t pos)
+{
+	const uint8_t *buf = p->jp_buf;
+	size_t len = p->jp_len;
+	size_t i = pos;
+	uint64_t value = 0;
+	bool negative = false;
+	bool integer = true;
+	char local[64];
+	char *copy;
+	double d;
+
+	if (buf[i] == '-') {
+		negative = true;
+		i++;
+	}
+
+	if (i >= len || !g_ascii_isdigit(buf[i]))
+		return (-1);
+
+	if (buf[i] == '0')
+		i++;
+	else {
+		while (i < len && g_ascii_isdigit(buf[i]))
+			i++;
+	}
+
+	if (i < len && buf[i] == '.') {
+		integer = false;
+		if (++i >= len || !g_ascii_isdigit(buf[i]))
+			return (-1);
+
+		while (i < len && g_ascii_isdigit(buf[i]))
+			i++;
+	}
+
+	if (i < len && (buf[i] == 'e' || buf[i] == 'E')) {
+		integer = false;
+		if (++i < len && (buf[i] == '+' || buf[i] == '-'))
+			i++;
+
+		if (i >= len || !g_ascii_isdigit(buf[i]))
+			return (-1);
+
+		while (i < len && g_ascii_isdigit(buf[i]))
+			i++;
+	}
+
+	if (!json_is_delimiter(p, i))
+		return (-1);
+
+	if (integer) {
+		for (pos += negative ? 1 : 0; pos < i; pos++) {
+			if (value > (uint64_t)(G_MAXINT64 / 10))
+				return (-1);
+
+			value = value * 10 + (uint64_t)(buf[pos] - '0');
+			if (value > (uint64_t)G_MAXINT64)
+				return (-1);
+		}
+
+		return (p->jp_handlers->rjh_integer(p->jp_ctx, negative ?
+		    -(long long)value : (long long)value) ? 0 : -1);
+	}
+
+	copy = i - pos < sizeof(local) ? local : g_malloc(i - pos + 1);
+	memcpy(copy, buf + pos, i - pos);
+	copy[i - pos] = '\0';
+	errno = 0;
+	d = g_ascii_strtod(copy, NULL);
+	if (copy != local)
+		g_free(copy);
+
+	if ((d == HUGE_VAL || d == -HUGE_VAL) && errno == ERANGE)
+		return (-1);
+
+	return (p->jp_handlers->rjh_double(p->jp_ctx, d) ? 0 : -1);
+}
+
+static int
+json_parse_literal(struct json_parser *p, size_t pos)
+{
+	const uint8_t *buf = p->jp_buf + pos;
+	size_t avail = p->jp_len - pos;
+
+	if (avail >= 4 && memcmp(buf, "null", 4) == 0 &&
+	    json_is_delimiter(p, pos + 4))
+		return (p->jp_handlers->rjh_null(p->jp_ctx) ? 0 : -1);
+
+	if (avail >= 4 && memcmp(buf, "true", 4) == 0 &&
+	    json_is_delimiter(p, pos + 4))
+		return (p->jp_handlers->rjh_boolean(p->jp_ctx, 1) ? 0 : -1);
+
+	if (avail >= 5 && memcmp(buf, "false", 5) == 0 &&
+	    json_is_delimiter(p, pos + 5))
+		return (p->jp_handlers->rjh_boolean(p->jp_ctx, 0) ? 0 : -1);
+
+	return (-1);
+}
+
+static void
+json_push(struct json_parser *p, uint8_t kind)
+{
+
+	if (p->jp_depth == p->jp_stack_size) {
+		p->jp_stack_size = p->jp_stack_size * 2 + 32;
+		p->jp_stack = g_realloc(p->jp_stack, p->jp_stack_size);
+	}
+
+	p->jp_stack[p->jp_depth++] = kind;
+}
+
+static inline uint8_t
+json_char(struct json_parser *p, size_t n)
+{
+
+	return (p->jp_buf[p->jp_idx[n]]);
+}
+
+/*
+ * Stage two: walks the structural offsets.
+ */
+static int
+json_walk(struct json_parser *p)
+{
+	const struct rpc_json_handlers *h = p->jp_handlers;
+	const uint8_t *str;
+	size_t len;
+	size_t pos;
+	size_t n = 0;
+
+value:
+	if (n >= p->jp_count)
+		return (-1);
+
+	pos = p->jp_idx[n++];
+	switch (p->jp_buf[pos]) {
+	case '{':
+		if (!h->rjh_start_map(p->jp_ctx))
+			return (-1);
+
+		if (n < p->jp_count && json_char(p, n) == '}') {
+			n++;
+			if (!h->rjh_end_map(p->jp_ctx))
+				return (-1);
+
+			goto next;
+		}
+
+		json_push(p, JSON_IN_MAP);
+		goto key;
+
+	case '[':
+		if (!h->rjh_start_array(p->jp_ctx))
+			return (-1);
+
+		if (n < p->jp_count && json_char(p, n) == ']') {
+			n++;
+			if (!h->rjh_end_array(p->jp_ctx))
+				return (-1);
+
+			goto next;
+		}
+
+		json_push(p, JSON_IN_ARRAY);
+		goto value;
+
+	case '"':
+		if (json_parse_string(p, pos, &str, &len) != 0)
+			return (-1);
+
+		if (!h->rjh_string(p->jp_ctx, str, len))
+			return (-1);
+
+		goto next;
+
+	case 't':
+	case 'f':
+	case 'n':
+		if (json_parse_literal(p, pos) != 0)
+			return (-1);
+
+		goto next;
+
+	case '-':
+	case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+		if (json_parse_number(p, pos) != 0)
+			return (-1);
+
+		goto next;
+
+	default:
+		return (-1);
+	}
+
+key:
+	if (n + 1 >= p->jp_count || json_char(p, n) != '"')
+		return (-1);
+
+	if (json_parse_string(p, p->jp_idx[n++], &str, &len) != 0)
+		return (-1);
+
+	if (!h->rjh_map_key(p->jp_ctx, str, len))
+		return (-1);
+
+	if (json_char(p, n++) != ':')
+		return (-1);
+
+	goto value;
+
+next:
+	if (p->jp_depth == 0)
+		return (n == p->jp_count ? 0 : -1);
+
+	if (n >= p->jp_count)
+		return (-1);
+
+	switch (json_char(p, n++)) {
+	case ',':
+		if (p->jp_stack[p->jp_depth - 1] == JSON_IN_MAP)
+			goto key;
+
+		goto value;
+
+	case '}':
+		if (p->jp_stack[--p->jp_depth] != JSON_IN_MAP)
+			return (-1);
+
+		if (!h->rjh_end_map(p->jp_ctx))
+			return (-1);
+
+		goto next;
+
+	case ']':
+		if (p->jp_stack[--p->jp_depth] != JSON_IN_ARRAY)
+			return (-1);
+
+		if (!h->rjh_end_array(p->jp_ctx))
+			return (-1);
+
+		goto next;
+
+	default:
+		return (-1);
+	}
+}
+
+int
+rpc_json_simd_parse(const void *buf, size_t len,
+    const struct rpc_json_handlers *handlers, void *ctx)
+{
+	struct json_parser p = {
+		.jp_buf = buf,
+		.jp_len = len,
+		.jp_handlers = handlers,
+		.jp_ctx = ctx
+	};
+	int ret;
+
+	if (len > RPC_JSON_SIMD_MAX) {
+		errno = E2BIG;
+		return (-1);
+	}
+
+	/* A guess good for most documents; json_index() grows it */
+	p.jp_size = len / 4 + JSON_BLOCK;
+	p.jp_idx = g_new(uint32_t, p.jp_size);
+	p.jp_scratch = g_string_sized_new(64);
+
+	ret = json_index(&p);
+	if (ret == 0)
+		ret = json_walk(&p);
+
+	g_free(p.jp_idx);
+	g_free(p.jp_stack);
+	g_string_free(p.jp_scratch, true);
+	return (ret);
+}
+
+static void
+json_gen_flush(rpc_json_gen_t gen)
+{
+
+	if (gen->rjg_buf->len == 0)
+		return;
+
+	gen->rjg_print(gen->rjg_arg, gen->rjg_buf->str, gen->rjg_buf->len);
+	g_string_truncate(gen->rjg_buf, 0);
+}
+
+/*
+ * Writes the separator a value needs where the generator is at, like
+ * yajl's INSERT_SEP. Map keys have to be strings.
+ */
+static int
+json_gen_begin(rpc_json_gen_t gen, bool string)
+{
+
+	switch (gen->rjg_state[gen->rjg_depth]) {
+	case JSON_GEN_COMPLETE:
+		return (-1);
+
+	case JSON_GEN_MAP_START:
+		if (!string)
+			return (-1);
+
+		break;
+
+	case JSON_GEN_MAP_KEY:
+		if (!string)
+			return (-1);
+
+		g_string_append_c(gen->rjg_buf, ',');
+		break;
+
+	case JSON_GEN_IN_ARRAY:
+		g_string_append_c(gen->rjg_buf, ',');
+		break;
+
+	case JSON_GEN_MAP_VAL:
+		g_string_append_c(gen->rjg_buf, ':');
+		break;
+
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+/*
+ * Moves on once a value is written, like yajl's APPENDED_ATOM.
+ */
+static void
+json_gen_end(rpc_json_gen_t gen)
+{
+	uint8_t *state = &gen->rjg_state[gen->rjg_depth];
+
+	switch (*state) {
+	case JSON_GEN_START:
+		*state = JSON_GEN_COMPLETE;
+		break;
+
+	case JSON_GEN_MAP_START:
+	case JSON_GEN_MAP_KEY:
+		*state = JSON_GEN_MAP_VAL;
+		break;
+
+	case JSON_GEN_ARRAY_START:
+		*state = JSON_GEN_IN_ARRAY;
+		break;
+
+	case JSON_GEN_MAP_VAL:
+		*state = JSON_GEN_MAP_KEY;
+		break;
+
+	default:
+		break;
+	}
+
+	if (*state == JSON_GEN_COMPLETE ||
+	    gen->rjg_buf->len >= JSON_GEN_CHUNK)
+		json_gen_flush(gen);
+}
+
+static int
+json_gen_open(rpc_json_gen_t gen, char c, uint8_t state)
+{
+
+	if (json_gen_begin(gen, false) != 0)
+		return (-1);
+
+	if (++gen->rjg_depth == gen->rjg_size) {
+		gen->rjg_size *= 2;
+		gen->rjg_state = g_realloc(gen->rjg_state, gen->rjg_size);
+	}
+
+	gen->rjg_state[gen->rjg_depth] = state;
+	g_string_append_c(gen->rjg_buf, c);
+	return (0);
+}
+
+static int
+json_gen_close(rpc_json_gen_t gen, char c)
+{
+	uint8_t state = gen->rjg_state[gen->rjg_depth];
+	bool map;
+
+	if (gen->rjg_depth == 0)
+		return (-1);
+
+	map = state == JSON_GEN_MAP_START || state == JSON_GEN_MAP_KEY;
+	if (map != (c == '}') || state == JSON_GEN_MAP_VAL)
+		return (-1);
+
+	gen->rjg_depth--;
+	g_string_append_c(gen->rjg_buf, c);
+	json_gen_end(gen);
+	return (0);
+}
+
+rpc_json_gen_t
+rpc_json_gen_alloc(rpc_json_print_t print, void *arg)
+{
+	rpc_json_gen_t gen;
+
+	gen = g_malloc0(sizeof(*gen));
+	gen->rjg_buf = g_string_sized_new(4096);
+	gen->rjg_print = print;
+	gen->rjg_arg = arg;
+	gen->rjg_size = 32;
+	gen->rjg_state = g_malloc0(gen->rjg_size);
+	gen->rjg_state[0] = JSON_GEN_START;
+	return (gen);
+}
+
+void
+rpc_json_gen_free(rpc_json_gen_t gen)
+{
+
+	json_gen_flush(gen);
+	g_string_free(gen->rjg_buf, true);
+	g_free(gen->rjg_state);
+	g_free(gen);
+}
+
+int
+rpc_json_gen_null(rpc_json_gen_t gen)
+{
+
+	if (json_gen_begin(gen, false) != 0)
+		return (-1);
+
+	g_string_append_len(gen->rjg_buf, "null", 4);
+	json_gen_end(gen);
+	return (0);
+}
+
+int
+rpc_json_gen_bool(rpc_json_gen_t gen, int value)
+{
+
+	if (json_gen_begin(gen, false) != 0)
+		return (-1);
+
+	if (value)
+		g_string_append_len(gen->rjg_buf, "true", 4);
+	else
+		g_string_append_len(gen->rjg_buf, "false", 5);
+
+	json_gen_end(gen);
+	return (0);
+}
+
+int
+rpc_json_gen_integer(rpc_json_gen_t gen, long long value)
+{
+	char digits[24];
+	char *p = digits + sizeof(digits);
+	unsigned long long magnitude;
+
+	if (json_gen_begin(gen, false) != 0)
+		return (-1);
+
+	magnitude = value < 0 ? 0ULL - (unsigned long long)value :
+	    (unsigned long long)value;
+	do {
+		*--p = (char)('0' + magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude != 0);
+
+	if (value < 0)
+		*--p = '-';
+
+	g_string_append_len(gen->rjg_buf, p, digits + sizeof(digits) - p);
+	json_gen_end(gen);
+	return (0);
+}
+
+int
+rpc_json_gen_double(rpc_json_gen_t gen, double value)
+{
+	char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	if (!isfinite(value))
+		return (-1);
+
+	if (json_gen_begin(gen, false) != 0)
+		return (-1);
+
+	/* Same formatting as yajl_gen_double() */
+	g_ascii_formatd(buf, sizeof(buf), "%.20g", value);
+	g_string_append(gen->rjg_buf, buf);
+	if (strspn(buf, "0123456789-") == strlen(buf))
+		g_string_append_len(gen->rjg_buf, ".0", 2);
+
+	json_gen_end(gen);
+	return (0);
+}
+
+int
+rpc_json_gen_string(rpc_json_gen_t gen, const unsigned char *str, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	GString *out = gen->rjg_buf;
+	size_t i = 0;
+	size_t run;
+
+	if (json_gen_begin(gen, true) != 0)
+		return (-1);
+
+	g_string_append_c(out, '"');
+	while (i < len) {
+		run = json_find_escape(str + i, len - i);
+		g_string_append_len(out, (const char *)str + i, (gssize)run);
+		i += run;
+		if (i == len)
+			break;
+
+		g_string_append_c(out, '\\');
+		switch (str[i]) {
+		case '"':
+		case '\\':
+			g_string_append_c(out, (char)str[i]);
+			break;
+
+		case '\b':
+			g_string_append_c(out, 'b');
+			break;
+
+		case '\f':
+			g_string_append_c(out, 'f');
+			break;
+
+		case '\n':
+			g_string_append_c(out, 'n');
+			break;
+
+		case '\r':
+			g_string_append_c(out, 'r');
+			break;
+
+		case '\t':
+			g_string_append_c(out, 't');
+			break;
+
+		default:
+			g_string_append_len(out, "u00", 3);
+			g_string_append_c(out, hex[str[i] >> 4]);
+			g_string_append_c(out, hex[str[i] & 0x0f]);
+			break;
+		}
+
+		i++;
+	}
+
+	g_string_append_c(out, '"');
+	json_gen_end(gen);
+	return (0);
+}
+
+int
+rpc_json_gen_map_open(rpc_json_gen_t gen)
+{
+
+	return (json_gen_open(gen, '{', JSON_GEN_MAP_START));
+}
+
+int
+rpc_json_gen_map_close(rpc_json_gen_t gen)
+{
+
+	return (json_gen_close(gen, '}'));
+}
+
+int
+rpc_json_gen_array_open(rpc_json_gen_t gen)
+{
+
+	return (json_gen_open(gen, '[', JSON_GEN_ARRAY_START));
+}
+
+int
+rpc_json_gen_array_close(rpc_json_gen_t gen)
+{
+
+	return (json_gen_close(gen, ']'));
+}
@@ -26,7 +26,10 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
 #include <rpc/object.h>
+#include <rpc/connection.h>
 #ifdef __APPLE__
 #include "../endian.h"
 #endif
@@ -35,21 +38,208 @@
 #include "../internal.h"
 #include "msgpack.h"
 
-static void rpc_msgpack_write_error(mpack_writer_t *, rpc_object_t);
-static rpc_object_t rpc_msgpack_read_error(mpack_tree_t *);
-static int rpc_msgpack_write_object(mpack_writer_t *, rpc_object_t);
+struct rpc_msgpack_writer
+{
+	mpack_writer_t *	rmw_writer;
+	bool			rmw_typed;
+	int *			rmw_fds;
+	size_t			rmw_nfds;
+	size_t			rmw_maxfds;
+	GArray *		rmw_segments;
+	bool			rmw_packed;
+	bool			rmw_positional;
+	bool			rmw_columnar;
+	bool			rmw_timestamps;
+	bool *			rmw_cacheable;
+	struct rpc_msgpack_types *rmw_types;
+	struct rpc_shmem_link *	rmw_shm;
+	bool			rmw_parallel;
+};
+
+#define	RPC_MSGPACK_CACHE_TYPED		0x1
+#define	RPC_MSGPACK_CACHE_PACKED	0x2
+#define	RPC_MSGPACK_CACHE_POSITIONAL	0x4
+#define	RPC_MSGPACK_CACHE_COLUMNAR	0x8
+#define	RPC_MSGPACK_CACHE_TIMESTAMPS	0x10
+
+#define	RPC_MSGPACK_COLUMNAR_MIN	4
+
+#define	RPC_MSGPACK_TYPES_MAX		4096
+#define	RPC_MSGPACK_NODE_POOL		4096
+
+/*
+ * Node storage for trees that don't outlive the decode call. Frames of
+ * up to RPC_MSGPACK_NODE_POOL bytes always fit, since every node takes
+ * up at least one byte.
+ */
+static GPrivate rpc_msgpack_node_pool = G_PRIVATE_INIT(g_free);
+
+/*
+ * Arrays and dictionaries of at least RPC_MSGPACK_PARALLEL_MIN elements
+ * are encoded in chunks, which the writing thread and helpers from a
+ * shared pool claim one at a time, each into a buffer of its own. The
+ * buffers are then appended in chunk order after the container header.
+ * Chunks see the type name table read-only and get no descriptor
+ * slots; a chunk that needs either fails, and the whole container is
+ * then encoded again the regular way.
+ */
+#define	RPC_MSGPACK_PARALLEL_MIN	65536
+#define	RPC_MSGPACK_PARALLEL_CHUNK	8192
+
+struct rpc_msgpack_chunk
+{
+	char *			rmc_buf;
+	size_t			rmc_len;
+	GArray *		rmc_segments;
+	bool			rmc_cacheable;
+};
+
+struct rpc_msgpack_job
+{
+	struct rpc_msgpack_writer rmj_ctx;
+	const char **		rmj_keys;
+	rpc_object_t *		rmj_values;
+	size_t			rmj_count;
+	guint			rmj_nchunks;
+	volatile gint		rmj_next;
+	volatile gint		rmj_refcnt;
+	volatile gint		rmj_failed;
+	guint			rmj_completed;
+	GMutex			rmj_mtx;
+	GCond			rmj_cv;
+	struct rpc_msgpack_chunk *rmj_chunks;
+};
+
+static GThreadPool *rpc_msgpack_pool;
+
+/*
+ * Per-connection table of canonical type names. The first time a name
+ * is sent, it goes out as an [id, name] pair; afterwards, as the bare
+ * id. The sending half is only touched with the connection send lock
+ * held, the receiving half only from the thread decoding its frames.
+ */
+struct rpc_msgpack_types
+{
+	GHashTable *		rmt_ids;
+	GPtrArray *		rmt_names;
+	GPtrArray *		rmt_typeis;
+};
+
+/*
+ * Parsed inbound frame backing lazily decoded containers. Holds the
+ * receive buffer until the last container referencing it is released.
+ */
+struct rpc_msgpack_frame
+{
+	volatile int		rmf_refcnt;
+	GMutex			rmf_mtx;
+	mpack_tree_t		rmf_tree;
+	void *			rmf_pool;
+	struct rpc_shmem_link *	rmf_shm;
+};
+
+struct rpc_msgpack_lazy
+{
+	struct rpc_lazy		rl_base;
+	struct rpc_msgpack_frame *rl_frame;
+	mpack_node_t		rl_node;
+	bool			rl_typed;
+	bool			rl_skip_type;
+};
+
+struct rpc_msgpack_reader
+{
+	void *			rmr_pool;
+	struct rpc_arena *	rmr_arena;
+	struct rpc_msgpack_frame *rmr_frame;
+	struct rpc_msgpack_types *rmr_types;
+	struct rpc_shmem_link *	rmr_shm;
+	GPtrArray *		rmr_descs;
+};
+
+static void rpc_msgpack_write_error(struct rpc_msgpack_writer *, rpc_object_t);
+static rpc_object_t rpc_msgpack_read_error(mpack_tree_t *,
+    struct rpc_msgpack_reader *);
+static int rpc_msgpack_write_fd(struct rpc_msgpack_writer *, int);
+static void rpc_msgpack_write_int64(mpack_writer_t *, int64_t);
+static void rpc_msgpack_write_date(struct rpc_msgpack_writer *, rpc_object_t);
+static rpc_object_t rpc_msgpack_read_timestamp(mpack_node_t,
+    struct rpc_msgpack_reader *);
+static void rpc_msgpack_write_uint64(mpack_writer_t *, uint64_t);
+static void rpc_msgpack_write_packed(struct rpc_msgpack_writer *,
+    rpc_object_t);
+static rpc_object_t rpc_msgpack_read_packed(const char *, size_t);
+static void rpc_msgpack_write_bin(struct rpc_msgpack_writer *, rpc_object_t);
+static int rpc_msgpack_write_object(struct rpc_msgpack_writer *, rpc_object_t);
+static int rpc_msgpack_write_typed(struct rpc_msgpack_writer *, rpc_object_t);
+static bool rpc_msgpack_write_cached(struct rpc_msgpack_writer *,
+    rpc_object_t);
+static int rpc_msgpack_write_struct(struct rpc_msgpack_writer *, rpc_object_t);
+static bool rpc_msgpack_write_positional(struct rpc_msgpack_writer *,
+    rpc_object_t);
+static bool rpc_msgpack_write_columnar(struct rpc_msgpack_writer *,
+    rpc_object_t);
+static bool rpc_msgpack_columnar_row(struct rpc_msgpack_writer *,
+    rpc_object_t, rpct_typei_t *);
+static bool rpc_msgpack_write_column_packed(struct rpc_msgpack_writer *,
+    rpc_object_t, const char *);
+static void rpc_msgpack_write_type_name(struct rpc_msgpack_writer *,
+    rpct_typei_t);
+static int rpc_msgpack_write_wrapped(struct rpc_msgpack_writer *,
+    rpc_object_t);
+static int rpc_msgpack_write_children(struct rpc_msgpack_writer *,
+    rpc_object_t);
+static void rpc_msgpack_job_unref(struct rpc_msgpack_job *);
+static void rpc_msgpack_job_work(struct rpc_msgpack_job *);
+static void rpc_msgpack_job_helper(gpointer, gpointer);
+static gpointer rpc_msgpack_pool_create(gpointer);
+static bool rpc_msgpack_write_parallel(struct rpc_msgpack_writer *,
+    rpc_object_t);
 #if defined(__linux__)
-static rpc_object_t rpc_msgpack_read_shmem(mpack_tree_t *);
-static void rpc_msgpack_write_shmem(mpack_writer_t *, rpc_object_t);
+static rpc_object_t rpc_msgpack_read_shmem(mpack_tree_t *,
+    struct rpc_msgpack_reader *);
+static void rpc_msgpack_write_shmem(struct rpc_msgpack_writer *, rpc_object_t,
+    int, struct rpc_shmem_pool *);
+static bool rpc_msgpack_write_bulk(struct rpc_msgpack_writer *, rpc_object_t);
+static rpc_object_t rpc_msgpack_read_bulk(mpack_tree_t *,
+    struct rpc_msgpack_reader *);
 #endif
-static rpc_object_t rpc_msgpack_read_object(mpack_node_t);
+static rpc_object_t rpc_msgpack_read_object(mpack_node_t,
+    struct rpc_msgpack_reader *);
+static rpc_object_t rpc_msgpack_read_typed(mpack_node_t,
+    struct rpc_msgpack_reader *);
+static rpc_object_t rpc_msgpack_read_children(mpack_node_t, bool,
+    struct rpc_msgpack_reader *);
+static rpc_object_t rpc_msgpack_read_binary(mpack_node_t,
+    struct rpc_msgpack_reader *);
+static rpc_object_t rpc_msgpack_read_positional(mpack_node_t,
+    struct rpc_msgpack_reader *);
+static bool rpc_msgpack_is_columnar(mpack_node_t, mpack_node_t *);
+static rpc_object_t rpc_msgpack_read_columnar(mpack_node_t, bool,
+    struct rpc_msgpack_reader *);
+static rpc_object_t rpc_msgpack_read_column_value(rpc_object_t, size_t,
+    struct rpc_msgpack_reader *);
+static rpct_typei_t rpc_msgpack_read_type_name(mpack_node_t,
+    struct rpc_msgpack_reader *, rpc_object_t *);
+static void rpc_msgpack_types_rollback(struct rpc_msgpack_types *, guint);
+static bool rpc_msgpack_is_type_field(mpack_node_t);
+static rpc_object_t rpc_msgpack_read_lazy(mpack_node_t, bool, bool,
+    struct rpc_msgpack_reader *);
+static void rpc_msgpack_frame_release(struct rpc_msgpack_frame *);
+static void rpc_msgpack_tree_init(mpack_tree_t *, const void *, size_t);
+static rpc_object_t rpc_msgpack_deserialize_impl(const void *, size_t, bool,
+    void *, bool, bool, struct rpc_msgpack_types *);
 
 static void
-rpc_msgpack_write_error(mpack_writer_t *writer, rpc_object_t error)
+rpc_msgpack_write_error(struct rpc_msgpack_writer *ctx, rpc_object_t error)
 {
+	mpack_writer_t *writer = ctx->rmw_writer;
+
 	assert(rpc_get_type(error) == RPC_TYPE_ERROR);
 
-	mpack_start_map(writer, 4);
+	mpack_start_map(writer, 2 +
+	    (rpc_error_get_extra(error) != NULL ? 1 : 0) +
+	    (rpc_error_get_stack(error) != NULL ? 1 : 0));
 	mpack_write_cstr(writer, MSGPACK_ERROR_CODE);
 	mpack_write_i64(writer, rpc_error_get_code(error));
 	mpack_write_cstr(writer, MSGPACK_ERROR_MESSAGE);
@@ -57,19 +247,19 @@ rpc_msgpack_write_error(mpack_writer_t *writer, rpc_object_t error)
 
 	if (rpc_error_get_extra(error) != NULL) {
 		mpack_write_cstr(writer, MSGPACK_ERROR_EXTRA);
-		rpc_msgpack_write_object(writer, rpc_error_get_extra(error));
+		rpc_msgpack_write_object(ctx, rpc_error_get_extra(error));
 	}
 
 	if (rpc_error_get_stack(error) != NULL) {
 		mpack_write_cstr(writer, MSGPACK_ERROR_STACK);
-		rpc_msgpack_write_object(writer, rpc_error_get_stack(error));
+		rpc_msgpack_write_object(ctx, rpc_error_get_stack(error));
 	}
 
 	mpack_finish_map(writer);
 }
 
 static rpc_object_t
-rpc_msgpack_read_error(mpack_tree_t *tree)
+rpc_msgpack_read_error(mpack_tree_t *tree, struct rpc_msgpack_reader *ctx)
 {
 	mpack_node_t root;
 	int code;
@@ -77,16 +267,19 @@ rpc_msgpack_read_error(mpack_tree_t *tree)
 	rpc_object_t extra;
 	rpc_object_t stack;
 	rpc_object_t result;
+	struct rpc_msgpack_reader subctx = *ctx;
 
+	/* The subtree doesn't outlive this call, so decode it eagerly */
+	subctx.rmr_frame = NULL;
 	root = mpack_tree_root(tree);
 	code = (int)mpack_node_i64(mpack_node_map_cstr(root,
 	    MSGPACK_ERROR_CODE));
 	msg = mpack_node_cstr_alloc(mpack_node_map_cstr(root,
 	    MSGPACK_ERROR_MESSAGE), 1024);
 	extra = rpc_msgpack_read_object(mpack_node_map_cstr(root,
-	    MSGPACK_ERROR_EXTRA));
+	    MSGPACK_ERROR_EXTRA), &subctx);
 	stack = rpc_msgpack_read_object(mpack_node_map_cstr(root,
-	    MSGPACK_ERROR_STACK));
+	    MSGPACK_ERROR_STACK), &subctx);
 	result = rpc_error_create_with_stack((int)code, msg,
 	    extra, stack);
 
@@ -95,24 +288,131 @@ rpc_msgpack_read_error(mpack_tree_t *tree)
 }
 
 #if defined(__linux__)
+/*
+ * Chunks of a pool the peer takes part in carry the pool id and size
+ * as well. Once the peer has the pool descriptor, fd is -1.
+ */
 static void
-rpc_msgpack_write_shmem(mpack_writer_t *writer, rpc_object_t shmem)
+rpc_msgpack_write_shmem(struct rpc_msgpack_writer *ctx, rpc_object_t shmem,
+    int fd, struct rpc_shmem_pool *pool)
 {
+	mpack_writer_t *writer = ctx->rmw_writer;
+
 	assert(rpc_get_type(shmem) == RPC_TYPE_SHMEM);
 
-	mpack_start_map(writer, 3);
+	mpack_start_map(writer, pool != NULL ? 5 : 3);
 	mpack_write_cstr(writer, MSGPACK_SHMEM_FD);
-	mpack_write_i64(writer, shmem->ro_value.rv_shmem.rsb_fd);
+	mpack_write_i64(writer, fd);
 	mpack_write_cstr(writer, MSGPACK_SHMEM_OFFSET);
 	mpack_write_u64(writer, shmem->ro_value.rv_shmem.rsb_offset);
 	mpack_write_cstr(writer, MSGPACK_SHMEM_LEN);
 	mpack_write_u64(writer, shmem->ro_value.rv_shmem.rsb_size);
+	if (pool != NULL) {
+		mpack_write_cstr(writer, MSGPACK_SHMEM_POOL);
+		mpack_write_u64(writer, pool->rsp_id);
+		mpack_write_cstr(writer, MSGPACK_SHMEM_POOL_SIZE);
+		mpack_write_u64(writer, pool->rsp_size);
+	}
+	mpack_finish_map(writer);
+}
+
+/*
+ * Large binaries sent to a peer taking part in our bulk pool go out of
+ * band: the frame only carries the pool id, offset and size of the chunk
+ * they were copied into. Each send lends the chunk to the peer, so the
+ * frame can't be cached.
+ */
+static bool
+rpc_msgpack_write_bulk(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	mpack_writer_t subwriter;
+	rpc_object_t chunk;
+	char *buffer;
+	size_t len;
+
+	chunk = rpc_shmem_link_bulk(ctx->rmw_shm,
+	    object->ro_value.rv_bin.rbv_ptr,
+	    object->ro_value.rv_bin.rbv_length);
+	if (chunk == NULL)
+		return (false);
+
+	if (ctx->rmw_cacheable != NULL)
+		*ctx->rmw_cacheable = false;
+
+	mpack_writer_init_growable(&subwriter, &buffer, &len);
+	mpack_start_map(&subwriter, 3);
+	mpack_write_cstr(&subwriter, MSGPACK_SHMEM_POOL);
+	mpack_write_u64(&subwriter, chunk->ro_value.rv_shmem.rsb_pool->rsp_id);
+	mpack_write_cstr(&subwriter, MSGPACK_SHMEM_OFFSET);
+	mpack_write_u64(&subwriter, chunk->ro_value.rv_shmem.rsb_offset);
+	mpack_write_cstr(&subwriter, MSGPACK_SHMEM_LEN);
+	mpack_write_u64(&subwriter, chunk->ro_value.rv_shmem.rsb_size);
+	mpack_finish_map(&subwriter);
+	mpack_writer_destroy(&subwriter);
+	mpack_write_ext(ctx->rmw_writer, MSGPACK_EXTTYPE_BULK, buffer, len);
+	free(buffer);
+
+	/* The peer's loan keeps the chunk until it gives it back */
+	rpc_release(chunk);
+	return (true);
+}
+
+/*
+ * Offsets and sizes of pool chunks come from the peer, and views of
+ * them point straight into the pool mapping, so they have to stay
+ * within it.
+ */
+static bool
+rpc_msgpack_chunk_valid(struct rpc_shmem_pool *pool, uint64_t offset,
+    uint64_t len)
+{
+
+	return (offset <= pool->rsp_size && len <= pool->rsp_size - offset);
+}
+
+/*
+ * A binary sent out of band is handed out straight from the mapping of
+ * the peer's bulk pool; releasing it gives the chunk back to the peer.
+ */
+static rpc_object_t
+rpc_msgpack_read_bulk(mpack_tree_t *tree, struct rpc_msgpack_reader *ctx)
+{
+	struct rpc_shmem_pool *pool;
+	mpack_node_t root;
+	rpc_object_t chunk;
+	uint64_t offset, len;
+
+	if (ctx->rmr_shm == NULL)
+		return (rpc_null_create());
+
+	root = mpack_tree_root(tree);
+	offset = mpack_node_u64(mpack_node_map_cstr(root, MSGPACK_SHMEM_OFFSET));
+	len = mpack_node_u64(mpack_node_map_cstr(root, MSGPACK_SHMEM_LEN));
+	pool = rpc_shmem_link_lookup(ctx->rmr_shm, mpack_node_u64(
+	    mpack_node_map_cstr(root, MSGPACK_SHMEM_POOL)));
+	if (pool == NULL)
+		return (rpc_null_create());
+
+	if (!rpc_msgpack_chunk_valid(pool, offset, len)) {
+		rpc_shmem_pool_unref(pool);
+		return (rpc_error_create(ERANGE,
+		    "Shared memory chunk out of pool bounds", NULL));
+	}
+
+	chunk = rpc_shmem_create_pooled(pool, (off_t)offset, (size_t)len);
+	return (rpc_data_create((char *)pool->rsp_base + offset, (size_t)len,
+	    ^(void *ptr __unused) {
+		rpc_release(chunk);
+	    }));
 }
 
 static rpc_object_t
-rpc_msgpack_read_shmem(mpack_tree_t *tree)
+rpc_msgpack_read_shmem(mpack_tree_t *tree, struct rpc_msgpack_reader *ctx)
 {
+	struct rpc_shmem_pool *pool;
 	mpack_node_t root;
+	mpack_node_t id;
+	rpc_object_t result;
 	int fd;
 	uint64_t offset, len;
 
@@ -120,17 +420,216 @@ rpc_msgpack_read_shmem(mpack_tree_t *tree)
 	fd = (int)mpack_node_i64(mpack_node_map_cstr(root, MSGPACK_SHMEM_FD));
 	offset = mpack_node_u64(mpack_node_map_cstr(root, MSGPACK_SHMEM_OFFSET));
 	len = mpack_node_u64(mpack_node_map_cstr(root, MSGPACK_SHMEM_LEN));
-	return (rpc_shmem_recreate(fd, (off_t)offset, (size_t)len));
+	id = mpack_node_map_cstr_optional(root, MSGPACK_SHMEM_POOL);
+	if (mpack_node_type(id) == mpack_type_nil)
+		return (rpc_shmem_recreate(fd, (off_t)offset, (size_t)len));
+
+	/* The pool descriptor came in an earlier frame */
+	if (fd < 0) {
+		if (ctx->rmr_shm == NULL)
+			return (rpc_null_create());
+
+		pool = rpc_shmem_link_lookup(ctx->rmr_shm, mpack_node_u64(id));
+		if (pool == NULL)
+			return (rpc_null_create());
+
+		if (!rpc_msgpack_chunk_valid(pool, offset, len)) {
+			rpc_shmem_pool_unref(pool);
+			return (rpc_error_create(ERANGE,
+			    "Shared memory chunk out of pool bounds", NULL));
+		}
+
+		return (rpc_shmem_create_pooled(pool, (off_t)offset,
+		    (size_t)len));
+	}
+
+	/* Imported when the descriptor is restored */
+	result = rpc_shmem_recreate(fd, (off_t)offset, (size_t)len);
+	result->ro_value.rv_shmem.rsb_pool_id = mpack_node_u64(id);
+	result->ro_value.rv_shmem.rsb_pool_size = (size_t)mpack_node_u64(
+	    mpack_node_map_cstr(root, MSGPACK_SHMEM_POOL_SIZE));
+	return (result);
 }
 
 #endif
+
+/*
+ * Returns the value to put on the wire in place of a file descriptor.
+ * When the caller collects descriptors for out-of-band passing, that's
+ * the index in the descriptor table; otherwise it's the descriptor itself.
+ */
 static int
-rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
+rpc_msgpack_write_fd(struct rpc_msgpack_writer *ctx, int fd)
+{
+
+	/* Descriptor indexes differ from frame to frame */
+	if (ctx->rmw_cacheable != NULL)
+		*ctx->rmw_cacheable = false;
+
+	if (ctx->rmw_fds == NULL)
+		return (fd);
+
+	if (ctx->rmw_nfds >= ctx->rmw_maxfds)
+		return (-1);
+
+	ctx->rmw_fds[ctx->rmw_nfds] = fd;
+	return ((int)ctx->rmw_nfds++);
+}
+
+/*
+ * When the caller asked for a vectored frame, large binaries are not
+ * copied into the output buffer. Only the bin header goes there and
+ * the payload is recorded as a segment to send straight from memory.
+ */
+static void
+rpc_msgpack_write_bin(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	struct rpc_output_segment seg;
+	char header[5];
+	uint32_t be_len;
+	size_t len = object->ro_value.rv_bin.rbv_length;
+
+	/* Better sent straight from memory than copied into a cache */
+	if (ctx->rmw_cacheable != NULL && len >= RPC_BINARY_IOV_MIN)
+		*ctx->rmw_cacheable = false;
+
+#if defined(__linux__)
+	if (ctx->rmw_shm != NULL && rpc_msgpack_write_bulk(ctx, object))
+		return;
+#endif
+
+	if (ctx->rmw_segments == NULL || len < RPC_BINARY_IOV_MIN ||
+	    len > UINT32_MAX) {
+		mpack_write_bin(ctx->rmw_writer,
+		    (char *)object->ro_value.rv_bin.rbv_ptr, (uint32_t)len);
+		return;
+	}
+
+	be_len = htobe32((uint32_t)len);
+	header[0] = (char)0xc6;
+	memcpy(&header[1], &be_len, sizeof(be_len));
+	mpack_write_object_bytes(ctx->rmw_writer, header, sizeof(header));
+
+	seg.ros_offset = mpack_writer_buffer_used(ctx->rmw_writer);
+	seg.ros_ptr = (const void *)object->ro_value.rv_bin.rbv_ptr;
+	seg.ros_len = len;
+	g_array_append_val(ctx->rmw_segments, seg);
+}
+
+/*
+ * Dates go out as the standard timestamp extension, in the shortest of
+ * its three forms that holds the value, unless the peer only knows the
+ * old whole second extension.
+ */
+static void
+rpc_msgpack_write_date(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	struct {
+		uint32_t nsec;
+		int64_t sec;
+	} __attribute__((packed)) data96;
+	uint64_t data64;
+	uint32_t data32;
+	uint32_t nsec;
+	int64_t sec;
+
+	sec = rpc_date_get_value(object);
+	if (!ctx->rmw_timestamps) {
+		mpack_write_ext(ctx->rmw_writer, MSGPACK_EXTTYPE_DATE,
+		    (const char *)&sec, sizeof(sec));
+		return;
+	}
+
+	nsec = (uint32_t)(rpc_date_get_usec(object) - sec * G_USEC_PER_SEC) *
+	    1000;
+
+	if ((sec >> 34) != 0) {
+		data96.nsec = GUINT32_TO_BE(nsec);
+		data96.sec = GINT64_TO_BE(sec);
+		mpack_write_ext(ctx->rmw_writer, MSGPACK_EXTTYPE_TIMESTAMP,
+		    (const char *)&data96, sizeof(data96));
+	} else if (nsec != 0 || sec > G_MAXUINT32) {
+		data64 = GUINT64_TO_BE(((uint64_t)nsec << 34) | (uint64_t)sec);
+		mpack_write_ext(ctx->rmw_writer, MSGPACK_EXTTYPE_TIMESTAMP,
+		    (const char *)&data64, sizeof(data64));
+	} else {
+		data32 = GUINT32_TO_BE((uint32_t)sec);
+		mpack_write_ext(ctx->rmw_writer, MSGPACK_EXTTYPE_TIMESTAMP,
+		    (const char *)&data32, sizeof(data32));
+	}
+}
+
+static rpc_object_t
+rpc_msgpack_read_timestamp(mpack_node_t node, struct rpc_msgpack_reader *ctx)
+{
+	const char *data = mpack_node_data(node);
+	union rpc_value val;
+	uint64_t data64;
+	uint32_t data32;
+	uint32_t nsec = 0;
+	int64_t sec;
+
+	switch (mpack_node_data_len(node)) {
+	case 4:
+		memcpy(&data32, data, sizeof(data32));
+		sec = GUINT32_FROM_BE(data32);
+		break;
+
+	case 8:
+		memcpy(&data64, data, sizeof(data64));
+		data64 = GUINT64_FROM_BE(data64);
+		nsec = (uint32_t)(data64 >> 34);
+		sec = (int64_t)(data64 & ((1ULL << 34) - 1));
+		break;
+
+	case 12:
+		memcpy(&data32, data, sizeof(data32));
+		memcpy(&data64, data + sizeof(data32), sizeof(data64));
+		nsec = GUINT32_FROM_BE(data32);
+		sec = (int64_t)GUINT64_FROM_BE(data64);
+		break;
+
+	default:
+		return (rpc_null_create());
+	}
+
+	val.rv_date.rdv_usec = sec * G_USEC_PER_SEC + nsec / 1000;
+	val.rv_date.rdv_tz_offset = 0;
+	return (rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_DATE, val));
+}
+
+/*
+ * Integers are always written with an explicit signed or unsigned tag,
+ * so that they are decoded back into the same type.
+ */
+static void
+rpc_msgpack_write_int64(mpack_writer_t *writer, int64_t value)
+{
+	struct {
+		uint8_t tag;
+		uint64_t value;
+	} __attribute__((packed)) be_int64;
+	struct {
+		uint8_t tag;
+		uint32_t value;
+	} __attribute__((packed)) be_int32;
+
+	if (value > (1LL << 32)) {
+		be_int64.value = htobe64(value);
+		be_int64.tag = 0xd3;
+		mpack_write_object_bytes(writer,
+		    (const char *)&be_int64, sizeof(be_int64));
+	} else {
+		be_int32.value = htobe32(value);
+		be_int32.tag = 0xd2;
+		mpack_write_object_bytes(writer,
+		    (const char *)&be_int32, sizeof(be_int32));
+	}
+}
+
+static void
+rpc_msgpack_write_uint64(mpack_writer_t *writer, uint64_t value)
 {
-	int64_t timestamp;
-	mpack_writer_t subwriter;
-	char *buffer;
-	size_t len;
 	struct {
 		uint8_t tag;
 		uint64_t value;
@@ -140,6 +639,147 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 		uint32_t value;
 	} __attribute__((packed)) be_int32;
 
+	if (value > (1ULL << 32)) {
+		be_int64.value = htobe64(value);
+		be_int64.tag = 0xcf;
+		mpack_write_object_bytes(writer,
+		    (const char *)&be_int64, sizeof(be_int64));
+	} else {
+		be_int32.value = htobe32(value);
+		be_int32.tag = 0xce;
+		mpack_write_object_bytes(writer,
+		    (const char *)&be_int32, sizeof(be_int32));
+	}
+}
+
+/*
+ * Packed arrays go out as a single blob: a type byte followed by the
+ * little-endian elements. Peers that haven't announced support for
+ * those get a regular array, written straight from the buffer.
+ */
+static void
+rpc_msgpack_write_packed(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	mpack_writer_t *writer = ctx->rmw_writer;
+	const char *data;
+	rpc_type_t type;
+	size_t count;
+	size_t size;
+	size_t i;
+	uint8_t tag;
+#if G_BYTE_ORDER != G_LITTLE_ENDIAN
+	uint64_t le;
+#endif
+
+	data = rpc_array_get_packed(object, &type, &count);
+	size = rpc_array_packed_elem_size(type);
+
+	if (!ctx->rmw_packed) {
+		mpack_start_array(writer, (uint32_t)count);
+		for (i = 0; i < count; i++) {
+			switch (type) {
+			case RPC_TYPE_INT64:
+				rpc_msgpack_write_int64(writer,
+				    ((const int64_t *)data)[i]);
+				break;
+
+			case RPC_TYPE_UINT64:
+				rpc_msgpack_write_uint64(writer,
+				    ((const uint64_t *)data)[i]);
+				break;
+
+			case RPC_TYPE_DOUBLE:
+				mpack_write_double(writer,
+				    ((const double *)data)[i]);
+				break;
+
+			case RPC_TYPE_BOOL:
+				mpack_write_bool(writer,
+				    ((const bool *)data)[i]);
+				break;
+
+			default:
+				g_assert_not_reached();
+			}
+		}
+
+		mpack_finish_array(writer);
+		return;
+	}
+
+	tag = (uint8_t)type;
+	mpack_start_ext(writer, MSGPACK_EXTTYPE_PACKED,
+	    (uint32_t)(1 + count * size));
+	mpack_write_bytes(writer, (const char *)&tag, 1);
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+	mpack_write_bytes(writer, data, count * size);
+#else
+	for (i = 0; i < count; i++) {
+		if (size != sizeof(le)) {
+			mpack_write_bytes(writer, data + i * size, size);
+			continue;
+		}
+
+		memcpy(&le, data + i * size, size);
+		le = GUINT64_TO_LE(le);
+		mpack_write_bytes(writer, (const char *)&le, size);
+	}
+#endif
+	mpack_finish_ext(writer);
+}
+
+static rpc_object_t
+rpc_msgpack_read_packed(const char *data, size_t len)
+{
+	rpc_type_t type;
+	size_t size;
+	size_t count;
+	void *buffer;
+#if G_BYTE_ORDER != G_LITTLE_ENDIAN
+	uint64_t *elem;
+	size_t i;
+#endif
+
+	if (len < 1)
+		return (rpc_null_create());
+
+	type = (rpc_type_t)(uint8_t)data[0];
+	size = rpc_array_packed_elem_size(type);
+	if (size == 0 || (len - 1) % size != 0)
+		return (rpc_null_create());
+
+	count = (len - 1) / size;
+	buffer = g_malloc(len - 1);
+	memcpy(buffer, data + 1, len - 1);
+#if G_BYTE_ORDER != G_LITTLE_ENDIAN
+	if (size == sizeof(*elem)) {
+		elem = buffer;
+		for (i = 0; i < count; i++)
+			elem[i] = GUINT64_FROM_LE(elem[i]);
+	}
+#endif
+
+	return (rpc_array_create_packed_stolen(type, buffer, count));
+}
+
+static int
+rpc_msgpack_write_object(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	mpack_writer_t *writer = ctx->rmw_writer;
+	struct rpc_msgpack_writer subctx = *ctx;
+	mpack_writer_t subwriter;
+#if defined(__linux__)
+	struct rpc_shmem_pool *pool;
+#endif
+	char *buffer;
+	size_t len;
+	int fd;
+
+	/* Everything below a typed leaf goes out untyped */
+	subctx.rmw_typed = false;
+	subctx.rmw_writer = &subwriter;
+	subctx.rmw_segments = NULL;
+
 	switch (object->ro_type) {
 	case RPC_TYPE_NULL:
 		mpack_write_nil(writer);
@@ -150,37 +790,15 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 		break;
 
 	case RPC_TYPE_INT64:
-		if (object->ro_value.rv_i > (1LL << 32)) {
-			be_int64.value = htobe64(object->ro_value.rv_i);
-			be_int64.tag = 0xd3;
-			mpack_write_object_bytes(writer,
-			    (const char *)&be_int64, sizeof(be_int64));
-		} else {
-			be_int32.value = htobe32(object->ro_value.rv_i);
-			be_int32.tag = 0xd2;
-			mpack_write_object_bytes(writer,
-			    (const char *)&be_int32, sizeof(be_int32));
-		}
+		rpc_msgpack_write_int64(writer, object->ro_value.rv_i);
 		break;
 
 	case RPC_TYPE_UINT64:
-		if (object->ro_value.rv_ui > (1ULL << 32)) {
-			be_int64.value = htobe64(object->ro_value.rv_ui);
-			be_int64.tag = 0xcf;
-			mpack_write_object_bytes(writer,
-			    (const char *)&be_int64, sizeof(be_int64));
-		} else {
-			be_int32.value = htobe32(object->ro_value.rv_ui);
-			be_int32.tag = 0xce;
-			mpack_write_object_bytes(writer,
-			    (const char *)&be_int32, sizeof(be_int32));
-		}
+		rpc_msgpack_write_uint64(writer, object->ro_value.rv_ui);
 		break;
 
 	case RPC_TYPE_DATE:
-		timestamp = g_date_time_to_unix(object->ro_value.rv_datetime);
-		mpack_write_ext(writer, MSGPACK_EXTTYPE_DATE,
-		    (const char *)&timestamp, sizeof(int64_t));
+		rpc_msgpack_write_date(ctx, object);
 		break;
 
 	case RPC_TYPE_DOUBLE:
@@ -188,182 +806,2112 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 		break;
 
 	case RPC_TYPE_STRING:
-		mpack_write_cstr(writer, object->ro_value.rv_str->str);
+		mpack_write_str(writer, rpc_string_get_string_ptr(object),
+		    (uint32_t)rpc_string_get_length(object));
 		break;
 
 	case RPC_TYPE_BINARY:
-		mpack_write_bin(writer, (char *)object->ro_value.rv_bin.rbv_ptr,
-		    (uint32_t)object->ro_value.rv_bin.rbv_length);
+		rpc_msgpack_write_bin(ctx, object);
 		break;
 
 	case RPC_TYPE_FD:
+		fd = rpc_msgpack_write_fd(ctx, object->ro_value.rv_fd);
+		if (fd < 0) {
+			rpc_set_last_error(E2BIG,
+			    "Too many file descriptors in a frame", NULL);
+			return (-1);
+		}
+
 		mpack_write_ext(writer, MSGPACK_EXTTYPE_FD,
-		    (const char *)&object->ro_value.rv_fd,
-		    sizeof(object->ro_value.rv_fd));
+		    (const char *)&fd, sizeof(fd));
 		break;
 
 #if defined(__linux__)
 	case RPC_TYPE_SHMEM:
+		/* Chunks of peer pools are passed on as plain shmem */
+		pool = object->ro_value.rv_shmem.rsb_pool;
+		if (pool == NULL || pool->rsp_remote || ctx->rmw_shm == NULL)
+			pool = NULL;
+
+		if (pool != NULL && rpc_shmem_link_lend(ctx->rmw_shm, pool,
+		    object->ro_value.rv_shmem.rsb_offset))
+			fd = -1;
+		else {
+			fd = rpc_msgpack_write_fd(ctx,
+			    object->ro_value.rv_shmem.rsb_fd);
+			if (fd < 0) {
+				rpc_set_last_error(E2BIG,
+				    "Too many file descriptors in a frame",
+				    NULL);
+				return (-1);
+			}
+		}
+
 		mpack_writer_init_growable(&subwriter, &buffer, &len);
-		rpc_msgpack_write_shmem(&subwriter, object);
+		rpc_msgpack_write_shmem(&subctx, object, fd, pool);
 		mpack_writer_destroy(&subwriter);
 		mpack_write_ext(writer, MSGPACK_EXTTYPE_SHMEM,
 		    buffer, len);
+		free(buffer);
 		break;
 #endif
 
 	case RPC_TYPE_ERROR:
 		mpack_writer_init_growable(&subwriter, &buffer, &len);
-		rpc_msgpack_write_error(&subwriter, object);
+		rpc_msgpack_write_error(&subctx, object);
 		mpack_writer_destroy(&subwriter);
+		ctx->rmw_nfds = subctx.rmw_nfds;
 		mpack_write_ext(writer, MSGPACK_EXTTYPE_ERROR,
 		    (const char *)buffer, len);
+		free(buffer);
 		break;
 
 	case RPC_TYPE_DICTIONARY:
+	case RPC_TYPE_ARRAY:
+		return (rpc_msgpack_write_children(ctx, object));
+	}
+
+	return (0);
+}
+
+static int
+rpc_msgpack_write_children(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	mpack_writer_t *writer = ctx->rmw_writer;
+	__block int ret = 0;
+
+	switch (object->ro_type) {
+	case RPC_TYPE_DICTIONARY:
+		if (rpc_msgpack_write_parallel(ctx, object))
+			break;
+
 		mpack_start_map(writer, (uint32_t)rpc_dictionary_get_count(object));
-		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
+		rpc_dictionary_walk(object, ^(const char *k, rpc_object_t v) {
 		    mpack_write_cstr(writer, k);
-		    rpc_msgpack_write_object(writer, v);
-		    return ((bool)true);
+		    ret = rpc_msgpack_write_typed(ctx, v);
+		    return ((bool)(ret == 0));
 		});
 		mpack_finish_map(writer);
 		break;
 
 	case RPC_TYPE_ARRAY:
+		if (rpc_array_get_packed(object, NULL, NULL) != NULL) {
+			rpc_msgpack_write_packed(ctx, object);
+			break;
+		}
+
+		if (ctx->rmw_columnar && rpc_msgpack_write_columnar(ctx, object))
+			break;
+
+		if (rpc_msgpack_write_parallel(ctx, object))
+			break;
+
 		mpack_start_array(writer, (uint32_t)rpc_array_get_count(object));
-		rpc_array_apply(object, ^(size_t idx __unused, rpc_object_t v) {
-		    rpc_msgpack_write_object(writer, v);
-		    return ((bool)true);
+		rpc_array_walk(object, ^(size_t idx __unused, rpc_object_t v) {
+		    ret = rpc_msgpack_write_typed(ctx, v);
+		    return ((bool)(ret == 0));
 		});
 		mpack_finish_array(writer);
 		break;
+
+	default:
+		g_assert_not_reached();
 	}
 
-	return (0);
+	return (ret);
 }
 
-static rpc_object_t
-rpc_msgpack_read_object(mpack_node_t node)
+static void
+rpc_msgpack_job_unref(struct rpc_msgpack_job *job)
 {
-	int *fd;
-	void *buffer;
-	int64_t *date;
-	mpack_tree_t subtree;
-	__block size_t i;
-	__block char *cstr;
-	__block mpack_node_t tmp;
-	__block rpc_object_t result;
+	guint i;
 
-	switch (mpack_node_type(node)) {
-	case mpack_type_int:
-		return (rpc_int64_create(mpack_node_i64(node)));
+	if (!g_atomic_int_dec_and_test(&job->rmj_refcnt))
+		return;
 
-	case mpack_type_uint:
-		return (rpc_uint64_create(mpack_node_u64(node)));
+	for (i = 0; i < job->rmj_nchunks; i++) {
+		free(job->rmj_chunks[i].rmc_buf);
+		if (job->rmj_chunks[i].rmc_segments != NULL)
+			g_array_free(job->rmj_chunks[i].rmc_segments, true);
+	}
 
-	case mpack_type_bool:
-		return (rpc_bool_create(mpack_node_bool(node)));
+	g_mutex_clear(&job->rmj_mtx);
+	g_cond_clear(&job->rmj_cv);
+	g_free(job->rmj_chunks);
+	g_free(job);
+}
 
-	case mpack_type_float:
-	case mpack_type_double:
-		return (rpc_double_create(mpack_node_double(node)));
+static void
+rpc_msgpack_job_work(struct rpc_msgpack_job *job)
+{
+	struct rpc_msgpack_chunk *chunk;
+	struct rpc_msgpack_writer ctx;
+	mpack_writer_t writer;
+	size_t i;
+	size_t end;
+	gint c;
+	int ret;
 
-	case mpack_type_str:
-		cstr = g_strndup(mpack_node_str(node), mpack_node_strlen(node));
-		result = rpc_string_create(cstr);
-		g_free(cstr);
-		return (result);
+	for (;;) {
+		c = g_atomic_int_add(&job->rmj_next, 1);
+		if (c >= (gint)job->rmj_nchunks)
+			break;
+
+		chunk = &job->rmj_chunks[c];
+		ctx = job->rmj_ctx;
+		ctx.rmw_writer = &writer;
+		ctx.rmw_nfds = 0;
+		ctx.rmw_maxfds = 0;
+		ctx.rmw_shm = NULL;
+		ctx.rmw_segments = chunk->rmc_segments;
+		ctx.rmw_cacheable = &chunk->rmc_cacheable;
+		ctx.rmw_parallel = true;
+
+		end = MIN((size_t)(c + 1) * RPC_MSGPACK_PARALLEL_CHUNK,
+		    job->rmj_count);
+		ret = 0;
+
+		mpack_writer_init_growable(&writer, &chunk->rmc_buf,
+		    &chunk->rmc_len);
+		for (i = (size_t)c * RPC_MSGPACK_PARALLEL_CHUNK;
+		    i < end && ret == 0; i++) {
+			if (job->rmj_keys != NULL)
+				mpack_write_cstr(&writer, job->rmj_keys[i]);
+
+			ret = rpc_msgpack_write_typed(&ctx, job->rmj_values[i]);
+		}
+
+		if (mpack_writer_destroy(&writer) != mpack_ok || ret != 0)
+			g_atomic_int_set(&job->rmj_failed, 1);
+
+		g_mutex_lock(&job->rmj_mtx);
+		if (++job->rmj_completed == job->rmj_nchunks)
+			g_cond_broadcast(&job->rmj_cv);
+
+		g_mutex_unlock(&job->rmj_mtx);
+	}
+}
+
+static void
+rpc_msgpack_job_helper(gpointer data, gpointer user_data __unused)
+{
+	struct rpc_msgpack_job *job = data;
+
+	rpc_msgpack_job_work(job);
+	rpc_msgpack_job_unref(job);
+}
+
+static gpointer
+rpc_msgpack_pool_create(gpointer data __unused)
+{
+
+	rpc_msgpack_pool = g_thread_pool_new(rpc_msgpack_job_helper, NULL,
+	    (gint)g_get_num_processors(), false, NULL);
+	return (NULL);
+}
+
+/*
+ * Returns false, having written nothing, if the container is too small
+ * to be worth splitting or one of its chunks couldn't be encoded.
+ */
+static bool
+rpc_msgpack_write_parallel(struct rpc_msgpack_writer *ctx,
+    rpc_object_t object)
+{
+	static GOnce pool_once = G_ONCE_INIT;
+	mpack_writer_t *writer = ctx->rmw_writer;
+	struct rpc_msgpack_job *job;
+	struct rpc_msgpack_chunk *chunk;
+	struct rpc_output_segment *seg;
+	__block size_t n = 0;
+	char header[5];
+	uint32_t be_count;
+	size_t count;
+	size_t base;
+	guint nhelpers;
+	guint c;
+	guint i;
+
+#if MPACK_WRITE_TRACKING
+	/* Appended chunks would upset the element tracking */
+	return (false);
+#endif
+
+	count = object->ro_type == RPC_TYPE_ARRAY ?
+	    rpc_array_get_count(object) : rpc_dictionary_get_count(object);
+	if (ctx->rmw_parallel || count < RPC_MSGPACK_PARALLEL_MIN ||
+	    count > UINT32_MAX || g_get_num_processors() < 2)
+		return (false);
+
+	g_once(&pool_once, rpc_msgpack_pool_create, NULL);
+
+	job = g_malloc0(sizeof(*job));
+	job->rmj_ctx = *ctx;
+	job->rmj_count = count;
+	job->rmj_values = g_new(rpc_object_t, count);
+	job->rmj_nchunks = (guint)((count + RPC_MSGPACK_PARALLEL_CHUNK - 1) /
+	    RPC_MSGPACK_PARALLEL_CHUNK);
+	job->rmj_chunks = g_new0(struct rpc_msgpack_chunk, job->rmj_nchunks);
+	job->rmj_refcnt = 1;
+	g_mutex_init(&job->rmj_mtx);
+	g_cond_init(&job->rmj_cv);
+
+	if (object->ro_type == RPC_TYPE_DICTIONARY) {
+		job->rmj_keys = g_new(const char *, count);
+		rpc_dictionary_walk(object, ^(const char *k, rpc_object_t v) {
+			job->rmj_keys[n] = k;
+			job->rmj_values[n++] = v;
+			return ((bool)true);
+		});
+	} else {
+		rpc_array_walk(object, ^(size_t idx, rpc_object_t v) {
+			job->rmj_values[idx] = v;
+			return ((bool)true);
+		});
+	}
+
+	for (c = 0; c < job->rmj_nchunks; c++) {
+		job->rmj_chunks[c].rmc_cacheable = true;
+		if (ctx->rmw_segments != NULL) {
+			job->rmj_chunks[c].rmc_segments = g_array_new(false,
+			    false, sizeof(struct rpc_output_segment));
+		}
+	}
+
+	nhelpers = MIN(g_get_num_processors() - 1, job->rmj_nchunks - 1);
+	for (c = 0; c < nhelpers; c++) {
+		g_atomic_int_inc(&job->rmj_refcnt);
+		g_thread_pool_push(rpc_msgpack_pool, job, NULL);
+	}
+
+	rpc_msgpack_job_work(job);
+
+	g_mutex_lock(&job->rmj_mtx);
+	while (job->rmj_completed < job->rmj_nchunks)
+		g_cond_wait(&job->rmj_cv, &job->rmj_mtx);
+
+	g_mutex_unlock(&job->rmj_mtx);
+
+	/* Helpers starting this late find no chunks left to claim */
+	g_free(job->rmj_values);
+	g_free(job->rmj_keys);
+	job->rmj_values = NULL;
+	job->rmj_keys = NULL;
+
+	if (g_atomic_int_get(&job->rmj_failed)) {
+		rpc_msgpack_job_unref(job);
+		return (false);
+	}
+
+	be_count = htobe32((uint32_t)count);
+	header[0] = (char)(object->ro_type == RPC_TYPE_ARRAY ? 0xdd : 0xdf);
+	memcpy(&header[1], &be_count, sizeof(be_count));
+	mpack_write_object_bytes(writer, header, sizeof(header));
+
+	for (c = 0; c < job->rmj_nchunks; c++) {
+		chunk = &job->rmj_chunks[c];
+		if (!chunk->rmc_cacheable && ctx->rmw_cacheable != NULL)
+			*ctx->rmw_cacheable = false;
+
+		base = mpack_writer_buffer_used(writer);
+		mpack_write_object_bytes(writer, chunk->rmc_buf,
+		    chunk->rmc_len);
+
+		/* Segment offsets were taken within the chunk buffer */
+		for (i = 0; chunk->rmc_segments != NULL &&
+		    i < chunk->rmc_segments->len; i++) {
+			seg = &g_array_index(chunk->rmc_segments,
+			    struct rpc_output_segment, i);
+			seg->ros_offset += base;
+			g_array_append_vals(ctx->rmw_segments, seg, 1);
+		}
+	}
+
+	rpc_msgpack_job_unref(job);
+	return (true);
+}
+
+/*
+ * Writes a struct instance the same way struct_serialize() would lay it
+ * out: every member serialized recursively, followed by the type field.
+ */
+static int
+rpc_msgpack_write_struct(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	mpack_writer_t *writer = ctx->rmw_writer;
+	size_t count;
+	__block int ret = 0;
+
+	if (ctx->rmw_positional && rpc_msgpack_write_positional(ctx, object))
+		return (0);
+
+	count = rpc_dictionary_get_count(object);
+	if (!rpc_dictionary_has_key(object, RPCT_TYPE_FIELD))
+		count++;
+
+	mpack_start_map(writer, (uint32_t)count);
+	rpc_dictionary_walk(object, ^(const char *k, rpc_object_t v) {
+		if (g_strcmp0(k, RPCT_TYPE_FIELD) == 0)
+			return ((bool)true);
+
+		mpack_write_cstr(writer, k);
+		ret = rpc_msgpack_write_typed(ctx, v);
+		return ((bool)(ret == 0));
+	});
+
+	mpack_write_cstr(writer, RPCT_TYPE_FIELD);
+	rpc_msgpack_write_type_name(ctx, object->ro_typei);
+	mpack_finish_map(writer);
+	return (ret);
+}
+
+/*
+ * Writes a struct instance as {"%p": [type, fingerprint, values...]},
+ * with the values in layout order and no member names. Only instances
+ * carrying exactly the members of their type qualify; anything else
+ * returns false without writing and goes out keyed instead.
+ */
+static bool
+rpc_msgpack_write_positional(struct rpc_msgpack_writer *ctx,
+    rpc_object_t object)
+{
+	mpack_writer_t *writer = ctx->rmw_writer;
+	const struct rpct_layout *layout;
+	size_t count;
+	guint i;
+
+	layout = rpct_type_get_layout(object->ro_typei->type);
+	count = rpc_dictionary_get_count(object);
+	if (rpc_dictionary_has_key(object, RPCT_TYPE_FIELD))
+		count--;
+
+	if (count != layout->rl_count)
+		return (false);
+
+	for (i = 0; i < layout->rl_count; i++) {
+		if (!rpc_dictionary_has_key(object, layout->rl_names[i]))
+			return (false);
+	}
+
+	mpack_start_map(writer, 1);
+	mpack_write_cstr(writer, MSGPACK_POSITIONAL_FIELD);
+	mpack_start_array(writer, layout->rl_count + 2);
+	rpc_msgpack_write_type_name(ctx, object->ro_typei);
+	mpack_write_u32(writer, layout->rl_fingerprint);
+
+	for (i = 0; i < layout->rl_count; i++) {
+		if (rpc_msgpack_write_typed(ctx, rpc_dictionary_get_value(
+		    object, layout->rl_names[i])) != 0) {
+			mpack_writer_flag_error(writer, mpack_error_bug);
+			break;
+		}
+	}
+
+	mpack_finish_array(writer);
+	mpack_finish_map(writer);
+	return (true);
+}
+
+/*
+ * Writes an array of dictionaries that all have the same keys, and
+ * are either all plain or all instances of the same struct type, as
+ * {"%c": [count, type, [keys...], columns...]}: the keys once, then
+ * the values of every key in row order. The type is nil for plain
+ * dictionaries. Arrays that don't qualify, or are too short to gain
+ * anything, return false without writing.
+ */
+static bool
+rpc_msgpack_write_columnar(struct rpc_msgpack_writer *ctx,
+    rpc_object_t array)
+{
+	mpack_writer_t *writer = ctx->rmw_writer;
+	rpct_typei_t typei;
+	rpct_typei_t rtypei;
+	rpc_object_t first;
+	rpc_object_t row;
+	GPtrArray *keys;
+	size_t count;
+	size_t nkeys;
+	size_t i;
+	guint k;
+
+	count = rpc_array_get_count(array);
+	if (count < RPC_MSGPACK_COLUMNAR_MIN)
+		return (false);
+
+	first = rpc_array_get_value(array, 0);
+	if (!rpc_msgpack_columnar_row(ctx, first, &typei))
+		return (false);
+
+	keys = g_ptr_array_new();
+	rpc_dictionary_walk(first, ^(const char *key, rpc_object_t v __unused) {
+		if (g_strcmp0(key, RPCT_TYPE_FIELD) != 0)
+			g_ptr_array_add(keys, (gpointer)key);
+
+		return ((bool)true);
+	});
+
+	nkeys = rpc_dictionary_get_count(first);
+	for (i = 1; keys->len > 0 && i < count; i++) {
+		row = rpc_array_get_value(array, i);
+		if (!rpc_msgpack_columnar_row(ctx, row, &rtypei) ||
+		    rpc_dictionary_get_count(row) != nkeys)
+			goto fail;
+
+		if (typei != rtypei && (typei == NULL || rtypei == NULL ||
+		    g_strcmp0(typei->canonical_form,
+		    rtypei->canonical_form) != 0))
+			goto fail;
+
+		for (k = 0; k < keys->len; k++) {
+			if (!rpc_dictionary_has_key(row,
+			    g_ptr_array_index(keys, k)))
+				goto fail;
+		}
+	}
+
+	if (keys->len == 0)
+		goto fail;
+
+	mpack_start_map(writer, 1);
+	mpack_write_cstr(writer, MSGPACK_COLUMNAR_FIELD);
+	mpack_start_array(writer, keys->len + 3);
+	mpack_write_u64(writer, count);
+	if (typei != NULL)
+		rpc_msgpack_write_type_name(ctx, typei);
+	else
+		mpack_write_nil(writer);
+
+	mpack_start_array(writer, keys->len);
+	for (k = 0; k < keys->len; k++)
+		mpack_write_cstr(writer, g_ptr_array_index(keys, k));
+
+	mpack_finish_array(writer);
+
+	for (k = 0; k < keys->len; k++) {
+		if (rpc_msgpack_write_column_packed(ctx, array,
+		    g_ptr_array_index(keys, k)))
+			continue;
+
+		mpack_start_array(writer, (uint32_t)count);
+		for (i = 0; i < count; i++) {
+			row = rpc_array_get_value(array, i);
+			if (rpc_msgpack_write_typed(ctx,
+			    rpc_dictionary_get_value(row,
+			    g_ptr_array_index(keys, k))) != 0) {
+				mpack_writer_flag_error(writer, mpack_error_bug);
+				break;
+			}
+		}
+
+		mpack_finish_array(writer);
+	}
+
+	mpack_finish_array(writer);
+	mpack_finish_map(writer);
+	g_ptr_array_free(keys, true);
+	return (true);
+
+fail:
+	g_ptr_array_free(keys, true);
+	return (false);
+}
+
+/*
+ * Checks whether an array element can be a row of a columnar array.
+ * *typei is set to its struct type, or to NULL if it goes out as a
+ * plain dictionary.
+ */
+static bool
+rpc_msgpack_columnar_row(struct rpc_msgpack_writer *ctx, rpc_object_t row,
+    rpct_typei_t *typei)
+{
+
+	*typei = NULL;
+	if (rpc_get_type(row) != RPC_TYPE_DICTIONARY)
+		return (false);
+
+	if (!ctx->rmw_typed || row->ro_typei == NULL)
+		return (true);
+
+	switch (row->ro_typei->type->clazz) {
+	case RPC_TYPING_STRUCT:
+		*typei = row->ro_typei;
+		return (true);
+
+	case RPC_TYPING_CONTAINER:
+	case RPC_TYPING_BUILTIN:
+		return (true);
+
+	default:
+		return (false);
+	}
+}
+
+/*
+ * Writes the column of a key as a packed array if all of its values
+ * are numbers or booleans of the same type. Returns false otherwise.
+ */
+static bool
+rpc_msgpack_write_column_packed(struct rpc_msgpack_writer *ctx,
+    rpc_object_t array, const char *key)
+{
+	rpc_object_t column;
+	rpc_object_t value;
+	rpc_type_t type;
+	size_t count;
+	size_t size;
+	size_t i;
+	char *data;
+
+	count = rpc_array_get_count(array);
+	value = rpc_dictionary_get_value(rpc_array_get_value(array, 0), key);
+	type = rpc_get_type(value);
+	size = rpc_array_packed_elem_size(type);
+	if (size == 0)
+		return (false);
+
+	data = g_malloc(count * size);
+	for (i = 0; i < count; i++) {
+		value = rpc_dictionary_get_value(rpc_array_get_value(array, i),
+		    key);
+		/* Union members carry their type on the wire */
+		if (rpc_get_type(value) != type || (ctx->rmw_typed &&
+		    value->ro_typei != NULL &&
+		    value->ro_typei->type->clazz == RPC_TYPING_UNION)) {
+			g_free(data);
+			return (false);
+		}
+
+		switch (type) {
+		case RPC_TYPE_INT64:
+			((int64_t *)data)[i] = rpc_int64_get_value(value);
+			break;
+
+		case RPC_TYPE_UINT64:
+			((uint64_t *)data)[i] = rpc_uint64_get_value(value);
+			break;
+
+		case RPC_TYPE_DOUBLE:
+			((double *)data)[i] = rpc_double_get_value(value);
+			break;
+
+		case RPC_TYPE_BOOL:
+			((bool *)data)[i] = rpc_bool_get_value(value);
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+	}
+
+	column = rpc_array_create_packed_stolen(type, data, count);
+	rpc_msgpack_write_packed(ctx, column);
+	rpc_release(column);
+	return (true);
+}
+
+/*
+ * Writes the canonical name of a type, or its id in the connection
+ * type table when there is one. Once the table is full, names that
+ * didn't make it in are always sent in full.
+ */
+static void
+rpc_msgpack_write_type_name(struct rpc_msgpack_writer *ctx,
+    rpct_typei_t typei)
+{
+	struct rpc_msgpack_types *types = ctx->rmw_types;
+	mpack_writer_t *writer = ctx->rmw_writer;
+	gpointer id;
+	char *name;
+
+	if (types == NULL) {
+		mpack_write_cstr(writer, typei->canonical_form);
+		return;
+	}
+
+	if (g_hash_table_lookup_extended(types->rmt_ids, typei->canonical_form,
+	    NULL, &id)) {
+		mpack_write_u32(writer, GPOINTER_TO_UINT(id));
+		return;
+	}
+
+	/* Parallel chunks may only look names up */
+	if (ctx->rmw_parallel ||
+	    types->rmt_names->len >= RPC_MSGPACK_TYPES_MAX) {
+		mpack_write_cstr(writer, typei->canonical_form);
+		return;
+	}
+
+	name = g_strdup(typei->canonical_form);
+	id = GUINT_TO_POINTER(types->rmt_names->len);
+	g_ptr_array_add(types->rmt_names, name);
+	g_hash_table_insert(types->rmt_ids, name, id);
+
+	mpack_start_array(writer, 2);
+	mpack_write_u32(writer, GPOINTER_TO_UINT(id));
+	mpack_write_cstr(writer, name);
+	mpack_finish_array(writer);
+}
+
+/*
+ * Unions and enums travel as a {"%type": ..., "%value": ...} pair,
+ * matching union_serialize() and enum_serialize().
+ */
+static int
+rpc_msgpack_write_wrapped(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	mpack_writer_t *writer = ctx->rmw_writer;
+	struct rpc_msgpack_writer subctx = *ctx;
+	int ret;
+
+	subctx.rmw_typed = false;
+
+	mpack_start_map(writer, 2);
+	mpack_write_cstr(writer, RPCT_TYPE_FIELD);
+	rpc_msgpack_write_type_name(ctx, object->ro_typei);
+	mpack_write_cstr(writer, RPCT_VALUE_FIELD);
+	ret = rpc_msgpack_write_object(&subctx, object);
+	mpack_finish_map(writer);
+	ctx->rmw_nfds = subctx.rmw_nfds;
+	return (ret);
+}
+
+/*
+ * Frozen containers keep their encoding around, so that sending the same
+ * tree again is a single copy. The first time, the tree is encoded into
+ * a separate buffer. Nested frozen containers may be spliced in from
+ * their own caches, but don't get one created. Returns false when the
+ * object has to be encoded the regular way.
+ */
+static bool
+rpc_msgpack_write_cached(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	const struct rpc_encoding *enc;
+	struct rpc_msgpack_writer subctx = *ctx;
+	mpack_writer_t subwriter;
+	unsigned int flags = 0;
+	bool cacheable = true;
+	char *buffer;
+	size_t len;
+	int ret;
+
+	if (ctx->rmw_typed)
+		flags |= RPC_MSGPACK_CACHE_TYPED;
+
+	if (ctx->rmw_packed)
+		flags |= RPC_MSGPACK_CACHE_PACKED;
+
+	if (ctx->rmw_positional)
+		flags |= RPC_MSGPACK_CACHE_POSITIONAL;
+
+	if (ctx->rmw_columnar)
+		flags |= RPC_MSGPACK_CACHE_COLUMNAR;
+
+	if (ctx->rmw_timestamps)
+		flags |= RPC_MSGPACK_CACHE_TIMESTAMPS;
+
+	enc = rpc_encoding_find(object, flags);
+	if (enc == NULL) {
+		if (ctx->rmw_cacheable != NULL)
+			return (false);
+
+		subctx.rmw_writer = &subwriter;
+		subctx.rmw_fds = NULL;
+		subctx.rmw_nfds = 0;
+		subctx.rmw_maxfds = 0;
+		subctx.rmw_segments = NULL;
+		subctx.rmw_cacheable = &cacheable;
+
+		/* Type ids and pool loans are only valid on one connection */
+		subctx.rmw_types = NULL;
+		subctx.rmw_shm = NULL;
+
+		mpack_writer_init_growable(&subwriter, &buffer, &len);
+		ret = rpc_msgpack_write_typed(&subctx, object);
+		if (mpack_writer_destroy(&subwriter) != mpack_ok || ret != 0) {
+			free(buffer);
+			return (false);
+		}
+
+		enc = rpc_encoding_add(object, flags,
+		    cacheable ? buffer : NULL, len);
+		free(buffer);
+	}
+
+	if (!enc->re_valid)
+		return (false);
+
+	mpack_write_object_bytes(ctx->rmw_writer, enc->re_data, enc->re_len);
+	return (true);
+}
+
+/*
+ * Single-pass equivalent of rpc_msgpack_write_object(rpct_serialize(obj)):
+ * emits the typing wrappers directly instead of building a typed copy
+ * of the whole tree first.
+ */
+static int
+rpc_msgpack_write_typed(struct rpc_msgpack_writer *ctx, rpc_object_t object)
+{
+	struct rpc_msgpack_writer subctx;
+	rpct_class_t clazz;
+	int ret;
+
+	if (rpc_object_is_frozen(object) &&
+	    (object->ro_type == RPC_TYPE_DICTIONARY ||
+	    object->ro_type == RPC_TYPE_ARRAY) &&
+	    rpc_msgpack_write_cached(ctx, object))
+		return (0);
+
+	if (!ctx->rmw_typed || object->ro_typei == NULL)
+		goto plain;
+
+	clazz = object->ro_typei->type->clazz;
+	switch (clazz) {
+	case RPC_TYPING_STRUCT:
+		if (rpc_get_type(object) != RPC_TYPE_DICTIONARY)
+			goto plain;
+
+		return (rpc_msgpack_write_struct(ctx, object));
+
+	case RPC_TYPING_UNION:
+	case RPC_TYPING_ENUM:
+		return (rpc_msgpack_write_wrapped(ctx, object));
+
+	case RPC_TYPING_TYPEDEF:
+		subctx = *ctx;
+		subctx.rmw_typed = false;
+		ret = rpc_msgpack_write_object(&subctx, object);
+		ctx->rmw_nfds = subctx.rmw_nfds;
+		return (ret);
+
+	case RPC_TYPING_CONTAINER:
+	case RPC_TYPING_BUILTIN:
+		break;
+	}
+
+plain:
+	return (rpc_msgpack_write_object(ctx, object));
+}
+
+/*
+ * Large binary values decoded from a pooled receive buffer reference
+ * the buffer directly instead of being copied out of it.
+ */
+static rpc_object_t
+rpc_msgpack_read_binary(mpack_node_t node, struct rpc_msgpack_reader *ctx)
+{
+	void *pool = ctx->rmr_pool;
+	void *buffer;
+	size_t len = mpack_node_data_len(node);
+
+	if (pool != NULL && len >= RPC_BINARY_SLICE_MIN) {
+		rpc_recv_buffer_retain(pool);
+		return (rpc_data_create(mpack_node_data(node), len,
+		    ^(void *ptr __unused) {
+			rpc_recv_buffer_release(pool);
+		    }));
+	}
+
+	buffer = g_memdup(mpack_node_data(node), (guint)len);
+	return (rpc_data_create(buffer, len, RPC_BINARY_DESTRUCTOR(g_free)));
+}
+
+static bool
+rpc_msgpack_is_type_field(mpack_node_t key)
+{
+
+	return (mpack_node_strlen(key) == sizeof(RPCT_TYPE_FIELD) - 1 &&
+	    memcmp(mpack_node_str(key), RPCT_TYPE_FIELD,
+	    sizeof(RPCT_TYPE_FIELD) - 1) == 0);
+}
+
+/*
+ * Creates an empty container standing in for a map or array node of
+ * the frame. Its children are decoded by rpc_msgpack_materialize(), on
+ * first access.
+ */
+static rpc_object_t
+rpc_msgpack_read_lazy(mpack_node_t node, bool typed, bool skip_type,
+    struct rpc_msgpack_reader *ctx)
+{
+	struct rpc_msgpack_lazy *lazy;
+	union rpc_value val;
+	rpc_object_t result;
+
+	if (mpack_node_type(node) == mpack_type_array) {
+		val.rv_list = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)rpc_release_impl);
+		result = rpc_prim_create(RPC_TYPE_ARRAY, val);
+	} else {
+		val.rv_dict = rpc_dict_new(0);
+		result = rpc_prim_create(RPC_TYPE_DICTIONARY, val);
+	}
+
+	lazy = g_new(struct rpc_msgpack_lazy, 1);
+	lazy->rl_base.rl_materialize = rpc_msgpack_materialize;
+	lazy->rl_base.rl_free = rpc_msgpack_lazy_free;
+	lazy->rl_frame = ctx->rmr_frame;
+	lazy->rl_node = node;
+	lazy->rl_typed = typed;
+	lazy->rl_skip_type = skip_type;
+	g_atomic_int_inc(&ctx->rmr_frame->rmf_refcnt);
+	result->ro_lazy = &lazy->rl_base;
+	return (result);
+}
+
+static void
+rpc_msgpack_frame_release(struct rpc_msgpack_frame *frame)
+{
+
+	if (!g_atomic_int_dec_and_test(&frame->rmf_refcnt))
+		return;
+
+	mpack_tree_destroy(&frame->rmf_tree);
+	rpc_recv_buffer_release(frame->rmf_pool);
+#if defined(__linux__)
+	rpc_shmem_link_release(frame->rmf_shm);
+#endif
+	g_mutex_clear(&frame->rmf_mtx);
+	g_free(frame);
+}
+
+static rpc_object_t
+rpc_msgpack_read_object(mpack_node_t node, struct rpc_msgpack_reader *ctx)
+{
+	union rpc_value val;
+	int *fd;
+	int64_t *date;
+	mpack_tree_t subtree;
+	__block size_t i;
+	__block mpack_node_t tmp;
+	__block rpc_object_t result;
+
+	if (rpc_msgpack_is_columnar(node, &tmp))
+		return (rpc_msgpack_read_columnar(tmp, false, ctx));
+
+	if (ctx->rmr_frame != NULL && (mpack_node_type(node) ==
+	    mpack_type_array || mpack_node_type(node) == mpack_type_map))
+		return (rpc_msgpack_read_lazy(node, false, false, ctx));
+
+	switch (mpack_node_type(node)) {
+	case mpack_type_int:
+		val.rv_i = mpack_node_i64(node);
+		return (rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_INT64,
+		    val));
+
+	case mpack_type_uint:
+		val.rv_ui = mpack_node_u64(node);
+		return (rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_UINT64,
+		    val));
+
+	case mpack_type_bool:
+		val.rv_b = mpack_node_bool(node);
+		return (rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_BOOL, val));
+
+	case mpack_type_float:
+	case mpack_type_double:
+		val.rv_d = mpack_node_double(node);
+		return (rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_DOUBLE,
+		    val));
+
+	case mpack_type_str:
+		return (rpc_string_create_in(ctx->rmr_arena,
+		    mpack_node_str(node), mpack_node_strlen(node)));
 
 	case mpack_type_bin:
-		buffer = g_memdup(mpack_node_data(node), mpack_node_data_len(node));
-		return (rpc_data_create(buffer, mpack_node_data_len(node),
-		    RPC_BINARY_DESTRUCTOR(g_free)));
+		return (rpc_msgpack_read_binary(node, ctx));
 
 	case mpack_type_array:
-		result = rpc_array_create();
+		val.rv_list = g_ptr_array_new_full(
+		    (guint)mpack_node_array_length(node),
+		    (GDestroyNotify)rpc_release_impl);
+		for (i = 0; i < mpack_node_array_length(node); i++) {
+			g_ptr_array_add(val.rv_list, rpc_msgpack_read_object(
+			    mpack_node_array_at(node, (uint32_t)i), ctx));
+		}
+
+		return (rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_ARRAY,
+		    val));
+
+	case mpack_type_map:
+		val.rv_dict = rpc_dict_new(mpack_node_map_count(node));
+		result = rpc_prim_create_in(ctx->rmr_arena,
+		    RPC_TYPE_DICTIONARY, val);
+		for (i = 0; i < mpack_node_map_count(node); i++) {
+			tmp = mpack_node_map_key_at(node, (uint32_t)i);
+			rpc_dict_insert_str(result->ro_value.rv_dict,
+			    mpack_node_str(tmp), mpack_node_strlen(tmp),
+			    rpc_msgpack_read_object(mpack_node_map_value_at(
+				node, (uint32_t)i), ctx));
+		}
+		return (result);
+
+	case mpack_type_ext:
+		switch (mpack_node_exttype(node)) {
+		case MSGPACK_EXTTYPE_DATE:
+			date = (int64_t *)mpack_node_data(node);
+			return (rpc_date_create(*date));
+
+		case MSGPACK_EXTTYPE_TIMESTAMP:
+			return (rpc_msgpack_read_timestamp(node, ctx));
+
+		case MSGPACK_EXTTYPE_FD:
+			fd = (int *)mpack_node_data(node);
+			result = rpc_fd_create(*fd);
+			if (ctx->rmr_descs != NULL)
+				g_ptr_array_add(ctx->rmr_descs, result);
+
+			return (result);
+
+#if defined(__linux__)
+		case MSGPACK_EXTTYPE_SHMEM:
+			mpack_tree_init(&subtree, mpack_node_data(node),
+			    mpack_node_data_len(node));
+			result = rpc_msgpack_read_shmem(&subtree, ctx);
+			mpack_tree_destroy(&subtree);
+
+			/* Chunks of mapped pools carry no descriptor index */
+			if (ctx->rmr_descs != NULL &&
+			    rpc_get_type(result) == RPC_TYPE_SHMEM &&
+			    result->ro_value.rv_shmem.rsb_pool == NULL)
+				g_ptr_array_add(ctx->rmr_descs, result);
+
+			return (result);
+
+		case MSGPACK_EXTTYPE_BULK:
+			mpack_tree_init(&subtree, mpack_node_data(node),
+			    mpack_node_data_len(node));
+			result = rpc_msgpack_read_bulk(&subtree, ctx);
+			mpack_tree_destroy(&subtree);
+			return (result);
+#endif
+
+		case MSGPACK_EXTTYPE_ERROR:
+			mpack_tree_init(&subtree, mpack_node_data(node),
+			    mpack_node_data_len(node));
+			result = rpc_msgpack_read_error(&subtree, ctx);
+			mpack_tree_destroy(&subtree);
+			return (result);
+
+		case MSGPACK_EXTTYPE_PACKED:
+			return (rpc_msgpack_read_packed(mpack_node_data(node),
+			    mpack_node_data_len(node)));
+
+		default:
+			return (rpc_null_create());
+		}
+
+	case mpack_type_nil:
+	default:
+		return (rpc_null_create());
+	}
+}
+
+static rpc_object_t
+rpc_msgpack_read_children(mpack_node_t node, bool skip_type,
+    struct rpc_msgpack_reader *ctx)
+{
+	union rpc_value val;
+	mpack_node_t key;
+	rpc_object_t result;
+	size_t i;
+
+	if (ctx->rmr_frame != NULL)
+		return (rpc_msgpack_read_lazy(node, true, skip_type, ctx));
+
+	if (mpack_node_type(node) == mpack_type_array) {
+		val.rv_list = g_ptr_array_new_full(
+		    (guint)mpack_node_array_length(node),
+		    (GDestroyNotify)rpc_release_impl);
 		for (i = 0; i < mpack_node_array_length(node); i++) {
-			rpc_array_append_stolen_value(result, rpc_msgpack_read_object(
-			    mpack_node_array_at(node, (uint32_t)i)));
+			g_ptr_array_add(val.rv_list, rpc_msgpack_read_typed(
+			    mpack_node_array_at(node, (uint32_t)i), ctx));
 		}
+
+		return (rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_ARRAY,
+		    val));
+	}
+
+	val.rv_dict = rpc_dict_new(mpack_node_map_count(node));
+	result = rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_DICTIONARY, val);
+	for (i = 0; i < mpack_node_map_count(node); i++) {
+		key = mpack_node_map_key_at(node, (uint32_t)i);
+		if (skip_type && rpc_msgpack_is_type_field(key))
+			continue;
+
+		rpc_dict_insert_str(result->ro_value.rv_dict,
+		    mpack_node_str(key), mpack_node_strlen(key),
+		    rpc_msgpack_read_typed(mpack_node_map_value_at(node,
+		    (uint32_t)i), ctx));
+	}
+
+	return (result);
+}
+
+/*
+ * Reads back a struct written by rpc_msgpack_write_positional(). The
+ * fingerprint has to match the local layout of the type, otherwise the
+ * peers disagree about the members and positions can't be trusted.
+ */
+static rpc_object_t
+rpc_msgpack_read_positional(mpack_node_t node, struct rpc_msgpack_reader *ctx)
+{
+	const struct rpct_layout *layout;
+	mpack_node_t fnode;
+	rpct_typei_t typei;
+	rpc_object_t result;
+	union rpc_value val;
+	guint i;
+
+	if (mpack_node_array_length(node) < 2)
+		return (rpc_error_create(EINVAL, "Malformed positional struct",
+		    NULL));
+
+	fnode = mpack_node_array_at(node, 1);
+	if (mpack_node_type(fnode) != mpack_type_uint)
+		return (rpc_error_create(EINVAL, "Malformed positional struct",
+		    NULL));
+
+	typei = rpc_msgpack_read_type_name(mpack_node_array_at(node, 0), ctx,
+	    &result);
+	if (typei == NULL) {
+		if (result == NULL)
+			result = rpc_error_create(EINVAL,
+			    "Malformed positional struct", NULL);
+
 		return (result);
+	}
+
+	if (typei->type->clazz != RPC_TYPING_STRUCT) {
+		result = rpc_error_create(EINVAL, "Not a struct type",
+		    rpc_object_pack("{type:s}", typei->canonical_form));
+		rpct_typei_release(typei);
+		return (result);
+	}
+
+	layout = rpct_type_get_layout(typei->type);
+	if (mpack_node_u64(fnode) != layout->rl_fingerprint ||
+	    mpack_node_array_length(node) != layout->rl_count + 2) {
+		result = rpc_error_create(EINVAL, "Struct layout mismatch",
+		    rpc_object_pack("{type:s}", typei->canonical_form));
+		rpct_typei_release(typei);
+		return (result);
+	}
+
+	val.rv_dict = rpc_dict_new_layout(layout);
+	result = rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_DICTIONARY, val);
+	for (i = 0; i < layout->rl_count; i++) {
+		rpc_dict_set_slot(result->ro_value.rv_dict, i,
+		    rpc_msgpack_read_typed(mpack_node_array_at(node, i + 2),
+		    ctx));
+	}
+
+	result->ro_typei = typei;
+	return (result);
+}
+
+static bool
+rpc_msgpack_is_columnar(mpack_node_t node, mpack_node_t *payload)
+{
+
+	if (mpack_node_type(node) != mpack_type_map ||
+	    mpack_node_map_count(node) != 1)
+		return (false);
+
+	*payload = mpack_node_map_cstr_optional(node, MSGPACK_COLUMNAR_FIELD);
+	return (mpack_node_type(*payload) == mpack_type_array);
+}
+
+/*
+ * Reads back an array written by rpc_msgpack_write_columnar(), as an
+ * array of dictionaries or, if the rows were sent with a type, of
+ * struct instances. Nested containers are still decoded lazily.
+ */
+static rpc_object_t
+rpc_msgpack_read_columnar(mpack_node_t node, bool typed,
+    struct rpc_msgpack_reader *ctx)
+{
+	rpct_typei_t typei = NULL;
+	rpct_typei_t vtypei;
+	mpack_node_t knodes;
+	mpack_node_t knode;
+	mpack_node_t cnode;
+	rpc_object_t column;
+	rpc_object_t result;
+	rpc_object_t value;
+	union rpc_value val;
+	rpc_type_t type;
+	size_t count;
+	size_t nkeys;
+	size_t size;
+	size_t i;
+	size_t k;
+
+	if (mpack_node_array_length(node) < 4 ||
+	    mpack_node_type(mpack_node_array_at(node, 0)) != mpack_type_uint)
+		goto malformed;
+
+	count = mpack_node_u64(mpack_node_array_at(node, 0));
+	knodes = mpack_node_array_at(node, 2);
+	if (mpack_node_type(knodes) != mpack_type_array)
+		goto malformed;
+
+	nkeys = mpack_node_array_length(knodes);
+	if (nkeys == 0 || mpack_node_array_length(node) != nkeys + 3)
+		goto malformed;
+
+	/* Every column has to have exactly one value per row */
+	for (k = 0; k < nkeys; k++) {
+		knode = mpack_node_array_at(knodes, (uint32_t)k);
+		cnode = mpack_node_array_at(node, (uint32_t)k + 3);
+		if (mpack_node_type(knode) != mpack_type_str)
+			goto malformed;
+
+		if (mpack_node_type(cnode) == mpack_type_array &&
+		    mpack_node_array_length(cnode) == count)
+			continue;
+
+		if (mpack_node_type(cnode) != mpack_type_ext ||
+		    mpack_node_exttype(cnode) != MSGPACK_EXTTYPE_PACKED ||
+		    mpack_node_data_len(cnode) < 1)
+			goto malformed;
+
+		type = (rpc_type_t)(uint8_t)mpack_node_data(cnode)[0];
+		size = rpc_array_packed_elem_size(type);
+		if (size == 0 || (mpack_node_data_len(cnode) - 1) % size != 0 ||
+		    (mpack_node_data_len(cnode) - 1) / size != count)
+			goto malformed;
+	}
+
+	if (typed) {
+		cnode = mpack_node_array_at(node, 1);
+		if (mpack_node_type(cnode) == mpack_type_nil)
+			typei = rpct_new_typei(
+			    rpc_get_type_name(RPC_TYPE_DICTIONARY));
+		else {
+			typei = rpc_msgpack_read_type_name(cnode, ctx, &result);
+			if (typei == NULL)
+				return (result != NULL ? result :
+				    rpc_error_create(EINVAL,
+				    "Malformed columnar array", NULL));
+		}
+	}
+
+	val.rv_list = g_ptr_array_new_full((guint)count,
+	    (GDestroyNotify)rpc_release_impl);
+	result = rpc_prim_create_in(ctx->rmr_arena, RPC_TYPE_ARRAY, val);
+	for (i = 0; i < count; i++) {
+		val.rv_dict = rpc_dict_new(nkeys);
+		value = rpc_prim_create_in(ctx->rmr_arena,
+		    RPC_TYPE_DICTIONARY, val);
+		if (typei != NULL)
+			value->ro_typei = rpct_typei_retain(typei);
+
+		g_ptr_array_add(result->ro_value.rv_list, value);
+	}
+
+	for (k = 0; k < nkeys; k++) {
+		knode = mpack_node_array_at(knodes, (uint32_t)k);
+		cnode = mpack_node_array_at(node, (uint32_t)k + 3);
+		column = NULL;
+		vtypei = NULL;
+
+		if (mpack_node_type(cnode) == mpack_type_ext) {
+			column = rpc_msgpack_read_packed(mpack_node_data(cnode),
+			    mpack_node_data_len(cnode));
+			rpc_array_get_packed(column, &type, NULL);
+			if (typed)
+				vtypei = rpct_new_typei(rpc_get_type_name(type));
+		}
+
+		for (i = 0; i < count; i++) {
+			if (column == NULL) {
+				cnode = mpack_node_array_at(mpack_node_array_at(
+				    node, (uint32_t)k + 3), (uint32_t)i);
+				value = typed ?
+				    rpc_msgpack_read_typed(cnode, ctx) :
+				    rpc_msgpack_read_object(cnode, ctx);
+			} else {
+				value = rpc_msgpack_read_column_value(column,
+				    i, ctx);
+				if (vtypei != NULL)
+					value->ro_typei =
+					    rpct_typei_retain(vtypei);
+			}
+
+			rpc_dict_insert_str(((rpc_object_t)g_ptr_array_index(
+			    result->ro_value.rv_list, i))->ro_value.rv_dict,
+			    mpack_node_str(knode), mpack_node_strlen(knode),
+			    value);
+		}
+
+		if (vtypei != NULL)
+			rpct_typei_release(vtypei);
+
+		if (column != NULL)
+			rpc_release(column);
+	}
+
+	if (typei != NULL) {
+		rpct_typei_release(typei);
+		result->ro_typei = rpct_new_typei(
+		    rpc_get_type_name(RPC_TYPE_ARRAY));
+	}
+
+	return (result);
+
+malformed:
+	return (rpc_error_create(EINVAL, "Malformed columnar array", NULL));
+}
+
+static rpc_object_t
+rpc_msgpack_read_column_value(rpc_object_t column, size_t index,
+    struct rpc_msgpack_reader *ctx)
+{
+	union rpc_value val;
+	rpc_type_t type;
+
+	rpc_array_get_packed(column, &type, NULL);
+	switch (type) {
+	case RPC_TYPE_INT64:
+		val.rv_i = rpc_array_get_int64(column, index);
+		break;
+
+	case RPC_TYPE_UINT64:
+		val.rv_ui = rpc_array_get_uint64(column, index);
+		break;
+
+	case RPC_TYPE_DOUBLE:
+		val.rv_d = rpc_array_get_double(column, index);
+		break;
+
+	case RPC_TYPE_BOOL:
+		val.rv_b = rpc_array_get_bool(column, index);
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+
+	return (rpc_prim_create_in(ctx->rmr_arena, type, val));
+}
+
+/*
+ * Resolves a type field: a canonical type name or, on connections with
+ * a type table, an id sent earlier or an [id, name] pair defining one.
+ * Returns a type instance reference, or NULL with *error set to an
+ * error object. *error is left NULL if the node isn't a type field at
+ * all.
+ */
+static rpct_typei_t
+rpc_msgpack_read_type_name(mpack_node_t node, struct rpc_msgpack_reader *ctx,
+    rpc_object_t *error)
+{
+	struct rpc_msgpack_types *types = ctx->rmr_types;
+	mpack_node_t nnode;
+	rpct_typei_t typei;
+	uint64_t id;
+	char *decl;
+
+	*error = NULL;
+
+	switch (mpack_node_type(node)) {
+	case mpack_type_str:
+		nnode = node;
+		break;
+
+	case mpack_type_uint:
+		if (types == NULL)
+			return (NULL);
+
+		id = mpack_node_u64(node);
+		typei = id < types->rmt_typeis->len ?
+		    g_ptr_array_index(types->rmt_typeis, id) : NULL;
+		if (typei == NULL) {
+			*error = rpc_error_create(ENOENT,
+			    "Unknown type reference",
+			    rpc_object_pack("{id:u}", id));
+			return (NULL);
+		}
+
+		return (rpct_typei_retain(typei));
+
+	case mpack_type_array:
+		if (types == NULL)
+			return (NULL);
+
+		if (mpack_node_array_length(node) != 2) {
+			*error = rpc_error_create(EINVAL,
+			    "Malformed type definition", NULL);
+			return (NULL);
+		}
+
+		/* Ids are handed out in order, starting from zero */
+		id = mpack_node_type(mpack_node_array_at(node, 0)) ==
+		    mpack_type_uint ?
+		    mpack_node_u64(mpack_node_array_at(node, 0)) : UINT64_MAX;
+		nnode = mpack_node_array_at(node, 1);
+		if (id != types->rmt_typeis->len ||
+		    id >= RPC_MSGPACK_TYPES_MAX ||
+		    mpack_node_type(nnode) != mpack_type_str) {
+			*error = rpc_error_create(EINVAL,
+			    "Malformed type definition", NULL);
+			return (NULL);
+		}
+		break;
+
+	default:
+		return (NULL);
+	}
+
+	decl = g_strndup(mpack_node_str(nnode), mpack_node_strlen(nnode));
+	typei = rpct_new_typei(decl);
+
+	/* Unknown types keep their slot, so that later ids still line up */
+	if (nnode != node) {
+		g_ptr_array_add(types->rmt_typeis, typei != NULL ?
+		    rpct_typei_retain(typei) : NULL);
+	}
+
+	if (typei == NULL) {
+		*error = rpc_error_create(ENOENT, "Type information not found",
+		    rpc_object_pack("{type:s}", decl));
+	}
 
+	g_free(decl);
+	return (typei);
+}
+
+/*
+ * Single-pass equivalent of rpct_deserialize(rpc_msgpack_read_object()):
+ * resolves the type field of every map while reading it, so each object
+ * is allocated exactly once.
+ */
+static rpc_object_t
+rpc_msgpack_read_typed(mpack_node_t node, struct rpc_msgpack_reader *ctx)
+{
+	mpack_node_t tnode;
+	rpct_typei_t typei;
+	rpc_object_t result;
+
+	switch (mpack_node_type(node)) {
 	case mpack_type_map:
-		result = rpc_dictionary_create();
-		for (i = 0; i < mpack_node_map_count(node); i++) {
-			tmp = mpack_node_map_key_at(node, (uint32_t)i);
-			cstr = g_strndup(mpack_node_str(tmp), mpack_node_strlen(tmp));
-			rpc_dictionary_steal_value(result, cstr,
-			    rpc_msgpack_read_object(mpack_node_map_value_at(
-				node, (uint32_t)i)));
-			g_free(cstr);
+		if (mpack_node_map_count(node) == 1) {
+			tnode = mpack_node_map_cstr_optional(node,
+			    MSGPACK_POSITIONAL_FIELD);
+			if (mpack_node_type(tnode) == mpack_type_array)
+				return (rpc_msgpack_read_positional(tnode,
+				    ctx));
 		}
-		return (result);
 
-	case mpack_type_ext:
-		switch (mpack_node_exttype(node)) {
-		case MSGPACK_EXTTYPE_DATE:
-			date = (int64_t *)mpack_node_data(node);
-			return (rpc_date_create(*date));
+		if (rpc_msgpack_is_columnar(node, &tnode))
+			return (rpc_msgpack_read_columnar(tnode, true, ctx));
 
-		case MSGPACK_EXTTYPE_FD:
-			fd = (int *)mpack_node_data(node);
-			return (rpc_fd_create(*fd));
+		tnode = mpack_node_map_cstr_optional(node, RPCT_TYPE_FIELD);
+		typei = rpc_msgpack_read_type_name(tnode, ctx, &result);
+		if (typei == NULL) {
+			if (result != NULL)
+				return (result);
 
-#if defined(__linux__)
-		case MSGPACK_EXTTYPE_SHMEM:
-			mpack_tree_init(&subtree, mpack_node_data(node),
-			    mpack_node_data_len(node));
-			result = rpc_msgpack_read_shmem(&subtree);
-			mpack_tree_destroy(&subtree);
-			return (result);
-#endif
+			break;
+		}
 
-		case MSGPACK_EXTTYPE_ERROR:
-			mpack_tree_init(&subtree, mpack_node_data(node),
-			    mpack_node_data_len(node));
-			result = rpc_msgpack_read_error(&subtree);
-			mpack_tree_destroy(&subtree);
-			return (result);
+		switch (typei->type->clazz) {
+		case RPC_TYPING_STRUCT:
+			result = rpc_msgpack_read_children(node, true, ctx);
+			break;
+
+		case RPC_TYPING_UNION:
+		case RPC_TYPING_ENUM:
+			result = rpc_msgpack_read_object(
+			    mpack_node_map_cstr_optional(node,
+			    RPCT_VALUE_FIELD), ctx);
+			break;
+
+		case RPC_TYPING_CONTAINER:
+		case RPC_TYPING_BUILTIN:
+			result = rpc_msgpack_read_children(node, false, ctx);
+			break;
 
 		default:
-			return (rpc_null_create());
+			result = rpc_msgpack_read_object(node, ctx);
+			break;
 		}
 
-	case mpack_type_nil:
+		result->ro_typei = typei;
+		return (result);
+
+	case mpack_type_array:
+		break;
+
 	default:
-		return (rpc_null_create());
+		result = rpc_msgpack_read_object(node, ctx);
+		result->ro_typei = rpct_new_typei(
+		    rpc_get_type_name(rpc_get_type(result)));
+		return (result);
+	}
+
+	result = rpc_msgpack_read_children(node, false, ctx);
+	result->ro_typei = rpct_new_typei(
+	    rpc_get_type_name(rpc_get_type(result)));
+	return (result);
+}
+
+/*
+ * Decodes the direct children of a lazy container into its storage.
+ * Nested containers become lazy in turn. Called by rpc_container_load()
+ * with the container's lazy lock held; the frame lock serializes
+ * containers of the same frame decoded at the same time.
+ */
+void
+rpc_msgpack_materialize(rpc_object_t object)
+{
+	struct rpc_msgpack_lazy *lazy = (struct rpc_msgpack_lazy *)
+	    g_atomic_pointer_get(&object->ro_lazy);
+	struct rpc_msgpack_frame *frame;
+	struct rpc_msgpack_reader ctx;
+	mpack_node_t node;
+	mpack_node_t key;
+	mpack_node_t child;
+	rpc_object_t value;
+	size_t i;
+
+	if (lazy == NULL)
+		return;
+
+	frame = lazy->rl_frame;
+	g_mutex_lock(&frame->rmf_mtx);
+	if (object->ro_lazy == NULL) {
+		g_mutex_unlock(&frame->rmf_mtx);
+		return;
+	}
+
+	ctx.rmr_pool = frame->rmf_pool;
+	ctx.rmr_arena = NULL;
+	ctx.rmr_frame = frame;
+	ctx.rmr_types = NULL;
+	ctx.rmr_shm = frame->rmf_shm;
+	ctx.rmr_descs = NULL;
+	node = lazy->rl_node;
+
+	if (mpack_node_type(node) == mpack_type_array) {
+		for (i = 0; i < mpack_node_array_length(node); i++) {
+			child = mpack_node_array_at(node, (uint32_t)i);
+			value = lazy->rl_typed ?
+			    rpc_msgpack_read_typed(child, &ctx) :
+			    rpc_msgpack_read_object(child, &ctx);
+			g_ptr_array_add(object->ro_value.rv_list, value);
+		}
+	} else {
+		for (i = 0; i < mpack_node_map_count(node); i++) {
+			key = mpack_node_map_key_at(node, (uint32_t)i);
+			if (lazy->rl_skip_type &&
+			    rpc_msgpack_is_type_field(key))
+				continue;
+
+			child = mpack_node_map_value_at(node, (uint32_t)i);
+			value = lazy->rl_typed ?
+			    rpc_msgpack_read_typed(child, &ctx) :
+			    rpc_msgpack_read_object(child, &ctx);
+			rpc_dict_insert_str(object->ro_value.rv_dict,
+			    mpack_node_str(key), mpack_node_strlen(key), value);
+		}
+	}
+
+	/* Publish the storage before readers stop taking the lock */
+	g_atomic_pointer_set(&object->ro_lazy, NULL);
+	g_mutex_unlock(&frame->rmf_mtx);
+	rpc_msgpack_lazy_free(&lazy->rl_base);
+}
+
+void
+rpc_msgpack_lazy_free(struct rpc_lazy *base)
+{
+	struct rpc_msgpack_lazy *lazy = (struct rpc_msgpack_lazy *)base;
+
+	if (lazy == NULL)
+		return;
+
+	rpc_msgpack_frame_release(lazy->rl_frame);
+	g_free(lazy);
+}
+
+struct rpc_msgpack_types *
+rpc_msgpack_types_new(void)
+{
+	struct rpc_msgpack_types *types;
+
+	types = g_new0(struct rpc_msgpack_types, 1);
+	types->rmt_ids = g_hash_table_new(g_str_hash, g_str_equal);
+	types->rmt_names = g_ptr_array_new_with_free_func(g_free);
+	types->rmt_typeis = g_ptr_array_new();
+	return (types);
+}
+
+void
+rpc_msgpack_types_free(struct rpc_msgpack_types *types)
+{
+	guint i;
+
+	if (types == NULL)
+		return;
+
+	for (i = 0; i < types->rmt_typeis->len; i++) {
+		if (g_ptr_array_index(types->rmt_typeis, i) != NULL)
+			rpct_typei_release(g_ptr_array_index(
+			    types->rmt_typeis, i));
+	}
+
+	g_hash_table_destroy(types->rmt_ids);
+	g_ptr_array_free(types->rmt_names, true);
+	g_ptr_array_free(types->rmt_typeis, true);
+	g_free(types);
+}
+
+/*
+ * Both halves of a type table, as {"sent": [names...], "received":
+ * [names...]} in id order, so that another process can carry on with
+ * the same ids. Received ids that didn't resolve are nil.
+ */
+rpc_object_t
+rpc_msgpack_types_export(struct rpc_msgpack_types *types)
+{
+	rpc_object_t sent = rpc_array_create();
+	rpc_object_t received = rpc_array_create();
+	rpct_typei_t typei;
+	guint i;
+
+	for (i = 0; i < types->rmt_names->len; i++) {
+		rpc_array_append_stolen_value(sent, rpc_string_create(
+		    g_ptr_array_index(types->rmt_names, i)));
+	}
+
+	for (i = 0; i < types->rmt_typeis->len; i++) {
+		typei = g_ptr_array_index(types->rmt_typeis, i);
+		rpc_array_append_stolen_value(received, typei != NULL ?
+		    rpc_string_create(typei->canonical_form) :
+		    rpc_null_create());
+	}
+
+	return (rpc_object_pack("{v,v}", "sent", sent, "received", received));
+}
+
+/*
+ * Loads a table exported by rpc_msgpack_types_export() into an empty
+ * one.
+ */
+void
+rpc_msgpack_types_import(struct rpc_msgpack_types *types, rpc_object_t state)
+{
+	rpc_object_t sent;
+	rpc_object_t received;
+
+	sent = rpc_dictionary_get_value(state, "sent");
+	received = rpc_dictionary_get_value(state, "received");
+
+	if (sent != NULL) {
+		rpc_array_apply(sent, ^(size_t idx, rpc_object_t v) {
+			char *name;
+
+			if (rpc_get_type(v) != RPC_TYPE_STRING)
+				return ((bool)false);
+
+			name = g_strdup(rpc_string_get_string_ptr(v));
+			g_ptr_array_add(types->rmt_names, name);
+			g_hash_table_insert(types->rmt_ids, name,
+			    GUINT_TO_POINTER(idx));
+			return ((bool)true);
+		});
+	}
+
+	if (received != NULL) {
+		rpc_array_apply(received, ^(size_t idx __unused,
+		    rpc_object_t v) {
+			g_ptr_array_add(types->rmt_typeis,
+			    rpc_get_type(v) == RPC_TYPE_STRING ?
+			    rpct_new_typei(rpc_string_get_string_ptr(v)) :
+			    NULL);
+			return ((bool)true);
+		});
+	}
+}
+
+/*
+ * Forgets the names defined by a frame that never made it out, so that
+ * they get defined again by the next frame using them.
+ */
+static void
+rpc_msgpack_types_rollback(struct rpc_msgpack_types *types, guint mark)
+{
+	guint i;
+
+	for (i = mark; i < types->rmt_names->len; i++) {
+		g_hash_table_remove(types->rmt_ids,
+		    g_ptr_array_index(types->rmt_names, i));
 	}
+
+	g_ptr_array_set_size(types->rmt_names, mark);
 }
 
 int
 rpc_msgpack_serialize(rpc_object_t obj, void **frame, size_t *size)
 {
 	mpack_writer_t writer;
+	struct rpc_msgpack_writer ctx = {
+		.rmw_writer = &writer,
+		.rmw_typed = false,
+		.rmw_packed = true,
+		.rmw_timestamps = true
+	};
+	int ret;
 
 	mpack_writer_init_growable(&writer, (char **)frame, size);
-	rpc_msgpack_write_object(&writer, obj);
-	mpack_writer_destroy(&writer);
+	ret = rpc_msgpack_write_object(&ctx, obj);
+	if (mpack_writer_destroy(&writer) != mpack_ok || ret != 0) {
+		free(*frame);
+		*frame = NULL;
+		return (-1);
+	}
+
 	return (0);
 }
 
-rpc_object_t
-rpc_msgpack_deserialize(const void *frame, size_t size)
+static int
+rpc_msgpack_serialize_impl(mpack_writer_t *writer, rpc_object_t obj,
+    int *fds, size_t *nfds, GArray *segments, bool packed, bool positional,
+    bool columnar, bool timestamps, struct rpc_msgpack_types *types,
+    struct rpc_shmem_link *shm)
+{
+	struct rpc_msgpack_writer ctx = {
+		.rmw_writer = writer,
+		.rmw_typed = rpct_is_initialized(),
+		.rmw_fds = fds,
+		.rmw_nfds = 0,
+		.rmw_maxfds = nfds != NULL ? *nfds : 0,
+		.rmw_segments = segments,
+		.rmw_packed = packed,
+		.rmw_positional = positional,
+		.rmw_columnar = columnar,
+		.rmw_timestamps = timestamps,
+		.rmw_types = types,
+		.rmw_shm = shm
+	};
+	int ret;
+
+	ret = rpc_msgpack_write_typed(&ctx, obj);
+	if (mpack_writer_destroy(writer) != mpack_ok || ret != 0)
+		return (-1);
+
+	if (nfds != NULL)
+		*nfds = ctx.rmw_nfds;
+
+	return (0);
+}
+
+int
+rpc_msgpack_serialize_typed(rpc_object_t obj, void **frame, size_t *size,
+    int *fds, size_t *nfds)
+{
+	mpack_writer_t writer;
+
+	mpack_writer_init_growable(&writer, (char **)frame, size);
+	if (rpc_msgpack_serialize_impl(&writer, obj, fds, nfds, NULL,
+	    true, false, false, true, NULL, NULL) != 0) {
+		free(*frame);
+		*frame = NULL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+rpc_msgpack_fd_flush(mpack_writer_t *writer, const char *data, size_t count)
+{
+
+	if (rpc_serializer_write_all(*(int *)writer->context, data,
+	    count) != 0)
+		mpack_writer_flag_error(writer, mpack_error_io);
+}
+
+/*
+ * Same as rpc_msgpack_serialize_typed(), but writes the frame out to
+ * a file descriptor chunk by chunk, as the writer buffer fills up.
+ */
+int
+rpc_msgpack_serialize_fd(rpc_object_t obj, int fd)
+{
+	mpack_writer_t writer;
+	char *buffer;
+	int ret;
+
+	buffer = g_malloc(RPC_SERIALIZER_CHUNK);
+	mpack_writer_init(&writer, buffer, RPC_SERIALIZER_CHUNK);
+	mpack_writer_set_context(&writer, &fd);
+	mpack_writer_set_flush(&writer, rpc_msgpack_fd_flush);
+	ret = rpc_msgpack_serialize_impl(&writer, obj, NULL, NULL, NULL,
+	    true, false, false, true, NULL, NULL);
+
+	g_free(buffer);
+	return (ret);
+}
+
+/*
+ * Grows the output buffer in place, the same way mpack's growable writer
+ * does, but keeps the memory owned by the rpc_output_buffer.
+ */
+static void
+rpc_msgpack_buffer_flush(mpack_writer_t *writer, const char *data,
+    size_t count)
+{
+	struct rpc_output_buffer *buf = writer->context;
+	size_t new_size;
+	char *new_data;
+
+	if (data == writer->buffer) {
+		/* Teardown flush, nothing to do */
+		if (writer->used == count)
+			return;
+
+		writer->used = count;
+		count = 0;
+	}
+
+	new_size = writer->size * 2;
+	while (new_size < writer->used + count)
+		new_size *= 2;
+
+	new_data = g_try_realloc(writer->buffer, new_size);
+	if (new_data == NULL) {
+		mpack_writer_flag_error(writer, mpack_error_memory);
+		return;
+	}
+
+	writer->buffer = new_data;
+	writer->size = new_size;
+	buf->rob_grows++;
+
+	if (count > 0) {
+		memcpy(writer->buffer + writer->used, data, count);
+		writer->used += count;
+	}
+}
+
+static void
+rpc_msgpack_buffer_teardown(mpack_writer_t *writer)
+{
+	struct rpc_output_buffer *buf = writer->context;
+
+	buf->rob_data = writer->buffer;
+	buf->rob_size = writer->size;
+
+	/* On error, the frames queued before this one stay intact */
+	if (mpack_writer_error(writer) == mpack_ok) {
+		buf->rob_used = writer->used;
+		buf->rob_hwm = MAX(buf->rob_hwm, buf->rob_used);
+		buf->rob_frames++;
+	}
+
+	writer->buffer = NULL;
+	writer->context = NULL;
+}
+
+/*
+ * Appends an encoded frame to the output buffer, after any frames
+ * already queued there. If types is set, type names are sent through
+ * the connection type table. If shm is set, chunks of shared memory
+ * pools are lent to the peer through it.
+ */
+int
+rpc_msgpack_serialize_buffered(struct rpc_output_buffer *buf,
+    rpc_object_t obj, size_t maxfds, bool vectored, bool packed,
+    bool positional, bool columnar, bool timestamps,
+    struct rpc_msgpack_types *types, struct rpc_shmem_link *shm)
+{
+	struct rpc_output_frame frame;
+	mpack_writer_t writer;
+	GArray *segments;
+	guint nsegs;
+	guint base;
+	guint mark;
+	size_t nfds = maxfds;
+
+	if (buf->rob_data == NULL) {
+		buf->rob_data = g_malloc(RPC_OUTPUT_BUFFER_MIN);
+		buf->rob_size = RPC_OUTPUT_BUFFER_MIN;
+	}
+
+	if (buf->rob_bounds == NULL) {
+		buf->rob_bounds = g_array_new(false, false,
+		    sizeof(struct rpc_output_frame));
+		buf->rob_fds = g_array_new(false, false, sizeof(int));
+		buf->rob_objects = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)rpc_release_impl);
+	}
+
+	if (vectored && buf->rob_segments == NULL) {
+		buf->rob_segments = g_array_new(false, false,
+		    sizeof(struct rpc_output_segment));
+	}
+
+	segments = vectored ? buf->rob_segments : NULL;
+	nsegs = buf->rob_segments != NULL ? buf->rob_segments->len : 0;
+	base = buf->rob_fds->len;
+	mark = types != NULL ? types->rmt_names->len : 0;
+	g_array_set_size(buf->rob_fds, base + (guint)maxfds);
+
+	mpack_writer_init(&writer, buf->rob_data, buf->rob_size);
+	mpack_writer_set_context(&writer, buf);
+	mpack_writer_set_flush(&writer, rpc_msgpack_buffer_flush);
+	mpack_writer_set_teardown(&writer, rpc_msgpack_buffer_teardown);
+	writer.used = buf->rob_used;
+
+	if (rpc_msgpack_serialize_impl(&writer, obj,
+	    &g_array_index(buf->rob_fds, int, base), &nfds, segments,
+	    packed, positional, columnar, timestamps, types, shm) != 0) {
+		g_array_set_size(buf->rob_fds, base);
+		if (segments != NULL)
+			g_array_set_size(segments, nsegs);
+
+		if (types != NULL)
+			rpc_msgpack_types_rollback(types, mark);
+
+		return (-1);
+	}
+
+	g_array_set_size(buf->rob_fds, base + (guint)nfds);
+
+	frame.rof_end = buf->rob_used;
+	frame.rof_segments = segments != NULL ? segments->len : 0;
+	frame.rof_fds = buf->rob_fds->len;
+	g_array_append_val(buf->rob_bounds, frame);
+	return (0);
+}
+
+/*
+ * Parses a frame into nodes from the calling thread's pool, falling
+ * back to allocating node pages when it has too many of them.
+ */
+static void
+rpc_msgpack_tree_init(mpack_tree_t *tree, const void *frame, size_t size)
+{
+	mpack_node_data_t *pool;
+
+	pool = g_private_get(&rpc_msgpack_node_pool);
+	if (pool == NULL) {
+		pool = g_new(mpack_node_data_t, RPC_MSGPACK_NODE_POOL);
+		g_private_set(&rpc_msgpack_node_pool, pool);
+	}
+
+	mpack_tree_init_pool(tree, frame, size, pool, RPC_MSGPACK_NODE_POOL);
+	if (mpack_tree_error(tree) != mpack_error_too_big)
+		return;
+
+	mpack_tree_destroy(tree);
+	mpack_tree_init(tree, frame, size);
+}
+
+static rpc_object_t
+rpc_msgpack_deserialize_impl(const void *frame, size_t size, bool typed,
+    void *pool, bool arena, bool lazy, struct rpc_msgpack_types *types,
+    struct rpc_shmem_link *shm, GPtrArray *descs)
 {
-	mpack_tree_t tree;
+	struct rpc_msgpack_reader ctx = {
+		.rmr_pool = pool,
+		.rmr_arena = arena ? rpc_arena_new(size * 4) : NULL,
+		.rmr_types = types,
+		.rmr_shm = shm,
+		.rmr_descs = descs
+	};
+	mpack_tree_t local;
+	mpack_tree_t *tree = &local;
 	rpc_object_t result;
 
-	mpack_tree_init(&tree, frame, size);
-	result = rpc_msgpack_read_object(mpack_tree_root(&tree));
-	mpack_tree_destroy(&tree);
+	/*
+	 * Lazy containers keep walking the parsed tree after we return,
+	 * so it lives in a refcounted frame holding the receive buffer.
+	 * Type ids have to be resolved in frame order, which rules that
+	 * out on connections with a type table. Descriptors have to be
+	 * collected while decoding, which rules it out too.
+	 */
+	if (lazy && pool != NULL && !arena && types == NULL && descs == NULL) {
+		ctx.rmr_frame = g_new0(struct rpc_msgpack_frame, 1);
+		ctx.rmr_frame->rmf_refcnt = 1;
+		ctx.rmr_frame->rmf_pool = pool;
+		g_mutex_init(&ctx.rmr_frame->rmf_mtx);
+		rpc_recv_buffer_retain(pool);
+		tree = &ctx.rmr_frame->rmf_tree;
+#if defined(__linux__)
+		if (shm != NULL) {
+			ctx.rmr_frame->rmf_shm = shm;
+			rpc_shmem_link_retain(shm);
+		}
+#endif
+	}
+
+	if (ctx.rmr_frame != NULL)
+		mpack_tree_init(tree, frame, size);
+	else
+		rpc_msgpack_tree_init(tree, frame, size);
+
+	if (typed && rpct_is_initialized())
+		result = rpc_msgpack_read_typed(mpack_tree_root(tree), &ctx);
+	else
+		result = rpc_msgpack_read_object(mpack_tree_root(tree), &ctx);
+
+	if (ctx.rmr_frame != NULL)
+		rpc_msgpack_frame_release(ctx.rmr_frame);
+	else
+		mpack_tree_destroy(tree);
+
+	/* From now on, the arena is kept alive by the objects in it */
+	if (ctx.rmr_arena != NULL)
+		rpc_arena_release(ctx.rmr_arena);
 
 	return (result);
 }
 
+rpc_object_t
+rpc_msgpack_deserialize(const void *frame, size_t size)
+{
+
+	return (rpc_msgpack_deserialize_impl(frame, size, false, NULL, false,
+	    false, NULL, NULL, NULL));
+}
+
+rpc_object_t
+rpc_msgpack_deserialize_typed(const void *frame, size_t size)
+{
+
+	return (rpc_msgpack_deserialize_impl(frame, size, true, NULL, false,
+	    false, NULL, NULL, NULL));
+}
+
+/*
+ * Decodes an inbound frame. If pool is set, it is the receive buffer
+ * holding the frame, which large binaries may keep referencing. If
+ * arena is set, the decoded objects are allocated from a single
+ * per-frame arena. If lazy is set and there is a pool, nested
+ * containers are decoded on first access instead. If types is set, type
+ * ids are resolved through the connection type table, and the frame is
+ * always decoded eagerly. If shm is set, chunks of peer pools mapped
+ * earlier are resolved through it. If descs is set, every fd and shmem
+ * object holding a descriptor index is appended to it, so the indexes
+ * can be resolved without walking the result; the frame is decoded
+ * eagerly then.
+ */
+rpc_object_t
+rpc_msgpack_deserialize_frame(const void *frame, size_t size, void *pool,
+    bool arena, bool lazy, struct rpc_msgpack_types *types,
+    struct rpc_shmem_link *shm, GPtrArray *descs)
+{
+
+	return (rpc_msgpack_deserialize_impl(frame, size, true, pool, arena,
+	    lazy, types, shm, descs));
+}
+
+/*
+ * Reads a string value into buf if it fits, and skips it otherwise.
+ * Returns whether it was read.
+ */
+static bool
+rpc_msgpack_peek_str(mpack_reader_t *reader, mpack_tag_t tag, char *buf,
+    size_t size)
+{
+	bool fits = tag.v.l < size;
+
+	if (fits) {
+		mpack_read_bytes(reader, buf, tag.v.l);
+		buf[tag.v.l] = '\0';
+	} else
+		mpack_skip_bytes(reader, tag.v.l);
+
+	mpack_done_str(reader);
+	return (fits);
+}
+
+/*
+ * Reads the routing keys of a frame, that is its opcode, or namespace
+ * and name, and its id, stepping over everything else without decoding
+ * it. The opcode is -1 if the frame names its handler instead.
+ */
+int
+rpc_msgpack_peek_frame(const void *frame, size_t size, int64_t *opp,
+    struct rpc_frame_info *info)
+{
+	mpack_reader_t reader;
+	mpack_tag_t tag;
+	char key[16];
+	char *field;
+	size_t len;
+	uint32_t count;
+	uint32_t i;
+
+	memset(info, 0, sizeof(*info));
+	*opp = -1;
+
+	mpack_reader_init_data(&reader, frame, size);
+	count = mpack_expect_map(&reader);
+	for (i = 0; i < count && mpack_reader_error(&reader) == mpack_ok;
+	    i++) {
+		tag = mpack_peek_tag(&reader);
+		if (tag.type != mpack_type_str) {
+			mpack_discard(&reader);
+			mpack_discard(&reader);
+			continue;
+		}
+
+		mpack_read_tag(&reader);
+		if (!rpc_msgpack_peek_str(&reader, tag, key, sizeof(key))) {
+			mpack_discard(&reader);
+			continue;
+		}
+
+		field = NULL;
+		len = 0;
+		if (strcmp(key, "namespace") == 0) {
+			field = info->rfi_namespace;
+			len = sizeof(info->rfi_namespace);
+		} else if (strcmp(key, "name") == 0) {
+			field = info->rfi_name;
+			len = sizeof(info->rfi_name);
+		} else if (strcmp(key, "id") == 0) {
+			field = info->rfi_id;
+			len = sizeof(info->rfi_id);
+		} else if (strcmp(key, "op") != 0) {
+			mpack_discard(&reader);
+			continue;
+		}
+
+		tag = mpack_peek_tag(&reader);
+		if (tag.type == mpack_type_str && field != NULL) {
+			mpack_read_tag(&reader);
+			rpc_msgpack_peek_str(&reader, tag, field, len);
+		} else if (tag.type == mpack_type_uint && field == NULL) {
+			mpack_read_tag(&reader);
+			*opp = (int64_t)tag.v.u;
+		} else if (tag.type == mpack_type_uint &&
+		    field == info->rfi_id) {
+			/* Compact call id */
+			mpack_read_tag(&reader);
+			g_snprintf(field, len, "%" G_GUINT64_FORMAT, tag.v.u);
+		} else
+			mpack_discard(&reader);
+	}
+
+	mpack_done_map(&reader);
+	return (mpack_reader_destroy(&reader) == mpack_ok ? 0 : -1);
+}
+
 static struct rpc_serializer msgpack_serializer = {
 	.name = "msgpack",
     	.serialize = &rpc_msgpack_serialize,
-    	.deserialize = &rpc_msgpack_deserialize
+	.serialize_typed = &rpc_msgpack_serialize_typed,
+    	.deserialize = &rpc_msgpack_deserialize,
+	.deserialize_typed = &rpc_msgpack_deserialize_typed,
+	.serialize_fd = &rpc_msgpack_serialize_fd
 };
 
 DECLARE_SERIALIZER(msgpack_serializer);
@@ -32,22 +32,52 @@
 extern "C" {
 #endif
 
+struct rpc_lazy;
+struct rpc_msgpack_types;
+struct rpc_frame_info;
+struct rpc_shmem_link;
+
 #define MSGPACK_EXTTYPE_DATE	1
 #define MSGPACK_EXTTYPE_FD	2
 #define MSGPACK_EXTTYPE_SHMEM	3
 #define MSGPACK_EXTTYPE_ERROR	4
+#define MSGPACK_EXTTYPE_PACKED	5
+#define MSGPACK_EXTTYPE_BULK	6
+#define MSGPACK_EXTTYPE_TIMESTAMP	(-1)
 
 #define	MSGPACK_SHMEM_FD	"fd"
 #define	MSGPACK_SHMEM_OFFSET	"offset"
 #define	MSGPACK_SHMEM_LEN	"len"
+#define	MSGPACK_SHMEM_POOL	"pool"
+#define	MSGPACK_SHMEM_POOL_SIZE	"pool_size"
 
 #define	MSGPACK_ERROR_CODE	"code"
 #define	MSGPACK_ERROR_MESSAGE	"message"
 #define	MSGPACK_ERROR_EXTRA	"extra"
 #define	MSGPACK_ERROR_STACK	"stack"
 
+#define	MSGPACK_POSITIONAL_FIELD "%p"
+#define	MSGPACK_COLUMNAR_FIELD	"%c"
+
 int rpc_msgpack_serialize(rpc_object_t, void **, size_t *);
+int rpc_msgpack_serialize_typed(rpc_object_t, void **, size_t *, int *,
+    size_t *);
+int rpc_msgpack_serialize_fd(rpc_object_t, int);
+int rpc_msgpack_serialize_buffered(struct rpc_output_buffer *, rpc_object_t,
+    size_t, bool, bool, bool, bool, bool, struct rpc_msgpack_types *,
+    struct rpc_shmem_link *);
 rpc_object_t rpc_msgpack_deserialize(const void *, size_t);
+rpc_object_t rpc_msgpack_deserialize_typed(const void *, size_t);
+rpc_object_t rpc_msgpack_deserialize_frame(const void *, size_t, void *, bool,
+    bool, struct rpc_msgpack_types *, struct rpc_shmem_link *, GPtrArray *);
+void rpc_msgpack_materialize(rpc_object_t);
+void rpc_msgpack_lazy_free(struct rpc_lazy *);
+struct rpc_msgpack_types *rpc_msgpack_types_new(void);
+void rpc_msgpack_types_free(struct rpc_msgpack_types *);
+rpc_object_t rpc_msgpack_types_export(struct rpc_msgpack_types *);
+void rpc_msgpack_types_import(struct rpc_msgpack_types *, rpc_object_t);
+int rpc_msgpack_peek_frame(const void *, size_t, int64_t *,
+    struct rpc_frame_info *);
 
 #ifdef __cplusplus
 }
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <unistd.h>
 #include <glib.h>
 #include <rpc/object.h>
 #include <yaml.h>
@@ -499,23 +500,31 @@ rpc_yaml_write_output(void *data, unsigned char *buffer, size_t size)
 	return (1);
 }
 
-int
-rpc_yaml_serialize(rpc_object_t obj, void **frame, size_t *size)
+static int
+rpc_yaml_write_fd(void *data, unsigned char *buffer, size_t size)
+{
+
+	return (rpc_serializer_write_all(*(int *)data, buffer, size) == 0);
+}
+
+/*
+ * Emits a document holding obj through the given write handler, which
+ * libyaml calls each time its internal output buffer fills up.
+ */
+static int
+rpc_yaml_emit(rpc_object_t obj, yaml_write_handler_t *handler, void *data)
 {
 	yaml_emitter_t emitter;
 	yaml_event_t event;
-	GString *out_buffer;
 	int status = 0;
 
-	out_buffer = g_string_new(NULL);
 	yaml_emitter_initialize(&emitter);
 	yaml_emitter_set_canonical(&emitter, 0);
 	yaml_emitter_set_encoding(&emitter, YAML_UTF8_ENCODING);
 	yaml_emitter_set_unicode(&emitter, 1);
 	yaml_emitter_set_indent(&emitter, 2);
 	yaml_emitter_set_width(&emitter, 120);
-	yaml_emitter_set_output(&emitter, &rpc_yaml_write_output,
-	    (void *)out_buffer);
+	yaml_emitter_set_output(&emitter, handler, data);
 	yaml_emitter_open(&emitter);
 
 	status = yaml_document_start_event_initialize(&event, NULL, NULL, NULL,
@@ -541,6 +550,18 @@ rpc_yaml_serialize(rpc_object_t obj, void **frame, size_t *size)
 	status = yaml_emitter_close(&emitter);
 
 done:	yaml_emitter_delete(&emitter);
+	return (status);
+}
+
+int
+rpc_yaml_serialize(rpc_object_t obj, void **frame, size_t *size)
+{
+	GString *out_buffer;
+	int status;
+
+	out_buffer = g_string_new(NULL);
+	status = rpc_yaml_emit(obj, &rpc_yaml_write_output,
+	    (void *)out_buffer);
 
 	if (status != 1)
 		g_string_free(out_buffer, true);
@@ -552,27 +573,40 @@ done:	yaml_emitter_delete(&emitter);
 	return (status == 1 ? 0 : -1);
 }
 
-rpc_object_t
-rpc_yaml_deserialize(const void *frame, size_t size)
+int
+rpc_yaml_serialize_fd(rpc_object_t obj, int fd)
+{
+
+	return (rpc_yaml_emit(obj, &rpc_yaml_write_fd, &fd) == 1 ? 0 : -1);
+}
+
+/*
+ * Builds objects out of parser events, one document. The completed
+ * top-level value is handed to item, which doesn't take a reference on
+ * it. With stream set, the items of a top-level sequence are handed to
+ * item one by one as each is completed, and never collected into the
+ * sequence itself, so memory use is bounded by the largest item rather
+ * than by the document. Returning false from item stops the parser.
+ */
+static int
+rpc_yaml_load(yaml_parser_t *parser, bool stream, rpc_serializer_item_t item)
 {
 	GQueue *containers = g_queue_new();
 	GQueue *keys = g_queue_new();
-	rpc_object_t current = NULL;
+	rpc_object_t current;
 	rpc_object_t container;
-	yaml_parser_t parser;
 	yaml_event_t event;
 	bool done = false;
 	bool read_key = false;
 	char *key;
 	char *tag;
-
-	yaml_parser_initialize(&parser);
-	yaml_parser_set_input_string(&parser, frame, size);
+	int ret = 0;
 
 	while (!done) {
-		if (!yaml_parser_parse(&parser, &event)) {
-			rpc_set_last_error(EINVAL, parser.problem, NULL);
-			goto out;
+		if (!yaml_parser_parse(parser, &event)) {
+			rpc_set_last_error(EINVAL, parser->problem, NULL);
+			ret = -1;
+			break;
 		}
 
 		switch (event.type) {
@@ -580,10 +614,13 @@ rpc_yaml_deserialize(const void *frame, size_t size)
 				read_key = true;
 				tag = (char *)event.data.mapping_start.tag;
 				if (tag != NULL) {
-					current = rpc_yaml_read_ext(&parser,
+					current = rpc_yaml_read_ext(parser,
 					    tag);
-					if (current == NULL)
-						goto out;
+					if (current == NULL) {
+						ret = -1;
+						done = true;
+						goto done;
+					}
 					break;
 				}
 				g_queue_push_head(containers,
@@ -617,6 +654,7 @@ rpc_yaml_deserialize(const void *frame, size_t size)
 				current = rpc_yaml_read_scalar(&event);
 				break;
 
+			case YAML_DOCUMENT_END_EVENT:
 			case YAML_STREAM_END_EVENT:
 				done = true;
 				goto done;
@@ -627,11 +665,24 @@ rpc_yaml_deserialize(const void *frame, size_t size)
 		}
 
 		container = g_queue_peek_head(containers);
-		if (container == NULL)
-			goto out;
+		if (container == NULL) {
+			/* The items of a streamed sequence are gone already */
+			if (!stream || rpc_get_type(current) != RPC_TYPE_ARRAY)
+				item(current);
+
+			rpc_release(current);
+			done = true;
+			goto done;
+		}
 
 		switch (rpc_get_type(container)) {
 		case RPC_TYPE_ARRAY:
+			if (stream && g_queue_get_length(containers) == 1) {
+				done = !item(current);
+				rpc_release(current);
+				break;
+			}
+
 			rpc_array_append_stolen_value(container, current);
 			break;
 
@@ -650,17 +701,71 @@ done:
 		yaml_event_delete(&event);
 	}
 
-out:
-	yaml_parser_delete(&parser);
 	g_queue_free_full(keys, g_free);
-	g_queue_free(containers);
-	return (current);
+	g_queue_free_full(containers, (GDestroyNotify)rpc_release_impl);
+	return (ret);
+}
+
+static int
+rpc_yaml_read_fd(void *data, unsigned char *buffer, size_t size,
+    size_t *size_read)
+{
+	int fd = *(int *)data;
+	ssize_t ret;
+
+	do
+		ret = read(fd, buffer, size);
+	while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return (0);
+
+	*size_read = (size_t)ret;
+	return (1);
+}
+
+rpc_object_t
+rpc_yaml_deserialize(const void *frame, size_t size)
+{
+	__block rpc_object_t result = NULL;
+	yaml_parser_t parser;
+	int ret;
+
+	yaml_parser_initialize(&parser);
+	yaml_parser_set_input_string(&parser, frame, size);
+	ret = rpc_yaml_load(&parser, false, ^(rpc_object_t obj) {
+		result = rpc_retain(obj);
+		return ((bool)true);
+	});
+
+	yaml_parser_delete(&parser);
+	if (ret != 0) {
+		rpc_release(result);
+		return (NULL);
+	}
+
+	return (result);
+}
+
+int
+rpc_yaml_deserialize_stream(int fd, rpc_serializer_item_t item)
+{
+	yaml_parser_t parser;
+	int ret;
+
+	yaml_parser_initialize(&parser);
+	yaml_parser_set_input(&parser, rpc_yaml_read_fd, &fd);
+	ret = rpc_yaml_load(&parser, true, item);
+	yaml_parser_delete(&parser);
+	return (ret);
 }
 
 static struct rpc_serializer yaml_serializer = {
 	.name = "yaml",
 	.serialize = rpc_yaml_serialize,
-	.deserialize = rpc_yaml_deserialize
+	.deserialize = rpc_yaml_deserialize,
+	.deserialize_stream = rpc_yaml_deserialize_stream,
+	.serialize_fd = rpc_yaml_serialize_fd
 };
 
 DECLARE_SERIALIZER(yaml_serializer);
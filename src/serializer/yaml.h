@@ -33,6 +33,7 @@ extern "C" {
 #endif
 
 #include <rpc/object.h>
+#include <rpc/serializer.h>
 
 #define	YAML_TAG_UINT64		"!uint"
 #define	YAML_TAG_DATE		"!date"
@@ -53,7 +54,9 @@ extern "C" {
 #endif
 
 int rpc_yaml_serialize(rpc_object_t, void **, size_t *);
+int rpc_yaml_serialize_fd(rpc_object_t, int);
 rpc_object_t rpc_yaml_deserialize(const void *, size_t);
+int rpc_yaml_deserialize_stream(int, rpc_serializer_item_t);
 
 #ifdef __cplusplus
 }
@@ -27,6 +27,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -36,6 +37,8 @@
 #include <sys/socket.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <glib.h>
 #include <yuarel.h>
 #include <libudev.h>
@@ -46,7 +49,9 @@
 #include "../internal.h"
 #include "../../kmod/librpc.h"
 
-#define	BUS_NL_MSGSIZE	16384
+#define	BUS_NL_MSGSIZE		16384
+#define	BUS_WINDOW_DEFAULT	8
+#define	BUS_WINDOW_MAX		256
 
 struct bus_netlink;
 struct bus_connection;
@@ -64,7 +69,11 @@ static int bus_get_fd(void *);
 static int bus_netlink_open(struct bus_netlink *);
 static int bus_netlink_close(struct bus_netlink *);
 static int bus_netlink_send(struct bus_netlink *, struct librpc_message *,
-    const void *, size_t);
+    const void *, size_t, uint16_t);
+static int bus_netlink_send_window(struct bus_netlink *,
+    struct librpc_message *, const void *, size_t, uint16_t);
+static int bus_netlink_send_frame(struct bus_netlink *,
+    struct librpc_message *, const void *, size_t);
 static int bus_netlink_recv(struct bus_netlink *);
 static int bus_lookup_address(const char *, uint32_t *);
 static void bus_process_message(void *, struct librpc_message *, void *, size_t);
@@ -72,6 +81,11 @@ static void *bus_reader(void *);
 static void bus_release(void *);
 static void bus_nack_all_locked(struct bus_netlink *bn);
 static void bus_process_departure(void *arg);
+static int bus_ring_open(struct bus_connection *);
+static void bus_ring_close(struct bus_connection *);
+static void bus_ring_dispatch(struct bus_connection *,
+    struct librpc_ring_record *);
+static void *bus_ring_reader(void *);
 
 static const struct rpc_bus_transport bus_transport_ops = {
 	.open = bus_open,
@@ -97,23 +111,52 @@ struct bus_ack
 	uint32_t		ba_seq;
 };
 
+/*
+ * With a window larger than one, up to bn_window messages may be in
+ * flight; bn_unacked is the oldest one not acked yet. Errors for them
+ * come back asynchronously and are reported by the next send.
+ */
 struct bus_netlink
 {
     	int 			bn_sock;
     	uint32_t 		bn_seq;
+    	uint32_t		bn_unacked;
+    	uint32_t		bn_ack_req;
+    	uint32_t		bn_window;
+    	int			bn_error;
     	GHashTable *		bn_ack;
     	GMutex			bn_mtx;
+    	GCond			bn_window_cv;
+    	GMutex			bn_send_mtx;
+    	GByteArray *		bn_reasm[2];
     	GThread *		bn_thread;
     	bus_netlink_cb_t	bn_callback;
     	void *			bn_arg;
 	bool			bn_departed;
 };
 
+/*
+ * Device events and logs, taken straight from the kernel's mmap'd ring
+ * (see kmod/librpc.h). br_stop is an eventfd used to wake the reader
+ * up when the connection goes away.
+ */
+struct bus_ring
+{
+	int			br_fd;
+	int			br_stop;
+	size_t			br_maplen;
+	struct librpc_ring *	br_hdr;
+	char *			br_data;
+	GThread *		br_thread;
+};
+
 struct bus_connection
 {
     	const char *		bc_name;
     	uint32_t		bc_address;
     	struct bus_netlink	bc_bn;
+    	struct bus_ring		bc_ring;
+    	int			bc_logfd;
     	struct rpc_connection *	bc_parent;
 };
 
@@ -143,11 +186,17 @@ bus_close(void *arg)
 
 static int
 bus_connect(struct rpc_connection *rco, const char *uri_string,
-    rpc_object_t args __unused)
+    rpc_object_t args)
 {
 	g_autofree char *uri_copy = g_strdup(uri_string);
 	struct yuarel uri;
 	struct bus_connection *conn;
+	int64_t window = BUS_WINDOW_DEFAULT;
+	int logfd = -1;
+
+	/* Params may be a dictionary: {"window": int, "logfd": fd} */
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY)
+		rpc_object_unpack(args, "{window:i,logfd:f}", &window, &logfd);
 
 	if (yuarel_parse(&uri, uri_copy) != 0) {
 		rpc_set_last_errorf(EINVAL, "Cannot parse URI");
@@ -156,6 +205,7 @@ bus_connect(struct rpc_connection *rco, const char *uri_string,
 
 	conn = g_malloc0(sizeof(struct bus_connection));
 	conn->bc_parent = rco;
+	conn->bc_logfd = logfd;
 
 	if (bus_lookup_address(uri.host, &conn->bc_address) != 0) {
 		rpc_set_last_error(ENOENT, "Cannot find device", NULL);
@@ -169,8 +219,14 @@ bus_connect(struct rpc_connection *rco, const char *uri_string,
 		return (-1);
 	}
 
+	conn->bc_bn.bn_window = (uint32_t)CLAMP(window, 1, BUS_WINDOW_MAX);
 	conn->bc_bn.bn_callback = &bus_process_message;
 	conn->bc_bn.bn_arg = conn;
+
+	/* Without the ring, events and logs keep coming over netlink */
+	if (bus_ring_open(conn) != 0)
+		debugf("no event ring for device %u", conn->bc_address);
+
 	rco->rco_send_msg = &bus_send_msg;
 	rco->rco_abort = &bus_abort;
 	rco->rco_get_fd = &bus_get_fd;
@@ -187,6 +243,7 @@ bus_abort(void *arg)
 
 	fprintf(stderr, "ABORT  bn %p conn %p  thread %lld\n",
 	    &conn->bc_bn, conn, (uint64_t)syscall(SYS_gettid));
+	bus_ring_close(conn);
 	bus_netlink_close(&conn->bc_bn);
 	g_free(conn);
 	return (0);
@@ -214,7 +271,7 @@ bus_ping(void *arg, const char *name)
 	msg.address = address;
 	msg.status = 0;
 
-	return (bus_netlink_send(bn, &msg, NULL, 0));
+	return (bus_netlink_send(bn, &msg, NULL, 0, 0));
 }
 
 static int
@@ -310,7 +367,7 @@ bus_send_msg(void *arg, const void *buf, size_t len, const int *fds __unused,
 	msg.address = conn->bc_address;
 	msg.status = 0;
 
-	return (bus_netlink_send(&conn->bc_bn, &msg, buf, len));
+	return (bus_netlink_send_frame(&conn->bc_bn, &msg, buf, len));
 }
 
 static int
@@ -320,6 +377,9 @@ bus_netlink_open(struct bus_netlink *bn)
 	int group = CN_LIBRPC_IDX;
 
 	bn->bn_seq = 0;
+	bn->bn_unacked = 0;
+	bn->bn_ack_req = 0;
+	bn->bn_window = 1;
 	bn->bn_sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_CONNECTOR);
 	if (bn->bn_sock < 0) {
 		rpc_set_last_error(errno, strerror(errno), NULL);
@@ -327,7 +387,11 @@ bus_netlink_open(struct bus_netlink *bn)
 	}
 
 	g_mutex_init(&bn->bn_mtx);
+	g_mutex_init(&bn->bn_send_mtx);
+	g_cond_init(&bn->bn_window_cv);
 	bn->bn_ack = g_hash_table_new(NULL, NULL);
+	bn->bn_reasm[0] = g_byte_array_new();
+	bn->bn_reasm[1] = g_byte_array_new();
 
 	sa.nl_family = AF_NETLINK;
 	sa.nl_groups = (uint32_t)-1;
@@ -353,21 +417,19 @@ bus_netlink_close(struct bus_netlink *bn)
 	return (0);
 }
 
+/*
+ * Sends a single message; must be called with bn_mtx held.
+ */
 static int
-bus_netlink_send(struct bus_netlink *bn, struct librpc_message *msg,
-    const void *payload, size_t len)
+bus_netlink_xmit_locked(struct bus_netlink *bn, struct librpc_message *msg,
+    const void *payload, size_t len, uint16_t flags, uint32_t *seqp)
 {
 	char buf[BUS_NL_MSGSIZE];
-	struct bus_ack ack;
 	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
 	struct cn_msg *cn = NLMSG_DATA(nlh);
 	size_t size = NLMSG_SPACE(sizeof(*cn) + sizeof(*msg) + len);
 
-	g_mutex_lock(&bn->bn_mtx);
-	if (bn->bn_departed) {
-		g_mutex_unlock(&bn->bn_mtx);
-		return(EIO);
-	}
+	g_assert(size <= sizeof(buf));
 
 	nlh->nlmsg_seq = bn->bn_seq++;
 	nlh->nlmsg_pid = (uint32_t)getpid();
@@ -379,24 +441,47 @@ bus_netlink_send(struct bus_netlink *bn, struct librpc_message *msg,
 	cn->id.val = CN_LIBRPC_VAL;
 	cn->seq = nlh->nlmsg_seq;
 	cn->ack = 100;
-	cn->flags = 0;
+	cn->flags = flags;
 	cn->len = sizeof(struct librpc_message) + (uint16_t)len;
 	memcpy(cn->data, msg, sizeof(struct librpc_message));
 
 	if (payload != NULL)
 		memcpy(cn->data + sizeof(struct librpc_message), payload, len);
 
+	*seqp = cn->seq;
+	if (send(bn->bn_sock, buf, size, 0) != (ssize_t)size) {
+		fprintf(stderr, "NL send failed %d\n", cn->seq);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Sends a message and waits for it to be acked.
+ */
+static int
+bus_netlink_send(struct bus_netlink *bn, struct librpc_message *msg,
+    const void *payload, size_t len, uint16_t flags)
+{
+	struct bus_ack ack;
+	uint32_t seq;
+
+	g_mutex_lock(&bn->bn_mtx);
+	if (bn->bn_departed) {
+		g_mutex_unlock(&bn->bn_mtx);
+		return(EIO);
+	}
 
 	ack.ba_done = false;
 	ack.ba_status = 0;
-	ack.ba_seq = nlh->nlmsg_seq;
+	ack.ba_seq = bn->bn_seq;
 	g_mutex_init(&ack.ba_mtx);
 	g_cond_init(&ack.ba_cv);
-	g_hash_table_insert(bn->bn_ack, GUINT_TO_POINTER(cn->seq), &ack);
+	g_hash_table_insert(bn->bn_ack, GUINT_TO_POINTER(ack.ba_seq), &ack);
 
-	if (send(bn->bn_sock, buf, size, 0) != (ssize_t)size) {
-		g_hash_table_remove(bn->bn_ack, GUINT_TO_POINTER(cn->seq));
-		fprintf(stderr, "NL send failed %d\n", cn->seq);
+	if (bus_netlink_xmit_locked(bn, msg, payload, len, flags, &seq) != 0) {
+		g_hash_table_remove(bn->bn_ack, GUINT_TO_POINTER(seq));
 		g_mutex_unlock(&bn->bn_mtx);
 		return (-1);
 	}
@@ -411,18 +496,131 @@ bus_netlink_send(struct bus_netlink *bn, struct librpc_message *msg,
 	return (ack.ba_status);
 }
 
+/*
+ * Sends a message without waiting for the ack, as long as there's room
+ * in the window. An ack is asked for every half a window, so the window
+ * keeps sliding while the sender keeps sending.
+ */
+static int
+bus_netlink_send_window(struct bus_netlink *bn, struct librpc_message *msg,
+    const void *payload, size_t len, uint16_t flags)
+{
+	uint32_t seq;
+	int ret;
+
+	g_mutex_lock(&bn->bn_mtx);
+	while (!bn->bn_departed && bn->bn_error == 0 &&
+	    bn->bn_seq - bn->bn_unacked >= bn->bn_window)
+		g_cond_wait(&bn->bn_window_cv, &bn->bn_mtx);
+
+	if (bn->bn_departed) {
+		g_mutex_unlock(&bn->bn_mtx);
+		return (EIO);
+	}
+
+	if (bn->bn_error != 0) {
+		ret = bn->bn_error;
+		bn->bn_error = 0;
+		g_mutex_unlock(&bn->bn_mtx);
+		return (ret);
+	}
+
+	flags |= LIBRPC_FLAG_WINDOW;
+	if (bn->bn_seq - bn->bn_ack_req >= MAX(bn->bn_window / 2, 1)) {
+		flags |= LIBRPC_FLAG_ACK_NOW;
+		bn->bn_ack_req = bn->bn_seq;
+	}
+
+	ret = bus_netlink_xmit_locked(bn, msg, payload, len, flags, &seq);
+	g_mutex_unlock(&bn->bn_mtx);
+	return (ret);
+}
+
+/*
+ * Sends an RPC frame, split into fragments if it doesn't fit in a single
+ * netlink message. Fragments of a frame are never interleaved with other
+ * frames.
+ */
+static int
+bus_netlink_send_frame(struct bus_netlink *bn, struct librpc_message *msg,
+    const void *payload, size_t len)
+{
+	size_t off = 0;
+	size_t chunk;
+	uint16_t flags;
+	int ret;
+
+	g_mutex_lock(&bn->bn_send_mtx);
+	do {
+		chunk = MIN(len - off, LIBRPC_FRAGMENT_SIZE);
+		flags = off + chunk < len ? LIBRPC_FLAG_MORE : 0;
+
+		if (bn->bn_window > 1) {
+			ret = bus_netlink_send_window(bn, msg,
+			    (const char *)payload + off, chunk, flags);
+		} else {
+			ret = bus_netlink_send(bn, msg,
+			    (const char *)payload + off, chunk, flags);
+		}
+
+		if (ret != 0)
+			break;
+
+		off += chunk;
+	} while (off < len);
+
+	g_mutex_unlock(&bn->bn_send_mtx);
+	return (ret);
+}
+
+/*
+ * Must be called with bn_mtx held. Acks arrive in order, so an ack for
+ * seq acks everything sent before it too, whether or not it's flagged
+ * cumulative.
+ */
+static void
+bus_netlink_ack_locked(struct bus_netlink *bn, uint32_t seq, int status)
+{
+	GHashTableIter iter;
+	struct bus_ack *ack;
+
+	if ((int32_t)(seq + 1 - bn->bn_unacked) > 0)
+		bn->bn_unacked = seq + 1;
+
+	g_hash_table_iter_init(&iter, bn->bn_ack);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer)&ack)) {
+		if ((int32_t)(seq - ack->ba_seq) < 0)
+			continue;
+
+		g_hash_table_iter_remove(&iter);
+		g_mutex_lock(&ack->ba_mtx);
+		ack->ba_done = true;
+		ack->ba_status = ack->ba_seq == seq ? status : 0;
+		g_cond_broadcast(&ack->ba_cv);
+		g_mutex_unlock(&ack->ba_mtx);
+		if (ack->ba_seq == seq)
+			status = 0;
+	}
+
+	/* Nobody waits for this one; report it from the next send */
+	if (status != 0 && bn->bn_error == 0)
+		bn->bn_error = status;
+
+	g_cond_broadcast(&bn->bn_window_cv);
+}
+
 static int
 bus_netlink_recv(struct bus_netlink *bn)
 {
 	char buf[BUS_NL_MSGSIZE];
-	struct bus_ack *ack;
 	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
 	struct cn_msg *cn = NLMSG_DATA(nlh);
 	struct librpc_message *msg = (struct librpc_message *)(cn + 1);
-	struct librpc_message *out;
 	struct librpc_endpoint *endp;
 	struct rpc_bus_node node;
+	GByteArray *reasm;
 	void *payload;
+	size_t len;
 	ssize_t msglen = 0;
 
 	msglen = recv(bn->bn_sock, buf, BUS_NL_MSGSIZE, 0);
@@ -443,24 +641,23 @@ bus_netlink_recv(struct bus_netlink *bn)
 		return (-1);
 	}
 
-	debugf("message: type=%d, seq=%d, len=%d", nlh->nlmsg_type, cn->seq,
-	    cn->len);
+	debugf("message: type=%d, seq=%d, len=%d, flags=0x%x",
+	    nlh->nlmsg_type, cn->seq, cn->len, cn->flags);
 
 	switch (nlh->nlmsg_type) {
 		case NLMSG_ERROR:
 			return (-1);
 
 		case NLMSG_DONE:
-			out = g_malloc(sizeof(*out));
-			payload = g_malloc(cn->len);
-			memcpy(out, msg, sizeof(struct librpc_message));
-			memcpy(payload, msg + 1, cn->len);
 			break;
 
 		default:
 			return (0);
 	}
 
+	len = cn->len > sizeof(*msg) ? cn->len - sizeof(*msg) : 0;
+	len = MIN(len, (size_t)msglen - ((char *)msg->data - buf));
+
 	switch (msg->opcode) {
 	case LIBRPC_ARRIVE:
 	case LIBRPC_DEPART:
@@ -497,24 +694,35 @@ bus_netlink_recv(struct bus_netlink *bn)
 
 	case LIBRPC_ACK:
 		g_mutex_lock(&bn->bn_mtx);
-		ack = g_hash_table_lookup(bn->bn_ack, GUINT_TO_POINTER(cn->seq));
-		g_hash_table_remove(bn->bn_ack, GUINT_TO_POINTER(cn->seq));
+		bus_netlink_ack_locked(bn, cn->seq, msg->status);
 		g_mutex_unlock(&bn->bn_mtx);
+		break;
 
-		if (ack != NULL) {
-			g_mutex_lock(&ack->ba_mtx);
-			ack->ba_done = true;
-			ack->ba_status = msg->status;
-			g_cond_broadcast(&ack->ba_cv);
-			g_mutex_unlock(&ack->ba_mtx);
-		}
+	case LIBRPC_RESPONSE:
+	case LIBRPC_EVENT:
+		/* Responses and events may come in fragments */
+		reasm = bn->bn_reasm[msg->opcode == LIBRPC_EVENT];
+		if ((cn->flags & LIBRPC_FLAG_MORE) || reasm->len > 0) {
+			g_byte_array_append(reasm, (guint8 *)msg->data,
+			    (guint)len);
+			if (cn->flags & LIBRPC_FLAG_MORE)
+				break;
+
+			len = reasm->len;
+			payload = g_memdup(reasm->data, reasm->len);
+			g_byte_array_set_size(reasm, 0);
+		} else
+			payload = g_memdup(msg->data, (guint)len);
+
+		if (bn->bn_callback != NULL)
+			bn->bn_callback(bn->bn_arg, msg, payload, len);
+
+		g_free(payload);
 		break;
 
 	default:
-		if (bn->bn_callback != NULL) {
-			bn->bn_callback(bn->bn_arg, msg, payload,
-			    cn->len - sizeof(*cn));
-		}
+		if (bn->bn_callback != NULL)
+			bn->bn_callback(bn->bn_arg, msg, msg->data, len);
 		break;
 	}
 
@@ -537,6 +745,8 @@ bus_nack_all_locked(struct bus_netlink *bn)
 		g_cond_broadcast(&ack->ba_cv);
 		g_mutex_unlock(&ack->ba_mtx);
 	}
+
+	g_cond_broadcast(&bn->bn_window_cv);
 }
 
 static void
@@ -575,6 +785,143 @@ bus_process_message(void *arg, struct librpc_message *msg, void *payload,
 	}
 }
 
+static int
+bus_ring_open(struct bus_connection *conn)
+{
+	struct bus_ring *ring = &conn->bc_ring;
+	g_autofree char *path = NULL;
+	void *map;
+
+	ring->br_fd = -1;
+	ring->br_stop = -1;
+	path = g_strdup_printf("/dev/librpc%u", conn->bc_address);
+	ring->br_fd = open(path, O_RDWR | O_CLOEXEC);
+	if (ring->br_fd < 0)
+		return (-1);
+
+	ring->br_maplen = (size_t)sysconf(_SC_PAGESIZE) + LIBRPC_RING_SIZE;
+	map = mmap(NULL, ring->br_maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    ring->br_fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	ring->br_stop = eventfd(0, EFD_CLOEXEC);
+	if (ring->br_stop < 0) {
+		munmap(map, ring->br_maplen);
+		goto fail;
+	}
+
+	ring->br_hdr = map;
+	ring->br_data = (char *)map + sysconf(_SC_PAGESIZE);
+	ring->br_thread = g_thread_new("bus ring", &bus_ring_reader, conn);
+	return (0);
+
+fail:
+	close(ring->br_fd);
+	ring->br_fd = -1;
+	return (-1);
+}
+
+static void
+bus_ring_close(struct bus_connection *conn)
+{
+	struct bus_ring *ring = &conn->bc_ring;
+	uint64_t one = 1;
+
+	if (ring->br_thread == NULL)
+		return;
+
+	(void)write(ring->br_stop, &one, sizeof(one));
+	if (ring->br_thread != g_thread_self())
+		g_thread_join(ring->br_thread);
+	else
+		g_thread_unref(ring->br_thread);
+
+	munmap(ring->br_hdr, ring->br_maplen);
+	close(ring->br_stop);
+	close(ring->br_fd);
+	ring->br_thread = NULL;
+}
+
+static void
+bus_ring_dispatch(struct bus_connection *conn, struct librpc_ring_record *rec)
+{
+
+	switch (rec->opcode) {
+	case LIBRPC_EVENT:
+		conn->bc_parent->rco_recv_msg(conn->bc_parent, rec->data,
+		    rec->len, NULL, 0);
+		break;
+
+	case LIBRPC_LOG:
+		if (conn->bc_logfd != -1) {
+			dprintf(conn->bc_logfd, "%.*s\n", (int)rec->len,
+			    rec->data);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Drains the ring in batches: one poll() per wakeup, however many
+ * records came in meanwhile. After publishing tail, head is looked at
+ * again before going to sleep, as the kernel only rings the doorbell
+ * for a ring it sees caught up.
+ */
+static void *
+bus_ring_reader(void *arg)
+{
+	struct bus_connection *conn = arg;
+	struct bus_ring *ring = &conn->bc_ring;
+	struct librpc_ring_record *rec;
+	struct pollfd fds[2];
+	uint64_t dropped = 0;
+	uint64_t head;
+	uint64_t tail;
+
+	fds[0].fd = ring->br_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = ring->br_stop;
+	fds[1].events = POLLIN;
+	tail = ring->br_hdr->tail;
+
+	for (;;) {
+		head = __atomic_load_n(&ring->br_hdr->head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			rec = (struct librpc_ring_record *)(ring->br_data +
+			    tail % LIBRPC_RING_SIZE);
+			if (rec->opcode != LIBRPC_RING_PAD)
+				bus_ring_dispatch(conn, rec);
+
+			tail += (sizeof(*rec) + rec->len +
+			    LIBRPC_RING_ALIGN - 1) & ~(LIBRPC_RING_ALIGN - 1);
+		}
+
+		__atomic_store_n(&ring->br_hdr->tail, tail, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->br_hdr->head, __ATOMIC_SEQ_CST) !=
+		    tail)
+			continue;
+
+		if (ring->br_hdr->dropped != dropped) {
+			dropped = ring->br_hdr->dropped;
+			debugf("device %u: %" PRIu64 " ring records dropped",
+			    conn->bc_address, dropped);
+		}
+
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+
+		if (fds[1].revents != 0 ||
+		    (fds[0].revents & (POLLHUP | POLLERR)))
+			break;
+	}
+
+	return (NULL);
+}
+
 static void *
 bus_reader(void *arg)
 {
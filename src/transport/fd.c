@@ -27,11 +27,22 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <glib.h>
 #include <yuarel.h>
 #include "../linker_set.h"
 #include "../internal.h"
 
+/*
+ * Batches are written in chunks of at most FD_BATCH_FRAMES frames and
+ * IOV_MAX vectors. A frame with more vectors than that goes out alone.
+ */
+#define	FD_BATCH_FRAMES	64
+#if !defined(IOV_MAX)
+#define	IOV_MAX		1024
+#endif
+
 static int fd_connect(struct rpc_connection *, const char *, rpc_object_t);
 static int fd_listen(struct rpc_server *, const char *, rpc_object_t);
 
@@ -53,6 +64,7 @@ static const struct rpc_transport fd_transport = {
 	.schemas = {"fd", NULL},
 	.connect = fd_connect,
 	.listen = fd_listen,
+	.flags = RPC_TRANSPORT_POOLED_RECV
 };
 
 static ssize_t
@@ -78,13 +90,38 @@ xread(int fd, void *buf, size_t nbytes)
 	return (done);
 }
 
+static int
+fd_recv_msg(struct fd_connection *fdconn, void **frame, size_t *size)
+{
+	uint32_t header[4];
+	size_t length;
+
+	if (xread(fdconn->fd, header, sizeof(header)) < 0)
+		return (-1);
+
+	if (header[0] != 0xdeadbeef)
+		return (-1);
+
+	length = header[1];
+	*frame = rpc_recv_buffer_alloc(length);
+	*size = length;
+
+	if (xread(fdconn->fd, *frame, length) < 0) {
+		rpc_recv_buffer_release(*frame);
+		return (-1);
+	}
+
+	return (0);
+}
+
 static ssize_t
-xwrite(int fd, const void *buf, size_t nbytes)
+xwritev(int fd, struct iovec *iov, int iovcnt)
 {
 	ssize_t ret, done = 0;
+	size_t tmp;
 
-	while (done < (ssize_t)nbytes) {
-		ret = write(fd, (buf + done), nbytes - done);
+	while (iovcnt > 0) {
+		ret = writev(fd, iov, MIN(iovcnt, IOV_MAX));
 		if (ret == 0)
 			return (-1);
 
@@ -96,49 +133,117 @@ xwrite(int fd, const void *buf, size_t nbytes)
 		}
 
 		done += ret;
+
+		while (iovcnt > 0 && ret > 0) {
+			tmp = MIN((size_t)ret, iov->iov_len);
+			iov->iov_base = (char *)iov->iov_base + tmp;
+			iov->iov_len -= tmp;
+			ret -= tmp;
+
+			if (iov->iov_len == 0) {
+				iov++;
+				iovcnt--;
+			}
+		}
 	}
 
 	return (done);
 }
 
 static int
-fd_recv_msg(struct fd_connection *fdconn, void **frame, size_t *size)
+fd_send_chunk(struct fd_connection *fdconn, const struct iovec *vec,
+    const size_t *frame_niov, size_t nframes)
 {
-	uint32_t header[4];
-	size_t length;
+	struct iovec *iov;
+	struct iovec *heap = NULL;
+	uint32_t (*headers)[4];
+	size_t niov = 0;
+	size_t nvec = 0;
+	size_t size;
+	size_t i, j;
+	int ret = 0;
+
+	for (i = 0; i < nframes; i++)
+		nvec += frame_niov[i];
+
+	if (nvec + nframes > IOV_MAX)
+		iov = heap = g_new(struct iovec, nvec + nframes);
+	else
+		iov = g_newa(struct iovec, nvec + nframes);
+
+	headers = g_newa(uint32_t[4], nframes);
+
+	for (i = 0; i < nframes; i++) {
+		size = 0;
+		headers[i][0] = 0xdeadbeef;
+		headers[i][2] = 0;
+		headers[i][3] = 0;
+		iov[niov].iov_base = headers[i];
+		iov[niov].iov_len = sizeof(headers[i]);
+		niov++;
+
+		for (j = 0; j < frame_niov[i]; j++) {
+			iov[niov++] = *vec;
+			size += vec->iov_len;
+			vec++;
+		}
 
-	if (xread(fdconn->fd, header, sizeof(header)) < 0)
-		return (-1);
+		headers[i][1] = (uint32_t)size;
+	}
 
-	if (header[0] != 0xdeadbeef)
-		return (-1);
+	if (xwritev(fdconn->fd, iov, (int)niov) < 0)
+		ret = -1;
 
-	length = header[1];
-	*frame = g_malloc(length);
-	*size = length;
+	g_free(heap);
+	return (ret);
+}
 
-	if (xread(fdconn->fd, *frame, length) < 0) {
-		g_free(*frame);
-		return (-1);
+static int
+fd_send_batch(void *arg, const struct iovec *vec, const size_t *frame_niov,
+    size_t nframes, const int *fds __unused, size_t nfds __unused)
+{
+	struct fd_connection *fdconn = arg;
+	size_t nvec;
+	size_t n;
+	size_t i;
+
+	while (nframes > 0) {
+		nvec = frame_niov[0] + 1;
+		for (n = 1; n < MIN(nframes, FD_BATCH_FRAMES); n++) {
+			if (nvec + frame_niov[n] + 1 > IOV_MAX)
+				break;
+
+			nvec += frame_niov[n] + 1;
+		}
+
+		if (fd_send_chunk(fdconn, vec, frame_niov, n) != 0)
+			return (-1);
+
+		for (i = 0; i < n; i++)
+			vec += frame_niov[i];
+
+		frame_niov += n;
+		nframes -= n;
 	}
 
 	return (0);
 }
 
 static int
-fd_send_msg(void *arg, const void *buf, size_t size, const int *fds __unused,
-    size_t nfds __unused)
+fd_send_msgv(void *arg, const struct iovec *vec, size_t nvec,
+    const int *fds, size_t nfds)
 {
-	struct fd_connection *fdconn = arg;
-	uint32_t header[4] = { 0xdeadbeef, (uint32_t)size, 0, 0 };
 
-	if (xwrite(fdconn->fd, header, sizeof(header)) < 0)
-		return (-1);
+	return (fd_send_batch(arg, vec, &nvec, 1, fds, nfds));
+}
 
-	if (xwrite(fdconn->fd, buf, size) < 0)
-		return (-1);
+static int
+fd_send_msg(void *arg, const void *buf, size_t size, const int *fds,
+    size_t nfds)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
 
-	return (0);
+	return (fd_send_msgv(arg, &iov, 1, fds, nfds));
 }
 
 static int
@@ -176,11 +281,11 @@ fd_reader(void *arg)
 
 		if (fdconn->parent->rco_recv_msg(fdconn->parent, frame, len,
 		    NULL, 0) != 0) {
-			g_free(frame);
+			rpc_recv_buffer_release(frame);
 			break;
 		}
 
-		g_free(frame);
+		rpc_recv_buffer_release(frame);
 	}
 
 	fdconn->parent->rco_close(fdconn->parent);
@@ -219,6 +324,8 @@ fd_connect(struct rpc_connection *rco, const char *uri_string,
 	fdconn->parent = rco;
 	fdconn->fd = fd;
 	rco->rco_send_msg = fd_send_msg;
+	rco->rco_send_msgv = fd_send_msgv;
+	rco->rco_send_batch = fd_send_batch;
 	rco->rco_abort = fd_abort;
 	rco->rco_get_fd = fd_get_fd;
 	rco->rco_release = fd_release;
@@ -257,6 +364,8 @@ fd_listen(struct rpc_server *srv, const char *uri_string,
 	fdsrv->conn.fd = fd;
 	fdsrv->conn.parent = rpc_connection_alloc(srv);
 	fdsrv->conn.parent->rco_send_msg = fd_send_msg;
+	fdsrv->conn.parent->rco_send_msgv = fd_send_msgv;
+	fdsrv->conn.parent->rco_send_batch = fd_send_batch;
 	fdsrv->conn.parent->rco_abort = fd_abort;
 	fdsrv->conn.parent->rco_get_fd = fd_get_fd;
 	fdsrv->conn.parent->rco_release = fd_release;
@@ -27,6 +27,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <glib.h>
 #include <libsoup/soup.h>
 #include <libusb.h>
@@ -41,6 +42,19 @@
 
 #define	LIBRPC_USB_VID		0xbeef
 
+/*
+ * Devices exposing a pair of bulk endpoints get the same bulk data path
+ * as in the kernel driver: frames go out as a header followed by the
+ * payload, in chunks submitted together, and responses, events and logs
+ * come in on bulk IN, which always has USB_NXFERS transfers queued up.
+ */
+#define	USB_NXFERS		4
+#define	USB_BUFSIZE		16384
+#define	USB_CHUNK		65536
+#define	USB_TIMEOUT		5000
+#define	USB_BULK_MAGIC		0x4c525043
+#define	USB_MAX_FRAME		(16 * 1024 * 1024)
+
 struct usb_context;
 struct usb_connection;
 
@@ -52,6 +66,12 @@ static gboolean usb_hotplug_impl(void *);
 static bool usb_valid_pid(uint16_t);
 static int usb_connect(struct rpc_connection *, const char *, rpc_object_t);
 static int usb_send_msg(void *, const void *, size_t, const int *fds, size_t nfds);
+static int usb_send_msgv(void *, const struct iovec *, size_t, const int *,
+    size_t);
+static int usb_bulk_setup(struct usb_connection *);
+static void usb_bulk_teardown(struct usb_connection *);
+static void LIBUSB_CALL usb_bulk_in_cb(struct libusb_transfer *);
+static void LIBUSB_CALL usb_bulk_out_cb(struct libusb_transfer *);
 static int usb_abort(void *);
 static int usb_get_fd(void *);
 static int usb_ping(void *, const char *);
@@ -103,6 +123,32 @@ struct librpc_usb_log
 	char 		buffer[];
 };
 
+enum librpc_usb_bulk_type
+{
+	LIBRPC_USB_BULK_REQUEST = 0,
+	LIBRPC_USB_BULK_RESPONSE,
+	LIBRPC_USB_BULK_EVENT,
+	LIBRPC_USB_BULK_LOG
+};
+
+/* Little endian on the wire */
+struct librpc_usb_bulk_header
+{
+	uint32_t	magic;
+	uint32_t	length;
+	uint8_t		type;
+	uint8_t		status;
+	uint16_t	id;
+} __attribute__((packed));
+
+struct usb_bulk_send
+{
+	GMutex				ubs_mtx;
+	GCond				ubs_cv;
+	int				ubs_pending;
+	bool				ubs_failed;
+};
+
 struct usb_thread_state
 {
 	libusb_context *		uts_libusb;
@@ -145,6 +191,20 @@ struct usb_connection
 	struct usb_thread_state		uc_state;
 	size_t 				uc_logsize;
 	int				uc_logfd;
+	bool				uc_bulk;
+	uint8_t				uc_ep_in;
+	uint8_t				uc_ep_out;
+	uint16_t			uc_next_id;
+	GMutex				uc_send_mtx;
+	GMutex				uc_xfer_mtx;
+	GCond				uc_xfer_cv;
+	int				uc_in_active;
+	bool				uc_closing;
+	struct libusb_transfer *	uc_in[USB_NXFERS];
+	struct librpc_usb_bulk_header	uc_rx_hdr;
+	size_t				uc_rx_hdr_len;
+	uint8_t *			uc_rx_buf;
+	size_t				uc_rx_len;
 };
 
 struct rpc_bus_transport libusb_bus_ops = {
@@ -332,6 +392,9 @@ usb_connect(struct rpc_connection *rco, const char *uri_string,
 	conn = g_malloc0(sizeof(*conn));
 	conn->uc_logfd = -1;
 	g_mutex_init(&conn->uc_mtx);
+	g_mutex_init(&conn->uc_send_mtx);
+	g_mutex_init(&conn->uc_xfer_mtx);
+	g_cond_init(&conn->uc_xfer_cv);
 	libusb_init(&conn->uc_libusb);
 
 	rpc_object_unpack(args, "f", &conn->uc_logfd);
@@ -359,13 +422,20 @@ usb_connect(struct rpc_connection *rco, const char *uri_string,
 		goto error;
 	}
 
-	conn->uc_event_source = g_timeout_source_new(500);
-	g_source_set_callback(conn->uc_event_source, usb_event_impl, conn,
-	    NULL);
-	g_source_attach(conn->uc_event_source, rco->rco_main_context);
-
 	conn->uc_logsize = ident.log_size;
 	conn->uc_rco = rco;
+
+	/* Bulk IN brings events and logs in, no need to poll for them */
+	if (usb_bulk_setup(conn) == 0)
+		rco->rco_send_msgv = usb_send_msgv;
+	else {
+		conn->uc_event_source = g_timeout_source_new(500);
+		g_source_set_callback(conn->uc_event_source, usb_event_impl,
+		    conn, NULL);
+		g_source_attach(conn->uc_event_source,
+		    rpc_connection_get_main_context(rco));
+	}
+
 	rco->rco_send_msg = usb_send_msg;
 	rco->rco_abort = usb_abort;
 	rco->rco_get_fd = usb_get_fd;
@@ -389,13 +459,18 @@ usb_send_msg(void *arg, const void *buf, size_t len, const int *fds __unused,
 {
 
 	struct usb_connection *conn = arg;
-	struct usb_send_state *send = g_malloc0(sizeof(*send));
+	struct usb_send_state *send;
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	if (conn->uc_bulk)
+		return (usb_send_msgv(arg, &iov, 1, NULL, 0));
 
+	send = g_malloc0(sizeof(*send));
 	send->uss_buf = g_memdup(buf, (guint)len);
 	send->uss_len = len;
 	send->uss_conn = conn;
-	g_main_context_invoke(conn->uc_rco->rco_main_context, usb_send_msg_impl,
-	    send);
+	g_main_context_invoke(rpc_connection_get_main_context(conn->uc_rco),
+	    usb_send_msg_impl, send);
 	return (0);
 }
 
@@ -404,9 +479,12 @@ usb_abort(void *arg)
 {
 	struct usb_connection *conn = arg;
 
+	usb_bulk_teardown(conn);
+
 	g_mutex_lock(&conn->uc_mtx);
 	conn->uc_state.uts_exit = true;
-	g_source_destroy(conn->uc_event_source);
+	if (conn->uc_event_source != NULL)
+		g_source_destroy(conn->uc_event_source);
 	g_mutex_unlock(&conn->uc_mtx);
 	libusb_close(conn->uc_handle);
 	libusb_exit(conn->uc_libusb);
@@ -602,6 +680,328 @@ usb_find(struct libusb_context *libusb, const char *serial, int addr)
 	return (NULL);
 }
 
+/*
+ * Looks for a bulk endpoint pair on the first interface and, if there is
+ * one, starts receiving on it. Returns -1 if the device has to be driven
+ * with control transfers instead.
+ */
+static int
+usb_bulk_setup(struct usb_connection *conn)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *intf;
+	const struct libusb_endpoint_descriptor *ep;
+	struct libusb_transfer *xfer;
+	int i;
+
+	if (libusb_get_active_config_descriptor(
+	    libusb_get_device(conn->uc_handle), &config) != 0)
+		return (-1);
+
+	if (config->bNumInterfaces > 0 &&
+	    config->interface[0].num_altsetting > 0) {
+		intf = &config->interface[0].altsetting[0];
+		for (i = 0; i < intf->bNumEndpoints; i++) {
+			ep = &intf->endpoint[i];
+			if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) !=
+			    LIBUSB_TRANSFER_TYPE_BULK)
+				continue;
+
+			if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+				conn->uc_ep_in = ep->bEndpointAddress;
+			else
+				conn->uc_ep_out = ep->bEndpointAddress;
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+
+	if (conn->uc_ep_in == 0 || conn->uc_ep_out == 0)
+		return (-1);
+
+	libusb_set_auto_detach_kernel_driver(conn->uc_handle, 1);
+	if (libusb_claim_interface(conn->uc_handle, 0) != 0) {
+		debugf("cannot claim interface, using control transfers");
+		return (-1);
+	}
+
+	conn->uc_bulk = true;
+	for (i = 0; i < USB_NXFERS; i++) {
+		xfer = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(xfer, conn->uc_handle, conn->uc_ep_in,
+		    g_malloc(USB_BUFSIZE), USB_BUFSIZE, usb_bulk_in_cb, conn, 0);
+		xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		conn->uc_in[i] = xfer;
+
+		g_mutex_lock(&conn->uc_xfer_mtx);
+		if (libusb_submit_transfer(xfer) == 0)
+			conn->uc_in_active++;
+		g_mutex_unlock(&conn->uc_xfer_mtx);
+	}
+
+	if (conn->uc_in_active == 0) {
+		usb_bulk_teardown(conn);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Cancels the transfers on bulk IN and waits for the libusb thread to
+ * see them off.
+ */
+static void
+usb_bulk_teardown(struct usb_connection *conn)
+{
+	int i;
+
+	if (!conn->uc_bulk)
+		return;
+
+	g_mutex_lock(&conn->uc_xfer_mtx);
+	conn->uc_closing = true;
+	for (i = 0; i < USB_NXFERS; i++) {
+		if (conn->uc_in[i] != NULL)
+			libusb_cancel_transfer(conn->uc_in[i]);
+	}
+
+	while (conn->uc_in_active > 0)
+		g_cond_wait(&conn->uc_xfer_cv, &conn->uc_xfer_mtx);
+	g_mutex_unlock(&conn->uc_xfer_mtx);
+
+	for (i = 0; i < USB_NXFERS; i++) {
+		if (conn->uc_in[i] != NULL)
+			libusb_free_transfer(conn->uc_in[i]);
+
+		conn->uc_in[i] = NULL;
+	}
+
+	libusb_release_interface(conn->uc_handle, 0);
+	g_free(conn->uc_rx_buf);
+	conn->uc_rx_buf = NULL;
+	conn->uc_bulk = false;
+}
+
+static gboolean
+usb_close_impl(void *arg)
+{
+	struct usb_connection *conn = arg;
+
+	conn->uc_rco->rco_close(conn->uc_rco);
+	return (false);
+}
+
+static void
+usb_bulk_deliver(struct usb_connection *conn)
+{
+	struct librpc_usb_bulk_header *hdr = &conn->uc_rx_hdr;
+
+	switch (hdr->type) {
+	case LIBRPC_USB_BULK_RESPONSE:
+	case LIBRPC_USB_BULK_EVENT:
+		if (hdr->status != LIBRPC_USB_OK) {
+			debugf("device returned error status %d", hdr->status);
+			break;
+		}
+
+		conn->uc_rco->rco_recv_msg(conn->uc_rco, conn->uc_rx_buf,
+		    conn->uc_rx_len, NULL, 0);
+		break;
+
+	case LIBRPC_USB_BULK_LOG:
+		if (conn->uc_logfd != -1) {
+			dprintf(conn->uc_logfd, "%.*s", (int)conn->uc_rx_len,
+			    (char *)conn->uc_rx_buf);
+		}
+		break;
+
+	default:
+		debugf("unknown message type %d on bulk IN", hdr->type);
+		break;
+	}
+
+	g_free(conn->uc_rx_buf);
+	conn->uc_rx_buf = NULL;
+	conn->uc_rx_len = 0;
+	conn->uc_rx_hdr_len = 0;
+}
+
+/*
+ * Puts messages back together from what comes in on bulk IN. Transfers
+ * on an endpoint complete in order, so the stream does too.
+ */
+static void
+usb_bulk_parse(struct usb_connection *conn, const uint8_t *data, size_t len)
+{
+	struct librpc_usb_bulk_header *hdr = &conn->uc_rx_hdr;
+	size_t want;
+	size_t n;
+
+	while (len > 0) {
+		if (conn->uc_rx_hdr_len < sizeof(*hdr)) {
+			n = MIN(len, sizeof(*hdr) - conn->uc_rx_hdr_len);
+			memcpy((uint8_t *)hdr + conn->uc_rx_hdr_len, data, n);
+			conn->uc_rx_hdr_len += n;
+			data += n;
+			len -= n;
+
+			if (conn->uc_rx_hdr_len < sizeof(*hdr))
+				return;
+
+			/* Out of sync; drop the rest of this transfer */
+			if (GUINT32_FROM_LE(hdr->magic) != USB_BULK_MAGIC ||
+			    GUINT32_FROM_LE(hdr->length) > USB_MAX_FRAME) {
+				debugf("malformed message on bulk IN");
+				conn->uc_rx_hdr_len = 0;
+				return;
+			}
+
+			conn->uc_rx_buf = g_malloc(
+			    MAX(GUINT32_FROM_LE(hdr->length), 1));
+			conn->uc_rx_len = 0;
+		}
+
+		want = GUINT32_FROM_LE(hdr->length);
+		n = MIN(len, want - conn->uc_rx_len);
+		memcpy(conn->uc_rx_buf + conn->uc_rx_len, data, n);
+		conn->uc_rx_len += n;
+		data += n;
+		len -= n;
+
+		if (conn->uc_rx_len == want)
+			usb_bulk_deliver(conn);
+	}
+}
+
+static void LIBUSB_CALL
+usb_bulk_in_cb(struct libusb_transfer *xfer)
+{
+	struct usb_connection *conn = xfer->user_data;
+
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED)
+		usb_bulk_parse(conn, xfer->buffer, (size_t)xfer->actual_length);
+
+	g_mutex_lock(&conn->uc_xfer_mtx);
+	if (!conn->uc_closing && xfer->status != LIBUSB_TRANSFER_CANCELLED &&
+	    xfer->status != LIBUSB_TRANSFER_NO_DEVICE &&
+	    libusb_submit_transfer(xfer) == 0) {
+		g_mutex_unlock(&conn->uc_xfer_mtx);
+		return;
+	}
+
+	conn->uc_in_active--;
+	g_cond_broadcast(&conn->uc_xfer_cv);
+	g_mutex_unlock(&conn->uc_xfer_mtx);
+
+	if (xfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		g_main_context_invoke(
+		    rpc_connection_get_main_context(conn->uc_rco),
+		    usb_close_impl, conn);
+	}
+}
+
+static void LIBUSB_CALL
+usb_bulk_out_cb(struct libusb_transfer *xfer)
+{
+	struct usb_bulk_send *send = xfer->user_data;
+
+	g_mutex_lock(&send->ubs_mtx);
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED)
+		send->ubs_failed = true;
+
+	send->ubs_pending--;
+	g_cond_broadcast(&send->ubs_cv);
+	g_mutex_unlock(&send->ubs_mtx);
+}
+
+/*
+ * Sends a frame over bulk OUT straight from the connection's send
+ * buffer: the header and each chunk of the payload get a transfer of
+ * their own, all submitted at once. The buffer only has to stay valid
+ * until this returns, so we wait for all of them to finish.
+ */
+static int
+usb_send_msgv(void *arg, const struct iovec *iov, size_t niov,
+    const int *fds __unused, size_t nfds __unused)
+{
+	struct usb_connection *conn = arg;
+	struct librpc_usb_bulk_header hdr;
+	struct usb_bulk_send send;
+	GPtrArray *xfers;
+	struct libusb_transfer *xfer;
+	size_t total = 0;
+	size_t off;
+	size_t chunk;
+	size_t i;
+
+	for (i = 0; i < niov; i++)
+		total += iov[i].iov_len;
+
+	if (total > USB_MAX_FRAME) {
+		conn->uc_rco->rco_error = rpc_error_create(EMSGSIZE,
+		    "Frame too large", NULL);
+		return (-1);
+	}
+
+	g_mutex_init(&send.ubs_mtx);
+	g_cond_init(&send.ubs_cv);
+	send.ubs_pending = 0;
+	send.ubs_failed = false;
+	xfers = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)libusb_free_transfer);
+
+	g_mutex_lock(&conn->uc_send_mtx);
+	hdr.magic = GUINT32_TO_LE(USB_BULK_MAGIC);
+	hdr.length = GUINT32_TO_LE((uint32_t)total);
+	hdr.type = LIBRPC_USB_BULK_REQUEST;
+	hdr.status = 0;
+	hdr.id = GUINT16_TO_LE(conn->uc_next_id++);
+
+	xfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(xfer, conn->uc_handle, conn->uc_ep_out,
+	    (uint8_t *)&hdr, sizeof(hdr), usb_bulk_out_cb, &send, USB_TIMEOUT);
+	g_ptr_array_add(xfers, xfer);
+
+	for (i = 0; i < niov; i++) {
+		for (off = 0; off < iov[i].iov_len; off += chunk) {
+			chunk = MIN(iov[i].iov_len - off, USB_CHUNK);
+			xfer = libusb_alloc_transfer(0);
+			libusb_fill_bulk_transfer(xfer, conn->uc_handle,
+			    conn->uc_ep_out, (uint8_t *)iov[i].iov_base + off,
+			    (int)chunk, usb_bulk_out_cb, &send, USB_TIMEOUT);
+			g_ptr_array_add(xfers, xfer);
+		}
+	}
+
+	g_mutex_lock(&send.ubs_mtx);
+	for (i = 0; i < xfers->len; i++) {
+		if (libusb_submit_transfer(g_ptr_array_index(xfers, i)) != 0) {
+			send.ubs_failed = true;
+			break;
+		}
+
+		send.ubs_pending++;
+	}
+
+	while (send.ubs_pending > 0)
+		g_cond_wait(&send.ubs_cv, &send.ubs_mtx);
+	g_mutex_unlock(&send.ubs_mtx);
+	g_mutex_unlock(&conn->uc_send_mtx);
+
+	g_ptr_array_free(xfers, true);
+	g_mutex_clear(&send.ubs_mtx);
+	g_cond_clear(&send.ubs_cv);
+
+	if (send.ubs_failed) {
+		conn->uc_rco->rco_error = rpc_error_create(EIO,
+		    "Bulk transfer failed", NULL);
+		return (-1);
+	}
+
+	return (0);
+}
+
 static gboolean
 usb_send_msg_impl(void *arg)
 {
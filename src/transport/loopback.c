@@ -39,19 +39,34 @@ struct loopback_channel
     	struct rpc_server *		lc_srv;
 };
 
-struct looplock
+/*
+ * Frames are handed over to the peer as they are, through a lock-free
+ * queue on the receiving end. Whoever finds the queue idle delivers, on
+ * its own thread, everything queued up until it's drained again, so
+ * frames are still delivered one at a time and in order. Uncontended
+ * sends never touch the queue at all.
+ */
+struct loopback_msg
 {
-	int				ll_refcnt;
-	GMutex				ll_mtx;
+	struct loopback_msg *_Atomic	lm_next;
+	rpc_object_t			lm_frame;
 };
 
+/* lb_state: closed flag and the number of sends in flight */
+#define	LOOPBACK_CLOSED			(1 << 30)
+
 struct loopback
 {
 	rpc_connection_t		lb_conn;
 	struct loopback *		lb_peer;
+	rpc_connection_t _Atomic	lb_peer_conn;
 	bool				lb_is_srv;
-	bool				lb_closed;
-        struct looplock *		lb_lock;
+	atomic_bool			lb_aborted;
+	atomic_int			lb_state;
+	struct loopback_msg *_Atomic	lb_head;
+	struct loopback_msg *		lb_tail;
+	struct loopback_msg		lb_stub;
+	atomic_int			lb_pending;
 };
 
 
@@ -62,47 +77,58 @@ static int loopback_abort(void *);
 static int loopback_teardown(struct rpc_server *);
 static int loopback_send_msg(void *, const void *, size_t, const int *, size_t);
 static void loopback_release(void *);
-static int loopback_lock_free(struct loopback *);
 static bool loopback_supports_fd_passing(struct rpc_connection *);
 
 static GHashTable *loopback_channels = NULL;
 
-static int
-loopback_accept(struct loopback_channel *chan, struct rpc_connection *conn)
+static struct loopback *
+loopback_new(rpc_connection_t conn, bool is_srv)
 {
-	struct loopback *lb_s;
-	struct loopback *lb_c;
-
-	lb_c = g_malloc0(sizeof(*lb_c));
-	lb_s = g_malloc0(sizeof(*lb_s));
-
-	/*connections need a shared lock freed when both are closed*/
-	lb_c->lb_lock = g_malloc0(sizeof(*lb_c->lb_lock));
-	g_mutex_init(&lb_c->lb_lock->ll_mtx);
-	lb_s->lb_lock = lb_c->lb_lock;
-	lb_c->lb_lock->ll_refcnt = 2;
+	struct loopback *lb;
 
-	lb_s->lb_conn = rpc_connection_alloc(chan->lc_srv);
-	lb_s->lb_is_srv = true;
-	lb_s->lb_conn->rco_send_msg = loopback_send_msg;
-	lb_s->lb_conn->rco_abort = loopback_abort;
-	lb_s->lb_conn->rco_arg = lb_s;
-	lb_s->lb_conn->rco_release = loopback_release;
+	lb = g_malloc0(sizeof(*lb));
+	lb->lb_conn = conn;
+	lb->lb_is_srv = is_srv;
+	lb->lb_head = &lb->lb_stub;
+	lb->lb_tail = &lb->lb_stub;
 
-	lb_c->lb_conn = conn;
 	conn->rco_send_msg = loopback_send_msg;
 	conn->rco_abort = loopback_abort;
-	conn->rco_arg = lb_c;
+	conn->rco_arg = lb;
 	conn->rco_release = loopback_release;
+	return (lb);
+}
 
+static int
+loopback_accept(struct loopback_channel *chan, struct rpc_connection *conn)
+{
+	struct loopback *lb_s;
+	struct loopback *lb_c;
+
+	lb_s = loopback_new(rpc_connection_alloc(chan->lc_srv), true);
+	lb_c = loopback_new(conn, false);
+
+	/* Each end keeps the other one around until it's aborted */
 	lb_c->lb_peer = lb_s;
 	lb_s->lb_peer = lb_c;
+	lb_c->lb_peer_conn = lb_s->lb_conn;
+	lb_s->lb_peer_conn = conn;
+	rpc_connection_retain(lb_s->lb_conn);
+	rpc_connection_retain(conn);
 
 	if (chan->lc_srv->rs_accept(chan->lc_srv, lb_s->lb_conn) != 0) {
 		debugf("loopback accept refused, s: %p, c: %p",
 			lb_s->lb_conn, lb_c->lb_conn);
-		lb_c->lb_closed = true;
-		loopback_release(lb_c);
+		conn->rco_send_msg = NULL;
+		conn->rco_abort = NULL;
+		conn->rco_arg = NULL;
+		conn->rco_release = NULL;
+		rpc_connection_release(lb_c->lb_peer_conn);
+		g_free(lb_c);
+
+		lb_s->lb_peer = NULL;
+		rpc_connection_release(lb_s->lb_peer_conn);
+		lb_s->lb_peer_conn = NULL;
 		loopback_abort(lb_s);
 
 		return (-1);
@@ -181,29 +207,142 @@ loopback_listen(struct rpc_server *srv, const char *uri_string,
 	return (0);
 }
 
+static void
+loopback_push(struct loopback *lb, struct loopback_msg *msg)
+{
+	struct loopback_msg *prev;
+
+	atomic_store_explicit(&msg->lm_next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&lb->lb_head, msg,
+	    memory_order_acq_rel);
+	atomic_store_explicit(&prev->lm_next, msg, memory_order_release);
+}
+
+/*
+ * Takes the oldest message off the queue. Only ever called by the one
+ * thread currently delivering. Returns NULL if the queue is empty or a
+ * producer is halfway through loopback_push().
+ */
+static struct loopback_msg *
+loopback_pop(struct loopback *lb)
+{
+	struct loopback_msg *tail = lb->lb_tail;
+	struct loopback_msg *next;
+
+	next = atomic_load_explicit(&tail->lm_next, memory_order_acquire);
+	if (tail == &lb->lb_stub) {
+		if (next == NULL)
+			return (NULL);
+
+		lb->lb_tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->lm_next,
+		    memory_order_acquire);
+	}
+
+	if (next != NULL) {
+		lb->lb_tail = next;
+		return (tail);
+	}
+
+	if (tail != atomic_load_explicit(&lb->lb_head, memory_order_acquire))
+		return (NULL);
+
+	loopback_push(lb, &lb->lb_stub);
+	next = atomic_load_explicit(&tail->lm_next, memory_order_acquire);
+	if (next != NULL) {
+		lb->lb_tail = next;
+		return (tail);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Delivers messages queued for lb until there are none left. Whoever
+ * made lb_pending go up from zero does this; the messages are known to
+ * be there, but may still be in the middle of being pushed.
+ */
+static void
+loopback_drain(struct loopback *lb)
+{
+	struct loopback_msg *msg;
+
+	while (atomic_fetch_sub(&lb->lb_pending, 1) != 1) {
+		while ((msg = loopback_pop(lb)) == NULL)
+			g_thread_yield();
+
+		lb->lb_conn->rco_recv_msg(lb->lb_conn, msg->lm_frame, 0, NULL,
+		    0);
+		rpc_release(msg->lm_frame);
+		g_free(msg);
+	}
+}
+
+static void
+loopback_drop_peer(struct loopback *lb)
+{
+	rpc_connection_t peer_conn;
+
+	peer_conn = atomic_exchange(&lb->lb_peer_conn, NULL);
+	if (peer_conn != NULL)
+		rpc_connection_release(peer_conn);
+}
+
+static void
+loopback_send_done(struct loopback *lb)
+{
+
+	/* Last send to finish after an abort lets go of the peer */
+	if (atomic_fetch_sub(&lb->lb_state, 1) == (LOOPBACK_CLOSED | 1))
+		loopback_drop_peer(lb);
+}
+
 static int
 loopback_send_msg(void *arg, const void *buf, size_t len __unused,
-    const int *fds, size_t nfds)
+    const int *fds __unused, size_t nfds __unused)
 {
 	struct loopback *lb = arg;
-	struct rpc_connection *peer_conn;
+	struct loopback *peer;
+	struct loopback_msg *msg;
 	rpc_object_t obj = (void *)buf;
-	int ret;
+	int expected = 0;
+	int ret = 0;
 
-	g_mutex_lock(&lb->lb_lock->ll_mtx);
-	if (lb->lb_closed || lb->lb_peer == NULL || lb->lb_peer->lb_closed) {
-		g_mutex_unlock(&lb->lb_lock->ll_mtx);
+	if (atomic_fetch_add(&lb->lb_state, 1) & LOOPBACK_CLOSED) {
+		loopback_send_done(lb);
 		return (-1);
 	}
-	peer_conn = lb->lb_peer->lb_conn;
-	rpc_connection_retain(peer_conn);
-	g_mutex_unlock(&lb->lb_lock->ll_mtx);
-
-	rpc_retain(obj);
-	ret = (peer_conn->rco_recv_msg(peer_conn, (const void *)obj, 0,
-	    (int *)fds, nfds));
-	rpc_release(obj);
-	rpc_connection_release(peer_conn);
+
+	peer = lb->lb_peer;
+	if (atomic_load(&peer->lb_state) & LOOPBACK_CLOSED) {
+		loopback_send_done(lb);
+		return (-1);
+	}
+
+	/* Nobody delivering and nothing queued: hand the frame over now */
+	if (atomic_compare_exchange_strong(&peer->lb_pending, &expected, 1)) {
+		ret = peer->lb_conn->rco_recv_msg(peer->lb_conn, obj, 0, NULL,
+		    0);
+		loopback_drain(peer);
+		loopback_send_done(lb);
+		return (ret);
+	}
+
+	msg = g_malloc(sizeof(*msg));
+	msg->lm_frame = rpc_retain(obj);
+	loopback_push(peer, msg);
+	if (atomic_fetch_add(&peer->lb_pending, 1) == 0) {
+		/*
+		 * Whoever was delivering has just finished, so it's up to
+		 * us. Like on the direct path, one extra count stands for
+		 * the message being delivered.
+		 */
+		atomic_fetch_add(&peer->lb_pending, 1);
+		loopback_drain(peer);
+	}
+
+	loopback_send_done(lb);
 	return (ret);
 }
 
@@ -211,45 +350,32 @@ static int
 loopback_abort(void *arg)
 {
 	struct loopback *lb = arg;
-	struct loopback *lb_peer = NULL;
 	struct rpc_connection *conn;
-	struct rpc_connection *peer = NULL;;
 
 	if (lb == NULL)
 		return (0);
 
-	g_mutex_lock(&lb->lb_lock->ll_mtx);
-	g_assert(!lb->lb_closed);
-	if (lb->lb_closed) {
+	if (atomic_exchange(&lb->lb_aborted, true)) {
 		debugf("Abort called on %p, %p already closed",
 			lb, lb->lb_conn);
-		g_mutex_unlock(&lb->lb_lock->ll_mtx);
 		return (0);
 	}
-	if (lb->lb_peer) {
-		g_assert_nonnull(lb->lb_peer->lb_peer);
-		if (!lb->lb_is_srv) {
-			lb_peer = lb->lb_peer;
-			peer = lb_peer->lb_conn;
-			rpc_connection_retain(peer);
-		}
-		lb->lb_peer->lb_peer = NULL;
-		lb->lb_peer = NULL;
-	}
+
+	/*
+	 * Stop new sends, but count as one in flight ourselves, so the
+	 * peer stays around while it's being aborted too.
+	 */
+	atomic_fetch_add(&lb->lb_state, LOOPBACK_CLOSED | 1);
 
 	conn = lb->lb_conn;
-	lb->lb_closed = true;
 	rpc_connection_retain(conn);
-
-	g_mutex_unlock(&lb->lb_lock->ll_mtx);
-
 	conn->rco_close(conn);
 	rpc_connection_release(conn);
 
-	if (peer != NULL) {
-		loopback_abort(lb_peer);
-		rpc_connection_release(peer);
-	}
+	if (lb->lb_peer != NULL)
+		loopback_abort(lb->lb_peer);
+
+	loopback_send_done(lb);
 	return (0);
 }
 
@@ -260,39 +386,23 @@ loopback_teardown(struct rpc_server *srv __unused)
 	return (0);
 }
 
-static int
-loopback_lock_free(struct loopback *lb)
-{
-	
-	g_assert_nonnull(lb);
-
-	g_mutex_lock(&lb->lb_lock->ll_mtx);
-
-	g_assert(lb->lb_closed);
-	g_assert_nonnull(lb->lb_lock);
-
-	if (lb->lb_lock->ll_refcnt == 1) {
-		g_mutex_unlock(&lb->lb_lock->ll_mtx);
-		g_free(lb->lb_lock);
-		lb->lb_lock = NULL;
-		return 0;
-	}
-	g_assert(lb->lb_lock->ll_refcnt == 2);
-	lb->lb_lock->ll_refcnt = 1;
-	g_mutex_unlock(&lb->lb_lock->ll_mtx);
-	return(1);
-}
-
 static void
 loopback_release(void *arg)
 {
 	struct loopback *lb = arg;
+	struct loopback_msg *msg;
 
 	if (lb == NULL)
 		return;
-	g_assert(lb->lb_closed);
+	g_assert(atomic_load(&lb->lb_aborted));
+
+	/* Nobody can be sending to us anymore */
+	while ((msg = loopback_pop(lb)) != NULL) {
+		rpc_release(msg->lm_frame);
+		g_free(msg);
+	}
 
-	loopback_lock_free(lb);
+	loopback_drop_peer(lb);
 	g_free(lb);
 }
 
@@ -0,0 +1,1098 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory transport for peers on the same host.
+ *
+ * Peers meet on a Unix domain socket. The client creates a memfd holding
+ * a pair of single producer, single consumer byte rings (one for each
+ * direction) and four eventfd doorbells, and passes them all over the
+ * socket. From then on, frames go through the rings; the socket is only
+ * used to pass descriptors attached to frames and to notice the peer
+ * going away.
+ *
+ * Both ends spin for a while when they find a ring empty (or full)
+ * before parking on a doorbell. Doorbells are only rung when the other
+ * end says it's parked, so a busy connection makes no system calls.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include "../linker_set.h"
+#include "../internal.h"
+
+#define	SHM_MAGIC		0x72706373
+#define	SHM_VERSION		1
+#define	SHM_FRAME_MAGIC		0xdeadbeef
+#define	SHM_RING_SIZE		(1024 * 1024)
+#define	SHM_RING_SIZE_MIN	4096
+#define	SHM_SPIN_MIN		64
+#define	SHM_SPIN_MAX		65536
+#define	SHM_HANDSHAKE_TIMEOUT	5
+#define	SHM_NFDS		5
+#define	SHM_MAX_FDS		128
+#define	SHM_MAX_FRAME		(256 * 1024 * 1024)
+#define	SHM_CACHELINE		64
+#define	SHM_SEALS		(F_SEAL_SHRINK | F_SEAL_GROW)
+
+#ifndef F_GET_SEALS
+#define	F_GET_SEALS		(1024 + 10)
+#define	F_SEAL_SHRINK		0x0002
+#define	F_SEAL_GROW		0x0004
+#endif
+
+/* Rings, as seen from the client; the server uses them the other way */
+#define	SHM_RING_C2S		0
+#define	SHM_RING_S2C		1
+
+/* Doorbells of a ring */
+#define	SHM_BELL_DATA		0	/* reader waits on this one */
+#define	SHM_BELL_SPACE		1	/* writer waits on this one */
+
+static int shm_connect(struct rpc_connection *, const char *, rpc_object_t);
+static int shm_listen(struct rpc_server *, const char *, rpc_object_t);
+static bool shm_supports_fd_passing(struct rpc_connection *);
+
+static const struct rpc_transport shm_transport = {
+	.name = "shm",
+	.schemas = {"shm", NULL},
+	.connect = shm_connect,
+	.listen = shm_listen,
+	.is_fd_passing = shm_supports_fd_passing,
+	.flags = RPC_TRANSPORT_FD_PASSING | RPC_TRANSPORT_CREDENTIALS |
+	    RPC_TRANSPORT_POOLED_RECV
+};
+
+/*
+ * Ring control block, in shared memory. Positions only ever grow; the
+ * ring size is a power of two, so they're turned into offsets by masking.
+ */
+struct shm_ring
+{
+	_Atomic uint64_t	sr_head __attribute__((aligned(SHM_CACHELINE)));
+	_Atomic uint64_t	sr_tail __attribute__((aligned(SHM_CACHELINE)));
+	_Atomic int		sr_reader_parked
+	    __attribute__((aligned(SHM_CACHELINE)));
+	_Atomic int		sr_writer_parked;
+	_Atomic int		sr_closed;
+};
+
+struct shm_region
+{
+	uint32_t		sr_magic;
+	uint32_t		sr_version;
+	uint64_t		sr_ring_size;
+	struct shm_ring		sr_rings[2];
+};
+
+/* Sent along with the descriptors by the client */
+struct shm_hello
+{
+	uint32_t		sh_magic;
+	uint32_t		sh_version;
+	uint64_t		sh_ring_size;
+};
+
+struct shm_server
+{
+	char *			ss_path;
+	struct rpc_server *	ss_server;
+	GSocketListener *	ss_listener;
+	GCancellable *		ss_cancellable;
+	GMutex			ss_mtx;
+	size_t			ss_max_frame;
+	bool			ss_outstanding_accept;
+};
+
+struct shm_connection
+{
+	struct rpc_connection *	shc_parent;
+	GSocketConnection *	shc_gconn;
+	int			shc_sock;
+	rpc_object_t		shc_shmem;
+	struct shm_region *	shc_region;
+	size_t			shc_region_size;
+	uint64_t		shc_ring_size;
+	struct shm_ring *	shc_tx;
+	struct shm_ring *	shc_rx;
+	char *			shc_tx_data;
+	char *			shc_rx_data;
+	int			shc_efds[2][2];
+	int			shc_tx_bells[2];
+	int			shc_rx_bells[2];
+	guint			shc_rx_spin;
+	guint			shc_tx_spin;
+	size_t			shc_max_frame;
+	GMutex			shc_send_mtx;
+	GMutex			shc_abort_mtx;
+	bool			shc_aborted;
+	GThread *		shc_reader;
+};
+
+static inline void
+shm_cpu_relax(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static size_t
+shm_region_size(uint64_t ring_size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size;
+
+	size = (sizeof(struct shm_region) + page - 1) & ~(page - 1);
+	return (size + 2 * ring_size);
+}
+
+static void
+shm_bell_ring(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) < 0)
+		debugf("doorbell write failed: %s", strerror(errno));
+}
+
+static void
+shm_bell_drain(int efd)
+{
+	uint64_t value;
+
+	if (read(efd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		debugf("doorbell read failed: %s", strerror(errno));
+}
+
+/*
+ * Spins on a ring position for a while, then parks on a doorbell.
+ * The spin budget grows when spinning pays off and shrinks when it
+ * doesn't. Returns -1 once either end has closed the connection.
+ */
+static int
+shm_wait(struct shm_connection *conn, struct shm_ring *ring,
+    _Atomic uint64_t *pos, uint64_t seen, _Atomic int *parked, int bell,
+    guint *spin)
+{
+	struct pollfd pfd[2];
+	guint i;
+
+	for (i = 0; i < *spin; i++) {
+		if (atomic_load_explicit(pos, memory_order_acquire) != seen) {
+			*spin = MIN(*spin * 2, SHM_SPIN_MAX);
+			return (0);
+		}
+
+		if (atomic_load_explicit(&ring->sr_closed,
+		    memory_order_relaxed))
+			return (-1);
+
+		shm_cpu_relax();
+	}
+
+	*spin = MAX(*spin / 2, SHM_SPIN_MIN);
+
+	atomic_store(parked, 1);
+	if (atomic_load(pos) != seen) {
+		atomic_store(parked, 0);
+		return (0);
+	}
+
+	pfd[0].fd = bell;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = conn->shc_sock;
+	pfd[1].events = POLLRDHUP;
+
+	while (atomic_load(pos) == seen && !atomic_load(&ring->sr_closed)) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN)
+			shm_bell_drain(bell);
+
+		if (pfd[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+			atomic_store(&ring->sr_closed, 1);
+			break;
+		}
+	}
+
+	atomic_store(parked, 0);
+	return (atomic_load(&ring->sr_closed) ? -1 : 0);
+}
+
+/*
+ * Wakes up the other end of a ring if it is parked. The fence pairs
+ * with the one implied by the sequentially consistent store of the
+ * parked flag, so either the other end sees the new position or we see
+ * it parked.
+ */
+static void
+shm_kick(_Atomic int *parked, int bell)
+{
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(parked, memory_order_relaxed))
+		shm_bell_ring(bell);
+}
+
+/*
+ * Both positions sit in memory the peer can write to, so they're checked
+ * every time they're loaded: a writer can never be more than a ring
+ * ahead of the reader. Anything else would make us copy past the end of
+ * the ring, so the connection is closed instead.
+ */
+static bool
+shm_ring_valid(struct shm_connection *conn, uint64_t head, uint64_t tail)
+{
+
+	if (head - tail <= conn->shc_ring_size)
+		return (true);
+
+	debugf("ring positions out of bounds: head %" G_GUINT64_FORMAT
+	    ", tail %" G_GUINT64_FORMAT, head, tail);
+	atomic_store(&conn->shc_region->sr_rings[0].sr_closed, 1);
+	atomic_store(&conn->shc_region->sr_rings[1].sr_closed, 1);
+	errno = EPROTO;
+	return (false);
+}
+
+static int
+shm_ring_write(struct shm_connection *conn, const void *buf, size_t len)
+{
+	struct shm_ring *ring = conn->shc_tx;
+	uint64_t mask = conn->shc_ring_size - 1;
+	uint64_t head;
+	uint64_t tail;
+	size_t room;
+	size_t chunk;
+	size_t first;
+	size_t off;
+
+	head = atomic_load_explicit(&ring->sr_head, memory_order_relaxed);
+	while (len > 0) {
+		tail = atomic_load_explicit(&ring->sr_tail,
+		    memory_order_acquire);
+		if (!shm_ring_valid(conn, head, tail))
+			return (-1);
+
+		room = (size_t)(conn->shc_ring_size - (head - tail));
+		if (room == 0) {
+			/* Let the reader drain what's there before waiting */
+			shm_kick(&ring->sr_reader_parked,
+			    conn->shc_tx_bells[SHM_BELL_DATA]);
+			if (shm_wait(conn, ring, &ring->sr_tail, tail,
+			    &ring->sr_writer_parked,
+			    conn->shc_tx_bells[SHM_BELL_SPACE],
+			    &conn->shc_tx_spin) != 0)
+				return (-1);
+
+			continue;
+		}
+
+		chunk = MIN(len, room);
+		off = (size_t)(head & mask);
+		first = MIN(chunk, (size_t)conn->shc_ring_size - off);
+		memcpy(conn->shc_tx_data + off, buf, first);
+		memcpy(conn->shc_tx_data, (const char *)buf + first,
+		    chunk - first);
+
+		head += chunk;
+		buf = (const char *)buf + chunk;
+		len -= chunk;
+		atomic_store_explicit(&ring->sr_head, head,
+		    memory_order_release);
+	}
+
+	return (0);
+}
+
+static int
+shm_ring_read(struct shm_connection *conn, void *buf, size_t len)
+{
+	struct shm_ring *ring = conn->shc_rx;
+	uint64_t mask = conn->shc_ring_size - 1;
+	uint64_t head;
+	uint64_t tail;
+	size_t avail;
+	size_t chunk;
+	size_t first;
+	size_t off;
+
+	tail = atomic_load_explicit(&ring->sr_tail, memory_order_relaxed);
+	while (len > 0) {
+		head = atomic_load_explicit(&ring->sr_head,
+		    memory_order_acquire);
+		if (!shm_ring_valid(conn, head, tail))
+			return (-1);
+
+		avail = (size_t)(head - tail);
+		if (avail == 0) {
+			if (shm_wait(conn, ring, &ring->sr_head, head,
+			    &ring->sr_reader_parked,
+			    conn->shc_rx_bells[SHM_BELL_DATA],
+			    &conn->shc_rx_spin) != 0)
+				return (-1);
+
+			continue;
+		}
+
+		chunk = MIN(len, avail);
+		off = (size_t)(tail & mask);
+		first = MIN(chunk, (size_t)conn->shc_ring_size - off);
+		memcpy(buf, conn->shc_rx_data + off, first);
+		memcpy((char *)buf + first, conn->shc_rx_data, chunk - first);
+
+		tail += chunk;
+		buf = (char *)buf + chunk;
+		len -= chunk;
+		atomic_store_explicit(&ring->sr_tail, tail,
+		    memory_order_release);
+		shm_kick(&ring->sr_writer_parked,
+		    conn->shc_rx_bells[SHM_BELL_SPACE]);
+	}
+
+	return (0);
+}
+
+static int
+shm_send_fds(struct shm_connection *conn, const void *data, size_t len,
+    const int *fds, size_t nfds)
+{
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char *control;
+	ssize_t ret;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	control = g_alloca(CMSG_SPACE(nfds * sizeof(int)));
+	memset(control, 0, CMSG_SPACE(nfds * sizeof(int)));
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	do
+		ret = sendmsg(conn->shc_sock, &msg, MSG_NOSIGNAL);
+	while (ret < 0 && errno == EINTR);
+
+	return (ret == (ssize_t)len ? 0 : -1);
+}
+
+/*
+ * Receives exactly len bytes and up to nfds descriptors sent along with
+ * them. Returns the number of descriptors received or -1.
+ */
+static int
+shm_recv_fds(struct shm_connection *conn, void *data, size_t len, int *fds,
+    size_t nfds)
+{
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char *control;
+	size_t count = 0;
+	ssize_t ret;
+
+	if (nfds > SHM_MAX_FDS) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	control = g_alloca(CMSG_SPACE(nfds * sizeof(int)));
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+	do
+		ret = recvmsg(conn->shc_sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	while (ret < 0 && errno == EINTR);
+
+	if (ret != (ssize_t)len)
+		return (-1);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), MIN(count, nfds) * sizeof(int));
+	}
+
+	return ((int)MIN(count, nfds));
+}
+
+/*
+ * Sends a number of frames. Descriptors, if any, belong to the first
+ * frame; they go over the socket before the frame enters the ring, so
+ * the reader always finds them waiting.
+ */
+static int
+shm_send_batch(void *arg, const struct iovec *vec, const size_t *frame_niov,
+    size_t nframes, const int *fds, size_t nfds)
+{
+	struct shm_connection *conn = arg;
+	uint32_t header[4];
+	uint8_t marker = 0;
+	size_t i, j;
+	int ret = 0;
+
+	g_mutex_lock(&conn->shc_send_mtx);
+	if (nfds > 0 && shm_send_fds(conn, &marker, sizeof(marker), fds,
+	    nfds) != 0) {
+		conn->shc_parent->rco_error = rpc_error_create(errno,
+		    "Cannot pass descriptors", NULL);
+		ret = -1;
+		goto done;
+	}
+
+	for (i = 0; i < nframes; i++) {
+		header[0] = SHM_FRAME_MAGIC;
+		header[1] = 0;
+		header[2] = i == 0 ? (uint32_t)nfds : 0;
+		header[3] = 0;
+		for (j = 0; j < frame_niov[i]; j++)
+			header[1] += (uint32_t)vec[j].iov_len;
+
+		if (shm_ring_write(conn, header, sizeof(header)) != 0)
+			goto fail;
+
+		for (j = 0; j < frame_niov[i]; j++) {
+			if (shm_ring_write(conn, vec->iov_base,
+			    vec->iov_len) != 0)
+				goto fail;
+
+			vec++;
+		}
+	}
+
+	shm_kick(&conn->shc_tx->sr_reader_parked,
+	    conn->shc_tx_bells[SHM_BELL_DATA]);
+	goto done;
+
+fail:
+	conn->shc_parent->rco_error = rpc_error_create(ECONNRESET,
+	    "Connection terminated", NULL);
+	ret = -1;
+done:
+	g_mutex_unlock(&conn->shc_send_mtx);
+	return (ret);
+}
+
+static int
+shm_send_msgv(void *arg, const struct iovec *vec, size_t nvec,
+    const int *fds, size_t nfds)
+{
+
+	return (shm_send_batch(arg, vec, &nvec, 1, fds, nfds));
+}
+
+static int
+shm_send_msg(void *arg, const void *buf, size_t size, const int *fds,
+    size_t nfds)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+
+	return (shm_send_msgv(arg, &iov, 1, fds, nfds));
+}
+
+static void *
+shm_reader(void *arg)
+{
+	struct shm_connection *conn = arg;
+	uint32_t header[4];
+	uint8_t marker;
+	void *frame;
+	int *fds;
+	int nfds;
+
+	for (;;) {
+		if (shm_ring_read(conn, header, sizeof(header)) != 0)
+			break;
+
+		if (header[0] != SHM_FRAME_MAGIC)
+			break;
+
+		/* The header is in memory the peer can write to */
+		if (header[1] > conn->shc_max_frame ||
+		    header[2] > SHM_MAX_FDS) {
+			conn->shc_parent->rco_error = rpc_error_create(
+			    EMSGSIZE, "Frame too large",
+			    rpc_object_pack("{size:u,fds:u,limit:u}",
+			    (uint64_t)header[1], (uint64_t)header[2],
+			    (uint64_t)conn->shc_max_frame));
+			break;
+		}
+
+		frame = rpc_recv_buffer_alloc(header[1]);
+		if (shm_ring_read(conn, frame, header[1]) != 0) {
+			rpc_recv_buffer_release(frame);
+			break;
+		}
+
+		fds = NULL;
+		nfds = 0;
+		if (header[2] > 0) {
+			fds = g_new(int, header[2]);
+			nfds = shm_recv_fds(conn, &marker, sizeof(marker), fds,
+			    header[2]);
+			if (nfds < 0) {
+				rpc_recv_buffer_release(frame);
+				g_free(fds);
+				break;
+			}
+		}
+
+		if (conn->shc_parent->rco_recv_msg(conn->shc_parent, frame,
+		    header[1], fds, (size_t)nfds) != 0) {
+			rpc_recv_buffer_release(frame);
+			g_free(fds);
+			break;
+		}
+
+		rpc_recv_buffer_release(frame);
+		g_free(fds);
+	}
+
+	conn->shc_parent->rco_close(conn->shc_parent);
+	return (NULL);
+}
+
+static int
+shm_abort(void *arg)
+{
+	struct shm_connection *conn = arg;
+	int i, j;
+
+	g_mutex_lock(&conn->shc_abort_mtx);
+	if (conn->shc_aborted) {
+		g_mutex_unlock(&conn->shc_abort_mtx);
+		return (0);
+	}
+
+	conn->shc_aborted = true;
+	g_mutex_unlock(&conn->shc_abort_mtx);
+
+	/* Wake up whoever is parked, on either end */
+	for (i = 0; i < 2; i++) {
+		atomic_store(&conn->shc_region->sr_rings[i].sr_closed, 1);
+		for (j = 0; j < 2; j++)
+			shm_bell_ring(conn->shc_efds[i][j]);
+	}
+
+	shutdown(conn->shc_sock, SHUT_RDWR);
+
+	if (conn->shc_reader != NULL &&
+	    conn->shc_reader != g_thread_self()) {
+		g_thread_join(conn->shc_reader);
+		conn->shc_reader = NULL;
+	}
+
+	return (0);
+}
+
+static int
+shm_get_fd(void *arg)
+{
+	struct shm_connection *conn = arg;
+
+	return (conn->shc_sock);
+}
+
+static void
+shm_free(struct shm_connection *conn)
+{
+	int i, j;
+
+	if (conn->shc_region != NULL)
+		rpc_shmem_unmap(conn->shc_shmem, conn->shc_region);
+
+	if (conn->shc_shmem != NULL) {
+		close(rpc_shmem_get_fd(conn->shc_shmem));
+		rpc_release(conn->shc_shmem);
+	}
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			if (conn->shc_efds[i][j] != -1)
+				close(conn->shc_efds[i][j]);
+		}
+	}
+
+	if (conn->shc_gconn != NULL)
+		g_object_unref(conn->shc_gconn);
+	else if (conn->shc_sock != -1)
+		close(conn->shc_sock);
+
+	g_mutex_clear(&conn->shc_send_mtx);
+	g_mutex_clear(&conn->shc_abort_mtx);
+	g_free(conn);
+}
+
+static void
+shm_release(void *arg)
+{
+
+	shm_free(arg);
+}
+
+static struct shm_connection *
+shm_connection_new(int sock, size_t max_frame)
+{
+	struct shm_connection *conn;
+	int i, j;
+
+	conn = g_malloc0(sizeof(*conn));
+	conn->shc_sock = sock;
+	conn->shc_max_frame = max_frame > 0 ? max_frame : SHM_MAX_FRAME;
+	conn->shc_rx_spin = SHM_SPIN_MIN;
+	conn->shc_tx_spin = SHM_SPIN_MIN;
+	g_mutex_init(&conn->shc_send_mtx);
+	g_mutex_init(&conn->shc_abort_mtx);
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++)
+			conn->shc_efds[i][j] = -1;
+	}
+
+	return (conn);
+}
+
+/*
+ * Points the connection at its rings: the client sends on the first
+ * one and the server on the second one.
+ */
+static void
+shm_connection_attach(struct shm_connection *conn, bool server)
+{
+	char *data;
+	int tx = server ? SHM_RING_S2C : SHM_RING_C2S;
+	int rx = server ? SHM_RING_C2S : SHM_RING_S2C;
+
+	data = (char *)conn->shc_region +
+	    (shm_region_size(conn->shc_ring_size) - 2 * conn->shc_ring_size);
+
+	conn->shc_tx = &conn->shc_region->sr_rings[tx];
+	conn->shc_rx = &conn->shc_region->sr_rings[rx];
+	conn->shc_tx_data = data + tx * conn->shc_ring_size;
+	conn->shc_rx_data = data + rx * conn->shc_ring_size;
+	memcpy(conn->shc_tx_bells, conn->shc_efds[tx], sizeof(int) * 2);
+	memcpy(conn->shc_rx_bells, conn->shc_efds[rx], sizeof(int) * 2);
+}
+
+static void
+shm_connection_setup(struct shm_connection *conn, struct rpc_connection *rco)
+{
+
+	conn->shc_parent = rco;
+	rco->rco_send_msg = shm_send_msg;
+	rco->rco_send_msgv = shm_send_msgv;
+	rco->rco_send_batch = shm_send_batch;
+	rco->rco_abort = shm_abort;
+	rco->rco_get_fd = shm_get_fd;
+	rco->rco_release = shm_release;
+	rco->rco_arg = conn;
+}
+
+static const char *
+shm_parse_uri(const char *uri)
+{
+
+	if (!g_str_has_prefix(uri, "shm://") || uri[6] == '\0') {
+		rpc_set_last_errorf(EINVAL, "Cannot parse URI");
+		return (NULL);
+	}
+
+	return (uri + 6);
+}
+
+static int
+shm_connect(struct rpc_connection *rco, const char *uri, rpc_object_t args)
+{
+	struct shm_connection *conn;
+	struct shm_hello hello;
+	struct sockaddr_un sun = { 0 };
+	struct timeval tv = { .tv_sec = SHM_HANDSHAKE_TIMEOUT };
+	const char *path;
+	int64_t ring_size = SHM_RING_SIZE;
+	int64_t max_frame = 0;
+	int fds[SHM_NFDS];
+	uint8_t ack;
+	int sock;
+	int i, j;
+
+	/* Params may be a dictionary: {"ring_size": int, "max_frame": int} */
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY)
+		rpc_object_unpack(args, "{ring_size:i,max_frame:i}", &ring_size,
+		    &max_frame);
+
+	if (ring_size < SHM_RING_SIZE_MIN || (ring_size & (ring_size - 1))) {
+		rpc_set_last_errorf(EINVAL,
+		    "Ring size has to be a power of two, at least %d",
+		    SHM_RING_SIZE_MIN);
+		return (-1);
+	}
+
+	path = shm_parse_uri(uri);
+	if (path == NULL)
+		return (-1);
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		rpc_set_last_errorf(ENAMETOOLONG, "Socket path too long");
+		return (-1);
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		rpc_set_last_errorf(errno, "Cannot create socket");
+		return (-1);
+	}
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		rpc_set_last_errorf(errno, "Cannot connect to %s", path);
+		close(sock);
+		return (-1);
+	}
+
+	conn = shm_connection_new(sock,
+	    max_frame > 0 ? (size_t)max_frame : 0);
+	conn->shc_ring_size = (uint64_t)ring_size;
+	conn->shc_region_size = shm_region_size(conn->shc_ring_size);
+	conn->shc_shmem = rpc_shmem_create(conn->shc_region_size);
+	if (conn->shc_shmem == NULL)
+		goto fail;
+
+	conn->shc_region = rpc_shmem_map(conn->shc_shmem);
+	if (conn->shc_region == MAP_FAILED) {
+		conn->shc_region = NULL;
+		goto fail;
+	}
+
+	conn->shc_region->sr_magic = SHM_MAGIC;
+	conn->shc_region->sr_version = SHM_VERSION;
+	conn->shc_region->sr_ring_size = conn->shc_ring_size;
+
+	fds[0] = rpc_shmem_get_fd(conn->shc_shmem);
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			conn->shc_efds[i][j] = eventfd(0,
+			    EFD_CLOEXEC | EFD_NONBLOCK);
+			if (conn->shc_efds[i][j] < 0)
+				goto fail;
+
+			fds[1 + i * 2 + j] = conn->shc_efds[i][j];
+		}
+	}
+
+	hello.sh_magic = SHM_MAGIC;
+	hello.sh_version = SHM_VERSION;
+	hello.sh_ring_size = conn->shc_ring_size;
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (shm_send_fds(conn, &hello, sizeof(hello), fds, SHM_NFDS) != 0)
+		goto fail;
+
+	if (recv(sock, &ack, sizeof(ack), MSG_WAITALL) != sizeof(ack) ||
+	    ack != 0)
+		goto fail;
+
+	tv.tv_sec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	shm_connection_attach(conn, false);
+	shm_connection_setup(conn, rco);
+	conn->shc_reader = g_thread_new("shm reader thread", shm_reader,
+	    conn);
+	return (0);
+
+fail:
+	rpc_set_last_errorf(errno != 0 ? errno : ECONNREFUSED,
+	    "Shared memory handshake failed");
+	shm_free(conn);
+	return (-1);
+}
+
+/*
+ * Takes the region and doorbells a client has passed. Anything else
+ * than exactly what we expect to get is refused, and so is a region
+ * the client could still resize under our mapping.
+ */
+static int
+shm_handshake(struct shm_connection *conn)
+{
+	struct shm_hello hello;
+	struct timeval tv = { .tv_sec = SHM_HANDSHAKE_TIMEOUT };
+	struct stat st;
+	int fds[SHM_NFDS];
+	uint8_t ack = 0;
+	int seals;
+	int nfds;
+	int i;
+
+	setsockopt(conn->shc_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	nfds = shm_recv_fds(conn, &hello, sizeof(hello), fds, SHM_NFDS);
+	if (nfds < 0)
+		return (-1);
+
+	if (nfds != SHM_NFDS || hello.sh_magic != SHM_MAGIC ||
+	    hello.sh_version != SHM_VERSION ||
+	    hello.sh_ring_size < SHM_RING_SIZE_MIN ||
+	    (hello.sh_ring_size & (hello.sh_ring_size - 1)) ||
+	    hello.sh_ring_size > G_MAXSIZE / 4)
+		goto fail;
+
+	conn->shc_ring_size = hello.sh_ring_size;
+	conn->shc_region_size = shm_region_size(conn->shc_ring_size);
+	if (fstat(fds[0], &st) != 0 ||
+	    (size_t)st.st_size < conn->shc_region_size)
+		goto fail;
+
+	seals = fcntl(fds[0], F_GET_SEALS);
+	if (seals < 0 || (seals & SHM_SEALS) != SHM_SEALS)
+		goto fail;
+
+	conn->shc_shmem = rpc_shmem_recreate(fds[0], 0,
+	    conn->shc_region_size);
+	conn->shc_region = rpc_shmem_map(conn->shc_shmem);
+	if (conn->shc_region == MAP_FAILED) {
+		conn->shc_region = NULL;
+		goto fail_mapped;
+	}
+
+	if (conn->shc_region->sr_magic != SHM_MAGIC ||
+	    conn->shc_region->sr_ring_size != conn->shc_ring_size)
+		goto fail_mapped;
+
+	for (i = 0; i < 4; i++)
+		conn->shc_efds[i / 2][i % 2] = fds[1 + i];
+
+	if (send(conn->shc_sock, &ack, sizeof(ack), MSG_NOSIGNAL) !=
+	    sizeof(ack))
+		return (-1);
+
+	tv.tv_sec = 0;
+	setsockopt(conn->shc_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	shm_connection_attach(conn, true);
+	return (0);
+
+fail:
+	close(fds[0]);
+fail_mapped:
+	for (i = 1; i < nfds; i++)
+		close(fds[i]);
+
+	return (-1);
+}
+
+static void
+shm_accept(GObject *source __unused, GAsyncResult *result, void *data)
+{
+	struct shm_server *server = data;
+	struct shm_connection *conn;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	GError *err = NULL;
+	GSocketConnection *gconn;
+	rpc_connection_t rco;
+	rpc_server_t srv = server->ss_server;
+
+	gconn = g_socket_listener_accept_finish(server->ss_listener, result,
+	    NULL, &err);
+	if (err != NULL) {
+		debugf("accept failed");
+		g_error_free(err);
+		if (srv->rs_valid(srv))
+			goto done;
+
+		return;
+	}
+
+	conn = shm_connection_new(g_socket_get_fd(
+	    g_socket_connection_get_socket(gconn)), server->ss_max_frame);
+	conn->shc_gconn = gconn;
+	g_socket_set_blocking(g_socket_connection_get_socket(gconn), true);
+
+	if (shm_handshake(conn) != 0) {
+		debugf("handshake failed");
+		shm_free(conn);
+		goto done;
+	}
+
+	rco = rpc_connection_alloc(srv);
+	shm_connection_setup(conn, rco);
+	rco->rco_endpoint_address = g_strdup("shm");
+
+	if (getsockopt(conn->shc_sock, SOL_SOCKET, SO_PEERCRED, &cred,
+	    &len) == 0 && rco->rco_set_creds != NULL)
+		rco->rco_set_creds(rco, cred.pid, cred.uid, cred.gid);
+
+	if (srv->rs_accept(srv, rco) != 0) {
+		rpc_connection_close(rco); /* will rco_abort, rco_release */
+		goto done;
+	}
+
+	conn->shc_reader = g_thread_new("shm reader thread", shm_reader,
+	    conn);
+
+done:
+	/* Schedule next accept if server isn't closing */
+	g_mutex_lock(&server->ss_mtx);
+	g_cancellable_reset(server->ss_cancellable);
+	g_socket_listener_accept_async(server->ss_listener,
+	    server->ss_cancellable, &shm_accept, data);
+	server->ss_outstanding_accept = true;
+	g_mutex_unlock(&server->ss_mtx);
+}
+
+static int
+shm_teardown(struct rpc_server *srv)
+{
+	struct shm_server *server = srv->rs_arg;
+
+	g_mutex_lock(&server->ss_mtx);
+	if (server->ss_outstanding_accept)
+		g_cancellable_cancel(server->ss_cancellable);
+
+	g_socket_listener_close(server->ss_listener);
+	g_object_unref(server->ss_listener);
+	g_mutex_unlock(&server->ss_mtx);
+
+	unlink(server->ss_path);
+	return (0);
+}
+
+static int
+shm_listen(struct rpc_server *srv, const char *uri, rpc_object_t args)
+{
+	GError *err = NULL;
+	GSocketAddress *addr;
+	struct shm_server *server;
+	const char *path;
+	int64_t mode = 0660;
+	int64_t max_frame = 0;
+
+	/* Params may be a dictionary: {"mode": int, "max_frame": int} */
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY)
+		rpc_object_unpack(args, "{mode:i,max_frame:i}", &mode,
+		    &max_frame);
+
+	path = shm_parse_uri(uri);
+	if (path == NULL) {
+		srv->rs_error = rpc_error_create(ENXIO, "No Such Address",
+		    NULL);
+		return (-1);
+	}
+
+	/* Make sure there's no stale socket file on the filesystem */
+	if (unlink(path) != 0 && errno != ENOENT) {
+		srv->rs_error = rpc_error_create(errno,
+		    "Cannot remove stale socket", NULL);
+		return (-1);
+	}
+
+	server = g_malloc0(sizeof(*server));
+	server->ss_server = srv;
+	server->ss_path = g_strdup(path);
+	server->ss_max_frame = max_frame > 0 ? (size_t)max_frame : 0;
+	server->ss_listener = g_socket_listener_new();
+	g_mutex_init(&server->ss_mtx);
+
+	addr = g_unix_socket_address_new(path);
+	g_socket_listener_add_address(server->ss_listener, addr,
+	    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &err);
+	g_object_unref(addr);
+
+	if (err != NULL) {
+		srv->rs_error = rpc_error_create(err->code, err->message, NULL);
+		g_error_free(err);
+		g_object_unref(server->ss_listener);
+		g_free(server->ss_path);
+		g_free(server);
+		return (-1);
+	}
+
+	chmod(path, (mode_t)mode);
+
+	srv->rs_teardown = shm_teardown;
+	srv->rs_arg = server;
+
+	/* Schedule first accept */
+	server->ss_cancellable = g_cancellable_new();
+
+	g_mutex_lock(&server->ss_mtx);
+	g_socket_listener_accept_async(server->ss_listener,
+	    server->ss_cancellable, &shm_accept, server);
+	server->ss_outstanding_accept = true;
+	g_mutex_unlock(&server->ss_mtx);
+
+	return (0);
+}
+
+static bool
+shm_supports_fd_passing(struct rpc_connection *rco __unused)
+{
+
+	return (true);
+}
+
+DECLARE_TRANSPORT(shm_transport);
@@ -25,11 +25,21 @@
  *
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__linux__)
+#include <linux/vm_sockets.h>
+#endif
 #include <gio/gio.h>
 #ifndef _WIN32
 #include <gio/gunixcredentialsmessage.h>
@@ -37,30 +47,179 @@
 #include <gio/gunixsocketaddress.h>
 #endif
 #include <yuarel.h>
+#if defined(ZSTD_SUPPORT)
+#include <zstd.h>
+#endif
+#if defined(TLS_SUPPORT)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
 #include "../linker_set.h"
 #include "../internal.h"
 
 #define SC_ABORT_TIMEOUT 30
 
+/*
+ * Frame header flags, in header[2]. Every frame sent by a peer able to
+ * decompress carries SOCKET_HDR_ZSTD_OK, so compression is negotiated
+ * without an extra round trip. A compressed frame has SOCKET_HDR_ZSTD
+ * set and its uncompressed length in header[3]. The compressed frames
+ * of a connection form a single zstd stream, so that later frames are
+ * compressed against the keys and type markers seen in earlier ones.
+ */
+#define	SOCKET_HDR_ZSTD_OK	0x1
+#define	SOCKET_HDR_ZSTD		0x2
+#define	SOCKET_COMPRESS_MIN	512
+
+#if defined(ZSTD_SUPPORT)
+#define	SOCKET_HDR_FLAGS	SOCKET_HDR_ZSTD_OK
+#else
+#define	SOCKET_HDR_FLAGS	0
+#endif
+
+/*
+ * unix+seq:// uses a SOCK_SEQPACKET socket instead, which keeps record
+ * boundaries. Each frame is then sent as a record of its own, without
+ * the header, and read back with a single recvmsg() once its size is
+ * known. There is no compression in this mode, and a frame can't be
+ * larger than the socket send buffer.
+ */
+#define	SOCKET_SEQ_SCHEME	"unix+seq"
+
+/*
+ * vsock://(cid):(port) talks AF_VSOCK between a VM and its host, with
+ * the same framing as tcp://. The context ID may also be "any" (for
+ * listening) or "host".
+ */
+#define	SOCKET_VSOCK_SCHEME	"vsock"
+#if defined(__linux__) && defined(AF_VSOCK)
+#define	SOCKET_VSOCK
+#endif
+
+/*
+ * tcp+tls:// is tcp:// with TLS. The handshake is done by OpenSSL, which
+ * then hands the record layer over to the kernel (kTLS) if it can, in
+ * which case frames are sent and received through the plain socket code
+ * path. Otherwise records go through SSL_read() and SSL_write(). The
+ * handshake of an incoming connection happens on the accepting thread,
+ * so it's bounded by SOCKET_TLS_TIMEOUT.
+ */
+#define	SOCKET_TLS_SCHEME	"tcp+tls"
+#define	SOCKET_TLS_TIMEOUT	10
+
+/*
+ * Opt-in low latency profile ("low_latency" param): TCP_NODELAY and
+ * TCP_QUICKACK on TCP sockets, SO_BUSY_POLL for "busy_poll" us, and a
+ * reader that polls the socket for as long before blocking on it. The
+ * reader thread can also be pinned to a CPU ("cpu" param).
+ *
+ * Servers can keep their threads on a set of CPUs ("cpus" param, in
+ * the kernel's CPU list notation): accept threads and reader threads
+ * not pinned with "cpu" stay within it. "io_cpus" does the same for the
+ * shared I/O threads of the event loop mode, one CPU per thread, so
+ * that with "listeners" and io_uring, each shard keeps to its own core.
+ * The I/O threads are shared by the whole process, so it's the first
+ * event loop server that gets to place them.
+ */
+#define	SOCKET_BUSY_POLL	50
+
+/*
+ * Batches are sent in chunks of at most SOCKET_BATCH_FRAMES frames and
+ * IOV_MAX vectors, so that each chunk fits in a single sendmsg() and
+ * its vectors on the stack. A frame with more vectors than that goes
+ * out alone, IOV_MAX vectors at a time (or flattened, as a record).
+ */
+#define	SOCKET_BATCH_FRAMES	64
+#if !defined(IOV_MAX)
+#define	IOV_MAX			1024
+#endif
+
 static GSocketAddress *socket_parse_uri(const char *);
+static GSocketType socket_uri_type(const char *);
+static int socket_vsock_open(const char *, bool);
+static gssize socket_receive(struct socket_connection *, GInputVector *, gint,
+    GSocketControlMessage ***, gint *, GCancellable *, GError **);
+#if defined(TLS_SUPPORT)
+static char *socket_uri_host(const char *);
+static const char *socket_tls_error(void);
+static SSL_CTX *socket_tls_context(rpc_object_t, bool);
+static SSL *socket_tls_handshake(GSocket *, SSL_CTX *, const char *,
+    GError **);
+static void socket_tls_attach(struct socket_connection *, SSL *);
+static int socket_tls_write(struct socket_connection *, const GOutputVector *,
+    size_t, size_t);
+static gssize socket_tls_read(struct socket_connection *, GInputVector *, gint,
+    GCancellable *, GError **);
+#endif
+static bool socket_is_vsock(GSocket *);
+static char *socket_vsock_peer(GSocket *);
 static int socket_connect(struct rpc_connection *, const char *, rpc_object_t);
 static int socket_listen(struct rpc_server *, const char *, rpc_object_t);
 static int socket_send_msg(void *, const void *, size_t, const int *, size_t);
+static int socket_send_msgv(void *, const struct iovec *, size_t, const int *,
+    size_t);
+static int socket_send_batch(void *, const struct iovec *, const size_t *,
+    size_t, const int *, size_t);
 static int socket_teardown(struct rpc_server *);
+static int socket_stop_accepting(struct rpc_server *);
+static int socket_handover(struct rpc_server *, GArray *);
+static int socket_adopt(struct rpc_server *, int, rpc_object_t);
+static int socket_detach(void *);
 static int socket_abort(void *);
 static int socket_get_fd(void *);
 static void socket_release(void *);
 static void *socket_reader(void *);
+static void socket_process_cmsgs(struct socket_connection *,
+    GSocketControlMessage **, int, int **, size_t *);
+static bool socket_mux_read(void *);
+static bool socket_mux_read_records(struct socket_connection *);
+static int socket_start_reader(struct socket_connection *, bool, guint,
+    const GArray *, rpc_iomux_backend_t, int);
+static void socket_listener_event(GSocketListener *, GSocketListenerEvent,
+    GSocket *, gpointer);
+static struct socket_connection *socket_server_connection(
+    struct socket_server *, GSocketConnection *);
+static int socket_serve_connection(struct socket_server *,
+    struct socket_connection *, int, rpc_object_t);
+static int socket_accept_connection(struct socket_server *,
+    GSocketConnection *, int);
+static void *socket_accept_worker(void *);
+static int socket_listen_sharded(struct socket_server *, GSocketAddress *,
+    guint, GError **);
+static void socket_free_listeners(struct socket_server *);
 static gboolean socket_abort_timeout(gpointer user_data);
 static bool socket_supports_fd_passing(struct rpc_connection *);
+static void socket_set_low_latency(struct socket_connection *, bool,
+    int64_t, int64_t);
+static void socket_quickack(struct socket_connection *);
+static void socket_spin(struct socket_connection *);
+static void socket_set_compress(struct socket_connection *, bool);
+static int socket_check_length(struct socket_connection *, const uint32_t *);
+static int socket_check_size(struct socket_connection *, size_t);
+static int socket_send_chunk(struct socket_connection *,
+    const struct iovec *, const size_t *, size_t, const int *, size_t);
+static int socket_send_records(struct socket_connection *,
+    const struct iovec *, const size_t *, size_t, const int *, size_t);
+static bool socket_detached(struct socket_connection *, GError *);
+static ssize_t socket_recv_record(struct socket_connection *, void **, int **,
+    size_t *, GCancellable *, GError **);
+#if defined(ZSTD_SUPPORT)
+static int socket_deflate(struct socket_connection *, const struct iovec *,
+    size_t, size_t, void **, size_t *);
+#endif
+static int socket_inflate(struct socket_connection *, const uint32_t *,
+    void **, size_t *);
 
 static const struct rpc_transport socket_transport = {
 	.name = "socket",
-	.schemas = {"unix", "tcp", "socket", NULL},
+	.schemas = {"unix", SOCKET_SEQ_SCHEME, "tcp", SOCKET_TLS_SCHEME,
+	    SOCKET_VSOCK_SCHEME, "socket", NULL},
 	.connect = socket_connect,
 	.listen = socket_listen,
 	.is_fd_passing = socket_supports_fd_passing,
-	.flags = RPC_TRANSPORT_FD_PASSING | RPC_TRANSPORT_CREDENTIALS
+	.flags = RPC_TRANSPORT_FD_PASSING | RPC_TRANSPORT_CREDENTIALS |
+	    RPC_TRANSPORT_POOLED_RECV
 };
 
 struct socket_server
@@ -71,6 +230,36 @@ struct socket_server
 	GCancellable *			ss_cancellable;
 	GMutex 				ss_mtx;
 	bool				ss_outstanding_accept;
+	bool				ss_stopped;
+	bool				ss_event_loop;
+	guint				ss_io_threads;
+	rpc_iomux_backend_t		ss_io_backend;
+	bool				ss_compress;
+	size_t				ss_max_frame;
+	bool				ss_low_latency;
+	int64_t				ss_busy_poll;
+	int64_t				ss_cpu;
+	GArray *			ss_cpus;
+	GArray *			ss_io_cpus;
+#if defined(TLS_SUPPORT)
+	SSL_CTX *			ss_tls_ctx;
+#endif
+	GPtrArray *			ss_listeners;
+	GPtrArray *			ss_sockets;	/* listening */
+};
+
+/*
+ * One of several SO_REUSEPORT sockets bound to the same address, with
+ * a thread of its own accepting on it. The kernel spreads incoming
+ * connections over them, and each one hands its connections over to the
+ * I/O shard of the same index.
+ */
+struct socket_listener
+{
+	struct socket_server *		sl_server;
+	GSocket *			sl_socket;
+	GThread *			sl_thread;
+	int				sl_shard;
 };
 
 struct socket_connection
@@ -82,9 +271,44 @@ struct socket_connection
 	struct rpc_connection *		sc_parent;
 	GMutex 				sc_abort_mtx;
 	bool				sc_aborted;
+	volatile gint			sc_detaching;
+	bool				sc_detached;
 	GCancellable *			sc_cancellable;
 	GSource *			sc_abort_timeout;
 	bool				sc_creds_sent;
+	bool				sc_seqpacket;
+	size_t				sc_max_frame;
+
+	/* Low latency profile */
+	bool				sc_quickack;
+	gint64				sc_spin;
+	int				sc_cpu;
+	GArray *			sc_cpus;
+
+	/* Event loop mode */
+	struct rpc_iomux_handle *	sc_mux;
+	uint32_t			sc_header[4];
+	void *				sc_frame;
+	size_t				sc_done;
+	int *				sc_fds;
+	size_t				sc_nfds;
+
+#if defined(TLS_SUPPORT)
+	/* TLS; sc_tls_tx/rx are set if kTLS doesn't cover that direction */
+	SSL *				sc_ssl;
+	GMutex				sc_tls_mtx;
+	bool				sc_tls_tx;
+	bool				sc_tls_rx;
+#endif
+
+#if defined(ZSTD_SUPPORT)
+	/* Frame compression */
+	bool				sc_compress;
+	volatile int			sc_peer_zstd;
+	GMutex				sc_zstd_mtx;
+	ZSTD_CCtx *			sc_cctx;
+	ZSTD_DCtx *			sc_dctx;
+#endif
 };
 
 static GSocketAddress *
@@ -111,7 +335,16 @@ socket_parse_uri(const char *uri_string)
 		return (NULL);
 	}
 
-	if (!g_strcmp0(uri.scheme, "tcp")) {
+#if !defined(TLS_SUPPORT)
+	if (!g_strcmp0(uri.scheme, SOCKET_TLS_SCHEME)) {
+		g_free(uri_copy);
+		rpc_set_last_errorf(ENOTSUP, "Built without TLS support");
+		return (NULL);
+	}
+#endif
+
+	if (!g_strcmp0(uri.scheme, "tcp") ||
+	    !g_strcmp0(uri.scheme, SOCKET_TLS_SCHEME)) {
 
 		resolver = g_resolver_get_default();
 		addresses = g_resolver_lookup_by_name(resolver, uri.host,
@@ -135,7 +368,8 @@ socket_parse_uri(const char *uri_string)
 	}
 
 #ifndef _WIN32
-	if (!g_strcmp0(uri.scheme, "unix")) {
+	if (!g_strcmp0(uri.scheme, "unix") ||
+	    !g_strcmp0(uri.scheme, SOCKET_SEQ_SCHEME)) {
 
 		if (uri.host == NULL)
 			return (NULL);
@@ -152,16 +386,136 @@ done:
 	return (addr);
 }
 
+static GSocketType
+socket_uri_type(const char *uri)
+{
+
+	if (g_str_has_prefix(uri, SOCKET_SEQ_SCHEME ":"))
+		return (G_SOCKET_TYPE_SEQPACKET);
+
+	return (G_SOCKET_TYPE_STREAM);
+}
+
+#if defined(TLS_SUPPORT)
+static char *
+socket_uri_host(const char *uri_string)
+{
+	struct yuarel uri;
+	char *uri_copy = g_strdup(uri_string);
+	char *host = NULL;
+
+	if (yuarel_parse(&uri, uri_copy) == 0)
+		host = g_strdup(uri.host);
+
+	g_free(uri_copy);
+	return (host);
+}
+#endif
+
+/*
+ * GIO has no idea of AF_VSOCK addresses, so vsock sockets get connected
+ * (or bound and put into listening mode) here and then handed over to
+ * GSocket as if they were passed in by descriptor. Returns -1 with
+ * errno set on failure.
+ */
+static int
+socket_vsock_open(const char *uri_string, bool server)
+{
+#if defined(SOCKET_VSOCK)
+	struct sockaddr_vm svm;
+	struct yuarel uri;
+	char *uri_copy = g_strdup(uri_string);
+	char *end;
+	int error;
+	int fd;
+
+	if (yuarel_parse(&uri, uri_copy) != 0 || uri.host == NULL ||
+	    uri.port <= 0) {
+		g_free(uri_copy);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	memset(&svm, 0, sizeof(svm));
+	svm.svm_family = AF_VSOCK;
+	svm.svm_port = (unsigned int)uri.port;
+
+	if (!g_strcmp0(uri.host, "any"))
+		svm.svm_cid = VMADDR_CID_ANY;
+	else if (!g_strcmp0(uri.host, "host"))
+		svm.svm_cid = VMADDR_CID_HOST;
+	else {
+		svm.svm_cid = (unsigned int)strtoul(uri.host, &end, 10);
+		if (*end != '\0') {
+			g_free(uri_copy);
+			errno = EINVAL;
+			return (-1);
+		}
+	}
+
+	g_free(uri_copy);
+
+	fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return (-1);
+
+	if (server) {
+		if (bind(fd, (struct sockaddr *)&svm, sizeof(svm)) == 0 &&
+		    listen(fd, SOMAXCONN) == 0)
+			return (fd);
+	} else if (connect(fd, (struct sockaddr *)&svm, sizeof(svm)) == 0)
+		return (fd);
+
+	error = errno;
+	close(fd);
+	errno = error;
+	return (-1);
+#else
+	(void)uri_string;
+	(void)server;
+	errno = ENOTSUP;
+	return (-1);
+#endif
+}
+
+static bool
+socket_is_vsock(GSocket *sock)
+{
+#if defined(SOCKET_VSOCK)
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(g_socket_get_fd(sock), (struct sockaddr *)&ss,
+	    &len) == 0)
+		return (ss.ss_family == AF_VSOCK);
+#else
+	(void)sock;
+#endif
+	return (false);
+}
+
+static char *
+socket_vsock_peer(GSocket *sock)
+{
+#if defined(SOCKET_VSOCK)
+	struct sockaddr_vm svm;
+	socklen_t len = sizeof(svm);
+
+	if (getpeername(g_socket_get_fd(sock), (struct sockaddr *)&svm,
+	    &len) == 0 && svm.svm_family == AF_VSOCK)
+		return (g_strdup_printf("vsock:%u", svm.svm_cid));
+#else
+	(void)sock;
+#endif
+	return (NULL);
+}
+
 static void
 socket_accept(GObject *source __unused, GAsyncResult *result, void *data)
 {
 	struct socket_server *server = data;
-	struct socket_connection *conn = NULL;
-	char *remote_addr = NULL;
 	GError *err = NULL;
 	GSocketConnection *gconn;
-	GSocketAddress *remote;
-	rpc_connection_t rco = NULL;
 	rpc_server_t srv = server->ss_server;
 
 	gconn = g_socket_listener_accept_finish(server->ss_listener, result,
@@ -175,18 +529,155 @@ socket_accept(GObject *source __unused, GAsyncResult *result, void *data)
 		return;
 	}
 
+	if (socket_accept_connection(server, gconn, -1) != 0)
+		return;
+
+done:
+	/* Schedule next accept if server isn't closing */
+	g_mutex_lock(&server->ss_mtx);
+	if (server->ss_stopped) {
+		server->ss_outstanding_accept = false;
+		g_mutex_unlock(&server->ss_mtx);
+		return;
+	}
+
+	g_cancellable_reset (server->ss_cancellable);
+	g_socket_listener_accept_async(server->ss_listener,
+	    server->ss_cancellable, &socket_accept, data);
+	server->ss_outstanding_accept = true;
+	g_mutex_unlock(&server->ss_mtx);
+}
+
+static void *
+socket_accept_worker(void *arg)
+{
+	struct socket_listener *sl = arg;
+	struct socket_server *server = sl->sl_server;
+	rpc_server_t srv = server->ss_server;
+	GSocketConnection *gconn;
+	GSocket *sock;
+	GError *err = NULL;
+	bool cancelled;
+
+	if (server->ss_cpus != NULL && rpc_thread_bind(server->ss_cpus) != 0)
+		debugf("Couldn't pin accept thread to the server's CPUs");
+
+	for (;;) {
+		sock = g_socket_accept(sl->sl_socket, server->ss_cancellable,
+		    &err);
+		if (sock == NULL) {
+			debugf("accept failed: %s", err->message);
+			cancelled = g_error_matches(err, G_IO_ERROR,
+			    G_IO_ERROR_CANCELLED);
+			g_clear_error(&err);
+			if (cancelled || !srv->rs_valid(srv))
+				break;
+
+			continue;
+		}
+
+		gconn = g_socket_connection_factory_create_connection(sock);
+		g_object_unref(sock);
+
+		if (socket_accept_connection(server, gconn, sl->sl_shard) != 0)
+			break;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Sets up a freshly accepted connection. Returns -1 if the server is
+ * going away and no more connections should be accepted.
+ */
+static int
+socket_accept_connection(struct socket_server *server,
+    GSocketConnection *gconn, int shard)
+{
+	struct socket_connection *conn;
+	GError *err = NULL;
+	rpc_server_t srv = server->ss_server;
+#if defined(TLS_SUPPORT)
+	SSL *ssl = NULL;
+#endif
+
 #if defined(__linux__)
 	if (!g_socket_set_option(g_socket_connection_get_socket(gconn),
 	    SOL_SOCKET, SO_PASSCRED, true, &err)) {
 		g_error_free(err);
-		if (srv->rs_valid(srv))
-			goto done;
+		g_object_unref(gconn);
+		return (srv->rs_valid(srv) ? 0 : -1);
+	}
+#endif
 
-		return;
+#if defined(TLS_SUPPORT)
+	if (server->ss_tls_ctx != NULL) {
+		ssl = socket_tls_handshake(
+		    g_socket_connection_get_socket(gconn),
+		    server->ss_tls_ctx, NULL, &err);
+		if (ssl == NULL) {
+			debugf("TLS handshake failed: %s", err->message);
+			g_error_free(err);
+			g_object_unref(gconn);
+			return (srv->rs_valid(srv) ? 0 : -1);
+		}
 	}
 #endif
 
-	remote = g_socket_connection_get_remote_address(gconn, NULL);
+	conn = socket_server_connection(server, gconn);
+
+	/* There are no credentials to pass over vsock */
+	conn->sc_creds_sent = socket_is_vsock(conn->sc_socket);
+
+#if defined(TLS_SUPPORT)
+	if (ssl != NULL)
+		socket_tls_attach(conn, ssl);
+#endif
+
+	return (socket_serve_connection(server, conn, shard, NULL));
+}
+
+static struct socket_connection *
+socket_server_connection(struct socket_server *server,
+    GSocketConnection *gconn)
+{
+	struct socket_connection *conn;
+
+	conn = g_malloc0(sizeof(*conn));
+
+	debugf("new connection %p", conn);
+	conn->sc_conn = gconn;
+	conn->sc_socket = g_object_ref(g_socket_connection_get_socket(gconn));
+	conn->sc_seqpacket = g_socket_get_socket_type(conn->sc_socket) ==
+	    G_SOCKET_TYPE_SEQPACKET;
+	g_mutex_init(&conn->sc_abort_mtx);
+	socket_set_compress(conn, server->ss_compress && !conn->sc_seqpacket);
+	conn->sc_max_frame = server->ss_max_frame;
+
+	socket_set_low_latency(conn, server->ss_low_latency,
+	    server->ss_busy_poll, server->ss_cpu);
+	if (server->ss_cpus != NULL)
+		conn->sc_cpus = g_array_ref(server->ss_cpus);
+
+	return (conn);
+}
+
+/*
+ * Hands a connection over to the server and starts reading from it.
+ * A connection taken over from another process has its state loaded
+ * before the first frame is read. Returns -1 if the server didn't take
+ * the connection.
+ */
+static int
+socket_serve_connection(struct socket_server *server,
+    struct socket_connection *conn, int shard, rpc_object_t state)
+{
+	char *remote_addr = NULL;
+	GSocketAddress *remote;
+	rpc_connection_t rco;
+	rpc_server_t srv = server->ss_server;
+
+	remote = g_socket_connection_get_remote_address(conn->sc_conn, NULL);
 	if (remote != NULL) {
 		if (G_IS_INET_SOCKET_ADDRESS(remote)) {
 			remote_addr = g_inet_address_to_string(
@@ -198,51 +689,129 @@ socket_accept(GObject *source __unused, GAsyncResult *result, void *data)
 			remote_addr = g_strdup("unix");
 	}
 
-	conn = g_malloc0(sizeof(*conn));
-
-	debugf("new connection %p", conn);
-	conn->sc_conn = gconn;
-	conn->sc_socket = g_object_ref(g_socket_connection_get_socket(gconn));
-	g_mutex_init(&conn->sc_abort_mtx);
+	if (remote_addr == NULL)
+		remote_addr = socket_vsock_peer(conn->sc_socket);
 
 	rco = rpc_connection_alloc(srv);
 	rco->rco_send_msg = socket_send_msg;
+	rco->rco_send_msgv = socket_send_msgv;
+	rco->rco_send_batch = socket_send_batch;
 	rco->rco_get_fd = socket_get_fd;
+	rco->rco_detach = socket_detach;
 	rco->rco_arg = conn;
 	conn->sc_parent = rco;
 	rco->rco_release = socket_release;
 	rco->rco_abort = socket_abort;
 	rco->rco_endpoint_address = remote_addr;
 
-	if (srv->rs_accept(srv, rco) == 0) {
-		conn->sc_cancellable = g_cancellable_new ();
-		conn->sc_reader_thread = g_thread_new("socket reader thread",
-		    socket_reader, (gpointer)conn);
-	} else {
+	if (srv->rs_accept(srv, rco) != 0) {
 		rpc_connection_close(rco); /* will rco_abort, rco_release */
-		return;
+		return (-1);
 	}
-done:
-	/* Schedule next accept if server isn't closing */
-	g_mutex_lock(&server->ss_mtx);
-	g_cancellable_reset (server->ss_cancellable);
-	g_socket_listener_accept_async(server->ss_listener,
-	    server->ss_cancellable, &socket_accept, data);
-	server->ss_outstanding_accept = true;
-	g_mutex_unlock(&server->ss_mtx);
+
+	if (state != NULL && rpc_connection_import_state(rco, state) != 0) {
+		rpc_connection_close(rco);
+		return (-1);
+	}
+
+	conn->sc_cancellable = g_cancellable_new ();
+	if (socket_start_reader(conn, server->ss_event_loop,
+	    server->ss_io_threads, server->ss_io_cpus, server->ss_io_backend,
+	    shard) != 0)
+		rpc_connection_close(rco);
+
+	return (0);
+}
+
+/*
+ * Takes over a connection another process was serving, along with the
+ * state it exported, and owns fd from then on. The peer's credentials
+ * come with the state and the handshake is long done, so neither is
+ * redone here.
+ */
+static int
+socket_adopt(struct rpc_server *srv, int fd, rpc_object_t state)
+{
+	struct socket_server *server = srv->rs_arg;
+	struct socket_connection *conn;
+	GSocketConnection *gconn;
+	GSocket *sock;
+	GError *err = NULL;
+
+	sock = g_socket_new_from_fd(fd, &err);
+	if (sock == NULL) {
+		rpc_set_last_gerror(err);
+		g_error_free(err);
+		close(fd);
+		return (-1);
+	}
+
+	gconn = g_socket_connection_factory_create_connection(sock);
+	g_object_unref(sock);
+
+	conn = socket_server_connection(server, gconn);
+	conn->sc_creds_sent = true;
+
+	if (socket_serve_connection(server, conn, -1, state) != 0) {
+		rpc_set_last_errorf(ECONNABORTED,
+		    "Server didn't take the connection");
+		return (-1);
+	}
+
+	return (0);
 }
 
 int
 socket_connect(struct rpc_connection *rco, const char *uri,
-    rpc_object_t args __unused)
+    rpc_object_t args)
 {
 	GError *err = NULL;
 	GSocket *sock = NULL;
 	GSocketAddress *addr = NULL;
 	struct socket_connection *conn;
+	rpc_object_t tls = NULL;
+	bool compress = false;
+	bool low_latency = false;
+	bool shared_loop = false;
+	int64_t busy_poll = SOCKET_BUSY_POLL;
+	int64_t cpu = -1;
+	int64_t max_frame = 0;
+	int64_t affinity = -1;
+	int fd = -1;
+#if defined(TLS_SUPPORT)
+	SSL_CTX *ctx;
+	SSL *ssl = NULL;
+	char *host;
+#endif
 
-	if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD) {
-		sock = g_socket_new_from_fd(rpc_fd_get_value(args), &err);
+	/*
+	 * Besides a bare descriptor, params may be a dictionary:
+	 * {"fd": fd, "compress": bool, "max_frame": int, "tls": dict,
+	 * "low_latency": bool, "busy_poll": int, "cpu": int,
+	 * "shared_loop": bool, "loop_affinity": int}.
+	 * See socket_tls_context() for what goes into "tls". Clients on
+	 * a shared loop have their reads serviced by the I/O multiplexer,
+	 * on the shard picked by "loop_affinity", instead of a thread each.
+	 */
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY) {
+		rpc_object_unpack(args, "{fd:f,compress:b,max_frame:i,tls:v,"
+		    "low_latency:b,busy_poll:i,cpu:i,shared_loop:b,"
+		    "loop_affinity:i}", &fd, &compress, &max_frame, &tls,
+		    &low_latency, &busy_poll, &cpu, &shared_loop, &affinity);
+	} else if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD)
+		fd = rpc_fd_get_value(args);
+
+	if (fd == -1 && g_str_has_prefix(uri, SOCKET_VSOCK_SCHEME ":")) {
+		fd = socket_vsock_open(uri, false);
+		if (fd == -1) {
+			rpc_set_last_errorf(errno, "Cannot connect: %s",
+			    g_strerror(errno));
+			return (-1);
+		}
+	}
+
+	if (fd != -1) {
+		sock = g_socket_new_from_fd(fd, &err);
 		if (sock == NULL) {
 			rpc_set_last_gerror(err);
 			g_error_free(err);
@@ -254,7 +823,7 @@ socket_connect(struct rpc_connection *rco, const char *uri,
 			return (-1);
 
 		sock = g_socket_new(g_socket_address_get_family(addr),
-		    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, &err);
+		    socket_uri_type(uri), G_SOCKET_PROTOCOL_DEFAULT, &err);
 		if (sock == NULL) {
 			rpc_set_last_gerror(err);
 			g_object_unref(addr);
@@ -283,21 +852,63 @@ socket_connect(struct rpc_connection *rco, const char *uri,
 	}
 #endif
 
+#if defined(TLS_SUPPORT)
+	if (g_str_has_prefix(uri, SOCKET_TLS_SCHEME ":")) {
+		ctx = socket_tls_context(tls, false);
+		if (ctx == NULL) {
+			rpc_set_last_errorf(EINVAL, "Cannot set up TLS: %s",
+			    socket_tls_error());
+			g_object_unref(addr);
+			g_object_unref(sock);
+			return (-1);
+		}
+
+		host = socket_uri_host(uri);
+		ssl = socket_tls_handshake(sock, ctx, host, &err);
+		SSL_CTX_free(ctx);
+		g_free(host);
+
+		if (ssl == NULL) {
+			rpc_set_last_gerror(err);
+			g_object_unref(addr);
+			g_object_unref(sock);
+			g_error_free(err);
+			return (-1);
+		}
+	}
+#else
+	(void)tls;
+#endif
+
 	conn = g_malloc0(sizeof(*conn));
 	conn->sc_parent = rco;
 	conn->sc_uri = strdup(uri);
+	conn->sc_seqpacket = g_socket_get_socket_type(sock) ==
+	    G_SOCKET_TYPE_SEQPACKET;
 	g_mutex_init(&conn->sc_abort_mtx);
+	socket_set_compress(conn, compress && !conn->sc_seqpacket);
+	conn->sc_max_frame = max_frame > 0 ? (size_t)max_frame : 0;
+	conn->sc_creds_sent = socket_is_vsock(sock);
+#if defined(TLS_SUPPORT)
+	if (ssl != NULL)
+		socket_tls_attach(conn, ssl);
+#endif
+
+	conn->sc_socket = sock;
+	socket_set_low_latency(conn, low_latency, busy_poll, cpu);
 
 	rco->rco_release = socket_release;
 	rco->rco_abort = socket_abort;
 	rco->rco_arg = conn;
 
-	conn->sc_socket = sock;
 	rco->rco_send_msg = socket_send_msg;
+	rco->rco_send_msgv = socket_send_msgv;
+	rco->rco_send_batch = socket_send_batch;
 	rco->rco_get_fd = socket_get_fd;
 	conn->sc_cancellable = g_cancellable_new ();
-	conn->sc_reader_thread = g_thread_new("socket reader thread",
-	    socket_reader, (gpointer)conn);
+	socket_start_reader(conn, shared_loop && rpc_iomux_supported(), 0,
+	    NULL, RPC_IOMUX_BACKEND_DEFAULT,
+	    affinity >= 0 ? (int)(affinity % G_MAXINT) : -1);
 
 	g_object_unref(addr);
 	return (0);
@@ -313,10 +924,65 @@ socket_listen(struct rpc_server *srv, const char *uri,
 	GSocketAddress *addr = NULL;
 	GSocket *sock = NULL;
 	struct socket_server *server;
+	struct socket_listener *sl;
 	mode_t unix_socket_mode = 0660;
+	guint i;
+	bool event_loop = false;
+	int64_t io_threads = 0;
+	int64_t mode = -1;
+	const char *io_backend = NULL;
+	bool compress = false;
+	int64_t max_frame = 0;
+	int64_t listeners = 1;
+	bool low_latency = false;
+	int64_t busy_poll = SOCKET_BUSY_POLL;
+	int64_t cpu = -1;
+	const char *cpus_spec = NULL;
+	const char *io_cpus_spec = NULL;
+	GArray *cpus = NULL;
+	GArray *io_cpus = NULL;
+	rpc_object_t tls = NULL;
+	int fd = -1;
+#if defined(TLS_SUPPORT)
+	SSL_CTX *ctx = NULL;
+#endif
+
+	/*
+	 * Besides a bare descriptor or socket mode, params may be a
+	 * dictionary: {"fd": fd, "mode": int, "event_loop": bool,
+	 * "io_threads": int, "io_backend": "io_uring", "compress": bool,
+	 * "max_frame": int, "listeners": int, "tls": dict,
+	 * "low_latency": bool, "busy_poll": int, "cpu": int,
+	 * "cpus": string, "io_cpus": string}.
+	 */
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY) {
+		rpc_object_unpack(args, "{fd:f,mode:i,event_loop:b,"
+		    "io_threads:i,io_backend:s,compress:b,max_frame:i,"
+		    "listeners:i,tls:v,low_latency:b,busy_poll:i,cpu:i,"
+		    "cpus:s,io_cpus:s}", &fd, &mode, &event_loop, &io_threads,
+		    &io_backend, &compress, &max_frame, &listeners, &tls,
+		    &low_latency, &busy_poll, &cpu, &cpus_spec, &io_cpus_spec);
+	} else if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD)
+		fd = rpc_fd_get_value(args);
+	else if (args != NULL && rpc_get_type(args) == RPC_TYPE_INT64)
+		mode = rpc_int64_get_value(args);
+
+	if (event_loop && !rpc_iomux_supported()) {
+		debugf("event loop mode not supported, using reader threads");
+		event_loop = false;
+	}
+
+	if (fd == -1 && g_str_has_prefix(uri, SOCKET_VSOCK_SCHEME ":")) {
+		fd = socket_vsock_open(uri, true);
+		if (fd == -1) {
+			srv->rs_error = rpc_error_create(errno,
+			    g_strerror(errno), NULL);
+			return (-1);
+		}
+	}
 
-	if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD) {
-		sock = g_socket_new_from_fd(rpc_fd_get_value(args), &err);
+	if (fd != -1) {
+		sock = g_socket_new_from_fd(fd, &err);
 		if (sock == NULL) {
 			srv->rs_error = rpc_error_create(err->code,
 			    err->message, NULL);
@@ -331,16 +997,68 @@ socket_listen(struct rpc_server *srv, const char *uri,
 			return (-1);
 		}
 
-		if (args != NULL && rpc_get_type(args) == RPC_TYPE_INT64)
-			unix_socket_mode = (mode_t)rpc_int64_get_value(args);
+		if (mode != -1)
+			unix_socket_mode = (mode_t)mode;
+	}
+
+	if ((cpus_spec != NULL &&
+	    (cpus = rpc_cpulist_parse(cpus_spec)) == NULL) ||
+	    (io_cpus_spec != NULL &&
+	    (io_cpus = rpc_cpulist_parse(io_cpus_spec)) == NULL)) {
+		srv->rs_error = rpc_error_create(EINVAL, "Invalid CPU list",
+		    NULL);
+		if (cpus != NULL)
+			g_array_unref(cpus);
+		g_clear_object(&addr);
+		g_clear_object(&sock);
+		return (-1);
+	}
+
+#if defined(TLS_SUPPORT)
+	if (g_str_has_prefix(uri, SOCKET_TLS_SCHEME ":")) {
+		ctx = socket_tls_context(tls, true);
+		if (ctx == NULL) {
+			srv->rs_error = rpc_error_create(EINVAL,
+			    socket_tls_error(), NULL);
+			g_clear_pointer(&cpus, g_array_unref);
+			g_clear_pointer(&io_cpus, g_array_unref);
+			g_clear_object(&addr);
+			g_clear_object(&sock);
+			return (-1);
+		}
 	}
+#else
+	(void)tls;
+#endif
 
 	server = g_malloc0(sizeof(*server));
 	server->ss_server = srv;
 	server->ss_uri = strdup(uri);
 	server->ss_listener = g_socket_listener_new();
+	server->ss_event_loop = event_loop;
+	server->ss_io_threads = (guint)io_threads;
+	server->ss_io_backend = RPC_IOMUX_BACKEND_DEFAULT;
+	server->ss_compress = compress;
+	server->ss_max_frame = max_frame > 0 ? (size_t)max_frame : 0;
+	server->ss_low_latency = low_latency;
+	server->ss_busy_poll = busy_poll;
+	server->ss_cpu = cpu;
+	server->ss_cpus = cpus;
+	server->ss_io_cpus = io_cpus;
+	server->ss_listeners = g_ptr_array_new();
+	server->ss_sockets = g_ptr_array_new_with_free_func(g_object_unref);
+	g_signal_connect(server->ss_listener, "event",
+	    G_CALLBACK(socket_listener_event), server);
+
+	if (g_strcmp0(io_backend, "io_uring") == 0) {
+		server->ss_event_loop = true;
+		server->ss_io_backend = RPC_IOMUX_BACKEND_IO_URING;
+	}
 
 	srv->rs_teardown = socket_teardown;
+	srv->rs_handover = socket_handover;
+	srv->rs_stop_accepting = socket_stop_accepting;
+	srv->rs_adopt = socket_adopt;
 	srv->rs_arg = server;
 	g_mutex_init(&server->ss_mtx);
 
@@ -361,6 +1079,15 @@ socket_listen(struct rpc_server *srv, const char *uri,
 					    err->code, err->message, NULL);
 					g_object_unref(addr);
 					g_error_free(err);
+					socket_free_listeners(server);
+#if defined(TLS_SUPPORT)
+					SSL_CTX_free(ctx);
+#endif
+					g_clear_pointer(&cpus, g_array_unref);
+					g_clear_pointer(&io_cpus,
+					    g_array_unref);
+					g_ptr_array_free(server->ss_sockets,
+					    true);
 					g_free(server->ss_uri);
 					g_free(server);
 					return (-1);
@@ -369,9 +1096,14 @@ socket_listen(struct rpc_server *srv, const char *uri,
 
 		}
 
-		g_socket_listener_add_address(server->ss_listener, addr,
-		    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL,
-		    NULL, &err);
+		if (listeners > 1 && G_IS_INET_SOCKET_ADDRESS(addr)) {
+			socket_listen_sharded(server, addr,
+			    (guint)MIN(listeners, G_MAXUINT), &err);
+		} else {
+			g_socket_listener_add_address(server->ss_listener,
+			    addr, socket_uri_type(uri),
+			    G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &err);
+		}
 
 		if (file != NULL) {
 			chmod(g_file_get_path(file), unix_socket_mode);
@@ -381,22 +1113,44 @@ socket_listen(struct rpc_server *srv, const char *uri,
 		g_object_unref(addr);
 	}
 
-	if (sock != NULL)
+	if (sock != NULL) {
+		g_ptr_array_add(server->ss_sockets, g_object_ref(sock));
 		g_socket_listener_add_socket(server->ss_listener, sock, NULL,
 		    &err);
+	}
 
 	if (err != NULL) {
 		srv->rs_error = rpc_error_create(err->code, err->message, NULL);
 		g_error_free(err);
+		socket_free_listeners(server);
 		g_object_unref(server->ss_listener);
+#if defined(TLS_SUPPORT)
+		SSL_CTX_free(ctx);
+#endif
+		g_clear_pointer(&cpus, g_array_unref);
+		g_clear_pointer(&io_cpus, g_array_unref);
+		g_ptr_array_free(server->ss_sockets, true);
 		g_free(server->ss_uri);
 		g_free(server);
 		return (-1);
 	}
 
-	/* Schedule first accept */
+#if defined(TLS_SUPPORT)
+	server->ss_tls_ctx = ctx;
+#endif
 	server->ss_cancellable = g_cancellable_new();
 
+	if (server->ss_listeners->len > 0) {
+		for (i = 0; i < server->ss_listeners->len; i++) {
+			sl = g_ptr_array_index(server->ss_listeners, i);
+			sl->sl_thread = g_thread_new("socket accept thread",
+			    socket_accept_worker, sl);
+		}
+
+		return (0);
+	}
+
+	/* Schedule first accept */
 	g_mutex_lock(&server->ss_mtx);
 	g_socket_listener_accept_async(server->ss_listener,
 	    server->ss_cancellable, &socket_accept, server);
@@ -406,26 +1160,275 @@ socket_listen(struct rpc_server *srv, const char *uri,
 	return (0);
 }
 
+/*
+ * Binds n sockets to the same address with SO_REUSEPORT. If the port
+ * is 0, the first one picks it and the rest follow.
+ */
+static int
+socket_listen_sharded(struct socket_server *server, GSocketAddress *addr,
+    guint n, GError **err)
+{
+#if defined(SO_REUSEPORT)
+	struct socket_listener *sl;
+	GSocketAddress *bound;
+	GSocket *sock;
+	guint i;
+
+	bound = g_object_ref(addr);
+	for (i = 0; i < n; i++) {
+		sock = g_socket_new(g_socket_address_get_family(addr),
+		    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, err);
+		if (sock == NULL)
+			goto fail;
+
+		if (!g_socket_set_option(sock, SOL_SOCKET, SO_REUSEPORT, true,
+		    err) || !g_socket_bind(sock, bound, true, err) ||
+		    !g_socket_listen(sock, err)) {
+			g_object_unref(sock);
+			goto fail;
+		}
+
+		if (i == 0) {
+			g_object_unref(bound);
+			bound = g_socket_get_local_address(sock, err);
+			if (bound == NULL) {
+				g_object_unref(sock);
+				return (-1);
+			}
+		}
+
+		sl = g_malloc0(sizeof(*sl));
+		sl->sl_server = server;
+		sl->sl_socket = sock;
+		sl->sl_shard = (int)i;
+		g_ptr_array_add(server->ss_listeners, sl);
+	}
+
+	g_object_unref(bound);
+	return (0);
+
+fail:
+	g_object_unref(bound);
+	return (-1);
+#else
+	debugf("SO_REUSEPORT not supported, using a single listener");
+	(void)n;
+	return (g_socket_listener_add_address(server->ss_listener, addr,
+	    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+	    err) ? 0 : -1);
+#endif
+}
+
+/*
+ * Keeps track of the sockets GSocketListener creates for an address, so
+ * that they can be handed over to another process later.
+ */
+static void
+socket_listener_event(GSocketListener *listener __unused,
+    GSocketListenerEvent event, GSocket *sock, gpointer data)
+{
+	struct socket_server *server = data;
+
+	if (event == G_SOCKET_LISTENER_LISTENED)
+		g_ptr_array_add(server->ss_sockets, g_object_ref(sock));
+}
+
+/*
+ * Waits for the accept threads to finish, so the accept has to have
+ * been cancelled already, if there ever were any threads.
+ */
+static void
+socket_free_listeners(struct socket_server *server)
+{
+	struct socket_listener *sl;
+	guint i;
+
+	for (i = 0; i < server->ss_listeners->len; i++) {
+		sl = g_ptr_array_index(server->ss_listeners, i);
+		if (sl->sl_thread != NULL)
+			g_thread_join(sl->sl_thread);
+
+		g_socket_close(sl->sl_socket, NULL);
+		g_object_unref(sl->sl_socket);
+		g_free(sl);
+	}
+
+	g_ptr_array_free(server->ss_listeners, true);
+	server->ss_listeners = NULL;
+}
+
 static int
 socket_send_msg(void *arg, const void *buf, size_t size, const int *fds,
     size_t nfds)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+
+	return (socket_send_msgv(arg, &iov, 1, fds, nfds));
+}
+
+static int
+socket_send_msgv(void *arg, const struct iovec *vec, size_t nvec,
+    const int *fds, size_t nfds)
+{
+
+	return (socket_send_batch(arg, vec, &nvec, 1, fds, nfds));
+}
+
+/*
+ * Sends a number of frames with as few sendmsg() calls as possible.
+ * Descriptors, if any, belong to the first frame.
+ */
+static int
+socket_send_batch(void *arg, const struct iovec *vec, const size_t *frame_niov,
+    size_t nframes, const int *fds, size_t nfds)
 {
 	struct socket_connection *conn = arg;
+	size_t nvec;
+	size_t n;
+	size_t i;
+	int ret;
+
+	while (nframes > 0) {
+		/* Each frame takes a header vector in the stream flavor */
+		nvec = frame_niov[0] + 1;
+		for (n = 1; n < MIN(nframes, SOCKET_BATCH_FRAMES); n++) {
+			if (nvec + frame_niov[n] + 1 > IOV_MAX)
+				break;
+
+			nvec += frame_niov[n] + 1;
+		}
+
+		if (conn->sc_seqpacket)
+			ret = socket_send_records(conn, vec, frame_niov, n,
+			    fds, nfds);
+		else
+			ret = socket_send_chunk(conn, vec, frame_niov, n,
+			    fds, nfds);
+
+		if (ret != 0)
+			return (ret);
+
+		for (i = 0; i < n; i++)
+			vec += frame_niov[i];
+
+		frame_niov += n;
+		nframes -= n;
+		fds = NULL;
+		nfds = 0;
+	}
+
+	return (0);
+}
+
+/*
+ * Sends a chunk of socket_send_batch() over a stream socket, each
+ * frame preceded by its header.
+ */
+static int
+socket_send_chunk(struct socket_connection *conn, const struct iovec *vec,
+    const size_t *frame_niov, size_t nframes, const int *fds, size_t nfds)
+{
 	GError *err = NULL;
 	GSocketControlMessage *cmsg[2] = { NULL };
-	GOutputVector iov[2];
-	uint32_t header[4] = { 0xdeadbeef, (uint32_t)size, 0, 0 };
+	GOutputVector *iov;
+	GOutputVector *heap = NULL;
+	uint32_t (*headers)[4];
+	size_t total = 0;
+	size_t niov = 0;
+	size_t nvec = 0;
 	size_t done = 0;
+	size_t first = 0;
+	size_t size;
 	ssize_t step;
 	size_t tmp;
+	size_t i, j;
 	int ncmsg = 0;
 	int ret = 0;
-	int i;
+#if defined(ZSTD_SUPPORT)
+	const struct iovec *fvec;
+	void **zbufs;
+	size_t zlen;
+	size_t fiov;
+	bool compress;
+#endif
+
+	for (i = 0; i < nframes; i++)
+		nvec += frame_niov[i];
+
+	/* Only a lone, heavily vectored frame gets past IOV_MAX */
+	if (nvec + nframes > IOV_MAX)
+		iov = heap = g_new(GOutputVector, nvec + nframes);
+	else
+		iov = g_newa(GOutputVector, nvec + nframes);
 
-	debugf("sending frame: addr=%p, len=%zu, nfds=%zu", buf, size, nfds);
+	headers = g_newa(uint32_t[4], nframes);
 
-	iov[0] = (GOutputVector){ .buffer = header, .size = sizeof(header) };
-	iov[1] = (GOutputVector){ .buffer = buf, .size = size };
+#if defined(ZSTD_SUPPORT)
+	/* Frames must enter the zstd stream in the order they're sent */
+	compress = conn->sc_compress && g_atomic_int_get(&conn->sc_peer_zstd);
+	zbufs = g_newa(void *, nframes);
+	memset(zbufs, 0, nframes * sizeof(void *));
+	if (compress)
+		g_mutex_lock(&conn->sc_zstd_mtx);
+#endif
+
+	for (i = 0; i < nframes; i++) {
+		size = 0;
+		headers[i][0] = 0xdeadbeef;
+		headers[i][2] = SOCKET_HDR_FLAGS;
+		headers[i][3] = 0;
+		iov[niov++] = (GOutputVector){
+			.buffer = headers[i],
+			.size = sizeof(headers[i])
+		};
+
+#if defined(ZSTD_SUPPORT)
+		fvec = vec;
+		fiov = niov;
+#endif
+		for (j = 0; j < frame_niov[i]; j++) {
+			iov[niov++] = (GOutputVector){
+				.buffer = vec->iov_base,
+				.size = vec->iov_len
+			};
+			size += vec->iov_len;
+			vec++;
+		}
+
+#if defined(ZSTD_SUPPORT)
+		if (compress && size >= SOCKET_COMPRESS_MIN) {
+			if (socket_deflate(conn, fvec, frame_niov[i], size,
+			    &zbufs[i], &zlen) != 0) {
+				conn->sc_parent->rco_error = rpc_error_create(
+				    EIO, "Frame compression failed", NULL);
+				ret = -1;
+				goto done;
+			}
+
+			niov = fiov;
+			iov[niov++] = (GOutputVector){
+				.buffer = zbufs[i],
+				.size = zlen
+			};
+			headers[i][2] |= SOCKET_HDR_ZSTD;
+			headers[i][3] = (uint32_t)size;
+			size = zlen;
+		}
+#endif
+
+		headers[i][1] = (uint32_t)size;
+		total += size + sizeof(headers[i]);
+	}
+
+	debugf("sending %zu frames: len=%zu, niov=%zu, nfds=%zu", nframes,
+	    total, niov, nfds);
+
+#if defined(TLS_SUPPORT)
+	if (conn->sc_tls_tx) {
+		ret = socket_tls_write(conn, iov, niov, total);
+		goto done;
+	}
+#endif
 
 #ifndef _WIN32
 	if (g_unix_credentials_message_is_supported()) {
@@ -441,8 +1444,17 @@ socket_send_msg(void *arg, const void *buf, size_t size, const int *fds,
 #endif
 
 	for (;;) {
-		step = g_socket_send_message(conn->sc_socket, NULL, iov, 2,
-		    cmsg, ncmsg, 0, NULL, &err);
+		step = g_socket_send_message(conn->sc_socket, NULL,
+		    &iov[first], (gint)MIN(niov - first, IOV_MAX), cmsg,
+		    ncmsg, 0, NULL, &err);
+		if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+			/* Socket is in event loop mode; wait for room */
+			g_clear_error(&err);
+			if (g_socket_condition_wait(conn->sc_socket, G_IO_OUT,
+			    NULL, &err))
+				continue;
+		}
+
 		if (err != NULL) {
 			conn->sc_parent->rco_error =
 			    rpc_error_create_from_gerror(err);
@@ -451,31 +1463,808 @@ socket_send_msg(void *arg, const void *buf, size_t size, const int *fds,
 			goto done;
 		}
 
-		if (step == 0) {
-			conn->sc_parent->rco_error = rpc_error_create(
-			    ECONNRESET, "Connection terminated", NULL);
-			ret = -1;
-			goto done;
-		}
+		if (step == 0) {
+			conn->sc_parent->rco_error = rpc_error_create(
+			    ECONNRESET, "Connection terminated", NULL);
+			ret = -1;
+			goto done;
+		}
+
+		done += step;
+
+		if (done == total)
+			break;
+
+		/* Control messages go out with the first chunk only */
+		for (i = 0; i < (size_t)ncmsg; i++)
+			g_object_unref(cmsg[i]);
+
+		ncmsg = 0;
+
+		for (i = first; i < niov && step > 0; i++) {
+			tmp = MIN((size_t)step, (size_t)iov[i].size);
+			iov[i].size -= tmp;
+			iov[i].buffer += tmp;
+			step -= tmp;
+		}
+
+		while (first < niov && iov[first].size == 0)
+			first++;
+	}
+
+done:
+	for (i = 0; i < (size_t)ncmsg; i++)
+		g_object_unref(cmsg[i]);
+
+#if defined(ZSTD_SUPPORT)
+	if (compress)
+		g_mutex_unlock(&conn->sc_zstd_mtx);
+
+	for (i = 0; i < nframes; i++)
+		g_free(zbufs[i]);
+#endif
+
+	g_free(heap);
+	return (ret);
+}
+
+/*
+ * SOCK_SEQPACKET flavor of socket_send_batch(): one record per frame,
+ * all of them handed to the kernel with a single sendmmsg() where
+ * available. Records go out whole or not at all.
+ */
+static int
+socket_send_records(struct socket_connection *conn, const struct iovec *vec,
+    const size_t *frame_niov, size_t nframes, const int *fds, size_t nfds)
+{
+	GError *err = NULL;
+	GSocketControlMessage *cmsg[2] = { NULL };
+	GOutputMessage *msgs;
+	GOutputVector *iov;
+	uint8_t *flat = NULL;
+	size_t nvec = 0;
+	size_t niov = 0;
+	size_t first = 0;
+	size_t size = 0;
+	size_t i, j;
+	gint step;
+	int ncmsg = 0;
+	int ret = 0;
+
+	for (i = 0; i < nframes; i++)
+		nvec += frame_niov[i];
+
+	iov = g_newa(GOutputVector, MIN(nvec, IOV_MAX));
+	msgs = g_newa(GOutputMessage, nframes);
+
+	if (nvec > IOV_MAX) {
+		/* A lone frame; a record can't span more than IOV_MAX */
+		for (j = 0; j < nvec; j++)
+			size += vec[j].iov_len;
+
+		flat = g_malloc(size);
+		for (j = 0, size = 0; j < nvec; j++) {
+			memcpy(flat + size, vec[j].iov_base, vec[j].iov_len);
+			size += vec[j].iov_len;
+		}
+
+		iov[niov++] = (GOutputVector){
+			.buffer = flat,
+			.size = size
+		};
+		msgs[0] = (GOutputMessage){
+			.vectors = iov,
+			.num_vectors = 1
+		};
+	}
+
+	for (i = 0; flat == NULL && i < nframes; i++) {
+		msgs[i] = (GOutputMessage){
+			.vectors = &iov[niov],
+			.num_vectors = (guint)frame_niov[i]
+		};
+
+		for (j = 0; j < frame_niov[i]; j++) {
+			iov[niov++] = (GOutputVector){
+				.buffer = vec->iov_base,
+				.size = vec->iov_len
+			};
+			vec++;
+		}
+	}
+
+	debugf("sending %zu records: niov=%zu, nfds=%zu", nframes, niov,
+	    nfds);
+
+#ifndef _WIN32
+	if (!conn->sc_creds_sent) {
+		cmsg[ncmsg++] = g_unix_credentials_message_new();
+		conn->sc_creds_sent = true;
+	}
+
+	if (nfds > 0)
+		cmsg[ncmsg++] = g_unix_fd_message_new_with_fd_list(
+		    g_unix_fd_list_new_from_array(fds, (gint)nfds));
+#endif
+
+	msgs[0].control_messages = cmsg;
+	msgs[0].num_control_messages = (guint)ncmsg;
+
+	while (first < nframes) {
+		step = g_socket_send_messages(conn->sc_socket, &msgs[first],
+		    (guint)(nframes - first), 0, NULL, &err);
+		if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+			/* Socket is in event loop mode; wait for room */
+			g_clear_error(&err);
+			if (g_socket_condition_wait(conn->sc_socket, G_IO_OUT,
+			    NULL, &err))
+				continue;
+		}
+
+		if (err != NULL) {
+			conn->sc_parent->rco_error =
+			    rpc_error_create_from_gerror(err);
+			g_error_free(err);
+			ret = -1;
+			break;
+		}
+
+		first += (size_t)step;
+	}
+
+	for (i = 0; i < (size_t)ncmsg; i++)
+		g_object_unref(cmsg[i]);
+
+	g_free(flat);
+	return (ret);
+}
+
+#if defined(TLS_SUPPORT)
+static const char *
+socket_tls_error(void)
+{
+	const char *reason;
+
+	reason = ERR_reason_error_string(ERR_get_error());
+	ERR_clear_error();
+	return (reason != NULL ? reason : "Unknown TLS error");
+}
+
+/*
+ * Builds a TLS context out of the "tls" params dictionary:
+ * {"cert": path, "key": path, "ca": path, "verify": bool}. Servers
+ * need a certificate, and only check client certificates when given
+ * "ca". Clients check the server against "ca" or the system store,
+ * unless "verify" is false. "key" defaults to the "cert" file.
+ */
+static SSL_CTX *
+socket_tls_context(rpc_object_t params, bool server)
+{
+	SSL_CTX *ctx;
+	const char *cert = NULL;
+	const char *key = NULL;
+	const char *ca = NULL;
+	bool verify = true;
+
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY)
+		rpc_object_unpack(params, "{cert:s,key:s,ca:s,verify:b}",
+		    &cert, &key, &ca, &verify);
+
+	ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+	if (ctx == NULL)
+		return (NULL);
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#if defined(SSL_OP_ENABLE_KTLS)
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	if (server) {
+		/*
+		 * Session tickets would show up as non-data records on a
+		 * client socket with kTLS receive, which the plain socket
+		 * read path can't deal with.
+		 */
+		SSL_CTX_set_num_tickets(ctx, 0);
+
+		if (cert == NULL) {
+			SSL_CTX_free(ctx);
+			ERR_raise(ERR_LIB_SSL, SSL_R_NO_CERTIFICATE_SET);
+			return (NULL);
+		}
+	}
+
+	if (cert != NULL &&
+	    (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key != NULL ? key : cert,
+	    SSL_FILETYPE_PEM) != 1))
+		goto fail;
+
+	if (ca != NULL) {
+		if (SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1)
+			goto fail;
+	} else if (!server && SSL_CTX_set_default_verify_paths(ctx) != 1)
+		goto fail;
+
+	if (!server && verify)
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+	if (server && ca != NULL)
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER |
+		    SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+
+	return (ctx);
+
+fail:
+	SSL_CTX_free(ctx);
+	return (NULL);
+}
+
+/*
+ * Runs the handshake over a connected socket. GSocket keeps its
+ * descriptor non-blocking, so OpenSSL wants to be waited for every now
+ * and then, for at most SOCKET_TLS_TIMEOUT seconds each time.
+ */
+static SSL *
+socket_tls_handshake(GSocket *sock, SSL_CTX *ctx, const char *host,
+    GError **err)
+{
+	GIOCondition cond;
+	SSL *ssl;
+	int ret;
+
+	ssl = SSL_new(ctx);
+	if (ssl == NULL || SSL_set_fd(ssl, g_socket_get_fd(sock)) != 1)
+		goto fail;
+
+	if (host != NULL) {
+		if (g_hostname_is_ip_address(host)) {
+			if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl),
+			    host) != 1)
+				goto fail;
+		} else if (SSL_set_tlsext_host_name(ssl, host) != 1 ||
+		    SSL_set1_host(ssl, host) != 1)
+			goto fail;
+	}
+
+	g_socket_set_timeout(sock, SOCKET_TLS_TIMEOUT);
+
+	for (;;) {
+		ret = SSL_do_handshake(ssl);
+		if (ret == 1)
+			break;
+
+		switch (SSL_get_error(ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			cond = G_IO_IN;
+			break;
+
+		case SSL_ERROR_WANT_WRITE:
+			cond = G_IO_OUT;
+			break;
+
+		default:
+			g_socket_set_timeout(sock, 0);
+			goto fail;
+		}
+
+		if (!g_socket_condition_wait(sock, cond, NULL, err)) {
+			g_socket_set_timeout(sock, 0);
+			SSL_free(ssl);
+			return (NULL);
+		}
+	}
+
+	g_socket_set_timeout(sock, 0);
+	return (ssl);
+
+fail:
+	g_set_error(err, G_IO_ERROR, G_IO_ERROR_FAILED,
+	    "TLS handshake failed: %s", socket_tls_error());
+	SSL_free(ssl);
+	return (NULL);
+}
+
+/*
+ * Whatever direction kTLS took over goes through the regular socket
+ * code from now on; the other one, if any, through OpenSSL.
+ */
+static void
+socket_tls_attach(struct socket_connection *conn, SSL *ssl)
+{
+
+	conn->sc_ssl = ssl;
+	conn->sc_tls_tx = true;
+	conn->sc_tls_rx = true;
+	conn->sc_creds_sent = true;
+	g_mutex_init(&conn->sc_tls_mtx);
+
+#if defined(SSL_OP_ENABLE_KTLS)
+	conn->sc_tls_tx = !BIO_get_ktls_send(SSL_get_wbio(ssl));
+	conn->sc_tls_rx = !BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#endif
+
+	debugf("TLS established: %s, ktls send=%d, ktls recv=%d",
+	    SSL_get_version(ssl), !conn->sc_tls_tx, !conn->sc_tls_rx);
+}
+
+/*
+ * Userspace record layer send. The frames are gathered into a single
+ * buffer first, so that small vectors don't end up as records of their
+ * own. The reader may be using the SSL object concurrently, hence the
+ * lock, which is never held while waiting on the socket.
+ */
+static int
+socket_tls_write(struct socket_connection *conn, const GOutputVector *iov,
+    size_t niov, size_t total)
+{
+	GError *err = NULL;
+	GIOCondition cond;
+	char *buf;
+	size_t done = 0;
+	size_t i;
+	int step;
+	int ret;
+
+	buf = g_malloc(total);
+	for (i = 0; i < niov; i++) {
+		memcpy(buf + done, iov[i].buffer, iov[i].size);
+		done += iov[i].size;
+	}
+
+	done = 0;
+	while (done < total) {
+		g_mutex_lock(&conn->sc_tls_mtx);
+		step = SSL_write(conn->sc_ssl, buf + done,
+		    (int)MIN(total - done, G_MAXINT));
+		ret = step > 0 ? SSL_ERROR_NONE :
+		    SSL_get_error(conn->sc_ssl, step);
+		g_mutex_unlock(&conn->sc_tls_mtx);
+
+		switch (ret) {
+		case SSL_ERROR_NONE:
+			done += (size_t)step;
+			continue;
+
+		case SSL_ERROR_WANT_READ:
+			cond = G_IO_IN;
+			break;
+
+		case SSL_ERROR_WANT_WRITE:
+			cond = G_IO_OUT;
+			break;
+
+		default:
+			conn->sc_parent->rco_error = rpc_error_create(EIO,
+			    socket_tls_error(), NULL);
+			g_free(buf);
+			return (-1);
+		}
+
+		if (!g_socket_condition_wait(conn->sc_socket, cond, NULL,
+		    &err)) {
+			conn->sc_parent->rco_error =
+			    rpc_error_create_from_gerror(err);
+			g_error_free(err);
+			g_free(buf);
+			return (-1);
+		}
+	}
+
+	g_free(buf);
+	return (0);
+}
+
+/*
+ * Userspace record layer receive, with the same semantics as
+ * g_socket_receive_message(): it fills the first vector with room left
+ * and fails with G_IO_ERROR_WOULD_BLOCK in event loop mode.
+ */
+static gssize
+socket_tls_read(struct socket_connection *conn, GInputVector *iov, gint niov,
+    GCancellable *cancellable, GError **err)
+{
+	GIOCondition cond;
+	gint i;
+	int step;
+	int ret;
+
+	for (i = 0; i < niov && iov[i].size == 0; i++)
+		;
+
+	g_assert(i < niov);
+
+	for (;;) {
+		g_mutex_lock(&conn->sc_tls_mtx);
+		step = SSL_read(conn->sc_ssl, iov[i].buffer,
+		    (int)MIN(iov[i].size, G_MAXINT));
+		ret = step > 0 ? SSL_ERROR_NONE :
+		    SSL_get_error(conn->sc_ssl, step);
+		g_mutex_unlock(&conn->sc_tls_mtx);
+
+		switch (ret) {
+		case SSL_ERROR_NONE:
+			return (step);
+
+		case SSL_ERROR_ZERO_RETURN:
+			return (0);
+
+		case SSL_ERROR_WANT_READ:
+			cond = G_IO_IN;
+			break;
+
+		case SSL_ERROR_WANT_WRITE:
+			cond = G_IO_OUT;
+			break;
+
+		default:
+			g_set_error(err, G_IO_ERROR, G_IO_ERROR_FAILED,
+			    "TLS receive failed: %s", socket_tls_error());
+			return (-1);
+		}
+
+		if (!g_socket_get_blocking(conn->sc_socket)) {
+			g_set_error_literal(err, G_IO_ERROR,
+			    G_IO_ERROR_WOULD_BLOCK, "No TLS record ready");
+			return (-1);
+		}
+
+		if (!g_socket_condition_wait(conn->sc_socket, cond,
+		    cancellable, err))
+			return (-1);
+	}
+}
+#endif
+
+static void
+socket_set_low_latency(struct socket_connection *conn, bool enable,
+    int64_t busy_poll, int64_t cpu)
+{
+	GSocketFamily family = g_socket_get_family(conn->sc_socket);
+	GError *err = NULL;
+
+	conn->sc_cpu = (int)cpu;
+	if (!enable)
+		return;
+
+	conn->sc_spin = MAX(busy_poll, 0);
+
+	if (family == G_SOCKET_FAMILY_IPV4 || family == G_SOCKET_FAMILY_IPV6) {
+		if (!g_socket_set_option(conn->sc_socket, IPPROTO_TCP,
+		    TCP_NODELAY, true, &err)) {
+			debugf("Couldn't set TCP_NODELAY: %s", err->message);
+			g_clear_error(&err);
+		}
+
+#if defined(TCP_QUICKACK)
+		conn->sc_quickack = true;
+		socket_quickack(conn);
+#endif
+	}
+
+#if defined(SO_BUSY_POLL)
+	/* Needs CAP_NET_ADMIN to go above net.core.busy_read */
+	if (conn->sc_spin > 0 && !g_socket_set_option(conn->sc_socket,
+	    SOL_SOCKET, SO_BUSY_POLL, (gint)conn->sc_spin, &err)) {
+		debugf("Couldn't set SO_BUSY_POLL: %s", err->message);
+		g_clear_error(&err);
+	}
+#endif
+}
+
+/*
+ * TCP_QUICKACK doesn't stick: the kernel goes back to delayed ACKs on
+ * its own, so it gets set again after every frame.
+ */
+static void
+socket_quickack(struct socket_connection *conn)
+{
+
+#if defined(TCP_QUICKACK)
+	if (conn->sc_quickack)
+		g_socket_set_option(conn->sc_socket, IPPROTO_TCP,
+		    TCP_QUICKACK, true, NULL);
+#else
+	(void)conn;
+#endif
+}
+
+/*
+ * Polls the socket for up to sc_spin us before the reader goes to
+ * sleep in a blocking read.
+ */
+static void
+socket_spin(struct socket_connection *conn)
+{
+	gint64 deadline;
+
+	if (conn->sc_spin == 0)
+		return;
+
+	deadline = g_get_monotonic_time() + conn->sc_spin;
+	while (g_socket_condition_check(conn->sc_socket, G_IO_IN) == 0) {
+		if (g_get_monotonic_time() >= deadline)
+			break;
+	}
+}
+
+static void
+socket_set_compress(struct socket_connection *conn, bool compress)
+{
+
+#if defined(ZSTD_SUPPORT)
+	conn->sc_compress = compress;
+	g_mutex_init(&conn->sc_zstd_mtx);
+#else
+	if (compress)
+		debugf("built without zstd, not compressing frames");
+#endif
+}
+
+#if defined(ZSTD_SUPPORT)
+/*
+ * Compresses a frame into a newly allocated buffer, continuing the
+ * connection's zstd stream.
+ */
+static int
+socket_deflate(struct socket_connection *conn, const struct iovec *vec,
+    size_t nvec, size_t size, void **bufp, size_t *lenp)
+{
+	ZSTD_EndDirective mode;
+	ZSTD_outBuffer out;
+	ZSTD_inBuffer in;
+	size_t ret;
+	size_t i;
+
+	if (conn->sc_cctx == NULL) {
+		conn->sc_cctx = ZSTD_createCCtx();
+		ZSTD_CCtx_setParameter(conn->sc_cctx,
+		    ZSTD_c_compressionLevel, 1);
+	}
+
+	out.size = ZSTD_compressBound(size);
+	out.dst = g_malloc(out.size);
+	out.pos = 0;
+
+	for (i = 0; i < nvec; i++) {
+		in.src = vec[i].iov_base;
+		in.size = vec[i].iov_len;
+		in.pos = 0;
+		mode = i + 1 == nvec ? ZSTD_e_flush : ZSTD_e_continue;
+
+		do {
+			ret = ZSTD_compressStream2(conn->sc_cctx, &out, &in,
+			    mode);
+			if (ZSTD_isError(ret)) {
+				g_free(out.dst);
+				return (-1);
+			}
+		} while (in.pos < in.size || (mode == ZSTD_e_flush &&
+		    ret != 0));
+	}
+
+	*bufp = out.dst;
+	*lenp = out.pos;
+	return (0);
+}
+#endif
+
+/*
+ * Rejects frames over the connection's size limit, if any, before
+ * a buffer for them gets allocated. Compressed frames are checked
+ * against their uncompressed length too.
+ */
+static int
+socket_check_length(struct socket_connection *conn, const uint32_t *header)
+{
+	size_t length = header[1];
+
+	if ((header[2] & SOCKET_HDR_ZSTD) != 0)
+		length = MAX(length, header[3]);
+
+	return (socket_check_size(conn, length));
+}
+
+static int
+socket_check_size(struct socket_connection *conn, size_t length)
+{
+
+	if (conn->sc_max_frame == 0 || length <= conn->sc_max_frame)
+		return (0);
+
+	conn->sc_parent->rco_error = rpc_error_create(EMSGSIZE,
+	    "Frame too large", rpc_object_pack("{size:u,limit:u}",
+	    (uint64_t)length, (uint64_t)conn->sc_max_frame));
+	return (-1);
+}
+
+/*
+ * Replaces a compressed frame with its decompressed contents. Also
+ * takes note of whether the peer accepts compressed frames.
+ */
+static int
+socket_inflate(struct socket_connection *conn, const uint32_t *header,
+    void **frame, size_t *size)
+{
+#if defined(ZSTD_SUPPORT)
+	ZSTD_outBuffer out;
+	ZSTD_inBuffer in;
+	size_t ret;
+
+	if ((header[2] & SOCKET_HDR_ZSTD_OK) != 0 &&
+	    !g_atomic_int_get(&conn->sc_peer_zstd))
+		g_atomic_int_set(&conn->sc_peer_zstd, 1);
+#endif
+
+	if ((header[2] & SOCKET_HDR_ZSTD) == 0)
+		return (0);
+
+#if defined(ZSTD_SUPPORT)
+	if (conn->sc_dctx == NULL)
+		conn->sc_dctx = ZSTD_createDCtx();
+
+	in.src = *frame;
+	in.size = *size;
+	in.pos = 0;
+	out.size = header[3];
+	out.dst = rpc_recv_buffer_alloc(out.size);
+	out.pos = 0;
+
+	do {
+		ret = ZSTD_decompressStream(conn->sc_dctx, &out, &in);
+		if (ZSTD_isError(ret))
+			break;
+	} while (in.pos < in.size && out.pos < out.size);
+
+	if (ZSTD_isError(ret) || in.pos != in.size || out.pos != out.size) {
+		rpc_recv_buffer_release(out.dst);
+		conn->sc_parent->rco_error = rpc_error_create(EBADMSG,
+		    "Corrupt compressed frame", NULL);
+		return (-1);
+	}
+
+	rpc_recv_buffer_release(*frame);
+	*frame = out.dst;
+	*size = out.size;
+	return (0);
+#else
+	conn->sc_parent->rco_error = rpc_error_create(ENOTSUP,
+	    "Compressed frames not supported", NULL);
+	return (-1);
+#endif
+}
+
+static void
+socket_process_cmsgs(struct socket_connection *conn,
+    GSocketControlMessage **cmsg, int ncmsg, int **fds, size_t *nfds)
+{
+	GError *err = NULL;
+	int nfds_i;
+	int i;
+#if defined(__linux__)
+	int ret;
+	uid_t uid;
+	pid_t pid;
+	GCredentials *cr;
+#endif
+
+#ifndef _WIN32
+	for (i = 0; i < ncmsg; i++) {
+#if defined(__linux__)
+		if (G_IS_UNIX_CREDENTIALS_MESSAGE(cmsg[i])) {
+			cr = g_unix_credentials_message_get_credentials(
+			    G_UNIX_CREDENTIALS_MESSAGE(cmsg[i]));
+			pid = g_credentials_get_unix_pid(cr, &err);
+			uid = g_credentials_get_unix_user(cr, &err);
+			g_assert(pid != -1 && (int)uid != -1);
+			g_assert(conn->sc_parent->rco_set_creds != NULL);
+
+			ret = conn->sc_parent->rco_set_creds(conn->sc_parent,
+			    pid, uid, (gid_t)-1);
+			g_assert(ret == 0);
+
+			if (!g_socket_set_option(conn->sc_socket, SOL_SOCKET,
+			    SO_PASSCRED, false, &err)) {
+				debugf("Couldn't disable passcreds %s", err->message);
+				g_error_free(err);
+			}
+
+			debugf("remote pid=%d, uid=%d, gid=%d", pid, uid, -1);
+		}
+#endif
+
+		if (G_IS_UNIX_FD_MESSAGE(cmsg[i])) {
+			*fds = g_unix_fd_message_steal_fds(
+			    G_UNIX_FD_MESSAGE(cmsg[i]), &nfds_i);
+			*nfds = (size_t)nfds_i;
+		}
+
+		g_object_unref(cmsg[i]);
+	}
+#endif
+
+	if (cmsg != NULL)
+		g_free(cmsg);
+}
+
+static gssize
+socket_receive(struct socket_connection *conn, GInputVector *iov, gint niov,
+    GSocketControlMessage ***cmsg, gint *ncmsg, GCancellable *cancellable,
+    GError **err)
+{
 
-		done += step;
+#if defined(TLS_SUPPORT)
+	if (conn->sc_tls_rx)
+		return (socket_tls_read(conn, iov, niov, cancellable, err));
+#endif
 
-		if (done == size + sizeof(header))
-			break;
+	return (g_socket_receive_message(conn->sc_socket, NULL, iov, niov,
+	    cmsg, ncmsg, NULL, cancellable, err));
+}
 
-		for (i = 0; i < 2; i++) {
-			tmp = MIN((size_t)step, (size_t)iov[i].size);
-			iov[i].size -= tmp;
-			iov[i].buffer += tmp;
-			step -= tmp;
-		}
+/*
+ * Reads one record off a SOCK_SEQPACKET socket. MSG_PEEK | MSG_TRUNC
+ * with no buffer yields the length of the next record without taking
+ * it off the queue, so the buffer can be sized exactly and the record
+ * read, along with its descriptors, in one go. Returns the length, 0
+ * if the peer went away or -1 on error, with either err or rco_error
+ * set.
+ */
+static ssize_t
+socket_recv_record(struct socket_connection *conn, void **frame, int **fds,
+    size_t *nfds, GCancellable *cancellable, GError **err)
+{
+	GSocketControlMessage **cmsg = NULL;
+	GInputVector iov;
+	ssize_t length;
+	ssize_t step;
+	size_t i;
+	int flags = G_SOCKET_MSG_PEEK | MSG_TRUNC;
+	int ncmsg = 0;
+
+	length = g_socket_receive_message(conn->sc_socket, NULL, NULL, 0,
+	    NULL, NULL, &flags, cancellable, err);
+	if (length <= 0)
+		return (length);
+
+	if (socket_check_size(conn, (size_t)length) != 0)
+		return (-1);
+
+	*frame = rpc_recv_buffer_alloc((size_t)length);
+	iov = (GInputVector){ .buffer = *frame, .size = (gsize)length };
+	flags = 0;
+	step = g_socket_receive_message(conn->sc_socket, NULL, &iov, 1,
+	    &cmsg, &ncmsg, &flags, cancellable, err);
+	if (step != length) {
+		if (step >= 0 && *err == NULL)
+			conn->sc_parent->rco_error = rpc_error_create(EBADMSG,
+			    "Short record", NULL);
+
+		socket_process_cmsgs(conn, cmsg, ncmsg, fds, nfds);
+		for (i = 0; i < *nfds; i++)
+			close((*fds)[i]);
+
+		g_free(*fds);
+		*fds = NULL;
+		*nfds = 0;
+		rpc_recv_buffer_release(*frame);
+		*frame = NULL;
+		return (-1);
 	}
 
-done:
-	for (i = 0; i < ncmsg; i++)
-		g_object_unref(cmsg[i]);
+	socket_process_cmsgs(conn, cmsg, ncmsg, fds, nfds);
+	return (length);
+}
 
-	return (ret);
+/*
+ * Whether a read was cut short by socket_detach(), rather than failing.
+ */
+static bool
+socket_detached(struct socket_connection *conn, GError *err)
+{
+
+	return (g_atomic_int_get(&conn->sc_detaching) &&
+	    g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED));
 }
 
 static int
@@ -492,26 +2281,62 @@ socket_recv_msg(struct socket_connection *conn, void **frame, size_t *size,
 	size_t tmp;
 	bool have_header = false;
 	int ncmsg = 0, i;
-	int nfds_i;
-#if defined(__linux__)
-	int ret;
-	uid_t uid;
-	pid_t pid;
-	GCredentials *cr;
-#endif
 
 	*nfds = 0;
+	socket_spin(conn);
+
+	if (conn->sc_seqpacket) {
+		*fds = NULL;
+		step = socket_recv_record(conn, frame, fds, nfds,
+		    conn->sc_cancellable, &err);
+		if (err != NULL) {
+			if (!socket_detached(conn, err))
+				conn->sc_parent->rco_error =
+				    rpc_error_create_from_gerror(err);
+
+			g_error_free(err);
+			return (-1);
+		}
+
+		if (step == 0) {
+			conn->sc_parent->rco_error = rpc_error_create(
+			    ECONNRESET, "Connection terminated", NULL);
+			return (-1);
+		}
+
+		if (step < 0)
+			return (-1);
+
+		*size = (size_t)step;
+		g_cancellable_reset(conn->sc_cancellable);
+		return (0);
+	}
+
 	iov[0] = (GInputVector){ .buffer = header, .size = sizeof(header) };
 	iov[1] = (GInputVector){ .buffer = NULL, .size = 0 };
 
 	for (;;) {
-		step = g_socket_receive_message(conn->sc_socket, NULL, iov, 2,
+		step = socket_receive(conn, iov, 2,
 		    have_header ? NULL : &cmsg, have_header ? NULL : &ncmsg,
-		    0, conn->sc_cancellable, &err);
+		    conn->sc_cancellable, &err);
+		if (err != NULL && done > 0 && socket_detached(conn, err)) {
+			/* Being detached, but the frame has to be read whole */
+			g_clear_error(&err);
+			g_cancellable_reset(conn->sc_cancellable);
+			continue;
+		}
+
+		if (err != NULL && socket_detached(conn, err)) {
+			g_error_free(err);
+			return (-1);
+		}
+
 		if (err != NULL) {
 			conn->sc_parent->rco_error =
 			    rpc_error_create_from_gerror(err);
 			g_error_free(err);
+			if (have_header)
+				rpc_recv_buffer_release(*frame);
 			return (-1);
 		}
 
@@ -519,6 +2344,8 @@ socket_recv_msg(struct socket_connection *conn, void **frame, size_t *size,
 		if (step == 0) {
 			conn->sc_parent->rco_error = rpc_error_create(
 			    ECONNRESET, "Connection terminated", NULL);
+			if (have_header)
+				rpc_recv_buffer_release(*frame);
 			return (-1);
 		}
 
@@ -539,10 +2366,13 @@ socket_recv_msg(struct socket_connection *conn, void **frame, size_t *size,
 			if (header[0] != 0xdeadbeef)
 				return (-1);
 
+			if (socket_check_length(conn, header) != 0)
+				return (-1);
+
 			have_header = true;
 			length = header[1];
 			*size = length;
-			*frame = g_malloc(length);
+			*frame = rpc_recv_buffer_alloc(length);
 			iov[1].buffer = *frame + done - sizeof(header);
 			iov[1].size = length - done + sizeof(header);
 		}
@@ -551,44 +2381,13 @@ socket_recv_msg(struct socket_connection *conn, void **frame, size_t *size,
 			break;
 	}
 
-#ifndef _WIN32
-	for (i = 0; i < ncmsg; i++) {
-#if defined(__linux__)
-		if (G_IS_UNIX_CREDENTIALS_MESSAGE(cmsg[i])) {
-			cr = g_unix_credentials_message_get_credentials(
-			    G_UNIX_CREDENTIALS_MESSAGE(cmsg[i]));
-			pid = g_credentials_get_unix_pid(cr, &err);
-			uid = g_credentials_get_unix_user(cr, &err);
-			g_assert(pid != -1 && (int)uid != -1);
-			g_assert(conn->sc_parent->rco_set_creds != NULL);
-
-			ret = conn->sc_parent->rco_set_creds(conn->sc_parent,
-			    pid, uid, (gid_t)-1);
-			g_assert(ret == 0);
-
-			if (!g_socket_set_option(conn->sc_socket, SOL_SOCKET,
-			    SO_PASSCRED, false, &err)) {
-				debugf("Couldn't disable passcreds %s", err->message);
-				g_error_free(err);
-			}
-
-			debugf("remote pid=%d, uid=%d, gid=%d", pid, uid, -1);
-		}
-#endif
-
-		if (G_IS_UNIX_FD_MESSAGE(cmsg[i])) {
-			*fds = g_unix_fd_message_steal_fds(
-			    G_UNIX_FD_MESSAGE(cmsg[i]), &nfds_i);
-			*nfds = (size_t)nfds_i;
-		}
-
-		g_object_unref(cmsg[i]);
+	if (socket_inflate(conn, header, frame, size) != 0) {
+		rpc_recv_buffer_release(*frame);
+		return (-1);
 	}
-#endif
-
-	if (cmsg != NULL)
-		g_free(cmsg);
 
+	socket_process_cmsgs(conn, cmsg, ncmsg, fds, nfds);
+	socket_quickack(conn);
 	g_cancellable_reset(conn->sc_cancellable);
 	return (0);
 }
@@ -599,10 +2398,20 @@ socket_abort(void *arg)
 	struct socket_connection *conn = arg;
 
 	g_mutex_lock(&conn->sc_abort_mtx);
-	if (!conn->sc_aborted) {
+	if (conn->sc_detached && !conn->sc_aborted) {
+		/* The socket lives on elsewhere, so leave it be */
+		conn->sc_aborted = true;
+		g_mutex_unlock(&conn->sc_abort_mtx);
+		g_socket_close(conn->sc_socket, NULL);
+	} else if (!conn->sc_aborted) {
 		conn->sc_aborted = true;
 		g_mutex_unlock(&conn->sc_abort_mtx);
 
+		if (conn->sc_mux != NULL) {
+			rpc_iomux_remove(conn->sc_mux);
+			conn->sc_mux = NULL;
+		}
+
 		g_socket_shutdown(conn->sc_socket, true, true, NULL);
 		g_socket_close(conn->sc_socket, NULL);
 
@@ -612,7 +2421,7 @@ socket_abort(void *arg)
 			g_source_set_callback(conn->sc_abort_timeout,
 			    &socket_abort_timeout, conn, NULL);
 			g_source_attach(conn->sc_abort_timeout,
-			    conn->sc_parent->rco_main_context);
+			    rpc_connection_get_main_context(conn->sc_parent));
 			g_thread_join(conn->sc_reader_thread);
 			if (!g_source_is_destroyed(conn->sc_abort_timeout))
 				g_source_destroy(conn->sc_abort_timeout);
@@ -636,6 +2445,68 @@ socket_abort_timeout(gpointer user_data)
 	return (false);
 }
 
+/*
+ * Stops reading from the connection on a frame boundary and returns a
+ * copy of its socket, so that another process can carry on from the
+ * next frame. The connection can still send until it's closed, which
+ * won't touch the socket itself anymore.
+ */
+static int
+socket_detach(void *arg)
+{
+	struct socket_connection *conn = arg;
+	int fd;
+
+#if defined(TLS_SUPPORT)
+	if (conn->sc_ssl != NULL) {
+		rpc_set_last_errorf(ENOTSUP,
+		    "TLS connections can't be handed over");
+		return (-1);
+	}
+#endif
+
+	g_mutex_lock(&conn->sc_abort_mtx);
+	if (conn->sc_aborted || conn->sc_detaching) {
+		g_mutex_unlock(&conn->sc_abort_mtx);
+		rpc_set_last_errorf(ENOTCONN, "Connection is going away");
+		return (-1);
+	}
+
+	g_atomic_int_set(&conn->sc_detaching, true);
+	g_mutex_unlock(&conn->sc_abort_mtx);
+
+	if (conn->sc_mux != NULL) {
+		rpc_iomux_remove(conn->sc_mux);
+		conn->sc_mux = NULL;
+
+		/* Finish off a frame that was partly read */
+		if (conn->sc_done != 0) {
+			g_socket_set_blocking(conn->sc_socket, true);
+			if (!socket_mux_read(conn)) {
+				rpc_set_last_errorf(ECONNRESET,
+				    "Connection terminated");
+				return (-1);
+			}
+		}
+	} else if (conn->sc_reader_thread != NULL) {
+		g_cancellable_cancel(conn->sc_cancellable);
+		g_thread_join(conn->sc_reader_thread);
+		conn->sc_reader_thread = NULL;
+	}
+
+	fd = dup(g_socket_get_fd(conn->sc_socket));
+	if (fd == -1) {
+		rpc_set_last_errorf(errno, "Cannot duplicate socket: %s",
+		    g_strerror(errno));
+		return (-1);
+	}
+
+	g_mutex_lock(&conn->sc_abort_mtx);
+	conn->sc_detached = true;
+	g_mutex_unlock(&conn->sc_abort_mtx);
+	return (fd);
+}
+
 static int
 socket_get_fd(void *arg)
 {
@@ -653,6 +2524,19 @@ socket_release(void *arg)
 		g_object_unref(conn->sc_conn);
 	if (conn->sc_uri)
 		g_free(conn->sc_uri);
+	if (conn->sc_frame)
+		rpc_recv_buffer_release(conn->sc_frame);
+	g_free(conn->sc_fds);
+	if (conn->sc_cpus != NULL)
+		g_array_unref(conn->sc_cpus);
+#if defined(ZSTD_SUPPORT)
+	ZSTD_freeCCtx(conn->sc_cctx);
+	ZSTD_freeDCtx(conn->sc_dctx);
+#endif
+#if defined(TLS_SUPPORT)
+	if (conn->sc_ssl != NULL)
+		SSL_free(conn->sc_ssl);
+#endif
 	if (conn->sc_abort_timeout) {
 		if (!g_source_is_destroyed(conn->sc_abort_timeout))
 			g_source_destroy(conn->sc_abort_timeout);
@@ -661,18 +2545,88 @@ socket_release(void *arg)
 	g_free(conn);
 }
 
+/*
+ * Stops accepting new connections, but leaves the ones already accepted
+ * alone. Safe to call more than once.
+ */
+static int
+socket_stop_accepting(struct rpc_server *srv)
+{
+	struct socket_server *server = srv->rs_arg;
+
+	g_mutex_lock(&server->ss_mtx);
+	if (server->ss_stopped) {
+		g_mutex_unlock(&server->ss_mtx);
+		return (0);
+	}
+
+	server->ss_stopped = true;
+	if (server->ss_outstanding_accept || server->ss_listeners->len > 0)
+            g_cancellable_cancel (server->ss_cancellable);
+	g_socket_listener_close(server->ss_listener);
+	g_mutex_unlock(&server->ss_mtx);
+	return (0);
+}
+
+/*
+ * Passes copies of the listening sockets to the caller. Once
+ * socket_stop_accepting() is called, connections that arrive wait in
+ * the backlog for whoever the copies went to.
+ */
+static int
+socket_handover(struct rpc_server *srv, GArray *fds)
+{
+	struct socket_server *server = srv->rs_arg;
+	struct socket_listener *sl;
+	int fd;
+	guint i;
+
+	for (i = 0; i < server->ss_sockets->len; i++) {
+		fd = dup(g_socket_get_fd(g_ptr_array_index(
+		    server->ss_sockets, i)));
+		if (fd == -1)
+			goto fail;
+
+		g_array_append_val(fds, fd);
+	}
+
+	for (i = 0; i < server->ss_listeners->len; i++) {
+		sl = g_ptr_array_index(server->ss_listeners, i);
+		fd = dup(g_socket_get_fd(sl->sl_socket));
+		if (fd == -1)
+			goto fail;
+
+		g_array_append_val(fds, fd);
+	}
+
+	return (0);
+
+fail:
+	rpc_set_last_errorf(errno, "Cannot duplicate listening socket: %s",
+	    g_strerror(errno));
+	for (i = 0; i < fds->len; i++)
+		close(g_array_index(fds, int, i));
+
+	g_array_set_size(fds, 0);
+	return (-1);
+}
+
 static int
 socket_teardown(struct rpc_server *srv)
 {
 	struct socket_server *socket_srv = srv->rs_arg;
 
-	g_mutex_lock(&socket_srv->ss_mtx);
-	if (socket_srv->ss_outstanding_accept)
-            g_cancellable_cancel (socket_srv->ss_cancellable);
-	g_socket_listener_close(socket_srv->ss_listener);
+	socket_stop_accepting(srv);
 	g_object_unref(socket_srv->ss_listener);
-	g_mutex_unlock(&socket_srv->ss_mtx);
 
+	socket_free_listeners(socket_srv);
+	g_clear_pointer(&socket_srv->ss_sockets, g_ptr_array_unref);
+	g_clear_pointer(&socket_srv->ss_cpus, g_array_unref);
+	g_clear_pointer(&socket_srv->ss_io_cpus, g_array_unref);
+#if defined(TLS_SUPPORT)
+	SSL_CTX_free(socket_srv->ss_tls_ctx);
+	socket_srv->ss_tls_ctx = NULL;
+#endif
 	return (0);
 }
 
@@ -684,23 +2638,226 @@ socket_reader(void *arg)
 	int *fds;
 	size_t len, nfds;
 
+	if (conn->sc_cpu >= 0) {
+		if (rpc_thread_bind_cpu(conn->sc_cpu) != 0)
+			debugf("Couldn't pin reader to CPU %d", conn->sc_cpu);
+	} else if (conn->sc_cpus != NULL) {
+		if (rpc_thread_bind(conn->sc_cpus) != 0)
+			debugf("Couldn't pin reader to the server's CPUs");
+	}
+
 	for (;;) {
+		if (g_atomic_int_get(&conn->sc_detaching))
+			return (NULL);
+
 		if (socket_recv_msg(conn, &frame, &len, &fds, &nfds) != 0)
 			break;
 
 		if (conn->sc_parent->rco_recv_msg(conn->sc_parent, frame, len,
 		    fds, nfds) != 0) {
-			g_free(frame);
+			rpc_recv_buffer_release(frame);
 			break;
 		}
 
-		g_free(frame);
+		rpc_recv_buffer_release(frame);
 	}
 
-	conn->sc_parent->rco_close(conn->sc_parent);
+	if (!g_atomic_int_get(&conn->sc_detaching))
+		conn->sc_parent->rco_close(conn->sc_parent);
+
 	return (NULL);
 }
 
+/*
+ * socket_mux_read() for SOCK_SEQPACKET sockets. Every read yields a
+ * whole frame, so there's nothing to carry over between calls.
+ */
+static bool
+socket_mux_read_records(struct socket_connection *conn)
+{
+	GError *err = NULL;
+	ssize_t step;
+
+	for (;;) {
+		if (g_atomic_int_get(&conn->sc_detaching))
+			return (true);
+
+		step = socket_recv_record(conn, &conn->sc_frame, &conn->sc_fds,
+		    &conn->sc_nfds, NULL, &err);
+		if (err != NULL) {
+			if (g_error_matches(err, G_IO_ERROR,
+			    G_IO_ERROR_WOULD_BLOCK)) {
+				g_error_free(err);
+				return (true);
+			}
+
+			conn->sc_parent->rco_error =
+			    rpc_error_create_from_gerror(err);
+			g_error_free(err);
+			break;
+		}
+
+		if (step == 0) {
+			conn->sc_parent->rco_error = rpc_error_create(
+			    ECONNRESET, "Connection terminated", NULL);
+			break;
+		}
+
+		if (step < 0)
+			break;
+
+		if (conn->sc_parent->rco_recv_msg(conn->sc_parent,
+		    conn->sc_frame, (size_t)step, conn->sc_fds,
+		    conn->sc_nfds) != 0)
+			break;
+
+		rpc_recv_buffer_release(conn->sc_frame);
+		g_free(conn->sc_fds);
+		conn->sc_frame = NULL;
+		conn->sc_fds = NULL;
+		conn->sc_nfds = 0;
+	}
+
+	rpc_recv_buffer_release(conn->sc_frame);
+	conn->sc_frame = NULL;
+	conn->sc_parent->rco_close(conn->sc_parent);
+	return (false);
+}
+
+/*
+ * Event loop mode: called from an I/O thread whenever the socket becomes
+ * readable. Reads whatever is available without blocking, reassembling
+ * frames across calls, and returns false once the connection is gone.
+ */
+static bool
+socket_mux_read(void *arg)
+{
+	struct socket_connection *conn = arg;
+	GError *err = NULL;
+	GSocketControlMessage **cmsg = NULL;
+	GInputVector iov;
+	size_t length;
+	ssize_t step;
+	int ncmsg = 0;
+
+	if (conn->sc_seqpacket)
+		return (socket_mux_read_records(conn));
+
+	for (;;) {
+		/* Stop on a frame boundary for socket_detach() */
+		if (g_atomic_int_get(&conn->sc_detaching) && conn->sc_done == 0)
+			return (true);
+
+		if (conn->sc_done < sizeof(conn->sc_header)) {
+			iov.buffer = (char *)conn->sc_header + conn->sc_done;
+			iov.size = sizeof(conn->sc_header) - conn->sc_done;
+		} else {
+			length = conn->sc_header[1];
+			iov.buffer = (char *)conn->sc_frame + conn->sc_done -
+			    sizeof(conn->sc_header);
+			iov.size = length + sizeof(conn->sc_header) -
+			    conn->sc_done;
+		}
+
+		step = socket_receive(conn, &iov, 1, &cmsg, &ncmsg, NULL, &err);
+		if (err != NULL) {
+			if (g_error_matches(err, G_IO_ERROR,
+			    G_IO_ERROR_WOULD_BLOCK)) {
+				g_error_free(err);
+				return (true);
+			}
+
+			conn->sc_parent->rco_error =
+			    rpc_error_create_from_gerror(err);
+			g_error_free(err);
+			goto fail;
+		}
+
+		if (ncmsg > 0)
+			socket_process_cmsgs(conn, cmsg, ncmsg, &conn->sc_fds,
+			    &conn->sc_nfds);
+		else if (cmsg != NULL)
+			g_free(cmsg);
+
+		cmsg = NULL;
+		ncmsg = 0;
+
+		if (step == 0) {
+			conn->sc_parent->rco_error = rpc_error_create(
+			    ECONNRESET, "Connection terminated", NULL);
+			goto fail;
+		}
+
+		conn->sc_done += step;
+
+		if (conn->sc_frame == NULL &&
+		    conn->sc_done == sizeof(conn->sc_header)) {
+			if (conn->sc_header[0] != 0xdeadbeef)
+				goto fail;
+
+			if (socket_check_length(conn, conn->sc_header) != 0)
+				goto fail;
+
+			conn->sc_frame = rpc_recv_buffer_alloc(
+			    conn->sc_header[1]);
+		}
+
+		if (conn->sc_frame == NULL ||
+		    conn->sc_done < conn->sc_header[1] + sizeof(conn->sc_header))
+			continue;
+
+		/* Got a complete frame */
+		socket_quickack(conn);
+		length = conn->sc_header[1];
+		if (socket_inflate(conn, conn->sc_header, &conn->sc_frame,
+		    &length) != 0)
+			goto fail;
+
+		if (conn->sc_parent->rco_recv_msg(conn->sc_parent,
+		    conn->sc_frame, length, conn->sc_fds,
+		    conn->sc_nfds) != 0)
+			goto fail;
+
+		rpc_recv_buffer_release(conn->sc_frame);
+		g_free(conn->sc_fds);
+		conn->sc_frame = NULL;
+		conn->sc_fds = NULL;
+		conn->sc_nfds = 0;
+		conn->sc_done = 0;
+	}
+
+fail:
+	rpc_recv_buffer_release(conn->sc_frame);
+	conn->sc_frame = NULL;
+	conn->sc_parent->rco_close(conn->sc_parent);
+	return (false);
+}
+
+static int
+socket_start_reader(struct socket_connection *conn, bool event_loop,
+    guint io_threads, const GArray *io_cpus, rpc_iomux_backend_t backend,
+    int shard)
+{
+
+	if (event_loop) {
+		g_socket_set_blocking(conn->sc_socket, false);
+		conn->sc_mux = rpc_iomux_add(g_socket_get_fd(conn->sc_socket),
+		    socket_mux_read, conn, io_threads, io_cpus, backend,
+		    shard);
+		if (conn->sc_mux != NULL) {
+			conn->sc_parent->rco_shared_reader = true;
+			return (0);
+		}
+
+		/* Fall back to a dedicated reader thread */
+		g_socket_set_blocking(conn->sc_socket, true);
+	}
+
+	conn->sc_reader_thread = g_thread_new("socket reader thread",
+	    socket_reader, (gpointer)conn);
+	return (0);
+}
+
 static bool
 socket_supports_fd_passing(struct rpc_connection *rpc_conn)
 {
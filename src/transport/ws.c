@@ -29,12 +29,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <glib.h>
 #include <libsoup/soup.h>
 #include "../linker_set.h"
 #include "../internal.h"
 
 #define	WS_MAX_MESSAGE_SIZE	(1024 * 2048) /* 2MB */
+#define	WS_BATCH_MAX		(64 * 1024)
+
+/*
+ * Peers that agree on this subprotocol coalesce frames: each WebSocket
+ * message carries one or more frames, every one of them prefixed with
+ * its length as a 32-bit little endian integer.
+ */
+#define	WS_PROTOCOL_BATCH	"librpc.batch.v1"
+
+/*
+ * Servers spread their connections over "io_threads" shards, each one a
+ * SoupServer with a main context and a thread of its own, so that
+ * framing, masking and dispatch of received messages scale with cores.
+ * Every shard listens on an SO_REUSEPORT socket of its own, letting the
+ * kernel balance accepts; with a descriptor passed in, or without
+ * SO_REUSEPORT, they all poll a duplicate of the same socket instead.
+ * The first shard runs on the server's own main context.
+ */
+#define	WS_IO_THREADS_MAX	4
 
 static gboolean ws_do_connect(gpointer user_data);
 static int ws_connect(struct rpc_connection *, const char *, rpc_object_t);
@@ -55,6 +76,13 @@ static void ws_release(void *);
 static int ws_teardown(struct rpc_server *);
 static int ws_teardown_end(struct rpc_server *);
 static gboolean ws_done_waiting (gpointer user_data);
+static gboolean ws_flush(gpointer);
+static void ws_flush_locked(struct ws_connection *);
+static void ws_setup_connection(struct ws_connection *);
+static GPtrArray *ws_listen_sockets(GSocketAddress *, int, guint, GError **);
+static gpointer ws_shard_worker(gpointer);
+
+static char *ws_protocols[] = { WS_PROTOCOL_BATCH, NULL };
 
 struct rpc_transport ws_transport = {
 	.name = "websocket",
@@ -80,17 +108,34 @@ struct ws_connection
 	bool				wc_aborted;
 	bool				wc_closed;
 	struct ws_server *		wc_server;
+	GMainContext *			wc_context;
+	bool				wc_deflate;
+	bool				wc_batch;
+	GMutex				wc_batch_mtx;
+	GByteArray *			wc_batch_buf;
+	bool				wc_flush_scheduled;
 };
 
 struct ws_server
 {
 	struct rpc_server *		ws_server;
-	SoupServer *			ws_soupserver;
 	SoupURI *			ws_uri;
-	bool				ws_done;
 	GMutex				ws_mtx;
 	GCond				ws_cv;
 	GMutex				ws_abort_mtx;
+	bool				ws_batch;
+	struct ws_shard *		ws_shards;
+	guint				ws_nshards;
+};
+
+struct ws_shard
+{
+	struct ws_server *		wsh_server;
+	SoupServer *			wsh_soupserver;
+	GMainContext *			wsh_context;
+	GMainLoop *			wsh_loop;	/* unless server's own */
+	GThread *			wsh_thread;
+	bool				wsh_done;
 };
 
 static gboolean
@@ -101,18 +146,31 @@ ws_do_connect(gpointer user_data)
 
 	conn->wc_session = soup_session_new_with_options(
 	    SOUP_SESSION_USE_THREAD_CONTEXT, TRUE, NULL);
+#if SOUP_CHECK_VERSION(2, 68, 0)
+	/* Sessions offer permessage-deflate by default */
+	if (!conn->wc_deflate) {
+		soup_session_remove_feature_by_type(conn->wc_session,
+		    SOUP_TYPE_WEBSOCKET_EXTENSION_DEFLATE);
+	}
+#endif
 	msg = soup_message_new_from_uri(SOUP_METHOD_GET, conn->wc_uri);
-	soup_session_websocket_connect_async(conn->wc_session, msg, NULL, NULL,
-	    NULL, &ws_connect_done, conn);
+	soup_session_websocket_connect_async(conn->wc_session, msg, NULL,
+	    conn->wc_batch ? ws_protocols : NULL, NULL, &ws_connect_done, conn);
 
 	return (false);
 }
 
 static int
 ws_connect(struct rpc_connection *rco, const char *uri_string,
-    rpc_object_t args __unused)
+    rpc_object_t args)
 {
 	struct ws_connection *conn = NULL;
+	bool deflate = true;
+	bool batch = true;
+
+	/* Params may be a dictionary: {"deflate": bool, "batch": bool} */
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY)
+		rpc_object_unpack(args, "{deflate:b,batch:b}", &deflate, &batch);
 
 	conn = g_malloc0(sizeof(*conn));
 	g_mutex_init(&conn->wc_mtx);
@@ -121,8 +179,11 @@ ws_connect(struct rpc_connection *rco, const char *uri_string,
 	g_cond_init(&conn->wc_abort_cv);
 	conn->wc_uri = soup_uri_new(uri_string);
 	conn->wc_parent = rco;
+	conn->wc_context = rpc_connection_get_main_context(rco);
+	conn->wc_deflate = deflate;
+	conn->wc_batch = batch;
 
-	g_main_context_invoke(rco->rco_main_context, ws_do_connect, conn);
+	g_main_context_invoke(conn->wc_context, ws_do_connect, conn);
 	g_mutex_lock(&conn->wc_mtx);
 	while (conn->wc_connect_err == NULL && conn->wc_ws == NULL)
 		g_cond_wait(&conn->wc_cv, &conn->wc_mtx);
@@ -167,6 +228,7 @@ ws_connect_done(GObject *obj, GAsyncResult *res, gpointer user_data)
 
 	g_mutex_lock(&conn->wc_mtx);
 	conn->wc_ws = ws;
+	ws_setup_connection(conn);
 	g_signal_connect(conn->wc_ws, "closed", G_CALLBACK(ws_close), conn);
 	g_signal_connect(conn->wc_ws, "message", G_CALLBACK(ws_receive_message),
 	    conn);
@@ -180,22 +242,36 @@ ws_listen(struct rpc_server *srv, const char *uri_str,
 {
 	GError *err = NULL;
 	GSocketAddress *addr = NULL;
+	GPtrArray *socks = NULL;
 	SoupURI *uri;
 	struct ws_server *server;
+	struct ws_shard *shard;
+	bool deflate = true;
+	bool batch = true;
+	int64_t io_threads = 0;
 	int fd = -1;
-	int ret = 0;
+	guint i;
+
+	/*
+	 * Besides a bare descriptor, params may be a dictionary:
+	 * {"fd": fd, "deflate": bool, "batch": bool, "io_threads": int}.
+	 */
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY) {
+		rpc_object_unpack(args, "{fd:f,deflate:b,batch:b,io_threads:i}",
+		    &fd, &deflate, &batch, &io_threads);
+	} else if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD)
+		fd = rpc_fd_get_value(args);
+
+	if (io_threads <= 0)
+		io_threads = MIN(g_get_num_processors(), WS_IO_THREADS_MAX);
 
 	uri = soup_uri_new(uri_str);
-	if (uri != NULL) {
-		if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD)
-			fd = rpc_fd_get_value(args);
-		else {
-			addr = g_inet_socket_address_new_from_string(uri->host,
-			    uri->port);
-		}
+	if (uri != NULL && fd == -1) {
+		addr = g_inet_socket_address_new_from_string(uri->host,
+		    uri->port);
 	}
 
-	if (addr == NULL) {
+	if (uri == NULL || (addr == NULL && fd == -1)) {
 		srv->rs_error = rpc_error_create(ENXIO, "No such address", NULL);
 		if (uri != NULL)
 			soup_uri_free(uri);
@@ -203,9 +279,22 @@ ws_listen(struct rpc_server *srv, const char *uri_str,
 		return (-1);
 	}
 
+	socks = ws_listen_sockets(addr, fd, (guint)MIN(io_threads, G_MAXUINT),
+	    &err);
+	g_clear_object(&addr);
+	if (socks == NULL) {
+		srv->rs_error = rpc_error_create(err->code, err->message, NULL);
+		g_error_free(err);
+		soup_uri_free(uri);
+		return (-1);
+	}
+
 	server = calloc(1, sizeof(*server));
 	server->ws_uri = uri;
 	server->ws_server = srv;
+	server->ws_batch = batch;
+	server->ws_nshards = socks->len;
+	server->ws_shards = g_new0(struct ws_shard, socks->len);
 	g_mutex_init(&server->ws_mtx);
 	g_cond_init(&server->ws_cv);
 	g_mutex_init(&server->ws_abort_mtx);
@@ -214,49 +303,158 @@ ws_listen(struct rpc_server *srv, const char *uri_str,
 	srv->rs_threaded_teardown = true;
         srv->rs_arg = server;
 
-	server->ws_soupserver = soup_server_new(
-	    SOUP_SERVER_SERVER_HEADER, "librpc",
-	    NULL);
-
-	if (g_strcmp0(server->ws_uri->path, "/") != 0) {
-		soup_server_add_handler(server->ws_soupserver, "/",
-		    ws_process_banner, server, NULL);
-	}
+	for (i = 0; i < server->ws_nshards; i++) {
+		shard = &server->ws_shards[i];
+		shard->wsh_server = server;
+		shard->wsh_context = i == 0 ?
+		    g_main_context_ref(srv->rs_g_context) :
+		    g_main_context_new();
+		shard->wsh_soupserver = soup_server_new(
+		    SOUP_SERVER_SERVER_HEADER, "librpc",
+		    NULL);
+
+#if SOUP_CHECK_VERSION(2, 68, 0)
+		/* Servers accept permessage-deflate by default */
+		if (!deflate) {
+			soup_server_remove_websocket_extension(
+			    shard->wsh_soupserver,
+			    SOUP_TYPE_WEBSOCKET_EXTENSION_DEFLATE);
+		}
+#else
+		(void)deflate;
+#endif
 
-	soup_server_add_websocket_handler(server->ws_soupserver,
-	    server->ws_uri->path, NULL, NULL, ws_process_connection, server,
-	    NULL);
+		if (g_strcmp0(server->ws_uri->path, "/") != 0) {
+			soup_server_add_handler(shard->wsh_soupserver, "/",
+			    ws_process_banner, server, NULL);
+		}
 
-	if (addr != NULL)
-		soup_server_listen(server->ws_soupserver, addr, 0, &err);
+		soup_server_add_websocket_handler(shard->wsh_soupserver,
+		    server->ws_uri->path, NULL, batch ? ws_protocols : NULL,
+		    ws_process_connection, shard, NULL);
 
-	if (fd != -1)
-		soup_server_listen_fd(server->ws_soupserver, fd, 0, &err);
+		/* The listening source goes to the thread-default context */
+		g_main_context_push_thread_default(shard->wsh_context);
+		if (err == NULL) {
+			soup_server_listen_socket(shard->wsh_soupserver,
+			    g_ptr_array_index(socks, i), 0, &err);
+		}
+		g_main_context_pop_thread_default(shard->wsh_context);
+	}
 
+	g_ptr_array_free(socks, true);
 	if (err != NULL) {
 		srv->rs_error = rpc_error_create(err->code, err->message, NULL);
 		g_error_free(err);
+		for (i = 0; i < server->ws_nshards; i++) {
+			shard = &server->ws_shards[i];
+			soup_server_disconnect(shard->wsh_soupserver);
+			g_object_unref(shard->wsh_soupserver);
+			g_main_context_unref(shard->wsh_context);
+		}
+
 		soup_uri_free(server->ws_uri);
-		g_object_unref(server->ws_soupserver);
+		g_free(server->ws_shards);
 		g_free(server);
-		ret = -1;
+		return (-1);
+	}
+
+	for (i = 1; i < server->ws_nshards; i++) {
+		shard = &server->ws_shards[i];
+		shard->wsh_loop = g_main_loop_new(shard->wsh_context, false);
+		shard->wsh_thread = g_thread_new("librpc ws", ws_shard_worker,
+		    shard);
 	}
 
-	g_object_unref(addr);
-	return (ret);
+	return (0);
+}
+
+/*
+ * Opens a listening socket for each of n shards. If the port is 0, the
+ * first one picks it and the rest follow.
+ */
+static GPtrArray *
+ws_listen_sockets(GSocketAddress *addr, int fd, guint n, GError **err)
+{
+	GSocketAddress *bound = NULL;
+	GPtrArray *socks;
+	GSocket *sock;
+	bool shared = true;
+	guint i;
+
+#if defined(SO_REUSEPORT)
+	shared = fd != -1;
+#endif
+	socks = g_ptr_array_new_with_free_func(g_object_unref);
+	if (addr != NULL)
+		bound = g_object_ref(addr);
+
+	for (i = 0; i < n; i++) {
+		if (i > 0 && shared) {
+			sock = g_socket_new_from_fd(dup(g_socket_get_fd(
+			    g_ptr_array_index(socks, 0))), err);
+		} else if (fd != -1)
+			sock = g_socket_new_from_fd(fd, err);
+		else {
+			sock = g_socket_new(g_socket_address_get_family(bound),
+			    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+			    err);
+#if defined(SO_REUSEPORT)
+			if (sock != NULL && n > 1 && !g_socket_set_option(sock,
+			    SOL_SOCKET, SO_REUSEPORT, true, err))
+				g_clear_object(&sock);
+#endif
+			if (sock != NULL && (!g_socket_bind(sock, bound, true,
+			    err) || !g_socket_listen(sock, err)))
+				g_clear_object(&sock);
+
+			if (sock != NULL && i == 0) {
+				g_object_unref(bound);
+				bound = g_socket_get_local_address(sock, err);
+				if (bound == NULL)
+					g_clear_object(&sock);
+			}
+		}
+
+		if (sock == NULL) {
+			g_clear_object(&bound);
+			g_ptr_array_free(socks, true);
+			return (NULL);
+		}
+
+		g_ptr_array_add(socks, sock);
+	}
+
+	g_clear_object(&bound);
+	return (socks);
+}
+
+static gpointer
+ws_shard_worker(gpointer arg)
+{
+	struct ws_shard *shard = arg;
+
+	g_main_context_push_thread_default(shard->wsh_context);
+	g_main_loop_run(shard->wsh_loop);
+	g_main_context_pop_thread_default(shard->wsh_context);
+	return (NULL);
 }
 
 static gboolean
 ws_done_waiting(gpointer user_data)
 {
-	struct ws_server *server = user_data;
+	struct ws_shard *shard = user_data;
+	struct ws_server *server = shard->wsh_server;
 
 	g_mutex_lock(&server->ws_mtx);
-	server->ws_done = true;
-        soup_server_disconnect (server->ws_soupserver);
+	shard->wsh_done = true;
+        soup_server_disconnect(shard->wsh_soupserver);
 	g_cond_broadcast(&server->ws_cv);
 	g_mutex_unlock(&server->ws_mtx);
 
+	if (shard->wsh_loop != NULL)
+		g_main_loop_quit(shard->wsh_loop);
+
         return (false);
 }
 
@@ -264,9 +462,16 @@ static int
 ws_teardown(struct rpc_server *srv)
 {
 	struct ws_server *server = srv->rs_arg;
+	struct ws_shard *shard;
+	guint i;
+
+	for (i = 0; i < server->ws_nshards; i++) {
+		shard = &server->ws_shards[i];
+		soup_server_remove_handler(shard->wsh_soupserver, "/");
+		soup_server_remove_handler(shard->wsh_soupserver,
+		    server->ws_uri->path);
+	}
 
-	soup_server_remove_handler(server->ws_soupserver, "/");
-	soup_server_remove_handler(server->ws_soupserver, server->ws_uri->path);
 	return (0);
 }
 
@@ -275,21 +480,39 @@ static int
 ws_teardown_end(struct rpc_server *srv)
 {
 	struct ws_server *server = srv->rs_arg;
-        GSource *source = g_idle_source_new();
-
-        g_source_set_priority(source, G_PRIORITY_LOW);
-        g_source_set_callback(source, ws_done_waiting, server, NULL);
-        g_source_attach(source, srv->rs_g_context);
-        g_source_unref(source);
+	struct ws_shard *shard;
+        GSource *source;
+	guint i;
+
+	for (i = 0; i < server->ws_nshards; i++) {
+		shard = &server->ws_shards[i];
+		source = g_idle_source_new();
+		g_source_set_priority(source, G_PRIORITY_LOW);
+		g_source_set_callback(source, ws_done_waiting, shard, NULL);
+		g_source_attach(source, shard->wsh_context);
+		g_source_unref(source);
+	}
 
 	g_mutex_lock(&server->ws_mtx);
-	while (!server->ws_done)
-		g_cond_wait(&server->ws_cv, &server->ws_mtx);
+	for (i = 0; i < server->ws_nshards; i++) {
+		while (!server->ws_shards[i].wsh_done)
+			g_cond_wait(&server->ws_cv, &server->ws_mtx);
+	}
 	g_mutex_unlock(&server->ws_mtx);
 
-	soup_uri_free(server->ws_uri);
-	g_object_unref(server->ws_soupserver);
+	for (i = 0; i < server->ws_nshards; i++) {
+		shard = &server->ws_shards[i];
+		if (shard->wsh_thread != NULL) {
+			g_thread_join(shard->wsh_thread);
+			g_main_loop_unref(shard->wsh_loop);
+		}
+
+		g_object_unref(shard->wsh_soupserver);
+		g_main_context_unref(shard->wsh_context);
+	}
 
+	soup_uri_free(server->ws_uri);
+	g_free(server->ws_shards);
 	g_free(server);
         return (0);
 }
@@ -316,7 +539,8 @@ ws_process_connection(SoupServer *ss __unused,
     SoupClientContext *client __unused, gpointer user_data)
 {
 	rpc_connection_t rco;
-	struct ws_server *server = user_data;
+	struct ws_shard *shard = user_data;
+	struct ws_server *server = shard->wsh_server;
 	struct ws_connection *conn;
 
 	debugf("new connection");
@@ -324,6 +548,8 @@ ws_process_connection(SoupServer *ss __unused,
 	conn = g_malloc0(sizeof(*conn));
 	conn->wc_ws = connection;
 	conn->wc_server = server;
+	conn->wc_context = shard->wsh_context;
+	ws_setup_connection(conn);
 
 	g_mutex_init(&conn->wc_abort_mtx);
 	g_cond_init(&conn->wc_abort_cv);
@@ -348,17 +574,68 @@ ws_process_connection(SoupServer *ss __unused,
 	    G_CALLBACK(ws_receive_message), conn);
 }
 
+/*
+ * Batching is used if both ends asked for it during the handshake.
+ */
+static void
+ws_setup_connection(struct ws_connection *conn)
+{
+
+	conn->wc_batch = g_strcmp0(
+	    soup_websocket_connection_get_protocol(conn->wc_ws),
+	    WS_PROTOCOL_BATCH) == 0;
+	g_mutex_init(&conn->wc_batch_mtx);
+	conn->wc_batch_buf = g_byte_array_new();
+}
+
+/*
+ * Frames are decoded straight out of the message, which stays alive
+ * for as long as anything decoded from it references it.
+ */
 static void
 ws_receive_message(SoupWebsocketConnection *ws __unused,
     SoupWebsocketDataType type __unused, GBytes *message, gpointer user_data)
 {
 	struct ws_connection *conn = user_data;
-	const void *data;
+	struct rpc_connection *rco = conn->wc_parent;
+	const uint8_t *data;
+	void *owner;
+	uint32_t framelen;
 	size_t len;
 
 	data = g_bytes_get_data(message, &len);
-	debugf("received frame: addr=%p, len=%zu", data, len);
-	conn->wc_parent->rco_recv_msg(conn->wc_parent, data, len, NULL, 0);
+	debugf("received message: addr=%p, len=%zu", data, len);
+	owner = rpc_recv_buffer_wrap(message);
+
+	if (!conn->wc_batch) {
+		rco->rco_recv_owned(rco, data, len, owner);
+		rpc_recv_buffer_release(owner);
+		return;
+	}
+
+	while (len > 0) {
+		if (len < sizeof(framelen)) {
+			debugf("truncated frame header, dropping %zu bytes", len);
+			break;
+		}
+
+		memcpy(&framelen, data, sizeof(framelen));
+		framelen = GUINT32_FROM_LE(framelen);
+		data += sizeof(framelen);
+		len -= sizeof(framelen);
+
+		if (framelen > len) {
+			debugf("truncated frame: len=%u, left=%zu", framelen,
+			    len);
+			break;
+		}
+
+		rco->rco_recv_owned(rco, data, framelen, owner);
+		data += framelen;
+		len -= framelen;
+	}
+
+	rpc_recv_buffer_release(owner);
 }
 
 static void
@@ -398,16 +675,80 @@ ws_close(SoupWebsocketConnection *ws __unused, gpointer user_data)
 	rpc_connection_release(conn->wc_parent);
 }
 
+static void
+ws_flush_locked(struct ws_connection *conn)
+{
+
+	if (conn->wc_batch_buf->len == 0)
+		return;
+
+	if (soup_websocket_connection_get_state(conn->wc_ws) ==
+	    SOUP_WEBSOCKET_STATE_OPEN) {
+		soup_websocket_connection_send_binary(conn->wc_ws,
+		    conn->wc_batch_buf->data, conn->wc_batch_buf->len);
+	}
+
+	g_byte_array_set_size(conn->wc_batch_buf, 0);
+}
+
+static gboolean
+ws_flush(gpointer user_data)
+{
+	struct ws_connection *conn = user_data;
+	struct rpc_connection *rco = conn->wc_parent;
+
+	g_mutex_lock(&conn->wc_batch_mtx);
+	conn->wc_flush_scheduled = false;
+	ws_flush_locked(conn);
+	g_mutex_unlock(&conn->wc_batch_mtx);
+
+	/* Taken when the flush was scheduled */
+	rpc_connection_release(rco);
+	return (false);
+}
+
+/*
+ * With batching, frames sent before the connection's main loop gets
+ * around to flushing go out together in a single message, or as soon
+ * as WS_BATCH_MAX bytes pile up.
+ */
 static int
 ws_send_message(void *arg, const void *buf, size_t len,
     const int *fds __unused, size_t nfds __unused)
 {
 	struct ws_connection *conn = arg;
+	GSource *source;
+	uint32_t framelen;
 
 	if (soup_websocket_connection_get_state(conn->wc_ws) != SOUP_WEBSOCKET_STATE_OPEN)
 		return (-1);
 
-	soup_websocket_connection_send_binary(conn->wc_ws, buf, len);
+	if (!conn->wc_batch) {
+		soup_websocket_connection_send_binary(conn->wc_ws, buf, len);
+		return (0);
+	}
+
+	if (len > UINT32_MAX)
+		return (-1);
+
+	framelen = GUINT32_TO_LE((uint32_t)len);
+	g_mutex_lock(&conn->wc_batch_mtx);
+	g_byte_array_append(conn->wc_batch_buf, (const guint8 *)&framelen,
+	    sizeof(framelen));
+	g_byte_array_append(conn->wc_batch_buf, buf, (guint)len);
+
+	if (conn->wc_batch_buf->len >= WS_BATCH_MAX)
+		ws_flush_locked(conn);
+	else if (!conn->wc_flush_scheduled) {
+		conn->wc_flush_scheduled = true;
+		rpc_connection_retain(conn->wc_parent);
+		source = g_idle_source_new();
+		g_source_set_callback(source, ws_flush, conn, NULL);
+		g_source_attach(source, conn->wc_context);
+		g_source_unref(source);
+	}
+
+	g_mutex_unlock(&conn->wc_batch_mtx);
 	return (0);
 }
 
@@ -427,6 +768,12 @@ ws_abort(void *arg)
 
 	conn->wc_aborted = true;
 	g_mutex_unlock(&conn->wc_abort_mtx);
+
+	/* Don't lose whatever is still waiting to be batched up */
+	g_mutex_lock(&conn->wc_batch_mtx);
+	ws_flush_locked(conn);
+	g_mutex_unlock(&conn->wc_batch_mtx);
+
 	if (soup_websocket_connection_get_state(conn->wc_ws) !=
 			SOUP_WEBSOCKET_STATE_OPEN)
 		return (0);
@@ -454,6 +801,9 @@ ws_release(void *arg)
 	if (conn->wc_ws)
 		g_object_unref(conn->wc_ws);
 
+	if (conn->wc_batch_buf)
+		g_byte_array_free(conn->wc_batch_buf, true);
+
 	g_free(conn);
 }
 
@@ -31,11 +31,24 @@
 #include <xpc/xpc.h>
 #include "../linker_set.h"
 #include "../internal.h"
+#include "../serializer/msgpack.h"
+
+/*
+ * Messages between two librpc peers may travel as a single msgpack
+ * frame under this key, instead of a tree of native xpc objects. A
+ * client asks for it with the "frames" connect parameter; a server
+ * answers in frames to whoever sent it one. Anything else, including
+ * every non-librpc peer, gets native objects.
+ */
+#define	XPC_FRAME_KEY		"$frame"
 
 static int xpc_connect(struct rpc_connection *, const char *, rpc_object_t);
 static int xpc_listen(struct rpc_server *, const char *, rpc_object_t);
 static xpc_object_t xpc_from_rpc(rpc_object_t);
 static rpc_object_t xpc_to_rpc(xpc_object_t);
+static xpc_object_t xpc_from_buffer(const void *, size_t,
+    dispatch_block_t);
+static rpc_object_t xpc_recv(struct xpc_connection *, xpc_object_t);
 static int xpc_send_msg(void *, const void *, size_t, const int *, size_t);
 static int xpc_abort(void *);
 static void xpc_conn_release(void *);
@@ -52,6 +65,7 @@ struct xpc_connection
 	xpc_connection_t	xpc_handle;
 	dispatch_queue_t 	queue;
 	struct rpc_connection *	conn;
+	bool			frames;
 };
 
 static const struct rpc_transport xpc_transport = {
@@ -97,9 +111,11 @@ xpc_from_rpc(rpc_object_t obj)
 		return (xpc_string_create(rpc_string_get_string_ptr(obj)));
 
 	case RPC_TYPE_BINARY:
-		return (xpc_data_create(
-		    rpc_data_get_bytes_ptr(obj),
-		    rpc_data_get_length(obj)));
+		rpc_retain(obj);
+		return (xpc_from_buffer(rpc_data_get_bytes_ptr(obj),
+		    rpc_data_get_length(obj), ^{
+			rpc_release(obj);
+		}));
 
 	case RPC_TYPE_ARRAY:
 		ret = xpc_array_create(NULL, 0);
@@ -153,7 +169,6 @@ xpc_to_rpc(xpc_object_t obj)
 	rpc_object_t ret;
 	xpc_type_t type = xpc_get_type(obj);
 	const char *dtype;
-	void *blob;
 
 	if (obj == NULL)
 		return (NULL);
@@ -179,12 +194,13 @@ xpc_to_rpc(xpc_object_t obj)
 	if (type == XPC_TYPE_STRING)
 		return (rpc_string_create(xpc_string_get_string_ptr(obj)));
 
+	/* Point into the message rather than copying out of it */
 	if (type == XPC_TYPE_DATA) {
-		blob = g_memdup(xpc_data_get_bytes_ptr(obj),
-		    (guint)xpc_data_get_length(obj));
-
-		return (rpc_data_create(blob, xpc_data_get_length(obj),
-		    ^(void *ptr) { g_free(ptr); }));
+		xpc_retain(obj);
+		return (rpc_data_create(xpc_data_get_bytes_ptr(obj),
+		    xpc_data_get_length(obj), ^(void *ptr __unused) {
+			xpc_release(obj);
+		}));
 	}
 
 	if (type == XPC_TYPE_ARRAY) {
@@ -220,6 +236,39 @@ xpc_to_rpc(xpc_object_t obj)
 	g_assert_not_reached();
 }
 
+/*
+ * Wraps a buffer in an xpc data object without copying it. The
+ * destructor runs once xpc is done with the buffer. Large buffers are
+ * then sent out of line, as a virtual memory transfer.
+ */
+static xpc_object_t
+xpc_from_buffer(const void *buf, size_t len, dispatch_block_t destructor)
+{
+	dispatch_data_t data;
+	xpc_object_t ret;
+
+	data = dispatch_data_create(buf, len, NULL, destructor);
+	ret = xpc_data_create_with_dispatch_data(data);
+	dispatch_release(data);
+	return (ret);
+}
+
+static rpc_object_t
+xpc_recv(struct xpc_connection *conn, xpc_object_t msg)
+{
+	xpc_object_t frame = NULL;
+
+	if (xpc_get_type(msg) == XPC_TYPE_DICTIONARY)
+		frame = xpc_dictionary_get_value(msg, XPC_FRAME_KEY);
+
+	if (frame == NULL || xpc_get_type(frame) != XPC_TYPE_DATA)
+		return (xpc_to_rpc(msg));
+
+	conn->frames = true;
+	return (rpc_msgpack_deserialize(xpc_data_get_bytes_ptr(frame),
+	    xpc_data_get_length(frame)));
+}
+
 static int
 xpc_send_msg(void *arg, const void *buf, size_t size __unused,
     const int *fds __unused, size_t nfds __unused)
@@ -227,9 +276,28 @@ xpc_send_msg(void *arg, const void *buf, size_t size __unused,
 	struct xpc_connection *conn = arg;
 	rpc_object_t obj = (rpc_object_t)buf;
 	xpc_object_t msg;
+	xpc_object_t data;
+	void *frame;
+	size_t len;
+
+	if (!conn->frames) {
+		msg = xpc_from_rpc(obj);
+		xpc_connection_send_message(conn->xpc_handle, msg);
+		xpc_release(msg);
+		return (0);
+	}
 
-	msg = xpc_from_rpc(obj);
+	if (rpc_msgpack_serialize(obj, &frame, &len) != 0)
+		return (-1);
+
+	data = xpc_from_buffer(frame, len, ^{
+		g_free(frame);
+	});
+
+	msg = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_value(msg, XPC_FRAME_KEY, data);
 	xpc_connection_send_message(conn->xpc_handle, msg);
+	xpc_release(data);
 	xpc_release(msg);
 	return (0);
 }
@@ -251,18 +319,23 @@ xpc_conn_release(void *arg)
 
 static int
 xpc_connect(struct rpc_connection *conn, const char *uri_string,
-    rpc_object_t params __unused)
+    rpc_object_t params)
 {
 	g_autofree char *uri_copy = g_strdup(uri_string);
 	struct yuarel uri;
 	struct xpc_connection *xconn;
+	bool frames = false;
 
 	if (yuarel_parse(&uri, uri_copy) != 0) {
 		rpc_set_last_errorf(EINVAL, "Cannot parse URI");
 		return (-1);
 	}
 
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY)
+		rpc_object_unpack(params, "{frames:b}", &frames);
+
 	xconn = g_malloc0(sizeof(*xconn));
+	xconn->frames = frames;
 	xconn->queue = dispatch_queue_create("xpc client", DISPATCH_QUEUE_SERIAL);
 	xconn->xpc_handle = g_strcmp0(uri.scheme, "xpc") == 0
 	    ? xpc_connection_create(uri.host, xconn->queue)
@@ -279,7 +352,7 @@ xpc_connect(struct rpc_connection *conn, const char *uri_string,
 			return;
 		}
 
-		rpc_object_t obj = xpc_to_rpc(msg);
+		rpc_object_t obj = xpc_recv(xconn, msg);
 		conn->rco_recv_msg(conn, obj, 0, NULL, 0);
 		rpc_release(obj);
 	});
@@ -323,7 +396,7 @@ xpc_listen(struct rpc_server *conn, const char *uri_string,
 				return;
 			}
 
-			rpc_object_t obj = xpc_to_rpc(msg);
+			rpc_object_t obj = xpc_recv(xconn, msg);
 			xconn->conn->rco_recv_msg(xconn->conn, obj, 0, NULL, 0);
 		});
 
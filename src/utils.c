@@ -26,9 +26,16 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #ifndef _WIN32
 #include <execinfo.h>
 #endif
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
 #include <glib.h>
 #include "linker_set.h"
 #include "internal.h"
@@ -159,37 +166,6 @@ rpc_get_last_error(void)
 	return (error);
 }
 
-void
-rpc_trace(const char *msg, const char *ident, rpc_object_t frame)
-{
-	char *descr;
-	const char *dest;
-	static FILE *stream = NULL;
-	GDateTime *now;
-
-	if (stream == NULL) {
-		dest = getenv("LIBRPC_LOGGING");
-		if (dest == NULL)
-			return;
-		else if (!g_strcmp0(dest, "stderr"))
-			stream = stderr;
-		else
-			stream = fopen(dest, "a");
-			if (stream == NULL)
-				return;
-	}
-
-	now = g_date_time_new_now_local();
-	descr = rpc_copy_description(frame);
-	fprintf(stream, "[%02d:%02d:%02d.%06d] %s (%s): %s\n",
-	    g_date_time_get_hour(now), g_date_time_get_minute(now),
-	    g_date_time_get_second(now), g_date_time_get_microsecond(now),
-	    msg, ident, descr);
-
-	g_date_time_unref(now);
-	g_free(descr);
-}
-
 void
 rpc_abort(const char *fmt, ...)
 {
@@ -206,32 +182,48 @@ rpc_abort(const char *fmt, ...)
 }
 
 #ifdef _WIN32
+int
+rpc_backtrace_capture(void **buffer, int size)
+{
+
+	return (0);
+}
+
 char *
-rpc_get_backtrace(void)
+rpc_backtrace_format(void *const *frames, int count)
 {
 
 	return (NULL);
 }
 #else
+/*
+ * Walking the stack is cheap; turning the addresses into names is what
+ * costs, so the two are kept apart and the latter can be done later.
+ */
+int
+rpc_backtrace_capture(void **buffer, int size)
+{
+
+	return (backtrace(buffer, size));
+}
+
 char *
-rpc_get_backtrace(void)
+rpc_backtrace_format(void *const *frames, int count)
 {
 	GString *result;
-	int count, i;
-	void *buffer[128];
 	char **names;
+	int i;
 
-	count = backtrace(buffer, 128);
 	if (count == 0)
 		return (NULL);
 
-	names = backtrace_symbols(buffer, count);
+	names = backtrace_symbols(frames, count);
 	if (names == NULL)
 		return (NULL);
 
 	result = g_string_new("Traceback (most recent call first):\n");
 
-	for (i = 1; i < count; i++)
+	for (i = 0; i < count; i++)
 		g_string_append_printf(result, "%s\n", names[i]);
 
 	free(names);
@@ -239,6 +231,20 @@ rpc_get_backtrace(void)
 }
 #endif
 
+char *
+rpc_get_backtrace(void)
+{
+	void *buffer[RPC_BACKTRACE_DEPTH];
+	int count;
+
+	count = rpc_backtrace_capture(buffer, RPC_BACKTRACE_DEPTH);
+	if (count < 3)
+		return (NULL);
+
+	/* Skip the capture and our own frame */
+	return (rpc_backtrace_format(&buffer[2], count - 2));
+}
+
 char *
 rpc_generate_v4_uuid(void)
 {
@@ -260,6 +266,80 @@ rpc_generate_v4_uuid(void)
 	    bytes[14], bytes[15]));
 }
 
+static int
+rpc_random_bytes(void *buf, size_t len)
+{
+	uint8_t *ptr = buf;
+	ssize_t ret;
+	int fd;
+
+#if defined(__linux__)
+	while (len > 0) {
+		ret = getrandom(ptr, len, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == ENOSYS)
+				break;
+
+			return (-1);
+		}
+
+		ptr += ret;
+		len -= (size_t)ret;
+	}
+
+	if (len == 0)
+		return (0);
+#endif
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (-1);
+
+	while (len > 0) {
+		ret = read(fd, ptr, len);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			close(fd);
+			return (-1);
+		}
+
+		ptr += ret;
+		len -= (size_t)ret;
+	}
+
+	close(fd);
+	return (0);
+}
+
+/*
+ * Returns a random hex token suitable as a bearer secret, or NULL if
+ * the system random source couldn't be read. Unlike
+ * rpc_generate_v4_uuid(), this never falls back to a non-cryptographic
+ * generator.
+ */
+char *
+rpc_generate_token(void)
+{
+	uint8_t bytes[RPC_TOKEN_BYTES];
+	GString *str;
+	size_t i;
+
+	if (rpc_random_bytes(bytes, sizeof(bytes)) != 0)
+		return (NULL);
+
+	str = g_string_sized_new(sizeof(bytes) * 2);
+	for (i = 0; i < sizeof(bytes); i++)
+		g_string_append_printf(str, "%02x", bytes[i]);
+
+	memset(bytes, 0, sizeof(bytes));
+	return (g_string_free(str, false));
+}
+
 gboolean
 rpc_kill_main_loop(void *arg)
 {
@@ -280,3 +360,198 @@ rpc_ptr_array_string_index(GPtrArray *arr, const char *str)
 
 	return (-1);
 }
+
+void
+rpc_output_buffer_recycle(struct rpc_output_buffer *buf)
+{
+
+	buf->rob_used = 0;
+	if (buf->rob_segments != NULL)
+		g_array_set_size(buf->rob_segments, 0);
+
+	if (buf->rob_bounds != NULL) {
+		g_array_set_size(buf->rob_bounds, 0);
+		g_array_set_size(buf->rob_fds, 0);
+		g_ptr_array_set_size(buf->rob_objects, 0);
+	}
+
+	/* Don't let a single large frame pin memory for the connection */
+	if (buf->rob_size > RPC_OUTPUT_BUFFER_RETAIN_MAX) {
+		g_free(buf->rob_data);
+		buf->rob_data = NULL;
+		buf->rob_size = 0;
+		buf->rob_releases++;
+	}
+}
+
+void
+rpc_output_buffer_free(struct rpc_output_buffer *buf)
+{
+
+	g_free(buf->rob_data);
+	buf->rob_data = NULL;
+	buf->rob_size = 0;
+	buf->rob_used = 0;
+
+	if (buf->rob_segments != NULL) {
+		g_array_free(buf->rob_segments, true);
+		buf->rob_segments = NULL;
+	}
+
+	if (buf->rob_bounds != NULL) {
+		g_array_free(buf->rob_bounds, true);
+		g_array_free(buf->rob_fds, true);
+		g_ptr_array_free(buf->rob_objects, true);
+		buf->rob_bounds = NULL;
+		buf->rob_fds = NULL;
+		buf->rob_objects = NULL;
+	}
+}
+
+/*
+ * Appends a frame that was encoded elsewhere. It can't carry binary
+ * segments or descriptors of its own.
+ */
+void
+rpc_output_buffer_append(struct rpc_output_buffer *buf, const void *data,
+    size_t len)
+{
+	struct rpc_output_frame frame;
+	size_t new_size;
+
+	if (buf->rob_bounds == NULL) {
+		buf->rob_bounds = g_array_new(false, false,
+		    sizeof(struct rpc_output_frame));
+		buf->rob_fds = g_array_new(false, false, sizeof(int));
+		buf->rob_objects = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)rpc_release_impl);
+	}
+
+	if (buf->rob_used + len > buf->rob_size) {
+		new_size = MAX(buf->rob_size, RPC_OUTPUT_BUFFER_MIN);
+		while (new_size < buf->rob_used + len)
+			new_size *= 2;
+
+		buf->rob_data = g_realloc(buf->rob_data, new_size);
+		buf->rob_size = new_size;
+		buf->rob_grows++;
+	}
+
+	memcpy(buf->rob_data + buf->rob_used, data, len);
+	buf->rob_used += len;
+	buf->rob_hwm = MAX(buf->rob_hwm, buf->rob_used);
+	buf->rob_frames++;
+
+	frame.rof_end = buf->rob_used;
+	frame.rof_segments = buf->rob_segments != NULL ?
+	    buf->rob_segments->len : 0;
+	frame.rof_fds = buf->rob_fds->len;
+	g_array_append_val(buf->rob_bounds, frame);
+}
+
+/*
+ * Exchanges the contents of two buffers, leaving the statistics where
+ * they were.
+ */
+void
+rpc_output_buffer_swap(struct rpc_output_buffer *a,
+    struct rpc_output_buffer *b)
+{
+	struct rpc_output_buffer tmp = *a;
+
+	a->rob_data = b->rob_data;
+	a->rob_size = b->rob_size;
+	a->rob_used = b->rob_used;
+	a->rob_segments = b->rob_segments;
+	a->rob_bounds = b->rob_bounds;
+	a->rob_fds = b->rob_fds;
+	a->rob_objects = b->rob_objects;
+
+	b->rob_data = tmp.rob_data;
+	b->rob_size = tmp.rob_size;
+	b->rob_used = tmp.rob_used;
+	b->rob_segments = tmp.rob_segments;
+	b->rob_bounds = tmp.rob_bounds;
+	b->rob_fds = tmp.rob_fds;
+	b->rob_objects = tmp.rob_objects;
+}
+
+/*
+ * Builds the I/O vector for count frames starting at first, interleaving
+ * the encoded data with the binary payloads that were left out of it.
+ * If frame_niov is not NULL, it receives the number of vector entries
+ * making up each of the frames. The caller is responsible for freeing
+ * the returned vector.
+ */
+size_t
+rpc_output_buffer_get_iov(struct rpc_output_buffer *buf, guint first,
+    guint count, struct iovec **iovp, size_t *frame_niov)
+{
+	struct rpc_output_frame *frame;
+	struct rpc_output_segment *seg;
+	struct iovec *iov;
+	size_t offset = 0;
+	size_t niov = 0;
+	size_t start;
+	guint nseg = 0;
+	guint i;
+
+	if (first > 0) {
+		frame = &g_array_index(buf->rob_bounds,
+		    struct rpc_output_frame, first - 1);
+		offset = frame->rof_end;
+		nseg = frame->rof_segments;
+	}
+
+	frame = &g_array_index(buf->rob_bounds, struct rpc_output_frame,
+	    first + count - 1);
+	iov = g_new(struct iovec, (frame->rof_segments - nseg) * 2 + count);
+
+	for (i = first; i < first + count; i++) {
+		frame = &g_array_index(buf->rob_bounds,
+		    struct rpc_output_frame, i);
+		start = niov;
+
+		for (; nseg < frame->rof_segments; nseg++) {
+			seg = &g_array_index(buf->rob_segments,
+			    struct rpc_output_segment, nseg);
+
+			if (seg->ros_offset > offset) {
+				iov[niov].iov_base = buf->rob_data + offset;
+				iov[niov].iov_len = seg->ros_offset - offset;
+				niov++;
+			}
+
+			iov[niov].iov_base = (void *)seg->ros_ptr;
+			iov[niov].iov_len = seg->ros_len;
+			niov++;
+			offset = seg->ros_offset;
+		}
+
+		if (frame->rof_end > offset) {
+			iov[niov].iov_base = buf->rob_data + offset;
+			iov[niov].iov_len = frame->rof_end - offset;
+			niov++;
+		}
+
+		offset = frame->rof_end;
+		if (frame_niov != NULL)
+			frame_niov[i - first] = niov - start;
+	}
+
+	*iovp = iov;
+	return (niov);
+}
+
+rpc_object_t
+rpc_output_buffer_get_stats(struct rpc_output_buffer *buf)
+{
+
+	return (rpc_object_pack("{size:u,high_water_mark:u,frames:u,grows:u,"
+	    "releases:u}",
+	    (uint64_t)buf->rob_size,
+	    (uint64_t)buf->rob_hwm,
+	    buf->rob_frames,
+	    buf->rob_grows,
+	    buf->rob_releases));
+}
@@ -47,10 +47,40 @@ validate_string_regex(rpc_object_t obj, rpc_object_t params,
 	return (valid);
 }
 
+static void *
+compile_string_regex(rpc_object_t params)
+{
+	const char *pattern = NULL;
+
+	rpc_object_unpack(params, "{s}", "pattern", &pattern);
+	if (pattern == NULL)
+		return (NULL);
+
+	/* G_REGEX_OPTIMIZE lets PCRE JIT-compile the pattern */
+	return (g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, NULL));
+}
+
+static bool
+validate_string_regex_compiled(rpc_object_t obj, void *compiled,
+    struct rpct_typei *typei __unused, struct rpct_error_context *errctx)
+{
+	GRegex *regex = compiled;
+
+	if (!g_regex_match(regex, rpc_string_get_string_ptr(obj), 0, NULL)) {
+		rpct_add_error(errctx, NULL, "String doesn't match");
+		return (false);
+	}
+
+	return (true);
+}
+
 struct rpct_validator validator_string_regex = {
 	.type = "string",
 	.name = "regex",
-	.validate = validate_string_regex
+	.validate = validate_string_regex,
+	.compile = compile_string_regex,
+	.validate_compiled = validate_string_regex_compiled,
+	.release = (GDestroyNotify)g_regex_unref
 };
 
 DECLARE_VALIDATOR(validator_string_regex);
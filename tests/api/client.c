@@ -28,6 +28,7 @@
 //#include "../catch.hpp"
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
 #include <rpc/object.h>
 #include <rpc/service.h>
 #include <rpc/server.h>
@@ -143,11 +144,14 @@ SCENARIO("RPC_CLIENT", "Create a simple RPC server and connect to it") {
  *
  */
 
+#define _GNU_SOURCE
 #include "../tests.h"
 #include <errno.h>
 #include "../../src/linker_set.h"
 #include "../../src/internal.h"
+#include "../../src/serializer/msgpack.h"
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -156,6 +160,17 @@ SCENARIO("RPC_CLIENT", "Create a simple RPC server and connect to it") {
 #include <rpc/server.h>
 #include <rpc/client.h>
 #include <rpc/connection.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#if defined(AF_VSOCK)
+#include <linux/vm_sockets.h>
+#endif
+#endif
 
 #define THREADS 50
 #define STREAMS 50
@@ -175,6 +190,12 @@ struct u {
 	 {"ws", "ws://w0.0.0.0:6600/ws", "ws://127.0.0.1:6600/ws", false},
 	 {"loopback", "loopback://0", "loopback://0", true},
 	 {"loopback", "loopback://a", "loopback://0", false},
+	 {"shm", "shm://test-shm.sock", "shm://test-shm.sock", true},
+	 {"unix+seq", "unix+seq://test-seq.sock", "unix+seq://test-seq.sock",
+	     true},
+	 {"vsock", "vsock://any:5700", "vsock://1:5700", true},
+	 {"tcp+tls", "tcp+tls://0.0.0.0:5800", "tcp+tls://127.0.0.1:5800",
+	     true},
 	 {0, "", "", 0}};
 
 
@@ -395,123 +416,2941 @@ client_server_calls_test(client_fixture *fixture, gconstpointer user_data)
 	rpc_context_unregister_member(fixture->ctx, NULL, "callyou");
 }
 
+static void
+client_stats_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_object_t stats;
+	uint64_t frames = 0;
+	uint64_t hwm = 0;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+
+	stats = rpc_connection_get_stats(conn);
+	g_assert_cmpint(rpc_object_unpack(
+	    rpc_dictionary_get_value(stats, "send_buffer"),
+	    "{frames:u,high_water_mark:u}", &frames, &hwm), ==, 2);
+	g_assert_cmpuint(frames, >=, 1);
+	g_assert_cmpuint(hwm, >, 0);
+
+	rpc_release(stats);
+	rpc_client_close(client);
+}
+
+static void
+client_flush_latency_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_object_t stats;
+	uint64_t writes = 0;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	rpc_connection_set_flush_latency(conn, 1000);
+
+	for (i = 0; i < 10; i++) {
+		result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+		g_assert_nonnull(result);
+		g_assert_false(rpc_is_error(result));
+		rpc_release(result);
+	}
+
+	stats = rpc_connection_get_stats(conn);
+	g_assert_cmpint(rpc_object_unpack(stats, "{writes:u}", &writes), ==, 1);
+	g_assert_cmpuint(writes, >=, 1);
+	g_assert_cmpuint(writes, <=, 10);
+
+	rpc_release(stats);
+	rpc_client_close(client);
+}
+
+static void
+client_arena_decoding_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t results[10];
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	rpc_connection_set_arena_decoding(conn, true);
+
+	for (i = 0; i < 10; i++) {
+		results[i] = rpc_connection_call_simple(conn, "hi", "[s]",
+		    "world");
+		g_assert_nonnull(results[i]);
+		g_assert_false(rpc_is_error(results[i]));
+	}
+
+	/* Results must outlive the frames they were decoded from */
+	for (i = 0; i < 10; i++) {
+		g_assert_cmpstr(rpc_string_get_string_ptr(results[i]), ==,
+		    "hello world!");
+		rpc_release(results[i]);
+	}
+
+	rpc_client_close(client);
+}
+
+#define	LAZY_WALKERS	8
+
+struct lazy_walk {
+	rpc_object_t		lazy;
+	rpc_object_t		eager;
+	volatile int *		start;
+};
+
+static rpc_object_t
+lazy_tree_create(void)
+{
+	rpc_object_t tree;
+	rpc_object_t items;
+	rpc_object_t item;
+	rpc_object_t tags;
+	rpc_object_t meta;
+	int64_t i;
+
+	tree = rpc_dictionary_create();
+	items = rpc_array_create();
+	for (i = 0; i < 32; i++) {
+		item = rpc_dictionary_create();
+		tags = rpc_array_create();
+		meta = rpc_dictionary_create();
+		rpc_array_append_stolen_value(tags, rpc_string_create("a"));
+		rpc_array_append_stolen_value(tags, rpc_int64_create(i));
+		rpc_array_append_stolen_value(tags, rpc_array_create());
+		rpc_dictionary_set_int64(meta, "depth", i % 4);
+		rpc_dictionary_steal_value(meta, "owner",
+		    rpc_object_pack("{name:s,uid:i}", "root", (int64_t)0));
+		rpc_dictionary_set_string(item, "name", "item");
+		rpc_dictionary_set_int64(item, "index", i);
+		rpc_dictionary_steal_value(item, "tags", tags);
+		rpc_dictionary_steal_value(item, "meta", meta);
+		rpc_array_append_stolen_value(items, item);
+	}
+
+	rpc_dictionary_steal_value(tree, "items", items);
+	rpc_dictionary_steal_value(tree, "empty", rpc_dictionary_create());
+	return (tree);
+}
+
+static gpointer
+lazy_walk_func(gpointer data)
+{
+	struct lazy_walk *walk = data;
+
+	while (!g_atomic_int_get(walk->start))
+		;
+
+	return (GINT_TO_POINTER(rpc_equal(walk->lazy, walk->eager)));
+}
+
+static void
+client_lazy_decoding_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t lazy_client;
+	rpc_client_t eager_client;
+	rpc_connection_t conn;
+	rpc_object_t eager;
+	rpc_object_t result;
+	GThread *threads[LAZY_WALKERS];
+	struct lazy_walk walk;
+	volatile int start;
+	int i, j;
+
+	rpc_context_register_block(fixture->ctx, NULL, "tree", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args __unused) {
+		return (lazy_tree_create());
+	});
+
+	rpc_server_resume(fixture->srv);
+	eager_client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(eager_client);
+	lazy_client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(lazy_client);
+
+	conn = rpc_client_get_connection(eager_client);
+	eager = rpc_connection_call_simple(conn, "tree", RPC_NULL_FORMAT);
+	g_assert_nonnull(eager);
+	g_assert_false(rpc_is_error(eager));
+
+	conn = rpc_client_get_connection(lazy_client);
+	rpc_connection_set_lazy_decoding(conn, true);
+
+	/* Several threads touch the same untouched containers at once */
+	for (i = 0; i < 10; i++) {
+		result = rpc_connection_call_simple(conn, "tree",
+		    RPC_NULL_FORMAT);
+		g_assert_nonnull(result);
+		g_assert_false(rpc_is_error(result));
+
+		start = 0;
+		walk.lazy = result;
+		walk.eager = eager;
+		walk.start = &start;
+		for (j = 0; j < LAZY_WALKERS; j++)
+			threads[j] = g_thread_new("lazy", lazy_walk_func, &walk);
+
+		g_atomic_int_set(&start, 1);
+		for (j = 0; j < LAZY_WALKERS; j++) {
+			g_assert_true(GPOINTER_TO_INT(
+			    g_thread_join(threads[j])));
+		}
+
+		g_assert_cmpint(rpc_dictionary_get_count(result), ==, 2);
+		g_assert_cmpint(rpc_array_get_count(
+		    rpc_dictionary_get_value(result, "items")), ==, 32);
+		rpc_release(result);
+	}
+
+	rpc_release(eager);
+	rpc_client_close(lazy_client);
+	rpc_client_close(eager_client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "tree");
+}
+
+static void
+client_modify_frames_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t call;
+	rpc_object_t args;
+	rpc_object_t result;
+	__block rpc_object_t kept;
+
+	kept = rpc_object_pack("{name:s,list:[i,i]}", "kept", (int64_t)1,
+	    (int64_t)2);
+
+	/* Handlers and callers may modify what they get, on any transport */
+	rpc_context_register_block(fixture->ctx, NULL, "modify", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args) {
+		rpc_array_append_stolen_value(args, rpc_int64_create(3));
+		rpc_array_set_value(args, 0, kept);
+		return (rpc_retain(args));
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	args = rpc_object_pack("[s,{a:i}]", "first", (int64_t)1);
+	call = rpc_connection_call(conn, NULL, NULL, "modify", args, NULL);
+	g_assert_nonnull(call);
+	rpc_call_wait(call);
+	result = rpc_retain(rpc_call_result(call));
+	rpc_call_free(call);
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+	g_assert_cmpint(rpc_array_get_count(result), ==, 3);
+	g_assert_cmpint(rpc_array_get_count(args), ==, 2);
+
+	rpc_dictionary_set_string(rpc_array_get_value(result, 0), "name",
+	    "changed");
+	rpc_array_append_stolen_value(rpc_dictionary_get_value(
+	    rpc_array_get_value(result, 0), "list"), rpc_int64_create(3));
+	rpc_dictionary_set_int64(rpc_array_get_value(result, 1), "a", 2);
+
+	g_assert_cmpstr(rpc_dictionary_get_string(kept, "name"), ==, "kept");
+	g_assert_cmpint(rpc_array_get_count(
+	    rpc_dictionary_get_value(kept, "list")), ==, 2);
+	g_assert_cmpint(rpc_dictionary_get_int64(rpc_array_get_value(args, 1),
+	    "a"), ==, 1);
+
+	rpc_release(result);
+	rpc_release(args);
+	rpc_release(kept);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "modify");
+}
+
+struct client_handoff
+{
+	rpc_connection_t	conn;
+	rpc_object_t		shared;
+};
+
+/*
+ * Sends the same object over and over and modifies what comes back,
+ * then checks a stream arrives in order while other threads send too.
+ */
+static gpointer
+client_handoff_func(gpointer data)
+{
+	struct client_handoff *handoff = data;
+	rpc_object_t result;
+	rpc_call_t call;
+	int64_t expected;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		result = rpc_connection_call_simple(handoff->conn, "stamp",
+		    "[V]", handoff->shared);
+		g_assert_nonnull(result);
+		g_assert_false(rpc_is_error(result));
+		g_assert_true(rpc_dictionary_get_bool(result, "seen"));
+		g_assert_cmpint(rpc_array_get_count(
+		    rpc_dictionary_get_value(result, "list")), ==, 4);
+
+		rpc_dictionary_set_bool(result, "caller", true);
+		rpc_release(result);
+	}
+
+	call = rpc_connection_call(handoff->conn, NULL, NULL, "sequence",
+	    NULL, NULL);
+	g_assert_nonnull(call);
+	expected = 0;
+	for (;;) {
+		rpc_call_wait(call);
+
+		switch (rpc_call_status(call)) {
+		case RPC_CALL_STREAM_START:
+			rpc_call_continue(call, false);
+			continue;
+
+		case RPC_CALL_MORE_AVAILABLE:
+			g_assert_cmpint(rpc_int64_get_value(
+			    rpc_call_result(call)), ==, expected);
+			expected++;
+			rpc_call_continue(call, false);
+			continue;
+
+		default:
+			break;
+		}
+
+		break;
+	}
+
+	g_assert_cmpint(rpc_call_status(call), ==, RPC_CALL_ENDED);
+	g_assert_cmpint(expected, ==, 100);
+	rpc_call_free(call);
+	return (NULL);
+}
+
+static void
+client_handoff_test(client_fixture *fixture, gconstpointer user_data)
+{
+	struct client_handoff handoff;
+	GThread *threads[8];
+	rpc_client_t client;
+	int i;
+
+	rpc_context_register_block(fixture->ctx, NULL, "stamp", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args) {
+		rpc_object_t dict = rpc_array_get_value(args, 0);
+
+		rpc_dictionary_set_bool(dict, "seen", true);
+		rpc_array_append_stolen_value(
+		    rpc_dictionary_get_value(dict, "list"),
+		    rpc_int64_create(4));
+		return (rpc_retain(dict));
+	});
+
+	rpc_context_register_block(fixture->ctx, NULL, "sequence", NULL,
+	    ^rpc_object_t(void *cookie, rpc_object_t args __unused) {
+		int64_t n;
+
+		rpc_function_start_stream(cookie);
+		for (n = 0; n < 100; n++) {
+			if (rpc_function_yield(cookie,
+			    rpc_int64_create(n)) != 0)
+				return (RPC_FUNCTION_STILL_RUNNING);
+		}
+
+		rpc_function_end(cookie);
+		return (RPC_FUNCTION_STILL_RUNNING);
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	handoff.conn = rpc_client_get_connection(client);
+	handoff.shared = rpc_object_pack("{name:s,list:[i,i,i]}", "shared",
+	    (int64_t)1, (int64_t)2, (int64_t)3);
+
+	for (i = 0; i < 8; i++) {
+		threads[i] = g_thread_new("sender", client_handoff_func,
+		    &handoff);
+	}
+
+	for (i = 0; i < 8; i++)
+		g_thread_join(threads[i]);
+
+	/* Nothing either side did shows through to the sender's object */
+	g_assert_false(rpc_dictionary_has_key(handoff.shared, "seen"));
+	g_assert_false(rpc_dictionary_has_key(handoff.shared, "caller"));
+	g_assert_cmpint(rpc_array_get_count(
+	    rpc_dictionary_get_value(handoff.shared, "list")), ==, 3);
+
+	rpc_release(handoff.shared);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "stamp");
+	rpc_context_unregister_member(fixture->ctx, NULL, "sequence");
+}
+
+static void
+client_large_frame_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t data;
+	rpc_object_t result;
+	uint8_t *buf;
+	size_t len = 3 * 1024 * 1024 + 17;
+	size_t i;
+	int round;
+
+	rpc_context_register_block(fixture->ctx, NULL, "echo", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args) {
+		return (rpc_retain(rpc_array_get_value(args, 0)));
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	/* Frames larger than the transport's buffers, back to back */
+	buf = g_malloc(len);
+	for (i = 0; i < len; i++)
+		buf[i] = (uint8_t)(i * 31);
+
+	data = rpc_data_create(buf, len, RPC_BINARY_DESTRUCTOR(g_free));
+	for (round = 0; round < 3; round++) {
+		result = rpc_connection_call_simple(conn, "echo", "[V]", data);
+		g_assert_nonnull(result);
+		g_assert_cmpint(rpc_get_type(result), ==, RPC_TYPE_BINARY);
+		g_assert_true(rpc_equal(result, data));
+		rpc_release(result);
+	}
+
+	rpc_release(data);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "echo");
+}
+
+static void
+client_fd_passing_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	char buf[8] = { 0 };
+	int fds[2];
+
+	rpc_context_register_block(fixture->ctx, NULL, "write-fd", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args) {
+		int fd;
+
+		fd = rpc_fd_get_value(rpc_array_get_value(args, 0));
+		g_assert_cmpint(write(fd, "passed", 6), ==, 6);
+		return (rpc_null_create());
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	g_assert_cmpint(pipe(fds), ==, 0);
+	result = rpc_connection_call_simple(conn, "write-fd", "[v]",
+	    rpc_fd_create(fds[1]));
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+	rpc_release(result);
+
+	g_assert_cmpint(read(fds[0], buf, sizeof(buf)), ==, 6);
+	g_assert_cmpstr(buf, ==, "passed");
+	close(fds[0]);
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "write-fd");
+}
+
+#if defined(__linux__)
+/*
+ * Shared memory region of the shm transport, as laid out by the client.
+ */
+struct shm_test_ring {
+	uint64_t	head __attribute__((aligned(64)));
+	uint64_t	tail __attribute__((aligned(64)));
+	int		reader_parked __attribute__((aligned(64)));
+	int		writer_parked;
+	int		closed;
+};
+
+struct shm_test_region {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	ring_size;
+	struct shm_test_ring rings[2];
+};
+
+struct shm_test_hello {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	ring_size;
+};
+
+#define	SHM_TEST_MAGIC		0x72706373
+#define	SHM_TEST_RING_SIZE	4096
+
+/*
+ * Connects to a shm:// server the way its client does, handing over a
+ * region and doorbells the caller keeps write access to.
+ */
 static int
-do_stream_work(struct work_item *item)
+client_shm_hostile_connect(const char *path, struct shm_test_region **region,
+    size_t *size, int fds[5])
+{
+	struct shm_test_hello hello = {
+		.magic = SHM_TEST_MAGIC,
+		.version = 1,
+		.ring_size = SHM_TEST_RING_SIZE
+	};
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	char control[CMSG_SPACE(5 * sizeof(int))] = { 0 };
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	uint8_t ack = 1;
+	int sock;
+	int i;
+
+	*size = ((sizeof(**region) + page - 1) & ~(page - 1)) +
+	    2 * SHM_TEST_RING_SIZE;
+	fds[0] = memfd_create("shm-test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	g_assert_cmpint(fds[0], >=, 0);
+	g_assert_cmpint(ftruncate(fds[0], (off_t)*size), ==, 0);
+	g_assert_cmpint(fcntl(fds[0], F_ADD_SEALS,
+	    F_SEAL_SHRINK | F_SEAL_GROW), ==, 0);
+
+	*region = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fds[0], 0);
+	g_assert_true(*region != MAP_FAILED);
+	(*region)->magic = SHM_TEST_MAGIC;
+	(*region)->version = 1;
+	(*region)->ring_size = SHM_TEST_RING_SIZE;
+
+	for (i = 1; i < 5; i++) {
+		fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		g_assert_cmpint(fds[i], >=, 0);
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	g_assert_cmpint(sock, >=, 0);
+	g_strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	g_assert_cmpint(connect(sock, (struct sockaddr *)&sun, sizeof(sun)),
+	    ==, 0);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(5 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 5 * sizeof(int));
+	g_assert_cmpint(sendmsg(sock, &msg, MSG_NOSIGNAL), ==, sizeof(hello));
+
+	g_assert_cmpint(recv(sock, &ack, sizeof(ack), MSG_WAITALL), ==, 1);
+	g_assert_cmpint(ack, ==, 0);
+	return (sock);
+}
+
+/*
+ * A client moving the ring positions so that the server would copy past
+ * the end of the ring gets disconnected, and the server keeps serving
+ * everybody else.
+ */
+static void
+client_shm_ring_bounds_test(client_fixture *fixture, gconstpointer user_data)
+{
+	struct shm_test_region *region;
+	struct pollfd pfd;
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	uint32_t header[4] = { 0xdeadbeef, 1024 * 1024, 0, 0 };
+	uint64_t one = 1;
+	uint64_t bad[2];
+	char *data;
+	size_t size;
+	char buf;
+	int fds[5];
+	int sock;
+	int round;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+
+	/* Writer more than a ring ahead, and writer behind the reader */
+	bad[0] = sizeof(header) + 1024 * 1024;
+	bad[1] = sizeof(header) - 1;
+
+	for (round = 0; round < 2; round++) {
+		sock = client_shm_hostile_connect(
+		    uris_[fixture->iuri].cli + strlen("shm://"), &region,
+		    &size, fds);
+
+		/* A valid header for a frame larger than the ring */
+		data = (char *)region + size - 2 * SHM_TEST_RING_SIZE;
+		memcpy(data, header, sizeof(header));
+		__atomic_store_n(&region->rings[0].head, sizeof(header),
+		    __ATOMIC_RELEASE);
+		g_assert_cmpint(write(fds[1], &one, sizeof(one)), ==,
+		    sizeof(one));
+
+		for (i = 0; i < 500; i++) {
+			if (__atomic_load_n(&region->rings[0].tail,
+			    __ATOMIC_ACQUIRE) == sizeof(header))
+				break;
+
+			g_usleep(10000);
+		}
+
+		g_assert_cmpuint(region->rings[0].tail, ==, sizeof(header));
+
+		/* The server is now waiting for the body */
+		__atomic_store_n(&region->rings[0].head, bad[round],
+		    __ATOMIC_RELEASE);
+		g_assert_cmpint(write(fds[1], &one, sizeof(one)), ==,
+		    sizeof(one));
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		g_assert_cmpint(poll(&pfd, 1, 5000), ==, 1);
+		g_assert_cmpint(recv(sock, &buf, sizeof(buf), 0), ==, 0);
+		g_assert_cmpint(region->rings[1].closed, ==, 1);
+
+		close(sock);
+		munmap(region, size);
+		for (i = 0; i < 5; i++)
+			close(fds[i]);
+	}
+
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	g_assert_cmpstr(rpc_string_get_string_ptr(result), ==,
+	    "hello world!");
+	rpc_release(result);
+	rpc_client_close(client);
+}
+#endif
+
+static void
+client_shmem_pool_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_shmem_pool_t pool;
+	rpc_object_t chunk;
+	rpc_object_t result;
+	int i;
+
+	rpc_context_register_block(fixture->ctx, NULL, "read-shmem", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args) {
+		rpc_object_t shmem = rpc_array_get_value(args, 0);
+		const char *addr;
+		int64_t count = 0;
+		size_t j;
+
+		addr = rpc_shmem_map(shmem);
+		for (j = 0; j < rpc_shmem_get_size(shmem); j++)
+			count += addr[j] == 'x';
+
+		rpc_shmem_unmap(shmem, (void *)addr);
+		return (rpc_int64_create(count));
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	/* Chunks of the same pool go out as offsets into a single file */
+	pool = rpc_shmem_pool_create(1024 * 1024);
+	g_assert_nonnull(pool);
+
+	for (i = 1; i <= 4; i++) {
+		chunk = rpc_shmem_pool_alloc(pool, (size_t)i * 5000);
+		g_assert_nonnull(chunk);
+		memset(rpc_shmem_map(chunk), 'x', (size_t)i * 5000);
+		result = rpc_connection_call_simple(conn, "read-shmem", "[v]",
+		    chunk);
+		g_assert_nonnull(result);
+		g_assert_false(rpc_is_error(result));
+		g_assert_cmpint(rpc_int64_get_value(result), ==, i * 5000);
+		rpc_release(result);
+	}
+
+	rpc_shmem_pool_release(pool);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "read-shmem");
+}
+
+static void
+client_bulk_pool_test(client_fixture *fixture, gconstpointer user_data)
 {
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t data[8];
+	rpc_object_t result;
+	GPtrArray *held;
+	uint8_t *buf;
+	size_t len = 256 * 1024;
+	size_t j;
+	int i;
+
+	held = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_release_impl);
+
+	/* Keeps the binaries, and so the pool chunks, until told to drop */
+	rpc_context_register_block(fixture->ctx, NULL, "hold", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args) {
+		rpc_object_t value = rpc_array_get_value(args, 0);
+
+		if (rpc_get_type(value) != RPC_TYPE_BINARY) {
+			g_ptr_array_set_size(held, 0);
+			return (rpc_null_create());
+		}
+
+		g_ptr_array_add(held, rpc_retain(value));
+		return (rpc_retain(value));
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	/* Let both sides exchange their features first */
+	conn = rpc_client_get_connection(client);
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	rpc_release(result);
+	g_assert_cmpint(rpc_connection_set_bulk_pool(conn, 1024 * 1024, 4096),
+	    ==, 0);
+
+	for (i = 0; i < 8; i++) {
+		buf = g_malloc(len);
+		for (j = 0; j < len; j++)
+			buf[j] = (uint8_t)(i + j * 13);
+
+		data[i] = rpc_data_create(buf, len,
+		    RPC_BINARY_DESTRUCTOR(g_free));
+	}
+
+	/* More than the pool holds; the rest has to go inline */
+	for (i = 0; i < 8; i++) {
+		result = rpc_connection_call_simple(conn, "hold", "[V]",
+		    data[i]);
+		g_assert_nonnull(result);
+		g_assert_true(rpc_equal(result, data[i]));
+		rpc_release(result);
+	}
+
+	result = rpc_connection_call_simple(conn, "hold", "[n]");
+	g_assert_nonnull(result);
+	rpc_release(result);
+
+	/* Chunks come back once the peer lets go of them */
+	for (i = 0; i < 8; i++) {
+		result = rpc_connection_call_simple(conn, "hold", "[V]",
+		    data[i]);
+		g_assert_nonnull(result);
+		g_assert_true(rpc_equal(result, data[i]));
+		rpc_release(result);
+		rpc_release(data[i]);
+	}
+
+	result = rpc_connection_call_simple(conn, "hold", "[n]");
+	rpc_release(result);
+	g_assert_cmpint(rpc_connection_set_bulk_pool(conn, 0, 0), ==, 0);
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "hold");
+	g_ptr_array_free(held, true);
+}
+
+static void
+client_peek_frame_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_call_t call;
+	__block struct rpc_frame_info info;
+	__block volatile int peeked = 0;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	/* Let both sides settle on the frame format first */
+	conn = rpc_client_get_connection(client);
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+	rpc_release(result);
+
+	rpc_connection_set_raw_message_handler(conn,
+	    ^int(const void *msg, size_t len, const int *fds __unused,
+	    size_t nfds __unused) {
+		if (g_atomic_int_get(&peeked))
+			return (0);
+
+		g_assert_cmpint(rpc_connection_peek_frame(conn, msg, len,
+		    &info), ==, 0);
+		g_atomic_int_set(&peeked, 1);
+		return (0);
+	});
+
+	call = rpc_connection_call(conn, NULL, NULL, "hi",
+	    rpc_object_pack("[s]", "world"), NULL);
+	g_assert_nonnull(call);
+
+	for (i = 0; i < 500 && !g_atomic_int_get(&peeked); i++)
+		g_usleep(10000);
+
+	g_assert_true(g_atomic_int_get(&peeked));
+	g_assert_cmpstr(info.rfi_namespace, ==, "rpc");
+	g_assert_cmpstr(info.rfi_name, ==, "response");
+	g_assert_cmpstr(info.rfi_id, !=, "");
+
+	rpc_connection_set_raw_message_handler(conn, NULL);
+	rpc_call_free(call);
+	rpc_client_close(client);
+}
+
+static void
+client_compact_frames_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_call_t calls[32];
+	rpc_call_t call;
+	__block rpc_object_t frame = NULL;
+	__block volatile int peeked = 0;
+	char *expected;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	/* The first call goes out with a UUID, before the peer is known */
+	conn = rpc_client_get_connection(client);
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	g_assert_cmpstr(rpc_string_get_string_ptr(result), ==, "hello world!");
+	rpc_release(result);
+
+	/* Later calls are all told apart by their integer ids */
+	for (i = 0; i < 32; i++) {
+		expected = g_strdup_printf("%d", i);
+		calls[i] = rpc_connection_call(conn, NULL, NULL, "hi",
+		    rpc_object_pack("[s]", expected), NULL);
+		g_assert_nonnull(calls[i]);
+		g_free(expected);
+	}
+
+	for (i = 0; i < 32; i++) {
+		rpc_call_wait(calls[i]);
+		g_assert_cmpint(rpc_call_status(calls[i]), ==, RPC_CALL_DONE);
+		expected = g_strdup_printf("hello %d!", i);
+		g_assert_cmpstr(rpc_string_get_string_ptr(
+		    rpc_call_result(calls[i])), ==, expected);
+		g_free(expected);
+		rpc_call_free(calls[i]);
+	}
+
+	/* Errors come back by opcode as well */
+	result = rpc_connection_call_simple(conn, "nonexistent", "[]");
+	g_assert_nonnull(result);
+	g_assert_true(rpc_is_error(result));
+	g_assert_cmpint(rpc_error_get_code(result), ==, ENOENT);
+	rpc_release(result);
+
+	rpc_connection_set_raw_message_handler(conn,
+	    ^int(const void *msg, size_t len, const int *fds __unused,
+	    size_t nfds __unused) {
+		if (g_atomic_int_get(&peeked))
+			return (0);
+
+		frame = rpc_msgpack_deserialize(msg, len);
+		g_atomic_int_set(&peeked, 1);
+		return (0);
+	});
+
+	call = rpc_connection_call(conn, NULL, NULL, "hi",
+	    rpc_object_pack("[s]", "world"), NULL);
+	g_assert_nonnull(call);
+
+	for (i = 0; i < 500 && !g_atomic_int_get(&peeked); i++)
+		g_usleep(10000);
+
+	g_assert_true(g_atomic_int_get(&peeked));
+	g_assert_nonnull(frame);
+	g_assert_cmpint(rpc_get_type(rpc_dictionary_get_value(frame, "id")),
+	    ==, RPC_TYPE_UINT64);
+
+	/* ...and the rpc.response opcode in place of namespace and name */
+	g_assert_cmpuint(rpc_dictionary_get_uint64(frame, "op"), ==, 1);
+	g_assert_false(rpc_dictionary_has_key(frame, "namespace"));
+	g_assert_false(rpc_dictionary_has_key(frame, "name"));
+
+	rpc_release(frame);
+	rpc_connection_set_raw_message_handler(conn, NULL);
+	rpc_call_free(call);
+	rpc_client_close(client);
+}
+
+static void
+client_compression_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	char *name;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli,
+	    rpc_object_pack("{b}", "compress", true));
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	name = g_strnfill(4096, 'x');
+
+	/* Compression kicks in once both sides have seen each other */
+	for (i = 0; i < 10; i++) {
+		result = rpc_connection_call_simple(conn, "hi", "[s]", name);
+		g_assert_nonnull(result);
+		g_assert_false(rpc_is_error(result));
+		g_assert_cmpuint(rpc_string_get_length(result), ==, 4096 + 7);
+		rpc_release(result);
+	}
+
+	g_free(name);
+	rpc_client_close(client);
+}
+
+static void
+client_max_frame_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	char *name;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli,
+	    rpc_object_pack("{i}", "max_frame", (int64_t)1024));
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+	rpc_release(result);
+
+	/* The response is over the limit and takes the connection down */
+	name = g_strnfill(4096, 'x');
+	result = rpc_connection_call_simple(conn, "hi", "[s]", name);
+	g_assert_true(result == NULL || rpc_is_error(result));
+	if (result != NULL)
+		rpc_release(result);
+
+	g_free(name);
+	rpc_client_close(client);
+}
+
+static void
+client_call_batch_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t calls;
+	rpc_object_t result;
+	rpc_call_t results[16];
+	char *expected;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	/* Let the connection negotiate batched calls first */
+	conn = rpc_client_get_connection(client);
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	rpc_release(result);
+
+	calls = rpc_array_create();
+	for (i = 0; i < 16; i++) {
+		expected = g_strdup_printf("%d", i);
+		rpc_array_append_stolen_value(calls, rpc_object_pack(
+		    "{s,[s]}", "method", "hi", "args", expected));
+		g_free(expected);
+	}
+
+	g_assert_cmpint(rpc_connection_call_batch(conn, calls, results), ==, 0);
+
+	for (i = 0; i < 16; i++) {
+		rpc_call_wait(results[i]);
+		g_assert_cmpint(rpc_call_status(results[i]), ==, RPC_CALL_DONE);
+		expected = g_strdup_printf("hello %d!", i);
+		g_assert_cmpstr(rpc_string_get_string_ptr(
+		    rpc_call_result(results[i])), ==, expected);
+		g_free(expected);
+		rpc_call_free(results[i]);
+	}
+
+	rpc_release(calls);
+	rpc_client_close(client);
+}
+
+static void
+client_call_timeout_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t call;
+	gint64 start;
+
+	rpc_context_register_block(fixture->ctx, NULL, "slow", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args __unused) {
+		g_usleep(G_USEC_PER_SEC);
+		return (rpc_null_create());
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	start = g_get_monotonic_time();
+	call = rpc_connection_call(conn, NULL, NULL, "slow", NULL, NULL);
+	g_assert_nonnull(call);
+	g_assert_cmpint(rpc_call_set_timeout(call, 100), ==, 0);
+
+	rpc_call_wait(call);
+	g_assert_cmpint(rpc_call_status(call), ==, RPC_CALL_ERROR);
+	g_assert_cmpint(rpc_error_get_code(rpc_call_result(call)), ==,
+	    ETIMEDOUT);
+	g_assert_cmpint(g_get_monotonic_time() - start, <, G_USEC_PER_SEC);
+
+	rpc_call_free(call);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "slow");
+}
+
+/*
+ * Makes a call with a callback which records every status it sees and
+ * frees the call from within the callback once it is over.
+ */
+static int
+client_callback_run(rpc_connection_t conn, const char *method,
+    uint64_t timeout, rpc_call_status_t *statuses, int *error)
+{
+	__block volatile int count = 0;
+	__block volatile int freed = 0;
+	rpc_call_t call;
+	int i;
+
+	*error = 0;
+	call = rpc_connection_call(conn, NULL, NULL, method, NULL,
+	    ^bool(rpc_call_t c) {
+		rpc_call_status_t status;
+
+		g_assert_false(g_atomic_int_get(&freed));
+		status = rpc_call_status(c);
+		if (count < 8)
+			statuses[count] = status;
+
+		g_atomic_int_inc(&count);
+		switch (status) {
+		case RPC_CALL_ERROR:
+			*error = rpc_error_get_code(rpc_call_result(c));
+			/* FALLTHROUGH */
+
+		case RPC_CALL_DONE:
+		case RPC_CALL_ENDED:
+			rpc_call_free(c);
+			g_atomic_int_set(&freed, 1);
+			break;
+
+		default:
+			break;
+		}
+
+		return ((bool)true);
+	});
+
+	g_assert_nonnull(call);
+	if (timeout > 0)
+		g_assert_cmpint(rpc_call_set_timeout(call, timeout), ==, 0);
+
+	for (i = 0; i < 500 && !g_atomic_int_get(&freed); i++)
+		g_usleep(10000);
+
+	g_assert_true(g_atomic_int_get(&freed));
+
+	/* Nothing runs the callback of a freed call */
+	g_usleep(100000);
+	return (g_atomic_int_get(&count));
+}
+
+static void
+client_call_callback_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_status_t statuses[8];
+	int error;
+	int i;
+
+	rpc_context_register_block(fixture->ctx, NULL, "fail", NULL,
+	    ^rpc_object_t(void *cookie, rpc_object_t args __unused) {
+		rpc_function_error(cookie, EPERM, "Not allowed");
+		return (NULL);
+	});
+
+	rpc_context_register_block(fixture->ctx, NULL, "count", NULL,
+	    ^rpc_object_t(void *cookie, rpc_object_t args __unused) {
+		int64_t n;
+
+		rpc_function_start_stream(cookie);
+		for (n = 0; n < 3; n++) {
+			if (rpc_function_yield(cookie,
+			    rpc_int64_create(n)) != 0)
+				return (RPC_FUNCTION_STILL_RUNNING);
+		}
+
+		rpc_function_end(cookie);
+		return (RPC_FUNCTION_STILL_RUNNING);
+	});
+
+	rpc_context_register_block(fixture->ctx, NULL, "slow", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args __unused) {
+		g_usleep(G_USEC_PER_SEC);
+		return (rpc_null_create());
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	g_assert_cmpint(client_callback_run(conn, "fail", 0, statuses,
+	    &error), ==, 1);
+	g_assert_cmpint(statuses[0], ==, RPC_CALL_ERROR);
+	g_assert_cmpint(error, ==, EPERM);
+
+	/* Start, a callback for each fragment, then the end */
+	g_assert_cmpint(client_callback_run(conn, "count", 0, statuses,
+	    &error), ==, 5);
+	g_assert_cmpint(statuses[0], ==, RPC_CALL_STREAM_START);
+	for (i = 1; i < 4; i++)
+		g_assert_cmpint(statuses[i], ==, RPC_CALL_MORE_AVAILABLE);
+
+	g_assert_cmpint(statuses[4], ==, RPC_CALL_ENDED);
+
+	g_assert_cmpint(client_callback_run(conn, "slow", 100, statuses,
+	    &error), ==, 1);
+	g_assert_cmpint(statuses[0], ==, RPC_CALL_ERROR);
+	g_assert_cmpint(error, ==, ETIMEDOUT);
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "fail");
+	rpc_context_unregister_member(fixture->ctx, NULL, "count");
+	rpc_context_unregister_member(fixture->ctx, NULL, "slow");
+}
+
+static void
+client_inline_method_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_instance_t root;
+
+	root = rpc_context_get_root(fixture->ctx);
+	g_assert_cmpint(rpc_instance_register_inline_func(root,
+	    RPC_DEFAULT_INTERFACE, "hello_inline", NULL, hello), ==, 0);
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	result = rpc_connection_call_simple(conn, "hello_inline", "[s]",
+	    "world");
+	g_assert_nonnull(result);
+	g_assert_cmpstr(rpc_string_get_string_ptr(result), ==, "hello world!");
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "hello_inline");
+}
+
+static void
+client_qos_limit_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t stats;
+	rpc_object_t qos;
+	rpc_call_t calls[8];
+	__block volatile int running = 0;
+	__block volatile int peak = 0;
+	int i;
+
+	g_assert_cmpint(rpc_context_set_interface_qos(fixture->ctx, NULL,
+	    RPC_PRIORITY_LOW, 1), ==, 0);
+
+	rpc_context_register_block(fixture->ctx, NULL, "probe", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args __unused) {
+		int now;
+
+		now = g_atomic_int_add(&running, 1) + 1;
+		if (now > g_atomic_int_get(&peak))
+			g_atomic_int_set(&peak, now);
+
+		g_usleep(20 * 1000);
+		g_atomic_int_add(&running, -1);
+		return (rpc_null_create());
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	for (i = 0; i < 8; i++) {
+		calls[i] = rpc_connection_call(conn, NULL, NULL, "probe",
+		    NULL, NULL);
+		g_assert_nonnull(calls[i]);
+	}
+
+	for (i = 0; i < 8; i++) {
+		rpc_call_wait(calls[i]);
+		g_assert_cmpint(rpc_call_status(calls[i]), ==, RPC_CALL_DONE);
+		rpc_call_free(calls[i]);
+	}
+
+	g_assert_cmpint(peak, ==, 1);
+
+	stats = rpc_context_get_qos_stats(fixture->ctx);
+	qos = rpc_dictionary_get_value(stats, RPC_DEFAULT_INTERFACE);
+	g_assert_nonnull(qos);
+	g_assert_cmpint(rpc_dictionary_get_uint64(qos, "dispatched"), ==, 8);
+	rpc_release(stats);
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "probe");
+}
+
+static void
+client_admission_limit_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t calls[4];
+	int done = 0;
+	int busy = 0;
+	int i;
+
+	rpc_server_set_limits(fixture->srv, 0, 2, RPC_SHED_NEWEST);
+	rpc_context_register_block(fixture->ctx, NULL, "slow", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args __unused) {
+		g_usleep(200 * 1000);
+		return (rpc_null_create());
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	for (i = 0; i < 4; i++) {
+		calls[i] = rpc_connection_call(conn, NULL, NULL, "slow", NULL,
+		    NULL);
+		g_assert_nonnull(calls[i]);
+	}
+
+	for (i = 0; i < 4; i++) {
+		rpc_call_wait(calls[i]);
+		if (rpc_call_status(calls[i]) == RPC_CALL_DONE)
+			done++;
+		else if (rpc_error_get_code(rpc_call_result(calls[i])) == EBUSY)
+			busy++;
+
+		rpc_call_free(calls[i]);
+	}
+
+	g_assert_cmpint(done, ==, 2);
+	g_assert_cmpint(busy, ==, 2);
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "slow");
+}
+
+static void
+client_property_coalescing_test(client_fixture *fixture,
+    gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_instance_t root;
+	__block volatile int events = 0;
+	__block volatile int64_t last = -1;
+	void *handle;
+	int i;
+
+	root = rpc_context_get_root(fixture->ctx);
+	g_assert_cmpint(rpc_instance_register_property(root,
+	    RPC_DEFAULT_INTERFACE, "level", NULL,
+	    ^rpc_object_t(void *cookie __unused) {
+		return (rpc_int64_create(0));
+	}, NULL), ==, 0);
+
+	g_assert_cmpint(rpc_instance_set_property_coalescing(root,
+	    RPC_DEFAULT_INTERFACE, "level", 100, true), ==, 0);
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	handle = rpc_connection_register_event_handler(conn, "/",
+	    RPC_OBSERVABLE_INTERFACE, "changed",
+	    ^(const char *path __unused, const char *interface __unused,
+	    const char *name __unused, rpc_object_t args) {
+		g_atomic_int_inc(&events);
+		last = rpc_dictionary_get_int64(args, "value");
+	});
+	g_assert_nonnull(handle);
+
+	/* Make sure the subscription got there first */
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	rpc_release(result);
+
+	for (i = 0; i < 1000; i++) {
+		result = rpc_int64_create(i);
+		rpc_instance_property_changed(root, RPC_DEFAULT_INTERFACE,
+		    "level", result);
+		rpc_release(result);
+	}
+
+	g_usleep(500 * 1000);
+	g_assert_cmpint(events, >=, 2);
+	g_assert_cmpint(events, <=, 12);
+	g_assert_cmpint(last, ==, 999);
+
+	rpc_connection_unregister_event_handler(conn, handle);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "level");
+}
+
+static void
+client_event_filter_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_object_t rules;
+	rpc_object_t other;
+	__block volatile int events = 0;
+	__block volatile int unwanted = 0;
+	void *handle;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	rules = rpc_object_pack("[[s,s,i],[s,s,b]]",
+	    "n", ">=", (int64_t)10,
+	    "even", "=", true);
+	g_assert_cmpint(rpc_connection_subscribe_event_filtered(conn,
+	    "/sensors/*", RPC_DEFAULT_INTERFACE, "tick", rules), ==, 0);
+
+	/* Rules belong to the subscription as a whole */
+	other = rpc_object_pack("[[s,s,i]]", "n", "<", (int64_t)10);
+	g_assert_cmpint(rpc_connection_subscribe_event_filtered(conn,
+	    "/sensors/*", RPC_DEFAULT_INTERFACE, "tick", other), ==, -1);
+	g_assert_cmpint(rpc_error_get_code(rpc_get_last_error()), ==, EEXIST);
+	rpc_release(other);
+
+	handle = rpc_connection_register_event_handler(conn, "/sensors/*",
+	    RPC_DEFAULT_INTERFACE, "tick",
+	    ^(const char *path, const char *interface __unused,
+	    const char *name __unused, rpc_object_t args) {
+		if (!g_str_has_prefix(path, "/sensors/") ||
+		    rpc_dictionary_get_int64(args, "n") < 10 ||
+		    !rpc_dictionary_get_bool(args, "even"))
+			g_atomic_int_inc(&unwanted);
+
+		g_atomic_int_inc(&events);
+	});
+	g_assert_nonnull(handle);
+
+	/* Make sure the subscription got there first */
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	rpc_release(result);
+
+	for (i = 0; i < 40; i++) {
+		rpc_context_emit_event(fixture->ctx,
+		    i < 20 ? "/sensors/a" : "/other/a", RPC_DEFAULT_INTERFACE,
+		    "tick", rpc_object_pack("{i,b}",
+		    "n", (int64_t)(i % 20),
+		    "even", i % 2 == 0));
+	}
+
+	for (i = 0; i < 500 && g_atomic_int_get(&events) < 5; i++)
+		g_usleep(10000);
+
+	g_usleep(200 * 1000);
+	g_assert_cmpint(events, ==, 5);
+	g_assert_cmpint(unwanted, ==, 0);
+
+	rpc_connection_unregister_event_handler(conn, handle);
+	g_assert_cmpint(rpc_connection_unsubscribe_event(conn, "/sensors/*",
+	    RPC_DEFAULT_INTERFACE, "tick"), ==, 0);
+	rpc_release(rules);
+	rpc_client_close(client);
+}
+
+static void
+client_event_order_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	__block volatile int events = 0;
+	__block int misordered = 0;
+	__block int64_t next = 0;
+	void *handle;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	/* A slow handler makes events pile up on the subscription */
+	conn = rpc_client_get_connection(client);
+	handle = rpc_connection_register_event_handler(conn, "/",
+	    RPC_DEFAULT_INTERFACE, "tick",
+	    ^(const char *path __unused, const char *interface __unused,
+	    const char *name __unused, rpc_object_t args) {
+		if (rpc_int64_get_value(args) != next)
+			misordered++;
+
+		next = rpc_int64_get_value(args) + 1;
+		if (next % 100 == 0)
+			g_usleep(10 * 1000);
+
+		g_atomic_int_inc(&events);
+	});
+	g_assert_nonnull(handle);
+
+	/* Make sure the subscription got there first */
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	rpc_release(result);
+
+	for (i = 0; i < 1000; i++) {
+		rpc_context_emit_event(fixture->ctx, "/", RPC_DEFAULT_INTERFACE,
+		    "tick", rpc_int64_create(i));
+	}
+
+	for (i = 0; i < 1000 && g_atomic_int_get(&events) < 1000; i++)
+		g_usleep(10000);
+
+	g_assert_cmpint(events, ==, 1000);
+	g_assert_cmpint(misordered, ==, 0);
+
+	rpc_connection_unregister_event_handler(conn, handle);
+	rpc_client_close(client);
+}
+
+static void
+client_event_batching_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_object_t stats;
+	__block volatile int events = 0;
+	__block int misordered = 0;
+	__block int64_t next = 0;
+	uint64_t before = 0;
+	uint64_t after = 0;
+	void *handle;
+	int i;
+
+	rpc_context_register_block(fixture->ctx, NULL, "batch", NULL,
+	    ^rpc_object_t (void *cookie, rpc_object_t args __unused) {
+		rpc_connection_t peer = rpc_function_get_connection(cookie);
+
+		rpc_connection_set_event_batching(peer, 32, 0, 10000);
+		return (rpc_bool_create(true));
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	handle = rpc_connection_register_event_handler(conn, "/",
+	    RPC_DEFAULT_INTERFACE, "tick",
+	    ^(const char *path __unused, const char *interface __unused,
+	    const char *name __unused, rpc_object_t args) {
+		if (rpc_int64_get_value(args) != next)
+			misordered++;
+
+		next = rpc_int64_get_value(args) + 1;
+		g_atomic_int_inc(&events);
+	});
+	g_assert_nonnull(handle);
+
+	result = rpc_connection_call_simple(conn, "batch", RPC_NULL_FORMAT);
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+	rpc_release(result);
+
+	stats = rpc_connection_get_stats(conn);
+	g_assert_cmpint(rpc_object_unpack(stats, "{frames_in:u}", &before),
+	    ==, 1);
+	rpc_release(stats);
+
+	for (i = 0; i < 256; i++) {
+		rpc_context_emit_event(fixture->ctx, "/", RPC_DEFAULT_INTERFACE,
+		    "tick", rpc_int64_create(i));
+	}
+
+	for (i = 0; i < 1000 && g_atomic_int_get(&events) < 256; i++)
+		g_usleep(10000);
+
+	g_assert_cmpint(events, ==, 256);
+	g_assert_cmpint(misordered, ==, 0);
+
+	/* 256 events in bursts of at most 32 take a lot fewer frames */
+	stats = rpc_connection_get_stats(conn);
+	g_assert_cmpint(rpc_object_unpack(stats, "{frames_in:u}", &after),
+	    ==, 1);
+	g_assert_cmpuint(after - before, >=, 8);
+	g_assert_cmpuint(after - before, <, 128);
+	rpc_release(stats);
+
+	rpc_connection_unregister_event_handler(conn, handle);
+	rpc_context_unregister_member(fixture->ctx, NULL, "batch");
+	rpc_client_close(client);
+}
+
+static rpc_call_t
+client_conditional_call(rpc_connection_t conn, const char *name,
+    const char *etag)
+{
+	rpc_call_t call;
+
+	call = rpc_connection_call_conditional(conn, NULL, NULL, name,
+	    rpc_array_create(), etag, NULL);
+	g_assert_nonnull(call);
+	rpc_call_wait(call);
+	g_assert_cmpint(rpc_call_status(call), ==, RPC_CALL_DONE);
+	return (call);
+}
+
+static void
+client_conditional_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t call;
+	__block const char *value = "first";
+	__block volatile int builds = 0;
+	char *etag;
+
+	rpc_context_register_block(fixture->ctx, NULL, "digest", NULL,
+	    ^rpc_object_t (void *cookie __unused, rpc_object_t args __unused) {
+		return (rpc_string_create(value));
+	});
+
+	rpc_context_register_block(fixture->ctx, NULL, "versioned", NULL,
+	    ^rpc_object_t (void *cookie, rpc_object_t args __unused) {
+		rpc_function_set_etag(cookie, "v1");
+		if (g_strcmp0(rpc_function_get_etag(cookie), "v1") == 0)
+			return (NULL);
+
+		g_atomic_int_inc(&builds);
+		return (rpc_string_create("built"));
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	/* Unversioned: the tag is a digest of the response */
+	call = client_conditional_call(conn, "digest", NULL);
+	g_assert_false(rpc_call_not_modified(call));
+	g_assert_cmpstr(rpc_string_get_string_ptr(rpc_call_result(call)), ==,
+	    "first");
+	g_assert_nonnull(rpc_call_get_etag(call));
+	etag = g_strdup(rpc_call_get_etag(call));
+	rpc_call_free(call);
+
+	call = client_conditional_call(conn, "digest", etag);
+	g_assert_true(rpc_call_not_modified(call));
+	g_assert_cmpint(rpc_get_type(rpc_call_result(call)), ==,
+	    RPC_TYPE_NULL);
+	g_assert_cmpstr(rpc_call_get_etag(call), ==, etag);
+	rpc_call_free(call);
+
+	value = "second";
+	call = client_conditional_call(conn, "digest", etag);
+	g_assert_false(rpc_call_not_modified(call));
+	g_assert_cmpstr(rpc_string_get_string_ptr(rpc_call_result(call)), ==,
+	    "second");
+	g_assert_cmpstr(rpc_call_get_etag(call), !=, etag);
+	rpc_call_free(call);
+	g_free(etag);
+
+	/* Versioned: an up to date caller doesn't get the response built */
+	call = client_conditional_call(conn, "versioned", NULL);
+	g_assert_false(rpc_call_not_modified(call));
+	g_assert_cmpstr(rpc_call_get_etag(call), ==, "v1");
+	g_assert_cmpstr(rpc_string_get_string_ptr(rpc_call_result(call)), ==,
+	    "built");
+	rpc_call_free(call);
+
+	call = client_conditional_call(conn, "versioned", "v1");
+	g_assert_true(rpc_call_not_modified(call));
+	g_assert_cmpstr(rpc_call_get_etag(call), ==, "v1");
+	rpc_call_free(call);
+	g_assert_cmpint(builds, ==, 1);
+
+	/* Plain calls don't get tagged */
+	call = rpc_connection_call(conn, NULL, NULL, "digest",
+	    rpc_array_create(), NULL);
+	g_assert_nonnull(call);
+	rpc_call_wait(call);
+	g_assert_cmpstr(rpc_string_get_string_ptr(rpc_call_result(call)), ==,
+	    "second");
+	g_assert_null(rpc_call_get_etag(call));
+	g_assert_false(rpc_call_not_modified(call));
+	rpc_call_free(call);
+
+	rpc_context_unregister_member(fixture->ctx, NULL, "digest");
+	rpc_context_unregister_member(fixture->ctx, NULL, "versioned");
+	rpc_client_close(client);
+}
+
+static void
+client_event_queue_run(client_fixture *fixture, rpc_event_overflow_t policy)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_object_t stats;
+	__block rpc_connection_t peer = NULL;
+	__block volatile int events = 0;
+	__block int misordered = 0;
+	__block int64_t next = 0;
+	uint64_t dropped = 0;
+	uint64_t coalesced = 0;
+	void *handle;
+	int i;
+
+	rpc_context_register_block(fixture->ctx, NULL, "limit", NULL,
+	    ^rpc_object_t (void *cookie, rpc_object_t args __unused) {
+		peer = rpc_function_get_connection(cookie);
+		rpc_connection_set_event_queue(peer, 4, policy);
+		return (rpc_bool_create(true));
+	});
+
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	handle = rpc_connection_register_event_handler(conn, "/",
+	    RPC_DEFAULT_INTERFACE, "tick",
+	    ^(const char *path __unused, const char *interface __unused,
+	    const char *name __unused, rpc_object_t args) {
+		if (rpc_int64_get_value(args) < next)
+			misordered++;
+
+		next = rpc_int64_get_value(args) + 1;
+		g_atomic_int_inc(&events);
+	});
+	g_assert_nonnull(handle);
+
+	result = rpc_connection_call_simple(conn, "limit", RPC_NULL_FORMAT);
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+	rpc_release(result);
+	g_assert_nonnull(peer);
+
+	for (i = 0; i < 1000; i++) {
+		rpc_context_emit_event(fixture->ctx, "/", RPC_DEFAULT_INTERFACE,
+		    "tick", rpc_int64_create(i));
+	}
+
+	/* Every event is either delivered or accounted for */
+	for (i = 0; i < 1000; i++) {
+		stats = rpc_connection_get_stats(peer);
+		g_assert_cmpint(rpc_object_unpack(stats,
+		    "{events_dropped:u,events_coalesced:u}", &dropped,
+		    &coalesced), ==, 2);
+		rpc_release(stats);
+
+		if (g_atomic_int_get(&events) + dropped + coalesced >= 1000)
+			break;
+
+		g_usleep(10000);
+	}
+
+	g_assert_cmpuint(events + dropped + coalesced, ==, 1000);
+	g_assert_cmpint(misordered, ==, 0);
+
+	/* Neither policy ever loses the newest event */
+	g_assert_cmpint(next, ==, 1000);
+
+	if (policy == RPC_EVENT_OVERFLOW_DROP_OLDEST)
+		g_assert_cmpuint(coalesced, ==, 0);
+
+	if (policy == RPC_EVENT_OVERFLOW_COALESCE)
+		g_assert_cmpuint(dropped, ==, 0);
+
+	rpc_connection_unregister_event_handler(conn, handle);
+	rpc_context_unregister_member(fixture->ctx, NULL, "limit");
+	rpc_client_close(client);
+}
+
+static void
+client_event_queue_test(client_fixture *fixture, gconstpointer user_data)
+{
+
+	rpc_server_resume(fixture->srv);
+	client_event_queue_run(fixture, RPC_EVENT_OVERFLOW_DROP_OLDEST);
+	client_event_queue_run(fixture, RPC_EVENT_OVERFLOW_COALESCE);
+}
+
+static void
+client_coalesce_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t calls[4];
+	__block volatile int runs = 0;
+	int i;
+
+	rpc_context_register_block(fixture->ctx, NULL, "status", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args __unused) {
+		g_atomic_int_inc(&runs);
+		g_usleep(200 * 1000);
+		return (rpc_string_create("healthy"));
+	});
+
+	g_assert_cmpint(rpc_instance_set_method_flags(
+	    rpc_context_get_root(fixture->ctx), NULL, "status",
+	    RPC_METHOD_COALESCE), ==, 0);
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	for (i = 0; i < 4; i++) {
+		calls[i] = rpc_connection_call(conn, NULL, NULL, "status",
+		    rpc_object_pack("[s]", "pool"), NULL);
+		g_assert_nonnull(calls[i]);
+	}
+
+	for (i = 0; i < 4; i++) {
+		rpc_call_wait(calls[i]);
+		g_assert_cmpint(rpc_call_status(calls[i]), ==, RPC_CALL_DONE);
+		g_assert_cmpstr(rpc_string_get_string_ptr(
+		    rpc_call_result(calls[i])), ==, "healthy");
+		rpc_call_free(calls[i]);
+	}
+
+	g_assert_cmpint(runs, ==, 1);
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "status");
+}
+
+static void
+client_method_stats_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_object_t stats;
+	__block rpc_object_t hi = NULL;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	for (i = 0; i < 3; i++) {
+		result = rpc_connection_call_simple(conn, "hi", "[s]",
+		    "world");
+		g_assert_nonnull(result);
+		rpc_release(result);
+	}
+
+	/* Calls are accounted for right after their response goes out */
+	g_usleep(50 * 1000);
+	stats = rpc_connection_call_sync(conn, "/", RPC_STATISTICS_INTERFACE,
+	    "get_method_stats", NULL);
+	g_assert_nonnull(stats);
+	g_assert_cmpint(rpc_get_type(stats), ==, RPC_TYPE_ARRAY);
+
+	rpc_array_apply(stats, ^(size_t idx __unused, rpc_object_t value) {
+		if (g_strcmp0(rpc_dictionary_get_string(value, "method"),
+		    "hi") != 0)
+			return ((bool)true);
+
+		hi = value;
+		return ((bool)false);
+	});
+
+	g_assert_nonnull(hi);
+	g_assert_cmpint(rpc_dictionary_get_uint64(hi, "calls"), ==, 3);
+	g_assert_cmpint(rpc_dictionary_get_uint64(hi, "errors"), ==, 0);
+	g_assert_cmpint(rpc_dictionary_get_uint64(hi, "bytes_in"), >, 0);
+	g_assert_cmpint(rpc_dictionary_get_uint64(hi, "bytes_out"), >, 0);
+	g_assert_cmpint(rpc_dictionary_get_uint64(
+	    rpc_dictionary_get_value(hi, "exec"), "count"), ==, 3);
+	rpc_release(stats);
+
+	rpc_client_close(client);
+}
+
+static int
+client_fanout_run(rpc_connection_t *conns, size_t nconns, const char *method,
+    rpc_fanout_policy_t policy, size_t count, uint64_t timeout, int *done,
+    bool *succeeded)
+{
+	struct rpc_fanout_result res;
+	rpc_fanout_t fanout;
+	rpc_object_t args;
+	int answers = 0;
+	size_t i;
+
+	args = rpc_object_pack("[s]", "fan");
+	fanout = rpc_fanout_create(NULL, NULL, method, args);
+	rpc_release(args);
+
+	rpc_fanout_set_policy(fanout, policy, count, RPC_FANOUT_CONTINUE);
+	if (timeout > 0)
+		rpc_fanout_set_timeout(fanout, timeout);
+
+	g_assert_cmpint(rpc_fanout_start(fanout, conns, nconns), ==, 0);
+
+	*done = 0;
+	while (rpc_fanout_next(fanout, &res)) {
+		for (i = 0; i < nconns && conns[i] != res.conn; i++)
+			;
+
+		g_assert_cmpuint(i, <, nconns);
+		g_assert_nonnull(res.result);
+		if (res.status == RPC_CALL_DONE) {
+			g_assert_cmpstr(rpc_string_get_string_ptr(res.result),
+			    ==, "hello fan!");
+			(*done)++;
+		} else
+			g_assert_true(rpc_is_error(res.result));
+
+		rpc_release(res.result);
+		answers++;
+	}
+
+	*succeeded = rpc_fanout_succeeded(fanout);
+	rpc_fanout_free(fanout);
+	return (answers);
+}
+
+static void
+client_fanout_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t clients[4];
+	rpc_connection_t conns[4];
+	rpc_object_t result;
+	__block volatile int calls = 0;
+	bool succeeded;
+	int done;
+	int i;
+
+	/* Only the first two calls since the count was reset succeed */
+	rpc_context_register_block(fixture->ctx, NULL, "flaky", NULL,
+	    ^rpc_object_t(void *cookie, rpc_object_t args) {
+		if (g_atomic_int_add(&calls, 1) >= 2) {
+			rpc_function_error(cookie, EIO, "Flaked out");
+			return (NULL);
+		}
+
+		return (rpc_string_create_with_format("hello %s!",
+		    rpc_array_get_string(args, 0)));
+	});
+
+	rpc_context_register_block(fixture->ctx, NULL, "slow", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args) {
+		g_usleep(500 * 1000);
+		return (rpc_string_create_with_format("hello %s!",
+		    rpc_array_get_string(args, 0)));
+	});
+
+	rpc_server_resume(fixture->srv);
+	for (i = 0; i < 4; i++) {
+		clients[i] = rpc_client_create(uris_[fixture->iuri].cli, 0);
+		g_assert_nonnull(clients[i]);
+		conns[i] = rpc_client_get_connection(clients[i]);
+
+		/* Targets may have negotiated their options already or not */
+		if (i % 2 == 0)
+			continue;
+
+		result = rpc_connection_call_simple(conns[i], "hi", "[s]",
+		    "world");
+		g_assert_nonnull(result);
+		rpc_release(result);
+	}
+
+	g_assert_cmpint(client_fanout_run(conns, 4, "hi", RPC_FANOUT_ALL, 0,
+	    0, &done, &succeeded), ==, 4);
+	g_assert_cmpint(done, ==, 4);
+	g_assert_true(succeeded);
+
+	/* Two out of four isn't a quorum, but enough for the first two */
+	client_fanout_run(conns, 4, "flaky", RPC_FANOUT_QUORUM, 0, 0, &done,
+	    &succeeded);
+	g_assert_cmpint(done, <=, 2);
+	g_assert_false(succeeded);
+
+	calls = 0;
+	client_fanout_run(conns, 4, "flaky", RPC_FANOUT_FIRST_N, 2, 0, &done,
+	    &succeeded);
+	g_assert_cmpint(done, ==, 2);
+	g_assert_true(succeeded);
+
+	/* A single deadline covers all of the targets */
+	g_assert_cmpint(client_fanout_run(conns, 4, "slow", RPC_FANOUT_ALL, 0,
+	    100, &done, &succeeded), >=, 1);
+	g_assert_cmpint(done, ==, 0);
+	g_assert_false(succeeded);
+
+	for (i = 0; i < 4; i++)
+		rpc_client_close(clients[i]);
+
+	rpc_context_unregister_member(fixture->ctx, NULL, "flaky");
+	rpc_context_unregister_member(fixture->ctx, NULL, "slow");
+}
+
+static void
+client_completion_queue_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_completion_queue_t cq;
+	rpc_call_t calls[8];
+	struct rpc_cq_event events[8];
+	struct pollfd pfd;
+	size_t done = 0;
+	size_t count;
+	size_t i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	cq = rpc_completion_queue_create();
+	g_assert_nonnull(cq);
+
+	conn = rpc_client_get_connection(client);
+	g_assert_cmpint(rpc_connection_set_completion_queue(conn, cq), ==, 0);
+
+	for (i = 0; i < 8; i++) {
+		calls[i] = rpc_connection_call(conn, NULL, NULL, "hi",
+		    rpc_object_pack("[s]", "world"), NULL);
+		g_assert_nonnull(calls[i]);
+	}
+
+	pfd.fd = rpc_completion_queue_get_fd(cq);
+	pfd.events = POLLIN;
+
+	while (done < 8) {
+		g_assert_cmpint(poll(&pfd, 1, 5000), ==, 1);
+		count = rpc_cq_poll(cq, events, 8);
+		for (i = 0; i < count; i++) {
+			g_assert_nonnull(events[i].call);
+			g_assert_true(events[i].conn == conn);
+			g_assert_cmpint(rpc_call_status(events[i].call), ==,
+			    RPC_CALL_DONE);
+			rpc_cq_event_release(&events[i]);
+			done++;
+		}
+	}
+
+	for (i = 0; i < 8; i++)
+		rpc_call_free(calls[i]);
+
+	rpc_client_close(client);
+	rpc_completion_queue_free(cq);
+}
+
+static void
+client_upload_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t call;
+	int64_t i;
+
+	rpc_context_register_block(fixture->ctx, NULL, "sum", NULL,
+	    ^rpc_object_t(void *cookie, rpc_object_t args __unused) {
+		rpc_object_t item;
+		int64_t sum = 0;
+
+		while ((item = rpc_function_next_input(cookie)) != NULL) {
+			sum += rpc_int64_get_value(item);
+			rpc_release(item);
+		}
+
+		return (rpc_int64_create(sum));
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	call = rpc_connection_call_upload(conn, NULL, NULL, "sum", NULL, NULL);
+	g_assert_nonnull(call);
+
+	for (i = 0; i < 1000; i++) {
+		g_assert_cmpint(rpc_call_yield(call, rpc_int64_create(i)), ==,
+		    0);
+	}
+
+	g_assert_cmpint(rpc_call_end_upload(call), ==, 0);
+	rpc_call_wait(call);
+	g_assert_cmpint(rpc_call_status(call), ==, RPC_CALL_DONE);
+	g_assert_cmpint(rpc_int64_get_value(rpc_call_result(call)), ==,
+	    999 * 1000 / 2);
+
+	rpc_call_free(call);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "sum");
+}
+
+static void
+client_adaptive_prefetch_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t call;
+	int64_t expected = 0;
+
+	rpc_context_register_block(fixture->ctx, NULL, "count", NULL,
+	    ^rpc_object_t(void *cookie, rpc_object_t args __unused) {
+		int64_t i;
+
+		rpc_function_start_stream(cookie);
+		for (i = 0; i < 1000; i++) {
+			if (rpc_function_yield(cookie,
+			    rpc_int64_create(i)) != 0)
+				return (NULL);
+		}
+
+		rpc_function_end(cookie);
+		return (RPC_FUNCTION_STILL_RUNNING);
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+
+	conn = rpc_client_get_connection(client);
+	call = rpc_connection_call(conn, NULL, NULL, "count", NULL, NULL);
+	g_assert_nonnull(call);
+	rpc_call_set_prefetch_adaptive(call, 64, 0);
+
+	for (;;) {
+		rpc_call_wait(call);
+
+		switch (rpc_call_status(call)) {
+		case RPC_CALL_STREAM_START:
+			rpc_call_continue(call, false);
+			continue;
+
+		case RPC_CALL_MORE_AVAILABLE:
+			g_assert_cmpint(rpc_int64_get_value(
+			    rpc_call_result(call)), ==, expected);
+			expected++;
+			rpc_call_continue(call, false);
+			continue;
+
+		case RPC_CALL_DONE:
+		case RPC_CALL_ENDED:
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+		break;
+	}
+
+	g_assert_cmpint(expected, ==, 1000);
+	rpc_call_free(call);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "count");
+}
+
+static int
+do_stream_work(struct work_item *item)
+{
+
+	int cnt = 0;
+	rpc_object_t result;
+	const char *method;
+	rpc_call_t call;
+	int i;
+	const char *str;
+	int64_t len;
+	int64_t num;
+	bool failed = false;
+
+	g_atomic_int_inc(&item->fx->count);
+	i = rpc_object_unpack(item->args, "[s, i]", &method, &item->ccnt);
+	g_assert(i == 2);
+
+	call = rpc_connection_call(item->conn, NULL, NULL, method, rpc_array_create(), NULL);
+	if (call == NULL) {
+		rpc_function_error(item->call, EINVAL, "Unable to make call");
+		return (0);
+	}
+	for (;;) {
+		rpc_call_wait(call);
+
+		switch (rpc_call_status(call)) {
+		case RPC_CALL_STREAM_START:
+			rpc_call_continue(call, false);
+			break;
+
+		case RPC_CALL_MORE_AVAILABLE:
+			result = rpc_call_result(call);
+			i = rpc_object_unpack(result,
+			    "[s, i, i]", &str, &len, &num);
+			cnt++;
+			g_assert(i == 3);
+			g_assert(len == (int)strlen(str));
+			rpc_call_continue(call, false);
+			break;
+
+		case RPC_CALL_DONE:
+		case RPC_CALL_ENDED:
+			goto done;
+
+		case RPC_CALL_ERROR:
+			debugf("Client call error: %s %d",
+			    rpc_error_get_message(rpc_call_result(call)),
+			    rpc_error_get_code(rpc_call_result(call)));
+			failed = true;
+			goto done;
+
+		default:
+			g_assert_not_reached();
+		}
+	}
+done:
+
+	if (!failed)
+		item->result = rpc_string_create("DONE!");
+	else
+		item->result = rpc_error_create(EPROTO,
+		    "Error in receiving streamed data", NULL);
+	rpc_call_free(call);
+	return (cnt);
+}
+
+/*
+ * Streams a call through a query and gathers the fragments that come out.
+ */
+static rpc_object_t
+client_query_collect(rpc_connection_t conn, rpc_object_t query)
+{
+	rpc_call_t call;
+	rpc_object_t result;
+
+	call = rpc_connection_call_query(conn, NULL, NULL, "items", NULL,
+	    query, NULL);
+	g_assert_nonnull(call);
+	rpc_release(query);
+	result = rpc_array_create();
+
+	for (;;) {
+		rpc_call_wait(call);
+
+		switch (rpc_call_status(call)) {
+		case RPC_CALL_STREAM_START:
+			rpc_call_continue(call, false);
+			continue;
+
+		case RPC_CALL_MORE_AVAILABLE:
+			rpc_array_append_value(result, rpc_call_result(call));
+			rpc_call_continue(call, false);
+			continue;
+
+		case RPC_CALL_DONE:
+		case RPC_CALL_ENDED:
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+		break;
+	}
+
+	rpc_call_free(call);
+	return (result);
+}
+
+static void
+client_query_pushdown_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_object_t item;
+	__block volatile int sent = 0;
+
+	rpc_context_register_block(fixture->ctx, NULL, "items", NULL,
+	    ^rpc_object_t(void *cookie, rpc_object_t args __unused) {
+		int64_t i;
+
+		sent = 0;
+		rpc_function_start_stream(cookie);
+		for (i = 0; i < 100; i++) {
+			if (rpc_function_should_abort(cookie))
+				break;
+
+			if (rpc_function_yield(cookie, rpc_object_pack("{i,i}",
+			    "id", i, "value", i % 10)) != 0)
+				return (NULL);
+
+			sent++;
+		}
+
+		rpc_function_end(cookie);
+		return (RPC_FUNCTION_STILL_RUNNING);
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	/* Matches cut down to the selected fields, up to the limit */
+	result = client_query_collect(conn, rpc_object_pack("{[[s,s,i]],u,[s]}",
+	    "rules", "value", "=", (int64_t)3, "limit", (uint64_t)5,
+	    "select", "id"));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 5);
+	item = rpc_array_get_value(result, 4);
+	g_assert_cmpuint(rpc_dictionary_get_count(item), ==, 1);
+	g_assert_cmpint(rpc_dictionary_get_int64(item, "id"), ==, 43);
+	rpc_release(result);
+
+	/* The method stops once the limit is reached */
+	g_assert_cmpint(sent, <, 100);
+
+	/* Sorted results are held back until the stream ends */
+	result = client_query_collect(conn, rpc_object_pack("{[[s,s,i]],s,b,u}",
+	    "rules", "value", "=", (int64_t)1, "sort", "id", "reverse", true,
+	    "limit", (uint64_t)3));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 3);
+	g_assert_cmpint(rpc_dictionary_get_int64(rpc_array_get_value(result,
+	    0), "id"), ==, 91);
+	g_assert_cmpint(rpc_dictionary_get_int64(rpc_array_get_value(result,
+	    2), "id"), ==, 71);
+	rpc_release(result);
+
+	result = client_query_collect(conn, rpc_object_pack("{[[s,s,i]],b}",
+	    "rules", "value", "<", (int64_t)2, "count", true));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 1);
+	g_assert_cmpuint(rpc_array_get_uint64(result, 0), ==, 20);
+	rpc_release(result);
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "items");
+}
+
+static void
+stream_worker(void *arg, void *data)
+{
+	int cnt;
+	struct work_item *item = arg;
+
+	item->fx = data;
+	cnt = do_stream_work(item);
+	g_assert(cnt == item->ccnt);
+	rpc_function_respond(item->call, item->result);
+	rpc_function_release(item->call);
+	g_free(item);
+}
+
+static void
+client_multi_streams_test(client_fixture *fixture, gconstpointer user_data)
+{
+	int ret = 0;
+	GError *err = NULL;
+	GRand *rand = g_rand_new ();
+	gint n = g_rand_int_range (rand, 3, THREADS);
+
+	fixture->resume = true;
+	fixture->workers = g_thread_pool_new(stream_worker, fixture,
+	    g_get_num_processors() * 4, false, &err);
+	g_assert_null(err);
+
+	rpc_context_register_block(fixture->ctx, NULL, "stream-me",	NULL,
+	    ^rpc_object_t (void *cookie, rpc_object_t args) {
+		struct work_item *item;
+		GError *error = NULL;
+
+		rpc_function_retain(cookie);
+		item = g_malloc0(sizeof(*item));
+		item->call = cookie;
+		item->args = args;
+		item->conn = rpc_function_get_connection(cookie);
+		g_thread_pool_push(fixture->workers, item, &error);
+		g_assert_null(error);
+
+		return (RPC_FUNCTION_STILL_RUNNING);
+	});
+
+	ret = thread_test(n, &thread_mestream_func, fixture);
+	g_assert(fixture->count + ret == n);
+	rpc_context_unregister_member(fixture->ctx, NULL, "stream-me");
+}
+
+/*
+ * Each thread makes calls on the shared connection and checks it gets
+ * its own answers back. Some calls are aborted and freed while the
+ * others are in flight, which removes them from their shard early.
+ */
+static gpointer
+client_shared_calls_func(gpointer data)
+{
+	rpc_connection_t conn = data;
+	rpc_object_t result;
+	rpc_call_t call;
+	char *expected;
+	char *arg;
+	int i;
+
+	for (i = 0; i < 200; i++) {
+		if (i % 8 == 0) {
+			call = rpc_connection_call(conn, NULL, NULL, "sleepy",
+			    NULL, NULL);
+			g_assert_nonnull(call);
+			rpc_call_abort(call);
+			rpc_call_free(call);
+			continue;
+		}
+
+		arg = g_strdup_printf("%p-%d", (void *)g_thread_self(), i);
+		expected = g_strdup_printf("hello %s!", arg);
+		result = rpc_connection_call_simple(conn, "hi", "[s]", arg);
+		g_assert_nonnull(result);
+		g_assert_cmpstr(rpc_string_get_string_ptr(result), ==,
+		    expected);
+		rpc_release(result);
+		g_free(expected);
+		g_free(arg);
+	}
+
+	return (NULL);
+}
+
+static void
+client_shared_calls_test(client_fixture *fixture, gconstpointer user_data)
+{
+	GThread *threads[8];
+	rpc_client_t client;
+	rpc_connection_t conn;
+	int i;
+
+	rpc_context_register_block(fixture->ctx, NULL, "sleepy", NULL,
+	    ^rpc_object_t(void *cookie __unused, rpc_object_t args __unused) {
+		g_usleep(10000);
+		return (rpc_null_create());
+	});
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	for (i = 0; i < 8; i++) {
+		threads[i] = g_thread_new("caller", client_shared_calls_func,
+		    conn);
+	}
+
+	for (i = 0; i < 8; i++)
+		g_thread_join(threads[i]);
+
+	/* Every call was freed, so every shard is empty again */
+	for (i = 0; i < RPC_CALL_SHARDS; i++) {
+		g_rw_lock_reader_lock(&conn->rco_call_shards[i].rcs_lock);
+		g_assert_cmpuint(g_hash_table_size(
+		    conn->rco_call_shards[i].rcs_calls), ==, 0);
+		g_rw_lock_reader_unlock(&conn->rco_call_shards[i].rcs_lock);
+	}
+
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "sleepy");
+}
+
+static void
+client_many_connections_test(client_fixture *fixture,
+    gconstpointer user_data)
+{
+	rpc_client_t clients[8];
+	rpc_call_t calls[8];
+	char *expected;
+	int round;
+	int ret;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	for (i = 0; i < 8; i++) {
+		clients[i] = rpc_client_create(uris_[fixture->iuri].cli, 0);
+		g_assert_nonnull(clients[i]);
+	}
+
+	/* Calls on connections held by different threads interleave */
+	for (round = 0; round < 10; round++) {
+		for (i = 0; i < 8; i++) {
+			expected = g_strdup_printf("%d", i);
+			calls[i] = rpc_connection_call(
+			    rpc_client_get_connection(clients[i]), NULL, NULL,
+			    "hi", rpc_object_pack("[s]", expected), NULL);
+			g_assert_nonnull(calls[i]);
+			g_free(expected);
+		}
+
+		for (i = 0; i < 8; i++) {
+			rpc_call_wait(calls[i]);
+			g_assert_cmpint(rpc_call_status(calls[i]), ==,
+			    RPC_CALL_DONE);
+			expected = g_strdup_printf("hello %d!", i);
+			g_assert_cmpstr(rpc_string_get_string_ptr(
+			    rpc_call_result(calls[i])), ==, expected);
+			g_free(expected);
+			rpc_call_free(calls[i]);
+		}
+	}
+
+	for (i = 0; i < 8; i++)
+		rpc_client_close(clients[i]);
+
+	g_assert_cmpint(fixture->count, ==, 80);
+
+	/* Connections coming and going at once */
+	ret = thread_test(16, &thread_func, fixture);
+	g_assert_cmpint(ret, ==, 0);
+	g_assert_cmpint(fixture->count, ==, 96);
+}
+
+static rpc_object_t
+client_session_params(bool replay)
+{
+
+	return (rpc_object_pack("{b,b}", "resume", true, "replay", replay));
+}
+
+/*
+ * Registers a method that drops the connection it's called over on the
+ * calls picked by @p drop, numbered from 1.
+ */
+static void
+client_session_register_dropper(client_fixture *fixture, const char *name,
+    volatile int *counter, bool (^drop)(int))
+{
+
+	rpc_context_register_block(fixture->ctx, NULL, name, NULL,
+	    ^rpc_object_t(void *cookie, rpc_object_t args __unused) {
+		int n = g_atomic_int_add(counter, 1) + 1;
+
+		if (drop(n)) {
+			/* Give the caller time to mark the call */
+			g_usleep(100 * 1000);
+			rpc_connection_close(
+			    rpc_function_get_connection(cookie));
+		}
+
+		return (rpc_int64_create(n));
+	});
+}
+
+static char *
+client_session_token(rpc_connection_t conn)
+{
+	char *token;
+
+	g_mutex_lock(&conn->rco_mtx);
+	token = g_strdup(conn->rco_session);
+	g_mutex_unlock(&conn->rco_mtx);
+	return (token);
+}
+
+static void
+client_session_resume_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t params;
+	rpc_object_t result;
+	__block volatile int events = 0;
+	static volatile int drops = 0;
+	char *token;
+	char *current;
+	void *handle;
+	int i;
+
+	client_session_register_dropper(fixture, "drop", &drops,
+	    ^bool(int n __unused) {
+		return (true);
+	});
+
+	rpc_server_resume(fixture->srv);
+	params = client_session_params(false);
+	client = rpc_client_create(uris_[fixture->iuri].cli, params);
+	g_assert_nonnull(client);
+	rpc_release(params);
+
+	conn = rpc_client_get_connection(client);
+	token = client_session_token(conn);
+	g_assert_nonnull(token);
+	g_assert_cmpuint(strlen(token), ==, 64);
+
+	handle = rpc_connection_register_event_handler(conn, "/",
+	    RPC_DEFAULT_INTERFACE, "tick",
+	    ^(const char *path __unused, const char *interface __unused,
+	    const char *name __unused, rpc_object_t args __unused) {
+		g_atomic_int_inc(&events);
+	});
+	g_assert_nonnull(handle);
+
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	rpc_release(result);
+
+	/* Not idempotent and not replayed anyway; the result doesn't matter */
+	result = rpc_connection_call_simple(conn, "drop", RPC_NULL_FORMAT);
+	rpc_release(result);
+
+	/* Calls wait for the transport to come back */
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "again");
+	g_assert_nonnull(result);
+	g_assert_cmpstr(rpc_string_get_string_ptr(result), ==, "hello again!");
+	rpc_release(result);
+
+	/* The server moved our subscription over; no new session */
+	for (i = 0; i < 500 && g_atomic_int_get(&events) == 0; i++) {
+		rpc_context_emit_event(fixture->ctx, "/",
+		    RPC_DEFAULT_INTERFACE, "tick", rpc_null_create());
+		g_usleep(10000);
+	}
+
+	g_assert_cmpint(events, >, 0);
+	g_usleep(200 * 1000);
+	current = client_session_token(conn);
+	g_assert_cmpstr(current, ==, token);
+	g_mutex_lock(&fixture->ctx->rcx_sessions_mtx);
+	g_assert_cmpuint(g_hash_table_size(fixture->ctx->rcx_sessions), ==, 1);
+	g_mutex_unlock(&fixture->ctx->rcx_sessions_mtx);
+
+	g_free(current);
+	g_free(token);
+	rpc_connection_unregister_event_handler(conn, handle);
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "drop");
+}
+
+static void
+client_session_takeover_test(client_fixture *fixture,
+    gconstpointer user_data)
+{
+	rpc_client_t owner;
+	rpc_client_t other;
+	rpc_connection_t conn;
+	rpc_object_t params;
+	rpc_object_t result;
+	char *token;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	params = client_session_params(false);
+	owner = rpc_client_create(uris_[fixture->iuri].cli, params);
+	g_assert_nonnull(owner);
+	rpc_release(params);
+
+	token = client_session_token(rpc_client_get_connection(owner));
+	g_assert_nonnull(token);
+
+	other = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(other);
+	conn = rpc_client_get_connection(other);
+
+	/* A token that was never handed out */
+	result = rpc_connection_call_syncp(conn, "/", RPC_SESSION_INTERFACE,
+	    "resume", "[s]", "0123456789abcdef");
+	g_assert_nonnull(result);
+	g_assert_false(rpc_bool_get_value(result));
+	rpc_release(result);
+
+	/* No credentials over TCP, so a live session stays where it is */
+	result = rpc_connection_call_syncp(conn, "/", RPC_SESSION_INTERFACE,
+	    "resume", "[s]", token);
+	g_assert_nonnull(result);
+	g_assert_false(rpc_bool_get_value(result));
+	rpc_release(result);
+
+	/* Once its connection is gone, the token is enough */
+	rpc_client_close(owner);
+	for (i = 0; i < 500; i++) {
+		result = rpc_connection_call_syncp(conn, "/",
+		    RPC_SESSION_INTERFACE, "resume", "[s]", token);
+		g_assert_nonnull(result);
+		if (rpc_bool_get_value(result))
+			break;
+
+		rpc_release(result);
+		result = NULL;
+		g_usleep(10000);
+	}
+
+	g_assert_nonnull(result);
+	rpc_release(result);
+	g_free(token);
+	rpc_client_close(other);
+}
+
+static void
+client_session_expiry_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_context_t ctx;
+	rpc_server_t srv;
+	rpc_object_t params;
+	rpc_object_t result;
+	__block volatile int events = 0;
+	char *token;
+	char *current = NULL;
+	void *handle;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	params = client_session_params(false);
+	client = rpc_client_create(uris_[fixture->iuri].cli, params);
+	g_assert_nonnull(client);
+	rpc_release(params);
+
+	conn = rpc_client_get_connection(client);
+	token = client_session_token(conn);
+	g_assert_nonnull(token);
+
+	handle = rpc_connection_register_event_handler(conn, "/",
+	    RPC_DEFAULT_INTERFACE, "tick",
+	    ^(const char *path __unused, const char *interface __unused,
+	    const char *name __unused, rpc_object_t args __unused) {
+		g_atomic_int_inc(&events);
+	});
+	g_assert_nonnull(handle);
+
+	result = rpc_connection_call_simple(conn, "hi", "[s]", "world");
+	g_assert_nonnull(result);
+	rpc_release(result);
+
+	/*
+	 * A server that comes back with a fresh context knows nothing of
+	 * the session, same as when it expired.
+	 */
+	rpc_server_close(fixture->srv);
+	while (rpc_server_find(uris_[fixture->iuri].srv, fixture->ctx) != NULL)
+		g_usleep(10000);
+
+	fixture->srv = NULL;
+	ctx = rpc_context_create();
+	rpc_context_register_block(ctx, NULL, "hi",
+	    NULL, ^(void *cookie __unused, rpc_object_t args) {
+		return rpc_string_create_with_format("hello %s!",
+		    rpc_array_get_string(args, 0));
+	    });
+
+	srv = rpc_server_create(uris_[fixture->iuri].srv, ctx);
+	g_assert_nonnull(srv);
+	rpc_server_resume(srv);
+
+	/* The client opens a new session once resuming fails */
+	for (i = 0; i < 2000; i++) {
+		g_free(current);
+		current = client_session_token(conn);
+		if (current != NULL && g_strcmp0(current, token) != 0)
+			break;
+
+		g_usleep(10000);
+	}
+
+	g_assert_nonnull(current);
+	g_assert_cmpstr(current, !=, token);
+
+	/* ...and subscribes to its events again */
+	for (i = 0; i < 500 && g_atomic_int_get(&events) == 0; i++) {
+		rpc_context_emit_event(ctx, "/", RPC_DEFAULT_INTERFACE,
+		    "tick", rpc_null_create());
+		g_usleep(10000);
+	}
+
+	g_assert_cmpint(events, >, 0);
+
+	g_free(current);
+	g_free(token);
+	rpc_connection_unregister_event_handler(conn, handle);
+	rpc_client_close(client);
+	rpc_server_close(srv);
+	while (rpc_server_find(uris_[fixture->iuri].srv, ctx) != NULL)
+		g_usleep(10000);
+
+	rpc_context_unregister_member(ctx, NULL, "hi");
+	rpc_context_free(ctx);
+}
+
+static void
+client_session_replay_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t params;
+	rpc_object_t result;
+	rpc_call_t call;
+	static volatile int flaky = 0;
+	static volatile int fragile = 0;
+
+	client_session_register_dropper(fixture, "flaky", &flaky,
+	    ^bool(int n) {
+		return (n == 1);
+	});
+	client_session_register_dropper(fixture, "fragile", &fragile,
+	    ^bool(int n) {
+		return (n <= 2);
+	});
+
+	rpc_server_resume(fixture->srv);
+	params = client_session_params(true);
+	client = rpc_client_create(uris_[fixture->iuri].cli, params);
+	g_assert_nonnull(client);
+	rpc_release(params);
+
+	conn = rpc_client_get_connection(client);
+	rpc_connection_set_idempotent(conn, NULL, "flaky", true);
+
+	/* Declared idempotent: sent again after the drop */
+	result = rpc_connection_call_simple(conn, "flaky", RPC_NULL_FORMAT);
+	g_assert_nonnull(result);
+	g_assert_cmpint(rpc_get_type(result), ==, RPC_TYPE_INT64);
+	g_assert_cmpint(rpc_int64_get_value(result), ==, 2);
+	rpc_release(result);
+
+	/* Not idempotent: fails instead */
+	result = rpc_connection_call_simple(conn, "fragile", RPC_NULL_FORMAT);
+	g_assert_nonnull(result);
+	g_assert_true(rpc_is_error(result));
+	g_assert_cmpint(rpc_error_get_code(result), ==, ECONNABORTED);
+	rpc_release(result);
+	g_assert_cmpint(fragile, ==, 1);
+
+	/* Marking the call itself works as well */
+	call = rpc_connection_call(conn, NULL, NULL, "fragile", NULL, NULL);
+	g_assert_nonnull(call);
+	g_assert_cmpint(rpc_call_set_idempotent(call, true), ==, 0);
+	rpc_call_wait(call);
+	g_assert_cmpint(rpc_call_status(call), ==, RPC_CALL_DONE);
+	g_assert_cmpint(rpc_int64_get_value(rpc_call_result(call)), ==, 3);
+	rpc_call_free(call);
 
-	int cnt = 0;
-	rpc_object_t result;
-	const char *method;
-	rpc_call_t call;
-	int i;
-	const char *str;
-	int64_t len;
-	int64_t num;
-	bool failed = false;
+	rpc_client_close(client);
+	rpc_context_unregister_member(fixture->ctx, NULL, "flaky");
+	rpc_context_unregister_member(fixture->ctx, NULL, "fragile");
+}
 
-	g_atomic_int_inc(&item->fx->count);
-	i = rpc_object_unpack(item->args, "[s, i]", &method, &item->ccnt);
-	g_assert(i == 2);
+static void
+client_test_single_set_up(client_fixture *fixture, gconstpointer user_data)
+{
 
-	call = rpc_connection_call(item->conn, NULL, NULL, method, rpc_array_create(), NULL);
-	if (call == NULL) {
-		rpc_function_error(item->call, EINVAL, "Unable to make call");
-		return (0);
-	}
-	for (;;) {
-		rpc_call_wait(call);
+	fixture->ctx = rpc_context_create();
+	fixture->iuri = (int)user_data;
 
-		switch (rpc_call_status(call)) {
-		case RPC_CALL_STREAM_START:
-			rpc_call_continue(call, false);
-			break;
+	rpc_context_register_block(fixture->ctx, NULL, "hi",
+	    NULL, ^(void *cookie __unused, rpc_object_t args) {
+		g_atomic_int_inc(&fixture->count);
+		return rpc_string_create_with_format("hello %s!",
+		    rpc_array_get_string(args, 0));
+	    });
 
-		case RPC_CALL_MORE_AVAILABLE:
-			result = rpc_call_result(call);
-			i = rpc_object_unpack(result,
-			    "[s, i, i]", &str, &len, &num);
-			cnt++;
-			g_assert(i == 3);
-			g_assert(len == (int)strlen(str));
-			rpc_call_continue(call, false);
-			break;
+	fixture->srv = rpc_server_create(uris_[fixture->iuri].srv, fixture->ctx);
+}
 
-		case RPC_CALL_DONE:
-		case RPC_CALL_ENDED:
-			goto done;
+static void
+client_test_compress_set_up(client_fixture *fixture, gconstpointer user_data)
+{
 
-		case RPC_CALL_ERROR:
-			debugf("Client call error: %s %d",
-			    rpc_error_get_message(rpc_call_result(call)),
-			    rpc_error_get_code(rpc_call_result(call)));
-			failed = true;
-			goto done;
+	fixture->ctx = rpc_context_create();
+	fixture->iuri = (int)user_data;
 
-		default:
-			g_assert_not_reached();
-		}
-	}
-done:
+	rpc_context_register_block(fixture->ctx, NULL, "hi",
+	    NULL, ^(void *cookie __unused, rpc_object_t args) {
+		return rpc_string_create_with_format("hello %s!",
+		    rpc_array_get_string(args, 0));
+	    });
 
-	if (!failed)
-		item->result = rpc_string_create("DONE!");
-	else
-		item->result = rpc_error_create(EPROTO,
-		    "Error in receiving streamed data", NULL);
-	rpc_call_free(call);
-	return (cnt);
+	fixture->srv = rpc_server_create_ex(uris_[fixture->iuri].srv,
+	    fixture->ctx, rpc_object_pack("{b}", "compress", true));
 }
 
+#if defined(TLS_SUPPORT)
+/*
+ * Makes a self-signed certificate for 127.0.0.1 with the openssl tool
+ * and starts the server with it. The server is left NULL, and the test
+ * skipped, if that can't be done.
+ */
 static void
-stream_worker(void *arg, void *data)
+client_test_tls_set_up(client_fixture *fixture, gconstpointer user_data)
 {
-	int cnt;
-	struct work_item *item = arg;
+	char *cert;
+	char *key;
+	char *cmd;
+	char *out = NULL;
+	char *err = NULL;
+	int status;
 
-	item->fx = data;
-	cnt = do_stream_work(item);
-	g_assert(cnt == item->ccnt);
-	rpc_function_respond(item->call, item->result);
-	rpc_function_release(item->call);
-	g_free(item);
+	fixture->ctx = rpc_context_create();
+	fixture->iuri = (int)user_data;
+
+	rpc_context_register_block(fixture->ctx, NULL, "hi",
+	    NULL, ^(void *cookie __unused, rpc_object_t args) {
+		return rpc_string_create_with_format("hello %s!",
+		    rpc_array_get_string(args, 0));
+	    });
+
+	fixture->str = g_dir_make_tmp("librpc-tls-XXXXXX", NULL);
+	g_assert_nonnull(fixture->str);
+	cert = g_build_filename(fixture->str, "cert.pem", NULL);
+	key = g_build_filename(fixture->str, "key.pem", NULL);
+	cmd = g_strdup_printf("openssl req -x509 -newkey rsa:2048 -nodes "
+	    "-days 1 -subj /CN=127.0.0.1 -addext subjectAltName=IP:127.0.0.1 "
+	    "-keyout '%s' -out '%s'", key, cert);
+
+	if (g_spawn_command_line_sync(cmd, &out, &err, &status, NULL) &&
+	    status == 0) {
+		fixture->srv = rpc_server_create_ex(uris_[fixture->iuri].srv,
+		    fixture->ctx, rpc_object_pack("{tls:{cert:s,key:s}}",
+		    cert, key));
+	}
+
+	g_free(out);
+	g_free(err);
+	g_free(cmd);
+	g_free(cert);
+	g_free(key);
 }
 
 static void
-client_multi_streams_test(client_fixture *fixture, gconstpointer user_data)
+client_tls_test(client_fixture *fixture, gconstpointer user_data)
 {
-	int ret = 0;
-	GError *err = NULL;
-	GRand *rand = g_rand_new ();
-	gint n = g_rand_int_range (rand, 3, THREADS);
+	rpc_client_t client;
+	rpc_object_t result;
+	char *cert;
+	char *key;
+
+	cert = g_build_filename(fixture->str, "cert.pem", NULL);
+	key = g_build_filename(fixture->str, "key.pem", NULL);
+	if (fixture->srv == NULL) {
+		g_test_skip("Cannot start a TLS server");
+		goto done;
+	}
 
-	fixture->resume = true;
-	fixture->workers = g_thread_pool_new(stream_worker, fixture,
-	    g_get_num_processors() * 4, false, &err);
-	g_assert_null(err);
+	rpc_server_resume(fixture->srv);
 
-	rpc_context_register_block(fixture->ctx, NULL, "stream-me",	NULL,
-	    ^rpc_object_t (void *cookie, rpc_object_t args) {
-		struct work_item *item;
-		GError *error = NULL;
+	/* Nothing vouches for a self-signed certificate by default */
+	client = rpc_client_create(uris_[fixture->iuri].cli, NULL);
+	g_assert_null(client);
 
-		rpc_function_retain(cookie);
-		item = g_malloc0(sizeof(*item));
-		item->call = cookie;
-		item->args = args;
-		item->conn = rpc_function_get_connection(cookie);
-		g_thread_pool_push(fixture->workers, item, &error);
-		g_assert_null(error);
+	client = rpc_client_create(uris_[fixture->iuri].cli,
+	    rpc_object_pack("{tls:{ca:s}}", cert));
+	g_assert_nonnull(client);
 
-		return (RPC_FUNCTION_STILL_RUNNING);
-	});
+	result = rpc_connection_call_simple(rpc_client_get_connection(client),
+	    "hi", "[s]", "tls");
+	g_assert_nonnull(result);
+	g_assert_cmpstr(rpc_string_get_string_ptr(result), ==, "hello tls!");
+	rpc_release(result);
+	rpc_client_close(client);
 
-	ret = thread_test(n, &thread_mestream_func, fixture);
-	g_assert(fixture->count + ret == n);
-	rpc_context_unregister_member(fixture->ctx, NULL, "stream-me");
+done:
+	g_unlink(cert);
+	g_unlink(key);
+	g_rmdir(fixture->str);
+	g_free(fixture->str);
+	g_free(cert);
+	g_free(key);
 }
+#endif
 
 static void
-client_test_single_set_up(client_fixture *fixture, gconstpointer user_data)
+client_test_sharded_set_up(client_fixture *fixture, gconstpointer user_data)
 {
 
 	fixture->ctx = rpc_context_create();
@@ -524,7 +3363,8 @@ client_test_single_set_up(client_fixture *fixture, gconstpointer user_data)
 		    rpc_array_get_string(args, 0));
 	    });
 
-	fixture->srv = rpc_server_create(uris_[fixture->iuri].srv, fixture->ctx);
+	fixture->srv = rpc_server_create_ex(uris_[fixture->iuri].srv,
+	    fixture->ctx, rpc_object_pack("{io_threads:i}", (int64_t)4));
 }
 
 static void
@@ -541,6 +3381,46 @@ client_test_tear_down(client_fixture *fixture, gconstpointer user_data)
 }
 
 
+#if defined(__linux__) && defined(AF_VSOCK)
+/*
+ * The vsock tests connect to the local CID, which only works with the
+ * vsock_loopback module loaded. Probes for it with a listener of its
+ * own on a port the kernel picks.
+ */
+static bool
+client_vsock_loopback(void)
+{
+	struct sockaddr_vm svm;
+	socklen_t len = sizeof(svm);
+	bool ret = false;
+	int lfd;
+	int fd;
+
+	lfd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd == -1)
+		return (false);
+
+	memset(&svm, 0, sizeof(svm));
+	svm.svm_family = AF_VSOCK;
+	svm.svm_cid = VMADDR_CID_ANY;
+	svm.svm_port = VMADDR_PORT_ANY;
+	if (bind(lfd, (struct sockaddr *)&svm, sizeof(svm)) == 0 &&
+	    listen(lfd, 1) == 0 &&
+	    getsockname(lfd, (struct sockaddr *)&svm, &len) == 0) {
+		fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd != -1) {
+			svm.svm_cid = 1;	/* VMADDR_CID_LOCAL */
+			ret = connect(fd, (struct sockaddr *)&svm,
+			    sizeof(svm)) == 0;
+			close(fd);
+		}
+	}
+
+	close(lfd);
+	return (ret);
+}
+#endif
+
 static void
 client_test_register()
 {
@@ -553,6 +3433,245 @@ client_test_register()
 	    client_test_single_set_up, client_server_calls_test,
 	    client_test_tear_down);
 
+	g_test_add("/client/stats/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_stats_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/flush-latency/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_flush_latency_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/arena-decoding/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_arena_decoding_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/lazy-decoding/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_lazy_decoding_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/modify-frames/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_modify_frames_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/modify-frames/loopback", client_fixture,
+	    (void *)7, client_test_single_set_up, client_modify_frames_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/handoff/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_handoff_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/handoff/loopback", client_fixture, (void *)7,
+	    client_test_single_set_up, client_handoff_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/simple/shm", client_fixture, (void *)9,
+	    client_test_single_set_up, client_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/modify-frames/shm", client_fixture, (void *)9,
+	    client_test_single_set_up, client_modify_frames_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/large-frame/shm", client_fixture, (void *)9,
+	    client_test_single_set_up, client_large_frame_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/fd-passing/unix", client_fixture, (void *)3,
+	    client_test_single_set_up, client_fd_passing_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/fd-passing/shm", client_fixture, (void *)9,
+	    client_test_single_set_up, client_fd_passing_test,
+	    client_test_tear_down);
+
+#if defined(__linux__)
+	g_test_add("/client/ring-bounds/shm", client_fixture, (void *)9,
+	    client_test_single_set_up, client_shm_ring_bounds_test,
+	    client_test_tear_down);
+#endif
+
+	g_test_add("/client/session-resume/unix", client_fixture, (void *)3,
+	    client_test_single_set_up, client_session_resume_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/session-takeover/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_session_takeover_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/session-expiry/unix", client_fixture, (void *)3,
+	    client_test_single_set_up, client_session_expiry_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/session-replay/unix", client_fixture, (void *)3,
+	    client_test_single_set_up, client_session_replay_test,
+	    client_test_tear_down);
+
+#if defined(__linux__)
+	/* Elsewhere, Unix domain sockets often have no SOCK_SEQPACKET */
+	g_test_add("/client/simple/unix+seq", client_fixture, (void *)10,
+	    client_test_single_set_up, client_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/modify-frames/unix+seq", client_fixture,
+	    (void *)10, client_test_single_set_up, client_modify_frames_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/fd-passing/unix+seq", client_fixture, (void *)10,
+	    client_test_single_set_up, client_fd_passing_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/call-batch/unix+seq", client_fixture, (void *)10,
+	    client_test_single_set_up, client_call_batch_test,
+	    client_test_tear_down);
+#endif
+
+#if defined(TLS_SUPPORT)
+	g_test_add("/client/tls/tcp+tls", client_fixture, (void *)12,
+	    client_test_tls_set_up, client_tls_test,
+	    client_test_tear_down);
+#endif
+
+#if defined(__linux__) && defined(AF_VSOCK)
+	if (client_vsock_loopback()) {
+		g_test_add("/client/simple/vsock", client_fixture, (void *)11,
+		    client_test_single_set_up, client_test,
+		    client_test_tear_down);
+
+		g_test_add("/client/large-frame/vsock", client_fixture,
+		    (void *)11, client_test_single_set_up,
+		    client_large_frame_test, client_test_tear_down);
+	}
+#endif
+
+	g_test_add("/client/shmem-pool/unix", client_fixture, (void *)3,
+	    client_test_single_set_up, client_shmem_pool_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/shmem-pool/shm", client_fixture, (void *)9,
+	    client_test_single_set_up, client_shmem_pool_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/bulk-pool/unix", client_fixture, (void *)3,
+	    client_test_single_set_up, client_bulk_pool_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/bulk-pool/shm", client_fixture, (void *)9,
+	    client_test_single_set_up, client_bulk_pool_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/simple/ws-sharded", client_fixture, (void *)5,
+	    client_test_sharded_set_up, client_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/server-call/ws-sharded", client_fixture,
+	    (void *)5, client_test_sharded_set_up, client_server_calls_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/many-connections/ws-sharded", client_fixture,
+	    (void *)5, client_test_sharded_set_up,
+	    client_many_connections_test, client_test_tear_down);
+
+	g_test_add("/client/peek-frame/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_peek_frame_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/peek-frame/loopback", client_fixture, (void *)7,
+	    client_test_single_set_up, client_peek_frame_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/compact-frames/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_compact_frames_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/compression/tcp", client_fixture, (void *)0,
+	    client_test_compress_set_up, client_compression_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/max-frame/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_max_frame_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/call-batch/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_call_batch_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/call-timeout/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_call_timeout_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/call-callback/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_call_callback_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/fanout/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_fanout_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/completion-queue/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_completion_queue_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/upload/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_upload_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/inline-method/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_inline_method_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/qos-limit/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_qos_limit_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/admission-limit/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_admission_limit_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/property-coalescing/tcp", client_fixture,
+	    (void *)0, client_test_single_set_up,
+	    client_property_coalescing_test, client_test_tear_down);
+
+	g_test_add("/client/event-filter/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_event_filter_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/event-order/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_event_order_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/event-batching/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_event_batching_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/conditional/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_conditional_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/event-queue/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_event_queue_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/coalesce/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_coalesce_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/method-stats/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_method_stats_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/adaptive-prefetch/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_adaptive_prefetch_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/query-pushdown/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_query_pushdown_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/shared-calls/tcp", client_fixture, (void *)0,
+	    client_test_single_set_up, client_shared_calls_test,
+	    client_test_tear_down);
+
 	g_test_add("/client/multi-streams/tcp", client_fixture, (void *)0,
 	    client_test_single_set_up, client_multi_streams_test,
 	    client_test_tear_down);
@@ -1432,7 +1432,10 @@ SCENARIO("RPC_DESCRIPTION_TEST", "Create a tree of RPC objects and print their d
 
 #include "../tests.h"
 #include "../../src/linker_set.h"
+#include <string.h>
 #include <glib.h>
+#include <rpc/object.h>
+#include <rpc/typing.h>
 
 
 typedef struct {
@@ -1457,10 +1460,365 @@ object_test_tear_down(object_fixture *fixture, gconstpointer user_data)
 
 }
 
+static void
+object_interned_keys_test(object_fixture *fixture, gconstpointer user_data)
+{
+	rpc_object_t dict;
+	rpc_key_t key;
+	char name[16];
+	int i;
+
+	key = rpc_key_intern("interned");
+	g_assert_true(key == rpc_key_intern("interned"));
+	g_assert_cmpstr(rpc_key_get_string(key), ==, "interned");
+
+	/* Plain and interned keys must be interchangeable */
+	dict = rpc_dictionary_create();
+	rpc_dictionary_set_int64(dict, "plain", 1);
+	rpc_dictionary_steal_value_k(dict, key, rpc_int64_create(2));
+	g_assert_cmpint(rpc_dictionary_get_int64(dict, "interned"), ==, 2);
+	g_assert_true(rpc_dictionary_has_key_k(dict, rpc_key_intern("plain")));
+
+	rpc_dictionary_set_int64(dict, "interned", 3);
+	g_assert_cmpuint(rpc_dictionary_get_count(dict), ==, 2);
+
+	/* Keep working after the dictionary turns into a hash table */
+	for (i = 0; i < 16; i++) {
+		g_snprintf(name, sizeof(name), "key%d", i);
+		rpc_dictionary_set_int64(dict, name, i);
+	}
+
+	g_assert_cmpint(rpc_int64_get_value(rpc_dictionary_get_value_k(dict,
+	    key)), ==, 3);
+	rpc_dictionary_remove_key(dict, "interned");
+	g_assert_false(rpc_dictionary_has_key_k(dict, key));
+	rpc_release(dict);
+}
+
+static void
+object_string_test(object_fixture *fixture, gconstpointer user_data)
+{
+	const char *lengths[] = { "", "short", "exactly 22 bytes long.",
+	    "a string long enough not to be stored inline", NULL };
+	rpc_object_t str;
+	rpc_object_t fmt;
+	int i;
+
+	for (i = 0; lengths[i] != NULL; i++) {
+		str = rpc_string_create(lengths[i]);
+		fmt = rpc_string_create_with_format("%s", lengths[i]);
+		g_assert_cmpstr(rpc_string_get_string_ptr(str), ==, lengths[i]);
+		g_assert_cmpuint(rpc_string_get_length(str), ==,
+		    strlen(lengths[i]));
+		g_assert_true(rpc_equal(str, fmt));
+		g_assert_cmpuint(rpc_hash(str), ==, rpc_hash(fmt));
+		rpc_release(str);
+		rpc_release(fmt);
+	}
+}
+
+static void
+object_cow_test(object_fixture *fixture, gconstpointer user_data)
+{
+	rpc_object_t orig, copy, nested;
+
+	orig = rpc_object_pack("{s,[i,i]}", "name", "orig", "list",
+	    (int64_t)1, (int64_t)2);
+	copy = rpc_copy(orig);
+	g_assert_true(rpc_equal(orig, copy));
+
+	rpc_dictionary_set_string(copy, "name", "copy");
+	nested = rpc_dictionary_get_value(copy, "list");
+	rpc_array_append_stolen_value(nested, rpc_int64_create(3));
+
+	g_assert_cmpstr(rpc_dictionary_get_string(orig, "name"), ==, "orig");
+	g_assert_cmpuint(rpc_array_get_count(
+	    rpc_dictionary_get_value(orig, "list")), ==, 2);
+	g_assert_cmpuint(rpc_array_get_count(nested), ==, 3);
+
+	rpc_release(orig);
+	g_assert_cmpstr(rpc_dictionary_get_string(copy, "name"), ==, "copy");
+	rpc_release(copy);
+}
+
+static void
+object_cow_typed_test(object_fixture *fixture, gconstpointer user_data)
+{
+	rpct_typei_t typei;
+	rpc_object_t orig, copy, child;
+
+	g_assert_cmpint(rpct_init(false), ==, 0);
+	typei = rpct_new_typei("int64");
+	g_assert_nonnull(typei);
+
+	orig = rpc_object_pack("{i,[i]}", "count", (int64_t)1, "list",
+	    (int64_t)2);
+	copy = rpc_copy(orig);
+
+	/* Typing a scalar of the copy must not type the original's */
+	child = rpc_dictionary_get_value(copy, "count");
+	g_assert_nonnull(rpct_set_typei(typei, child));
+	child = rpc_array_get_value(rpc_dictionary_get_value(copy, "list"), 0);
+	g_assert_nonnull(rpct_set_typei(typei, child));
+
+	g_assert_true(rpct_get_typei(
+	    rpc_dictionary_get_value(copy, "count")) == typei);
+	g_assert_null(rpct_get_typei(
+	    rpc_dictionary_get_value(orig, "count")));
+	g_assert_null(rpct_get_typei(rpc_array_get_value(
+	    rpc_dictionary_get_value(orig, "list"), 0)));
+	g_assert_cmpint(rpc_dictionary_get_int64(orig, "count"), ==, 1);
+
+	rpc_release(copy);
+	rpc_release(orig);
+	rpct_typei_release(typei);
+}
+
+static void
+object_freeze_test(object_fixture *fixture, gconstpointer user_data)
+{
+	rpc_object_t root, nested, copy;
+
+	root = rpc_object_pack("{s,[i,s]}", "name", "frozen", "list",
+	    (int64_t)1, "two");
+	rpc_object_freeze(root);
+
+	nested = rpc_dictionary_get_value(root, "list");
+	g_assert_true(rpc_object_is_frozen(root));
+	g_assert_true(rpc_object_is_frozen(nested));
+	g_assert_true(rpc_object_is_frozen(rpc_array_get_value(nested, 1)));
+
+	/* A reference to a pinned object keeps the whole tree around */
+	rpc_retain(nested);
+	rpc_release(root);
+	g_assert_cmpstr(rpc_array_get_string(nested, 1), ==, "two");
+
+	copy = rpc_copy(nested);
+	g_assert_false(rpc_object_is_frozen(copy));
+	rpc_array_append_stolen_value(copy, rpc_int64_create(3));
+	g_assert_cmpuint(rpc_array_get_count(copy), ==, 3);
+	g_assert_cmpuint(rpc_array_get_count(nested), ==, 2);
+
+	rpc_release(copy);
+	rpc_release(nested);
+}
+
+static void
+object_pack_compiled_test(object_fixture *fixture, gconstpointer user_data)
+{
+	rpc_pack_fmt_t fmt;
+	rpc_object_t expected, packed;
+	int i;
+
+	g_assert_null(rpc_pack_compile("{s,[i}"));
+	g_assert_null(rpc_pack_compile("{s}, i"));
+
+	fmt = rpc_pack_compile("{name:'inline', s, list:[i, 3:u, {s}]}");
+	g_assert_nonnull(fmt);
+
+	expected = rpc_object_pack("{name:'inline',s,list:[i,3:u,{s}]}",
+	    "key", "value", (int64_t)1, (uint64_t)2, "nested", "string");
+
+	for (i = 0; i < 2; i++) {
+		packed = rpc_object_pack_compiled(fmt, "key", "value",
+		    (int64_t)1, (uint64_t)2, "nested", "string");
+		g_assert_true(rpc_equal(packed, expected));
+		rpc_release(packed);
+	}
+
+	g_assert_cmpuint(rpc_array_get_count(
+	    rpc_dictionary_get_value(expected, "list")), ==, 5);
+
+	rpc_release(expected);
+	rpc_pack_free(fmt);
+}
+
+static void
+object_capacity_test(object_fixture *fixture, gconstpointer user_data)
+{
+	const char *keys[] = { "a", "b", "c" };
+	rpc_object_t values[3];
+	rpc_object_t array, dict;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		values[i] = rpc_int64_create(i);
+
+	array = rpc_array_create_ex(values, 3, false);
+	dict = rpc_dictionary_create_ex(keys, values, 3, false);
+	g_assert_cmpint(rpc_get_refcount(values[1]), ==, 3);
+	g_assert_cmpint(rpc_array_get_int64(array, 2), ==, 2);
+	g_assert_cmpint(rpc_dictionary_get_int64(dict, "c"), ==, 2);
+	rpc_release(array);
+	rpc_release(dict);
+
+	/* Stolen references go away along with the array */
+	array = rpc_array_create_ex(values, 3, true);
+	g_assert_cmpint(rpc_get_refcount(values[1]), ==, 1);
+	rpc_release(array);
+
+	array = rpc_array_create_with_capacity(100);
+	for (i = 0; i < 200; i++)
+		rpc_array_append_stolen_value(array, rpc_int64_create(i));
+
+	g_assert_cmpuint(rpc_array_get_count(array), ==, 200);
+	rpc_release(array);
+
+	dict = rpc_dictionary_create_with_capacity(32);
+	g_assert_cmpuint(rpc_dictionary_get_count(dict), ==, 0);
+	rpc_release(dict);
+}
+
+#if defined(__linux__)
+static void
+object_shmem_pool_test(object_fixture *fixture, gconstpointer user_data)
+{
+	rpc_shmem_pool_t pool;
+	rpc_object_t chunks[16];
+	rpc_object_t whole;
+	char *addr[2];
+	int i;
+
+	pool = rpc_shmem_pool_create(64 * 1024);
+	g_assert_nonnull(pool);
+	g_assert_null(rpc_shmem_pool_alloc(pool, 128 * 1024));
+
+	/* Chunks are rounded up to a page and don't overlap */
+	for (i = 0; i < 16; i++) {
+		chunks[i] = rpc_shmem_pool_alloc(pool, 3000);
+		g_assert_nonnull(chunks[i]);
+		g_assert_cmpuint(rpc_shmem_get_size(chunks[i]), >=, 3000);
+		memset(rpc_shmem_map(chunks[i]), 'a' + i, 3000);
+	}
+
+	g_assert_null(rpc_shmem_pool_alloc(pool, 1));
+	addr[0] = rpc_shmem_map(chunks[0]);
+	addr[1] = rpc_shmem_map(chunks[15]);
+	g_assert_cmpint(addr[0][2999], ==, 'a');
+	g_assert_cmpint(addr[1][0], ==, 'p');
+
+	/* Freed chunks are reused, and merged back together */
+	rpc_release(chunks[3]);
+	chunks[3] = rpc_shmem_pool_alloc(pool, 4096);
+	g_assert_nonnull(chunks[3]);
+	g_assert_null(rpc_shmem_pool_alloc(pool, 8192));
+
+	for (i = 0; i < 16; i++)
+		rpc_release(chunks[i]);
+
+	whole = rpc_shmem_pool_alloc(pool, 64 * 1024);
+	g_assert_nonnull(whole);
+
+	/* The pool lives on for as long as its chunks do */
+	rpc_shmem_pool_release(pool);
+	memset(rpc_shmem_map(whole), 0, 64 * 1024);
+	rpc_release(whole);
+}
+#endif
+
+/*
+ * Objects are created on one thread and released on another, so the
+ * object cache hands them back to their allocating thread through its
+ * depot. Each producer exits with its cache still holding items.
+ */
+#define	OBJECT_CACHE_PAIRS	4
+#define	OBJECT_CACHE_COUNT	20000
+
+static gpointer
+object_cache_producer(gpointer data)
+{
+	GAsyncQueue *queue = data;
+	int64_t i;
+
+	for (i = 0; i < OBJECT_CACHE_COUNT; i++) {
+		g_async_queue_push(queue, i % 2 == 0
+		    ? rpc_int64_create(i)
+		    : rpc_string_create_with_format("%" G_GINT64_FORMAT, i));
+	}
+
+	return (NULL);
+}
+
+static gpointer
+object_cache_consumer(gpointer data)
+{
+	GAsyncQueue *queue = data;
+	rpc_object_t object;
+	char *expected;
+	int64_t i;
+
+	for (i = 0; i < OBJECT_CACHE_COUNT; i++) {
+		object = g_async_queue_pop(queue);
+		if (i % 2 == 0)
+			g_assert_cmpint(rpc_int64_get_value(object), ==, i);
+		else {
+			expected = g_strdup_printf("%" G_GINT64_FORMAT, i);
+			g_assert_cmpstr(rpc_string_get_string_ptr(object), ==,
+			    expected);
+			g_free(expected);
+		}
+
+		rpc_release(object);
+	}
+
+	return (NULL);
+}
+
+static void
+object_cache_test(object_fixture *fixture, gconstpointer user_data)
+{
+	GThread *threads[OBJECT_CACHE_PAIRS * 2];
+	GAsyncQueue *queues[OBJECT_CACHE_PAIRS];
+	int i;
+
+	for (i = 0; i < OBJECT_CACHE_PAIRS; i++) {
+		queues[i] = g_async_queue_new();
+		threads[i * 2] = g_thread_new("producer",
+		    object_cache_producer, queues[i]);
+		threads[i * 2 + 1] = g_thread_new("consumer",
+		    object_cache_consumer, queues[i]);
+	}
+
+	for (i = 0; i < OBJECT_CACHE_PAIRS * 2; i++)
+		g_thread_join(threads[i]);
+
+	for (i = 0; i < OBJECT_CACHE_PAIRS; i++)
+		g_async_queue_unref(queues[i]);
+}
+
 static void
 object_test_register()
 {
 
+	g_test_add("/object/string/inline", object_fixture, NULL,
+	    object_test_single_set_up, object_string_test,
+	    object_test_tear_down);
+	g_test_add("/object/dictionary/interned-keys", object_fixture, NULL,
+	    object_test_single_set_up, object_interned_keys_test,
+	    object_test_tear_down);
+	g_test_add("/object/dictionary/copy-on-write", object_fixture, NULL,
+	    object_test_single_set_up, object_cow_test,
+	    object_test_tear_down);
+	g_test_add("/object/dictionary/copy-on-write-typed", object_fixture,
+	    NULL, object_test_single_set_up, object_cow_typed_test,
+	    object_test_tear_down);
+	g_test_add("/object/freeze", object_fixture, NULL,
+	    object_test_single_set_up, object_freeze_test,
+	    object_test_tear_down);
+	g_test_add("/object/array/capacity", object_fixture, NULL,
+	    object_test_single_set_up, object_capacity_test,
+	    object_test_tear_down);
+	g_test_add("/object/pack/compiled", object_fixture, NULL,
+	    object_test_single_set_up, object_pack_compiled_test,
+	    object_test_tear_down);
+	g_test_add("/object/cache/cross-thread", object_fixture, NULL,
+	    object_test_single_set_up, object_cache_test,
+	    object_test_tear_down);
+#if defined(__linux__)
+	g_test_add("/object/shmem/pool", object_fixture, NULL,
+	    object_test_single_set_up, object_shmem_pool_test,
+	    object_test_tear_down);
+#endif
 }
 
 static struct librpc_test object = {
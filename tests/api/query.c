@@ -28,6 +28,8 @@
 #include "../tests.h"
 #include "../../src/linker_set.h"
 #include <glib.h>
+#include <rpc/object.h>
+#include <rpc/query.h>
 
 
 typedef struct {
@@ -40,6 +42,574 @@ query_test(query_fixture *fixture, gconstpointer user_data)
 
 }
 
+/*
+ * Array of {id, name: "item<id>", value: id % 10} dictionaries.
+ */
+static rpc_object_t
+query_dataset(int64_t count)
+{
+	rpc_object_t array;
+	char name[32];
+	int64_t i;
+
+	array = rpc_array_create();
+	for (i = 0; i < count; i++) {
+		g_snprintf(name, sizeof(name), "item%" G_GINT64_FORMAT, i);
+		rpc_array_append_stolen_value(array, rpc_object_pack(
+		    "{i,s,i}", "id", i, "name", name, "value", i % 10));
+	}
+
+	return (array);
+}
+
+/*
+ * Drains an iterator into an array and frees it.
+ */
+static rpc_object_t
+query_collect(rpc_query_iter_t iter)
+{
+	rpc_object_t result;
+	rpc_object_t chunk;
+
+	g_assert_nonnull(iter);
+	result = rpc_array_create();
+	while (rpc_query_next(iter, &chunk))
+		rpc_array_append_stolen_value(result, chunk);
+
+	rpc_query_iter_free(iter);
+	return (result);
+}
+
+static void
+query_plan_test(query_fixture *fixture, gconstpointer user_data)
+{
+	rpc_query_plan_t plan;
+	rpc_object_t data, rules, expected, result, match;
+	int i;
+
+	data = query_dataset(100);
+	rules = rpc_object_pack("[[s,s,i],[s,s,s]]", "value", ">", (int64_t)3,
+	    "name", "~", "^item1");
+
+	match = rpc_string_create("rules");
+	g_assert_null(rpc_query_compile(match));
+	rpc_release(match);
+
+	plan = rpc_query_compile(rules);
+	g_assert_nonnull(plan);
+
+	/* A plan is reusable and matches what the rules match */
+	expected = query_collect(rpc_query(data, NULL, rules));
+	g_assert_cmpuint(rpc_array_get_count(expected), ==, 6);
+
+	for (i = 0; i < 2; i++) {
+		result = query_collect(rpc_query_plan(data, NULL, plan));
+		g_assert_true(rpc_equal(result, expected));
+		rpc_release(result);
+	}
+
+	g_assert_cmpint(rpc_dictionary_get_int64(
+	    rpc_array_get_value(expected, 0), "id"), ==, 14);
+
+	match = rpc_query_plan_apply(rpc_array_get_value(data, 19), plan);
+	g_assert_true(match == rpc_array_get_value(data, 19));
+	rpc_release(match);
+	g_assert_null(rpc_query_plan_apply(rpc_array_get_value(data, 29),
+	    plan));
+
+	rpc_query_plan_free(plan);
+	rpc_release(expected);
+	rpc_release(rules);
+
+	/* Nested logic operators */
+	rules = rpc_object_pack("[[s,[[s,s,i],[s,s,i]]]]", "or",
+	    "value", "=", (int64_t)0, "value", "=", (int64_t)9);
+	plan = rpc_query_compile(rules);
+	result = query_collect(rpc_query_plan(data, NULL, plan));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 20);
+	rpc_release(result);
+	rpc_query_plan_free(plan);
+	rpc_release(rules);
+
+	rpc_release(data);
+}
+
+static void
+query_index_test(query_fixture *fixture, gconstpointer user_data)
+{
+	rpc_query_index_t hash, ordered;
+	rpc_object_t data, eq, in, ge, expected[3], result;
+
+	data = query_dataset(1000);
+	eq = rpc_object_pack("[[s,s,i]]", "value", "=", (int64_t)3);
+	in = rpc_object_pack("[[s,s,[i,i]]]", "value", "in", (int64_t)1,
+	    (int64_t)2);
+	ge = rpc_object_pack("[[s,s,i],[s,s,i]]", "id", ">=", (int64_t)990,
+	    "value", "!=", (int64_t)5);
+
+	expected[0] = query_collect(rpc_query(data, NULL, eq));
+	expected[1] = query_collect(rpc_query(data, NULL, in));
+	expected[2] = query_collect(rpc_query(data, NULL, ge));
+	g_assert_cmpuint(rpc_array_get_count(expected[0]), ==, 100);
+	g_assert_cmpuint(rpc_array_get_count(expected[1]), ==, 200);
+
+	g_assert_null(rpc_query_index_create(rpc_array_get_value(data, 0),
+	    "value", RPC_QUERY_INDEX_HASH));
+
+	hash = rpc_query_index_create(data, "value", RPC_QUERY_INDEX_HASH);
+	ordered = rpc_query_index_create(data, "id", RPC_QUERY_INDEX_ORDERED);
+	g_assert_nonnull(hash);
+	g_assert_nonnull(ordered);
+
+	/* Indexes narrow the scan down, but never change the outcome */
+	result = query_collect(rpc_query(data, NULL, eq));
+	g_assert_true(rpc_equal(result, expected[0]));
+	rpc_release(result);
+
+	result = query_collect(rpc_query(data, NULL, in));
+	g_assert_true(rpc_equal(result, expected[1]));
+	rpc_release(result);
+
+	result = query_collect(rpc_query(data, NULL, ge));
+	g_assert_true(rpc_equal(result, expected[2]));
+	rpc_release(result);
+
+	/* Indexes are rebuilt after the array changes */
+	rpc_array_append_stolen_value(data, rpc_object_pack("{i,s,i}",
+	    "id", (int64_t)1000, "name", "item1000", "value", (int64_t)3));
+	result = query_collect(rpc_query(data, NULL, eq));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 101);
+	g_assert_cmpint(rpc_dictionary_get_int64(rpc_array_get_value(result,
+	    100), "id"), ==, 1000);
+	rpc_release(result);
+
+	rpc_query_index_free(ordered);
+	rpc_query_index_free(hash);
+	rpc_release(expected[0]);
+	rpc_release(expected[1]);
+	rpc_release(expected[2]);
+	rpc_release(eq);
+	rpc_release(in);
+	rpc_release(ge);
+	rpc_release(data);
+}
+
+static void
+query_top_k_test(query_fixture *fixture, gconstpointer user_data)
+{
+	struct rpc_query_params params = { 0 };
+	rpc_object_t data, rules, full, result;
+	size_t i;
+	int reverse;
+
+	data = query_dataset(500);
+	rules = rpc_object_pack("[[s,s,i]]", "value", "!=", (int64_t)7);
+	params.sort = ^int(rpc_object_t o1, rpc_object_t o2) {
+		int64_t v1 = rpc_dictionary_get_int64(o1, "value");
+		int64_t v2 = rpc_dictionary_get_int64(o2, "value");
+
+		return ((v2 > v1) - (v2 < v1));
+	};
+
+	/* Picking the first offset + limit must keep the full sort order */
+	for (reverse = 0; reverse < 2; reverse++) {
+		params.reverse = (bool)reverse;
+		params.offset = 0;
+		params.limit = 0;
+		full = query_collect(rpc_query(data, &params, rules));
+		g_assert_cmpuint(rpc_array_get_count(full), ==, 450);
+
+		params.offset = 45;
+		params.limit = 60;
+		result = query_collect(rpc_query(data, &params, rules));
+		g_assert_cmpuint(rpc_array_get_count(result), ==, 60);
+
+		for (i = 0; i < 60; i++) {
+			g_assert_true(rpc_array_get_value(result, i) ==
+			    rpc_array_get_value(full, i + 45));
+		}
+
+		rpc_release(result);
+
+		/* A limit past the end yields what's left */
+		params.offset = 440;
+		params.limit = 100;
+		result = query_collect(rpc_query(data, &params, rules));
+		g_assert_cmpuint(rpc_array_get_count(result), ==, 10);
+		g_assert_true(rpc_array_get_value(result, 9) ==
+		    rpc_array_get_value(full, 449));
+
+		rpc_release(result);
+		rpc_release(full);
+	}
+
+	rpc_release(rules);
+	rpc_release(data);
+}
+
+static void
+query_parallel_test(query_fixture *fixture, gconstpointer user_data)
+{
+	struct rpc_query_params params = { 0 };
+	rpc_object_t data, rules, serial, result;
+
+	data = query_dataset(RPC_QUERY_PARALLEL_MIN + 1000);
+	rules = rpc_object_pack("[[s,s,s],[s,s,i]]", "name", "~", "7$",
+	    "value", "=", (int64_t)7);
+
+	serial = query_collect(rpc_query(data, &params, rules));
+	g_assert_cmpuint(rpc_array_get_count(serial), ==,
+	    (RPC_QUERY_PARALLEL_MIN + 1000) / 10);
+
+	/* Same matches in the same order, whatever the thread count */
+	params.parallel = 4;
+	result = query_collect(rpc_query(data, &params, rules));
+	g_assert_true(rpc_equal(result, serial));
+	rpc_release(result);
+
+	params.offset = 10;
+	params.limit = 20;
+	params.callback = ^rpc_object_t(rpc_object_t object) {
+		return (rpc_dictionary_get_value(object, "id"));
+	};
+
+	result = query_collect(rpc_query(data, &params, rules));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 20);
+	g_assert_cmpint(rpc_array_get_int64(result, 0), ==,
+	    rpc_dictionary_get_int64(rpc_array_get_value(serial, 10), "id"));
+	g_assert_cmpint(rpc_array_get_int64(result, 19), ==,
+	    rpc_dictionary_get_int64(rpc_array_get_value(serial, 29), "id"));
+	rpc_release(result);
+
+	rpc_release(serial);
+	rpc_release(rules);
+	rpc_release(data);
+}
+
+static void
+query_select_test(query_fixture *fixture, gconstpointer user_data)
+{
+	const char *flat[] = { "id", "name", "missing", NULL };
+	const char *nested[] = { "id", "meta.owner", NULL };
+	struct rpc_query_params params = { 0 };
+	rpc_object_t data, rules, result, item, orig;
+
+	data = rpc_object_pack("[{i,s,{s,i}},{i,s,{s,i}},s]",
+	    "id", (int64_t)1, "name", "one", "meta", "owner", "root",
+	    "size", (int64_t)10,
+	    "id", (int64_t)2, "name", "two", "meta", "owner", "user",
+	    "size", (int64_t)20,
+	    "three");
+	rules = rpc_array_create();
+
+	/* Only the selected fields, shared with the source */
+	params.select = flat;
+	result = query_collect(rpc_query(data, &params, rules));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 3);
+
+	orig = rpc_array_get_value(data, 1);
+	item = rpc_array_get_value(result, 1);
+	g_assert_cmpuint(rpc_dictionary_get_count(item), ==, 2);
+	g_assert_cmpint(rpc_dictionary_get_int64(item, "id"), ==, 2);
+	g_assert_true(rpc_dictionary_get_value(item, "name") ==
+	    rpc_dictionary_get_value(orig, "name"));
+	g_assert_false(rpc_dictionary_has_key(item, "meta"));
+	g_assert_false(rpc_dictionary_has_key(item, "missing"));
+
+	/* Anything but a dictionary is passed through */
+	g_assert_cmpstr(rpc_array_get_string(result, 2), ==, "three");
+	rpc_release(result);
+
+	/* Dotted paths come out nested */
+	params.select = nested;
+	params.single = true;
+	result = query_collect(rpc_query(data, &params, rules));
+	item = rpc_array_get_value(result, 0);
+	g_assert_cmpuint(rpc_dictionary_get_count(item), ==, 2);
+	g_assert_true(rpc_query_contains(item, "meta.owner"));
+	g_assert_cmpstr(rpc_string_get_string_ptr(rpc_query_get(item,
+	    "meta.owner", NULL)), ==, "root");
+	g_assert_false(rpc_query_contains(item, "meta.size"));
+	rpc_release(result);
+
+	/* The source is left alone */
+	g_assert_cmpuint(rpc_dictionary_get_count(orig), ==, 3);
+
+	rpc_release(rules);
+	rpc_release(data);
+}
+
+static void
+query_path_test(query_fixture *fixture, gconstpointer user_data)
+{
+	rpc_path_t path, empty;
+	rpc_object_t obj, expected, def;
+
+	path = rpc_path_compile("some.0.values.1.and.indexes");
+	g_assert_nonnull(path);
+
+	/* Compiled paths behave just like the string ones */
+	obj = rpc_dictionary_create();
+	expected = rpc_dictionary_create();
+	rpc_query_set_path(obj, path, rpc_bool_create(true), true);
+	rpc_query_set(expected, "some.0.values.1.and.indexes",
+	    rpc_bool_create(true), true);
+	g_assert_true(rpc_equal(obj, expected));
+	g_assert_true(rpc_query_contains_path(obj, path));
+	g_assert_true(rpc_query_get_path(obj, path, NULL) != NULL);
+	g_assert_true(rpc_bool_get_value(rpc_query_get_path(obj, path, NULL)));
+	g_assert_cmpint(rpc_get_type(rpc_query_get(obj, "some.0.values.0",
+	    NULL)), ==, RPC_TYPE_NULL);
+
+	rpc_query_delete_path(obj, path);
+	rpc_query_delete(expected, "some.0.values.1.and.indexes");
+	g_assert_false(rpc_query_contains_path(obj, path));
+	g_assert_true(rpc_equal(obj, expected));
+
+	def = rpc_string_create("default");
+	g_assert_true(rpc_query_get_path(obj, path, def) == def);
+	rpc_release(def);
+
+	/* Empty segments are skipped */
+	empty = rpc_path_compile("some..0.values.");
+	g_assert_true(rpc_query_contains_path(obj, empty));
+	g_assert_true(rpc_query_get_path(obj, empty, NULL) ==
+	    rpc_query_get(obj, "some.0.values", NULL));
+
+	rpc_path_free(empty);
+	rpc_path_free(path);
+	rpc_release(expected);
+	rpc_release(obj);
+}
+
+/*
+ * Checks that a view holds what a full query over its array returns.
+ */
+static void
+query_view_check(rpc_query_view_t view, rpc_object_t array,
+    rpc_query_plan_t plan)
+{
+	rpc_object_t expected, result;
+
+	expected = query_collect(rpc_query_plan(array, NULL, plan));
+	result = rpc_query_view_get(view);
+	g_assert_true(rpc_equal(result, expected));
+	rpc_release(expected);
+	rpc_release(result);
+}
+
+static void
+query_view_test(query_fixture *fixture, gconstpointer user_data)
+{
+	rpc_query_plan_t plan;
+	rpc_query_view_t view;
+	rpc_object_t data, rules, result;
+
+	data = query_dataset(50);
+	rules = rpc_object_pack("[[s,s,i]]", "value", "<", (int64_t)3);
+	plan = rpc_query_compile(rules);
+	view = rpc_query_view_create(data, plan);
+	g_assert_nonnull(view);
+	query_view_check(view, data, plan);
+
+	result = rpc_query_view_get(view);
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 15);
+	rpc_release(result);
+
+	/* Appending, replacing and removing elements of the array */
+	rpc_array_append_stolen_value(data, rpc_object_pack("{i,i}",
+	    "id", (int64_t)50, "value", (int64_t)1));
+	query_view_check(view, data, plan);
+
+	rpc_array_set_value(data, 3, rpc_array_get_value(data, 50));
+	rpc_array_steal_value(data, 0, rpc_object_pack("{i,i}",
+	    "id", (int64_t)0, "value", (int64_t)9));
+	query_view_check(view, data, plan);
+
+	rpc_array_remove_index(data, 1);
+	rpc_array_remove_index(data, 4);
+	query_view_check(view, data, plan);
+
+	rpc_array_sort(data, ^int(rpc_object_t o1, rpc_object_t o2) {
+		return (rpc_cmp(rpc_dictionary_get_value(o2, "id"),
+		    rpc_dictionary_get_value(o1, "id")));
+	});
+	query_view_check(view, data, plan);
+
+	/* In place changes are picked up on refresh */
+	rpc_dictionary_set_int64(rpc_array_get_value(data, 0), "value", 0);
+	rpc_query_view_refresh(view);
+	query_view_check(view, data, plan);
+
+	rpc_array_remove_all(data);
+	result = rpc_query_view_get(view);
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 0);
+	rpc_release(result);
+
+	rpc_query_view_free(view);
+	rpc_query_plan_free(plan);
+	rpc_release(rules);
+	rpc_release(data);
+}
+
+static void
+query_packed_test(query_fixture *fixture, gconstpointer user_data)
+{
+	int64_t values[1000];
+	rpc_object_t packed, boxed, rules, expected, result;
+	size_t i;
+
+	boxed = rpc_array_create();
+	for (i = 0; i < 1000; i++) {
+		values[i] = (int64_t)(i * 7 % 1000);
+		rpc_array_append_stolen_value(boxed,
+		    rpc_int64_create(values[i]));
+	}
+
+	packed = rpc_array_create_packed(RPC_TYPE_INT64, values, 1000);
+	g_assert_nonnull(packed);
+
+	/* Same matches as over a regular array, the source stays packed */
+	rules = rpc_object_pack("[[s,s,i],[s,s,i]]", "", ">", (int64_t)10,
+	    "", "<=", (int64_t)20);
+	expected = query_collect(rpc_query(boxed, NULL, rules));
+	result = query_collect(rpc_query(packed, NULL, rules));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 10);
+	g_assert_true(rpc_equal(result, expected));
+	g_assert_nonnull(rpc_array_get_packed(packed, NULL, NULL));
+	rpc_release(expected);
+	rpc_release(result);
+	rpc_release(rules);
+
+	/* Equality needs the types to match */
+	rules = rpc_object_pack("[[s,s,i]]", "", "=", (int64_t)5);
+	result = query_collect(rpc_query(packed, NULL, rules));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 1);
+	g_assert_cmpint(rpc_array_get_int64(result, 0), ==, 5);
+	rpc_release(result);
+	rpc_release(rules);
+
+	rules = rpc_object_pack("[[s,s,u]]", "", "=", (uint64_t)5);
+	result = query_collect(rpc_query(packed, NULL, rules));
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 0);
+	rpc_release(result);
+	rpc_release(rules);
+
+	rpc_release(packed);
+	rpc_release(boxed);
+}
+
+/*
+ * Diffs two objects, checks the delta turns one into the other and
+ * returns the number of operations it took.
+ */
+static size_t
+query_diff_check(rpc_object_t from, rpc_object_t to)
+{
+	rpc_object_t orig, delta, result;
+	size_t count;
+
+	orig = rpc_copy(from);
+	delta = rpc_query_diff(from, to);
+	g_assert_cmpint(rpc_get_type(delta), ==, RPC_TYPE_ARRAY);
+	result = rpc_query_patch(from, delta);
+	g_assert_nonnull(result);
+	g_assert_true(rpc_equal(result, to));
+	g_assert_true(rpc_equal(from, orig));
+
+	count = rpc_array_get_count(delta);
+	rpc_release(result);
+	rpc_release(delta);
+	rpc_release(orig);
+	return (count);
+}
+
+static void
+query_diff_test(query_fixture *fixture, gconstpointer user_data)
+{
+	rpc_object_t from, to, delta, result;
+
+	from = rpc_object_pack("{s,i,{i,b},[i,i,i,i]}",
+	    "name", "sensor",
+	    "rate", (int64_t)10,
+	    "limits", "low", (int64_t)0, "enabled", true,
+	    "samples", (int64_t)1, (int64_t)2, (int64_t)3, (int64_t)4);
+
+	/* Nothing to do for equal objects */
+	to = rpc_copy(from);
+	g_assert_cmpuint(query_diff_check(from, to), ==, 0);
+
+	/* A nested change is a single set at its path */
+	rpc_dictionary_set_int64(rpc_dictionary_get_value(to, "limits"),
+	    "low", -5);
+	delta = rpc_query_diff(from, to);
+	g_assert_cmpuint(rpc_array_get_count(delta), ==, 1);
+	g_assert_cmpstr(rpc_dictionary_get_string(
+	    rpc_array_get_value(delta, 0), "op"), ==, "set");
+	g_assert_cmpstr(rpc_dictionary_get_string(
+	    rpc_array_get_value(delta, 0), "path"), ==, "limits.low");
+	rpc_release(delta);
+	g_assert_cmpuint(query_diff_check(from, to), ==, 1);
+
+	/* Added, removed and retyped keys */
+	rpc_dictionary_set_string(to, "unit", "Hz");
+	rpc_dictionary_remove_key(to, "name");
+	rpc_dictionary_set_string(to, "rate", "fast");
+	g_assert_cmpuint(query_diff_check(from, to), ==, 4);
+
+	/* Arrays change in place or get spliced in the middle */
+	rpc_release(to);
+	to = rpc_copy(from);
+	rpc_array_steal_value(rpc_dictionary_get_value(to, "samples"), 1,
+	    rpc_int64_create(20));
+	g_assert_cmpuint(query_diff_check(from, to), ==, 1);
+
+	rpc_release(to);
+	to = rpc_copy(from);
+	rpc_dictionary_steal_value(to, "samples", rpc_object_pack(
+	    "[i,i,i,i,i]", (int64_t)1, (int64_t)7, (int64_t)8, (int64_t)3,
+	    (int64_t)4));
+	delta = rpc_query_diff(from, to);
+	g_assert_cmpuint(rpc_array_get_count(delta), ==, 1);
+	g_assert_cmpstr(rpc_dictionary_get_string(
+	    rpc_array_get_value(delta, 0), "op"), ==, "splice");
+	g_assert_cmpuint(rpc_dictionary_get_uint64(
+	    rpc_array_get_value(delta, 0), "index"), ==, 1);
+	g_assert_cmpuint(rpc_dictionary_get_uint64(
+	    rpc_array_get_value(delta, 0), "remove"), ==, 1);
+	rpc_release(delta);
+	g_assert_cmpuint(query_diff_check(from, to), ==, 1);
+
+	/* Keys that can't be spelled in a path take the whole dictionary */
+	rpc_release(to);
+	to = rpc_copy(from);
+	rpc_dictionary_set_bool(rpc_dictionary_get_value(to, "limits"),
+	    "a.b", true);
+	g_assert_cmpuint(query_diff_check(from, to), ==, 1);
+
+	/* Top level type changes replace the object */
+	rpc_release(to);
+	to = rpc_string_create("gone");
+	g_assert_cmpuint(query_diff_check(from, to), ==, 1);
+
+	/* Operations that don't apply fail the whole patch */
+	delta = rpc_object_pack("[{s,s}]", "op", "delete", "path", "missing");
+	g_assert_null(rpc_query_patch(from, delta));
+	rpc_release(delta);
+
+	delta = rpc_object_pack("[{s,s,u,u}]", "op", "splice", "path", "name",
+	    "index", (uint64_t)0, "remove", (uint64_t)1);
+	g_assert_null(rpc_query_patch(from, delta));
+	rpc_release(delta);
+
+	result = rpc_int64_create(1);
+	g_assert_null(rpc_query_patch(from, result));
+	rpc_release(result);
+
+	rpc_release(to);
+	rpc_release(from);
+}
+
 static void
 query_test_single_set_up(query_fixture *fixture, gconstpointer user_data)
 {
@@ -56,6 +626,33 @@ static void
 query_test_register()
 {
 
+	g_test_add("/query/plan", query_fixture, NULL,
+	    query_test_single_set_up, query_plan_test,
+	    query_test_tear_down);
+	g_test_add("/query/index", query_fixture, NULL,
+	    query_test_single_set_up, query_index_test,
+	    query_test_tear_down);
+	g_test_add("/query/top-k", query_fixture, NULL,
+	    query_test_single_set_up, query_top_k_test,
+	    query_test_tear_down);
+	g_test_add("/query/parallel", query_fixture, NULL,
+	    query_test_single_set_up, query_parallel_test,
+	    query_test_tear_down);
+	g_test_add("/query/select", query_fixture, NULL,
+	    query_test_single_set_up, query_select_test,
+	    query_test_tear_down);
+	g_test_add("/query/path", query_fixture, NULL,
+	    query_test_single_set_up, query_path_test,
+	    query_test_tear_down);
+	g_test_add("/query/view", query_fixture, NULL,
+	    query_test_single_set_up, query_view_test,
+	    query_test_tear_down);
+	g_test_add("/query/packed", query_fixture, NULL,
+	    query_test_single_set_up, query_packed_test,
+	    query_test_tear_down);
+	g_test_add("/query/diff", query_fixture, NULL,
+	    query_test_single_set_up, query_diff_test,
+	    query_test_tear_down);
 }
 
 static struct librpc_test query = {
@@ -26,10 +26,15 @@
  */
 
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
 #include <rpc/object.h>
 #include <rpc/serializer.h>
 #include "../../src/linker_set.h"
+#include "../../src/internal.h"
+#include "../../src/serializer/msgpack.h"
 #include "../tests.h"
 
 struct serializer_fixture
@@ -56,6 +61,32 @@ serializer_test(struct serializer_fixture *fixture, gconstpointer user_data)
 	g_test_queue_destroy((GDestroyNotify)rpc_release_impl, object_mirror);
 }
 
+static void
+serializer_test_fd(struct serializer_fixture *fixture, gconstpointer user_data)
+{
+	rpc_object_t mirror;
+	char *path;
+	gchar *buf;
+	gsize size;
+	int fd;
+
+	fd = g_file_open_tmp(NULL, &path, NULL);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_cmpint(rpc_serializer_dump_fd(fixture->type, fixture->object,
+	    fd), ==, 0);
+	close(fd);
+
+	g_assert_true(g_file_get_contents(path, &buf, &size, NULL));
+	mirror = rpc_serializer_load(fixture->type, buf, size);
+	g_assert_nonnull(mirror);
+	g_assert_true(rpc_equal(fixture->object, mirror));
+
+	rpc_release(mirror);
+	g_free(buf);
+	g_unlink(path);
+	g_free(path);
+}
+
 static void
 serializer_test_dict_set_up(struct serializer_fixture *fixture,
     gconstpointer user_data)
@@ -120,6 +151,523 @@ serializer_test_single_set_up(struct serializer_fixture *fixture,
 	fixture->type = user_data;
 }
 
+static void
+serializer_test_large_dict_set_up(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	char key[16];
+	int i;
+
+	/* Large enough to be stored in a hash table */
+	fixture->object = rpc_dictionary_create();
+	for (i = 0; i < 32; i++) {
+		g_snprintf(key, sizeof(key), "key%d", i);
+		rpc_dictionary_set_int64(fixture->object, key, i);
+	}
+
+	rpc_dictionary_remove_key(fixture->object, "key0");
+	g_assert_cmpuint(rpc_dictionary_get_count(fixture->object), ==, 31);
+	g_assert_cmpint(rpc_dictionary_get_int64(fixture->object, "key31"),
+	    ==, 31);
+
+	fixture->type = user_data;
+}
+
+static void
+serializer_test_escaped_keys_set_up(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+
+	fixture->object = rpc_object_pack("{i,i,i}",
+	    "$uint", (int64_t)1,
+	    "\\escaped", (int64_t)2,
+	    "plain", (int64_t)3);
+	fixture->type = user_data;
+}
+
+static void
+serializer_test_json_strings_set_up(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	static const char *special[] = {
+		"\"", "\\", "\\\\\"", "\n", "\t\x01", "\x1f/"
+	};
+	rpc_object_t dict;
+	GString *str;
+	size_t len;
+	size_t i;
+
+	/*
+	 * Strings with quotes, backslash runs and control characters at
+	 * every offset around the 16 and 64-byte block boundaries.
+	 */
+	fixture->object = rpc_array_create();
+	for (len = 0; len < 200; len++) {
+		str = g_string_new(NULL);
+		for (i = 0; i < len; i++) {
+			if (i % 7 == len % 7)
+				g_string_append(str,
+				    special[(i + len) % G_N_ELEMENTS(special)]);
+			else if (i % 13 == 0)
+				g_string_append(str, "\xc3\xa9");
+			else
+				g_string_append_c(str, (char)('a' + i % 26));
+		}
+
+		dict = rpc_dictionary_create();
+		rpc_dictionary_set_string(dict, str->str, str->str);
+		rpc_array_append_stolen_value(fixture->object, dict);
+		rpc_array_append_stolen_value(fixture->object,
+		    rpc_string_create(str->str));
+		g_string_free(str, true);
+	}
+
+	fixture->type = user_data;
+}
+
+static void
+serializer_test_json_parse(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	static const char doc[] =
+	    " { \"a\" : [ 1 , -2 , 0.5 , -1e3 , true , false , null ] ,\n"
+	    "\t\"\\\\x\": \"\\u00e9\\ud83d\\ude00\\n\\/\","
+	    "\"max\": 9223372036854775807, \"\\\\$uint\": {},"
+	    "\"e\": [[], {}, [[\"\"]]]}\r\n";
+	rpc_object_t obj;
+	rpc_object_t array;
+
+	obj = rpc_serializer_load("json", doc, strlen(doc));
+	g_assert_nonnull(obj);
+
+	array = rpc_dictionary_get_value(obj, "a");
+	g_assert_cmpuint(rpc_array_get_count(array), ==, 7);
+	g_assert_cmpint(rpc_array_get_int64(array, 1), ==, -2);
+	g_assert_cmpfloat(rpc_array_get_double(array, 2), ==, 0.5);
+	g_assert_cmpfloat(rpc_array_get_double(array, 3), ==, -1000.0);
+	g_assert_true(rpc_array_get_bool(array, 4));
+	g_assert_false(rpc_array_get_bool(array, 5));
+	g_assert_cmpint(rpc_get_type(rpc_array_get_value(array, 6)), ==,
+	    RPC_TYPE_NULL);
+
+	g_assert_cmpstr(rpc_dictionary_get_string(obj, "x"), ==,
+	    "\xc3\xa9\xf0\x9f\x98\x80\n/");
+	g_assert_cmpint(rpc_dictionary_get_int64(obj, "max"), ==, G_MAXINT64);
+	g_assert_true(rpc_dictionary_has_key(obj, "$uint"));
+	g_assert_cmpuint(rpc_array_get_count(
+	    rpc_dictionary_get_value(obj, "e")), ==, 3);
+
+	rpc_release(obj);
+}
+
+static void
+serializer_test_json_errors(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	static const char *docs[] = {
+		"", " ", "{", "}", "[1,]", "{\"a\":1,}", "{\"a\" 1}",
+		"{1:2}", "[1 2]", "[1]]", "[1] 2", "\"abc", "\"a\tb\"",
+		"\"\\x\"", "\"\\u12\"", "01", "1.", "-", "1e", ".5",
+		"tru", "truex", "nul", "[+1]", "9223372036854775808",
+		"-9223372036854775809", "1e999", "\"\xc3\"", "\"\xff\"",
+		"[\"\\\"]", "[1}", "{\"a\":1]", NULL
+	};
+	rpc_object_t obj;
+	GString *deep;
+	int i;
+
+	for (i = 0; docs[i] != NULL; i++) {
+		obj = rpc_serializer_load("json", docs[i], strlen(docs[i]));
+		if (obj != NULL)
+			g_error("accepted invalid JSON: %s", docs[i]);
+	}
+
+	/* Deep nesting is fine, as long as it's balanced */
+	deep = g_string_new(NULL);
+	for (i = 0; i < 10000; i++)
+		g_string_append_c(deep, '[');
+
+	obj = rpc_serializer_load("json", deep->str, deep->len);
+	g_assert_null(obj);
+
+	for (i = 0; i < 10000; i++)
+		g_string_append_c(deep, ']');
+
+	obj = rpc_serializer_load("json", deep->str, deep->len);
+	g_assert_nonnull(obj);
+	rpc_release(obj);
+	g_string_free(deep, true);
+}
+
+static void
+serializer_test_packed(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	rpc_object_t mirror;
+	rpc_type_t type;
+	size_t count;
+	size_t buf_size;
+	void *buf = NULL;
+
+	g_assert(rpc_serializer_dump("msgpack", fixture->object, &buf,
+	    &buf_size) == 0);
+	mirror = rpc_serializer_load("msgpack", buf, buf_size);
+	g_assert_nonnull(rpc_array_get_packed(mirror, &type, &count));
+	g_assert_cmpint(type, ==, RPC_TYPE_DOUBLE);
+	g_assert_cmpuint(count, ==, 1000);
+	g_assert_cmpfloat(rpc_array_get_double(mirror, 500), ==, 250.0);
+
+	rpc_release(mirror);
+	g_free(buf);
+
+	serializer_test(fixture, user_data);
+}
+
+static void
+serializer_test_frozen(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	size_t size, cached_size;
+	void *buf = NULL;
+	void *cached_buf = NULL;
+
+	rpc_object_freeze(fixture->object);
+	g_assert(rpc_serializer_dump("msgpack", fixture->object, &buf,
+	    &size) == 0);
+
+	/* The second round comes out of the cache, if there's one */
+	g_assert(rpc_serializer_dump("msgpack", fixture->object, &cached_buf,
+	    &cached_size) == 0);
+	g_assert_cmpuint(cached_size, ==, size);
+	g_assert(memcmp(cached_buf, buf, size) == 0);
+
+	g_free(cached_buf);
+	g_free(buf);
+
+	serializer_test(fixture, user_data);
+}
+
+static void
+serializer_test_date_set_up(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+
+	fixture->object = rpc_object_pack("{D,[D,D]}",
+	    "date", (int64_t)g_test_rand_int_range(0, 0xffff),
+	    "dates",
+	    (int64_t)g_test_rand_int_range(0, 0xffff),
+	    (int64_t)g_test_rand_int_range(0, 0xffff));
+	fixture->type = user_data;
+}
+
+static void
+serializer_test_frozen_timestamps(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	struct rpc_output_buffer stamped = { 0 };
+	struct rpc_output_buffer legacy = { 0 };
+	struct rpc_output_buffer fresh = { 0 };
+	rpc_object_t copy;
+
+	copy = rpc_copy(fixture->object);
+	rpc_object_freeze(fixture->object);
+
+	/* A peer without timestamps mustn't get the cached timestamp bytes */
+	g_assert(rpc_msgpack_serialize_buffered(&stamped, fixture->object, 0,
+	    false, true, false, false, true, NULL, NULL) == 0);
+	g_assert(rpc_msgpack_serialize_buffered(&legacy, fixture->object, 0,
+	    false, true, false, false, false, NULL, NULL) == 0);
+	g_assert(rpc_msgpack_serialize_buffered(&fresh, copy, 0,
+	    false, true, false, false, false, NULL, NULL) == 0);
+	g_assert_cmpuint(legacy.rob_used, ==, fresh.rob_used);
+	g_assert(memcmp(legacy.rob_data, fresh.rob_data,
+	    fresh.rob_used) == 0);
+
+	rpc_output_buffer_free(&stamped);
+	rpc_output_buffer_free(&legacy);
+	rpc_output_buffer_free(&fresh);
+	rpc_release(copy);
+
+	serializer_test(fixture, user_data);
+}
+
+static void
+serializer_test_timestamps(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	struct rpc_output_buffer stamped = { 0 };
+	struct rpc_output_buffer legacy = { 0 };
+	rpc_object_t dates;
+	rpc_object_t mirror;
+	rpc_object_t date;
+	int64_t usecs[] = {
+		0,
+		(int64_t)1500000000 * G_USEC_PER_SEC,
+		(int64_t)1500000000 * G_USEC_PER_SEC + 123456,
+		-1500000,
+		(int64_t)20000000000 * G_USEC_PER_SEC + 7
+	};
+	size_t i;
+
+	dates = rpc_array_create();
+	for (i = 0; i < G_N_ELEMENTS(usecs); i++)
+		rpc_array_append_stolen_value(dates,
+		    rpc_date_create_usec(usecs[i], 0));
+
+	/* Timestamps keep the microseconds, the legacy form whole seconds */
+	g_assert(rpc_msgpack_serialize_buffered(&stamped, dates, 0,
+	    false, true, false, false, true, NULL, NULL) == 0);
+	g_assert(rpc_msgpack_serialize_buffered(&legacy, dates, 0,
+	    false, true, false, false, false, NULL, NULL) == 0);
+
+	mirror = rpc_msgpack_deserialize(stamped.rob_data, stamped.rob_used);
+	g_assert_nonnull(mirror);
+	g_assert_cmpuint(rpc_array_get_count(mirror), ==, G_N_ELEMENTS(usecs));
+	for (i = 0; i < G_N_ELEMENTS(usecs); i++) {
+		date = rpc_array_get_value(mirror, i);
+		g_assert_cmpint(rpc_get_type(date), ==, RPC_TYPE_DATE);
+		g_assert_cmpint(rpc_date_get_usec(date), ==, usecs[i]);
+	}
+
+	rpc_release(mirror);
+
+	mirror = rpc_msgpack_deserialize(legacy.rob_data, legacy.rob_used);
+	g_assert_nonnull(mirror);
+	for (i = 0; i < G_N_ELEMENTS(usecs); i++) {
+		date = rpc_array_get_value(mirror, i);
+		g_assert_cmpint(rpc_date_get_value(date), ==,
+		    rpc_date_get_value(rpc_array_get_value(dates, i)));
+	}
+
+	rpc_release(mirror);
+	rpc_release(dates);
+	rpc_output_buffer_free(&stamped);
+	rpc_output_buffer_free(&legacy);
+
+	serializer_test(fixture, user_data);
+}
+
+static void
+serializer_test_packed_set_up(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	double values[1000];
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		values[i] = i / 2.0;
+
+	fixture->object = rpc_array_create_packed(RPC_TYPE_DOUBLE, values,
+	    1000);
+	fixture->type = user_data;
+}
+
+static void
+serializer_test_columnar_set_up(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	int i;
+
+	fixture->object = rpc_array_create();
+	for (i = 0; i < 100; i++) {
+		rpc_array_append_stolen_value(fixture->object, rpc_object_pack(
+		    "{i,u,d,b,s,n,[i,s]}",
+		    "id", (int64_t)i,
+		    "uint", (uint64_t)i * 3,
+		    "ratio", i / 4.0,
+		    "even", i % 2 == 0,
+		    "name", "row",
+		    "none",
+		    "list", (int64_t)i, "item"));
+	}
+
+	fixture->type = user_data;
+}
+
+static void
+serializer_test_columnar(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	struct rpc_output_buffer columnar = { 0 };
+	struct rpc_output_buffer rows = { 0 };
+	struct rpc_output_buffer mixed = { 0 };
+	rpc_object_t mirror;
+	rpc_object_t row;
+
+	g_assert(rpc_msgpack_serialize_buffered(&columnar, fixture->object, 0,
+	    false, true, false, true, true, NULL, NULL) == 0);
+	g_assert(rpc_msgpack_serialize_buffered(&rows, fixture->object, 0,
+	    false, true, false, false, true, NULL, NULL) == 0);
+	g_assert_cmpuint(columnar.rob_used, <, rows.rob_used);
+
+	mirror = rpc_msgpack_deserialize(columnar.rob_data, columnar.rob_used);
+	g_assert_nonnull(mirror);
+	g_assert_true(rpc_equal(fixture->object, mirror));
+	row = rpc_array_get_value(mirror, 42);
+	g_assert_cmpint(rpc_get_type(rpc_dictionary_get_value(row, "uint")),
+	    ==, RPC_TYPE_UINT64);
+	g_assert_cmpuint(rpc_dictionary_get_uint64(row, "uint"), ==, 126);
+	g_assert_true(rpc_dictionary_get_bool(row, "even"));
+	rpc_release(mirror);
+
+	/* A row with a different set of keys keeps the array row-wise */
+	rpc_dictionary_set_bool(rpc_array_get_value(fixture->object, 50),
+	    "extra", true);
+	g_assert(rpc_msgpack_serialize_buffered(&mixed, fixture->object, 0,
+	    false, true, false, true, true, NULL, NULL) == 0);
+	g_assert_cmpuint(mixed.rob_used, >, rows.rob_used);
+
+	mirror = rpc_msgpack_deserialize(mixed.rob_data, mixed.rob_used);
+	g_assert_nonnull(mirror);
+	g_assert_true(rpc_equal(fixture->object, mirror));
+	rpc_release(mirror);
+
+	rpc_output_buffer_free(&columnar);
+	rpc_output_buffer_free(&rows);
+	rpc_output_buffer_free(&mixed);
+}
+
+static void
+serializer_test_struct_set_up(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	static const char idl[] =
+	    "meta:\n"
+	    "  version: 1\n"
+	    "  namespace: com.twoporeguys.librpc.test\n"
+	    "  description: Serializer test types\n"
+	    "\n"
+	    "struct Point:\n"
+	    "  members:\n"
+	    "    x:\n"
+	    "      type: int64\n"
+	    "    y:\n"
+	    "      type: int64\n"
+	    "    label:\n"
+	    "      type: string\n";
+	rpct_typei_t typei;
+	rpc_object_t body;
+	rpc_object_t point;
+
+	g_assert_cmpint(rpct_init(false), ==, 0);
+	typei = rpct_new_typei("com.twoporeguys.librpc.test.Point");
+	if (typei == NULL) {
+		body = rpc_serializer_load("yaml", idl, sizeof(idl) - 1);
+		g_assert_nonnull(body);
+		g_assert_cmpint(rpct_read_idl("serializer-test", body), ==, 0);
+		g_assert_cmpint(rpct_load_types("serializer-test"), ==, 0);
+		rpc_release(body);
+		typei = rpct_new_typei("com.twoporeguys.librpc.test.Point");
+	}
+
+	g_assert_nonnull(typei);
+	point = rpc_object_pack("{x:i,y:i,label:s}",
+	    (int64_t)g_test_rand_int(), (int64_t)-42, "origin");
+	fixture->object = rpct_newi(typei, point);
+	rpct_typei_release(typei);
+	rpc_release(point);
+	fixture->type = user_data;
+}
+
+static void
+serializer_test_positional(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	struct rpc_output_buffer positional = { 0 };
+	struct rpc_output_buffer keyed = { 0 };
+	struct rpc_output_buffer partial = { 0 };
+	rpc_object_t mirror;
+
+	g_assert(rpc_msgpack_serialize_buffered(&positional, fixture->object,
+	    0, false, true, true, false, true, NULL, NULL) == 0);
+	g_assert(rpc_msgpack_serialize_buffered(&keyed, fixture->object, 0,
+	    false, true, false, false, true, NULL, NULL) == 0);
+	g_assert_cmpuint(positional.rob_used, <, keyed.rob_used);
+
+	mirror = rpc_msgpack_deserialize_frame(positional.rob_data,
+	    positional.rob_used, NULL, false, false, NULL, NULL, NULL);
+	g_assert_nonnull(mirror);
+	g_assert_false(rpc_is_error(mirror));
+	g_assert_true(rpc_equal(fixture->object, mirror));
+	g_assert_nonnull(rpct_get_typei(mirror));
+	g_assert_cmpstr(rpct_typei_get_canonical_form(rpct_get_typei(mirror)),
+	    ==, "com.twoporeguys.librpc.test.Point");
+	g_assert_cmpint(rpc_dictionary_get_int64(mirror, "y"), ==, -42);
+	rpc_release(mirror);
+
+	/* Instances missing a member go out keyed */
+	rpc_dictionary_remove_key(fixture->object, "label");
+	g_assert(rpc_msgpack_serialize_buffered(&partial, fixture->object, 0,
+	    false, true, true, false, true, NULL, NULL) == 0);
+	mirror = rpc_msgpack_deserialize_frame(partial.rob_data,
+	    partial.rob_used, NULL, false, false, NULL, NULL, NULL);
+	g_assert_nonnull(mirror);
+	g_assert_true(rpc_equal(fixture->object, mirror));
+	g_assert_false(rpc_dictionary_has_key(mirror, "label"));
+	rpc_release(mirror);
+
+	rpc_output_buffer_free(&positional);
+	rpc_output_buffer_free(&keyed);
+	rpc_output_buffer_free(&partial);
+}
+
+static void
+serializer_test_type_table(struct serializer_fixture *fixture,
+    gconstpointer user_data)
+{
+	struct rpc_msgpack_types *sender;
+	struct rpc_msgpack_types *receiver;
+	struct rpc_msgpack_types *stranger;
+	struct rpc_output_buffer first = { 0 };
+	struct rpc_output_buffer second = { 0 };
+	struct rpc_output_buffer plain = { 0 };
+	rpc_object_t mirror;
+
+	sender = rpc_msgpack_types_new();
+	receiver = rpc_msgpack_types_new();
+	stranger = rpc_msgpack_types_new();
+
+	/* The type name goes out in full once, then as an id */
+	g_assert(rpc_msgpack_serialize_buffered(&first, fixture->object, 0,
+	    false, true, false, false, true, sender, NULL) == 0);
+	g_assert(rpc_msgpack_serialize_buffered(&second, fixture->object, 0,
+	    false, true, false, false, true, sender, NULL) == 0);
+	g_assert(rpc_msgpack_serialize_buffered(&plain, fixture->object, 0,
+	    false, true, false, false, true, NULL, NULL) == 0);
+	g_assert_cmpuint(first.rob_used, >=, plain.rob_used);
+	g_assert_cmpuint(second.rob_used, <, plain.rob_used);
+
+	mirror = rpc_msgpack_deserialize_frame(first.rob_data, first.rob_used,
+	    NULL, false, false, receiver, NULL, NULL);
+	g_assert_nonnull(mirror);
+	g_assert_true(rpc_equal(fixture->object, mirror));
+	rpc_release(mirror);
+
+	mirror = rpc_msgpack_deserialize_frame(second.rob_data,
+	    second.rob_used, NULL, false, false, receiver, NULL, NULL);
+	g_assert_nonnull(mirror);
+	g_assert_false(rpc_is_error(mirror));
+	g_assert_true(rpc_equal(fixture->object, mirror));
+	g_assert_cmpstr(rpct_typei_get_canonical_form(rpct_get_typei(mirror)),
+	    ==, "com.twoporeguys.librpc.test.Point");
+	rpc_release(mirror);
+
+	/* An id means nothing to a table that hasn't seen its definition */
+	mirror = rpc_msgpack_deserialize_frame(second.rob_data,
+	    second.rob_used, NULL, false, false, stranger, NULL, NULL);
+	g_assert_nonnull(mirror);
+	g_assert_true(rpc_is_error(mirror));
+	g_assert_cmpint(rpc_error_get_code(mirror), ==, ENOENT);
+	rpc_release(mirror);
+
+	rpc_output_buffer_free(&first);
+	rpc_output_buffer_free(&second);
+	rpc_output_buffer_free(&plain);
+	rpc_msgpack_types_free(sender);
+	rpc_msgpack_types_free(receiver);
+	rpc_msgpack_types_free(stranger);
+}
+
 #if defined(__linux__)
 static void
 serializer_test_shmem_set_up(struct serializer_fixture *fixture,
@@ -153,16 +701,60 @@ serializer_test_register()
 	g_test_add("/serializer/json/single", struct serializer_fixture,
 	    "json", serializer_test_single_set_up, serializer_test,
 	    serializer_test_tear_down);
+	g_test_add("/serializer/json/escaped-keys", struct serializer_fixture,
+	    "json", serializer_test_escaped_keys_set_up, serializer_test,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/json/fd", struct serializer_fixture,
+	    "json", serializer_test_dict_set_up, serializer_test_fd,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/json/strings", struct serializer_fixture,
+	    "json", serializer_test_json_strings_set_up, serializer_test,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/json/parse", struct serializer_fixture,
+	    "json", NULL, serializer_test_json_parse, NULL);
+	g_test_add("/serializer/json/errors", struct serializer_fixture,
+	    "json", NULL, serializer_test_json_errors, NULL);
 
 	g_test_add("/serializer/msgpack/dict", struct serializer_fixture,
 	    "msgpack", serializer_test_dict_set_up, serializer_test,
 	    serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/large-dict", struct serializer_fixture,
+	    "msgpack", serializer_test_large_dict_set_up, serializer_test,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/packed-array",
+	    struct serializer_fixture, "msgpack",
+	    serializer_test_packed_set_up, serializer_test_packed,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/frozen", struct serializer_fixture,
+	    "msgpack", serializer_test_large_dict_set_up,
+	    serializer_test_frozen, serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/frozen-fds", struct serializer_fixture,
+	    "msgpack", serializer_test_dict_set_up, serializer_test_frozen,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/frozen-timestamps",
+	    struct serializer_fixture, "msgpack", serializer_test_date_set_up,
+	    serializer_test_frozen_timestamps, serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/columnar", struct serializer_fixture,
+	    "msgpack", serializer_test_columnar_set_up,
+	    serializer_test_columnar, serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/timestamps",
+	    struct serializer_fixture, "msgpack", serializer_test_date_set_up,
+	    serializer_test_timestamps, serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/positional", struct serializer_fixture,
+	    "msgpack", serializer_test_struct_set_up,
+	    serializer_test_positional, serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/type-table", struct serializer_fixture,
+	    "msgpack", serializer_test_struct_set_up,
+	    serializer_test_type_table, serializer_test_tear_down);
 	g_test_add("/serializer/msgpack/array", struct serializer_fixture,
 	    "msgpack", serializer_test_array_set_up, serializer_test,
 	    serializer_test_tear_down);
 	g_test_add("/serializer/msgpack/single", struct serializer_fixture,
 	    "msgpack", serializer_test_single_set_up, serializer_test,
 	    serializer_test_tear_down);
+	g_test_add("/serializer/msgpack/fd", struct serializer_fixture,
+	    "msgpack", serializer_test_dict_set_up, serializer_test_fd,
+	    serializer_test_tear_down);
 
 	g_test_add("/serializer/yaml/dict", struct serializer_fixture,
 	    "yaml", serializer_test_dict_set_up, serializer_test,
@@ -173,6 +765,9 @@ serializer_test_register()
 	g_test_add("/serializer/yaml/single", struct serializer_fixture,
 	    "yaml", serializer_test_single_set_up, serializer_test,
 	    serializer_test_tear_down);
+	g_test_add("/serializer/yaml/fd", struct serializer_fixture,
+	    "yaml", serializer_test_dict_set_up, serializer_test_fd,
+	    serializer_test_tear_down);
 
 #if defined(__linux__)
 	g_test_add("/serializer/json/shmem", struct serializer_fixture,
@@ -27,35 +27,137 @@
 
 #include "../tests.h"
 #include "../../src/linker_set.h"
+#include "../../src/internal.h"
 #include <glib.h>
+#include <rpc/object.h>
+#include <rpc/service.h>
 
+#define	SERVICE_READERS		4
+#define	SERVICE_ROUNDS		2000
 
 typedef struct {
-
+	rpc_context_t		ctx;
+	rpc_instance_t		stable;
+	volatile int		done;
+	volatile int		failed;
 } service_fixture;
 
+static rpc_object_t
+service_noop(void *cookie __unused, rpc_object_t args __unused)
+{
+
+	return (rpc_null_create());
+}
+
 static void
 service_test(service_fixture *fixture, gconstpointer user_data)
 {
 
 }
 
+/*
+ * Looks up a registered instance and its method over and over, while
+ * the writer adds and removes other instances and members.
+ */
+static gpointer
+service_lookup_reader(gpointer data)
+{
+	service_fixture *fixture = data;
+	rpc_instance_t instance;
+	char *path;
+	guint i = 0;
+
+	while (!g_atomic_int_get(&fixture->done)) {
+		instance = rpc_instance_find_and_retain(fixture->ctx,
+		    "/stable");
+		if (instance == NULL ||
+		    rpc_instance_find_member(instance, NULL, "method") == NULL ||
+		    !rpc_instance_has_interface(instance,
+		    RPC_DEFAULT_INTERFACE))
+			g_atomic_int_inc(&fixture->failed);
+
+		rpc_instance_release(instance);
+
+		/* Churned instances may or may not be there */
+		path = g_strdup_printf("/churn/%u", i++ % 16);
+		instance = rpc_instance_find_and_retain(fixture->ctx, path);
+		if (instance != NULL) {
+			rpc_instance_find_member(instance, NULL, "method");
+			rpc_instance_release(instance);
+		}
+
+		g_free(path);
+	}
+
+	return (NULL);
+}
+
+static void
+service_lookup_test(service_fixture *fixture, gconstpointer user_data)
+{
+	GThread *readers[SERVICE_READERS];
+	rpc_instance_t instance;
+	char *name;
+	int i;
+
+	for (i = 0; i < SERVICE_READERS; i++) {
+		readers[i] = g_thread_new("reader", service_lookup_reader,
+		    fixture);
+	}
+
+	for (i = 0; i < SERVICE_ROUNDS; i++) {
+		instance = rpc_instance_new(NULL, "/churn/%d", i % 16);
+		g_assert_nonnull(instance);
+		g_assert_cmpint(rpc_instance_register_func(instance, NULL,
+		    "method", NULL, service_noop), ==, 0);
+
+		g_assert_cmpint(rpc_context_register_instance(fixture->ctx,
+		    instance), ==, 0);
+
+		name = g_strdup_printf("extra%d", i);
+		g_assert_cmpint(rpc_instance_register_func(fixture->stable,
+		    NULL, name, NULL, service_noop), ==, 0);
+		g_assert_cmpint(rpc_instance_unregister_member(
+		    fixture->stable, NULL, name), ==, 0);
+		g_free(name);
+
+		rpc_context_unregister_instance(fixture->ctx,
+		    rpc_instance_get_path(instance));
+		rpc_instance_free(instance);
+	}
+
+	g_atomic_int_set(&fixture->done, 1);
+	for (i = 0; i < SERVICE_READERS; i++)
+		g_thread_join(readers[i]);
+
+	g_assert_cmpint(g_atomic_int_get(&fixture->failed), ==, 0);
+}
+
 static void
 service_test_single_set_up(service_fixture *fixture, gconstpointer user_data)
 {
 
+	fixture->ctx = rpc_context_create();
+	fixture->stable = rpc_instance_new(NULL, "/stable");
+	rpc_instance_register_func(fixture->stable, NULL, "method", NULL,
+	    service_noop);
+	rpc_context_register_instance(fixture->ctx, fixture->stable);
 }
 
 static void
 service_test_tear_down(service_fixture *fixture, gconstpointer user_data)
 {
 
+	rpc_context_free(fixture->ctx);
 }
 
 static void
 service_test_register()
 {
 
+	g_test_add("/service/lookup/concurrent", service_fixture, NULL,
+	    service_test_single_set_up, service_lookup_test,
+	    service_test_tear_down);
 }
 
 static struct librpc_test service = {
@@ -63,4 +165,4 @@ static struct librpc_test service = {
     .register_f = &service_test_register
 };
 
-DECLARE_TEST(service);
\ No newline at end of file
+DECLARE_TEST(service);
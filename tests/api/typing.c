@@ -28,34 +28,144 @@
 #include "../tests.h"
 #include "../../src/linker_set.h"
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <rpc/object.h>
+#include <rpc/typing.h>
 
+#define	TYPING_READERS		4
+#define	TYPING_FILES		64
 
 typedef struct {
-
+	char *			dir;
+	volatile int		loaded;
+	volatile int		done;
+	volatile int		failed;
 } typing_fixture;
 
+static int
+typing_write_idl(typing_fixture *fixture, const char *ns, const char *name)
+{
+	char *contents;
+	char *path;
+	int ret;
+
+	contents = g_strdup_printf(
+	    "---\n"
+	    "meta:\n"
+	    "  version: 1\n"
+	    "  namespace: %s\n"
+	    "  description: Test types\n"
+	    "\n"
+	    "type %s:\n"
+	    "  description: Test type\n"
+	    "  type: int64\n", ns, name);
+
+	path = g_strdup_printf("%s/%s.yaml", fixture->dir, ns);
+	ret = g_file_set_contents(path, contents, -1, NULL) ? 0 : -1;
+	if (ret == 0)
+		ret = rpct_load_types(path);
+
+	g_unlink(path);
+	g_free(contents);
+	g_free(path);
+	return (ret);
+}
+
 static void
 typing_test(typing_fixture *fixture, gconstpointer user_data)
 {
 
 }
 
+/*
+ * Looks types up while another thread loads more of them. A type that
+ * was loaded before the lookup started has to be there.
+ */
+static gpointer
+typing_lookup_reader(gpointer data)
+{
+	typing_fixture *fixture = data;
+	rpct_typei_t typei;
+	char *name;
+	guint seed = GPOINTER_TO_UINT(g_thread_self());
+	int loaded;
+
+	while (!g_atomic_int_get(&fixture->done)) {
+		typei = rpct_new_typei("test.base.Base");
+		if (typei == NULL)
+			g_atomic_int_inc(&fixture->failed);
+		else
+			rpct_typei_release(typei);
+
+		loaded = g_atomic_int_get(&fixture->loaded);
+		if (loaded == 0)
+			continue;
+
+		seed = seed * 1103515245 + 12345;
+		name = g_strdup_printf("test.snap%u.Type",
+		    (seed >> 16) % (guint)loaded);
+		if (rpct_get_type(name) == NULL)
+			g_atomic_int_inc(&fixture->failed);
+
+		g_free(name);
+	}
+
+	return (NULL);
+}
+
+static void
+typing_load_test(typing_fixture *fixture, gconstpointer user_data)
+{
+	GThread *readers[TYPING_READERS];
+	char *ns;
+	int i;
+
+	g_assert_cmpint(typing_write_idl(fixture, "test.base", "Base"), ==, 0);
+	g_assert_nonnull(rpct_get_type("test.base.Base"));
+
+	for (i = 0; i < TYPING_READERS; i++) {
+		readers[i] = g_thread_new("reader", typing_lookup_reader,
+		    fixture);
+	}
+
+	for (i = 0; i < TYPING_FILES; i++) {
+		ns = g_strdup_printf("test.snap%d", i);
+		g_assert_cmpint(typing_write_idl(fixture, ns, "Type"), ==, 0);
+		g_atomic_int_set(&fixture->loaded, i + 1);
+		g_free(ns);
+	}
+
+	g_atomic_int_set(&fixture->done, 1);
+	for (i = 0; i < TYPING_READERS; i++)
+		g_thread_join(readers[i]);
+
+	g_assert_cmpint(g_atomic_int_get(&fixture->failed), ==, 0);
+}
+
 static void
 typing_test_single_set_up(typing_fixture *fixture, gconstpointer user_data)
 {
 
+	g_assert_cmpint(rpct_init(false), ==, 0);
+	fixture->dir = g_dir_make_tmp("librpc-typing-XXXXXX", NULL);
+	g_assert_nonnull(fixture->dir);
 }
 
 static void
 typing_test_tear_down(typing_fixture *fixture, gconstpointer user_data)
 {
 
+	g_rmdir(fixture->dir);
+	g_free(fixture->dir);
 }
 
 static void
 typing_test_register()
 {
 
+	g_test_add("/typing/load/concurrent", typing_fixture, NULL,
+	    typing_test_single_set_up, typing_load_test,
+	    typing_test_tear_down);
 }
 
 static struct librpc_test typing = {
@@ -63,4 +173,4 @@ static struct librpc_test typing = {
     .register_f = &typing_test_register
 };
 
-DECLARE_TEST(typing);
\ No newline at end of file
+DECLARE_TEST(typing);
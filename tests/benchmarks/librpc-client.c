@@ -29,63 +29,652 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <getopt.h>
 #include <time.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <rpc/object.h>
 #include <rpc/client.h>
+#include <rpc/server.h>
 
-static void timespec_diff(struct timespec *, struct timespec *,
-    struct timespec *);
+#define	BENCH_INTERFACE		"com.twoporeguys.librpc.Benchmark"
+#define	MAX_SIZES		64
+
+/*
+ * Latencies go into a log-linear histogram in the style of HdrHistogram:
+ * values below 2048 ns are counted exactly, larger ones in buckets
+ * spanning a power of two each, split into 1024 linear sub-buckets.
+ * That keeps three significant digits over the whole range at a fixed
+ * cost per sample, so tail percentiles stay exact to within 0.1%.
+ */
+#define	HIST_SUB_BITS		11
+#define	HIST_HALF		(1 << (HIST_SUB_BITS - 1))
+#define	HIST_MAX_SHIFT		34
+#define	HIST_LEN		((HIST_MAX_SHIFT + 2) * HIST_HALF)
+
+typedef enum {
+	WORKLOAD_STREAM,
+	WORKLOAD_CALL,
+	WORKLOAD_EVENT
+} workload_t;
+
+struct histogram
+{
+	uint64_t		h_counts[HIST_LEN];
+	uint64_t		h_total;
+	uint64_t		h_sum;
+	uint64_t		h_min;
+	uint64_t		h_max;
+};
+
+struct worker
+{
+	pthread_t		w_thread;
+	rpc_client_t *		w_clients;
+	struct histogram *	w_hist;
+	rpc_object_t		w_payload;
+	size_t			w_size;
+	uint64_t		w_ops;
+	uint64_t		w_bytes;
+	uint64_t		w_errors;
+	uint64_t		w_outstanding;
+	pthread_mutex_t		w_mtx;
+	pthread_cond_t		w_cv;
+};
+
+struct result
+{
+	size_t			r_size;
+	uint64_t		r_ops;
+	uint64_t		r_bytes;
+	uint64_t		r_errors;
+	double			r_elapsed;
+	struct histogram *	r_hist;
+};
+
+static uint64_t now_ns(void);
+static size_t hist_index(uint64_t);
+static uint64_t hist_value(size_t);
+static struct histogram *hist_create(void);
+static void hist_record(struct histogram *, uint64_t);
+static void hist_merge(struct histogram *, struct histogram *);
+static uint64_t hist_percentile(struct histogram *, double);
+static void worker_begin(struct worker *, uint64_t);
+static void worker_complete(struct worker *, uint64_t, uint64_t, bool);
+static void worker_drain(struct worker *);
+static void issue_call(struct worker *, rpc_connection_t, uint64_t);
+static void run_stream(struct worker *);
+static void run_call_closed(struct worker *);
+static void run_call_open(struct worker *);
+static void run_event(struct worker *);
+static void *worker_main(void *);
+static int run(size_t, struct result *);
+static void print_result(struct result *, bool);
+static void print_json(struct result *, size_t);
+rpc_server_t benchmark_server_start(const char *);
 void usage(const char *);
 int main(int, char * const[]);
 
+static const char *workload_names[] = {
+	[WORKLOAD_STREAM] = "stream",
+	[WORKLOAD_CALL] = "call",
+	[WORKLOAD_EVENT] = "event"
+};
+
+static workload_t workload = WORKLOAD_STREAM;
+static char *uri = NULL;
+static int nthreads = 1;
+static int nconns = 1;
+static int64_t ncycles = 1000;
+static double rate = 0;
+static double duration = 5;
+static bool shmem = false;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+static size_t
+hist_index(uint64_t value)
+{
+	int shift;
+
+	if (value < (1 << HIST_SUB_BITS))
+		return ((size_t)value);
+
+	shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+	if (shift > HIST_MAX_SHIFT)
+		return (HIST_LEN - 1);
+
+	return ((size_t)shift * HIST_HALF + (size_t)(value >> shift));
+}
+
+/* Highest value that falls into a given slot */
+static uint64_t
+hist_value(size_t index)
+{
+	size_t shift;
+
+	if (index < (1 << HIST_SUB_BITS))
+		return (index);
+
+	shift = index / HIST_HALF - 1;
+	return (((uint64_t)(index - shift * HIST_HALF + 1) << shift) - 1);
+}
+
+static struct histogram *
+hist_create(void)
+{
+	struct histogram *hist;
+
+	hist = calloc(1, sizeof(*hist));
+	hist->h_min = UINT64_MAX;
+	return (hist);
+}
+
+/* Samples may come from library callback threads, hence the atomics */
+static void
+hist_record(struct histogram *hist, uint64_t value)
+{
+	uint64_t cur;
+
+	__atomic_add_fetch(&hist->h_counts[hist_index(value)], 1,
+	    __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->h_total, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->h_sum, value, __ATOMIC_RELAXED);
+
+	cur = __atomic_load_n(&hist->h_max, __ATOMIC_RELAXED);
+	while (value > cur && !__atomic_compare_exchange_n(&hist->h_max,
+	    &cur, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	cur = __atomic_load_n(&hist->h_min, __ATOMIC_RELAXED);
+	while (value < cur && !__atomic_compare_exchange_n(&hist->h_min,
+	    &cur, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void
+hist_merge(struct histogram *dst, struct histogram *src)
+{
+	size_t i;
+
+	for (i = 0; i < HIST_LEN; i++)
+		dst->h_counts[i] += src->h_counts[i];
+
+	dst->h_total += src->h_total;
+	dst->h_sum += src->h_sum;
+	dst->h_min = src->h_min < dst->h_min ? src->h_min : dst->h_min;
+	dst->h_max = src->h_max > dst->h_max ? src->h_max : dst->h_max;
+}
+
+static uint64_t
+hist_percentile(struct histogram *hist, double pct)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	uint64_t value;
+	size_t i;
+
+	if (hist->h_total == 0)
+		return (0);
+
+	target = (uint64_t)(pct / 100 * hist->h_total + 0.5);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < HIST_LEN; i++) {
+		seen += hist->h_counts[i];
+		if (seen >= target) {
+			value = hist_value(i);
+			return (value < hist->h_max ? value : hist->h_max);
+		}
+	}
+
+	return (hist->h_max);
+}
+
+static void
+worker_begin(struct worker *w, uint64_t count)
+{
+
+	pthread_mutex_lock(&w->w_mtx);
+	w->w_outstanding += count;
+	pthread_mutex_unlock(&w->w_mtx);
+}
+
+static void
+worker_complete(struct worker *w, uint64_t latency, uint64_t bytes, bool ok)
+{
+
+	if (ok) {
+		hist_record(w->w_hist, latency);
+		__atomic_add_fetch(&w->w_ops, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&w->w_bytes, bytes, __ATOMIC_RELAXED);
+	} else
+		__atomic_add_fetch(&w->w_errors, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&w->w_mtx);
+	if (--w->w_outstanding == 0)
+		pthread_cond_broadcast(&w->w_cv);
+	pthread_mutex_unlock(&w->w_mtx);
+}
+
+static void
+worker_drain(struct worker *w)
+{
+
+	pthread_mutex_lock(&w->w_mtx);
+	while (w->w_outstanding > 0)
+		pthread_cond_wait(&w->w_cv, &w->w_mtx);
+	pthread_mutex_unlock(&w->w_mtx);
+}
+
+/*
+ * Latency is taken from @p start, which is when the call was supposed
+ * to go out rather than when it did. In the open loop mode, that charges
+ * a stalled server for the requests it held back, instead of quietly
+ * leaving them out (coordinated omission).
+ */
 static void
-timespec_diff(struct timespec *start, struct timespec *stop,
-    struct timespec *result)
+issue_call(struct worker *w, rpc_connection_t conn, uint64_t start)
 {
-	if ((stop->tv_nsec - start->tv_nsec) < 0) {
-		result->tv_sec = stop->tv_sec - start->tv_sec - 1;
-		result->tv_nsec = stop->tv_nsec - start->tv_nsec + 1000000000;
-	} else {
-		result->tv_sec = stop->tv_sec - start->tv_sec;
-		result->tv_nsec = stop->tv_nsec - start->tv_nsec;
+	rpc_object_t args;
+	rpc_call_t call;
+	uint64_t bytes = w->w_size * 2;
+
+	worker_begin(w, 1);
+	args = rpc_object_pack("[V]", w->w_payload);
+	call = rpc_connection_call(conn, "/", BENCH_INTERFACE, "echo", args,
+	    ^bool(rpc_call_t c) {
+		switch (rpc_call_status(c)) {
+		case RPC_CALL_DONE:
+			worker_complete(w, now_ns() - start, bytes, true);
+			break;
+
+		case RPC_CALL_ERROR:
+		case RPC_CALL_ABORTED:
+			worker_complete(w, 0, 0, false);
+			break;
+
+		default:
+			return (true);
+		}
+
+		rpc_call_free(c);
+		return (false);
+	});
+
+	rpc_release(args);
+	if (call == NULL)
+		worker_complete(w, 0, 0, false);
+}
+
+/*
+ * Streams on all connections of a worker at once. Latency is the time
+ * between consecutive fragments of a stream.
+ */
+static void
+run_stream(struct worker *w)
+{
+	rpc_connection_t conn;
+	rpc_call_t calls[nconns];
+	uint64_t last[nconns];
+	rpc_object_t item;
+	uint64_t now;
+	int active = 0;
+	int i;
+
+	for (i = 0; i < nconns; i++) {
+		conn = rpc_client_get_connection(w->w_clients[i]);
+		calls[i] = rpc_connection_call(conn, "/", BENCH_INTERFACE,
+		    "stream", rpc_object_pack("[i,i]", ncycles,
+		    (int64_t)w->w_size), NULL);
+		if (calls[i] == NULL) {
+			w->w_errors++;
+			continue;
+		}
+
+		rpc_call_set_prefetch(calls[i], 128);
+		last[i] = now_ns();
+		active++;
+	}
+
+	while (active > 0) {
+		for (i = 0; i < nconns; i++) {
+			if (calls[i] == NULL)
+				continue;
+
+			rpc_call_wait(calls[i]);
+			switch (rpc_call_status(calls[i])) {
+			case RPC_CALL_STREAM_START:
+				rpc_call_continue(calls[i], false);
+				continue;
+
+			case RPC_CALL_MORE_AVAILABLE:
+				item = rpc_call_result(calls[i]);
+				if (shmem && rpc_get_type(item) == RPC_TYPE_SHMEM)
+					w->w_bytes += rpc_shmem_get_size(item);
+				else if (!shmem &&
+				    rpc_get_type(item) == RPC_TYPE_BINARY)
+					w->w_bytes += rpc_data_get_length(item);
+				else
+					w->w_errors++;
+
+				now = now_ns();
+				hist_record(w->w_hist, now - last[i]);
+				w->w_ops++;
+				last[i] = now;
+				rpc_call_continue(calls[i], false);
+				continue;
+
+			case RPC_CALL_ERROR:
+				w->w_errors++;
+				break;
+
+			default:
+				break;
+			}
+
+			rpc_call_free(calls[i]);
+			calls[i] = NULL;
+			active--;
+		}
 	}
 }
 
+/* Keeps one call in flight on every connection of a worker */
+static void
+run_call_closed(struct worker *w)
+{
+	int64_t cycle;
+	int i;
+
+	for (cycle = 0; cycle < ncycles; cycle++) {
+		for (i = 0; i < nconns; i++) {
+			issue_call(w, rpc_client_get_connection(w->w_clients[i]),
+			    now_ns());
+		}
+
+		worker_drain(w);
+	}
+}
+
+/*
+ * Sends calls on a fixed schedule, round robin over connections,
+ * no matter how many are still waiting for a response.
+ */
+static void
+run_call_open(struct worker *w)
+{
+	struct timespec ts;
+	uint64_t interval = (uint64_t)(1E9 * nthreads / rate);
+	uint64_t start = now_ns();
+	uint64_t end = start + (uint64_t)(duration * 1E9);
+	uint64_t next;
+	uint64_t n;
+
+	for (n = 0;; n++) {
+		next = start + n * interval;
+		if (next >= end)
+			break;
+
+		ts.tv_sec = (time_t)(next / 1000000000);
+		ts.tv_nsec = (long)(next % 1000000000);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+		    NULL) == EINTR);
+
+		issue_call(w, rpc_client_get_connection(
+		    w->w_clients[n % (uint64_t)nconns]), next);
+	}
+
+	worker_drain(w);
+}
+
+/* Event handlers are set up in run() */
+static void
+run_event(struct worker *w)
+{
+	rpc_connection_t conn;
+	rpc_call_t call;
+	int i;
+
+	for (i = 0; i < nconns; i++) {
+		conn = rpc_client_get_connection(w->w_clients[i]);
+		worker_begin(w, (uint64_t)ncycles);
+		call = rpc_connection_call(conn, "/", BENCH_INTERFACE,
+		    "events", rpc_object_pack("[i,i]", ncycles,
+		    (int64_t)w->w_size), NULL);
+		if (call == NULL) {
+			fprintf(stderr, "Cannot request events: %s\n",
+			    rpc_error_get_message(rpc_get_last_error()));
+			exit(EXIT_FAILURE);
+		}
+
+		rpc_call_wait(call);
+		if (rpc_call_status(call) == RPC_CALL_ERROR) {
+			fprintf(stderr, "Cannot request events: %s\n",
+			    rpc_error_get_message(rpc_call_result(call)));
+			exit(EXIT_FAILURE);
+		}
+
+		rpc_call_free(call);
+	}
+
+	worker_drain(w);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	switch (workload) {
+	case WORKLOAD_STREAM:
+		run_stream(w);
+		break;
+
+	case WORKLOAD_CALL:
+		if (rate > 0)
+			run_call_open(w);
+		else
+			run_call_closed(w);
+		break;
+
+	case WORKLOAD_EVENT:
+		run_event(w);
+		break;
+	}
+
+	return (NULL);
+}
+
+static int
+run(size_t size, struct result *result)
+{
+	struct worker workers[nthreads];
+	struct worker *w;
+	rpc_connection_t conn;
+	rpc_object_t error;
+	void *buffer;
+	uint64_t start;
+	int i;
+	int j;
+
+	buffer = malloc(size);
+	memset(buffer, 0x55, size);
+
+	memset(result, 0, sizeof(*result));
+	result->r_size = size;
+	result->r_hist = hist_create();
+
+	for (i = 0; i < nthreads; i++) {
+		w = &workers[i];
+		memset(w, 0, sizeof(*w));
+		w->w_size = size;
+		w->w_hist = hist_create();
+		w->w_payload = rpc_data_create(buffer, size, NULL);
+		w->w_clients = calloc((size_t)nconns, sizeof(rpc_client_t));
+		pthread_mutex_init(&w->w_mtx, NULL);
+		pthread_cond_init(&w->w_cv, NULL);
+
+		for (j = 0; j < nconns; j++) {
+			w->w_clients[j] = rpc_client_create(uri, NULL);
+			if (w->w_clients[j] == NULL) {
+				error = rpc_get_last_error();
+				fprintf(stderr, "Cannot connect: %s\n",
+				    rpc_error_get_message(error));
+				return (-1);
+			}
+
+			if (workload != WORKLOAD_EVENT)
+				continue;
+
+			conn = rpc_client_get_connection(w->w_clients[j]);
+			rpc_connection_register_event_handler(conn, "/",
+			    BENCH_INTERFACE, "tick", ^(const char *path,
+			    const char *interface, const char *name,
+			    rpc_object_t args) {
+				uint64_t sent;
+				rpc_object_t data;
+
+				if (rpc_object_unpack(args, "[u,v]", &sent,
+				    &data) < 2) {
+					worker_complete(w, 0, 0, false);
+					return;
+				}
+
+				worker_complete(w, now_ns() - sent,
+				    rpc_get_type(data) == RPC_TYPE_BINARY ?
+				    rpc_data_get_length(data) : 0, true);
+			});
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].w_thread, NULL, worker_main,
+		    &workers[i]);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].w_thread, NULL);
+
+	result->r_elapsed = (now_ns() - start) / 1E9;
+
+	for (i = 0; i < nthreads; i++) {
+		w = &workers[i];
+		for (j = 0; j < nconns; j++)
+			rpc_client_close(w->w_clients[j]);
+
+		hist_merge(result->r_hist, w->w_hist);
+		result->r_ops += w->w_ops;
+		result->r_bytes += w->w_bytes;
+		result->r_errors += w->w_errors;
+		rpc_release(w->w_payload);
+		pthread_mutex_destroy(&w->w_mtx);
+		pthread_cond_destroy(&w->w_cv);
+		free(w->w_clients);
+		free(w->w_hist);
+	}
+
+	free(buffer);
+	return (0);
+}
+
+static void
+print_result(struct result *r, bool quiet)
+{
+	struct histogram *h = r->r_hist;
+	double mean = h->h_total > 0 ? (double)h->h_sum / h->h_total : 0;
+
+	if (quiet) {
+		printf("size=%zu msgs=%" PRIu64 " bytes=%" PRIu64 " bps=%f "
+		    "pps=%f lat=%f p50=%f p99=%f p999=%f max=%f\n", r->r_size,
+		    r->r_ops, r->r_bytes, r->r_bytes / r->r_elapsed,
+		    r->r_ops / r->r_elapsed, mean / 1E9,
+		    hist_percentile(h, 50) / 1E9, hist_percentile(h, 99) / 1E9,
+		    hist_percentile(h, 99.9) / 1E9, h->h_max / 1E9);
+		return;
+	}
+
+	printf("Message size %zu bytes, %s workload, %d x %d connections\n",
+	    r->r_size, workload_names[workload], nthreads, nconns);
+	printf("Completed %" PRIu64 " operations and %" PRIu64 " bytes, "
+	    "%" PRIu64 " errors\n", r->r_ops, r->r_bytes, r->r_errors);
+	printf("It took %.04f seconds\n", r->r_elapsed);
+	printf("Average data rate: %.04f MB/s\n",
+	    r->r_bytes / r->r_elapsed / 1024 / 1024);
+	printf("Average operation rate: %.04f ops/s\n",
+	    r->r_ops / r->r_elapsed);
+	printf("Latency: mean %.03fus, p50 %.03fus, p99 %.03fus, "
+	    "p99.9 %.03fus, max %.03fus\n", mean / 1E3,
+	    hist_percentile(h, 50) / 1E3, hist_percentile(h, 99) / 1E3,
+	    hist_percentile(h, 99.9) / 1E3, h->h_max / 1E3);
+}
+
+static void
+print_json(struct result *results, size_t count)
+{
+	struct result *r;
+	struct histogram *h;
+	size_t i;
+
+	printf("[\n");
+	for (i = 0; i < count; i++) {
+		r = &results[i];
+		h = r->r_hist;
+		printf("  {\"workload\": \"%s\", \"uri\": \"%s\", "
+		    "\"threads\": %d, \"connections\": %d, \"size\": %zu, "
+		    "\"rate\": %f, \"ops\": %" PRIu64 ", \"bytes\": %" PRIu64 ", "
+		    "\"errors\": %" PRIu64 ", \"elapsed\": %f, "
+		    "\"ops_per_sec\": %f, \"bytes_per_sec\": %f, "
+		    "\"latency_ns\": {\"count\": %" PRIu64 ", "
+		    "\"min\": %" PRIu64 ", \"mean\": %f, \"p50\": %" PRIu64 ", "
+		    "\"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", "
+		    "\"p99_9\": %" PRIu64 ", \"max\": %" PRIu64 "}}%s\n",
+		    workload_names[workload], uri, nthreads, nconns, r->r_size,
+		    rate, r->r_ops, r->r_bytes, r->r_errors, r->r_elapsed,
+		    r->r_ops / r->r_elapsed, r->r_bytes / r->r_elapsed,
+		    h->h_total, h->h_total > 0 ? h->h_min : 0,
+		    h->h_total > 0 ? (double)h->h_sum / h->h_total : 0,
+		    hist_percentile(h, 50), hist_percentile(h, 90),
+		    hist_percentile(h, 99), hist_percentile(h, 99.9),
+		    h->h_max, i + 1 < count ? "," : "");
+	}
+	printf("]\n");
+}
+
 void
 usage(const char *argv0)
 {
 
-	fprintf(stderr, "Usage: %s -u URI [-c CYCLES] [-m]\n", argv0);
+	fprintf(stderr, "Usage: %s -u URI [-w stream|call|event] [-t THREADS] "
+	    "[-n CONNECTIONS]\n", argv0);
+	fprintf(stderr, "       [-s SIZE[,SIZE...]] [-c CYCLES] "
+	    "[-r RATE [-d SECONDS]] [-m] [-L] [-q|-j]\n");
 	fprintf(stderr, "       %s -h\n", argv0);
 }
 
 int
 main(int argc, char * const argv[])
 {
-	struct timespec start;
-	struct timespec end;
-	struct timespec lat_start;
-	struct timespec lat_end;
-	struct timespec diff;
-	double elapsed;
-	double lat_sum = 0;
-	rpc_object_t error;
-	rpc_object_t item;
-	rpc_client_t client;
-	rpc_connection_t connection;
-	rpc_call_t call;
-	int64_t cycles = 0;
-	int64_t bytes = 0;
-	int64_t ncycles = 1000;
-	bool shmem = false;
+	struct result results[MAX_SIZES];
+	size_t sizes[MAX_SIZES] = { 4096 };
+	size_t nsizes = 1;
+	size_t i;
 	bool quiet = false;
-	char *uri = NULL;
+	bool json = false;
+	bool local = false;
+	char *tok;
+	char *end;
 	int c;
 
 	for (;;) {
-		c = getopt(argc, argv, "u:c:mhq");
+		c = getopt(argc, argv, "u:w:t:n:s:c:r:d:mLhqj");
 		if (c == -1)
 			break;
 
@@ -94,18 +683,73 @@ main(int argc, char * const argv[])
 			uri = strdup(optarg);
 			break;
 
+		case 'w':
+			for (i = 0; i < sizeof(workload_names) /
+			    sizeof(*workload_names); i++) {
+				if (strcmp(optarg, workload_names[i]) == 0)
+					break;
+			}
+
+			if (i == sizeof(workload_names) /
+			    sizeof(*workload_names)) {
+				fprintf(stderr, "Error: unknown workload %s\n",
+				    optarg);
+				return (EXIT_FAILURE);
+			}
+
+			workload = (workload_t)i;
+			break;
+
+		case 't':
+			nthreads = (int)strtol(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			nconns = (int)strtol(optarg, NULL, 10);
+			break;
+
+		case 's':
+			nsizes = 0;
+			for (tok = strtok(optarg, ","); tok != NULL &&
+			    nsizes < MAX_SIZES; tok = strtok(NULL, ",")) {
+				sizes[nsizes++] = (size_t)strtoull(tok, &end,
+				    10);
+				if (*end != '\0') {
+					fprintf(stderr, "Error: invalid size "
+					    "%s\n", tok);
+					return (EXIT_FAILURE);
+				}
+			}
+			break;
+
 		case 'c':
 			ncycles = strtoll(optarg, NULL, 10);
 			break;
 
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+
+		case 'd':
+			duration = strtod(optarg, NULL);
+			break;
+
 		case 'm':
 			shmem = true;
 			break;
 
+		case 'L':
+			local = true;
+			break;
+
 		case 'q':
 			quiet = true;
 			break;
 
+		case 'j':
+			json = true;
+			break;
+
 		case 'h':
 			usage(argv[0]);
 			return (EXIT_SUCCESS);
@@ -118,92 +762,37 @@ main(int argc, char * const argv[])
 		return (EXIT_SUCCESS);
 	}
 
-	client = rpc_client_create(uri, NULL);
-	if (client == NULL) {
-		error = rpc_get_last_error();
-		fprintf(stderr, "Cannot connect: %s\n",
-		    rpc_error_get_message(error));
+	if (nthreads < 1 || nconns < 1 || nsizes == 0) {
+		fprintf(stderr, "Error: invalid thread, connection or size "
+		    "count\n");
 		return (EXIT_FAILURE);
 	}
 
-	connection = rpc_client_get_connection(client);
-	call = rpc_connection_call(connection, "/",
-	    "com.twoporeguys.librpc.Benchmark", "stream",
-	    rpc_object_pack("[i]", ncycles), NULL);
-	if (call == NULL) {
-		error = rpc_get_last_error();
-		fprintf(stderr, "Cannot start streaming: %s\n",
-		    rpc_error_get_message(error));
+	if (rate > 0 && workload != WORKLOAD_CALL) {
+		fprintf(stderr, "Error: fixed rate only works with the call "
+		    "workload\n");
 		return (EXIT_FAILURE);
 	}
 
-	clock_gettime(CLOCK_REALTIME, &start);
-	lat_start = start;
-
-	rpc_call_set_prefetch(call, 128);
-	rpc_call_wait(call);
-
-next:
-	switch (rpc_call_status(call)) {
-	case RPC_CALL_STREAM_START:
-		rpc_call_continue(call, true);
-		goto next;
-
-	case RPC_CALL_MORE_AVAILABLE:
-		cycles++;
-		item = rpc_call_result(call);
-
-		if (shmem) {
-			if (rpc_get_type(item) != RPC_TYPE_SHMEM) {
-				fprintf(stderr, "Wrong response type %s\n",
-				    rpc_get_type_name(rpc_get_type(item)));
-				goto error;
-			}
-			bytes += rpc_shmem_get_size(rpc_call_result(call));
-		} else {
-			if (rpc_get_type(item) != RPC_TYPE_BINARY) {
-				fprintf(stderr, "Wrong response type %s\n",
-				    rpc_get_type_name(rpc_get_type(item)));
-				goto error;
-			}
-			bytes += rpc_data_get_length(rpc_call_result(call));
-		}
-
-		clock_gettime(CLOCK_REALTIME, &lat_end);
-		timespec_diff(&lat_start, &lat_end, &diff);
-		lat_sum += diff.tv_sec + diff.tv_nsec / 1E9;
-
-		clock_gettime(CLOCK_REALTIME, &lat_start);
-		rpc_call_continue(call, true);
-		goto next;
+	if (local && benchmark_server_start(uri) == NULL) {
+		fprintf(stderr, "Error: cannot start server on %s: %s\n", uri,
+		    rpc_error_get_message(rpc_get_last_error()));
+		return (EXIT_FAILURE);
+	}
 
-	case RPC_CALL_DONE:
-		break;
+	for (i = 0; i < nsizes; i++) {
+		if (run(sizes[i], &results[i]) != 0)
+			return (EXIT_FAILURE);
 
-	case RPC_CALL_ERROR:
-		fprintf(stderr, "Stream failed: %s\n",
-		    rpc_error_get_message(rpc_call_result(call)));
-		goto error;
+		if (!json)
+			print_result(&results[i], quiet);
 	}
 
-	clock_gettime(CLOCK_REALTIME, &end);
-	timespec_diff(&start, &end, &diff);
-	elapsed = diff.tv_sec + diff.tv_nsec / 1E9;
+	if (json)
+		print_json(results, nsizes);
 
-	if (quiet) {
-		printf("msgs=%" PRId64 " bytes=%" PRId64 " bps=%f pps=%f lat=%f\n",
-		    cycles, bytes, bytes / elapsed, cycles / elapsed,
-		    lat_sum / cycles);
-	} else {
-		printf("Received %" PRId64 " messages and %" PRId64 " bytes\n", cycles, bytes);
-		printf("It took %.04f seconds\n", elapsed);
-		printf("Average data rate: %.04f MB/s\n", bytes / elapsed / 1024 / 1024);
-		printf("Average packet rate: %.04f packets/s\n", cycles / elapsed);
-		printf("Average latency: %.08fs\n", lat_sum / cycles);
-	}
+	for (i = 0; i < nsizes; i++)
+		free(results[i].r_hist);
 
 	return (EXIT_SUCCESS);
-
-error:
-	return (EXIT_FAILURE);
 }
@@ -31,7 +31,9 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <time.h>
 #include <rpc/object.h>
+#include <rpc/connection.h>
 #include <rpc/service.h>
 #include <rpc/server.h>
 
@@ -39,47 +41,144 @@ static char *uri = NULL;
 static size_t msgsize = 4096;
 static bool shmem = false;
 
+static uint64_t now_ns(void);
+static rpc_object_t create_payload(size_t);
 static rpc_object_t benchmark_stream(void *, rpc_object_t);
+static rpc_object_t benchmark_echo(void *, rpc_object_t);
+static rpc_object_t benchmark_events(void *, rpc_object_t);
+rpc_server_t benchmark_server_start(const char *);
+#ifndef BENCHMARK_EMBEDDED
 void usage(const char *);
 int main(int, char * const []);
+#endif
 
 static const struct rpc_if_member benchmark_vtable[] = {
 	RPC_METHOD(stream, benchmark_stream),
+	RPC_METHOD(echo, benchmark_echo),
+	RPC_METHOD(events, benchmark_events),
 	RPC_MEMBER_END
 };
 
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
 static rpc_object_t
-benchmark_stream(void *cookie, rpc_object_t args)
+create_payload(size_t size)
 {
 	rpc_object_t data;
-	int64_t cycles;
 	void *buffer;
 
-	if (rpc_object_unpack(args, "[i]", &cycles) < 1) {
-		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
-		return (NULL);
-	}
-
 	if (shmem) {
-		data = rpc_shmem_create(msgsize);
+		data = rpc_shmem_create(size);
 		buffer = rpc_shmem_map(data);
 	} else {
-		buffer = malloc(msgsize);
-		data = rpc_data_create(buffer, msgsize,
+		buffer = malloc(size);
+		data = rpc_data_create(buffer, size,
 		    RPC_BINARY_DESTRUCTOR(free));
 	}
 
-	memset(buffer, 0x55, msgsize);
+	memset(buffer, 0x55, size);
+	return (data);
+}
 
+/*
+ * Arguments are the number of fragments and, optionally, their size,
+ * which defaults to the one given on the command line.
+ */
+static rpc_object_t
+benchmark_stream(void *cookie, rpc_object_t args)
+{
+	rpc_object_t data;
+	int64_t cycles;
+	int64_t size = (int64_t)msgsize;
+
+	if (rpc_object_unpack(args, "[i]", &cycles) < 1) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	if (rpc_array_get_count(args) > 1)
+		size = rpc_array_get_int64(args, 1);
+
+	data = create_payload((size_t)size);
 	rpc_function_start_stream(cookie);
 	while (cycles--) {
 		if (rpc_function_yield(cookie, rpc_retain(data)) < 0)
 			break;
 	}
 
+	rpc_release(data);
 	return (NULL);
 }
 
+static rpc_object_t
+benchmark_echo(void *cookie, rpc_object_t args)
+{
+
+	rpc_object_t data = rpc_array_get_value(args, 0);
+
+	return (data != NULL ? rpc_retain(data) : rpc_null_create());
+}
+
+/*
+ * Sends a number of "tick" events of a given size back to the caller.
+ * Each carries the time it was sent at, so that a client on the same
+ * host can tell the delivery latency.
+ */
+static rpc_object_t
+benchmark_events(void *cookie, rpc_object_t args)
+{
+	rpc_connection_t conn = rpc_function_get_connection(cookie);
+	rpc_object_t data;
+	rpc_object_t event;
+	int64_t count;
+	int64_t size;
+
+	if (rpc_object_unpack(args, "[i,i]", &count, &size) < 2) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	data = create_payload((size_t)size);
+	while (count--) {
+		event = rpc_object_pack("[u,V]", now_ns(), data);
+		rpc_connection_send_event(conn, "/",
+		    "com.twoporeguys.librpc.Benchmark", "tick", event);
+		rpc_release(event);
+	}
+
+	rpc_release(data);
+	return (rpc_null_create());
+}
+
+/*
+ * Also linked into librpc-client, which runs the server in-process for
+ * transports that can't cross processes, such as loopback.
+ */
+rpc_server_t
+benchmark_server_start(const char *server_uri)
+{
+	rpc_context_t context;
+	rpc_server_t server;
+
+	context = rpc_context_create();
+	rpc_instance_register_interface(rpc_context_get_root(context),
+	    "com.twoporeguys.librpc.Benchmark", benchmark_vtable, NULL);
+
+	server = rpc_server_create(server_uri, context);
+	if (server != NULL)
+		rpc_server_resume(server);
+
+	return (server);
+}
+
+#ifndef BENCHMARK_EMBEDDED
 void
 usage(const char *argv0)
 {
@@ -91,7 +190,6 @@ usage(const char *argv0)
 int
 main(int argc, char *const argv[])
 {
-	rpc_context_t context;
 	rpc_server_t server;
 	int c;
 
@@ -125,12 +223,12 @@ main(int argc, char *const argv[])
 		return (EXIT_SUCCESS);
 	}
 
-	context = rpc_context_create();
-	rpc_instance_register_interface(rpc_context_get_root(context),
-	    "com.twoporeguys.librpc.Benchmark", benchmark_vtable, NULL);
-
-	server = rpc_server_create(uri, context);
-	rpc_server_resume(server);
+	server = benchmark_server_start(uri);
+	if (server == NULL) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", uri,
+		    rpc_error_get_message(rpc_get_last_error()));
+		return (EXIT_FAILURE);
+	}
 
 	printf("Listening on %s\n", uri);
 	printf("Using %zu message size\n", msgsize);
@@ -142,3 +240,4 @@ main(int argc, char *const argv[])
 
 	return (EXIT_SUCCESS);
 }
+#endif
@@ -0,0 +1,533 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+#include <rpc/object.h>
+#include <rpc/typing.h>
+#include "bench-allocs.h"
+
+#define	BENCH_MAX_KEYS		1024
+
+struct bench_case
+{
+	const char *		bc_name;
+	size_t			bc_size;
+	void			(*bc_setup)(size_t);
+	void			(*bc_op)(int64_t);
+};
+
+static void bench_setup_none(size_t);
+static void bench_setup_dict(size_t);
+static void bench_setup_array(size_t);
+static void bench_setup_tree(size_t);
+static void bench_setup_record(size_t);
+static void bench_setup_serialized(size_t);
+static void bench_create_null(int64_t);
+static void bench_create_bool(int64_t);
+static void bench_create_int64(int64_t);
+static void bench_create_uint64(int64_t);
+static void bench_create_double(int64_t);
+static void bench_create_date(int64_t);
+static void bench_create_string(int64_t);
+static void bench_create_binary(int64_t);
+static void bench_create_array(int64_t);
+static void bench_create_dictionary(int64_t);
+static void bench_create_error(int64_t);
+static void bench_dict_build(int64_t);
+static void bench_dict_set(int64_t);
+static void bench_dict_get(int64_t);
+static void bench_array_append(int64_t);
+static void bench_array_apply(int64_t);
+static void bench_copy(int64_t);
+static void bench_hash(int64_t);
+static void bench_equal(int64_t);
+static void bench_cmp(int64_t);
+static void bench_pack(int64_t);
+static void bench_unpack(int64_t);
+static void bench_rpct_serialize(int64_t);
+static void bench_rpct_deserialize(int64_t);
+static rpc_object_t bench_tree(void);
+static uint64_t bench_now(void);
+static void bench_cleanup(void);
+void usage(const char *);
+int main(int, char * const[]);
+
+#define	BENCH_SIZES(name, setup, op)		\
+	{ name, 1, setup, op },			\
+	{ name, 8, setup, op },			\
+	{ name, 64, setup, op },		\
+	{ name, 1024, setup, op }
+
+static const struct bench_case bench_cases[] = {
+	{ "create-null", 0, bench_setup_none, bench_create_null },
+	{ "create-bool", 0, bench_setup_none, bench_create_bool },
+	{ "create-int64", 0, bench_setup_none, bench_create_int64 },
+	{ "create-uint64", 0, bench_setup_none, bench_create_uint64 },
+	{ "create-double", 0, bench_setup_none, bench_create_double },
+	{ "create-date", 0, bench_setup_none, bench_create_date },
+	{ "create-string", 0, bench_setup_none, bench_create_string },
+	{ "create-binary", 0, bench_setup_none, bench_create_binary },
+	{ "create-array", 0, bench_setup_none, bench_create_array },
+	{ "create-dict", 0, bench_setup_none, bench_create_dictionary },
+	{ "create-error", 0, bench_setup_none, bench_create_error },
+	BENCH_SIZES("dict-build", bench_setup_dict, bench_dict_build),
+	BENCH_SIZES("dict-set", bench_setup_dict, bench_dict_set),
+	BENCH_SIZES("dict-get", bench_setup_dict, bench_dict_get),
+	BENCH_SIZES("array-append", bench_setup_array, bench_array_append),
+	BENCH_SIZES("array-apply", bench_setup_array, bench_array_apply),
+	{ "copy", 0, bench_setup_tree, bench_copy },
+	{ "hash", 0, bench_setup_tree, bench_hash },
+	{ "equal", 0, bench_setup_tree, bench_equal },
+	{ "cmp", 0, bench_setup_tree, bench_cmp },
+	{ "pack", 0, bench_setup_none, bench_pack },
+	{ "unpack", 0, bench_setup_record, bench_unpack },
+	{ "rpct-serialize", 0, bench_setup_tree, bench_rpct_serialize },
+	{ "rpct-deserialize", 0, bench_setup_serialized,
+	    bench_rpct_deserialize },
+	{ NULL, 0, NULL, NULL }
+};
+
+static char bench_keys[BENCH_MAX_KEYS][16];
+static char bench_blob[256];
+static size_t bench_size;
+static rpc_object_t bench_obj;
+static rpc_object_t bench_other;
+static volatile uint64_t bench_sink;
+
+static void
+bench_setup_none(size_t size)
+{
+
+}
+
+static void
+bench_setup_dict(size_t size)
+{
+	size_t i;
+
+	bench_obj = rpc_dictionary_create();
+	bench_other = rpc_int64_create(42);
+	for (i = 0; i < size; i++)
+		rpc_dictionary_set_value(bench_obj, bench_keys[i], bench_other);
+}
+
+static void
+bench_setup_array(size_t size)
+{
+	size_t i;
+
+	bench_obj = rpc_array_create();
+	for (i = 0; i < size; i++)
+		rpc_array_append_stolen_value(bench_obj,
+		    rpc_int64_create((int64_t)i));
+}
+
+static void
+bench_setup_tree(size_t size)
+{
+
+	bench_obj = bench_tree();
+	bench_other = bench_tree();
+}
+
+static void
+bench_setup_record(size_t size)
+{
+
+	bench_obj = rpc_object_pack("{i,s,d,b}",
+	    "id", (int64_t)1234,
+	    "name", "sample",
+	    "value", 0.5,
+	    "enabled", true);
+}
+
+static void
+bench_setup_serialized(size_t size)
+{
+	rpc_object_t tree;
+
+	tree = bench_tree();
+	bench_obj = rpct_serialize(tree);
+	rpc_release(tree);
+}
+
+static void
+bench_create_null(int64_t i)
+{
+
+	rpc_release(rpc_null_create());
+}
+
+static void
+bench_create_bool(int64_t i)
+{
+
+	rpc_release(rpc_bool_create(i & 1));
+}
+
+static void
+bench_create_int64(int64_t i)
+{
+
+	rpc_release(rpc_int64_create(i));
+}
+
+static void
+bench_create_uint64(int64_t i)
+{
+
+	rpc_release(rpc_uint64_create((uint64_t)i));
+}
+
+static void
+bench_create_double(int64_t i)
+{
+
+	rpc_release(rpc_double_create((double)i));
+}
+
+static void
+bench_create_date(int64_t i)
+{
+
+	rpc_release(rpc_date_create(i));
+}
+
+static void
+bench_create_string(int64_t i)
+{
+
+	rpc_release(rpc_string_create(bench_keys[i % BENCH_MAX_KEYS]));
+}
+
+static void
+bench_create_binary(int64_t i)
+{
+
+	rpc_release(rpc_data_create(bench_blob, sizeof(bench_blob), NULL));
+}
+
+static void
+bench_create_array(int64_t i)
+{
+
+	rpc_release(rpc_array_create());
+}
+
+static void
+bench_create_dictionary(int64_t i)
+{
+
+	rpc_release(rpc_dictionary_create());
+}
+
+static void
+bench_create_error(int64_t i)
+{
+
+	rpc_release(rpc_error_create(22, "Invalid argument", NULL));
+}
+
+static void
+bench_dict_build(int64_t i)
+{
+	rpc_object_t dict;
+	size_t j;
+
+	dict = rpc_dictionary_create();
+	for (j = 0; j < bench_size; j++)
+		rpc_dictionary_set_value(dict, bench_keys[j], bench_other);
+
+	rpc_release(dict);
+}
+
+static void
+bench_dict_set(int64_t i)
+{
+
+	rpc_dictionary_set_value(bench_obj,
+	    bench_keys[(size_t)i % bench_size], bench_other);
+}
+
+static void
+bench_dict_get(int64_t i)
+{
+
+	bench_sink += (uintptr_t)rpc_dictionary_get_value(bench_obj,
+	    bench_keys[(size_t)i % bench_size]);
+}
+
+static void
+bench_array_append(int64_t i)
+{
+	rpc_object_t array;
+	size_t j;
+
+	array = rpc_array_create();
+	for (j = 0; j < bench_size; j++)
+		rpc_array_append_stolen_value(array,
+		    rpc_int64_create((int64_t)j));
+
+	rpc_release(array);
+}
+
+static void
+bench_array_apply(int64_t i)
+{
+	__block int64_t sum = 0;
+
+	rpc_array_apply(bench_obj, ^(size_t index, rpc_object_t value) {
+		sum += rpc_int64_get_value(value);
+		return ((bool)true);
+	});
+
+	bench_sink += (uint64_t)sum;
+}
+
+static void
+bench_copy(int64_t i)
+{
+
+	rpc_release(rpc_copy(bench_obj));
+}
+
+static void
+bench_hash(int64_t i)
+{
+
+	bench_sink += rpc_hash(bench_obj);
+}
+
+static void
+bench_equal(int64_t i)
+{
+
+	bench_sink += rpc_equal(bench_obj, bench_other);
+}
+
+static void
+bench_cmp(int64_t i)
+{
+
+	bench_sink += (uint64_t)rpc_cmp(bench_obj, bench_other);
+}
+
+static void
+bench_pack(int64_t i)
+{
+
+	rpc_release(rpc_object_pack("{i,s,d,b}",
+	    "id", i,
+	    "name", "sample",
+	    "value", 0.5,
+	    "enabled", true));
+}
+
+static void
+bench_unpack(int64_t i)
+{
+	const char *name;
+	int64_t id;
+	double value;
+	bool enabled;
+
+	rpc_object_unpack(bench_obj, "{i,s,d,b}",
+	    "id", &id,
+	    "name", &name,
+	    "value", &value,
+	    "enabled", &enabled);
+
+	bench_sink += (uint64_t)id;
+}
+
+static void
+bench_rpct_serialize(int64_t i)
+{
+
+	rpc_release(rpct_serialize(bench_obj));
+}
+
+static void
+bench_rpct_deserialize(int64_t i)
+{
+
+	rpc_release(rpct_deserialize(bench_obj));
+}
+
+/*
+ * A small, mixed object tree, like a typical method result: a record
+ * with scalars of every common type, a short list and a nested record.
+ */
+static rpc_object_t
+bench_tree(void)
+{
+	rpc_object_t result;
+	rpc_object_t list;
+	int64_t i;
+
+	list = rpc_array_create();
+	for (i = 0; i < 16; i++)
+		rpc_array_append_stolen_value(list, rpc_int64_create(i));
+
+	result = rpc_object_pack("{i,u,d,b,s,n}",
+	    "id", (int64_t)1234,
+	    "flags", (uint64_t)0xff,
+	    "ratio", 0.25,
+	    "enabled", true,
+	    "name", "/var/lib/librpc/objects",
+	    "parent");
+
+	rpc_dictionary_steal_value(result, "items", list);
+	rpc_dictionary_steal_value(result, "owner", rpc_object_pack("{s,i,i}",
+	    "name", "nobody",
+	    "uid", (int64_t)65534,
+	    "gid", (int64_t)65534));
+	rpc_dictionary_steal_value(result, "created", rpc_date_create(0));
+	rpc_dictionary_steal_value(result, "data",
+	    rpc_data_create(bench_blob, sizeof(bench_blob), NULL));
+
+	return (result);
+}
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+static void
+bench_cleanup(void)
+{
+
+	if (bench_obj != NULL)
+		rpc_release(bench_obj);
+
+	if (bench_other != NULL)
+		rpc_release(bench_other);
+
+	bench_obj = NULL;
+	bench_other = NULL;
+}
+
+void
+usage(const char *argv0)
+{
+
+	fprintf(stderr, "Usage: %s [-c CYCLES] [-b BENCHMARK]\n", argv0);
+	fprintf(stderr, "       %s -h\n", argv0);
+}
+
+int
+main(int argc, char * const argv[])
+{
+	const struct bench_case *bc;
+	const char *only = NULL;
+	uint64_t start;
+	uint64_t allocs;
+	double ns;
+	int64_t cycles = 100000;
+	int64_t n;
+	int64_t i;
+	int c;
+
+	for (;;) {
+		c = getopt(argc, argv, "c:b:h");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			cycles = strtoll(optarg, NULL, 10);
+			break;
+
+		case 'b':
+			only = optarg;
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			return (c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (cycles <= 0) {
+		fprintf(stderr, "Error: invalid cycle count\n");
+		return (EXIT_FAILURE);
+	}
+
+	if (!BENCH_COUNT_ALLOCS)
+		fprintf(stderr, "Allocation counting not supported here\n");
+
+	rpct_init(true);
+	for (i = 0; i < BENCH_MAX_KEYS; i++)
+		snprintf(bench_keys[i], sizeof(bench_keys[i]), "key%" PRId64, i);
+
+	memset(bench_blob, 0x55, sizeof(bench_blob));
+
+	printf("%-18s %6s %14s %12s\n", "benchmark", "size", "ns/op",
+	    "allocs/op");
+
+	for (bc = bench_cases; bc->bc_name != NULL; bc++) {
+		if (only != NULL && strcmp(only, bc->bc_name) != 0)
+			continue;
+
+		/* Keep whole-container cases from taking forever */
+		n = bc->bc_size > 1 ? cycles / (int64_t)bc->bc_size + 1 :
+		    cycles;
+
+		bench_size = bc->bc_size;
+		bc->bc_setup(bc->bc_size);
+
+		/* One warm-up round that is not measured */
+		for (i = 0; i < n / 10 + 1; i++)
+			bc->bc_op(i);
+
+		allocs = bench_allocs_count();
+		start = bench_now();
+		for (i = 0; i < n; i++)
+			bc->bc_op(i);
+
+		ns = (double)(bench_now() - start) / n;
+		printf("%-18s %6zu %14.1f %12.2f\n", bc->bc_name, bc->bc_size,
+		    ns, (double)(bench_allocs_count() - allocs) / n);
+
+		bench_cleanup();
+	}
+
+	return (EXIT_SUCCESS);
+}
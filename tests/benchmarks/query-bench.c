@@ -0,0 +1,371 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+#include <rpc/object.h>
+#include <rpc/query.h>
+#include <rpc/serializer.h>
+#include "bench-allocs.h"
+
+enum bench_dataset
+{
+	BENCH_RECORDS,		/* array of nested dictionaries */
+	BENCH_PACKED		/* packed array of doubles */
+};
+
+struct bench_case
+{
+	const char *		bc_name;
+	enum bench_dataset	bc_dataset;
+	const char *		bc_rules;
+	bool			bc_sort;
+	uint64_t		bc_limit;
+	bool			bc_count;
+};
+
+struct bench_result
+{
+	double			br_rows;
+	double			br_allocs;
+	size_t			br_matches;
+};
+
+static rpc_object_t bench_records(size_t);
+static rpc_object_t bench_packed(size_t);
+static int bench_run(const struct bench_case *, rpc_object_t,
+    rpc_query_plan_t, int64_t, struct bench_result *);
+static size_t bench_query(const struct bench_case *, rpc_object_t,
+    rpc_query_plan_t);
+static uint64_t bench_now(void);
+void usage(const char *);
+int main(int, char * const[]);
+
+static const struct bench_case bench_cases[] = {
+	{ "eq", BENCH_RECORDS, "[[\"enabled\", \"=\", true]]",
+	    false, 0, false },
+	{ "nested", BENCH_RECORDS, "[[\"owner.uid\", \"=\", 42]]",
+	    false, 0, false },
+	{ "regex", BENCH_RECORDS, "[[\"name\", \"~\", \"^item-1[0-9]*5$\"]]",
+	    false, 0, false },
+	{ "in", BENCH_RECORDS,
+	    "[[\"owner.uid\", \"in\", [1, 2, 3, 5, 8, 13, 21, 34, 55, 89]]]",
+	    false, 0, false },
+	{ "or", BENCH_RECORDS,
+	    "[[\"or\", [[\"owner.uid\", \"<\", 10], "
+	    "[\"tags.0\", \"=\", \"red\"]]]]",
+	    false, 0, false },
+	{ "nor", BENCH_RECORDS,
+	    "[[\"nor\", [[\"owner.uid\", \"<\", 10], "
+	    "[\"tags.0\", \"=\", \"red\"]]]]",
+	    false, 0, false },
+	{ "sort-limit", BENCH_RECORDS, "[[\"enabled\", \"=\", true]]",
+	    true, 10, false },
+	{ "count", BENCH_RECORDS, "[[\"enabled\", \"=\", true]]",
+	    false, 0, true },
+	{ "packed", BENCH_PACKED, "[[\"\", \">\", 500], [\"\", \"<=\", 900]]",
+	    false, 0, false },
+	{ NULL, BENCH_RECORDS, NULL, false, 0, false }
+};
+
+static const size_t bench_sizes[] = { 1000, 10000, 100000, 0 };
+
+static const char *bench_tags[] = { "red", "green", "blue", "black" };
+
+static rpc_object_t
+bench_records(size_t count)
+{
+	rpc_object_t result;
+	rpc_object_t item;
+	char name[32];
+	char owner[32];
+	size_t i;
+
+	result = rpc_array_create_with_capacity(count);
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "item-%zu", i);
+		snprintf(owner, sizeof(owner), "user-%zu", i % 100);
+		item = rpc_object_pack("{i,s,d,b,{s,i},[s,s]}",
+		    "id", (int64_t)i,
+		    "name", name,
+		    "value", (double)((i * 7919) % 1000) / 10,
+		    "enabled", (i % 3) == 0,
+		    "owner",
+		        "name", owner,
+		        "uid", (int64_t)(i % 100),
+		    "tags",
+		        bench_tags[i % 4],
+		        bench_tags[(i / 4) % 4]);
+
+		rpc_array_append_stolen_value(result, item);
+	}
+
+	return (result);
+}
+
+static rpc_object_t
+bench_packed(size_t count)
+{
+	rpc_object_t result;
+	double *values;
+	size_t i;
+
+	values = malloc(count * sizeof(double));
+	for (i = 0; i < count; i++)
+		values[i] = (double)((i * 7919) % 1000);
+
+	result = rpc_array_create_packed(RPC_TYPE_DOUBLE, values, count);
+	free(values);
+	return (result);
+}
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+/*
+ * Runs the query once and drains the iterator, returning the number of
+ * results (or the count, for counting queries).
+ */
+static size_t
+bench_query(const struct bench_case *bcase, rpc_object_t dataset,
+    rpc_query_plan_t plan)
+{
+	struct rpc_query_params params = { 0 };
+	rpc_query_iter_t iter;
+	rpc_object_t item = NULL;
+	size_t matches = 0;
+
+	params.limit = bcase->bc_limit;
+	params.count = bcase->bc_count;
+	if (bcase->bc_sort) {
+		params.sort = ^(rpc_object_t o1, rpc_object_t o2) {
+			double d1 = rpc_dictionary_get_double(o1, "value");
+			double d2 = rpc_dictionary_get_double(o2, "value");
+
+			return ((d1 > d2) - (d1 < d2));
+		};
+	}
+
+	iter = rpc_query_plan(dataset, &params, plan);
+	if (iter == NULL)
+		return (0);
+
+	while (rpc_query_next(iter, &item)) {
+		matches++;
+		rpc_release(item);
+	}
+
+	if (item != NULL) {
+		if (bcase->bc_count)
+			matches = (size_t)rpc_uint64_get_value(item);
+		else
+			matches++;
+
+		rpc_release(item);
+	}
+
+	rpc_query_iter_free(iter);
+	return (matches);
+}
+
+/*
+ * Queries the dataset cycles times, after one warm-up round that is not
+ * measured. Packed datasets are copied for every round, as querying may
+ * convert them in place; the copies are made outside of the measurement.
+ */
+static int
+bench_run(const struct bench_case *bcase, rpc_object_t dataset,
+    rpc_query_plan_t plan, int64_t cycles, struct bench_result *res)
+{
+	rpc_object_t *copies;
+	size_t rows;
+	uint64_t start;
+	uint64_t elapsed = 0;
+	uint64_t allocs = 0;
+	uint64_t mark;
+	int64_t i;
+
+	rows = rpc_array_get_count(dataset);
+	copies = calloc((size_t)cycles + 1, sizeof(rpc_object_t));
+	for (i = 0; i <= cycles; i++) {
+		copies[i] = bcase->bc_dataset == BENCH_PACKED ?
+		    rpc_copy(dataset) : rpc_retain(dataset);
+	}
+
+	res->br_matches = bench_query(bcase, copies[0], plan);
+
+	for (i = 1; i <= cycles; i++) {
+		mark = bench_allocs_count();
+		start = bench_now();
+		bench_query(bcase, copies[i], plan);
+		elapsed += bench_now() - start;
+		allocs += bench_allocs_count() - mark;
+	}
+
+	for (i = 0; i <= cycles; i++)
+		rpc_release(copies[i]);
+
+	free(copies);
+	res->br_rows = elapsed > 0 ?
+	    (double)rows * cycles * 1000000000 / elapsed : 0;
+	res->br_allocs = rows > 0 ? (double)allocs / ((double)rows * cycles) : 0;
+	return (0);
+}
+
+void
+usage(const char *argv0)
+{
+
+	fprintf(stderr, "Usage: %s [-c CYCLES] [-n ROWS] [-q CASE] [-x]\n",
+	    argv0);
+	fprintf(stderr, "       %s -h\n", argv0);
+}
+
+int
+main(int argc, char * const argv[])
+{
+	const struct bench_case *bcase;
+	const size_t *size;
+	struct bench_result res;
+	rpc_query_index_t indexes[2] = { NULL, NULL };
+	rpc_query_plan_t plan;
+	rpc_object_t datasets[2];
+	rpc_object_t rules;
+	size_t only_size[2] = { 0, 0 };
+	const size_t *sizes = bench_sizes;
+	int64_t cycles = 10;
+	const char *only_case = NULL;
+	bool index = false;
+	int c;
+	int i;
+
+	for (;;) {
+		c = getopt(argc, argv, "c:n:q:xh");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			cycles = strtoll(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			only_size[0] = (size_t)strtoull(optarg, NULL, 10);
+			sizes = only_size;
+			break;
+
+		case 'q':
+			only_case = optarg;
+			break;
+
+		case 'x':
+			index = true;
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			return (c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (cycles <= 0 || sizes[0] == 0) {
+		fprintf(stderr, "Error: invalid cycle or row count\n");
+		return (EXIT_FAILURE);
+	}
+
+	if (!BENCH_COUNT_ALLOCS)
+		fprintf(stderr, "Allocation counting not supported here\n");
+
+	printf("%-12s %10s %10s %14s %12s\n", "case", "rows", "matches",
+	    "rows/s", "allocs/row");
+
+	for (size = sizes; *size != 0; size++) {
+		datasets[BENCH_RECORDS] = bench_records(*size);
+		datasets[BENCH_PACKED] = bench_packed(*size);
+
+		if (index) {
+			indexes[0] = rpc_query_index_create(
+			    datasets[BENCH_RECORDS], "owner.uid",
+			    RPC_QUERY_INDEX_HASH);
+			indexes[1] = rpc_query_index_create(
+			    datasets[BENCH_RECORDS], "enabled",
+			    RPC_QUERY_INDEX_HASH);
+		}
+
+		for (bcase = bench_cases; bcase->bc_name != NULL; bcase++) {
+			if (only_case != NULL &&
+			    strcmp(only_case, bcase->bc_name) != 0)
+				continue;
+
+			rules = rpc_serializer_load("json", bcase->bc_rules,
+			    strlen(bcase->bc_rules));
+			plan = rules != NULL ? rpc_query_compile(rules) : NULL;
+			if (plan == NULL) {
+				fprintf(stderr, "Cannot compile rules of %s\n",
+				    bcase->bc_name);
+				if (rules != NULL)
+					rpc_release(rules);
+
+				continue;
+			}
+
+			bench_run(bcase, datasets[bcase->bc_dataset], plan,
+			    cycles, &res);
+			printf("%-12s %10zu %10zu %14.0f %12.2f\n",
+			    bcase->bc_name, *size, res.br_matches,
+			    res.br_rows, res.br_allocs);
+
+			rpc_query_plan_free(plan);
+			rpc_release(rules);
+		}
+
+		for (i = 0; i < 2; i++) {
+			if (indexes[i] != NULL)
+				rpc_query_index_free(indexes[i]);
+
+			indexes[i] = NULL;
+		}
+
+		rpc_release(datasets[BENCH_RECORDS]);
+		rpc_release(datasets[BENCH_PACKED]);
+	}
+
+	return (EXIT_SUCCESS);
+}
@@ -26,73 +26,131 @@
 #
 
 import os
+import sys
+import json
+import math
 import argparse
+import platform
+import statistics
 import time
 import subprocess
-import psutil
-import matplotlib.pyplot as plt
 
 
 SOCKET_PATH = 'unix:///tmp/benchmark.sock'
+TRANSPORTS = {
+    'unix': SOCKET_PATH,
+    'tcp': 'tcp://127.0.0.1:5500',
+}
 MESSAGE_SIZES = [2**n for n in range(4, 22)]
+OFFERED_RATES = [1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000]
+
+# Regression mode: name -> (server URI, client URI, client flags).
+# Loopback only works within a process, so the client hosts the server.
+REGRESS_TRANSPORTS = {
+    'unix': (SOCKET_PATH, SOCKET_PATH, []),
+    'tcp': ('tcp://127.0.0.1:5500', 'tcp://127.0.0.1:5500', []),
+    'ws': ('ws://0.0.0.0:5501/ws', 'ws://127.0.0.1:5501/ws', []),
+    'shmem': (SOCKET_PATH, SOCKET_PATH, ['-m']),
+    'loopback': (None, 'loopback://0', ['-L']),
+}
+
+REGRESS_WORKLOADS = {
+    'call-64': ['-w', 'call', '-s', 64],
+    'call-4k': ['-w', 'call', '-s', 4096],
+    'stream-64k': ['-w', 'stream', '-s', 65536],
+}
+
+# Metric -> True if higher is better
+REGRESS_METRICS = {
+    'ops_per_sec': True,
+    'bytes_per_sec': True,
+    'p50_ns': False,
+    'p99_ns': False,
+}
+
+# Two-sided 95% Student's t quantiles by degrees of freedom
+T_95 = [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+        2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101,
+        2.093, 2.086]
 
 
 def parse_result(result):
     return {k: float(v) for k, v in (i.split('=') for i in result.split())}
 
 
-def librpc_step(msgsize, cycles):
+def parse_cpus(spec):
+    """Parses a CPU list such as 2,4-5"""
+    cpus = set()
+    for part in spec.split(','):
+        first, _, last = part.partition('-')
+        cpus.update(range(int(first), int(last or first) + 1))
+
+    return cpus
+
+
+def pinned(cpus):
+    if not cpus or not hasattr(os, 'sched_setaffinity'):
+        return None
+
+    return lambda: os.sched_setaffinity(0, cpus)
+
+
+def start_server(uri, msgsize, shmem=False, cpus=None):
+    args = ['./librpc-server', '-u', uri, '-s', str(msgsize)]
+    if shmem:
+        args.append('-m')
+
     server = subprocess.Popen(
-        [
-            './librpc-server',
-            '-u', SOCKET_PATH,
-            '-s', str(msgsize)
-        ],
-        stdout=subprocess.DEVNULL
+        args,
+        stdout=subprocess.DEVNULL,
+        preexec_fn=pinned(cpus)
     )
 
     time.sleep(1)
+    return server
+
+
+def run_client(uri, *args, cpus=None):
     client = subprocess.Popen(
-        [
-            './librpc-client',
-            '-u', SOCKET_PATH,
-            '-q', '-c', str(cycles)
-        ],
-        stdout=subprocess.PIPE
+        ['./librpc-client', '-u', uri, '-j'] + [str(i) for i in args],
+        stdout=subprocess.PIPE,
+        preexec_fn=pinned(cpus)
     )
 
     result, _ = client.communicate()
     client.wait()
+    return json.loads(result.decode('utf-8'))
+
+
+def librpc_sweep(uri, cycles, shmem=False):
+    """Streams at every message size from a single server instance"""
+    server = start_server(uri, MESSAGE_SIZES[0], shmem)
+    args = ['-c', cycles, '-s', ','.join(str(i) for i in MESSAGE_SIZES)]
+    if shmem:
+        args.append('-m')
+
+    result = run_client(uri, *args)
     server.terminate()
     server.wait()
-    return result.decode('utf-8').strip()
+    return result
 
 
-def librpc_shmem_step(msgsize, cycles):
-    server = subprocess.Popen(
-        [
-            './librpc-server',
-            '-u', SOCKET_PATH,
-            '-s', str(msgsize), '-m'
-        ],
-        stdout=subprocess.DEVNULL
-    )
+def librpc_rate_curve(uri, args):
+    """Open loop echo calls at increasing offered rates"""
+    server = start_server(uri, args.size)
+    result = []
 
-    time.sleep(1)
-    client = subprocess.Popen(
-        [
-            './librpc-client',
-            '-u', SOCKET_PATH,
-            '-q', '-c', str(cycles), '-m'
-        ],
-        stdout=subprocess.PIPE
-    )
+    for rate in OFFERED_RATES:
+        print('  offered rate {0}/s'.format(rate))
+        result += run_client(
+            uri, '-w', 'call', '-s', args.size,
+            '-t', args.threads, '-n', args.connections,
+            '-r', rate, '-d', args.duration
+        )
 
-    result, _ = client.communicate()
-    client.wait()
     server.terminate()
     server.wait()
-    return result.decode('utf-8').strip()
+    return result
 
 
 def dbus_step(msgsize, cycles):
@@ -120,6 +178,157 @@ def dbus_step(msgsize, cycles):
     return result.decode('utf-8').strip()
 
 
+def summarize(samples):
+    mean = statistics.mean(samples)
+    stdev = statistics.stdev(samples) if len(samples) > 1 else 0.0
+    dof = len(samples) - 1
+    t = T_95[min(dof, len(T_95)) - 1] if dof > 0 else 0.0
+    return {
+        'median': statistics.median(samples),
+        'mean': mean,
+        'stdev': stdev,
+        'ci95': t * stdev / math.sqrt(len(samples)),
+        'samples': samples
+    }
+
+
+def regress_case(transport, workload, args):
+    """Warms up, then repeats a single transport/workload pair"""
+    server_uri, client_uri, flags = REGRESS_TRANSPORTS[transport]
+    server = None
+    if server_uri is not None:
+        server = start_server(server_uri, 64, '-m' in flags,
+                              args.server_cpus)
+
+    client_args = REGRESS_WORKLOADS[workload] + flags + ['-c', args.cycles]
+    samples = {metric: [] for metric in REGRESS_METRICS}
+
+    try:
+        for i in range(args.warmup + args.repeat):
+            result = run_client(client_uri, *client_args,
+                                cpus=args.client_cpus)[0]
+            if i < args.warmup:
+                continue
+
+            samples['ops_per_sec'].append(result['ops_per_sec'])
+            samples['bytes_per_sec'].append(result['bytes_per_sec'])
+            samples['p50_ns'].append(result['latency_ns']['p50'])
+            samples['p99_ns'].append(result['latency_ns']['p99'])
+    finally:
+        if server is not None:
+            server.terminate()
+            server.wait()
+
+    return {metric: summarize(s) for metric, s in samples.items()}
+
+
+def compare(results, baseline, threshold):
+    """
+    A metric regressed if its median got worse by more than the threshold
+    and by more than both runs' confidence intervals put together, so that
+    noisy cases don't cry wolf.
+    """
+    comparison = {}
+    for case, metrics in results.items():
+        if case not in baseline:
+            continue
+
+        for metric, current in metrics.items():
+            base = baseline[case].get(metric)
+            if base is None or base['median'] == 0:
+                continue
+
+            change = (current['median'] - base['median']) / base['median']
+            worse = -change if REGRESS_METRICS[metric] else change
+            noise = current['ci95'] + base['ci95']
+            comparison['{0}/{1}'.format(case, metric)] = {
+                'baseline': base['median'],
+                'current': current['median'],
+                'change': change,
+                'regression': worse > threshold and
+                    abs(current['median'] - base['median']) > noise
+            }
+
+    return comparison
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', 'HEAD'],
+            stderr=subprocess.DEVNULL
+        ).decode('utf-8').strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def regress(args):
+    transports = args.transports.split(',')
+    results = {}
+
+    for transport in transports:
+        if transport not in REGRESS_TRANSPORTS:
+            print('Unknown transport {0}'.format(transport))
+            return 2
+
+        for workload in REGRESS_WORKLOADS:
+            case = '{0}/{1}'.format(transport, workload)
+            print('Running {0}'.format(case))
+            results[case] = regress_case(transport, workload, args)
+
+    report = {
+        'meta': {
+            'revision': git_revision(),
+            'host': platform.node(),
+            'platform': platform.platform(),
+            'cpus': os.cpu_count(),
+            'server_cpus': sorted(args.server_cpus or []),
+            'client_cpus': sorted(args.client_cpus or []),
+            'cycles': args.cycles,
+            'warmup': args.warmup,
+            'repeat': args.repeat,
+            'time': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime())
+        },
+        'results': results
+    }
+
+    failed = False
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+        report['comparison'] = compare(
+            results, baseline['results'], args.threshold / 100
+        )
+
+        for key, entry in sorted(report['comparison'].items()):
+            failed |= entry['regression']
+            print('{0:<40} {1:>14.1f} {2:>14.1f} {3:>+8.1%}{4}'.format(
+                key, entry['baseline'], entry['current'], entry['change'],
+                '  REGRESSION' if entry['regression'] else ''
+            ))
+
+    os.makedirs(args.output, exist_ok=True)
+    with open(os.path.join(args.output, 'regress.json'), 'w') as f:
+        json.dump(report, f, indent=2)
+
+    if args.save_baseline:
+        with open(args.save_baseline, 'w') as f:
+            json.dump(report, f, indent=2)
+
+    return 1 if failed else 0
+
+
+def save_plot(plt, args, name):
+    lgd = plt.legend(bbox_to_anchor=(1.05, 1), loc=2, borderaxespad=0.)
+    plt.grid('on')
+    plt.savefig(
+        os.path.join(args.output, name),
+        bbox_extra_artists=(lgd,),
+        bbox_inches='tight'
+    )
+
+
 def main():
     parser = argparse.ArgumentParser()
     parser.add_argument(
@@ -139,69 +348,183 @@ def main():
         type=int
     )
 
-    librpc_results = []
-    librpc_shmem_results = []
-    dbus_results = []
+    parser.add_argument(
+        '-s',
+        '--size',
+        metavar='BYTES',
+        help='Message size for latency vs. throughput curves',
+        default=256,
+        type=int
+    )
+
+    parser.add_argument(
+        '-t',
+        '--threads',
+        metavar='N',
+        help='Client threads for latency vs. throughput curves',
+        default=4,
+        type=int
+    )
+
+    parser.add_argument(
+        '-n',
+        '--connections',
+        metavar='N',
+        help='Connections per client thread',
+        default=4,
+        type=int
+    )
+
+    parser.add_argument(
+        '-d',
+        '--duration',
+        metavar='SECONDS',
+        help='Duration of every fixed rate run',
+        default=5,
+        type=float
+    )
+
+    parser.add_argument(
+        '--regress',
+        action='store_true',
+        help='Run the regression suite instead of the plots'
+    )
+
+    parser.add_argument(
+        '--transports',
+        metavar='LIST',
+        help='Transports to cover in regression mode',
+        default=','.join(REGRESS_TRANSPORTS)
+    )
+
+    parser.add_argument(
+        '--warmup',
+        metavar='N',
+        help='Discarded runs before measuring, in regression mode',
+        default=1,
+        type=int
+    )
+
+    parser.add_argument(
+        '--repeat',
+        metavar='N',
+        help='Measured runs per case, in regression mode',
+        default=5,
+        type=int
+    )
+
+    parser.add_argument(
+        '--server-cpus',
+        metavar='CPUS',
+        help='Pin servers to these CPUs, e.g. 2 or 2-3',
+        type=parse_cpus
+    )
+
+    parser.add_argument(
+        '--client-cpus',
+        metavar='CPUS',
+        help='Pin clients to these CPUs',
+        type=parse_cpus
+    )
+
+    parser.add_argument(
+        '--baseline',
+        metavar='FILE',
+        help='Compare against results saved with --save-baseline'
+    )
+
+    parser.add_argument(
+        '--save-baseline',
+        metavar='FILE',
+        help='Save the results as a baseline'
+    )
+
+    parser.add_argument(
+        '--threshold',
+        metavar='PERCENT',
+        help='Change of a median that counts as a regression',
+        default=5.0,
+        type=float
+    )
 
     args = parser.parse_args()
+    if args.regress:
+        sys.exit(regress(args))
+
+    import matplotlib.pyplot as plt
     os.makedirs(args.output, exist_ok=True)
 
+    print('Running message size sweep')
+    librpc_results = librpc_sweep(SOCKET_PATH, args.cycles)
+    librpc_shmem_results = librpc_sweep(SOCKET_PATH, args.cycles, True)
+    dbus_results = []
+
     for msgsize in MESSAGE_SIZES:
-        print('Running for message size {0}'.format(msgsize))
-        librpc_results.append(parse_result(librpc_step(msgsize, args.cycles)))
-        librpc_shmem_results.append(parse_result(librpc_shmem_step(msgsize, args.cycles)))
+        print('Running D-Bus for message size {0}'.format(msgsize))
         dbus_results.append(parse_result(dbus_step(msgsize, args.cycles)))
 
+    curves = {}
+    for name, uri in TRANSPORTS.items():
+        print('Running latency vs. throughput for {0}'.format(name))
+        curves[name] = librpc_rate_curve(uri, args)
+
+    with open(os.path.join(args.output, 'results.json'), 'w') as f:
+        json.dump({
+            'librpc': librpc_results,
+            'librpc-shmem': librpc_shmem_results,
+            'd-bus': dbus_results,
+            'curves': curves
+        }, f, indent=2)
+
     print('Generating plots...')
     plt.figure(1)
-    plt.plot(MESSAGE_SIZES, [i['bps'] for i in librpc_results], 'r', label='librpc')
-    plt.plot(MESSAGE_SIZES, [i['bps'] for i in librpc_shmem_results], 'g', label='librpc-shmem')
+    plt.plot(MESSAGE_SIZES, [i['bytes_per_sec'] for i in librpc_results], 'r', label='librpc')
+    plt.plot(MESSAGE_SIZES, [i['bytes_per_sec'] for i in librpc_shmem_results], 'g', label='librpc-shmem')
     plt.plot(MESSAGE_SIZES, [i['bps'] for i in dbus_results], 'b', label='d-bus')
 
     plt.xscale('log', basex=2)
     plt.yscale('log', basey=2)
     plt.xlabel('Message size (bytes)')
     plt.ylabel('Bytes per second')
-    plt.grid('on')
-    lgd = plt.legend(bbox_to_anchor=(1.05, 1), loc=2, borderaxespad=0.)
-    plt.savefig(
-        os.path.join(args.output, 'bytes_per_second.png'),
-        bbox_extra_artists=(lgd,),
-        bbox_inches='tight'
-    )
+    save_plot(plt, args, 'bytes_per_second.png')
 
     plt.figure(2)
-    plt.plot(MESSAGE_SIZES, [i['pps'] for i in librpc_results], 'r', label='librpc')
-    plt.plot(MESSAGE_SIZES, [i['pps'] for i in librpc_shmem_results], 'g', label='librpc-shmem')
+    plt.plot(MESSAGE_SIZES, [i['ops_per_sec'] for i in librpc_results], 'r', label='librpc')
+    plt.plot(MESSAGE_SIZES, [i['ops_per_sec'] for i in librpc_shmem_results], 'g', label='librpc-shmem')
     plt.plot(MESSAGE_SIZES, [i['pps'] for i in dbus_results], 'b', label='d-bus')
 
     plt.xscale('log', basex=2)
     plt.xlabel('Message size (bytes)')
     plt.ylabel('Packets per second')
-    plt.grid('on')
-    lgd = plt.legend(bbox_to_anchor=(1.05, 1), loc=2, borderaxespad=0.)
-    plt.savefig(
-        os.path.join(args.output, 'packets_per_second.png'),
-        bbox_extra_artists=(lgd,),
-        bbox_inches='tight'
-    )
+    save_plot(plt, args, 'packets_per_second.png')
 
     plt.figure(3)
-    plt.plot(MESSAGE_SIZES, [i['lat'] for i in librpc_results], 'r', label='librpc')
-    plt.plot(MESSAGE_SIZES, [i['lat'] for i in librpc_shmem_results], 'g', label='librpc-shmem')
+    plt.plot(MESSAGE_SIZES, [i['latency_ns']['mean'] / 1E9 for i in librpc_results], 'r', label='librpc')
+    plt.plot(MESSAGE_SIZES, [i['latency_ns']['p99'] / 1E9 for i in librpc_results], 'r--', label='librpc p99')
+    plt.plot(MESSAGE_SIZES, [i['latency_ns']['mean'] / 1E9 for i in librpc_shmem_results], 'g', label='librpc-shmem')
+    plt.plot(MESSAGE_SIZES, [i['latency_ns']['p99'] / 1E9 for i in librpc_shmem_results], 'g--', label='librpc-shmem p99')
     plt.plot(MESSAGE_SIZES, [i['lat'] for i in dbus_results], 'b', label='d-bus')
 
     plt.xscale('log', basex=2)
     plt.yscale('log')
     plt.xlabel('Message size (bytes)')
-    plt.ylabel('Average latency (seconds)')
-    plt.grid('on')
-    lgd = plt.legend(bbox_to_anchor=(1.05, 1), loc=2, borderaxespad=0.)
-    plt.savefig(
-        os.path.join(args.output, 'latency.png'),
-        bbox_extra_artists=(lgd,),
-        bbox_inches='tight'
-    )
+    plt.ylabel('Latency (seconds)')
+    save_plot(plt, args, 'latency.png')
+
+    plt.figure(4)
+    for name, points in curves.items():
+        throughput = [i['ops_per_sec'] for i in points]
+        for pct, style in (('p50', '-'), ('p99', '--'), ('p99_9', ':')):
+            plt.plot(
+                throughput,
+                [i['latency_ns'][pct] / 1E3 for i in points],
+                style, marker='o', label='{0} {1}'.format(name, pct)
+            )
+
+    plt.yscale('log')
+    plt.xlabel('Achieved throughput (calls per second)')
+    plt.ylabel('Latency (microseconds)')
+    save_plot(plt, args, 'latency_vs_throughput.png')
 
     print('Plots saved to "{0}" directory'.format(args.output))
 
@@ -0,0 +1,480 @@
+/*
+ * Copyright 2018 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+#include <rpc/object.h>
+#include <rpc/serializer.h>
+#include <rpc/typing.h>
+#include "bench-allocs.h"
+
+/*
+ * Not part of the public API, but exported by the library. These are
+ * the entry points the connection code uses.
+ */
+int rpc_msgpack_serialize(rpc_object_t, void **, size_t *);
+rpc_object_t rpc_msgpack_deserialize(const void *, size_t);
+
+#define	BENCH_NAMESPACE		"com.twoporeguys.librpc.benchmark"
+#define	BENCH_STRUCT		BENCH_NAMESPACE ".Sample"
+#define	BENCH_BLOB_SIZE		(64 * 1024)
+
+enum bench_mode
+{
+	BENCH_DUMP,		/* rpc_serializer_dump() / _load() */
+	BENCH_RAW,		/* msgpack without typing information */
+	BENCH_RPCT		/* msgpack wrapped in rpct_serialize() */
+};
+
+struct bench_fixture
+{
+	const char *		bf_name;
+	rpc_object_t		(*bf_create)(void);
+	bool			bf_typed;
+};
+
+struct bench_codec
+{
+	const char *		bc_name;
+	const char *		bc_serializer;
+	enum bench_mode		bc_mode;
+};
+
+struct bench_result
+{
+	double			br_ns;
+	double			br_allocs;
+	size_t			br_bytes;
+};
+
+static rpc_object_t bench_deep_dict(void);
+static rpc_object_t bench_wide_array(void);
+static rpc_object_t bench_binary(void);
+static rpc_object_t bench_strings(void);
+static rpc_object_t bench_structs(void);
+static int bench_load_idl(void);
+static int bench_encode(const struct bench_codec *, rpc_object_t, void **,
+    size_t *);
+static rpc_object_t bench_decode(const struct bench_codec *, const void *,
+    size_t);
+static int bench_run(const struct bench_codec *, rpc_object_t, int64_t,
+    struct bench_result *, struct bench_result *);
+static uint64_t bench_now(void);
+void usage(const char *);
+int main(int, char * const[]);
+
+static const char bench_idl[] =
+    "meta:\n"
+    "  version: 1\n"
+    "  namespace: " BENCH_NAMESPACE "\n"
+    "  description: Serializer benchmark types\n"
+    "struct Sample:\n"
+    "  members:\n"
+    "    id:\n"
+    "      type: int64\n"
+    "    name:\n"
+    "      type: string\n"
+    "    value:\n"
+    "      type: double\n"
+    "    enabled:\n"
+    "      type: bool\n";
+
+static const struct bench_fixture bench_fixtures[] = {
+	{ "deep-dict", bench_deep_dict, false },
+	{ "wide-array", bench_wide_array, false },
+	{ "binary", bench_binary, false },
+	{ "strings", bench_strings, false },
+	{ "structs", bench_structs, true },
+	{ NULL, NULL, false }
+};
+
+static const struct bench_codec bench_codecs[] = {
+	{ "msgpack", "msgpack", BENCH_DUMP },
+	{ "msgpack-raw", "msgpack", BENCH_RAW },
+	{ "msgpack-rpct", "msgpack", BENCH_RPCT },
+	{ "json", "json", BENCH_DUMP },
+	{ "yaml", "yaml", BENCH_DUMP },
+	{ NULL, NULL, BENCH_DUMP }
+};
+
+static char bench_blob[BENCH_BLOB_SIZE];
+
+static rpc_object_t
+bench_deep_dict(void)
+{
+	rpc_object_t result = NULL;
+	rpc_object_t node;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		node = rpc_object_pack("{i,s,b}",
+		    "level", (int64_t)i,
+		    "name", "node",
+		    "leaf", result == NULL);
+
+		if (result != NULL)
+			rpc_dictionary_steal_value(node, "child", result);
+
+		result = node;
+	}
+
+	return (result);
+}
+
+static rpc_object_t
+bench_wide_array(void)
+{
+	rpc_object_t result;
+	int64_t i;
+
+	result = rpc_array_create();
+	for (i = 0; i < 10000; i++)
+		rpc_array_append_stolen_value(result,
+		    rpc_int64_create(i * 7919));
+
+	return (result);
+}
+
+static rpc_object_t
+bench_binary(void)
+{
+	rpc_object_t result;
+	size_t i;
+
+	for (i = 0; i < sizeof(bench_blob); i++)
+		bench_blob[i] = (char)(i * 31);
+
+	result = rpc_array_create();
+	for (i = 0; i < 8; i++)
+		rpc_array_append_stolen_value(result,
+		    rpc_data_create(bench_blob, sizeof(bench_blob), NULL));
+
+	return (result);
+}
+
+static rpc_object_t
+bench_strings(void)
+{
+	rpc_object_t result;
+	char buf[256];
+	int i;
+
+	result = rpc_array_create();
+	for (i = 0; i < 1000; i++) {
+		snprintf(buf, sizeof(buf), "%0*d", 16 + (i % 200), i);
+		rpc_array_append_stolen_value(result,
+		    rpc_object_pack("{s,s,s,s}",
+		    "path", "/var/lib/librpc/objects",
+		    "name", buf,
+		    "owner", "nobody",
+		    "description", "A string-heavy record, like the ones "
+		    "returned by listing calls"));
+	}
+
+	return (result);
+}
+
+static rpc_object_t
+bench_structs(void)
+{
+	rpc_object_t result;
+	rpc_object_t item;
+	rpc_object_t value;
+	char name[32];
+	int64_t i;
+
+	result = rpc_array_create();
+	for (i = 0; i < 500; i++) {
+		snprintf(name, sizeof(name), "sample-%" PRId64, i);
+		value = rpc_object_pack("{i,s,d,b}",
+		    "id", i,
+		    "name", name,
+		    "value", (double)i / 3,
+		    "enabled", (i % 2) == 0);
+
+		item = rpct_new(BENCH_STRUCT, value);
+		rpc_release(value);
+		if (item == NULL) {
+			rpc_release(result);
+			return (NULL);
+		}
+
+		rpc_array_append_stolen_value(result, item);
+	}
+
+	return (result);
+}
+
+static int
+bench_load_idl(void)
+{
+	rpc_object_t idl;
+	int ret;
+
+	idl = rpc_serializer_load("yaml", bench_idl, sizeof(bench_idl) - 1);
+	if (idl == NULL)
+		return (-1);
+
+	ret = rpct_read_idl("serializer-bench", idl);
+	rpc_release(idl);
+	if (ret != 0)
+		return (-1);
+
+	return (rpct_load_types("serializer-bench"));
+}
+
+static int
+bench_encode(const struct bench_codec *codec, rpc_object_t obj, void **buf,
+    size_t *len)
+{
+	rpc_object_t typed;
+	int ret;
+
+	switch (codec->bc_mode) {
+	case BENCH_DUMP:
+		return (rpc_serializer_dump(codec->bc_serializer, obj, buf,
+		    len));
+
+	case BENCH_RAW:
+		return (rpc_msgpack_serialize(obj, buf, len));
+
+	case BENCH_RPCT:
+		typed = rpct_serialize(obj);
+		if (typed == NULL)
+			return (-1);
+
+		ret = rpc_msgpack_serialize(typed, buf, len);
+		rpc_release(typed);
+		return (ret);
+	}
+
+	return (-1);
+}
+
+static rpc_object_t
+bench_decode(const struct bench_codec *codec, const void *buf, size_t len)
+{
+	rpc_object_t untyped;
+	rpc_object_t result;
+
+	switch (codec->bc_mode) {
+	case BENCH_DUMP:
+		return (rpc_serializer_load(codec->bc_serializer, buf, len));
+
+	case BENCH_RAW:
+		return (rpc_msgpack_deserialize(buf, len));
+
+	case BENCH_RPCT:
+		untyped = rpc_msgpack_deserialize(buf, len);
+		if (untyped == NULL)
+			return (NULL);
+
+		result = rpct_deserialize(untyped);
+		rpc_release(untyped);
+		return (result);
+	}
+
+	return (NULL);
+}
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+/*
+ * Encodes and then decodes the fixture cycles times each, after one
+ * warm-up round that is not measured.
+ */
+static int
+bench_run(const struct bench_codec *codec, rpc_object_t obj, int64_t cycles,
+    struct bench_result *enc, struct bench_result *dec)
+{
+	rpc_object_t result;
+	uint64_t start;
+	uint64_t allocs;
+	void *buf;
+	size_t len;
+	int64_t i;
+
+	if (bench_encode(codec, obj, &buf, &len) != 0)
+		return (-1);
+
+	result = bench_decode(codec, buf, len);
+	if (result == NULL) {
+		free(buf);
+		return (-1);
+	}
+
+	rpc_release(result);
+	free(buf);
+
+	allocs = bench_allocs_count();
+	start = bench_now();
+	for (i = 0; i < cycles; i++) {
+		bench_encode(codec, obj, &buf, &len);
+		free(buf);
+	}
+
+	enc->br_ns = (double)(bench_now() - start) / cycles;
+	enc->br_allocs = (double)(bench_allocs_count() - allocs) / cycles;
+	enc->br_bytes = len;
+
+	bench_encode(codec, obj, &buf, &len);
+	allocs = bench_allocs_count();
+	start = bench_now();
+	for (i = 0; i < cycles; i++)
+		rpc_release(bench_decode(codec, buf, len));
+
+	dec->br_ns = (double)(bench_now() - start) / cycles;
+	dec->br_allocs = (double)(bench_allocs_count() - allocs) / cycles;
+	dec->br_bytes = len;
+	free(buf);
+	return (0);
+}
+
+void
+usage(const char *argv0)
+{
+
+	fprintf(stderr, "Usage: %s [-c CYCLES] [-f FIXTURE] [-s CODEC] [-u]\n",
+	    argv0);
+	fprintf(stderr, "       %s -h\n", argv0);
+}
+
+int
+main(int argc, char * const argv[])
+{
+	const struct bench_fixture *fixture;
+	const struct bench_codec *codec;
+	struct bench_result enc;
+	struct bench_result dec;
+	rpc_object_t obj;
+	int64_t cycles = 1000;
+	const char *only_fixture = NULL;
+	const char *only_codec = NULL;
+	bool typing = true;
+	int c;
+
+	for (;;) {
+		c = getopt(argc, argv, "c:f:s:uh");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			cycles = strtoll(optarg, NULL, 10);
+			break;
+
+		case 'f':
+			only_fixture = optarg;
+			break;
+
+		case 's':
+			only_codec = optarg;
+			break;
+
+		case 'u':
+			typing = false;
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			return (c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (cycles <= 0) {
+		fprintf(stderr, "Error: invalid cycle count\n");
+		return (EXIT_FAILURE);
+	}
+
+	if (typing) {
+		rpct_init(true);
+		if (bench_load_idl() != 0) {
+			fprintf(stderr, "Cannot load benchmark types: %s\n",
+			    rpc_error_get_message(rpc_get_last_error()));
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if (!BENCH_COUNT_ALLOCS)
+		fprintf(stderr, "Allocation counting not supported here\n");
+
+	printf("%-12s %-14s %-6s %14s %12s %12s\n", "fixture", "codec", "op",
+	    "ns/op", "bytes/op", "allocs/op");
+
+	for (fixture = bench_fixtures; fixture->bf_name != NULL; fixture++) {
+		if (only_fixture != NULL &&
+		    strcmp(only_fixture, fixture->bf_name) != 0)
+			continue;
+
+		if (fixture->bf_typed && !typing)
+			continue;
+
+		obj = fixture->bf_create();
+		if (obj == NULL) {
+			fprintf(stderr, "Cannot create fixture %s\n",
+			    fixture->bf_name);
+			continue;
+		}
+
+		for (codec = bench_codecs; codec->bc_name != NULL; codec++) {
+			if (only_codec != NULL &&
+			    strcmp(only_codec, codec->bc_name) != 0)
+				continue;
+
+			if (bench_run(codec, obj, cycles, &enc, &dec) != 0) {
+				printf("%-12s %-14s %s\n", fixture->bf_name,
+				    codec->bc_name, "unsupported");
+				continue;
+			}
+
+			printf("%-12s %-14s %-6s %14.1f %12zu %12.1f\n",
+			    fixture->bf_name, codec->bc_name, "encode",
+			    enc.br_ns, enc.br_bytes, enc.br_allocs);
+			printf("%-12s %-14s %-6s %14.1f %12zu %12.1f\n",
+			    fixture->bf_name, codec->bc_name, "decode",
+			    dec.br_ns, dec.br_bytes, dec.br_allocs);
+		}
+
+		rpc_release(obj);
+	}
+
+	return (EXIT_SUCCESS);
+}
@@ -48,6 +48,82 @@ def generate_objc(typing):
     )
 
 
+# Builtin member types the C generator maps to native fields
+c_builtins = {
+    'int64': 'int64_t',
+    'uint64': 'uint64_t',
+    'double': 'double',
+    'bool': 'bool',
+    'string': 'char *',
+    'binary': 'uint8_t *',
+}
+
+
+def c_name(name):
+    return name.replace('.', '_')
+
+
+def c_structs(typing):
+    """
+    Returns the struct types that can be mapped to native C structs,
+    ordered so that every struct comes after the structs it embeds.
+    Generic structs, and structs with members of any other type, are
+    left out.
+    """
+    types = {t.name: t for t in typing.types if t.is_struct and not t.generic}
+    result = []
+    state = {}
+
+    def visit(t):
+        if state.get(t.name) == 'done':
+            return True
+
+        if state.get(t.name) == 'visiting':
+            return False
+
+        state[t.name] = 'visiting'
+        members = []
+        for m in sorted(t.members, key=lambda m: m.name):
+            mtype = m.type.type
+            if mtype.is_builtin and m.type.canonical in c_builtins:
+                members.append((m, 'builtin', m.type.canonical))
+                continue
+
+            if mtype.name in types and visit(types[mtype.name]):
+                members.append((m, 'struct', c_name(mtype.name)))
+                continue
+
+            state[t.name] = 'skipped'
+            return False
+
+        # Member presence is tracked in a 64-bit mask when decoding
+        if len(members) > 64:
+            state[t.name] = 'skipped'
+            return False
+
+        state[t.name] = 'done'
+        result.append({
+            'name': t.name,
+            'cname': c_name(t.name),
+            'description': t.description,
+            'members': members,
+        })
+        return True
+
+    for name in sorted(types):
+        visit(types[name])
+
+    return result
+
+
+def generate_c(typing):
+    t = lookup.get_template('c.mako')
+    return t.render(
+        structs=c_structs(typing),
+        builtins=c_builtins,
+    )
+
+
 def generate_file(name, contents):
     with open(name, 'w') as f:
         f.write(contents)
@@ -0,0 +1,252 @@
+/*
+ * THIS IS AN AUTOMATICALLY GENERATED FILE - EDITING IT IS FUTILE
+ *
+ * Native C structs for IDL struct types, with msgpack encoders and
+ * decoders that produce and accept the same keyed form as librpc's
+ * msgpack serializer, without going through rpc_object_t.
+ *
+ * Define LIBRPC_APIGEN_IMPLEMENTATION in exactly one translation unit
+ * before including this file to get the function definitions. Needs
+ * mpack (contrib/mpack) with the writer and node APIs enabled.
+ */
+
+#ifndef LIBRPC_APIGEN_C_H
+#define LIBRPC_APIGEN_C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <mpack.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+% for s in structs:
+/**
+ * ${s['name']}
+% if s['description']:
+ *
+ * ${s['description']}
+% endif
+ */
+struct ${s['cname']}
+{
+% for m, kind, t in s['members']:
+% if kind == 'struct':
+	struct ${t} ${m.name};
+% elif t == 'binary':
+	uint8_t *${m.name};
+	size_t ${m.name}_len;
+% else:
+	${builtins[t]}${'' if builtins[t].endswith('*') else ' '}${m.name};
+% endif
+% endfor
+};
+
+void ${s['cname']}_free(struct ${s['cname']} *value);
+int ${s['cname']}_encode(const struct ${s['cname']} *value,
+    mpack_writer_t *writer);
+int ${s['cname']}_decode(struct ${s['cname']} *value, mpack_node_t node);
+int ${s['cname']}_dump(const struct ${s['cname']} *value, char **bufp,
+    size_t *lenp);
+int ${s['cname']}_load(struct ${s['cname']} *value, const char *buf,
+    size_t len);
+
+% endfor
+#ifdef LIBRPC_APIGEN_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+
+static bool
+librpc_apigen_key_eq(mpack_node_t key, const char *str)
+{
+	size_t len = strlen(str);
+
+	return (mpack_node_type(key) == mpack_type_str &&
+	    mpack_node_strlen(key) == len &&
+	    memcmp(mpack_node_str(key), str, len) == 0);
+}
+
+static bool
+librpc_apigen_is_int(mpack_node_t node)
+{
+
+	return (mpack_node_type(node) == mpack_type_int ||
+	    mpack_node_type(node) == mpack_type_uint);
+}
+
+% for s in structs:
+void
+${s['cname']}_free(struct ${s['cname']} *value)
+{
+
+% for m, kind, t in s['members']:
+% if kind == 'struct':
+	${t}_free(&value->${m.name});
+% elif t in ('string', 'binary'):
+	free(value->${m.name});
+% endif
+% endfor
+	memset(value, 0, sizeof(*value));
+}
+
+int
+${s['cname']}_encode(const struct ${s['cname']} *value, mpack_writer_t *writer)
+{
+
+	mpack_start_map(writer, ${len(s['members']) + 1});
+% for m, kind, t in s['members']:
+	mpack_write_cstr(writer, "${m.name}");
+% if kind == 'struct':
+	if (${t}_encode(&value->${m.name}, writer) != 0)
+		return (-1);
+% elif t == 'int64':
+	mpack_write_i64(writer, value->${m.name});
+% elif t == 'uint64':
+	mpack_write_u64(writer, value->${m.name});
+% elif t == 'double':
+	mpack_write_double(writer, value->${m.name});
+% elif t == 'bool':
+	mpack_write_bool(writer, value->${m.name});
+% elif t == 'string':
+	if (value->${m.name} == NULL)
+		return (-1);
+	mpack_write_cstr(writer, value->${m.name});
+% elif t == 'binary':
+	mpack_write_bin(writer, (const char *)value->${m.name},
+	    (uint32_t)value->${m.name}_len);
+% endif
+% endfor
+	mpack_write_cstr(writer, "%type");
+	mpack_write_cstr(writer, "${s['name']}");
+	mpack_finish_map(writer);
+
+	return (mpack_writer_error(writer) == mpack_ok ? 0 : -1);
+}
+
+/*
+ * Every member has to be present and of the right type, which is what
+ * struct validation in librpc checks for too.
+ */
+int
+${s['cname']}_decode(struct ${s['cname']} *value, mpack_node_t node)
+{
+	mpack_node_t key;
+	mpack_node_t val;
+	uint64_t seen = 0;
+	size_t count;
+	size_t i;
+
+	memset(value, 0, sizeof(*value));
+
+	if (mpack_node_type(node) != mpack_type_map)
+		return (-1);
+
+	count = mpack_node_map_count(node);
+	for (i = 0; i < count; i++) {
+		key = mpack_node_map_key_at(node, i);
+		val = mpack_node_map_value_at(node, i);
+
+		if (librpc_apigen_key_eq(key, "%type")) {
+			if (!librpc_apigen_key_eq(val, "${s['name']}"))
+				goto error;
+
+			continue;
+		}
+% for idx, (m, kind, t) in enumerate(s['members']):
+
+		if (librpc_apigen_key_eq(key, "${m.name}")) {
+% if kind == 'struct':
+			${t}_free(&value->${m.name});
+			if (${t}_decode(&value->${m.name}, val) != 0)
+				goto error;
+% elif t in ('int64', 'uint64'):
+			if (!librpc_apigen_is_int(val))
+				goto error;
+
+			value->${m.name} = mpack_node_${'i64' if t == 'int64' else 'u64'}(val);
+% elif t == 'double':
+			if (mpack_node_type(val) != mpack_type_double &&
+			    mpack_node_type(val) != mpack_type_float)
+				goto error;
+
+			value->${m.name} = mpack_node_double(val);
+% elif t == 'bool':
+			if (mpack_node_type(val) != mpack_type_bool)
+				goto error;
+
+			value->${m.name} = mpack_node_bool(val);
+% elif t == 'string':
+			if (mpack_node_type(val) != mpack_type_str)
+				goto error;
+
+			free(value->${m.name});
+			value->${m.name} = mpack_node_cstr_alloc(val,
+			    mpack_node_strlen(val) + 1);
+% elif t == 'binary':
+			if (mpack_node_type(val) != mpack_type_bin)
+				goto error;
+
+			free(value->${m.name});
+			value->${m.name}_len = mpack_node_data_len(val);
+			value->${m.name} = (uint8_t *)mpack_node_data_alloc(val,
+			    value->${m.name}_len);
+% endif
+			seen |= (1ull << ${idx});
+			continue;
+		}
+% endfor
+	}
+
+	if (mpack_node_error(node) != mpack_ok ||
+	    seen != ${'0x%xull' % ((1 << len(s['members'])) - 1)})
+		goto error;
+
+	return (0);
+
+error:
+	${s['cname']}_free(value);
+	return (-1);
+}
+
+int
+${s['cname']}_dump(const struct ${s['cname']} *value, char **bufp, size_t *lenp)
+{
+	mpack_writer_t writer;
+
+	mpack_writer_init_growable(&writer, bufp, lenp);
+	${s['cname']}_encode(value, &writer);
+	return (mpack_writer_destroy(&writer) == mpack_ok ? 0 : -1);
+}
+
+int
+${s['cname']}_load(struct ${s['cname']} *value, const char *buf, size_t len)
+{
+	mpack_tree_t tree;
+	int ret;
+
+	mpack_tree_init(&tree, buf, len);
+	if (mpack_tree_error(&tree) != mpack_ok) {
+		mpack_tree_destroy(&tree);
+		return (-1);
+	}
+
+	ret = ${s['cname']}_decode(value, mpack_tree_root(&tree));
+	if (mpack_tree_destroy(&tree) != mpack_ok && ret == 0) {
+		${s['cname']}_free(value);
+		ret = -1;
+	}
+
+	return (ret);
+}
+
+% endfor
+#endif /* LIBRPC_APIGEN_IMPLEMENTATION */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRPC_APIGEN_C_H */
@@ -26,10 +26,13 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
 #include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <glib.h>
 #include <rpc/object.h>
 #include <rpc/connection.h>
@@ -39,6 +42,9 @@
 #include <rpc/serializer.h>
 #include "internal.h"
 
+/* Seconds our copy of a handed off socket is kept open for */
+#define	RPCD_HANDOFF_LINGER	5
+
 static rpc_object_t rpcd_register_service(void *, rpc_object_t);
 static rpc_object_t rpcd_service_connect(void *, rpc_object_t);
 static rpc_object_t rpcd_service_unregister(void *, rpc_object_t);
@@ -144,20 +150,47 @@ rpcd_register_service(void *cookie, rpc_object_t args)
 	return (rpc_string_create(rpc_instance_get_path(service->instance)));
 }
 
+/*
+ * Opens a plain socket to a local service, for handing off to a client
+ * that can take file descriptors. Only unix:// services can be dialed
+ * like that.
+ */
 static int
-rpcd_service_forward(void *arg, const void *msg, size_t len,
-    const int *fds, size_t nfds)
+rpcd_service_dial(const char *uri)
 {
+	struct sockaddr_un sun;
+	const char *path;
+	int fd;
+
+	if (!g_str_has_prefix(uri, "unix://"))
+		return (-1);
+
+	path = uri + strlen("unix://");
+	if (strlen(path) >= sizeof(sun.sun_path))
+		return (-1);
 
-	return (rpc_connection_send_raw_message(arg, msg, len, fds, nfds));
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return (-1);
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
 }
 
-static void
-rpc_service_handle_error(void *arg, rpc_error_code_t code, rpc_object_t args)
+static gboolean
+rpcd_handoff_done(gpointer data)
 {
 
-	if (code == RPC_CONNECTION_CLOSED)
-		rpc_connection_close(arg);
+	close(GPOINTER_TO_INT(data));
+	return (G_SOURCE_REMOVE);
 }
 
 static rpc_object_t
@@ -170,33 +203,40 @@ rpcd_service_connect(void *cookie, rpc_object_t args __unused)
 	int fd;
 
 	service = rpc_function_get_arg(cookie);
+	this_conn = rpc_function_get_connection(cookie);
+	if (this_conn == NULL) {
+		rpc_function_error(cookie, ENOTCONN, "Not connected");
+		return (NULL);
+	}
+
+	/*
+	 * Clients that can take descriptors get a socket of their own to
+	 * the service, so that rpcd stays out of the data path. Ours is
+	 * closed once the response carrying it has surely been sent.
+	 */
+	if (rpc_connection_supports_fd_passing(this_conn)) {
+		fd = rpcd_service_dial(service->uri);
+		if (fd != -1) {
+			g_timeout_add_seconds(RPCD_HANDOFF_LINGER,
+			    rpcd_handoff_done, GINT_TO_POINTER(fd));
+			return (rpc_fd_create(fd));
+		}
+	}
+
 	client = rpc_client_create(service->uri, NULL);
 	if (client == NULL) {
 		rpc_function_error_ex(cookie, rpc_get_last_error());
 		return (NULL);
 	}
 
-	this_conn = rpc_function_get_connection(cookie);
+	/* Set up bidirectional bridging, passing frames through as they are */
 	conn = rpc_client_get_connection(client);
-
-	if (rpc_connection_supports_fd_passing(this_conn)) {
-		fd = rpc_connection_get_fd(conn);
-		return (rpc_fd_create(fd));
+	if (rpc_proxy_splice(this_conn, conn, NULL) != 0) {
+		rpc_function_error_ex(cookie, rpc_get_last_error());
+		rpc_client_close(client);
+		return (NULL);
 	}
 
-	/* Set up bidirectional bridging */
-	rpc_connection_set_raw_message_handler(this_conn,
-	    RPC_RAW_HANDLER(rpcd_service_forward, conn));
-
-	rpc_connection_set_raw_message_handler(conn,
-	    RPC_RAW_HANDLER(rpcd_service_forward, this_conn));
-
-	rpc_connection_set_error_handler(this_conn,
-	    RPC_ERROR_HANDLER(rpc_service_handle_error, conn));
-
-	rpc_connection_set_error_handler(conn,
-	    RPC_ERROR_HANDLER(rpc_service_handle_error, this_conn));
-
 	return (rpc_string_create("BRIDGED"));
 }
 
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/typing.h>
+
+static const char *output;
+static char **args;
+
+static GOptionEntry options[] = {
+	{ "output", 'o', 0, G_OPTION_ARG_STRING, &output,
+	    "Database file to write", NULL },
+	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &args, "", NULL },
+	{ }
+};
+
+int
+main(int argc, char *argv[])
+{
+	GError *err = NULL;
+	GOptionContext *context;
+	rpc_object_t error;
+
+	context = g_option_context_new(
+	    "<DIRECTORY> - compile IDL files into a type database");
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &err)) {
+		fprintf(stderr, "%s\n", err->message);
+		g_error_free(err);
+		return (1);
+	}
+
+	if (args == NULL || args[0] == NULL || args[1] != NULL) {
+		fprintf(stderr, "%s", g_option_context_get_help(context,
+		    true, NULL));
+		return (1);
+	}
+
+	if (output == NULL)
+		output = "idl.db";
+
+	rpct_init(false);
+
+	if (rpct_compile_types_dir(args[0], output) != 0) {
+		error = rpc_get_last_error();
+		fprintf(stderr, "Cannot compile %s: %s\n", args[0],
+		    rpc_error_get_message(error));
+		return (1);
+	}
+
+	return (0);
+}
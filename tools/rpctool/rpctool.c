@@ -45,7 +45,13 @@
     "  call PATH INTERFACE METHOD [ARGUMENTS]\n"			\
     "  get PATH INTERFACE PROPERTY\n"					\
     "  set PATH INTERFACE PROPERTY VALUE\n"				\
-    "  listen PATH\n"
+    "  listen PATH\n"							\
+    "  trace FILE\n"							\
+    "  bench PATH INTERFACE METHOD [ARGUMENTS]\n"			\
+    "\n"								\
+    "bench makes --count calls, or calls for --duration seconds, with\n" \
+    "--concurrency of them in flight or --rate of them started every\n" \
+    "second. Streaming methods are measured in fragments as well.\n"
 
 static int cmd_tree(int argc, char *argv[]);
 static int cmd_inspect(int argc, char *argv[]);
@@ -53,6 +59,8 @@ static int cmd_call(int argc, char *argv[]);
 static int cmd_get(int argc, char *argv[]);
 static int cmd_set(int argc, char *argv[]);
 static int cmd_listen(int argc, char *argv[]);
+static int cmd_trace(int argc, char *argv[]);
+static int cmd_bench(int argc, char *argv[]);
 static void  usage(GOptionContext *);
 
 static const char *server;
@@ -60,6 +68,10 @@ static const char **idls;
 static char **args;
 static bool json;
 static bool yaml;
+static gint bench_concurrency = 1;
+static gint64 bench_count;
+static gdouble bench_duration;
+static gdouble bench_rate;
 
 static struct {
 	const char *name;
@@ -71,6 +83,8 @@ static struct {
 	{ "get", cmd_get },
 	{ "set", cmd_set },
 	{ "listen", cmd_listen },
+	{ "trace", cmd_trace },
+	{ "bench", cmd_bench },
 	{ }
 };
 
@@ -79,6 +93,10 @@ static GOptionEntry options[] = {
 	{ "json", 'j', 0, G_OPTION_ARG_NONE, &json, "JSON output", NULL },
 	{ "yaml", 'y', 0, G_OPTION_ARG_NONE, &yaml, "YAML output", NULL },
 	{ "idl", 'i', 0, G_OPTION_ARG_STRING_ARRAY, &idls, "IDL files to load", NULL },
+	{ "concurrency", 'c', 0, G_OPTION_ARG_INT, &bench_concurrency, "Calls in flight (bench)", "N" },
+	{ "count", 'n', 0, G_OPTION_ARG_INT64, &bench_count, "Number of calls (bench)", "N" },
+	{ "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &bench_duration, "Duration in seconds (bench)", "SECONDS" },
+	{ "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &bench_rate, "Calls per second (bench)", "N" },
 	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &args, "", NULL },
 	{ }
 };
@@ -102,7 +120,7 @@ connect(void)
 
 	if (idls != NULL) {
 		for (idl = idls; *idl != NULL; idl++)
-			rpct_load_types_dir(*idl);
+			rpct_index_types_dir(*idl);
 	}
 
 	client = rpc_client_create(server, NULL);
@@ -120,27 +138,18 @@ static void
 output(rpc_object_t obj)
 {
 	char *str;
-	void *frame;
-	size_t len;
 
 	if (obj == NULL)
 		return;
 
-	if (json) {
-		if (rpc_serializer_dump("json", obj, &frame, &len) != 0)
+	if (json || yaml) {
+		/* Large results are streamed rather than built up in memory */
+		fflush(stdout);
+		if (rpc_serializer_dump_fd(json ? "json" : "yaml", obj,
+		    STDOUT_FILENO) != 0)
 			abort();
 
-		printf("%s\n", (char *)frame);
-		g_free(frame);
-		return;
-	}
-
-	if (yaml) {
-		if (rpc_serializer_dump("yaml", obj, &frame, &len) != 0)
-			abort();
-
-		printf("%s\n", (char *)frame);
-		g_free(frame);
+		printf("\n");
 		return;
 	}
 
@@ -425,6 +434,469 @@ cmd_listen(int argc, char *argv[])
 	return (0);
 }
 
+static gint
+trace_compare(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_trace_record *ra = a;
+	const struct rpc_trace_record *rb = b;
+
+	if (ra->rtr_time == rb->rtr_time)
+		return (0);
+
+	return (ra->rtr_time < rb->rtr_time ? -1 : 1);
+}
+
+/*
+ * Decodes a dump written by rpc_trace_dump(), printing the records of
+ * all threads merged in time order.
+ */
+static int
+cmd_trace(int argc, char *argv[])
+{
+	GError *err = NULL;
+	struct rpc_trace_header hdr;
+	struct rpc_trace_record *records;
+	struct rpc_trace_record *rec;
+	GDateTime *time;
+	const char *namespace;
+	const char *name;
+	char *contents;
+	char *stamp;
+	gsize len;
+	size_t count;
+	size_t i;
+	int64_t offset;
+
+	if (argc < 1) {
+		fprintf(stderr, "Not enough arguments provided\n");
+		return (1);
+	}
+
+	if (!g_file_get_contents(argv[0], &contents, &len, &err)) {
+		fprintf(stderr, "Cannot read trace: %s\n", err->message);
+		g_error_free(err);
+		return (1);
+	}
+
+	if (len < sizeof(hdr)) {
+		fprintf(stderr, "Truncated trace\n");
+		g_free(contents);
+		return (1);
+	}
+
+	memcpy(&hdr, contents, sizeof(hdr));
+	if (hdr.rth_magic != RPC_TRACE_MAGIC ||
+	    hdr.rth_version != RPC_TRACE_VERSION ||
+	    hdr.rth_record_size != sizeof(*records)) {
+		fprintf(stderr, "Not a librpc trace, or an incompatible one\n");
+		g_free(contents);
+		return (1);
+	}
+
+	count = (len - sizeof(hdr)) / sizeof(*records);
+	records = g_memdup(contents + sizeof(hdr), count * sizeof(*records));
+	g_free(contents);
+	qsort(records, count, sizeof(*records), trace_compare);
+
+	offset = (int64_t)hdr.rth_realtime - (int64_t)hdr.rth_monotonic;
+
+	for (i = 0; i < count; i++) {
+		rec = &records[i];
+		if (rpc_trace_op_name(rec->rtr_op, &namespace, &name) != 0) {
+			namespace = "?";
+			name = "?";
+		}
+
+		time = g_date_time_new_from_unix_local(
+		    ((int64_t)rec->rtr_time + offset) / 1000000000);
+		stamp = g_date_time_format(time, "%H:%M:%S");
+		printf("%s.%09" G_GINT64_FORMAT " [%u] %s conn=%#" G_GINT64_MODIFIER
+		    "x %s.%s id=%" G_GUINT64_FORMAT "%s size=%u",
+		    stamp, ((int64_t)rec->rtr_time + offset) % 1000000000,
+		    rec->rtr_thread,
+		    (rec->rtr_flags & RPC_TRACE_SEND) ? "SEND" : "RECV",
+		    rec->rtr_conn, namespace, name, rec->rtr_call_id,
+		    (rec->rtr_flags & RPC_TRACE_ID_HASHED) ? "(hash)" : "",
+		    rec->rtr_size);
+
+		if (rec->rtr_flags & RPC_TRACE_PAYLOAD_HASH)
+			printf(" hash=%08x", rec->rtr_hash);
+
+		printf("\n");
+		g_free(stamp);
+		g_date_time_unref(time);
+	}
+
+	g_free(records);
+	return (0);
+}
+
+/*
+ * Load generation for the bench command. Latencies are kept in full and
+ * sorted for percentiles, which is exact and cheap enough for the call
+ * counts a command line tool sees.
+ */
+struct bench_state
+{
+	GMutex			bs_mtx;
+	GCond			bs_cv;
+	GCond			bs_report_cv;
+	rpc_connection_t	bs_conn;
+	const char *		bs_path;
+	const char *		bs_interface;
+	const char *		bs_method;
+	rpc_object_t		bs_args;
+	GArray *		bs_latency;
+	GArray *		bs_ttff;
+	GArray *		bs_window;
+	guint64			bs_issued;
+	guint64			bs_done;
+	guint64			bs_errors;
+	guint64			bs_fragments;
+	guint64			bs_window_fragments;
+	guint64			bs_inflight;
+	gint64			bs_deadline;
+	bool			bs_finished;
+};
+
+static gint
+bench_compare(gconstpointer a, gconstpointer b)
+{
+	guint64 va = *(const guint64 *)a;
+	guint64 vb = *(const guint64 *)b;
+
+	if (va == vb)
+		return (0);
+
+	return (va < vb ? -1 : 1);
+}
+
+/* Returns microseconds; @p samples must be sorted */
+static double
+bench_percentile(GArray *samples, double pct)
+{
+	guint idx;
+
+	if (samples->len == 0)
+		return (0);
+
+	idx = (guint)(pct / 100 * (samples->len - 1) + 0.5);
+	return (g_array_index(samples, guint64, idx) / 1E3);
+}
+
+/* Called with bs_mtx held */
+static bool
+bench_next(struct bench_state *state)
+{
+
+	if (bench_count > 0 && state->bs_issued >= (guint64)bench_count)
+		return (false);
+
+	if (state->bs_deadline > 0 &&
+	    g_get_monotonic_time() >= state->bs_deadline)
+		return (false);
+
+	state->bs_issued++;
+	state->bs_inflight++;
+	return (true);
+}
+
+static void
+bench_fragment(struct bench_state *state, gint64 start, bool first)
+{
+	guint64 ttff = (guint64)(g_get_monotonic_time() - start) * 1000;
+
+	g_mutex_lock(&state->bs_mtx);
+	if (first)
+		g_array_append_val(state->bs_ttff, ttff);
+
+	state->bs_fragments++;
+	state->bs_window_fragments++;
+	g_mutex_unlock(&state->bs_mtx);
+}
+
+static void
+bench_done(struct bench_state *state, gint64 start, bool ok)
+{
+	guint64 latency = (guint64)(g_get_monotonic_time() - start) * 1000;
+
+	g_mutex_lock(&state->bs_mtx);
+	if (ok) {
+		g_array_append_val(state->bs_latency, latency);
+		g_array_append_val(state->bs_window, latency);
+		state->bs_done++;
+	} else
+		state->bs_errors++;
+
+	if (--state->bs_inflight == 0)
+		g_cond_broadcast(&state->bs_cv);
+
+	g_mutex_unlock(&state->bs_mtx);
+}
+
+/* One of --concurrency workers, each keeping a single call going */
+static gpointer
+bench_worker(gpointer arg)
+{
+	struct bench_state *state = arg;
+	rpc_call_status_t status;
+	rpc_call_t call;
+	gint64 start;
+	bool first;
+
+	for (;;) {
+		g_mutex_lock(&state->bs_mtx);
+		if (!bench_next(state)) {
+			g_mutex_unlock(&state->bs_mtx);
+			break;
+		}
+
+		g_mutex_unlock(&state->bs_mtx);
+		start = g_get_monotonic_time();
+		call = rpc_connection_call(state->bs_conn, state->bs_path,
+		    state->bs_interface, state->bs_method, state->bs_args,
+		    NULL);
+		if (call == NULL) {
+			bench_done(state, start, false);
+			continue;
+		}
+
+		first = true;
+		for (;;) {
+			rpc_call_wait(call);
+			status = rpc_call_status(call);
+			if (status == RPC_CALL_STREAM_START) {
+				rpc_call_continue(call, false);
+				continue;
+			}
+
+			if (status != RPC_CALL_MORE_AVAILABLE)
+				break;
+
+			bench_fragment(state, start, first);
+			first = false;
+			rpc_call_continue(call, false);
+		}
+
+		rpc_call_free(call);
+		bench_done(state, start, status == RPC_CALL_DONE ||
+		    status == RPC_CALL_ENDED);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Starts calls on a fixed schedule, no matter how many are still in
+ * flight. Latency is taken from when a call was due rather than when
+ * it actually went out, so that a stalled server can't hide behind
+ * the calls it held back.
+ */
+static void
+bench_schedule(struct bench_state *state)
+{
+	gint64 interval = (gint64)(G_USEC_PER_SEC / bench_rate);
+	gint64 begin = g_get_monotonic_time();
+	gint64 due;
+	gint64 now;
+	guint64 n;
+	rpc_call_t call;
+
+	for (n = 0;; n++) {
+		__block bool first = true;
+
+		due = begin + (gint64)n * interval;
+		now = g_get_monotonic_time();
+		if (due > now)
+			g_usleep((gulong)(due - now));
+
+		g_mutex_lock(&state->bs_mtx);
+		if (!bench_next(state)) {
+			g_mutex_unlock(&state->bs_mtx);
+			break;
+		}
+
+		g_mutex_unlock(&state->bs_mtx);
+		call = rpc_connection_call(state->bs_conn, state->bs_path,
+		    state->bs_interface, state->bs_method, state->bs_args,
+		    ^(rpc_call_t c) {
+			rpc_call_status_t status = rpc_call_status(c);
+
+			switch (status) {
+			case RPC_CALL_IN_PROGRESS:
+			case RPC_CALL_STREAM_START:
+				return ((bool)true);
+
+			case RPC_CALL_MORE_AVAILABLE:
+				bench_fragment(state, due, first);
+				first = false;
+				return ((bool)true);
+
+			default:
+				break;
+			}
+
+			bench_done(state, due, status == RPC_CALL_DONE ||
+			    status == RPC_CALL_ENDED);
+			rpc_call_free(c);
+			return ((bool)false);
+		});
+
+		if (call == NULL)
+			bench_done(state, due, false);
+	}
+}
+
+/* Prints throughput and latency of the last second, every second */
+static gpointer
+bench_reporter(gpointer arg)
+{
+	struct bench_state *state = arg;
+	gint64 since = g_get_monotonic_time();
+	gint64 now;
+	double elapsed;
+
+	g_mutex_lock(&state->bs_mtx);
+	while (!state->bs_finished) {
+		if (g_cond_wait_until(&state->bs_report_cv, &state->bs_mtx,
+		    since + G_USEC_PER_SEC))
+			continue;
+
+		now = g_get_monotonic_time();
+		elapsed = (now - since) / 1E6;
+		g_array_sort(state->bs_window, bench_compare);
+		fprintf(stderr, "%10.1f calls/s", state->bs_window->len / elapsed);
+		if (state->bs_window_fragments > 0)
+			fprintf(stderr, "  %10.1f fragments/s",
+			    state->bs_window_fragments / elapsed);
+
+		fprintf(stderr, "  p50 %.1fus  p99 %.1fus  in flight %"
+		    G_GUINT64_FORMAT "  errors %" G_GUINT64_FORMAT "\n",
+		    bench_percentile(state->bs_window, 50),
+		    bench_percentile(state->bs_window, 99),
+		    state->bs_inflight, state->bs_errors);
+
+		g_array_set_size(state->bs_window, 0);
+		state->bs_window_fragments = 0;
+		since = now;
+	}
+
+	g_mutex_unlock(&state->bs_mtx);
+	return (NULL);
+}
+
+static int
+cmd_bench(int argc, char *argv[])
+{
+	struct bench_state state = { };
+	GThread **workers;
+	GThread *reporter;
+	rpc_object_t error;
+	rpc_object_t result;
+	gint64 start;
+	double elapsed;
+	gint i;
+
+	if (argc < 3) {
+		fprintf(stderr, "Not enough arguments provided\n");
+		return (1);
+	}
+
+	if (bench_count <= 0 && bench_duration <= 0) {
+		fprintf(stderr, "Either --count or --duration is required\n");
+		return (1);
+	}
+
+	if (bench_concurrency < 1) {
+		fprintf(stderr, "Invalid concurrency\n");
+		return (1);
+	}
+
+	state.bs_args = argc > 3 ?
+	    rpc_serializer_load("json", argv[3], strlen(argv[3])) :
+	    rpc_array_create();
+	if (state.bs_args == NULL) {
+		error = rpc_get_last_error();
+		fprintf(stderr, "Cannot read input: %s\n",
+		    rpc_error_get_message(error));
+		return (1);
+	}
+
+	g_mutex_init(&state.bs_mtx);
+	g_cond_init(&state.bs_cv);
+	g_cond_init(&state.bs_report_cv);
+	state.bs_conn = connect();
+	state.bs_path = argv[0];
+	state.bs_interface = argv[1];
+	state.bs_method = argv[2];
+	state.bs_latency = g_array_new(false, false, sizeof(guint64));
+	state.bs_ttff = g_array_new(false, false, sizeof(guint64));
+	state.bs_window = g_array_new(false, false, sizeof(guint64));
+
+	start = g_get_monotonic_time();
+	if (bench_duration > 0)
+		state.bs_deadline = start + (gint64)(bench_duration * 1E6);
+
+	reporter = g_thread_new("bench reporter", bench_reporter, &state);
+
+	if (bench_rate > 0)
+		bench_schedule(&state);
+	else {
+		workers = g_new0(GThread *, bench_concurrency);
+		for (i = 0; i < bench_concurrency; i++)
+			workers[i] = g_thread_new("bench worker", bench_worker,
+			    &state);
+
+		for (i = 0; i < bench_concurrency; i++)
+			g_thread_join(workers[i]);
+
+		g_free(workers);
+	}
+
+	g_mutex_lock(&state.bs_mtx);
+	while (state.bs_inflight > 0)
+		g_cond_wait(&state.bs_cv, &state.bs_mtx);
+
+	state.bs_finished = true;
+	g_cond_signal(&state.bs_report_cv);
+	g_mutex_unlock(&state.bs_mtx);
+	g_thread_join(reporter);
+
+	elapsed = (g_get_monotonic_time() - start) / 1E6;
+	g_array_sort(state.bs_latency, bench_compare);
+	g_array_sort(state.bs_ttff, bench_compare);
+
+	result = rpc_object_pack("{u,u,d,d,d,d,d,d,d}",
+	    "calls", (uint64_t)state.bs_done,
+	    "errors", (uint64_t)state.bs_errors,
+	    "elapsed", elapsed,
+	    "calls_per_second", state.bs_done / elapsed,
+	    "p50_us", bench_percentile(state.bs_latency, 50),
+	    "p90_us", bench_percentile(state.bs_latency, 90),
+	    "p99_us", bench_percentile(state.bs_latency, 99),
+	    "p999_us", bench_percentile(state.bs_latency, 99.9),
+	    "max_us", bench_percentile(state.bs_latency, 100));
+
+	if (state.bs_fragments > 0) {
+		rpc_dictionary_set_uint64(result, "fragments",
+		    state.bs_fragments);
+		rpc_dictionary_set_double(result, "fragments_per_second",
+		    state.bs_fragments / elapsed);
+		rpc_dictionary_set_double(result, "ttff_p50_us",
+		    bench_percentile(state.bs_ttff, 50));
+		rpc_dictionary_set_double(result, "ttff_p99_us",
+		    bench_percentile(state.bs_ttff, 99));
+	}
+
+	output(result);
+	rpc_release(result);
+	rpc_release(state.bs_args);
+	g_array_free(state.bs_latency, true);
+	g_array_free(state.bs_ttff, true);
+	g_array_free(state.bs_window, true);
+	return (state.bs_errors > 0 ? 1 : 0);
+}
+
 static void
 usage(GOptionContext *context)
 {